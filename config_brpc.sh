@@ -21,9 +21,11 @@ else
     LDD=ldd
 fi
 
-TEMP=`getopt -o v: --long headers:,libs:,cc:,cxx:,with-glog,with-thrift,nodebugsymbols -n 'config_brpc' -- "$@"`
+TEMP=`getopt -o v: --long headers:,libs:,cc:,cxx:,with-glog,with-thrift,with-lz4,with-zstd,nodebugsymbols -n 'config_brpc' -- "$@"`
 WITH_GLOG=0
 WITH_THRIFT=0
+WITH_LZ4=0
+WITH_ZSTD=0
 DEBUGSYMBOLS=-g
 
 if [ $? != 0 ] ; then >&2 $ECHO "Terminating..."; exit 1 ; fi
@@ -40,6 +42,8 @@ while true; do
         --cxx ) CXX=$2; shift 2 ;;
         --with-glog ) WITH_GLOG=1; shift 1 ;;
         --with-thrift) WITH_THRIFT=1; shift 1 ;;
+        --with-lz4) WITH_LZ4=1; shift 1 ;;
+        --with-zstd) WITH_ZSTD=1; shift 1 ;;
         --nodebugsymbols ) DEBUGSYMBOLS=; shift 1 ;;
         -- ) shift; break ;;
         * ) break ;;
@@ -298,6 +302,36 @@ if [ $WITH_THRIFT != 0 ]; then
     fi
 fi
 
+if [ $WITH_LZ4 != 0 ]; then
+    LZ4_LIB=$(find_dir_of_lib_or_die lz4)
+    LZ4_HDR=$(find_dir_of_header_or_die lz4frame.h)
+    append_to_output_libs "$LZ4_LIB"
+    append_to_output_headers "$LZ4_HDR"
+
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_LZ4"
+
+    if [ -f "$LZ4_LIB/liblz4.$SO" ]; then
+        append_to_output "DYNAMIC_LINKINGS+=-llz4"
+    else
+        append_to_output "STATIC_LINKINGS+=-llz4"
+    fi
+fi
+
+if [ $WITH_ZSTD != 0 ]; then
+    ZSTD_LIB=$(find_dir_of_lib_or_die zstd)
+    ZSTD_HDR=$(find_dir_of_header_or_die zstd.h)
+    append_to_output_libs "$ZSTD_LIB"
+    append_to_output_headers "$ZSTD_HDR"
+
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_ZSTD"
+
+    if [ -f "$ZSTD_LIB/libzstd.$SO" ]; then
+        append_to_output "DYNAMIC_LINKINGS+=-lzstd"
+    else
+        append_to_output "STATIC_LINKINGS+=-lzstd"
+    fi
+fi
+
 append_to_output "CPPFLAGS=${CPPFLAGS}"
 
 append_to_output "ifeq (\$(NEED_LIBPROTOC), 1)"
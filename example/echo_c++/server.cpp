@@ -21,6 +21,9 @@
 
 DEFINE_bool(echo_attachment, true, "Echo attachment as well");
 DEFINE_int32(port, 8000, "TCP Port of this server");
+DEFINE_string(listen_addr, "", "Server listen address, may be IPV4 address "
+              "or unix:<path> of a unix domain socket. If this is set, the "
+              "flag port will be ignored");
 DEFINE_int32(idle_timeout_s, -1, "Connection will be closed if there is no "
              "read/write operations during the last `idle_timeout_s'");
 DEFINE_int32(logoff_ms, 2000, "Maximum duration of server's LOGOFF state "
@@ -92,7 +95,10 @@ int main(int argc, char* argv[]) {
     // Start the server.
     brpc::ServerOptions options;
     options.idle_timeout_sec = FLAGS_idle_timeout_s;
-    if (server.Start(FLAGS_port, &options) != 0) {
+    const int rc = FLAGS_listen_addr.empty() ?
+        server.Start(FLAGS_port, &options) :
+        server.Start(FLAGS_listen_addr.c_str(), &options);
+    if (rc != 0) {
         LOG(ERROR) << "Fail to start EchoServer";
         return -1;
     }
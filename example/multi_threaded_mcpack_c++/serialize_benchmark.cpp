@@ -0,0 +1,118 @@
+// Copyright (c) 2014 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compare one-pass and two-pass serializations of mcpack2pb.
+
+#include <algorithm>
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <butil/string_splitter.h>
+#include <butil/time.h>
+#include <mcpack2pb/mcpack2pb.h>
+#include "echo.pb.h"
+
+DEFINE_string(item_nums, "0,1,10,100,1000", "Serialize messages with so many "
+              "items, separated by comma");
+DEFINE_int32(name_size, 16, "Bytes of each name");
+DEFINE_int64(total_items, 10000000, "Serialize each message until so many "
+             "items are serialized");
+DEFINE_bool(compack, true, "Serialize as compack, otherwise mcpack_v2");
+
+static void fill_message(example::BenchmarkMessage* msg, int item_num) {
+    msg->set_title(std::string(FLAGS_name_size, 't'));
+    for (int i = 0; i < item_num; ++i) {
+        example::BenchmarkItem* item = msg->add_items();
+        item->set_id(i);
+        item->set_name(std::string(FLAGS_name_size, 'n'));
+        for (int j = 0; j < i % 8; ++j) {
+            item->add_values(j);
+        }
+        if (i % 2) {
+            item->set_score(i * 0.5);
+        }
+        msg->add_tags(std::string(i % FLAGS_name_size, 'g'));
+    }
+}
+
+typedef bool (mcpack2pb::MessageHandler::*SerializeFn)(
+    const google::protobuf::Message&, butil::IOBuf*,
+    mcpack2pb::SerializationFormat);
+
+static int64_t benchmark(mcpack2pb::MessageHandler& handler, SerializeFn fn,
+                         const example::BenchmarkMessage& msg, int times,
+                         mcpack2pb::SerializationFormat format) {
+    butil::IOBuf buf;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < times; ++i) {
+        buf.clear();
+        CHECK((handler.*fn)(msg, &buf, format));
+    }
+    tm.stop();
+    return tm.n_elapsed() / times;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse gflags. We recommend you to use gflags as well.
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+
+    mcpack2pb::MessageHandler handler =
+        mcpack2pb::find_message_handler("example.BenchmarkMessage");
+    if (handler.size_body == NULL) {
+        LOG(ERROR) << "example.BenchmarkMessage is not generated by "
+            "protoc-gen-mcpack supporting two-pass serializations";
+        return -1;
+    }
+    const mcpack2pb::SerializationFormat format =
+        (FLAGS_compack ? mcpack2pb::FORMAT_COMPACK :
+         mcpack2pb::FORMAT_MCPACK_V2);
+    for (butil::StringSplitter sp(FLAGS_item_nums.c_str(), ',');
+         sp != NULL; ++sp) {
+        const int item_num = strtol(sp.field(), NULL, 10);
+        example::BenchmarkMessage msg;
+        fill_message(&msg, item_num);
+
+        butil::IOBuf buf1;
+        butil::IOBuf buf2;
+        if (!handler.serialize_to_iobuf(msg, &buf1, format) ||
+            !handler.serialize_to_iobuf_two_pass(msg, &buf2, format)) {
+            LOG(ERROR) << "Fail to serialize message of " << item_num
+                       << " items";
+            return -1;
+        }
+        if (buf1 != buf2) {
+            LOG(ERROR) << "Two-pass serialization of " << item_num
+                       << " items is different";
+            return -1;
+        }
+        const int times = std::max(FLAGS_total_items / std::max(item_num, 1),
+                                   (int64_t)10);
+        // Warm up TLS blocks and sizes.
+        benchmark(handler, &mcpack2pb::MessageHandler::serialize_to_iobuf,
+                  msg, std::min(times, 100), format);
+        benchmark(handler,
+                  &mcpack2pb::MessageHandler::serialize_to_iobuf_two_pass,
+                  msg, std::min(times, 100), format);
+        const int64_t one_pass = benchmark(
+            handler, &mcpack2pb::MessageHandler::serialize_to_iobuf,
+            msg, times, format);
+        const int64_t two_pass = benchmark(
+            handler, &mcpack2pb::MessageHandler::serialize_to_iobuf_two_pass,
+            msg, times, format);
+        LOG(INFO) << "items=" << item_num << " bytes=" << buf1.size()
+                  << " one-pass=" << one_pass << "ns"
+                  << " two-pass=" << two_pass << "ns";
+    }
+    return 0;
+}
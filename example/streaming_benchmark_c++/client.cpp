@@ -0,0 +1,115 @@
+// Copyright (c) 2014 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A client writing small messages into many streams as fast as possible.
+
+#include <gflags/gflags.h>
+#include <bthread/bthread.h>
+#include <butil/logging.h>
+#include <bvar/bvar.h>
+#include <brpc/channel.h>
+#include <brpc/stream.h>
+#include "echo.pb.h"
+
+DEFINE_string(server, "0.0.0.0:8002", "IP Address of server");
+DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
+DEFINE_int32(stream_num, 1000, "Number of concurrent streams");
+DEFINE_int32(message_size, 64, "Bytes of each message");
+DEFINE_int32(max_buf_size, 64 * 1024, "StreamOptions.max_buf_size");
+DEFINE_int32(max_coalesced_size, 64 * 1024, "StreamOptions.max_coalesced_size, "
+             "0 to send each message in one frame");
+
+bvar::Adder<int64_t> g_sent_messages("streaming_benchmark_sent_messages");
+bvar::PerSecond<bvar::Adder<int64_t> > g_sent_messages_second(
+    "streaming_benchmark_sent_messages_second", &g_sent_messages);
+bvar::Adder<int> g_error_count("streaming_benchmark_error_count");
+
+static void* writer(void* arg) {
+    brpc::StreamId stream = *(brpc::StreamId*)arg;
+    butil::IOBuf msg;
+    msg.resize(FLAGS_message_size, 'm');
+    while (!brpc::IsAskedToQuit()) {
+        const int rc = brpc::StreamWrite(stream, msg);
+        if (rc == 0) {
+            g_sent_messages << 1;
+        } else if (rc == EAGAIN) {
+            // Wait for feedback from the server.
+            const timespec due_time = butil::milliseconds_from_now(100);
+            brpc::StreamWait(stream, &due_time);
+        } else {
+            LOG(ERROR) << "Fail to write Stream=" << stream << ": " << berror(rc);
+            g_error_count << 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse gflags. We recommend you to use gflags as well.
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_BAIDU_STD;
+    options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
+    if (channel.Init(FLAGS_server.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to initialize channel";
+        return -1;
+    }
+    example::EchoService_Stub stub(&channel);
+
+    // All streams share the connection to the server.
+    std::vector<brpc::StreamId> streams(FLAGS_stream_num, brpc::INVALID_STREAM_ID);
+    brpc::StreamOptions stream_options;
+    stream_options.max_buf_size = FLAGS_max_buf_size;
+    stream_options.max_coalesced_size = FLAGS_max_coalesced_size;
+    for (int i = 0; i < FLAGS_stream_num; ++i) {
+        brpc::Controller cntl;
+        if (brpc::StreamCreate(&streams[i], cntl, &stream_options) != 0) {
+            LOG(ERROR) << "Fail to create stream";
+            return -1;
+        }
+        example::EchoRequest request;
+        example::EchoResponse response;
+        request.set_message("I'm a RPC to connect stream");
+        stub.Echo(&cntl, &request, &response, NULL);
+        if (cntl.Failed()) {
+            LOG(ERROR) << "Fail to connect stream, " << cntl.ErrorText();
+            return -1;
+        }
+    }
+
+    std::vector<bthread_t> bids(FLAGS_stream_num);
+    for (int i = 0; i < FLAGS_stream_num; ++i) {
+        if (bthread_start_background(&bids[i], NULL, writer, &streams[i]) != 0) {
+            LOG(ERROR) << "Fail to create bthread";
+            return -1;
+        }
+    }
+
+    while (!brpc::IsAskedToQuit()) {
+        sleep(1);
+        LOG(INFO) << "Writing " << g_sent_messages_second.get_value(1)
+                  << " messages/s into " << FLAGS_stream_num << " streams,"
+                  << " error_count=" << g_error_count.get_value();
+    }
+
+    LOG(INFO) << "StreamingBenchmarkClient is going to quit";
+    for (int i = 0; i < FLAGS_stream_num; ++i) {
+        bthread_join(bids[i], NULL);
+        brpc::StreamClose(streams[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2014 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A server accepting streams and counting received messages.
+
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <bvar/bvar.h>
+#include <brpc/server.h>
+#include <brpc/stream.h>
+#include "echo.pb.h"
+
+DEFINE_int32(port, 8002, "TCP Port of this server");
+DEFINE_int32(min_feedback_size, 16 * 1024, "StreamOptions.min_feedback_size, "
+             "0 to send feedback after consuming each batch");
+DEFINE_int32(feedback_delay_ms, 10, "StreamOptions.feedback_delay_ms");
+
+bvar::Adder<int64_t> g_received_messages("streaming_benchmark_received_messages");
+bvar::PerSecond<bvar::Adder<int64_t> > g_received_messages_second(
+    "streaming_benchmark_received_messages_second", &g_received_messages);
+
+class StreamReceiver : public brpc::StreamInputHandler {
+public:
+    virtual int on_received_messages(brpc::StreamId /*id*/,
+                                     butil::IOBuf *const /*messages*/[],
+                                     size_t size) {
+        g_received_messages << size;
+        return 0;
+    }
+    virtual void on_idle_timeout(brpc::StreamId /*id*/) {}
+    virtual void on_closed(brpc::StreamId id) {
+        // Release the stream which is closed by the client.
+        brpc::StreamClose(id);
+    }
+};
+
+// Your implementation of example::EchoService
+class StreamingBenchmarkService : public example::EchoService {
+public:
+    virtual void Echo(google::protobuf::RpcController* controller,
+                      const example::EchoRequest* /*request*/,
+                      example::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+
+        brpc::Controller* cntl =
+            static_cast<brpc::Controller*>(controller);
+        brpc::StreamOptions stream_options;
+        stream_options.handler = &_receiver;
+        stream_options.min_feedback_size = FLAGS_min_feedback_size;
+        stream_options.feedback_delay_ms = FLAGS_feedback_delay_ms;
+        brpc::StreamId sd;
+        if (brpc::StreamAccept(&sd, *cntl, &stream_options) != 0) {
+            cntl->SetFailed("Fail to accept stream");
+            return;
+        }
+        response->set_message("Accepted stream");
+    }
+
+private:
+    StreamReceiver _receiver;
+};
+
+int main(int argc, char* argv[]) {
+    // Parse gflags. We recommend you to use gflags as well.
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+
+    brpc::Server server;
+    StreamingBenchmarkService service_impl;
+    if (server.AddService(&service_impl,
+                          brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
+        LOG(ERROR) << "Fail to add service";
+        return -1;
+    }
+    if (server.Start(FLAGS_port, NULL) != 0) {
+        LOG(ERROR) << "Fail to start StreamingBenchmarkServer";
+        return -1;
+    }
+
+    while (!brpc::IsAskedToQuit()) {
+        sleep(1);
+        LOG(INFO) << "Receiving " << g_received_messages_second.get_value(1)
+                  << " messages/s";
+    }
+    server.Stop(0);
+    server.Join();
+    return 0;
+}
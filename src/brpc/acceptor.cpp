@@ -16,11 +16,15 @@
 //          Ge,Jun(gejun@baidu.com)
 
 #include <inttypes.h>
+#include <netinet/tcp.h>                    // TCP_INFO
 #include <gflags/gflags.h>
+#include "bthread/unstable.h"               // bthread_timer_add
 #include "butil/fd_guard.h"                 // fd_guard 
 #include "butil/fd_utility.h"               // make_close_on_exec
 #include "butil/time.h"                     // gettimeofday_us
 #include "butil/unique_ptr.h"               // std::unique_ptr
+#include "bvar/bvar.h"
+#include "brpc/reloadable_flags.h"          // BRPC_VALIDATE_GFLAG
 #include "brpc/rdma/rdma_communication_manager.h"
 #include "brpc/rdma/rdma_endpoint.h"
 #include "brpc/acceptor.h"
@@ -30,18 +34,77 @@ namespace brpc {
 
 static const int INITIAL_CONNECTION_CAP = 65536;
 
-Acceptor::Acceptor(bthread_keytable_pool_t* pool)
+DEFINE_int32(acceptor_batch_size, 64, "Connections accepted in a row are "
+             "handed to another bthread to create Sockets every so many "
+             "connections, so that Socket creations of reconnecting storms "
+             "are spread over workers");
+BRPC_VALIDATE_GFLAG(acceptor_batch_size, PositiveInteger);
+
+DEFINE_int32(max_new_connections_per_second, 0, "Maximum number of "
+             "connections accepted per second by each server, others stay "
+             "in the accept queue. No limit for non-positive values");
+BRPC_VALIDATE_GFLAG(max_new_connections_per_second, PassValidate);
+
+DEFINE_int32(accept_shed_backlog_percent, 90, "When accepting is limited by "
+             "-max_new_connections_per_second and the accept queue is fuller "
+             "than so many percent of its backlog, oldest connections in the "
+             "queue are closed to make room. Never close for non-positive "
+             "values");
+BRPC_VALIDATE_GFLAG(accept_shed_backlog_percent, PassValidate);
+
+struct AcceptorVars {
+    // Microseconds from accepting a connection to its Socket being created,
+    // as well as the rate of accepting (rpc_accept_qps).
+    bvar::LatencyRecorder accept_latency;
+    // Connections closed without being served by ShedBacklog().
+    bvar::Adder<int64_t> nshed;
+    // Times that accepting is paused by -max_new_connections_per_second.
+    bvar::Adder<int64_t> nthrottled;
+
+    AcceptorVars()
+        : accept_latency("rpc_accept")
+        , nshed("rpc_accept_shed_count")
+        , nthrottled("rpc_accept_throttled_count") {}
+};
+
+static AcceptorVars* s_acceptor_vars = NULL;
+static pthread_once_t s_create_acceptor_vars_once = PTHREAD_ONCE_INIT;
+static void CreateAcceptorVars() {
+    s_acceptor_vars = new AcceptorVars;
+}
+
+struct AcceptedConnection {
+    int fd;
+    butil::EndPoint remote_side;
+    int64_t accepted_us;
+};
+
+struct Acceptor::AcceptedBatch {
+    Acceptor* acceptor;
+    int event_dispatcher_index;
+    std::vector<AcceptedConnection> conns;
+};
+
+Acceptor::Acceptor(bthread_keytable_pool_t* pool, bthread_tag_t tag)
     : InputMessenger()
     , _keytable_pool(pool)
+    , _bthread_tag(tag)
     , _status(UNINITIALIZED)
     , _idle_timeout_sec(-1)
     , _close_idle_tid(INVALID_BTHREAD)
     , _listened_fd(-1)
     , _acception_id(0)
+    , _nreuse_port_listened(0)
     , _listened_rdma(NULL)
     , _rdma_acception_id(0)
     , _empty_cond(&_map_mutex)
-    , _ssl_ctx(NULL) {
+    , _npending_tasks(0)
+    , _resume_pending(false)
+    , _accept_window_s(0)
+    , _naccepted_in_window(0)
+    , _ssl_ctx(NULL)
+    , _use_shm(false) {
+    pthread_once(&s_create_acceptor_vars_once, CreateAcceptorVars);
 }
 
 Acceptor::~Acceptor() {
@@ -52,10 +115,25 @@ Acceptor::~Acceptor() {
 int Acceptor::StartAccept(
     int listened_fd, rdma::RdmaCommunicationManager* listened_rdma,
     int idle_timeout_sec, SSL_CTX* ssl_ctx) {
-    if (listened_fd < 0) {
-        LOG(FATAL) << "Invalid listened_fd=" << listened_fd;
+    return StartAccept(std::vector<int>(1, listened_fd), listened_rdma,
+                       idle_timeout_sec, ssl_ctx);
+}
+
+int Acceptor::StartAccept(
+    const std::vector<int>& listened_fds,
+    rdma::RdmaCommunicationManager* listened_rdma,
+    int idle_timeout_sec, SSL_CTX* ssl_ctx) {
+    if (listened_fds.empty()) {
+        LOG(FATAL) << "No listened_fds";
         return -1;
     }
+    const int listened_fd = listened_fds[0];
+    for (size_t i = 0; i < listened_fds.size(); ++i) {
+        if (listened_fds[i] < 0) {
+            LOG(FATAL) << "Invalid listened_fd=" << listened_fds[i];
+            return -1;
+        }
+    }
     
     BAIDU_SCOPED_LOCK(_map_mutex);
     if (_status == UNINITIALIZED) {
@@ -85,11 +163,29 @@ int Acceptor::StartAccept(
     options.fd = listened_fd;
     options.user = this;
     options.on_edge_triggered_events = OnNewConnections;
+    if (listened_fds.size() > 1) {
+        options.event_dispatcher_index = 0;
+    }
     if (Socket::Create(options, &_acception_id) != 0) {
         // Close-idle-socket thread will be stopped inside destructor
         LOG(FATAL) << "Fail to create _acception_id";
         return -1;
     }
+    _reuse_port_acception_ids.clear();
+    for (size_t i = 1; i < listened_fds.size(); ++i) {
+        // Not fatal, connections are still accepted by other fds.
+        options.fd = listened_fds[i];
+        options.event_dispatcher_index = i;
+        SocketId id;
+        if (Socket::Create(options, &id) != 0) {
+            LOG(ERROR) << "Fail to create Socket for listened_fd="
+                       << listened_fds[i];
+            continue;
+        }
+        _reuse_port_acception_ids.push_back(id);
+    }
+    _nreuse_port_listened = _reuse_port_acception_ids.size();
+    options.event_dispatcher_index = -1;
 
     if (listened_rdma) {
         // Start rdmacm accept, with another Socket.
@@ -98,6 +194,9 @@ int Acceptor::StartAccept(
         if (Socket::Create(options, &_rdma_acception_id) < 0) {
             LOG(FATAL) << "Fail to create _rdma_acception_id";
             Socket::SetFailed(_acception_id);
+            for (size_t i = 0; i < _reuse_port_acception_ids.size(); ++i) {
+                Socket::SetFailed(_reuse_port_acception_ids[i]);
+            }
             return -1;
         }
     }
@@ -110,17 +209,10 @@ int Acceptor::StartAccept(
 
 void* Acceptor::CloseIdleConnections(void* arg) {
     Acceptor* am = static_cast<Acceptor*>(arg);
-    std::vector<SocketId> checking_fds;
     const uint64_t CHECK_INTERVAL_US = 1000000UL;
     while (bthread_usleep(CHECK_INTERVAL_US) == 0) {
-        // TODO: this is not efficient for a lot of connections(>100K)
-        am->ListConnections(&checking_fds);
-        for (size_t i = 0; i < checking_fds.size(); ++i) {
-            SocketUniquePtr s;
-            if (Socket::Address(checking_fds[i], &s) == 0) {
-                s->ReleaseReferenceIfIdle(am->_idle_timeout_sec);
-            }
-        }
+        // Only connections whose deadlines expired are checked.
+        am->_idle_wheel.CloseIdleConnections(am->_idle_timeout_sec);
     }
     return NULL;
 }
@@ -140,6 +232,9 @@ void Acceptor::StopAccept(int /*closewait_ms*/) {
 
     // Don't set _acception_id to 0 because BeforeRecycle needs it.
     Socket::SetFailed(_acception_id);
+    for (size_t i = 0; i < _reuse_port_acception_ids.size(); ++i) {
+        Socket::SetFailed(_reuse_port_acception_ids[i]);
+    }
     if (_rdma_acception_id > 0) {
         Socket::SetFailed(_rdma_acception_id);
     }
@@ -185,7 +280,8 @@ void Acceptor::Join() {
         return;
     }
     // `_listened_fd' will be set to -1 once it has been recycled
-    while (_listened_fd > 0 || _listened_rdma || !_socket_map.empty()) {
+    while (_listened_fd > 0 || _nreuse_port_listened > 0 ||
+           _listened_rdma || !_socket_map.empty() || _npending_tasks > 0) {
         _empty_cond.Wait();
     }
     const int saved_idle_timeout_sec = _idle_timeout_sec;
@@ -205,6 +301,20 @@ void Acceptor::Join() {
     }
 }
 
+void Acceptor::ListListenedFds(std::vector<int>* fds) const {
+    fds->clear();
+    if (_status != RUNNING || _listened_fd < 0) {
+        return;
+    }
+    fds->push_back(_listened_fd);
+    for (size_t i = 0; i < _reuse_port_acception_ids.size(); ++i) {
+        SocketUniquePtr s;
+        if (Socket::Address(_reuse_port_acception_ids[i], &s) == 0) {
+            fds->push_back(s->fd());
+        }
+    }
+}
+
 size_t Acceptor::ConnectionCount() const {
     // Notice that _socket_map may be modified concurrently. This actually
     // assumes that size() is safe to call concurrently.
@@ -259,14 +369,38 @@ void Acceptor::ListConnections(std::vector<SocketId>* conn_list) {
 }
 
 void Acceptor::OnNewConnectionsUntilEAGAIN(Socket* acception) {
+    Acceptor* am = dynamic_cast<Acceptor*>(acception->user());
+    if (NULL == am) {
+        LOG(FATAL) << "Impossible! acception->user() MUST be Acceptor";
+        acception->SetFailed(EINVAL, "Impossible! acception->user() MUST be Acceptor");
+        return;
+    }
+    const size_t batch_size = FLAGS_acceptor_batch_size;
+    std::unique_ptr<AcceptedBatch> batch;
     while (1) {
-        struct sockaddr in_addr;
+        if (am->ReachAcceptRate()) {
+            // Leave connections in the accept queue. No more events are
+            // triggered for them (edge-triggered), resume by a timer.
+            s_acceptor_vars->nthrottled << 1;
+            am->ShedBacklog(acception->fd());
+            am->ResumeAcceptLater();
+            break;
+        }
+        // Large enough for unix domain sockets.
+        struct sockaddr_storage in_addr;
         socklen_t in_len = sizeof(in_addr);
-        butil::fd_guard in_fd(accept(acception->fd(), &in_addr, &in_len));
+#if defined(OS_LINUX)
+        // Save fcntl() in Socket::ResetFileDescriptor.
+        const int in_fd = accept4(acception->fd(), (sockaddr*)&in_addr,
+                                  &in_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        const int in_fd = accept(acception->fd(), (sockaddr*)&in_addr,
+                                 &in_len);
+#endif
         if (in_fd < 0) {
             // no EINTR because listened fd is non-blocking.
             if (errno == EAGAIN) {
-                return;
+                break;
             }
             // Do NOT return -1 when `accept' failed, otherwise `_listened_fd'
             // will be closed. Continue to consume all the events until EAGAIN
@@ -277,29 +411,89 @@ void Acceptor::OnNewConnectionsUntilEAGAIN(Socket* acception) {
                 << "Fail to accept from listened_fd=" << acception->fd();
             continue;
         }
-
-        Acceptor* am = dynamic_cast<Acceptor*>(acception->user());
-        if (NULL == am) {
-            LOG(FATAL) << "Impossible! acception->user() MUST be Acceptor";
-            acception->SetFailed(EINVAL, "Impossible! acception->user() MUST be Acceptor");
-            return;
+        am->_naccepted_in_window.fetch_add(1, butil::memory_order_relaxed);
+        if (batch == NULL) {
+            batch.reset(new AcceptedBatch);
+            batch->acceptor = am;
+            // Handled by the dispatcher of the listened fd when -reuse_port
+            // is on, otherwise chosen by hash.
+            batch->event_dispatcher_index = acception->_edisp_index;
+            batch->conns.reserve(batch_size);
         }
-        
+        AcceptedConnection conn;
+        conn.fd = in_fd;
+        if (butil::sockaddr2endpoint(in_addr, in_len, &conn.remote_side) != 0) {
+            conn.remote_side = butil::EndPoint();
+        }
+        conn.accepted_us = butil::cpuwide_time_us();
+        batch->conns.push_back(conn);
+        if (batch->conns.size() >= batch_size) {
+            // More connections are likely to be accepted, create Sockets of
+            // this batch in parallel.
+            am->CreateAcceptedSocketsInBackground(batch.release());
+        }
+    }
+    if (batch != NULL) {
+        // The last batch is created in this bthread which is ending.
+        CreateAcceptedSockets(batch.get());
+    }
+}
+
+void Acceptor::CreateAcceptedSocketsInBackground(AcceptedBatch* batch) {
+    {
+        BAIDU_SCOPED_LOCK(_map_mutex);
+        ++_npending_tasks;
+    }
+    bthread_t th;
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = _bthread_tag;
+    if (bthread_start_background(&th, &attr, RunCreateAcceptedSockets,
+                                 batch) != 0) {
+        LOG(ERROR) << "Fail to start bthread, create Sockets in place";
+        RunCreateAcceptedSockets(batch);
+    }
+}
+
+void* Acceptor::RunCreateAcceptedSockets(void* arg) {
+    AcceptedBatch* batch = static_cast<AcceptedBatch*>(arg);
+    Acceptor* am = batch->acceptor;
+    CreateAcceptedSockets(batch);
+    delete batch;
+    am->EndPendingTask();
+    return NULL;
+}
+
+void Acceptor::EndPendingTask() {
+    BAIDU_SCOPED_LOCK(_map_mutex);
+    if (--_npending_tasks == 0) {
+        _empty_cond.Broadcast();
+    }
+}
+
+void Acceptor::CreateAcceptedSockets(AcceptedBatch* batch) {
+    Acceptor* am = batch->acceptor;
+    for (size_t i = 0; i < batch->conns.size(); ++i) {
+        const AcceptedConnection& conn = batch->conns[i];
+        butil::fd_guard in_fd(conn.fd);
         SocketId socket_id;
         SocketOptions options;
         options.keytable_pool = am->_keytable_pool;
+        options.bthread_tag = am->_bthread_tag;
+        options.event_dispatcher_index = batch->event_dispatcher_index;
         options.fd = in_fd;
-        options.remote_side = butil::EndPoint(*(sockaddr_in*)&in_addr);
-        options.user = acception->user();
+        options.remote_side = conn.remote_side;
+        options.user = am;
         options.on_edge_triggered_events = InputMessenger::OnNewMessages;
         options.ssl_ctx = am->_ssl_ctx;
         options.use_rdma = (am->_listened_rdma != NULL);
+        options.use_shm = am->_use_shm;
         if (Socket::Create(options, &socket_id) != 0) {
             LOG(ERROR) << "Fail to create Socket";
             continue;
         }
         in_fd.release(); // transfer ownership to socket_id
-
+        s_acceptor_vars->accept_latency
+            << butil::cpuwide_time_us() - conn.accepted_us;
         // There's a funny race condition here. After Socket::Create, messages
         // from the socket are already handled and a RPC is possibly done
         // before the socket is added into _socket_map below. This is found in
@@ -320,19 +514,118 @@ void Acceptor::OnNewConnectionsUntilEAGAIN(Socket* acception) {
                 // has been destroyed
                 am->_socket_map.insert(socket_id, ConnectStatistics());
             }
+            if (am->_idle_timeout_sec > 0) {
+                am->_idle_wheel.Add(socket_id, butil::cpuwide_time_us() +
+                                    am->_idle_timeout_sec * 1000000L);
+            }
             if (!is_running) {
-                LOG(WARNING) << "Acceptor on fd=" << acception->fd()
-                    << " has been stopped, discard newly created " << *sock;
-                sock->SetFailed(ELOGOFF, "Acceptor on fd=%d has been stopped, "
-                        "discard newly created %s", acception->fd(),
+                LOG(WARNING) << "Acceptor has been stopped, discard newly "
+                    "created " << *sock;
+                sock->SetFailed(ELOGOFF, "Acceptor has been stopped, "
+                        "discard newly created %s",
                         sock->description().c_str());
-                return;
+                continue;
             }
         } // else: The socket has already been destroyed, Don't add its id
           // into _socket_map
     }
 }
 
+bool Acceptor::ReachAcceptRate() {
+    const int max_rate = FLAGS_max_new_connections_per_second;
+    if (max_rate <= 0) {
+        return false;
+    }
+    const int64_t now_s = butil::gettimeofday_s();
+    int64_t window_s = _accept_window_s.load(butil::memory_order_relaxed);
+    if (window_s != now_s &&
+        _accept_window_s.compare_exchange_strong(
+            window_s, now_s, butil::memory_order_relaxed)) {
+        _naccepted_in_window.store(0, butil::memory_order_relaxed);
+    }
+    return _naccepted_in_window.load(butil::memory_order_relaxed) >= max_rate;
+}
+
+void Acceptor::ShedBacklog(int listened_fd) {
+#if defined(OS_LINUX)
+    const int percent = FLAGS_accept_shed_backlog_percent;
+    if (percent <= 0) {
+        return;
+    }
+    // For listening sockets, tcpi_unacked is length of the accept queue
+    // and tcpi_sacked is the backlog.
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(listened_fd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0 ||
+        ti.tcpi_sacked == 0) {
+        return;
+    }
+    const int64_t limit = (int64_t)ti.tcpi_sacked * std::min(percent, 100) / 100;
+    // Front connections waited longest and their clients are likely to
+    // have timed out.
+    for (int64_t n = (int64_t)ti.tcpi_unacked - limit; n > 0; --n) {
+        const int fd = accept(listened_fd, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+        close(fd);
+        s_acceptor_vars->nshed << 1;
+    }
+#else
+    (void)listened_fd;
+#endif
+}
+
+void Acceptor::ResumeAcceptLater() {
+    if (_resume_pending.exchange(true, butil::memory_order_relaxed)) {
+        return;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_map_mutex);
+        ++_npending_tasks;
+    }
+    // At the beginning of next second when the quota is renewed.
+    const int64_t abstime_us = (butil::gettimeofday_s() + 1) * 1000000L;
+    bthread_timer_t timer;
+    if (bthread_timer_add(&timer, butil::microseconds_to_timespec(abstime_us),
+                          ResumeAcceptTimer, this) != 0) {
+        LOG(ERROR) << "Fail to add timer, resume accepting now";
+        ResumeAcceptTimer(this);
+    }
+}
+
+void Acceptor::ResumeAcceptTimer(void* arg) {
+    // Don't accept in the timer thread.
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, RunResumeAccept, arg) != 0) {
+        LOG(ERROR) << "Fail to start bthread, resume accepting in place";
+        RunResumeAccept(arg);
+    }
+}
+
+void* Acceptor::RunResumeAccept(void* arg) {
+    Acceptor* am = static_cast<Acceptor*>(arg);
+    am->_resume_pending.store(false, butil::memory_order_relaxed);
+    std::vector<SocketId> acception_ids;
+    {
+        BAIDU_SCOPED_LOCK(am->_map_mutex);
+        if (am->_status == RUNNING) {
+            acception_ids.push_back(am->_acception_id);
+            acception_ids.insert(acception_ids.end(),
+                                 am->_reuse_port_acception_ids.begin(),
+                                 am->_reuse_port_acception_ids.end());
+        }
+    }
+    for (size_t i = 0; i < acception_ids.size(); ++i) {
+        SocketUniquePtr acception;
+        if (Socket::Address(acception_ids[i], &acception) == 0) {
+            OnNewConnectionsUntilEAGAIN(acception.get());
+        }
+    }
+    am->EndPendingTask();
+    return NULL;
+}
+
 void Acceptor::OnNewConnections(Socket* acception) {
     int progress = Socket::PROGRESS_INIT;
     do {
@@ -390,6 +683,13 @@ void Acceptor::BeforeRecycle(Socket* sock) {
         _empty_cond.Broadcast();
         return;
     }
+    for (size_t i = 0; i < _reuse_port_acception_ids.size(); ++i) {
+        if (sock->id() == _reuse_port_acception_ids[i]) {
+            --_nreuse_port_listened;
+            _empty_cond.Broadcast();
+            return;
+        }
+    }
     if (sock->id() == _rdma_acception_id) {
         sock->_fd = -1;  // avoid RemoveConsumer twice
         delete _listened_rdma;
@@ -22,6 +22,7 @@
 #include "butil/synchronization/condition_variable.h"
 #include "butil/containers/flat_map.h"
 #include "brpc/input_messenger.h"
+#include "brpc/details/idle_connection_wheel.h"
 
 
 namespace brpc {
@@ -46,7 +47,8 @@ public:
     };
 
 public:
-    explicit Acceptor(bthread_keytable_pool_t* pool = NULL);
+    explicit Acceptor(bthread_keytable_pool_t* pool = NULL,
+                      bthread_tag_t tag = BTHREAD_TAG_DEFAULT);
     ~Acceptor();
 
     // [thread-safe] Accept connections from `listened_fd' and `listened_rdma'.
@@ -64,6 +66,16 @@ public:
         return StartAccept(listened_fd, NULL, idle_timeout_sec, ssl_ctx);
     }
 
+    // [thread-safe] Accept connections from all `listened_fds' which listen
+    // to a same port with SO_REUSEPORT. If there're more than one fds,
+    // the i-th fd and connections accepted from it are handled by the i-th
+    // EventDispatcher(modulo -event_dispatcher_num). Ownership of all fds
+    // is transferred to `Acceptor' on success, listened_fds[0] is the one
+    // returned by listened_fd(). Other parameters are same as above.
+    int StartAccept(const std::vector<int>& listened_fds,
+                    rdma::RdmaCommunicationManager* listened_rdma,
+                    int idle_timeout_sec, SSL_CTX* ssl_ctx);
+
     // [thread-safe] Stop accepting connections.
     // `closewait_ms' is not used anymore.
     void StopAccept(int /*closewait_ms*/);
@@ -74,6 +86,10 @@ public:
     // The parameter to StartAccept. Negative when acceptor is stopped.
     int listened_fd() const { return _listened_fd; }
 
+    // Clear `fds' and append all fds accepted from into it, listened_fd()
+    // is the first one. Empty when acceptor is stopped.
+    void ListListenedFds(std::vector<int>* fds) const;
+
     // Get number of existing connections.
     size_t ConnectionCount() const;
 
@@ -85,6 +101,10 @@ public:
 
     Status status() const { return _status; }
 
+    // Let accepted sockets accept shared memory proposed by local clients.
+    // Must be called before StartAccept.
+    void set_use_shm(bool use_shm) { _use_shm = use_shm; }
+
 private:
     // Accept connections.
     static void OnNewConnectionsUntilEAGAIN(Socket* m);
@@ -94,6 +114,25 @@ private:
     static void OnNewRdmaConnections(Socket* m);
 
     static void* CloseIdleConnections(void* arg);
+
+    // Create Sockets for connections accepted in a batch.
+    struct AcceptedBatch;
+    static void CreateAcceptedSockets(AcceptedBatch* batch);
+    static void* RunCreateAcceptedSockets(void* arg);
+    void CreateAcceptedSocketsInBackground(AcceptedBatch* batch);
+
+    // True if -max_new_connections_per_second was reached in this second.
+    bool ReachAcceptRate();
+    // Close connections at front of the accept queue of `listened_fd' if
+    // it's too full to hold new connections.
+    void ShedBacklog(int listened_fd);
+    // Accept from all listened fds again at next second.
+    void ResumeAcceptLater();
+    static void ResumeAcceptTimer(void* arg);
+    static void* RunResumeAccept(void* arg);
+
+    // Called when a background task of this Acceptor ends.
+    void EndPendingTask();
     
     // Initialize internal structure. 
     int Initialize();
@@ -102,14 +141,22 @@ private:
     virtual void BeforeRecycle(Socket* sock);
 
     bthread_keytable_pool_t* _keytable_pool; // owned by Server
+    bthread_tag_t _bthread_tag;
     Status _status;
     int _idle_timeout_sec;
     bthread_t _close_idle_tid;
+    // Accepted connections checked by CloseIdleConnections.
+    IdleConnectionWheel _idle_wheel;
 
     int _listened_fd;
     // The Socket to accept connections.
     SocketId _acception_id;
 
+    // Sockets to accept connections from listened_fds[1...] of StartAccept.
+    std::vector<SocketId> _reuse_port_acception_ids;
+    // Number of sockets in _reuse_port_acception_ids not recycled yet.
+    size_t _nreuse_port_listened;
+
     // The rdmacm used for listenning
     rdma::RdmaCommunicationManager* _listened_rdma;
     // The Socket to accept RDMA connections.
@@ -121,8 +168,20 @@ private:
     // The map containing all the accepted sockets
     SocketMap _socket_map;
 
+    // Number of bthreads creating accepted Sockets and pending resumptions
+    // of accepting, waited by Join(). Protected by _map_mutex.
+    int _npending_tasks;
+    // True if accepting is paused by -max_new_connections_per_second and
+    // will be resumed by a timer.
+    butil::atomic<bool> _resume_pending;
+    // Seconds and number of connections accepted in it.
+    butil::atomic<int64_t> _accept_window_s;
+    butil::atomic<int> _naccepted_in_window;
+
     // Not owner
     SSL_CTX* _ssl_ctx;
+
+    bool _use_shm;
 };
 
 } // namespace brpc
@@ -0,0 +1,147 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <map>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "brpc/compress.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/adaptive_compressor.h"
+
+
+namespace brpc {
+
+DEFINE_int32(auto_compress_min_size, 1024, "Messages smaller than this "
+             "value(in bytes) are not compressed by COMPRESS_TYPE_AUTO");
+BRPC_VALIDATE_GFLAG(auto_compress_min_size, NonNegativeInteger);
+DEFINE_double(auto_compress_max_ratio, 0.7, "COMPRESS_TYPE_AUTO picks the "
+              "cheapest compression whose ratio(compressed size / original "
+              "size) is not larger than this value");
+BRPC_VALIDATE_GFLAG(auto_compress_max_ratio, PassValidate);
+DEFINE_int32(auto_compress_sample_interval, 100, "COMPRESS_TYPE_AUTO "
+             "samples ratios of compressions every so many messages");
+BRPC_VALIDATE_GFLAG(auto_compress_sample_interval, PositiveInteger);
+
+// Weight of the latest sample in smoothed ratios.
+static const double SAMPLE_WEIGHT = 0.3;
+
+// From the cheapest to the most expensive. gzip is not a candidate since
+// it's slower than zlib with a similar ratio.
+static const CompressType s_candidates[] = {
+    COMPRESS_TYPE_LZ4,
+    COMPRESS_TYPE_SNAPPY,
+    COMPRESS_TYPE_ZSTD,
+    COMPRESS_TYPE_ZLIB
+};
+
+AdaptiveCompressor::AdaptiveCompressor()
+    : _selected(COMPRESS_TYPE_NONE)
+    , _nmessage(0)
+    , _nsmall(0)
+    , _nsample(0) {
+    BAIDU_CASSERT(arraysize(s_candidates) == NCANDIDATE,
+                  candidates_must_match_ratios);
+    for (int i = 0; i < NCANDIDATE; ++i) {
+        _ratios[i] = -1;
+    }
+}
+
+bool AdaptiveCompressor::Serialize(const google::protobuf::Message& msg,
+                                   butil::IOBuf* buf, CompressType* type) {
+    const int size = msg.ByteSize();
+    if (size < FLAGS_auto_compress_min_size) {
+        _nsmall.fetch_add(1, butil::memory_order_relaxed);
+        *type = COMPRESS_TYPE_NONE;
+        return SerializeAsCompressedData(msg, buf, COMPRESS_TYPE_NONE);
+    }
+    const int64_t n = _nmessage.fetch_add(1, butil::memory_order_relaxed);
+    if (n % FLAGS_auto_compress_sample_interval == 0) {
+        return Sample(msg, size, buf, type);
+    }
+    *type = selected();
+    return SerializeAsCompressedData(msg, buf, *type);
+}
+
+bool AdaptiveCompressor::Sample(const google::protobuf::Message& msg,
+                                size_t size, butil::IOBuf* buf,
+                                CompressType* type) {
+    _nsample.fetch_add(1, butil::memory_order_relaxed);
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (int i = 0; i < NCANDIDATE; ++i) {
+        if (!HasCompressHandler(s_candidates[i])) {
+            continue;
+        }
+        butil::IOBuf compressed;
+        if (!SerializeAsCompressedData(msg, &compressed, s_candidates[i])) {
+            continue;
+        }
+        const double ratio = compressed.size() / (double)size;
+        _ratios[i] = (_ratios[i] < 0 ? ratio :
+                      _ratios[i] * (1 - SAMPLE_WEIGHT) + ratio * SAMPLE_WEIGHT);
+        if (_ratios[i] <= FLAGS_auto_compress_max_ratio) {
+            _selected.store(s_candidates[i], butil::memory_order_relaxed);
+            *type = s_candidates[i];
+            buf->append(compressed);
+            return true;
+        }
+    }
+    _selected.store(COMPRESS_TYPE_NONE, butil::memory_order_relaxed);
+    *type = COMPRESS_TYPE_NONE;
+    return SerializeAsCompressedData(msg, buf, COMPRESS_TYPE_NONE);
+}
+
+void AdaptiveCompressor::Describe(std::ostream& os,
+                                  const DescribeOptions&) const {
+    os << "selected=" << CompressTypeToCStr(selected())
+       << " samples=" << _nsample.load(butil::memory_order_relaxed)
+       << " small=" << _nsmall.load(butil::memory_order_relaxed)
+       << " ratios={";
+    BAIDU_SCOPED_LOCK(_mutex);
+    bool first = true;
+    for (int i = 0; i < NCANDIDATE; ++i) {
+        if (_ratios[i] < 0) {
+            continue;
+        }
+        if (!first) {
+            os << ' ';
+        }
+        first = false;
+        os << CompressTypeToCStr(s_candidates[i]) << '='
+           << (int)(_ratios[i] * 100) << '%';
+    }
+    os << '}';
+}
+
+typedef std::map<const google::protobuf::MethodDescriptor*,
+                 AdaptiveCompressor*> RequestCompressorMap;
+static pthread_mutex_t s_request_compressors_mutex = PTHREAD_MUTEX_INITIALIZER;
+static RequestCompressorMap* s_request_compressors = NULL;
+
+AdaptiveCompressor* AdaptiveCompressor::ForRequestsOf(
+    const google::protobuf::MethodDescriptor* method) {
+    BAIDU_SCOPED_LOCK(s_request_compressors_mutex);
+    if (s_request_compressors == NULL) {
+        s_request_compressors = new RequestCompressorMap;
+    }
+    // Never deleted since messages are sent till the end of the process.
+    AdaptiveCompressor*& c = (*s_request_compressors)[method];
+    if (c == NULL) {
+        c = new AdaptiveCompressor;
+    }
+    return c;
+}
+
+} // namespace brpc
@@ -0,0 +1,90 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_ADAPTIVE_COMPRESSOR_H
+#define BRPC_ADAPTIVE_COMPRESSOR_H
+
+#include <ostream>
+#include <google/protobuf/message.h>              // Message
+#include <google/protobuf/descriptor.h>           // MethodDescriptor
+#include "butil/atomicops.h"
+#include "butil/iobuf.h"
+#include "butil/synchronization/lock.h"          // butil::Mutex
+#include "brpc/describable.h"
+#include "brpc/options.pb.h"                     // CompressType
+
+
+namespace brpc {
+
+// Pick compression for messages of a method when the CompressType is
+// COMPRESS_TYPE_AUTO (only supported by baidu_std):
+//   - Messages smaller than -auto_compress_min_size are not compressed.
+//   - One of every -auto_compress_sample_interval messages is a sample,
+//     which is compressed by candidates from the cheapest(lz4, snappy,
+//     zstd, zlib, unregistered ones are skipped) until the smoothed ratio
+//     (compressed size / original size) of a candidate is not larger than
+//     -auto_compress_max_ratio. The candidate is picked for following
+//     messages, or no compression if none of the candidates qualifies.
+// Decisions are shown in /status for responses of server methods.
+class AdaptiveCompressor : public Describable {
+public:
+    AdaptiveCompressor();
+
+    // Serialize `msg' into `buf' compressed by the picked type, which is
+    // stored into `type'.
+    // Returns true on success, false otherwise.
+    bool Serialize(const google::protobuf::Message& msg,
+                   butil::IOBuf* buf, CompressType* type);
+
+    // The type picked at last sample.
+    CompressType selected() const {
+        return (CompressType)_selected.load(butil::memory_order_relaxed);
+    }
+
+    // True if any message was compressed by this compressor.
+    bool used() const {
+        return _nmessage.load(butil::memory_order_relaxed) != 0 ||
+            _nsmall.load(butil::memory_order_relaxed) != 0;
+    }
+
+    void Describe(std::ostream& os, const DescribeOptions&) const;
+
+    // The compressor shared by requests of `method' sent by channels,
+    // created at the first call.
+    static AdaptiveCompressor* ForRequestsOf(
+        const google::protobuf::MethodDescriptor* method);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveCompressor);
+
+    static const int NCANDIDATE = 4;
+
+    bool Sample(const google::protobuf::Message& msg, size_t size,
+                butil::IOBuf* buf, CompressType* type);
+
+    butil::atomic<int> _selected;
+    butil::atomic<int64_t> _nmessage;
+    butil::atomic<int64_t> _nsmall;
+    butil::atomic<int64_t> _nsample;
+    // Protects _ratios, only locked by samples.
+    mutable butil::Mutex _mutex;
+    // Smoothed ratios of candidates, negative when never sampled.
+    double _ratios[NCANDIDATE];
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_ADAPTIVE_COMPRESSOR_H
@@ -0,0 +1,57 @@
+// Copyright (c) 2018 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include "butil/string_printf.h"
+#include "brpc/adaptive_max_concurrency.h"
+
+
+namespace brpc {
+
+AdaptiveMaxConcurrency::AdaptiveMaxConcurrency()
+    : _value("0"), _max_concurrency(0), _adaptive(false) {
+}
+
+AdaptiveMaxConcurrency::AdaptiveMaxConcurrency(int max_concurrency)
+    : _max_concurrency(0), _adaptive(false) {
+    *this = max_concurrency;
+}
+
+AdaptiveMaxConcurrency::AdaptiveMaxConcurrency(
+    const butil::StringPiece& value)
+    : _max_concurrency(0), _adaptive(false) {
+    *this = value;
+}
+
+void AdaptiveMaxConcurrency::operator=(int max_concurrency) {
+    _value = butil::string_printf("%d", max_concurrency);
+    _adaptive = false;
+    _max_concurrency = max_concurrency;
+}
+
+void AdaptiveMaxConcurrency::operator=(const butil::StringPiece& value) {
+    const std::string str = value.as_string();
+    char* endptr = NULL;
+    const long n = strtol(str.c_str(), &endptr, 10);
+    if (!str.empty() && *endptr == '\0') {
+        *this = (int)n;
+        return;
+    }
+    _value = str;
+    // Not limited by the constant path in MethodStatus.
+    _max_concurrency = 0;
+    _adaptive = true;
+}
+
+} // namespace brpc
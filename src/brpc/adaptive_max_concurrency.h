@@ -0,0 +1,64 @@
+// Copyright (c) 2018 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_ADAPTIVE_MAX_CONCURRENCY_H
+#define BRPC_ADAPTIVE_MAX_CONCURRENCY_H
+
+#include <string>
+#include <ostream>
+#include "butil/strings/string_piece.h"
+
+
+namespace brpc {
+
+// Max concurrency of a method, which is either a constant number (0 means
+// unlimited) or name of a ConcurrencyLimiter (e.g. "auto") that adjusts
+// the limit at runtime.
+// Example:
+//   server.MaxConcurrencyOf("example.EchoService.Echo") = 10;
+//   server.MaxConcurrencyOf("example.EchoService.Echo") = "auto";
+class AdaptiveMaxConcurrency {
+public:
+    AdaptiveMaxConcurrency();
+    AdaptiveMaxConcurrency(int max_concurrency);
+    AdaptiveMaxConcurrency(const butil::StringPiece& value);
+
+    void operator=(int max_concurrency);
+    // Numbers are treated as constants, others as names of limiters.
+    void operator=(const butil::StringPiece& value);
+
+    // The constant limit, 0 if it's unlimited or decided by a limiter.
+    operator int() const { return _max_concurrency; }
+
+    // The number or name of the limiter.
+    const std::string& value() const { return _value; }
+
+    // True if the limit is decided by a ConcurrencyLimiter named value().
+    bool is_adaptive() const { return _adaptive; }
+
+private:
+    std::string _value;
+    int _max_concurrency;
+    bool _adaptive;
+};
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const AdaptiveMaxConcurrency& amc) {
+    return os << amc.value();
+}
+
+} // namespace brpc
+
+
+#endif  // BRPC_ADAPTIVE_MAX_CONCURRENCY_H
@@ -0,0 +1,109 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include "butil/time.h"
+#include "brpc/controller.h"
+#include "brpc/backup_request_policy.h"
+
+namespace brpc {
+
+// Interval of re-computing the percentile.
+static const int64_t UPDATE_INTERVAL_US = 100000;
+static const int64_t BUDGET_UNIT = 1000;
+
+LatencyPercentileBackupPolicyOptions::LatencyPercentileBackupPolicyOptions()
+    : percentile(0.95)
+    , max_backup_ratio(0.05)
+    , max_backup_burst(10)
+    , window_size(10)
+    , min_backup_request_ms(1) {
+}
+
+static LatencyPercentileBackupPolicyOptions NormalizeOptions(
+    const LatencyPercentileBackupPolicyOptions& options) {
+    LatencyPercentileBackupPolicyOptions opt = options;
+    opt.percentile = std::min(std::max(opt.percentile, 0.01), 0.9999);
+    opt.max_backup_ratio = std::min(std::max(opt.max_backup_ratio, 0.0), 1.0);
+    opt.max_backup_burst = std::max(opt.max_backup_burst, 1);
+    opt.window_size = std::max(opt.window_size, 1);
+    opt.min_backup_request_ms = std::max(opt.min_backup_request_ms, 0);
+    return opt;
+}
+
+LatencyPercentileBackupPolicy::LatencyPercentileBackupPolicy()
+    : _options(NormalizeOptions(LatencyPercentileBackupPolicyOptions()))
+    , _latency(_options.window_size)
+    , _backup_request_ms(-1)
+    , _next_update_us(0)
+    , _budget(0) {
+}
+
+LatencyPercentileBackupPolicy::LatencyPercentileBackupPolicy(
+    const LatencyPercentileBackupPolicyOptions& options)
+    : _options(NormalizeOptions(options))
+    , _latency(_options.window_size)
+    , _backup_request_ms(-1)
+    , _next_update_us(0)
+    , _budget(0) {
+}
+
+int32_t LatencyPercentileBackupPolicy::GetBackupRequestMs() const {
+    const int64_t now = butil::cpuwide_time_us();
+    int64_t next = _next_update_us.load(butil::memory_order_relaxed);
+    if (now >= next &&
+        _next_update_us.compare_exchange_strong(
+            next, now + UPDATE_INTERVAL_US, butil::memory_order_relaxed)) {
+        const int64_t latency_us =
+            _latency.latency_percentile(_options.percentile);
+        int32_t ms = -1;
+        if (latency_us > 0) {
+            // No latencies in the window yet otherwise.
+            ms = std::max((int64_t)_options.min_backup_request_ms,
+                          (latency_us + 999) / 1000);
+        }
+        _backup_request_ms.store(ms, butil::memory_order_relaxed);
+    }
+    return _backup_request_ms.load(butil::memory_order_relaxed);
+}
+
+bool LatencyPercentileBackupPolicy::DoBackup(const Controller*) const {
+    int64_t budget = _budget.load(butil::memory_order_relaxed);
+    while (budget >= BUDGET_UNIT) {
+        if (_budget.compare_exchange_weak(budget, budget - BUDGET_UNIT,
+                                          butil::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LatencyPercentileBackupPolicy::OnRPCEnd(const Controller* cntl) {
+    if (!cntl->Failed()) {
+        _latency << cntl->latency_us();
+    }
+    const int64_t inc = (int64_t)(_options.max_backup_ratio * BUDGET_UNIT);
+    const int64_t max_budget = _options.max_backup_burst * BUDGET_UNIT;
+    int64_t budget = _budget.load(butil::memory_order_relaxed);
+    while (budget < max_budget) {
+        if (_budget.compare_exchange_weak(
+                budget, std::min(budget + inc, max_budget),
+                butil::memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+} // namespace brpc
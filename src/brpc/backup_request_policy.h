@@ -0,0 +1,104 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_BACKUP_REQUEST_POLICY_H
+#define BRPC_BACKUP_REQUEST_POLICY_H
+
+#include <stdint.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "bvar/latency_recorder.h"
+
+namespace brpc {
+
+class Controller;
+
+// Inherit this class to customize when backup requests are sent, instead
+// of the fixed ChannelOptions.backup_request_ms.
+class BackupRequestPolicy {
+public:
+    virtual ~BackupRequestPolicy() {}
+
+    // Send a backup request if the RPC does not finish after so many
+    // milliseconds. Negative value means no backup request. Called before
+    // each RPC whose backup_request_ms is not set by the Controller.
+    virtual int32_t GetBackupRequestMs() const = 0;
+
+    // Called when the backup timer of `controller' fires, returns true to
+    // send the backup request, false to keep waiting for the ongoing call.
+    virtual bool DoBackup(const Controller* controller) const = 0;
+
+    // Called at the end of each RPC over the channel, for collecting latency
+    // or error information of RPCs.
+    virtual void OnRPCEnd(const Controller* controller) = 0;
+};
+
+struct LatencyPercentileBackupPolicyOptions {
+    LatencyPercentileBackupPolicyOptions();
+
+    // Send backup requests after this percentile of latencies of successful
+    // RPCs in last `window_size' seconds.
+    // Default: 0.95
+    double percentile;
+
+    // Backup requests are at most so many times of finished RPCs.
+    // Default: 0.05
+    double max_backup_ratio;
+
+    // Number of backup requests that can be sent in a burst before being
+    // limited by `max_backup_ratio'.
+    // Default: 10
+    int max_backup_burst;
+
+    // Seconds of latencies counted in the percentile.
+    // Default: 10
+    int window_size;
+
+    // Backup requests are not sent earlier than this.
+    // Default: 1
+    int32_t min_backup_request_ms;
+};
+
+// Send backup requests at a percentile of live latencies of the channel,
+// within a budget of extra requests. Pass the object as
+// ChannelOptions.backup_request_policy and make sure it outlives RPCs of
+// the channel. An object should not be shared by channels to different
+// services, which have different latencies.
+class LatencyPercentileBackupPolicy : public BackupRequestPolicy {
+public:
+    LatencyPercentileBackupPolicy();
+    explicit LatencyPercentileBackupPolicy(
+        const LatencyPercentileBackupPolicyOptions& options);
+
+    int32_t GetBackupRequestMs() const;
+    bool DoBackup(const Controller* controller) const;
+    void OnRPCEnd(const Controller* controller);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyPercentileBackupPolicy);
+
+    LatencyPercentileBackupPolicyOptions _options;
+    bvar::LatencyRecorder _latency;
+    // Percentiles are expensive to compute, cache it for a while.
+    mutable butil::atomic<int32_t> _backup_request_ms;
+    mutable butil::atomic<int64_t> _next_update_us;
+    // Budget of backup requests in thousandths: each finished RPC adds
+    // max_backup_ratio and each backup request takes one.
+    mutable butil::atomic<int64_t> _budget;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_BACKUP_REQUEST_POLICY_H
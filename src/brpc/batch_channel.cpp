@@ -0,0 +1,450 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <inttypes.h>
+#include <algorithm>                          // std::max
+#include <map>
+#include <gflags/gflags.h>
+#include "bthread/bthread.h"                  // bthread_id_xx
+#include "bthread/unstable.h"                 // bthread_timer_add
+#include "butil/time.h"
+#include "butil/scoped_lock.h"
+#include "butil/iobuf.h"
+#include "butil/string_printf.h"
+#include "butil/synchronization/lock.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/protocol.h"                    // SerializeRequestDefault
+#include "brpc/batch.pb.h"
+#include "brpc/batch_channel.h"
+
+namespace brpc {
+
+DECLARE_bool(usercode_in_pthread);
+
+BatchChannelOptions::BatchChannelOptions()
+    : max_delay_us(50)
+    , max_batch_size(64) {
+}
+
+struct BatchChannel::PendingCall {
+    Controller* cntl;
+    google::protobuf::Message* response;
+    google::protobuf::Closure* done;
+    CallId cid;
+    butil::IOBuf request;
+};
+
+class BatchChannel::BatchCall : public google::protobuf::Closure {
+public:
+    void Run() { BatchChannel::EndBatch(this); }
+
+    Controller cntl;
+    BatchRequest request;
+    BatchResponse response;
+    std::vector<PendingCall*> calls;
+};
+
+// Calls to one method waiting to be sent.
+class BatchChannel::Batcher {
+public:
+    Batcher(BatchChannel* owner,
+            const google::protobuf::MethodDescriptor* method)
+        : _owner(owner)
+        , _method(method)
+        , _nsending(0)
+        , _flush_scheduled(false)
+        , _timer_armed(false)
+        , _timer(0) {}
+
+    ~Batcher() {
+        // Wait for the scheduled flush and batches being sent which touch
+        // this batcher and the owner.
+        std::vector<PendingCall*> calls;
+        for (;;) {
+            {
+                BAIDU_SCOPED_LOCK(_mutex);
+                if (_flush_scheduled && _timer_armed &&
+                    bthread_timer_del(_timer) == 0) {
+                    _flush_scheduled = false;
+                }
+                if (!_flush_scheduled && _nsending == 0) {
+                    calls.swap(_pending);
+                    break;
+                }
+            }
+            bthread_usleep(1000);
+        }
+        // Calls whose flush was canceled above are never sent.
+        for (size_t i = 0; i < calls.size(); ++i) {
+            calls[i]->cntl->SetFailed(
+                ECANCELED, "BatchChannel=%p is destroyed", _owner);
+            BatchChannel::EndCall(calls[i], false);
+        }
+    }
+
+    void AddCall(PendingCall* call) {
+        std::vector<PendingCall*> calls;
+        bool start_bthread = false;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            _pending.push_back(call);
+            if ((int)_pending.size() >= _owner->_options.max_batch_size) {
+                calls.swap(_pending);
+                ++_nsending;
+            } else if (!_flush_scheduled) {
+                _flush_scheduled = true;
+                const int delay_us = _owner->_options.max_delay_us;
+                if (delay_us > 0) {
+                    _timer_armed = (bthread_timer_add(
+                            &_timer,
+                            butil::microseconds_from_now(delay_us),
+                            OnTimer, this) == 0);
+                }
+                start_bthread = !_timer_armed;
+            }
+        }
+        if (!calls.empty()) {
+            _owner->SendBatch(_method, &calls);
+            EndSending();
+        } else if (start_bthread) {
+            // Calls issued before the bthread runs are batched.
+            bthread_t th;
+            if (bthread_start_background(&th, NULL, Flush, this) != 0) {
+                LOG(FATAL) << "Fail to start bthread";
+                Flush(this);
+            }
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Batcher);
+
+    // Run in TimerThread, don't block.
+    static void OnTimer(void* arg) {
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, Flush, arg) != 0) {
+            LOG(FATAL) << "Fail to start bthread";
+            Flush(arg);
+        }
+    }
+
+    // Called after SendBatch() to let dtor go. Don't touch this batcher
+    // after the call.
+    void EndSending() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        --_nsending;
+    }
+
+    static void* Flush(void* arg) {
+        Batcher* b = static_cast<Batcher*>(arg);
+        std::vector<PendingCall*> calls;
+        {
+            BAIDU_SCOPED_LOCK(b->_mutex);
+            calls.swap(b->_pending);
+            b->_flush_scheduled = false;
+            b->_timer_armed = false;
+            if (calls.empty()) {
+                // NOTE: `b' may be destroyed after unlocking.
+                return NULL;
+            }
+            ++b->_nsending;
+        }
+        b->_owner->SendBatch(b->_method, &calls);
+        b->EndSending();
+        return NULL;
+    }
+
+    BatchChannel* const _owner;
+    const google::protobuf::MethodDescriptor* const _method;
+    butil::Mutex _mutex;
+    std::vector<PendingCall*> _pending;
+    // Number of batches taken from _pending and being sent.
+    int _nsending;
+    bool _flush_scheduled;
+    bool _timer_armed;
+    bthread_timer_t _timer;
+};
+
+struct BatchChannel::BatcherGroup {
+    typedef std::map<const google::protobuf::MethodDescriptor*, Batcher*>
+    BatcherMap;
+
+    static size_t AddBatcher(BatcherMap& bg,
+                             const google::protobuf::MethodDescriptor* method,
+                             Batcher* batcher) {
+        bg[method] = batcher;
+        return 1;
+    }
+
+    butil::DoublyBufferedData<BatcherMap> batchers;
+    butil::Mutex modify_mutex;
+};
+
+BatchChannel::BatchChannel()
+    : _chan(NULL)
+    , _ownership(DOESNT_OWN_CHANNEL)
+    , _batchers(new BatcherGroup) {
+}
+
+BatchChannel::~BatchChannel() {
+    {
+        butil::DoublyBufferedData<BatcherGroup::BatcherMap>::ScopedPtr ptr;
+        if (_batchers->batchers.Read(&ptr) == 0) {
+            for (BatcherGroup::BatcherMap::const_iterator it = ptr->begin();
+                 it != ptr->end(); ++it) {
+                delete it->second;
+            }
+        }
+    }
+    delete _batchers;
+    _batchers = NULL;
+    if (_ownership == OWNS_CHANNEL) {
+        delete _chan;
+    }
+    _chan = NULL;
+}
+
+int BatchChannel::Init(ChannelBase* sub_channel, ChannelOwnership ownership,
+                       const BatchChannelOptions* options) {
+    if (NULL == sub_channel) {
+        LOG(ERROR) << "Param[sub_channel] is NULL";
+        return -1;
+    }
+    if (_chan != NULL) {
+        LOG(ERROR) << "BatchChannel=" << this << " was initialized before";
+        return -1;
+    }
+    if (options) {
+        _options = *options;
+    }
+    if (_options.max_batch_size < 1) {
+        _options.max_batch_size = 1;
+    }
+    if (_options.max_delay_us < 0) {
+        _options.max_delay_us = 0;
+    }
+    _chan = sub_channel;
+    _ownership = ownership;
+    return 0;
+}
+
+BatchChannel::Batcher* BatchChannel::GetBatcher(
+    const google::protobuf::MethodDescriptor* method) {
+    typedef BatcherGroup::BatcherMap BatcherMap;
+    {
+        butil::DoublyBufferedData<BatcherMap>::ScopedPtr ptr;
+        if (_batchers->batchers.Read(&ptr) == 0) {
+            BatcherMap::const_iterator it = ptr->find(method);
+            if (it != ptr->end()) {
+                return it->second;
+            }
+        }
+    }
+    BAIDU_SCOPED_LOCK(_batchers->modify_mutex);
+    {
+        butil::DoublyBufferedData<BatcherMap>::ScopedPtr ptr;
+        if (_batchers->batchers.Read(&ptr) == 0) {
+            BatcherMap::const_iterator it = ptr->find(method);
+            if (it != ptr->end()) {
+                return it->second;
+            }
+        }
+    }
+    Batcher* batcher = new Batcher(this, method);
+    _batchers->batchers.Modify(BatcherGroup::AddBatcher, method, batcher);
+    return batcher;
+}
+
+void BatchChannel::CallMethod(
+    const google::protobuf::MethodDescriptor* method,
+    google::protobuf::RpcController* cntl_base,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    Controller* cntl = static_cast<Controller*>(cntl_base);
+    cntl->OnRPCBegin(butil::gettimeofday_us());
+    const CallId cid = cntl->call_id();
+    const int rc = bthread_id_lock(cid, NULL);
+    if (rc != 0) {
+        CHECK_EQ(EINVAL, rc);
+        if (!cntl->FailedInline()) {
+            cntl->SetFailed(EINVAL, "Fail to lock call_id=%" PRId64, cid.value);
+        }
+        LOG_IF(ERROR, cntl->is_used_by_rpc())
+            << "Controller=" << cntl << " was used by another RPC before. "
+            "Did you forget to Reset() it before reuse?";
+        // Have to run done in-place.
+        // Read comment in CallMethod() in channel.cpp for details.
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    cntl->set_used_by_rpc();
+
+    PendingCall* call = new PendingCall;
+    call->cntl = cntl;
+    call->response = response;
+    call->done = done;
+    call->cid = cid;
+    if (cntl->FailedInline()) {
+        // The call_id is cancelled before RPC.
+    } else if (_chan == NULL) {
+        cntl->SetFailed(EINVAL, "BatchChannel=%p is not initialized", this);
+    } else if (response == NULL) {
+        cntl->SetFailed(EINVAL, "response must be non-NULL");
+    } else if (!cntl->request_attachment().empty()) {
+        cntl->SetFailed(EREQUEST, "BatchChannel does not support attachments");
+    } else {
+        SerializeRequestDefault(&call->request, cntl, request);
+        if (!cntl->FailedInline()) {
+            GetBatcher(method)->AddCall(call);
+            // Don't touch `cntl' again for async RPC.
+            if (done == NULL) {
+                Join(cid);
+                cntl->OnRPCEnd(butil::gettimeofday_us());
+            }
+            return;
+        }
+    }
+    EndCall(call, cntl->is_done_allowed_to_run_in_place());
+}
+
+void BatchChannel::SendBatch(const google::protobuf::MethodDescriptor* method,
+                             std::vector<PendingCall*>* calls) {
+    BatchCall* bc = new BatchCall;
+    bc->calls.swap(*calls);
+    bc->request.set_method(method->full_name());
+    // Use the max timeout of the calls, or the timeout of the sub channel
+    // if any of the calls does not set timeout.
+    bool use_max_timeout = true;
+    int64_t max_timeout_ms = 0;
+    for (size_t i = 0; i < bc->calls.size(); ++i) {
+        PendingCall* call = bc->calls[i];
+        BatchRequestItem* item = bc->request.add_items();
+        item->set_request_size(call->request.size());
+        if (call->cntl->has_log_id()) {
+            item->set_log_id(call->cntl->log_id());
+        }
+        const int64_t timeout_ms = call->cntl->timeout_ms();
+        if (timeout_ms == UNSET_MAGIC_NUM) {
+            use_max_timeout = false;
+        } else if (max_timeout_ms >= 0) {
+            max_timeout_ms = (timeout_ms < 0 ? -1 :
+                              std::max(max_timeout_ms, timeout_ms));
+        }
+        bc->cntl.request_attachment().append(call->request);
+        call->request.clear();
+    }
+    if (use_max_timeout) {
+        bc->cntl.set_timeout_ms(max_timeout_ms);
+    }
+    batch_Stub stub(_chan);
+    stub.call(&bc->cntl, &bc->request, &bc->response, bc);
+}
+
+void BatchChannel::EndBatch(BatchCall* bc) {
+    const Controller& bcntl = bc->cntl;
+    const size_t ncall = bc->calls.size();
+    int error_code = bcntl.ErrorCode();
+    std::string error_text = bcntl.ErrorText();
+    if (error_code == 0 && (size_t)bc->response.items_size() != ncall) {
+        error_code = ERESPONSE;
+        butil::string_printf(&error_text, "Batch of %" PRIu64 " calls is "
+                             "responded with %d results", (uint64_t)ncall,
+                             bc->response.items_size());
+    }
+    butil::IOBuf& att = bc->cntl.response_attachment();
+    for (size_t i = 0; i < ncall; ++i) {
+        PendingCall* call = bc->calls[i];
+        Controller* cntl = call->cntl;
+        cntl->_remote_side = bcntl.remote_side();
+        cntl->_local_side = bcntl.local_side();
+        if (error_code != 0) {
+            cntl->SetFailed(error_code, "%s", error_text.c_str());
+        } else {
+            const BatchResponseItem& item = bc->response.items(i);
+            if (item.error_code() != 0) {
+                cntl->SetFailed(item.error_code(), "%s",
+                                item.error_text().c_str());
+            } else {
+                butil::IOBuf buf;
+                if (att.cutn(&buf, item.response_size()) !=
+                    item.response_size() ||
+                    !ParsePbFromIOBuf(call->response, buf)) {
+                    cntl->SetFailed(ERESPONSE, "Fail to parse response of "
+                                    "the batch");
+                }
+            }
+        }
+        // Run the last done in-place.
+        EndCall(call, i + 1 == ncall);
+    }
+    delete bc;
+}
+
+void BatchChannel::EndCall(PendingCall* call, bool run_done_in_place) {
+    if (call->done == NULL) {
+        // Wake up the caller blocking on Join().
+        const CallId cid = call->cid;
+        delete call;
+        CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+        return;
+    }
+    if (!run_done_in_place) {
+        bthread_t th;
+        bthread_attr_t attr = (FLAGS_usercode_in_pthread ?
+                               BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL);
+        if (bthread_start_background(&th, &attr, RunDone, call) == 0) {
+            return;
+        }
+        LOG(FATAL) << "Fail to start bthread";
+    }
+    RunDone(call);
+}
+
+void* BatchChannel::RunDone(void* arg) {
+    PendingCall* call = static_cast<PendingCall*>(arg);
+    Controller* cntl = call->cntl;
+    google::protobuf::Closure* done = call->done;
+    // Save call_id from the controller which may be deleted after Run().
+    const CallId cid = call->cid;
+    delete call;
+    cntl->OnRPCEnd(butil::gettimeofday_us());
+    done->Run();
+    CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+    return NULL;
+}
+
+int BatchChannel::Weight() {
+    return (_chan ? _chan->Weight() : 0);
+}
+
+int BatchChannel::CheckHealth() {
+    return (_chan ? _chan->CheckHealth() : -1);
+}
+
+void BatchChannel::Describe(std::ostream& os,
+                            const DescribeOptions& options) const {
+    os << "BatchChannel[max_delay_us=" << _options.max_delay_us
+       << " max_batch_size=" << _options.max_batch_size;
+    if (_chan) {
+        os << ' ';
+        _chan->Describe(os, options);
+    }
+    os << ']';
+}
+
+} // namespace brpc
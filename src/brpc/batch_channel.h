@@ -0,0 +1,108 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_BATCH_CHANNEL_H
+#define BRPC_BATCH_CHANNEL_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include <vector>
+#include "brpc/channel.h"
+
+namespace brpc {
+
+struct BatchChannelOptions {
+    // Constructed with default options.
+    BatchChannelOptions();
+
+    // Calls to a method within so many microseconds after the first one are
+    // sent together. If this value is 0, only calls issued before the batch
+    // is scheduled to be sent are batched.
+    // Default: 50
+    int max_delay_us;
+
+    // A batch is sent immediately when it has so many calls.
+    // Default: 64
+    int max_batch_size;
+};
+
+// Coalesces concurrent calls to the same method into one RPC of the sub
+// channel, so that overhead of each RPC (controller, correlation id, meta,
+// writing) is amortized by tiny calls. Servers must add BatchService in
+// brpc/batch_service.h to unpack the batches. The batch goes to one server
+// selected by the sub channel, as a result calls in one batch go to the
+// same server.
+// Notes:
+//  - The timeout of a batch is the max timeout of its calls, namely a call
+//    may end later than its timeout.
+//  - Canceling of batched calls is not supported.
+//  - Calls not sent yet when the channel is destroyed fail with ECANCELED.
+//  - Attachments are not supported.
+//  - Options of the sub channel (retries, backup requests, compression...)
+//    apply to the batches rather than calls.
+class BatchChannel : public ChannelBase {
+public:
+    BatchChannel();
+    ~BatchChannel();
+
+    // Send batches through `sub_channel'.
+    // If `ownership' is OWNS_CHANNEL, `sub_channel' is deleted in dtor.
+    // Returns 0 on success, -1 otherwise.
+    int Init(ChannelBase* sub_channel, ChannelOwnership ownership,
+             const BatchChannelOptions* options);
+
+    // Call `method' of the remote service with `request' as input, and
+    // `response' as output. `controller' contains options and extra data.
+    // If `done' is not NULL, this method returns after the call was put
+    // into a batch and `done->Run()' will be called when the call
+    // finishes, otherwise caller blocks until the call finishes.
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    int Weight();
+
+    int CheckHealth();
+
+    void Describe(std::ostream& os, const DescribeOptions&) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BatchChannel);
+
+    struct PendingCall;
+    class BatchCall;
+    class Batcher;
+    struct BatcherGroup;
+    Batcher* GetBatcher(const google::protobuf::MethodDescriptor* method);
+    void SendBatch(const google::protobuf::MethodDescriptor* method,
+                   std::vector<PendingCall*>* calls);
+    static void EndBatch(BatchCall* bc);
+    static void EndCall(PendingCall* call, bool run_done_in_place);
+    static void* RunDone(void* arg);
+
+    ChannelBase* _chan;
+    ChannelOwnership _ownership;
+    BatchChannelOptions _options;
+    // Batchers are created at first calls to methods and never removed
+    // before dtor.
+    BatcherGroup* _batchers;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_BATCH_CHANNEL_H
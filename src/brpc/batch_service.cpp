@@ -0,0 +1,203 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "butil/time.h"
+#include "butil/iobuf.h"
+#include "brpc/closure_guard.h"
+#include "brpc/server.h"
+#include "brpc/protocol.h"                    // ParsePbFromIOBuf
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/server_private_accessor.h"
+#include "brpc/batch_service.h"
+
+namespace brpc {
+
+namespace {
+
+// Calls unpacked from a batch, the batch is responded after all of them
+// are done.
+class UnpackedCalls {
+public:
+    struct Call : public google::protobuf::Closure {
+        void Run();
+
+        UnpackedCalls* owner;
+        const Server::MethodProperty* mp;
+        Controller* cntl;
+        google::protobuf::Message* request;
+        google::protobuf::Message* response;
+        int64_t start_us;
+        // MethodStatus::OnRequested() was called.
+        bool requested;
+        int error_code;
+        std::string error_text;
+        butil::IOBuf response_buf;
+    };
+
+    UnpackedCalls(int ncall, Controller* cntl, BatchResponse* response,
+                  google::protobuf::Closure* done)
+        : _calls(ncall)
+        , _nleft(ncall)
+        , _cntl(cntl)
+        , _response(response)
+        , _done(done) {}
+
+    Call* call(int i) { return &_calls[i]; }
+
+    void OnCallDone() {
+        if (_nleft.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            Finish();
+        }
+    }
+
+private:
+    void Finish() {
+        butil::IOBuf& att = _cntl->response_attachment();
+        for (size_t i = 0; i < _calls.size(); ++i) {
+            Call& c = _calls[i];
+            BatchResponseItem* item = _response->add_items();
+            if (c.error_code != 0) {
+                item->set_error_code(c.error_code);
+                item->set_error_text(c.error_text);
+            } else {
+                item->set_response_size(c.response_buf.size());
+                att.append(c.response_buf);
+            }
+        }
+        google::protobuf::Closure* done = _done;
+        delete this;
+        done->Run();
+    }
+
+    std::vector<Call> _calls;
+    butil::atomic<int> _nleft;
+    Controller* _cntl;
+    BatchResponse* _response;
+    google::protobuf::Closure* _done;
+};
+
+void UnpackedCalls::Call::Run() {
+    if (requested) {
+        mp->status->OnResponded(!cntl->Failed(),
+                                butil::cpuwide_time_us() - start_us);
+    }
+    if (cntl->Failed()) {
+        error_code = cntl->ErrorCode();
+        error_text = cntl->ErrorText();
+    } else if (!response->IsInitialized()) {
+        error_code = ERESPONSE;
+        error_text = "Missing required fields in response: " +
+            response->InitializationErrorString();
+    } else {
+        butil::IOBufAsZeroCopyOutputStream wrapper(&response_buf);
+        if (!response->SerializeToZeroCopyStream(&wrapper)) {
+            response_buf.clear();
+            error_code = ERESPONSE;
+            error_text = "Fail to serialize response";
+        }
+    }
+    LogErrorTextAndDelete()(cntl);
+    cntl = NULL;
+    delete request;
+    request = NULL;
+    delete response;
+    response = NULL;
+    owner->OnCallDone();
+}
+
+} // namespace
+
+void BatchService::call(::google::protobuf::RpcController* cntl_base,
+                        const BatchRequest* request,
+                        BatchResponse* response,
+                        ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller* cntl = static_cast<Controller*>(cntl_base);
+    const int ncall = request->items_size();
+    if (ncall == 0) {
+        return;
+    }
+    const Server::MethodProperty* mp = NULL;
+    if (cntl->server() != NULL) {
+        mp = ServerPrivateAccessor(cntl->server())
+            .FindMethodPropertyByFullName(request->method());
+    }
+    if (mp == NULL) {
+        cntl->SetFailed(ENOMETHOD, "Fail to find method=%s",
+                        request->method().c_str());
+        return;
+    }
+    if (mp->is_builtin_service ||
+        mp->service->GetDescriptor() == batch::descriptor()) {
+        cntl->SetFailed(EPERM, "Not allowed to batch calls to method=%s",
+                        request->method().c_str());
+        return;
+    }
+    google::protobuf::Service* svc = mp->service;
+    const google::protobuf::MethodDescriptor* method = mp->method;
+    butil::IOBuf& att = cntl->request_attachment();
+    UnpackedCalls* calls = new UnpackedCalls(ncall, cntl, response,
+                                             done_guard.release());
+    for (int i = 0; i < ncall; ++i) {
+        const BatchRequestItem& item = request->items(i);
+        UnpackedCalls::Call* c = calls->call(i);
+        c->owner = calls;
+        c->mp = mp;
+        c->start_us = butil::cpuwide_time_us();
+        c->requested = false;
+        c->error_code = 0;
+        c->request = svc->GetRequestPrototype(method).New();
+        c->response = svc->GetResponsePrototype(method).New();
+        c->cntl = NewServerController();
+        ControllerPrivateAccessor accessor(c->cntl);
+        accessor.set_server(cntl->server())
+            .set_security_mode(cntl->is_security_mode())
+            .set_remote_side(cntl->remote_side())
+            .set_local_side(cntl->local_side())
+            .set_auth_context(cntl->auth_context())
+            .set_request_protocol(cntl->request_protocol());
+        accessor.set_method(method);
+        if (item.has_log_id()) {
+            c->cntl->set_log_id(item.log_id());
+        }
+        butil::IOBuf req_buf;
+        if (att.cutn(&req_buf, item.request_size()) != item.request_size()) {
+            c->cntl->SetFailed(EREQUEST, "request_size=%u of call[%d] is "
+                               "larger than the left attachment",
+                               item.request_size(), i);
+            c->Run();
+            continue;
+        }
+        if (!ParsePbFromIOBuf(c->request, req_buf)) {
+            c->cntl->SetFailed(EREQUEST, "Fail to parse request of call[%d]",
+                               i);
+            c->Run();
+            continue;
+        }
+        if (mp->status) {
+            c->requested = true;
+            if (!mp->status->OnRequested()) {
+                c->cntl->SetFailed(ELIMIT, "Reached %s's max_concurrency=%d",
+                                   method->full_name().c_str(),
+                                   mp->status->MaxConcurrency());
+                c->Run();
+                continue;
+            }
+        }
+        svc->CallMethod(method, c->cntl, c->request, c->response, c);
+    }
+}
+
+} // namespace brpc
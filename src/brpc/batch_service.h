@@ -0,0 +1,38 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_BATCH_SERVICE_H
+#define BRPC_BATCH_SERVICE_H
+
+#include "brpc/batch.pb.h"
+
+namespace brpc {
+
+// Add this service to servers to process batches from BatchChannel:
+//   server.AddService(new brpc::BatchService, brpc::SERVER_OWNS_SERVICE);
+// Calls in a batch are dispatched to their methods one by one as if they
+// were sent individually, and the batch is responded after all of them
+// are done. Concurrency limits and stats of the methods are effective.
+class BatchService : public batch {
+public:
+    void call(::google::protobuf::RpcController* controller,
+              const BatchRequest* request,
+              BatchResponse* response,
+              ::google::protobuf::Closure* done);
+};
+
+} // namespace brpc
+
+#endif  // BRPC_BATCH_SERVICE_H
@@ -16,6 +16,7 @@
 
 #include <ostream>
 #include <iomanip>
+#include <algorithm>                   // std::partial_sort
 #include <netinet/tcp.h>
 #include <gflags/gflags.h>
 #include "brpc/closure_guard.h"        // ClosureGuard
@@ -104,6 +105,46 @@ static std::string BriefName(const std::string& cname) {
     return tmp;
 }
 
+const char* ConnectionsService::ProtocolName(
+    Socket* ptr, const Server* server, std::string* nshead_service_name,
+    SocketUniquePtr* first_sub) const {
+    // Get name of the protocol. In principle we can dynamic_cast the
+    // socket user to InputMessenger but I'm not sure if that's a bit
+    // slow (because we have many connections here).
+    int pref_index = ptr->preferred_index();
+    if (pref_index < 0) {
+        // Check preferred_index of any pooled sockets.
+        std::vector<SocketId> first_id;
+        ptr->ListPooledSockets(&first_id, 1);
+        if (!first_id.empty()) {
+            if (Socket::Address(first_id[0], first_sub) == 0) {
+                pref_index = (*first_sub)->preferred_index();
+            }
+        }
+    }
+    const char* pref_prot = "-";
+    if (ptr->user() == server->_am) {
+        pref_prot = server->_am->NameOfProtocol(pref_index);
+        // Special treatment for nshead services. Notice that
+        // pref_index is comparable to ProtocolType after r31951
+        if (pref_index == (int)PROTOCOL_NSHEAD &&
+            server->options().nshead_service != NULL) {
+            if (nshead_service_name->empty()) {
+                *nshead_service_name = BriefName(butil::class_name_str(
+                        *server->options().nshead_service));
+            }
+            pref_prot = nshead_service_name->c_str();
+        }
+    } else if (ptr->CreatedByConnect()) {
+        pref_prot = get_client_side_messenger()->NameOfProtocol(pref_index);
+    }
+    if (strcmp(pref_prot, "unknown") == 0) {
+        // Show unknown protocol as - to be consistent with other columns.
+        pref_prot = "-";
+    }
+    return pref_prot;
+}
+
 void ConnectionsService::PrintConnections(
     std::ostream& os, const std::vector<SocketId>& conns,
     bool use_html, const Server* server, bool need_local) const {
@@ -129,6 +170,7 @@ void ConnectionsService::PrintConnections(
             "<th>OutBytes/m</th>"
             "<th>Out/m</th>"
             "<th>Rtt/Var(ms)</th>"
+            "<th>Memory</th>"
             "<th>SocketId</th>"
             "</tr>\n";
     } else {
@@ -139,13 +181,12 @@ void ConnectionsService::PrintConnections(
         os << "SSL|Protocol |fd   |"
             "InBytes/s|In/s  |InBytes/m |In/m    |"
             "OutBytes/s|Out/s |OutBytes/m|Out/m   |"
-            "Rtt/Var(ms)|SocketId\n";
+            "Rtt/Var(ms)|Memory|SocketId\n";
     }
 
     const char* const bar = (use_html ? "</td><td>" : "|");
     SocketStat stat;
     std::string nshead_service_name; // shared in following for iterations.
-    std::vector<SocketId> first_id;
     for (size_t i = 0; i < conns.size(); ++i) {
         const SocketId socket_id = conns[i];
         SocketUniquePtr ptr;
@@ -183,42 +224,12 @@ void ConnectionsService::PrintConnections(
                << min_width("-", 6) << bar
                << min_width("-", 10) << bar
                << min_width("-", 8) << bar
-               << min_width("-", 11) << bar;
+               << min_width("-", 11) << bar
+               << min_width("-", 6) << bar;
         } else {
-            // Get name of the protocol. In principle we can dynamic_cast the
-            // socket user to InputMessenger but I'm not sure if that's a bit
-            // slow (because we have many connections here).
-            int pref_index = ptr->preferred_index();
             SocketUniquePtr first_sub;
-            if (pref_index < 0) {
-                // Check preferred_index of any pooled sockets.
-                ptr->ListPooledSockets(&first_id, 1);
-                if (!first_id.empty()) {
-                    if (Socket::Address(first_id[0], &first_sub) == 0) {
-                        pref_index = first_sub->preferred_index();
-                    }
-                }
-            }
-            const char* pref_prot = "-";
-            if (ptr->user() == server->_am) {
-                pref_prot = server->_am->NameOfProtocol(pref_index);
-                // Special treatment for nshead services. Notice that
-                // pref_index is comparable to ProtocolType after r31951
-                if (pref_index == (int)PROTOCOL_NSHEAD &&
-                    server->options().nshead_service != NULL) {
-                    if (nshead_service_name.empty()) {
-                        nshead_service_name = BriefName(butil::class_name_str(
-                                *server->options().nshead_service));
-                    }
-                    pref_prot = nshead_service_name.c_str();
-                }
-            } else if (ptr->CreatedByConnect()) {
-                pref_prot = get_client_side_messenger()->NameOfProtocol(pref_index);
-            }
-            if (strcmp(pref_prot, "unknown") == 0) {
-                // Show unknown protocol as - to be consistent with other columns.
-                pref_prot = "-";
-            }
+            const char* pref_prot = ProtocolName(
+                ptr.get(), server, &nshead_service_name, &first_sub);
             ptr->GetStat(&stat);
             PrintRealDateTime(os, ptr->_reset_fd_real_us);
             int rttfd = ptr->fd();
@@ -273,7 +284,8 @@ void ConnectionsService::PrintConnections(
                << min_width(stat.out_num_messages_s, 6) << bar
                << min_width(stat.out_size_m, 10) << bar
                << min_width(stat.out_num_messages_m, 8) << bar
-               << min_width(rtt_display, 11) << bar;
+               << min_width(rtt_display, 11) << bar
+               << min_width(ptr->MemoryUsage(), 6) << bar;
         }
 
         if (use_html) {
@@ -367,6 +379,204 @@ void ConnectionsService::default_method(
     cntl->set_response_compress_type(COMPRESS_TYPE_GZIP);
 }
 
+// Fields of a connection needed by filtering and sorting, converted to
+// ConnectionInfo only when the connection is on the requested page.
+struct ListedConnection {
+    SocketId socket_id;
+    butil::EndPoint remote_side;
+    int local_port;
+    int fd;
+    const char* protocol;
+    bool ssl;
+    bool server_side;
+    bool broken;
+    int64_t created_time_us;
+    SocketStat stat;
+    int64_t unwritten_bytes;
+};
+
+struct MoreBytes {
+    bool operator()(const ListedConnection& c1,
+                    const ListedConnection& c2) const {
+        return c1.stat.in_size_m + c1.stat.out_size_m >
+            c2.stat.in_size_m + c2.stat.out_size_m;
+    }
+};
+
+struct MoreUnwrittenBytes {
+    bool operator()(const ListedConnection& c1,
+                    const ListedConnection& c2) const {
+        return c1.unwritten_bytes > c2.unwritten_bytes;
+    }
+};
+
+struct Older {
+    bool operator()(const ListedConnection& c1,
+                    const ListedConnection& c2) const {
+        return c1.created_time_us < c2.created_time_us;
+    }
+};
+
+// Overwrite fields of `req' with same-named queries so that the method can
+// be accessed by curl or browsers without a body.
+static int MergeQueries(const URI& uri, ConnectionListRequest* req) {
+    const std::string* val = uri.GetQuery("sort_by");
+    if (val) {
+        req->set_sort_by(*val);
+    }
+    const char* const uint_names[] = { "offset", "limit" };
+    for (size_t i = 0; i < arraysize(uint_names); ++i) {
+        val = uri.GetQuery(uint_names[i]);
+        if (val == NULL) {
+            continue;
+        }
+        char* endptr = NULL;
+        const unsigned long n = strtoul(val->c_str(), &endptr, 10);
+        if (val->empty() || *endptr != '\0' ||
+            n > std::numeric_limits<uint32_t>::max()) {
+            return -1;
+        }
+        if (i == 0) {
+            req->set_offset(n);
+        } else {
+            req->set_limit(n);
+        }
+    }
+    if ((val = uri.GetQuery("remote_side")) != NULL) {
+        req->set_remote_side(*val);
+    }
+    if ((val = uri.GetQuery("protocol")) != NULL) {
+        req->set_protocol(*val);
+    }
+    if ((val = uri.GetQuery("side")) != NULL) {
+        req->set_side(*val);
+    }
+    return 0;
+}
+
+void ConnectionsService::list(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::ConnectionListRequest* request,
+    ::brpc::ConnectionListResponse* response,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    const Server* server = cntl->server();
+    ConnectionListRequest req(*request);
+    if (MergeQueries(cntl->http_request().uri(), &req) != 0) {
+        cntl->SetFailed(EINVAL, "Invalid offset or limit");
+        return;
+    }
+    if (req.has_side() && req.side() != "server" && req.side() != "channel") {
+        cntl->SetFailed(EINVAL, "Unknown side=%s", req.side().c_str());
+        return;
+    }
+    if (req.has_sort_by() && req.sort_by() != "bytes" &&
+        req.sort_by() != "unwritten_bytes" && req.sort_by() != "age") {
+        cntl->SetFailed(EINVAL, "Unknown sort_by=%s", req.sort_by().c_str());
+        return;
+    }
+
+    // Only ids are copied from the acceptors and the SocketMap, which is
+    // cheap even with lots of connections.
+    std::vector<SocketId> conns;
+    size_t nserver_side = 0;
+    if (req.side() != "channel") {
+        const size_t max_listed = std::numeric_limits<size_t>::max();
+        server->_am->ListConnections(&conns, max_listed);
+        if (server->_internal_am) {
+            std::vector<SocketId> internal_conns;
+            server->_internal_am->ListConnections(&internal_conns, max_listed);
+            conns.insert(conns.end(), internal_conns.begin(),
+                         internal_conns.end());
+        }
+        nserver_side = conns.size();
+    }
+    if (req.side() != "server") {
+        std::vector<SocketId> channel_conns;
+        SocketMapList(&channel_conns);
+        conns.insert(conns.end(), channel_conns.begin(), channel_conns.end());
+    }
+
+    std::vector<ListedConnection> listed;
+    listed.reserve(conns.size());
+    std::string nshead_service_name;
+    for (size_t i = 0; i < conns.size(); ++i) {
+        SocketUniquePtr ptr;
+        bool broken = false;
+        if (Socket::Address(conns[i], &ptr) != 0) {
+            if (Socket::AddressFailedAsWell(conns[i], &ptr) <= 0 ||
+                ptr->_health_check_interval_s <= 0) {
+                // Recycled or will soon be destroyed.
+                continue;
+            }
+            broken = true;
+        }
+        ListedConnection c;
+        c.remote_side = ptr->remote_side();
+        if (!req.remote_side().empty()) {
+            const std::string remote_str = butil::endpoint2str(c.remote_side).c_str();
+            if (remote_str.compare(0, req.remote_side().size(),
+                                   req.remote_side()) != 0) {
+                continue;
+            }
+        }
+        SocketUniquePtr first_sub;
+        c.protocol = (broken ? "-" : ProtocolName(
+                          ptr.get(), server, &nshead_service_name, &first_sub));
+        if (!req.protocol().empty() && req.protocol() != c.protocol) {
+            continue;
+        }
+        c.socket_id = conns[i];
+        c.local_port = ptr->local_side().port;
+        c.fd = ptr->fd();
+        c.ssl = (ptr->ssl_state() == SSL_CONNECTING ||
+                 ptr->ssl_state() == SSL_CONNECTED);
+        c.server_side = (i < nserver_side);
+        c.broken = broken;
+        c.created_time_us = ptr->_reset_fd_real_us;
+        ptr->GetStat(&c.stat);
+        c.unwritten_bytes = ptr->_unwritten_bytes.load(butil::memory_order_relaxed);
+        listed.push_back(c);
+    }
+
+    // Sort the connections before the end of the page only.
+    const size_t limit = std::min<size_t>(
+        (req.has_limit() ? req.limit() : FLAGS_max_shown_connections),
+        std::max(FLAGS_max_shown_connections, 0));
+    const size_t begin = std::min<size_t>(req.offset(), listed.size());
+    const size_t end = std::min(begin + limit, listed.size());
+    if (req.sort_by() == "bytes") {
+        std::partial_sort(listed.begin(), listed.begin() + end, listed.end(),
+                          MoreBytes());
+    } else if (req.sort_by() == "unwritten_bytes") {
+        std::partial_sort(listed.begin(), listed.begin() + end, listed.end(),
+                          MoreUnwrittenBytes());
+    } else if (req.sort_by() == "age") {
+        std::partial_sort(listed.begin(), listed.begin() + end, listed.end(),
+                          Older());
+    }
+    response->set_total(listed.size());
+    for (size_t i = begin; i < end; ++i) {
+        const ListedConnection& c = listed[i];
+        ConnectionInfo* info = response->add_connection();
+        info->set_socket_id(c.socket_id);
+        info->set_remote_side(butil::endpoint2str(c.remote_side).c_str());
+        info->set_local_port(c.local_port);
+        info->set_fd(c.fd);
+        info->set_protocol(c.protocol);
+        info->set_ssl(c.ssl);
+        info->set_server_side(c.server_side);
+        info->set_broken(c.broken);
+        info->set_created_time_us(c.created_time_us);
+        info->set_in_bytes_m(c.stat.in_size_m);
+        info->set_in_messages_m(c.stat.in_num_messages_m);
+        info->set_out_bytes_m(c.stat.out_size_m);
+        info->set_out_messages_m(c.stat.out_num_messages_m);
+        info->set_unwritten_bytes(c.unwritten_bytes);
+    }
+}
+
 void ConnectionsService::GetTabInfo(TabInfoList* info_list) const {
     TabInfo* info = info_list->add();
     info->path = "/connections";
@@ -32,11 +32,24 @@ public:
                         ::brpc::ConnectionsResponse* response,
                         ::google::protobuf::Closure* done);
 
+    // Paginated and sorted connections in protobuf or json, for programs
+    // watching servers with lots of connections.
+    void list(::google::protobuf::RpcController* cntl_base,
+              const ::brpc::ConnectionListRequest* request,
+              ::brpc::ConnectionListResponse* response,
+              ::google::protobuf::Closure* done);
+
     void GetTabInfo(TabInfoList* info_list) const;
     
 private:
     void PrintConnections(std::ostream& os, const std::vector<SocketId>& conns,
                           bool use_html, const Server*, bool need_local) const;
+
+    // Name of the protocol used by the connection. `first_sub' is set to the
+    // first pooled socket if the protocol is got from it.
+    const char* ProtocolName(Socket* ptr, const Server* server,
+                             std::string* nshead_service_name,
+                             SocketUniquePtr* first_sub) const;
 };
 
 } // namespace brpc
@@ -55,6 +55,10 @@ void DirService::default_method(::google::protobuf::RpcController* cntl_base,
         butil::make_non_blocking(fd);
         butil::make_close_on_exec(fd);
 
+        // Read rather than mapping the file with IOBuf::append_mapped_file:
+        // files under /dir are often logs truncated by rotations, which
+        // would raise SIGBUS when the mapped pages are written into the
+        // socket.
         butil::IOPortal read_portal;
         size_t total_read = 0;
         do {
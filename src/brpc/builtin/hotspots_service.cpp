@@ -15,11 +15,15 @@
 // Authors: Ge,Jun (gejun@baidu.com)
 
 #include <stdio.h>
+#include <algorithm>
+#include <map>
 #include <gflags/gflags.h>
+#include <google/protobuf/descriptor.h>
 #include "butil/files/file_enumerator.h"
 #include "butil/file_util.h"                     // butil::FilePath
 #include "butil/popen.h"                         // butil::read_command_output
 #include "butil/fd_guard.h"                      // butil::fd_guard
+#include "butil/third_party/symbolize/symbolize.h"  // google::Symbolize
 #include "brpc/log.h"
 #include "brpc/controller.h"
 #include "brpc/server.h"
@@ -27,6 +31,7 @@
 #include "brpc/builtin/pprof_perl.h"
 #include "brpc/builtin/hotspots_service.h"
 #include "brpc/details/tcmalloc_extension.h"
+#include "brpc/details/continuous_profiler.h"
 
 extern "C" {
 int __attribute__((weak)) ProfilerStart(const char* fname);
@@ -36,6 +41,8 @@ void __attribute__((weak)) ProfilerStop();
 namespace bthread {
 bool ContentionProfilerStart(const char* filename);
 void ContentionProfilerStop();
+bool OffCpuProfilerStart(const char* filename);
+void OffCpuProfilerStop();
 }
 
 
@@ -88,7 +95,8 @@ struct ProfilingEnvironment {
 };
 
 // Different ProfilingType have different env.
-static ProfilingEnvironment g_env[4] = {
+static ProfilingEnvironment g_env[5] = {
+    { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
@@ -150,6 +158,19 @@ static bool WriteSmallFile(const char* filepath_in,
     return true;
 }
 
+// cpu, contention and offcpu profilers take samples for some seconds while
+// memory profilers dump snapshots.
+static bool IsProfiledForSeconds(ProfilingType type) {
+    return type == PROFILING_CPU || type == PROFILING_CONTENTION ||
+        type == PROFILING_OFFCPU;
+}
+
+// Profiles of offcpu are written in the format of contention, whose counts
+// can be shown instead of durations.
+static bool IsContentionFormat(ProfilingType type) {
+    return type == PROFILING_CONTENTION || type == PROFILING_OFFCPU;
+}
+
 static int ReadSeconds(const Controller* cntl) {
     int seconds = DEFAULT_PROFILING_SECONDS;
     const std::string* param =
@@ -551,7 +572,7 @@ static void DoProfiling(ProfilingType type,
     }
 
     const int seconds = ReadSeconds(cntl);
-    if ((type == PROFILING_CPU || type == PROFILING_CONTENTION)) {
+    if (IsProfiledForSeconds(type)) {
         if (seconds < 0) {
             os << "Invalid seconds" << (use_html ? "</body></html>" : "\n");
             os.move_to(cntl->response_attachment());
@@ -569,7 +590,7 @@ static void DoProfiling(ProfilingType type,
         client_info << "(no auth)";
     }
     client_info << " requests for profiling " << ProfilingType2String(type);
-    if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+    if (IsProfiledForSeconds(type)) {
         LOG(INFO) << client_info.str() << " for " << seconds << " seconds";
     } else {
         LOG(INFO) << client_info.str();
@@ -683,6 +704,18 @@ static void DoProfiling(ProfilingType type,
             PLOG(WARNING) << "Profiling has been interrupted";
         }
         bthread::ContentionProfilerStop();
+    } else if (type == PROFILING_OFFCPU) {
+        if (!bthread::OffCpuProfilerStart(prof_name)) {
+            os << "Another profiler (not via /hotspots/offcpu) is running, "
+                "try again later" << (use_html ? "</body></html>" : "\n");
+            os.move_to(resp);
+            cntl->http_response().set_status_code(HTTP_STATUS_SERVICE_UNAVAILABLE);
+            return NotifyWaiters(type, cntl, view);
+        }
+        if (bthread_usleep(seconds * 1000000L) != 0) {
+            PLOG(WARNING) << "Profiling has been interrupted";
+        }
+        bthread::OffCpuProfilerStop();
     } else if (type == PROFILING_HEAP) {
         MallocExtension* malloc_ext = MallocExtension::instance();
         if (malloc_ext == NULL || !has_TCMALLOC_SAMPLE_PARAMETER()) {
@@ -757,7 +790,7 @@ static void StartProfiling(ProfilingType type,
 
     if (type == PROFILING_CPU) {
         enabled = cpu_profiler_enabled;
-    } else if (type == PROFILING_CONTENTION) {
+    } else if (type == PROFILING_CONTENTION || type == PROFILING_OFFCPU) {
         enabled = true;
     } else if (type == PROFILING_HEAP) {
         enabled = IsHeapProfilerEnabled();
@@ -822,7 +855,7 @@ static void StartProfiling(ProfilingType type,
         "  var past_prof = document.getElementById('view_prof').value;\n"
         "  var base_prof = document.getElementById('base_prof').value;\n"
         "  var use_text = document.getElementById('text_cb').checked;\n";
-    if (type == PROFILING_CONTENTION) {
+    if (IsContentionFormat(type)) {
         os << "  var show_ccount = document.getElementById('ccount_cb').checked;\n";
     }
     os << "  var targetURL = '/hotspots/" << type_str << "';\n"
@@ -854,7 +887,7 @@ static void StartProfiling(ProfilingType type,
         "    }\n"
         "    targetURL += 'text';\n"
         "  }\n";
-    if (type == PROFILING_CONTENTION) {
+    if (IsContentionFormat(type)) {
         os <<
         "  if (show_ccount) {\n"
         "    if (first) {\n"
@@ -912,7 +945,7 @@ static void StartProfiling(ProfilingType type,
         "  }\n"
         "  $.ajax({\n"
         "    url: \"/hotspots/" << type_str << "_non_responsive?console=1";
-    if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+    if (IsProfiledForSeconds(type)) {
         os << "&seconds=" << seconds;
     }
     if (profiling_client.id != 0) {
@@ -1006,7 +1039,7 @@ static void StartProfiling(ProfilingType type,
         "<input id='text_cb' type='checkbox'"
        << (use_text ? " checked=''" : "") <<
         " onclick='onChangedCB(this);'>text</label>";
-    if (type == PROFILING_CONTENTION) {
+    if (IsContentionFormat(type)) {
         os << "&nbsp;&nbsp;&nbsp;<label for='ccount_cb'>"
             "<input id='ccount_cb' type='checkbox'"
            << (show_ccount ? " checked=''" : "") <<
@@ -1036,7 +1069,7 @@ static void StartProfiling(ProfilingType type,
         return;
     }
 
-    if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) && view == NULL) {
+    if (IsProfiledForSeconds(type) && view == NULL) {
         if (seconds < 0) {
             os << "Invalid seconds</body></html>";
             os.move_to(cntl->response_attachment());
@@ -1060,11 +1093,11 @@ static void StartProfiling(ProfilingType type,
                       / 1000000.0);
         os << "Your request is merged with the request from "
            << profiling_client.point;
-        if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+        if (IsProfiledForSeconds(type)) {
             os << ", showing in about " << wait_seconds << " seconds ...";
         }
     } else {
-        if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) && view == NULL) {
+        if (IsProfiledForSeconds(type) && view == NULL) {
             os << "Profiling " << ProfilingType2String(type) << " for "
                << seconds << " seconds ...";
         } else {
@@ -1114,6 +1147,14 @@ void HotspotsService::contention(
     return StartProfiling(PROFILING_CONTENTION, cntl_base, done);
 }
 
+void HotspotsService::offcpu(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    return StartProfiling(PROFILING_OFFCPU, cntl_base, done);
+}
+
 void HotspotsService::cpu_non_responsive(
     ::google::protobuf::RpcController* cntl_base,
     const ::brpc::HotspotsRequest*,
@@ -1146,6 +1187,216 @@ void HotspotsService::contention_non_responsive(
     return DoProfiling(PROFILING_CONTENTION, cntl_base, done);
 }
 
+void HotspotsService::offcpu_non_responsive(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    return DoProfiling(PROFILING_OFFCPU, cntl_base, done);
+}
+
+// Symbols of return addresses are cached since symbolizing is slow and
+// the stacks sampled by the continuous profiler rarely change.
+static pthread_mutex_t s_symbol_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<void*, std::string>* s_symbols = NULL;
+
+static std::string SymbolizeFrame(void* pc) {
+    BAIDU_SCOPED_LOCK(s_symbol_mutex);
+    if (s_symbols == NULL) {
+        s_symbols = new std::map<void*, std::string>;
+    }
+    std::string& name = (*s_symbols)[pc];
+    if (name.empty()) {
+        char buf[512];
+        // Subtract by one since a return address may be in the next
+        // function when the call is the last instruction.
+        if (google::Symbolize((char*)pc - 1, buf, sizeof(buf))) {
+            name = buf;
+        } else {
+            snprintf(buf, sizeof(buf), "%p", pc);
+            name = buf;
+        }
+        // ';' separates frames in folded stacks.
+        std::replace(name.begin(), name.end(), ';', ':');
+    }
+    return name;
+}
+
+struct FlameNode {
+    FlameNode() : count(0) {}
+    ~FlameNode() {
+        for (std::map<std::string, FlameNode*>::iterator
+                 it = children.begin(); it != children.end(); ++it) {
+            delete it->second;
+        }
+    }
+    FlameNode* child(const std::string& name) {
+        FlameNode*& c = children[name];
+        if (c == NULL) {
+            c = new FlameNode;
+        }
+        return c;
+    }
+    int64_t count;
+    std::map<std::string, FlameNode*> children;
+};
+
+// Callers are on top of callees, frames taking less than 0.2% of all
+// samples are omitted.
+static void PrintFlameNode(std::ostream& os, const std::string& name,
+                           const FlameNode& node, int64_t parent_count,
+                           int64_t total) {
+    std::string escaped;
+    WebEscape(name, &escaped);
+    // A function has the same color everywhere.
+    uint32_t hash = 0;
+    for (size_t i = 0; i < name.size(); ++i) {
+        hash = hash * 31 + (unsigned char)name[i];
+    }
+    os << "<div class=\"fn\" style=\"width:"
+       << node.count * 100.0 / parent_count << "%\">"
+       << "<div class=\"fl\" style=\"background:hsl(" << hash % 50
+       << ",80%," << 55 + hash % 20 << "%)\" title=\"" << escaped << ' '
+       << node.count << " samples("
+       << node.count * 100.0 / total << "%)\">" << escaped << "</div>";
+    for (std::map<std::string, FlameNode*>::const_iterator
+             it = node.children.begin(); it != node.children.end(); ++it) {
+        if (it->second->count * 500 >= total) {
+            PrintFlameNode(os, it->first, *it->second, node.count, total);
+        }
+    }
+    os << "</div>";
+}
+
+void HotspotsService::continuous(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    const bool use_html = UseHTML(cntl->http_request());
+    butil::IOBufBuilder os;
+    int minutes = 60;
+    const std::string* param =
+        cntl->http_request().uri().GetQuery("minutes");
+    if (param) {
+        minutes = strtol(param->c_str(), NULL, 10);
+    }
+    minutes = std::max(1, std::min(minutes, FLAGS_continuous_profiling_minutes));
+    const std::string* method_filter =
+        cntl->http_request().uri().GetQuery("method");
+
+    ContinuousProfile profile;
+    if (GetContinuousProfile(minutes, &profile) != 0) {
+        cntl->http_response().set_content_type("text/plain");
+        cntl->http_response().set_status_code(HTTP_STATUS_FORBIDDEN);
+        os << "Error: continuous profiler is not enabled, set "
+            "-continuous_profiling_hz to a positive value(e.g. 19) at "
+            "/flags/continuous_profiling_hz\n";
+        os.move_to(cntl->response_attachment());
+        return;
+    }
+    // Name the samples with methods first and outermost frames next, which
+    // is the "folded" format accepted by tools drawing flame graphs.
+    FlameNode root;
+    std::map<std::string, int64_t> methods;
+    std::map<std::string, int64_t> folded;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < profile.stacks.size(); ++i) {
+        const ProfiledStack& stack = profile.stacks[i];
+        const std::string method_name =
+            (stack.method ? stack.method->full_name() : "-");
+        methods[method_name] += stack.count;
+        if (method_filter && *method_filter != method_name) {
+            continue;
+        }
+        names.clear();
+        names.push_back(method_name);
+        for (size_t j = stack.frames.size(); j > 0; --j) {
+            names.push_back(SymbolizeFrame(stack.frames[j - 1]));
+        }
+        root.count += stack.count;
+        FlameNode* node = &root;
+        std::string line;
+        for (size_t j = 0; j < names.size(); ++j) {
+            if (j) {
+                line.push_back(';');
+            }
+            line.append(names[j]);
+            node = node->child(names[j]);
+            node->count += stack.count;
+        }
+        folded[line] += stack.count;
+    }
+
+    if (!use_html) {
+        cntl->http_response().set_content_type("text/plain");
+        os << "# " << root.count << " samples in " << profile.seconds
+           << " seconds, " << profile.dropped << " dropped\n";
+        for (std::map<std::string, int64_t>::const_iterator
+                 it = folded.begin(); it != folded.end(); ++it) {
+            os << it->first << ' ' << it->second << '\n';
+        }
+        os.move_to(cntl->response_attachment());
+        return;
+    }
+
+    cntl->http_response().set_content_type("text/html");
+    os << "<!DOCTYPE html><html><head>\n"
+        "<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
+        "<script language=\"javascript\" type=\"text/javascript\" src=\"/js/jquery_min\"></script>\n"
+       << TabsHead() << gridtable_style()
+       << "<style type=\"text/css\">\n"
+        ".fn {display:inline-block; vertical-align:top; overflow:hidden; }\n"
+        ".fl {font-size:12px; height:16px; line-height:16px; padding-left:2px;"
+        " white-space:nowrap; overflow:hidden; border:1px solid #fff;"
+        " box-sizing:border-box; cursor:default; }\n"
+        "</style>\n"
+        "</head>\n"
+        "<body>\n";
+    cntl->server()->PrintTabsBody(os, "continuous");
+    os << "<p>Last";
+    const int candidates[] = { 10, 60, 360, 1440, 10080 };
+    for (size_t i = 0; i < arraysize(candidates); ++i) {
+        if (candidates[i] > FLAGS_continuous_profiling_minutes) {
+            break;
+        }
+        os << ' ';
+        if (candidates[i] == minutes) {
+            os << "<b>" << candidates[i] << "</b>";
+        } else {
+            os << "<a href=\"/hotspots/continuous?minutes=" << candidates[i]
+               << "\">" << candidates[i] << "</a>";
+        }
+    }
+    os << " minutes: " << root.count << " samples in " << profile.seconds
+       << " seconds, " << profile.dropped << " dropped. <a href=\""
+       << "/hotspots/continuous?minutes=" << minutes << "&console=1\">"
+       << "folded stacks</a></p>\n"
+        "<table class=\"gridtable\" border=\"1\"><tr><th>Method</th>"
+        "<th>Samples</th><th>Percent</th></tr>\n";
+    int64_t nsamples = 0;
+    for (std::map<std::string, int64_t>::const_iterator
+             it = methods.begin(); it != methods.end(); ++it) {
+        nsamples += it->second;
+    }
+    for (std::map<std::string, int64_t>::const_iterator
+             it = methods.begin(); it != methods.end(); ++it) {
+        os << "<tr><td><a href=\"/hotspots/continuous?minutes=" << minutes
+           << "&method=" << it->first << "\">" << it->first << "</a></td><td>"
+           << it->second << "</td><td>"
+           << it->second * 100.0 / std::max(nsamples, (int64_t)1)
+           << "%</td></tr>\n";
+    }
+    os << "</table>\n<div style=\"width:100%;margin-top:10px\">";
+    if (root.count > 0) {
+        PrintFlameNode(os, "all", root, root.count, root.count);
+    }
+    os << "</div></body></html>";
+    os.move_to(cntl->response_attachment());
+}
+
 void HotspotsService::GetTabInfo(TabInfoList* info_list) const {
     TabInfo* info = info_list->add();
     info->path = "/hotspots/cpu";
@@ -1159,6 +1410,12 @@ void HotspotsService::GetTabInfo(TabInfoList* info_list) const {
     info = info_list->add();
     info->path = "/hotspots/contention";
     info->tab_name = "contention";
+    info = info_list->add();
+    info->path = "/hotspots/offcpu";
+    info->tab_name = "offcpu";
+    info = info_list->add();
+    info->path = "/hotspots/continuous";
+    info->tab_name = "continuous";
 }
 
 } // namespace brpc
@@ -48,6 +48,11 @@ public:
                     ::brpc::HotspotsResponse* response,
                     ::google::protobuf::Closure* done);
 
+    void offcpu(::google::protobuf::RpcController* cntl_base,
+                const ::brpc::HotspotsRequest* request,
+                ::brpc::HotspotsResponse* response,
+                ::google::protobuf::Closure* done);
+
     void cpu_non_responsive(::google::protobuf::RpcController* cntl_base,
                             const ::brpc::HotspotsRequest* request,
                             ::brpc::HotspotsResponse* response,
@@ -68,6 +73,17 @@ public:
                                    ::brpc::HotspotsResponse* response,
                                    ::google::protobuf::Closure* done);
 
+    void offcpu_non_responsive(::google::protobuf::RpcController* cntl_base,
+                               const ::brpc::HotspotsRequest* request,
+                               ::brpc::HotspotsResponse* response,
+                               ::google::protobuf::Closure* done);
+
+    // Samples of the continuous profiler, see -continuous_profiling_hz.
+    void continuous(::google::protobuf::RpcController* cntl_base,
+                    const ::brpc::HotspotsRequest* request,
+                    ::brpc::HotspotsResponse* response,
+                    ::google::protobuf::Closure* done);
+
     void GetTabInfo(brpc::TabInfoList*) const;
 };
 
@@ -0,0 +1,315 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <map>
+#include "butil/iobuf.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "bvar/variable.h"
+#include "brpc/controller.h"           // Controller
+#include "brpc/closure_guard.h"        // ClosureGuard
+#include "brpc/builtin/prometheus_metrics_service.h"
+
+namespace brpc {
+
+// Names of bvars are mostly valid Prometheus names already, the ones that
+// are not are escaped once and cached.
+class PrometheusNameCache {
+public:
+    // Returns `name' itself or the cached escaped name. The returned value
+    // is valid until next call on the same `buf'.
+    butil::StringPiece Get(const std::string& name, std::string* buf) {
+        if (IsValid(name)) {
+            return name;
+        }
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            std::map<std::string, std::string>::const_iterator
+                it = _escaped.find(name);
+            if (it != _escaped.end()) {
+                *buf = it->second;
+                return *buf;
+            }
+        }
+        Escape(name, buf);
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_escaped.size() >= MAX_CACHED_NAMES) {
+            _escaped.clear();
+        }
+        _escaped[name] = *buf;
+        return *buf;
+    }
+
+private:
+    static const size_t MAX_CACHED_NAMES = 65536;
+
+    // [a-zA-Z_:][a-zA-Z0-9_:]*
+    static bool IsValidChar(char c, bool first) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            c == '_' || c == ':' || (!first && c >= '0' && c <= '9');
+    }
+
+    static bool IsValid(const std::string& name) {
+        if (name.empty()) {
+            return false;
+        }
+        for (size_t i = 0; i < name.size(); ++i) {
+            if (!IsValidChar(name[i], i == 0)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void Escape(const std::string& name, std::string* out) {
+        out->clear();
+        out->reserve(name.size() + 1);
+        if (name.empty() || !IsValidChar(name[0], true)) {
+            out->push_back('_');
+        }
+        for (size_t i = 0; i < name.size(); ++i) {
+            out->push_back(IsValidChar(name[i], false) ? name[i] : '_');
+        }
+    }
+
+    butil::Mutex _mutex;
+    std::map<std::string, std::string> _escaped;
+};
+
+static PrometheusNameCache* GetPrometheusNameCache() {
+    static PrometheusNameCache* s_cache = new PrometheusNameCache;
+    return s_cache;
+}
+
+// A decimal or floating-point number, as printed by numeric bvars.
+static bool IsNumber(const butil::StringPiece& s) {
+    size_t i = 0;
+    if (i < s.size() && (s[i] == '-' || s[i] == '+')) {
+        ++i;
+    }
+    bool has_digit = false;
+    for (; i < s.size() && isdigit(s[i]); ++i) {
+        has_digit = true;
+    }
+    if (i < s.size() && s[i] == '.') {
+        for (++i; i < s.size() && isdigit(s[i]); ++i) {
+            has_digit = true;
+        }
+    }
+    if (!has_digit) {
+        return false;
+    }
+    if (i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+        ++i;
+        if (i < s.size() && (s[i] == '-' || s[i] == '+')) {
+            ++i;
+        }
+        const size_t exp_begin = i;
+        for (; i < s.size() && isdigit(s[i]); ++i) {}
+        if (i == exp_begin) {
+            return false;
+        }
+    }
+    return i == s.size();
+}
+
+// Write bvars in Prometheus text format(version 0.0.4) into an IOBuf
+// directly. Values that are not numbers are skipped. Descriptions of
+// bvar::MultiDimension are expanded into one sample per stat.
+class PrometheusMetricsDumper : public bvar::Dumper {
+public:
+    explicit PrometheusMetricsDumper(butil::IOBufAppender* app) : _app(app) {}
+
+    bool dump(const std::string& name, const butil::StringPiece& desc) {
+        butil::StringPiece metric_name =
+            GetPrometheusNameCache()->Get(name, &_name_buf);
+        if (!desc.empty() && desc[0] == '{') {
+            DumpMultiDimension(metric_name, desc);
+        } else if (IsNumber(desc)) {
+            AppendType(metric_name);
+            _app->append(metric_name);
+            _app->push_back(' ');
+            _app->append(desc);
+            _app->push_back('\n');
+        }
+        return true;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
+
+    void AppendType(const butil::StringPiece& metric_name) {
+        _app->append("# TYPE ");
+        _app->append(metric_name);
+        _app->append(" gauge\n");
+    }
+
+    // Description of bvar::MultiDimension looks like:
+    //   {a="x",b="y"}:1 {a="x",b="z"}:{latency=3 max10=5 qps=1 count=9}
+    // The first stat is exported as `name{a="x",b="y"} 1', fields of
+    // the second are exported as `name_latency{a="x",b="z"} 3' ...
+    void DumpMultiDimension(const butil::StringPiece& metric_name,
+                            const butil::StringPiece& desc) {
+        std::string plain;
+        // Samples are grouped by the name of each field.
+        std::map<std::string, std::string> fields;
+        size_t i = 0;
+        while (i < desc.size()) {
+            if (desc[i] != '{') {
+                break;
+            }
+            // Find end of labels, '}' and '\\' inside values are escaped.
+            size_t j = i + 1;
+            bool in_quote = false;
+            for (; j < desc.size(); ++j) {
+                const char c = desc[j];
+                if (in_quote) {
+                    if (c == '\\') {
+                        ++j;
+                    } else if (c == '"') {
+                        in_quote = false;
+                    }
+                } else if (c == '"') {
+                    in_quote = true;
+                } else if (c == '}') {
+                    break;
+                }
+            }
+            if (j + 1 >= desc.size() || desc[j + 1] != ':') {
+                break;
+            }
+            const butil::StringPiece labels = desc.substr(i, j + 1 - i);
+            const size_t value_begin = j + 2;
+            size_t value_end = butil::StringPiece::npos;
+            if (value_begin < desc.size() && desc[value_begin] == '{') {
+                value_end = desc.find('}', value_begin);
+                if (value_end != butil::StringPiece::npos) {
+                    ++value_end;
+                }
+            } else {
+                value_end = desc.find(' ', value_begin);
+            }
+            if (value_end == butil::StringPiece::npos) {
+                value_end = desc.size();
+            }
+            const butil::StringPiece value =
+                desc.substr(value_begin, value_end - value_begin);
+            if (IsNumber(value)) {
+                labels.AppendToString(&plain);
+                plain.push_back(' ');
+                value.AppendToString(&plain);
+                plain.push_back('\n');
+            } else if (value.size() >= 2 && value[0] == '{') {
+                AppendFields(labels, value.substr(1, value.size() - 2), &fields);
+            }
+            i = value_end;
+            while (i < desc.size() && desc[i] == ' ') {
+                ++i;
+            }
+        }
+        if (!plain.empty()) {
+            AppendSamples(metric_name, butil::StringPiece(), plain);
+        }
+        for (std::map<std::string, std::string>::const_iterator
+                 it = fields.begin(); it != fields.end(); ++it) {
+            AppendSamples(metric_name, it->first, it->second);
+        }
+    }
+
+    // `plain' contains lines of `{labels} value', prefix each of them with
+    // metric_name[_field].
+    void AppendSamples(const butil::StringPiece& metric_name,
+                       const butil::StringPiece& field,
+                       const std::string& lines) {
+        std::string full_name;
+        metric_name.AppendToString(&full_name);
+        if (!field.empty()) {
+            full_name.push_back('_');
+            field.AppendToString(&full_name);
+        }
+        AppendType(full_name);
+        size_t begin = 0;
+        while (begin < lines.size()) {
+            size_t end = lines.find('\n', begin);
+            if (end == std::string::npos) {
+                end = lines.size();
+            }
+            _app->append(full_name);
+            _app->append(butil::StringPiece(lines.data() + begin, end - begin));
+            _app->push_back('\n');
+            begin = end + 1;
+        }
+    }
+
+    // Split `k1=v1 k2=v2' and add numeric values into `fields'.
+    static void AppendFields(const butil::StringPiece& labels,
+                             const butil::StringPiece& kvs,
+                             std::map<std::string, std::string>* fields) {
+        size_t i = 0;
+        while (i < kvs.size()) {
+            size_t end = kvs.find(' ', i);
+            if (end == butil::StringPiece::npos) {
+                end = kvs.size();
+            }
+            const butil::StringPiece kv = kvs.substr(i, end - i);
+            const size_t eq = kv.find('=');
+            if (eq != butil::StringPiece::npos && eq > 0 &&
+                IsNumber(kv.substr(eq + 1))) {
+                std::string key;
+                std::string buf;
+                key = GetPrometheusNameCache()->Get(
+                    kv.substr(0, eq).as_string(), &buf).as_string();
+                std::string& lines = (*fields)[key];
+                labels.AppendToString(&lines);
+                lines.push_back(' ');
+                kv.substr(eq + 1).AppendToString(&lines);
+                lines.push_back('\n');
+            }
+            i = end + 1;
+        }
+    }
+
+    butil::IOBufAppender* _app;
+    std::string _name_buf;
+};
+
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* buf) {
+    butil::IOBufAppender app;
+    PrometheusMetricsDumper dumper(&app);
+    bvar::DumpOptions options;
+    // Series and cdf which are shown on html only are not numbers.
+    options.display_filter = bvar::DISPLAY_ON_PLAIN_TEXT;
+    const int ndump = bvar::Variable::dump_exposed(&dumper, &options);
+    if (ndump < 0) {
+        return -1;
+    }
+    app.move_to(*buf);
+    return 0;
+}
+
+void PrometheusMetricsService::default_method(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::MetricsRequest*,
+    ::brpc::MetricsResponse*,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    cntl->http_response().set_content_type("text/plain; version=0.0.4");
+    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment()) != 0) {
+        cntl->SetFailed("Fail to dump metrics");
+        return;
+    }
+}
+
+} // namespace brpc
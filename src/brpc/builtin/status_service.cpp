@@ -22,6 +22,7 @@
 #include "brpc/details/method_status.h"        // MethodStatus
 #include "brpc/builtin/status_service.h"
 #include "brpc/nshead_service.h"       // NsheadService
+#include "brpc/tenant_quota.h"         // TenantQuotas
 #include "brpc/rtmp.h"                 // RtmpService
 #include "brpc/builtin/common.h"
 
@@ -35,6 +36,16 @@ extern MethodStatus* g_server_msg_status;
 // Defined in vars_service.cpp
 void PutVarsHeading(std::ostream& os, bool expand_all);
 
+static void PrintMaxConcurrency(std::ostream& os, const MethodStatus& st) {
+    const int max_concurrency = st.MaxConcurrency();
+    if (st.max_concurrency().is_adaptive()) {
+        os << " max_concurrency=" << st.max_concurrency()
+           << '(' << max_concurrency << ')';
+    } else if (max_concurrency > 0) {
+        os << " max_concurrency=" << max_concurrency;
+    }
+}
+
 void StatusService::default_method(::google::protobuf::RpcController* cntl_base,
                                    const ::brpc::StatusRequest*,
                                    ::brpc::StatusResponse*,
@@ -152,8 +163,8 @@ void StatusService::default_method(::google::protobuf::RpcController* cntl_base,
                     if (mp->http_url) {
                         os << " @" << *mp->http_url;
                     }
-                    if (mp->status && mp->status->max_concurrency() > 0) {
-                        os << " max_concurrency=" << mp->status->max_concurrency();
+                    if (mp->status) {
+                        PrintMaxConcurrency(os, *mp->status);
                     }
                 }
                 os << "</h4>\n";
@@ -164,8 +175,8 @@ void StatusService::default_method(::google::protobuf::RpcController* cntl_base,
                     if (mp->http_url) {
                         os << " @" << *mp->http_url;
                     }
-                    if (mp->status && mp->status->max_concurrency() > 0) {
-                        os << " max_concurrency=" << mp->status->max_concurrency();
+                    if (mp->status) {
+                        PrintMaxConcurrency(os, *mp->status);
                     }
                 }
                 os << '\n';
@@ -176,6 +187,13 @@ void StatusService::default_method(::google::protobuf::RpcController* cntl_base,
             }
         }
     }
+    const TenantQuotas* tenant_quotas = server->options().tenant_quotas;
+    if (tenant_quotas) {
+        os << (use_html ? "<h3>" : "[") << "Tenants"
+           << (use_html ? "</h3>\n" : "]\n");
+        tenant_quotas->Describe(os, desc_options);
+        os << '\n';
+    }
     const NsheadService* nshead_svc = server->options().nshead_service;
     if (nshead_svc && nshead_svc->_status) {
         DescribeOptions options;
@@ -309,9 +309,12 @@ void VarsService::default_method(::google::protobuf::RpcController* cntl_base,
                                  ::google::protobuf::Closure* done) {
     ClosureGuard done_guard(done);
     Controller *cntl = static_cast<Controller*>(cntl_base);    
-    if (cntl->http_request().uri().GetQuery("series") != NULL) {
+    const std::string* series = cntl->http_request().uri().GetQuery("series");
+    if (series != NULL) {
         butil::IOBufBuilder os;
         bvar::SeriesOptions series_options;
+        // /vars/<name>?series=all shows all values kept by compressed series.
+        series_options.fixed_length = (*series != "all");
         const int rc = bvar::Variable::describe_series_exposed(
             cntl->http_request().unresolved_path(), os, series_options);
         if (rc == 0) {
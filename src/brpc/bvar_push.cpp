@@ -0,0 +1,237 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>                             // strtod
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "butil/scoped_lock.h"
+#include "butil/containers/flat_map.h"
+#include "bvar/variable.h"
+#include "brpc/log.h"
+#include "brpc/channel.h"
+#include "brpc/callback.h"
+#include "brpc/bvar_push.pb.h"
+#include "brpc/bvar_push.h"
+
+namespace brpc {
+
+DEFINE_string(bvar_push_server, "", "Where BvarSnapshots are pushed to, could"
+              " be a naming service url. Pushing is disabled when it's empty");
+DEFINE_int32(bvar_push_interval, 10, "Seconds between two pushes of bvars");
+DEFINE_int32(bvar_push_full_interval, 30, "Push values of all bvars every so "
+             "many pushes, values unchanged since last push are omitted in "
+             "other pushes");
+DEFINE_string(bvar_push_white_wildcards, "", "Only push bvars matched by "
+              "these wildcards separated by ; or ,. Push all when it's empty");
+
+static bool validate_positive(const char*, int32_t v) {
+    return v > 0;
+}
+const bool ALLOW_UNUSED dummy_bvar_push_interval =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_push_interval,
+                                       validate_positive);
+const bool ALLOW_UNUSED dummy_bvar_push_full_interval =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_push_full_interval,
+                                       validate_positive);
+
+struct PushedBvar {
+    uint32_t id;
+    bool seen;
+    std::string value;
+};
+typedef butil::FlatMap<std::string, PushedBvar> PushedBvarMap;
+
+// Protecting global vars on pushing.
+static pthread_mutex_t g_push_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Channel* g_push_chan = NULL;
+// Any server address in this process.
+static std::string* g_push_addr = NULL;
+// The timestamp(microseconds) of last push.
+static int64_t g_push_last_time = 0;
+// True when a push is not responded yet.
+static bool g_pushing = false;
+// Set when the receiver asks for it or last push failed.
+static bool g_push_need_full = true;
+static uint64_t g_push_seq = 0;
+// Values of pushed bvars, only accessed by the one pushing.
+static PushedBvarMap* g_pushed_bvars = NULL;
+static uint32_t g_next_bvar_id = 0;
+
+// Called in server.cpp
+void SetBvarPushAddress(butil::EndPoint pt) {
+    BAIDU_SCOPED_LOCK(g_push_mutex);
+    if (g_push_addr == NULL) {
+        g_push_addr = new std::string(butil::endpoint2str(pt).c_str());
+    }
+}
+
+// Put bvars whose values changed since last push(or all bvars when `full'
+// is true) into the snapshot.
+class BvarSnapshotDumper : public bvar::Dumper {
+public:
+    BvarSnapshotDumper(PushedBvarMap* pushed, BvarSnapshot* snapshot)
+        : _pushed(pushed), _snapshot(snapshot) {}
+
+    bool dump(const std::string& name, const butil::StringPiece& desc) {
+        PushedBvar* bvar = _pushed->seek(name);
+        bool first_push = false;
+        if (bvar == NULL) {
+            bvar = &(*_pushed)[name];
+            bvar->id = g_next_bvar_id++;
+            first_push = true;
+        }
+        bvar->seen = true;
+        const bool full = _snapshot->full();
+        if (!full && !first_push && desc == bvar->value) {
+            return true;
+        }
+        bvar->value.assign(desc.data(), desc.size());
+        BvarSnapshotItem* item = _snapshot->add_items();
+        item->set_id(bvar->id);
+        if (full || first_push) {
+            item->set_name(name);
+        }
+        const char* begin = bvar->value.c_str();
+        char* end = NULL;
+        const double number = strtod(begin, &end);
+        if (!bvar->value.empty() && end == begin + bvar->value.size()) {
+            item->set_number(number);
+        } else {
+            item->set_text(bvar->value);
+        }
+        return true;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BvarSnapshotDumper);
+
+    PushedBvarMap* _pushed;
+    BvarSnapshot* _snapshot;
+};
+
+static void HandleBvarPushResponse(Controller* cntl, BvarSnapshot* req,
+                                   BvarPushResponse* res) {
+    const bool failed = cntl->Failed();
+    if (failed) {
+        RPC_VLOG << "Fail to push bvars to " << FLAGS_bvar_push_server
+                 << ", " << cntl->ErrorText();
+    }
+    {
+        BAIDU_SCOPED_LOCK(g_push_mutex);
+        g_pushing = false;
+        // Unchanged values in the failed push would be missing in the
+        // receiver, push all values next time.
+        if (failed || res->need_full()) {
+            g_push_need_full = true;
+        }
+    }
+    delete cntl;
+    delete req;
+    delete res;
+}
+
+static void PushBvarsNow(std::unique_lock<pthread_mutex_t>& mu) {
+    if (g_push_chan == NULL) {
+        Channel* chan = new (std::nothrow) Channel;
+        if (chan == NULL) {
+            LOG(FATAL) << "Fail to new bvar push channel";
+            return;
+        }
+        const char* lb_name =
+            (FLAGS_bvar_push_server.find("://") != std::string::npos ?
+             "rr" : "");
+        if (chan->Init(FLAGS_bvar_push_server.c_str(), lb_name, NULL) != 0) {
+            LOG(WARNING) << "Fail to connect to " << FLAGS_bvar_push_server;
+            delete chan;
+            return;
+        }
+        g_push_chan = chan;
+    }
+    if (g_pushed_bvars == NULL) {
+        g_pushed_bvars = new PushedBvarMap;
+        if (g_pushed_bvars->init(1024) != 0) {
+            LOG(ERROR) << "Fail to init g_pushed_bvars";
+            delete g_pushed_bvars;
+            g_pushed_bvars = NULL;
+            return;
+        }
+    }
+    ++g_push_seq;
+    const bool full = (g_push_need_full ||
+                       g_push_seq % FLAGS_bvar_push_full_interval == 0);
+    g_push_need_full = false;
+    g_pushing = true;
+    BvarSnapshot* req = new BvarSnapshot;
+    if (g_push_addr) {
+        req->set_server_addr(*g_push_addr);
+    }
+    req->set_seq(g_push_seq);
+    req->set_full(full);
+    mu.unlock();
+
+    req->set_timestamp_us(butil::gettimeofday_us());
+    BvarSnapshotDumper dumper(g_pushed_bvars, req);
+    bvar::DumpOptions opt;
+    opt.white_wildcards = FLAGS_bvar_push_white_wildcards;
+    if (bvar::Variable::dump_exposed(&dumper, &opt) < 0) {
+        LOG(WARNING) << "Fail to dump bvars";
+    }
+    // Remove bvars that are not exposed anymore.
+    std::vector<std::string> removed;
+    for (PushedBvarMap::iterator it = g_pushed_bvars->begin();
+         it != g_pushed_bvars->end(); ++it) {
+        if (!it->second.seen) {
+            req->add_removed_ids(it->second.id);
+            removed.push_back(it->first);
+        } else {
+            it->second.seen = false;
+        }
+    }
+    for (size_t i = 0; i < removed.size(); ++i) {
+        g_pushed_bvars->erase(removed[i]);
+    }
+
+    BvarPushService_Stub stub(g_push_chan);
+    BvarPushResponse* res = new BvarPushResponse;
+    Controller* cntl = new Controller;
+    google::protobuf::Closure* done =
+        ::brpc::NewCallback(&HandleBvarPushResponse, cntl, req, res);
+    stub.Push(cntl, req, res, done);
+}
+
+// Called in global.cpp
+// [Thread-safe] supposed to be called in low frequency.
+void PushBvars() {
+    if (FLAGS_bvar_push_server.empty()) {
+        return;
+    }
+    const int64_t now = butil::gettimeofday_us();
+    std::unique_lock<pthread_mutex_t> mu(g_push_mutex);
+    if (g_pushing) {
+        return;
+    }
+    if (g_push_last_time == 0) {
+        // Delay the first push randomly within the interval to spread pushes
+        // from processes started together.
+        g_push_last_time = now - 1000000L * FLAGS_bvar_push_interval +
+            butil::fast_rand_less_than(FLAGS_bvar_push_interval) * 1000000L;
+    }
+    if (now >= g_push_last_time + 1000000L * FLAGS_bvar_push_interval) {
+        g_push_last_time = now;
+        return PushBvarsNow(mu);
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,34 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_BVAR_PUSH_H
+#define BRPC_BVAR_PUSH_H
+
+// [Internal] RPC users are not supposed to call functions below.
+
+#include "butil/endpoint.h"
+
+namespace brpc {
+
+// Set the server address carried in BvarSnapshot.
+// Currently only the first address will be saved.
+void SetBvarPushAddress(butil::EndPoint pt);
+
+// Call this function every second to push BvarSnapshot to -bvar_push_server
+// every -bvar_push_interval seconds.
+void PushBvars();
+
+} // namespace brpc
+
+#endif // BRPC_BVAR_PUSH_H
@@ -17,6 +17,7 @@
 //          Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include <inttypes.h>
+#include <memory>
 #include <google/protobuf/descriptor.h>
 #include <gflags/gflags.h>
 #include "butil/time.h"                              // milliseconds_from_now
@@ -30,6 +31,7 @@
 #include "brpc/controller.h"
 #include "brpc/channel.h"
 #include "brpc/details/usercode_backup_pool.h"       // TooManyUserCode
+#include "brpc/details/controller_private_accessor.h"  // GetInheritedDeadline
 #include "brpc/policy/esp_authenticator.h"
 #include "brpc/rdma/rdma_helper.h"              // rdma::GlobalRdmaInitializeOrDie
 
@@ -38,6 +40,7 @@ namespace brpc {
 
 DECLARE_bool(enable_rpcz);
 DECLARE_bool(usercode_in_pthread);
+DECLARE_bool(rpc_inherit_deadline);
 
 ChannelOptions::ChannelOptions()
     : connect_timeout_ms(200)
@@ -46,12 +49,18 @@ ChannelOptions::ChannelOptions()
     , max_retry(3)
     , protocol(PROTOCOL_BAIDU_STD)
     , connection_type(CONNECTION_TYPE_UNKNOWN)
+    , connection_pool_warmup_size(0)
     , succeed_without_server(true)
     , log_succeed_without_server(true)
     , auth(NULL)
     , retry_policy(NULL)
+    , backup_request_policy(NULL)
+    , retry_budget(NULL)
+    , enable_circuit_breaker(false)
     , ns_filter(NULL)
     , use_rdma(false)
+    , use_shm(false)
+    , response_cache(NULL)
 {}
 
 Channel::Channel(ProfilerLinker)
@@ -64,10 +73,10 @@ Channel::Channel(ProfilerLinker)
 
 Channel::~Channel() {
     if (_server_id != (SocketId)-1) {
-        SocketMapRemove(SocketMapKey(_server_address,
-                                     _options.use_rdma,
-                                     _options.ssl_options,
-                                     _options.auth));
+        SocketMapKey key(_server_address, _options.use_rdma,
+                         _options.ssl_options, _options.auth);
+        key.use_shm = _options.use_shm;
+        SocketMapRemove(key);
     }
 }
 
@@ -123,7 +132,10 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
         // connection_type.
         const bool has_error = _options.connection_type.has_error();
         
-        if (protocol->supported_connection_type & CONNECTION_TYPE_SINGLE) {
+        if ((protocol->supported_connection_type & CONNECTION_TYPE_SINGLE) &&
+            // Pipelined HTTP/1.x requests are responded in order, a slow
+            // response delays all following ones, not chosen by default.
+            _options.protocol != PROTOCOL_HTTP) {
             _options.connection_type = CONNECTION_TYPE_SINGLE;
         } else if (protocol->supported_connection_type & CONNECTION_TYPE_POOLED) {
             _options.connection_type = CONNECTION_TYPE_POOLED;
@@ -154,7 +166,9 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
         if (_options.auth == NULL) {
             _options.auth = policy::global_esp_authenticator();
         }
-    } else if (_options.protocol == brpc::PROTOCOL_HTTP) {
+    } else if (_options.protocol == brpc::PROTOCOL_HTTP ||
+               _options.protocol == brpc::PROTOCOL_H2 ||
+               _options.protocol == brpc::PROTOCOL_GRPC) {
         if (_raw_server_address.compare(0, 5, "https") == 0) {
             _options.ssl_options.enable = true;
             if (_options.ssl_options.sni_name.empty()) {
@@ -233,13 +247,22 @@ int Channel::Init(butil::EndPoint server_addr_and_port,
         return -1;
     }
     _server_address = server_addr_and_port;
-    if (SocketMapInsert(SocketMapKey(server_addr_and_port,
-                                     _options.use_rdma,
-                                     _options.ssl_options,
-                                     _options.auth), &_server_id) != 0) {
+    SocketMapKey key(server_addr_and_port, _options.use_rdma,
+                     _options.ssl_options, _options.auth);
+    key.use_shm = _options.use_shm;
+    if (SocketMapInsert(key, &_server_id) != 0) {
         LOG(ERROR) << "Fail to insert into SocketMap";
         return -1;
     }
+    if (_options.connection_type == CONNECTION_TYPE_POOLED &&
+        _options.connection_pool_warmup_size > 0) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(_server_id, &ptr) == 0) {
+            Socket::WarmUpPooledSockets(ptr.get(),
+                                        _options.connection_pool_warmup_size,
+                                        _options.connect_timeout_ms);
+        }
+    }
     return 0;
 }
 
@@ -254,21 +277,15 @@ int Channel::Init(const char* ns_url,
     if (InitChannelOptions(options) != 0) {
         return -1;
     }
-    LoadBalancerWithNaming* lb = new (std::nothrow) LoadBalancerWithNaming;
-    if (NULL == lb) {
-        LOG(FATAL) << "Fail to new LoadBalancerWithNaming";
-        return -1;        
-    }
     GetNamingServiceThreadOptions ns_opt;
     ns_opt.succeed_without_server = _options.succeed_without_server;
     ns_opt.log_succeed_without_server = _options.log_succeed_without_server;
     ns_opt.use_rdma = _options.use_rdma;
-    if (lb->Init(ns_url, lb_name, _options.ns_filter, &ns_opt) != 0) {
+    if (GetSharedLoadBalancerWithNaming(&_lb, ns_url, lb_name,
+                                        _options.ns_filter, &ns_opt) != 0) {
         LOG(ERROR) << "Fail to initialize LoadBalancerWithNaming";
-        delete lb;
         return -1;
     }
-    _lb.reset(lb);
     return 0;
 }
 
@@ -282,14 +299,76 @@ static void HandleBackupRequest(void* arg) {
     bthread_id_error(correlation_id, EBACKUPREQUEST);
 }
 
+// Refresh a stale response in ClientResponseCache.
+class RevalidateResponseCache : public google::protobuf::Closure {
+public:
+    RevalidateResponseCache(ClientResponseCache* cache,
+                            const ClientResponseCache::Key& key,
+                            google::protobuf::Message* response)
+        : _cache(cache), _key(key), _response(response) {}
+
+    void Run() {
+        if (cntl.Failed()) {
+            _cache->Unrevalidate(_key);
+        } else {
+            _cache->Put(_key, *_response, cntl.response_attachment());
+        }
+        delete this;
+    }
+
+    google::protobuf::Message* response() const { return _response.get(); }
+
+    Controller cntl;
+
+private:
+    ClientResponseCache* _cache;
+    ClientResponseCache::Key _key;
+    std::unique_ptr<google::protobuf::Message> _response;
+};
+
+bool Channel::GetResponseFromCache(
+    const google::protobuf::MethodDescriptor* method,
+    Controller* cntl, google::protobuf::Message* response) {
+    ClientResponseCache* cache = _options.response_cache;
+    const ClientResponseCache::Key key = ClientResponseCache::MakeKey(
+        method, cntl->_request_buf, cntl->request_attachment());
+    bool revalidate = false;
+    if (!cache->Get(key, response, &cntl->response_attachment(),
+                    &revalidate)) {
+        // Cached in OnRPCEnd() if the RPC succeeds.
+        cntl->ext()->response_cache = cache;
+        return false;
+    }
+    if (revalidate) {
+        RevalidateResponseCache* done =
+            new RevalidateResponseCache(cache, key, response->New());
+        Controller* sub_cntl = &done->cntl;
+        // Send the serialized request again without the cache.
+        sub_cntl->_request_buf = cntl->_request_buf;
+        sub_cntl->request_attachment() = cntl->request_attachment();
+        sub_cntl->set_request_compress_type(cntl->request_compress_type());
+        if (cntl->has_log_id()) {
+            sub_cntl->set_log_id(cntl->log_id());
+        }
+        if (cntl->has_request_code()) {
+            sub_cntl->set_request_code(cntl->request_code());
+        }
+        sub_cntl->add_flag(Controller::FLAGS_REQUEST_SERIALIZED |
+                           Controller::FLAGS_BYPASS_RESPONSE_CACHE);
+        CallMethod(method, sub_cntl, NULL, done->response(), done);
+    }
+    return true;
+}
+
 void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
                          google::protobuf::RpcController* controller_base,
                          const google::protobuf::Message* request,
                          google::protobuf::Message* response,
                          google::protobuf::Closure* done) {
-    const int64_t start_send_real_us = butil::gettimeofday_us();
+    const int64_t start_send_real_us = butil::fast_realtime_us();
     Controller* cntl = static_cast<Controller*>(controller_base);
     cntl->OnRPCBegin(start_send_real_us);
+    cntl->_phase_times.Mark(RPC_CLIENT_BEGIN);
     // Override max_retry first to reset the range of correlation_id
     if (cntl->max_retry() == UNSET_MAGIC_NUM) {
         cntl->set_max_retry(_options.max_retry);
@@ -303,6 +382,9 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     cntl->_request_protocol = _options.protocol;
     cntl->_preferred_index = _preferred_index;
     cntl->_retry_policy = _options.retry_policy;
+    cntl->_retry_budget = _options.retry_budget;
+    cntl->set_flag(Controller::FLAGS_ENABLED_CIRCUIT_BREAKER,
+                   _options.enable_circuit_breaker);
     const CallId correlation_id = cntl->call_id();
     const int rc = bthread_id_lock_and_reset_range(
                     correlation_id, NULL, 2 + cntl->max_retry());
@@ -352,12 +434,31 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     if (cntl->timeout_ms() == UNSET_MAGIC_NUM) {
         cntl->set_timeout_ms(_options.timeout_ms);
     }
+    if (FLAGS_rpc_inherit_deadline) {
+        const int64_t inherited_deadline_us = GetInheritedDeadline();
+        if (inherited_deadline_us >= 0) {
+            const int64_t left_ms =
+                (inherited_deadline_us - start_send_real_us) / 1000L;
+            if (left_ms <= 0) {
+                cntl->SetFailed(ERPCTIMEDOUT, "Deadline of the request being "
+                                "processed has passed");
+            } else if (cntl->timeout_ms() < 0 || cntl->timeout_ms() > left_ms) {
+                cntl->set_timeout_ms(left_ms);
+            }
+        }
+    }
     // Since connection is shared extensively amongst channels and RPC,
     // overriding connect_timeout_ms does not make sense, just use the
     // one in ChannelOptions
     cntl->_connect_timeout_ms = _options.connect_timeout_ms;
+    cntl->_backup_request_policy = _options.backup_request_policy;
     if (cntl->backup_request_ms() == UNSET_MAGIC_NUM) {
-        cntl->set_backup_request_ms(_options.backup_request_ms);
+        if (_options.backup_request_policy) {
+            cntl->set_backup_request_ms(
+                _options.backup_request_policy->GetBackupRequestMs());
+        } else {
+            cntl->set_backup_request_ms(_options.backup_request_ms);
+        }
     }
     if (cntl->connection_type() == CONNECTION_TYPE_UNKNOWN) {
         cntl->set_connection_type(_options.connection_type);
@@ -388,17 +489,41 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         // parameters in `cntl' are set.
         return cntl->HandleSendFailed();
     }
-    _serialize_request(&cntl->_request_buf, cntl, request);
+    if (!cntl->has_flag(Controller::FLAGS_REQUEST_SERIALIZED)) {
+        _serialize_request(&cntl->_request_buf, cntl, request);
+    }
     if (cntl->FailedInline()) {
         return cntl->HandleSendFailed();
     }
+    if (FLAGS_rpc_phase_latency) {
+        cntl->_phase_times.Mark(RPC_CLIENT_SERIALIZED);
+        if (cntl->_span) {
+            cntl->_span->Annotate("Serialized request(%lld) in %lldus",
+                (long long)cntl->_request_buf.size(),
+                (long long)cntl->_phase_times.Between(
+                    RPC_CLIENT_BEGIN, RPC_CLIENT_SERIALIZED));
+        }
+    }
 
     if (cntl->_request_stream != INVALID_STREAM_ID) {
         // Currently we cannot handle retry and backup request correctly
         cntl->set_max_retry(0);
         cntl->set_backup_request_ms(-1);
+    } else if (_options.response_cache != NULL && method != NULL &&
+               response != NULL &&
+               !cntl->has_flag(Controller::FLAGS_BYPASS_RESPONSE_CACHE) &&
+               GetResponseFromCache(method, cntl, response)) {
+        cntl->HandleResponseFromCache();
+        if (done == NULL) {
+            if (cntl->_span) {
+                cntl->SubmitSpan();
+            }
+            cntl->OnRPCEnd(butil::fast_realtime_us());
+        }
+        return;
     }
 
+    bool timeout_in_join = false;
     if (cntl->backup_request_ms() >= 0 &&
         (cntl->backup_request_ms() < cntl->timeout_ms() ||
          cntl->timeout_ms() < 0)) {
@@ -422,17 +547,22 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
             return cntl->HandleSendFailed();
         }
     } else if (cntl->timeout_ms() >= 0) {
-        // Setup timer for RPC timetout
-
         // _abstime_us is for truncating _connect_timeout_ms
         cntl->_abstime_us = cntl->timeout_ms() * 1000L + start_send_real_us;
-        const int rc = bthread_timer_add(
-            &cntl->_timeout_id,
-            butil::microseconds_to_timespec(cntl->_abstime_us),
-            HandleTimeout, (void*)correlation_id.value);
-        if (BAIDU_UNLIKELY(rc != 0)) {
-            cntl->SetFailed(rc, "Fail to add timer for timeout");
-            return cntl->HandleSendFailed();
+        if (done == NULL) {
+            // Synchronous RPC waits until the deadline in Join below, which
+            // saves adding and deleting a timer in TimerThread.
+            timeout_in_join = true;
+        } else {
+            // Setup timer for RPC timetout
+            const int rc = bthread_timer_add(
+                &cntl->_timeout_id,
+                butil::microseconds_to_timespec(cntl->_abstime_us),
+                HandleTimeout, (void*)correlation_id.value);
+            if (BAIDU_UNLIKELY(rc != 0)) {
+                cntl->SetFailed(rc, "Fail to add timer for timeout");
+                return cntl->HandleSendFailed();
+            }
         }
     } else {
         cntl->_abstime_us = -1;
@@ -443,11 +573,23 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         // MUST wait for response when sending synchronous RPC. It will
         // be woken up by callback when RPC finishes (succeeds or still
         // fails after retry)
-        Join(correlation_id);
+        if (timeout_in_join) {
+            const timespec abstime =
+                butil::microseconds_to_timespec(cntl->_abstime_us);
+            if (bthread_id_timedjoin(correlation_id, &abstime) == ETIMEDOUT) {
+                HandleTimeout((void*)correlation_id.value);
+                Join(correlation_id);
+            }
+        } else {
+            Join(correlation_id);
+        }
         if (cntl->_span) {
             cntl->SubmitSpan();
         }
-        cntl->OnRPCEnd(butil::gettimeofday_us());
+        cntl->OnRPCEnd(butil::fast_realtime_us());
+        if (FLAGS_rpc_phase_latency && !cntl->Failed()) {
+            RecordClientPhases(method, cntl->_phase_times, -1);
+        }
     }
 }
 
@@ -32,6 +32,8 @@
 #include "brpc/controller.h"                // brpc::Controller
 #include "brpc/details/profiler_linker.h"
 #include "brpc/retry_policy.h"
+#include "brpc/backup_request_policy.h"
+#include "brpc/client_response_cache.h"
 #include "brpc/naming_service_filter.h"
 
 namespace brpc {
@@ -80,6 +82,13 @@ struct ChannelOptions {
     // Possible values: "single", "pooled", "short".
     AdaptiveConnectionType connection_type;
 
+    // Number of connections created (and SSL handshaked) in background by
+    // Init() when connection_type is "pooled", so that calls after a restart
+    // don't pay for connecting. These connections are not closed by
+    // -connection_pool_adaptive_size. Only for channels to a single server.
+    // Default: 0
+    int connection_pool_warmup_size;
+
     // Channel.Init() succeeds even if there's no server in the NamingService. 
     // E.g. the BNS directory is empty. All RPC over the channel will fail before
     // new nodes being added to the NamingService.
@@ -104,6 +113,34 @@ struct ChannelOptions {
     // channel is used.
     const RetryPolicy* retry_policy;
 
+    // Decide when backup requests are sent with live information of RPCs,
+    // e.g. LatencyPercentileBackupPolicy sends backup requests at a
+    // percentile of latencies within a budget of extra requests. The
+    // interface is defined in src/brpc/backup_request_policy.h
+    // backup_request_ms is ignored when this field is set, but
+    // Controller.set_backup_request_ms() still overrides it.
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used.
+    // Default: NULL
+    BackupRequestPolicy* backup_request_policy;
+
+    // Limit retries of this channel to a ratio of successful RPCs, so that
+    // retries do not multiply the load on servers when most RPCs fail.
+    // Retries denied by RetryPolicy are not affected. The class is defined
+    // in src/brpc/retry_policy.h and can be shared by multiple channels.
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used.
+    // Default: NULL
+    RetryBudget* retry_budget;
+
+    // Isolate a server when EWMA of its error rate or latency spikes, and
+    // admit it gradually after the isolation which is done with health
+    // checking (-health_check_interval must be positive). Only applicable to
+    // channels with load balancers. Check src/brpc/circuit_breaker.h and
+    // gflags -circuit_breaker_* for details.
+    // Default: false
+    bool enable_circuit_breaker;
+
     // Filter ServerNodes (i.e. based on `tag' field of `ServerNode')
     // which are generated by NamingService. The interface is defined
     // in src/brpc/naming_service_filter.h
@@ -114,6 +151,22 @@ struct ChannelOptions {
     // Let this channel use rdma rather than tcp.
     // Default: false
     bool use_rdma;
+
+    // Transfer data through shared memory instead of the connection if the
+    // server is on this machine and enables ServerOptions.use_shm. Falls
+    // back to the connection otherwise. Only for channels to single servers.
+    // Default: false
+    bool use_shm;
+
+    // Return responses cached locally for calls with identical requests,
+    // and refresh stale responses in background. Only calls with response
+    // messages and without streams are cached. The class is defined in
+    // src/brpc/client_response_cache.h and can be shared by channels to
+    // the same service.
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used.
+    // Default: NULL
+    ClientResponseCache* response_cache;
 };
 
 // A Channel represents a communication line to one server or multiple servers
@@ -128,6 +181,7 @@ struct ChannelOptions {
 class Channel : public ChannelBase {
 friend class Controller;
 friend class SelectiveChannel;
+friend class ParallelChannel;
 public:
     Channel(ProfilerLinker = ProfilerLinker());
     ~Channel();
@@ -193,6 +247,13 @@ protected:
 
     int InitChannelOptions(const ChannelOptions* options);
 
+    // Fill `response' from _options.response_cache and returns true if the
+    // call of `cntl' is cached, in which case stale responses are refreshed
+    // by another RPC in background.
+    bool GetResponseFromCache(const google::protobuf::MethodDescriptor* method,
+                              Controller* cntl,
+                              google::protobuf::Message* response);
+
     std::string _raw_server_address;
     butil::EndPoint _server_address;
     SocketId _server_id;
@@ -0,0 +1,169 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>                           // std::min
+#include <gflags/gflags.h>
+#include "butil/scoped_lock.h"
+#include "butil/time.h"
+#include "brpc/errno.pb.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/circuit_breaker.h"
+
+namespace brpc {
+
+DEFINE_int32(circuit_breaker_window_size, 100,
+             "Calls in the window of EWMA of error rates and latencies, also"
+             " the minimum calls to a server before it can be isolated");
+DEFINE_int32(circuit_breaker_max_error_percent, 20,
+             "Isolate a server when EWMA of its error rate exceeds this");
+DEFINE_int32(circuit_breaker_latency_multiplier, 5,
+             "Isolate a server when EWMA of its latency exceeds this times of"
+             " the long-term EWMA (10 times the window), <= 0 means never");
+DEFINE_int32(circuit_breaker_min_isolation_ms, 100,
+             "Isolation of a server broken for the first time");
+DEFINE_int32(circuit_breaker_max_isolation_ms, 30000,
+             "Max isolation of a server broken repeatedly");
+DEFINE_int32(circuit_breaker_recovery_ms, 3000,
+             "Traffic to a server grows linearly during this time after its"
+             " isolation");
+BRPC_VALIDATE_GFLAG(circuit_breaker_window_size, PositiveInteger);
+BRPC_VALIDATE_GFLAG(circuit_breaker_max_error_percent, PassValidate);
+BRPC_VALIDATE_GFLAG(circuit_breaker_latency_multiplier, PassValidate);
+BRPC_VALIDATE_GFLAG(circuit_breaker_min_isolation_ms, PositiveInteger);
+BRPC_VALIDATE_GFLAG(circuit_breaker_max_isolation_ms, PositiveInteger);
+BRPC_VALIDATE_GFLAG(circuit_breaker_recovery_ms, PassValidate);
+
+// Admit some calls even at the beginning of the recovery, otherwise the
+// recovery can't be observed.
+static const int MIN_ADMISSION_PERMILLE = 10;
+
+CircuitBreaker::CircuitBreaker()
+    : _nsample(0)
+    , _nlatency(0)
+    , _ema_error_rate(0)
+    , _ema_latency_us(0)
+    , _ema_long_latency_us(0)
+    , _isolation_duration_ms(0)
+    , _broken(false)
+    , _isolated_until_us(0)
+    , _recovery_begin_us(0) {
+}
+
+bool CircuitBreaker::OnCallEnd(int error_code, int64_t latency_us) {
+    if (error_code == ECANCELED || error_code == EBACKUPREQUEST ||
+        error_code == EPCHANENOUGH) {
+        // Not caused by the server.
+        return true;
+    }
+    const int window = FLAGS_circuit_breaker_window_size;
+    const double alpha = 2.0 / (window + 1);
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_broken.load(butil::memory_order_relaxed)) {
+        // Calls sent before the isolation.
+        return true;
+    }
+    ++_nsample;
+    _ema_error_rate += alpha * ((error_code ? 1.0 : 0.0) - _ema_error_rate);
+    // Latencies of failed calls are often cut by timeouts or fast failures,
+    // which are covered by the error rate.
+    if (error_code == 0) {
+        if (_nlatency++ == 0) {
+            _ema_latency_us = latency_us;
+            _ema_long_latency_us = latency_us;
+        } else {
+            _ema_latency_us += alpha * (latency_us - _ema_latency_us);
+            _ema_long_latency_us +=
+                alpha / 10 * (latency_us - _ema_long_latency_us);
+        }
+    }
+    if (_nsample < window) {
+        return true;
+    }
+    const int multiplier = FLAGS_circuit_breaker_latency_multiplier;
+    if (_ema_error_rate * 100 <= FLAGS_circuit_breaker_max_error_percent &&
+        (multiplier <= 0 || _nlatency < window ||
+         _ema_latency_us <= _ema_long_latency_us * multiplier)) {
+        return true;
+    }
+    const int64_t now = butil::cpuwide_time_us();
+    const int64_t recovery_begin_us =
+        _recovery_begin_us.load(butil::memory_order_relaxed);
+    const int min_ms = FLAGS_circuit_breaker_min_isolation_ms;
+    const int max_ms = std::max(FLAGS_circuit_breaker_max_isolation_ms, min_ms);
+    if (recovery_begin_us > 0 &&
+        now < recovery_begin_us +
+        2000L * std::max(FLAGS_circuit_breaker_recovery_ms,
+                         _isolation_duration_ms)) {
+        // Broken again soon after the recovery.
+        _isolation_duration_ms =
+            std::min(std::max(_isolation_duration_ms * 2, min_ms), max_ms);
+    } else {
+        _isolation_duration_ms = min_ms;
+    }
+    _isolated_until_us.store(now + _isolation_duration_ms * 1000L,
+                             butil::memory_order_relaxed);
+    _broken.store(true, butil::memory_order_relaxed);
+    return false;
+}
+
+void CircuitBreaker::OnRevived() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (!_broken.load(butil::memory_order_relaxed)) {
+        return;
+    }
+    _ema_error_rate = 0;
+    _ema_latency_us = _ema_long_latency_us;
+    _isolated_until_us.store(0, butil::memory_order_relaxed);
+    _recovery_begin_us.store(butil::cpuwide_time_us(),
+                             butil::memory_order_relaxed);
+    _broken.store(false, butil::memory_order_relaxed);
+}
+
+void CircuitBreaker::Reset() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _nsample = 0;
+    _nlatency = 0;
+    _ema_error_rate = 0;
+    _ema_latency_us = 0;
+    _ema_long_latency_us = 0;
+    _isolation_duration_ms = 0;
+    _broken.store(false, butil::memory_order_relaxed);
+    _isolated_until_us.store(0, butil::memory_order_relaxed);
+    _recovery_begin_us.store(0, butil::memory_order_relaxed);
+}
+
+int64_t CircuitBreaker::isolation_remaining_us() const {
+    const int64_t until = _isolated_until_us.load(butil::memory_order_relaxed);
+    if (until == 0) {
+        return 0;
+    }
+    return std::max(until - butil::cpuwide_time_us(), (int64_t)0);
+}
+
+int CircuitBreaker::admission_permille() const {
+    const int64_t begin = _recovery_begin_us.load(butil::memory_order_relaxed);
+    const int64_t recovery_us = FLAGS_circuit_breaker_recovery_ms * 1000L;
+    if (begin == 0 || recovery_us <= 0) {
+        return 1000;
+    }
+    const int64_t elapsed_us = butil::cpuwide_time_us() - begin;
+    if (elapsed_us >= recovery_us) {
+        return 1000;
+    }
+    return std::max((int)(elapsed_us * 1000 / recovery_us),
+                    MIN_ADMISSION_PERMILLE);
+}
+
+} // namespace brpc
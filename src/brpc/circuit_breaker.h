@@ -0,0 +1,82 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_CIRCUIT_BREAKER_H
+#define BRPC_CIRCUIT_BREAKER_H
+
+#include <stdint.h>
+#include "butil/macros.h"
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"
+
+namespace brpc {
+
+// Isolates a server when EWMA(exponentially weighted moving average) of
+// its error rate exceeds -circuit_breaker_max_error_percent, or EWMA of its
+// latency exceeds -circuit_breaker_latency_multiplier times of the long-term
+// EWMA. The isolation starts from -circuit_breaker_min_isolation_ms and is
+// doubled each time the server is broken again soon after recovery, up to
+// -circuit_breaker_max_isolation_ms. After the isolation, the server is
+// admitted gradually during -circuit_breaker_recovery_ms.
+// Each Socket of servers has one, fed by SharedLoadBalancer when
+// ChannelOptions.enable_circuit_breaker is true. All methods are thread-safe.
+class CircuitBreaker {
+public:
+    CircuitBreaker();
+
+    // Record a call to the server which ended with `error_code' after
+    // `latency_us'. Returns false if the server is just broken and should
+    // be isolated.
+    bool OnCallEnd(int error_code, int64_t latency_us);
+
+    // Called when the server is revived after the isolation, starting the
+    // recovery.
+    void OnRevived();
+
+    // Forget everything.
+    void Reset();
+
+    // True if the server is broken and not revived yet.
+    bool broken() const { return _broken.load(butil::memory_order_relaxed); }
+
+    // Microseconds before the isolation ends, 0 if the server is not
+    // isolated.
+    int64_t isolation_remaining_us() const;
+
+    // Duration of the last isolation.
+    int isolation_duration_ms() const { return _isolation_duration_ms; }
+
+    // Chance in thousandths that a call should be sent to the server, which
+    // grows linearly to 1000 during the recovery.
+    int admission_permille() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CircuitBreaker);
+
+    butil::Mutex _mutex;
+    int64_t _nsample;
+    int64_t _nlatency;
+    double _ema_error_rate;
+    double _ema_latency_us;
+    double _ema_long_latency_us;
+    int _isolation_duration_ms;
+    butil::atomic<bool> _broken;
+    butil::atomic<int64_t> _isolated_until_us;
+    butil::atomic<int64_t> _recovery_begin_us;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_CIRCUIT_BREAKER_H
@@ -0,0 +1,172 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <algorithm>
+#include "butil/time.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "brpc/protocol.h"                       // ParsePbFromIOBuf
+#include "brpc/client_response_cache.h"
+
+namespace brpc {
+
+// Bytes of bookkeeping counted for each entry besides the response.
+static const int64_t ENTRY_OVERHEAD = 128;
+
+ClientResponseCacheOptions::ClientResponseCacheOptions()
+    : fresh_ms(1000)
+    , stale_ms(0)
+    , max_bytes(64L * 1024 * 1024) {
+}
+
+ClientResponseCache::ClientResponseCache() {}
+
+ClientResponseCache::ClientResponseCache(
+    const ClientResponseCacheOptions& options)
+    : _options(options) {
+}
+
+static void HashIOBuf(butil::MurmurHash3_x64_128_Context* ctx,
+                      const butil::IOBuf& buf) {
+    const size_t nblock = buf.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = buf.backing_block(i);
+        butil::MurmurHash3_x64_128_Update(ctx, blk.data(), blk.size());
+    }
+}
+
+ClientResponseCache::Key ClientResponseCache::MakeKey(
+    const google::protobuf::MethodDescriptor* method,
+    const butil::IOBuf& request,
+    const butil::IOBuf& request_attachment) {
+    butil::MurmurHash3_x64_128_Context ctx;
+    butil::MurmurHash3_x64_128_Init(&ctx, 0);
+    const std::string& name = method->full_name();
+    // Sizes separate the name, the request and the attachment.
+    const uint64_t sizes[3] = { name.size(), request.size(),
+                                request_attachment.size() };
+    butil::MurmurHash3_x64_128_Update(&ctx, sizes, sizeof(sizes));
+    butil::MurmurHash3_x64_128_Update(&ctx, name.data(), name.size());
+    HashIOBuf(&ctx, request);
+    HashIOBuf(&ctx, request_attachment);
+    Key key;
+    butil::MurmurHash3_x64_128_Final(key.hash, &ctx);
+    return key;
+}
+
+bool ClientResponseCache::Get(const Key& key,
+                              google::protobuf::Message* response,
+                              butil::IOBuf* response_attachment,
+                              bool* revalidate) {
+    *revalidate = false;
+    butil::IOBuf body;
+    Shard* shard = GetShard(key);
+    {
+        BAIDU_SCOPED_LOCK(shard->mutex);
+        butil::MRUCache<Key, Entry>::iterator it = shard->entries.Get(key);
+        if (it == shard->entries.end()) {
+            _nmiss << 1;
+            return false;
+        }
+        Entry& entry = it->second;
+        const int64_t now_us = butil::cpuwide_time_us();
+        if (now_us >= entry.stale_until_us) {
+            shard->bytes -= entry.bytes;
+            _memory << -entry.bytes;
+            shard->entries.Erase(it);
+            _nmiss << 1;
+            return false;
+        }
+        if (now_us >= entry.fresh_until_us && !entry.revalidating) {
+            entry.revalidating = true;
+            *revalidate = true;
+        }
+        // Blocks are shared rather than copied.
+        body = entry.body;
+        *response_attachment = entry.attachment;
+    }
+    // Parse outside the lock.
+    if (!ParsePbFromIOBuf(response, body)) {
+        if (*revalidate) {
+            Unrevalidate(key);
+            *revalidate = false;
+        }
+        response_attachment->clear();
+        _nmiss << 1;
+        return false;
+    }
+    _nhit << 1;
+    return true;
+}
+
+void ClientResponseCache::Put(const Key& key,
+                              const google::protobuf::Message& response,
+                              const butil::IOBuf& response_attachment) {
+    const int64_t max_bytes = _options.max_bytes / (int64_t)NSHARD;
+    Entry entry;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&entry.body);
+    if (!response.SerializeToZeroCopyStream(&wrapper)) {
+        return;
+    }
+    entry.attachment = response_attachment;
+    entry.bytes = entry.body.size() + entry.attachment.size() + ENTRY_OVERHEAD;
+    if (entry.bytes > max_bytes || _options.fresh_ms <= 0) {
+        return;
+    }
+    entry.fresh_until_us = butil::cpuwide_time_us() + _options.fresh_ms * 1000L;
+    entry.stale_until_us = entry.fresh_until_us +
+        std::max(_options.stale_ms, 0) * 1000L;
+    entry.revalidating = false;
+    Shard* shard = GetShard(key);
+    BAIDU_SCOPED_LOCK(shard->mutex);
+    butil::MRUCache<Key, Entry>::iterator it = shard->entries.Peek(key);
+    if (it != shard->entries.end()) {
+        shard->bytes -= it->second.bytes;
+        _memory << -it->second.bytes;
+        shard->entries.Erase(it);
+    }
+    EvictLocked(shard, max_bytes - entry.bytes);
+    shard->bytes += entry.bytes;
+    _memory << entry.bytes;
+    shard->entries.Put(key, entry);
+}
+
+void ClientResponseCache::Unrevalidate(const Key& key) {
+    Shard* shard = GetShard(key);
+    BAIDU_SCOPED_LOCK(shard->mutex);
+    butil::MRUCache<Key, Entry>::iterator it = shard->entries.Peek(key);
+    if (it != shard->entries.end()) {
+        it->second.revalidating = false;
+    }
+}
+
+void ClientResponseCache::Clear() {
+    for (size_t i = 0; i < NSHARD; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        EvictLocked(&_shards[i], 0);
+    }
+}
+
+void ClientResponseCache::EvictLocked(Shard* shard, int64_t max_bytes) {
+    while (shard->bytes > max_bytes && shard->entries.size() != 0) {
+        butil::MRUCache<Key, Entry>::reverse_iterator it =
+            shard->entries.rbegin();
+        shard->bytes -= it->second.bytes;
+        _memory << -it->second.bytes;
+        shard->entries.Erase(it);
+    }
+}
+
+} // namespace brpc
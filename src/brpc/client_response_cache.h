@@ -0,0 +1,130 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_CLIENT_RESPONSE_CACHE_H
+#define BRPC_CLIENT_RESPONSE_CACHE_H
+
+#include <stdint.h>
+#include <google/protobuf/message.h>
+#include "butil/macros.h"
+#include "butil/iobuf.h"
+#include "butil/synchronization/lock.h"
+#include "butil/containers/mru_cache.h"
+#include "bvar/bvar.h"
+
+namespace brpc {
+
+struct ClientResponseCacheOptions {
+    ClientResponseCacheOptions();
+
+    // Cached responses younger than so many milliseconds are returned
+    // without sending RPC.
+    // Default: 1000
+    int fresh_ms;
+
+    // Cached responses older than fresh_ms but younger than fresh_ms +
+    // stale_ms are still returned, meanwhile one RPC is sent in background
+    // to refresh the response. 0 means no stale responses.
+    // Default: 0
+    int stale_ms;
+
+    // Memory used by cached responses, least recently used responses are
+    // evicted when it's exceeded.
+    // Default: 64MB
+    int64_t max_bytes;
+};
+
+// Cache successful responses of channels keyed by hashes of methods along
+// with serialized requests and attachments, so that repeated calls with
+// identical requests (e.g. lookups of configurations) are answered locally.
+// Only use this for methods whose responses are decided by requests alone
+// and tolerate staleness of fresh_ms + stale_ms. Can be shared by channels
+// to the same service. All methods are thread-safe.
+class ClientResponseCache {
+public:
+    // 128-bit hash of a call, collisions are ignored.
+    struct Key {
+        uint64_t hash[2];
+        bool operator<(const Key& rhs) const {
+            return hash[0] != rhs.hash[0] ? hash[0] < rhs.hash[0]
+                                          : hash[1] < rhs.hash[1];
+        }
+    };
+
+    ClientResponseCache();
+    explicit ClientResponseCache(const ClientResponseCacheOptions& options);
+
+    static Key MakeKey(const google::protobuf::MethodDescriptor* method,
+                       const butil::IOBuf& request,
+                       const butil::IOBuf& request_attachment);
+
+    // Returns true and fills `response' and `response_attachment' if a
+    // usable response of `key' is cached. `revalidate' is set to true for
+    // one caller getting a stale response, which should send RPC to
+    // refresh the response and call Put() or Unrevalidate() later.
+    bool Get(const Key& key, google::protobuf::Message* response,
+             butil::IOBuf* response_attachment, bool* revalidate);
+
+    // Cache `response' and `response_attachment' of `key'.
+    void Put(const Key& key, const google::protobuf::Message& response,
+             const butil::IOBuf& response_attachment);
+
+    // The RPC refreshing `key' failed, let another caller revalidate.
+    void Unrevalidate(const Key& key);
+
+    // Drop all cached responses.
+    void Clear();
+
+    int64_t hit_count() const { return _nhit.get_value(); }
+    int64_t miss_count() const { return _nmiss.get_value(); }
+    int64_t memory() const { return _memory.get_value(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ClientResponseCache);
+
+    struct Entry {
+        // Serialized response.
+        butil::IOBuf body;
+        butil::IOBuf attachment;
+        int64_t fresh_until_us;
+        int64_t stale_until_us;
+        int64_t bytes;
+        bool revalidating;
+    };
+    struct Shard {
+        butil::Mutex mutex;
+        butil::MRUCache<Key, Entry> entries;
+        int64_t bytes;
+        Shard() : entries(butil::MRUCache<Key, Entry>::NO_AUTO_EVICT)
+                , bytes(0) {}
+    };
+    static const size_t NSHARD = 16;
+
+    Shard* GetShard(const Key& key) { return &_shards[key.hash[0] % NSHARD]; }
+    // Remove the least recently used entries until the shard fits in
+    // `max_bytes'. Called with shard->mutex held.
+    void EvictLocked(Shard* shard, int64_t max_bytes);
+
+    const ClientResponseCacheOptions _options;
+    Shard _shards[NSHARD];
+    bvar::Adder<int64_t> _nhit;
+    bvar::Adder<int64_t> _nmiss;
+    bvar::Adder<int64_t> _memory;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_CLIENT_RESPONSE_CACHE_H
@@ -15,15 +15,28 @@
 // Authors: Rujie Jiang (jiangrujie@baidu.com)
 //          Ge,Jun (gejun@baidu.com)
 
+#include <gflags/gflags.h>
 #include "butil/logging.h"
+#include "bvar/bvar.h"
 #include "brpc/compress.h"
 #include "brpc/protocol.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/parallel_compress.h"
+#include "brpc/details/iobuf_block_tag.h"
 
 
 namespace brpc {
 
+DEFINE_int32(compress_accelerator_min_size, 4096, "Payloads smaller than "
+             "this value(in bytes) are not offloaded to CompressAccelerator");
+BRPC_VALIDATE_GFLAG(compress_accelerator_min_size, NonNegativeInteger);
+
 static const int MAX_HANDLER_SIZE = 1024;
 static CompressHandler s_handler_map[MAX_HANDLER_SIZE] = { { NULL, NULL, NULL } };
+static CompressAccelerator* s_accelerator_map[MAX_HANDLER_SIZE] = { NULL };
+// Created at the first registration of accelerators.
+static bvar::Adder<int64_t>* s_noffloaded = NULL;
+static bvar::Adder<int64_t>* s_nfallback = NULL;
 
 int RegisterCompressHandler(CompressType type, 
                             CompressHandler handler) {
@@ -44,6 +57,54 @@ int RegisterCompressHandler(CompressType type,
     return 0;
 }
 
+int RegisterCompressAccelerator(CompressType type,
+                                CompressAccelerator* accelerator) {
+    const int index = type;
+    if (accelerator == NULL || index < 0 || index >= MAX_HANDLER_SIZE ||
+        s_handler_map[index].Compress == NULL) {
+        LOG(ERROR) << "Invalid accelerator or CompressType=" << type
+                   << " without handler";
+        return -1;
+    }
+    if (s_accelerator_map[index] != NULL) {
+        LOG(ERROR) << "Accelerator of CompressType=" << type
+                   << " was registered";
+        return -1;
+    }
+    if (s_noffloaded == NULL) {
+        s_noffloaded = new bvar::Adder<int64_t>("rpc_compress_offloaded_count");
+        s_nfallback = new bvar::Adder<int64_t>("rpc_compress_fallback_count");
+    }
+    s_accelerator_map[index] = accelerator;
+    return 0;
+}
+
+inline CompressAccelerator* FindCompressAccelerator(CompressType type) {
+    const int index = type;
+    return (index >= 0 && index < MAX_HANDLER_SIZE ?
+            s_accelerator_map[index] : NULL);
+}
+
+// Compress or decompress `in' into `out' with `accelerator'. Returns false
+// if the device did not take or failed the job and nothing is appended to
+// `out', in which case the software handler should be used.
+static bool Offload(CompressAccelerator* accelerator, bool compress,
+                    const butil::IOBuf& in, butil::IOBuf* out) {
+    const size_t saved_size = out->size();
+    CompressDone done;
+    const int rc = (compress ? accelerator->SubmitCompress(in, out, &done)
+                    : accelerator->SubmitDecompress(in, out, &done));
+    if (rc == 0 && done.Wait()) {
+        *s_noffloaded << 1;
+        return true;
+    }
+    if (out->size() > saved_size) {
+        out->pop_back(out->size() - saved_size);
+    }
+    *s_nfallback << 1;
+    return false;
+}
+
 // Find CompressHandler by type.
 // Returns NULL if not found
 inline const CompressHandler* FindCompressHandler(CompressType type) {
@@ -62,10 +123,19 @@ const char* CompressTypeToCStr(CompressType type) {
     if (type == COMPRESS_TYPE_NONE) {
         return "none";
     }
+    if (type == COMPRESS_TYPE_AUTO) {
+        return "auto";
+    }
     const CompressHandler* handler = FindCompressHandler(type);
     return (handler != NULL ? handler->name : "unknown");
 }
 
+bool HasCompressHandler(CompressType type) {
+    const int index = type;
+    return index >= 0 && index < MAX_HANDLER_SIZE &&
+        s_handler_map[index].Compress != NULL;
+}
+
 void ListCompressHandler(std::vector<CompressHandler>* vec) {
     vec->clear();
     for (int i = 0; i < MAX_HANDLER_SIZE; ++i) {
@@ -83,6 +153,21 @@ bool ParseFromCompressedData(const butil::IOBuf& data,
     }
     const CompressHandler* handler = FindCompressHandler(compress_type);
     if (NULL != handler) {
+        if (policy::IsCompressedInParallel(data, compress_type)) {
+            butil::IOBuf binary_pb;
+            return policy::ParallelDecompress(data, compress_type,
+                                              msg->GetDescriptor(),
+                                              &binary_pb) &&
+                ParsePbFromIOBuf(msg, binary_pb);
+        }
+        CompressAccelerator* accelerator = FindCompressAccelerator(compress_type);
+        if (accelerator != NULL &&
+            data.size() >= (size_t)FLAGS_compress_accelerator_min_size) {
+            butil::IOBuf binary_pb;
+            if (Offload(accelerator, false, data, &binary_pb)) {
+                return ParsePbFromIOBuf(msg, binary_pb);
+            }
+        }
         return handler->Decompress(data, msg);
     }
     return false;
@@ -90,12 +175,35 @@ bool ParseFromCompressedData(const butil::IOBuf& data,
 
 bool SerializeAsCompressedData(const google::protobuf::Message& msg,
                                butil::IOBuf* buf, CompressType compress_type) {
+    // Offloading and parallel compression wait for other bthreads, only
+    // blocks created in this bthread are tagged.
     if (compress_type == COMPRESS_TYPE_NONE) {
+        butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_MESSAGE);
         butil::IOBufAsZeroCopyOutputStream wrapper(buf);
         return msg.SerializeToZeroCopyStream(&wrapper);
     }
     const CompressHandler* handler = FindCompressHandler(compress_type);
     if (NULL != handler) {
+        CompressAccelerator* accelerator = FindCompressAccelerator(compress_type);
+        if (accelerator != NULL &&
+            msg.ByteSize() >= FLAGS_compress_accelerator_min_size) {
+            butil::IOBuf serialized_pb;
+            if (!SerializeAsCompressedData(msg, &serialized_pb,
+                                           COMPRESS_TYPE_NONE)) {
+                return false;
+            }
+            if (Offload(accelerator, true, serialized_pb, buf)) {
+                return true;
+            }
+        }
+        if (policy::ShouldCompressInParallel(compress_type, msg)) {
+            butil::IOBuf serialized_pb;
+            return SerializeAsCompressedData(msg, &serialized_pb,
+                                             COMPRESS_TYPE_NONE) &&
+                policy::ParallelCompress(serialized_pb, compress_type,
+                                         msg.GetDescriptor(), buf);
+        }
+        butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_MESSAGE);
         return handler->Compress(msg, buf);
     }
     return false;
@@ -19,7 +19,9 @@
 #define BRPC_COMPRESS_H
 
 #include <google/protobuf/message.h>              // Message
+#include "butil/macros.h"                          // DISALLOW_COPY_AND_ASSIGN
 #include "butil/iobuf.h"                           // butil::IOBuf
+#include "bthread/countdown_event.h"               // bthread::CountdownEvent
 #include "brpc/options.pb.h"                     // CompressType
 
 namespace brpc {
@@ -44,9 +46,68 @@ int RegisterCompressHandler(CompressType type, CompressHandler handler);
 // Returns the `name' of the CompressType if registered
 const char* CompressTypeToCStr(CompressType type);
 
+// True if a handler is registered with `type'.
+bool HasCompressHandler(CompressType type);
+
 // Put all registered handlers into `vec'.
 void ListCompressHandler(std::vector<CompressHandler>* vec);
 
+// Notified by a CompressAccelerator when an offloaded job is finished,
+// which resumes the bthread waiting for the job.
+class CompressDone {
+public:
+    CompressDone() : _event(1), _success(false) {}
+
+    // Called exactly once by the accelerator in any thread when the job is
+    // finished. `success' is false if the device failed, in which case the
+    // job is redone by the software handler. The object may be destroyed
+    // once this function is called.
+    void Finish(bool success) {
+        _success = success;
+        _event.signal();
+    }
+
+    // Block until Finish() is called, returns the `success' passed.
+    bool Wait() {
+        _event.wait();
+        return _success;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CompressDone);
+    bthread::CountdownEvent _event;
+    bool _success;
+};
+
+// Offload compression of a CompressType to devices like Intel QAT or IAA.
+// Data produced by the device must be decodable by the software handler of
+// the type and vice versa, since peers and fallbacks may use either one.
+class CompressAccelerator {
+public:
+    virtual ~CompressAccelerator() {}
+
+    // Submit compressing `in' into `out' to the device. Blocks of `in' may
+    // be handed to the device one by one(see IOBuf::backing_block) without
+    // flattening. Returns 0 when the job is submitted and `done' will be
+    // finished later, -1 when the device does not take the job(e.g. it's
+    // saturated) and nothing is done, in which case the software handler
+    // is used instead. Don't block in this function.
+    virtual int SubmitCompress(const butil::IOBuf& in, butil::IOBuf* out,
+                               CompressDone* done) = 0;
+
+    // Submit decompressing `in' into `out' to the device, with the same
+    // semantics as SubmitCompress().
+    virtual int SubmitDecompress(const butil::IOBuf& in, butil::IOBuf* out,
+                                 CompressDone* done) = 0;
+};
+
+// [NOT thread-safe] Offload compressions of `type' which has a registered
+// handler to `accelerator'(not owned). Payloads smaller than
+// -compress_accelerator_min_size are always compressed by the handler.
+// Returns 0 on success, -1 otherwise.
+int RegisterCompressAccelerator(CompressType type,
+                                CompressAccelerator* accelerator);
+
 // Parse decompressed `data' as `msg' using registered `compress_type'.
 // Returns true on success, false otherwise
 bool ParseFromCompressedData(const butil::IOBuf& data,
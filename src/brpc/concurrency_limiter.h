@@ -0,0 +1,60 @@
+// Copyright (c) 2018 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_CONCURRENCY_LIMITER_H
+#define BRPC_CONCURRENCY_LIMITER_H
+
+#include "brpc/describable.h"
+#include "brpc/destroyable.h"
+#include "brpc/extension.h"                       // Extension<T>
+
+
+namespace brpc {
+
+// Decide whether a request to a method should be processed or rejected
+// with ELIMIT according to the concurrency of the method. Instances are
+// created by New() from the ones registered in ConcurrencyLimiterExtension()
+// and selected by Server::MaxConcurrencyOf("method") = "<name>".
+class ConcurrencyLimiter : public Describable, public Destroyable {
+public:
+    ConcurrencyLimiter() {}
+
+    // ====================================================================
+    //  All methods except New() and Destroy() must be thread-safe!
+    // ====================================================================
+
+    // Called when a request is about to be processed, `current_concurrency'
+    // is the number of requests being processed including this one.
+    // Returns false if the request should be rejected.
+    virtual bool OnRequested(int current_concurrency) = 0;
+
+    // Called when a request accepted by OnRequested() finished.
+    // `latency_us' is only meaningful when `success' is true.
+    virtual void OnResponded(bool success, int64_t latency_us) = 0;
+
+    // Current limit of concurrency, 0 means unlimited.
+    virtual int MaxConcurrency() const = 0;
+
+    // Create an instance for one method, which is Destroy()-ed by caller.
+    virtual ConcurrencyLimiter* New() const = 0;
+};
+
+inline Extension<const ConcurrencyLimiter>* ConcurrencyLimiterExtension() {
+    return Extension<const ConcurrencyLimiter>::instance();
+}
+
+} // namespace brpc
+
+
+#endif  // BRPC_CONCURRENCY_LIMITER_H
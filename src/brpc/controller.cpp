@@ -39,11 +39,15 @@
 #include "brpc/server.h"   // Server::_session_local_data_pool
 #include "brpc/simple_data_pool.h"
 #include "brpc/retry_policy.h"
+#include "brpc/backup_request_policy.h"
+#include "brpc/client_response_cache.h"
 #include "brpc/stream_impl.h"
 #include "brpc/policy/streaming_rpc_protocol.h" // FIXME
 #include "brpc/rpc_dump.pb.h"
 #include "brpc/details/usercode_backup_pool.h"  // RunUserCode
+#include "brpc/details/pb_arena.h"             // ReturnPooledPBArena
 #include "brpc/mongo_service_adaptor.h"
+#include "brpc/reloadable_flags.h"
 
 // Force linking the .o in UT (which analysis deps by inclusions)
 #include "brpc/parallel_channel.h"
@@ -67,6 +71,7 @@ BAIDU_REGISTER_ERRNO(brpc::ERTMPCREATESTREAM, "createStream was rejected by the
 BAIDU_REGISTER_ERRNO(brpc::EEOF, "Got EOF");
 BAIDU_REGISTER_ERRNO(brpc::EUNUSED, "The socket was not needed");
 BAIDU_REGISTER_ERRNO(brpc::ESSL, "SSL related operation failed");
+BAIDU_REGISTER_ERRNO(brpc::EPCHANENOUGH, "ParallelChannel got enough successful sub calls");
 BAIDU_REGISTER_ERRNO(brpc::ERDMA, "RDMA verbs error");
 BAIDU_REGISTER_ERRNO(brpc::ERDMACM, "RDMACM error");
 
@@ -82,6 +87,16 @@ namespace brpc {
 
 DEFINE_bool(graceful_quit_on_sigterm, false, "Register SIGTERM handle func to quit graceful");
 
+DEFINE_bool(rpc_deliver_timeout, true, "Send the remaining timeout along "
+            "with requests of baidu_std and http, servers drop requests "
+            "whose clients have given up before running user code");
+BRPC_VALIDATE_GFLAG(rpc_deliver_timeout, PassValidate);
+
+DEFINE_bool(rpc_inherit_deadline, true, "RPCs issued in the bthread "
+            "running a service method don't wait beyond the deadline of "
+            "the request being processed");
+BRPC_VALIDATE_GFLAG(rpc_inherit_deadline, PassValidate);
+
 const IdlNames idl_single_req_single_res = { "req", "res" };
 const IdlNames idl_single_req_multi_res = { "req", "" };
 const IdlNames idl_multi_req_single_res = { "", "res" };
@@ -130,6 +145,7 @@ Controller::Controller() {
 Controller::~Controller() {
     *g_ncontroller << -1;
     DeleteStuff();
+    delete _ext;
 }
 
 class IgnoreAllRead : public ProgressiveReader {
@@ -157,8 +173,6 @@ void Controller::DeleteStuff() {
     if (_session_local_data) {
         _server->_session_local_data_pool->Return(_session_local_data);
     }
-    _mongo_session_data.reset();
-    delete _rpc_dump_meta;
 
     if (!is_used_by_rpc() && _correlation_id != INVALID_BTHREAD_ID) {
         CHECK_NE(EPERM, bthread_id_cancel(_correlation_id));
@@ -178,28 +192,62 @@ void Controller::DeleteStuff() {
     delete _http_response;
     _request_attachment.clear();
     _response_attachment.clear();
-    if (_wpa) {
-        _wpa->MarkRPCAsDone(Failed());
-        _wpa.reset(NULL);
-    }
-    if (_rpa != NULL) {
-        if (!has_progressive_reader()) {
+    if (_ext) {
+        if (_ext->wpa) {
+            _ext->wpa->MarkRPCAsDone(Failed());
+        }
+        if (_ext->rpa != NULL && !has_progressive_reader()) {
             // Never called ReadProgressiveAttachmentBy (successfully), the data
             // is probably being buffered and a full buffer may block parse
             // handler of the protocol. We need to set a reader to consume
             // the buffer.
             pthread_once(&s_ignore_all_read_once, CreateIgnoreAllRead);
-            _rpa->ReadProgressiveAttachmentBy(s_ignore_all_read);
+            _ext->rpa->ReadProgressiveAttachmentBy(s_ignore_all_read);
         }
-        _rpa.reset(NULL);
+        _ext->Reset();
     }
-    delete _remote_stream_settings;
+    if (_pb_arena) {
+        // After messages on it which are not deleted separately.
+        ReturnPooledPBArena(_pb_arena);
+        _pb_arena = NULL;
+    }
+}
+
+Controller::Extension::Extension()
+    : rpc_dump_meta(NULL)
+    , remote_stream_settings(NULL)
+    , response_cache(NULL) {
+}
+
+Controller::Extension::~Extension() {
+    Reset();
+}
+
+void Controller::Extension::Reset() {
+    mongo_session_data.reset();
+    delete rpc_dump_meta;
+    rpc_dump_meta = NULL;
+    wpa.reset(NULL);
+    rpa.reset(NULL);
+    delete remote_stream_settings;
+    remote_stream_settings = NULL;
+    thrift_method_name.clear();
+    response_cache = NULL;
+}
+
+Controller::Extension* Controller::ext() {
+    if (_ext == NULL) {
+        _ext = new Extension;
+    }
+    return _ext;
 }
 
 void Controller::InternalReset(bool in_constructor) {
     if (!in_constructor) {
         DeleteStuff();
         CHECK(_unfinished_call == NULL);
+    } else {
+        _ext = NULL;
     }
     // NOTE: Make the sequence of assignments same with the order that they're
     // defined in header. Better for cpu cache and faster for lookup.
@@ -215,10 +263,13 @@ void Controller::InternalReset(bool in_constructor) {
     _server = NULL;
     _oncancel_id = INVALID_BTHREAD_ID;
     _auth_context = NULL;
-    _rpc_dump_meta = NULL;
+    _tenant_status = NULL;
+    _pb_arena = NULL;
     _request_protocol = PROTOCOL_UNKNOWN;
     _max_retry = UNSET_MAGIC_NUM;
     _retry_policy = NULL;
+    _backup_request_policy = NULL;
+    _retry_budget = NULL;
     _correlation_id = INVALID_BTHREAD_ID;
     _connection_type = CONNECTION_TYPE_UNKNOWN;
     _timeout_ms = UNSET_MAGIC_NUM;
@@ -228,6 +279,7 @@ void Controller::InternalReset(bool in_constructor) {
     _timeout_id = 0;
     _begin_time_us = 0;
     _end_time_us = 0;
+    _phase_times.Reset();
     _tos = 0;
     _preferred_index = -1;
     _request_compress_type = COMPRESS_TYPE_NONE;
@@ -253,8 +305,6 @@ void Controller::InternalReset(bool in_constructor) {
     _http_response = NULL;
     _request_stream = INVALID_STREAM_ID;
     _response_stream = INVALID_STREAM_ID;
-    _remote_stream_settings = NULL;
-    _thrift_method_name = "";
 }
 
 Controller::Call::Call(Controller::Call* rhs)
@@ -294,6 +344,47 @@ void Controller::set_timeout_ms(int64_t timeout_ms) {
     }
 }
 
+int64_t Controller::remaining_time_us() const {
+    if (_abstime_us < 0) {
+        return -1;
+    }
+    return std::max(_abstime_us - butil::fast_realtime_us(), (int64_t)0);
+}
+
+PooledPBArena* Controller::GetOrCreatePBArena() {
+    if (_pb_arena == NULL) {
+        _pb_arena = GetPooledPBArena();
+    }
+    return _pb_arena;
+}
+
+void* Controller::AllocateFromArena(size_t n) {
+    PooledPBArena* arena = GetOrCreatePBArena();
+    return arena ? AllocateOnPooledPBArena(arena, n) : NULL;
+}
+
+google::protobuf::Arena* Controller::arena() {
+    PooledPBArena* arena = GetOrCreatePBArena();
+    return arena ? GetPBArena(arena) : NULL;
+}
+
+// Not inlined since the bthread may be switched to another pthread between
+// the accesses to tls_bls.
+int64_t GetInheritedDeadline() {
+    const int64_t deadline_us = bthread::tls_bls.rpc_deadline_us;
+    return deadline_us > 0 ? deadline_us : -1;
+}
+
+ScopedInheritedDeadline::ScopedInheritedDeadline(const Controller* server_cntl)
+    : _saved_deadline_us(bthread::tls_bls.rpc_deadline_us) {
+    const int64_t deadline_us = server_cntl->deadline_us();
+    bthread::tls_bls.rpc_deadline_us = (deadline_us > 0 ? deadline_us : 0);
+}
+
+ScopedInheritedDeadline::~ScopedInheritedDeadline() {
+    bthread::tls_bls.rpc_deadline_us = _saved_deadline_us;
+}
+
 void Controller::set_backup_request_ms(int64_t timeout_ms) {
     if (timeout_ms <= 0x7fffffff) {
         _backup_request_ms = timeout_ms;
@@ -369,7 +460,8 @@ int ErrorCode2StatusCode(int error_code);
 
 inline void UpdateResponseHeader(Controller* cntl) {
     DCHECK(cntl->Failed());
-    if (cntl->request_protocol() == PROTOCOL_HTTP) {
+    if (cntl->request_protocol() == PROTOCOL_HTTP ||
+        cntl->request_protocol() == PROTOCOL_H2) {
         if (cntl->ErrorCode() != EHTTP) {
             // We assume that status code is already set along with EHTTP.
             cntl->http_response().set_status_code(
@@ -542,6 +634,36 @@ static void HandleTimeout(void* arg) {
     bthread_id_error(correlation_id, ERPCTIMEDOUT);
 }
 
+int Controller::AddTimeoutTimerWithoutBackup() {
+    if (timeout_ms() < 0) {
+        _timeout_id = 0;
+        return 0;
+    }
+    return bthread_timer_add(&_timeout_id,
+                             butil::microseconds_to_timespec(_abstime_us),
+                             HandleTimeout, (void*)_correlation_id.value);
+}
+
+void Controller::OnRPCEnd(int64_t end_time_us) {
+    _end_time_us = end_time_us;
+    if (has_flag(FLAGS_RESPONSE_FROM_CACHE)) {
+        // Not a RPC to servers.
+        return;
+    }
+    if (_backup_request_policy) {
+        _backup_request_policy->OnRPCEnd(this);
+    }
+    if (_retry_budget && !FailedInline()) {
+        _retry_budget->Deposit();
+    }
+    if (_ext != NULL && _ext->response_cache != NULL && !FailedInline()) {
+        _ext->response_cache->Put(
+            ClientResponseCache::MakeKey(_method, _request_buf,
+                                         _request_attachment),
+            *_response, _response_attachment);
+    }
+}
+
 void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
                                         bool new_bthread, int saved_error) {
     // Intercept errors from previous calls because handling these errors
@@ -559,7 +681,8 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
         return;
     }
     if ((!_error_code && _retry_policy == NULL) ||
-        _current_call.nretry >= _max_retry) {
+        _current_call.nretry >= _max_retry ||
+        has_flag(FLAGS_RESPONSE_FROM_CACHE)) {
         goto END_OF_RPC;
     }
     if (_error_code == EBACKUPREQUEST) {
@@ -595,9 +718,10 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
         }
         ++_current_call.nretry;
         add_flag(FLAGS_BACKUP_REQUEST);
-        return IssueRPC(butil::gettimeofday_us());
-    } else if (_retry_policy ? _retry_policy->DoRetry(this)
-               : DefaultRetryPolicy()->DoRetry(this)) {
+        return IssueRPC(butil::fast_realtime_us());
+    } else if ((_retry_policy ? _retry_policy->DoRetry(this)
+                : DefaultRetryPolicy()->DoRetry(this)) &&
+               (_retry_budget == NULL || _retry_budget->Withdraw())) {
         // The error must come from _current_call because:
         //  * we intercepted error from _unfinished_call in OnVersionedRPCReturned
         //  * ERPCTIMEDOUT/ECANCELED are not retrying error by default.
@@ -623,7 +747,7 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
         }
         response_attachment().clear();
         
-        return IssueRPC(butil::gettimeofday_us());
+        return IssueRPC(butil::fast_realtime_us());
     }
     
 END_OF_RPC:
@@ -701,12 +825,13 @@ void Controller::Call::OnComplete(Controller* c, int error_code/*note*/,
     case CONNECTION_TYPE_UNKNOWN:
         break;
     case CONNECTION_TYPE_SINGLE:
-        // Set main socket to be failed for connection refusal of streams.
+        // Set main socket to be failed for connection refusal of streams
+        // or multiplexed sockets (-single_connection_num).
         // "single" streams are often maintained in a separate SocketMap and
         // different from the main socket as well.
-        if (c->_stream_creator != NULL &&
-            does_error_affect_main_socket(error_code) &&
-            (sending_sock == NULL || sending_sock->id() != peer_id)) {
+        if (does_error_affect_main_socket(error_code) &&
+            (sending_sock == NULL ? c->_stream_creator != NULL :
+             sending_sock->id() != peer_id)) {
             Socket::SetFailed(peer_id);
         }
         break;
@@ -768,14 +893,33 @@ void Controller::Call::OnComplete(Controller* c, int error_code/*note*/,
     // Release the `Socket' we used to send/receive data
     sending_sock.reset(NULL);
     
-    if (need_feedback) {
+    const bool feed_circuit_breaker =
+        (c->_lb != NULL && c->has_flag(FLAGS_ENABLED_CIRCUIT_BREAKER));
+    if (need_feedback || feed_circuit_breaker) {
         const LoadBalancer::CallInfo info =
             { begin_time_us, peer_id, error_code, c };
-        c->_lb->Feedback(info);
+        if (feed_circuit_breaker) {
+            c->_lb->FeedbackCircuitBreaker(info);
+        }
+        if (need_feedback) {
+            c->_lb->Feedback(info);
+        }
     }
 }
 
+// Run `done' of an asynchronous RPC and record client-side phases of the
+// RPC. `times' is copied because `done' may delete the controller.
+static void RunDoneAndRecordPhases(
+    google::protobuf::Closure* done,
+    const google::protobuf::MethodDescriptor* method,
+    const RpcPhaseTimes times) {
+    const int64_t start_us = butil::cpuwide_time_us();
+    done->Run();
+    RecordClientPhases(method, times, butil::cpuwide_time_us() - start_us);
+}
+
 void Controller::EndRPC(const CompletionInfo& info) {
+    _phase_times.Mark(RPC_CLIENT_PARSED);
     if (_timeout_id != 0) {
         bthread_timer_del(_timeout_id);
         _timeout_id = 0;
@@ -870,9 +1014,13 @@ void Controller::EndRPC(const CompletionInfo& info) {
             // Join is not signalled when the done does not Run() and the done
             // can't Run() because all backup threads are blocked by Join().
             
-            OnRPCEnd(butil::gettimeofday_us());
+            OnRPCEnd(butil::fast_realtime_us());
             const bool destroy_cid_in_done = has_flag(FLAGS_DESTROY_CID_IN_DONE);
-            _done->Run();
+            if (FLAGS_rpc_phase_latency && _error_code == 0) {
+                RunDoneAndRecordPhases(_done, _method, _phase_times);
+            } else {
+                _done->Run();
+            }
             // NOTE: Don't touch this Controller anymore, because it's likely to be
             // deleted by done.
             if (!destroy_cid_in_done) {
@@ -901,10 +1049,14 @@ void Controller::RunDoneInBackupThread(void* arg) {
 void Controller::DoneInBackupThread() {
     // OnRPCEnd for sync RPC is called in Channel::CallMethod to count in
     // latency of the context-switch.
-    OnRPCEnd(butil::gettimeofday_us());
+    OnRPCEnd(butil::fast_realtime_us());
     const CallId saved_cid = _correlation_id;
     const bool destroy_cid_in_done = has_flag(FLAGS_DESTROY_CID_IN_DONE);
-    _done->Run();
+    if (FLAGS_rpc_phase_latency && _error_code == 0) {
+        RunDoneAndRecordPhases(_done, _method, _phase_times);
+    } else {
+        _done->Run();
+    }
     // NOTE: Don't touch fields of controller anymore, it may be deleted.
     if (!destroy_cid_in_done) {
         CHECK_EQ(0, bthread_id_unlock_and_destroy(saved_cid));
@@ -938,6 +1090,16 @@ void Controller::HandleSendFailed() {
     OnVersionedRPCReturned(info, new_bthread, _error_code);
 }
 
+void Controller::HandleResponseFromCache() {
+    add_flag(FLAGS_RESPONSE_FROM_CACHE);
+    _error_code = 0;
+    const CompletionInfo info = { current_id(), true };
+    // Same as HandleSendFailed(), don't run async done in-place.
+    const bool new_bthread =
+        (_done != NULL && !is_done_allowed_to_run_in_place());
+    OnVersionedRPCReturned(info, new_bthread, 0);
+}
+
 void Controller::IssueRPC(int64_t start_realtime_us) {
     _current_call.begin_time_us = start_realtime_us;
     // Clear last error, Don't clear _error_text because we append to it.
@@ -982,7 +1144,9 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
             { start_realtime_us, true,
               has_request_code(), _request_code, _accessed };
         LoadBalancer::SelectOut sel_out(&tmp_sock);
-        const int rc = _lb->SelectServer(sel_in, &sel_out);
+        const int rc = (has_flag(FLAGS_ENABLED_CIRCUIT_BREAKER) ?
+                        _lb->SelectServerWithCircuitBreaker(sel_in, &sel_out) :
+                        _lb->SelectServer(sel_in, &sel_out));
         if (rc != 0) {
             std::ostringstream os;
             DescribeOptions opt;
@@ -1022,7 +1186,26 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
     if (_connection_type == CONNECTION_TYPE_SINGLE ||
         _stream_creator != NULL) { // let user decides the sending_socket
         // in the callback(according to connection_type) directly
-        _current_call.sending_sock.reset(tmp_sock.release());
+        if (_stream_creator == NULL) {
+            // Spread over multiplexed sockets to the server. Streams are
+            // long-lived and spread in round-robin rather than by threads.
+            int index = -1;
+            if (_request_stream != INVALID_STREAM_ID) {
+                static butil::static_atomic<int> s_nstream =
+                    BUTIL_STATIC_ATOMIC_INIT(0);
+                index = s_nstream.fetch_add(1, butil::memory_order_relaxed)
+                    & 0x7FFFFFFF;
+            }
+            if (Socket::GetMultiplexedSocket(
+                    tmp_sock.get(), &_current_call.sending_sock, index) != 0) {
+                tmp_sock.reset();
+                SetFailed(EINTERNAL, "Fail to get single connection");
+                return HandleSendFailed();
+            }
+            tmp_sock.reset();
+        } else {
+            _current_call.sending_sock.reset(tmp_sock.release());
+        }
         // TODO(gejun): Setting preferred index of single-connected socket
         // has two issues:
         //   1. race conditions. If a set perferred_index is overwritten by
@@ -1123,6 +1306,7 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
         packet_size = packet.size();
         rc = _current_call.sending_sock->Write(&packet, &wopt);
     }
+    _phase_times.Mark(RPC_CLIENT_WRITTEN);
     if (span) {
         if (_current_call.nretry == 0) {
             span->set_sent_us(butil::cpuwide_time_us());
@@ -1170,6 +1354,12 @@ int Controller::HandleSocketFailed(bthread_id_t id, void* data, int error_code,
                         cntl->timeout_ms(),
                         butil::endpoint2str(cntl->remote_side()).c_str());
     } else if (error_code == EBACKUPREQUEST) {
+        if (cntl->_backup_request_policy != NULL &&
+            !cntl->_backup_request_policy->DoBackup(cntl) &&
+            cntl->AddTimeoutTimerWithoutBackup() == 0) {
+            // Keep waiting for the ongoing call.
+            return bthread_id_unlock(id);
+        }
         cntl->SetFailed(error_code, "Reached backup timeout=%" PRId64 "ms @%s",
                         cntl->backup_request_ms(),
                         butil::endpoint2str(cntl->remote_side()).c_str());
@@ -1275,7 +1465,7 @@ void Controller::HandleStreamConnection(Socket *host_socket) {
                 SetFailed(EREQUEST, "Request stream=%" PRIu64 " was closed before responded",
                                      _request_stream);
             }
-        } else if (_remote_stream_settings == NULL) {
+        } else if (!has_remote_stream()) {
             if (!FailedInline()) {
                 SetFailed(EREQUEST, "The server didn't accept the stream");
             }
@@ -1283,14 +1473,14 @@ void Controller::HandleStreamConnection(Socket *host_socket) {
     }
     if (FailedInline()) {
         Stream::SetFailed(_request_stream);
-        if (_remote_stream_settings != NULL) {
+        if (has_remote_stream()) {
             policy::SendStreamRst(host_socket, 
-                                  _remote_stream_settings->stream_id());
+                                  _ext->remote_stream_settings->stream_id());
         }
         return;
     }
     Stream* s = (Stream*)ptr->conn();
-    s->SetConnected(_remote_stream_settings);
+    s->SetConnected(_ext->remote_stream_settings);
 }
 
 // TODO: Need more security advices from professionals.
@@ -1310,8 +1500,9 @@ void WebEscape(const std::string& source, std::string* output) {
 }
 
 void Controller::reset_rpc_dump_meta(RpcDumpMeta* meta) { 
-    delete _rpc_dump_meta;
-    _rpc_dump_meta = meta;
+    Extension* e = ext();
+    delete e->rpc_dump_meta;
+    e->rpc_dump_meta = meta;
 }
 
 ProgressiveAttachment*
@@ -1336,7 +1527,7 @@ Controller::CreateProgressiveAttachment(StopStyle stop_style) {
     }
     ProgressiveAttachment* pb = new ProgressiveAttachment(
         httpsock, http_request().before_http_1_1());
-    _wpa.reset(pb);
+    ext()->wpa.reset(pb);
     return pb;
 }
 
@@ -1345,13 +1536,13 @@ void Controller::ReadProgressiveAttachmentBy(ProgressiveReader* r) {
         LOG(FATAL) << "Param[r] is NULL";
         return;
     }
-    if (!is_response_read_progressively()) {
+    if (!is_response_read_progressively() && !is_request_read_progressively()) {
         return r->OnEndOfMessage(
             butil::Status(EINVAL, "Can't read progressive attachment from a "
                          "controller without calling "
                          "response_will_be_read_progressively() before"));
     }
-    if (_rpa == NULL) {
+    if (_ext == NULL || _ext->rpa == NULL) {
         return r->OnEndOfMessage(
             butil::Status(EINVAL, "ReadableProgressiveAttachment is NULL"));
     }
@@ -1361,11 +1552,11 @@ void Controller::ReadProgressiveAttachmentBy(ProgressiveReader* r) {
                          __FUNCTION__));
     }
     add_flag(FLAGS_PROGRESSIVE_READER);
-    return _rpa->ReadProgressiveAttachmentBy(r);
+    return _ext->rpa->ReadProgressiveAttachmentBy(r);
 }
 
 void Controller::set_mongo_session_data(MongoContext* data) {
-    _mongo_session_data = data;
+    ext()->mongo_session_data = data;
 }
 
 bool Controller::is_ssl() const {
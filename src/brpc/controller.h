@@ -40,6 +40,7 @@
 #include "brpc/callback.h"
 #include "brpc/progressive_attachment.h"       // ProgressiveAttachment
 #include "brpc/progressive_reader.h"           // ProgressiveReader
+#include "brpc/details/rpc_phase.h"            // RpcPhaseTimes
 
 // EAUTH is defined in MAC
 #ifndef EAUTH
@@ -50,6 +51,12 @@ extern "C" {
 struct x509_st;
 }
 
+namespace google {
+namespace protobuf {
+class Arena;
+}
+}
+
 namespace brpc {
 class Span;
 class Server;
@@ -60,7 +67,12 @@ class StreamSettings;
 class RpcDumpMeta;
 class MongoContext;
 class RetryPolicy;
+class BackupRequestPolicy;
+class RetryBudget;
+class ClientResponseCache;
 class InputMessageBase;
+class TenantStatus;
+class PooledPBArena;
 namespace policy {
 class OnServerStreamCreated;
 void ProcessMongoRequest(InputMessageBase*);
@@ -102,6 +114,9 @@ friend class ParallelChannelDone;
 friend class ControllerPrivateAccessor;
 friend class ServerPrivateAccessor;
 friend class SelectiveChannel;
+friend class BatchChannel;
+friend class ShardedMemcacheChannel;
+friend class RedisClusterChannel;
 friend class schan::Sender;
 friend class schan::SubDone;
 friend class policy::OnServerStreamCreated;
@@ -126,6 +141,19 @@ friend void policy::ProcessMongoRequest(InputMessageBase*);
     static const uint32_t FLAGS_ALLOW_DONE_TO_RUN_IN_PLACE = (1 << 12);
     static const uint32_t FLAGS_USED_BY_RPC = (1 << 13);
     static const uint32_t FLAGS_REQUEST_WITH_AUTH = (1 << 15);
+    // _request_buf was serialized by ParallelChannel and shared with other
+    // sub calls.
+    static const uint32_t FLAGS_REQUEST_SERIALIZED = (1 << 14);
+    // Got from the object pool, see NewServerController()
+    static const uint32_t FLAGS_FROM_POOL = (1 << 16);
+    // Feed circuit breakers of servers, see ChannelOptions
+    static const uint32_t FLAGS_ENABLED_CIRCUIT_BREAKER = (1 << 17);
+    // Request and response of the server are on _pb_arena
+    static const uint32_t FLAGS_MESSAGES_ON_ARENA = (1 << 20);
+    // The response was got from ClientResponseCache, see ChannelOptions
+    static const uint32_t FLAGS_RESPONSE_FROM_CACHE = (1 << 18);
+    // Don't look up ClientResponseCache, set by calls refreshing the cache
+    static const uint32_t FLAGS_BYPASS_RESPONSE_CACHE = (1 << 19);
     
 public:
     Controller();
@@ -166,6 +194,11 @@ public:
     // True if a backup request was sent during the RPC.
     bool has_backup_request() const { return has_flag(FLAGS_BACKUP_REQUEST); }
 
+    // True if the response was got from ChannelOptions.response_cache
+    // without sending the RPC.
+    bool response_from_cache() const
+    { return has_flag(FLAGS_RESPONSE_FROM_CACHE); }
+
     // Get latency of the RPC call.
     int64_t latency_us() const { return _end_time_us - _begin_time_us; }
 
@@ -236,7 +269,8 @@ public:
     // Get/own RpcDumpMeta for sending dumped requests.
     // Deleted along with controller.
     void reset_rpc_dump_meta(RpcDumpMeta* meta);
-    const RpcDumpMeta* rpc_dump_meta() { return _rpc_dump_meta; }
+    const RpcDumpMeta* rpc_dump_meta()
+    { return _ext ? _ext->rpc_dump_meta : NULL; }
 
     // Attach a StreamCreator to this RPC. Notice that controller never deletes
     // the StreamCreator, you can do the deletion inside OnStreamCreationDone.
@@ -249,7 +283,15 @@ public:
     // True if response_will_be_read_progressively() was called.
     bool is_response_read_progressively() const { return has_flag(FLAGS_READ_PROGRESSIVELY); }
 
-    // Read the remaining body after RPC:
+    // [Server-side] True if the method was called before the body of the
+    // http request was fully read, which is enabled by
+    // ServiceOptions.enable_progressive_read. Read the body by
+    // ReadProgressiveAttachmentBy().
+    bool is_request_read_progressively() const
+    { return _server != NULL && _ext != NULL && _ext->rpa != NULL; }
+
+    // Read the remaining body after RPC, or the remaining body of the
+    // request at server-side when is_request_read_progressively() is true:
     // - This function can only be called once.
     // - If user called response_will_be_read_progressively() but
     //   ReadProgressiveAttachmentBy(), controller will set a reader ignoring
@@ -258,6 +300,8 @@ public:
     //   ReadProgressiveAttachmentBy(), the reader is Destroyed() immediately.
     // - Any error occurred will destroy the reader by calling r->Destroy().
     // - r->Destroy() is guaranteed to be called once and only once.
+    // - The reader is called in the thread parsing the connection, blocking
+    //   OnReadOnePart() stops reading more data from the connection.
     void ReadProgressiveAttachmentBy(ProgressiveReader* r);
     
     // True if ReadProgressiveAttachmentBy() was ever called successfully.
@@ -335,7 +379,7 @@ public:
     // Default value of `stop_style' is WAIT_FOR_STOP.
     ProgressiveAttachment*
     CreateProgressiveAttachment(StopStyle stop_style = WAIT_FOR_STOP);
-    bool has_progressive_writer() const { return _wpa != NULL; }
+    bool has_progressive_writer() const { return _ext && _ext->wpa != NULL; }
 
     // Set compression method for response.
     void set_response_compress_type(CompressType t) { _response_compress_type = t; }
@@ -368,7 +412,15 @@ public:
     void* session_local_data();
 
     // Get the data attached to a mongo session(practically a socket).
-    MongoContext* mongo_session_data() { return _mongo_session_data.get(); }
+    MongoContext* mongo_session_data()
+    { return _ext ? _ext->mongo_session_data.get() : NULL; }
+
+    // Serialized(and decompressed) request of methods parsing requests
+    // lazily, see Server::SetParseRequestLazily(). The data references the
+    // buffer received from network without copying and the request message
+    // passed to the method is left empty. Parse it with ParsePbFromIOBuf()
+    // after cutting big bytes fields out by CutPbBytesField().
+    butil::IOBuf& unparsed_request() { return _request_buf; }
     
     // -------------------------------------------------------------------
     //                      Both-side methods.
@@ -390,6 +442,33 @@ public:
     // Protocol of the request sent by client or received by server.
     ProtocolType request_protocol() const { return _request_protocol; }
 
+    // Client-side: when this RPC times out, set when the RPC starts.
+    // Server-side: when the client stops waiting for the response, computed
+    // from the timeout sent by client (baidu_std and http only). Expired
+    // requests are dropped before running user code, RPCs issued in the
+    // same bthread of the service method don't wait beyond it.
+    // Microseconds since the Epoch, -1 if there's no deadline.
+    int64_t deadline_us() const { return _abstime_us; }
+
+    // Microseconds left before deadline_us(), 0 if it has passed, -1 if
+    // there's no deadline.
+    int64_t remaining_time_us() const;
+
+    // Allocate `n' bytes aligned to 8 which are freed all at once when the
+    // controller is reset or destroyed, e.g. after the response is sent at
+    // server-side. The memory is from an arena pooled across RPCs which also
+    // holds request and response of methods using arenas(see
+    // Server::SetUseArena), so that temporary allocations of the RPC are
+    // mostly pointer bumps. Destructors are not called: use arena() for
+    // objects with non-trivial destructors.
+    // Returns NULL on failure.
+    void* AllocateFromArena(size_t n);
+
+    // The protobuf arena behind AllocateFromArena() for creating messages or
+    // objects with google::protobuf::Arena::Create*(), which are destroyed
+    // along with the arena. NULL if protobuf does not support arenas(< 3.0).
+    google::protobuf::Arena* arena();
+
     // Resets the Controller to its initial state so that it may be reused in
     // a new call.  Must NOT be called while an RPC is in progress.
     void Reset() { InternalReset(false); }
@@ -432,7 +511,8 @@ public:
     const butil::IOBuf& response_attachment() const { return _response_attachment; }
 
     // Return true if the remote side creates a stream.
-    bool has_remote_stream() { return _remote_stream_settings != NULL; }
+    bool has_remote_stream()
+    { return _ext && _ext->remote_stream_settings != NULL; }
 
     // The id to cancel RPC call or join response.
     CallId call_id();
@@ -452,9 +532,10 @@ public:
     int64_t idl_result() const { return _idl_result; }
 
     void set_thrift_method_name(const std::string& method_name) {
-        _thrift_method_name = method_name;
+        ext()->thrift_method_name = method_name;
     }
-    std::string thrift_method_name() { return _thrift_method_name; }
+    std::string thrift_method_name()
+    { return _ext ? _ext->thrift_method_name : std::string(); }
 
 private:
     struct CompletionInfo {
@@ -487,6 +568,11 @@ private:
     static int HandleSocketFailed(bthread_id_t, void* data, int error_code,
                                   const std::string& error_text);
     void HandleSendFailed();
+    // End the RPC whose response was filled by ClientResponseCache.
+    void HandleResponseFromCache();
+
+    // Get _pb_arena from the pool if it's NULL.
+    PooledPBArena* GetOrCreatePBArena();
 
     static int RunOnCancel(bthread_id_t, void* data, int error_code);
     
@@ -574,9 +660,11 @@ private:
         _end_time_us = begin_time_us;
     }
 
-    void OnRPCEnd(int64_t end_time_us) {
-        _end_time_us = end_time_us;
-    }
+    void OnRPCEnd(int64_t end_time_us);
+
+    // Replace the fired backup timer with the timer of RPC timeout when
+    // BackupRequestPolicy declines the backup request.
+    int AddTimeoutTimerWithoutBackup();
 
     static void RunDoneInBackupThread(void*);
     void DoneInBackupThread();
@@ -588,6 +676,32 @@ private:
     { return t ? add_flag(f) : clear_flag(f); }
     inline bool has_flag(uint32_t f) const { return _flags & f; }
 
+    // Fields used by few protocols or features. They're allocated at the
+    // first write and reused by following RPCs after Reset(), so that
+    // commonly used fields stay in fewer cachelines and Reset() does not
+    // touch them at all when they're never used.
+    struct Extension {
+        Extension();
+        ~Extension();
+        // Release resources and set fields to initial state.
+        void Reset();
+
+        butil::intrusive_ptr<MongoContext> mongo_session_data;
+        RpcDumpMeta* rpc_dump_meta;
+        // Writable progressive attachment
+        butil::intrusive_ptr<ProgressiveAttachment> wpa;
+        // Readable progressive attachment
+        butil::intrusive_ptr<ReadableProgressiveAttachment> rpa;
+        // Defined at both sides
+        StreamSettings* remote_stream_settings;
+        // Thrift method name, only used when thrift protocol enabled
+        std::string thrift_method_name;
+        // Cache the response when the client-side RPC succeeds
+        ClientResponseCache* response_cache;
+    };
+
+    Extension* ext();
+
     void set_used_by_rpc() { add_flag(FLAGS_USED_BY_RPC); }
     bool is_used_by_rpc() const { return has_flag(FLAGS_USED_BY_RPC); }
 
@@ -605,14 +719,18 @@ private:
     const Server* _server;
     bthread_id_t _oncancel_id;
     const AuthContext* _auth_context;        // Authentication result
-    butil::intrusive_ptr<MongoContext> _mongo_session_data;
-    RpcDumpMeta* _rpc_dump_meta;
+    TenantStatus* _tenant_status;  // Set when admitted by tenant quotas
+    // Owns request and response of servers using arenas and allocations
+    // from AllocateFromArena()
+    PooledPBArena* _pb_arena;
 
     ProtocolType _request_protocol;
     // Some of them are copied from `Channel' which might be destroyed
     // after CallMethod.
     int _max_retry;
     const RetryPolicy* _retry_policy;
+    BackupRequestPolicy* _backup_request_policy;
+    RetryBudget* _retry_budget;
     // Synchronization object for one RPC call. It remains unchanged even 
     // when retry happens. Synchronous RPC will wait on this id.
     CallId _correlation_id;
@@ -628,7 +746,8 @@ private:
     int32_t _timeout_ms;
     int32_t _connect_timeout_ms;
     int32_t _backup_request_ms;
-    // Deadline of this RPC (since the Epoch in microseconds).
+    // Deadline of this RPC (since the Epoch in microseconds). Computed from
+    // the timeout sent by client on server-side.
     int64_t _abstime_us;
     // Timer registered to trigger RPC timeout event
     bthread_timer_t _timeout_id;
@@ -636,6 +755,8 @@ private:
     // Begin/End time of a single RPC call (since Epoch in microseconds)
     int64_t _begin_time_us;
     int64_t _end_time_us;
+    // When the RPC reached its phases, set when -rpc_phase_latency is on.
+    RpcPhaseTimes _phase_times;
     short _tos;    // Type of service.
     // The index of parse function which `InputMessenger' will use
     int _preferred_index;
@@ -663,6 +784,7 @@ private:
     Protocol::PackRequest _pack_request;
     const google::protobuf::MethodDescriptor* _method;
     const Authenticator* _auth;
+    // Serialized request at client-side, unparsed request at server-side.
     butil::IOBuf _request_buf;
     IdlNames _idl_names;
     int64_t _idl_result;
@@ -674,22 +796,14 @@ private:
     butil::IOBuf _request_attachment;
     butil::IOBuf _response_attachment;
 
-    // Writable progressive attachment
-    butil::intrusive_ptr<ProgressiveAttachment> _wpa;
-    // Readable progressive attachment
-    butil::intrusive_ptr<ReadableProgressiveAttachment> _rpa;
-
     // TODO: Replace following fields with StreamCreator
     // Defined at client side
     StreamId _request_stream;
     // Defined at server side
     StreamId _response_stream;
-    // Defined at both sides
-    StreamSettings *_remote_stream_settings;
 
-    // Thrift method name, only used when thrift protocol enabled
-    std::string _thrift_method_name;
-    uint32_t _thrift_seq_id;
+    // Rarely used fields, NULL until being written.
+    Extension* _ext;
 };
 
 // Advises the RPC system that the caller desires that the RPC call be
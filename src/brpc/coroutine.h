@@ -0,0 +1,141 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_COROUTINE_H
+#define BRPC_COROUTINE_H
+
+// C++20 coroutine interface of RPCs. Everything in this file is defined only
+// when the including file is compiled with coroutine support (e.g. -std=c++20
+// of gcc >= 10), the library itself remains C++11.
+//
+// Client-side:
+//   brpc::Controller cntl;
+//   co_await brpc::Await(&stub, &EchoService_Stub::Echo, &cntl, &req, &res);
+//   if (cntl.Failed()) { ... }
+//
+// Server-side, the method returns at the first co_await so that the bthread
+// running it (and its stack) is released while the RPCs are in flight:
+//   brpc::CoTask EchoImpl(brpc::Controller* cntl, const EchoRequest* req,
+//                         EchoResponse* res, google::protobuf::Closure* done) {
+//       brpc::ClosureGuard done_guard(done);
+//       co_await brpc::Await(&stub, &EchoService_Stub::Echo, ...);
+//       ...
+//   }
+//   void Echo(google::protobuf::RpcController* cntl_base, const EchoRequest* req,
+//             EchoResponse* res, google::protobuf::Closure* done) {
+//       EchoImpl(static_cast<brpc::Controller*>(cntl_base), req, res, done);
+//   }
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <exception>
+#include <google/protobuf/stubs/common.h>      // google::protobuf::Closure
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "brpc/controller.h"
+
+namespace brpc {
+
+// Awaiting this object starts an asynchronous RPC and suspends the coroutine
+// until the RPC ends. The coroutine is resumed in the thread running the
+// done of the RPC, generally a bthread worker, without creating a bthread.
+// If the RPC ends before the coroutine is suspended (e.g. failed to select
+// a server), the coroutine does not suspend at all.
+// `StartFn' is called as `fn(google::protobuf::Closure* done)' and must
+// start an asynchronous call which runs `done' once at the end.
+template <typename StartFn>
+class CallAwaiter : public google::protobuf::Closure {
+public:
+    explicit CallAwaiter(StartFn fn) : _fn(fn), _state(STARTING) {}
+
+    bool await_ready() const { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        _handle = h;
+        _fn(this);
+        // Run() may be called before this line in the same or another thread.
+        int expected = STARTING;
+        return _state.compare_exchange_strong(
+            expected, SUSPENDED, butil::memory_order_acq_rel);
+    }
+
+    void await_resume() const {}
+
+    // @google::protobuf::Closure, called at the end of the RPC. Unlike most
+    // closures of brpc, this object is owned by the coroutine frame.
+    void Run() {
+        if (_state.exchange(ENDED, butil::memory_order_acq_rel) == SUSPENDED) {
+            _handle.resume();
+        }
+    }
+
+private:
+    enum State { STARTING, SUSPENDED, ENDED };
+
+    StartFn _fn;
+    butil::atomic<int> _state;
+    std::coroutine_handle<> _handle;
+};
+
+// co_await AwaitCall([&](google::protobuf::Closure* done) {
+//     channel.CallMethod(method, &cntl, &req, &res, done);
+// });
+template <typename StartFn>
+inline CallAwaiter<StartFn> AwaitCall(StartFn fn) {
+    return CallAwaiter<StartFn>(fn);
+}
+
+// co_await Await(&stub, &EchoService_Stub::Echo, &cntl, &req, &res);
+// The arguments must stay valid until the co_await returns, which is always
+// true for objects on the coroutine frame.
+template <typename Stub, typename Request, typename Response>
+inline auto Await(Stub* stub,
+                  void (Stub::*method)(google::protobuf::RpcController*,
+                                       const Request*, Response*,
+                                       google::protobuf::Closure*),
+                  Controller* cntl, const Request* request,
+                  Response* response) {
+    return AwaitCall([=](google::protobuf::Closure* done) {
+            (stub->*method)(cntl, request, response, done);
+        });
+}
+
+// Return type of coroutines which start immediately when being called, run
+// until the first suspension and then return to the caller, destroying
+// themselves after finishing. Nobody waits for them, so they fit handlers
+// of server methods which signal the end of RPC by calling `done'.
+// Exceptions escaping the coroutine are fatal.
+class CoTask {
+public:
+    struct promise_type {
+        CoTask get_return_object() { return CoTask(); }
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept {
+            return std::suspend_never();
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            LOG(FATAL) << "Uncaught exception in brpc::CoTask";
+            std::terminate();
+        }
+    };
+};
+
+} // namespace brpc
+
+#endif  // __cpp_impl_coroutine
+
+#endif  // BRPC_COROUTINE_H
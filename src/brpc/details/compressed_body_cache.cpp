@@ -0,0 +1,92 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <pthread.h>
+#include <gflags/gflags.h>
+#include "butil/containers/mru_cache.h"
+#include "butil/crc32c.h"
+#include "butil/scoped_lock.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/gzip_compress.h"
+#include "brpc/details/compressed_body_cache.h"
+
+namespace brpc {
+
+DEFINE_int32(http_compressed_body_cache_size, 0,
+             "Max number of gzip-compressed http bodies cached for identical "
+             "responses, 0 disables the cache. Both the original and the "
+             "compressed body are kept in memory");
+BRPC_VALIDATE_GFLAG(http_compressed_body_cache_size, NonNegativeInteger);
+
+DEFINE_int32(http_compressed_body_cache_max_body_size, 1048576,
+             "Http bodies larger than so many bytes are compressed without "
+             "being cached");
+BRPC_VALIDATE_GFLAG(http_compressed_body_cache_max_body_size, PositiveInteger);
+
+namespace {
+struct CompressedBody {
+    butil::IOBuf original;
+    butil::IOBuf compressed;
+};
+// Keyed by size and crc32c of the original body. Different bodies with
+// the same key are told apart by comparing `original'.
+typedef butil::MRUCache<uint64_t, CompressedBody> CompressedBodyCache;
+} // namespace
+
+static pthread_mutex_t s_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Sized by the flag after each insertion so that it's reloadable.
+static CompressedBodyCache* s_cache = NULL;
+
+bool GzipCompressWithCache(const butil::IOBuf& body, butil::IOBuf* out) {
+    const int max_entries = FLAGS_http_compressed_body_cache_size;
+    if (max_entries <= 0 ||
+        body.size() > (size_t)FLAGS_http_compressed_body_cache_max_body_size) {
+        return policy::GzipCompress(body, out, NULL);
+    }
+    const uint64_t key =
+        ((uint64_t)body.size() << 32) | butil::crc32c::Value(body);
+    CompressedBody cached;
+    {
+        BAIDU_SCOPED_LOCK(s_cache_mutex);
+        if (s_cache == NULL) {
+            s_cache = new CompressedBodyCache(CompressedBodyCache::NO_AUTO_EVICT);
+        }
+        CompressedBodyCache::iterator it = s_cache->Get(key);
+        if (it != s_cache->end()) {
+            // Copying IOBuf only references the blocks.
+            cached = it->second;
+        }
+    }
+    // Compare outside the lock, which may take a while for large bodies.
+    if (!cached.compressed.empty() && cached.original.equals(body)) {
+        out->append(cached.compressed);
+        return true;
+    }
+    butil::IOBuf compressed;
+    if (!policy::GzipCompress(body, &compressed, NULL)) {
+        return false;
+    }
+    cached.original = body;
+    cached.compressed = compressed;
+    {
+        BAIDU_SCOPED_LOCK(s_cache_mutex);
+        s_cache->Put(key, cached);
+        s_cache->ShrinkToSize(FLAGS_http_compressed_body_cache_size);
+    }
+    out->append(compressed);
+    return true;
+}
+
+} // namespace brpc
@@ -0,0 +1,32 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_COMPRESSED_BODY_CACHE_H
+#define BRPC_COMPRESSED_BODY_CACHE_H
+
+#include "butil/iobuf.h"
+
+namespace brpc {
+
+// Gzip `body' into `out'. When -http_compressed_body_cache_size is positive,
+// results of recently compressed bodies are kept in a LRU cache keyed by
+// the content, and an identical body (e.g. static files or config pages served
+// repeatedly) is answered from the cache without compressing it again.
+// Returns true on success.
+bool GzipCompressWithCache(const butil::IOBuf& body, butil::IOBuf* out);
+
+} // namespace brpc
+
+#endif // BRPC_COMPRESSED_BODY_CACHE_H
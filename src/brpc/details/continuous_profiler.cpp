@@ -0,0 +1,342 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <gflags/gflags.h>
+#include "butil/build_config.h"                // OS_LINUX
+#include "butil/atomicops.h"
+#include "butil/containers/flat_map.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/time.h"
+#include "bthread/task_meta.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/continuous_profiler.h"
+
+namespace bthread {
+extern __thread bthread::LocalStorage tls_bls;
+}
+
+namespace brpc {
+
+static bool validate_continuous_profiling_hz(const char*, int32_t);
+
+DEFINE_int32(continuous_profiling_hz, 0, "Take so many CPU samples per "
+             "second of CPU time used by the process in the background, "
+             "which are shown at /hotspots/continuous. Low values(e.g. 19) "
+             "keep the overhead negligible. 0 disables the profiler");
+BRPC_VALIDATE_GFLAG(continuous_profiling_hz, validate_continuous_profiling_hz);
+
+DEFINE_int32(continuous_profiling_minutes, 1440, "Keep samples of the "
+             "continuous profiler for so many minutes");
+BRPC_VALIDATE_GFLAG(continuous_profiling_minutes, PositiveInteger);
+
+namespace {
+
+const int MAX_FRAMES = 48;
+// The signal handler and the trampoline of signals.
+const int SKIPPED_FRAMES = 2;
+// Must be power of 2.
+const size_t RING_SIZE = 4096;
+// Samples of new stacks are dropped when so many distinct stacks were
+// recorded, which bounds the memory.
+const size_t MAX_STACKS = 65536;
+const int64_t COLLECT_INTERVAL_US = 100000;
+
+enum SampleState {
+    SAMPLE_EMPTY = 0,
+    SAMPLE_WRITING,
+    SAMPLE_READY
+};
+
+// Written by the signal handler and consumed by the collecting thread.
+struct RawSample {
+    butil::atomic<int> state;
+    int nframes;
+    const void* method;
+    void* frames[MAX_FRAMES];
+};
+
+struct MinuteBucket {
+    int64_t minute;     // since the Epoch
+    int64_t dropped;
+    // index in ContinuousProfiler::_stacks -> number of samples
+    std::map<size_t, int64_t> counts;
+};
+
+class ContinuousProfiler {
+public:
+    ContinuousProfiler();
+    // Returns 0 on success, -1 otherwise.
+    int Start();
+    // Sample `hz' times per second of CPU time, 0 to pause.
+    void SetFrequency(int hz);
+    int GetProfile(int minutes, ContinuousProfile* profile);
+    static void OnSignal(int signo, siginfo_t* info, void* context);
+
+private:
+    static void* RunCollector(void* arg);
+    void Collect();
+
+    RawSample* _ring;
+    butil::atomic<uint64_t> _write_index;
+    butil::atomic<int64_t> _ndropped;
+#if defined(OS_LINUX)
+    timer_t _timer;
+#endif
+    pthread_t _collector;
+    // Protects fields below.
+    pthread_mutex_t _mutex;
+    std::vector<ProfiledStack> _stacks;
+    butil::FlatMap<std::string, size_t> _stack_index;
+    std::deque<MinuteBucket> _buckets;
+};
+
+ContinuousProfiler* g_profiler = NULL;
+pthread_mutex_t g_profiler_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ContinuousProfiler::ContinuousProfiler()
+    : _ring(NULL)
+    , _write_index(0)
+    , _ndropped(0) {
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+int ContinuousProfiler::Start() {
+#if defined(OS_LINUX)
+    if (_stack_index.init(1024) != 0) {
+        LOG(ERROR) << "Fail to init _stack_index";
+        return -1;
+    }
+    _ring = new RawSample[RING_SIZE];
+    for (size_t i = 0; i < RING_SIZE; ++i) {
+        _ring[i].state.store(SAMPLE_EMPTY, butil::memory_order_relaxed);
+    }
+    // backtrace() may allocate memory at the first call, which is unsafe
+    // inside signal handlers. Call it once before sampling.
+    void* dummy[4];
+    backtrace(dummy, arraysize(dummy));
+
+    // Not SIGPROF which is used by the cpu profiler at /hotspots/cpu, so
+    // that both profilers can run at the same time.
+    const int signo = SIGRTMIN + 4;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = OnSignal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signo, &sa, NULL) != 0) {
+        PLOG(ERROR) << "Fail to install handler of signal=" << signo;
+        return -1;
+    }
+    // Expiration of timers of CPU time of the process are signalled to the
+    // thread consuming the CPU, so that samples are proportional to CPU
+    // usages of threads.
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = signo;
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &_timer) != 0) {
+        PLOG(ERROR) << "Fail to create timer of CPU time";
+        return -1;
+    }
+    if (pthread_create(&_collector, NULL, RunCollector, this) != 0) {
+        LOG(ERROR) << "Fail to create collecting thread";
+        return -1;
+    }
+    return 0;
+#else
+    LOG(ERROR) << "Continuous profiler is only supported on linux";
+    return -1;
+#endif
+}
+
+void ContinuousProfiler::SetFrequency(int hz) {
+#if defined(OS_LINUX)
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (hz > 0) {
+        const int64_t interval_ns = 1000000000L / hz;
+        its.it_interval.tv_sec = interval_ns / 1000000000L;
+        its.it_interval.tv_nsec = interval_ns % 1000000000L;
+        its.it_value = its.it_interval;
+    }
+    if (timer_settime(_timer, 0, &its, NULL) != 0) {
+        PLOG(ERROR) << "Fail to set timer of CPU time";
+    }
+#endif
+}
+
+void ContinuousProfiler::OnSignal(int, siginfo_t*, void*) {
+    // NOTE: Only async-signal-safe code is allowed here.
+    const int saved_errno = errno;
+    ContinuousProfiler* p = g_profiler;
+    if (p != NULL && p->_ring != NULL) {
+        const uint64_t index =
+            p->_write_index.fetch_add(1, butil::memory_order_relaxed);
+        RawSample& s = p->_ring[index & (RING_SIZE - 1)];
+        int expected = SAMPLE_EMPTY;
+        if (s.state.compare_exchange_strong(
+                expected, SAMPLE_WRITING, butil::memory_order_acquire)) {
+            s.method = bthread::tls_bls.rpc_method;
+            s.nframes = backtrace(s.frames, MAX_FRAMES);
+            s.state.store(SAMPLE_READY, butil::memory_order_release);
+        } else {
+            // The collector fell behind.
+            p->_ndropped.fetch_add(1, butil::memory_order_relaxed);
+        }
+    }
+    errno = saved_errno;
+}
+
+void* ContinuousProfiler::RunCollector(void* arg) {
+    ContinuousProfiler* p = static_cast<ContinuousProfiler*>(arg);
+    while (true) {
+        usleep(COLLECT_INTERVAL_US);
+        p->Collect();
+    }
+    return NULL;
+}
+
+void ContinuousProfiler::Collect() {
+    const int64_t minute = butil::gettimeofday_s() / 60;
+    std::string key;
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_buckets.empty() || _buckets.back().minute != minute) {
+        _buckets.push_back(MinuteBucket());
+        _buckets.back().minute = minute;
+        _buckets.back().dropped = 0;
+    }
+    while (_buckets.front().minute <=
+           minute - FLAGS_continuous_profiling_minutes) {
+        _buckets.pop_front();
+    }
+    MinuteBucket& bucket = _buckets.back();
+    bucket.dropped += _ndropped.exchange(0, butil::memory_order_relaxed);
+    for (size_t i = 0; i < RING_SIZE; ++i) {
+        RawSample& s = _ring[i];
+        if (s.state.load(butil::memory_order_acquire) != SAMPLE_READY) {
+            continue;
+        }
+        const int nframes = std::max(s.nframes - SKIPPED_FRAMES, 0);
+        void* const* frames = s.frames + (s.nframes - nframes);
+        key.assign((const char*)&s.method, sizeof(s.method));
+        key.append((const char*)frames, nframes * sizeof(void*));
+        size_t* index = _stack_index.seek(key);
+        if (index == NULL) {
+            if (_stacks.size() >= MAX_STACKS) {
+                ++bucket.dropped;
+                s.state.store(SAMPLE_EMPTY, butil::memory_order_release);
+                continue;
+            }
+            _stacks.push_back(ProfiledStack());
+            ProfiledStack& stack = _stacks.back();
+            stack.method = static_cast<const google::protobuf::MethodDescriptor*>(
+                s.method);
+            stack.frames.assign(frames, frames + nframes);
+            stack.count = 0;
+            index = &(_stack_index[key] = _stacks.size() - 1);
+        }
+        ++bucket.counts[*index];
+        s.state.store(SAMPLE_EMPTY, butil::memory_order_release);
+    }
+}
+
+int ContinuousProfiler::GetProfile(int minutes, ContinuousProfile* profile) {
+    const int64_t now_s = butil::gettimeofday_s();
+    const int64_t first_minute = now_s / 60 - minutes + 1;
+    std::map<size_t, int64_t> merged;
+    profile->seconds = 0;
+    profile->dropped = 0;
+    profile->stacks.clear();
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (std::deque<MinuteBucket>::const_iterator
+             it = _buckets.begin(); it != _buckets.end(); ++it) {
+        if (it->minute < first_minute) {
+            continue;
+        }
+        if (profile->seconds == 0) {
+            profile->seconds = now_s - it->minute * 60;
+        }
+        profile->dropped += it->dropped;
+        for (std::map<size_t, int64_t>::const_iterator
+                 it2 = it->counts.begin(); it2 != it->counts.end(); ++it2) {
+            merged[it2->first] += it2->second;
+        }
+    }
+    profile->stacks.reserve(merged.size());
+    for (std::map<size_t, int64_t>::const_iterator
+             it = merged.begin(); it != merged.end(); ++it) {
+        profile->stacks.push_back(_stacks[it->first]);
+        profile->stacks.back().count = it->second;
+    }
+    return 0;
+}
+
+} // namespace
+
+static bool validate_continuous_profiling_hz(const char*, int32_t hz) {
+    if (hz < 0 || hz > 1000) {
+        return false;
+    }
+    BAIDU_SCOPED_LOCK(g_profiler_mutex);
+    if (g_profiler == NULL) {
+        if (hz == 0) {
+            return true;
+        }
+        ContinuousProfiler* p = new ContinuousProfiler;
+        if (p->Start() != 0) {
+            // Partially started profiler is leaked since the handler may be
+            // running. This only happens on misconfigured systems.
+            return false;
+        }
+        g_profiler = p;
+    }
+    g_profiler->SetFrequency(hz);
+    return true;
+}
+
+int GetContinuousProfile(int minutes, ContinuousProfile* profile) {
+    ContinuousProfiler* p = NULL;
+    {
+        BAIDU_SCOPED_LOCK(g_profiler_mutex);
+        p = g_profiler;
+    }
+    if (p == NULL) {
+        return -1;
+    }
+    return p->GetProfile(minutes, profile);
+}
+
+ScopedProfiledMethod::ScopedProfiledMethod(
+    const google::protobuf::MethodDescriptor* method)
+    : _saved_method(bthread::tls_bls.rpc_method) {
+    bthread::tls_bls.rpc_method = method;
+}
+
+ScopedProfiledMethod::~ScopedProfiledMethod() {
+    bthread::tls_bls.rpc_method = _saved_method;
+}
+
+} // namespace brpc
@@ -0,0 +1,82 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_CONTINUOUS_PROFILER_H
+#define BRPC_CONTINUOUS_PROFILER_H
+
+#include <stdint.h>
+#include <vector>
+#include <gflags/gflags_declare.h>
+#include "butil/macros.h"
+
+namespace google {
+namespace protobuf {
+class MethodDescriptor;
+}
+}
+
+namespace brpc {
+
+DECLARE_int32(continuous_profiling_hz);
+DECLARE_int32(continuous_profiling_minutes);
+
+// A low-frequency CPU profiler which keeps running in the background when
+// -continuous_profiling_hz is positive. Samples are taken by a timer of
+// CPU time of the process, attributed to the server-side method being
+// processed by the interrupted bthread, and aggregated into per-minute
+// buckets kept for -continuous_profiling_minutes. Displayed at
+// /hotspots/continuous.
+
+// A distinct call stack and its number of samples.
+struct ProfiledStack {
+    // Method of the server-side RPC being processed, NULL if there's none.
+    const google::protobuf::MethodDescriptor* method;
+    // Return addresses, innermost first.
+    std::vector<void*> frames;
+    int64_t count;
+};
+
+struct ContinuousProfile {
+    // Seconds covered by `stacks'.
+    int64_t seconds;
+    // Samples lost because the collector fell behind or too many distinct
+    // stacks were recorded.
+    int64_t dropped;
+    std::vector<ProfiledStack> stacks;
+};
+
+// Get samples collected in last `minutes'.
+// Returns 0 on success, -1 if the profiler never ran.
+int GetContinuousProfile(int minutes, ContinuousProfile* profile);
+
+// CPU samples taken in the scope are attributed to `method'. Protocols put
+// one around the call to the service method (and where the method is run
+// in another thread), so that CPU used by user code is shown per method.
+// The method is saved in bthread-local storage, samples taken in other
+// bthreads created by the method are not attributed to it.
+class ScopedProfiledMethod {
+public:
+    explicit ScopedProfiledMethod(
+        const google::protobuf::MethodDescriptor* method);
+    ~ScopedProfiledMethod();
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedProfiledMethod);
+    const void* _saved_method;
+};
+
+} // namespace brpc
+
+#endif // BRPC_CONTINUOUS_PROFILER_H
@@ -99,6 +99,12 @@ public:
     
     Span* span() const { return _cntl->_span; }
 
+    // Mark `point' of the RPC as reached now or at `us'(cpuwide).
+    void mark_phase(RpcPhasePoint point) { _cntl->_phase_times.Mark(point); }
+    void mark_phase(RpcPhasePoint point, int64_t us)
+    { _cntl->_phase_times.Mark(point, us); }
+    const RpcPhaseTimes& phase_times() const { return _cntl->_phase_times; }
+
     uint32_t pipelined_count() const { return _cntl->_pipelined_count; }
     void set_pipelined_count(uint32_t count) {  _cntl->_pipelined_count = count; }
 
@@ -110,10 +116,10 @@ public:
     // Pass the owership of |settings| to _cntl, while is going to be
     // destroyed in Controller::Reset()
     void set_remote_stream_settings(StreamSettings *settings) {
-        _cntl->_remote_stream_settings = settings;
+        _cntl->ext()->remote_stream_settings = settings;
     }
     StreamSettings* remote_stream_settings() {
-        return _cntl->_remote_stream_settings;
+        return _cntl->_ext ? _cntl->_ext->remote_stream_settings : NULL;
     }
 
     StreamId request_stream() { return _cntl->_request_stream; }
@@ -123,15 +129,53 @@ public:
     { _cntl->_method = method; }
 
     void set_readable_progressive_attachment(ReadableProgressiveAttachment* s)
-    { _cntl->_rpa.reset(s); }
+    { _cntl->ext()->rpa.reset(s); }
 
     void add_with_auth() {
         _cntl->add_flag(Controller::FLAGS_REQUEST_WITH_AUTH);
     }
+
+    // [Server-side] `timeout_ms' was sent by client along with the request
+    // which was received at `received_real_us'.
+    ControllerPrivateAccessor& set_deadline(int64_t received_real_us,
+                                            int64_t timeout_ms) {
+        _cntl->_abstime_us = received_real_us + timeout_ms * 1000L;
+        return *this;
+    }
+
+    // [Server-side] Request and response are allocated on `arena' which is
+    // returned to the pool when the controller is destroyed.
+    void set_pb_arena(PooledPBArena* arena) {
+        _cntl->_pb_arena = arena;
+        _cntl->set_flag(Controller::FLAGS_MESSAGES_ON_ARENA, arena != NULL);
+    }
+    PooledPBArena* pb_arena() const { return _cntl->_pb_arena; }
+    bool messages_on_arena() const
+    { return _cntl->has_flag(Controller::FLAGS_MESSAGES_ON_ARENA); }
+
+    // [Server-side] The controller is from the object pool and should be
+    // reset and returned instead of being deleted.
+    void set_from_pool() { _cntl->add_flag(Controller::FLAGS_FROM_POOL); }
+    bool is_from_pool() const
+    { return _cntl->has_flag(Controller::FLAGS_FROM_POOL); }
 private:
     Controller* _cntl;
 };
 
+// Deadline of the server-side RPC running in current bthread, which is
+// inherited by RPCs issued in the bthread. -1 if there's none.
+int64_t GetInheritedDeadline();
+
+// RPCs issued in the scope inherit deadline of `server_cntl'.
+class ScopedInheritedDeadline {
+public:
+    explicit ScopedInheritedDeadline(const Controller* server_cntl);
+    ~ScopedInheritedDeadline();
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedInheritedDeadline);
+    int64_t _saved_deadline_us;
+};
+
 // Inherit this class to intercept Controller::IssueRPC. This is an internal
 // utility only useable by brpc developers.
 class RPCSender {
@@ -0,0 +1,537 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "butil/build_config.h"                       // OS_MACOSX
+#include <netdb.h>                                    // gethostbyname_r
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>                                // EPOLLIN
+#include <ctype.h>                                    // tolower
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>                                  // std::count
+#include <map>
+#include <memory>                                     // std::unique_ptr
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/fd_utility.h"                         // make_non_blocking
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_splitter.h"
+#include "butil/synchronization/lock.h"
+#include "butil/time.h"
+#include "bthread/unstable.h"                         // bthread_fd_timedwait
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/dns_resolver.h"
+
+namespace brpc {
+
+DEFINE_bool(async_dns, true, "Query nameservers without blocking worker "
+            "pthreads and cache the results, instead of gethostbyname_r");
+DEFINE_string(dns_nameservers, "", "Comma-separated ip[:port] of "
+              "nameservers, empty means the ones in /etc/resolv.conf");
+DEFINE_string(dns_search, "", "Comma-separated search domains, empty means "
+              "the ones in /etc/resolv.conf");
+DEFINE_int32(dns_ndots, -1, "Names with fewer dots are tried with search "
+             "domains before being queried as they are, negative means the "
+             "ndots option in /etc/resolv.conf");
+DEFINE_int32(dns_timeout_ms, 1000, "Timeout of querying each nameserver");
+BRPC_VALIDATE_GFLAG(dns_timeout_ms, PositiveInteger);
+DEFINE_int32(dns_max_ttl_s, 300, "Answers are cached for at most so many "
+             "seconds even if their TTL is longer");
+BRPC_VALIDATE_GFLAG(dns_max_ttl_s, NonNegativeInteger);
+DEFINE_int32(dns_negative_ttl_s, 5, "Non-existent names are cached for so "
+             "many seconds");
+BRPC_VALIDATE_GFLAG(dns_negative_ttl_s, NonNegativeInteger);
+
+static const uint16_t DNS_TYPE_A = 1;
+static const uint16_t DNS_CLASS_IN = 1;
+static const size_t DNS_HEADER_SIZE = 12;
+static const size_t MAX_DNS_MESSAGE_SIZE = 512;
+// Same as RES_MAXNDOTS of glibc.
+static const int MAX_NDOTS = 15;
+
+struct DnsCacheEntry {
+    std::vector<butil::ip_t> ips;  // empty for non-existent names
+    int64_t expire_us;
+};
+
+typedef std::map<std::string, std::vector<butil::ip_t> > HostsMap;
+typedef std::map<std::string, DnsCacheEntry> DnsCache;
+
+struct ResolvConf {
+    std::vector<butil::EndPoint> nameservers;
+    std::vector<std::string> search;
+    int ndots;
+    ResolvConf() : ndots(1) {}
+};
+
+static pthread_once_t s_dns_once = PTHREAD_ONCE_INIT;
+static butil::Mutex* s_dns_mutex = NULL;
+static DnsCache* s_dns_cache = NULL;
+// Loaded once, read without locks.
+static HostsMap* s_hosts = NULL;
+static ResolvConf* s_resolv_conf = NULL;
+
+static void LoadHosts(HostsMap* hosts) {
+    FILE* fp = fopen("/etc/hosts", "r");
+    if (fp == NULL) {
+        return;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        butil::ip_t ip;
+        bool first = true;
+        for (butil::StringMultiSplitter sp(line, " \t\r\n"); sp; ++sp) {
+            const std::string item(sp.field(), sp.length());
+            if (first) {
+                // Only IPv4 addresses are supported
+                if (butil::str2ip(item.c_str(), &ip) != 0) {
+                    break;
+                }
+                first = false;
+                continue;
+            }
+            std::string name(item);
+            for (size_t i = 0; i < name.size(); ++i) {
+                name[i] = ::tolower(name[i]);
+            }
+            (*hosts)[name].push_back(ip);
+        }
+    }
+    fclose(fp);
+}
+
+static void LoadResolvConf(ResolvConf* conf) {
+    FILE* fp = fopen("/etc/resolv.conf", "r");
+    if (fp == NULL) {
+        return;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        std::vector<std::string> items;
+        for (butil::StringMultiSplitter sp(line, " \t\r\n"); sp; ++sp) {
+            items.push_back(std::string(sp.field(), sp.length()));
+        }
+        if (items.size() < 2) {
+            continue;
+        }
+        if (items[0] == "nameserver") {
+            butil::ip_t ip;
+            if (butil::str2ip(items[1].c_str(), &ip) == 0) {
+                conf->nameservers.push_back(butil::EndPoint(ip, 53));
+            }
+        } else if (items[0] == "search" || items[0] == "domain") {
+            // The last one of "search" and "domain" wins, as in glibc.
+            conf->search.assign(items.begin() + 1, items.end());
+        } else if (items[0] == "options") {
+            for (size_t i = 1; i < items.size(); ++i) {
+                int ndots = 0;
+                if (sscanf(items[i].c_str(), "ndots:%d", &ndots) == 1) {
+                    conf->ndots = std::max(0, std::min(ndots, MAX_NDOTS));
+                }
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static void InitDnsResolver() {
+    s_dns_mutex = new butil::Mutex;
+    s_dns_cache = new DnsCache;
+    s_hosts = new HostsMap;
+    LoadHosts(s_hosts);
+    s_resolv_conf = new ResolvConf;
+    LoadResolvConf(s_resolv_conf);
+}
+
+static void GetNameservers(std::vector<butil::EndPoint>* nameservers) {
+    nameservers->clear();
+    const std::string flag = FLAGS_dns_nameservers;
+    if (flag.empty()) {
+        *nameservers = s_resolv_conf->nameservers;
+        return;
+    }
+    for (butil::StringSplitter sp(flag.c_str(), ','); sp; ++sp) {
+        const std::string item(sp.field(), sp.length());
+        butil::EndPoint pt;
+        if (butil::str2endpoint(item.c_str(), &pt) == 0) {
+            nameservers->push_back(pt);
+        } else if (butil::str2ip(item.c_str(), &pt.ip) == 0) {
+            pt.port = 53;
+            nameservers->push_back(pt);
+        } else {
+            LOG(ERROR) << "Invalid nameserver=`" << item << '\'';
+        }
+    }
+}
+
+// Names to query for `name' in order, like res_nsearch() of glibc: names
+// with fewer dots than ndots are tried with search domains first, others
+// are tried as they are first. Names ending with a dot are absolute and
+// never tried with search domains.
+static void GetCandidateNames(const std::string& name, bool absolute,
+                              std::vector<std::string>* candidates) {
+    candidates->clear();
+    if (absolute) {
+        candidates->push_back(name);
+        return;
+    }
+    std::vector<std::string> search;
+    const std::string flag = FLAGS_dns_search;
+    if (flag.empty()) {
+        search = s_resolv_conf->search;
+    } else {
+        for (butil::StringSplitter sp(flag.c_str(), ','); sp; ++sp) {
+            search.push_back(std::string(sp.field(), sp.length()));
+        }
+    }
+    const int ndots = (FLAGS_dns_ndots >= 0 ?
+                       std::min((int)FLAGS_dns_ndots, MAX_NDOTS) :
+                       s_resolv_conf->ndots);
+    const int dots = std::count(name.begin(), name.end(), '.');
+    if (dots == 0 && search.empty()) {
+        // Left to gethostbyname_r which knows the local domain.
+        return;
+    }
+    if (dots >= ndots) {
+        candidates->push_back(name);
+    }
+    for (size_t i = 0; i < search.size(); ++i) {
+        std::string domain = search[i];
+        if (!domain.empty() && domain[domain.size() - 1] == '.') {
+            domain.resize(domain.size() - 1);
+        }
+        if (!domain.empty()) {
+            candidates->push_back(name + '.' + domain);
+        }
+    }
+    if (dots < ndots) {
+        candidates->push_back(name);
+    }
+}
+
+static bool SkipName(const uint8_t* msg, size_t len, size_t* off) {
+    while (*off < len) {
+        const uint8_t c = msg[*off];
+        if (c == 0) {
+            ++*off;
+            return true;
+        }
+        if ((c & 0xC0) == 0xC0) {
+            // Compressed as a pointer which ends the name.
+            *off += 2;
+            return *off <= len;
+        }
+        if (c & 0xC0) {
+            return false;
+        }
+        *off += 1 + c;
+    }
+    return false;
+}
+
+static uint16_t ReadUint16(const uint8_t* p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t ReadUint32(const uint8_t* p) {
+    return ((uint32_t)ReadUint16(p) << 16) | ReadUint16(p + 2);
+}
+
+// Returns length of the query, 0 if the name is invalid.
+static size_t MakeQuery(const std::string& name, uint16_t id, uint8_t* buf) {
+    memset(buf, 0, DNS_HEADER_SIZE);
+    buf[0] = id >> 8;
+    buf[1] = id & 0xFF;
+    buf[2] = 0x01;  // recursion desired
+    buf[5] = 1;     // one question
+    size_t off = DNS_HEADER_SIZE;
+    for (butil::StringSplitter sp(name.c_str(), '.'); sp; ++sp) {
+        if (sp.length() > 63 ||
+            off + 1 + sp.length() + 5 > MAX_DNS_MESSAGE_SIZE) {
+            return 0;
+        }
+        buf[off++] = sp.length();
+        memcpy(buf + off, sp.field(), sp.length());
+        off += sp.length();
+    }
+    buf[off++] = 0;
+    buf[off++] = DNS_TYPE_A >> 8;
+    buf[off++] = DNS_TYPE_A & 0xFF;
+    buf[off++] = DNS_CLASS_IN >> 8;
+    buf[off++] = DNS_CLASS_IN & 0xFF;
+    return off;
+}
+
+// Returns 0 on success, ENOENT if the name has no addresses, other errors
+// if the answer can't be used.
+static int ParseAnswer(const uint8_t* msg, size_t len, uint16_t id,
+                       std::vector<butil::ip_t>* ips, int32_t* ttl_s) {
+    if (len < DNS_HEADER_SIZE || ReadUint16(msg) != id ||
+        !(msg[2] & 0x80)/*not a response*/) {
+        return EINVAL;
+    }
+    if (msg[2] & 0x02) {
+        // Truncated, needs TCP.
+        return EMSGSIZE;
+    }
+    const int rcode = msg[3] & 0x0F;
+    if (rcode == 3/*NXDOMAIN*/) {
+        return ENOENT;
+    }
+    if (rcode != 0) {
+        return EAGAIN;
+    }
+    const uint16_t qdcount = ReadUint16(msg + 4);
+    const uint16_t ancount = ReadUint16(msg + 6);
+    size_t off = DNS_HEADER_SIZE;
+    for (uint16_t i = 0; i < qdcount; ++i) {
+        if (!SkipName(msg, len, &off) || off + 4 > len) {
+            return EINVAL;
+        }
+        off += 4;
+    }
+    int32_t min_ttl = FLAGS_dns_max_ttl_s;
+    for (uint16_t i = 0; i < ancount; ++i) {
+        if (!SkipName(msg, len, &off) || off + 10 > len) {
+            return EINVAL;
+        }
+        const uint16_t type = ReadUint16(msg + off);
+        const uint16_t klass = ReadUint16(msg + off + 2);
+        const uint32_t ttl = ReadUint32(msg + off + 4);
+        const uint16_t rdlen = ReadUint16(msg + off + 8);
+        off += 10;
+        if (off + rdlen > len) {
+            return EINVAL;
+        }
+        // CNAMEs are skipped, their addresses are answered as well.
+        if (type == DNS_TYPE_A && klass == DNS_CLASS_IN && rdlen == 4) {
+            butil::ip_t ip;
+            memcpy(&ip, msg + off, 4);
+            ips->push_back(ip);
+            if ((int64_t)ttl < min_ttl) {
+                min_ttl = ttl;
+            }
+        }
+        off += rdlen;
+    }
+    if (ips->empty()) {
+        return ENOENT;
+    }
+    *ttl_s = min_ttl;
+    return 0;
+}
+
+static int QueryNameserver(const butil::EndPoint& nameserver,
+                           const std::string& name,
+                           std::vector<butil::ip_t>* ips, int32_t* ttl_s) {
+    uint8_t buf[MAX_DNS_MESSAGE_SIZE];
+    const uint16_t id = butil::fast_rand() & 0xFFFF;
+    const size_t query_len = MakeQuery(name, id, buf);
+    if (query_len == 0) {
+        return EINVAL;
+    }
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return errno;
+    }
+    butil::make_non_blocking(fd);
+    int rc = 0;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = nameserver.ip;
+    addr.sin_port = htons(nameserver.port);
+    if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        send(fd, buf, query_len, 0) != (ssize_t)query_len) {
+        rc = errno;
+        bthread_close(fd);
+        return rc;
+    }
+    const timespec abstime =
+        butil::milliseconds_from_now(FLAGS_dns_timeout_ms);
+    while (true) {
+        const ssize_t nr = recv(fd, buf, sizeof(buf), 0);
+        if (nr >= 0) {
+            ips->clear();
+            rc = ParseAnswer(buf, nr, id, ips, ttl_s);
+            if (rc != EINVAL) {
+                break;
+            }
+            // Not the answer of the query, keep waiting.
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            rc = errno;
+            break;
+        }
+        if (bthread_fd_timedwait(fd, EPOLLIN, &abstime) != 0 &&
+            errno != EINTR) {
+            rc = errno;
+            break;
+        }
+    }
+    bthread_close(fd);
+    return rc;
+}
+
+static int BlockingResolve(const char* hostname,
+                           std::vector<butil::ip_t>* ips) {
+#if defined(OS_MACOSX)
+    // gethostbyname on MAC is thread-safe (with current usage) since the
+    // returned hostent is TLS. Check following link for the ref:
+    // https://lists.apple.com/archives/darwin-dev/2006/May/msg00008.html
+    struct hostent* result = gethostbyname(hostname);
+    if (result == NULL) {
+        LOG(WARNING) << "result of gethostbyname is NULL";
+        return -1;
+    }
+#else
+    size_t aux_buf_len = 1024;
+    std::unique_ptr<char[]> aux_buf(new char[aux_buf_len]);
+    int ret = 0;
+    int error = 0;
+    struct hostent ent;
+    struct hostent* result = NULL;
+    do {
+        result = NULL;
+        error = 0;
+        ret = gethostbyname_r(hostname, &ent, aux_buf.get(), aux_buf_len,
+                              &result, &error);
+        if (ret != ERANGE) { // aux_buf is not long enough
+            break;
+        }
+        aux_buf_len *= 2;
+        aux_buf.reset(new char[aux_buf_len]);
+    } while (1);
+    if (ret != 0) {
+        // `hstrerror' is thread safe under linux
+        LOG(WARNING) << "Can't resolve `" << hostname << "', return=`"
+                     << berror(ret) << "' herror=`" << hstrerror(error) << '\'';
+        return -1;
+    }
+    if (result == NULL) {
+        LOG(WARNING) << "result of gethostbyname_r is NULL";
+        return -1;
+    }
+#endif
+    for (int i = 0; result->h_addr_list[i] != NULL; ++i) {
+        if (result->h_addrtype == AF_INET) {
+            // Only fetch IPv4 addresses
+            butil::ip_t ip;
+            bcopy(result->h_addr_list[i], &ip, result->h_length);
+            ips->push_back(ip);
+        } else {
+            LOG(WARNING) << "Found address of unsupported protocol="
+                         << result->h_addrtype;
+        }
+    }
+    return 0;
+}
+
+int ResolveHostname(const char* hostname, std::vector<butil::ip_t>* ips) {
+    ips->clear();
+    butil::ip_t ip;
+    if (butil::str2ip(hostname, &ip) == 0) {
+        ips->push_back(ip);
+        return 0;
+    }
+    if (!FLAGS_async_dns) {
+        return BlockingResolve(hostname, ips);
+    }
+    pthread_once(&s_dns_once, InitDnsResolver);
+    std::string name(hostname);
+    for (size_t i = 0; i < name.size(); ++i) {
+        name[i] = ::tolower(name[i]);
+    }
+    const bool absolute = (!name.empty() && name[name.size() - 1] == '.');
+    if (absolute) {
+        name.resize(name.size() - 1);
+    }
+    HostsMap::const_iterator hit = s_hosts->find(name);
+    if (hit != s_hosts->end()) {
+        *ips = hit->second;
+        return 0;
+    }
+    // Absolute names are not tried with search domains, cache them apart.
+    const std::string cache_key = (absolute ? name + '.' : name);
+    const int64_t now_us = butil::gettimeofday_us();
+    {
+        BAIDU_SCOPED_LOCK(*s_dns_mutex);
+        DnsCache::const_iterator it = s_dns_cache->find(cache_key);
+        if (it != s_dns_cache->end() && it->second.expire_us > now_us) {
+            *ips = it->second.ips;
+            return ips->empty() ? -1 : 0;
+        }
+    }
+    std::vector<butil::EndPoint> nameservers;
+    GetNameservers(&nameservers);
+    std::vector<std::string> candidates;
+    GetCandidateNames(name, absolute, &candidates);
+    if (candidates.empty() || nameservers.empty()) {
+        return BlockingResolve(hostname, ips);
+    }
+    // The name does not exist only if none of the candidates exists.
+    int rc = ENOENT;
+    int32_t ttl_s = 0;
+    for (size_t c = 0; c < candidates.size() && rc == ENOENT; ++c) {
+        rc = ETIMEDOUT;
+        for (size_t i = 0; i < nameservers.size(); ++i) {
+            rc = QueryNameserver(nameservers[i], candidates[c], ips, &ttl_s);
+            if (rc == 0 || rc == ENOENT) {
+                break;
+            }
+            LOG(WARNING) << "Fail to query " << candidates[c]
+                         << " from nameserver=" << nameservers[i] << ": "
+                         << berror(rc);
+        }
+    }
+    if (rc != 0 && rc != ENOENT) {
+        ips->clear();
+        return BlockingResolve(hostname, ips);
+    }
+    if (rc == ENOENT) {
+        ips->clear();
+        ttl_s = FLAGS_dns_negative_ttl_s;
+    }
+    DnsCacheEntry entry;
+    entry.ips = *ips;
+    entry.expire_us = now_us + ttl_s * 1000000L;
+    {
+        BAIDU_SCOPED_LOCK(*s_dns_mutex);
+        (*s_dns_cache)[cache_key] = entry;
+    }
+    if (rc == ENOENT) {
+        LOG(WARNING) << "Can't resolve `" << hostname << '\'';
+        return -1;
+    }
+    return 0;
+}
+
+void ClearDnsCache() {
+    pthread_once(&s_dns_once, InitDnsResolver);
+    BAIDU_SCOPED_LOCK(*s_dns_mutex);
+    s_dns_cache->clear();
+}
+
+} // namespace brpc
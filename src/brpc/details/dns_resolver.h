@@ -0,0 +1,43 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_DETAILS_DNS_RESOLVER_H
+#define BRPC_DETAILS_DNS_RESOLVER_H
+
+#include <vector>
+#include "butil/endpoint.h"
+
+namespace brpc {
+
+// Get IPv4 addresses of `hostname'.
+// When -async_dns is on, names in /etc/hosts are answered directly, other
+// names with dots are queried from nameservers (-dns_nameservers or
+// /etc/resolv.conf) over UDP with bthread_fd_timedwait, which suspends the
+// calling bthread instead of blocking the worker pthread. Answers are
+// cached by their TTL, non-existent names are cached for
+// -dns_negative_ttl_s. Like glibc, names with fewer dots than ndots are
+// tried with search domains (-dns_search, -dns_ndots or /etc/resolv.conf)
+// before being queried as they are, others are queried as they are first.
+// Names without dots and search domains, and failed queries fall back to
+// gethostbyname_r.
+// Returns 0 on success, -1 otherwise.
+int ResolveHostname(const char* hostname, std::vector<butil::ip_t>* ips);
+
+// Clear cached results of ResolveHostname().
+void ClearDnsCache();
+
+} // namespace brpc
+
+#endif  // BRPC_DETAILS_DNS_RESOLVER_H
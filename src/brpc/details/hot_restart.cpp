@@ -0,0 +1,214 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/types.h>
+#include <sys/socket.h>                        // sendmsg, recvmsg
+#include <sys/un.h>                            // sockaddr_un
+#include <unistd.h>
+#include <string.h>
+#include <gflags/gflags.h>
+#include "butil/fd_guard.h"
+#include "butil/logging.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/hot_restart.h"
+
+namespace brpc {
+
+DEFINE_int32(hot_restart_timeout_ms, 3000,
+             "Timeout of each step in handing over listening sockets between"
+             " processes of hot restarts");
+BRPC_VALIDATE_GFLAG(hot_restart_timeout_ms, PositiveInteger);
+
+static const uint32_t HOT_RESTART_MAGIC = 0x48525354;  // "HRST"
+// Fds of the main port are at most as many as event dispatchers.
+static const size_t MAX_HANDED_OVER_FDS = 256;
+static const char HOT_RESTART_ACK = 'A';
+
+struct HandOverHeader {
+    uint32_t magic;
+    uint32_t nmain;
+    uint32_t has_internal;
+};
+
+static void SetIOTimeout(int fd, int timeout_ms) {
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+HandedOverSockets::~HandedOverSockets() {
+    Reset();
+}
+
+void HandedOverSockets::Reset() {
+    if (conn >= 0) {
+        close(conn);
+        conn = -1;
+    }
+    for (size_t i = 0; i < fds.size(); ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    fds.clear();
+    if (internal_fd >= 0) {
+        close(internal_fd);
+        internal_fd = -1;
+    }
+}
+
+int TakeOverListenedSockets(const char* path, HandedOverSockets* out) {
+    out->Reset();
+    if (access(path, F_OK) != 0) {
+        // The first process, nothing to take over.
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    butil::fd_guard conn(socket(AF_LOCAL, SOCK_STREAM, 0));
+    if (conn < 0) {
+        PLOG(ERROR) << "Fail to create unix socket";
+        return -1;
+    }
+    if (connect(conn, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        // Generally the old process already quited.
+        PLOG(WARNING) << "Fail to connect hot-restart path=" << path;
+        return -1;
+    }
+    SetIOTimeout(conn, FLAGS_hot_restart_timeout_ms);
+
+    HandOverHeader header;
+    struct iovec iov;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    char control[CMSG_SPACE(sizeof(int) * (MAX_HANDED_OVER_FDS + 1))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t nr;
+    do {
+        nr = recvmsg(conn, &msg, 0);
+    } while (nr < 0 && errno == EINTR);
+    if (nr != (ssize_t)sizeof(header)) {
+        PLOG(ERROR) << "Fail to receive listened fds from path=" << path;
+        return -1;
+    }
+    std::vector<int> fds;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* p = (const int*)CMSG_DATA(cmsg);
+            fds.insert(fds.end(), p, p + n);
+        }
+    }
+    if (header.magic != HOT_RESTART_MAGIC ||
+        (msg.msg_flags & MSG_CTRUNC) ||
+        fds.size() != header.nmain + (header.has_internal ? 1 : 0) ||
+        header.nmain == 0) {
+        LOG(ERROR) << "Invalid listened fds from hot-restart path=" << path;
+        for (size_t i = 0; i < fds.size(); ++i) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    if (header.has_internal) {
+        out->internal_fd = fds.back();
+        fds.pop_back();
+    }
+    out->fds.swap(fds);
+    out->conn = conn.release();
+    return 0;
+}
+
+int AckHandOver(HandedOverSockets* s) {
+    if (s->conn < 0) {
+        return -1;
+    }
+    ssize_t nw;
+    do {
+        nw = write(s->conn, &HOT_RESTART_ACK, 1);
+    } while (nw < 0 && errno == EINTR);
+    const int saved_errno = errno;
+    close(s->conn);
+    s->conn = -1;
+    if (nw != 1) {
+        errno = saved_errno;
+        PLOG(ERROR) << "Fail to ack the hand-over";
+        return -1;
+    }
+    return 0;
+}
+
+int HandOverListenedSockets(int conn, const std::vector<int>& fds,
+                            int internal_fd) {
+    if (fds.empty() || fds.size() > MAX_HANDED_OVER_FDS) {
+        LOG(ERROR) << "Invalid number of listened fds=" << fds.size();
+        return -1;
+    }
+    SetIOTimeout(conn, FLAGS_hot_restart_timeout_ms);
+    std::vector<int> all_fds(fds);
+    if (internal_fd >= 0) {
+        all_fds.push_back(internal_fd);
+    }
+    HandOverHeader header;
+    header.magic = HOT_RESTART_MAGIC;
+    header.nmain = fds.size();
+    header.has_internal = (internal_fd >= 0);
+    struct iovec iov;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    char control[CMSG_SPACE(sizeof(int) * (MAX_HANDED_OVER_FDS + 1))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * all_fds.size());
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * all_fds.size());
+    memcpy(CMSG_DATA(cmsg), &all_fds[0], sizeof(int) * all_fds.size());
+    ssize_t nw;
+    do {
+        nw = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    } while (nw < 0 && errno == EINTR);
+    if (nw != (ssize_t)sizeof(header)) {
+        PLOG(ERROR) << "Fail to send listened fds";
+        return -1;
+    }
+    // The new process closes the connection without the ack if it can't
+    // accept from the fds, in which case this process keeps serving.
+    char ack = 0;
+    ssize_t nr;
+    do {
+        nr = read(conn, &ack, 1);
+    } while (nr < 0 && errno == EINTR);
+    if (nr != 1 || ack != HOT_RESTART_ACK) {
+        LOG(WARNING) << "The new process did not take over listened fds";
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace brpc
@@ -0,0 +1,73 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_DETAILS_HOT_RESTART_H
+#define BRPC_DETAILS_HOT_RESTART_H
+
+#include <vector>
+#include "butil/macros.h"
+
+namespace brpc {
+
+// Listening sockets of a server are handed over from the old process to the
+// new one through an unix domain socket (ServerOptions.hot_restart_path):
+//   1. The new process connects to the path and receives listened fds of
+//      the old process with SCM_RIGHTS.
+//   2. The new process accepts from the received fds and sends an ack.
+//   3. The old process stops accepting and drains its connections, while
+//      the new one replaces the path to serve the next hot restart.
+// Pending connections in the backlog are never lost since both processes
+// share the same listening sockets.
+
+// Listening sockets received from the old process.
+class HandedOverSockets {
+public:
+    HandedOverSockets() : conn(-1), internal_fd(-1) {}
+    // Close the connection and all fds not taken.
+    ~HandedOverSockets();
+
+    // Close everything. The old process keeps serving without the ack.
+    void Reset();
+
+    // Connection to the old process, -1 if nothing is handed over.
+    int conn;
+    // Fds listening to the main port. fds[0] is the first one and others
+    // are shards listening with SO_REUSEPORT. Taken fds should be set to -1.
+    std::vector<int> fds;
+    // Fd listening to the internal port, -1 if absent.
+    int internal_fd;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(HandedOverSockets);
+};
+
+// [New process] Take over listening sockets from the process serving at
+// `path'. Returns 0 and fills `out' on success, -1 otherwise (generally
+// there's no old process).
+int TakeOverListenedSockets(const char* path, HandedOverSockets* out);
+
+// [New process] Tell the old process that handed-over sockets are being
+// accepted. The connection is closed after this call.
+// Returns 0 on success, -1 otherwise.
+int AckHandOver(HandedOverSockets* s);
+
+// [Old process] Send `fds' of the main port and `internal_fd'(-1 if absent)
+// over `conn' accepted from the hot-restart path and wait for the ack.
+// Returns 0 if the new process acked, -1 otherwise.
+int HandOverListenedSockets(int conn, const std::vector<int>& fds,
+                            int internal_fd);
+
+} // namespace brpc
+
+#endif  // BRPC_DETAILS_HOT_RESTART_H
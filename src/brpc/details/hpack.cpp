@@ -298,134 +298,221 @@ private:
 
 };
 
+// Decode HPACK huffman strings 4 bits per step by a finite state machine
+// built from HuffmanTree, which is much faster than walking the tree bit by
+// bit. States are internal nodes of the tree. Since the shortest code is 5
+// bits long, each step emits at most one symbol.
+struct HuffmanDecodeEntry {
+    uint16_t next_state;
+    uint8_t flags;
+    uint8_t symbol;
+};
+
+class BAIDU_CACHELINE_ALIGNMENT HuffmanDecodeTable {
+DISALLOW_COPY_AND_ASSIGN(HuffmanDecodeTable);
+public:
+    enum Flags {
+        // `symbol' is decoded in this step
+        EMIT_SYMBOL = 1,
+        // The stream is either decoded to EOS or undecodable
+        FAILED = 2,
+        // The stream can end after this step: bits after the last symbol
+        // are the MSB of EOS and shorter than 8
+        ACCEPTED = 4,
+    };
+    static const uint16_t ROOT_STATE = 0;
+
+    explicit HuffmanDecodeTable(const HuffmanTree* tree) {
+        // Number internal nodes in BFS order, root is state 0. Also record
+        // depths of nodes reachable from root by `1's only, which are valid
+        // paddings
+        std::vector<int> state_of_node(1, -1);
+        std::vector<int> padding_depth(1, -1);
+        std::vector<HuffmanTree::NodeId> nodes;
+        nodes.push_back(HuffmanTree::ROOT_NODE);
+        state_of_node.resize(HuffmanTree::ROOT_NODE + 1, -1);
+        padding_depth.resize(HuffmanTree::ROOT_NODE + 1, -1);
+        state_of_node[HuffmanTree::ROOT_NODE] = 0;
+        padding_depth[HuffmanTree::ROOT_NODE] = 0;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const HuffmanNode* n = tree->node(nodes[i]);
+            const HuffmanTree::NodeId children[2] =
+                { n->left_child, n->right_child };
+            for (int b = 0; b < 2; ++b) {
+                const HuffmanTree::NodeId c = children[b];
+                const HuffmanNode* child = tree->node(c);
+                if (child == NULL) {
+                    continue;
+                }
+                if (c >= state_of_node.size()) {
+                    state_of_node.resize(c + 1, -1);
+                    padding_depth.resize(c + 1, -1);
+                }
+                if (b == 1 && padding_depth[nodes[i]] >= 0) {
+                    padding_depth[c] = padding_depth[nodes[i]] + 1;
+                }
+                if (child->value == HuffmanTree::INVALID_VALUE) {
+                    state_of_node[c] = nodes.size();
+                    nodes.push_back(c);
+                }
+            }
+        }
+        _entries.resize(nodes.size() * 16);
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            for (uint32_t nibble = 0; nibble < 16; ++nibble) {
+                HuffmanDecodeEntry e = { ROOT_STATE, 0, 0 };
+                HuffmanTree::NodeId cur = nodes[i];
+                for (int bit = 3; bit >= 0; --bit) {
+                    const HuffmanNode* n = tree->node(cur);
+                    cur = (nibble & (1u << bit)) ? n->right_child
+                                                 : n->left_child;
+                    const HuffmanNode* child = tree->node(cur);
+                    if (child == NULL ||
+                        child->value == HPACK_HUFFMAN_EOS) {
+                        e.flags = FAILED;
+                        break;
+                    }
+                    if (child->value != HuffmanTree::INVALID_VALUE) {
+                        e.flags |= EMIT_SYMBOL;
+                        e.symbol = static_cast<uint8_t>(child->value);
+                        cur = HuffmanTree::ROOT_NODE;
+                    }
+                }
+                if (!(e.flags & FAILED)) {
+                    e.next_state = state_of_node[cur];
+                    if (padding_depth[cur] >= 0 && padding_depth[cur] <= 7) {
+                        e.flags |= ACCEPTED;
+                    }
+                }
+                _entries[i * 16 + nibble] = e;
+            }
+        }
+    }
+
+    const HuffmanDecodeEntry& entry(uint16_t state, uint8_t nibble) const {
+        return _entries[state * 16 + nibble];
+    }
+
+private:
+    std::vector<HuffmanDecodeEntry> _entries;
+};
+
+// Encode bytes with codes of at most 30 bits into a 64-bit accumulator and
+// write out the completed bytes in batches.
 class HuffmanEncoder {
 DISALLOW_COPY_AND_ASSIGN(HuffmanEncoder);
 public:
     HuffmanEncoder(butil::IOBufAppender* out, const HuffmanCode* table)
         : _out(out)
         , _table(table)
-        , _partial_byte(0)
-        , _remain_bit(8)
+        , _bits(0)
+        , _nbits(0)
+        , _nbuf(0)
         , _out_bytes(0)
     {}
 
     void Encode(unsigned char byte) {
         const HuffmanCode code = _table[byte];
-        uint16_t bits_left = code.bit_len;
-        while (bits_left) {
-            const uint16_t adding_bits_len = std::min(_remain_bit, bits_left);
-            const uint8_t adding_bits = static_cast<uint8_t>(
-                    (code.code & ((1u << bits_left) - 1))   // clear leading bits
-                            >> (bits_left - adding_bits_len));  // align to LSB
-            _partial_byte |= adding_bits << (_remain_bit - adding_bits_len);
-            _remain_bit -= adding_bits_len;
-            bits_left -= adding_bits_len;
-            if (!_remain_bit) {
-                ++_out_bytes;
-                _out->push_back(_partial_byte);
-                _remain_bit = 8;
-                _partial_byte = 0;
+        _bits = (_bits << code.bit_len) | code.code;
+        _nbits += code.bit_len;
+        if (_nbits >= 32) {
+            _nbits -= 32;
+            const uint32_t v = static_cast<uint32_t>(_bits >> _nbits);
+            if (_nbuf + 4 > sizeof(_buf)) {
+                Flush();
             }
+            _buf[_nbuf++] = static_cast<char>(v >> 24);
+            _buf[_nbuf++] = static_cast<char>(v >> 16);
+            _buf[_nbuf++] = static_cast<char>(v >> 8);
+            _buf[_nbuf++] = static_cast<char>(v);
         }
     }
 
     void EndStream() {
-        if (_remain_bit == 8u) {
-            return;
-        }
-        DCHECK_LT(_remain_bit, 8u);
-        // Add padding `1's to lsb to make _out aligned
-        _partial_byte |= (1 << _remain_bit) - 1;
-        // TODO: push_back is probably costly since it acquires tls everytime it
-        // is invoked.
-        _out->push_back(_partial_byte);
-        _partial_byte = 0;
-        _remain_bit = 0;
+        while (_nbits >= 8) {
+            _nbits -= 8;
+            PutByte(static_cast<char>(_bits >> _nbits));
+        }
+        if (_nbits) {
+            DCHECK_LT(_nbits, 8u);
+            // Add padding `1's to lsb to make _out aligned
+            const uint32_t pad = 8 - _nbits;
+            PutByte(static_cast<char>((_bits << pad) | ((1u << pad) - 1)));
+            _nbits = 0;
+        }
+        Flush();
         _out = NULL;
-        ++_out_bytes;
     }
 
     uint32_t out_bytes() const { return _out_bytes; }
 
 private:
+    void PutByte(char c) {
+        if (_nbuf == sizeof(_buf)) {
+            Flush();
+        }
+        _buf[_nbuf++] = c;
+    }
+
+    void Flush() {
+        _out->append(_buf, _nbuf);
+        _out_bytes += _nbuf;
+        _nbuf = 0;
+    }
+
     butil::IOBufAppender* _out;
     const HuffmanCode* _table;
-    uint8_t  _partial_byte;
-    uint16_t _remain_bit;
+    uint64_t _bits;
+    uint32_t _nbits;
+    uint32_t _nbuf;
     uint32_t _out_bytes;
+    char _buf[64];
 };
 
 class HuffmanDecoder {
 DISALLOW_COPY_AND_ASSIGN(HuffmanDecoder);
 public:
-    HuffmanDecoder(std::string* out, const HuffmanTree* tree)
-        // FIXME: resizing of out is costly
+    // Decoded bytes are written from `out', which must have enough space,
+    // the 8/5 of input length at most.
+    HuffmanDecoder(char* out, const HuffmanDecodeTable* table)
         : _out(out)
-        , _tree(tree)
-        , _cur_node(tree->node(HuffmanTree::ROOT_NODE))
-        , _cur_depth(0)  // Depth of root node is 0
-        , _padding(true)
+        , _table(table)
+        , _state(HuffmanDecodeTable::ROOT_STATE)
+        , _accepted(true)
     {}
     int Decode(uint8_t byte) {
-        for (int i = 7; i >= 0; --i) {
-            if (byte & (1u << i)) {
-                _cur_node = _tree->node(_cur_node->right_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
-                }
-                _padding &= 1;
-            } else {
-                _cur_node = _tree->node(_cur_node->left_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
-                }
-                _padding &= 0;
-            }
-            ++_cur_depth;
+        if (DecodeNibble(byte >> 4) != 0) {
+            return -1;
         }
-        return 0;
+        return DecodeNibble(byte & 0xF);
     }
     int EndStream() {
-        if (_cur_depth == 0) {
-            return 0;
-        }
-        if (_cur_depth <= 7 && _padding) {
+        if (_accepted) {
             return 0;
         }
         // Invalid stream, the padding is not corresponding to MSB of EOS
         // https://tools.ietf.org/html/rfc7541#section-5.2
         return -1;
     }
+    char* out() const { return _out; }
 private:
-    std::string* _out;
-    const HuffmanTree* _tree;
-    const HuffmanNode* _cur_node;
-    uint16_t _cur_depth;
-    bool _padding;
+    int DecodeNibble(uint8_t nibble) {
+        const HuffmanDecodeEntry& e = _table->entry(_state, nibble);
+        if (BAIDU_UNLIKELY(e.flags & HuffmanDecodeTable::FAILED)) {
+            LOG(ERROR) << "Decoder stream reaches EOS or NULL_NODE";
+            return -1;
+        }
+        if (e.flags & HuffmanDecodeTable::EMIT_SYMBOL) {
+            *_out++ = static_cast<char>(e.symbol);
+        }
+        _state = e.next_state;
+        _accepted = (e.flags & HuffmanDecodeTable::ACCEPTED);
+        return 0;
+    }
+    char* _out;
+    const HuffmanDecodeTable* _table;
+    uint16_t _state;
+    bool _accepted;
 };
 
 // Primitive Type Representations
@@ -453,15 +540,16 @@ inline size_t EncodeInteger(butil::IOBufAppender* out, uint8_t msb,
 }
 
 // Static variables
-static HuffmanTree* s_huffman_tree = NULL;
+static HuffmanDecodeTable* s_huffman_decode_table = NULL;
 static IndexTable* s_static_table = NULL;
 static pthread_once_t s_create_once = PTHREAD_ONCE_INIT;
 
 static void CreateStaticTableOrDie() {
-    s_huffman_tree = new HuffmanTree;
+    HuffmanTree huffman_tree;
     for (size_t i = 0; i < ARRAY_SIZE(s_huffman_table); ++i) {
-        s_huffman_tree->AddLeafNode(i, s_huffman_table[i]);
+        huffman_tree.AddLeafNode(i, s_huffman_table[i]);
     }
+    s_huffman_decode_table = new HuffmanDecodeTable(&huffman_tree);
     IndexTableOptions options;
     options.max_size = UINT_MAX;
     options.static_table = s_static_headers;
@@ -566,15 +654,27 @@ inline ssize_t DecodeString(butil::IOBufBytesIterator& iter, std::string* out) {
         iter.copy_and_forward(out, length);
         return in_bytes;
     }
-    HuffmanDecoder d(out, s_huffman_tree);
-    for (; iter != NULL && length; ++iter, --length) {
-        if (d.Decode(*iter) != 0) {
+    // Shortest code is 5 bits, a byte is decoded to at most 8/5 bytes.
+    out->resize(length * 8 / 5 + 1);
+    HuffmanDecoder d(&(*out)[0], s_huffman_decode_table);
+    char buf[256];
+    while (length) {
+        const size_t n = iter.copy_and_forward(
+            buf, std::min(length, (uint32_t)sizeof(buf)));
+        if (n == 0) {
             return -1;
         }
+        for (size_t i = 0; i < n; ++i) {
+            if (d.Decode(buf[i]) != 0) {
+                return -1;
+            }
+        }
+        length -= n;
     }
     if (d.EndStream() != 0) {
         return -1;
     }
+    out->resize(d.out() - out->data());
     return in_bytes;
 }
 
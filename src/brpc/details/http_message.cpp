@@ -16,6 +16,7 @@
 //          Ge,Jun (gejun@baidu.com)
 
 #include <cstdlib>
+#include <pthread.h>
 
 #include <string>                               // std::string
 #include <iostream>
@@ -25,6 +26,8 @@
 #include "butil/scoped_lock.h"
 #include "butil/endpoint.h"
 #include "butil/base64.h"
+#include "butil/string_printf.h"
+#include "butil/fast_search.h"               // find_control_char
 #include "bthread/bthread.h"                    // bthread_usleep
 #include "brpc/log.h"
 #include "brpc/reloadable_flags.h"
@@ -36,6 +39,11 @@ DEFINE_bool(http_verbose, false,
             "[DEBUG] Print EVERY http request/response to stderr");
 DEFINE_int32(http_verbose_max_body_length, 512,
              "[DEBUG] Max body length printed when -http_verbose is on");
+DEFINE_bool(http_fast_parser, true, "Parse intact headers of HTTP/1.x "
+            "messages in one pass instead of with http_parser, which is "
+            "only used for messages being received slowly or in less common "
+            "formats(e.g. chunked)");
+BRPC_VALIDATE_GFLAG(http_fast_parser, PassValidate);
 DECLARE_int64(socket_max_unwritten_bytes);
 
 // Implement callbacks for http parser
@@ -131,14 +139,22 @@ int HttpMessage::on_header_value(http_parser *parser,
     return 0;
 }
 
+// Headers checked for every message, hashed only once.
+static const butil::CaseIgnoredKey CONTENT_TYPE_KEY("content-type");
+static const butil::CaseIgnoredKey CONTENT_LENGTH_KEY("content-length");
+static const butil::CaseIgnoredKey HOST_KEY("host");
+static const butil::CaseIgnoredKey ACCEPT_KEY("accept");
+static const butil::CaseIgnoredKey USER_AGENT_KEY("user-agent");
+static const butil::CaseIgnoredKey AUTHORIZATION_KEY("authorization");
+
 int HttpMessage::on_headers_complete(http_parser *parser) {
     HttpMessage *http_message = (HttpMessage *)parser->data;
     http_message->_stage = HTTP_ON_HEADERS_COMPLELE;
     // Move content-type into the member field.
-    const std::string* content_type = http_message->header().GetHeader("content-type");
+    const std::string* content_type = http_message->header().GetHeader(CONTENT_TYPE_KEY);
     if (content_type) {
         http_message->header().set_content_type(*content_type);
-        http_message->header().RemoveHeader("content-type");
+        http_message->header().RemoveHeader(CONTENT_TYPE_KEY);
     }
     if (parser->http_major > 1) {
         // NOTE: this checking is a MUST because ProcessHttpResponse relies
@@ -171,7 +187,7 @@ int HttpMessage::on_headers_complete(http_parser *parser) {
     //server, the responce MUST be a 400 error messsage.
     URI & uri = http_message->header().uri();
     if (uri._host.empty()) {
-        const std::string* host_header = http_message->header().GetHeader("host");
+        const std::string* host_header = http_message->header().GetHeader(HOST_KEY);
         if (host_header != NULL) {
             uri.SetHostAndPort(*host_header);
         }
@@ -395,6 +411,8 @@ HttpMessage::HttpMessage(bool read_body_progressively)
     , _read_body_progressively(read_body_progressively)
     , _body_reader(NULL)
     , _cur_value(NULL)
+    , _http_parser_started(false)
+    , _fast_body_left(-1)
     , _vmsgbuilder(NULL)
     , _body_length(0) {
     http_parser_init(&_parser, HTTP_BOTH);
@@ -423,6 +441,22 @@ ssize_t HttpMessage::ParseFromArray(const char *data, const size_t length) {
                    << ") to already-completed message";
         return -1;
     }
+    if (_fast_body_left >= 0) {
+        if (length == 0) {
+            // EOF before the body is complete.
+            _parser.http_errno = HPE_INVALID_EOF_STATE;
+            return -1;
+        }
+        const ssize_t n = AppendFastBody(data, length);
+        if (n < 0) {
+            return -1;
+        }
+        _parsed_length += n;
+        return n;
+    }
+    if (length != 0) {
+        _http_parser_started = true;
+    }
     const size_t nprocessed =
         http_parser_execute(&_parser, &g_parser_settings, data, length);
     if (_parser.http_errno != 0) {
@@ -444,6 +478,28 @@ ssize_t HttpMessage::ParseFromIOBuf(const butil::IOBuf &buf) {
                    << ") to already-completed message";
         return -1;
     }
+    if (_fast_body_left >= 0) {
+        const ssize_t n = AppendFastBody(buf, 0);
+        if (n < 0) {
+            return -1;
+        }
+        _parsed_length += n;
+        return n;
+    }
+    if (!_http_parser_started && !buf.empty() && FLAGS_http_fast_parser &&
+        // Progressive reading and printing messages are left to http_parser.
+        !_read_body_progressively && !FLAGS_http_verbose) {
+        const ssize_t nheader = ParseHeadersFast(buf);
+        if (nheader > 0) {
+            // Not progressive yet, appending the body never fails.
+            const size_t n = nheader + AppendFastBody(buf, nheader);
+            _parsed_length += n;
+            return n;
+        }
+    }
+    if (!buf.empty()) {
+        _http_parser_started = true;
+    }
     size_t nprocessed = 0;
     for (size_t i = 0; i < buf.backing_block_num(); ++i) {
         butil::StringPiece blk = buf.backing_block(i);
@@ -467,6 +523,282 @@ ssize_t HttpMessage::ParseFromIOBuf(const butil::IOBuf &buf) {
     return (ssize_t)nprocessed;
 }
 
+ssize_t HttpMessage::AppendFastBody(const butil::IOBuf& buf, size_t pos) {
+    const size_t n = std::min((size_t)_fast_body_left, buf.size() - pos);
+    if (!_read_body_progressively) {
+        // Reference blocks of `buf' without copying.
+        buf.append_to(&_body, n, pos);
+    } else {
+        butil::IOBuf part;
+        buf.append_to(&part, n, pos);
+        for (size_t i = 0; i < part.backing_block_num(); ++i) {
+            const butil::StringPiece blk = part.backing_block(i);
+            if (OnBody(blk.data(), blk.size()) != 0) {
+                _parser.http_errno = HPE_CB_body;
+                return -1;
+            }
+        }
+    }
+    return OnFastBodyAppended(n);
+}
+
+ssize_t HttpMessage::AppendFastBody(const char* data, size_t size) {
+    const size_t n = std::min((size_t)_fast_body_left, size);
+    if (!_read_body_progressively) {
+        _body.append(data, n);
+    } else if (n != 0 && OnBody(data, n) != 0) {
+        _parser.http_errno = HPE_CB_body;
+        return -1;
+    }
+    return OnFastBodyAppended(n);
+}
+
+ssize_t HttpMessage::OnFastBodyAppended(size_t n) {
+    _fast_body_left -= n;
+    _stage = HTTP_ON_BODY;
+    if (_fast_body_left == 0 && OnMessageComplete() != 0) {
+        _parser.http_errno = HPE_CB_message_complete;
+        return -1;
+    }
+    return n;
+}
+
+ssize_t HttpMessage::ParseHeadersFast(const butil::IOBuf& buf) {
+    const butil::StringPiece first = buf.backing_block(0);
+    const ssize_t rc = ParseHeadersFastFrom(first.data(), first.size());
+    if (rc != 0 || first.size() == buf.size()) {
+        return rc;
+    }
+    // Headers may span blocks, copy them out.
+    std::string headers;
+    buf.copy_to(&headers, BRPC_HTTP_MAX_HEADER_SIZE);
+    return ParseHeadersFastFrom(headers.data(), headers.size());
+}
+
+static bool IsHeaderNameChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.';
+}
+
+inline bool EqualsIgnoreCase(const butil::StringPiece& s, const char* lower,
+                             size_t len) {
+    return s.size() == len && strncasecmp(s.data(), lower, len) == 0;
+}
+
+// Common methods sent by clients, others are left to http_parser.
+static bool ParseCommonMethod(const butil::StringPiece& s, HttpMethod* m) {
+    switch (s.size()) {
+    case 3:
+        if (memcmp(s.data(), "GET", 3) == 0) {
+            *m = HTTP_METHOD_GET;
+            return true;
+        } else if (memcmp(s.data(), "PUT", 3) == 0) {
+            *m = HTTP_METHOD_PUT;
+            return true;
+        }
+        return false;
+    case 4:
+        if (memcmp(s.data(), "POST", 4) == 0) {
+            *m = HTTP_METHOD_POST;
+            return true;
+        } else if (memcmp(s.data(), "HEAD", 4) == 0) {
+            *m = HTTP_METHOD_HEAD;
+            return true;
+        }
+        return false;
+    case 5:
+        if (memcmp(s.data(), "PATCH", 5) == 0) {
+            *m = HTTP_METHOD_PATCH;
+            return true;
+        }
+        return false;
+    case 6:
+        if (memcmp(s.data(), "DELETE", 6) == 0) {
+            *m = HTTP_METHOD_DELETE;
+            return true;
+        }
+        return false;
+    case 7:
+        if (memcmp(s.data(), "OPTIONS", 7) == 0) {
+            *m = HTTP_METHOD_OPTIONS;
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+// Parse "HTTP/x.y" at `p'. Returns end of the version, NULL if it's not a
+// single-digit version.
+static const char* ParseHttpVersion(const char* p, const char* end,
+                                    int* major, int* minor) {
+    if (end - p < 8 || memcmp(p, "HTTP/", 5) != 0 ||
+        p[5] < '0' || p[5] > '9' || p[6] != '.' || p[7] < '0' || p[7] > '9') {
+        return NULL;
+    }
+    *major = p[5] - '0';
+    *minor = p[7] - '0';
+    return p + 8;
+}
+
+// Find the CRLF ending the line starting at `p'. Returns position of CR,
+// `end' if the line is incomplete, NULL if the line contains control
+// characters other than HTAB.
+static const char* FindLineEnd(const char* p, const char* end) {
+    while (true) {
+        const char* q = butil::find_control_char(p, end - p);
+        if (q == NULL || q + 1 >= end) {
+            return end;
+        }
+        if (*q == '\r') {
+            return (q[1] == '\n' ? q : NULL);
+        }
+        if (*q != '\t') {
+            return NULL;
+        }
+        p = q + 1;
+    }
+}
+
+ssize_t HttpMessage::ParseHeadersFastFrom(const char* data, size_t size) {
+    struct HeaderSpan {
+        butil::StringPiece name;
+        butil::StringPiece value;
+    };
+    const char* const end = data + std::min(size, (size_t)BRPC_HTTP_MAX_HEADER_SIZE);
+    const char* p = data;
+    int major = 0;
+    int minor = 0;
+    int status_code = 0;
+    HttpMethod method = HTTP_METHOD_DELETE;
+    butil::StringPiece url;
+    const bool is_request = (end - p < 5 || memcmp(p, "HTTP/", 5) != 0);
+    if (is_request) {
+        // Request-Line = Method SP Request-URI SP HTTP-Version CRLF
+        const char* sp = (const char*)memchr(p, ' ', end - p);
+        if (sp == NULL || !ParseCommonMethod(butil::StringPiece(p, sp - p),
+                                             &method)) {
+            return 0;
+        }
+        p = sp + 1;
+        sp = (const char*)memchr(p, ' ', end - p);
+        if (sp == NULL || sp == p ||
+            butil::find_control_char(p, sp - p) != NULL) {
+            return 0;
+        }
+        url.set(p, sp - p);
+        p = ParseHttpVersion(sp + 1, end, &major, &minor);
+        if (p == NULL || end - p < 2 || p[0] != '\r' || p[1] != '\n') {
+            return 0;
+        }
+        p += 2;
+    } else {
+        // Status-Line = HTTP-Version SP Status-Code SP Reason-Phrase CRLF
+        p = ParseHttpVersion(p, end, &major, &minor);
+        if (p == NULL || end - p < 5 || p[0] != ' ' ||
+            p[1] < '1' || p[1] > '5' || p[2] < '0' || p[2] > '9' ||
+            p[3] < '0' || p[3] > '9' || p[4] != ' ') {
+            return 0;
+        }
+        status_code = (p[1] - '0') * 100 + (p[2] - '0') * 10 + (p[3] - '0');
+        if (status_code < 200 || status_code == 204 || status_code == 304) {
+            // Messages without bodies.
+            return 0;
+        }
+        const char* cr = FindLineEnd(p + 5, end);
+        if (cr == NULL || cr == end) {
+            return 0;
+        }
+        p = cr + 2;
+    }
+    // Spans reference `data' until the headers are complete.
+    HeaderSpan spans[64];
+    size_t nspan = 0;
+    int64_t content_length = -1;
+    while (true) {
+        if (end - p < 2) {
+            return 0;
+        }
+        if (p[0] == '\r') {
+            if (p[1] != '\n') {
+                return 0;
+            }
+            p += 2;
+            break;
+        }
+        const char* q = p;
+        while (q < end && IsHeaderNameChar(*q)) {
+            ++q;
+        }
+        if (q == p || q == end || *q != ':' || nspan == arraysize(spans)) {
+            return 0;
+        }
+        HeaderSpan& h = spans[nspan++];
+        h.name.set(p, q - p);
+        for (++q; q < end && (*q == ' ' || *q == '\t'); ++q) {}
+        const char* cr = FindLineEnd(q, end);
+        if (cr == NULL || cr == end) {
+            return 0;
+        }
+        // Trailing spaces are kept as http_parser does.
+        h.value.set(q, cr - q);
+        p = cr + 2;
+        if (EqualsIgnoreCase(h.name, "content-length", 14)) {
+            if (content_length >= 0 || h.value.empty() ||
+                h.value.size() > 18) {
+                return 0;
+            }
+            content_length = 0;
+            for (size_t i = 0; i < h.value.size(); ++i) {
+                const char c = h.value[i];
+                if (c < '0' || c > '9') {
+                    return 0;
+                }
+                content_length = content_length * 10 + (c - '0');
+            }
+        } else if (EqualsIgnoreCase(h.name, "transfer-encoding", 17) ||
+                   EqualsIgnoreCase(h.name, "upgrade", 7)) {
+            // Chunked bodies and upgrades are handled by http_parser.
+            return 0;
+        }
+    }
+    if (content_length < 0) {
+        if (!is_request) {
+            // The body of the response ends at EOF.
+            return 0;
+        }
+        content_length = 0;
+    }
+
+    // Materialize the spans.
+    for (size_t i = 0; i < nspan; ++i) {
+        std::string& value = _header.GetOrAddHeader(spans[i].name.as_string());
+        if (!value.empty()) {
+            value.push_back(',');
+        }
+        value.append(spans[i].value.data(), spans[i].value.size());
+    }
+    _url.assign(url.data(), url.size());
+    _parser.type = (is_request ? HTTP_REQUEST : HTTP_RESPONSE);
+    _parser.http_major = major;
+    _parser.http_minor = minor;
+    _parser.status_code = status_code;
+    _parser.method = method;
+    _parser.content_length = content_length;
+    if (on_headers_complete(&_parser) != 0) {
+        // Let http_parser report the error from the beginning.
+        _header.Clear();
+        _url.clear();
+        http_parser_init(&_parser, HTTP_BOTH);
+        _parser.data = this;
+        _stage = HTTP_ON_MESSAGE_BEGIN;
+        return 0;
+    }
+    _fast_body_left = content_length;
+    return p - data;
+}
+
 static void DescribeHttpParserFlags(std::ostream& os, unsigned int flags) {
     if (flags & F_CHUNKED) {
         os << "F_CHUNKED|";
@@ -545,7 +877,7 @@ void SerializeHttpRequest(butil::IOBuf* request,
     os << " HTTP/" << h->major_version() << '.'
        << h->minor_version() << BRPC_CRLF;
     if (h->method() != HTTP_METHOD_GET) {
-        h->RemoveHeader("Content-Length");
+        h->RemoveHeader(CONTENT_LENGTH_KEY);
         // Never use "Content-Length" set by user.
         os << "Content-Length: " << (content ? content->length() : 0)
            << BRPC_CRLF;
@@ -559,7 +891,7 @@ void SerializeHttpRequest(butil::IOBuf* request,
     //the request-target consists of only the host name and port number of 
     //the tunnel destination, seperated by a colon. For example,
     //Host: server.example.com:80
-    if (h->GetHeader("host") == NULL) {
+    if (h->GetHeader(HOST_KEY) == NULL) {
         os << "Host: ";
         if (!uri.host().empty()) {
             os << uri.host();
@@ -579,15 +911,15 @@ void SerializeHttpRequest(butil::IOBuf* request,
          it != h->HeaderEnd(); ++it) {
         os << it->first << ": " << it->second << BRPC_CRLF;
     }
-    if (h->GetHeader("Accept") == NULL) {
+    if (h->GetHeader(ACCEPT_KEY) == NULL) {
         os << "Accept: */*" BRPC_CRLF;
     }
     // The fake "curl" user-agent may let servers return plain-text results.
-    if (h->GetHeader("User-Agent") == NULL) {
+    if (h->GetHeader(USER_AGENT_KEY) == NULL) {
         os << "User-Agent: brpc/1.0 curl/7.0" BRPC_CRLF;
     }
     const std::string& user_info = h->uri().user_info();
-    if (!user_info.empty() && h->GetHeader("Authorization") == NULL) {
+    if (!user_info.empty() && h->GetHeader(AUTHORIZATION_KEY) == NULL) {
         // NOTE: just assume user_info is well formatted, namely
         // "<user_name>:<password>". Users are very unlikely to add extra
         // characters in this part and even if users did, most of them are
@@ -611,29 +943,77 @@ void SerializeHttpRequest(butil::IOBuf* request,
 //                CRLF
 //                [ message-body ]          ; Section 7.2
 // Status-Line = HTTP-Version SP Status-Code SP Reason-Phrase CRLF
+// Status lines of HTTP/1.0 and HTTP/1.1 responses, encoded once.
+static const int MAX_CACHED_STATUS_CODE = 600;
+static std::string* g_status_lines[2][MAX_CACHED_STATUS_CODE];
+static pthread_once_t g_status_lines_once = PTHREAD_ONCE_INIT;
+
+static void InitStatusLines() {
+    for (int minor = 0; minor < 2; ++minor) {
+        for (int code = 0; code < MAX_CACHED_STATUS_CODE; ++code) {
+            g_status_lines[minor][code] = new std::string(butil::string_printf(
+                    "HTTP/1.%d %d %s" BRPC_CRLF, minor, code,
+                    HttpReasonPhrase(code)));
+        }
+    }
+}
+
+static void AppendStatusLine(butil::IOBufAppender* os, const HttpHeader& h) {
+    pthread_once(&g_status_lines_once, InitStatusLines);
+    const int code = h.status_code();
+    if (h.major_version() == 1 && h.minor_version() >= 0 &&
+        h.minor_version() < 2 && code >= 0 && code < MAX_CACHED_STATUS_CODE) {
+        os->append(*g_status_lines[h.minor_version()][code]);
+        return;
+    }
+    os->append(butil::string_printf(
+            "HTTP/%d.%d %d %s" BRPC_CRLF, h.major_version(), h.minor_version(),
+            code, h.reason_phrase()));
+}
+
+static void AppendDecimal(butil::IOBufAppender* os, uint64_t n) {
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    os->append(p, buf + sizeof(buf) - p);
+}
+
+inline void AppendHeaderLine(butil::IOBufAppender* os,
+                             const butil::StringPiece& name,
+                             const butil::StringPiece& value) {
+    os->append(name);
+    os->append(": ", 2);
+    os->append(value);
+    os->append(BRPC_CRLF, 2);
+}
+
 void SerializeHttpResponse(butil::IOBuf* response,
                            HttpHeader* h,
                            butil::IOBuf* content) {
-    butil::IOBufBuilder os;
-    os << "HTTP/" << h->major_version() << '.'
-       << h->minor_version() << ' ' << h->status_code()
-       << ' ' << h->reason_phrase() << BRPC_CRLF;
+    // Responses are serialized for every request at server-side, append
+    // pre-encoded parts without formatting.
+    butil::IOBufAppender os;
+    AppendStatusLine(&os, *h);
     if (content) {
-        h->RemoveHeader("Content-Length");
+        h->RemoveHeader(CONTENT_LENGTH_KEY);
         // Never use "Content-Length" set by user.
         // Always set Content-Length since lighttpd requires the header to be
         // set to 0 for empty content.
-        os << "Content-Length: " << content->length() << BRPC_CRLF;
+        os.append("Content-Length: ", 16);
+        AppendDecimal(&os, content->length());
+        os.append(BRPC_CRLF, 2);
     }
     if (!h->content_type().empty()) {
-        os << "Content-Type: " << h->content_type()
-           << BRPC_CRLF;
+        AppendHeaderLine(&os, "Content-Type", h->content_type());
     }
     for (HttpHeader::HeaderIterator it = h->HeaderBegin();
          it != h->HeaderEnd(); ++it) {
-        os << it->first << ": " << it->second << BRPC_CRLF;
+        AppendHeaderLine(&os, it->first, it->second);
     }
-    os << BRPC_CRLF;  // CRLF before content
+    os.append(BRPC_CRLF, 2);  // CRLF before content
     os.move_to(*response);
     if (content) {
         response->append(butil::IOBuf::Movable(*content));
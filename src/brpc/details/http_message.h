@@ -80,6 +80,11 @@ public:
 
     bool read_body_progressively() const { return _read_body_progressively; }
 
+    // [Server-side] Read the remaining body progressively, called when the
+    // headers are complete before the message is returned to the protocol
+    // handler. Body parsed so far is fed to the reader set later.
+    void set_read_body_progressively() { _read_body_progressively = true; }
+
     // Send new parts of the body to the reader. If the body already has some
     // data, feed them to the reader immediately.
     // Any error during the setting will destroy the reader.
@@ -94,6 +99,19 @@ private:
     DISALLOW_COPY_AND_ASSIGN(HttpMessage);
     int UnlockAndFlushToBodyReader(std::unique_lock<butil::Mutex>& locked);
 
+    // Parse the start line and headers at the beginning of `buf' in one
+    // pass without http_parser, which is much faster for intact headers.
+    // Returns bytes of the parsed part, 0 if the headers are incomplete or
+    // the message should be parsed by http_parser(e.g. chunked).
+    ssize_t ParseHeadersFast(const butil::IOBuf& buf);
+    ssize_t ParseHeadersFastFrom(const char* data, size_t size);
+    // Append body of the message whose headers were parsed by
+    // ParseHeadersFast(). Returns bytes appended, -1 if the body reader
+    // failed.
+    ssize_t AppendFastBody(const butil::IOBuf& buf, size_t pos);
+    ssize_t AppendFastBody(const char* data, size_t size);
+    ssize_t OnFastBodyAppended(size_t n);
+
     HttpParserStage _stage;
     std::string _url;
     HttpHeader _header;
@@ -108,6 +126,11 @@ private:
     struct http_parser _parser;
     std::string _cur_header;
     std::string *_cur_value;
+    // True if any data of the message was fed into _parser.
+    bool _http_parser_started;
+    // Bytes of the body not read yet, if headers were parsed by
+    // ParseHeadersFast(), -1 otherwise.
+    int64_t _fast_body_left;
 
 protected:
     // Only valid when -http_verbose is on
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include "butil/fast_search.h"
 
 #ifndef ULLONG_MAX
 # define ULLONG_MAX ((uint64_t) -1) /* 2^64-1 */
@@ -1595,7 +1596,20 @@ size_t http_parser_execute (http_parser *parser,
 
         switch (parser->header_state) {
           case h_general:
+          {
+            /* Skip to the end of the value in one pass rather than walking
+             * the main loop byte by byte. */
+            const char* p_cr_lf = butil::find_first_of2(
+                p, data + len - p, CR, LF);
+            const char* p_end = (p_cr_lf ? p_cr_lf : data + len);
+            parser->nread += (p_end - 1) - p;
+            if (parser->nread > (BRPC_HTTP_MAX_HEADER_SIZE)) {
+              SET_ERRNO(HPE_HEADER_OVERFLOW);
+              goto error;
+            }
+            p = p_end - 1;
             break;
+          }
 
           case h_connection:
           case h_transfer_encoding:
@@ -0,0 +1,102 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <algorithm>                            // std::max
+#include "butil/time.h"                         // cpuwide_time_us
+#include "butil/scoped_lock.h"
+#include "brpc/socket.h"
+#include "brpc/details/idle_connection_wheel.h"
+
+
+namespace brpc {
+
+static const int64_t TICK_US = 1000000L;
+// Interval of checking connections when the timeout is turned off.
+static const int64_t DISABLED_CHECK_INTERVAL_US = 10000000L;
+
+IdleConnectionWheel::IdleConnectionWheel(size_t nslot)
+    : _slots(std::max(nslot, (size_t)2))
+    , _current_tick(butil::cpuwide_time_us() / TICK_US)
+    , _size(0) {
+}
+
+void IdleConnectionWheel::Add(SocketId id, int64_t deadline_us) {
+    Entry e;
+    e.id = id;
+    // Round up so that the connection is not checked before the deadline.
+    e.tick = (deadline_us + TICK_US - 1) / TICK_US;
+    BAIDU_SCOPED_LOCK(_mutex);
+    // Passed deadlines are checked at next tick.
+    const int64_t tick = std::max(e.tick, _current_tick);
+    _slots[tick % _slots.size()].push_back(e);
+    ++_size;
+}
+
+void IdleConnectionWheel::Advance(int64_t now_us, std::vector<SocketId>* due) {
+    due->clear();
+    const int64_t now_tick = now_us / TICK_US;
+    const int64_t nslot = _slots.size();
+    BAIDU_SCOPED_LOCK(_mutex);
+    // Check each slot at most once even if a lot of ticks were skipped.
+    _current_tick = std::max(_current_tick, now_tick + 1 - nslot);
+    for (; _current_tick <= now_tick; ++_current_tick) {
+        std::vector<Entry>& slot = _slots[_current_tick % nslot];
+        size_t nkept = 0;
+        for (size_t i = 0; i < slot.size(); ++i) {
+            if (slot[i].tick <= now_tick) {
+                due->push_back(slot[i].id);
+            } else {
+                // Wait for next round.
+                slot[nkept++] = slot[i];
+            }
+        }
+        slot.resize(nkept);
+    }
+    _size -= due->size();
+}
+
+size_t IdleConnectionWheel::CloseIdleConnections(int idle_seconds) {
+    const int64_t now_us = butil::cpuwide_time_us();
+    Advance(now_us, &_due);
+    size_t nclosed = 0;
+    for (size_t i = 0; i < _due.size(); ++i) {
+        SocketUniquePtr s;
+        if (Socket::Address(_due[i], &s) != 0) {
+            // Failed or recycled, not watched anymore.
+            continue;
+        }
+        if (idle_seconds <= 0) {
+            Add(_due[i], now_us + DISABLED_CHECK_INTERVAL_US);
+            continue;
+        }
+        const int64_t deadline_us =
+            s->last_active_time_us() + idle_seconds * 1000000L;
+        if (deadline_us < now_us) {
+            s->ReleaseReferenceIfIdle(idle_seconds);
+            ++nclosed;
+        } else {
+            Add(_due[i], deadline_us);
+        }
+    }
+    return nclosed;
+}
+
+size_t IdleConnectionWheel::size() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _size;
+}
+
+} // namespace brpc
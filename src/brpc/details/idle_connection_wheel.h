@@ -0,0 +1,78 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_IDLE_CONNECTION_WHEEL_H
+#define BRPC_IDLE_CONNECTION_WHEEL_H
+
+#include <vector>
+#include "butil/macros.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/socket_id.h"                 // SocketId
+
+
+namespace brpc {
+
+// Closes connections without data transmission for a while. Connections are
+// hashed into one-second slots of a timing wheel by their deadlines, and each
+// tick only checks connections in the slot that expires, instead of scanning
+// all connections every second which is costly for a lot of connections
+// (>100K). Deadlines are not moved on every read or write: a connection found
+// active when its slot expires is added back at last_active_time_us() plus
+// the timeout.
+class IdleConnectionWheel {
+public:
+    // Deadlines more than `nslot' seconds later wait for more rounds.
+    explicit IdleConnectionWheel(size_t nslot = 64);
+
+    // Check `id' at `deadline_us' (butil::cpuwide_time_us()).
+    void Add(SocketId id, int64_t deadline_us);
+
+    // Move connections whose deadlines are not later than `now_us' into
+    // `due'. Slots skipped since last call are checked as well.
+    void Advance(int64_t now_us, std::vector<SocketId>* due);
+
+    // Release connections due and idle for more than `idle_seconds', add the
+    // others back. Connections are checked every 10 seconds when
+    // `idle_seconds' is non-positive, so that they're watched again soon
+    // after the timeout is turned on by reloading gflags.
+    // Returns number of connections released.
+    size_t CloseIdleConnections(int idle_seconds);
+
+    // Number of connections in the wheel, including recycled ones not
+    // removed yet.
+    size_t size() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(IdleConnectionWheel);
+
+    struct Entry {
+        SocketId id;
+        int64_t tick;
+    };
+
+    mutable butil::Mutex _mutex;
+    std::vector<std::vector<Entry> > _slots;
+    // The first tick not checked yet.
+    int64_t _current_tick;
+    size_t _size;
+    // Only used by CloseIdleConnections() which runs in one thread.
+    std::vector<SocketId> _due;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_IDLE_CONNECTION_WHEEL_H
@@ -0,0 +1,827 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "butil/build_config.h"                  // OS_LINUX
+#include <errno.h>
+#include <sched.h>                               // sched_yield
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/socket.h"
+#include "brpc/details/io_uring_engine.h"
+
+// Multishot recv(6.0) implies provided buffer rings(5.19) and sparse
+// registered files(5.19).
+#if defined(OS_LINUX) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT)
+#define BRPC_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef BRPC_HAS_IO_URING
+#include <sys/epoll.h>                          // EPOLLIN
+#include <sys/mman.h>
+#include <sys/resource.h>                       // getrlimit
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace brpc {
+
+DECLARE_int64(socket_max_unwritten_bytes);
+
+DEFINE_int32(io_uring_queue_depth, 4096,
+             "Number of entries in the submission queue of each io_uring, "
+             "the completion queue is 4 times larger");
+DEFINE_int32(io_uring_max_sockets, 65536,
+             "Max number of sockets (registered files) in each io_uring");
+DEFINE_int32(io_uring_buffer_size, 16384,
+             "Size of each buffer provided to io_uring for receiving");
+DEFINE_int32(io_uring_buffer_num, 4096,
+             "Number of buffers provided to each io_uring for receiving, "
+             "must be power of 2");
+DEFINE_int64(io_uring_max_unread_bytes, 16 * 1024 * 1024,
+             "Stop receiving from a socket of io_uring when so many bytes are "
+             "received but not read by the socket yet");
+BRPC_VALIDATE_GFLAG(io_uring_max_unread_bytes, PositiveInteger);
+
+#ifdef BRPC_HAS_IO_URING
+
+struct IoUringRing {
+    int fd;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    io_uring_sqe* sqes;
+    size_t sqes_len;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    // Owned by the holder of IoUringEngine::_sq_mutex
+    unsigned sq_local_tail;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+};
+
+struct IoUringBufferRing {
+    io_uring_buf_ring* br;
+    size_t br_len;
+    char* mem;
+    uint32_t buf_size;
+    uint32_t nbuf;
+    // Owned by the dispatcher thread which recycles the buffers.
+    uint16_t local_tail;
+};
+
+static const SocketId INVALID_SOCKET_ID = (SocketId)-1;
+
+// Max number of iovecs in one sendmsg, remaining blocks are sent by next
+// sendmsg.
+static const size_t IO_URING_MAX_IOV = 64;
+
+struct IoUringEntry {
+    butil::Mutex mutex;
+    SocketId socket_id;
+    bool used;
+    // RemoveConsumer() was called.
+    bool removed;
+    bool recv_armed;
+    // Receiving is cancelled because of too many unread bytes.
+    bool recv_paused;
+    bool send_inflight;
+    // Write() returned EAGAIN since last completed send.
+    bool write_blocked;
+    bool eof;
+    int error;
+    butil::IOBuf input;
+    // Being sent by the in-flight sendmsg.
+    butil::IOBuf sending;
+    butil::IOBuf unsent;
+    struct msghdr msg;
+    struct iovec iov[IO_URING_MAX_IOV];
+
+    IoUringEntry() { Reset(); }
+    void Reset() {
+        socket_id = INVALID_SOCKET_ID;
+        used = false;
+        removed = false;
+        recv_armed = false;
+        recv_paused = false;
+        send_inflight = false;
+        write_blocked = false;
+        eof = false;
+        error = 0;
+        input.clear();
+        sending.clear();
+        unsent.clear();
+    }
+    size_t unwritten_bytes() const { return sending.size() + unsent.size(); }
+};
+
+enum IoUringOp {
+    IO_URING_OP_RECV = 1,
+    IO_URING_OP_SEND = 2,
+    IO_URING_OP_CANCEL = 3,
+};
+
+inline uint64_t MakeUserData(IoUringOp op, int slot) {
+    return ((uint64_t)op << 56) | (uint32_t)slot;
+}
+
+inline int sys_io_uring_setup(unsigned entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+inline int sys_io_uring_enter(int fd, unsigned to_submit) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+inline int sys_io_uring_register(int fd, unsigned opcode,
+                                 const void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void DestroyRing(IoUringRing* r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    delete r;
+}
+
+static IoUringRing* CreateRing(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = entries * 4;
+    IoUringRing* r = new IoUringRing;
+    memset(r, 0, sizeof(*r));
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        PLOG(WARNING) << "Fail to setup io_uring";
+        delete r;
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        LOG(WARNING) << "io_uring of this kernel may drop completions";
+        DestroyRing(r);
+        return NULL;
+    }
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_len = r->cq_len = std::max(r->sq_len, r->cq_len);
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        PLOG(WARNING) << "Fail to mmap sq of io_uring";
+        DestroyRing(r);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            PLOG(WARNING) << "Fail to mmap cq of io_uring";
+            DestroyRing(r);
+            return NULL;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    r->sqes = (io_uring_sqe*)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, r->fd,
+                                  IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        PLOG(WARNING) << "Fail to mmap sqes of io_uring";
+        DestroyRing(r);
+        return NULL;
+    }
+    char* sq = (char*)r->sq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_entries = *(unsigned*)(sq + p.sq_off.ring_entries);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    char* cq = (char*)r->cq_ptr;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    return r;
+}
+
+static void DestroyBufferRing(IoUringBufferRing* b) {
+    if (b->br) {
+        munmap(b->br, b->br_len);
+    }
+    free(b->mem);
+    delete b;
+}
+
+static void ProvideBuffer(IoUringBufferRing* b, uint16_t bid) {
+    // Don't use io_uring_buf_ring::bufs which is not at offset 0 in C++:
+    // the empty struct of __DECLARE_FLEX_ARRAY takes space.
+    io_uring_buf* buf = (io_uring_buf*)b->br + (b->local_tail & (b->nbuf - 1));
+    buf->addr = (uint64_t)(b->mem + (size_t)bid * b->buf_size);
+    buf->len = b->buf_size;
+    buf->bid = bid;
+    ++b->local_tail;
+}
+
+static void PublishBuffers(IoUringBufferRing* b) {
+    __atomic_store_n(&b->br->tail, b->local_tail, __ATOMIC_RELEASE);
+}
+
+static IoUringBufferRing* CreateBufferRing(int ring_fd) {
+    const int32_t nbuf = FLAGS_io_uring_buffer_num;
+    if (nbuf <= 0 || nbuf > 32768 || (nbuf & (nbuf - 1)) != 0) {
+        LOG(ERROR) << "-io_uring_buffer_num=" << nbuf
+                   << " is not a power of 2 in [1, 32768]";
+        return NULL;
+    }
+    if (FLAGS_io_uring_buffer_size <= 0) {
+        LOG(ERROR) << "Invalid -io_uring_buffer_size="
+                   << FLAGS_io_uring_buffer_size;
+        return NULL;
+    }
+    IoUringBufferRing* b = new IoUringBufferRing;
+    b->nbuf = nbuf;
+    b->buf_size = FLAGS_io_uring_buffer_size;
+    b->local_tail = 0;
+    b->br_len = nbuf * sizeof(io_uring_buf);
+    b->br = (io_uring_buf_ring*)mmap(NULL, b->br_len, PROT_READ | PROT_WRITE,
+                                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    b->mem = (char*)malloc((size_t)nbuf * b->buf_size);
+    if (b->br == MAP_FAILED || b->mem == NULL) {
+        if (b->br == MAP_FAILED) {
+            b->br = NULL;
+        }
+        LOG(ERROR) << "Fail to allocate buffers of io_uring";
+        DestroyBufferRing(b);
+        return NULL;
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)b->br;
+    reg.ring_entries = nbuf;
+    reg.bgid = 0;
+    if (sys_io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        PLOG(WARNING) << "Fail to register buffer ring of io_uring";
+        DestroyBufferRing(b);
+        return NULL;
+    }
+    for (int32_t i = 0; i < nbuf; ++i) {
+        ProvideBuffer(b, i);
+    }
+    PublishBuffers(b);
+    return b;
+}
+
+IoUringEngine::IoUringEngine()
+    : _ring(NULL)
+    , _buffers(NULL)
+    , _nqueued(0)
+    , _flushing(false)
+    , _entries(NULL)
+    , _nentry(0) {
+}
+
+IoUringEngine::~IoUringEngine() {
+    if (_buffers) {
+        DestroyBufferRing(_buffers);
+        _buffers = NULL;
+    }
+    if (_ring) {
+        DestroyRing(_ring);
+        _ring = NULL;
+    }
+    if (_entries) {
+        for (int i = 0; i < _nentry; ++i) {
+            delete _entries[i];
+        }
+        delete [] _entries;
+        _entries = NULL;
+    }
+}
+
+bool IoUringEngine::IsSupported() {
+    return true;
+}
+
+IoUringEngine* IoUringEngine::Create() {
+    IoUringEngine* e = new IoUringEngine;
+    if (e->Init() != 0) {
+        delete e;
+        return NULL;
+    }
+    return e;
+}
+
+int IoUringEngine::Init() {
+    if (FLAGS_io_uring_queue_depth <= 0 || FLAGS_io_uring_max_sockets <= 0) {
+        LOG(ERROR) << "Invalid -io_uring_queue_depth or -io_uring_max_sockets";
+        return -1;
+    }
+    _ring = CreateRing(FLAGS_io_uring_queue_depth);
+    if (_ring == NULL) {
+        return -1;
+    }
+    _buffers = CreateBufferRing(_ring->fd);
+    if (_buffers == NULL) {
+        return -1;
+    }
+    // The kernel rejects more registered files than RLIMIT_NOFILE.
+    int nfile = FLAGS_io_uring_max_sockets;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        (rlim_t)nfile > rl.rlim_cur) {
+        nfile = rl.rlim_cur;
+    }
+    io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = nfile;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (sys_io_uring_register(_ring->fd, IORING_REGISTER_FILES2,
+                              &files, sizeof(files)) != 0) {
+        PLOG(WARNING) << "Fail to register files of io_uring";
+        return -1;
+    }
+    _nentry = nfile;
+    _entries = new IoUringEntry*[_nentry]();
+    _free_slots.reserve(_nentry);
+    for (int i = _nentry - 1; i >= 0; --i) {
+        _free_slots.push_back(i);
+    }
+    return 0;
+}
+
+int IoUringEngine::fd() const {
+    return _ring->fd;
+}
+
+static int UpdateFile(int ring_fd, int slot, int fd) {
+    io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (uint64_t)&fd;
+    const int rc = sys_io_uring_register(
+        ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+    return rc == 1 ? 0 : -1;
+}
+
+int IoUringEngine::AddConsumer(SocketId socket_id, int fd) {
+    int slot = -1;
+    {
+        BAIDU_SCOPED_LOCK(_free_mutex);
+        if (_free_slots.empty()) {
+            errno = EMFILE;
+            return -1;
+        }
+        slot = _free_slots.back();
+        _free_slots.pop_back();
+    }
+    if (UpdateFile(_ring->fd, slot, fd) != 0) {
+        const int saved_errno = errno;
+        PLOG(WARNING) << "Fail to register fd=" << fd << " into io_uring";
+        BAIDU_SCOPED_LOCK(_free_mutex);
+        _free_slots.push_back(slot);
+        errno = saved_errno;
+        return -1;
+    }
+    if (_entries[slot] == NULL) {
+        _entries[slot] = new IoUringEntry;
+    }
+    IoUringEntry* e = _entries[slot];
+    {
+        BAIDU_SCOPED_LOCK(e->mutex);
+        e->socket_id = socket_id;
+        e->used = true;
+        ArmRecv(slot);
+    }
+    Flush();
+    return slot;
+}
+
+void IoUringEngine::RemoveConsumer(int slot) {
+    IoUringEntry* e = _entries[slot];
+    {
+        BAIDU_SCOPED_LOCK(e->mutex);
+        e->removed = true;
+        e->socket_id = INVALID_SOCKET_ID;
+        e->input.clear();
+        e->unsent.clear();
+        // In-flight requests still reference the file, which is closed
+        // after they complete.
+        if (UpdateFile(_ring->fd, slot, -1) != 0) {
+            PLOG(WARNING) << "Fail to unregister slot=" << slot
+                          << " from io_uring";
+        }
+        if (e->recv_armed) {
+            CancelRecv(slot);
+        }
+        TryFreeSlot(slot, e);
+    }
+    Flush();
+}
+
+ssize_t IoUringEngine::Read(int slot, butil::IOBuf* buf, size_t size_hint) {
+    IoUringEntry* e = _entries[slot];
+    std::unique_lock<butil::Mutex> mu(e->mutex);
+    if (!e->input.empty()) {
+        const ssize_t nr = e->input.cutn(buf, std::max(size_hint, (size_t)1));
+        if (e->recv_paused &&
+            (int64_t)e->input.size() < FLAGS_io_uring_max_unread_bytes / 2) {
+            e->recv_paused = false;
+            if (!e->recv_armed && !e->removed && !e->eof && !e->error) {
+                ArmRecv(slot);
+                mu.unlock();
+                Flush();
+            }
+        }
+        return nr;
+    }
+    if (e->error) {
+        errno = e->error;
+        return -1;
+    }
+    if (e->eof) {
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t IoUringEngine::Write(int slot, butil::IOBuf* const* data_list,
+                             size_t ndata) {
+    IoUringEntry* e = _entries[slot];
+    ssize_t nw = 0;
+    {
+        BAIDU_SCOPED_LOCK(e->mutex);
+        if (e->error) {
+            errno = e->error;
+            return -1;
+        }
+        if (e->removed) {
+            errno = EINVAL;
+            return -1;
+        }
+        if ((int64_t)e->unwritten_bytes() >= FLAGS_socket_max_unwritten_bytes) {
+            e->write_blocked = true;
+            errno = EAGAIN;
+            return -1;
+        }
+        for (size_t i = 0; i < ndata; ++i) {
+            nw += data_list[i]->cutn(&e->unsent, data_list[i]->size());
+        }
+        if (!e->send_inflight && !e->unsent.empty()) {
+            e->sending.swap(e->unsent);
+            SubmitSend(slot, e);
+        }
+    }
+    Flush();
+    return nw;
+}
+
+bool IoUringEngine::Writable(int slot) {
+    IoUringEntry* e = _entries[slot];
+    BAIDU_SCOPED_LOCK(e->mutex);
+    if (e->error || e->removed ||
+        (int64_t)e->unwritten_bytes() < FLAGS_socket_max_unwritten_bytes) {
+        return true;
+    }
+    e->write_blocked = true;
+    return false;
+}
+
+io_uring_sqe* IoUringEngine::GetSqe() {
+    IoUringRing* r = _ring;
+    const unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        return NULL;
+    }
+    const unsigned index = r->sq_local_tail & r->sq_mask;
+    io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    return sqe;
+}
+
+io_uring_sqe* IoUringEngine::GetSqeOrFlush(std::unique_lock<butil::Mutex>& lck) {
+    while (true) {
+        io_uring_sqe* sqe = GetSqe();
+        if (sqe) {
+            return sqe;
+        }
+        lck.unlock();
+        Flush();
+        sched_yield();
+        lck.lock();
+    }
+}
+
+// Make the sqe got from GetSqe() visible to the kernel, _sq_mutex must
+// be held.
+static void CommitSqe(IoUringRing* r, butil::atomic<int>* nqueued) {
+    ++r->sq_local_tail;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    nqueued->fetch_add(1, butil::memory_order_release);
+}
+
+void IoUringEngine::Flush() {
+    if (_nqueued.load(butil::memory_order_acquire) == 0) {
+        return;
+    }
+    if (_flushing.exchange(true, butil::memory_order_acquire)) {
+        // The flushing thread will submit our sqes as well.
+        return;
+    }
+    while (true) {
+        const int n = _nqueued.exchange(0, butil::memory_order_acq_rel);
+        int nsubmitted = 0;
+        while (nsubmitted < n) {
+            const int rc = sys_io_uring_enter(_ring->fd, n - nsubmitted);
+            if (rc > 0) {
+                nsubmitted += rc;
+            } else if (rc < 0 && errno == EINTR) {
+                continue;
+            } else {
+                // EBUSY/EAGAIN: completions are not reaped in time, submit
+                // in next Flush().
+                if (rc < 0) {
+                    PLOG_EVERY_SECOND(WARNING) << "Fail to submit to io_uring";
+                }
+                _nqueued.fetch_add(n - nsubmitted, butil::memory_order_relaxed);
+                break;
+            }
+        }
+        _flushing.store(false, butil::memory_order_release);
+        if (nsubmitted < n ||
+            _nqueued.load(butil::memory_order_acquire) == 0 ||
+            _flushing.exchange(true, butil::memory_order_acquire)) {
+            break;
+        }
+    }
+}
+
+void IoUringEngine::ArmRecv(int slot) {
+    std::unique_lock<butil::Mutex> lck(_sq_mutex);
+    io_uring_sqe* sqe = GetSqeOrFlush(lck);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = 0;
+    sqe->user_data = MakeUserData(IO_URING_OP_RECV, slot);
+    CommitSqe(_ring, &_nqueued);
+    _entries[slot]->recv_armed = true;
+}
+
+void IoUringEngine::CancelRecv(int slot) {
+    std::unique_lock<butil::Mutex> lck(_sq_mutex);
+    io_uring_sqe* sqe = GetSqeOrFlush(lck);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = MakeUserData(IO_URING_OP_RECV, slot);
+    sqe->user_data = MakeUserData(IO_URING_OP_CANCEL, slot);
+    CommitSqe(_ring, &_nqueued);
+}
+
+void IoUringEngine::SubmitSend(int slot, IoUringEntry* e) {
+    const size_t nblock = std::min(e->sending.backing_block_num(),
+                                   IO_URING_MAX_IOV);
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = e->sending.backing_block(i);
+        e->iov[i].iov_base = (void*)blk.data();
+        e->iov[i].iov_len = blk.size();
+    }
+    memset(&e->msg, 0, sizeof(e->msg));
+    e->msg.msg_iov = e->iov;
+    e->msg.msg_iovlen = nblock;
+    std::unique_lock<butil::Mutex> lck(_sq_mutex);
+    io_uring_sqe* sqe = GetSqeOrFlush(lck);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)&e->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = MakeUserData(IO_URING_OP_SEND, slot);
+    CommitSqe(_ring, &_nqueued);
+    e->send_inflight = true;
+}
+
+void IoUringEngine::TryFreeSlot(int slot, IoUringEntry* e) {
+    if (!e->used || !e->removed || e->recv_armed || e->send_inflight) {
+        return;
+    }
+    e->Reset();
+    BAIDU_SCOPED_LOCK(_free_mutex);
+    _free_slots.push_back(slot);
+}
+
+void IoUringEngine::OnRecv(int slot, int res, uint32_t flags,
+                           std::vector<int>* notified) {
+    IoUringEntry* e = _entries[slot];
+    BAIDU_SCOPED_LOCK(e->mutex);
+    if (flags & IORING_CQE_F_BUFFER) {
+        const uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !e->removed) {
+            e->input.append(_buffers->mem + (size_t)bid * _buffers->buf_size, res);
+        }
+        ProvideBuffer(_buffers, bid);
+    }
+    if (res == 0) {
+        e->eof = true;
+    } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        e->error = -res;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        e->recv_armed = false;
+    }
+    if (e->removed) {
+        TryFreeSlot(slot, e);
+        return;
+    }
+    if (res > 0 && e->recv_armed && !e->recv_paused &&
+        (int64_t)e->input.size() >= FLAGS_io_uring_max_unread_bytes) {
+        e->recv_paused = true;
+        CancelRecv(slot);
+    }
+    // Terminated recv is re-armed with notified slots.
+    if (res >= 0 || e->error || !e->recv_armed) {
+        notified->push_back(slot);
+    }
+}
+
+void IoUringEngine::OnSend(int slot, int res, std::vector<int>* notified,
+                           std::vector<SocketId>* writable) {
+    IoUringEntry* e = _entries[slot];
+    BAIDU_SCOPED_LOCK(e->mutex);
+    e->send_inflight = false;
+    if (e->removed) {
+        e->sending.clear();
+        TryFreeSlot(slot, e);
+        return;
+    }
+    if (res < 0) {
+        // Reported to the socket by next Read().
+        e->error = -res;
+        e->sending.clear();
+        e->unsent.clear();
+        notified->push_back(slot);
+    } else {
+        e->sending.pop_front(res);
+        if (e->sending.empty()) {
+            e->sending.swap(e->unsent);
+        }
+        if (!e->sending.empty()) {
+            SubmitSend(slot, e);
+        }
+    }
+    if (e->write_blocked &&
+        (e->error ||
+         (int64_t)e->unwritten_bytes() < FLAGS_socket_max_unwritten_bytes)) {
+        e->write_blocked = false;
+        writable->push_back(e->socket_id);
+    }
+}
+
+void IoUringEngine::HandleCompletions(const bthread_attr_t& consumer_thread_attr) {
+    IoUringRing* r = _ring;
+    std::vector<int> notified;
+    std::vector<SocketId> writable;
+    bool has_recv = false;
+    unsigned head = *r->cq_head;
+    while (true) {
+        const unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            break;
+        }
+        for (; head != tail; ++head) {
+            const io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+            const int slot = (int)(uint32_t)cqe->user_data;
+            switch ((IoUringOp)(cqe->user_data >> 56)) {
+            case IO_URING_OP_RECV:
+                has_recv = true;
+                OnRecv(slot, cqe->res, cqe->flags, &notified);
+                break;
+            case IO_URING_OP_SEND:
+                OnSend(slot, cqe->res, &notified, &writable);
+                break;
+            case IO_URING_OP_CANCEL:
+                break;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (has_recv) {
+        PublishBuffers(_buffers);
+    }
+    // Re-arm terminated recv after buffers are given back, most likely
+    // terminated by ENOBUFS.
+    std::sort(notified.begin(), notified.end());
+    notified.erase(std::unique(notified.begin(), notified.end()), notified.end());
+    std::vector<SocketId> readable;
+    readable.reserve(notified.size());
+    for (size_t i = 0; i < notified.size(); ++i) {
+        IoUringEntry* e = _entries[notified[i]];
+        BAIDU_SCOPED_LOCK(e->mutex);
+        if (e->removed) {
+            continue;
+        }
+        if (!e->recv_armed && !e->recv_paused && !e->eof && !e->error) {
+            ArmRecv(notified[i]);
+        }
+        readable.push_back(e->socket_id);
+    }
+    Flush();
+    for (size_t i = 0; i < readable.size(); ++i) {
+        // Same as readable events from epoll.
+        Socket::StartInputEvent(readable[i], EPOLLIN, consumer_thread_attr);
+    }
+    for (size_t i = 0; i < writable.size(); ++i) {
+        Socket::HandleEpollOut(writable[i]);
+    }
+}
+
+#else  // BRPC_HAS_IO_URING
+
+struct IoUringRing {};
+struct IoUringBufferRing {};
+struct IoUringEntry {};
+
+IoUringEngine::IoUringEngine()
+    : _ring(NULL)
+    , _buffers(NULL)
+    , _nqueued(0)
+    , _flushing(false)
+    , _entries(NULL)
+    , _nentry(0) {
+}
+
+IoUringEngine::~IoUringEngine() {}
+
+bool IoUringEngine::IsSupported() { return false; }
+
+IoUringEngine* IoUringEngine::Create() {
+    LOG(WARNING) << "brpc is not built with io_uring(linux 6.0+ headers)";
+    return NULL;
+}
+
+int IoUringEngine::Init() { return -1; }
+int IoUringEngine::fd() const { return -1; }
+int IoUringEngine::AddConsumer(SocketId, int) { errno = ENOSYS; return -1; }
+void IoUringEngine::RemoveConsumer(int) {}
+ssize_t IoUringEngine::Read(int, butil::IOBuf*, size_t) {
+    errno = ENOSYS;
+    return -1;
+}
+ssize_t IoUringEngine::Write(int, butil::IOBuf* const*, size_t) {
+    errno = ENOSYS;
+    return -1;
+}
+bool IoUringEngine::Writable(int) { return true; }
+void IoUringEngine::HandleCompletions(const bthread_attr_t&) {}
+
+#endif  // BRPC_HAS_IO_URING
+
+} // namespace brpc
@@ -0,0 +1,132 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_IO_URING_ENGINE_H
+#define BRPC_IO_URING_ENGINE_H
+
+#include <vector>
+#include <mutex>                             // std::unique_lock
+#include "butil/macros.h"
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"
+#include "butil/iobuf.h"
+#include "bthread/types.h"                   // bthread_attr_t
+#include "brpc/socket_id.h"                  // SocketId
+
+struct io_uring_sqe;
+
+namespace brpc {
+
+struct IoUringRing;
+struct IoUringBufferRing;
+struct IoUringEntry;
+
+// Reads and writes sockets with io_uring instead of epoll + readv/writev:
+//   - Each socket is put into a slot of registered files, so that requests
+//     on it do not look up the fd table.
+//   - Input is received by one multishot recv per socket which picks
+//     buffers from a ring provided to the kernel. Received bytes are copied
+//     into IOBuf blocks buffered in the slot, the buffer is given back to the
+//     kernel immediately, Socket::DoRead() moves the bytes into _read_buf.
+//   - Output cut from WriteRequests is sent by at most one in-flight sendmsg
+//     per socket to keep the order. Submissions from all threads are
+//     combined into as few io_uring_enter as possible.
+// One engine is created for each EventDispatcher which watches the ring and
+// reaps completions in its thread. Completed reads start input events of
+// the socket just like epoll, completed writes wake up KeepWrite.
+class IoUringEngine {
+public:
+    // Returns NULL if io_uring is not supported by the kernel or the build.
+    static IoUringEngine* Create();
+    ~IoUringEngine();
+
+    // True if this build has io_uring support compiled in.
+    static bool IsSupported();
+
+    // File descriptor of the ring, readable when there're completions.
+    int fd() const;
+
+    // Put `fd' into a free slot and start receiving from it. Input events
+    // of `socket_id' are started when data or errors are received.
+    // Returns the slot on success, -1 otherwise.
+    int AddConsumer(SocketId socket_id, int fd);
+
+    // Stop receiving from the slot which is freed after all requests on it
+    // completed. Called when the Socket is recycled or its fd is reset.
+    void RemoveConsumer(int slot);
+
+    // Move at most `size_hint' received bytes into `buf'.
+    // Returns bytes moved, 0 on EOF, -1 otherwise and errno is set (EAGAIN
+    // when nothing is received yet).
+    ssize_t Read(int slot, butil::IOBuf* buf, size_t size_hint);
+
+    // Cut all data from IOBufs in `data_list' and send them asynchronously.
+    // Returns bytes cut, -1 otherwise and errno is set (EAGAIN when too many
+    // bytes are unsent in this slot).
+    ssize_t Write(int slot, butil::IOBuf* const* data_list, size_t ndata);
+
+    // True if Write() on the slot can accept more data or the slot is broken.
+    bool Writable(int slot);
+
+    // Reap all completions. Called by the owning dispatcher only.
+    // Input events are started with `consumer_thread_attr'.
+    void HandleCompletions(const bthread_attr_t& consumer_thread_attr);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(IoUringEngine);
+    IoUringEngine();
+
+    int Init();
+
+    // Get a free sqe or NULL if the submission queue is full. _sq_mutex
+    // must be held.
+    io_uring_sqe* GetSqe();
+
+    // Get sqes with _sq_mutex held, flushing the queue when it's full.
+    io_uring_sqe* GetSqeOrFlush(std::unique_lock<butil::Mutex>& lck);
+
+    // Submit queued sqes, combined with concurrent callers.
+    void Flush();
+
+    // Queue requests of a slot, which are submitted by next Flush().
+    // IoUringEntry::mutex of the slot must be held while _sq_mutex must not.
+    void ArmRecv(int slot);
+    void CancelRecv(int slot);
+    void SubmitSend(int slot, IoUringEntry* e);
+
+    void OnRecv(int slot, int res, uint32_t flags,
+                std::vector<int>* notified);
+    void OnSend(int slot, int res, std::vector<int>* notified,
+                std::vector<SocketId>* writable);
+    // Return the slot into free list when nothing may reference it.
+    // IoUringEntry::mutex must be held.
+    void TryFreeSlot(int slot, IoUringEntry* e);
+
+    IoUringRing* _ring;
+    IoUringBufferRing* _buffers;
+    butil::Mutex _sq_mutex;
+    // Number of sqes queued but not submitted
+    butil::atomic<int> _nqueued;
+    butil::atomic<bool> _flushing;
+
+    // Created on first use of the slot.
+    IoUringEntry** _entries;
+    int _nentry;
+    butil::Mutex _free_mutex;
+    std::vector<int> _free_slots;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_IO_URING_ENGINE_H
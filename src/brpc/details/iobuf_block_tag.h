@@ -0,0 +1,43 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_IOBUF_BLOCK_TAG_H
+#define BRPC_IOBUF_BLOCK_TAG_H
+
+#include "butil/iobuf.h"
+
+
+namespace brpc {
+
+// Tags of IOBuf blocks created by the framework, see butil::ScopedIOBufBlockTag.
+// Memory of each tag is exposed as bvar "iobuf_block_memory_<name>".
+enum IOBufBlockTag {
+    // Blocks created by users, or by the framework in untagged places.
+    IOBUF_BLOCK_TAG_OTHER = 0,
+    // Data read from connections, including payloads and attachments of
+    // received messages which are referenced by user code.
+    IOBUF_BLOCK_TAG_READ_BUFFER = 1,
+    // Serialized requests and responses, which are pending in write queues
+    // of sockets until being written out.
+    IOBUF_BLOCK_TAG_MESSAGE = 2,
+    // Samples buffered by rpc_dump before being written into files.
+    IOBUF_BLOCK_TAG_RPC_DUMP = 3,
+};
+
+} // namespace brpc
+
+
+#endif // BRPC_IOBUF_BLOCK_TAG_H
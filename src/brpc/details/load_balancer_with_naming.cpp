@@ -14,12 +14,72 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <ctype.h>                              // tolower
+#include <map>
+#include <pthread.h>
+#include <gflags/gflags.h>
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
 #include "brpc/details/load_balancer_with_naming.h"
 
 
 namespace brpc {
 
+DEFINE_bool(share_load_balancer, true, "Channels initialized with same "
+            "naming service, load balancer and filter share one load balancer");
+
+typedef std::map<std::string, LoadBalancerWithNaming*> SharedLBMap;
+// Construct on demand to make the code work before main()
+static SharedLBMap* g_shared_lb_map = NULL;
+static pthread_mutex_t g_shared_lb_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the shared load balancer of `key' with a reference added, or NULL.
+// g_shared_lb_map_mutex must be locked.
+static LoadBalancerWithNaming* FindSharedLoadBalancer(const std::string& key) {
+    if (g_shared_lb_map == NULL) {
+        return NULL;
+    }
+    SharedLBMap::iterator it = g_shared_lb_map->find(key);
+    if (it == g_shared_lb_map->end()) {
+        return NULL;
+    }
+    if (it->second->AddRefManually() == 0) {
+        // The last reference was just removed and ~LoadBalancerWithNaming()
+        // is about to remove the entry. We don't need to remove the reference
+        // because the object is already destructing.
+        return NULL;
+    }
+    return it->second;
+}
+
+// Protocols of naming services and names of load balancers are
+// case-insensitive, make "File://x" + "Rr" and "file://x" + "rr" same.
+static void MakeSharedLBKey(std::string* key, const char* ns_url,
+                            const char* lb_name,
+                            const NamingServiceFilter* filter,
+                            const GetNamingServiceThreadOptions& opt) {
+    key->assign(ns_url);
+    const size_t pos = key->find("://");
+    for (size_t i = 0; i < key->size() && i < pos; ++i) {
+        (*key)[i] = ::tolower((*key)[i]);
+    }
+    key->push_back(' ');
+    for (const char* p = lb_name; *p; ++p) {
+        key->push_back(::tolower(*p));
+    }
+    butil::string_appendf(key, " %p %d%d", filter,
+                          (int)opt.succeed_without_server,
+                          (int)opt.use_rdma);
+}
+
 LoadBalancerWithNaming::~LoadBalancerWithNaming() {
+    if (_shared) {
+        BAIDU_SCOPED_LOCK(g_shared_lb_map_mutex);
+        SharedLBMap::iterator it = g_shared_lb_map->find(_shared_key);
+        if (it != g_shared_lb_map->end() && it->second == this) {
+            g_shared_lb_map->erase(it);
+        }
+    }
     if (_nsthread_ptr.get()) {
         _nsthread_ptr->RemoveWatcher(this);
     }
@@ -42,6 +102,57 @@ int LoadBalancerWithNaming::Init(const char* ns_url, const char* lb_name,
     return 0;
 }
 
+int GetSharedLoadBalancerWithNaming(
+    butil::intrusive_ptr<SharedLoadBalancer>* lb_out,
+    const char* ns_url, const char* lb_name,
+    const NamingServiceFilter* filter,
+    const GetNamingServiceThreadOptions* options) {
+    std::string key;
+    if (FLAGS_share_load_balancer) {
+        GetNamingServiceThreadOptions opt;
+        if (options) {
+            opt = *options;
+        }
+        MakeSharedLBKey(&key, ns_url, lb_name, filter, opt);
+        BAIDU_SCOPED_LOCK(g_shared_lb_map_mutex);
+        LoadBalancerWithNaming* lb = FindSharedLoadBalancer(key);
+        if (lb != NULL) {
+            lb_out->reset(lb, false);
+            return 0;
+        }
+    }
+    // Init() blocks until the first batch of servers arrives, don't hold
+    // the lock during it.
+    LoadBalancerWithNaming* raw_lb = new (std::nothrow) LoadBalancerWithNaming;
+    if (NULL == raw_lb) {
+        LOG(FATAL) << "Fail to new LoadBalancerWithNaming";
+        return -1;
+    }
+    butil::intrusive_ptr<LoadBalancerWithNaming> lb(raw_lb);
+    if (lb->Init(ns_url, lb_name, filter, options) != 0) {
+        LOG(ERROR) << "Fail to initialize LoadBalancerWithNaming";
+        return -1;
+    }
+    if (!key.empty()) {
+        BAIDU_SCOPED_LOCK(g_shared_lb_map_mutex);
+        LoadBalancerWithNaming* lb2 = FindSharedLoadBalancer(key);
+        if (lb2 != NULL) {
+            // Another channel created the load balancer concurrently,
+            // use that one and drop ours.
+            lb_out->reset(lb2, false);
+            return 0;
+        }
+        if (g_shared_lb_map == NULL) {
+            g_shared_lb_map = new SharedLBMap;
+        }
+        (*g_shared_lb_map)[key] = lb.get();
+        lb->_shared = true;
+        lb->_shared_key = key;
+    }
+    lb_out->reset(lb.get());
+    return 0;
+}
+
 void LoadBalancerWithNaming::OnAddedServers(
     const std::vector<ServerId>& servers) {
     AddServersInBatch(servers);
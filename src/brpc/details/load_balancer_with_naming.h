@@ -26,8 +26,11 @@ namespace brpc {
 
 class LoadBalancerWithNaming : public SharedLoadBalancer,
                                public NamingServiceWatcher {
+friend int GetSharedLoadBalancerWithNaming(
+    butil::intrusive_ptr<SharedLoadBalancer>*, const char*, const char*,
+    const NamingServiceFilter*, const GetNamingServiceThreadOptions*);
 public:
-    LoadBalancerWithNaming() {}
+    LoadBalancerWithNaming() : _shared(false) {}
     ~LoadBalancerWithNaming();
 
     int Init(const char* ns_url, const char* lb_name,
@@ -41,8 +44,22 @@ public:
 
 private:
     butil::intrusive_ptr<NamingServiceThread> _nsthread_ptr;
+    // Key in the global map if this load balancer is shared.
+    bool _shared;
+    std::string _shared_key;
 };
 
+// Get the load balancer watching `ns_url' and selecting servers with
+// `lb_name', which is shared by channels initialized with same arguments
+// when -share_load_balancer is on, so that channels to a big cluster do not
+// keep and update their own copies of the server list.
+// Returns 0 on success, -1 otherwise.
+int GetSharedLoadBalancerWithNaming(
+    butil::intrusive_ptr<SharedLoadBalancer>* lb_out,
+    const char* ns_url, const char* lb_name,
+    const NamingServiceFilter* filter,
+    const GetNamingServiceThreadOptions* options);
+
 } // namespace brpc
 
 
@@ -0,0 +1,54 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "brpc/details/message_pool.h"
+
+namespace brpc {
+
+void* MessagePool::MessageFactory::CreateData() const {
+    return _prototype->New();
+}
+
+void MessagePool::MessageFactory::DestroyData(void* data) const {
+    delete static_cast<google::protobuf::Message*>(data);
+}
+
+MessagePool::MessagePool(const google::protobuf::Message* prototype)
+    : _factory(prototype)
+    , _pool(&_factory) {
+}
+
+google::protobuf::Message* MessagePool::Borrow() {
+    return static_cast<google::protobuf::Message*>(_pool.Borrow());
+}
+
+void MessagePool::Return(google::protobuf::Message* msg) {
+    if (msg == NULL) {
+        return;
+    }
+    msg->Clear();
+    _pool.Return(msg);
+}
+
+void ReturnMessageOrDelete::operator()(
+    const google::protobuf::Message* msg) const {
+    if (_pool) {
+        _pool->Return(const_cast<google::protobuf::Message*>(msg));
+    } else {
+        delete msg;
+    }
+}
+
+} // namespace brpc
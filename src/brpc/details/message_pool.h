@@ -0,0 +1,73 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_DETAILS_MESSAGE_POOL_H
+#define BRPC_DETAILS_MESSAGE_POOL_H
+
+#include <google/protobuf/message.h>
+#include "butil/macros.h"
+#include "brpc/data_factory.h"
+#include "brpc/simple_data_pool.h"
+
+namespace brpc {
+
+// Reuse messages of one type between RPCs. Returned messages are Clear()-ed
+// instead of being deleted, which keeps memory of strings and repeated
+// fields for following RPCs.
+class MessagePool {
+public:
+    // `prototype' must be valid during lifetime of the pool.
+    explicit MessagePool(const google::protobuf::Message* prototype);
+
+    // Get a cleared message, created by prototype->New() if the pool is
+    // empty. Returns NULL on error.
+    google::protobuf::Message* Borrow();
+
+    // Clear `msg' and put it back into the pool. `msg' must be created by
+    // prototype->New() or borrowed from this pool.
+    void Return(google::protobuf::Message* msg);
+
+    SimpleDataPool::Stat stat() const { return _pool.stat(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MessagePool);
+
+    class MessageFactory : public DataFactory {
+    public:
+        explicit MessageFactory(const google::protobuf::Message* prototype)
+            : _prototype(prototype) {}
+        void* CreateData() const;
+        void DestroyData(void*) const;
+    private:
+        const google::protobuf::Message* _prototype;
+    };
+
+    MessageFactory _factory;
+    SimpleDataPool _pool;
+};
+
+// Deleter for unique_ptr to return the message into `pool', or delete it
+// if `pool' is NULL.
+class ReturnMessageOrDelete {
+public:
+    explicit ReturnMessageOrDelete(MessagePool* pool = NULL) : _pool(pool) {}
+    void operator()(const google::protobuf::Message* msg) const;
+private:
+    MessagePool* _pool;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_DETAILS_MESSAGE_POOL_H
@@ -16,31 +16,328 @@
 
 #include <limits>
 #include "butil/macros.h"
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/details/method_status.h"
+#include "brpc/details/message_pool.h"
+#include "brpc/details/response_cache.h"
+#include "brpc/details/request_coalescer.h"
+#include "brpc/details/usercode_pool.h"
+#include "brpc/details/rpc_phase.h"
 
 namespace brpc {
 
+DEFINE_int32(codel_target_delay_ms, 0, "If queueing latencies of all "
+             "requests to a method exceeded this value during last "
+             "-codel_interval_ms, the method is regarded as overloaded and "
+             "requests queued longer than twice of this value are rejected "
+             "with ELIMIT, so that newer requests are processed first. "
+             "<=0 means never rejecting requests by queueing latency");
+BRPC_VALIDATE_GFLAG(codel_target_delay_ms, PassValidate);
+
+DEFINE_int32(codel_interval_ms, 100, "Interval of checking whether a method "
+             "is overloaded, see -codel_target_delay_ms");
+BRPC_VALIDATE_GFLAG(codel_interval_ms, PositiveInteger);
+
+DEFINE_bool(lazy_method_status, false, "Expose vars of a method at its first "
+            "call rather than when the server starts, so that servers with "
+            "lots of methods which are rarely called start faster and use "
+            "less memory. Methods never called are not listed in /vars");
+
 static int cast_nprocessing(void* arg) {
     return *(int*)arg;
 }
 
+static int get_max_concurrency(void* arg) {
+    return static_cast<MethodStatus*>(arg)->MaxConcurrency();
+}
+
 MethodStatus::MethodStatus()
-    : _max_concurrency(0)
+    : _cl(NULL)
+    , _high_priority(false)
+    , _use_arena(false)
+    , _parse_request_lazily(false)
+    , _reuse_messages(false)
+    , _request_pool(NULL)
+    , _response_pool(NULL)
+    , _response_cache(NULL)
+    , _request_coalescer(NULL)
+    , _usercode_pool(NULL)
+    , _recorders(NULL)
+    , _phase_recorders(NULL)
     , _nprocessing_bvar(cast_nprocessing, &_nprocessing)
-    , _nprocessing(0) {
+    , _max_concurrency_bvar(get_max_concurrency, this)
+    , _nprocessing(0)
+    , _codel_interval_end_us(0)
+    , _codel_min_latency_us(std::numeric_limits<int64_t>::max())
+    , _codel_overloaded(false) {
 }
 
 MethodStatus::~MethodStatus() {
+    if (_cl) {
+        _cl->Destroy();
+        _cl = NULL;
+    }
+    delete _recorders.exchange(NULL, butil::memory_order_relaxed);
+    delete _phase_recorders.exchange(NULL, butil::memory_order_relaxed);
+    delete _request_pool;
+    _request_pool = NULL;
+    delete _response_pool;
+    _response_pool = NULL;
+    delete _response_cache.exchange(NULL, butil::memory_order_relaxed);
+    delete _request_coalescer.exchange(NULL, butil::memory_order_relaxed);
+    delete _usercode_pool.exchange(NULL, butil::memory_order_relaxed);
+}
+
+void MethodStatus::SetReuseMessages(
+    bool reuse,
+    const google::protobuf::Message* req_prototype,
+    const google::protobuf::Message* res_prototype) {
+    BAIDU_SCOPED_LOCK(_expose_mutex);
+    if (reuse && _request_pool == NULL) {
+        _request_pool = new MessagePool(req_prototype);
+        _response_pool = new MessagePool(res_prototype);
+    }
+    // Release the pools to readers of reuse_messages().
+    _reuse_messages.store(reuse, butil::memory_order_release);
+}
+
+void MethodStatus::SetResponseCache(int ttl_ms, int64_t max_bytes) {
+    BAIDU_SCOPED_LOCK(_expose_mutex);
+    ResponseCache* cache = _response_cache.load(butil::memory_order_relaxed);
+    if (cache == NULL) {
+        if (ttl_ms <= 0) {
+            return;
+        }
+        cache = new ResponseCache;
+        cache->Reset(ttl_ms, max_bytes);
+        if (!_expose_prefix.empty()) {
+            cache->Expose(_expose_prefix);
+        }
+        _response_cache.store(cache, butil::memory_order_release);
+        return;
+    }
+    cache->Reset(ttl_ms, max_bytes);
+}
+
+void MethodStatus::SetCoalesceRequests(bool coalesce) {
+    BAIDU_SCOPED_LOCK(_expose_mutex);
+    RequestCoalescer* coalescer =
+        _request_coalescer.load(butil::memory_order_relaxed);
+    if (coalescer == NULL) {
+        if (!coalesce) {
+            return;
+        }
+        coalescer = new RequestCoalescer;
+        coalescer->set_enabled(true);
+        if (!_expose_prefix.empty()) {
+            coalescer->Expose(_expose_prefix);
+        }
+        _request_coalescer.store(coalescer, butil::memory_order_release);
+        return;
+    }
+    coalescer->set_enabled(coalesce);
+}
+
+void MethodStatus::SetUserCodePool(int min_threads, int max_threads,
+                                   int max_queue_size) {
+    BAIDU_SCOPED_LOCK(_expose_mutex);
+    UserCodePool* pool = _usercode_pool.load(butil::memory_order_relaxed);
+    if (pool == NULL) {
+        if (max_threads <= 0) {
+            return;
+        }
+        pool = new UserCodePool;
+        pool->Reset(min_threads, max_threads, max_queue_size);
+        if (!_expose_prefix.empty()) {
+            pool->Expose(_expose_prefix);
+        }
+        _usercode_pool.store(pool, butil::memory_order_release);
+        return;
+    }
+    pool->Reset(min_threads, max_threads, max_queue_size);
+}
+
+MethodStatus::LatencyRecorders* MethodStatus::CreateRecorders() {
+    BAIDU_SCOPED_LOCK(_expose_mutex);
+    LatencyRecorders* r = _recorders.load(butil::memory_order_consume);
+    if (!r) {
+        r = new LatencyRecorders;
+        _recorders.store(r, butil::memory_order_release);
+        if (!_expose_prefix.empty()) {
+            ExposeLocked();
+        }
+    }
+    return r;
+}
+
+MethodStatus::PhaseRecorders* MethodStatus::CreatePhaseRecorders() {
+    BAIDU_SCOPED_LOCK(_expose_mutex);
+    PhaseRecorders* r = _phase_recorders.load(butil::memory_order_consume);
+    if (!r) {
+        r = new PhaseRecorders;
+        _phase_recorders.store(r, butil::memory_order_release);
+        if (!_expose_prefix.empty()) {
+            ExposePhasesLocked();
+        }
+    }
+    return r;
+}
+
+void MethodStatus::OnPhases(const RpcPhaseTimes& times) {
+    PhaseRecorders* r = _phase_recorders.load(butil::memory_order_consume);
+    if (!r) {
+        r = CreatePhaseRecorders();
+    }
+    int64_t us = times.Between(RPC_SERVER_START_PARSE,
+                               RPC_SERVER_START_CALLBACK);
+    if (us >= 0) {
+        r->parse << us;
+    }
+    us = times.Between(RPC_SERVER_START_CALLBACK, RPC_SERVER_START_SEND);
+    if (us >= 0) {
+        r->process << us;
+    }
+    us = times.Between(RPC_SERVER_START_SEND, RPC_SERVER_SERIALIZED);
+    if (us >= 0) {
+        r->serialize << us;
+    }
+    us = times.Between(RPC_SERVER_SERIALIZED, RPC_SERVER_WRITTEN);
+    if (us >= 0) {
+        r->write << us;
+    }
+}
+
+int MethodStatus::SetConcurrencyLimiter() {
+    ConcurrencyLimiter* cl = NULL;
+    if (_max_concurrency.is_adaptive()) {
+        const ConcurrencyLimiter* prototype =
+            ConcurrencyLimiterExtension()->Find(
+                _max_concurrency.value().c_str());
+        if (prototype == NULL) {
+            LOG(ERROR) << "Unknown ConcurrencyLimiter="
+                       << _max_concurrency.value();
+            return -1;
+        }
+        cl = prototype->New();
+        if (cl == NULL) {
+            LOG(ERROR) << "Fail to new ConcurrencyLimiter="
+                       << _max_concurrency.value();
+            return -1;
+        }
+    }
+    if (_cl) {
+        _cl->Destroy();
+    }
+    _cl = cl;
+    return 0;
+}
+
+bool MethodStatus::OnDispatched(int64_t received_us) {
+    const int64_t now_us = butil::cpuwide_time_us();
+    const int64_t latency_us = now_us - received_us;
+    recorders().queue_latency << latency_us;
+    const int64_t target_us = FLAGS_codel_target_delay_ms * 1000L;
+    if (target_us <= 0) {
+        return true;
+    }
+    int64_t end_us = _codel_interval_end_us.load(butil::memory_order_relaxed);
+    if (now_us >= end_us &&
+        _codel_interval_end_us.compare_exchange_strong(
+            end_us, now_us + FLAGS_codel_interval_ms * 1000L,
+            butil::memory_order_relaxed)) {
+        // An interval without requests is not overloaded.
+        const int64_t last_min_us = _codel_min_latency_us.exchange(
+            std::numeric_limits<int64_t>::max(), butil::memory_order_relaxed);
+        _codel_overloaded.store(
+            last_min_us > target_us &&
+            last_min_us != std::numeric_limits<int64_t>::max(),
+            butil::memory_order_relaxed);
+    }
+    int64_t min_latency_us =
+        _codel_min_latency_us.load(butil::memory_order_relaxed);
+    while (latency_us < min_latency_us &&
+           !_codel_min_latency_us.compare_exchange_weak(
+               min_latency_us, latency_us, butil::memory_order_relaxed)) {}
+    if (_codel_overloaded.load(butil::memory_order_relaxed) &&
+        latency_us > 2 * target_us) {
+        _nshed << 1;
+        return false;
+    }
+    return true;
 }
 
 int MethodStatus::Expose(const butil::StringPiece& prefix) {
+    if (!FLAGS_lazy_method_status) {
+        recorders();
+    }
+    BAIDU_SCOPED_LOCK(_expose_mutex);
+    prefix.CopyToString(&_expose_prefix);
+    if (_phase_recorders.load(butil::memory_order_relaxed) != NULL &&
+        ExposePhasesLocked() != 0) {
+        return -1;
+    }
+    ResponseCache* cache = _response_cache.load(butil::memory_order_relaxed);
+    if (cache != NULL && cache->Expose(_expose_prefix) != 0) {
+        return -1;
+    }
+    RequestCoalescer* coalescer =
+        _request_coalescer.load(butil::memory_order_relaxed);
+    if (coalescer != NULL && coalescer->Expose(_expose_prefix) != 0) {
+        return -1;
+    }
+    UserCodePool* pool = _usercode_pool.load(butil::memory_order_relaxed);
+    if (pool != NULL && pool->Expose(_expose_prefix) != 0) {
+        return -1;
+    }
+    if (_recorders.load(butil::memory_order_relaxed) == NULL) {
+        return 0;
+    }
+    return ExposeLocked();
+}
+
+int MethodStatus::ExposePhasesLocked() {
+    const std::string& prefix = _expose_prefix;
+    PhaseRecorders* r = _phase_recorders.load(butil::memory_order_relaxed);
+    if (r->parse.expose(prefix, "parse") != 0) {
+        return -1;
+    }
+    if (r->process.expose(prefix, "process") != 0) {
+        return -1;
+    }
+    if (r->serialize.expose(prefix, "serialize") != 0) {
+        return -1;
+    }
+    if (r->write.expose(prefix, "write") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int MethodStatus::ExposeLocked() {
+    const std::string& prefix = _expose_prefix;
+    LatencyRecorders* r = _recorders.load(butil::memory_order_relaxed);
     if (_nprocessing_bvar.expose_as(prefix, "processing") != 0) {
         return -1;
     }
+    if (_max_concurrency_bvar.expose_as(prefix, "max_concurrency") != 0) {
+        return -1;
+    }
     if (_nerror.expose_as(prefix, "error") != 0) {
         return -1;
     }
-    if (_latency_rec.expose(prefix) != 0) {
+    if (r->latency.expose(prefix) != 0) {
+        return -1;
+    }
+    if (r->sched_latency.expose(prefix, "sched") != 0) {
+        return -1;
+    }
+    if (r->queue_latency.expose(prefix, "queue") != 0) {
+        return -1;
+    }
+    if (_nshed.expose_as(prefix, "shed") != 0) {
         return -1;
     }
     return 0;
@@ -76,37 +373,88 @@ void OutputValue(std::ostream& os,
 
 void MethodStatus::Describe(
     std::ostream &os, const DescribeOptions& options) const {
+    if (_cl) {
+        os << (options.use_html ? "<p class=\"variable\">" : "")
+           << "concurrency_limiter: ";
+        _cl->Describe(os, options);
+        os << (options.use_html ? "</p>\n" : "\n");
+    }
+    if (_response_compressor.used()) {
+        os << (options.use_html ? "<p class=\"variable\">" : "")
+           << "auto_compress: ";
+        _response_compressor.Describe(os, options);
+        os << (options.use_html ? "</p>\n" : "\n");
+    }
+    const LatencyRecorders* r = _recorders.load(butil::memory_order_consume);
+    if (r == NULL) {
+        // Never called, don't create recorders just for describing.
+        const char* const br = (options.use_html ? "<br>\n" : "\n");
+        os << "count: 0" << br
+           << "max_concurrency: " << MaxConcurrency() << br
+           << "processing: " << _nprocessing.load(butil::memory_order_relaxed)
+           << br;
+        return;
+    }
+    const bvar::LatencyRecorder& latency_rec = r->latency;
+    const bvar::LatencyRecorder& sched_latency_rec = r->sched_latency;
+    const bvar::LatencyRecorder& queue_latency_rec = r->queue_latency;
     // Sort by alphebetical order to be consistent with /vars.
-    const int64_t qps = _latency_rec.qps();
+    const int64_t qps = latency_rec.qps();
     const bool expand = (qps != 0);
-    OutputValue(os, "count: ", _latency_rec.count_name(), _latency_rec.count(),
+    OutputValue(os, "count: ", latency_rec.count_name(), latency_rec.count(),
                 options, false);
     OutputValue(os, "error: ", _nerror.name(), _nerror.get_value(),
                 options, false);
-    OutputValue(os, "latency: ", _latency_rec.latency_name(),
-                _latency_rec.latency(), options, false);
+    OutputValue(os, "latency: ", latency_rec.latency_name(),
+                latency_rec.latency(), options, false);
     if (options.use_html) {
         OutputValue(os, "latency_percentiles: ",
-                    _latency_rec.latency_percentiles_name(),
-                    _latency_rec.latency_percentiles(), options, expand);
-        OutputValue(os, "latency_cdf: ", _latency_rec.latency_cdf_name(),
+                    latency_rec.latency_percentiles_name(),
+                    latency_rec.latency_percentiles(), options, expand);
+        OutputValue(os, "latency_cdf: ", latency_rec.latency_cdf_name(),
                     "click to view", options, expand);
     } else {
         OutputTextValue(os, "latency_50: ",
-                        _latency_rec.latency_percentile(0.5));
+                        latency_rec.latency_percentile(0.5));
         OutputTextValue(os, "latency_90: ",
-                        _latency_rec.latency_percentile(0.9));
+                        latency_rec.latency_percentile(0.9));
         OutputTextValue(os, "latency_99: ",
-                        _latency_rec.latency_percentile(0.99));
+                        latency_rec.latency_percentile(0.99));
         OutputTextValue(os, "latency_999: ",
-                        _latency_rec.latency_percentile(0.999));
+                        latency_rec.latency_percentile(0.999));
         OutputTextValue(os, "latency_9999: ",
-                        _latency_rec.latency_percentile(0.9999));
+                        latency_rec.latency_percentile(0.9999));
     }
-    OutputValue(os, "max_latency: ", _latency_rec.max_latency_name(),
-                _latency_rec.max_latency(), options, false);
-    OutputValue(os, "qps: ", _latency_rec.qps_name(), _latency_rec.qps(),
+    OutputValue(os, "max_concurrency: ", _max_concurrency_bvar.name(),
+                MaxConcurrency(), options, false);
+    OutputValue(os, "max_latency: ", latency_rec.max_latency_name(),
+                latency_rec.max_latency(), options, false);
+    OutputValue(os, "qps: ", latency_rec.qps_name(), latency_rec.qps(),
                 options, expand);
+    OutputValue(os, "queue_latency: ", queue_latency_rec.latency_name(),
+                queue_latency_rec.latency(), options, false);
+    OutputValue(os, "max_queue_latency: ",
+                queue_latency_rec.max_latency_name(),
+                queue_latency_rec.max_latency(), options, false);
+    OutputValue(os, "sched_latency: ", sched_latency_rec.latency_name(),
+                sched_latency_rec.latency(), options, false);
+    OutputValue(os, "max_sched_latency: ",
+                sched_latency_rec.max_latency_name(),
+                sched_latency_rec.max_latency(), options, false);
+    OutputValue(os, "shed: ", _nshed.name(), _nshed.get_value(),
+                options, false);
+    const PhaseRecorders* pr =
+        _phase_recorders.load(butil::memory_order_consume);
+    if (pr) {
+        OutputValue(os, "parse_latency: ", pr->parse.latency_name(),
+                    pr->parse.latency(), options, false);
+        OutputValue(os, "process_latency: ", pr->process.latency_name(),
+                    pr->process.latency(), options, false);
+        OutputValue(os, "serialize_latency: ", pr->serialize.latency_name(),
+                    pr->serialize.latency(), options, false);
+        OutputValue(os, "write_latency: ", pr->write.latency_name(),
+                    pr->write.latency(), options, false);
+    }
     // Many people are confusing with the old name "unresponded" which
     // contains "un" generally associated with something wrong. Name it
     // to "processing" should be more understandable.
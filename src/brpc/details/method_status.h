@@ -17,13 +17,31 @@
 #ifndef  BRPC_METHOD_STATUS_H
 #define  BRPC_METHOD_STATUS_H
 
+#include <string>
 #include "butil/macros.h"                  // DISALLOW_COPY_AND_ASSIGN
+#include "butil/synchronization/lock.h"   // butil::Mutex
 #include "bvar/bvar.h"                    // vars
+#include "bthread/unstable.h"              // bthread_set_high_priority
 #include "brpc/describable.h"
+#include "brpc/adaptive_max_concurrency.h"
+#include "brpc/concurrency_limiter.h"
+#include "brpc/adaptive_compressor.h"
 
 
+namespace google {
+namespace protobuf {
+class Message;
+}
+}
+
 namespace brpc {
 
+class MessagePool;
+class ResponseCache;
+class RequestCoalescer;
+class UserCodePool;
+class RpcPhaseTimes;
+
 // Record accessing stats of a method.
 class MethodStatus : public Describable {
 public:
@@ -31,10 +49,23 @@ public:
     ~MethodStatus();
 
     // Call this function when the method is about to be called.
-    // Returns false when the request reaches max_concurrency to the method
+    // Returns false when the request reaches max concurrency of the method
     // and is suggested to be rejected.
+    // If the method is of high priority, the calling bthread is scheduled
+    // with BTHREAD_PRIORITY_HIGH since then.
+    // Time that the calling bthread waited in the runqueue before its
+    // latest run is recorded as scheduling latency of the method.
     bool OnRequested();
 
+    // Call this function after OnRequested() returned true.
+    // `received_us' is butil::cpuwide_time_us() when the request was read
+    // from the connection, the time before now is recorded as queueing
+    // latency of the method.
+    // Returns false when the method is overloaded and the request has been
+    // queued for too long, which is suggested to be shed so that workers
+    // are spared for newer requests. See -codel_target_delay_ms.
+    bool OnDispatched(int64_t received_us);
+
     // Call this when the method just finished.
     // `success' : successful call or not.
     // `latency_us' : microseconds taken by a successful call. Latency can
@@ -43,26 +74,141 @@ public:
     // false, `latency_us' is not used.
     void OnResponded(bool success, int64_t latency_us);
 
-    // Expose internal vars.
+    // Record latencies of server-side phases of a successful call, which
+    // are exposed as <prefix>_{parse,process,serialize,write}_latency at
+    // the first call. Called when -rpc_phase_latency is on.
+    void OnPhases(const RpcPhaseTimes& times);
+
+    // Expose internal vars. If -lazy_method_status is on and the method
+    // was never called, vars are exposed at the first call.
     // Return 0 on success, -1 otherwise.
     int Expose(const butil::StringPiece& prefix);
 
     // Describe internal vars, used by /status
     void Describe(std::ostream &os, const DescribeOptions&) const;
 
-    int max_concurrency() const { return _max_concurrency; }
-    int& max_concurrency() { return _max_concurrency; }
+    // Max concurrency set by user. A constant takes effect immediately,
+    // while a ConcurrencyLimiter is created by SetConcurrencyLimiter().
+    const AdaptiveMaxConcurrency& max_concurrency() const
+    { return _max_concurrency; }
+    AdaptiveMaxConcurrency& max_concurrency() { return _max_concurrency; }
+
+    // Current limit of concurrency, 0 means unlimited.
+    int MaxConcurrency() const {
+        return _cl ? _cl->MaxConcurrency() : (int)_max_concurrency;
+    }
+
+    // Create the ConcurrencyLimiter named by max_concurrency() or remove
+    // the existing one if max_concurrency() is a constant. Must be called
+    // when no requests are being processed, e.g. before server starts.
+    // Returns 0 on success, -1 otherwise.
+    int SetConcurrencyLimiter();
+
+    bool high_priority() const { return _high_priority; }
+    void set_high_priority(bool high) { _high_priority = high; }
+
+    // Allocate request and response of the method on pooled arenas.
+    bool use_arena() const { return _use_arena; }
+    void set_use_arena(bool use) { _use_arena = use; }
+
+    // Leave requests of the method unparsed in Controller.unparsed_request().
+    bool parse_request_lazily() const { return _parse_request_lazily; }
+    void set_parse_request_lazily(bool lazy) { _parse_request_lazily = lazy; }
+
+    // Borrow request and response of the method from pools and return them
+    // after RPCs instead of deleting them. Pools are created with the
+    // prototypes at the first enabling and kept until destruction.
+    void SetReuseMessages(bool reuse,
+                          const google::protobuf::Message* req_prototype,
+                          const google::protobuf::Message* res_prototype);
+    bool reuse_messages() const
+    { return _reuse_messages.load(butil::memory_order_acquire); }
+    // Valid after reuse_messages() returned true.
+    MessagePool* request_pool() const { return _request_pool; }
+    MessagePool* response_pool() const { return _response_pool; }
+
+    // Cache responses of the method for `ttl_ms' within `max_bytes', or
+    // stop caching if `ttl_ms' is not positive. The cache is created at the
+    // first enabling and kept until destruction.
+    void SetResponseCache(int ttl_ms, int64_t max_bytes);
+    // NULL if responses of the method were never cached.
+    ResponseCache* response_cache() const
+    { return _response_cache.load(butil::memory_order_acquire); }
+
+    // Let concurrent identical requests of the method share one execution.
+    // The coalescer is created at the first enabling and kept until
+    // destruction.
+    void SetCoalesceRequests(bool coalesce);
+    // NULL if requests of the method were never coalesced.
+    RequestCoalescer* request_coalescer() const
+    { return _request_coalescer.load(butil::memory_order_acquire); }
+
+    // Run user code of the method in a dedicated pool of pthreads, or stop
+    // using the pool if `max_threads' is not positive. The pool is created
+    // at the first enabling and kept until destruction.
+    void SetUserCodePool(int min_threads, int max_threads, int max_queue_size);
+    // NULL if the method never ran in a pool.
+    UserCodePool* usercode_pool() const
+    { return _usercode_pool.load(butil::memory_order_acquire); }
+
+    // Picks compression for responses set to COMPRESS_TYPE_AUTO.
+    AdaptiveCompressor* response_compressor() { return &_response_compressor; }
     
 private:
 friend class ScopedMethodStatus;
     DISALLOW_COPY_AND_ASSIGN(MethodStatus);
     void OnError();
 
-    int _max_concurrency;
+    // LatencyRecorders cost memory and sampling every second, they're
+    // created at the first call to the method, so that methods never
+    // called(e.g. most builtin services) are cheap.
+    struct LatencyRecorders {
+        bvar::LatencyRecorder latency;
+        bvar::LatencyRecorder sched_latency;
+        bvar::LatencyRecorder queue_latency;
+    };
+    LatencyRecorders& recorders();
+    LatencyRecorders* CreateRecorders();
+    // Created at the first call to OnPhases().
+    struct PhaseRecorders {
+        bvar::LatencyRecorder parse;
+        bvar::LatencyRecorder process;
+        bvar::LatencyRecorder serialize;
+        bvar::LatencyRecorder write;
+    };
+    PhaseRecorders* CreatePhaseRecorders();
+    // Called with _expose_mutex held.
+    int ExposeLocked();
+    int ExposePhasesLocked();
+
+    AdaptiveMaxConcurrency _max_concurrency;
+    ConcurrencyLimiter* _cl;
+    bool _high_priority;
+    bool _use_arena;
+    bool _parse_request_lazily;
+    butil::atomic<bool> _reuse_messages;
+    MessagePool* _request_pool;
+    MessagePool* _response_pool;
+    butil::atomic<ResponseCache*> _response_cache;
+    butil::atomic<RequestCoalescer*> _request_coalescer;
+    butil::atomic<UserCodePool*> _usercode_pool;
+    AdaptiveCompressor _response_compressor;
     bvar::Adder<int64_t>         _nerror;
-    bvar::LatencyRecorder        _latency_rec;
+    butil::atomic<LatencyRecorders*> _recorders;
+    butil::atomic<PhaseRecorders*> _phase_recorders;
+    bvar::Adder<int64_t>         _nshed;
     bvar::PassiveStatus<int>     _nprocessing_bvar;
+    bvar::PassiveStatus<int>     _max_concurrency_bvar;
     butil::atomic<int> BAIDU_CACHELINE_ALIGNMENT _nprocessing;
+    // States of CoDel: the method is overloaded during an interval if
+    // queueing latencies of all requests in last interval exceeded target.
+    butil::atomic<int64_t> BAIDU_CACHELINE_ALIGNMENT _codel_interval_end_us;
+    butil::atomic<int64_t> _codel_min_latency_us;
+    butil::atomic<bool> _codel_overloaded;
+    // Protects fields below and creation of message pools
+    butil::Mutex _expose_mutex;
+    // Prefix of Expose() which is applied when recorders are created.
+    std::string _expose_prefix;
 };
 
 // If release() is not called before destruction of this object,
@@ -87,16 +233,37 @@ private:
     MethodStatus* _status;
 };
 
+inline MethodStatus::LatencyRecorders& MethodStatus::recorders() {
+    LatencyRecorders* r = _recorders.load(butil::memory_order_consume);
+    if (!r) {
+        r = CreateRecorders();
+    }
+    return *r;
+}
+
 inline bool MethodStatus::OnRequested() {
+    if (_high_priority) {
+        bthread_set_high_priority(1);
+    }
+    bthread_stat_t stat;
+    if (bthread_self_stat(&stat) == 0) {
+        recorders().sched_latency << stat.last_queue_ns / 1000L;
+    }
     const int last_nproc = _nprocessing.fetch_add(1, butil::memory_order_relaxed);
+    if (_cl) {
+        return _cl->OnRequested(last_nproc + 1);
+    }
     // _max_concurrency may be changed by user at any time.
     const int saved_max_concurrency = _max_concurrency;
     return (saved_max_concurrency <= 0 || last_nproc < saved_max_concurrency);
 }
 
 inline void MethodStatus::OnResponded(bool success, int64_t latency) {
+    if (_cl) {
+        _cl->OnResponded(success, latency);
+    }
     if (success) {
-        _latency_rec << latency;
+        recorders().latency << latency;
         _nprocessing.fetch_sub(1, butil::memory_order_relaxed);
     } else {
         OnError();
@@ -56,7 +56,7 @@ NamingServiceThread::Actions::Actions(NamingServiceThread* owner)
 
 NamingServiceThread::Actions::~Actions() {
     // Remove all sockets from SocketMap
-    for (std::vector<ServerNode>::const_iterator it = _last_servers.begin();
+    for (std::set<ServerNode>::const_iterator it = _last_servers.begin();
          it != _last_servers.end(); ++it) {
         SocketMapRemove(SocketMapKey(it->addr));
 #ifdef BRPC_RDMA
@@ -67,23 +67,41 @@ NamingServiceThread::Actions::~Actions() {
 }
 
 void NamingServiceThread::Actions::AddServers(
-    const std::vector<ServerNode>&) {
-    // FIXME(gejun)
-    abort();
+    const std::vector<ServerNode>& servers) {
+    _added.clear();
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (_last_servers.find(servers[i]) == _last_servers.end()) {
+            _added.push_back(servers[i]);
+        }
+    }
+    std::sort(_added.begin(), _added.end());
+    _added.resize(std::unique(_added.begin(), _added.end()) - _added.begin());
+    _removed.clear();
+    ApplyChanges();
+    EndWait(_last_servers.empty() ? ENODATA : 0);
 }
 
 void NamingServiceThread::Actions::RemoveServers(
-    const std::vector<ServerNode>&) {
-    // FIXME(gejun)
-    abort();
+    const std::vector<ServerNode>& servers) {
+    _removed.clear();
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (_last_servers.find(servers[i]) != _last_servers.end()) {
+            _removed.push_back(servers[i]);
+        }
+    }
+    std::sort(_removed.begin(), _removed.end());
+    _removed.resize(std::unique(_removed.begin(), _removed.end())
+                    - _removed.begin());
+    _added.clear();
+    ApplyChanges();
+    EndWait(_last_servers.empty() ? ENODATA : 0);
 }
 
 void NamingServiceThread::Actions::ResetServers(
         const std::vector<ServerNode>& servers) {
     _servers.assign(servers.begin(), servers.end());
     
-    // Diff servers with _last_servers by comparing sorted vectors.
-    // Notice that _last_servers is always sorted.
+    // Diff servers with _last_servers by comparing sorted sequences.
     std::sort(_servers.begin(), _servers.end());
     const size_t dedup_size = std::unique(_servers.begin(), _servers.end())
         - _servers.begin();
@@ -92,20 +110,23 @@ void NamingServiceThread::Actions::ResetServers(
                      << " duplicated servers";
         _servers.resize(dedup_size);
     }
-    _added.resize(_servers.size());
-    std::vector<ServerNode>::iterator _added_end = 
-        std::set_difference(_servers.begin(), _servers.end(),
-                            _last_servers.begin(), _last_servers.end(),
-                            _added.begin());
-    _added.resize(_added_end - _added.begin());
-
-    _removed.resize(_last_servers.size());
-    std::vector<ServerNode>::iterator _removed_end = 
-        std::set_difference(_last_servers.begin(), _last_servers.end(),
-                            _servers.begin(), _servers.end(),
-                            _removed.begin());
-    _removed.resize(_removed_end - _removed.begin());
+    _added.clear();
+    std::set_difference(_servers.begin(), _servers.end(),
+                        _last_servers.begin(), _last_servers.end(),
+                        std::back_inserter(_added));
+    _removed.clear();
+    std::set_difference(_last_servers.begin(), _last_servers.end(),
+                        _servers.begin(), _servers.end(),
+                        std::back_inserter(_removed));
+    ApplyChanges();
+    EndWait(servers.empty() ? ENODATA : 0);
+}
 
+void NamingServiceThread::Actions::ApplyChanges() {
+    if (_added.empty() && _removed.empty()) {
+        // Generally the list is not changed, nothing to do.
+        return;
+    }
     _added_sockets.clear();
     for (size_t i = 0; i < _added.size(); ++i) {
         ServerNodeWithId tagged_id;
@@ -141,35 +162,23 @@ void NamingServiceThread::Actions::ResetServers(
 #endif
     }
 
-    // Refresh sockets
-    if (_removed_sockets.empty()) {
-        _sockets = _owner->_last_sockets;
-    } else {
-        std::sort(_removed_sockets.begin(), _removed_sockets.end());
-        _sockets.resize(_owner->_last_sockets.size());
-        std::vector<ServerNodeWithId>::iterator _sockets_end =
-            std::set_difference(
-                _owner->_last_sockets.begin(), _owner->_last_sockets.end(),
-                _removed_sockets.begin(), _removed_sockets.end(),
-                _sockets.begin());
-        _sockets.resize(_sockets_end - _sockets.begin());
-    }
-    if (!_added_sockets.empty()) {
-        const size_t before_added = _sockets.size();
-        std::sort(_added_sockets.begin(), _added_sockets.end());
-        _sockets.insert(_sockets.end(),
-                       _added_sockets.begin(), _added_sockets.end());
-        std::inplace_merge(_sockets.begin(), _sockets.begin() + before_added,
-                           _sockets.end());
-    }
     std::vector<ServerId> removed_ids;
     ServerNodeWithId2ServerId(_removed_sockets, &removed_ids, NULL,
                               _owner->_options.use_rdma);
 
     {
         BAIDU_SCOPED_LOCK(_owner->_mutex);
-        _last_servers.swap(_servers);
-        _owner->_last_sockets.swap(_sockets);
+        // Only changed entries are touched, the cost is proportional to
+        // size of the change rather than size of the list.
+        for (size_t i = 0; i < _removed.size(); ++i) {
+            _last_servers.erase(_removed[i]);
+        }
+        _last_servers.insert(_added.begin(), _added.end());
+        for (size_t i = 0; i < _removed_sockets.size(); ++i) {
+            _owner->_last_sockets.erase(_removed_sockets[i]);
+        }
+        _owner->_last_sockets.insert(_added_sockets.begin(),
+                                     _added_sockets.end());
         for (std::map<NamingServiceWatcher*,
                       const NamingServiceFilter*>::iterator
                  it = _owner->_watchers.begin();
@@ -196,20 +205,16 @@ void NamingServiceThread::Actions::ResetServers(
 #endif
     }
 
-    if (!_removed.empty() || !_added.empty()) {
-        std::ostringstream info;
-        info << butil::class_name_str(*_owner->_ns) << "(\"" 
-             << _owner->_service_name << "\"):";
-        if (!_added.empty()) {
-            info << " added "<< _added.size();
-        }
-        if (!_removed.empty()) {
-            info << " removed " << _removed.size();
-        }
-        LOG(INFO) << info.str();
+    std::ostringstream info;
+    info << butil::class_name_str(*_owner->_ns) << "(\"" 
+         << _owner->_service_name << "\"):";
+    if (!_added.empty()) {
+        info << " added "<< _added.size();
     }
-
-    EndWait(servers.empty() ? ENODATA : 0);
+    if (!_removed.empty()) {
+        info << " removed " << _removed.size();
+    }
+    LOG(INFO) << info.str();
 }
 
 void NamingServiceThread::Actions::EndWait(int error_code) {
@@ -322,12 +327,13 @@ int NamingServiceThread::WaitForFirstBatchOfServers() {
     return 0;
 }
 
+template <typename Container>
 void NamingServiceThread::ServerNodeWithId2ServerId(
-    const std::vector<ServerNodeWithId>& src,
+    const Container& src,
     std::vector<ServerId>* dst, const NamingServiceFilter* filter,
     bool use_rdma) {
     dst->reserve(src.size());
-    for (std::vector<ServerNodeWithId>::const_iterator
+    for (typename Container::const_iterator
              it = src.begin(); it != src.end(); ++it) {
         if (filter && !filter->Accept(it->node)) {
             continue;
@@ -18,6 +18,7 @@
 #define BRPC_NAMING_SERVICE_THREAD_H
 
 #include <string>
+#include <set>                                  // std::set
 #include "butil/intrusive_ptr.hpp"               // butil::intrusive_ptr
 #include "bthread/bthread.h"                    // bthread_t
 #include "brpc/server_id.h"                     // ServerId
@@ -42,7 +43,8 @@ public:
 struct GetNamingServiceThreadOptions {
     GetNamingServiceThreadOptions()
         : succeed_without_server(false)
-        , log_succeed_without_server(true) {}
+        , log_succeed_without_server(true)
+        , use_rdma(false) {}
     
     bool succeed_without_server;
     bool log_succeed_without_server;
@@ -70,15 +72,18 @@ class NamingServiceThread : public SharedObject, public Describable {
         void EndWait(int error_code);
 
     private:
+        // Create sockets for `_added', remove sockets of `_removed' and
+        // notify watchers.
+        void ApplyChanges();
+
         NamingServiceThread* _owner;
         bthread_id_t _wait_id;
         butil::atomic<bool> _has_wait_error;
         int _wait_error;
-        std::vector<ServerNode> _last_servers;
+        std::set<ServerNode> _last_servers;
         std::vector<ServerNode> _servers;
         std::vector<ServerNode> _added;
         std::vector<ServerNode> _removed;
-        std::vector<ServerNodeWithId> _sockets;
         std::vector<ServerNodeWithId> _added_sockets;
         std::vector<ServerNodeWithId> _removed_sockets;
     };
@@ -101,8 +106,9 @@ private:
     void Run();
     static void* RunThis(void*);
 
+    template <typename Container>
     static void ServerNodeWithId2ServerId(
-        const std::vector<ServerNodeWithId>& src,
+        const Container& src,
         std::vector<ServerId>* dst, const NamingServiceFilter* filter,
         bool use_rdma);
 
@@ -113,7 +119,7 @@ private:
     NamingService* _ns;
     std::string _service_name;
     GetNamingServiceThreadOptions _options;
-    std::vector<ServerNodeWithId> _last_sockets;
+    std::set<ServerNodeWithId> _last_sockets;
     Actions _actions;
     std::map<NamingServiceWatcher*, const NamingServiceFilter*> _watchers;
 };
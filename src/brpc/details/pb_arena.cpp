@@ -0,0 +1,127 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>                           // std::max
+#include <gflags/gflags.h>
+#include <google/protobuf/stubs/common.h>      // GOOGLE_PROTOBUF_VERSION
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+#include <google/protobuf/arena.h>
+#endif
+#include "butil/macros.h"
+#include "butil/arena.h"
+#include "butil/object_pool.h"
+#include "brpc/details/pb_arena.h"
+
+namespace brpc {
+
+DEFINE_int32(pb_arena_initial_block_size, 8192, "Bytes reserved by each "
+             "pooled arena for messages of methods using arenas, which are "
+             "reused by following RPCs. Messages exceeding this size use "
+             "blocks allocated and freed per RPC");
+
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+
+class PooledPBArena {
+public:
+    PooledPBArena()
+        : _block_size(std::max(FLAGS_pb_arena_initial_block_size, 256))
+        , _block(new char[_block_size])
+        , _arena(MakeOptions(_block, _block_size)) {}
+
+    ~PooledPBArena() {
+        _arena.Reset();
+        delete [] _block;
+    }
+
+    google::protobuf::Arena* arena() { return &_arena; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PooledPBArena);
+
+    static google::protobuf::ArenaOptions MakeOptions(char* block,
+                                                      size_t size) {
+        google::protobuf::ArenaOptions options;
+        options.initial_block = block;
+        options.initial_block_size = size;
+        return options;
+    }
+
+    const size_t _block_size;
+    char* _block;
+    google::protobuf::Arena _arena;
+};
+
+bool IsPBArenaSupported() { return true; }
+
+PooledPBArena* GetPooledPBArena() {
+    return butil::get_object<PooledPBArena>();
+}
+
+void ReturnPooledPBArena(PooledPBArena* arena) {
+    // Blocks beyond the initial one are freed.
+    arena->arena()->Reset();
+    butil::return_object(arena);
+}
+
+google::protobuf::Message* NewMessageOnArena(
+    const google::protobuf::Message& prototype, PooledPBArena* arena) {
+    return prototype.New(arena ? arena->arena() : NULL);
+}
+
+void* AllocateOnPooledPBArena(PooledPBArena* arena, size_t n) {
+    return google::protobuf::Arena::CreateArray<char>(arena->arena(), n);
+}
+
+google::protobuf::Arena* GetPBArena(PooledPBArena* arena) {
+    return arena->arena();
+}
+
+#else
+
+class PooledPBArena {
+public:
+    butil::Arena* arena() { return &_arena; }
+
+private:
+    butil::Arena _arena;
+};
+
+bool IsPBArenaSupported() { return false; }
+
+PooledPBArena* GetPooledPBArena() {
+    return butil::get_object<PooledPBArena>();
+}
+
+void ReturnPooledPBArena(PooledPBArena* arena) {
+    arena->arena()->clear();
+    butil::return_object(arena);
+}
+
+google::protobuf::Message* NewMessageOnArena(
+    const google::protobuf::Message& prototype, PooledPBArena*) {
+    return prototype.New();
+}
+
+void* AllocateOnPooledPBArena(PooledPBArena* arena, size_t n) {
+    // Sizes are rounded up so that all allocations are aligned to 8.
+    return arena->arena()->allocate((n + 7) & ~(size_t)7);
+}
+
+google::protobuf::Arena* GetPBArena(PooledPBArena*) {
+    return NULL;
+}
+
+#endif  // GOOGLE_PROTOBUF_VERSION
+
+} // namespace brpc
@@ -0,0 +1,57 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_DETAILS_PB_ARENA_H
+#define BRPC_DETAILS_PB_ARENA_H
+
+#include <google/protobuf/message.h>
+
+namespace google {
+namespace protobuf {
+class Arena;
+}
+}
+
+namespace brpc {
+
+// A google::protobuf::Arena with a reserved initial block, pooled so that
+// messages of frequent RPCs are allocated without hitting malloc. It's a
+// butil::Arena for allocations of users if protobuf does not support arenas.
+class PooledPBArena;
+
+// True if protobuf of this build supports arenas.
+bool IsPBArenaSupported();
+
+// Get an arena from the pool.
+// Returns NULL if arenas are not supported.
+PooledPBArena* GetPooledPBArena();
+
+// Destroy all messages on `arena' and return it into the pool.
+void ReturnPooledPBArena(PooledPBArena* arena);
+
+// Create a message of the same type with `prototype' on `arena', or on heap
+// if `arena' is NULL. Messages on arenas must not be deleted.
+google::protobuf::Message* NewMessageOnArena(
+    const google::protobuf::Message& prototype, PooledPBArena* arena);
+
+// Allocate `n' bytes aligned to 8 on `arena', which are freed when the
+// arena is returned. Returns NULL on failure.
+void* AllocateOnPooledPBArena(PooledPBArena* arena, size_t n);
+
+// The protobuf arena inside, NULL if arenas are not supported.
+google::protobuf::Arena* GetPBArena(PooledPBArena* arena);
+
+} // namespace brpc
+
+#endif  // BRPC_DETAILS_PB_ARENA_H
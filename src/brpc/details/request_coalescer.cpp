@@ -0,0 +1,91 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <algorithm>
+#include "butil/logging.h"
+#include "bthread/bthread.h"
+#include "brpc/details/request_coalescer.h"
+
+namespace brpc {
+
+namespace {
+// Waiters called in one bthread.
+struct LandingBatch {
+    RequestCoalescer::Result result;
+    std::vector<RequestCoalescer::Waiter*> waiters;
+};
+
+void* RunLandingBatch(void* arg) {
+    LandingBatch* batch = static_cast<LandingBatch*>(arg);
+    for (size_t i = 0; i < batch->waiters.size(); ++i) {
+        batch->waiters[i]->OnFlightDone(batch->result);
+    }
+    delete batch;
+    return NULL;
+}
+} // namespace
+
+bool RequestCoalescer::Join(const ResponseCache::Key& key, Waiter* waiter) {
+    Shard& shard = _shards[key.hash[0] % NSHARD];
+    {
+        BAIDU_SCOPED_LOCK(shard.mutex);
+        std::map<ResponseCache::Key, std::vector<Waiter*> >::iterator it =
+            shard.flights.find(key);
+        if (it == shard.flights.end()) {
+            shard.flights[key];
+            return false;
+        }
+        it->second.push_back(waiter);
+    }
+    _ncoalesced << 1;
+    return true;
+}
+
+void RequestCoalescer::Land(const ResponseCache::Key& key,
+                            const Result& result) {
+    Shard& shard = _shards[key.hash[0] % NSHARD];
+    std::vector<Waiter*> waiters;
+    {
+        BAIDU_SCOPED_LOCK(shard.mutex);
+        std::map<ResponseCache::Key, std::vector<Waiter*> >::iterator it =
+            shard.flights.find(key);
+        if (it == shard.flights.end()) {
+            return;
+        }
+        waiters.swap(it->second);
+        shard.flights.erase(it);
+    }
+    // Waiters send responses, don't call them with the lock held.
+    for (size_t i = 0; i < waiters.size(); i += WAITERS_PER_BTHREAD) {
+        LandingBatch* batch = new LandingBatch;
+        // Blocks of the response are shared rather than copied.
+        batch->result = result;
+        batch->waiters.assign(
+            waiters.begin() + i,
+            waiters.begin() + std::min(i + WAITERS_PER_BTHREAD, waiters.size()));
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, RunLandingBatch, batch) != 0) {
+            LOG(ERROR) << "Fail to start bthread, answer waiters in place";
+            RunLandingBatch(batch);
+        }
+    }
+}
+
+int RequestCoalescer::Expose(const butil::StringPiece& prefix) {
+    return _ncoalesced.expose_as(prefix, "coalesced_requests");
+}
+
+} // namespace brpc
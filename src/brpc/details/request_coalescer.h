@@ -0,0 +1,94 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_DETAILS_REQUEST_COALESCER_H
+#define BRPC_DETAILS_REQUEST_COALESCER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "butil/macros.h"
+#include "butil/atomicops.h"
+#include "butil/strings/string_piece.h"
+#include "butil/synchronization/lock.h"
+#include "bvar/bvar.h"
+#include "brpc/details/response_cache.h"
+
+namespace brpc {
+
+// Let concurrent identical requests of a method share one execution: the
+// first request of a key runs the method as usual while the following ones
+// wait for it and are answered with its serialized response. All methods
+// are thread-safe.
+class RequestCoalescer {
+public:
+    struct Result {
+        // Non-zero if the first request failed.
+        int error_code;
+        std::string error_text;
+        // Valid when error_code is 0.
+        ResponseCache::Response response;
+        Result() : error_code(0) {}
+    };
+
+    // A request waiting for the first request of the same key.
+    class Waiter {
+    public:
+        virtual ~Waiter() {}
+        // Called once when the first request is done, may delete itself.
+        virtual void OnFlightDone(const Result& result) = 0;
+    };
+
+    RequestCoalescer() : _enabled(false) {}
+
+    void set_enabled(bool enabled)
+    { _enabled.store(enabled, butil::memory_order_relaxed); }
+    bool enabled() const { return _enabled.load(butil::memory_order_relaxed); }
+
+    // Returns true if a request of `key' is in flight, in which case
+    // `waiter' is called when that request is done. Otherwise the caller
+    // is the first request of `key', `waiter' is untouched and Land() must
+    // be called after the caller is done.
+    bool Join(const ResponseCache::Key& key, Waiter* waiter);
+
+    // End the flight of `key' and pass `result' to all waiters joined.
+    // Waiters are called in background bthreads, at most
+    // WAITERS_PER_BTHREAD ones per bthread, so that responses of waiters
+    // are sent in parallel and the caller is not delayed by them.
+    void Land(const ResponseCache::Key& key, const Result& result);
+
+    // Expose <prefix>_coalesced_requests.
+    int Expose(const butil::StringPiece& prefix);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RequestCoalescer);
+
+    struct Shard {
+        butil::Mutex mutex;
+        // Waiters of keys in flight.
+        std::map<ResponseCache::Key, std::vector<Waiter*> > flights;
+    };
+    static const size_t NSHARD = 16;
+    static const size_t WAITERS_PER_BTHREAD = 16;
+
+    Shard _shards[NSHARD];
+    butil::atomic<bool> _enabled;
+    bvar::Adder<int64_t> _ncoalesced;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_DETAILS_REQUEST_COALESCER_H
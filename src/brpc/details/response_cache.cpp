@@ -0,0 +1,145 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <algorithm>
+#include "butil/time.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "brpc/details/response_cache.h"
+
+namespace brpc {
+
+// Bytes of bookkeeping counted for each entry besides the response.
+static const int64_t ENTRY_OVERHEAD = 128;
+// Seconds of the window in which the hit ratio is computed.
+static const int HIT_RATIO_WINDOW = 10;
+
+ResponseCache::ResponseCache()
+    : _ttl_us(0)
+    , _max_shard_bytes(0)
+    , _nhit_window(&_nhit, HIT_RATIO_WINDOW)
+    , _nmiss_window(&_nmiss, HIT_RATIO_WINDOW)
+    , _hit_ratio(GetHitRatio, this) {
+}
+
+void ResponseCache::Reset(int ttl_ms, int64_t max_bytes) {
+    _ttl_us.store(ttl_ms > 0 ? ttl_ms * 1000L : 0,
+                  butil::memory_order_relaxed);
+    _max_shard_bytes.store(std::max(max_bytes, (int64_t)0) / NSHARD,
+                           butil::memory_order_relaxed);
+    for (size_t i = 0; i < NSHARD; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        EvictLocked(&_shards[i], 0);
+    }
+}
+
+ResponseCache::Key ResponseCache::MakeKey(int compress_type,
+                                          int attachment_size,
+                                          const butil::IOBuf& request) {
+    butil::MurmurHash3_x64_128_Context ctx;
+    butil::MurmurHash3_x64_128_Init(&ctx, 0);
+    const int header[2] = { compress_type, attachment_size };
+    butil::MurmurHash3_x64_128_Update(&ctx, header, sizeof(header));
+    const size_t nblock = request.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = request.backing_block(i);
+        butil::MurmurHash3_x64_128_Update(&ctx, blk.data(), blk.size());
+    }
+    Key key;
+    butil::MurmurHash3_x64_128_Final(key.hash, &ctx);
+    return key;
+}
+
+bool ResponseCache::Get(const Key& key, Response* out) {
+    Shard& shard = _shards[key.hash[0] % NSHARD];
+    {
+        BAIDU_SCOPED_LOCK(shard.mutex);
+        butil::MRUCache<Key, Entry>::iterator it = shard.entries.Get(key);
+        if (it != shard.entries.end()) {
+            if (it->second.expire_us > butil::cpuwide_time_us()) {
+                *out = it->second.response;
+                _nhit << 1;
+                return true;
+            }
+            shard.bytes -= it->second.bytes;
+            _memory << -it->second.bytes;
+            shard.entries.Erase(it);
+        }
+    }
+    _nmiss << 1;
+    return false;
+}
+
+void ResponseCache::Put(const Key& key, const Response& response) {
+    const int64_t ttl_us = _ttl_us.load(butil::memory_order_relaxed);
+    const int64_t max_bytes =
+        _max_shard_bytes.load(butil::memory_order_relaxed);
+    const int64_t bytes = response.body.size() + response.attachment.size()
+        + ENTRY_OVERHEAD;
+    if (ttl_us <= 0 || bytes > max_bytes) {
+        return;
+    }
+    Entry entry;
+    entry.response = response;
+    entry.expire_us = butil::cpuwide_time_us() + ttl_us;
+    entry.bytes = bytes;
+    Shard& shard = _shards[key.hash[0] % NSHARD];
+    BAIDU_SCOPED_LOCK(shard.mutex);
+    butil::MRUCache<Key, Entry>::iterator it = shard.entries.Peek(key);
+    if (it != shard.entries.end()) {
+        shard.bytes -= it->second.bytes;
+        _memory << -it->second.bytes;
+        shard.entries.Erase(it);
+    }
+    EvictLocked(&shard, max_bytes - bytes);
+    shard.entries.Put(key, entry);
+    shard.bytes += bytes;
+    _memory << bytes;
+}
+
+void ResponseCache::EvictLocked(Shard* shard, int64_t max_bytes) {
+    while (shard->bytes > max_bytes && shard->entries.size() != 0) {
+        butil::MRUCache<Key, Entry>::reverse_iterator it =
+            shard->entries.rbegin();
+        shard->bytes -= it->second.bytes;
+        _memory << -it->second.bytes;
+        shard->entries.Erase(it);
+    }
+}
+
+double ResponseCache::GetHitRatio(void* arg) {
+    ResponseCache* c = static_cast<ResponseCache*>(arg);
+    const int64_t nhit = c->_nhit_window.get_value();
+    const int64_t ntotal = nhit + c->_nmiss_window.get_value();
+    return ntotal > 0 ? (double)nhit / ntotal : 0;
+}
+
+int ResponseCache::Expose(const butil::StringPiece& prefix) {
+    if (_nhit.expose_as(prefix, "response_cache_hit") != 0) {
+        return -1;
+    }
+    if (_nmiss.expose_as(prefix, "response_cache_miss") != 0) {
+        return -1;
+    }
+    if (_hit_ratio.expose_as(prefix, "response_cache_hit_ratio") != 0) {
+        return -1;
+    }
+    if (_memory.expose_as(prefix, "response_cache_memory") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace brpc
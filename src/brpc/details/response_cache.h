@@ -0,0 +1,118 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_DETAILS_RESPONSE_CACHE_H
+#define BRPC_DETAILS_RESPONSE_CACHE_H
+
+#include <stdint.h>
+#include "butil/macros.h"
+#include "butil/iobuf.h"
+#include "butil/atomicops.h"
+#include "butil/strings/string_piece.h"
+#include "butil/synchronization/lock.h"
+#include "butil/containers/mru_cache.h"
+#include "bvar/bvar.h"
+
+namespace brpc {
+
+// Cache serialized responses of a method keyed by hashes of serialized
+// requests, so that identical requests within a TTL are answered without
+// running user code or serializing again. Entries are spread over shards,
+// each of which evicts least recently used entries when it exceeds its
+// share of the memory. All methods are thread-safe.
+class ResponseCache {
+public:
+    // 128-bit hash of a request, collisions are ignored.
+    struct Key {
+        uint64_t hash[2];
+        bool operator<(const Key& rhs) const {
+            return hash[0] != rhs.hash[0] ? hash[0] < rhs.hash[0]
+                                          : hash[1] < rhs.hash[1];
+        }
+    };
+
+    struct Response {
+        // Serialized and compressed response message.
+        butil::IOBuf body;
+        butil::IOBuf attachment;
+        int compress_type;
+        Response() : compress_type(0) {}
+    };
+
+    ResponseCache();
+
+    // Cache responses for `ttl_ms' using at most `max_bytes' of memory and
+    // drop all cached responses. Nothing is cached when `ttl_ms' is not
+    // positive.
+    void Reset(int ttl_ms, int64_t max_bytes);
+
+    bool enabled() const {
+        return _ttl_us.load(butil::memory_order_relaxed) > 0;
+    }
+
+    // Hash the compression type, size of the attachment and bytes of
+    // `request' which includes the attachment.
+    static Key MakeKey(int compress_type, int attachment_size,
+                       const butil::IOBuf& request);
+
+    // Returns true and fills `out' if an unexpired response of `key' is
+    // cached. Blocks of the response are shared rather than copied.
+    bool Get(const Key& key, Response* out);
+
+    // Cache `response' of `key', evicting least recently used responses
+    // if the memory is exceeded.
+    void Put(const Key& key, const Response& response);
+
+    // Expose <prefix>_response_cache_{hit,miss,hit_ratio,memory}.
+    int Expose(const butil::StringPiece& prefix);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ResponseCache);
+
+    struct Entry {
+        Response response;
+        int64_t expire_us;
+        int64_t bytes;
+    };
+    struct Shard {
+        butil::Mutex mutex;
+        butil::MRUCache<Key, Entry> entries;
+        int64_t bytes;
+        Shard() : entries(butil::MRUCache<Key, Entry>::NO_AUTO_EVICT)
+                , bytes(0) {}
+    };
+    static const size_t NSHARD = 16;
+
+    // Remove the least recently used entries until the shard fits in
+    // `max_bytes'. Called with shard->mutex held.
+    void EvictLocked(Shard* shard, int64_t max_bytes);
+
+    static double GetHitRatio(void* arg);
+
+    Shard _shards[NSHARD];
+    butil::atomic<int64_t> _ttl_us;
+    butil::atomic<int64_t> _max_shard_bytes;
+    bvar::Adder<int64_t> _nhit;
+    bvar::Adder<int64_t> _nmiss;
+    bvar::Adder<int64_t> _memory;
+    bvar::Window<bvar::Adder<int64_t> > _nhit_window;
+    bvar::Window<bvar::Adder<int64_t> > _nmiss_window;
+    bvar::PassiveStatus<double> _hit_ratio;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_DETAILS_RESPONSE_CACHE_H
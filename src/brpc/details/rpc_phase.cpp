@@ -0,0 +1,129 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <pthread.h>
+#include <map>
+#include <gflags/gflags.h>
+#include <google/protobuf/descriptor.h>
+#include "butil/containers/doubly_buffered_data.h"
+#include "butil/scoped_lock.h"
+#include "bvar/latency_recorder.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/rpc_phase.h"
+
+namespace brpc {
+
+DEFINE_bool(rpc_phase_latency, false, "Record latencies of phases of RPCs "
+            "per method: serializing, writing, waiting for the response, "
+            "parsing and running done at client-side; parsing, processing, "
+            "serializing and writing at server-side");
+BRPC_VALIDATE_GFLAG(rpc_phase_latency, PassValidate);
+
+namespace {
+
+struct ClientPhaseRecorders {
+    bvar::LatencyRecorder serialize;
+    bvar::LatencyRecorder write;
+    bvar::LatencyRecorder wait;
+    bvar::LatencyRecorder parse;
+    bvar::LatencyRecorder done;
+};
+
+typedef std::map<const google::protobuf::MethodDescriptor*,
+                 ClientPhaseRecorders*> ClientPhaseMap;
+
+// Recorders are read in every RPC and added rarely.
+butil::DoublyBufferedData<ClientPhaseMap>* g_client_phases = NULL;
+pthread_once_t g_client_phases_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t g_client_phases_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void InitClientPhases() {
+    g_client_phases = new butil::DoublyBufferedData<ClientPhaseMap>;
+}
+
+size_t AddClientPhaseRecorders(
+    ClientPhaseMap& m, const google::protobuf::MethodDescriptor* const& method,
+    ClientPhaseRecorders* const& r) {
+    m[method] = r;
+    return 1;
+}
+
+ClientPhaseRecorders* FindClientPhaseRecorders(
+    const google::protobuf::MethodDescriptor* method) {
+    butil::DoublyBufferedData<ClientPhaseMap>::ScopedPtr ptr;
+    if (g_client_phases->Read(&ptr) != 0) {
+        return NULL;
+    }
+    ClientPhaseMap::const_iterator it = ptr->find(method);
+    return (it != ptr->end() ? it->second : NULL);
+}
+
+ClientPhaseRecorders* GetClientPhaseRecorders(
+    const google::protobuf::MethodDescriptor* method) {
+    pthread_once(&g_client_phases_once, InitClientPhases);
+    ClientPhaseRecorders* r = FindClientPhaseRecorders(method);
+    if (r) {
+        return r;
+    }
+    BAIDU_SCOPED_LOCK(g_client_phases_mutex);
+    r = FindClientPhaseRecorders(method);
+    if (r) {
+        return r;
+    }
+    r = new ClientPhaseRecorders;
+    const std::string prefix = "rpc_client_" + method->full_name();
+    r->serialize.expose(prefix, "serialize");
+    r->write.expose(prefix, "write");
+    r->wait.expose(prefix, "wait");
+    r->parse.expose(prefix, "parse");
+    r->done.expose(prefix, "done");
+    g_client_phases->Modify(AddClientPhaseRecorders, method, r);
+    return r;
+}
+
+} // namespace
+
+void RecordClientPhases(const google::protobuf::MethodDescriptor* method,
+                        const RpcPhaseTimes& times, int64_t done_us) {
+    if (method == NULL) {
+        return;
+    }
+    ClientPhaseRecorders* r = GetClientPhaseRecorders(method);
+    if (r == NULL) {
+        return;
+    }
+    int64_t us = times.Between(RPC_CLIENT_BEGIN, RPC_CLIENT_SERIALIZED);
+    if (us >= 0) {
+        r->serialize << us;
+    }
+    us = times.Between(RPC_CLIENT_SERIALIZED, RPC_CLIENT_WRITTEN);
+    if (us >= 0) {
+        r->write << us;
+    }
+    us = times.Between(RPC_CLIENT_WRITTEN, RPC_CLIENT_RECEIVED);
+    if (us >= 0) {
+        r->wait << us;
+    }
+    us = times.Between(RPC_CLIENT_RECEIVED, RPC_CLIENT_PARSED);
+    if (us >= 0) {
+        r->parse << us;
+    }
+    if (done_us >= 0) {
+        r->done << done_us;
+    }
+}
+
+} // namespace brpc
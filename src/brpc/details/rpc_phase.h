@@ -0,0 +1,93 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_RPC_PHASE_H
+#define BRPC_RPC_PHASE_H
+
+#include <string.h>
+#include <gflags/gflags_declare.h>
+#include "butil/time.h"
+
+namespace google {
+namespace protobuf {
+class MethodDescriptor;
+}
+}
+
+namespace brpc {
+
+DECLARE_bool(rpc_phase_latency);
+
+// Points in the lifetime of an RPC. Latencies between adjacent points are
+// recorded per method when -rpc_phase_latency is on.
+enum RpcPhasePoint {
+    // Client-side.
+    RPC_CLIENT_BEGIN = 0,       // Channel::CallMethod() was called
+    RPC_CLIENT_SERIALIZED,      // the request was serialized
+    RPC_CLIENT_WRITTEN,         // the request(of the last try) was written
+                                // into the socket
+    RPC_CLIENT_RECEIVED,        // the response was read from the socket
+    RPC_CLIENT_PARSED,          // the response was parsed and the RPC ended
+    // Server-side.
+    RPC_SERVER_START_PARSE,     // the protocol started to process the request
+    RPC_SERVER_START_CALLBACK,  // the request was parsed, calling the method
+    RPC_SERVER_START_SEND,      // done->Run() was called
+    RPC_SERVER_SERIALIZED,      // the response was serialized and packed
+    RPC_SERVER_WRITTEN,         // the response was written into the socket
+    RPC_PHASE_POINT_COUNT
+};
+
+// Times(butil::cpuwide_time_us()) when an RPC reached the points.
+class RpcPhaseTimes {
+public:
+    RpcPhaseTimes() { Reset(); }
+
+    void Reset() { memset(_us, 0, sizeof(_us)); }
+
+    // Mark `point' as reached now, or at `us'. No-op if -rpc_phase_latency
+    // is off.
+    void Mark(RpcPhasePoint point) {
+        if (FLAGS_rpc_phase_latency) {
+            _us[point] = butil::cpuwide_time_us();
+        }
+    }
+    void Mark(RpcPhasePoint point, int64_t us) {
+        if (FLAGS_rpc_phase_latency) {
+            _us[point] = us;
+        }
+    }
+
+    // Microseconds from `from' to `to', -1 if any of them was not reached.
+    int64_t Between(RpcPhasePoint from, RpcPhasePoint to) const {
+        if (_us[from] == 0 || _us[to] < _us[from]) {
+            return -1;
+        }
+        return _us[to] - _us[from];
+    }
+
+private:
+    int64_t _us[RPC_PHASE_POINT_COUNT];
+};
+
+// Record client-side phases of a successful RPC to `method'. `done_us' is
+// microseconds spent in running done, -1 for synchronous RPCs.
+// Latencies are exposed as rpc_client_<full-method-name>_<phase>_latency.
+void RecordClientPhases(const google::protobuf::MethodDescriptor* method,
+                        const RpcPhaseTimes& times, int64_t done_us);
+
+} // namespace brpc
+
+#endif // BRPC_RPC_PHASE_H
@@ -19,6 +19,7 @@
 #include "brpc/server.h"
 #include "brpc/acceptor.h"
 #include "brpc/details/method_status.h"
+#include "brpc/tenant_quota.h"
 #include "brpc/builtin/bad_method_service.h"
 #include "brpc/restful.h"
 
@@ -38,6 +39,17 @@ public:
         _server->_nerror << 1;
     }
 
+    // Returns true iff the request is admitted by `tenant_quotas'.
+    // Called before AddConcurrency().
+    bool AddTenantConcurrency(Controller* c) {
+        TenantQuotas* quotas = _server->options().tenant_quotas;
+        if (quotas == NULL) {
+            return true;
+        }
+        return quotas->OnRequested(c, _server->options().max_concurrency,
+                                   &c->_tenant_status);
+    }
+
     // Returns true iff the `max_concurrency' limit is not reached.
     bool AddConcurrency(Controller* c) {
         if (_server->options().max_concurrency <= 0) {
@@ -49,15 +61,21 @@ public:
             return true;
         }
         butil::subtle::NoBarrier_AtomicIncrement(&_server->_concurrency, -1);
+        if (c->_tenant_status) {
+            _server->options().tenant_quotas->OnServerLimited(
+                c->_tenant_status);
+        }
         return false;
     }
 
-    // Remove the increment of AddConcurrency(). Must not be called when
-    // AddConcurrency() returned false.
+    // Remove the increments of AddTenantConcurrency() and AddConcurrency().
     void RemoveConcurrency(const Controller* c) {
         if (c->has_flag(Controller::FLAGS_ADDED_CONCURRENCY)) {
             butil::subtle::NoBarrier_AtomicIncrement(&_server->_concurrency, -1);
         }
+        if (c->_tenant_status) {
+            _server->options().tenant_quotas->OnResponded(c->_tenant_status);
+        }
     }
 
     // Find by MethodDescriptor::full_name
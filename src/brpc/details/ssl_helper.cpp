@@ -23,6 +23,7 @@
 #include "butil/logging.h"
 #include "butil/ssl_compat.h"
 #include "butil/string_splitter.h"
+#include "butil/synchronization/lock.h"
 #include "brpc/socket.h"
 #include "brpc/details/ssl_helper.h"
 
@@ -37,6 +38,60 @@ static DH* g_dh_8192 = NULL;
 
 static const char* const PEM_START = "-----BEGIN";
 
+// The latest session of a client SSL_CTX which is created for each server
+// in SocketMap and shared by connections to the server, so that reconnecting
+// to the server avoids full handshakes.
+struct ClientSessionCache {
+    ClientSessionCache() : session(NULL) {}
+    ~ClientSessionCache() {
+        if (session) {
+            SSL_SESSION_free(session);
+        }
+    }
+    butil::Mutex mutex;
+    SSL_SESSION* session;
+};
+
+static pthread_once_t g_client_session_once = PTHREAD_ONCE_INIT;
+static int g_client_session_index = -1;
+
+static void FreeClientSessionCache(void*, void* ptr, CRYPTO_EX_DATA*,
+                                   int, long, void*) {
+    delete static_cast<ClientSessionCache*>(ptr);
+}
+
+static void InitClientSessionIndex() {
+    g_client_session_index = SSL_CTX_get_ex_new_index(
+        0, NULL, NULL, NULL, FreeClientSessionCache);
+}
+
+static ClientSessionCache* GetClientSessionCache(SSL_CTX* ctx) {
+    if (g_client_session_index < 0) {
+        return NULL;
+    }
+    return static_cast<ClientSessionCache*>(
+        SSL_CTX_get_ex_data(ctx, g_client_session_index));
+}
+
+// Called by OpenSSL when a new session is established (or a ticket is
+// received in TLSv1.3). Returns 1 to take the reference of `session'.
+static int OnNewClientSession(SSL* ssl, SSL_SESSION* session) {
+    ClientSessionCache* cache = GetClientSessionCache(SSL_get_SSL_CTX(ssl));
+    if (cache == NULL) {
+        return 0;
+    }
+    SSL_SESSION* old = NULL;
+    {
+        BAIDU_SCOPED_LOCK(cache->mutex);
+        old = cache->session;
+        cache->session = session;
+    }
+    if (old) {
+        SSL_SESSION_free(old);
+    }
+    return 1;
+}
+
 static bool IsPemString(const std::string& input) {
     for (const char* s = input.c_str(); *s != '\0'; ++s) {
         if (*s != '\n') {
@@ -462,7 +517,19 @@ SSL_CTX* CreateClientSSLContext(const ChannelSSLOptions& options) {
         return NULL;
     }
 
-    SSL_CTX_set_session_cache_mode(ssl_ctx.get(), SSL_SESS_CACHE_CLIENT);
+    // Sessions are cached by OnNewClientSession instead of OpenSSL.
+    SSL_CTX_set_session_cache_mode(ssl_ctx.get(), SSL_SESS_CACHE_CLIENT
+                                   | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    pthread_once(&g_client_session_once, InitClientSessionIndex);
+    if (g_client_session_index >= 0) {
+        ClientSessionCache* cache = new ClientSessionCache;
+        if (SSL_CTX_set_ex_data(ssl_ctx.get(), g_client_session_index,
+                                cache) != 1) {
+            delete cache;
+        } else {
+            SSL_CTX_sess_set_new_cb(ssl_ctx.get(), OnNewClientSession);
+        }
+    }
     return ssl_ctx.release();
 }
 
@@ -501,6 +568,11 @@ SSL_CTX* CreateServerSSLContext(const std::string& certificate,
 
     SSL_CTX_set_timeout(ssl_ctx.get(), options.session_lifetime_s);
     SSL_CTX_sess_set_cache_size(ssl_ctx.get(), options.session_cache_size);
+    // Required to resume sessions by ID when client certificates are
+    // verified. Session tickets are on by default.
+    static const unsigned char SESSION_ID_CONTEXT[] = "brpc";
+    SSL_CTX_set_session_id_context(ssl_ctx.get(), SESSION_ID_CONTEXT,
+                                   sizeof(SESSION_ID_CONTEXT) - 1);
 
 #ifndef OPENSSL_NO_DH
     SSL_CTX_set_tmp_dh_callback(ssl_ctx.get(), SSLGetDHCallback);
@@ -523,7 +595,8 @@ SSL_CTX* CreateServerSSLContext(const std::string& certificate,
     return ssl_ctx.release();
 }
 
-SSL* CreateSSLSession(SSL_CTX* ctx, SocketId id, int fd, bool server_mode) {
+SSL* CreateSSLSession(SSL_CTX* ctx, SocketId id, int fd, bool server_mode,
+                      bool ktls) {
     if (ctx == NULL) {
         LOG(WARNING) << "Lack SSL_ctx to create an SSL session";
         return NULL;
@@ -543,11 +616,43 @@ SSL* CreateSSLSession(SSL_CTX* ctx, SocketId id, int fd, bool server_mode) {
         SSL_set_accept_state(ssl);
     } else {
         SSL_set_connect_state(ssl);
+        ClientSessionCache* cache = GetClientSessionCache(ctx);
+        if (cache != NULL) {
+            BAIDU_SCOPED_LOCK(cache->mutex);
+            if (cache->session) {
+                // A full handshake is done if the server rejects it.
+                SSL_set_session(ssl, cache->session);
+            }
+        }
     }
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ktls) {
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+    }
+#else
+    (void)ktls;
+#endif  // SSL_OP_ENABLE_KTLS
     SSL_set_app_data(ssl, id);
     return ssl;
 }
 
+bool IsKernelTLSSendEnabled(SSL* ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+#else
+    (void)ssl;
+    return false;
+#endif
+}
+
+void FreeSSLSession(SSL* ssl) {
+    if (SSL_is_init_finished(ssl)) {
+        // Closing without close_notify invalidates the session otherwise.
+        SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+    SSL_free(ssl);
+}
+
 void AddBIOBuffer(SSL* ssl, int fd, int bufsize) {
     BIO* rbio = BIO_new(BIO_f_buffer());
     BIO_set_buffer_size(rbio, bufsize);
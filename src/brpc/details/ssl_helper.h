@@ -81,7 +81,19 @@ SSL_CTX* CreateServerSSLContext(const std::string& certificate_file,
 
 // Create a new SSL (per connection object) using configurations in `ctx'.
 // Set the required `fd' and mode. `id' will be set into SSL as app data.
-SSL* CreateSSLSession(SSL_CTX* ctx, SocketId id, int fd, bool server_mode);
+// In client mode, the last session got by `ctx' is resumed if possible.
+// If `ktls' is true, ask OpenSSL to enable kernel TLS after handshake.
+SSL* CreateSSLSession(SSL_CTX* ctx, SocketId id, int fd, bool server_mode,
+                      bool ktls = false);
+
+// True if records written into `ssl' are encrypted by the kernel (kTLS),
+// in which case plain data can be written into the fd directly.
+bool IsKernelTLSSendEnabled(SSL* ssl);
+
+// Free `ssl' created by CreateSSLSession. Sessions of connections closed
+// after handshake are kept resumable, while OpenSSL removes the ones
+// broken by errors.
+void FreeSSLSession(SSL* ssl);
 
 // Add a buffer layer of BIO in front of the socket fd layer,
 // which can reduce the total number of calls to system read/write
@@ -0,0 +1,81 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "butil/scoped_lock.h"
+#include "brpc/details/stream_frame_queue.h"
+
+
+namespace brpc {
+
+bool StreamFrameQueue::Push(SocketId stream_id, int weight,
+                            std::deque<butil::IOBuf>* frames) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    PendingFrames& pf = _streams[stream_id];
+    if (pf.frames.empty()) {
+        _active_streams.push_back(stream_id);
+        pf.frames.swap(*frames);
+    } else {
+        for (size_t i = 0; i < frames->size(); ++i) {
+            pf.frames.push_back(butil::IOBuf());
+            pf.frames.back().swap((*frames)[i]);
+        }
+        frames->clear();
+    }
+    pf.weight = std::max(weight, 1);
+    if (_writing) {
+        return false;
+    }
+    _writing = true;
+    return true;
+}
+
+bool StreamFrameQueue::PickFrames(size_t quantum, butil::IOBuf* out) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    // Frames larger than the credit are taken in later rounds.
+    while (!_active_streams.empty() && out->empty()) {
+        for (size_t n = _active_streams.size(); n > 0; --n) {
+            const SocketId stream_id = _active_streams.front();
+            _active_streams.pop_front();
+            std::map<SocketId, PendingFrames>::iterator it =
+                _streams.find(stream_id);
+            PendingFrames& pf = it->second;
+            pf.credit += pf.weight * quantum;
+            while (!pf.frames.empty() && pf.frames.front().size() <= pf.credit) {
+                pf.credit -= pf.frames.front().size();
+                out->append(pf.frames.front().movable());
+                pf.frames.pop_front();
+            }
+            if (pf.frames.empty()) {
+                _streams.erase(it);
+            } else {
+                _active_streams.push_back(stream_id);
+            }
+        }
+    }
+    if (out->empty()) {
+        _writing = false;
+        return false;
+    }
+    return true;
+}
+
+void StreamFrameQueue::Clear() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _streams.clear();
+    _active_streams.clear();
+    _writing = false;
+}
+
+} // namespace brpc
@@ -0,0 +1,77 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_STREAM_FRAME_QUEUE_H
+#define BRPC_STREAM_FRAME_QUEUE_H
+
+#include <deque>
+#include <map>
+#include "butil/iobuf.h"
+#include "butil/macros.h"                  // DISALLOW_COPY_AND_ASSIGN
+#include "butil/synchronization/lock.h"    // butil::Mutex
+#include "brpc/socket_id.h"                // SocketId
+
+
+namespace brpc {
+
+// Frames of streams sharing a connection, which are picked in weighted
+// round-robin(deficit round-robin) so that heavy streams don't delay others
+// by writing large batches. At most one thread writes picked frames at any
+// time, like the write queue of Socket.
+class StreamFrameQueue {
+public:
+    StreamFrameQueue() : _writing(false) {}
+
+    // Append `frames' of stream `stream_id' which gets `weight' times
+    // more bytes than a stream with weight 1 in each round. `frames' is
+    // cleared.
+    // Returns true if the caller becomes the writer, which should call
+    // PickFrames() and write frames until it returns false.
+    bool Push(SocketId stream_id, int weight, std::deque<butil::IOBuf>* frames);
+
+    // [Called by the writer]
+    // Cut frames of a round into `out': each active stream gets
+    // weight * `quantum' bytes of credit and frames are taken while the
+    // credit is enough, unused credit is kept for the next round.
+    // Returns false and the caller is not the writer anymore if there're
+    // no frames.
+    bool PickFrames(size_t quantum, butil::IOBuf* out);
+
+    // [Called by the writer]
+    // Drop all frames and the caller is not the writer anymore, e.g. when
+    // the connection is broken.
+    void Clear();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(StreamFrameQueue);
+
+    struct PendingFrames {
+        PendingFrames() : weight(1), credit(0) {}
+        std::deque<butil::IOBuf> frames;
+        int weight;
+        size_t credit;
+    };
+
+    butil::Mutex _mutex;
+    bool _writing;
+    std::map<SocketId, PendingFrames> _streams;
+    // Streams with frames in round-robin order.
+    std::deque<SocketId> _active_streams;
+};
+
+} // namespace brpc
+
+
+#endif // BRPC_STREAM_FRAME_QUEUE_H
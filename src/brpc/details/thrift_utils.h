@@ -23,7 +23,10 @@
 
 #include <thrift/TDispatchProcessor.h>
 #include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TVirtualTransport.h>
+#include <thrift/transport/TTransportException.h>
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
 
 // _THRIFT_STDCXX_H_ is defined by thrift/stdcxx.h which was added since thrift 0.11.0
 // TDispatcherProcessor.h above uses shared_ptr and should include stdcxx.h
@@ -39,6 +42,83 @@
 
 namespace brpc {
 
+// First byte of messages in TCompactProtocol, messages in TBinaryProtocol
+// start with THRIFT_HEAD_VERSION_1.
+static const uint8_t THRIFT_COMPACT_PROTOCOL_ID = 0x82;
+
+// Transport reading from and writing to IOBuf directly, without copying
+// the whole body into a contiguous buffer as TMemoryBuffer does. Fixed-size
+// fields are borrowed from the blocks of the IOBuf if possible.
+class ThriftIOBufTransport
+    : public ::apache::thrift::transport::TVirtualTransport<ThriftIOBufTransport> {
+public:
+    // Read from `in' which is consumed, `in' can be NULL if this transport
+    // is only for writing.
+    explicit ThriftIOBufTransport(butil::IOBuf* in) : _in(in) {}
+
+    // isOpen() is not overridden: it's const since thrift 0.13 and not
+    // called by protocols.
+
+    uint32_t read(uint8_t* buf, uint32_t len) {
+        return _in->cutn(buf, len);
+    }
+
+    uint32_t readAll(uint8_t* buf, uint32_t len) {
+        if (_in->cutn(buf, len) != len) {
+            throw ::apache::thrift::transport::TTransportException(
+                ::apache::thrift::transport::TTransportException::END_OF_FILE,
+                "No more data to read.");
+        }
+        return len;
+    }
+
+    const uint8_t* borrow(uint8_t* /*buf*/, uint32_t* len) {
+        const butil::StringPiece front = _in->backing_block(0);
+        if (front.size() >= *len) {
+            *len = front.size();
+            return (const uint8_t*)front.data();
+        }
+        return NULL;
+    }
+
+    void consume(uint32_t len) {
+        _in->pop_front(len);
+    }
+
+    void write(const uint8_t* buf, uint32_t len) {
+        _appender.append(buf, len);
+    }
+
+    // Append written data into `out'.
+    void move_written_to(butil::IOBuf* out) {
+        out->append(_appender.buf().movable());
+    }
+
+private:
+    butil::IOBuf* _in;
+    butil::IOBufAppender _appender;
+};
+
+// True if the thrift message in `body' is in TCompactProtocol.
+inline bool is_thrift_compact_message(const butil::IOBuf& body) {
+    char c = 0;
+    return body.copy_to(&c, 1) == 1 &&
+        (uint8_t)c == THRIFT_COMPACT_PROTOCOL_ID;
+}
+
+// Create the protocol upon `transport'. Protocols are specialized with
+// ThriftIOBufTransport so that calls to the transport are not virtual.
+inline THRIFT_STDCXX::shared_ptr< ::apache::thrift::protocol::TProtocol>
+create_thrift_protocol(const THRIFT_STDCXX::shared_ptr<ThriftIOBufTransport>& transport,
+                       bool compact) {
+    if (compact) {
+        return THRIFT_STDCXX::make_shared<
+            ::apache::thrift::protocol::TCompactProtocolT<ThriftIOBufTransport> >(transport);
+    }
+    return THRIFT_STDCXX::make_shared<
+        ::apache::thrift::protocol::TBinaryProtocolT<ThriftIOBufTransport> >(transport);
+}
+
 template <typename T>
 void thrift_framed_message_deleter(void* p) {
    delete static_cast<T*>(p);
@@ -54,21 +134,11 @@ template<typename T>
 bool serialize_iobuf_to_thrift_message(butil::IOBuf& body,
     void* thrift_raw_instance, std::string* method_name, int32_t* thrift_message_seq_id) {
 
-    auto in_buffer =
-        THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-    auto in_portocol =
-        THRIFT_STDCXX::make_shared<apache::thrift::protocol::TBinaryProtocol>(in_buffer);
-    
-    // Cut the thrift buffer and parse thrift message
-    size_t body_len  = body.size();
-    std::unique_ptr<uint8_t[]> thrift_buffer(new uint8_t[body_len]);
-    
-    const size_t k = body.copy_to(thrift_buffer.get(), body_len);
-    if ( k != body_len) {
-        return false;
-    }
-    
-    in_buffer->resetBuffer(thrift_buffer.get(), body_len);
+    // Read from a copy referencing the same blocks.
+    butil::IOBuf in_buf(body);
+    auto in_buffer = THRIFT_STDCXX::make_shared<ThriftIOBufTransport>(&in_buf);
+    auto in_portocol = create_thrift_protocol(
+        in_buffer, is_thrift_compact_message(body));
     
     // The following code was taken and modified from thrift auto generated code
     
@@ -0,0 +1,183 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <errno.h>
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/usercode_pool.h"
+
+namespace bthread {
+// Defined in bthread/task_control.cpp
+void run_worker_startfn();
+}
+
+namespace brpc {
+
+DEFINE_int32(usercode_pool_idle_timeout_ms, 10000, "Threads of per-method "
+             "usercode pools beyond min_threads quit after being idle for so "
+             "many milliseconds");
+BRPC_VALIDATE_GFLAG(usercode_pool_idle_timeout_ms, PositiveInteger);
+
+UserCodePool::UserCodePool()
+    : _nthreads(0)
+    , _nidle(0)
+    , _min_threads(0)
+    , _max_threads(0)
+    , _max_queue_size(0)
+    , _stop(false)
+    , _enabled(false)
+    , _nthreads_var(GetThreadCount, this)
+    , _queue_size_var(GetQueueSize, this) {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    pthread_cond_init(&_quit_cond, NULL);
+}
+
+UserCodePool::~UserCodePool() {
+    pthread_mutex_lock(&_mutex);
+    _stop = true;
+    pthread_cond_broadcast(&_cond);
+    while (_nthreads > 0) {
+        pthread_cond_wait(&_quit_cond, &_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+    pthread_cond_destroy(&_quit_cond);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void UserCodePool::Reset(int min_threads, int max_threads,
+                         int max_queue_size) {
+    pthread_mutex_lock(&_mutex);
+    _max_threads = std::max(max_threads, 0);
+    _min_threads = std::min(std::max(min_threads, 0), _max_threads);
+    _max_queue_size = std::max(max_queue_size, 0);
+    _enabled.store(_max_threads > 0, butil::memory_order_relaxed);
+    while (_nthreads < _min_threads) {
+        AddThreadLocked();
+    }
+    // Let extra idle threads quit.
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void UserCodePool::AddThreadLocked() {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t th;
+    if (pthread_create(&th, &attr, RunThread, this) != 0) {
+        PLOG(ERROR) << "Fail to create thread of UserCodePool";
+    } else {
+        ++_nthreads;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+bool UserCodePool::Run(void (*fn)(void*), void* arg) {
+    pthread_mutex_lock(&_mutex);
+    // User code queued beyond idle threads, including the woken ones which
+    // have not picked user code yet.
+    const int nwaiting = (int)_queue.size() - _nidle;
+    if (_stop || (nwaiting >= 0 && _nthreads >= _max_threads &&
+                  nwaiting >= _max_queue_size)) {
+        pthread_mutex_unlock(&_mutex);
+        _nrejected << 1;
+        return false;
+    }
+    const UserCode usercode = { fn, arg, butil::cpuwide_time_us() };
+    _queue.push_back(usercode);
+    if ((int)_queue.size() > _nidle && _nthreads < _max_threads) {
+        AddThreadLocked();
+    }
+    pthread_mutex_unlock(&_mutex);
+    pthread_cond_signal(&_cond);
+    return true;
+}
+
+void* UserCodePool::RunThread(void* arg) {
+    static_cast<UserCodePool*>(arg)->RunLoop();
+    return NULL;
+}
+
+void UserCodePool::RunLoop() {
+    bthread::run_worker_startfn();
+    pthread_mutex_lock(&_mutex);
+    while (true) {
+        if (_queue.empty()) {
+            if (_stop || _nthreads > _max_threads) {
+                break;
+            }
+            const timespec abstime = butil::milliseconds_from_now(
+                FLAGS_usercode_pool_idle_timeout_ms);
+            ++_nidle;
+            const int rc = pthread_cond_timedwait(&_cond, &_mutex, &abstime);
+            --_nidle;
+            if (rc == ETIMEDOUT && _queue.empty() &&
+                _nthreads > _min_threads) {
+                break;
+            }
+            continue;
+        }
+        const UserCode usercode = _queue.front();
+        _queue.pop_front();
+        pthread_mutex_unlock(&_mutex);
+        _wait_latency << (butil::cpuwide_time_us() - usercode.queued_us);
+        usercode.fn(usercode.arg);
+        pthread_mutex_lock(&_mutex);
+    }
+    if (--_nthreads == 0) {
+        pthread_cond_broadcast(&_quit_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+int UserCodePool::GetThreadCount(void* arg) {
+    UserCodePool* p = static_cast<UserCodePool*>(arg);
+    pthread_mutex_lock(&p->_mutex);
+    const int n = p->_nthreads;
+    pthread_mutex_unlock(&p->_mutex);
+    return n;
+}
+
+int UserCodePool::GetQueueSize(void* arg) {
+    UserCodePool* p = static_cast<UserCodePool*>(arg);
+    pthread_mutex_lock(&p->_mutex);
+    const int n = (int)p->_queue.size();
+    pthread_mutex_unlock(&p->_mutex);
+    return n;
+}
+
+int UserCodePool::Expose(const butil::StringPiece& prefix) {
+    if (_wait_latency.expose(prefix, "pool_wait") != 0) {
+        return -1;
+    }
+    if (_nrejected.expose_as(prefix, "pool_rejected") != 0) {
+        return -1;
+    }
+    if (_nthreads_var.expose_as(prefix, "pool_threads") != 0) {
+        return -1;
+    }
+    if (_queue_size_var.expose_as(prefix, "pool_queue_size") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace brpc
@@ -0,0 +1,95 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_DETAILS_USERCODE_POOL_H
+#define BRPC_DETAILS_USERCODE_POOL_H
+
+#include <pthread.h>
+#include <deque>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/strings/string_piece.h"
+#include "bvar/bvar.h"
+
+namespace brpc {
+
+// An elastic pool of pthreads running user code of a method, so that
+// methods blocking pthreads (e.g. legacy code calling blocking functions)
+// neither block bthread workers nor delay user code of other methods in
+// the global backup pool of -usercode_in_pthread. Threads are created on
+// demand up to max_threads, and the ones beyond min_threads quit after
+// being idle for -usercode_pool_idle_timeout_ms. All methods are
+// thread-safe.
+class UserCodePool {
+public:
+    UserCodePool();
+    // Wait for all queued user code to finish.
+    ~UserCodePool();
+
+    // Run user code with at most `max_threads' threads, at most
+    // `max_queue_size' user code can wait for threads beyond idle ones.
+    // Threads beyond `max_threads' quit after running current user code.
+    // The pool is disabled when `max_threads' is not positive.
+    void Reset(int min_threads, int max_threads, int max_queue_size);
+
+    bool enabled() const { return _enabled.load(butil::memory_order_relaxed); }
+
+    // Run `fn(arg)' in a thread of the pool. Returns false without
+    // running it if all threads are busy and the queue is full.
+    bool Run(void (*fn)(void*), void* arg);
+
+    // Expose <prefix>_pool_{threads,queue_size,rejected} and latency of
+    // waiting for threads as <prefix>_pool_wait_*.
+    int Expose(const butil::StringPiece& prefix);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(UserCodePool);
+
+    struct UserCode {
+        void (*fn)(void*);
+        void* arg;
+        int64_t queued_us;
+    };
+
+    static void* RunThread(void* arg);
+    void RunLoop();
+    // Called with _mutex held.
+    void AddThreadLocked();
+
+    static int GetThreadCount(void* arg);
+    static int GetQueueSize(void* arg);
+
+    mutable pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    // Signaled when the last thread quits.
+    pthread_cond_t _quit_cond;
+    std::deque<UserCode> _queue;
+    int _nthreads;
+    int _nidle;
+    int _min_threads;
+    int _max_threads;
+    int _max_queue_size;
+    bool _stop;
+    butil::atomic<bool> _enabled;
+    bvar::LatencyRecorder _wait_latency;
+    bvar::Adder<int64_t> _nrejected;
+    bvar::PassiveStatus<int> _nthreads_var;
+    bvar::PassiveStatus<int> _queue_size_var;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_DETAILS_USERCODE_POOL_H
@@ -17,11 +17,15 @@
 
 #include <gflags/gflags.h>                            // DEFINE_int32
 #include "butil/compat.h"
+#include "butil/atomicops.h"                          // static_atomic
 #include "butil/fd_utility.h"                         // make_close_on_exec
 #include "butil/logging.h"                            // LOG
+#include "butil/scoped_lock.h"                        // BAIDU_SCOPED_LOCK
+#include "butil/time.h"                               // cpuwide_time_us
 #include "butil/third_party/murmurhash3/murmurhash3.h"// fmix32
 #include "bthread/bthread.h"                          // bthread_start_background
 #include "brpc/event_dispatcher.h"
+#include "brpc/details/io_uring_engine.h"
 #ifdef BRPC_SOCKET_HAS_EOF
 #include "brpc/details/has_epollrdhup.h"
 #endif
@@ -39,12 +43,36 @@ DEFINE_int32(event_dispatcher_num, 1, "Number of event dispatcher");
 DEFINE_bool(usercode_in_pthread, false, 
             "Call user's callback in pthreads, use bthreads otherwise");
 
+DEFINE_bool(event_dispatcher_busy_poll, false,
+            "Run each event dispatcher in a dedicated pthread which polls "
+            "events without blocking, removing the wakeup latency of "
+            "epoll_wait at the cost of burning a CPU core per dispatcher");
+DEFINE_int32(event_dispatcher_busy_poll_idle_us, 10000,
+             "A busy-polling dispatcher blocks in epoll_wait again after "
+             "seeing no events for so many microseconds, to bound CPU burn "
+             "of idle dispatchers. Non-positive value means spinning forever");
+BRPC_VALIDATE_GFLAG(event_dispatcher_busy_poll_idle_us, PassValidate);
+DEFINE_int32(event_dispatcher_busy_poll_first_cpu, -1,
+             "Pin the i-th busy-polling dispatcher to CPU first_cpu+i if this "
+             "flag is non-negative, so that dispatchers run on dedicated cores");
+DEFINE_int32(event_dispatcher_inline_max_bytes, 0,
+             "A busy-polling dispatcher processes input of a socket in itself "
+             "rather than a new bthread when no more than so many bytes are "
+             "readable, saving a bthread switch for small messages. Callbacks "
+             "of such messages run in the dispatcher as well and should be "
+             "short and non-blocking. 0 disables");
+BRPC_VALIDATE_GFLAG(event_dispatcher_inline_max_bytes, NonNegativeInteger);
+
 EventDispatcher::EventDispatcher()
     : _epfd(-1)
     , _stop(false)
     , _tid(0)
+    , _busy_poll(false)
     , _consumer_thread_attr(BTHREAD_ATTR_NORMAL)
+    , _io_uring_created(false)
+    , _io_uring(NULL)
 {
+    pthread_mutex_init(&_io_uring_mutex, NULL);
 #if defined(OS_LINUX)
     _epfd = epoll_create(1024 * 1024);
     if (_epfd < 0) {
@@ -81,6 +109,8 @@ EventDispatcher::~EventDispatcher() {
         close(_wakeup_fds[0]);
         close(_wakeup_fds[1]);
     }
+    delete _io_uring.exchange(NULL, butil::memory_order_relaxed);
+    pthread_mutex_destroy(&_io_uring_mutex);
 }
 
 int EventDispatcher::Start(const bthread_attr_t* consumer_thread_attr) {
@@ -93,7 +123,7 @@ int EventDispatcher::Start(const bthread_attr_t* consumer_thread_attr) {
         return -1;
     }
     
-    if (_tid != 0) {
+    if (_tid != 0 || _busy_poll) {
         LOG(FATAL) << "Already started this dispatcher(" << this 
                    << ") in bthread=" << _tid;
         return -1;
@@ -104,13 +134,28 @@ int EventDispatcher::Start(const bthread_attr_t* consumer_thread_attr) {
     _consumer_thread_attr = (consumer_thread_attr  ?
                              *consumer_thread_attr : BTHREAD_ATTR_NORMAL);
 
+    if (FLAGS_event_dispatcher_busy_poll) {
+        // Spinning in a bthread would occupy a worker which is supposed to
+        // run user code, use a pthread instead.
+        const int rc = pthread_create(&_busy_poll_thread, NULL, RunThis, this);
+        if (rc) {
+            LOG(FATAL) << "Fail to create busy-polling thread: " << berror(rc);
+            return -1;
+        }
+        _busy_poll = true;
+        return 0;
+    }
+
     // Polling thread uses the same attr for consumer threads (NORMAL right
     // now). Previously, we used small stack (32KB) which may be overflowed
     // when the older comlog (e.g. 3.1.85) calls com_openlog_r(). Since this
     // is also a potential issue for consumer threads, using the same attr
-    // should be a reasonable solution.
+    // should be a reasonable solution. The polling thread always runs on
+    // the default tag, tagged servers are isolated by the consumer threads.
+    bthread_attr_t epoll_thread_attr = _consumer_thread_attr;
+    epoll_thread_attr.tag = BTHREAD_TAG_DEFAULT;
     int rc = bthread_start_background(
-        &_tid, &_consumer_thread_attr, RunThis, this);
+        &_tid, &epoll_thread_attr, RunThis, this);
     if (rc) {
         LOG(FATAL) << "Fail to create epoll/kqueue thread: " << berror(rc);
         return -1;
@@ -119,7 +164,7 @@ int EventDispatcher::Start(const bthread_attr_t* consumer_thread_attr) {
 }
 
 bool EventDispatcher::Running() const {
-    return !_stop  && _epfd >= 0 && _tid != 0;
+    return !_stop  && _epfd >= 0 && (_tid != 0 || _busy_poll);
 }
 
 void EventDispatcher::Stop() {
@@ -139,6 +184,10 @@ void EventDispatcher::Stop() {
 }
 
 void EventDispatcher::Join() {
+    if (_busy_poll) {
+        pthread_join(_busy_poll_thread, NULL);
+        _busy_poll = false;
+    }
     if (_tid) {
         bthread_join(_tid, NULL);
         _tid = 0;
@@ -241,6 +290,37 @@ int EventDispatcher::AddConsumer(SocketId socket_id, int fd) {
     return -1;
 }
 
+int EventDispatcher::PauseInput(SocketId socket_id, int fd) {
+#if defined(OS_LINUX)
+    epoll_event evt;
+    evt.data.u64 = socket_id;
+    evt.events = EPOLLET;
+    return epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &evt);
+#elif defined(OS_MACOSX)
+    struct kevent evt;
+    EV_SET(&evt, fd, EVFILT_READ, EV_DISABLE, 0, 0, (void*)socket_id);
+    return kevent(_epfd, &evt, 1, NULL, 0, NULL);
+#endif
+    return -1;
+}
+
+int EventDispatcher::ResumeInput(SocketId socket_id, int fd) {
+#if defined(OS_LINUX)
+    epoll_event evt;
+    evt.data.u64 = socket_id;
+    evt.events = EPOLLIN | EPOLLET;
+#ifdef BRPC_SOCKET_HAS_EOF
+    evt.events |= has_epollrdhup;
+#endif
+    return epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &evt);
+#elif defined(OS_MACOSX)
+    struct kevent evt;
+    EV_SET(&evt, fd, EVFILT_READ, EV_ENABLE | EV_CLEAR, 0, 0, (void*)socket_id);
+    return kevent(_epfd, &evt, 1, NULL, 0, NULL);
+#endif
+    return -1;
+}
+
 int EventDispatcher::RemoveConsumer(int fd) {
     if (fd < 0) {
         return -1;
@@ -267,27 +347,97 @@ int EventDispatcher::RemoveConsumer(int fd) {
     return 0;
 }
 
+// epoll data of the io_uring, never a valid SocketId.
+static const uint64_t IO_URING_EVENT_DATA = (uint64_t)-1;
+
+IoUringEngine* EventDispatcher::GetIoUringEngine() {
+    IoUringEngine* io_uring = _io_uring.load(butil::memory_order_acquire);
+    if (io_uring) {
+        return io_uring;
+    }
+    BAIDU_SCOPED_LOCK(_io_uring_mutex);
+    if (_io_uring_created) {
+        return _io_uring.load(butil::memory_order_relaxed);
+    }
+    _io_uring_created = true;
+#if defined(OS_LINUX)
+    io_uring = IoUringEngine::Create();
+    if (io_uring == NULL) {
+        LOG(WARNING) << "io_uring is not available, use epoll instead";
+        return NULL;
+    }
+    // Level-triggered, completions are reaped until the ring is empty.
+    epoll_event evt;
+    evt.events = EPOLLIN;
+    evt.data.u64 = IO_URING_EVENT_DATA;
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, io_uring->fd(), &evt) != 0) {
+        PLOG(WARNING) << "Fail to add io_uring into epfd=" << _epfd;
+        delete io_uring;
+        return NULL;
+    }
+    _io_uring.store(io_uring, butil::memory_order_release);
+#endif
+    return io_uring;
+}
+
 void* EventDispatcher::RunThis(void* arg) {
     ((EventDispatcher*)arg)->Run();
     return NULL;
 }
 
+static butil::static_atomic<int> g_nbusy_poll_dispatcher = BUTIL_STATIC_ATOMIC_INIT(0);
+
+static void PinBusyPollingThread() {
+    const int index = g_nbusy_poll_dispatcher.fetch_add(1, butil::memory_order_relaxed);
+    if (FLAGS_event_dispatcher_busy_poll_first_cpu < 0) {
+        return;
+    }
+#if defined(OS_LINUX)
+    const int cpu = FLAGS_event_dispatcher_busy_poll_first_cpu + index;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc) {
+        LOG(ERROR) << "Fail to pin busy-polling dispatcher to cpu=" << cpu
+                   << ": " << berror(rc);
+    }
+#else
+    LOG_ONCE(WARNING) << "-event_dispatcher_busy_poll_first_cpu is not "
+        "supported on this platform";
+#endif
+}
+
 void EventDispatcher::Run() {
+    // Last time that a busy-polling dispatcher saw events.
+    int64_t last_active_us = 0;
+    if (_busy_poll) {
+        PinBusyPollingThread();
+        last_active_us = butil::cpuwide_time_us();
+    }
     while (!_stop) {
+        bool nonblocking = false;
+        if (_busy_poll) {
+            const int32_t idle_us = FLAGS_event_dispatcher_busy_poll_idle_us;
+            nonblocking = (idle_us <= 0 ||
+                           butil::cpuwide_time_us() - last_active_us < idle_us);
+        }
 #if defined(OS_LINUX)
         epoll_event e[32];
 #ifdef BRPC_ADDITIONAL_EPOLL
         // Performance downgrades in examples.
         int n = epoll_wait(_epfd, e, ARRAY_SIZE(e), 0);
-        if (n == 0) {
+        if (n == 0 && !nonblocking) {
             n = epoll_wait(_epfd, e, ARRAY_SIZE(e), -1);
         }
 #else
-        const int n = epoll_wait(_epfd, e, ARRAY_SIZE(e), -1);
+        const int n = epoll_wait(_epfd, e, ARRAY_SIZE(e), nonblocking ? 0 : -1);
 #endif
 #elif defined(OS_MACOSX)
         struct kevent e[32];
-        int n = kevent(_epfd, NULL, 0, e, ARRAY_SIZE(e), NULL);
+        const timespec zero_timeout = { 0, 0 };
+        int n = kevent(_epfd, NULL, 0, e, ARRAY_SIZE(e),
+                       nonblocking ? &zero_timeout : NULL);
 #endif
         if (_stop) {
             // epoll_ctl/epoll_wait should have some sort of memory fencing
@@ -307,8 +457,24 @@ void EventDispatcher::Run() {
 #endif
             break;
         }
+        if (n == 0) {
+            continue;
+        }
+        // Processing input inline delays remaining events of this round,
+        // which is only done by busy-polling dispatchers that are meant
+        // for latency rather than throughput.
+        size_t inline_max_bytes = 0;
+        if (_busy_poll) {
+            last_active_us = butil::cpuwide_time_us();
+            inline_max_bytes = FLAGS_event_dispatcher_inline_max_bytes;
+        }
         for (int i = 0; i < n; ++i) {
 #if defined(OS_LINUX)
+            if (e[i].data.u64 == IO_URING_EVENT_DATA) {
+                _io_uring.load(butil::memory_order_relaxed)
+                    ->HandleCompletions(_consumer_thread_attr);
+                continue;
+            }
             if (e[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)
 #ifdef BRPC_SOCKET_HAS_EOF
                 || (e[i].events & has_epollrdhup)
@@ -316,18 +482,23 @@ void EventDispatcher::Run() {
                 ) {
                 // We don't care about the return value.
                 Socket::StartInputEvent(e[i].data.u64, e[i].events,
-                                        _consumer_thread_attr);
+                                        _consumer_thread_attr,
+                                        inline_max_bytes);
             }
 #elif defined(OS_MACOSX)
             if ((e[i].flags & EV_ERROR) || e[i].filter == EVFILT_READ) {
                 // We don't care about the return value.
                 Socket::StartInputEvent((SocketId)e[i].udata, e[i].filter,
-                                        _consumer_thread_attr);
+                                        _consumer_thread_attr,
+                                        inline_max_bytes);
             }
 #endif
         }
         for (int i = 0; i < n; ++i) {
 #if defined(OS_LINUX)
+            if (e[i].data.u64 == IO_URING_EVENT_DATA) {
+                continue;
+            }
             if (e[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
                 // We don't care about the return value.
                 Socket::HandleEpollOut(e[i].data.u64);
@@ -372,4 +543,12 @@ EventDispatcher& GetGlobalEventDispatcher(int fd) {
     return g_edisp[index];
 }
 
+EventDispatcher& GetGlobalEventDispatcher(int fd, int dispatcher_index) {
+    if (dispatcher_index < 0) {
+        return GetGlobalEventDispatcher(fd);
+    }
+    pthread_once(&g_edisp_once, InitializeGlobalDispatchers);
+    return g_edisp[dispatcher_index % FLAGS_event_dispatcher_num];
+}
+
 } // namespace brpc
@@ -18,13 +18,17 @@
 #ifndef BRPC_EVENT_DISPATCHER_H
 #define BRPC_EVENT_DISPATCHER_H
 
+#include <pthread.h>
 #include "butil/macros.h"                     // DISALLOW_COPY_AND_ASSIGN
+#include "butil/atomicops.h"
 #include "bthread/types.h"                   // bthread_t, bthread_attr_t
 #include "brpc/socket.h"                     // Socket, SocketId
 
 
 namespace brpc {
 
+class IoUringEngine;
+
 // Dispatch edge-triggered events of file descriptors to consumers
 // running in separate bthreads.
 class EventDispatcher {
@@ -34,7 +38,8 @@ public:
     
     virtual ~EventDispatcher();
 
-    // Start this dispatcher in a bthread.
+    // Start this dispatcher in a bthread, or a dedicated pthread busy-polling
+    // events when -event_dispatcher_busy_poll is on.
     // Use |*consumer_thread_attr| (if it's not NULL) as the attribute to
     // create bthreads running user callbacks.
     // Returns 0 on success, -1 otherwise.
@@ -81,6 +86,19 @@ private:
     // Remove the file descriptor `fd' from epoll.
     int RemoveConsumer(int fd);
 
+    // Stop or restart watching input events of `fd' added by AddConsumer().
+    // Errors and hangups are still reported during the pause while EPOLLOUT
+    // added by AddEpollOut() is not, writers waiting for it retry after
+    // timeout. Restarting doesn't report the data arrived during the pause
+    // on all platforms.
+    // Returns 0 on success, -1 otherwise and errno is set
+    int PauseInput(SocketId socket_id, int fd);
+    int ResumeInput(SocketId socket_id, int fd);
+
+    // Get io_uring of this dispatcher, which is created and watched at the
+    // first call. Returns NULL if io_uring is not available.
+    IoUringEngine* GetIoUringEngine();
+
     // The epoll to watch events.
     int _epfd;
 
@@ -90,15 +108,28 @@ private:
     // identifier of hosting bthread
     bthread_t _tid;
 
+    // Set when -event_dispatcher_busy_poll is on. The dispatcher runs in
+    // `_busy_poll_thread' instead of `_tid' and polls epoll without blocking.
+    bool _busy_poll;
+    pthread_t _busy_poll_thread;
+
     // The attribute of bthreads calling user callbacks.
     bthread_attr_t _consumer_thread_attr;
 
     // Pipe fds to wakeup EventDispatcher from `epoll_wait' in order to quit
     int _wakeup_fds[2];
+
+    pthread_mutex_t _io_uring_mutex;
+    bool _io_uring_created;
+    butil::atomic<IoUringEngine*> _io_uring;
 };
 
 EventDispatcher& GetGlobalEventDispatcher(int fd);
 
+// Get the `dispatcher_index'-th global dispatcher(modulo -event_dispatcher_num)
+// if it's non-negative, otherwise same as GetGlobalEventDispatcher(fd).
+EventDispatcher& GetGlobalEventDispatcher(int fd, int dispatcher_index);
+
 } // namespace brpc
 
 
@@ -30,25 +30,38 @@
 #include "brpc/policy/domain_naming_service.h"
 #include "brpc/policy/remote_file_naming_service.h"
 #include "brpc/policy/consul_naming_service.h"
+#include "brpc/policy/etcd_naming_service.h"
 
 // Load Balancers
 #include "brpc/policy/round_robin_load_balancer.h"
 #include "brpc/policy/weighted_round_robin_load_balancer.h"
 #include "brpc/policy/randomized_load_balancer.h"
+#include "brpc/policy/weighted_randomized_load_balancer.h"
+#include "brpc/policy/p2c_ewma_load_balancer.h"
+#include "brpc/policy/maglev_load_balancer.h"
+#include "brpc/policy/jump_hash_load_balancer.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+#include "brpc/policy/aperture_load_balancer.h"
 #include "brpc/policy/locality_aware_load_balancer.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
 #include "brpc/policy/hasher.h"
 #include "brpc/policy/dynpart_load_balancer.h"
 
+// Concurrency Limiters
+#include "brpc/policy/auto_concurrency_limiter.h"
+
 // Compress handlers
 #include "brpc/compress.h"
 #include "brpc/policy/gzip_compress.h"
 #include "brpc/policy/snappy_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
 
 // Protocols
 #include "brpc/protocol.h"
 #include "brpc/policy/baidu_rpc_protocol.h"
 #include "brpc/policy/http_rpc_protocol.h"
+#include "brpc/policy/http2_rpc_protocol.h"
 #include "brpc/policy/hulu_pbrpc_protocol.h"
 #include "brpc/policy/nova_pbrpc_protocol.h"
 #include "brpc/policy/public_pbrpc_protocol.h"
@@ -67,11 +80,16 @@
 #include "brpc/socket_map.h"          // SocketMapList
 #include "brpc/server.h"
 #include "brpc/trackme.h"             // TrackMe
+#include "brpc/bvar_push.h"           // PushBvars
 #include "brpc/details/usercode_backup_pool.h"
+#include "brpc/details/dns_resolver.h"
+#include "brpc/details/iobuf_block_tag.h"
 #if defined(OS_LINUX)
 #include <malloc.h>                   // malloc_trim
 #endif
 #include "butil/fd_guard.h"
+#include "butil/hugepage_block_allocator.h"
+#include "butil/numa.h"
 #include "butil/files/file_watcher.h"
 
 extern "C" {
@@ -89,9 +107,43 @@ DEFINE_int32(free_memory_to_system_interval, 0,
              "values <= 0 disables this feature");
 BRPC_VALIDATE_GFLAG(free_memory_to_system_interval, PassValidate);
 
+DEFINE_bool(iobuf_use_hugepage, false,
+            "Allocate blocks of IOBuf from regions backed by huge pages. "
+            "Only effective when set before the first RPC-related object "
+            "is created, e.g. by environment variables of gflags");
+DEFINE_bool(iobuf_hugepage_use_1gb, false,
+            "Map regions with 1GB huge pages instead of 2MB ones");
+DEFINE_int32(iobuf_hugepage_max_memory_mb, 4096,
+             "Max megabytes of huge-page regions for IOBuf blocks, "
+             "allocations beyond that go to malloc");
+
+static bool SetIOBufMaxBlocksPerThread(const char*, int32_t v) {
+    if (v < 0) {
+        return false;
+    }
+    butil::IOBuf::set_max_blocks_per_thread(v);
+    return true;
+}
+DEFINE_int32(iobuf_max_blocks_per_thread, 8,
+             "Max number of IOBuf blocks cached in each thread");
+BRPC_VALIDATE_GFLAG(iobuf_max_blocks_per_thread, SetIOBufMaxBlocksPerThread);
+
+DEFINE_int32(iobuf_tls_block_trim_interval, 30,
+             "Free IOBuf blocks cached in threads but not used in the last so "
+             "many seconds, values <= 0 disables this feature");
+BRPC_VALIDATE_GFLAG(iobuf_tls_block_trim_interval, PassValidate);
+
+DEFINE_int32(socket_reclaim_interval, 0,
+             "Check idle Socket blocks every so many seconds and return their "
+             "memory to the system in the next check, values <= 0 disables "
+             "this feature");
+BRPC_VALIDATE_GFLAG(socket_reclaim_interval, PassValidate);
+
 namespace policy {
 // Defined in http_rpc_protocol.cpp
 void InitCommonStrings();
+// Defined in consistent_hashing_load_balancer.cpp
+DECLARE_int32(chash_num_replicas);
 }
 
 using namespace policy;
@@ -102,7 +154,17 @@ const char* const DUMMY_SERVER_PORT_FILE = "dummy_server.port";
 struct GlobalExtensions {
     GlobalExtensions()
         : ch_mh_lb(MurmurHash32)
-        , ch_md5_lb(MD5Hash32){}
+        , ch_md5_lb(MD5Hash32)
+        , ch_mh_bounded_lb(MurmurHash32, FLAGS_chash_num_replicas, true)
+        , ch_md5_bounded_lb(MD5Hash32, FLAGS_chash_num_replicas, true)
+        , ch_wy_lb(WyHash32)
+        , ch_wy_bounded_lb(WyHash32, FLAGS_chash_num_replicas, true)
+        , zone_rr_lb(&rr_lb)
+        , zone_la_lb(&la_lb)
+        , zone_p2c_ewma_lb(&p2c_ewma_lb)
+        , aperture_rr_lb(&rr_lb)
+        , aperture_la_lb(&la_lb)
+        , aperture_p2c_ewma_lb(&p2c_ewma_lb) {}
 #ifdef BAIDU_INTERNAL
     BaiduNamingService bns;
 #endif
@@ -111,14 +173,32 @@ struct GlobalExtensions {
     DomainNamingService dns;
     RemoteFileNamingService rfns;
     ConsulNamingService cns;
+    EtcdNamingService etcdns;
 
     RoundRobinLoadBalancer rr_lb;
     WeightedRoundRobinLoadBalancer wrr_lb;
     RandomizedLoadBalancer randomized_lb;
+    WeightedRandomizedLoadBalancer wr_lb;
     LocalityAwareLoadBalancer la_lb;
+    P2CEwmaLoadBalancer p2c_ewma_lb;
     ConsistentHashingLoadBalancer ch_mh_lb;
     ConsistentHashingLoadBalancer ch_md5_lb;
+    ConsistentHashingLoadBalancer ch_mh_bounded_lb;
+    ConsistentHashingLoadBalancer ch_md5_bounded_lb;
+    ConsistentHashingLoadBalancer ch_wy_lb;
+    ConsistentHashingLoadBalancer ch_wy_bounded_lb;
+    MaglevLoadBalancer maglev_lb;
+    JumpHashLoadBalancer jump_hash_lb;
     DynPartLoadBalancer dynpart_lb;
+    // Must be declared after inner load balancers.
+    ZoneAwareLoadBalancer zone_rr_lb;
+    ZoneAwareLoadBalancer zone_la_lb;
+    ZoneAwareLoadBalancer zone_p2c_ewma_lb;
+    ApertureLoadBalancer aperture_rr_lb;
+    ApertureLoadBalancer aperture_la_lb;
+    ApertureLoadBalancer aperture_p2c_ewma_lb;
+
+    AutoConcurrencyLimiter auto_cl;
 };
 
 static pthread_once_t register_extensions_once = PTHREAD_ONCE_INIT;
@@ -163,6 +243,83 @@ static int64_t GetIOBufNewBigViewCount(void*) {
 static int64_t GetIOBufBlockMemory(void*) {
     return butil::IOBuf::block_memory();
 }
+static int64_t GetIOBufBlockMemoryOfTag(void* arg) {
+    return butil::IOBuf::block_memory((int)(intptr_t)arg);
+}
+static int64_t GetIOBufTLSBlockCount(void*) {
+    butil::IOBuf::TLSBlockCacheStats stats;
+    butil::IOBuf::get_tls_block_cache_stats(&stats);
+    return stats.cached_block_count;
+}
+static int64_t GetIOBufTLSBlockMaxCountPerThread(void*) {
+    butil::IOBuf::TLSBlockCacheStats stats;
+    butil::IOBuf::get_tls_block_cache_stats(&stats);
+    return stats.max_cached_block_count;
+}
+static int64_t GetIOBufTLSBlockHitCount(void*) {
+    butil::IOBuf::TLSBlockCacheStats stats;
+    butil::IOBuf::get_tls_block_cache_stats(&stats);
+    return stats.hit_count;
+}
+static int64_t GetIOBufTLSBlockMissCount(void*) {
+    butil::IOBuf::TLSBlockCacheStats stats;
+    butil::IOBuf::get_tls_block_cache_stats(&stats);
+    return stats.miss_count;
+}
+static int64_t GetIOBufTLSBlockReleaseCount(void*) {
+    butil::IOBuf::TLSBlockCacheStats stats;
+    butil::IOBuf::get_tls_block_cache_stats(&stats);
+    return stats.release_count;
+}
+static int64_t GetIOBufTLSBlockTrimmedCount(void*) {
+    butil::IOBuf::TLSBlockCacheStats stats;
+    butil::IOBuf::get_tls_block_cache_stats(&stats);
+    return stats.trimmed_count;
+}
+static int64_t GetIOBufHugePageRegionMemory(void*) {
+    butil::iobuf::HugePageAllocatorStats stats;
+    butil::iobuf::get_hugepage_allocator_stats(&stats);
+    return stats.region_memory;
+}
+static int64_t GetIOBufHugePageCarvedMemory(void*) {
+    butil::iobuf::HugePageAllocatorStats stats;
+    butil::iobuf::get_hugepage_allocator_stats(&stats);
+    return stats.carved_memory;
+}
+static int64_t GetIOBufHugePageFallbackCount(void*) {
+    butil::iobuf::HugePageAllocatorStats stats;
+    butil::iobuf::get_hugepage_allocator_stats(&stats);
+    return stats.fallback_count;
+}
+
+// Memory placement of Sockets on NUMA machines.
+static void PrintSocketNUMABlocks(std::ostream& os, void*) {
+    const butil::ResourcePoolInfo info = butil::describe_resources<Socket>();
+    for (size_t i = 0; i < info.numa_node_num; ++i) {
+        os << (i ? " " : "") << info.numa_block_num[i];
+    }
+}
+static int64_t GetSocketRemoteFreeChunkCount(void*) {
+    return butil::describe_resources<Socket>().remote_free_chunk_num;
+}
+static int64_t GetSocketReclaimableMemory(void*) {
+    const butil::ResourcePoolInfo info = butil::describe_resources<Socket>();
+    return info.idle_block_num * info.block_item_num * sizeof(Socket);
+}
+static int64_t GetSocketReclaimedMemory(void*) {
+    const butil::ResourcePoolInfo info = butil::describe_resources<Socket>();
+    return info.reclaimed_block_num * info.block_item_num * sizeof(Socket);
+}
+
+// Resolver of butil::hostname2ip()
+static int ResolveFirstIp(const char* hostname, butil::ip_t* ip) {
+    std::vector<butil::ip_t> ips;
+    if (ResolveHostname(hostname, &ips) != 0 || ips.empty()) {
+        return -1;
+    }
+    *ip = ips[0];
+    return 0;
+}
 
 // Defined in server.cpp
 extern butil::static_atomic<int> g_running_server_count;
@@ -184,6 +341,61 @@ static void* GlobalUpdate(void*) {
         "iobuf_newbigview_second", &var_iobuf_new_bigview_count);
     bvar::PassiveStatus<int64_t> var_iobuf_block_memory(
         "iobuf_block_memory", GetIOBufBlockMemory, NULL);
+    bvar::PassiveStatus<int64_t> var_iobuf_block_memory_other(
+        "iobuf_block_memory_other", GetIOBufBlockMemoryOfTag,
+        (void*)(intptr_t)IOBUF_BLOCK_TAG_OTHER);
+    bvar::PassiveStatus<int64_t> var_iobuf_block_memory_read_buffer(
+        "iobuf_block_memory_read_buffer", GetIOBufBlockMemoryOfTag,
+        (void*)(intptr_t)IOBUF_BLOCK_TAG_READ_BUFFER);
+    bvar::PassiveStatus<int64_t> var_iobuf_block_memory_message(
+        "iobuf_block_memory_message", GetIOBufBlockMemoryOfTag,
+        (void*)(intptr_t)IOBUF_BLOCK_TAG_MESSAGE);
+    bvar::PassiveStatus<int64_t> var_iobuf_block_memory_rpc_dump(
+        "iobuf_block_memory_rpc_dump", GetIOBufBlockMemoryOfTag,
+        (void*)(intptr_t)IOBUF_BLOCK_TAG_RPC_DUMP);
+    bvar::PassiveStatus<int64_t> var_iobuf_tls_block_count(
+        "iobuf_tls_block_count", GetIOBufTLSBlockCount, NULL);
+    bvar::PassiveStatus<int64_t> var_iobuf_tls_block_max_count_per_thread(
+        "iobuf_tls_block_max_count_per_thread",
+        GetIOBufTLSBlockMaxCountPerThread, NULL);
+    bvar::PassiveStatus<int64_t> var_iobuf_tls_block_hit_count(
+        GetIOBufTLSBlockHitCount, NULL);
+    bvar::PerSecond<bvar::PassiveStatus<int64_t> > var_iobuf_tls_block_hit_second(
+        "iobuf_tls_block_hit_second", &var_iobuf_tls_block_hit_count);
+    bvar::PassiveStatus<int64_t> var_iobuf_tls_block_miss_count(
+        GetIOBufTLSBlockMissCount, NULL);
+    bvar::PerSecond<bvar::PassiveStatus<int64_t> > var_iobuf_tls_block_miss_second(
+        "iobuf_tls_block_miss_second", &var_iobuf_tls_block_miss_count);
+    bvar::PassiveStatus<int64_t> var_iobuf_tls_block_release_count(
+        GetIOBufTLSBlockReleaseCount, NULL);
+    bvar::PerSecond<bvar::PassiveStatus<int64_t> > var_iobuf_tls_block_release_second(
+        "iobuf_tls_block_release_second", &var_iobuf_tls_block_release_count);
+    bvar::PassiveStatus<int64_t> var_iobuf_tls_block_trimmed_count(
+        "iobuf_tls_block_trimmed_count", GetIOBufTLSBlockTrimmedCount, NULL);
+    bvar::PassiveStatus<int64_t> var_iobuf_hugepage_region_memory(
+        GetIOBufHugePageRegionMemory, NULL);
+    bvar::PassiveStatus<int64_t> var_iobuf_hugepage_carved_memory(
+        GetIOBufHugePageCarvedMemory, NULL);
+    bvar::PassiveStatus<int64_t> var_iobuf_hugepage_fallback_count(
+        GetIOBufHugePageFallbackCount, NULL);
+    if (butil::iobuf::is_hugepage_block_allocator_enabled()) {
+        var_iobuf_hugepage_region_memory.expose("iobuf_hugepage_region_memory");
+        var_iobuf_hugepage_carved_memory.expose("iobuf_hugepage_carved_memory");
+        var_iobuf_hugepage_fallback_count.expose("iobuf_hugepage_fallback_count");
+    }
+    bvar::PassiveStatus<std::string> var_socket_numa_blocks(
+        PrintSocketNUMABlocks, NULL);
+    bvar::PassiveStatus<int64_t> var_socket_remote_free_chunk_count(
+        GetSocketRemoteFreeChunkCount, NULL);
+    if (butil::numa_node_num() > 1) {
+        var_socket_numa_blocks.expose("rpc_socket_numa_block_num");
+        var_socket_remote_free_chunk_count.expose(
+            "rpc_socket_remote_free_chunk_count");
+    }
+    bvar::PassiveStatus<int64_t> var_socket_reclaimable_memory(
+        "rpc_socket_reclaimable_memory", GetSocketReclaimableMemory, NULL);
+    bvar::PassiveStatus<int64_t> var_socket_reclaimed_memory(
+        "rpc_socket_reclaimed_memory", GetSocketReclaimedMemory, NULL);
     bvar::PassiveStatus<int> var_running_server_count(
         "rpc_server_count", GetRunningServerCount, NULL);
 
@@ -199,6 +411,8 @@ static void* GlobalUpdate(void*) {
     int64_t last_time_us = start_time_us;
     int consecutive_nosleep = 0;
     int64_t last_return_free_memory_time = start_time_us;
+    int64_t last_trim_tls_block_time = start_time_us;
+    int64_t last_reclaim_socket_time = start_time_us;
     while (1) {
         const int64_t sleep_us = 1000000L + last_time_us - butil::gettimeofday_us();
         if (sleep_us > 0) {
@@ -216,6 +430,7 @@ static void* GlobalUpdate(void*) {
         last_time_us = butil::gettimeofday_us();
 
         TrackMe();
+        PushBvars();
 
         if (!IsDummyServerRunning()
             && g_running_server_count.load(butil::memory_order_relaxed) == 0
@@ -235,6 +450,24 @@ static void* GlobalUpdate(void*) {
             }
         }
 
+        const int trim_interval =
+            FLAGS_iobuf_tls_block_trim_interval/*reloadable*/;
+        if (trim_interval > 0 &&
+            last_time_us >= last_trim_tls_block_time +
+            trim_interval * 1000000L) {
+            last_trim_tls_block_time = last_time_us;
+            butil::IOBuf::trim_tls_block_caches();
+        }
+
+        const int reclaim_interval =
+            FLAGS_socket_reclaim_interval/*reloadable*/;
+        if (reclaim_interval > 0 &&
+            last_time_us >= last_reclaim_socket_time +
+            reclaim_interval * 1000000L) {
+            last_reclaim_socket_time = last_time_us;
+            butil::shrink_resources<Socket>(reclaim_interval * 500000L);
+        }
+
         const int return_mem_interval =
             FLAGS_free_memory_to_system_interval/*reloadable*/;
         if (return_mem_interval > 0 &&
@@ -308,9 +541,28 @@ static void GlobalInitializeOrDieImpl() {
         exit(1);
     }
 
+    // Replace the block allocator of IOBuf before blocks are massively
+    // allocated. The gflags are probably default here unless they're set
+    // by environment variables or the program calls this function after
+    // parsing flags.
+    if (FLAGS_iobuf_use_hugepage) {
+        butil::iobuf::HugePageAllocatorOptions opt;
+        opt.use_1gb_pages = FLAGS_iobuf_hugepage_use_1gb;
+        if (FLAGS_iobuf_hugepage_max_memory_mb > 0) {
+            opt.max_memory = (size_t)FLAGS_iobuf_hugepage_max_memory_mb << 20;
+        }
+        if (butil::iobuf::enable_hugepage_block_allocator(&opt) != 0) {
+            LOG(WARNING) << "Fail to enable huge-page allocator of IOBuf";
+        }
+    }
+
     // Defined in http_rpc_protocol.cpp
     InitCommonStrings();
 
+    // Resolve hostnames in channels and naming services without blocking
+    // worker pthreads.
+    butil::set_hostname_resolver(ResolveFirstIp);
+
     // Leave memory of these extensions to process's clean up.
     g_ext = new(std::nothrow) GlobalExtensions();
     if (NULL == g_ext) {
@@ -325,15 +577,40 @@ static void GlobalInitializeOrDieImpl() {
     NamingServiceExtension()->RegisterOrDie("http", &g_ext->dns);
     NamingServiceExtension()->RegisterOrDie("remotefile", &g_ext->rfns);
     NamingServiceExtension()->RegisterOrDie("consul", &g_ext->cns);
+    NamingServiceExtension()->RegisterOrDie("etcd", &g_ext->etcdns);
 
     // Load Balancers
     LoadBalancerExtension()->RegisterOrDie("rr", &g_ext->rr_lb);
     LoadBalancerExtension()->RegisterOrDie("wrr", &g_ext->wrr_lb);
     LoadBalancerExtension()->RegisterOrDie("random", &g_ext->randomized_lb);
+    LoadBalancerExtension()->RegisterOrDie("wr", &g_ext->wr_lb);
     LoadBalancerExtension()->RegisterOrDie("la", &g_ext->la_lb);
+    LoadBalancerExtension()->RegisterOrDie("p2c_ewma", &g_ext->p2c_ewma_lb);
     LoadBalancerExtension()->RegisterOrDie("c_murmurhash", &g_ext->ch_mh_lb);
     LoadBalancerExtension()->RegisterOrDie("c_md5", &g_ext->ch_md5_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_murmurhash_bounded",
+                                           &g_ext->ch_mh_bounded_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_md5_bounded",
+                                           &g_ext->ch_md5_bounded_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_wyhash", &g_ext->ch_wy_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_wyhash_bounded",
+                                           &g_ext->ch_wy_bounded_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_maglev", &g_ext->maglev_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_jump", &g_ext->jump_hash_lb);
     LoadBalancerExtension()->RegisterOrDie("_dynpart", &g_ext->dynpart_lb);
+    LoadBalancerExtension()->RegisterOrDie("zone_rr", &g_ext->zone_rr_lb);
+    LoadBalancerExtension()->RegisterOrDie("zone_la", &g_ext->zone_la_lb);
+    LoadBalancerExtension()->RegisterOrDie("zone_p2c_ewma",
+                                           &g_ext->zone_p2c_ewma_lb);
+    LoadBalancerExtension()->RegisterOrDie("aperture_rr",
+                                           &g_ext->aperture_rr_lb);
+    LoadBalancerExtension()->RegisterOrDie("aperture_la",
+                                           &g_ext->aperture_la_lb);
+    LoadBalancerExtension()->RegisterOrDie("aperture_p2c_ewma",
+                                           &g_ext->aperture_p2c_ewma_lb);
+
+    // Concurrency Limiters
+    ConcurrencyLimiterExtension()->RegisterOrDie("auto", &g_ext->auto_cl);
 
     // Compress Handlers
     const CompressHandler gzip_compress =
@@ -351,6 +628,20 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterCompressHandler(COMPRESS_TYPE_SNAPPY, snappy_compress) != 0) {
         exit(1);
     }
+#ifdef BRPC_WITH_LZ4
+    const CompressHandler lz4_compress =
+        { Lz4Compress, Lz4Decompress, "lz4" };
+    if (RegisterCompressHandler(COMPRESS_TYPE_LZ4, lz4_compress) != 0) {
+        exit(1);
+    }
+#endif
+#ifdef BRPC_WITH_ZSTD
+    const CompressHandler zstd_compress =
+        { ZstdCompress, ZstdDecompress, "zstd" };
+    if (RegisterCompressHandler(COMPRESS_TYPE_ZSTD, zstd_compress) != 0) {
+        exit(1);
+    }
+#endif
 
     // Protocols
     Protocol baidu_protocol = { ParseRpcMessage,
@@ -377,12 +668,36 @@ static void GlobalInitializeOrDieImpl() {
                                ProcessHttpRequest, ProcessHttpResponse,
                                VerifyHttpRequest, ParseHttpServerAddress,
                                GetHttpMethodName,
-                               CONNECTION_TYPE_POOLED_AND_SHORT,
+                               CONNECTION_TYPE_ALL,
                                "http" };
     if (RegisterProtocol(PROTOCOL_HTTP, http_protocol) != 0) {
         exit(1);
     }
 
+    Protocol h2_protocol = { ParseH2Message,
+                             SerializeHttpRequest, PackH2Request,
+                             ProcessHttpRequest, ProcessHttpResponse,
+                             VerifyHttpRequest, ParseHttpServerAddress,
+                             GetHttpMethodName,
+                             CONNECTION_TYPE_SINGLE,
+                             "h2" };
+    if (RegisterProtocol(PROTOCOL_H2, h2_protocol) != 0) {
+        exit(1);
+    }
+
+    // Server-side grpc requests are recognized by content-type in the h2
+    // protocol.
+    Protocol grpc_protocol = { ParseH2Message,
+                               SerializeGrpcRequest, PackH2Request,
+                               NULL, ProcessHttpResponse,
+                               NULL, ParseHttpServerAddress,
+                               GetHttpMethodName,
+                               CONNECTION_TYPE_SINGLE,
+                               "grpc" };
+    if (RegisterProtocol(PROTOCOL_GRPC, grpc_protocol) != 0) {
+        exit(1);
+    }
+
     Protocol hulu_protocol = { ParseHuluMessage,
                                SerializeRequestDefault, PackHuluRequest,
                                ProcessHuluRequest, ProcessHuluResponse,
@@ -450,7 +765,7 @@ static void GlobalInitializeOrDieImpl() {
     Protocol redis_protocol = { ParseRedisMessage,
                                 SerializeRedisRequest,
                                 PackRedisRequest,
-                                NULL, ProcessRedisResponse,
+                                ProcessRedisRequest, ProcessRedisResponse,
                                 NULL, NULL, GetRedisMethodName,
                                 CONNECTION_TYPE_ALL, "redis" };
     if (RegisterProtocol(PROTOCOL_REDIS, redis_protocol) != 0) {
@@ -0,0 +1,158 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ctype.h>
+#include "brpc/errno.pb.h"
+#include "brpc/grpc.h"
+
+namespace brpc {
+
+GrpcStatus ErrorCodeToGrpcStatus(int error_code) {
+    switch (error_code) {
+    case 0:
+        return GRPC_OK;
+    case ENOSERVICE:
+    case ENOMETHOD:
+        return GRPC_UNIMPLEMENTED;
+    case ERPCAUTH:
+        return GRPC_UNAUTHENTICATED;
+    case EREQUEST:
+    case EINVAL:
+        return GRPC_INVALIDARGUMENT;
+    case ELIMIT:
+    case EOVERCROWDED:
+        return GRPC_RESOURCEEXHAUSTED;
+    case ELOGOFF:
+        return GRPC_UNAVAILABLE;
+    case EPERM:
+        return GRPC_PERMISSIONDENIED;
+    case ERPCTIMEDOUT:
+    case ETIMEDOUT:
+        return GRPC_DEADLINEEXCEEDED;
+    case ECANCELED:
+        return GRPC_CANCELED;
+    default:
+        return GRPC_INTERNAL;
+    }
+}
+
+int GrpcStatusToErrorCode(GrpcStatus status) {
+    switch (status) {
+    case GRPC_OK:
+        return 0;
+    case GRPC_CANCELED:
+        return ECANCELED;
+    case GRPC_INVALIDARGUMENT:
+    case GRPC_NOTFOUND:
+    case GRPC_ALREADYEXISTS:
+    case GRPC_FAILEDPRECONDITION:
+    case GRPC_OUTOFRANGE:
+        return EREQUEST;
+    case GRPC_DEADLINEEXCEEDED:
+        return ERPCTIMEDOUT;
+    case GRPC_PERMISSIONDENIED:
+        return EPERM;
+    case GRPC_RESOURCEEXHAUSTED:
+        return ELIMIT;
+    case GRPC_UNIMPLEMENTED:
+        return ENOMETHOD;
+    case GRPC_UNAVAILABLE:
+        return ELOGOFF;
+    case GRPC_UNAUTHENTICATED:
+        return ERPCAUTH;
+    default:
+        return EINTERNAL;
+    }
+}
+
+int64_t ConvertGrpcTimeoutToUS(const std::string* grpc_timeout) {
+    // TimeoutValue is a positive integer of at most 8 digits followed by
+    // one of the units "HMSmun".
+    if (grpc_timeout == NULL || grpc_timeout->size() < 2 ||
+        grpc_timeout->size() > 9) {
+        return -1;
+    }
+    int64_t value = 0;
+    for (size_t i = 0; i + 1 < grpc_timeout->size(); ++i) {
+        const char c = (*grpc_timeout)[i];
+        if (c < '0' || c > '9') {
+            return -1;
+        }
+        value = value * 10 + (c - '0');
+    }
+    switch (grpc_timeout->back()) {
+    case 'H':
+        return value * 3600 * 1000000L;
+    case 'M':
+        return value * 60 * 1000000L;
+    case 'S':
+        return value * 1000000L;
+    case 'm':
+        return value * 1000L;
+    case 'u':
+        return value;
+    case 'n':
+        // Round up so that tiny timeouts don't become zero.
+        return (value + 999) / 1000;
+    default:
+        return -1;
+    }
+}
+
+void PercentEncode(const std::string& str, std::string* str_out) {
+    static const char* const HEX = "0123456789ABCDEF";
+    str_out->clear();
+    str_out->reserve(str.size());
+    for (size_t i = 0; i < str.size(); ++i) {
+        const unsigned char c = str[i];
+        if (c >= 0x20 && c <= 0x7E && c != '%') {
+            str_out->push_back(c);
+        } else {
+            str_out->push_back('%');
+            str_out->push_back(HEX[c >> 4]);
+            str_out->push_back(HEX[c & 0xF]);
+        }
+    }
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+void PercentDecode(const std::string& str, std::string* str_out) {
+    str_out->clear();
+    str_out->reserve(str.size());
+    for (size_t i = 0; i < str.size(); ++i) {
+        if (str[i] == '%' && i + 2 < str.size()) {
+            const int hi = HexValue(str[i + 1]);
+            const int lo = HexValue(str[i + 2]);
+            if (hi >= 0 && lo >= 0) {
+                str_out->push_back((char)((hi << 4) | lo));
+                i += 2;
+                continue;
+            }
+        }
+        // Invalid encodings are kept as is.
+        str_out->push_back(str[i]);
+    }
+}
+
+} // namespace brpc
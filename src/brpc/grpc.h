@@ -0,0 +1,65 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_GRPC_H
+#define BRPC_GRPC_H
+
+#include <stdint.h>
+#include <string>
+
+namespace brpc {
+
+// Status codes of gRPC, carried by the "grpc-status" trailer, see
+// https://github.com/grpc/grpc/blob/master/doc/statuscodes.md
+enum GrpcStatus {
+    GRPC_OK = 0,
+    GRPC_CANCELED = 1,
+    GRPC_UNKNOWN = 2,
+    GRPC_INVALIDARGUMENT = 3,
+    GRPC_DEADLINEEXCEEDED = 4,
+    GRPC_NOTFOUND = 5,
+    GRPC_ALREADYEXISTS = 6,
+    GRPC_PERMISSIONDENIED = 7,
+    GRPC_RESOURCEEXHAUSTED = 8,
+    GRPC_FAILEDPRECONDITION = 9,
+    GRPC_ABORTED = 10,
+    GRPC_OUTOFRANGE = 11,
+    GRPC_UNIMPLEMENTED = 12,
+    GRPC_INTERNAL = 13,
+    GRPC_UNAVAILABLE = 14,
+    GRPC_DATALOSS = 15,
+    GRPC_UNAUTHENTICATED = 16,
+    GRPC_MAX,
+};
+
+// Map ErrorCode() of a failed Controller to the status sent to gRPC clients.
+GrpcStatus ErrorCodeToGrpcStatus(int error_code);
+
+// Map the status returned by a gRPC server to ErrorCode() of Controller.
+// Statuses that are worth retrying are mapped to retryable error codes.
+int GrpcStatusToErrorCode(GrpcStatus status);
+
+// Convert value of the "grpc-timeout" header(e.g. "100m" for 100
+// milliseconds) to microseconds. Returns -1 if `grpc_timeout' is NULL or
+// invalid.
+int64_t ConvertGrpcTimeoutToUS(const std::string* grpc_timeout);
+
+// "grpc-message" is percent-encoded: bytes outside printable ASCII and '%'
+// are encoded as "%XX".
+void PercentEncode(const std::string& str, std::string* str_out);
+void PercentDecode(const std::string& str, std::string* str_out);
+
+} // namespace brpc
+
+#endif  // BRPC_GRPC_H
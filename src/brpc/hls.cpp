@@ -0,0 +1,172 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "brpc/controller.h"
+#include "brpc/errno.pb.h"                       // ENOMETHOD
+#include "brpc/hls.h"
+
+
+namespace brpc {
+
+HlsSegmenterOptions::HlsSegmenterOptions()
+    : target_duration_ms(5000)
+    , max_segments(5) {
+}
+
+HlsSegmenter::HlsSegmenter(const HlsSegmenterOptions& options)
+    : _options(options)
+    , _writer(&_current)
+    , _has_video(false)
+    , _started(false)
+    , _start_ts(0)
+    , _last_ts(0)
+    , _next_seq(0) {
+}
+
+HlsSegmenter::~HlsSegmenter() {
+}
+
+void HlsSegmenter::UpdateTimestamp(uint32_t timestamp) {
+    if (!_started) {
+        _started = true;
+        _start_ts = timestamp;
+    }
+    _last_ts = timestamp;
+}
+
+void HlsSegmenter::CloseSegment(uint32_t timestamp) {
+    if (!_current.empty()) {
+        _segments.push_back(Segment());
+        Segment& seg = _segments.back();
+        seg.seq = _next_seq++;
+        seg.duration_ms = timestamp - _start_ts;
+        seg.data.swap(_current);
+        while ((int)_segments.size() > std::max(_options.max_segments, 1)) {
+            _segments.pop_front();
+        }
+        // Every segment starts with PAT/PMT to be decoded independently.
+        _writer.add_pat_pmt_on_next_write();
+    }
+    _start_ts = timestamp;
+}
+
+butil::Status HlsSegmenter::Write(const RtmpVideoMessage& msg) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    // Segments of video streams must start with keyframes.
+    if (_started && msg.frame_type == FLV_VIDEO_FRAME_KEYFRAME &&
+        !msg.IsAVCSequenceHeader() &&
+        msg.timestamp - _start_ts >= (uint32_t)_options.target_duration_ms) {
+        CloseSegment(msg.timestamp);
+    }
+    UpdateTimestamp(msg.timestamp);
+    butil::Status st = _writer.Write(msg);
+    if (st.ok()) {
+        _has_video = true;
+    }
+    return st;
+}
+
+butil::Status HlsSegmenter::Write(const RtmpAudioMessage& msg) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_started && !_has_video &&
+        msg.timestamp - _start_ts >= (uint32_t)_options.target_duration_ms) {
+        CloseSegment(msg.timestamp);
+    }
+    UpdateTimestamp(msg.timestamp);
+    return _writer.Write(msg);
+}
+
+void HlsSegmenter::Flush() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_started) {
+        CloseSegment(_last_ts);
+    }
+}
+
+int64_t HlsSegmenter::first_sequence() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _segments.empty() ? _next_seq : _segments.front().seq;
+}
+
+void HlsSegmenter::GetPlaylist(std::string* playlist) const {
+    playlist->clear();
+    BAIDU_SCOPED_LOCK(_mutex);
+    // EXT-X-TARGETDURATION must not be less than any EXTINF rounded to
+    // the nearest integer.
+    uint32_t max_duration_ms = _options.target_duration_ms;
+    for (size_t i = 0; i < _segments.size(); ++i) {
+        max_duration_ms = std::max(max_duration_ms, _segments[i].duration_ms);
+    }
+    butil::string_appendf(
+        playlist,
+        "#EXTM3U\n"
+        "#EXT-X-VERSION:3\n"
+        "#EXT-X-TARGETDURATION:%u\n"
+        "#EXT-X-MEDIA-SEQUENCE:%" PRId64 "\n",
+        (max_duration_ms + 999) / 1000,
+        _segments.empty() ? _next_seq : _segments.front().seq);
+    for (size_t i = 0; i < _segments.size(); ++i) {
+        butil::string_appendf(playlist, "#EXTINF:%.3f,\n%s%" PRId64 ".ts\n",
+                              _segments[i].duration_ms / 1000.0,
+                              _options.segment_uri_prefix.c_str(),
+                              _segments[i].seq);
+    }
+}
+
+bool HlsSegmenter::GetSegment(int64_t seq, butil::IOBuf* out) const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_segments.empty() || seq < _segments.front().seq ||
+        seq > _segments.back().seq) {
+        return false;
+    }
+    // Sequence numbers of segments are consecutive.
+    out->append(_segments[seq - _segments.front().seq].data);
+    return true;
+}
+
+static bool EndsWith(const std::string& str, const char* suffix, size_t len) {
+    return str.size() >= len &&
+        str.compare(str.size() - len, len, suffix) == 0;
+}
+
+void HlsSegmenter::ServeHttp(Controller* cntl, const std::string& name) const {
+    if (EndsWith(name, ".m3u8", 5)) {
+        std::string playlist;
+        GetPlaylist(&playlist);
+        cntl->http_response().set_content_type("application/vnd.apple.mpegurl");
+        // The playlist changes after every segment.
+        cntl->http_response().SetHeader("Cache-Control", "no-cache");
+        cntl->response_attachment().append(playlist);
+        return;
+    }
+    if (EndsWith(name, ".ts", 3) && name.size() > 3) {
+        char* endptr = NULL;
+        const int64_t seq = strtoll(name.c_str(), &endptr, 10);
+        if (endptr == name.c_str() + name.size() - 3 &&
+            GetSegment(seq, &cntl->response_attachment())) {
+            cntl->http_response().set_content_type("video/mp2t");
+            return;
+        }
+    }
+    cntl->SetFailed(ENOMETHOD, "No hls resource named `%s'", name.c_str());
+}
+
+} // namespace brpc
@@ -0,0 +1,116 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_HLS_H
+#define BRPC_HLS_H
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include "butil/iobuf.h"
+#include "butil/status.h"
+#include "butil/synchronization/lock.h"          // butil::Mutex
+#include "brpc/rtmp.h"
+#include "brpc/ts.h"
+
+
+namespace brpc {
+
+class Controller;
+
+struct HlsSegmenterOptions {
+    HlsSegmenterOptions();
+
+    // A segment is closed at the first video keyframe after it lasts for
+    // so long, or at the first audio message if there's no video.
+    // Default: 5000
+    int target_duration_ms;
+
+    // At most so many segments are kept in memory and listed in the
+    // playlist, older ones are dropped.
+    // Default: 5
+    int max_segments;
+
+    // Prepended to names of segments in the playlist, e.g. "/hls/live/".
+    // Default: "" (relative to the URI of the playlist)
+    std::string segment_uri_prefix;
+};
+
+// Mux audio/video messages of a RTMP stream into rolling TS segments in
+// memory, which are served to HLS viewers. Segments are IOBufs created by
+// TsWriter and never modified after being closed, responses of all
+// viewers reference the same blocks without copying. Typical usage:
+//   - Call Write() in OnAudioMessage()/OnVideoMessage() of the
+//     RtmpServerStream publishing the stream.
+//   - Call ServeHttp() in a http service with the last component of the
+//     unresolved path, which is "<anything>.m3u8" or "<sequence>.ts".
+// Methods are thread-safe.
+class HlsSegmenter {
+public:
+    explicit HlsSegmenter(const HlsSegmenterOptions& options);
+    ~HlsSegmenter();
+
+    // Mux the message into the current segment.
+    butil::Status Write(const RtmpVideoMessage& msg);
+    butil::Status Write(const RtmpAudioMessage& msg);
+
+    // Close the current segment, called when the publisher quits.
+    void Flush();
+
+    // Print the m3u8 playlist of segments in memory into `playlist'.
+    void GetPlaylist(std::string* playlist) const;
+
+    // Append the segment with sequence number `seq' to `out', which
+    // references blocks of the segment.
+    // Returns false if the segment does not exist (dropped or not closed).
+    bool GetSegment(int64_t seq, butil::IOBuf* out) const;
+
+    // Respond the playlist or a segment named `name' to `cntl'. Unknown
+    // names are failed with ENOMETHOD (404).
+    void ServeHttp(Controller* cntl, const std::string& name) const;
+
+    // Sequence number of the first segment in the playlist.
+    int64_t first_sequence() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(HlsSegmenter);
+
+    struct Segment {
+        int64_t seq;
+        uint32_t duration_ms;
+        butil::IOBuf data;
+    };
+
+    // Called with _mutex held.
+    void UpdateTimestamp(uint32_t timestamp);
+    void CloseSegment(uint32_t timestamp);
+
+    const HlsSegmenterOptions _options;
+    mutable butil::Mutex _mutex;
+    butil::IOBuf _current;
+    TsWriter _writer;
+    bool _has_video;
+    bool _started;
+    uint32_t _start_ts;
+    uint32_t _last_ts;
+    int64_t _next_seq;
+    std::deque<Segment> _segments;
+};
+
+} // namespace brpc
+
+
+#endif // BRPC_HLS_H
@@ -78,15 +78,24 @@ public:
     { return _headers.seek(key); }
     const std::string* GetHeader(const std::string& key) const
     { return _headers.seek(key); }
+    // Faster for well-known headers looked up repeatedly, the hash of `key'
+    // is not computed again. Example:
+    //   static const butil::CaseIgnoredKey MY_HEADER("x-my-header");
+    //   const std::string* value = header.GetHeader(MY_HEADER);
+    const std::string* GetHeader(const butil::CaseIgnoredKey& key) const
+    { return _headers.seek(key); }
 
     // Set value of a header.
     // NOTE: Not work for "Content-Type", call set_content_type() instead.
     void SetHeader(const std::string& key, const std::string& value)
     { GetOrAddHeader(key) = value; }
+    void SetHeader(const butil::CaseIgnoredKey& key, const std::string& value)
+    { GetOrAddHeader(key) = value; }
 
     // Remove a header.
     void RemoveHeader(const char* key) { _headers.erase(key); }
     void RemoveHeader(const std::string& key) { _headers.erase(key); }
+    void RemoveHeader(const butil::CaseIgnoredKey& key) { _headers.erase(key); }
 
     // Append value to a header. If the header already exists, separate
     // old value and new value with comma(,) according to:
@@ -144,6 +153,14 @@ friend void policy::ProcessHttpRequest(InputMessageBase *msg);
         return _headers[key];
     }
 
+    std::string& GetOrAddHeader(const butil::CaseIgnoredKey& key) {
+        std::string* value = _headers.seek(key);
+        if (value != NULL) {
+            return *value;
+        }
+        return GetOrAddHeader(key.str());
+    }
+
     HeaderMap _headers;
     URI _uri;
     int _status_code;
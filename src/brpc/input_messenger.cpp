@@ -14,11 +14,13 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <algorithm>                             // std::max
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                      // fd_guard
 #include "butil/logging.h"                       // CHECK
 #include "butil/time.h"                          // cpuwide_time_us
 #include "butil/fd_utility.h"                    // make_non_blocking
+#include "butil/object_pool.h"                   // get_object
 #include "bthread/bthread.h"                     // bthread_start_background
 #include "bthread/unstable.h"                   // bthread_flush
 #include "bvar/bvar.h"                          // bvar::Adder
@@ -50,6 +52,15 @@ DEFINE_bool(log_connection_close, false,
             "Print log when remote side closes the connection");
 BRPC_VALIDATE_GFLAG(log_connection_close, PassValidate);
 
+DEFINE_int32(max_batched_input_messages, 1,
+             "Messages cut from one read except the last one (which is "
+             "processed in the reading bthread) are processed sequentially in "
+             "one bthread for every so many messages, which saves bthread "
+             "creations for pipelined small messages(e.g. redis/memcache) at "
+             "the cost of less concurrency between them. 1 means one bthread "
+             "for each message");
+BRPC_VALIDATE_GFLAG(max_batched_input_messages, PositiveInteger);
+
 DECLARE_bool(usercode_in_pthread);
 DECLARE_uint64(max_body_size);
 
@@ -57,12 +68,54 @@ const size_t MSG_SIZE_WINDOW = 10;  // Take last so many message into stat.
 const size_t MIN_ONCE_READ = 4096;
 const size_t MAX_ONCE_READ = 524288;
 
+// Protocols recognizable by the first 4 bytes of a connection.
+struct ProtocolMagic {
+    char magic[4];
+    ProtocolType type;
+};
+static const ProtocolMagic s_protocol_magics[] = {
+    { {'P', 'R', 'P', 'C'}, PROTOCOL_BAIDU_STD },
+    { {'S', 'T', 'R', 'M'}, PROTOCOL_STREAMING_RPC },
+    { {'H', 'U', 'L', 'U'}, PROTOCOL_HULU_PBRPC },
+    { {'S', 'O', 'F', 'A'}, PROTOCOL_SOFA_PBRPC },
+    { {'G', 'E', 'T', ' '}, PROTOCOL_HTTP },
+    { {'P', 'O', 'S', 'T'}, PROTOCOL_HTTP },
+    { {'P', 'U', 'T', ' '}, PROTOCOL_HTTP },
+    { {'H', 'E', 'A', 'D'}, PROTOCOL_HTTP },
+    { {'D', 'E', 'L', 'E'}, PROTOCOL_HTTP },
+    { {'O', 'P', 'T', 'I'}, PROTOCOL_HTTP },
+    { {'P', 'A', 'T', 'C'}, PROTOCOL_HTTP },
+    { {'T', 'R', 'A', 'C'}, PROTOCOL_HTTP },
+    { {'C', 'O', 'N', 'N'}, PROTOCOL_HTTP },
+    { {'H', 'T', 'T', 'P'}, PROTOCOL_HTTP },
+    { {'P', 'R', 'I', ' '}, PROTOCOL_H2 },       // connection preface
+};
+
+// Guess the protocol of a connection without a preferred handler from
+// the magic number, so that the matched handler is tried first instead of
+// trying all handlers in order. Returns -1 if the magic is unknown.
+static int GuessHandlerIndex(const butil::IOBuf& buf) {
+    char head[4];
+    if (buf.copy_to(head, sizeof(head)) != sizeof(head)) {
+        return -1;
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(s_protocol_magics); ++i) {
+        if (memcmp(head, s_protocol_magics[i].magic, sizeof(head)) == 0) {
+            return s_protocol_magics[i].type;
+        }
+    }
+    return -1;
+}
+
 ParseResult InputMessenger::CutInputMessage(
         Socket* m, size_t* index, bool read_eof) {
-    const int preferred = m->_preferred_index;
+    int preferred = m->_preferred_index;
     const int max_index = (int)_max_index.load(butil::memory_order_acquire);
+    if (preferred < 0 && !m->CreatedByConnect()) {
+        preferred = GuessHandlerIndex(m->_read_buf);
+    }
     // Try preferred handler first. The _preferred_index is set on last
-    // selection or by client.
+    // selection or by client, or guessed from the magic number.
     if (preferred >= 0 && preferred <= max_index
             && _handlers[preferred].parse != NULL) {
         ParseResult result =
@@ -131,6 +184,9 @@ ParseResult InputMessenger::CutInputMessage(
 void* ProcessInputMessage(void* void_arg) {
     InputMessageBase* msg = static_cast<InputMessageBase*>(void_arg);
     msg->_process(msg);
+    // Methods of high priority raise priority of the processing bthread in
+    // MethodStatus::OnRequested, restore it before processing other messages.
+    bthread_set_high_priority(0);
     return NULL;
 }
 
@@ -163,6 +219,93 @@ static void QueueMessage(InputMessageBase* to_run_msg,
     }
 }
 
+struct InputMessageBatch {
+    std::vector<InputMessageBase*> msgs;
+};
+
+static void* ProcessInputMessageBatch(void* void_arg) {
+    InputMessageBatch* batch = static_cast<InputMessageBatch*>(void_arg);
+    // In the same order as they're cut.
+    for (size_t i = 0; i < batch->msgs.size(); ++i) {
+        ProcessInputMessage(batch->msgs[i]);
+    }
+    batch->msgs.clear();
+    butil::return_object(batch);
+    return NULL;
+}
+
+// Queue messages in batches of -max_batched_input_messages.
+class InputMessageBatcher {
+public:
+    InputMessageBatcher(int* num_bthread_created,
+                        bthread_keytable_pool_t* keytable_pool)
+        : _max_batch(FLAGS_max_batched_input_messages)
+        , _batch(NULL)
+        , _num_bthread_created(num_bthread_created)
+        , _keytable_pool(keytable_pool) {}
+    ~InputMessageBatcher() {
+        if (_batch) {
+            Flush();
+            bthread_flush();
+        }
+    }
+
+    void Add(InputMessageBase* msg) {
+        if (msg == NULL) {
+            return;
+        }
+        if (_max_batch <= 1) {
+            QueueMessage(msg, _num_bthread_created, _keytable_pool);
+            return;
+        }
+        if (_batch == NULL) {
+            _batch = butil::get_object<InputMessageBatch>();
+            if (_batch == NULL) {
+                QueueMessage(msg, _num_bthread_created, _keytable_pool);
+                return;
+            }
+        }
+        _batch->msgs.push_back(msg);
+        if ((int)_batch->msgs.size() >= _max_batch) {
+            Flush();
+        }
+    }
+
+    // Start a bthread to process queued messages.
+    void Flush() {
+        InputMessageBatch* batch = _batch;
+        if (batch == NULL) {
+            return;
+        }
+        _batch = NULL;
+        if (batch->msgs.size() == 1) {
+            InputMessageBase* msg = batch->msgs[0];
+            batch->msgs.clear();
+            butil::return_object(batch);
+            QueueMessage(msg, _num_bthread_created, _keytable_pool);
+            return;
+        }
+        bthread_t th;
+        bthread_attr_t tmp = (FLAGS_usercode_in_pthread ?
+                              BTHREAD_ATTR_PTHREAD :
+                              BTHREAD_ATTR_NORMAL) | BTHREAD_NOSIGNAL;
+        tmp.keytable_pool = _keytable_pool;
+        if (bthread_start_background(
+                &th, &tmp, ProcessInputMessageBatch, batch) == 0) {
+            ++*_num_bthread_created;
+        } else {
+            ProcessInputMessageBatch(batch);
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(InputMessageBatcher);
+    const int _max_batch;
+    InputMessageBatch* _batch;
+    int* _num_bthread_created;
+    bthread_keytable_pool_t* _keytable_pool;
+};
+
 InputMessenger::InputMessageClosure::~InputMessageClosure() {
     if (_msg) {
         ProcessInputMessage(_msg);
@@ -187,6 +330,7 @@ int InputMessenger::ProcessNewMessage(
 
     size_t last_size = m->_read_buf.length();
     int num_bthread_created = 0;
+    InputMessageBatcher batcher(&num_bthread_created, m->_keytable_pool);
     while (1) {
         size_t index = 8888;
         ParseResult pr = CutInputMessage(m, &index, read_eof);
@@ -242,8 +386,7 @@ int InputMessenger::ProcessNewMessage(
         // This unique_ptr prevents msg to be lost before transfering
         // ownership to last_msg
         DestroyingPtr<InputMessageBase> msg(pr.message());
-        QueueMessage(last_msg.release(), &num_bthread_created,
-                m->_keytable_pool);
+        batcher.Add(last_msg.release());
         if (_handlers[index].process == NULL) {
             LOG(ERROR) << "process of index=" << index << " is NULL";
             continue;
@@ -276,12 +419,15 @@ int InputMessenger::ProcessNewMessage(
             // Transfer ownership to last_msg
             last_msg.reset(msg.release());
         } else {
+            // Keep the order with batched messages.
+            batcher.Flush();
             QueueMessage(msg.release(), &num_bthread_created,
                     m->_keytable_pool);
             bthread_flush();
             num_bthread_created = 0;
         }
     }
+    batcher.Flush();
     if (num_bthread_created) {
         bthread_flush();
     }
@@ -311,8 +457,14 @@ void InputMessenger::OnNewMessages(Socket* m) {
         const int64_t received_us = butil::cpuwide_time_us();
         const int64_t base_realtime = butil::gettimeofday_us() - received_us;
 
-        // Calculate bytes to be read.
+        // Calculate bytes to be read. Besides completed messages, learn
+        // from the incomplete message (consumed and buffered bytes) so that
+        // a large message is not read in small pieces before it completes,
+        // and from the last read which filled the buffer.
         size_t once_read = m->_avg_msg_size * 16;
+        once_read = std::max(once_read, (size_t)m->_read_size_hint);
+        once_read = std::max(once_read,
+                             m->_last_msg_size + m->_read_buf.length());
         if (once_read < MIN_ONCE_READ) {
             once_read = MIN_ONCE_READ;
         } else if (once_read > MAX_ONCE_READ) {
@@ -321,6 +473,12 @@ void InputMessenger::OnNewMessages(Socket* m) {
 
         // Read.
         const ssize_t nr = m->DoRead(once_read);
+        if (nr > 0 && (size_t)nr >= once_read) {
+            // More data is probably pending in the kernel.
+            m->_read_size_hint = std::min(once_read * 2, MAX_ONCE_READ);
+        } else if (nr > 0 && (size_t)nr < once_read / 4) {
+            m->_read_size_hint /= 2;
+        }
         if (nr <= 0) {
             if (0 == nr) {
                 // Set `read_eof' flag and proceed to feed EOF into `Protocol'
@@ -338,17 +496,33 @@ void InputMessenger::OnNewMessages(Socket* m) {
                 m->SetFailed(saved_errno, "Fail to read from %s: %s",
                              m->description().c_str(), berror(saved_errno));
                 return;
-            } else if (!m->MoreReadEvents(&progress)) {
-                return;
-            } else { // new events during processing
+            } else {
+                // No more data for now, don't let an idle socket hold the
+                // unused part of the last block for the next read. The
+                // buffer is returned by the IOPortal when it's empty.
+                if (!m->_read_buf.empty()) {
+                    m->_read_buf.return_cached_blocks();
+                }
+                if (!m->MoreReadEvents(&progress)) {
+                    return;
+                }
+                // new events during processing
                 continue;
             }
         }
 
-        if (m->_rdma_state == Socket::RDMA_OFF && messenger->ProcessNewMessage(
+        if (m->_rdma_state == Socket::RDMA_OFF &&
+            m->_shm_state != Socket::SHM_UNKNOWN &&
+            messenger->ProcessNewMessage(
                     m, nr, read_eof, received_us, base_realtime, last_msg) < 0) {
             return;
         }
+        // Stop reading for a while if this socket buffers more than its
+        // share of -socket_max_total_read_buffer_bytes. Messages already
+        // cut are still processed.
+        if (!read_eof && m->UpdateReadBufferUsage() && m->PauseReading()) {
+            return;
+        }
     }
 
     if (read_eof) {
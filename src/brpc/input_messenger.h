@@ -74,6 +74,7 @@ struct InputMessageHandler {
 class InputMessenger : public SocketUser {
 friend class rdma::RdmaEndpoint;
 friend class rdma::RdmaCompletionQueue;
+friend class Socket;   // for checking OnNewMessages
 public:
     explicit InputMessenger(size_t capacity = 128);
     ~InputMessenger();
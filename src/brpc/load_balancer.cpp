@@ -14,8 +14,12 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <algorithm>
 #include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/time.h"
 #include "brpc/reloadable_flags.h"
+#include "brpc/socket.h"
 #include "brpc/load_balancer.h"
 
 
@@ -80,6 +84,41 @@ int SharedLoadBalancer::Init(const char* lb_name) {
     return 0;
 }
 
+// Times of selecting other servers instead of recovering ones in one
+// SelectServerGradually(), the last selected server is used anyway.
+static const int MAX_SKIPPED_RECOVERING_SERVERS = 2;
+
+int SharedLoadBalancer::SelectServerGradually(
+    const LoadBalancer::SelectIn& in, LoadBalancer::SelectOut* out,
+    bool with_circuit_breaker) {
+    for (int i = 0; ; ++i) {
+        const int rc = _lb->SelectServer(in, out);
+        if (rc != 0 || out->need_feedback ||
+            i == MAX_SKIPPED_RECOVERING_SERVERS) {
+            return rc;
+        }
+        int permille = (*out->ptr)->slow_start_permille();
+        if (with_circuit_breaker) {
+            permille = std::min(
+                permille, (*out->ptr)->circuit_breaker().admission_permille());
+        }
+        if (permille >= 1000 ||
+            (int)butil::fast_rand_less_than(1000) < permille) {
+            return 0;
+        }
+        out->ptr->reset();
+    }
+}
+
+void SharedLoadBalancer::FeedbackCircuitBreaker(
+    const LoadBalancer::CallInfo& info) {
+    SocketUniquePtr ptr;
+    if (Socket::Address(info.server_id, &ptr) == 0) {
+        ptr->FeedbackCircuitBreaker(
+            info.error_code, butil::gettimeofday_us() - info.begin_time_us);
+    }
+}
+
 void SharedLoadBalancer::Describe(std::ostream& os,
                                   const DescribeOptions& options) {
     if (_lb == NULL) {
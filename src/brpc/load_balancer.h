@@ -107,6 +107,7 @@ protected:
 };
 
 DECLARE_bool(show_lb_in_vars);
+DECLARE_int32(health_check_slow_start_ms);
 
 // A intrusively shareable load balancer created from name.
 class SharedLoadBalancer : public SharedObject, public NonConstDescribable {
@@ -121,10 +122,28 @@ public:
         if (FLAGS_show_lb_in_vars && !_exposed) {
             ExposeLB();
         }
+        if (FLAGS_health_check_slow_start_ms > 0) {
+            return SelectServerGradually(in, out, false);
+        }
         return _lb->SelectServer(in, out);
     }
 
+    // Same as SelectServer() except that servers recovering from isolation
+    // of circuit breakers are selected with a growing chance. Load balancers
+    // needing feedback are supposed to ramp up traffic by themselves.
+    int SelectServerWithCircuitBreaker(const LoadBalancer::SelectIn& in,
+                                       LoadBalancer::SelectOut* out) {
+        if (FLAGS_show_lb_in_vars && !_exposed) {
+            ExposeLB();
+        }
+        return SelectServerGradually(in, out, true);
+    }
+
     void Feedback(const LoadBalancer::CallInfo& info) { _lb->Feedback(info); }
+
+    // Feed the circuit breaker of the server in `info', which may isolate
+    // the server.
+    void FeedbackCircuitBreaker(const LoadBalancer::CallInfo& info);
     
     bool AddServer(const ServerId& server) {
         if (_lb->AddServer(server)) {
@@ -166,6 +185,11 @@ public:
 private:
     static void DescribeLB(std::ostream& os, void* arg);
     void ExposeLB();
+    // Select servers in slow start (and recovering from circuit breakers
+    // if `with_circuit_breaker' is true) with a growing chance.
+    int SelectServerGradually(const LoadBalancer::SelectIn& in,
+                              LoadBalancer::SelectOut* out,
+                              bool with_circuit_breaker);
 
     LoadBalancer* _lb;
     butil::atomic<int> _weight_sum;
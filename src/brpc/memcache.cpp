@@ -492,6 +492,44 @@ bool MemcacheRequest::Get(const butil::StringPiece& key) {
     return GetOrDelete(policy::MC_BINARY_GET, key);
 }
 
+bool MemcacheRequest::MultiGet(const butil::StringPiece* keys, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        const policy::MemcacheRequestHeader header = {
+            policy::MC_MAGIC_REQUEST,
+            policy::MC_BINARY_GETKQ,
+            butil::HostToNet16(keys[i].size()),
+            0,
+            policy::MC_BINARY_RAW_BYTES,
+            0,
+            butil::HostToNet32(keys[i].size()),
+            0,
+            0
+        };
+        if (_buf.append(&header, sizeof(header))) {
+            return false;
+        }
+        if (_buf.append(keys[i].data(), keys[i].size())) {
+            return false;
+        }
+    }
+    // Responses of GETKQ are sent only for hits, the response of NOOP marks
+    // the end of the batch.
+    const policy::MemcacheRequestHeader noop = {
+        policy::MC_MAGIC_REQUEST, policy::MC_BINARY_NOOP, 0, 0,
+        policy::MC_BINARY_RAW_BYTES, 0, 0, 0, 0
+    };
+    if (_buf.append(&noop, sizeof(noop))) {
+        return false;
+    }
+    ++_pipelined_count;
+    return true;
+}
+
+bool MemcacheRequest::MultiGet(const std::vector<std::string>& keys) {
+    std::vector<butil::StringPiece> pieces(keys.begin(), keys.end());
+    return MultiGet(pieces.data(), pieces.size());
+}
+
 bool MemcacheRequest::Delete(const butil::StringPiece& key) {
     return GetOrDelete(policy::MC_BINARY_DELETE, key);
 }
@@ -626,6 +664,68 @@ bool MemcacheResponse::PopGet(
     return false;
 }
 
+// Responses of GETKQ(hits or errors) ended with the response of NOOP.
+// GETKQ responses MUST have flags as extras and MUST have key when hit.
+bool MemcacheResponse::PopMultiGet(std::map<std::string, MemcacheValue>* values) {
+    values->clear();
+    std::string first_error;
+    while (true) {
+        const size_t n = _buf.size();
+        policy::MemcacheResponseHeader header;
+        if (n < sizeof(header)) {
+            butil::string_printf(&_err, "buffer is too small to contain a header");
+            return false;
+        }
+        _buf.copy_to(&header, sizeof(header));
+        if (n < sizeof(header) + header.total_body_length) {
+            butil::string_printf(&_err, "response=%u < header=%u + body=%u",
+                      (unsigned)n, (unsigned)sizeof(header), header.total_body_length);
+            return false;
+        }
+        if (header.command == (uint8_t)policy::MC_BINARY_NOOP) {
+            _buf.pop_front(sizeof(header) + header.total_body_length);
+            break;
+        }
+        if (header.command != (uint8_t)policy::MC_BINARY_GETKQ) {
+            butil::string_printf(&_err, "not a MULTIGET response");
+            return false;
+        }
+        const int value_size = (int)header.total_body_length - (int)header.extras_length
+            - (int)header.key_length;
+        if (value_size < 0) {
+            butil::string_printf(&_err, "value_size=%d is non-negative", value_size);
+            return false;
+        }
+        if (header.status != (uint16_t)STATUS_SUCCESS) {
+            _buf.pop_front(sizeof(header) + header.extras_length +
+                           header.key_length);
+            if (first_error.empty()) {
+                _buf.cutn(&first_error, value_size);
+            } else {
+                _buf.pop_front(value_size);
+            }
+            continue;
+        }
+        if (header.extras_length != 4u) {
+            butil::string_printf(&_err, "GETKQ response must have flags as extras, actual length=%u",
+                      header.extras_length);
+            return false;
+        }
+        _buf.pop_front(sizeof(header));
+        uint32_t raw_flags = 0;
+        _buf.cutn(&raw_flags, sizeof(raw_flags));
+        std::string key;
+        _buf.cutn(&key, header.key_length);
+        MemcacheValue& v = (*values)[key];
+        v.flags = butil::NetToHost32(raw_flags);
+        v.cas_value = header.cas_value;
+        v.value.clear();
+        _buf.cutn(&v.value, value_size);
+    }
+    _err.swap(first_error);
+    return _err.empty();
+}
+
 // MUST NOT have extras
 // MUST NOT have key
 // MUST NOT have value
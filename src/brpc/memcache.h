@@ -18,6 +18,8 @@
 #define BRPC_MEMCACHE_H
 
 #include <string>
+#include <vector>
+#include <map>
 #include <google/protobuf/stubs/common.h>
 #include <google/protobuf/generated_message_util.h>
 #include <google/protobuf/repeated_field.h>
@@ -30,6 +32,8 @@
 
 namespace brpc {
 
+class ShardedMemcacheChannel;
+
 // Request to memcache.
 // Notice that you can pipeline multiple operations in one request and sent
 // them to memcached server together.
@@ -55,6 +59,12 @@ public:
 
     bool Get(const butil::StringPiece& key);
 
+    // Get values of `keys' in one batch: a quiet GETKQ for every key and a
+    // NOOP at last, missing keys cost nothing in the response. Values are
+    // popped by MemcacheResponse::PopMultiGet().
+    bool MultiGet(const butil::StringPiece* keys, size_t count);
+    bool MultiGet(const std::vector<std::string>& keys);
+
     // If the cas_value(Data Version Check) is non-zero, the requested operation
     // MUST only succeed if the item exists and has a cas_value identical to the
     // provided value.
@@ -128,6 +138,7 @@ private:
     butil::IOBuf _buf;
     mutable int _cached_size_;
 
+friend class ShardedMemcacheChannel;
 friend void protobuf_AddDesc_baidu_2frpc_2fmemcache_5fbase_2eproto_impl();
 friend void protobuf_AddDesc_baidu_2frpc_2fmemcache_5fbase_2eproto();
 friend void protobuf_AssignDesc_baidu_2frpc_2fmemcache_5fbase_2eproto();
@@ -137,6 +148,13 @@ friend void protobuf_ShutdownFile_baidu_2frpc_2fmemcache_5fbase_2eproto();
     static MemcacheRequest* default_instance_;
 };
 
+// A value got by MemcacheRequest::MultiGet().
+struct MemcacheValue {
+    butil::IOBuf value;
+    uint32_t flags;
+    uint64_t cas_value;
+};
+
 // Response from Memcache.
 // Notice that a MemcacheResponse instance may contain multiple operations
 // due to pipelining. You can call pop_xxx according to your calling sequence
@@ -191,6 +209,10 @@ public:
    
     bool PopGet(butil::IOBuf* value, uint32_t* flags, uint64_t* cas_value);
     bool PopGet(std::string* value, uint32_t* flags, uint64_t* cas_value);
+    // Pop responses of a MultiGet() into `values' which is cleared before.
+    // Missing keys are not in `values'. Returns false if any key failed with
+    // an error other than non-existence, other keys are still popped.
+    bool PopMultiGet(std::map<std::string, MemcacheValue>* values);
     bool PopSet(uint64_t* cas_value);
     bool PopAdd(uint64_t* cas_value);
     bool PopReplace(uint64_t* cas_value);
@@ -32,6 +32,8 @@ enum MongoOpCode {
     MONGO_OPCODE_GET_MORE      = 2005,
     MONGO_OPCODE_DELETE        = 2006,
     MONGO_OPCODE_KILL_CURSORS  = 2007,
+    // OP_MSG of MongoDB 3.6+, not the deprecated one(1000).
+    MONGO_OPCODE_OP_MSG        = 2013,
 };
 
 inline bool is_mongo_opcode(int32_t op_code) {
@@ -44,6 +46,7 @@ inline bool is_mongo_opcode(int32_t op_code) {
     case MONGO_OPCODE_GET_MORE:      return true; 
     case MONGO_OPCODE_DELETE:        return true; 
     case MONGO_OPCODE_KILL_CURSORS : return true;
+    case MONGO_OPCODE_OP_MSG:        return true;
     }
     return false;
 }
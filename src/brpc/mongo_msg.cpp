@@ -0,0 +1,215 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "butil/logging.h"
+#include "butil/atomicops.h"
+#include "butil/sys_byteorder.h"
+#include "brpc/socket.h"
+#include "brpc/controller.h"
+#include "brpc/mongo_head.h"
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/mongo_msg.h"
+
+
+namespace brpc {
+
+// All data of mongo protocol is little-endian.
+inline uint32_t ToLittleEndian32(uint32_t v) {
+    return ARCH_CPU_LITTLE_ENDIAN ? v : butil::ByteSwap(v);
+}
+
+inline void AppendInt32(butil::IOBuf* buf, uint32_t v) {
+    v = ToLittleEndian32(v);
+    buf->append(&v, sizeof(v));
+}
+
+inline bool CopyInt32(const butil::IOBuf& buf, uint32_t* v) {
+    if (buf.copy_to(v, sizeof(*v)) != sizeof(*v)) {
+        return false;
+    }
+    *v = ToLittleEndian32(*v);
+    return true;
+}
+
+bool ParseMongoMsg(butil::IOBuf* payload, MongoMsg* msg) {
+    uint32_t flag_bits = 0;
+    if (!CopyInt32(*payload, &flag_bits)) {
+        LOG(WARNING) << "OP_MSG is too short to contain flagBits";
+        return false;
+    }
+    payload->pop_front(sizeof(flag_bits));
+    if (flag_bits & MONGO_MSG_CHECKSUM_PRESENT) {
+        if (payload->size() < sizeof(uint32_t)) {
+            LOG(WARNING) << "OP_MSG is too short to contain checksum";
+            return false;
+        }
+        payload->pop_back(sizeof(uint32_t));
+    }
+    msg->flag_bits = flag_bits;
+    msg->body.clear();
+    msg->sequences.clear();
+    bool has_body = false;
+    while (!payload->empty()) {
+        char kind = 0;
+        payload->cut1(&kind);
+        uint32_t size = 0;
+        if (!CopyInt32(*payload, &size) || size < sizeof(size) ||
+            size > payload->size()) {
+            LOG(WARNING) << "Invalid size of section of OP_MSG";
+            return false;
+        }
+        if (kind == 0) {
+            // size of BSON document, including itself.
+            if (has_body) {
+                LOG(WARNING) << "OP_MSG has more than one body";
+                return false;
+            }
+            payload->cutn(&msg->body, size);
+            has_body = true;
+        } else if (kind == 1) {
+            // size, identifier(cstring), documents.
+            payload->pop_front(sizeof(size));
+            size -= sizeof(size);
+            char id_buf[128];
+            const size_t n = payload->copy_to(id_buf, std::min(sizeof(id_buf),
+                                                               (size_t)size));
+            const char* end = (const char*)memchr(id_buf, '\0', n);
+            if (end == NULL) {
+                LOG(WARNING) << "Invalid identifier of document sequence";
+                return false;
+            }
+            msg->sequences.push_back(MongoMsgSequence());
+            MongoMsgSequence& seq = msg->sequences.back();
+            seq.identifier.assign(id_buf, end - id_buf);
+            payload->pop_front(end - id_buf + 1);
+            payload->cutn(&seq.documents, size - (end - id_buf + 1));
+        } else {
+            LOG(WARNING) << "Unknown kind=" << (int)kind << " of OP_MSG section";
+            return false;
+        }
+    }
+    if (!has_body) {
+        LOG(WARNING) << "OP_MSG does not have a body";
+        return false;
+    }
+    return true;
+}
+
+static size_t SerializeMongoMsgWithFlags(const MongoMsg& msg,
+                                        uint32_t flag_bits,
+                                        butil::IOBuf* out) {
+    const size_t old_size = out->size();
+    AppendInt32(out, flag_bits & ~(uint32_t)MONGO_MSG_CHECKSUM_PRESENT);
+    out->push_back(0);
+    out->append(msg.body);
+    for (size_t i = 0; i < msg.sequences.size(); ++i) {
+        const MongoMsgSequence& seq = msg.sequences[i];
+        out->push_back(1);
+        AppendInt32(out, sizeof(uint32_t) + seq.identifier.size() + 1 +
+                    seq.documents.size());
+        out->append(seq.identifier.data(), seq.identifier.size() + 1);
+        out->append(seq.documents);
+    }
+    return out->size() - old_size;
+}
+
+size_t SerializeMongoMsg(const MongoMsg& msg, butil::IOBuf* out) {
+    return SerializeMongoMsgWithFlags(msg, msg.flag_bits, out);
+}
+
+void MakeMongoMsgError(int code, const std::string& errmsg, MongoMsg* msg) {
+    msg->flag_bits = 0;
+    msg->sequences.clear();
+    // Elements of BSON: type, name(cstring), value.
+    butil::IOBuf elements;
+    const double ok = 0;
+    elements.push_back(0x01);  // double
+    elements.append("ok", 3);
+    elements.append(&ok, sizeof(ok));
+    elements.push_back(0x02);  // string
+    elements.append("errmsg", 7);
+    AppendInt32(&elements, errmsg.size() + 1);
+    elements.append(errmsg.c_str(), errmsg.size() + 1);
+    elements.push_back(0x10);  // int32
+    elements.append("code", 5);
+    AppendInt32(&elements, code);
+    msg->body.clear();
+    AppendInt32(&msg->body, sizeof(uint32_t) + elements.size() + 1);
+    msg->body.append(elements);
+    msg->body.push_back(0);
+}
+
+static butil::static_atomic<int32_t> s_mongo_request_id = BUTIL_STATIC_ATOMIC_INIT(0);
+
+int32_t NextMongoRequestId() {
+    return (s_mongo_request_id.fetch_add(1, butil::memory_order_relaxed) + 1)
+        & 0x7FFFFFFF;
+}
+
+MongoMsgWriter::MongoMsgWriter(SocketUniquePtr& movable_sock,
+                               int32_t response_to)
+    : _response_to(response_to)
+    , _done(false) {
+    _sock.swap(movable_sock);
+}
+
+int MongoMsgWriter::Write(const MongoMsg& msg, bool more_to_come) {
+    butil::IOBuf body;
+    uint32_t flag_bits = msg.flag_bits & ~(uint32_t)MONGO_MSG_MORE_TO_COME;
+    if (more_to_come) {
+        flag_bits |= MONGO_MSG_MORE_TO_COME;
+    }
+    const size_t body_len = SerializeMongoMsgWithFlags(msg, flag_bits, &body);
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_done) {
+        errno = EPERM;
+        return -1;
+    }
+    mongo_head_t header = {
+        (int32_t)(sizeof(mongo_head_t) + body_len),
+        NextMongoRequestId(),
+        _response_to,
+        MONGO_OPCODE_OP_MSG
+    };
+    const int32_t request_id = header.request_id;
+    header.make_host_endian();  // byte-swapping is symmetric.
+    butil::IOBuf buf;
+    buf.append(&header, sizeof(header));
+    buf.append(butil::IOBuf::Movable(body));
+    // Replies are ordered by the lock, Socket.Write does not block.
+    if (_sock->Write(&buf) != 0) {
+        return -1;
+    }
+    _response_to = request_id;
+    _done = !more_to_come;
+    return 0;
+}
+
+MongoMsgWriter* CreateMongoMsgWriter(Controller* cntl, int32_t response_to) {
+    if (cntl->request_protocol() != PROTOCOL_MONGO) {
+        LOG(ERROR) << "Only mongo requests can be replied by MongoMsgWriter";
+        return NULL;
+    }
+    Socket* sock = ControllerPrivateAccessor(cntl).get_sending_socket();
+    if (sock == NULL) {
+        LOG(ERROR) << "sending_sock is NULL";
+        return NULL;
+    }
+    SocketUniquePtr ptr;
+    sock->ReAddress(&ptr);
+    return new MongoMsgWriter(ptr, response_to);
+}
+
+} // namespace brpc
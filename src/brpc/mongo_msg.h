@@ -0,0 +1,124 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_MONGO_MSG_H
+#define BRPC_MONGO_MSG_H
+
+#include <string>
+#include <vector>
+#include "butil/iobuf.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/socket_id.h"             // SocketUniquePtr
+#include "brpc/shared_object.h"         // SharedObject
+
+
+namespace brpc {
+
+class Controller;
+
+// Bits of MongoMsg::flag_bits.
+enum MongoMsgFlag {
+    MONGO_MSG_CHECKSUM_PRESENT = 1u << 0,
+    // The sender sends another message after this one without waiting for
+    // a reply. A request with this flag is not replied.
+    MONGO_MSG_MORE_TO_COME = 1u << 1,
+    // The client is prepared for multiple replies(with moreToCome) to this
+    // request, namely exhaust cursors.
+    MONGO_MSG_EXHAUST_ALLOWED = 1u << 16,
+};
+
+// A sequence of documents(section of kind 1) in OP_MSG.
+struct MongoMsgSequence {
+    // e.g. "documents" of insert, "updates" of update.
+    std::string identifier;
+    // Concatenated BSON documents.
+    butil::IOBuf documents;
+};
+
+// OP_MSG of MongoDB 3.6+. Documents are referenced as IOBuf without copying
+// and not interpreted.
+// https://docs.mongodb.com/manual/reference/mongodb-wire-protocol/#op-msg
+struct MongoMsg {
+    MongoMsg() : flag_bits(0) {}
+
+    uint32_t flag_bits;
+    // The only BSON document of the section of kind 0.
+    butil::IOBuf body;
+    std::vector<MongoMsgSequence> sequences;
+};
+
+// Parse and consume the OP_MSG after mongo_head_t from `payload', the
+// checksum(if present) is removed without being checked.
+// Returns true on success.
+bool ParseMongoMsg(butil::IOBuf* payload, MongoMsg* msg);
+
+// Append the OP_MSG after mongo_head_t into `out' without the checksum and
+// MONGO_MSG_CHECKSUM_PRESENT. Returns size of the appended data.
+size_t SerializeMongoMsg(const MongoMsg& msg, butil::IOBuf* out);
+
+// OP_MSG containing {ok: 0, errmsg: <errmsg>, code: <code>} as the body.
+void MakeMongoMsgError(int code, const std::string& errmsg, MongoMsg* msg);
+
+// Write replies to an OP_MSG request, for streaming large results e.g.
+// exhaust cursors whose batches are replied one after another. Each reply
+// responds to the previous one, all replies except the last have
+// MONGO_MSG_MORE_TO_COME.
+// If a handler of MongoService(policy/mongo.proto) replies an OP_MSG by
+// the writer, it should leave the response attachment empty so that no
+// reply is sent after running `done'.
+// Example:
+//   butil::intrusive_ptr<MongoMsgWriter> writer(
+//       CreateMongoMsgWriter(cntl, req->header().request_id()));
+//   done->Run();  // the attachment is empty, nothing is sent.
+//   ...
+//   // In another thread
+//   while (has_next_batch) {
+//       if (writer->Write(batch, has_next_batch) != 0) {
+//           if (errno == EOVERCROWDED) { wait and retry later; }
+//           else { break; // the connection is broken. }
+//       }
+//   }
+class MongoMsgWriter : public SharedObject {
+public:
+    // [Thread-safe]
+    // Write `msg' as one OP_MSG to peer. MONGO_MSG_MORE_TO_COME is set if
+    // `more_to_come' is true, otherwise this is the last reply.
+    // Returns 0 on success, -1 otherwise and errno is set. Errnos are same
+    // as what Socket.Write may set, notably EOVERCROWDED when too much data
+    // is not written out yet, in which case the reply is not written and
+    // should be retried later. EPERM if the last reply was written.
+    int Write(const MongoMsg& msg, bool more_to_come);
+
+private:
+friend MongoMsgWriter* CreateMongoMsgWriter(Controller* cntl, int32_t response_to);
+    MongoMsgWriter(SocketUniquePtr& movable_sock, int32_t response_to);
+
+    butil::Mutex _mutex;
+    SocketUniquePtr _sock;
+    int32_t _response_to;
+    bool _done;
+};
+
+// Create a writer replying the OP_MSG request with `response_to' as the
+// request_id. Returns NULL if the controller is not of a mongo request.
+MongoMsgWriter* CreateMongoMsgWriter(Controller* cntl, int32_t response_to);
+
+// Request id of the next message sent by the server.
+int32_t NextMongoRequestId();
+
+} // namespace brpc
+
+
+#endif  // BRPC_MONGO_MSG_H
@@ -16,10 +16,14 @@
 
 #include "bthread/bthread.h"                  // bthread_id_xx
 #include "bthread/unstable.h"                 // bthread_timer_add
+#include "bthread/mutex.h"                    // bthread::Mutex
 #include "butil/atomicops.h"
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "butil/string_printf.h"
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/protocol.h"                      // SerializeRequestDefault
+#include "brpc/serialized_request.h"
 #include "brpc/parallel_channel.h"
 
 
@@ -27,7 +31,9 @@ namespace brpc {
 
 ParallelChannelOptions::ParallelChannelOptions()
     : timeout_ms(500)
-    , fail_limit(-1) {
+    , fail_limit(-1)
+    , success_limit(-1)
+    , incremental_merge(false) {
 }
 
 DECLARE_bool(usercode_in_pthread);
@@ -43,13 +49,18 @@ static __thread Memory tls_cached_pchan_mem = { 0, NULL };
 
 class ParallelChannelDone : public google::protobuf::Closure {
 private:
-    ParallelChannelDone(int fail_limit, int ndone, int nchan, int memsize,
-                        Controller* cntl, google::protobuf::Closure* user_done)
+    ParallelChannelDone(int fail_limit, int success_limit,
+                        bool incremental_merge, int ndone,
+                        int nchan, int memsize, Controller* cntl,
+                        google::protobuf::Closure* user_done)
         : _fail_limit(fail_limit)
+        , _success_limit(success_limit)
+        , _incremental_merge(incremental_merge)
         , _ndone(ndone)
         , _nchan(nchan)
         , _memsize(memsize)
         , _current_fail(0)
+        , _current_success(0)
         , _current_done(0)
         , _cntl(cntl)
         , _user_done(user_done)
@@ -62,7 +73,7 @@ private:
 public:
     class SubDone : public google::protobuf::Closure {
     public:
-        SubDone() : shared_data(NULL) {
+        SubDone() : shared_data(NULL), success_order(-1) {
         }
 
         ~SubDone() {
@@ -84,10 +95,13 @@ public:
         butil::intrusive_ptr<ResponseMerger> merger;
         SubCall ap;
         Controller cntl;
+        // Order of this sub call among successful ones, -1 if it failed.
+        int success_order;
     };
     
     static ParallelChannelDone* Create(
-        int fail_limit, int ndone, const SubCall* aps, int nchan,
+        int fail_limit, int success_limit, bool incremental_merge,
+        int ndone, const SubCall* aps, int nchan,
         Controller* cntl, google::protobuf::Closure* user_done) {
         // We need to create the object in this way because _sub_done is
         // dynamically allocated.
@@ -129,7 +143,8 @@ public:
         }
 #endif
         ParallelChannelDone* d = new (mem) ParallelChannelDone(
-            fail_limit, ndone, nchan, memsize, cntl, user_done);
+            fail_limit, success_limit, incremental_merge, ndone, nchan,
+            memsize, cntl, user_done);
 
         // Apply client settings of _cntl to controllers of sub calls, except
         // timeout. If we let sub channel do their timeout separately, when
@@ -189,7 +204,8 @@ public:
             _cntl->_error_code = 0;
             _cntl->_error_text.clear();
         } else {
-            CHECK(ECANCELED == ec || ERPCTIMEDOUT == ec) << "ec=" << ec;
+            CHECK(ECANCELED == ec || ERPCTIMEDOUT == ec || EPCHANENOUGH == ec)
+                << "ec=" << ec;
         }
         OnSubDoneRun(NULL);
     }
@@ -219,14 +235,26 @@ public:
             // [ called from SubDone::Run() ]
 
             // Count failed sub calls, if fail_limit is reached, cancel others.
-            if (fin->cntl.FailedInline() &&
-                _current_fail.fetch_add(1, butil::memory_order_relaxed) + 1
-                == _fail_limit) {
-                for (int i = 0; i < _ndone; ++i) {
-                    SubDone* sd = sub_done(i);
-                    if (fin != sd) {
-                        bthread_id_error(sd->cntl.call_id(), ECANCELED);
-                    }
+            // Sub calls canceled by success_limit are not failures.
+            if (fin->cntl.FailedInline()) {
+                if (fin->cntl.ErrorCode() != EPCHANENOUGH &&
+                    _current_fail.fetch_add(1, butil::memory_order_relaxed) + 1
+                    == _fail_limit) {
+                    CancelOthers(fin, ECANCELED);
+                }
+            } else {
+                // Count successful sub calls, if success_limit is reached,
+                // cancel others. The order is visible to OnComplete() by the
+                // release fence on _current_done.
+                fin->success_order =
+                    _current_success.fetch_add(1, butil::memory_order_relaxed);
+                if (_incremental_merge &&
+                    fin->success_order < _success_limit) {
+                    MergeIncrementally(fin);
+                }
+                if (fin->success_order + 1 == _success_limit &&
+                    _success_limit != _ndone) {
+                    CancelOthers(fin, EPCHANENOUGH);
                 }
             }
             // NOTE: Don't access any member after the fetch_add because
@@ -258,11 +286,11 @@ public:
             // after fetch_or.
             uint32_t val = _current_done.load(butil::memory_order_relaxed);
             // Lower 31 bits are number of finished sub calls. Cancel sub calls
-            // if not all of them finish.
+            // if not all of them finish. EPCHANENOUGH from the parent
+            // ParallelChannel is passed down.
             if ((val & 0x7fffffff) != (uint32_t)_ndone) {
-                for (int i = 0; i < _ndone; ++i) {
-                    bthread_id_error(sub_done(i)->cntl.call_id(), ECANCELED);
-                }
+                CancelOthers(NULL, _cntl->ErrorCode() == EPCHANENOUGH ?
+                             EPCHANENOUGH : ECANCELED);
             }
             // NOTE: Don't access any member after the fetch_or because
             // another thread may already go down and Destroy()-ed this object.
@@ -307,36 +335,28 @@ public:
         // to be failed since the RPC is still considered to be successful if
         // nfailed is less than fail_limit
         int nfailed = _current_fail.load(butil::memory_order_relaxed);
-        if (nfailed < _fail_limit) {
+        if (_incremental_merge) {
+            // Responses were merged in OnSubDoneRun().
+            if (!_merge_error.empty()) {
+                nfailed = _ndone;
+                _cntl->SetFailed(ERESPONSE, "%s", _merge_error.c_str());
+            }
+        } else if (nfailed < _fail_limit) {
+            std::string error_text;
             for (int i = 0; i < _ndone; ++i) {
                 SubDone* sd = sub_done(i);
-                google::protobuf::Message* sub_res = sd->cntl._response;
-                if (!sd->cntl.FailedInline()) {  // successful calls only.
-                    if (sd->merger == NULL) {
-                        try {
-                            _cntl->_response->MergeFrom(*sub_res);
-                        } catch (const std::exception& e) {
-                            nfailed = _ndone;
-                            _cntl->SetFailed(ERESPONSE, "%s", e.what());
-                            break;
-                        }
-                    } else {
-                        ResponseMerger::Result res =
-                            sd->merger->Merge(_cntl->_response, sub_res);
-                        switch (res) {
-                        case ResponseMerger::MERGED:
-                            break;
-                        case ResponseMerger::FAIL:
-                            ++nfailed;
-                            break;
-                        case ResponseMerger::FAIL_ALL:
-                            nfailed = _ndone;
-                            _cntl->SetFailed(
-                                ERESPONSE,
-                                "Fail to merge response of channel[%d]", i);
-                            break;
-                        }
-                    }
+                // successful calls within success_limit only.
+                if (sd->cntl.FailedInline() ||
+                    sd->success_order >= _success_limit) {
+                    continue;
+                }
+                const ResponseMerger::Result res = Merge(i, &error_text);
+                if (res == ResponseMerger::FAIL) {
+                    ++nfailed;
+                } else if (res == ResponseMerger::FAIL_ALL) {
+                    nfailed = _ndone;
+                    _cntl->SetFailed(ERESPONSE, "%s", error_text.c_str());
+                    break;
                 }
             }
         }
@@ -350,7 +370,7 @@ public:
                 for (int i = 0; i < _ndone; ++i) {
                     Controller* sub_cntl = &sub_done(i)->cntl;
                     const int ec = sub_cntl->ErrorCode();
-                    if (ec != 0 && ec != ECANCELED) {
+                    if (ec != 0 && ec != ECANCELED && ec != EPCHANENOUGH) {
                         if (unified_ec == ECANCELED) {
                             unified_ec = ec;
                         } else if (unified_ec != ec) {
@@ -390,6 +410,61 @@ public:
         CHECK_EQ(0, bthread_id_unlock_and_destroy(saved_cid));
     }
 
+    // Merge response of the i-th sub call into the response of _cntl.
+    // `error_text' is set when FAIL_ALL is returned.
+    ResponseMerger::Result Merge(int i, std::string* error_text) {
+        SubDone* sd = sub_done(i);
+        google::protobuf::Message* sub_res = sd->cntl._response;
+        if (sd->merger == NULL) {
+            try {
+                _cntl->_response->MergeFrom(*sub_res);
+            } catch (const std::exception& e) {
+                *error_text = e.what();
+                return ResponseMerger::FAIL_ALL;
+            }
+            return ResponseMerger::MERGED;
+        }
+        const ResponseMerger::Result res =
+            sd->merger->Merge(_cntl->_response, sub_res);
+        if (res == ResponseMerger::FAIL_ALL) {
+            butil::string_printf(
+                error_text, "Fail to merge response of channel[%d]", i);
+        }
+        return res;
+    }
+
+    // Merge response of a successful sub call as soon as it finishes.
+    // Failures of merging are counted like failed sub calls.
+    void MergeIncrementally(SubDone* fin) {
+        ResponseMerger::Result res = ResponseMerger::MERGED;
+        {
+            BAIDU_SCOPED_LOCK(_merge_mutex);
+            if (!_merge_error.empty()) {
+                // The RPC is failed by a previous merge.
+                return;
+            }
+            res = Merge(fin - _sub_done, &_merge_error);
+        }
+        if (res == ResponseMerger::FAIL) {
+            if (_current_fail.fetch_add(1, butil::memory_order_relaxed) + 1
+                == _fail_limit) {
+                CancelOthers(fin, ECANCELED);
+            }
+        } else if (res == ResponseMerger::FAIL_ALL) {
+            CancelOthers(fin, ECANCELED);
+        }
+    }
+
+    // Cancel sub calls except `except' with `error_code'.
+    void CancelOthers(const SubDone* except, int error_code) {
+        for (int i = 0; i < _ndone; ++i) {
+            SubDone* sd = sub_done(i);
+            if (except != sd) {
+                bthread_id_error(sd->cntl.call_id(), error_code);
+            }
+        }
+    }
+
     int sub_done_size() const { return _ndone; }
     SubDone* sub_done(int i) { return &_sub_done[i]; }
     const SubDone* sub_done(int i) const { return &_sub_done[i]; }
@@ -421,6 +496,8 @@ public:
 
 private:
     int _fail_limit;
+    int _success_limit;
+    bool _incremental_merge;
     int _ndone;
     int _nchan;
 #if defined(__clang__)
@@ -429,7 +506,11 @@ private:
     int _memsize;
 #endif
     butil::atomic<int> _current_fail;
+    butil::atomic<int> _current_success;
     butil::atomic<uint32_t> _current_done;
+    // Protect the response of _cntl and _merge_error in incremental merging
+    bthread::Mutex _merge_mutex;
+    std::string _merge_error;
     Controller* _cntl;
     google::protobuf::Closure* _user_done;
     bthread_t _callmethod_bthread;
@@ -546,6 +627,57 @@ void* ParallelChannel::RunDoneAndDestroy(void* arg) {
     return NULL;
 }
 
+void ParallelChannel::ShareSerializedRequest(ParallelChannelDone* d,
+                                             const SubCall* aps) const {
+    // SerializeRequestDefault depends on nothing but the request and
+    // compress_type which is same in all sub controllers, so a request
+    // shared by sub calls(the broadcasting case) is serialized once and
+    // referenced by all of them, including retries and backup requests.
+    const google::protobuf::Message* shared_req = NULL;
+    int nshared = 0;
+    int first_index = -1;
+    for (size_t i = 0, j = 0; i < _chans.size(); ++i) {
+        if (aps[i].is_skip()) {
+            continue;
+        }
+        const int index = j++;
+        const Channel* sub = dynamic_cast<const Channel*>(_chans[i].chan);
+        if (aps[i].request == NULL || sub == NULL ||
+            sub->_serialize_request != SerializeRequestDefault) {
+            continue;
+        }
+        if (shared_req == NULL) {
+            shared_req = aps[i].request;
+            first_index = index;
+        }
+        nshared += (aps[i].request == shared_req);
+    }
+    if (nshared < 2 ||
+        shared_req->GetDescriptor() == SerializedRequest::descriptor()) {
+        // SerializedRequest is referenced without serialization already.
+        return;
+    }
+    butil::IOBuf buf;
+    Controller* first_cntl = &d->sub_done(first_index)->cntl;
+    SerializeRequestDefault(&buf, first_cntl, shared_req);
+    if (first_cntl->FailedInline()) {
+        // The sub call fails before RPC. Others fail by themselves.
+        return;
+    }
+    for (size_t i = 0, j = 0; i < _chans.size(); ++i) {
+        if (aps[i].is_skip()) {
+            continue;
+        }
+        Controller* sub_cntl = &d->sub_done(j++)->cntl;
+        const Channel* sub = dynamic_cast<const Channel*>(_chans[i].chan);
+        if (aps[i].request == shared_req && sub != NULL &&
+            sub->_serialize_request == SerializeRequestDefault) {
+            sub_cntl->_request_buf = buf;
+            sub_cntl->add_flag(Controller::FLAGS_REQUEST_SERIALIZED);
+        }
+    }
+}
+
 void ParallelChannel::CallMethod(
     const google::protobuf::MethodDescriptor* method,
     google::protobuf::RpcController* cntl_base,
@@ -580,6 +712,7 @@ void ParallelChannel::CallMethod(
     ParallelChannelDone* d = NULL;
     int ndone = nchan;
     int fail_limit = 1;
+    int success_limit = 1;
     DEFINE_SMALL_ARRAY(SubCall, aps, nchan, 64);
 
     if (cntl->FailedInline()) {
@@ -633,9 +766,20 @@ void ParallelChannel::CallMethod(
             fail_limit = ndone;
         }
     }
+    if (_options.success_limit < 0) {
+        success_limit = ndone;
+    } else {
+        success_limit = _options.success_limit;
+        if (success_limit < 1) {
+            success_limit = 1;
+        } else if (success_limit > ndone) {
+            success_limit = ndone;
+        }
+    }
     
-    d = ParallelChannelDone::Create(fail_limit, ndone, aps, nchan,
-                                    cntl, done);
+    d = ParallelChannelDone::Create(fail_limit, success_limit,
+                                    _options.incremental_merge, ndone, aps,
+                                    nchan, cntl, done);
     if (NULL == d) {
         cntl->SetFailed(ENOMEM, "Fail to new ParallelChannelDone");
         goto FAIL;
@@ -671,6 +815,7 @@ void ParallelChannel::CallMethod(
     } else {
         cntl->_abstime_us = -1;
     }
+    ShareSerializedRequest(d, aps);
     d->SaveThreadInfoOfCallsite();
     CHECK_EQ(0, bthread_id_unlock(cid));
     // Don't touch `cntl' and `d' again (for async RPC)
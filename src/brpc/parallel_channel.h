@@ -119,6 +119,7 @@ public:
         // e.g. 10 sub channels & fail_limit=4, 3 failed before merging, 1
         // failed after merging, the rpc call will be treated as 4 sub
         // failures which reaches fail_limit, thus the call is failed.
+        // Sub RPC canceled by success_limit are not replenished.
         FAIL,
 
         // make the call to ParallelChannel fail.
@@ -152,6 +153,25 @@ struct ParallelChannelOptions {
     // does not fail unless all sub RPC failed.
     int fail_limit;
 
+    // The RPC completes as soon as so many sub RPC succeed, other sub RPC
+    // are canceled with EPCHANENOUGH which is not counted as failures and
+    // not fed back to load balancers or circuit breakers. Only responses of
+    // the first `success_limit' successful sub RPC are merged.
+    // Useful for reading replicas, e.g. 3 sub channels & success_limit=2
+    // let the slowest replica not delay the RPC.
+    // Default: number of sub channels, meaning that the RPC waits for all
+    // sub RPC.
+    int success_limit;
+
+    // Merge each successful sub response as soon as it arrives rather than
+    // merging all of them after the last sub RPC finishes, so that merging
+    // overlaps with waiting for slower sub RPC. Merges are serialized by a
+    // lock but their order is the order of arrival, which ResponseMerger
+    // and MergeFrom() must not depend on. Responses are merged even if the
+    // RPC fails by fail_limit later.
+    // Default: false
+    bool incremental_merge;
+
     // Construct with default options.
     ParallelChannelOptions();
 };
@@ -167,6 +187,8 @@ struct ParallelChannelOptions {
 //   * timeout.
 // There's no separate retrying inside ParallelChannel. To retry, enable
 // retrying of sub channels.
+class ParallelChannelDone;
+
 class ParallelChannel : public ChannelBase {
 friend class Controller;
 public:
@@ -242,6 +264,9 @@ public:
 protected:
     static void* RunDoneAndDestroy(void* arg);
     int CheckHealth();
+    // Serialize the request shared by sub calls only once.
+    void ShareSerializedRequest(ParallelChannelDone* d,
+                                const SubCall* aps) const;
 
     ParallelChannelOptions _options;
     ChannelList _chans;
@@ -14,6 +14,7 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <memory>
 #include "butil/containers/flat_map.h"
 #include "brpc/log.h"
 #include "brpc/load_balancer.h"
@@ -52,6 +53,8 @@ private:
     struct SubChannel : public Channel {
         SharedLoadBalancer* lb() { return _lb.get(); }
         std::vector<ServerId> tmp;
+        // Set when backups of the partition are decided by its own latencies.
+        std::unique_ptr<BackupRequestPolicy> backup_policy;
     };
 
     SubChannel* _subs;
@@ -91,8 +94,21 @@ int PartitionChannelBase::Init(int num_partition_kinds,
         LOG(ERROR) << "Fail to new Channels[" << num_partition_kinds << "]";
         return -1;
     }
+    const bool backup_per_partition =
+        (options.backup_request_per_partition &&
+         options.backup_request_policy == NULL);
     for (int i = 0; i < num_partition_kinds; ++i) {
-        if (_subs[i].Init("list://", load_balancer_name, &options) != 0) {
+        ChannelOptions sub_options = options;
+        if (backup_per_partition) {
+            _subs[i].backup_policy.reset(new (std::nothrow)
+                LatencyPercentileBackupPolicy(options.partition_backup_options));
+            if (_subs[i].backup_policy == NULL) {
+                LOG(ERROR) << "Fail to new backup policy of partition[" << i << "]";
+                return -1;
+            }
+            sub_options.backup_request_policy = _subs[i].backup_policy.get();
+        }
+        if (_subs[i].Init("list://", load_balancer_name, &sub_options) != 0) {
             LOG(ERROR) << "Fail to init sub channel[" << i << "]";
             return -1;
         }
@@ -108,6 +124,7 @@ int PartitionChannelBase::Init(int num_partition_kinds,
     ParallelChannelOptions pchan_options;
     pchan_options.timeout_ms = options.timeout_ms;
     pchan_options.fail_limit = options.fail_limit;
+    pchan_options.incremental_merge = options.incremental_merge;
     if (ParallelChannel::Init(&pchan_options) != 0) {
         LOG(ERROR) << "Fail to init PartitionChannel as ParallelChannel";
         return -1;
@@ -185,7 +202,10 @@ void PartitionChannelBase::OnRemovedServers(
 // ================= PartitionChannel ====================
 
 PartitionChannelOptions::PartitionChannelOptions()
-    : ChannelOptions(), fail_limit(-1) {
+    : ChannelOptions()
+    , fail_limit(-1)
+    , incremental_merge(false)
+    , backup_request_per_partition(false) {
 }
 
 PartitionChannel::PartitionChannel()
@@ -61,6 +61,21 @@ struct PartitionChannelOptions : public ChannelOptions {
     // will not be canceled until all sub calls failed.
     int fail_limit;
 
+    // Check comments on ParallelChannelOptions.incremental_merge
+    // Default: false
+    bool incremental_merge;
+
+    // When this field is true and backup_request_policy is NULL, every
+    // partition owns a LatencyPercentileBackupPolicy created with
+    // `partition_backup_options'. Latencies are measured per partition, so
+    // that a hot partition whose servers become slow sends backup requests
+    // to other servers of the same partition at the percentile of its own
+    // latencies and within its own budget, without affecting partitions
+    // that are not loaded. max_retry must be positive for backup requests.
+    // Default: false
+    bool backup_request_per_partition;
+    LatencyPercentileBackupPolicyOptions partition_backup_options;
+
     // Check comments on ParallelChannel.AddChannel in parallel_channel.h
     // Sub channels in PartitionChannel share the same mapper and merger.
     butil::intrusive_ptr<CallMapper> call_mapper;
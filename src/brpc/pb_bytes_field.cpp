@@ -0,0 +1,151 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdint.h>
+#include "brpc/pb_bytes_field.h"
+
+namespace brpc {
+
+// Wire types of protobuf.
+enum {
+    WIRETYPE_VARINT = 0,
+    WIRETYPE_FIXED64 = 1,
+    WIRETYPE_LENGTH_DELIMITED = 2,
+    WIRETYPE_START_GROUP = 3,
+    WIRETYPE_END_GROUP = 4,
+    WIRETYPE_FIXED32 = 5,
+};
+
+// Same with the limit of CodedInputStream.
+static const int MAX_GROUP_DEPTH = 100;
+
+// Decode the varint at `offset' of `buf' without consuming it.
+// Returns bytes of the varint, 0 on error.
+static size_t PeekVarint(const butil::IOBuf& buf, size_t offset,
+                         uint64_t* value) {
+    uint8_t tmp[10];
+    const size_t n = buf.copy_to(tmp, sizeof(tmp), offset);
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i) {
+        v |= (uint64_t)(tmp[i] & 0x7F) << (7 * i);
+        if (!(tmp[i] & 0x80)) {
+            *value = v;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Move the field at front of `in' into `out'. `tag' of `tag_size' bytes
+// is already decoded.
+// Returns 0 on success, -1 otherwise.
+static int MoveField(butil::IOBuf* in, butil::IOBuf* out,
+                     uint64_t tag, size_t tag_size, int depth) {
+    size_t size = tag_size;
+    switch (tag & 7) {
+    case WIRETYPE_VARINT: {
+        uint64_t dummy = 0;
+        const size_t n = PeekVarint(*in, tag_size, &dummy);
+        if (n == 0) {
+            return -1;
+        }
+        size += n;
+    } break;
+    case WIRETYPE_FIXED64:
+        size += 8;
+        break;
+    case WIRETYPE_FIXED32:
+        size += 4;
+        break;
+    case WIRETYPE_LENGTH_DELIMITED: {
+        uint64_t len = 0;
+        const size_t n = PeekVarint(*in, tag_size, &len);
+        if (n == 0 || len > in->size()) {
+            return -1;
+        }
+        size += n + len;
+    } break;
+    case WIRETYPE_START_GROUP: {
+        if (depth >= MAX_GROUP_DEPTH) {
+            return -1;
+        }
+        in->cutn(out, tag_size);
+        while (true) {
+            uint64_t inner_tag = 0;
+            const size_t n = PeekVarint(*in, 0, &inner_tag);
+            if (n == 0) {
+                return -1;
+            }
+            if ((inner_tag & 7) == WIRETYPE_END_GROUP) {
+                if ((inner_tag >> 3) != (tag >> 3)) {
+                    return -1;
+                }
+                in->cutn(out, n);
+                return 0;
+            }
+            if (MoveField(in, out, inner_tag, n, depth + 1) != 0) {
+                return -1;
+            }
+        }
+    }
+    default:
+        return -1;
+    }
+    if (size > in->size()) {
+        return -1;
+    }
+    in->cutn(out, size);
+    return 0;
+}
+
+int CutPbBytesField(butil::IOBuf* buf, int field_number, butil::IOBuf* field) {
+    if (field_number <= 0) {
+        return -1;
+    }
+    butil::IOBuf in(*buf);
+    butil::IOBuf rest;
+    butil::IOBuf payload;
+    bool found = false;
+    while (!in.empty()) {
+        uint64_t tag = 0;
+        const size_t tag_size = PeekVarint(in, 0, &tag);
+        if (tag_size == 0 || (tag >> 3) == 0) {
+            return -1;
+        }
+        if ((tag >> 3) == (uint64_t)field_number &&
+            (tag & 7) == WIRETYPE_LENGTH_DELIMITED) {
+            uint64_t len = 0;
+            const size_t n = PeekVarint(in, tag_size, &len);
+            if (n == 0 || len > in.size() ||
+                tag_size + n + len > in.size()) {
+                return -1;
+            }
+            in.pop_front(tag_size + n);
+            payload.clear();
+            in.cutn(&payload, len);
+            found = true;
+        } else if (MoveField(&in, &rest, tag, tag_size, 0) != 0) {
+            return -1;
+        }
+    }
+    if (!found) {
+        return 0;
+    }
+    buf->swap(rest);
+    field->swap(payload);
+    return 1;
+}
+
+} // namespace brpc
@@ -0,0 +1,38 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_PB_BYTES_FIELD_H
+#define BRPC_PB_BYTES_FIELD_H
+
+#include "butil/iobuf.h"
+
+namespace brpc {
+
+// Cut the length-delimited field(bytes, string or message) numbered
+// `field_number' out of serialized protobuf message `buf' and put its
+// payload into `field'. Both are done by referencing blocks of `buf'
+// without copying, so that big payloads can be passed or appended to other
+// IOBuf (e.g. response_attachment()) without being copied into std::string
+// by parsing. What's left in `buf' is still a serialized message without
+// the field, which can be parsed as usual. Only top-level fields are
+// searched. If the field occurs multiple times, the last one wins as in
+// protobuf and former ones are dropped.
+// Returns 1 if the field is cut, 0 if it's not found, -1 if `buf' is not a
+// valid serialized message, in which case `buf' and `field' are unchanged.
+int CutPbBytesField(butil::IOBuf* buf, int field_number, butil::IOBuf* field);
+
+} // namespace brpc
+
+#endif  // BRPC_PB_BYTES_FIELD_H
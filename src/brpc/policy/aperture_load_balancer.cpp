@@ -0,0 +1,302 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <unistd.h>                                    // getpid
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "butil/endpoint.h"
+#include "butil/string_printf.h"
+#include "butil/time.h"
+#include "butil/scoped_lock.h"
+#include "brpc/socket.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/hasher.h"
+#include "brpc/policy/aperture_load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(aperture_client_index, -1, "Index of this process among all "
+             "clients of the cluster, which spreads apertures of clients "
+             "evenly over servers together with -aperture_client_count");
+BRPC_VALIDATE_GFLAG(aperture_client_index, PassValidate);
+DEFINE_int32(aperture_client_count, 0, "Number of clients of the cluster, "
+             "0 means unknown and positions of clients are hashed");
+BRPC_VALIDATE_GFLAG(aperture_client_count, NonNegativeInteger);
+DEFINE_int32(aperture_min_size, 12, "Minimum number of servers selected by "
+             "an aperture load balancer");
+BRPC_VALIDATE_GFLAG(aperture_min_size, PositiveInteger);
+DEFINE_double(aperture_high_load, 2.0, "Grow the aperture when servers "
+              "inside have more in-flight requests on average");
+BRPC_VALIDATE_GFLAG(aperture_high_load, PassValidate);
+DEFINE_double(aperture_low_load, 0.5, "Shrink the aperture when servers "
+              "inside have less in-flight requests on average");
+BRPC_VALIDATE_GFLAG(aperture_low_load, PassValidate);
+DEFINE_int32(aperture_update_interval_ms, 1000, "Interval of resizing "
+             "apertures by one server");
+BRPC_VALIDATE_GFLAG(aperture_update_interval_ms, PositiveInteger);
+
+// Position of this process in the ring, in [0, 1).
+static double ClientPosition() {
+    const int index = FLAGS_aperture_client_index;
+    const int count = FLAGS_aperture_client_count;
+    if (count > 0 && index >= 0 && index < count) {
+        return (double)index / count;
+    }
+    const std::string key =
+        butil::string_printf("%s:%d", butil::my_ip_cstr(), (int)getpid());
+    return MurmurHash32(key.data(), key.size()) / 4294967296.0;
+}
+
+ApertureLoadBalancer::ApertureLoadBalancer(const LoadBalancer* inner)
+    : _inner(inner)
+    , _inner_lb(inner->New())
+    , _wanted_size(0)
+    , _naperture(0)
+    , _inflight(0)
+    , _last_adjust_us(0) {
+}
+
+ApertureLoadBalancer::~ApertureLoadBalancer() {
+    if (_inner_lb) {
+        _inner_lb->Destroy();
+        _inner_lb = NULL;
+    }
+}
+
+size_t ApertureLoadBalancer::MinApertureSize(size_t nserver) {
+    size_t n = std::max(FLAGS_aperture_min_size, 1);
+    const int nclient = FLAGS_aperture_client_count;
+    if (nclient > 0) {
+        // Apertures of evenly spread clients cover all servers.
+        n = std::max(n, (nserver + nclient - 1) / nclient + 1);
+    }
+    return n;
+}
+
+// All clients must order servers in a same way, SocketIds are not used
+// because they're different in each process.
+ApertureLoadBalancer::RingNode
+ApertureLoadBalancer::MakeRingNode(const ServerId& id) {
+    RingNode node;
+    node.server = id;
+    SocketUniquePtr ptr;
+    if (Socket::AddressFailedAsWell(id.id, &ptr) >= 0) {
+        const butil::EndPointStr str = butil::endpoint2str(ptr->remote_side());
+        node.hash = MurmurHash32(str.c_str(), strlen(str.c_str()));
+    } else {
+        node.hash = MurmurHash32(&id.id, sizeof(id.id));
+    }
+    return node;
+}
+
+size_t ApertureLoadBalancer::AddToRing(const std::vector<ServerId>& servers) {
+    const size_t old_size = _ring.size();
+    for (size_t i = 0; i < servers.size(); ++i) {
+        const RingNode node = MakeRingNode(servers[i]);
+        if (!std::binary_search(_ring.begin(), _ring.begin() + old_size,
+                                node, RingNodeLess())) {
+            _ring.push_back(node);
+        }
+    }
+    if (_ring.size() == old_size) {
+        return 0;
+    }
+    std::sort(_ring.begin(), _ring.end(), RingNodeLess());
+    size_t n = 1;
+    for (size_t i = 1; i < _ring.size(); ++i) {
+        // Remove duplicated servers in the batch.
+        if (RingNodeLess()(_ring[n - 1], _ring[i])) {
+            _ring[n++] = _ring[i];
+        }
+    }
+    _ring.resize(n);
+    return n - old_size;
+}
+
+size_t ApertureLoadBalancer::RemoveFromRing(
+    const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        const RingNode node = MakeRingNode(servers[i]);
+        std::vector<RingNode>::iterator it = std::lower_bound(
+            _ring.begin(), _ring.end(), node, RingNodeLess());
+        if (it == _ring.end() || it->server != servers[i]) {
+            // The socket was recycled and the hash differs, search it.
+            for (it = _ring.begin(); it != _ring.end() &&
+                     it->server != servers[i]; ++it) {}
+        }
+        if (it != _ring.end()) {
+            _ring.erase(it);
+            ++count;
+        }
+    }
+    return count;
+}
+
+void ApertureLoadBalancer::UpdateAperture() {
+    const size_t nserver = _ring.size();
+    const size_t size = std::min(
+        nserver, std::max(_wanted_size, MinApertureSize(nserver)));
+    std::set<ServerId> aperture;
+    if (nserver > 0) {
+        const size_t start = (size_t)(ClientPosition() * nserver) % nserver;
+        for (size_t i = 0; i < size; ++i) {
+            aperture.insert(_ring[(start + i) % nserver].server);
+        }
+    }
+    std::vector<ServerId> added;
+    std::vector<ServerId> removed;
+    std::set_difference(aperture.begin(), aperture.end(),
+                        _aperture.begin(), _aperture.end(),
+                        std::back_inserter(added));
+    std::set_difference(_aperture.begin(), _aperture.end(),
+                        aperture.begin(), aperture.end(),
+                        std::back_inserter(removed));
+    // Add before removing so that the inner load balancer is never empty
+    // during the change.
+    if (!added.empty()) {
+        _inner_lb->AddServersInBatch(added);
+    }
+    if (!removed.empty()) {
+        _inner_lb->RemoveServersInBatch(removed);
+    }
+    _aperture.swap(aperture);
+    _naperture.store(size, butil::memory_order_relaxed);
+}
+
+bool ApertureLoadBalancer::AddServer(const ServerId& id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (AddToRing(std::vector<ServerId>(1, id)) == 0) {
+        return false;
+    }
+    UpdateAperture();
+    return true;
+}
+
+bool ApertureLoadBalancer::RemoveServer(const ServerId& id) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (RemoveFromRing(std::vector<ServerId>(1, id)) == 0) {
+        return false;
+    }
+    UpdateAperture();
+    return true;
+}
+
+size_t ApertureLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const size_t n = AddToRing(servers);
+    if (n) {
+        UpdateAperture();
+    }
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t ApertureLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const size_t n = RemoveFromRing(servers);
+    if (n) {
+        UpdateAperture();
+    }
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+void ApertureLoadBalancer::AdjustApertureSize(int64_t now_us) {
+    int64_t last = _last_adjust_us.load(butil::memory_order_relaxed);
+    if (now_us - last < FLAGS_aperture_update_interval_ms * 1000L ||
+        !_last_adjust_us.compare_exchange_strong(
+            last, now_us, butil::memory_order_relaxed)) {
+        return;
+    }
+    const int64_t naperture = _naperture.load(butil::memory_order_relaxed);
+    if (naperture <= 0) {
+        return;
+    }
+    const double load =
+        (double)_inflight.load(butil::memory_order_relaxed) / naperture;
+    BAIDU_SCOPED_LOCK(_mutex);
+    const size_t size = _aperture.size();
+    if (load > FLAGS_aperture_high_load && size < _ring.size()) {
+        _wanted_size = size + 1;
+    } else if (load < FLAGS_aperture_low_load &&
+               size > MinApertureSize(_ring.size())) {
+        _wanted_size = size - 1;
+    } else {
+        return;
+    }
+    UpdateAperture();
+}
+
+int ApertureLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    AdjustApertureSize(butil::gettimeofday_us());
+    const int rc = _inner_lb->SelectServer(in, out);
+    if (rc != 0) {
+        return rc;
+    }
+    _inflight.fetch_add(1, butil::memory_order_relaxed);
+    // The inner load balancer receives feedbacks of all its selections.
+    out->need_feedback = true;
+    return 0;
+}
+
+void ApertureLoadBalancer::Feedback(const CallInfo& info) {
+    _inflight.fetch_sub(1, butil::memory_order_relaxed);
+    // Servers just removed from the aperture are ignored by the inner one.
+    _inner_lb->Feedback(info);
+}
+
+size_t ApertureLoadBalancer::aperture_size() {
+    return _naperture.load(butil::memory_order_relaxed);
+}
+
+ApertureLoadBalancer* ApertureLoadBalancer::New() const {
+    return new (std::nothrow) ApertureLoadBalancer(_inner);
+}
+
+void ApertureLoadBalancer::Destroy() {
+    delete this;
+}
+
+void ApertureLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "aperture_";
+        _inner_lb->Describe(os, options);
+        return;
+    }
+    size_t nserver = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        nserver = _ring.size();
+    }
+    os << "Aperture{n=" << nserver
+       << " aperture=" << _naperture.load(butil::memory_order_relaxed)
+       << " inflight=" << _inflight.load(butil::memory_order_relaxed)
+       << " inner_lb=";
+    _inner_lb->Describe(os, options);
+    os << '}';
+}
+
+}  // namespace policy
+} // namespace brpc
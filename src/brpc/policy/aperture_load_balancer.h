@@ -0,0 +1,100 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_APERTURE_LOAD_BALANCER_H
+#define BRPC_POLICY_APERTURE_LOAD_BALANCER_H
+
+#include <set>                                         // std::set
+#include <vector>                                      // std::vector
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Select servers from a subset (aperture) of all servers, so that clients of
+// a large cluster do not connect to every server. All clients order servers
+// in a same ring by hashes of their addresses, and each client takes
+// consecutive servers starting from its position in the ring:
+//  - Position of the client is -aperture_client_index / -aperture_client_count
+//    when both are set, so that apertures of clients are spread evenly
+//    (deterministic aperture). Otherwise the position is hashed from the
+//    address and pid of this process.
+//  - The aperture contains at least -aperture_min_size servers, and enough
+//    servers to cover the ring when -aperture_client_count is set.
+//  - The aperture grows by one server every -aperture_update_interval_ms
+//    when servers inside have more than -aperture_high_load in-flight
+//    requests on average, and shrinks by one when they have less than
+//    -aperture_low_load.
+// Servers in the aperture are selected by a load balancer created from
+// `inner', which receives all Feedback() of its servers.
+class ApertureLoadBalancer : public LoadBalancer {
+public:
+    explicit ApertureLoadBalancer(const LoadBalancer* inner);
+    ~ApertureLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    ApertureLoadBalancer* New() const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+    // Number of servers in the aperture.
+    size_t aperture_size();
+
+private:
+    struct RingNode {
+        uint32_t hash;
+        ServerId server;
+    };
+    struct RingNodeLess {
+        bool operator()(const RingNode& a, const RingNode& b) const {
+            return a.hash != b.hash ? a.hash < b.hash : a.server < b.server;
+        }
+    };
+    // Smallest aperture allowed for `nserver' servers.
+    static size_t MinApertureSize(size_t nserver);
+    static RingNode MakeRingNode(const ServerId& id);
+    size_t AddToRing(const std::vector<ServerId>& servers);
+    size_t RemoveFromRing(const std::vector<ServerId>& servers);
+    // Recompute the aperture and apply differences to _inner_lb.
+    // _mutex must be locked.
+    void UpdateAperture();
+    // Grow or shrink the aperture according to in-flight requests.
+    void AdjustApertureSize(int64_t now_us);
+
+    const LoadBalancer* _inner;
+    LoadBalancer* _inner_lb;
+    butil::Mutex _mutex;
+    // Sorted by RingNodeLess.
+    std::vector<RingNode> _ring;
+    std::set<ServerId> _aperture;
+    // Wanted size of the aperture, may be larger than the ring.
+    size_t _wanted_size;
+    butil::atomic<int64_t> _naperture;
+    butil::atomic<int64_t> _inflight;
+    butil::atomic<int64_t> _last_adjust_us;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_APERTURE_LOAD_BALANCER_H
@@ -0,0 +1,168 @@
+// Copyright (c) 2018 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <mutex>                                  // std::unique_lock
+#include <algorithm>                              // std::max
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/auto_concurrency_limiter.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(auto_cl_sample_window_ms, 1000, "Duration of a sampling "
+             "window of max_concurrency=\"auto\", in which qps and latency "
+             "of a method are measured");
+BRPC_VALIDATE_GFLAG(auto_cl_sample_window_ms, PositiveInteger);
+
+DEFINE_int32(auto_cl_min_sample_count, 100, "Successful requests in a "
+             "window less than this value are not used for adjusting the "
+             "limit");
+BRPC_VALIDATE_GFLAG(auto_cl_min_sample_count, PositiveInteger);
+
+DEFINE_int32(auto_cl_initial_max_concurrency, 40,
+             "Limit before the first sampling window ends");
+BRPC_VALIDATE_GFLAG(auto_cl_initial_max_concurrency, PositiveInteger);
+
+DEFINE_int32(auto_cl_min_max_concurrency, 4,
+             "The limit is never adjusted below this value");
+BRPC_VALIDATE_GFLAG(auto_cl_min_max_concurrency, PositiveInteger);
+
+DEFINE_double(auto_cl_explore_ratio, 0.3, "The limit is set to "
+              "peak_qps * min_latency * (1 + this value) to find out "
+              "higher qps");
+
+DEFINE_double(auto_cl_ema_alpha, 0.1, "Smoothing factor for min_latency "
+              "to fall and peak_qps to decay");
+
+DEFINE_int32(auto_cl_remeasure_interval_ms, 30000, "The limit is lowered "
+             "for a window every so many milliseconds to remeasure the "
+             "latency without queueing");
+BRPC_VALIDATE_GFLAG(auto_cl_remeasure_interval_ms, PositiveInteger);
+
+// Ratio of the limit during remeasuring.
+static const double REMEASURE_RATIO = 0.75;
+
+AutoConcurrencyLimiter::AutoConcurrencyLimiter()
+    : _max_concurrency(FLAGS_auto_cl_initial_max_concurrency)
+    , _sw_start_us(0)
+    , _sw_nsuccess(0)
+    , _sw_latency_sum_us(0)
+    , _min_latency_us(0)
+    , _peak_qps(0)
+    , _remeasure_start_us(0)
+    , _remeasuring(false) {
+}
+
+bool AutoConcurrencyLimiter::OnRequested(int current_concurrency) {
+    return current_concurrency <=
+        _max_concurrency.load(butil::memory_order_relaxed);
+}
+
+void AutoConcurrencyLimiter::OnResponded(bool success, int64_t latency_us) {
+    if (!success) {
+        // Latencies of failed requests are not representative, e.g. timed
+        // out by clients or rejected by user code.
+        return;
+    }
+    _sw_nsuccess.fetch_add(1, butil::memory_order_relaxed);
+    _sw_latency_sum_us.fetch_add(latency_us, butil::memory_order_relaxed);
+
+    const int64_t now_us = butil::gettimeofday_us();
+    const int64_t start_us = _sw_start_us.load(butil::memory_order_relaxed);
+    if (now_us - start_us < FLAGS_auto_cl_sample_window_ms * 1000L) {
+        return;
+    }
+    // Only one thread ends the window, others continue sampling.
+    if (!_mutex.try_lock()) {
+        return;
+    }
+    std::unique_lock<butil::Mutex> mu(_mutex, std::adopt_lock);
+    if (_sw_start_us.load(butil::memory_order_relaxed) != start_us) {
+        return;  // Ended by another thread.
+    }
+    const int64_t nsuccess =
+        _sw_nsuccess.exchange(0, butil::memory_order_relaxed);
+    const int64_t latency_sum_us =
+        _sw_latency_sum_us.exchange(0, butil::memory_order_relaxed);
+    _sw_start_us.store(now_us, butil::memory_order_relaxed);
+    if (start_us == 0) {
+        // The first request, nothing measured yet.
+        _remeasure_start_us =
+            now_us + FLAGS_auto_cl_remeasure_interval_ms * 1000L;
+        return;
+    }
+    if (nsuccess < FLAGS_auto_cl_min_sample_count) {
+        return;
+    }
+    const double avg_latency_us = latency_sum_us / (double)nsuccess;
+    const double qps = nsuccess * 1000000.0 / (now_us - start_us);
+    const double alpha = FLAGS_auto_cl_ema_alpha;
+    if (_remeasuring) {
+        // Queues were drained in this window.
+        _min_latency_us = avg_latency_us;
+        _remeasuring = false;
+        _remeasure_start_us =
+            now_us + FLAGS_auto_cl_remeasure_interval_ms * 1000L;
+    } else if (_min_latency_us <= 0) {
+        _min_latency_us = avg_latency_us;
+    } else if (avg_latency_us < _min_latency_us) {
+        _min_latency_us = avg_latency_us * alpha + _min_latency_us * (1 - alpha);
+    }
+    if (qps >= _peak_qps) {
+        _peak_qps = qps;
+    } else {
+        _peak_qps = qps * alpha + _peak_qps * (1 - alpha);
+    }
+
+    double next = _peak_qps * _min_latency_us / 1000000.0 *
+        (1 + FLAGS_auto_cl_explore_ratio);
+    if (now_us >= _remeasure_start_us) {
+        next *= REMEASURE_RATIO;
+        _remeasuring = true;
+    }
+    _max_concurrency.store(
+        std::max((int)ceil(next), (int)FLAGS_auto_cl_min_max_concurrency),
+        butil::memory_order_relaxed);
+}
+
+int AutoConcurrencyLimiter::MaxConcurrency() const {
+    return _max_concurrency.load(butil::memory_order_relaxed);
+}
+
+AutoConcurrencyLimiter* AutoConcurrencyLimiter::New() const {
+    return new (std::nothrow) AutoConcurrencyLimiter;
+}
+
+void AutoConcurrencyLimiter::Destroy() {
+    delete this;
+}
+
+void AutoConcurrencyLimiter::Describe(
+    std::ostream& os, const DescribeOptions&) const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    os << "auto{max_concurrency=" << MaxConcurrency()
+       << " min_latency_us=" << (int64_t)_min_latency_us
+       << " peak_qps=" << (int64_t)_peak_qps;
+    if (_remeasuring) {
+        os << " remeasuring";
+    }
+    os << '}';
+}
+
+} // namespace policy
+} // namespace brpc
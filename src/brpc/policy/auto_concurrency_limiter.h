@@ -0,0 +1,63 @@
+// Copyright (c) 2018 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_POLICY_AUTO_CONCURRENCY_LIMITER_H
+#define BRPC_POLICY_AUTO_CONCURRENCY_LIMITER_H
+
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/concurrency_limiter.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Adjust max concurrency of a method by Little's law: without queueing,
+// concurrency = peak_qps * min_latency. Both are measured in successive
+// sampling windows and the limit is set a little higher than the product
+// to find out higher qps. Requests exceeding the limit wait in queues and
+// only inflate latencies, rejecting them early with ELIMIT lets clients
+// retry other servers. The limit is lowered for a window periodically to
+// drain the queues and remeasure the latency when being not overloaded.
+class AutoConcurrencyLimiter : public ConcurrencyLimiter {
+public:
+    AutoConcurrencyLimiter();
+    bool OnRequested(int current_concurrency);
+    void OnResponded(bool success, int64_t latency_us);
+    int MaxConcurrency() const;
+    AutoConcurrencyLimiter* New() const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions& options) const;
+
+private:
+    butil::atomic<int> _max_concurrency;
+
+    // Samples of current window.
+    butil::atomic<int64_t> _sw_start_us;
+    butil::atomic<int64_t> _sw_nsuccess;
+    butil::atomic<int64_t> _sw_latency_sum_us;
+
+    // Protecting following fields, updated when a window ends.
+    mutable butil::Mutex _mutex;
+    double _min_latency_us;
+    double _peak_qps;
+    int64_t _remeasure_start_us;
+    bool _remeasuring;
+};
+
+} // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_AUTO_CONCURRENCY_LIMITER_H
@@ -15,14 +15,16 @@
 // Authors: Ge,Jun (gejun@baidu.com)
 //          Zhangyi Chen (chenzhangyi01@baidu.com)
 
+#include <map>
 #include <google/protobuf/descriptor.h>         // MethodDescriptor
 #include <google/protobuf/message.h>            // Message
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
-#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/coded_stream.h>    // CodedOutputStream
 #include "butil/logging.h"                       // LOG()
 #include "butil/time.h"
 #include "butil/iobuf.h"                         // butil::IOBuf
 #include "butil/raw_pack.h"                      // RawPacker RawUnpacker
+#include "butil/crc32c.h"                        // butil::crc32c::Value
+#include "bthread/bthread.h"                     // bthread_usleep
 #include "brpc/controller.h"                    // Controller
 #include "brpc/socket.h"                        // Socket
 #include "brpc/server.h"                        // Server
@@ -30,13 +32,19 @@
 #include "brpc/compress.h"                      // ParseFromCompressedData
 #include "brpc/stream_impl.h"
 #include "brpc/rpc_dump.h"                      // SampledRequest
+#include "brpc/reloadable_flags.h"              // BRPC_VALIDATE_GFLAG
 #include "brpc/policy/baidu_rpc_meta.pb.h"      // RpcRequestMeta
 #include "brpc/policy/baidu_rpc_protocol.h"
 #include "brpc/policy/most_common_message.h"
 #include "brpc/policy/streaming_rpc_protocol.h"
+#include "brpc/policy/pbrpc_helpers.h"          // SerializeHeaderAndMeta
 #include "brpc/details/usercode_backup_pool.h"
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/continuous_profiler.h"
 #include "brpc/details/server_private_accessor.h"
+#include "brpc/details/response_cache.h"         // ResponseCache
+#include "brpc/details/request_coalescer.h"      // RequestCoalescer
+#include "brpc/details/usercode_pool.h"          // UserCodePool
 
 extern "C" {
 void bthread_assign_data(void* data);
@@ -44,18 +52,116 @@ void bthread_assign_data(void* data);
 
 
 namespace brpc {
+
+DECLARE_bool(rpc_deliver_timeout);
+DECLARE_int64(socket_max_unwritten_bytes);
+
 namespace policy {
 
 DEFINE_bool(baidu_protocol_use_fullname, true,
             "If this flag is true, baidu_std puts service.full_name in requests"
             ", otherwise puts service.name (required by jprotobuf).");
 
+DEFINE_bool(baidu_std_attachment_checksum, false,
+            "Put crc32c of attachments into baidu_std meta. Attachments "
+            "with checksums are always verified by the receiver.");
+BRPC_VALIDATE_GFLAG(baidu_std_attachment_checksum, PassValidate);
+
+DEFINE_int64(baidu_std_bulk_response_size, 0,
+             "Responses not smaller than so many bytes are written after "
+             "smaller responses queued on the same connection, non-positive "
+             "values disable the reordering");
+BRPC_VALIDATE_GFLAG(baidu_std_bulk_response_size, PassValidate);
+
+DEFINE_int64(baidu_std_chunk_size, 0,
+             "Responses larger than so many bytes are split into chunks of "
+             "this size which are written after smaller responses queued on "
+             "the same connection, if the client is able to reassemble them. "
+             "Non-positive values disable the splitting");
+BRPC_VALIDATE_GFLAG(baidu_std_chunk_size, PassValidate);
+
+DEFINE_int64(baidu_std_streaming_response_size, 0,
+             "Uncompressed responses not smaller than so many bytes are "
+             "written chunk by chunk while being serialized rather than "
+             "after being serialized as a whole, if -baidu_std_chunk_size "
+             "is positive and the client is able to reassemble chunks. "
+             "Non-positive values disable the streaming");
+BRPC_VALIDATE_GFLAG(baidu_std_streaming_response_size, PassValidate);
+
+DEFINE_int32(baidu_std_streaming_drain_timeout_ms, 3000,
+             "A response written while being serialized fails and the "
+             "connection is closed if the overcrowded connection is not "
+             "drained within so many milliseconds or before the deadline "
+             "of the RPC");
+BRPC_VALIDATE_GFLAG(baidu_std_streaming_drain_timeout_ms, PositiveInteger);
+
 // Notes:
 // 1. 12-byte header [PRPC][body_size][meta_size]
 // 2. body_size and meta_size are in network byte order
 // 3. Use service->full_name() + method_name to specify the method to call
 // 4. `attachment_size' is set iff request/response has attachment
-// 5. Not supported: chunk_info
+// 5. `attachment_checksum' is masked crc32c of the attachment, set iff
+//    -baidu_std_attachment_checksum is on and there's attachment.
+// 6. Not supported: chunk_info
+// 7. A message may be split into chunks with 12-byte headers
+//    [PCHK][body_size][meta_size], whose metas only have correlation_id and
+//    `chunk'. Bodies of the chunks are concatenated into the body of the
+//    original message, see RpcChunkMeta.
+// 8. Servers only split responses to clients setting
+//    `accept_chunked_response'.
+
+// Chunks being reassembled on a connection, stored as parsing_context of
+// the socket. Accessed by the parsing thread only except `accept_chunks'.
+class RpcChunkContext : public Destroyable {
+public:
+    struct Partial {
+        size_t body_size;
+        size_t meta_size;
+        butil::IOBuf body;
+    };
+
+    RpcChunkContext() : accept_chunks(false) {}
+    void Destroy() { delete this; }
+
+    // Indexed by correlation_id.
+    std::map<int64_t, Partial> partials;
+    // Set when the peer accepts chunked responses.
+    butil::atomic<bool> accept_chunks;
+};
+
+static RpcChunkContext* GetChunkContext(Socket* socket) {
+    Destroyable* ctx = socket->parsing_context();
+    if (ctx == NULL) {
+        RpcChunkContext* chunk_ctx = new RpcChunkContext;
+        if (socket->initialize_parsing_context(&chunk_ctx)) {
+            return chunk_ctx;
+        }
+        ctx = socket->parsing_context();
+    }
+    // The connection may be shared with other protocols in principle.
+    return dynamic_cast<RpcChunkContext*>(ctx);
+}
+
+static bool AcceptChunks(Socket* socket) {
+    RpcChunkContext* ctx = dynamic_cast<RpcChunkContext*>(
+        socket->parsing_context());
+    return ctx && ctx->accept_chunks.load(butil::memory_order_relaxed);
+}
+
+static inline void SetAttachmentChecksum(RpcMeta* meta,
+                                         const butil::IOBuf& attachment) {
+    if (FLAGS_baidu_std_attachment_checksum) {
+        meta->set_attachment_checksum(
+            butil::crc32c::Mask(butil::crc32c::Value(attachment)));
+    }
+}
+
+static inline bool VerifyAttachmentChecksum(const RpcMeta& meta,
+                                            const butil::IOBuf& attachment) {
+    return !meta.has_attachment_checksum() ||
+        butil::crc32c::Unmask(meta.attachment_checksum()) ==
+        butil::crc32c::Value(attachment);
+}
 
 // Pack header into `buf'
 inline void PackRpcHeader(char* rpc_header, int meta_size, int payload_size) {
@@ -69,37 +175,285 @@ inline void PackRpcHeader(char* rpc_header, int meta_size, int payload_size) {
 
 static void SerializeRpcHeaderAndMeta(
     butil::IOBuf* out, const RpcMeta& meta, int payload_size) {
+    SerializeHeaderAndMeta<12>(out, meta, payload_size, PackRpcHeader);
+}
+
+inline void PackRpcChunkHeader(char* rpc_header, int meta_size,
+                               int payload_size) {
+    uint32_t* dummy = (uint32_t*)rpc_header;
+    *dummy = *(uint32_t*)"PCHK";
+    butil::RawPacker(rpc_header + 4)
+        .pack32(meta_size + payload_size)
+        .pack32(meta_size);
+}
+
+// Write `msg' packed by SerializeRpcHeaderAndMeta into `sock' as chunks
+// carrying at most `chunk_size' bytes of the body each. Each chunk is a
+// separate write so that other messages can be sent between them.
+static int WriteRpcChunks(Socket* sock, int64_t correlation_id,
+                          butil::IOBuf* msg, size_t chunk_size,
+                          const Socket::WriteOptions& wopt) {
+    char header[12];
+    msg->cutn(header, sizeof(header));
+    uint32_t body_size;
+    uint32_t meta_size;
+    butil::RawUnpacker(header + 4).unpack32(body_size).unpack32(meta_size);
+    RpcMeta chunk_meta;
+    chunk_meta.set_correlation_id(correlation_id);
+    chunk_meta.mutable_chunk()->set_body_size(body_size);
+    chunk_meta.mutable_chunk()->set_meta_size(meta_size);
+    while (!msg->empty()) {
+        const size_t n = std::min(chunk_size, msg->size());
+        butil::IOBuf chunk;
+        SerializeHeaderAndMeta<12>(&chunk, chunk_meta, n, PackRpcChunkHeader);
+        msg->cutn(&chunk, n);
+        if (sock->Write(&chunk, &wopt) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Serialized bytes are buffered and written into the socket as chunks of
+// `chunk_size' bytes once enough bytes are buffered, so that a message is
+// sent while the rest of it is being serialized. Writes are retried after
+// the socket is drained when it's overcrowded or chunks written by this
+// writer but not written out reach -socket_max_unwritten_bytes, which bounds
+// the memory of unwritten chunks. If the socket is not
+// drained within -baidu_std_streaming_drain_timeout_ms or before
+// `deadline_us', the writing fails with EOVERCROWDED and the socket is
+// SetFailed since the message is partially written.
+class RpcChunkWriter : public google::protobuf::io::ZeroCopyOutputStream {
+public:
+    // `body_size' and `meta_size' describe the message being written.
+    // `deadline_us' is in microseconds since the Epoch, -1 means no deadline.
+    RpcChunkWriter(Socket* sock, int64_t correlation_id,
+                   size_t body_size, size_t meta_size, size_t chunk_size,
+                   int64_t deadline_us)
+        : _sock(sock)
+        , _chunk_size(chunk_size)
+        , _deadline_us(deadline_us)
+        , _written_before(sock->written_bytes())
+        , _submitted(0)
+        , _buf_stream(&_buf)
+        , _failed(false) {
+        _chunk_meta.set_correlation_id(correlation_id);
+        _chunk_meta.mutable_chunk()->set_body_size(body_size);
+        _chunk_meta.mutable_chunk()->set_meta_size(meta_size);
+        // Smaller responses are written between the chunks.
+        _wopt.priority = -1;
+    }
+
+    bool Next(void** data, int* size) {
+        // Bytes given by previous Next() are all filled now.
+        while (_buf.size() >= _chunk_size) {
+            if (!WriteChunk(_chunk_size)) {
+                return false;
+            }
+        }
+        return _buf_stream.Next(data, size);
+    }
+    void BackUp(int count) { _buf_stream.BackUp(count); }
+    google::protobuf::int64 ByteCount() const {
+        return _buf_stream.ByteCount();
+    }
+
+    // Write `attachment' and all buffered bytes, must be called after the
+    // serialization.
+    // Returns 0 on success, -1 otherwise.
+    int Flush(butil::IOBuf* attachment) {
+        _buf.append(attachment->movable());
+        while (!_buf.empty()) {
+            if (!WriteChunk(std::min(_chunk_size, _buf.size()))) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // True if writing into the socket failed, errno is set.
+    bool failed() const { return _failed; }
+
+private:
+    bool WriteChunk(size_t n) {
+        if (_failed) {
+            return false;
+        }
+        butil::IOBuf chunk;
+        SerializeHeaderAndMeta<12>(&chunk, _chunk_meta, n, PackRpcChunkHeader);
+        _buf.cutn(&chunk, n);
+        const size_t nwrite = chunk.size();
+        int64_t wait_end_us = -1;
+        while (true) {
+            if (!overcrowded()) {
+                if (_sock->Write(&chunk, &_wopt) == 0) {
+                    _submitted += nwrite;
+                    return true;
+                }
+                if (errno != EOVERCROWDED) {
+                    _failed = true;
+                    return false;
+                }
+            }
+            const int64_t now_us = butil::gettimeofday_us();
+            if (wait_end_us < 0) {
+                wait_end_us = now_us +
+                    FLAGS_baidu_std_streaming_drain_timeout_ms * 1000L;
+                if (_deadline_us >= 0 && _deadline_us < wait_end_us) {
+                    wait_end_us = _deadline_us;
+                }
+            }
+            if (now_us >= wait_end_us) {
+                _failed = true;
+                _sock->SetFailed(EOVERCROWDED, "%s is not drained in time "
+                                 "for writing a response in chunks",
+                                 _sock->description().c_str());
+                errno = EOVERCROWDED;
+                return false;
+            }
+            bthread_usleep(1000);
+        }
+    }
+
+    // Socket counts a write as unwritten only after KeepWrite takes it,
+    // which may be tens of milliseconds later, while chunks are written much
+    // faster during the serialization. Count unwritten chunks of this writer
+    // by bytes written out by the socket as well.
+    bool overcrowded() const {
+        const int64_t written =
+            (int64_t)(_sock->written_bytes() - _written_before);
+        return _submitted - written >= FLAGS_socket_max_unwritten_bytes;
+    }
+
+    Socket* _sock;
+    size_t _chunk_size;
+    int64_t _deadline_us;
+    size_t _written_before;
+    int64_t _submitted;
+    Socket::WriteOptions _wopt;
+    RpcMeta _chunk_meta;
+    butil::IOBuf _buf;
+    butil::IOBufAsZeroCopyOutputStream _buf_stream;
+    bool _failed;
+};
+
+int WriteRpcChunksWhileSerializing(
+    Socket* sock, const RpcMeta& meta, const google::protobuf::Message& res,
+    int res_size, butil::IOBuf* attachment, size_t chunk_size,
+    int64_t deadline_us) {
     const int meta_size = meta.ByteSize();
-    if (meta_size <= 244) { // most common cases
-        char header_and_meta[12 + meta_size];
-        PackRpcHeader(header_and_meta, meta_size, payload_size);
-        ::google::protobuf::io::ArrayOutputStream arr_out(header_and_meta + 12, meta_size);
-        ::google::protobuf::io::CodedOutputStream coded_out(&arr_out);
-        meta.SerializeWithCachedSizes(&coded_out); // not calling ByteSize again
-        CHECK(!coded_out.HadError());
-        out->append(header_and_meta, sizeof(header_and_meta));
-    } else {
-        char header[12];
-        PackRpcHeader(header, meta_size, payload_size);
-        out->append(header, sizeof(header));
-        butil::IOBufAsZeroCopyOutputStream buf_stream(out);
-        ::google::protobuf::io::CodedOutputStream coded_out(&buf_stream);
+    const size_t body_size = meta_size + res_size + attachment->size();
+    RpcChunkWriter writer(sock, meta.correlation_id(), body_size,
+                          meta_size, chunk_size, deadline_us);
+    {
+        google::protobuf::io::CodedOutputStream coded_out(&writer);
         meta.SerializeWithCachedSizes(&coded_out);
-        CHECK(!coded_out.HadError());
+        // Sizes are cached by the caller.
+        res.SerializeWithCachedSizes(&coded_out);
+        if (coded_out.HadError()) {
+            if (!writer.failed()) {
+                errno = ENOMEM;
+            }
+            // Some chunks may be written, the connection is unusable.
+            const int saved_errno = errno;
+            sock->SetFailed();
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    if (writer.ByteCount() != meta_size + res_size) {
+        LOG(ERROR) << "Serialized " << writer.ByteCount() - meta_size
+                   << " bytes of response, expected " << res_size
+                   << " bytes. Is the response modified during sending?";
+        errno = ERESPONSE;
+        sock->SetFailed();
+        return -1;
+    }
+    return writer.Flush(attachment);
+}
+
+// Returns true if `res' should be written by WriteRpcChunksWhileSerializing,
+// in which case sizes of `res' are cached and written into `res_size' and
+// the chunk size is written into `chunk_size'.
+static bool ShouldStreamResponse(Socket* sock,
+                                 const google::protobuf::Message& res,
+                                 int* res_size, int64_t* chunk_size) {
+    // NOTE: save the gflags which may be reloaded at any time.
+    const int64_t min_size = FLAGS_baidu_std_streaming_response_size;
+    const int64_t size = FLAGS_baidu_std_chunk_size;
+    if (min_size <= 0 || size <= 0 || !AcceptChunks(sock)) {
+        return false;
+    }
+    const int byte_size = res.ByteSize();
+    if (byte_size < min_size) {
+        return false;
+    }
+    *res_size = byte_size;
+    *chunk_size = size;
+    return true;
+}
+
+// Append the chunk at the front of `source' to the message it belongs to.
+// Returns the message when all its chunks arrived, NULL otherwise.
+static ParseResult ParseRpcChunk(butil::IOBuf* source, Socket* socket,
+                                 uint32_t body_size, uint32_t meta_size) {
+    RpcChunkContext* ctx = (socket ? GetChunkContext(socket) : NULL);
+    if (ctx == NULL) {
+        return MakeParseError(PARSE_ERROR_NO_RESOURCE);
+    }
+    source->pop_front(12);
+    RpcMeta meta;
+    butil::IOBuf meta_buf;
+    source->cutn(&meta_buf, meta_size);
+    if (!ParsePbFromIOBuf(&meta, meta_buf) || !meta.has_chunk()) {
+        LOG(ERROR) << "Fail to parse chunk meta from " << *socket;
+        return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
     }
+    const RpcChunkMeta& chunk = meta.chunk();
+    if (chunk.body_size() < chunk.meta_size() || chunk.meta_size() < 0 ||
+        chunk.body_size() > (int64_t)FLAGS_max_body_size) {
+        LOG(ERROR) << "Invalid chunk of body_size=" << chunk.body_size()
+                   << " meta_size=" << chunk.meta_size() << " from "
+                   << *socket;
+        return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
+    }
+    RpcChunkContext::Partial& p = ctx->partials[meta.correlation_id()];
+    if (p.body.empty()) {
+        p.body_size = chunk.body_size();
+        p.meta_size = chunk.meta_size();
+    }
+    source->cutn(&p.body, body_size - meta_size);
+    if (p.body.size() < p.body_size) {
+        return MakeMessage(NULL);
+    }
+    if (p.body.size() > p.body_size) {
+        LOG(ERROR) << "Chunks of correlation_id=" << meta.correlation_id()
+                   << " exceed body_size=" << p.body_size;
+        return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
+    }
+    MostCommonMessage* msg = MostCommonMessage::Get();
+    p.body.cutn(&msg->meta, p.meta_size);
+    msg->payload.swap(p.body);
+    ctx->partials.erase(meta.correlation_id());
+    return MakeMessage(msg);
 }
 
 ParseResult ParseRpcMessage(butil::IOBuf* source, Socket* socket,
                             bool /*read_eof*/, const void*) {
     char header_buf[12];
     const size_t n = source->copy_to(header_buf, sizeof(header_buf));
+    bool is_chunk = false;
     if (n >= 4) {
         void* dummy = header_buf;
         if (*(const uint32_t*)dummy != *(const uint32_t*)"PRPC") {
-            return MakeParseError(PARSE_ERROR_TRY_OTHERS);
+            if (*(const uint32_t*)dummy != *(const uint32_t*)"PCHK") {
+                return MakeParseError(PARSE_ERROR_TRY_OTHERS);
+            }
+            is_chunk = true;
         }
     } else {
-        if (memcmp(header_buf, "PRPC", n) != 0) {
+        if (memcmp(header_buf, "PRPC", n) != 0 &&
+            memcmp(header_buf, "PCHK", n) != 0) {
             return MakeParseError(PARSE_ERROR_TRY_OTHERS);
         }
     }
@@ -125,6 +479,9 @@ ParseResult ParseRpcMessage(butil::IOBuf* source, Socket* socket,
         source->pop_front(sizeof(header_buf) + body_size);
         return MakeParseError(PARSE_ERROR_TRY_OTHERS);
     }
+    if (is_chunk) {
+        return ParseRpcChunk(source, socket, body_size, meta_size);
+    }
     source->pop_front(sizeof(header_buf));
     MostCommonMessage* msg = MostCommonMessage::Get();
     source->cutn(&msg->meta, meta_size);
@@ -132,6 +489,84 @@ ParseResult ParseRpcMessage(butil::IOBuf* source, Socket* socket,
     return MakeMessage(msg);
 }
 
+// The response cache which a request was looked up in.
+struct CachedRpcResponse {
+    // NULL if the method does not cache responses.
+    ResponseCache* cache;
+    ResponseCache::Key key;
+    // Send `response' instead of serializing the response message.
+    bool hit;
+    ResponseCache::Response response;
+    // Non-NULL if the request is the first one of `key' in flight, whose
+    // result is passed to identical requests coalesced meanwhile.
+    RequestCoalescer* coalescer;
+
+    CachedRpcResponse() : cache(NULL), hit(false), coalescer(NULL) {}
+};
+
+static void SendRpcResponseWithCache(int64_t correlation_id,
+                                     Controller* cntl,
+                                     const google::protobuf::Message* req,
+                                     const google::protobuf::Message* res,
+                                     const Server* server,
+                                     MethodStatus* method_status_raw,
+                                     long start_parse_us,
+                                     CachedRpcResponse cached);
+
+// Land the flight of `cached' with `result' when going out of scope, so
+// that coalesced requests are answered after the response of the first
+// request is written. Nothing is done if `cached' is not in flight.
+class ScopedLandFlight {
+public:
+    explicit ScopedLandFlight(const CachedRpcResponse* cached)
+        : _cached(cached) {}
+    ~ScopedLandFlight() {
+        if (_cached->coalescer != NULL) {
+            _cached->coalescer->Land(_cached->key, result);
+        }
+    }
+
+    RequestCoalescer::Result result;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedLandFlight);
+    const CachedRpcResponse* _cached;
+};
+
+// A request waiting for the identical request in flight.
+class CoalescedRpcRequest : public RequestCoalescer::Waiter {
+public:
+    CoalescedRpcRequest(int64_t correlation_id, Controller* cntl,
+                        const Server* server, MethodStatus* method_status,
+                        long start_parse_us)
+        : _correlation_id(correlation_id)
+        , _cntl(cntl)
+        , _server(server)
+        , _method_status(method_status)
+        , _start_parse_us(start_parse_us) {}
+
+    void OnFlightDone(const RequestCoalescer::Result& result) {
+        CachedRpcResponse cached;
+        if (result.error_code == 0) {
+            cached.hit = true;
+            cached.response = result.response;
+        } else {
+            _cntl->SetFailed(result.error_code, "%s",
+                             result.error_text.c_str());
+        }
+        SendRpcResponseWithCache(_correlation_id, _cntl, NULL, NULL, _server,
+                                 _method_status, _start_parse_us, cached);
+        delete this;
+    }
+
+private:
+    int64_t _correlation_id;
+    Controller* _cntl;
+    const Server* _server;
+    MethodStatus* _method_status;
+    long _start_parse_us;
+};
+
 // Used by UT, can't be static.
 void SendRpcResponse(int64_t correlation_id,
                      Controller* cntl, 
@@ -140,36 +575,82 @@ void SendRpcResponse(int64_t correlation_id,
                      const Server* server,
                      MethodStatus* method_status_raw,
                      long start_parse_us) {
+    SendRpcResponseWithCache(correlation_id, cntl, req, res, server,
+                             method_status_raw, start_parse_us,
+                             CachedRpcResponse());
+}
+
+static void SendRpcResponseWithCache(int64_t correlation_id,
+                                     Controller* cntl,
+                                     const google::protobuf::Message* req,
+                                     const google::protobuf::Message* res,
+                                     const Server* server,
+                                     MethodStatus* method_status_raw,
+                                     long start_parse_us,
+                                     CachedRpcResponse cached) {
     ControllerPrivateAccessor accessor(cntl);
     Span* span = accessor.span();
     if (span) {
         span->set_start_send_us(butil::cpuwide_time_us());
     }
+    accessor.mark_phase(RPC_SERVER_START_SEND);
     Socket* sock = accessor.get_sending_socket();
     ScopedMethodStatus method_status(method_status_raw);
     std::unique_ptr<Controller, LogErrorTextAndDelete> recycle_cntl(cntl);
-    std::unique_ptr<const google::protobuf::Message> recycle_req(req);
-    std::unique_ptr<const google::protobuf::Message> recycle_res(res);
+    ScopedServerMessages recycle_messages(cntl, method_status_raw, req, res);
     ScopedRemoveConcurrency remove_concurrency_dummy(server, cntl);
     
     StreamId response_stream_id = accessor.response_stream();
 
     if (cntl->IsCloseConnection()) {
+        if (cached.coalescer != NULL) {
+            RequestCoalescer::Result result;
+            result.error_code = ECLOSE;
+            result.error_text = "Close connection";
+            cached.coalescer->Land(cached.key, result);
+        }
         StreamClose(response_stream_id);
         sock->SetFailed();
         return;
     }
     bool append_body = false;
+    // Serialized while being written, see WriteRpcChunksWhileSerializing.
+    bool stream_body = false;
+    int stream_body_size = 0;
+    int64_t stream_chunk_size = 0;
     butil::IOBuf res_body;
     // `res' can be NULL here, in which case we don't serialize it
     // If user calls `SetFailed' on Controller, we don't serialize
     // response either
     CompressType type = cntl->response_compress_type();
-    if (res != NULL && !cntl->Failed()) {
+    if (cached.hit) {
+        res_body.swap(cached.response.body);
+        cntl->response_attachment().swap(cached.response.attachment);
+        cntl->set_response_compress_type(
+            (CompressType)cached.response.compress_type);
+        append_body = true;
+    } else if (res != NULL && !cntl->Failed()) {
         if (!res->IsInitialized()) {
             cntl->SetFailed(
                 ERESPONSE, "Missing required fields in response: %s", 
                 res->InitializationErrorString().c_str());
+        } else if (type == COMPRESS_TYPE_AUTO) {
+            if (method_status_raw == NULL ||
+                !method_status_raw->response_compressor()->Serialize(
+                    *res, &res_body, &type)) {
+                cntl->SetFailed(ERESPONSE, "Fail to serialize response, "
+                                "CompressType=auto");
+            } else {
+                // The picked type replaces AUTO and is packed into the meta.
+                cntl->set_response_compress_type(type);
+                append_body = true;
+            }
+        } else if (type == COMPRESS_TYPE_NONE &&
+                   cached.cache == NULL && cached.coalescer == NULL &&
+                   response_stream_id == INVALID_STREAM_ID &&
+                   ShouldStreamResponse(sock, *res, &stream_body_size,
+                                        &stream_chunk_size)) {
+            stream_body = true;
         } else if (!SerializeAsCompressedData(*res, &res_body, type)) {
             cntl->SetFailed(ERESPONSE, "Fail to serialize response, "
                             "CompressType=%s", CompressTypeToCStr(type));
@@ -178,12 +659,40 @@ void SendRpcResponse(int64_t correlation_id,
         }
     }
 
+    if (cntl->response_compress_type() == COMPRESS_TYPE_AUTO) {
+        // Nothing is compressed.
+        cntl->set_response_compress_type(COMPRESS_TYPE_NONE);
+    }
+
     // Don't use res->ByteSize() since it may be compressed
     size_t res_size = 0;
     size_t attached_size = 0;
+    if (stream_body) {
+        attached_size = cntl->response_attachment().length();
+    }
     if (append_body) {
         res_size = res_body.length();
         attached_size = cntl->response_attachment().length();
+        if (cached.cache != NULL && !cached.hit) {
+            // Blocks are shared with the cache rather than copied.
+            cached.response.body = res_body;
+            cached.response.attachment = cntl->response_attachment();
+            cached.response.compress_type = cntl->response_compress_type();
+            cached.cache->Put(cached.key, cached.response);
+        }
+    }
+    ScopedLandFlight land_flight(&cached);
+    if (cached.coalescer != NULL) {
+        RequestCoalescer::Result& result = land_flight.result;
+        if (append_body) {
+            result.response.body = res_body;
+            result.response.attachment = cntl->response_attachment();
+            result.response.compress_type = cntl->response_compress_type();
+        } else {
+            result.error_code =
+                (cntl->Failed() ? cntl->ErrorCode() : EINTERNAL);
+            result.error_text = cntl->ErrorText();
+        }
     }
 
     int error_code = cntl->ErrorCode();
@@ -204,6 +713,7 @@ void SendRpcResponse(int64_t correlation_id,
     meta.set_compress_type(cntl->response_compress_type());
     if (attached_size > 0) {
         meta.set_attachment_size(attached_size);
+        SetAttachmentChecksum(&meta, cntl->response_attachment());
     }
     SocketUniquePtr stream_ptr;
     if (response_stream_id != INVALID_STREAM_ID) {
@@ -218,7 +728,9 @@ void SendRpcResponse(int64_t correlation_id,
     }
 
     butil::IOBuf res_buf;
-    SerializeRpcHeaderAndMeta(&res_buf, meta, res_size + attached_size);
+    if (!stream_body) {
+        SerializeRpcHeaderAndMeta(&res_buf, meta, res_size + attached_size);
+    }
     if (append_body) {
         res_buf.append(res_body.movable());
         if (attached_size) {
@@ -226,8 +738,18 @@ void SendRpcResponse(int64_t correlation_id,
         }
     }
 
+    if (!stream_body) {
+        accessor.mark_phase(RPC_SERVER_SERIALIZED);
+    }
     if (span) {
-        span->set_response_size(res_buf.size());
+        span->set_response_size(stream_body ?
+                                stream_body_size + attached_size :
+                                res_buf.size());
+        if (FLAGS_rpc_phase_latency) {
+            span->Annotate("Serialized response in %lldus",
+                           (long long)accessor.phase_times().Between(
+                               RPC_SERVER_START_SEND, RPC_SERVER_SERIALIZED));
+        }
     }
     if (stream_ptr) {
         CHECK(accessor.remote_stream_settings() != NULL);
@@ -251,7 +773,29 @@ void SendRpcResponse(int64_t correlation_id,
         // users to set max_concurrency.
         Socket::WriteOptions wopt;
         wopt.ignore_eovercrowded = true;
-        if (sock->Write(&res_buf, &wopt) != 0) {
+        // Responses are matched by correlation ids, bulk ones don't have
+        // to block small ones behind them.
+        if (FLAGS_baidu_std_bulk_response_size > 0 &&
+            (int64_t)res_buf.size() >= FLAGS_baidu_std_bulk_response_size) {
+            wopt.priority = -1;
+        }
+        const int64_t chunk_size = FLAGS_baidu_std_chunk_size;
+        int rc = 0;
+        if (stream_body) {
+            rc = WriteRpcChunksWhileSerializing(
+                sock, meta, *res, stream_body_size,
+                &cntl->response_attachment(), stream_chunk_size,
+                cntl->deadline_us());
+            accessor.mark_phase(RPC_SERVER_SERIALIZED);
+        } else if (chunk_size > 0 && (int64_t)res_buf.size() > chunk_size + 12 &&
+                   AcceptChunks(sock)) {
+            // Smaller responses are written between the chunks.
+            wopt.priority = -1;
+            rc = WriteRpcChunks(sock, correlation_id, &res_buf, chunk_size, wopt);
+        } else {
+            rc = sock->Write(&res_buf, &wopt);
+        }
+        if (rc != 0) {
             const int errcode = errno;
             PLOG_IF(WARNING, errcode != EPIPE) << "Fail to write into " << *sock;
             cntl->SetFailed(errcode, "Fail to write into %s",
@@ -260,11 +804,15 @@ void SendRpcResponse(int64_t correlation_id,
         }
     }
 
+    accessor.mark_phase(RPC_SERVER_WRITTEN);
     if (span) {
         // TODO: this is not sent
         span->set_sent_us(butil::cpuwide_time_us());
     }
     if (method_status) {
+        if (FLAGS_rpc_phase_latency && !cntl->Failed()) {
+            method_status_raw->OnPhases(accessor.phase_times());
+        }
         method_status.release()->OnResponded(
             !cntl->Failed(), butil::cpuwide_time_us() - start_parse_us);
     }
@@ -281,11 +829,19 @@ struct CallMethodInBackupThreadArgs {
 
 static void CallMethodInBackupThread(void* void_args) {
     CallMethodInBackupThreadArgs* args = (CallMethodInBackupThreadArgs*)void_args;
+    ScopedProfiledMethod profiled_method(args->method);
     args->service->CallMethod(args->method, args->controller, args->request,
                               args->response, args->done);
     delete args;
 }
 
+static void CallMethodInMethodPool(void* void_args) {
+    CallMethodInBackupThreadArgs* args = (CallMethodInBackupThreadArgs*)void_args;
+    ScopedInheritedDeadline inherit_deadline(
+        static_cast<const Controller*>(args->controller));
+    CallMethodInBackupThread(args);
+}
+
 // Used by other protocols as well.
 void EndRunningCallMethodInPool(
     ::google::protobuf::Service* service,
@@ -320,6 +876,13 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         return;
     }
     const RpcRequestMeta &request_meta = meta.request();
+    if (request_meta.accept_chunked_response() &&
+        FLAGS_baidu_std_chunk_size > 0) {
+        RpcChunkContext* ctx = GetChunkContext(socket);
+        if (ctx) {
+            ctx->accept_chunks.store(true, butil::memory_order_relaxed);
+        }
+    }
 
     SampledRequest* sample = AskToBeSampled();
     if (sample) {
@@ -333,7 +896,8 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         sample->submit(start_parse_us);
     }
 
-    std::unique_ptr<Controller> cntl(new (std::nothrow) Controller);
+    std::unique_ptr<Controller, LogErrorTextAndDelete> cntl(
+        NewServerController());
     if (NULL == cntl.get()) {
         LOG(WARNING) << "Fail to new Controller";
         return;
@@ -343,11 +907,16 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
 
     ServerPrivateAccessor server_accessor(server);
     ControllerPrivateAccessor accessor(cntl.get());
+    accessor.mark_phase(RPC_SERVER_START_PARSE, start_parse_us);
     const bool security_mode = server->options().security_mode() &&
                                socket->user() == server_accessor.acceptor();
     if (request_meta.has_log_id()) {
         cntl->set_log_id(request_meta.log_id());
     }
+    if (request_meta.has_timeout_ms()) {
+        accessor.set_deadline(msg->received_us() + msg->base_real_us(),
+                              request_meta.timeout_ms());
+    }
     cntl->set_request_compress_type((CompressType)meta.compress_type());
     accessor.set_server(server)
         .set_security_mode(security_mode)
@@ -382,6 +951,9 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     }
 
     MethodStatus* method_status = NULL;
+    // Identical requests coalesced into this one must be answered even if
+    // this one fails before calling the method.
+    CachedRpcResponse cached;
     do {
         if (!server->IsRunning()) {
             cntl->SetFailed(ELOGOFF, "Server is stopping");
@@ -394,6 +966,10 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
             break;
         }
         
+        if (!server_accessor.AddTenantConcurrency(cntl.get())) {
+            cntl->SetFailed(ELIMIT, "Reached quota of the tenant");
+            break;
+        }
         if (!server_accessor.AddConcurrency(cntl.get())) {
             cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
                             server->options().max_concurrency);
@@ -442,9 +1018,22 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
             if (!method_status->OnRequested()) {
                 cntl->SetFailed(ELIMIT, "Reached %s's max_concurrency=%d",
                                 mp->method->full_name().c_str(),
-                                method_status->max_concurrency());
+                                method_status->MaxConcurrency());
                 break;
             }
+            if (!method_status->OnDispatched(msg->received_us())) {
+                cntl->SetFailed(ELIMIT, "%s is overloaded and the request has "
+                                "been queued for too long",
+                                mp->method->full_name().c_str());
+                break;
+            }
+        }
+        if (cntl->deadline_us() >= 0 &&
+            butil::fast_realtime_us() >= cntl->deadline_us()) {
+            // The client has given up, don't waste time on user code.
+            cntl->SetFailed(ERPCTIMEDOUT, "Deadline of %s has passed before "
+                            "it's processed", mp->method->full_name().c_str());
+            break;
         }
         google::protobuf::Service* svc = mp->service;
         const google::protobuf::MethodDescriptor* method = mp->method;
@@ -452,6 +1041,43 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         if (span) {
             span->ResetServerSpanName(method->full_name());
         }
+        RequestCoalescer* coalescer = NULL;
+        if (method_status && !meta.has_stream_settings()) {
+            cached.cache = method_status->response_cache();
+            if (cached.cache != NULL && !cached.cache->enabled()) {
+                cached.cache = NULL;
+            }
+            coalescer = method_status->request_coalescer();
+            if (coalescer != NULL && !coalescer->enabled()) {
+                coalescer = NULL;
+            }
+        }
+        if (cached.cache != NULL || coalescer != NULL) {
+            cached.key = ResponseCache::MakeKey(
+                meta.compress_type(), meta.attachment_size(), msg->payload);
+        }
+        if (cached.cache != NULL) {
+            if (cached.cache->Get(cached.key, &cached.response)) {
+                cached.hit = true;
+                msg.reset();
+                return SendRpcResponseWithCache(
+                    meta.correlation_id(), cntl.release(), NULL, NULL,
+                    server, method_status, start_parse_us, cached);
+            }
+        }
+        if (coalescer != NULL) {
+            CoalescedRpcRequest* waiter = new CoalescedRpcRequest(
+                meta.correlation_id(), cntl.get(), server,
+                method_status, start_parse_us);
+            if (coalescer->Join(cached.key, waiter)) {
+                // Answered when the identical request in flight is done.
+                cntl.release();
+                msg.reset();
+                return;
+            }
+            delete waiter;
+            cached.coalescer = coalescer;
+        }
         const int reqsize = static_cast<int>(msg->payload.size());
         butil::IOBuf req_buf;
         butil::IOBuf* req_buf_ptr = &msg->payload;
@@ -466,11 +1092,18 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
             msg->payload.cutn(&req_buf, att_size);
             req_buf_ptr = &req_buf;
             cntl->request_attachment().swap(msg->payload);
+            if (!VerifyAttachmentChecksum(meta, cntl->request_attachment())) {
+                cntl->SetFailed(EREQUEST, "Fail to verify checksum of "
+                                "attachment, attachment_size=%d",
+                                meta.attachment_size());
+                break;
+            }
         }
 
         CompressType req_cmp_type = (CompressType)meta.compress_type();
-        req.reset(svc->GetRequestPrototype(method).New());
-        if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
+        req.reset(NewServerRequest(svc, method, method_status, cntl.get()));
+        if (!ParseServerRequest(*req_buf_ptr, req_cmp_type, method,
+                                method_status, cntl.get(), req.get())) {
             cntl->SetFailed(EREQUEST, "Fail to parse request message, "
                             "CompressType=%s, request_size=%d", 
                             CompressTypeToCStr(req_cmp_type), reqsize);
@@ -481,19 +1114,59 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         msg.reset();
         req_buf.clear();
 
-        res.reset(svc->GetResponsePrototype(method).New());
+        res.reset(NewServerResponse(svc, method, method_status, cntl.get()));
         // `socket' will be held until response has been sent
-        google::protobuf::Closure* done = ::brpc::NewCallback<
-            int64_t, Controller*, const google::protobuf::Message*,
-            const google::protobuf::Message*, const Server*,
-            MethodStatus*, long>(
-                &SendRpcResponse, meta.correlation_id(), cntl.get(), 
-                req.get(), res.get(), server,
-                method_status, start_parse_us);
+        google::protobuf::Closure* done = NULL;
+        if (cached.cache == NULL && cached.coalescer == NULL) {
+            done = ::brpc::NewCallback<
+                int64_t, Controller*, const google::protobuf::Message*,
+                const google::protobuf::Message*, const Server*,
+                MethodStatus*, long>(
+                    &SendRpcResponse, meta.correlation_id(), cntl.get(), 
+                    req.get(), res.get(), server,
+                    method_status, start_parse_us);
+        } else {
+            done = ::brpc::NewCallback<
+                int64_t, Controller*, const google::protobuf::Message*,
+                const google::protobuf::Message*, const Server*,
+                MethodStatus*, long, CachedRpcResponse>(
+                    &SendRpcResponseWithCache, meta.correlation_id(),
+                    cntl.get(), req.get(), res.get(), server,
+                    method_status, start_parse_us, cached);
+        }
+        accessor.mark_phase(RPC_SERVER_START_CALLBACK);
         if (span) {
             span->set_start_callback_us(butil::cpuwide_time_us());
             span->AsParent();
         }
+        UserCodePool* pool =
+            (method_status ? method_status->usercode_pool() : NULL);
+        if (pool != NULL && pool->enabled()) {
+            CallMethodInBackupThreadArgs* args = new CallMethodInBackupThreadArgs;
+            args->service = svc;
+            args->method = method;
+            args->controller = cntl.get();
+            args->request = req.get();
+            args->response = res.get();
+            args->done = done;
+            if (pool->Run(CallMethodInMethodPool, args)) {
+                cntl.release();
+                req.release();
+                res.release();
+                return;
+            }
+            delete args;
+            cntl->SetFailed(ELIMIT, "Usercode pool of method=%s is full",
+                            method->full_name().c_str());
+            // `done' deletes `cntl', `req' and `res'.
+            cntl.release();
+            req.release();
+            res.release();
+            return done->Run();
+        }
+        // Calls to Channels inside the method don't wait beyond the deadline.
+        ScopedInheritedDeadline inherit_deadline(cntl.get());
+        ScopedProfiledMethod profiled_method(method);
         if (!FLAGS_usercode_in_pthread) {
             return svc->CallMethod(method, cntl.release(), 
                                    req.release(), res.release(), done);
@@ -511,9 +1184,9 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     
     // `cntl', `req' and `res' will be deleted inside `SendRpcResponse'
     // `socket' will be held until response has been sent
-    SendRpcResponse(meta.correlation_id(), cntl.release(), 
-                    req.release(), res.release(), server,
-                    method_status, -1);
+    SendRpcResponseWithCache(meta.correlation_id(), cntl.release(),
+                             req.release(), res.release(), server,
+                             method_status, -1, cached);
 }
 
 bool VerifyRpcRequest(const InputMessageBase* msg_base) {
@@ -562,6 +1235,7 @@ void ProcessRpcResponse(InputMessageBase* msg_base) {
     }
     
     ControllerPrivateAccessor accessor(cntl);
+    accessor.mark_phase(RPC_CLIENT_RECEIVED, msg->received_us());
     if (meta.has_stream_settings()) {
         accessor.set_remote_stream_settings(
                 new StreamSettings(meta.stream_settings()));
@@ -598,6 +1272,12 @@ void ProcessRpcResponse(InputMessageBase* msg_base) {
             msg->payload.cutn(&res_buf, att_size);
             res_buf_ptr = &res_buf;
             cntl->response_attachment().swap(msg->payload);
+            if (!VerifyAttachmentChecksum(meta, cntl->response_attachment())) {
+                cntl->SetFailed(ERESPONSE, "Fail to verify checksum of "
+                                "attachment, attachment_size=%d",
+                                meta.attachment_size());
+                break;
+            }
         }
 
         const CompressType res_cmp_type = (CompressType)meta.compress_type();
@@ -650,6 +1330,7 @@ void PackRpcRequest(butil::IOBuf* req_buf,
     if (cntl->has_log_id()) {
         request_meta->set_log_id(cntl->log_id());
     }
+    request_meta->set_accept_chunked_response(true);
     meta.set_correlation_id(correlation_id);
     StreamId request_stream_id = accessor.request_stream();
     if (request_stream_id != INVALID_STREAM_ID) {
@@ -667,6 +1348,7 @@ void PackRpcRequest(butil::IOBuf* req_buf,
     const size_t attached_size = cntl->request_attachment().length();
     if (attached_size) {
         meta.set_attachment_size(attached_size);
+        SetAttachmentChecksum(&meta, cntl->request_attachment());
     }
     Span* span = accessor.span();
     if (span) {
@@ -674,6 +1356,11 @@ void PackRpcRequest(butil::IOBuf* req_buf,
         request_meta->set_span_id(span->span_id());
         request_meta->set_parent_span_id(span->parent_span_id());
     }
+    if (FLAGS_rpc_deliver_timeout && cntl->deadline_us() >= 0) {
+        request_meta->set_timeout_ms(std::max(
+            (cntl->deadline_us() - butil::fast_realtime_us()) / 1000L,
+            (int64_t)0));
+    }
 
     SerializeRpcHeaderAndMeta(req_buf, meta, req_size + attached_size);
     req_buf->append(request_body);
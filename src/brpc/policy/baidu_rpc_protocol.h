@@ -23,6 +23,8 @@
 namespace brpc {
 namespace policy {
 
+class RpcMeta;
+
 // Parse binary format of baidu_std
 ParseResult ParseRpcMessage(butil::IOBuf* source, Socket *socket, bool read_eof,
                             const void *arg);
@@ -45,6 +47,19 @@ void PackRpcRequest(butil::IOBuf* buf,
                     const butil::IOBuf& request,
                     const Authenticator* auth);
 
+// Serialize `meta' and `res' whose sizes are cached and `res_size' bytes,
+// followed by `attachment', and write them into `sock' as chunks of at most
+// `chunk_size' bytes while serializing. Waits for `sock' to be drained when
+// it's overcrowded, so that unwritten bytes are bounded. If `sock' is not
+// drained within -baidu_std_streaming_drain_timeout_ms or before
+// `deadline_us'(microseconds since the Epoch, -1 means no deadline), `sock'
+// is SetFailed and errno is EOVERCROWDED.
+// Returns 0 on success, -1 otherwise and errno is set.
+int WriteRpcChunksWhileSerializing(Socket* sock, const RpcMeta& meta,
+                                   const google::protobuf::Message& res,
+                                   int res_size, butil::IOBuf* attachment,
+                                   size_t chunk_size, int64_t deadline_us);
+
 }  // namespace policy
 } // namespace brpc
 
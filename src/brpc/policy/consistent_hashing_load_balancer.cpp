@@ -14,11 +14,14 @@
 
 // Authors: Zhangyi Chen (chenzhangyi01@baidu.com)
 
+#include <math.h>                                              // ceil
 #include <algorithm>                                           // std::set_union
 #include <gflags/gflags.h>
 #include "butil/containers/flat_map.h"
 #include "butil/errno.h"
 #include "brpc/socket.h"
+#include "brpc/controller.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
 
 
@@ -29,16 +32,38 @@ namespace policy {
 DEFINE_int32(chash_num_replicas, 100, 
              "default number of replicas per server in chash");
 
+DEFINE_double(chash_load_epsilon, 0.25, "Servers of chash with bounded loads"
+              " take at most (1 + epsilon) times of the average in-flight "
+              "requests, exceeding requests go to next servers on the ring");
+BRPC_VALIDATE_GFLAG(chash_load_epsilon, PassValidate);
+
 ConsistentHashingLoadBalancer::ConsistentHashingLoadBalancer(HashFunc hash) 
     : _hash(hash)
-    , _num_replicas(FLAGS_chash_num_replicas) {
+    , _num_replicas(FLAGS_chash_num_replicas)
+    , _bounded_load(false)
+    , _total_inflight(0)
+    , _nspill(0) {
 }
 
 ConsistentHashingLoadBalancer::ConsistentHashingLoadBalancer(
         HashFunc hash,
         size_t num_replicas) 
     : _hash(hash)
-    , _num_replicas(num_replicas) {
+    , _num_replicas(num_replicas)
+    , _bounded_load(false)
+    , _total_inflight(0)
+    , _nspill(0) {
+}
+
+ConsistentHashingLoadBalancer::ConsistentHashingLoadBalancer(
+        HashFunc hash,
+        size_t num_replicas,
+        bool bounded_load) 
+    : _hash(hash)
+    , _num_replicas(num_replicas)
+    , _bounded_load(bounded_load)
+    , _total_inflight(0)
+    , _nspill(0) {
 }
 
 size_t ConsistentHashingLoadBalancer::AddBatch(
@@ -109,6 +134,29 @@ size_t ConsistentHashingLoadBalancer::Remove(
     return fg.size() - bg.size();
 }
 
+void ConsistentHashingLoadBalancer::AddNodes(
+    const ServerId& server, const butil::EndPoint& addr,
+    std::vector<Node>* nodes) const {
+    butil::intrusive_ptr<ServerLoad> load;
+    if (_bounded_load) {
+        load.reset(new ServerLoad);
+    }
+    for (size_t rep = 0; rep < _num_replicas; ++rep) {
+        char host[32];
+        // To be compatible with libmemcached, we formulate the key of
+        // a virtual node as `|address|-|replica_index|', see
+        // http://fe.baidu.com/-1bszwnf at line 297.
+        int len = snprintf(host, sizeof(host), "%s-%lu",
+                           endpoint2str(addr).c_str(), rep);
+        Node node;
+        node.hash = _hash(host, len);
+        node.server_sock = server;
+        node.server_addr = addr;
+        node.load = load;
+        nodes->push_back(node);
+    }
+}
+
 bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
     std::vector<Node> add_nodes;
     add_nodes.reserve(_num_replicas);
@@ -116,16 +164,7 @@ bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
     if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
         return false;
     }
-    for (size_t i = 0; i < _num_replicas; ++i) {
-        char host[32];
-        int len = snprintf(host, sizeof(host), "%s-%lu", 
-                 endpoint2str(ptr->remote_side()).c_str(), i);
-        Node node;
-        node.hash = _hash(host, len);
-        node.server_sock = server;
-        node.server_addr = ptr->remote_side();
-        add_nodes.push_back(node);
-    }
+    AddNodes(server, ptr->remote_side(), &add_nodes);
     std::sort(add_nodes.begin(), add_nodes.end());
     bool executed = false;
     const size_t ret = _db_hash_ring.ModifyWithForeground(
@@ -143,19 +182,7 @@ size_t ConsistentHashingLoadBalancer::AddServersInBatch(
         if (Socket::AddressFailedAsWell(servers[i].id, &ptr) == -1) {
             continue;
         }
-        for (size_t rep = 0; rep < _num_replicas; ++rep) {
-            char host[32];
-            // To be compatible with libmemcached, we formulate the key of
-            // a virtual node as `|address|-|replica_index|', see
-            // http://fe.baidu.com/-1bszwnf at line 297.
-            int len = snprintf(host, sizeof(host), "%s-%lu",
-                              endpoint2str(ptr->remote_side()).c_str(), rep);
-            Node node;
-            node.hash = _hash(host, len);
-            node.server_sock = servers[i];
-            node.server_addr = ptr->remote_side();
-            add_nodes.push_back(node);
-        }
+        AddNodes(servers[i], ptr->remote_side(), &add_nodes);
     }
     std::sort(add_nodes.begin(), add_nodes.end());
     bool executed = false;
@@ -188,6 +215,10 @@ size_t ConsistentHashingLoadBalancer::RemoveServersInBatch(
 }
 
 LoadBalancer *ConsistentHashingLoadBalancer::New() const {
+    if (_bounded_load) {
+        return new (std::nothrow) ConsistentHashingLoadBalancer(
+            _hash, FLAGS_chash_num_replicas, true);
+    }
     return new (std::nothrow) ConsistentHashingLoadBalancer(_hash);
 }
 
@@ -217,19 +248,91 @@ int ConsistentHashingLoadBalancer::SelectServer(
     if (choice == s->end()) {
         choice = s->begin();
     }
-    for (size_t i = 0; i < s->size(); ++i) {
+    if (!_bounded_load) {
+        for (size_t i = 0; i < s->size(); ++i) {
+            if (((i + 1) == s->size() // always take last chance
+                 || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
+                && Socket::Address(choice->server_sock.id, out->ptr) == 0 
+                && !(*out->ptr)->IsLogOff()) {
+                return 0;
+            } else {
+                if (++choice == s->end()) {
+                    choice = s->begin();
+                }
+            }
+        }
+        return EHOSTDOWN;
+    }
+    // Capacity of each server is ceil((1 + epsilon) * (m + 1) / n) where m
+    // is in-flight requests of all servers. At least one server is below
+    // the capacity, so the walk always ends.
+    const size_t nserver = std::max(s->size() / _num_replicas, (size_t)1);
+    const int64_t total = std::max(
+        _total_inflight.load(butil::memory_order_relaxed), (int64_t)0);
+    const int64_t capacity = (int64_t)ceil(
+        (1 + std::max(FLAGS_chash_load_epsilon, 0.0)) * (total + 1) / nserver);
+    // The first available server which is full.
+    std::vector<Node>::const_iterator first_full = s->end();
+    size_t i = 0;
+    for (; i < s->size(); ++i) {
         if (((i + 1) == s->size() // always take last chance
              || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
             && Socket::Address(choice->server_sock.id, out->ptr) == 0 
             && !(*out->ptr)->IsLogOff()) {
-            return 0;
-        } else {
-            if (++choice == s->end()) {
-                choice = s->begin();
+            if (choice->load->inflight.load(butil::memory_order_relaxed)
+                < capacity) {
+                break;
+            }
+            if (first_full == s->end()) {
+                first_full = choice;
             }
         }
+        if (++choice == s->end()) {
+            choice = s->begin();
+        }
+    }
+    if (i == s->size()) {
+        // All available servers are full, which happens when other servers
+        // are excluded or down.
+        if (first_full == s->end()) {
+            return EHOSTDOWN;
+        }
+        choice = first_full;
+        if (Socket::Address(choice->server_sock.id, out->ptr) != 0) {
+            return EHOSTDOWN;
+        }
+    } else if (first_full != s->end()) {
+        _nspill.fetch_add(1, butil::memory_order_relaxed);
+    }
+    choice->load->inflight.fetch_add(1, butil::memory_order_relaxed);
+    _total_inflight.fetch_add(1, butil::memory_order_relaxed);
+    out->need_feedback = true;
+    return 0;
+}
+
+void ConsistentHashingLoadBalancer::Feedback(const CallInfo& info) {
+    // Only the bounded load needs feedback.
+    _total_inflight.fetch_sub(1, butil::memory_order_relaxed);
+    if (info.controller == NULL || !info.controller->has_request_code()) {
+        return;
+    }
+    butil::DoublyBufferedData<std::vector<Node> >::ScopedPtr s;
+    if (_db_hash_ring.Read(&s) != 0 || s->empty()) {
+        return;
+    }
+    // Walk from the position of the key to the selected server, which is
+    // generally near unless the server was removed.
+    std::vector<Node>::const_iterator it = std::lower_bound(
+        s->begin(), s->end(), (uint32_t)info.controller->request_code());
+    for (size_t i = 0; i < s->size(); ++i, ++it) {
+        if (it == s->end()) {
+            it = s->begin();
+        }
+        if (it->server_sock.id == info.server_id) {
+            it->load->inflight.fetch_sub(1, butil::memory_order_relaxed);
+            return;
+        }
     }
-    return EHOSTDOWN;
 }
 
 extern const char *GetHashName(uint32_t (*hasher)(const void* key, size_t len));
@@ -237,12 +340,19 @@ extern const char *GetHashName(uint32_t (*hasher)(const void* key, size_t len));
 void ConsistentHashingLoadBalancer::Describe(
     std::ostream &os, const DescribeOptions& options) {
     if (!options.verbose) {
-        os << "c_hash";
+        os << (_bounded_load ? "c_hash_bounded" : "c_hash");
         return;
     }
     os << "ConsistentHashingLoadBalancer {\n"
        << "  hash function: " << GetHashName(_hash) << '\n'
        << "  replica per host: " << _num_replicas << '\n';
+    if (_bounded_load) {
+        os << "  bounded load epsilon: " << FLAGS_chash_load_epsilon << '\n'
+           << "  in-flight requests: "
+           << _total_inflight.load(butil::memory_order_relaxed) << '\n'
+           << "  spilled requests: "
+           << _nspill.load(butil::memory_order_relaxed) << '\n';
+    }
     std::map<butil::EndPoint, double> load_map;
     GetLoads(&load_map);
     os << "  number of hosts: " << load_map.size() << '\n';
@@ -21,17 +21,24 @@
 #include <vector>                                       // std::vector
 #include "butil/endpoint.h"                              // butil::EndPoint
 #include "butil/containers/doubly_buffered_data.h"
+#include "brpc/shared_object.h"                          // SharedObject
 #include "brpc/load_balancer.h"
 
 
 namespace brpc {
 namespace policy {
 
+// If `bounded_load' is true, a server whose in-flight requests exceed
+// (1 + -chash_load_epsilon) times of the average is skipped and the request
+// goes to the next server on the ring ("Consistent Hashing with Bounded
+// Loads"), so that hot keys don't overload a single server.
 class ConsistentHashingLoadBalancer : public LoadBalancer {
 public:
     typedef uint32_t (*HashFunc)(const void* key, size_t len);
     explicit ConsistentHashingLoadBalancer(HashFunc hash);
     ConsistentHashingLoadBalancer(HashFunc hash, size_t num_replicas);
+    ConsistentHashingLoadBalancer(HashFunc hash, size_t num_replicas,
+                                  bool bounded_load);
     bool AddServer(const ServerId& server);
     bool RemoveServer(const ServerId& server);
     size_t AddServersInBatch(const std::vector<ServerId> &servers);
@@ -39,14 +46,22 @@ public:
     LoadBalancer *New() const;
     void Destroy();
     int SelectServer(const SelectIn &in, SelectOut *out);
+    void Feedback(const CallInfo& info);
     void Describe(std::ostream &os, const DescribeOptions& options);
 
 private:
     void GetLoads(std::map<butil::EndPoint, double> *load_map);
+    // In-flight requests of a server, shared by all its virtual nodes.
+    struct ServerLoad : public SharedObject {
+        ServerLoad() : inflight(0) {}
+        butil::atomic<int64_t> inflight;
+    };
     struct Node {
         uint32_t hash;
         ServerId server_sock;
         butil::EndPoint server_addr;  // To make sorting stable among all clients
+        // NULL unless the load is bounded.
+        butil::intrusive_ptr<ServerLoad> load;
         bool operator<(const Node &rhs) const {
             if (hash < rhs.hash) { return true; }
             if (hash > rhs.hash) { return false; }
@@ -62,8 +77,16 @@ private:
                               const std::vector<ServerId> &servers, bool *executed);
     static size_t Remove(std::vector<Node> &bg, const std::vector<Node> &fg,
                          const ServerId& server, bool *executed);
+    void AddNodes(const ServerId& server, const butil::EndPoint& addr,
+                  std::vector<Node>* nodes) const;
+
     HashFunc _hash;
     size_t _num_replicas;
+    bool _bounded_load;
+    butil::atomic<int64_t> _total_inflight;
+    // Times of requests sent to other servers than the one owning the key
+    // because it's overloaded.
+    butil::atomic<int64_t> _nspill;
     butil::DoublyBufferedData<std::vector<Node> > _db_hash_ring;
 };
 
@@ -14,20 +14,17 @@
 
 // Authors: Rujie Jiang (jiangrujie@baidu.com)
 
-#include "butil/build_config.h"                       // OS_MACOSX
-#include <netdb.h>                                    // gethostbyname_r
 #include <stdlib.h>                                   // strtol
 #include <string>                                     // std::string
 #include "bthread/bthread.h"
 #include "brpc/log.h"
+#include "brpc/details/dns_resolver.h"                // ResolveHostname
 #include "brpc/policy/domain_naming_service.h"
 
 
 namespace brpc {
 namespace policy {
 
-DomainNamingService::DomainNamingService() : _aux_buf_len(0) {}
-
 int DomainNamingService::GetServers(const char* dns_name,
                                     std::vector<ServerNode>* servers) {
     servers->clear();
@@ -74,61 +71,13 @@ int DomainNamingService::GetServers(const char* dns_name,
         return -1;
     }
 
-#if defined(OS_MACOSX)
-    _aux_buf_len = 0; // suppress unused warning
-    // gethostbyname on MAC is thread-safe (with current usage) since the
-    // returned hostent is TLS. Check following link for the ref:
-    // https://lists.apple.com/archives/darwin-dev/2006/May/msg00008.html
-    struct hostent* result = gethostbyname(buf);
-    if (result == NULL) {
-        LOG(WARNING) << "result of gethostbyname is NULL";
-        return -1;
-    }
-#else
-    if (_aux_buf == NULL) {
-        _aux_buf_len = 1024;
-        _aux_buf.reset(new char[_aux_buf_len]);
-    }
-    int ret = 0;
-    int error = 0;
-    struct hostent ent;
-    struct hostent* result = NULL;
-    do {
-        result = NULL;
-        error = 0;
-        ret = gethostbyname_r(buf, &ent, _aux_buf.get(), _aux_buf_len,
-                              &result, &error);
-        if (ret != ERANGE) { // _aux_buf is not long enough
-            break;
-        }
-        _aux_buf_len *= 2;
-        _aux_buf.reset(new char[_aux_buf_len]);
-        RPC_VLOG << "Resized _aux_buf to " << _aux_buf_len
-                 << ", dns_name=" << dns_name;
-    } while (1);
-    if (ret != 0) {
-        // `hstrerror' is thread safe under linux
-        LOG(WARNING) << "Can't resolve `" << buf << "', return=`" << berror(ret)
-                     << "' herror=`" << hstrerror(error) << '\'';
+    std::vector<butil::ip_t> ips;
+    if (ResolveHostname(buf, &ips) != 0) {
         return -1;
     }
-    if (result == NULL) {
-        LOG(WARNING) << "result of gethostbyname_r is NULL";
-        return -1;
-    }
-#endif
-
-    butil::EndPoint point;
-    point.port = port;
-    for (int i = 0; result->h_addr_list[i] != NULL; ++i) {
-        if (result->h_addrtype == AF_INET) {
-            // Only fetch IPv4 addresses
-            bcopy(result->h_addr_list[i], &point.ip, result->h_length);
-            servers->push_back(ServerNode(point, std::string()));
-        } else {
-            LOG(WARNING) << "Found address of unsupported protocol="
-                         << result->h_addrtype;
-        }
+    for (size_t i = 0; i < ips.size(); ++i) {
+        servers->push_back(ServerNode(butil::EndPoint(ips[i], port),
+                                      std::string()));
     }
     return 0;
 }
@@ -18,16 +18,13 @@
 #define  BRPC_POLICY_DOMAIN_NAMING_SERVICE_H
 
 #include "brpc/periodic_naming_service.h"
-#include "butil/unique_ptr.h"
 
 
 namespace brpc {
 namespace policy {
 
+// Resolved by ResolveHostname() which caches answers of nameservers.
 class DomainNamingService : public PeriodicNamingService {
-public:
-    DomainNamingService();
-
 private:
     int GetServers(const char *service_name,
                    std::vector<ServerNode>* servers);
@@ -37,10 +34,6 @@ private:
     NamingService* New() const;
     
     void Destroy();
-
-private:
-    std::unique_ptr<char[]> _aux_buf;
-    size_t _aux_buf_len;
 };
 
 }  // namespace policy
@@ -0,0 +1,435 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <gflags/gflags.h>
+#include <inttypes.h>                                   // PRId64
+#include <stdlib.h>                                     // strtoll
+#include <string.h>                                     // strcmp
+#include <string>                                       // std::string
+#include <deque>                                        // std::deque
+#include <set>                                          // std::set
+#include "butil/base64.h"
+#include "butil/string_printf.h"
+#include "butil/third_party/rapidjson/document.h"
+#include "bthread/bthread.h"
+#include "bthread/mutex.h"
+#include "bthread/condition_variable.h"
+#include "brpc/log.h"
+#include "brpc/channel.h"
+#include "brpc/shared_object.h"
+#include "brpc/progressive_reader.h"
+#include "brpc/policy/etcd_naming_service.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_string(etcd_endpoint, "http://127.0.0.1:2379",
+              "Address of etcd for discovering services");
+DEFINE_int32(etcd_connect_timeout_ms, 200,
+             "Timeout for creating connections to etcd in milliseconds");
+DEFINE_int32(etcd_timeout_ms, 3000, "Timeout of requests to etcd in "
+             "milliseconds, streams of watching are not limited");
+DEFINE_int32(etcd_retry_interval_ms, 500,
+             "Wait so many milliseconds before retry when error happens");
+
+typedef BUTIL_RAPIDJSON_NAMESPACE::Value JsonValue;
+
+// The smallest key greater than all keys with `prefix'.
+static std::string PrefixRangeEnd(const std::string& prefix) {
+    std::string end(prefix);
+    while (!end.empty()) {
+        if ((unsigned char)end[end.size() - 1] < 0xff) {
+            ++end[end.size() - 1];
+            return end;
+        }
+        end.resize(end.size() - 1);
+    }
+    // "\0" means all keys.
+    return std::string(1, '\0');
+}
+
+static std::string MakeKeyRange(const char* prefix) {
+    std::string key;
+    std::string range_end;
+    butil::Base64Encode(prefix, &key);
+    butil::Base64Encode(PrefixRangeEnd(prefix), &range_end);
+    return butil::string_printf("\"key\":\"%s\",\"range_end\":\"%s\"",
+                                key.c_str(), range_end.c_str());
+}
+
+static bool GetBase64Member(const JsonValue& obj, const char* name,
+                            std::string* out) {
+    out->clear();
+    if (!obj.HasMember(name)) {
+        return false;
+    }
+    const JsonValue& v = obj[name];
+    return v.IsString() &&
+        butil::Base64Decode(butil::StringPiece(v.GetString(),
+                                               v.GetStringLength()), out);
+}
+
+// Integers of etcd are encoded as strings in JSON.
+static int64_t GetRevision(const JsonValue& obj) {
+    if (!obj.HasMember("header") || !obj["header"].IsObject()) {
+        return -1;
+    }
+    const JsonValue& header = obj["header"];
+    if (!header.HasMember("revision")) {
+        return -1;
+    }
+    const JsonValue& v = header["revision"];
+    if (v.IsString()) {
+        return strtoll(v.GetString(), NULL, 10);
+    }
+    return v.IsInt64() ? v.GetInt64() : -1;
+}
+
+// Address of the server is the last component of the key.
+static bool ParseServer(const std::string& key, const std::string& value,
+                        ServerNode* node) {
+    const size_t pos = key.rfind('/');
+    const std::string addr =
+        (pos == std::string::npos ? key : key.substr(pos + 1));
+    if (butil::str2endpoint(addr.c_str(), &node->addr) != 0 &&
+        butil::hostname2endpoint(addr.c_str(), &node->addr) != 0) {
+        LOG(ERROR) << "Invalid address=`" << addr << "' in key=" << key;
+        return false;
+    }
+    node->tag = value;
+    return true;
+}
+
+// Messages of the watching stream are separated by newlines. They're parsed
+// in the bthread of the naming service, which waits for them.
+class EtcdWatchStream : public SharedObject, public ProgressiveReader {
+public:
+    EtcdWatchStream() : _ended(false), _stopped(false) {}
+
+    butil::Status OnReadOnePart(const void* data, size_t length) {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        if (_stopped) {
+            // Close the connection.
+            return butil::Status(ECANCELED, "The naming service is stopped");
+        }
+        const char* p = (const char*)data;
+        const char* const end = p + length;
+        while (p < end) {
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            if (nl == NULL) {
+                _partial.append(p, end - p);
+                break;
+            }
+            _partial.append(p, nl - p);
+            if (!_partial.empty()) {
+                _messages.push_back(std::string());
+                _messages.back().swap(_partial);
+            }
+            p = nl + 1;
+        }
+        if (!_messages.empty()) {
+            _cond.notify_one();
+        }
+        return butil::Status::OK();
+    }
+
+    void OnEndOfMessage(const butil::Status& status) {
+        {
+            std::unique_lock<bthread::Mutex> mu(_mutex);
+            _ended = true;
+            _status = status;
+            _cond.notify_one();
+        }
+        // Remove the reference of the reader.
+        RemoveRefManually();
+    }
+
+    // Wait for the next message.
+    // Returns 0 on success, -1 when the stream ended or the bthread is
+    // stopped.
+    int Next(std::string* message) {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        while (_messages.empty() && !_ended) {
+            if (bthread_stopped(bthread_self())) {
+                _stopped = true;
+                return -1;
+            }
+            _cond.wait(mu);
+        }
+        if (_messages.empty()) {
+            LOG(WARNING) << "The watching stream ended: " << _status;
+            return -1;
+        }
+        message->swap(_messages.front());
+        _messages.pop_front();
+        return 0;
+    }
+
+    void Stop() {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        _stopped = true;
+    }
+
+private:
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+    bool _ended;
+    bool _stopped;
+    butil::Status _status;
+    std::string _partial;
+    std::deque<std::string> _messages;
+};
+
+int EtcdNamingService::GetServers(const char* prefix,
+                                  std::vector<ServerNode>* servers) {
+    if (!_etcd_connected) {
+        ChannelOptions opt;
+        opt.protocol = PROTOCOL_HTTP;
+        opt.connect_timeout_ms = FLAGS_etcd_connect_timeout_ms;
+        opt.timeout_ms = FLAGS_etcd_timeout_ms;
+        if (_channel.Init(FLAGS_etcd_endpoint.c_str(), "rr", &opt) != 0) {
+            LOG(ERROR) << "Fail to init channel to etcd at "
+                       << FLAGS_etcd_endpoint;
+            return -1;
+        }
+        _etcd_connected = true;
+    }
+
+    Controller cntl;
+    cntl.http_request().uri() = "/v3/kv/range";
+    cntl.http_request().set_method(HTTP_METHOD_POST);
+    cntl.http_request().set_content_type("application/json");
+    cntl.request_attachment().append('{' + MakeKeyRange(prefix) + '}');
+    _channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        LOG(ERROR) << "Fail to get servers of " << prefix << " from etcd: "
+                   << cntl.ErrorText();
+        return -1;
+    }
+    BUTIL_RAPIDJSON_NAMESPACE::Document doc;
+    doc.Parse(cntl.response_attachment().to_string().c_str());
+    const int64_t revision = (doc.IsObject() ? GetRevision(doc) : -1);
+    if (revision < 0) {
+        LOG(ERROR) << "Invalid response of etcd for " << prefix;
+        return -1;
+    }
+
+    servers->clear();
+    _servers.clear();
+    std::set<ServerNode> presence;
+    if (doc.HasMember("kvs") && doc["kvs"].IsArray()) {
+        const JsonValue& kvs = doc["kvs"];
+        for (BUTIL_RAPIDJSON_NAMESPACE::SizeType i = 0; i < kvs.Size(); ++i) {
+            std::string key;
+            std::string value;
+            ServerNode node;
+            if (!kvs[i].IsObject() || !GetBase64Member(kvs[i], "key", &key)) {
+                LOG(ERROR) << "Invalid key-value from etcd for " << prefix;
+                continue;
+            }
+            GetBase64Member(kvs[i], "value", &value);
+            if (!ParseServer(key, value, &node)) {
+                continue;
+            }
+            _servers[key] = node;
+            if (presence.insert(node).second) {
+                servers->push_back(node);
+            } else {
+                RPC_VLOG << "Duplicated server=" << node;
+            }
+        }
+    }
+    _revision = revision;
+    RPC_VLOG << "Got " << servers->size()
+             << (servers->size() > 1 ? " servers" : " server")
+             << " from " << prefix << " at revision=" << revision;
+    return 0;
+}
+
+int EtcdNamingService::ApplyWatchResponse(const std::string& response,
+                                          NamingServiceActions* actions) {
+    BUTIL_RAPIDJSON_NAMESPACE::Document doc;
+    doc.Parse(response.c_str());
+    if (!doc.IsObject() || !doc.HasMember("result") ||
+        !doc["result"].IsObject()) {
+        LOG(ERROR) << "Invalid watch response from etcd: " << response;
+        return -1;
+    }
+    const JsonValue& result = doc["result"];
+    if (result.HasMember("canceled") && result["canceled"].IsBool() &&
+        result["canceled"].GetBool()) {
+        // Generally the revision was compacted.
+        LOG(WARNING) << "Watching is canceled by etcd: " << response;
+        return -1;
+    }
+    const int64_t revision = GetRevision(result);
+    if (revision > _revision) {
+        _revision = revision;
+    }
+    if (!result.HasMember("events") || !result["events"].IsArray()) {
+        return 0;
+    }
+    // Servers before the events, if touched. Changes of a key cancelling
+    // each other (e.g. refreshing the value) are not passed to actions.
+    std::map<std::string, ServerNode> before;
+    std::set<std::string> absent_before;
+    const JsonValue& events = result["events"];
+    for (BUTIL_RAPIDJSON_NAMESPACE::SizeType i = 0; i < events.Size(); ++i) {
+        const JsonValue& ev = events[i];
+        std::string key;
+        if (!ev.IsObject() || !ev.HasMember("kv") || !ev["kv"].IsObject() ||
+            !GetBase64Member(ev["kv"], "key", &key)) {
+            LOG(ERROR) << "Invalid event from etcd: " << response;
+            continue;
+        }
+        std::map<std::string, ServerNode>::iterator it = _servers.find(key);
+        if (before.find(key) == before.end() &&
+            absent_before.find(key) == absent_before.end()) {
+            if (it != _servers.end()) {
+                before[key] = it->second;
+            } else {
+                absent_before.insert(key);
+            }
+        }
+        // PUT is the default type which is not present in JSON.
+        if (ev.HasMember("type") && ev["type"].IsString() &&
+            strcmp(ev["type"].GetString(), "DELETE") == 0) {
+            if (it != _servers.end()) {
+                _servers.erase(it);
+            }
+            continue;
+        }
+        std::string value;
+        GetBase64Member(ev["kv"], "value", &value);
+        ServerNode node;
+        if (!ParseServer(key, value, &node)) {
+            continue;
+        }
+        _servers[key] = node;
+    }
+    std::vector<ServerNode> removed;
+    std::vector<ServerNode> added;
+    for (std::map<std::string, ServerNode>::const_iterator
+             it = before.begin(); it != before.end(); ++it) {
+        std::map<std::string, ServerNode>::const_iterator it2 =
+            _servers.find(it->first);
+        if (it2 == _servers.end()) {
+            removed.push_back(it->second);
+        } else if (it2->second != it->second) {
+            removed.push_back(it->second);
+            added.push_back(it2->second);
+        }
+    }
+    for (std::set<std::string>::const_iterator
+             it = absent_before.begin(); it != absent_before.end(); ++it) {
+        std::map<std::string, ServerNode>::const_iterator it2 =
+            _servers.find(*it);
+        if (it2 != _servers.end()) {
+            added.push_back(it2->second);
+        }
+    }
+    if (!removed.empty()) {
+        actions->RemoveServers(removed);
+    }
+    if (!added.empty()) {
+        actions->AddServers(added);
+    }
+    return 0;
+}
+
+int EtcdNamingService::WatchServers(const char* prefix,
+                                    NamingServiceActions* actions) {
+    Controller cntl;
+    cntl.http_request().uri() = "/v3/watch";
+    cntl.http_request().set_method(HTTP_METHOD_POST);
+    cntl.http_request().set_content_type("application/json");
+    // Progress notifications make broken streams noticed.
+    cntl.request_attachment().append(butil::string_printf(
+        "{\"create_request\":{%s,\"start_revision\":%" PRId64
+        ",\"progress_notify\":true}}",
+        MakeKeyRange(prefix).c_str(), _revision + 1));
+    cntl.response_will_be_read_progressively();
+    _channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        LOG(ERROR) << "Fail to watch " << prefix << " in etcd: "
+                   << cntl.ErrorText();
+        return -1;
+    }
+    butil::intrusive_ptr<EtcdWatchStream> stream(new EtcdWatchStream);
+    // Referenced by the reader until OnEndOfMessage().
+    stream->AddRefManually();
+    cntl.ReadProgressiveAttachmentBy(stream.get());
+    std::string message;
+    while (stream->Next(&message) == 0) {
+        if (ApplyWatchResponse(message, actions) != 0) {
+            break;
+        }
+    }
+    stream->Stop();
+    return -1;
+}
+
+int EtcdNamingService::RunNamingService(const char* service_name,
+                                        NamingServiceActions* actions) {
+    std::vector<ServerNode> servers;
+    bool ever_reset = false;
+    for (;;) {
+        servers.clear();
+        if (GetServers(service_name, &servers) == 0) {
+            ever_reset = true;
+            actions->ResetServers(servers);
+            // Changes are pushed from now on.
+            WatchServers(service_name, actions);
+        } else if (!ever_reset) {
+            // ResetServers must be called at first time even if GetServers
+            // failed, to wake up callers to `WaitForFirstBatchOfServers'
+            ever_reset = true;
+            servers.clear();
+            actions->ResetServers(servers);
+        }
+        if (bthread_stopped(bthread_self())) {
+            RPC_VLOG << "Quit NamingServiceThread=" << bthread_self();
+            return 0;
+        }
+        if (bthread_usleep(std::max(FLAGS_etcd_retry_interval_ms, 1) * 1000L) < 0) {
+            if (errno == ESTOP) {
+                RPC_VLOG << "Quit NamingServiceThread=" << bthread_self();
+                return 0;
+            }
+            PLOG(FATAL) << "Fail to sleep";
+            return -1;
+        }
+    }
+    CHECK(false);
+    return -1;
+}
+
+void EtcdNamingService::Describe(std::ostream& os,
+                                 const DescribeOptions&) const {
+    os << "etcd";
+    return;
+}
+
+NamingService* EtcdNamingService::New() const {
+    return new EtcdNamingService;
+}
+
+void EtcdNamingService::Destroy() {
+    delete this;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,66 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef  BRPC_POLICY_ETCD_NAMING_SERVICE
+#define  BRPC_POLICY_ETCD_NAMING_SERVICE
+
+#include <map>                                          // std::map
+#include "brpc/naming_service.h"
+#include "brpc/channel.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Discover servers registered in etcd v3 (through its JSON gateway) under
+// a key prefix. "etcd://services/echo/" gets servers from keys like
+// "services/echo/10.0.0.1:8000" whose values are tags of the servers.
+// All servers are fetched once, after which changes are pushed by a watch
+// stream and applied incrementally, the list is fetched again only when
+// the stream is broken.
+class EtcdNamingService : public NamingService {
+private:
+    int RunNamingService(const char* service_name,
+                         NamingServiceActions* actions);
+
+    // Get all servers under `prefix' and the revision of them.
+    int GetServers(const char* prefix, std::vector<ServerNode>* servers);
+
+    // Apply changes after the revision of GetServers() until the stream
+    // is broken or the naming service is stopped.
+    int WatchServers(const char* prefix, NamingServiceActions* actions);
+
+    int ApplyWatchResponse(const std::string& response,
+                           NamingServiceActions* actions);
+
+    void Describe(std::ostream& os, const DescribeOptions&) const;
+
+    NamingService* New() const;
+
+    void Destroy();
+
+private:
+    Channel _channel;
+    bool _etcd_connected = false;
+    int64_t _revision = 0;
+    // Servers by keys. Deletion events only have keys.
+    std::map<std::string, ServerNode> _servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  //BRPC_POLICY_ETCD_NAMING_SERVICE
@@ -15,8 +15,11 @@
 // Authors: Zhangyi Chen (chenzhangyi01@baidu.com)
 
 #include <limits.h>
+#include <string.h>
 #include <openssl/md5.h>
+#include <string>
 #include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "butil/fast_hash.h"
 #include "brpc/policy/hasher.h"
 
 
@@ -67,6 +70,35 @@ uint32_t MurmurHash32V(const butil::StringPiece* keys, size_t num_keys) {
     return hash;
 }
 
+uint32_t WyHash32(const void* key, size_t len) {
+    const uint64_t h = butil::WyHash64(key, len);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+uint32_t WyHash32V(const butil::StringPiece* keys, size_t num_keys) {
+    if (num_keys == 1) {
+        return WyHash32(keys[0].data(), keys[0].size());
+    }
+    // Same as hashing the concatenated keys, like other *Hash32V do.
+    char stack_buf[256];
+    size_t total = 0;
+    for (size_t i = 0; i < num_keys; ++i) {
+        total += keys[i].size();
+    }
+    std::string heap_buf;
+    char* buf = stack_buf;
+    if (total > sizeof(stack_buf)) {
+        heap_buf.resize(total);
+        buf = &heap_buf[0];
+    }
+    char* p = buf;
+    for (size_t i = 0; i < num_keys; ++i) {
+        memcpy(p, keys[i].data(), keys[i].size());
+        p += keys[i].size();
+    }
+    return WyHash32(buf, total);
+}
+
 /* The crc32 functions and data was originally written by Spencer
  * Garrett <srg@quick.com> and was gleaned from the PostgreSQL source
  * tree via the files contrib/ltree/crc32.[ch] and from FreeBSD at
@@ -154,6 +186,9 @@ const char *GetHashName(uint32_t (*hasher)(const void* key, size_t len)) {
     if (hasher == MD5Hash32) {
         return "md5";
     }
+    if (hasher == WyHash32) {
+        return "wyhash";
+    }
     if (hasher == CRCHash32) {
         return "crc32";
     }
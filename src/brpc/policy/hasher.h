@@ -31,6 +31,12 @@ uint32_t MD5Hash32V(const butil::StringPiece* keys, size_t num_keys);
 uint32_t MurmurHash32(const void* key, size_t len);
 uint32_t MurmurHash32V(const butil::StringPiece* keys, size_t num_keys);
 
+// Much faster than MurmurHash32 on long keys and than MD5Hash32 on all keys,
+// but maps keys to different values, namely ring positions of c_wyhash are
+// not compatible with c_murmurhash or c_md5.
+uint32_t WyHash32(const void* key, size_t len);
+uint32_t WyHash32V(const butil::StringPiece* keys, size_t num_keys);
+
 }  // namespace policy
 } // namespace brpc
 
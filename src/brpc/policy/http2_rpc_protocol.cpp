@@ -0,0 +1,1467 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <gflags/gflags.h>
+#include <map>
+#include <mutex>                                // std::unique_lock
+#include "butil/base64.h"                      // Base64Encode
+#include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "butil/strings/string_util.h"       // StringToLowerASCII
+#include "butil/synchronization/lock.h"        // butil::Mutex
+#include "butil/time.h"
+#include "bthread/id.h"                        // bthread_id_error2
+#include "brpc/authenticator.h"
+#include "brpc/controller.h"
+#include "brpc/errno.pb.h"
+#include "brpc/reloadable_flags.h"             // BRPC_VALIDATE_GFLAG
+#include "brpc/socket.h"
+#include "brpc/details/hpack.h"                // HPacker
+#include "brpc/policy/http2_rpc_protocol.h"
+
+namespace brpc {
+
+DECLARE_bool(rpc_deliver_timeout);
+DECLARE_uint64(max_body_size);
+
+namespace policy {
+
+DEFINE_int32(h2_stream_window_size, 1024 * 1024,
+             "Bytes that the peer is allowed to send over each http2 stream "
+             "before it's acked, namely SETTINGS_INITIAL_WINDOW_SIZE");
+DEFINE_int32(h2_connection_window_size, 16 * 1024 * 1024,
+             "Bytes that the peer is allowed to send over each http2 "
+             "connection before it's acked");
+DEFINE_int32(h2_max_frame_size, 16384, "Max payload size of http2 frames "
+             "that this side accepts, namely SETTINGS_MAX_FRAME_SIZE");
+DEFINE_int32(h2_max_concurrent_streams, 0, "Max number of concurrent streams "
+             "that a http2 client is allowed to open on a connection to this "
+             "server, 0 means unlimited");
+
+static bool validate_h2_window_size(const char*, int32_t v) {
+    // Never smaller than the default one, otherwise the peer may send more
+    // than allowed before it sees our SETTINGS.
+    return v >= 65535;
+}
+BRPC_VALIDATE_GFLAG(h2_stream_window_size, validate_h2_window_size);
+BRPC_VALIDATE_GFLAG(h2_connection_window_size, validate_h2_window_size);
+
+static bool validate_h2_max_frame_size(const char*, int32_t v) {
+    return v >= 16384 && v <= 16777215;
+}
+BRPC_VALIDATE_GFLAG(h2_max_frame_size, validate_h2_max_frame_size);
+BRPC_VALIDATE_GFLAG(h2_max_concurrent_streams, NonNegativeInteger);
+
+// rfc7540#section-3.5
+static const char H2_CONNECTION_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t H2_CONNECTION_PREFACE_SIZE =
+    sizeof(H2_CONNECTION_PREFACE) - 1;
+static const size_t H2_FRAME_HEAD_SIZE = 9;
+static const int64_t H2_DEFAULT_WINDOW_SIZE = 65535;
+static const int64_t H2_MAX_WINDOW_SIZE = 0x7FFFFFFF;
+static const uint32_t H2_DEFAULT_MAX_FRAME_SIZE = 16384;
+static const uint32_t H2_MAX_FRAME_SIZE_LIMIT = 16777215;
+static const uint32_t H2_MAX_STREAM_ID = 0x7FFFFFFF;
+
+enum H2FrameType {
+    H2_FRAME_DATA          = 0x0,
+    H2_FRAME_HEADERS       = 0x1,
+    H2_FRAME_PRIORITY      = 0x2,
+    H2_FRAME_RST_STREAM    = 0x3,
+    H2_FRAME_SETTINGS      = 0x4,
+    H2_FRAME_PUSH_PROMISE  = 0x5,
+    H2_FRAME_PING          = 0x6,
+    H2_FRAME_GOAWAY        = 0x7,
+    H2_FRAME_WINDOW_UPDATE = 0x8,
+    H2_FRAME_CONTINUATION  = 0x9,
+};
+
+enum H2FrameFlags {
+    H2_FLAGS_END_STREAM    = 0x1,
+    H2_FLAGS_ACK           = 0x1,
+    H2_FLAGS_END_HEADERS   = 0x4,
+    H2_FLAGS_PADDED        = 0x8,
+    H2_FLAGS_PRIORITY      = 0x20,
+};
+
+enum H2Error {
+    H2_NO_ERROR            = 0x0,
+    H2_PROTOCOL_ERROR      = 0x1,
+    H2_INTERNAL_ERROR      = 0x2,
+    H2_FLOW_CONTROL_ERROR  = 0x3,
+    H2_SETTINGS_TIMEOUT    = 0x4,
+    H2_STREAM_CLOSED_ERROR = 0x5,
+    H2_FRAME_SIZE_ERROR    = 0x6,
+    H2_REFUSED_STREAM      = 0x7,
+    H2_CANCEL              = 0x8,
+    H2_COMPRESSION_ERROR   = 0x9,
+    H2_CONNECT_ERROR       = 0xa,
+    H2_ENHANCE_YOUR_CALM   = 0xb,
+    H2_INADEQUATE_SECURITY = 0xc,
+    H2_HTTP_1_1_REQUIRED   = 0xd,
+};
+
+enum H2SettingsId {
+    H2_SETTINGS_HEADER_TABLE_SIZE      = 0x1,
+    H2_SETTINGS_ENABLE_PUSH            = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE    = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE         = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE   = 0x6,
+};
+
+static const char* H2ErrorToString(uint32_t e) {
+    switch (e) {
+    case H2_NO_ERROR: return "NO_ERROR";
+    case H2_PROTOCOL_ERROR: return "PROTOCOL_ERROR";
+    case H2_INTERNAL_ERROR: return "INTERNAL_ERROR";
+    case H2_FLOW_CONTROL_ERROR: return "FLOW_CONTROL_ERROR";
+    case H2_SETTINGS_TIMEOUT: return "SETTINGS_TIMEOUT";
+    case H2_STREAM_CLOSED_ERROR: return "STREAM_CLOSED";
+    case H2_FRAME_SIZE_ERROR: return "FRAME_SIZE_ERROR";
+    case H2_REFUSED_STREAM: return "REFUSED_STREAM";
+    case H2_CANCEL: return "CANCEL";
+    case H2_COMPRESSION_ERROR: return "COMPRESSION_ERROR";
+    case H2_CONNECT_ERROR: return "CONNECT_ERROR";
+    case H2_ENHANCE_YOUR_CALM: return "ENHANCE_YOUR_CALM";
+    case H2_INADEQUATE_SECURITY: return "INADEQUATE_SECURITY";
+    case H2_HTTP_1_1_REQUIRED: return "HTTP_1_1_REQUIRED";
+    }
+    return "UNKNOWN_ERROR";
+}
+
+inline void SaveUint32(char* p, uint32_t v) {
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+inline uint32_t LoadUint32(const char* p) {
+    const uint8_t* q = (const uint8_t*)p;
+    return ((uint32_t)q[0] << 24) | ((uint32_t)q[1] << 16) |
+        ((uint32_t)q[2] << 8) | q[3];
+}
+
+struct H2FrameHead {
+    uint32_t payload_size;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+};
+
+static void SerializeFrameHead(char* out, uint32_t payload_size,
+                               uint8_t type, uint8_t flags,
+                               uint32_t stream_id) {
+    out[0] = (char)(payload_size >> 16);
+    out[1] = (char)(payload_size >> 8);
+    out[2] = (char)payload_size;
+    out[3] = (char)type;
+    out[4] = (char)flags;
+    SaveUint32(out + 5, stream_id & H2_MAX_STREAM_ID);
+}
+
+static void ParseFrameHead(const char* in, H2FrameHead* head) {
+    const uint8_t* p = (const uint8_t*)in;
+    head->payload_size = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    head->type = p[3];
+    head->flags = p[4];
+    head->stream_id = LoadUint32(in + 5) & H2_MAX_STREAM_ID;
+}
+
+static void AppendFrame(butil::IOBuf* out, uint8_t type, uint8_t flags,
+                        uint32_t stream_id, const char* payload,
+                        uint32_t size) {
+    char head[H2_FRAME_HEAD_SIZE];
+    SerializeFrameHead(head, size, type, flags, stream_id);
+    out->append(head, sizeof(head));
+    if (size) {
+        out->append(payload, size);
+    }
+}
+
+static void AppendWindowUpdate(butil::IOBuf* out, uint32_t stream_id,
+                               uint32_t increment) {
+    char payload[4];
+    SaveUint32(payload, increment);
+    AppendFrame(out, H2_FRAME_WINDOW_UPDATE, 0, stream_id,
+                payload, sizeof(payload));
+}
+
+static void AppendRstStream(butil::IOBuf* out, uint32_t stream_id,
+                            H2Error error) {
+    char payload[4];
+    SaveUint32(payload, error);
+    AppendFrame(out, H2_FRAME_RST_STREAM, 0, stream_id,
+                payload, sizeof(payload));
+}
+
+static void AppendGoAway(butil::IOBuf* out, uint32_t last_stream_id,
+                         H2Error error) {
+    char payload[8];
+    SaveUint32(payload, last_stream_id);
+    SaveUint32(payload + 4, error);
+    AppendFrame(out, H2_FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+// Remove the pad length and padding of DATA/HEADERS frames.
+static int RemovePadding(const H2FrameHead& head, butil::IOBuf* frame) {
+    if (!(head.flags & H2_FLAGS_PADDED)) {
+        return 0;
+    }
+    uint8_t pad_length = 0;
+    if (frame->cut1((char*)&pad_length) != 0 || pad_length > frame->size()) {
+        return -1;
+    }
+    frame->pop_back(pad_length);
+    return 0;
+}
+
+typedef std::vector<HPacker::Header> H2HeaderList;
+
+// Header names must be lowercase in http2.
+static void AddH2Header(H2HeaderList* list, const std::string& name,
+                        const std::string& value) {
+    list->push_back(HPacker::Header());
+    HPacker::Header& h = list->back();
+    h.name = StringToLowerASCII(name);
+    h.value = value;
+}
+
+// Connection-specific headers are not allowed in http2, see
+// rfc7540#section-8.1.2.2. "host" is replaced with ":authority".
+static bool IsConnectionSpecificHeader(const std::string& name,
+                                       const std::string& value) {
+    return strcasecmp(name.c_str(), "connection") == 0 ||
+        strcasecmp(name.c_str(), "keep-alive") == 0 ||
+        strcasecmp(name.c_str(), "proxy-connection") == 0 ||
+        strcasecmp(name.c_str(), "transfer-encoding") == 0 ||
+        strcasecmp(name.c_str(), "upgrade") == 0 ||
+        strcasecmp(name.c_str(), "host") == 0 ||
+        (strcasecmp(name.c_str(), "te") == 0 &&
+         strcasecmp(value.c_str(), "trailers") != 0);
+}
+
+static void AddRegularH2Headers(H2HeaderList* list, const HttpHeader& h) {
+    if (!h.content_type().empty()) {
+        AddH2Header(list, "content-type", h.content_type());
+    }
+    for (HttpHeader::HeaderIterator it = h.HeaderBegin();
+         it != h.HeaderEnd(); ++it) {
+        if (!IsConnectionSpecificHeader(it->first, it->second)) {
+            AddH2Header(list, it->first, it->second);
+        }
+    }
+}
+
+static HPackOptions GetHPackOptions(const std::string& name) {
+    HPackOptions options;
+    if (name == "authorization" || name == "cookie") {
+        options.index_policy = HPACK_NEVER_INDEX_HEADER;
+    } else if (name.compare(0, 5, "x-bd-") == 0 || name == "log-id" ||
+               name == "grpc-timeout" || name == "grpc-message") {
+        // Values of these headers change in each RPC, don't let them evict
+        // useful entries from the dynamic table.
+        options.index_policy = HPACK_NOT_INDEX_HEADER;
+    }
+    return options;
+}
+
+// Put pseudo or regular header `h' decoded from a header block into `out'.
+// Returns false if the header is invalid.
+static bool ApplyH2Header(HttpHeader* out, const HPacker::Header& h) {
+    if (h.name.empty()) {
+        return false;
+    }
+    if (h.name[0] != ':') {
+        if (h.name == "content-type") {
+            out->set_content_type(h.value);
+        } else {
+            out->AppendHeader(h.name, h.value);
+        }
+        return true;
+    }
+    if (h.name == ":method") {
+        HttpMethod method;
+        if (!Str2HttpMethod(h.value.c_str(), &method)) {
+            return false;
+        }
+        out->set_method(method);
+    } else if (h.name == ":path") {
+        out->uri().SetH2Path(h.value);
+    } else if (h.name == ":authority") {
+        out->uri().SetHostAndPort(h.value);
+    } else if (h.name == ":scheme") {
+        out->uri().set_schema(h.value);
+    } else if (h.name == ":status") {
+        char* endptr = NULL;
+        const long status = strtol(h.value.c_str(), &endptr, 10);
+        if (*endptr != '\0' || status < 100 || status > 999) {
+            return false;
+        }
+        out->set_status_code(status);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+H2StreamContext::H2StreamContext(uint32_t stream_id, uint64_t correlation_id)
+    : _stream_id(stream_id)
+    , _close_connection(false) {
+    set_correlation_id(correlation_id);
+    header().set_version(2, 0);
+}
+
+struct H2Settings {
+    H2Settings()
+        : header_table_size(HPacker::DEFAULT_HEADER_TABLE_SIZE)
+        , max_concurrent_streams(0)
+        , initial_window_size(H2_DEFAULT_WINDOW_SIZE)
+        , max_frame_size(H2_DEFAULT_MAX_FRAME_SIZE) {}
+
+    uint32_t header_table_size;
+    // 0 means unlimited.
+    uint32_t max_concurrent_streams;
+    int64_t initial_window_size;
+    uint32_t max_frame_size;
+};
+
+struct H2Stream {
+    H2Stream(uint32_t id2, uint64_t correlation_id2,
+             int64_t remote_window2, int64_t local_window2)
+        : id(id2)
+        , correlation_id(correlation_id2)
+        , msg(NULL)
+        , headers_received(false)
+        , remote_closed(false)
+        , remote_window(remote_window2)
+        , local_window(local_window2)
+        , local_unacked(0) {}
+
+    ~H2Stream() {
+        if (msg) {
+            msg->Destroy();
+        }
+    }
+
+    uint32_t id;
+    uint64_t correlation_id;
+    // The request(server-side) or response(client-side) being received.
+    H2StreamContext* msg;
+    bool headers_received;
+    // END_STREAM was received and `msg' was moved out, namely the stream is
+    // half-closed(remote). Server-side only since client-side streams are
+    // erased then.
+    bool remote_closed;
+    // Bytes allowed to be sent to the peer.
+    int64_t remote_window;
+    // Bytes that the peer is allowed to send.
+    int64_t local_window;
+    // Bytes received but not acked by WINDOW_UPDATE yet.
+    int64_t local_unacked;
+    // Body that can't be sent due to flow control. END_STREAM is set on the
+    // last DATA frame, or on `trailers' sent after the body if non-empty.
+    butil::IOBuf pending;
+    H2HeaderList trailers;
+};
+
+// The parsing context of a http2 connection, shared by the reading side
+// (Consume) and the writing side (AppendRequest/AppendResponse), which run
+// concurrently. Streams and windows of sending are guarded by _mutex, other
+// fields are only touched by one side.
+class H2Context : public Destroyable {
+public:
+    explicit H2Context(bool is_client);
+    ~H2Context();
+    int Init();
+    // @Destroyable
+    void Destroy() { delete this; }
+
+    // Append SETTINGS and WINDOW_UPDATE sent after the connection preface.
+    void AppendLocalSettings(butil::IOBuf* out);
+
+    // Parse one frame from `source'.
+    ParseResult Consume(butil::IOBuf* source, Socket* socket);
+
+    // Start a new stream sending `headers' and `body'. Called sequentially
+    // by SocketMessage of the client.
+    butil::Status AppendRequest(butil::IOBuf* out, Socket* socket,
+                                uint64_t correlation_id,
+                                const H2HeaderList& headers,
+                                butil::IOBuf* body);
+
+    // Send `headers', `body' and `trailers'(if non-empty) as the response
+    // to stream `stream_id'. Called sequentially by SocketMessage of the
+    // server.
+    void AppendResponse(butil::IOBuf* out, uint32_t stream_id,
+                        const H2HeaderList& headers, butil::IOBuf* body,
+                        const H2HeaderList& trailers);
+
+    // Send pending bodies allowed by the windows. Called sequentially by
+    // SocketMessage written by the reading side, so that frames(and header
+    // blocks encoded by _hpack_encoder) are serialized in the order of
+    // writing.
+    void AppendPending(butil::IOBuf* out);
+
+private:
+    typedef std::map<uint32_t, H2Stream*> StreamMap;
+
+    ParseResult OnData(const H2FrameHead&, butil::IOBuf*, Socket*);
+    ParseResult OnHeaders(const H2FrameHead&, butil::IOBuf*, Socket*);
+    ParseResult OnContinuation(const H2FrameHead&, butil::IOBuf*, Socket*);
+    ParseResult OnHeaderBlock(Socket*);
+    ParseResult OnRstStream(const H2FrameHead&, butil::IOBuf*, Socket*);
+    ParseResult OnSettings(const H2FrameHead&, butil::IOBuf*, Socket*);
+    ParseResult OnPing(const H2FrameHead&, butil::IOBuf*, Socket*);
+    ParseResult OnGoAway(const H2FrameHead&, butil::IOBuf*, Socket*);
+    ParseResult OnWindowUpdate(const H2FrameHead&, butil::IOBuf*, Socket*);
+    ParseResult ConnectionError(Socket* socket, H2Error error,
+                                const char* reason);
+
+    H2Stream* FindStreamLocked(uint32_t stream_id);
+    void EraseStreamLocked(uint32_t stream_id);
+    // Move out the message of a stream whose END_STREAM is received.
+    H2StreamContext* CompleteStreamLocked(H2Stream* s);
+    void AppendHeadersLocked(butil::IOBuf* out, uint32_t stream_id,
+                             const H2HeaderList& headers, bool end_stream);
+    // Send pending body of `s' as much as windows allow.
+    // Returns true if the pending body is completely sent.
+    bool SendPendingLocked(H2Stream* s, butil::IOBuf* out);
+    void SendAllPendingLocked(butil::IOBuf* out);
+    // Called by the reading side when windows are increased.
+    void WritePending(Socket* socket);
+
+    const bool _is_client;
+    const H2Settings _local_settings;
+    const int64_t _local_connection_window_size;
+
+    // Used by the reading side only.
+    HPacker _hpack_decoder;
+    uint32_t _last_received_stream_id;
+    int64_t _local_conn_window;
+    int64_t _local_conn_unacked;
+    uint32_t _header_stream_id;  // non-zero when expecting CONTINUATION
+    bool _header_end_stream;
+    butil::IOBuf _header_block;
+
+    // Used by the writing side only.
+    HPacker _hpack_encoder;
+    bool _allow_indexing;
+
+    butil::Mutex _mutex;
+    H2Settings _remote_settings;
+    int64_t _remote_conn_window;
+    uint32_t _next_stream_id;
+    // No more streams when GOAWAY is received or stream ids run out.
+    bool _draining;
+    StreamMap _streams;
+};
+
+static H2Settings MakeLocalSettings() {
+    H2Settings s;
+    s.max_concurrent_streams = FLAGS_h2_max_concurrent_streams;
+    s.initial_window_size = FLAGS_h2_stream_window_size;
+    s.max_frame_size = FLAGS_h2_max_frame_size;
+    return s;
+}
+
+H2Context::H2Context(bool is_client)
+    : _is_client(is_client)
+    , _local_settings(MakeLocalSettings())
+    , _local_connection_window_size(FLAGS_h2_connection_window_size)
+    , _last_received_stream_id(0)
+    , _local_conn_window(_local_connection_window_size)
+    , _local_conn_unacked(0)
+    , _header_stream_id(0)
+    , _header_end_stream(false)
+    , _allow_indexing(true)
+    , _remote_conn_window(H2_DEFAULT_WINDOW_SIZE)
+    , _next_stream_id(1)
+    , _draining(false) {
+}
+
+H2Context::~H2Context() {
+    for (StreamMap::iterator it = _streams.begin();
+         it != _streams.end(); ++it) {
+        delete it->second;
+    }
+    _streams.clear();
+}
+
+int H2Context::Init() {
+    if (_hpack_decoder.Init() != 0 || _hpack_encoder.Init() != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void H2Context::AppendLocalSettings(butil::IOBuf* out) {
+    char payload[18];
+    size_t n = 0;
+    if (_is_client) {
+        payload[n] = 0;
+        payload[n + 1] = H2_SETTINGS_ENABLE_PUSH;
+        SaveUint32(payload + n + 2, 0);
+        n += 6;
+    } else if (_local_settings.max_concurrent_streams) {
+        payload[n] = 0;
+        payload[n + 1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+        SaveUint32(payload + n + 2, _local_settings.max_concurrent_streams);
+        n += 6;
+    }
+    payload[n] = 0;
+    payload[n + 1] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    SaveUint32(payload + n + 2, _local_settings.initial_window_size);
+    n += 6;
+    payload[n] = 0;
+    payload[n + 1] = H2_SETTINGS_MAX_FRAME_SIZE;
+    SaveUint32(payload + n + 2, _local_settings.max_frame_size);
+    n += 6;
+    AppendFrame(out, H2_FRAME_SETTINGS, 0, 0, payload, n);
+    if (_local_connection_window_size > H2_DEFAULT_WINDOW_SIZE) {
+        AppendWindowUpdate(out, 0, _local_connection_window_size -
+                           H2_DEFAULT_WINDOW_SIZE);
+    }
+}
+
+H2Stream* H2Context::FindStreamLocked(uint32_t stream_id) {
+    StreamMap::iterator it = _streams.find(stream_id);
+    return (it != _streams.end() ? it->second : NULL);
+}
+
+void H2Context::EraseStreamLocked(uint32_t stream_id) {
+    StreamMap::iterator it = _streams.find(stream_id);
+    if (it != _streams.end()) {
+        delete it->second;
+        _streams.erase(it);
+    }
+}
+
+H2StreamContext* H2Context::CompleteStreamLocked(H2Stream* s) {
+    H2StreamContext* msg = s->msg;
+    s->msg = NULL;
+    if (_is_client) {
+        // The response is complete, the stream is closed no matter the
+        // request was completely sent or not.
+        EraseStreamLocked(s->id);
+        if (_draining && _streams.empty()) {
+            msg->_close_connection = true;
+        }
+    }
+    // Server-side streams are erased after sending the responses.
+    s->remote_closed = true;
+    return msg;
+}
+
+ParseResult H2Context::ConnectionError(Socket* socket, H2Error error,
+                                        const char* reason) {
+    LOG(WARNING) << "Close http2 connection " << *socket << " due to "
+                 << H2ErrorToString(error) << ": " << reason;
+    butil::IOBuf buf;
+    AppendGoAway(&buf, _last_received_stream_id, error);
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    socket->Write(&buf, &wopt);
+    return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG, reason);
+}
+
+ParseResult H2Context::Consume(butil::IOBuf* source, Socket* socket) {
+    char headbuf[H2_FRAME_HEAD_SIZE];
+    if (source->copy_to(headbuf, sizeof(headbuf)) < sizeof(headbuf)) {
+        return MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+    }
+    H2FrameHead head;
+    ParseFrameHead(headbuf, &head);
+    if (head.payload_size > _local_settings.max_frame_size) {
+        return ConnectionError(socket, H2_FRAME_SIZE_ERROR,
+                               "Frame is larger than SETTINGS_MAX_FRAME_SIZE");
+    }
+    if (source->size() < H2_FRAME_HEAD_SIZE + head.payload_size) {
+        return MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+    }
+    source->pop_front(H2_FRAME_HEAD_SIZE);
+    butil::IOBuf frame;
+    source->cutn(&frame, head.payload_size);
+    if (_header_stream_id != 0 &&
+        (head.type != H2_FRAME_CONTINUATION ||
+         head.stream_id != _header_stream_id)) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "Header block is interrupted");
+    }
+    switch (head.type) {
+    case H2_FRAME_DATA:
+        return OnData(head, &frame, socket);
+    case H2_FRAME_HEADERS:
+        return OnHeaders(head, &frame, socket);
+    case H2_FRAME_CONTINUATION:
+        return OnContinuation(head, &frame, socket);
+    case H2_FRAME_RST_STREAM:
+        return OnRstStream(head, &frame, socket);
+    case H2_FRAME_SETTINGS:
+        return OnSettings(head, &frame, socket);
+    case H2_FRAME_PING:
+        return OnPing(head, &frame, socket);
+    case H2_FRAME_GOAWAY:
+        return OnGoAway(head, &frame, socket);
+    case H2_FRAME_WINDOW_UPDATE:
+        return OnWindowUpdate(head, &frame, socket);
+    case H2_FRAME_PRIORITY:
+        if (head.stream_id == 0 || head.payload_size != 5) {
+            return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                                   "Invalid PRIORITY");
+        }
+        // Dependencies and weights of streams are ignored.
+        return MakeMessage(NULL);
+    case H2_FRAME_PUSH_PROMISE:
+        // Clients disable pushing in SETTINGS and clients never push.
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "PUSH_PROMISE is not allowed");
+    default:
+        // rfc7540#section-4.1: Implementations MUST ignore and discard any
+        // frame that has a type that is unknown.
+        return MakeMessage(NULL);
+    }
+}
+
+ParseResult H2Context::OnHeaders(const H2FrameHead& head, butil::IOBuf* frame,
+                                 Socket* socket) {
+    if (head.stream_id == 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "HEADERS on stream 0");
+    }
+    if (RemovePadding(head, frame) != 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "Invalid padding of HEADERS");
+    }
+    if (head.flags & H2_FLAGS_PRIORITY) {
+        if (frame->size() < 5) {
+            return ConnectionError(socket, H2_FRAME_SIZE_ERROR,
+                                   "Invalid priority of HEADERS");
+        }
+        frame->pop_front(5);
+    }
+    _header_stream_id = head.stream_id;
+    _header_end_stream = (head.flags & H2_FLAGS_END_STREAM);
+    _header_block.swap(*frame);
+    if (!(head.flags & H2_FLAGS_END_HEADERS)) {
+        return MakeMessage(NULL);
+    }
+    return OnHeaderBlock(socket);
+}
+
+ParseResult H2Context::OnContinuation(const H2FrameHead& head,
+                                      butil::IOBuf* frame, Socket* socket) {
+    if (_header_stream_id == 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "CONTINUATION without HEADERS");
+    }
+    _header_block.append(*frame);
+    if (_header_block.size() > FLAGS_max_body_size) {
+        return ConnectionError(socket, H2_ENHANCE_YOUR_CALM,
+                               "Header block is too large");
+    }
+    if (!(head.flags & H2_FLAGS_END_HEADERS)) {
+        return MakeMessage(NULL);
+    }
+    return OnHeaderBlock(socket);
+}
+
+ParseResult H2Context::OnHeaderBlock(Socket* socket) {
+    const uint32_t stream_id = _header_stream_id;
+    const bool end_stream = _header_end_stream;
+    _header_stream_id = 0;
+    // Decode the whole block even if the stream is gone, otherwise the
+    // dynamic table is inconsistent with the peer's.
+    H2HeaderList headers;
+    while (!_header_block.empty()) {
+        headers.push_back(HPacker::Header());
+        if (_hpack_decoder.Decode(&_header_block, &headers.back()) <= 0) {
+            _header_block.clear();
+            return ConnectionError(socket, H2_COMPRESSION_ERROR,
+                                   "Fail to decode header block");
+        }
+    }
+    const char* conn_error = NULL;
+    butil::IOBuf out;
+    H2StreamContext* done_msg = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        H2Stream* s = FindStreamLocked(stream_id);
+        if (s == NULL && !_is_client) {
+            if ((stream_id & 1) == 0 || stream_id <= _last_received_stream_id) {
+                conn_error = "Invalid id of new stream";
+            } else {
+                _last_received_stream_id = stream_id;
+                if (_local_settings.max_concurrent_streams != 0 &&
+                    _streams.size() >= _local_settings.max_concurrent_streams) {
+                    AppendRstStream(&out, stream_id, H2_REFUSED_STREAM);
+                } else {
+                    s = new H2Stream(stream_id, 0,
+                                     _remote_settings.initial_window_size,
+                                     _local_settings.initial_window_size);
+                    _streams[stream_id] = s;
+                }
+            }
+        }
+        if (s != NULL && s->remote_closed) {
+            // rfc7540#section-5.1: frames other than WINDOW_UPDATE, PRIORITY
+            // and RST_STREAM on half-closed(remote) streams are stream
+            // errors of STREAM_CLOSED.
+            AppendRstStream(&out, stream_id, H2_STREAM_CLOSED_ERROR);
+            EraseStreamLocked(stream_id);
+            s = NULL;
+        }
+        // Otherwise the stream was reset, ignore the headers.
+        if (s != NULL) {
+            if (s->msg == NULL) {
+                s->msg = new H2StreamContext(stream_id, s->correlation_id);
+            }
+            HttpHeader& h = s->msg->header();
+            if (s->headers_received) {
+                // Trailers
+                if (!end_stream) {
+                    conn_error = "Trailers without END_STREAM";
+                }
+                for (size_t i = 0; !conn_error && i < headers.size(); ++i) {
+                    if (headers[i].name.empty() || headers[i].name[0] == ':') {
+                        conn_error = "Pseudo header in trailers";
+                    } else {
+                        h.AppendHeader(headers[i].name, headers[i].value);
+                    }
+                }
+            } else {
+                for (size_t i = 0; !conn_error && i < headers.size(); ++i) {
+                    if (!ApplyH2Header(&h, headers[i])) {
+                        conn_error = "Invalid header";
+                    }
+                }
+                if (_is_client && h.status_code() < 200 && !end_stream) {
+                    // Skip informational responses, e.g. 100-continue
+                    s->msg->Destroy();
+                    s->msg = NULL;
+                } else {
+                    s->headers_received = true;
+                }
+            }
+            if (!conn_error && end_stream && s->msg != NULL) {
+                done_msg = CompleteStreamLocked(s);
+            }
+        }
+    }
+    if (conn_error) {
+        if (done_msg) {
+            done_msg->Destroy();
+        }
+        return ConnectionError(socket, H2_PROTOCOL_ERROR, conn_error);
+    }
+    if (!out.empty()) {
+        socket->Write(&out);
+    }
+    return MakeMessage(done_msg);
+}
+
+ParseResult H2Context::OnData(const H2FrameHead& head, butil::IOBuf* frame,
+                              Socket* socket) {
+    if (head.stream_id == 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR, "DATA on stream 0");
+    }
+    // Padding is counted in flow control as well.
+    const int64_t frame_size = head.payload_size;
+    _local_conn_window -= frame_size;
+    if (_local_conn_window < 0) {
+        return ConnectionError(socket, H2_FLOW_CONTROL_ERROR,
+                               "Connection window is exceeded");
+    }
+    butil::IOBuf out;
+    _local_conn_unacked += frame_size;
+    if (_local_conn_unacked >= _local_connection_window_size / 2) {
+        AppendWindowUpdate(&out, 0, _local_conn_unacked);
+        _local_conn_window += _local_conn_unacked;
+        _local_conn_unacked = 0;
+    }
+    if (RemovePadding(head, frame) != 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "Invalid padding of DATA");
+    }
+    H2Error conn_error = H2_NO_ERROR;
+    const char* reason = NULL;
+    uint64_t failed_cid = 0;
+    H2StreamContext* done_msg = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        H2Stream* s = FindStreamLocked(head.stream_id);
+        if (s == NULL) {
+            // The stream was reset, drop the data.
+        } else if (s->remote_closed) {
+            // The request is being processed, the response is dropped.
+            AppendRstStream(&out, head.stream_id, H2_STREAM_CLOSED_ERROR);
+            EraseStreamLocked(head.stream_id);
+        } else if (!s->headers_received) {
+            conn_error = H2_PROTOCOL_ERROR;
+            reason = "DATA before HEADERS";
+        } else if ((s->local_window -= frame_size) < 0) {
+            conn_error = H2_FLOW_CONTROL_ERROR;
+            reason = "Stream window is exceeded";
+        } else {
+            butil::IOBuf& body = s->msg->body();
+            body.append(*frame);
+            if (body.size() > FLAGS_max_body_size) {
+                LOG(WARNING) << "Body of http2 stream=" << head.stream_id
+                             << " from " << *socket << " is bigger than "
+                             << FLAGS_max_body_size << " bytes. Set "
+                    "max_body_size to allow bigger messages";
+                AppendRstStream(&out, head.stream_id, H2_CANCEL);
+                failed_cid = s->correlation_id;
+                EraseStreamLocked(head.stream_id);
+            } else if (head.flags & H2_FLAGS_END_STREAM) {
+                done_msg = CompleteStreamLocked(s);
+            } else {
+                s->local_unacked += frame_size;
+                if (s->local_unacked >= _local_settings.initial_window_size / 2) {
+                    AppendWindowUpdate(&out, head.stream_id, s->local_unacked);
+                    s->local_window += s->local_unacked;
+                    s->local_unacked = 0;
+                }
+            }
+        }
+    }
+    if (conn_error != H2_NO_ERROR) {
+        return ConnectionError(socket, conn_error, reason);
+    }
+    if (!out.empty()) {
+        socket->Write(&out);
+    }
+    if (failed_cid) {
+        const bthread_id_t cid = { failed_cid };
+        bthread_id_error2(cid, ERESPONSE,
+                          "Response body exceeds max_body_size");
+    }
+    return MakeMessage(done_msg);
+}
+
+ParseResult H2Context::OnRstStream(const H2FrameHead& head,
+                                   butil::IOBuf* frame, Socket* socket) {
+    if (head.stream_id == 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "RST_STREAM on stream 0");
+    }
+    if (head.payload_size != 4) {
+        return ConnectionError(socket, H2_FRAME_SIZE_ERROR,
+                               "Invalid size of RST_STREAM");
+    }
+    char payload[4];
+    frame->cutn(payload, sizeof(payload));
+    const uint32_t error = LoadUint32(payload);
+    uint64_t failed_cid = 0;
+    bool close_connection = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        H2Stream* s = FindStreamLocked(head.stream_id);
+        if (s != NULL) {
+            failed_cid = s->correlation_id;
+            EraseStreamLocked(head.stream_id);
+            close_connection = (_is_client && _draining && _streams.empty());
+        }
+    }
+    if (failed_cid) {
+        // Refused streams are not processed by the server, retrying is safe.
+        const bthread_id_t cid = { failed_cid };
+        bthread_id_error2(cid, (error == H2_REFUSED_STREAM ? ELIMIT : EHTTP),
+                          butil::string_printf(
+                              "http2 stream=%u was reset by %s: %s",
+                              head.stream_id,
+                              butil::endpoint2str(socket->remote_side()).c_str(),
+                              H2ErrorToString(error)));
+    }
+    if (close_connection) {
+        socket->SetFailed(ELOGOFF, "%s sent GOAWAY",
+                          butil::endpoint2str(socket->remote_side()).c_str());
+    }
+    return MakeMessage(NULL);
+}
+
+ParseResult H2Context::OnSettings(const H2FrameHead& head, butil::IOBuf* frame,
+                                  Socket* socket) {
+    if (head.stream_id != 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "SETTINGS on non-zero stream");
+    }
+    if (head.flags & H2_FLAGS_ACK) {
+        if (head.payload_size != 0) {
+            return ConnectionError(socket, H2_FRAME_SIZE_ERROR,
+                                   "SETTINGS ack with payload");
+        }
+        return MakeMessage(NULL);
+    }
+    if (head.payload_size % 6 != 0) {
+        return ConnectionError(socket, H2_FRAME_SIZE_ERROR,
+                               "Invalid size of SETTINGS");
+    }
+    H2Error error = H2_NO_ERROR;
+    const char* reason = NULL;
+    butil::IOBuf out;
+    AppendFrame(&out, H2_FRAME_SETTINGS, H2_FLAGS_ACK, 0, NULL, 0);
+    bool need_flush = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        bool window_increased = false;
+        while (!frame->empty() && error == H2_NO_ERROR) {
+            char item[6];
+            frame->cutn(item, sizeof(item));
+            const uint16_t id = ((uint16_t)(uint8_t)item[0] << 8) |
+                (uint8_t)item[1];
+            const uint32_t value = LoadUint32(item + 2);
+            switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                _remote_settings.header_table_size = value;
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    error = H2_PROTOCOL_ERROR;
+                    reason = "Invalid SETTINGS_ENABLE_PUSH";
+                }
+                break;
+            case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+                _remote_settings.max_concurrent_streams = value;
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW_SIZE) {
+                    error = H2_FLOW_CONTROL_ERROR;
+                    reason = "Invalid SETTINGS_INITIAL_WINDOW_SIZE";
+                    break;
+                }
+                // rfc7540#section-6.9.2: changes windows of all streams
+                const int64_t delta =
+                    (int64_t)value - _remote_settings.initial_window_size;
+                _remote_settings.initial_window_size = value;
+                for (StreamMap::iterator it = _streams.begin();
+                     it != _streams.end(); ++it) {
+                    it->second->remote_window += delta;
+                    if (it->second->remote_window > H2_MAX_WINDOW_SIZE) {
+                        error = H2_FLOW_CONTROL_ERROR;
+                        reason = "Stream window overflows";
+                    }
+                }
+                window_increased = window_increased || delta > 0;
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_DEFAULT_MAX_FRAME_SIZE ||
+                    value > H2_MAX_FRAME_SIZE_LIMIT) {
+                    error = H2_PROTOCOL_ERROR;
+                    reason = "Invalid SETTINGS_MAX_FRAME_SIZE";
+                    break;
+                }
+                _remote_settings.max_frame_size = value;
+                break;
+            default:
+                // SETTINGS_MAX_HEADER_LIST_SIZE is advisory, unknown
+                // settings must be ignored.
+                break;
+            }
+        }
+        need_flush = (error == H2_NO_ERROR && window_increased);
+    }
+    if (error != H2_NO_ERROR) {
+        return ConnectionError(socket, error, reason);
+    }
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    socket->Write(&out, &wopt);
+    if (need_flush) {
+        WritePending(socket);
+    }
+    return MakeMessage(NULL);
+}
+
+ParseResult H2Context::OnPing(const H2FrameHead& head, butil::IOBuf* frame,
+                              Socket* socket) {
+    if (head.stream_id != 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "PING on non-zero stream");
+    }
+    if (head.payload_size != 8) {
+        return ConnectionError(socket, H2_FRAME_SIZE_ERROR,
+                               "Invalid size of PING");
+    }
+    if (head.flags & H2_FLAGS_ACK) {
+        return MakeMessage(NULL);
+    }
+    char payload[8];
+    frame->cutn(payload, sizeof(payload));
+    butil::IOBuf out;
+    AppendFrame(&out, H2_FRAME_PING, H2_FLAGS_ACK, 0, payload, sizeof(payload));
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    socket->Write(&out, &wopt);
+    return MakeMessage(NULL);
+}
+
+ParseResult H2Context::OnGoAway(const H2FrameHead& head, butil::IOBuf* frame,
+                                Socket* socket) {
+    if (head.stream_id != 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "GOAWAY on non-zero stream");
+    }
+    if (head.payload_size < 8) {
+        return ConnectionError(socket, H2_FRAME_SIZE_ERROR,
+                               "Invalid size of GOAWAY");
+    }
+    char payload[8];
+    frame->cutn(payload, sizeof(payload));
+    const uint32_t last_stream_id = LoadUint32(payload) & H2_MAX_STREAM_ID;
+    const uint32_t error = LoadUint32(payload + 4);
+    if (!_is_client) {
+        // Clients are not going to open new streams, nothing to do.
+        return MakeMessage(NULL);
+    }
+    std::vector<uint64_t> refused_cids;
+    bool close_connection = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _draining = true;
+        StreamMap::iterator it = _streams.upper_bound(last_stream_id);
+        while (it != _streams.end()) {
+            refused_cids.push_back(it->second->correlation_id);
+            delete it->second;
+            _streams.erase(it++);
+        }
+        close_connection = _streams.empty();
+    }
+    // Streams after `last_stream_id' were not processed, retry them.
+    const std::string error_text = butil::string_printf(
+        "%s sent GOAWAY: %s",
+        butil::endpoint2str(socket->remote_side()).c_str(),
+        H2ErrorToString(error));
+    for (size_t i = 0; i < refused_cids.size(); ++i) {
+        const bthread_id_t cid = { refused_cids[i] };
+        bthread_id_error2(cid, ELOGOFF, error_text);
+    }
+    if (close_connection) {
+        socket->SetFailed(ELOGOFF, "%s", error_text.c_str());
+    }
+    return MakeMessage(NULL);
+}
+
+ParseResult H2Context::OnWindowUpdate(const H2FrameHead& head,
+                                      butil::IOBuf* frame, Socket* socket) {
+    if (head.payload_size != 4) {
+        return ConnectionError(socket, H2_FRAME_SIZE_ERROR,
+                               "Invalid size of WINDOW_UPDATE");
+    }
+    char payload[4];
+    frame->cutn(payload, sizeof(payload));
+    const int64_t increment = LoadUint32(payload) & 0x7FFFFFFF;
+    if (increment == 0) {
+        return ConnectionError(socket, H2_PROTOCOL_ERROR,
+                               "Zero increment of WINDOW_UPDATE");
+    }
+    bool overflow = false;
+    bool need_flush = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (head.stream_id == 0) {
+            _remote_conn_window += increment;
+            overflow = (_remote_conn_window > H2_MAX_WINDOW_SIZE);
+            need_flush = true;
+        } else {
+            H2Stream* s = FindStreamLocked(head.stream_id);
+            if (s != NULL) {
+                s->remote_window += increment;
+                overflow = (s->remote_window > H2_MAX_WINDOW_SIZE);
+                need_flush = !s->pending.empty();
+            }
+        }
+    }
+    if (overflow) {
+        return ConnectionError(socket, H2_FLOW_CONTROL_ERROR,
+                               "Window overflows");
+    }
+    if (need_flush) {
+        WritePending(socket);
+    }
+    return MakeMessage(NULL);
+}
+
+bool H2Context::SendPendingLocked(H2Stream* s, butil::IOBuf* out) {
+    while (!s->pending.empty()) {
+        int64_t n = std::min(s->remote_window, _remote_conn_window);
+        n = std::min(n, (int64_t)_remote_settings.max_frame_size);
+        n = std::min(n, (int64_t)s->pending.size());
+        if (n <= 0) {
+            return false;
+        }
+        const uint8_t flags =
+            ((size_t)n == s->pending.size() && s->trailers.empty() ?
+             H2_FLAGS_END_STREAM : 0);
+        char head[H2_FRAME_HEAD_SIZE];
+        SerializeFrameHead(head, n, H2_FRAME_DATA, flags, s->id);
+        out->append(head, sizeof(head));
+        s->pending.cutn(out, n);
+        s->remote_window -= n;
+        _remote_conn_window -= n;
+    }
+    if (!s->trailers.empty()) {
+        AppendHeadersLocked(out, s->id, s->trailers, true);
+        s->trailers.clear();
+    }
+    return true;
+}
+
+void H2Context::AppendPending(butil::IOBuf* out) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    SendAllPendingLocked(out);
+}
+
+void H2Context::SendAllPendingLocked(butil::IOBuf* out) {
+    for (StreamMap::iterator it = _streams.begin();
+         it != _streams.end() && _remote_conn_window > 0;) {
+        H2Stream* s = it->second;
+        if (!s->pending.empty() && SendPendingLocked(s, out) && !_is_client) {
+            delete s;
+            _streams.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void H2Context::AppendHeadersLocked(butil::IOBuf* out, uint32_t stream_id,
+                                    const H2HeaderList& headers,
+                                    bool end_stream) {
+    if (_allow_indexing &&
+        _remote_settings.header_table_size < HPacker::DEFAULT_HEADER_TABLE_SIZE) {
+        // HPacker can't shrink the dynamic table, stop adding entries.
+        _allow_indexing = false;
+    }
+    butil::IOBuf block;
+    butil::IOBufAppender appender;
+    for (size_t i = 0; i < headers.size(); ++i) {
+        HPackOptions options = GetHPackOptions(headers[i].name);
+        if (!_allow_indexing &&
+            options.index_policy == HPACK_INDEX_HEADER) {
+            options.index_policy = HPACK_NOT_INDEX_HEADER;
+        }
+        _hpack_encoder.Encode(&appender, headers[i], options);
+    }
+    appender.move_to(block);
+    // Split the block into HEADERS and CONTINUATION frames.
+    uint8_t type = H2_FRAME_HEADERS;
+    uint8_t flags = (end_stream ? H2_FLAGS_END_STREAM : 0);
+    do {
+        const size_t n = std::min(block.size(),
+                                  (size_t)_remote_settings.max_frame_size);
+        if (n == block.size()) {
+            flags |= H2_FLAGS_END_HEADERS;
+        }
+        char head[H2_FRAME_HEAD_SIZE];
+        SerializeFrameHead(head, n, type, flags, stream_id);
+        out->append(head, sizeof(head));
+        block.cutn(out, n);
+        type = H2_FRAME_CONTINUATION;
+        flags = 0;
+    } while (!block.empty());
+}
+
+butil::Status H2Context::AppendRequest(butil::IOBuf* out, Socket* socket,
+                                       uint64_t correlation_id,
+                                       const H2HeaderList& headers,
+                                       butil::IOBuf* body) {
+    std::unique_lock<butil::Mutex> mu(_mutex);
+    if (_draining || _next_stream_id > H2_MAX_STREAM_ID) {
+        bool close_connection = false;
+        if (!_draining) {
+            // Stream ids run out, close the connection after existing
+            // streams are done so that a new one is created.
+            _draining = true;
+            close_connection = _streams.empty();
+        }
+        mu.unlock();
+        if (close_connection) {
+            socket->SetFailed(ELOGOFF, "Stream ids of %s run out",
+                              socket->description().c_str());
+        }
+        return butil::Status(ELOGOFF, "http2 connection to %s is closing",
+                             butil::endpoint2str(socket->remote_side()).c_str());
+    }
+    if (_remote_settings.max_concurrent_streams != 0 &&
+        _streams.size() >= _remote_settings.max_concurrent_streams) {
+        return butil::Status(ELIMIT, "Reached max_concurrent_streams=%u of %s",
+                             _remote_settings.max_concurrent_streams,
+                             butil::endpoint2str(socket->remote_side()).c_str());
+    }
+    const uint32_t stream_id = _next_stream_id;
+    _next_stream_id += 2;
+    H2Stream* s = new H2Stream(stream_id, correlation_id,
+                               _remote_settings.initial_window_size,
+                               _local_settings.initial_window_size);
+    _streams[stream_id] = s;
+    AppendHeadersLocked(out, stream_id, headers, body->empty());
+    if (!body->empty()) {
+        s->pending.swap(*body);
+        SendPendingLocked(s, out);
+    }
+    return butil::Status::OK();
+}
+
+void H2Context::AppendResponse(butil::IOBuf* out, uint32_t stream_id,
+                               const H2HeaderList& headers,
+                               butil::IOBuf* body,
+                               const H2HeaderList& trailers) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    H2Stream* s = FindStreamLocked(stream_id);
+    if (s == NULL) {
+        // Reset by the client.
+        return;
+    }
+    const bool end_stream = (body->empty() && trailers.empty());
+    AppendHeadersLocked(out, stream_id, headers, end_stream);
+    if (!end_stream) {
+        s->pending.swap(*body);
+        s->trailers = trailers;
+        if (!SendPendingLocked(s, out)) {
+            // Erased after the pending body is sent.
+            return;
+        }
+    }
+    EraseStreamLocked(stream_id);
+}
+
+class H2PendingFlush : public SocketMessage {
+public:
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket* sock) {
+        std::unique_ptr<H2PendingFlush> delete_self(this);
+        if (sock != NULL) {
+            H2Context* ctx = static_cast<H2Context*>(sock->parsing_context());
+            if (ctx != NULL) {
+                ctx->AppendPending(out);
+            }
+        }
+        return butil::Status::OK();
+    }
+};
+
+void H2Context::WritePending(Socket* socket) {
+    SocketMessagePtr<> msg(new H2PendingFlush);
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    socket->Write(msg, &wopt);
+}
+
+class H2UnsentRequest : public SocketMessage {
+public:
+    explicit H2UnsentRequest(uint64_t correlation_id)
+        : _correlation_id(correlation_id) {}
+
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket* sock);
+    size_t EstimatedByteSize() { return _body.size(); }
+
+    H2HeaderList& headers() { return _headers; }
+    butil::IOBuf& body() { return _body; }
+
+private:
+    uint64_t _correlation_id;
+    H2HeaderList _headers;
+    butil::IOBuf _body;
+};
+
+butil::Status H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out,
+                                                    Socket* sock) {
+    std::unique_ptr<H2UnsentRequest> delete_self(this);
+    if (sock == NULL) {
+        return butil::Status::OK();
+    }
+    H2Context* ctx = static_cast<H2Context*>(sock->parsing_context());
+    if (ctx == NULL) {
+        // First request over the connection, the context is reset when the
+        // connection is re-established.
+        ctx = new H2Context(true);
+        if (ctx->Init() != 0) {
+            delete ctx;
+            return butil::Status(EINTERNAL, "Fail to init http2 context");
+        }
+        if (sock->initialize_parsing_context(&ctx)) {
+            out->append(H2_CONNECTION_PREFACE, H2_CONNECTION_PREFACE_SIZE);
+            ctx->AppendLocalSettings(out);
+        }
+    }
+    return ctx->AppendRequest(out, sock, _correlation_id, _headers, &_body);
+}
+
+class H2UnsentResponse : public SocketMessage {
+public:
+    explicit H2UnsentResponse(uint32_t stream_id) : _stream_id(stream_id) {}
+
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket* sock);
+    size_t EstimatedByteSize() { return _body.size(); }
+
+    H2HeaderList& headers() { return _headers; }
+    butil::IOBuf& body() { return _body; }
+    H2HeaderList& trailers() { return _trailers; }
+
+private:
+    uint32_t _stream_id;
+    H2HeaderList _headers;
+    butil::IOBuf _body;
+    H2HeaderList _trailers;
+};
+
+butil::Status H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out,
+                                                     Socket* sock) {
+    std::unique_ptr<H2UnsentResponse> delete_self(this);
+    if (sock == NULL) {
+        return butil::Status::OK();
+    }
+    H2Context* ctx = static_cast<H2Context*>(sock->parsing_context());
+    if (ctx != NULL) {
+        ctx->AppendResponse(out, _stream_id, _headers, &_body, _trailers);
+    }
+    return butil::Status::OK();
+}
+
+SocketMessage* NewH2UnsentResponse(uint32_t stream_id,
+                                   const HttpHeader& header,
+                                   butil::IOBuf* body,
+                                   const HttpHeader* trailers) {
+    H2UnsentResponse* res = new H2UnsentResponse(stream_id);
+    H2HeaderList* list = &res->headers();
+    char status[16];
+    snprintf(status, sizeof(status), "%d", header.status_code());
+    AddH2Header(list, ":status", status);
+    AddRegularH2Headers(list, header);
+    res->body().swap(*body);
+    if (trailers != NULL) {
+        for (HttpHeader::HeaderIterator it = trailers->HeaderBegin();
+             it != trailers->HeaderEnd(); ++it) {
+            AddH2Header(&res->trailers(), it->first, it->second);
+        }
+    }
+    return res;
+}
+
+ParseResult ParseH2Message(butil::IOBuf* source, Socket* socket,
+                           bool /*read_eof*/, const void* /*arg*/) {
+    H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+    if (ctx == NULL) {
+        if (socket->CreatedByConnect()) {
+            // The context is created before sending the first request.
+            return MakeParseError(PARSE_ERROR_TRY_OTHERS);
+        }
+        char preface[H2_CONNECTION_PREFACE_SIZE];
+        const size_t n = source->copy_to(preface, sizeof(preface));
+        if (memcmp(preface, H2_CONNECTION_PREFACE, n) != 0) {
+            return MakeParseError(PARSE_ERROR_TRY_OTHERS);
+        }
+        if (n < H2_CONNECTION_PREFACE_SIZE) {
+            return MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+        }
+        source->pop_front(H2_CONNECTION_PREFACE_SIZE);
+        ctx = new H2Context(false);
+        if (ctx->Init() != 0) {
+            delete ctx;
+            LOG(ERROR) << "Fail to init http2 context";
+            return MakeParseError(PARSE_ERROR_NO_RESOURCE);
+        }
+        if (socket->initialize_parsing_context(&ctx)) {
+            butil::IOBuf settings;
+            ctx->AppendLocalSettings(&settings);
+            socket->Write(&settings);
+        }
+        return MakeMessage(NULL);
+    }
+    return ctx->Consume(source, socket);
+}
+
+void PackH2Request(butil::IOBuf*,
+                   SocketMessage** user_message,
+                   uint64_t correlation_id,
+                   const google::protobuf::MethodDescriptor*,
+                   Controller* cntl,
+                   const butil::IOBuf& /*unused*/,
+                   const Authenticator* auth) {
+    HttpHeader* header = &cntl->http_request();
+    if (auth != NULL && header->GetHeader("authorization") == NULL) {
+        std::string auth_data;
+        if (auth->GenerateCredential(&auth_data) != 0) {
+            return cntl->SetFailed(EREQUEST, "Fail to GenerateCredential");
+        }
+        header->SetHeader("authorization", auth_data);
+    }
+    // Updated in each try since the remaining time decreases.
+    if (FLAGS_rpc_deliver_timeout && cntl->deadline_us() >= 0) {
+        const int64_t left_ms = std::max(
+            (cntl->deadline_us() - butil::gettimeofday_us()) / 1000L,
+            (int64_t)0);
+        if (cntl->request_protocol() == PROTOCOL_GRPC) {
+            // At most 8 digits are allowed in grpc-timeout.
+            header->SetHeader("grpc-timeout", butil::string_printf(
+                                  "%lldm", std::min((long long)left_ms,
+                                                    99999999LL)));
+        } else {
+            header->SetHeader("x-bd-timeout-ms", butil::string_printf(
+                                  "%lld", (long long)left_ms));
+        }
+    }
+
+    // Headers are encoded when the request is written, in the same order
+    // as they're decoded by the server.
+    H2UnsentRequest* req = new H2UnsentRequest(correlation_id);
+    H2HeaderList* list = &req->headers();
+    const URI& uri = header->uri();
+    AddH2Header(list, ":method", HttpMethod2Str(header->method()));
+    AddH2Header(list, ":scheme", (uri.schema() == "https" ? "https" : "http"));
+    std::string authority;
+    const std::string* host = header->GetHeader("host");
+    if (host != NULL) {
+        authority = *host;
+    } else if (!uri.host().empty()) {
+        authority = uri.host();
+        if (uri.port() >= 0) {
+            butil::string_appendf(&authority, ":%d", uri.port());
+        }
+    } else if (cntl->remote_side().port != 0) {
+        authority = butil::endpoint2str(cntl->remote_side()).c_str();
+    }
+    AddH2Header(list, ":authority", authority);
+    std::string path;
+    uri.GenerateH2Path(&path);
+    AddH2Header(list, ":path", path);
+    AddRegularH2Headers(list, *header);
+    if (header->GetHeader("accept") == NULL) {
+        AddH2Header(list, "accept", "*/*");
+    }
+    if (header->GetHeader("user-agent") == NULL) {
+        AddH2Header(list, "user-agent", "brpc/1.0 curl/7.0");
+    }
+    const std::string& user_info = uri.user_info();
+    if (!user_info.empty() && header->GetHeader("authorization") == NULL) {
+        std::string encoded_user_info;
+        butil::Base64Encode(user_info, &encoded_user_info);
+        AddH2Header(list, "authorization", "Basic " + encoded_user_info);
+    }
+    if (header->method() != HTTP_METHOD_GET) {
+        // Copying IOBuf just adds references, the attachment is kept for
+        // retrying.
+        req->body() = cntl->request_attachment();
+    }
+    *user_message = req;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,69 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_HTTP2_RPC_PROTOCOL_H
+#define BRPC_POLICY_HTTP2_RPC_PROTOCOL_H
+
+#include "brpc/policy/http_rpc_protocol.h"   // HttpContext
+#include "brpc/socket_message.h"             // SocketMessage
+
+namespace brpc {
+namespace policy {
+
+// A request or response received from a stream of a http2 connection.
+// The header has version 2.0 and pseudo headers are already converted into
+// method/uri/status_code, so that it's processed by ProcessHttpRequest and
+// ProcessHttpResponse just like messages of HTTP/1.x.
+class H2StreamContext : public HttpContext {
+public:
+    H2StreamContext(uint32_t stream_id, uint64_t correlation_id);
+
+    uint32_t stream_id() const { return _stream_id; }
+
+    // True if this is the last response before closing a connection which
+    // received GOAWAY, client-side only.
+    bool close_connection() const { return _close_connection; }
+
+private:
+friend class H2Context;
+    uint32_t _stream_id;
+    bool _close_connection;
+};
+
+// Create a message writing `header' and `body' as the response to stream
+// `stream_id', followed by headers of `trailers' if it's not NULL. Content
+// of `body' is consumed. The response is dropped if the stream was already
+// reset by the client.
+SocketMessage* NewH2UnsentResponse(uint32_t stream_id,
+                                   const HttpHeader& header,
+                                   butil::IOBuf* body,
+                                   const HttpHeader* trailers);
+
+// Implement functions required in protocol.h. Requests and responses are
+// processed by ProcessHttpRequest and ProcessHttpResponse respectively.
+ParseResult ParseH2Message(butil::IOBuf* source, Socket* socket,
+                           bool read_eof, const void* arg);
+void PackH2Request(butil::IOBuf* buf,
+                   SocketMessage** user_message_out,
+                   uint64_t correlation_id,
+                   const google::protobuf::MethodDescriptor* method,
+                   Controller* controller,
+                   const butil::IOBuf& request,
+                   const Authenticator* auth);
+
+}  // namespace policy
+} // namespace brpc
+
+#endif // BRPC_POLICY_HTTP2_RPC_PROTOCOL_H
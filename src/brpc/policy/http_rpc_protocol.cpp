@@ -25,6 +25,7 @@
 #include "butil/string_printf.h"
 #include "butil/time.h"
 #include "brpc/compress.h"
+#include "brpc/grpc.h"                         // GrpcStatus
 #include "brpc/errno.pb.h"                     // ENOSERVICE, ENOMETHOD
 #include "brpc/controller.h"                   // Controller
 #include "brpc/server.h"                       // Server
@@ -33,10 +34,14 @@
 #include "brpc/socket.h"                       // Socket
 #include "brpc/http_status_code.h"             // HTTP_STATUS_*
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/continuous_profiler.h"
 #include "brpc/builtin/index_service.h"        // IndexService
 #include "brpc/policy/gzip_compress.h"
+#include "brpc/details/compressed_body_cache.h"
 #include "brpc/details/usercode_backup_pool.h"
+#include "brpc/details/iobuf_block_tag.h"
 #include "brpc/policy/http_rpc_protocol.h"
+#include "brpc/policy/http2_rpc_protocol.h"   // H2StreamContext
 
 extern "C" {
 void bthread_assign_data(void* data);
@@ -48,6 +53,7 @@ int is_failed_after_queries(const http_parser* parser);
 int is_failed_after_http_version(const http_parser* parser);
 DECLARE_bool(http_verbose);
 DECLARE_int32(http_verbose_max_body_length);
+DECLARE_bool(rpc_deliver_timeout);
 
 namespace policy {
 
@@ -127,6 +133,15 @@ CommonStrings::CommonStrings()
     , H2_METHOD(":method")
     , METHOD_GET("GET")
     , METHOD_POST("POST")
+    , CONTENT_TYPE_GRPC("application/grpc")
+    , TE("te")
+    , TRAILERS("trailers")
+    , GRPC_ENCODING("grpc-encoding")
+    , GRPC_ACCEPT_ENCODING("grpc-accept-encoding")
+    , GRPC_ACCEPT_ENCODING_VALUE("identity,deflate,gzip,snappy")
+    , GRPC_STATUS("grpc-status")
+    , GRPC_MESSAGE("grpc-message")
+    , GRPC_TIMEOUT("grpc-timeout")
 {}
 
 static CommonStrings* common = NULL;
@@ -144,13 +159,16 @@ const CommonStrings* get_common_strings() { return common; }
 enum HttpContentType {
     HTTP_CONTENT_OTHERS = 0,
     HTTP_CONTENT_JSON = 1,
-    HTTP_CONTENT_PROTO = 2
+    HTTP_CONTENT_PROTO = 2,
+    HTTP_CONTENT_GRPC = 3
 };
 
 inline HttpContentType ParseContentType(butil::StringPiece content_type) {
     const butil::StringPiece prefix = "application/";
     const butil::StringPiece json = "json";
     const butil::StringPiece proto = "proto";
+    const butil::StringPiece grpc = "grpc";
+    const butil::StringPiece grpc_proto = "+proto";
 
     // According to http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.7
     //   media-type  = type "/" subtype *( ";" parameter )
@@ -167,6 +185,13 @@ inline HttpContentType ParseContentType(butil::StringPiece content_type) {
     } else if (content_type.starts_with(proto)) {
         type = HTTP_CONTENT_PROTO;
         content_type.remove_prefix(proto.size());
+    } else if (content_type.starts_with(grpc)) {
+        // "application/grpc" or "application/grpc+proto"
+        type = HTTP_CONTENT_GRPC;
+        content_type.remove_prefix(grpc.size());
+        if (content_type.starts_with(grpc_proto)) {
+            content_type.remove_prefix(grpc_proto.size());
+        }
     } else {
         return HTTP_CONTENT_OTHERS;
     }
@@ -211,11 +236,168 @@ static void PrintMessage(const butil::IOBuf& inbuf,
     std::cerr << buf2 << std::endl;
 }
 
+// Size of the prefix of gRPC Length-Prefixed-Message: a compressed-flag
+// byte followed by the 4-byte big-endian length of the message.
+static const size_t GRPC_PREFIX_SIZE = 5;
+
+static const char* CompressTypeToGrpcEncoding(CompressType type) {
+    switch (type) {
+    case COMPRESS_TYPE_NONE:
+        return "identity";
+    case COMPRESS_TYPE_GZIP:
+        return "gzip";
+    case COMPRESS_TYPE_ZLIB:
+        return "deflate";
+    case COMPRESS_TYPE_SNAPPY:
+        return "snappy";
+    default:
+        return NULL;
+    }
+}
+
+static bool GrpcEncodingToCompressType(const std::string* encoding,
+                                       CompressType* type) {
+    if (encoding == NULL || *encoding == "identity") {
+        *type = COMPRESS_TYPE_NONE;
+    } else if (*encoding == "gzip") {
+        *type = COMPRESS_TYPE_GZIP;
+    } else if (*encoding == "deflate") {
+        *type = COMPRESS_TYPE_ZLIB;
+    } else if (*encoding == "snappy") {
+        *type = COMPRESS_TYPE_SNAPPY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// True if `encoding' is listed in "grpc-accept-encoding".
+static bool IsGrpcEncodingAccepted(const std::string* accept_encoding,
+                                   const char* encoding) {
+    if (accept_encoding == NULL) {
+        return false;
+    }
+    for (butil::StringSplitter sp(accept_encoding->c_str(), ','); sp; ++sp) {
+        butil::StringPiece e(sp.field(), sp.length());
+        while (!e.empty() && e.front() == ' ') {
+            e.remove_prefix(1);
+        }
+        while (!e.empty() && e.back() == ' ') {
+            e.remove_suffix(1);
+        }
+        if (e == encoding) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Append `payload' to `out' as a Length-Prefixed-Message. Blocks of
+// `payload' are referenced rather than copied.
+static void AppendGrpcMessage(butil::IOBuf* out, const butil::IOBuf& payload,
+                              bool compressed) {
+    const uint32_t length = payload.size();
+    char prefix[GRPC_PREFIX_SIZE];
+    prefix[0] = (compressed ? 1 : 0);
+    prefix[1] = (length >> 24) & 0xFF;
+    prefix[2] = (length >> 16) & 0xFF;
+    prefix[3] = (length >> 8) & 0xFF;
+    prefix[4] = length & 0xFF;
+    out->append(prefix, sizeof(prefix));
+    out->append(payload);
+}
+
+// Parse the Length-Prefixed-Message in `body' into `msg'. `encoding' is
+// the value of "grpc-encoding", the compress type of the message is stored
+// in `compress_type'. Streaming RPCs are not supported, `body' must contain
+// exactly one message.
+static bool ParseGrpcMessage(butil::IOBuf* body, const std::string* encoding,
+                             google::protobuf::Message* msg,
+                             CompressType* compress_type,
+                             std::string* error) {
+    char prefix[GRPC_PREFIX_SIZE];
+    if (body->cutn(prefix, sizeof(prefix)) != sizeof(prefix)) {
+        *error = "Incomplete prefix of grpc message";
+        return false;
+    }
+    const uint32_t length = ((uint32_t)(uint8_t)prefix[1] << 24) |
+        ((uint32_t)(uint8_t)prefix[2] << 16) |
+        ((uint32_t)(uint8_t)prefix[3] << 8) | (uint8_t)prefix[4];
+    if (length != body->size()) {
+        butil::string_printf(error, "length=%u of grpc message does not match"
+                             " the remaining %lu bytes", length,
+                             (unsigned long)body->size());
+        return false;
+    }
+    CompressType type = COMPRESS_TYPE_NONE;
+    if (prefix[0] == 1) {
+        if (!GrpcEncodingToCompressType(encoding, &type) ||
+            type == COMPRESS_TYPE_NONE) {
+            butil::string_printf(error, "Unsupported grpc-encoding=%s",
+                                 (encoding ? encoding->c_str() : "identity"));
+            return false;
+        }
+    } else if (prefix[0] != 0) {
+        *error = "Invalid compressed-flag of grpc message";
+        return false;
+    }
+    *compress_type = type;
+    if (!ParseFromCompressedData(*body, msg, type)) {
+        butil::string_printf(error, "Fail to parse grpc message as %s",
+                             msg->GetDescriptor()->full_name().c_str());
+        return false;
+    }
+    return true;
+}
+
+// Results of gRPC calls are carried by the "grpc-status" and "grpc-message"
+// trailers, which are merged into `h' along with headers.
+static void ProcessGrpcResponse(Controller* cntl, const HttpHeader& h,
+                                butil::IOBuf* body) {
+    const std::string* status_str = h.GetHeader(common->GRPC_STATUS);
+    if (status_str == NULL) {
+        return cntl->SetFailed(ERESPONSE, "Missing %s in grpc response",
+                               common->GRPC_STATUS.c_str());
+    }
+    char* status_end = NULL;
+    const long status = strtol(status_str->c_str(), &status_end, 10);
+    if (*status_end || status < 0 || status >= GRPC_MAX) {
+        return cntl->SetFailed(ERESPONSE, "Invalid %s=%s",
+                               common->GRPC_STATUS.c_str(),
+                               status_str->c_str());
+    }
+    if (status != GRPC_OK) {
+        std::string message;
+        const std::string* encoded = h.GetHeader(common->GRPC_MESSAGE);
+        if (encoded != NULL) {
+            PercentDecode(*encoded, &message);
+        }
+        return cntl->SetFailed(GrpcStatusToErrorCode((GrpcStatus)status),
+                               "%s", message.c_str());
+    }
+    if (cntl->response() == NULL) {
+        return;
+    }
+    std::string error;
+    CompressType compress_type = COMPRESS_TYPE_NONE;
+    if (!ParseGrpcMessage(body, h.GetHeader(common->GRPC_ENCODING),
+                          cntl->response(), &compress_type, &error)) {
+        cntl->SetFailed(ERESPONSE, "%s", error.c_str());
+    }
+}
+
 void ProcessHttpResponse(InputMessageBase* msg) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
     DestroyingPtr<HttpContext> imsg_guard(static_cast<HttpContext*>(msg));
     Socket* socket = imsg_guard->socket();
-    uint64_t cid_value = socket->correlation_id();
+    const bool is_http2 = imsg_guard->header().is_http2();
+    // Responses of http2 are associated with RPCs by streams, responses of
+    // pipelined HTTP/1.x requests are associated by PipelinedInfo in the
+    // order of requests, otherwise there's only one RPC over the socket.
+    uint64_t cid_value = imsg_guard->correlation_id();
+    if (cid_value == 0 && !is_http2) {
+        cid_value = socket->correlation_id();
+    }
     if (cid_value == 0) {
         LOG(WARNING) << "Fail to find correlation_id from " << *socket;
         return;
@@ -230,6 +412,7 @@ void ProcessHttpResponse(InputMessageBase* msg) {
     }
 
     ControllerPrivateAccessor accessor(cntl);
+    accessor.mark_phase(RPC_CLIENT_RECEIVED, msg->received_us());
     
     Span* span = accessor.span();
     if (span) {
@@ -247,6 +430,12 @@ void ProcessHttpResponse(InputMessageBase* msg) {
     const int saved_error = cntl->ErrorCode();
 
     do {
+        if (is_http2) {
+            // The last stream of a connection which received GOAWAY.
+            if (static_cast<H2StreamContext*>(msg)->close_connection()) {
+                socket->SetFailed();
+            }
+        }
         // If header has "Connection: close", close the connection.
         const std::string* conn_cmd = res_header->GetHeader(common->CONNECTION);
         if (conn_cmd != NULL && 0 == strcasecmp(conn_cmd->c_str(), "close")) {
@@ -320,6 +509,10 @@ void ProcessHttpResponse(InputMessageBase* msg) {
             }
             break;
         }
+        if (cntl->request_protocol() == PROTOCOL_GRPC) {
+            ProcessGrpcResponse(cntl, *res_header, &res_body);
+            break;
+        }
         if (cntl->response() == NULL ||
             cntl->response()->GetDescriptor()->field_count() == 0) {
             // a http call, content is the "real response".
@@ -371,9 +564,66 @@ void ProcessHttpResponse(InputMessageBase* msg) {
     accessor.OnResponse(cid, saved_error);
 }
 
+// Fill headers shared by http and grpc requests.
+static void FillHttpRequestHeader(Controller* cntl) {
+    // Make RPC fail if uri() is not OK (previous SetHttpURL/operator= failed)
+    if (!cntl->http_request().uri().status().ok()) {
+        return cntl->SetFailed(EREQUEST, "%s",
+                        cntl->http_request().uri().status().error_cstr());
+    }
+    HttpHeader* header = &cntl->http_request();
+    ControllerPrivateAccessor accessor(cntl);
+
+    // Fill log-id if user set it.
+    if (cntl->has_log_id()) {
+        header->SetHeader(common->LOG_ID,
+                          butil::string_printf(
+                              "%llu", (unsigned long long)cntl->log_id()));
+    }
+
+    // HTTP before 1.1 needs to set keep-alive explicitly.
+    if (header->before_http_1_1() &&
+        cntl->connection_type() != CONNECTION_TYPE_SHORT &&
+        header->GetHeader(common->CONNECTION) == NULL) {
+        header->SetHeader(common->CONNECTION, common->KEEP_ALIVE);
+    }
+
+    // Set url to /ServiceName/MethodName when we're about to call protobuf
+    // services (indicated by non-NULL method).
+    const google::protobuf::MethodDescriptor* method = cntl->method();
+    if (method != NULL) {
+        header->set_method(HTTP_METHOD_POST);
+        std::string path;
+        path.reserve(2 + method->service()->full_name().size()
+                     + method->name().size());
+        path.push_back('/');
+        path.append(method->service()->full_name());
+        path.push_back('/');
+        path.append(method->name());
+        header->uri().set_path(path);
+    }
+
+    Span* span = accessor.span();
+    if (span) {
+        header->SetHeader("x-bd-trace-id", butil::string_printf(
+                              "%llu", (unsigned long long)span->trace_id()));
+        header->SetHeader("x-bd-span-id", butil::string_printf(
+                              "%llu", (unsigned long long)span->span_id()));
+        header->SetHeader("x-bd-parent-span-id", butil::string_printf(
+                              "%llu", (unsigned long long)span->parent_span_id()));
+    }
+}
+
 void SerializeHttpRequest(butil::IOBuf* /*not used*/,
                           Controller* cntl,
                           const google::protobuf::Message* request) {
+    if (cntl->request_protocol() == PROTOCOL_HTTP &&
+        cntl->connection_type() == CONNECTION_TYPE_SINGLE &&
+        cntl->is_response_read_progressively()) {
+        // Following responses can't be parsed before the body is read.
+        return cntl->SetFailed(EREQUEST, "Can't read response progressively "
+                               "with CONNECTION_TYPE_SINGLE");
+    }
     if (request != NULL) {
         // If request is not NULL, message body will be serialized json,
         if (!request->IsInitialized()) {
@@ -385,6 +635,7 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
             return cntl->SetFailed(EREQUEST, "request_attachment must be empty "
                                    "when request is not NULL");
         }
+        butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_MESSAGE);
         butil::IOBufAsZeroCopyOutputStream wrapper(&cntl->request_attachment());
         const HttpContentType content_type
                 = ParseContentType(cntl->http_request().content_type());
@@ -416,11 +667,6 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
         // Use request_attachment.
         // TODO: Checking required fields of http header.
     }
-    // Make RPC fail if uri() is not OK (previous SetHttpURL/operator= failed)
-    if (!cntl->http_request().uri().status().ok()) {
-        return cntl->SetFailed(EREQUEST, "%s",
-                        cntl->http_request().uri().status().error_cstr());
-    }
     if (cntl->request_compress_type() != COMPRESS_TYPE_NONE) {
         if (cntl->request_compress_type() != COMPRESS_TYPE_GZIP) {
             return cntl->SetFailed(EREQUEST, "http does not support %s",
@@ -438,48 +684,40 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
             }
         }
     }
+    FillHttpRequestHeader(cntl);
+}
 
-    HttpHeader* header = &cntl->http_request();
-    ControllerPrivateAccessor accessor(cntl);
-
-    // Fill log-id if user set it.
-    if (cntl->has_log_id()) {
-        header->SetHeader(common->LOG_ID,
-                          butil::string_printf(
-                              "%llu", (unsigned long long)cntl->log_id()));
-    }
-
-    // HTTP before 1.1 needs to set keep-alive explicitly.
-    if (header->before_http_1_1() &&
-        cntl->connection_type() != CONNECTION_TYPE_SHORT &&
-        header->GetHeader(common->CONNECTION) == NULL) {
-        header->SetHeader(common->CONNECTION, common->KEEP_ALIVE);
-    }
-
-    // Set url to /ServiceName/MethodName when we're about to call protobuf
-    // services (indicated by non-NULL method).
-    const google::protobuf::MethodDescriptor* method = cntl->method();
-    if (method != NULL) {
-        header->set_method(HTTP_METHOD_POST);
-        std::string path;
-        path.reserve(2 + method->service()->full_name().size()
-                     + method->name().size());
-        path.push_back('/');
-        path.append(method->service()->full_name());
-        path.push_back('/');
-        path.append(method->name());
-        header->uri().set_path(path);
-    }
-
-    Span* span = accessor.span();
-    if (span) {
-        header->SetHeader("x-bd-trace-id", butil::string_printf(
-                              "%llu", (unsigned long long)span->trace_id()));
-        header->SetHeader("x-bd-span-id", butil::string_printf(
-                              "%llu", (unsigned long long)span->span_id()));
-        header->SetHeader("x-bd-parent-span-id", butil::string_printf(
-                              "%llu", (unsigned long long)span->parent_span_id()));
+void SerializeGrpcRequest(butil::IOBuf* /*not used*/,
+                          Controller* cntl,
+                          const google::protobuf::Message* request) {
+    if (!cntl->request_attachment().empty()) {
+        return cntl->SetFailed(EREQUEST, "grpc does not support "
+                               "request_attachment");
+    }
+    const CompressType compress_type = cntl->request_compress_type();
+    const char* encoding = CompressTypeToGrpcEncoding(compress_type);
+    if (encoding == NULL) {
+        return cntl->SetFailed(EREQUEST, "grpc does not support %s",
+                               CompressTypeToCStr(compress_type));
+    }
+    // Serialized(and compressed) in the same way as baidu_std, the message
+    // is prefixed without being copied.
+    butil::IOBuf payload;
+    SerializeRequestDefault(&payload, cntl, request);
+    if (cntl->Failed()) {
+        return;
     }
+    AppendGrpcMessage(&cntl->request_attachment(), payload,
+                      compress_type != COMPRESS_TYPE_NONE);
+    HttpHeader* header = &cntl->http_request();
+    header->set_content_type(common->CONTENT_TYPE_GRPC);
+    header->SetHeader(common->TE, common->TRAILERS);
+    if (compress_type != COMPRESS_TYPE_NONE) {
+        header->SetHeader(common->GRPC_ENCODING, encoding);
+    }
+    header->SetHeader(common->GRPC_ACCEPT_ENCODING,
+                      common->GRPC_ACCEPT_ENCODING_VALUE);
+    FillHttpRequestHeader(cntl);
 }
 
 void PackHttpRequest(butil::IOBuf* buf,
@@ -489,9 +727,6 @@ void PackHttpRequest(butil::IOBuf* buf,
                      Controller* cntl,
                      const butil::IOBuf& /*unused*/,
                      const Authenticator* auth) {
-    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
-        return cntl->SetFailed(EREQUEST, "http can't work with CONNECTION_TYPE_SINGLE");
-    }
     ControllerPrivateAccessor accessor(cntl);
     HttpHeader* header = &cntl->http_request();
     if (auth != NULL && header->GetHeader(common->AUTHORIZATION) == NULL) {
@@ -502,9 +737,24 @@ void PackHttpRequest(butil::IOBuf* buf,
         header->SetHeader(common->AUTHORIZATION, auth_data);
     }
 
-    // Store `correlation_id' into Socket since http server
-    // may not echo back this field. But we send it anyway.
-    accessor.get_sending_socket()->set_correlation_id(correlation_id);
+    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
+        // Requests are pipelined over the connection, responses are
+        // associated with RPCs in the same order, see ParseHttpMessage().
+        accessor.set_pipelined_count(1);
+    } else {
+        // Store `correlation_id' into Socket since http server
+        // may not echo back this field. But we send it anyway.
+        accessor.get_sending_socket()->set_correlation_id(correlation_id);
+    }
+
+    // Updated in each try since the remaining time decreases.
+    if (FLAGS_rpc_deliver_timeout && cntl->deadline_us() >= 0) {
+        const int64_t left_ms = std::max(
+            (cntl->deadline_us() - butil::gettimeofday_us()) / 1000L,
+            (int64_t)0);
+        header->SetHeader("x-bd-timeout-ms", butil::string_printf(
+                              "%lld", (long long)left_ms));
+    }
 
     SerializeHttpRequest(buf, header, cntl->remote_side(),
                          &cntl->request_attachment());
@@ -551,12 +801,15 @@ static void SendHttpResponse(Controller *cntl,
                              const google::protobuf::Message *res,
                              const Server* server,
                              MethodStatus* method_status_raw,
-                             long start_parse_us) {
+                             long start_parse_us,
+                             uint32_t h2_stream_id,
+                             uint64_t response_slot) {
     ControllerPrivateAccessor accessor(cntl);
     Span* span = accessor.span();
     if (span) {
         span->set_start_send_us(butil::cpuwide_time_us());
     }
+    accessor.mark_phase(RPC_SERVER_START_SEND);
     ScopedMethodStatus method_status(method_status_raw);
     std::unique_ptr<Controller, LogErrorTextAndDelete> recycle_cntl(cntl);
     std::unique_ptr<const google::protobuf::Message> recycle_req(req);
@@ -573,11 +826,12 @@ static void SendHttpResponse(Controller *cntl,
     HttpHeader* res_header = &cntl->http_response();
     res_header->set_version(req_header->major_version(),
                             req_header->minor_version());
+    const bool is_grpc = (cntl->request_protocol() == PROTOCOL_GRPC);
 
     // Convert response to json/proto if needed.
     // Notice: Not check res->IsInitialized() which should be checked in the
     // conversion function.
-    if (res != NULL &&
+    if (!is_grpc && res != NULL &&
         cntl->response_attachment().empty() &&
         // ^ user did not fill the body yet.
         res->GetDescriptor()->field_count() > 0 &&
@@ -585,6 +839,7 @@ static void SendHttpResponse(Controller *cntl,
         !cntl->Failed()) {
         // ^ pb response in failed RPC is undefined, no need to convert.
         
+        butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_MESSAGE);
         butil::IOBufAsZeroCopyOutputStream wrapper(&cntl->response_attachment());
         const std::string* content_type_str = &res_header->content_type();
         if (content_type_str->empty()) {
@@ -631,8 +886,12 @@ static void SendHttpResponse(Controller *cntl,
     // or the server sent a Connection: close response header. If such a
     // response header exists, the client must close its end of the connection
     // after receiving the response.
+    const bool is_http2 = req_header->is_http2();
     const std::string* res_conn = res_header->GetHeader(common->CONNECTION);
-    if (res_conn == NULL || strcasecmp(res_conn->c_str(), "close") != 0) {
+    if (is_http2) {
+        // Connection-specific headers are not allowed in http2, where the
+        // connection is shared by streams.
+    } else if (res_conn == NULL || strcasecmp(res_conn->c_str(), "close") != 0) {
         const std::string* req_conn = req_header->GetHeader(common->CONNECTION);
         if (req_header->before_http_1_1()) {
             if (req_conn != NULL &&
@@ -647,8 +906,59 @@ static void SendHttpResponse(Controller *cntl,
         }
     } // else user explicitly set Connection:close, clients of
     // HTTP 1.1/1.0/0.9 should all close the connection.
+    if (server != NULL && server->IsHandedOver() && !is_http2) {
+        // Listening sockets were handed over to a hot-restarted process,
+        // tell the client to reconnect.
+        res_header->SetHeader(common->CONNECTION, common->CLOSE);
+    }
 
-    if (cntl->Failed()) {
+    HttpHeader grpc_trailers;
+    if (is_grpc) {
+        if (res != NULL && !cntl->Failed()) {
+            CompressType compress_type = cntl->response_compress_type();
+            const char* encoding = CompressTypeToGrpcEncoding(compress_type);
+            if (encoding == NULL ||
+                (compress_type != COMPRESS_TYPE_NONE &&
+                 !IsGrpcEncodingAccepted(
+                     req_header->GetHeader(common->GRPC_ACCEPT_ENCODING),
+                     encoding))) {
+                // Not compress if the client does not accept the encoding.
+                compress_type = COMPRESS_TYPE_NONE;
+            }
+            butil::IOBuf payload;
+            if (!cntl->response_attachment().empty()) {
+                cntl->SetFailed(ERESPONSE, "grpc does not support "
+                                "response_attachment");
+            } else if (!res->IsInitialized()) {
+                cntl->SetFailed(ERESPONSE, "Missing required fields in "
+                                "response: %s",
+                                res->InitializationErrorString().c_str());
+            } else if (!SerializeAsCompressedData(*res, &payload,
+                                                  compress_type)) {
+                cntl->SetFailed(ERESPONSE, "Fail to serialize %s",
+                                res->GetTypeName().c_str());
+            } else {
+                AppendGrpcMessage(&cntl->response_attachment(), payload,
+                                  compress_type != COMPRESS_TYPE_NONE);
+                if (compress_type != COMPRESS_TYPE_NONE) {
+                    res_header->SetHeader(common->GRPC_ENCODING, encoding);
+                }
+            }
+        }
+        // The status code is always 200, results of the RPC are sent in
+        // trailers.
+        res_header->set_status_code(HTTP_STATUS_OK);
+        res_header->set_content_type(common->CONTENT_TYPE_GRPC);
+        grpc_trailers.SetHeader(common->GRPC_STATUS, butil::string_printf(
+                                    "%d", ErrorCodeToGrpcStatus(cntl->ErrorCode())));
+        if (cntl->Failed()) {
+            res_header->RemoveHeader(common->GRPC_ENCODING);
+            cntl->response_attachment().clear();
+            std::string message;
+            PercentEncode(cntl->ErrorText(), &message);
+            grpc_trailers.SetHeader(common->GRPC_MESSAGE, message);
+        }
+    } else if (cntl->Failed()) {
         // Set status-code with default value(converted from error code)
         // if user did not set it.
         if (res_header->status_code() == HTTP_STATUS_OK) {
@@ -683,7 +993,7 @@ static void SendHttpResponse(Controller *cntl,
                 && SupportGzip(cntl)) {
                 TRACEPRINTF("Compressing response=%lu", (unsigned long)response_size);
                 butil::IOBuf tmpbuf;
-                if (GzipCompress(cntl->response_attachment(), &tmpbuf, NULL)) {
+                if (GzipCompressWithCache(cntl->response_attachment(), &tmpbuf)) {
                     cntl->response_attachment().swap(tmpbuf);
                     res_header->SetHeader(common->CONTENT_ENCODING, common->GZIP);
                 } else {
@@ -697,6 +1007,12 @@ static void SendHttpResponse(Controller *cntl,
         }
     }
 
+    accessor.mark_phase(RPC_SERVER_SERIALIZED);
+    if (span && FLAGS_rpc_phase_latency) {
+        span->Annotate("Serialized response in %lldus",
+                       (long long)accessor.phase_times().Between(
+                           RPC_SERVER_START_SEND, RPC_SERVER_SERIALIZED));
+    }
     int rc = -1;
     // Have the risk of unlimited pending responses, in which case, tell
     // users to set max_concurrency.
@@ -706,15 +1022,29 @@ static void SendHttpResponse(Controller *cntl,
     if (cntl->Failed() || !cntl->has_progressive_writer()) {
         content = &cntl->response_attachment();
     }
-    butil::IOBuf res_buf;
-    SerializeHttpResponse(&res_buf, res_header, content);
-    if (FLAGS_http_verbose) {
-        PrintMessage(res_buf, false, !!content);
-    }
-    if (span) {
-        span->set_response_size(res_buf.size());
+    if (is_http2) {
+        if (span) {
+            span->set_response_size(content ? content->size() : 0);
+        }
+        butil::IOBuf empty_content;
+        SocketMessagePtr<> h2_res(NewH2UnsentResponse(
+            h2_stream_id, *res_header, content ? content : &empty_content,
+            is_grpc ? &grpc_trailers : NULL));
+        rc = socket->Write(h2_res, &wopt);
+    } else {
+        butil::IOBuf res_buf;
+        SerializeHttpResponse(&res_buf, res_header, content);
+        if (FLAGS_http_verbose) {
+            PrintMessage(res_buf, false, !!content);
+        }
+        if (span) {
+            span->set_response_size(res_buf.size());
+        }
+        // Responses to pipelined requests are written in order.
+        // NOTE: chunks of progressive attachments are written directly and
+        // may be interleaved with responses to following requests.
+        rc = socket->WriteInOrder(response_slot, &res_buf);
     }
-    rc = socket->Write(&res_buf, &wopt);
 
     if (rc != 0) {
         // EPIPE is common in pooled connections + backup requests.
@@ -723,19 +1053,25 @@ static void SendHttpResponse(Controller *cntl,
         cntl->SetFailed(errcode, "Fail to write into %s", socket->description().c_str());
         return;
     }
+    accessor.mark_phase(RPC_SERVER_WRITTEN);
     if (span) {
         // TODO: this is not sent
         span->set_sent_us(butil::cpuwide_time_us());
     }
     if (method_status) {
+        if (FLAGS_rpc_phase_latency && !cntl->Failed()) {
+            method_status_raw->OnPhases(accessor.phase_times());
+        }
         method_status.release()->OnResponded(
             !cntl->Failed(), butil::cpuwide_time_us() - start_parse_us);
     }
 }
 
 inline void SendHttpResponse(Controller *cntl, const Server* svr,
-                             MethodStatus* method_status) {
-    SendHttpResponse(cntl, NULL, NULL, svr, method_status, -1);
+                             MethodStatus* method_status,
+                             uint32_t h2_stream_id, uint64_t response_slot) {
+    SendHttpResponse(cntl, NULL, NULL, svr, method_status, -1, h2_stream_id,
+                     response_slot);
 }
 
 // Normalize the sub string of `uri_path' covered by `splitter' and
@@ -859,8 +1195,46 @@ FindMethodPropertyByURI(const std::string& uri_path, const Server* server,
     return NULL;
 }
 
+// Associate an intact HTTP/1.x message with its RPC at client-side, or
+// reserve the slot of its response at server-side, both in the order of
+// messages over the connection. Returns false if the message is an
+// unexpected response.
+static bool AssociateHttpMessage(HttpContext* http_imsg, Socket* socket) {
+    if (!socket->CreatedByConnect()) {
+        http_imsg->set_response_slot(socket->ReserveOrderedWrite());
+        return true;
+    }
+    PipelinedInfo pi;
+    if (socket->PopPipelinedInfo(&pi)) {
+        http_imsg->set_correlation_id(pi.id_wait.value);
+        return true;
+    }
+    // Not pipelined, the RPC is stored in the socket.
+    return socket->correlation_id() != 0;
+}
+
+// [Server-side] Returns true and makes the remaining body of the request
+// read progressively if the method enables ServiceOptions.
+// enable_progressive_read. Called when headers of the request are parsed.
+static bool ReadRequestProgressively(HttpContext* http_imsg, Socket* socket,
+                                     const void* arg) {
+    const Server* server = static_cast<const Server*>(arg);
+    if (socket->CreatedByConnect() || server == NULL ||
+        server->options().http_master_service) {
+        return false;
+    }
+    std::string unresolved_path;
+    const Server::MethodProperty* mp = FindMethodPropertyByURI(
+        http_imsg->header().uri().path(), server, &unresolved_path);
+    if (mp == NULL || !mp->params.enable_progressive_read) {
+        return false;
+    }
+    http_imsg->set_read_body_progressively();
+    return true;
+}
+
 ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket, 
-                             bool read_eof, const void* /*arg*/) {
+                             bool read_eof, const void* arg) {
     HttpContext* http_imsg = 
         static_cast<HttpContext*>(socket->parsing_context());
     if (http_imsg == NULL) {
@@ -887,6 +1261,7 @@ ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket,
         // completed or destroyed along with the socket.
         socket->reset_parsing_context(http_imsg);
     }
+    const HttpParserStage stage_before = http_imsg->stage();
     ssize_t rc = 0;
     if (read_eof) {
         // Send EOF to HttpContext, check comments in http_message.h
@@ -924,15 +1299,26 @@ ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket,
         source->pop_front(rc);
         if (http_imsg->Completed()) {
             CHECK_EQ(http_imsg, socket->release_parsing_context());
+            if (!AssociateHttpMessage(http_imsg, socket)) {
+                http_imsg->Destroy();
+                return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG,
+                                      "unexpected http response");
+            }
             const ParseResult result = MakeMessage(http_imsg);
             if (socket->is_read_progressive()) {
                 socket->OnProgressiveReadCompleted();
             }
             return result;
-        } else if (socket->is_read_progressive() &&
-                   http_imsg->stage() >= HTTP_ON_HEADERS_COMPLELE) {
+        } else if (http_imsg->stage() >= HTTP_ON_HEADERS_COMPLELE &&
+                   (socket->is_read_progressive() ||
+                    (stage_before < HTTP_ON_HEADERS_COMPLELE &&
+                     ReadRequestProgressively(http_imsg, socket, arg)))) {
             // header part of a progressively-read http message is complete,
             // go on to ProcessHttpXXX w/o waiting for full body.
+            if (!AssociateHttpMessage(http_imsg, socket)) {
+                return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG,
+                                      "unexpected http response");
+            }
             http_imsg->AddOneRefForStage2(); // released when body is fully read
             return MakeMessage(http_imsg);
         } else {
@@ -971,9 +1357,8 @@ ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket,
             HttpHeader header;
             header.set_status_code(HTTP_STATUS_BAD_REQUEST);
             SerializeHttpRequest(&bad_req, &header, socket->remote_side(), NULL);
-            Socket::WriteOptions wopt;
-            wopt.ignore_eovercrowded = true;
-            socket->Write(&bad_req, &wopt);
+            // After responses to previous pipelined requests.
+            socket->WriteInOrder(socket->ReserveOrderedWrite(), &bad_req);
             return MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
         } else {
             return MakeParseError(PARSE_ERROR_TRY_OTHERS);
@@ -1044,8 +1429,25 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         return;
     }
     ControllerPrivateAccessor accessor(cntl.get());
+    accessor.mark_phase(RPC_SERVER_START_PARSE, start_parse_us);
+    if (imsg_guard->read_body_progressively()) {
+        // The remaining body is read by the method with
+        // Controller::ReadProgressiveAttachmentBy(), or ignored when the
+        // controller is destroyed, e.g. the request is rejected below.
+        accessor.set_readable_progressive_attachment(imsg_guard.get());
+    }
     HttpHeader& req_header = cntl->http_request();
     imsg_guard->header().Swap(req_header);
+    // Responses of http2 are sent to the streams of requests, while those of
+    // HTTP/1.x are written into the slots reserved in ParseHttpMessage().
+    const uint32_t h2_stream_id = (req_header.is_http2() ?
+        static_cast<H2StreamContext*>(msg)->stream_id() : 0);
+    const uint64_t response_slot = imsg_guard->response_slot();
+    ProtocolType protocol = PROTOCOL_HTTP;
+    if (req_header.is_http2()) {
+        protocol = (ParseContentType(req_header.content_type()) ==
+                    HTTP_CONTENT_GRPC ? PROTOCOL_GRPC : PROTOCOL_H2);
+    }
     butil::IOBuf& req_body = imsg_guard->body();
     
     butil::EndPoint user_addr;
@@ -1061,7 +1463,7 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         .set_remote_side(user_addr)
         .set_local_side(socket->local_side())
         .set_auth_context(socket->auth_context())
-        .set_request_protocol(PROTOCOL_HTTP)
+        .set_request_protocol(protocol)
         .move_in_server_receiving_sock(socket_guard);
     
     // Read log-id. errno may be set when input to strtoull overflows.
@@ -1072,13 +1474,43 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         errno = 0;
         uint64_t logid = strtoull(log_id_str->c_str(), &logid_end, 10);
         if (*logid_end || errno) {
-            LOG(ERROR) << "Invalid " << common->LOG_ID << '=' 
+            LOG(ERROR) << "Invalid " << common->LOG_ID.str() << '=' 
                        << *log_id_str << " in http request";
         } else {
             cntl->set_log_id(logid);
         }
     }
 
+    // Milliseconds that the client still waits, set by brpc clients.
+    const std::string* timeout_ms_str = req_header.GetHeader("x-bd-timeout-ms");
+    if (timeout_ms_str) {
+        char* timeout_end = NULL;
+        errno = 0;
+        const long long timeout_ms =
+            strtoll(timeout_ms_str->c_str(), &timeout_end, 10);
+        if (*timeout_end || errno || timeout_ms < 0) {
+            LOG(ERROR) << "Invalid x-bd-timeout-ms=" << *timeout_ms_str
+                       << " in http request";
+        } else {
+            accessor.set_deadline(msg->received_us() + msg->base_real_us(),
+                                  timeout_ms);
+        }
+    }
+    if (protocol == PROTOCOL_GRPC) {
+        const std::string* grpc_timeout =
+            req_header.GetHeader(common->GRPC_TIMEOUT);
+        if (grpc_timeout) {
+            const int64_t timeout_us = ConvertGrpcTimeoutToUS(grpc_timeout);
+            if (timeout_us < 0) {
+                LOG(ERROR) << "Invalid " << common->GRPC_TIMEOUT.str() << '='
+                           << *grpc_timeout << " in grpc request";
+            } else {
+                accessor.set_deadline(msg->received_us() + msg->base_real_us(),
+                                      (timeout_us + 999) / 1000);
+            }
+        }
+    }
+
     // Tag the bthread with this server's key for
     // thread_local_data().
     if (server->thread_local_options().thread_local_data_factory) {
@@ -1111,13 +1543,14 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         span->set_remote_side(user_addr);
         span->set_received_us(msg->received_us());
         span->set_start_parse_us(start_parse_us);
-        span->set_protocol(PROTOCOL_HTTP);
+        span->set_protocol(protocol);
         span->set_request_size(imsg_guard->parsed_length());
     }
     
     if (!server->IsRunning()) {
         cntl->SetFailed(ELOGOFF, "Server is stopping");
-        return SendHttpResponse(cntl.release(), server, NULL);
+        return SendHttpResponse(cntl.release(), server, NULL, h2_stream_id,
+                                response_slot);
     }
 
     if (server->options().http_master_service) {
@@ -1127,22 +1560,25 @@ void ProcessHttpRequest(InputMessageBase *msg) {
             svc->GetDescriptor()->FindMethodByName(common->DEFAULT_METHOD);
         if (md == NULL) {
             cntl->SetFailed(ENOMETHOD, "No default_method in http_master_service");
-            return SendHttpResponse(cntl.release(), server, NULL);
+            return SendHttpResponse(cntl.release(), server, NULL,
+                                    h2_stream_id, response_slot);
         }
         accessor.set_method(md);
         cntl->request_attachment().swap(req_body);
         google::protobuf::Closure* done = brpc::NewCallback<
             Controller*, const google::protobuf::Message*,
             const google::protobuf::Message*, const Server*,
-            MethodStatus *, long>(
+            MethodStatus *, long, uint32_t, uint64_t>(
                 &SendHttpResponse, cntl.get(), NULL, NULL, server,
-                NULL, start_parse_us);
+                NULL, start_parse_us, h2_stream_id, response_slot);
+        accessor.mark_phase(RPC_SERVER_START_CALLBACK);
         if (span) {
             span->ResetServerSpanName(md->full_name());
             span->set_start_callback_us(butil::cpuwide_time_us());
             span->AsParent();
         }
         // `cntl', `req' and `res' will be deleted inside `done'
+        ScopedProfiledMethod profiled_method(md);
         return svc->CallMethod(md, cntl.release(), NULL, NULL, done);
     }
     
@@ -1156,14 +1592,16 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         } else {
             cntl->SetFailed(ENOMETHOD, "Fail to find method on `%s'", path.c_str());
         }
-        return SendHttpResponse(cntl.release(), server, NULL);
+        return SendHttpResponse(cntl.release(), server, NULL, h2_stream_id,
+                                response_slot);
     } else if (sp->service->GetDescriptor() == BadMethodService::descriptor()) {
         BadMethodRequest breq;
         BadMethodResponse bres;
         butil::StringSplitter split(path.c_str(), '/');
         breq.set_service_name(std::string(split.field(), split.length()));
         sp->service->CallMethod(sp->method, cntl.get(), &breq, &bres, NULL);
-        return SendHttpResponse(cntl.release(), server, NULL);
+        return SendHttpResponse(cntl.release(), server, NULL, h2_stream_id,
+                                response_slot);
     }
     // Switch to service-specific error.
     non_service_error.release();
@@ -1172,8 +1610,16 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         if (!method_status->OnRequested()) {
             cntl->SetFailed(ELIMIT, "Reached %s's max_concurrency=%d",
                             sp->method->full_name().c_str(),
-                            method_status->max_concurrency());
-            return SendHttpResponse(cntl.release(), server, method_status);
+                            method_status->MaxConcurrency());
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
+        }
+        if (!method_status->OnDispatched(msg->received_us())) {
+            cntl->SetFailed(ELIMIT, "%s is overloaded and the request has "
+                            "been queued for too long",
+                            sp->method->full_name().c_str());
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
         }
     }
     
@@ -1186,23 +1632,40 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         if (socket->is_overcrowded()) {
             cntl->SetFailed(EOVERCROWDED, "Connection to %s is overcrowded",
                             butil::endpoint2str(socket->remote_side()).c_str());
-            return SendHttpResponse(cntl.release(), server, method_status);
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
+        }
+        if (!server_accessor.AddTenantConcurrency(cntl.get())) {
+            cntl->SetFailed(ELIMIT, "Reached quota of the tenant");
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
         }
         if (!server_accessor.AddConcurrency(cntl.get())) {
             cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
                             server->options().max_concurrency);
-            return SendHttpResponse(cntl.release(), server, method_status);
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
         }
         if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
             cntl->SetFailed(ELIMIT, "Too many user code to run when"
                             " -usercode_in_pthread is on");
-            return SendHttpResponse(cntl.release(), server, method_status);
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
+        }
+        if (cntl->deadline_us() >= 0 &&
+            butil::fast_realtime_us() >= cntl->deadline_us()) {
+            // The client has given up, don't waste time on user code.
+            cntl->SetFailed(ERPCTIMEDOUT, "Deadline of %s has passed before "
+                            "it's processed", sp->method->full_name().c_str());
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
         }
     } else if (security_mode) {
         cntl->SetFailed(EPERM, "Not allowed to access builtin services, try "
                         "ServerOptions.internal_port=%d instead if you're in"
                         " internal network", server->options().internal_port);
-        return SendHttpResponse(cntl.release(), server, method_status);
+        return SendHttpResponse(cntl.release(), server, method_status,
+                                h2_stream_id, response_slot);
     }
     
     google::protobuf::Service* svc = sp->service;
@@ -1215,10 +1678,29 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     if (__builtin_expect(!req || !res, 0)) {
         PLOG(FATAL) << "Fail to new req or res";
         cntl->SetFailed("Fail to new req or res");
-        return SendHttpResponse(cntl.release(), server, method_status);
-    }
-    if (sp->params.allow_http_body_to_pb &&
-        method->input_type()->field_count() > 0) {
+        return SendHttpResponse(cntl.release(), server, method_status,
+                                h2_stream_id, response_slot);
+    }
+    if (protocol == PROTOCOL_GRPC) {
+        std::string error;
+        CompressType compress_type = COMPRESS_TYPE_NONE;
+        if (!ParseGrpcMessage(&req_body, req_header.GetHeader(common->GRPC_ENCODING),
+                              req.get(), &compress_type, &error)) {
+            cntl->SetFailed(EREQUEST, "%s", error.c_str());
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
+        }
+        cntl->set_request_compress_type(compress_type);
+    } else if (imsg_guard->read_body_progressively()) {
+        if (sp->params.allow_http_body_to_pb &&
+            method->input_type()->field_count() > 0) {
+            cntl->SetFailed(EREQUEST, "A protobuf request can't be parsed"
+                            " from progressively-read HTTP body");
+            return SendHttpResponse(cntl.release(), server, method_status,
+                                    h2_stream_id, response_slot);
+        }
+    } else if (sp->params.allow_http_body_to_pb &&
+               method->input_type()->field_count() > 0) {
         // A protobuf service. No matter if Content-type is set to
         // applcation/json or body is empty, we have to treat body as a json
         // and try to convert it to pb, which guarantees that a protobuf
@@ -1229,7 +1711,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
                 cntl->SetFailed(EREQUEST, "%s needs to be created from a"
                                 " non-empty json, it has required fields.",
                                 req->GetDescriptor()->full_name().c_str());
-                return SendHttpResponse(cntl.release(), server, method_status);
+                return SendHttpResponse(cntl.release(), server, method_status,
+                                        h2_stream_id, response_slot);
             } // else all fields of the request are optional.
         } else {
             const std::string* encoding =
@@ -1240,7 +1723,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
                 butil::IOBuf uncompressed;
                 if (!policy::GzipDecompress(req_body, &uncompressed)) {
                     cntl->SetFailed(EREQUEST, "Fail to un-gzip request body");
-                    return SendHttpResponse(cntl.release(), server, method_status);
+                    return SendHttpResponse(cntl.release(), server, method_status,
+                                            h2_stream_id, response_slot);
                 }
                 req_body.swap(uncompressed);
             }
@@ -1248,7 +1732,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
                 if (!ParsePbFromIOBuf(req.get(), req_body)) {
                     cntl->SetFailed(EREQUEST, "Fail to parse http body as %s",
                                     req->GetDescriptor()->full_name().c_str());
-                    return SendHttpResponse(cntl.release(), server, method_status);
+                    return SendHttpResponse(cntl.release(), server, method_status,
+                                            h2_stream_id, response_slot);
                 }
             } else {
                 butil::IOBufAsZeroCopyInputStream wrapper(req_body);
@@ -1259,7 +1744,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
                 if (!json2pb::JsonToProtoMessage(&wrapper, req.get(), options, &err)) {
                     cntl->SetFailed(EREQUEST, "Fail to parse http body as %s, %s",
                                     req->GetDescriptor()->full_name().c_str(), err.c_str());
-                    return SendHttpResponse(cntl.release(), server, method_status);
+                    return SendHttpResponse(cntl.release(), server, method_status,
+                                            h2_stream_id, response_slot);
                 }
             }
         }
@@ -1273,14 +1759,18 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     google::protobuf::Closure* done = brpc::NewCallback<
         Controller*, const google::protobuf::Message*,
         const google::protobuf::Message*, const Server*,
-        MethodStatus *, long>(
+        MethodStatus *, long, uint32_t, uint64_t>(
             &SendHttpResponse, cntl.get(),
             req.get(), res.get(), server,
-            method_status, start_parse_us);
+            method_status, start_parse_us, h2_stream_id, response_slot);
+    accessor.mark_phase(RPC_SERVER_START_CALLBACK);
     if (span) {
         span->set_start_callback_us(butil::cpuwide_time_us());
         span->AsParent();
     }
+    // Calls to Channels inside the method don't wait beyond the deadline.
+    ScopedInheritedDeadline inherit_deadline(cntl.get());
+    ScopedProfiledMethod profiled_method(method);
     if (!FLAGS_usercode_in_pthread) {
         return svc->CallMethod(method, cntl.release(), 
                                req.release(), res.release(), done);
@@ -1297,6 +1787,9 @@ void ProcessHttpRequest(InputMessageBase *msg) {
 }
 
 bool ParseHttpServerAddress(butil::EndPoint* point, const char* server_addr_and_port) {
+    if (strncmp(server_addr_and_port, "unix:", 5) == 0) {
+        return butil::str2endpoint(server_addr_and_port, point) == 0;
+    }
     std::string host;
     int port = -1;
     if (ParseHostAndPortFromURL(server_addr_and_port, &host, &port) != 0) {
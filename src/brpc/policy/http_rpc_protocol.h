@@ -28,28 +28,30 @@ namespace policy {
 
 // Put commonly used std::strings (or other constants that need memory
 // allocations) in this struct to avoid memory allocations for each request.
+// Names of headers are butil::CaseIgnoredKey whose hashes are computed
+// only once, which are looked up in HttpHeader faster.
 struct CommonStrings {
-    std::string ACCEPT;
+    butil::CaseIgnoredKey ACCEPT;
     std::string DEFAULT_ACCEPT;
-    std::string USER_AGENT;
+    butil::CaseIgnoredKey USER_AGENT;
     std::string DEFAULT_USER_AGENT;
-    std::string CONTENT_TYPE;
+    butil::CaseIgnoredKey CONTENT_TYPE;
     std::string CONTENT_TYPE_TEXT;
     std::string CONTENT_TYPE_JSON;
     std::string CONTENT_TYPE_PROTO;
-    std::string ERROR_CODE;
-    std::string AUTHORIZATION;
-    std::string ACCEPT_ENCODING;
-    std::string CONTENT_ENCODING;
-    std::string CONTENT_LENGTH;
+    butil::CaseIgnoredKey ERROR_CODE;
+    butil::CaseIgnoredKey AUTHORIZATION;
+    butil::CaseIgnoredKey ACCEPT_ENCODING;
+    butil::CaseIgnoredKey CONTENT_ENCODING;
+    butil::CaseIgnoredKey CONTENT_LENGTH;
     std::string GZIP;
-    std::string CONNECTION;
+    butil::CaseIgnoredKey CONNECTION;
     std::string KEEP_ALIVE;
     std::string CLOSE;
     // Many users already GetHeader("log-id") in their code, it's difficult to
     // rename this to `x-bd-log-id'.
     // NOTE: Keep in mind that this name also appears inside `http_message.cpp'
-    std::string LOG_ID;
+    butil::CaseIgnoredKey LOG_ID;
     std::string DEFAULT_METHOD;
     std::string NO_METHOD;
     std::string H2_SCHEME;
@@ -62,6 +64,15 @@ struct CommonStrings {
     std::string H2_METHOD;
     std::string METHOD_GET;
     std::string METHOD_POST;
+    std::string CONTENT_TYPE_GRPC;
+    butil::CaseIgnoredKey TE;
+    std::string TRAILERS;
+    butil::CaseIgnoredKey GRPC_ENCODING;
+    butil::CaseIgnoredKey GRPC_ACCEPT_ENCODING;
+    std::string GRPC_ACCEPT_ENCODING_VALUE;
+    butil::CaseIgnoredKey GRPC_STATUS;
+    butil::CaseIgnoredKey GRPC_MESSAGE;
+    butil::CaseIgnoredKey GRPC_TIMEOUT;
 
     CommonStrings();
 };
@@ -74,7 +85,9 @@ public:
     HttpContext(bool read_body_progressively = false)
         : InputMessageBase()
         , HttpMessage(read_body_progressively)
-        , _is_stage2(false) {
+        , _is_stage2(false)
+        , _correlation_id(0)
+        , _response_slot(0) {
         // add one ref for Destroy
         butil::intrusive_ptr<HttpContext>(this).detach();
     }
@@ -91,6 +104,16 @@ public:
     // True if AddOneRefForStage2() was ever called.
     bool is_stage2() const { return _is_stage2; }
 
+    // [Client-side] correlation_id of the RPC that this response belongs
+    // to. 0 means the one stored in the socket.
+    uint64_t correlation_id() const { return _correlation_id; }
+    void set_correlation_id(uint64_t cid) { _correlation_id = cid; }
+
+    // [Server-side] Slot of the response to this HTTP/1.x request, check
+    // Socket::ReserveOrderedWrite().
+    uint64_t response_slot() const { return _response_slot; }
+    void set_response_slot(uint64_t slot) { _response_slot = slot; }
+
     // @InputMessageBase
     void DestroyImpl() {
         RemoveOneRefForStage2();
@@ -103,6 +126,8 @@ public:
 
 private:
     bool _is_stage2;
+    uint64_t _correlation_id;
+    uint64_t _response_slot;
 };
 
 // Implement functions required in protocol.h
@@ -114,6 +139,10 @@ bool VerifyHttpRequest(const InputMessageBase* msg);
 void SerializeHttpRequest(butil::IOBuf* request_buf,
                           Controller* cntl,
                           const google::protobuf::Message* msg);
+// Serialize `msg' as a gRPC Length-Prefixed-Message sent over http2.
+void SerializeGrpcRequest(butil::IOBuf* request_buf,
+                          Controller* cntl,
+                          const google::protobuf::Message* msg);
 void PackHttpRequest(butil::IOBuf* buf,
                      SocketMessage** user_message_out,
                      uint64_t correlation_id,
@@ -17,8 +17,6 @@
 
 #include <google/protobuf/descriptor.h>          // MethodDescriptor
 #include <google/protobuf/message.h>             // Message
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
-#include <google/protobuf/io/coded_stream.h>
 #include "butil/time.h"
 #include "brpc/controller.h"                     // Controller
 #include "brpc/socket.h"                         // Socket
@@ -27,11 +25,13 @@
 #include "brpc/span.h"
 #include "brpc/compress.h"                       // ParseFromCompressedData
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/continuous_profiler.h"
 #include "brpc/rpc_dump.h"
 #include "brpc/policy/hulu_pbrpc_meta.pb.h"      // HuluRpcRequestMeta
 #include "brpc/policy/hulu_pbrpc_protocol.h"
 #include "brpc/policy/most_common_message.h"
 #include "brpc/policy/hulu_pbrpc_controller.h"   // HuluController
+#include "brpc/policy/pbrpc_helpers.h"           // SerializeHeaderAndMeta
 #include "brpc/details/usercode_backup_pool.h"
 
 extern "C" {
@@ -90,6 +90,9 @@ HuluCompressType CompressType2Hulu(CompressType type) {
     case COMPRESS_TYPE_LZ4:
         LOG(ERROR) << "Hulu doesn't support LZ4";
         return HULU_COMPRESS_TYPE_NONE;
+    case COMPRESS_TYPE_ZSTD:
+        LOG(ERROR) << "Hulu doesn't support ZSTD";
+        return HULU_COMPRESS_TYPE_NONE;
     default:
         LOG(ERROR) << "Unknown CompressType=" << type;
         return HULU_COMPRESS_TYPE_NONE;
@@ -152,24 +155,7 @@ inline void PackHuluHeader(char* hulu_header, int meta_size, int body_size) {
 template <typename Meta>
 static void SerializeHuluHeaderAndMeta(
     butil::IOBuf* out, const Meta& meta, int payload_size) {
-    const int meta_size = meta.ByteSize();
-    if (meta_size <= 244) { // most common cases
-        char header_and_meta[12 + meta_size];
-        PackHuluHeader(header_and_meta, meta_size, payload_size);
-        ::google::protobuf::io::ArrayOutputStream arr_out(header_and_meta + 12, meta_size);
-        ::google::protobuf::io::CodedOutputStream coded_out(&arr_out);
-        meta.SerializeWithCachedSizes(&coded_out); // not calling ByteSize again
-        CHECK(!coded_out.HadError());
-        out->append(header_and_meta, sizeof(header_and_meta));
-    } else {
-        char header[12];
-        PackHuluHeader(header, meta_size, payload_size);
-        out->append(header, sizeof(header));
-        butil::IOBufAsZeroCopyOutputStream buf_stream(out);
-        ::google::protobuf::io::CodedOutputStream coded_out(&buf_stream);
-        meta.SerializeWithCachedSizes(&coded_out);
-        CHECK(!coded_out.HadError());
-    }
+    SerializeHeaderAndMeta<12>(out, meta, payload_size, PackHuluHeader);
 }
 
 ParseResult ParseHuluMessage(butil::IOBuf* source, Socket* socket,
@@ -231,11 +217,11 @@ static void SendHuluResponse(int64_t correlation_id,
     if (span) {
         span->set_start_send_us(butil::cpuwide_time_us());
     }
+    accessor.mark_phase(RPC_SERVER_START_SEND);
     ScopedMethodStatus method_status(method_status_raw);
     Socket* sock = accessor.get_sending_socket();
     std::unique_ptr<HuluController, LogErrorTextAndDelete> recycle_cntl(cntl);
-    std::unique_ptr<const google::protobuf::Message> recycle_req(req);
-    std::unique_ptr<const google::protobuf::Message> recycle_res(res);
+    ScopedServerMessages recycle_messages(cntl, method_status_raw, req, res);
     ScopedRemoveConcurrency remove_concurrency_dummy(server, cntl);
 
     if (cntl->IsCloseConnection()) {
@@ -299,8 +285,14 @@ static void SendHuluResponse(int64_t correlation_id,
             res_buf.append(cntl->response_attachment().movable());
         }
     }
+    accessor.mark_phase(RPC_SERVER_SERIALIZED);
     if (span) {
         span->set_response_size(res_buf.size());
+        if (FLAGS_rpc_phase_latency) {
+            span->Annotate("Serialized response in %lldus",
+                           (long long)accessor.phase_times().Between(
+                               RPC_SERVER_START_SEND, RPC_SERVER_SERIALIZED));
+        }
     }
     
     // Have the risk of unlimited pending responses, in which case, tell
@@ -314,11 +306,15 @@ static void SendHuluResponse(int64_t correlation_id,
                         sock->description().c_str());
         return;
     }
+    accessor.mark_phase(RPC_SERVER_WRITTEN);
     if (span) {
         // TODO: this is not sent
         span->set_sent_us(butil::cpuwide_time_us());
     }
     if (method_status) {
+        if (FLAGS_rpc_phase_latency && !cntl->Failed()) {
+            method_status_raw->OnPhases(accessor.phase_times());
+        }
         method_status.release()->OnResponded(
             !cntl->Failed(), butil::cpuwide_time_us() - start_parse_us);
     }
@@ -370,6 +366,7 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
 
     ServerPrivateAccessor server_accessor(server);
     ControllerPrivateAccessor accessor(cntl.get());
+    accessor.mark_phase(RPC_SERVER_START_PARSE, start_parse_us);
     int64_t correlation_id = meta.correlation_id();
     const bool security_mode = server->options().security_mode() &&
                                socket->user() == server_accessor.acceptor();
@@ -427,6 +424,10 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
             break;
         }
 
+        if (!server_accessor.AddTenantConcurrency(cntl.get())) {
+            cntl->SetFailed(ELIMIT, "Reached quota of the tenant");
+            break;
+        }
         if (!server_accessor.AddConcurrency(cntl.get())) {
             cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
                             server->options().max_concurrency);
@@ -460,7 +461,13 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
             if (!method_status->OnRequested()) {
                 cntl->SetFailed(ELIMIT, "Reached %s's max_concurrency=%d",
                                 sp->method->full_name().c_str(),
-                                method_status->max_concurrency());
+                                method_status->MaxConcurrency());
+                break;
+            }
+            if (!method_status->OnDispatched(msg->received_us())) {
+                cntl->SetFailed(ELIMIT, "%s is overloaded and the request has "
+                                "been queued for too long",
+                                sp->method->full_name().c_str());
                 break;
             }
         }
@@ -480,8 +487,9 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
             cntl->request_attachment().swap(msg->payload);
         }
 
-        req.reset(svc->GetRequestPrototype(method).New());
-        if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
+        req.reset(NewServerRequest(svc, method, method_status, cntl.get()));
+        if (!ParseServerRequest(*req_buf_ptr, req_cmp_type, method,
+                                method_status, cntl.get(), req.get())) {
             cntl->SetFailed(EREQUEST, "Fail to parse request message, "
                             "CompressType=%s, request_size=%d", 
                             CompressTypeToCStr(req_cmp_type), reqsize);
@@ -491,7 +499,7 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
         msg.reset();
         req_buf.clear();
 
-        res.reset(svc->GetResponsePrototype(method).New());
+        res.reset(NewServerResponse(svc, method, method_status, cntl.get()));
         // `socket' will be held until response has been sent
         google::protobuf::Closure* done = ::brpc::NewCallback<
             int64_t, HuluController*, const google::protobuf::Message*,
@@ -500,10 +508,12 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
                 &SendHuluResponse, correlation_id, cntl.get(),
                 req.get(), res.get(), server,
                 method_status, start_parse_us);
+        accessor.mark_phase(RPC_SERVER_START_CALLBACK);
         if (span) {
             span->set_start_callback_us(butil::cpuwide_time_us());
             span->AsParent();
         }
+        ScopedProfiledMethod profiled_method(method);
         if (!FLAGS_usercode_in_pthread) {
             return svc->CallMethod(method, cntl.release(), 
                                    req.release(), res.release(), done);
@@ -569,6 +579,7 @@ void ProcessHuluResponse(InputMessageBase* msg_base) {
     }
     
     ControllerPrivateAccessor accessor(cntl);
+    accessor.mark_phase(RPC_CLIENT_RECEIVED, msg->received_us());
     Span* span = accessor.span();
     if (span) {
         span->set_base_real_us(msg->base_real_us());
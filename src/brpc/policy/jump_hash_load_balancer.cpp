@@ -0,0 +1,225 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>                                    // std::sort
+#include "brpc/socket.h"
+#include "brpc/policy/jump_hash_load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+static const SocketId HOLE_ID = (SocketId)-1;
+
+// Keys of holes or unavailable servers are hashed again for so many times
+// before scanning slots one by one.
+static const size_t MAX_HASHED_TRIES = 8;
+
+int32_t JumpHashLoadBalancer::JumpConsistentHash(
+    uint64_t key, int32_t num_buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+    }
+    return b;
+}
+
+bool JumpHashLoadBalancer::Add(Servers& bg, const ServerId& id) {
+    if (id.id == HOLE_ID ||
+        bg.server_map.find(id) != bg.server_map.end()) {
+        return false;
+    }
+    size_t index = bg.slots.size();
+    if (!bg.holes.empty()) {
+        // Fill the first hole, keys of the removed server go to this one.
+        index = *bg.holes.begin();
+        bg.holes.erase(bg.holes.begin());
+        bg.slots[index] = id;
+    } else {
+        bg.slots.push_back(id);
+    }
+    bg.server_map[id] = index;
+    return true;
+}
+
+bool JumpHashLoadBalancer::Remove(Servers& bg, const ServerId& id) {
+    std::map<ServerId, size_t>::iterator it = bg.server_map.find(id);
+    if (it == bg.server_map.end()) {
+        return false;
+    }
+    const size_t index = it->second;
+    bg.server_map.erase(it);
+    if (index + 1 == bg.slots.size()) {
+        // Removing the last slot is consistent by itself, as well as holes
+        // before it.
+        bg.slots.pop_back();
+        while (!bg.slots.empty() && bg.slots.back().id == HOLE_ID) {
+            bg.holes.erase(bg.slots.size() - 1);
+            bg.slots.pop_back();
+        }
+    } else {
+        bg.slots[index] = ServerId(HOLE_ID);
+        bg.holes.insert(index);
+    }
+    return true;
+}
+
+size_t JumpHashLoadBalancer::BatchAdd(
+    Servers& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Add(bg, servers[i]);
+    }
+    return count;
+}
+
+size_t JumpHashLoadBalancer::BatchRemove(
+    Servers& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Remove(bg, servers[i]);
+    }
+    return count;
+}
+
+bool JumpHashLoadBalancer::AddServer(const ServerId& server) {
+    return _db_servers.Modify(Add, server);
+}
+
+bool JumpHashLoadBalancer::RemoveServer(const ServerId& server) {
+    return _db_servers.Modify(Remove, server);
+}
+
+struct AddrAndServer {
+    butil::EndPoint addr;
+    ServerId server;
+    bool operator<(const AddrAndServer& rhs) const {
+        if (addr < rhs.addr) { return true; }
+        if (rhs.addr < addr) { return false; }
+        return server < rhs.server;
+    }
+};
+
+size_t JumpHashLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    // Fill slots in order of addresses so that clients getting same servers
+    // in one batch, e.g. the initial list from naming services, have the
+    // same slots.
+    std::vector<AddrAndServer> sorted;
+    sorted.reserve(servers.size());
+    for (size_t i = 0; i < servers.size(); ++i) {
+        SocketUniquePtr ptr;
+        if (Socket::AddressFailedAsWell(servers[i].id, &ptr) == -1) {
+            continue;
+        }
+        AddrAndServer as = { ptr->remote_side(), servers[i] };
+        sorted.push_back(as);
+    }
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<ServerId> ordered;
+    ordered.reserve(sorted.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        ordered.push_back(sorted[i].server);
+    }
+    const size_t n = _db_servers.Modify(BatchAdd, ordered);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t JumpHashLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.Modify(BatchRemove, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+LoadBalancer* JumpHashLoadBalancer::New() const {
+    return new (std::nothrow) JumpHashLoadBalancer;
+}
+
+void JumpHashLoadBalancer::Destroy() {
+    delete this;
+}
+
+int JumpHashLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    if (!in.has_request_code) {
+        LOG(ERROR) << "Controller.set_request_code() is required";
+        return EINVAL;
+    }
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->slots.size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    uint64_t key = in.request_code;
+    size_t index = JumpConsistentHash(key, n);
+    for (size_t i = 0; i < MAX_HASHED_TRIES; ++i) {
+        const SocketId id = s->slots[index].id;
+        if (id != HOLE_ID
+            && !ExcludedServers::IsExcluded(in.excluded, id)
+            && Socket::Address(id, out->ptr) == 0
+            && !(*out->ptr)->IsLogOff()) {
+            return 0;
+        }
+        // Same as the next key of the LCG in JumpConsistentHash.
+        key = key * 2862933555777941757ULL + 1;
+        index = JumpConsistentHash(key, n);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        index = (index + 1) % n;
+        const SocketId id = s->slots[index].id;
+        if (id != HOLE_ID
+            && ((i + 1) == n // always take last chance
+                || !ExcludedServers::IsExcluded(in.excluded, id))
+            && Socket::Address(id, out->ptr) == 0
+            && !(*out->ptr)->IsLogOff()) {
+            return 0;
+        }
+    }
+    return EHOSTDOWN;
+}
+
+void JumpHashLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "c_jump";
+        return;
+    }
+    os << "JumpHash{";
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << "fail to read _db_servers";
+    } else {
+        os << "slots=" << s->slots.size() << " holes=" << s->holes.size()
+           << ':';
+        for (size_t i = 0; i < s->slots.size(); ++i) {
+            os << ' ' << s->slots[i];
+        }
+    }
+    os << '}';
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,70 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_JUMP_HASH_LOAD_BALANCER_H
+#define BRPC_POLICY_JUMP_HASH_LOAD_BALANCER_H
+
+#include <stdint.h>                                     // uint64_t
+#include <vector>                                       // std::vector
+#include <map>                                          // std::map
+#include <set>                                          // std::set
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Consistent hashing with the jump consistent hash (Lamping & Veach, 2014)
+// which maps `request_code' to one of N slots in O(log N) time without any
+// memory other than the slots. Removed servers leave holes in slots which
+// are filled by servers added later, keys of holes are hashed again to
+// spread them among other servers. Servers added in one batch fill slots in
+// order of addresses, however servers added at different times fill slots
+// in the order of being added, which may differ between clients.
+class JumpHashLoadBalancer : public LoadBalancer {
+public:
+    bool AddServer(const ServerId& server);
+    bool RemoveServer(const ServerId& server);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    LoadBalancer* New() const;
+    void Destroy();
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Describe(std::ostream& os, const DescribeOptions& options);
+
+    // Map `key' to [0, num_buckets).
+    static int32_t JumpConsistentHash(uint64_t key, int32_t num_buckets);
+
+private:
+    struct Servers {
+        // Holes are ServerId((SocketId)-1).
+        std::vector<ServerId> slots;
+        std::map<ServerId, size_t> server_map;
+        std::set<size_t> holes;
+    };
+    static bool Add(Servers& bg, const ServerId& id);
+    static bool Remove(Servers& bg, const ServerId& id);
+    static size_t BatchAdd(Servers& bg, const std::vector<ServerId>& servers);
+    static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
+
+    butil::DoublyBufferedData<Servers> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_JUMP_HASH_LOAD_BALANCER_H
@@ -381,6 +381,12 @@ int64_t LocalityAwareLoadBalancer::Weight::Update(
     _begin_time_sum -= ci.begin_time_us;
     --_begin_time_count;
 
+    if (ci.error_code == EPCHANENOUGH) {
+        // Canceled because the ParallelChannel got enough responses from
+        // others, which says nothing about this server.
+        return 0;
+    }
+
     if (latency <= 0) {
         // time skews, ignore the sample.
         return 0;
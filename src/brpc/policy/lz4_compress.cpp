@@ -0,0 +1,235 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdlib.h>                            // realloc
+#include <string.h>                            // memset
+#include <algorithm>                           // std::min
+#ifdef BRPC_WITH_LZ4
+#include <lz4frame.h>
+#endif
+#include "butil/logging.h"
+#include "butil/thread_local.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/protocol.h"
+
+
+namespace brpc {
+namespace policy {
+
+#ifdef BRPC_WITH_LZ4
+
+// Input is fed to LZ4F_compressUpdate in pieces of at most this size so that
+// the staging buffer for the output is bounded.
+static const size_t LZ4_MAX_INPUT_PIECE = 64 * 1024;
+
+struct Lz4ThreadContext {
+    LZ4F_cctx* cctx;
+    LZ4F_dctx* dctx;
+    char* buf;
+    size_t buf_cap;
+};
+
+static BAIDU_THREAD_LOCAL Lz4ThreadContext* tls_lz4_ctx = NULL;
+
+static void DestroyLz4ThreadContext(void* arg) {
+    Lz4ThreadContext* ctx = static_cast<Lz4ThreadContext*>(arg);
+    if (ctx->cctx) {
+        LZ4F_freeCompressionContext(ctx->cctx);
+    }
+    if (ctx->dctx) {
+        LZ4F_freeDecompressionContext(ctx->dctx);
+    }
+    free(ctx->buf);
+    delete ctx;
+    tls_lz4_ctx = NULL;
+}
+
+static Lz4ThreadContext* GetLz4ThreadContext() {
+    Lz4ThreadContext* ctx = tls_lz4_ctx;
+    if (ctx != NULL) {
+        return ctx;
+    }
+    ctx = new (std::nothrow) Lz4ThreadContext;
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->cctx = NULL;
+    ctx->dctx = NULL;
+    ctx->buf = NULL;
+    ctx->buf_cap = 0;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&ctx->cctx, LZ4F_VERSION)) ||
+        LZ4F_isError(LZ4F_createDecompressionContext(&ctx->dctx, LZ4F_VERSION))) {
+        LOG(ERROR) << "Fail to create lz4 contexts";
+        DestroyLz4ThreadContext(ctx);
+        return NULL;
+    }
+    tls_lz4_ctx = ctx;
+    butil::thread_atexit(DestroyLz4ThreadContext, ctx);
+    return ctx;
+}
+
+bool Lz4Compress(const butil::IOBuf& in, butil::IOBuf* out) {
+    Lz4ThreadContext* ctx = GetLz4ThreadContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs.frameInfo.contentSize = in.size();
+    // Every piece is compressed into the staging buffer which is appended
+    // to `out' before the next piece, so nothing is buffered inside cctx
+    // across calls and the buffer only has to hold one piece.
+    prefs.autoFlush = 1;
+    const size_t cap = std::max((size_t)LZ4F_HEADER_SIZE_MAX,
+                                LZ4F_compressBound(LZ4_MAX_INPUT_PIECE, &prefs));
+    if (ctx->buf_cap < cap) {
+        char* buf = (char*)realloc(ctx->buf, cap);
+        if (buf == NULL) {
+            LOG(ERROR) << "Fail to allocate " << cap << " bytes";
+            return false;
+        }
+        ctx->buf = buf;
+        ctx->buf_cap = cap;
+    }
+    size_t rc = LZ4F_compressBegin(ctx->cctx, ctx->buf, ctx->buf_cap, &prefs);
+    if (LZ4F_isError(rc)) {
+        LOG(WARNING) << "Fail to LZ4F_compressBegin: " << LZ4F_getErrorName(rc);
+        return false;
+    }
+    out->append(ctx->buf, rc);
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        butil::StringPiece block = in.backing_block(i);
+        while (!block.empty()) {
+            const size_t len = std::min(block.size(), LZ4_MAX_INPUT_PIECE);
+            rc = LZ4F_compressUpdate(ctx->cctx, ctx->buf, ctx->buf_cap,
+                                     block.data(), len, NULL);
+            if (LZ4F_isError(rc)) {
+                LOG(WARNING) << "Fail to LZ4F_compressUpdate: "
+                             << LZ4F_getErrorName(rc);
+                return false;
+            }
+            out->append(ctx->buf, rc);
+            block.remove_prefix(len);
+        }
+    }
+    rc = LZ4F_compressEnd(ctx->cctx, ctx->buf, ctx->buf_cap, NULL);
+    if (LZ4F_isError(rc)) {
+        LOG(WARNING) << "Fail to LZ4F_compressEnd: " << LZ4F_getErrorName(rc);
+        return false;
+    }
+    out->append(ctx->buf, rc);
+    return true;
+}
+
+bool Lz4Decompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    Lz4ThreadContext* ctx = GetLz4ThreadContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    // Drop the state left by a previous failure.
+    LZ4F_resetDecompressionContext(ctx->dctx);
+    butil::IOBufAsZeroCopyOutputStream wrapper(out);
+    char* dst = NULL;
+    int dst_size = 0;
+    int dst_pos = 0;
+    // Non-zero until the last frame is fully decoded. Concatenated frames
+    // are decoded one after another, dctx is reset at end of each frame.
+    size_t rc = 1;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        butil::StringPiece block = in.backing_block(i);
+        while (!block.empty()) {
+            if (dst_pos == dst_size) {
+                if (!wrapper.Next((void**)&dst, &dst_size)) {
+                    return false;
+                }
+                dst_pos = 0;
+            }
+            size_t out_len = dst_size - dst_pos;
+            size_t in_len = block.size();
+            rc = LZ4F_decompress(ctx->dctx, dst + dst_pos, &out_len,
+                                 block.data(), &in_len, NULL);
+            if (LZ4F_isError(rc)) {
+                LOG(WARNING) << "Fail to LZ4F_decompress: "
+                             << LZ4F_getErrorName(rc);
+                wrapper.BackUp(dst_size - dst_pos);
+                return false;
+            }
+            dst_pos += out_len;
+            block.remove_prefix(in_len);
+        }
+    }
+    // Flush output held inside dctx when `dst' was full.
+    while (rc != 0) {
+        if (dst_pos == dst_size) {
+            if (!wrapper.Next((void**)&dst, &dst_size)) {
+                return false;
+            }
+            dst_pos = 0;
+        }
+        size_t out_len = dst_size - dst_pos;
+        size_t in_len = 0;
+        rc = LZ4F_decompress(ctx->dctx, dst + dst_pos, &out_len,
+                             "", &in_len, NULL);
+        if (LZ4F_isError(rc) || (rc != 0 && out_len == 0)) {
+            LOG(WARNING) << "Fail to LZ4F_decompress: "
+                         << (LZ4F_isError(rc) ? LZ4F_getErrorName(rc)
+                             : "truncated frame");
+            wrapper.BackUp(dst_size - dst_pos);
+            return false;
+        }
+        dst_pos += out_len;
+    }
+    wrapper.BackUp(dst_size - dst_pos);
+    return true;
+}
+
+#else  // BRPC_WITH_LZ4
+
+bool Lz4Compress(const butil::IOBuf&, butil::IOBuf*) {
+    LOG(ERROR) << "brpc is not compiled with lz4";
+    return false;
+}
+
+bool Lz4Decompress(const butil::IOBuf&, butil::IOBuf*) {
+    LOG(ERROR) << "brpc is not compiled with lz4";
+    return false;
+}
+
+#endif  // BRPC_WITH_LZ4
+
+bool Lz4Compress(const google::protobuf::Message& res, butil::IOBuf* buf) {
+    butil::IOBuf serialized_pb;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
+    if (res.SerializeToZeroCopyStream(&wrapper)) {
+        return Lz4Compress(serialized_pb, buf);
+    }
+    LOG(WARNING) << "Fail to serialize input pb=" << &res;
+    return false;
+}
+
+bool Lz4Decompress(const butil::IOBuf& data, google::protobuf::Message* req) {
+    butil::IOBuf binary_pb;
+    if (Lz4Decompress(data, &binary_pb)) {
+        return ParsePbFromIOBuf(req, binary_pb);
+    }
+    LOG(WARNING) << "Fail to lz4 decompress, size=" << data.size();
+    return false;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,47 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_LZ4_COMPRESS_H
+#define BRPC_POLICY_LZ4_COMPRESS_H
+
+#include <google/protobuf/message.h>          // Message
+#include "butil/iobuf.h"                       // IOBuf
+
+
+namespace brpc {
+namespace policy {
+
+// The data is encoded in LZ4 frame format(the one written by `lz4' command)
+// and compressed/decompressed block by block without flattening the IOBuf.
+// Available when brpc is built with LZ4(-DBRPC_WITH_LZ4=ON or --with-lz4),
+// otherwise all functions fail.
+
+// Compress serialized `msg' into `buf'.
+bool Lz4Compress(const google::protobuf::Message& msg, butil::IOBuf* buf);
+
+// Parse `msg' from decompressed `buf'
+bool Lz4Decompress(const butil::IOBuf& data, google::protobuf::Message* msg);
+
+// Put compressed `in' into `out'.
+bool Lz4Compress(const butil::IOBuf& in, butil::IOBuf* out);
+
+// Put decompressed `in' into `out'.
+bool Lz4Decompress(const butil::IOBuf& in, butil::IOBuf* out);
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_LZ4_COMPRESS_H
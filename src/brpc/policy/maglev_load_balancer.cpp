@@ -0,0 +1,271 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>                                    // std::sort
+#include <set>                                          // std::set
+#include <gflags/gflags.h>
+#include "brpc/socket.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/hasher.h"
+#include "brpc/policy/maglev_load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(maglev_table_size, 65537, "Number of entries in lookup tables "
+             "of c_maglev, rounded up to a prime. Should be much larger than "
+             "number of servers");
+BRPC_VALIDATE_GFLAG(maglev_table_size, PositiveInteger);
+
+// Entries following the one of the key are tried before scanning servers
+// one by one when the server of the key is unavailable.
+static const size_t MAX_HASHED_TRIES = 8;
+static const uint32_t EMPTY_ENTRY = (uint32_t)-1;
+
+static bool IsPrime(uint32_t n) {
+    if (n < 2) {
+        return false;
+    }
+    for (uint32_t i = 2; (uint64_t)i * i <= n; ++i) {
+        if (n % i == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t NextPrime(uint32_t n) {
+    while (!IsPrime(n)) {
+        ++n;
+    }
+    return n;
+}
+
+MaglevLoadBalancer::MaglevLoadBalancer()
+    : _table_size(NextPrime(FLAGS_maglev_table_size)) {
+}
+
+MaglevLoadBalancer::MaglevLoadBalancer(uint32_t table_size)
+    : _table_size(NextPrime(table_size)) {
+}
+
+bool MaglevLoadBalancer::MakeMember(const ServerId& server, Member* m) const {
+    SocketUniquePtr ptr;
+    if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
+        return false;
+    }
+    const std::string key = endpoint2str(ptr->remote_side()).c_str();
+    m->server = server;
+    m->addr = ptr->remote_side();
+    m->offset = MurmurHash32(key.data(), key.size()) % _table_size;
+    m->skip = MD5Hash32(key.data(), key.size()) % (_table_size - 1) + 1;
+    return true;
+}
+
+void MaglevLoadBalancer::Populate(Servers* s, uint32_t table_size) {
+    const size_t n = s->members.size();
+    if (n == 0) {
+        s->table.clear();
+        return;
+    }
+    s->table.assign(table_size, EMPTY_ENTRY);
+    // Position in the permutation of each member.
+    std::vector<uint64_t> next(n, 0);
+    uint32_t filled = 0;
+    while (true) {
+        for (size_t i = 0; i < n; ++i) {
+            const Member& m = s->members[i];
+            uint32_t c = 0;
+            do {
+                c = (m.offset + next[i] * m.skip) % table_size;
+                ++next[i];
+            } while (s->table[c] != EMPTY_ENTRY);
+            s->table[c] = i;
+            if (++filled == table_size) {
+                return;
+            }
+        }
+    }
+}
+
+size_t MaglevLoadBalancer::AddBatch(
+    Servers& bg, const Servers& fg, const std::vector<Member>& members,
+    ModifyContext* ctx) {
+    if (ctx->executed) {
+        const size_t n = fg.members.size() - bg.members.size();
+        bg = fg;
+        return n;
+    }
+    ctx->executed = true;
+    std::set<ServerId> existing;
+    for (size_t i = 0; i < fg.members.size(); ++i) {
+        existing.insert(fg.members[i].server);
+    }
+    bg.members = fg.members;
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (existing.insert(members[i].server).second) {
+            bg.members.push_back(members[i]);
+        }
+    }
+    const size_t n = bg.members.size() - fg.members.size();
+    if (n != 0) {
+        std::sort(bg.members.begin(), bg.members.end());
+        Populate(&bg, ctx->table_size);
+    }
+    return n;
+}
+
+size_t MaglevLoadBalancer::RemoveBatch(
+    Servers& bg, const Servers& fg, const std::vector<ServerId>& servers,
+    ModifyContext* ctx) {
+    if (ctx->executed) {
+        const size_t n = bg.members.size() - fg.members.size();
+        bg = fg;
+        return n;
+    }
+    ctx->executed = true;
+    const std::set<ServerId> removed(servers.begin(), servers.end());
+    bg.members.clear();
+    for (size_t i = 0; i < fg.members.size(); ++i) {
+        if (removed.find(fg.members[i].server) == removed.end()) {
+            bg.members.push_back(fg.members[i]);
+        }
+    }
+    const size_t n = fg.members.size() - bg.members.size();
+    if (n != 0) {
+        Populate(&bg, ctx->table_size);
+    }
+    return n;
+}
+
+bool MaglevLoadBalancer::AddServer(const ServerId& server) {
+    std::vector<Member> members(1);
+    if (!MakeMember(server, &members[0])) {
+        return false;
+    }
+    ModifyContext ctx(_table_size);
+    return _db_servers.ModifyWithForeground(AddBatch, members, &ctx) != 0;
+}
+
+size_t MaglevLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    std::vector<Member> members;
+    members.reserve(servers.size());
+    for (size_t i = 0; i < servers.size(); ++i) {
+        Member m;
+        if (MakeMember(servers[i], &m)) {
+            members.push_back(m);
+        }
+    }
+    ModifyContext ctx(_table_size);
+    const size_t n = _db_servers.ModifyWithForeground(AddBatch, members, &ctx);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+bool MaglevLoadBalancer::RemoveServer(const ServerId& server) {
+    std::vector<ServerId> servers(1, server);
+    ModifyContext ctx(_table_size);
+    return _db_servers.ModifyWithForeground(RemoveBatch, servers, &ctx) != 0;
+}
+
+size_t MaglevLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    ModifyContext ctx(_table_size);
+    const size_t n = _db_servers.ModifyWithForeground(RemoveBatch, servers, &ctx);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+LoadBalancer* MaglevLoadBalancer::New() const {
+    return new (std::nothrow) MaglevLoadBalancer;
+}
+
+void MaglevLoadBalancer::Destroy() {
+    delete this;
+}
+
+int MaglevLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    if (!in.has_request_code) {
+        LOG(ERROR) << "Controller.set_request_code() is required";
+        return EINVAL;
+    }
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->members.size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    const size_t table_size = s->table.size();
+    size_t pos = in.request_code % table_size;
+    // Servers of following entries are spread, so that requests of an
+    // unavailable server don't all go to a single server.
+    for (size_t i = 0; i < MAX_HASHED_TRIES && i < n; ++i) {
+        const SocketId id = s->members[s->table[pos]].server.id;
+        if (!ExcludedServers::IsExcluded(in.excluded, id)
+            && Socket::Address(id, out->ptr) == 0
+            && !(*out->ptr)->IsLogOff()) {
+            return 0;
+        }
+        pos = (pos + 1) % table_size;
+    }
+    size_t index = s->table[in.request_code % table_size];
+    for (size_t i = 0; i < n; ++i) {
+        index = (index + 1) % n;
+        const SocketId id = s->members[index].server.id;
+        if (((i + 1) == n // always take last chance
+             || !ExcludedServers::IsExcluded(in.excluded, id))
+            && Socket::Address(id, out->ptr) == 0
+            && !(*out->ptr)->IsLogOff()) {
+            return 0;
+        }
+    }
+    return EHOSTDOWN;
+}
+
+void MaglevLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "c_maglev";
+        return;
+    }
+    os << "MaglevLoadBalancer {\n"
+       << "  table size: " << _table_size << '\n';
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << "  fail to read _db_servers\n}\n";
+        return;
+    }
+    std::vector<uint32_t> nentry(s->members.size(), 0);
+    for (size_t i = 0; i < s->table.size(); ++i) {
+        ++nentry[s->table[i]];
+    }
+    os << "  number of hosts: " << s->members.size() << '\n'
+       << "  entries of hosts: {\n";
+    for (size_t i = 0; i < s->members.size(); ++i) {
+        os << "    " << s->members[i].addr << ": " << nentry[i] << '\n';
+    }
+    os << "  }\n}\n";
+}
+
+}  // namespace policy
+} // namespace brpc
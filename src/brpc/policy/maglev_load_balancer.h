@@ -0,0 +1,94 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_MAGLEV_LOAD_BALANCER_H
+#define BRPC_POLICY_MAGLEV_LOAD_BALANCER_H
+
+#include <stdint.h>                                     // uint32_t
+#include <vector>                                       // std::vector
+#include "butil/endpoint.h"                             // butil::EndPoint
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Consistent hashing with the lookup table of Maglev (NSDI'16): every server
+// fills entries of a table with -maglev_table_size (a prime) entries in the
+// order of a permutation generated from its address, and a request goes to
+// the server at entry `request_code % size'. Comparing to
+// ConsistentHashingLoadBalancer, lookups are O(1), the memory is one uint32
+// per entry instead of 100 virtual nodes per server, and membership changes
+// refill the table in O(table size) without sorting. Choose a table size
+// much larger (say 100x) than number of servers to keep loads even.
+class MaglevLoadBalancer : public LoadBalancer {
+public:
+    MaglevLoadBalancer();
+    explicit MaglevLoadBalancer(uint32_t table_size);
+    bool AddServer(const ServerId& server);
+    bool RemoveServer(const ServerId& server);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    LoadBalancer* New() const;
+    void Destroy();
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Describe(std::ostream& os, const DescribeOptions& options);
+
+private:
+    struct Member {
+        ServerId server;
+        butil::EndPoint addr;  // To make the table same among all clients
+        // The permutation of this server is offset, offset + skip, ...
+        uint32_t offset;
+        uint32_t skip;
+        bool operator<(const Member& rhs) const {
+            if (addr < rhs.addr) { return true; }
+            if (rhs.addr < addr) { return false; }
+            return server < rhs.server;
+        }
+    };
+    struct Servers {
+        // Sorted by addresses.
+        std::vector<Member> members;
+        // Indexes of members.
+        std::vector<uint32_t> table;
+    };
+    // Modify() calls the function twice, the second call copies the
+    // instance modified in the first call instead of populating again.
+    struct ModifyContext {
+        explicit ModifyContext(uint32_t table_size2)
+            : executed(false), table_size(table_size2) {}
+        bool executed;
+        uint32_t table_size;
+    };
+    static size_t AddBatch(Servers& bg, const Servers& fg,
+                           const std::vector<Member>& members,
+                           ModifyContext* ctx);
+    static size_t RemoveBatch(Servers& bg, const Servers& fg,
+                              const std::vector<ServerId>& servers,
+                              ModifyContext* ctx);
+    static void Populate(Servers* s, uint32_t table_size);
+    bool MakeMember(const ServerId& server, Member* m) const;
+
+    uint32_t _table_size;
+    butil::DoublyBufferedData<Servers> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_MAGLEV_LOAD_BALANCER_H
@@ -50,6 +50,7 @@ static pthread_once_t supported_cmd_map_once = PTHREAD_ONCE_INIT;
 static void InitSupportedCommandMap() {
     butil::bit_array_clear(supported_cmd_map, 256);
     butil::bit_array_set(supported_cmd_map, MC_BINARY_GET);
+    butil::bit_array_set(supported_cmd_map, MC_BINARY_GETKQ);
     butil::bit_array_set(supported_cmd_map, MC_BINARY_SET);
     butil::bit_array_set(supported_cmd_map, MC_BINARY_ADD);
     butil::bit_array_set(supported_cmd_map, MC_BINARY_REPLACE);
@@ -135,6 +136,10 @@ ParseResult ParseMemcacheMessage(butil::IOBuf* source,
             DestroyingPtr<MostCommonMessage> auth_msg(
                  static_cast<MostCommonMessage*>(socket->release_parsing_context()));
             socket->GivebackPipelinedInfo(pi);
+        } else if (header->command == MC_BINARY_GETKQ) {
+            // Quiet responses are not counted, the batch is ended with
+            // the response of NOOP.
+            socket->GivebackPipelinedInfo(pi);
         } else {
             if (++msg->pi.count >= pi.count) {
                 CHECK_EQ(msg->pi.count, pi.count);
@@ -22,6 +22,7 @@
 #include "brpc/server.h"                   // Server
 #include "brpc/span.h"
 #include "brpc/mongo_head.h"
+#include "brpc/mongo_msg.h"
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/mongo_service_adaptor.h"
@@ -42,13 +43,19 @@ struct SendMongoResponse : public google::protobuf::Closure {
     SendMongoResponse(const Server *server) :
         status(NULL),
         start_callback_us(0L),
-        server(server) {}
+        server(server),
+        op_msg(false),
+        no_reply(false) {}
     ~SendMongoResponse();
     void Run();
 
     MethodStatus* status;
     long start_callback_us;
     const Server *server;
+    // The request is OP_MSG which is replied with OP_MSG.
+    bool op_msg;
+    // The request is OP_MSG with moreToCome which should not be replied.
+    bool no_reply;
     Controller cntl;
     MongoRequest req;
     MongoResponse res;
@@ -71,7 +78,32 @@ void SendMongoResponse::Run() {
     const MongoServiceAdaptor* adaptor =
             server->options().mongo_service_adaptor;
     butil::IOBuf res_buf;
-    if (cntl.Failed()) {
+    if (no_reply) {
+        // Nothing to send.
+    } else if (op_msg) {
+        // OP_MSG is replied with the response attachment which is
+        // serialized by SerializeMongoMsg, or by a MongoMsgWriter created
+        // by the user if the attachment is empty.
+        butil::IOBuf body;
+        if (cntl.Failed()) {
+            MongoMsg err;
+            MakeMongoMsgError(cntl.ErrorCode(), cntl.ErrorText(), &err);
+            SerializeMongoMsg(err, &body);
+        } else {
+            body.swap(cntl.response_attachment());
+        }
+        if (!body.empty()) {
+            mongo_head_t header = {
+                (int32_t)(sizeof(mongo_head_t) + body.size()),
+                NextMongoRequestId(),
+                res.header().response_to(),
+                MONGO_OPCODE_OP_MSG
+            };
+            header.make_host_endian();
+            res_buf.append(&header, sizeof(header));
+            res_buf.append(butil::IOBuf::Movable(body));
+        }
+    } else if (cntl.Failed()) {
         adaptor->SerializeError(res.header().response_to(), &res_buf);
     } else if (res.has_message()) {
         mongo_head_t header = {
@@ -201,6 +233,16 @@ void ProcessMongoRequest(InputMessageBase* msg_base) {
 
     SendMongoResponse* mongo_done = new SendMongoResponse(server);
     mongo_done->cntl.set_mongo_session_data(context_msg->context());
+    mongo_done->res.mutable_header()->set_response_to(header->request_id);
+    if (header->op_code == MONGO_OPCODE_OP_MSG) {
+        uint32_t flag_bits = 0;
+        msg->payload.copy_to(&flag_bits, sizeof(flag_bits));
+        if (!ARCH_CPU_LITTLE_ENDIAN) {
+            flag_bits = butil::ByteSwap(flag_bits);
+        }
+        mongo_done->op_msg = true;
+        mongo_done->no_reply = (flag_bits & MONGO_MSG_MORE_TO_COME);
+    }
 
     ControllerPrivateAccessor accessor(&(mongo_done->cntl));
     accessor.set_server(server)
@@ -248,7 +290,7 @@ void ProcessMongoRequest(InputMessageBase* msg_base) {
                 mongo_done->cntl.SetFailed(
                     ELIMIT, "Reached %s's max_concurrency=%d",
                     mp->method->full_name().c_str(),
-                    method_status->max_concurrency());
+                    method_status->MaxConcurrency());
                 break;
             }
         }
@@ -259,14 +301,20 @@ void ProcessMongoRequest(InputMessageBase* msg_base) {
         }
         
         mongo_done->cntl.set_log_id(header->request_id);
-        const std::string &body_str = msg->payload.to_string();
-        mongo_done->req.set_message(body_str.c_str(), body_str.size());
+        if (mongo_done->op_msg) {
+            // Documents of OP_MSG may be large, pass them in the request
+            // attachment without copying, parse it with ParseMongoMsg.
+            mongo_done->req.set_message("");
+            mongo_done->cntl.request_attachment().swap(msg->payload);
+        } else {
+            const std::string &body_str = msg->payload.to_string();
+            mongo_done->req.set_message(body_str.c_str(), body_str.size());
+        }
         mongo_done->req.mutable_header()->set_message_length(header->message_length);
         mongo_done->req.mutable_header()->set_request_id(header->request_id);
         mongo_done->req.mutable_header()->set_response_to(header->response_to);
         mongo_done->req.mutable_header()->set_op_code(
                 static_cast<MongoOp>(header->op_code));
-        mongo_done->res.mutable_header()->set_response_to(header->request_id);
         mongo_done->start_callback_us = butil::cpuwide_time_us();
 
         google::protobuf::Service* svc = mp->service;
@@ -295,6 +295,10 @@ void ProcessNsheadRequest(InputMessageBase* msg_base) {
                             butil::endpoint2str(socket->remote_side()).c_str());
             break;
         }
+        if (!server_accessor.AddTenantConcurrency(cntl)) {
+            cntl->SetFailed(ELIMIT, "Reached quota of the tenant");
+            break;
+        }
         if (!server_accessor.AddConcurrency(cntl)) {
             cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
                             server->options().max_concurrency);
@@ -0,0 +1,284 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <math.h>                                      // exp
+#include <gflags/gflags.h>
+#include "butil/macros.h"
+#include "butil/fast_rand.h"
+#include "butil/time.h"                                // gettimeofday_us
+#include "brpc/socket.h"
+#include "brpc/controller.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/p2c_ewma_load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(p2c_ewma_decay_ms, 10000, "Time for the latency EWMA of "
+             "p2c_ewma to decay a peak to 1/e of its height");
+BRPC_VALIDATE_GFLAG(p2c_ewma_decay_ms, PositiveInteger);
+
+// Cost of a server with in-flight requests but no latency samples yet,
+// making new servers take a few requests and wait for results.
+static const int64_t NO_SAMPLE_PENALTY_US = 10000000L;
+
+int64_t P2CEwmaLoadBalancer::Node::Cost() const {
+    const int64_t n = inflight.load(butil::memory_order_relaxed);
+    // Feedback of a removed and re-added server may make it negative.
+    const int64_t pending = (n > 0 ? n : 0);
+    const int64_t latency = ewma_latency_us.load(butil::memory_order_relaxed);
+    if (latency == 0) {
+        return pending * NO_SAMPLE_PENALTY_US;
+    }
+    return latency * (pending + 1);
+}
+
+void P2CEwmaLoadBalancer::Node::Update(int64_t latency_us, int64_t now_us) {
+    // Concurrent updates may lose one of the samples, which is acceptable
+    // for an estimation and cheaper than locking.
+    const int64_t prev = ewma_latency_us.load(butil::memory_order_relaxed);
+    const int64_t last = last_update_us.exchange(
+        now_us, butil::memory_order_relaxed);
+    int64_t ewma = latency_us;
+    if (prev != 0 && latency_us < prev) {
+        const int64_t elapsed = std::max(now_us - last, (int64_t)0);
+        const double w = exp(-(double)elapsed /
+                             (FLAGS_p2c_ewma_decay_ms * 1000.0));
+        ewma = (int64_t)(prev * w + latency_us * (1 - w));
+    }
+    ewma_latency_us.store(std::max(ewma, (int64_t)1),
+                          butil::memory_order_relaxed);
+}
+
+P2CEwmaLoadBalancer::~P2CEwmaLoadBalancer() {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) == 0) {
+        for (size_t i = 0; i < s->server_list.size(); ++i) {
+            delete s->server_list[i];
+        }
+    }
+}
+
+bool P2CEwmaLoadBalancer::Add(Servers& bg, const Servers& fg,
+                              const ServerId& id) {
+    if (bg.server_map.find(id.id) != bg.server_map.end()) {
+        return false;
+    }
+    Node* node = NULL;
+    std::map<SocketId, size_t>::const_iterator it = fg.server_map.find(id.id);
+    if (it != fg.server_map.end()) {
+        // Second call of Modify(), share the node created in the first call.
+        node = fg.server_list[it->second];
+    } else {
+        node = new Node(id.id);
+    }
+    bg.server_map[id.id] = bg.server_list.size();
+    bg.server_list.push_back(node);
+    return true;
+}
+
+bool P2CEwmaLoadBalancer::Remove(Servers& bg, const Servers& fg,
+                                 const ServerId& id) {
+    std::map<SocketId, size_t>::iterator it = bg.server_map.find(id.id);
+    if (it == bg.server_map.end()) {
+        return false;
+    }
+    const size_t index = it->second;
+    Node* node = bg.server_list[index];
+    bg.server_list[index] = bg.server_list.back();
+    bg.server_map[bg.server_list[index]->id] = index;
+    bg.server_list.pop_back();
+    bg.server_map.erase(it);
+    if (fg.server_map.find(id.id) == fg.server_map.end()) {
+        // Second call of Modify(). Readers of both instances can't see
+        // the node anymore.
+        delete node;
+    }
+    return true;
+}
+
+size_t P2CEwmaLoadBalancer::BatchAdd(
+    Servers& bg, const Servers& fg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Add(bg, fg, servers[i]);
+    }
+    return count;
+}
+
+size_t P2CEwmaLoadBalancer::BatchRemove(
+    Servers& bg, const Servers& fg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Remove(bg, fg, servers[i]);
+    }
+    return count;
+}
+
+bool P2CEwmaLoadBalancer::AddServer(const ServerId& id) {
+    return _db_servers.ModifyWithForeground(Add, id);
+}
+
+bool P2CEwmaLoadBalancer::RemoveServer(const ServerId& id) {
+    return _db_servers.ModifyWithForeground(Remove, id);
+}
+
+size_t P2CEwmaLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.ModifyWithForeground(BatchAdd, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t P2CEwmaLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.ModifyWithForeground(BatchRemove, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+inline bool IsAvailable(const LoadBalancer::SelectIn& in, SocketId id,
+                        SocketUniquePtr* ptr) {
+    return !ExcludedServers::IsExcluded(in.excluded, id)
+        && Socket::Address(id, ptr) == 0
+        && !(*ptr)->IsLogOff();
+}
+
+int P2CEwmaLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->server_list.size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    Node* chosen = NULL;
+    const size_t i1 = butil::fast_rand_less_than(n);
+    Node* n1 = s->server_list[i1];
+    if (n == 1) {
+        if (Socket::Address(n1->id, out->ptr) == 0 && !(*out->ptr)->IsLogOff()) {
+            chosen = n1;
+        }
+    } else {
+        // Pick a different server as the second choice.
+        const size_t i2 = (i1 + 1 + butil::fast_rand_less_than(n - 1)) % n;
+        Node* n2 = s->server_list[i2];
+        if (n1->Cost() > n2->Cost()) {
+            std::swap(n1, n2);
+        }
+        if (IsAvailable(in, n1->id, out->ptr)) {
+            chosen = n1;
+        } else if (IsAvailable(in, n2->id, out->ptr)) {
+            chosen = n2;
+        } else {
+            // Both choices are unavailable, scan for the first available
+            // server, taking excluded servers as the last chance.
+            Node* last_chance = NULL;
+            for (size_t i = 1; i < n && chosen == NULL; ++i) {
+                Node* node = s->server_list[(i1 + i) % n];
+                if (IsAvailable(in, node->id, out->ptr)) {
+                    chosen = node;
+                } else if (last_chance == NULL &&
+                           ExcludedServers::IsExcluded(in.excluded, node->id)) {
+                    last_chance = node;
+                }
+            }
+            if (chosen == NULL && last_chance != NULL &&
+                Socket::Address(last_chance->id, out->ptr) == 0 &&
+                !(*out->ptr)->IsLogOff()) {
+                chosen = last_chance;
+            }
+        }
+    }
+    if (chosen == NULL) {
+        return EHOSTDOWN;
+    }
+    chosen->inflight.fetch_add(1, butil::memory_order_relaxed);
+    out->need_feedback = true;
+    return 0;
+}
+
+void P2CEwmaLoadBalancer::Feedback(const CallInfo& info) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return;
+    }
+    std::map<SocketId, size_t>::const_iterator it =
+        s->server_map.find(info.server_id);
+    if (it == s->server_map.end()) {
+        return;
+    }
+    Node* node = s->server_list[it->second];
+    node->inflight.fetch_sub(1, butil::memory_order_relaxed);
+    if (info.error_code == EPCHANENOUGH) {
+        // Canceled by ParallelChannel.success_limit, not a sample.
+        return;
+    }
+    const int64_t now_us = butil::gettimeofday_us();
+    int64_t latency_us = now_us - info.begin_time_us;
+    if (latency_us <= 0) {
+        // time skews, ignore the sample.
+        return;
+    }
+    if (info.error_code != 0 && info.controller != NULL &&
+        info.controller->timeout_ms() > 0) {
+        // Punish errors as if they took the whole timeout, otherwise servers
+        // failing fast would attract more traffic.
+        latency_us = std::max(latency_us,
+                              info.controller->timeout_ms() * 1000L);
+    }
+    node->Update(latency_us, now_us);
+}
+
+P2CEwmaLoadBalancer* P2CEwmaLoadBalancer::New() const {
+    return new (std::nothrow) P2CEwmaLoadBalancer;
+}
+
+void P2CEwmaLoadBalancer::Destroy() {
+    delete this;
+}
+
+void P2CEwmaLoadBalancer::Describe(
+    std::ostream &os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "p2c_ewma";
+        return;
+    }
+    os << "P2CEwma{";
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << "fail to read _db_servers";
+    } else {
+        os << "n=" << s->server_list.size() << ':';
+        for (size_t i = 0; i < s->server_list.size(); ++i) {
+            const Node* node = s->server_list[i];
+            os << ' ' << node->id << "(inflight="
+               << node->inflight.load(butil::memory_order_relaxed)
+               << " latency="
+               << node->ewma_latency_us.load(butil::memory_order_relaxed)
+               << ')';
+        }
+    }
+    os << '}';
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,82 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_P2C_EWMA_LOAD_BALANCER_H
+#define BRPC_POLICY_P2C_EWMA_LOAD_BALANCER_H
+
+#include <vector>                                      // std::vector
+#include <map>                                         // std::map
+#include "butil/atomicops.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// This LoadBalancer picks two servers randomly and selects the one with
+// lower cost, which is (number of in-flight requests + 1) * peak-EWMA of
+// latencies. The EWMA jumps to latencies higher than itself immediately and
+// decays towards lower ones within -p2c_ewma_decay_ms, so that slowed-down
+// servers lose traffic fast and regain it gradually. Unlike
+// LocalityAwareLoadBalancer, membership changes don't rebuild any shared
+// structure and Feedback() only touches atomics of the server being fed.
+class P2CEwmaLoadBalancer : public LoadBalancer {
+public:
+    ~P2CEwmaLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    P2CEwmaLoadBalancer* New() const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    struct Node {
+        explicit Node(SocketId id2)
+            : id(id2), inflight(0), ewma_latency_us(0), last_update_us(0) {}
+        // Estimated cost of sending one more request to this server.
+        int64_t Cost() const;
+        void Update(int64_t latency_us, int64_t now_us);
+
+        SocketId id;
+        butil::atomic<int64_t> inflight;
+        // 0 until the first feedback.
+        butil::atomic<int64_t> ewma_latency_us;
+        butil::atomic<int64_t> last_update_us;
+    };
+    // Both instances of _db_servers point to same nodes.
+    struct Servers {
+        std::vector<Node*> server_list;
+        std::map<SocketId, size_t> server_map;
+    };
+    static bool Add(Servers& bg, const Servers& fg, const ServerId& id);
+    static bool Remove(Servers& bg, const Servers& fg, const ServerId& id);
+    static size_t BatchAdd(Servers& bg, const Servers& fg,
+                           const std::vector<ServerId>& servers);
+    static size_t BatchRemove(Servers& bg, const Servers& fg,
+                              const std::vector<ServerId>& servers);
+
+    butil::DoublyBufferedData<Servers> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_P2C_EWMA_LOAD_BALANCER_H
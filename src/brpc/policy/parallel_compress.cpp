@@ -0,0 +1,309 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "bthread/bthread.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/policy/parallel_compress.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(parallel_compress_min_size, 0, "Payloads of gzip, zstd and "
+             "lz4 not smaller than this value(in bytes) are compressed as "
+             "frames in parallel, 0 disables parallel compression");
+BRPC_VALIDATE_GFLAG(parallel_compress_min_size, NonNegativeInteger);
+DEFINE_int32(parallel_compress_frame_size, 1024 * 1024, "Bytes of payload "
+             "in each frame of parallel compression");
+BRPC_VALIDATE_GFLAG(parallel_compress_frame_size, PositiveInteger);
+
+// Payload of the index: the tag, number of frames and compressed sizes of
+// the frames, all integers are little endian.
+static const char INDEX_TAG[4] = { 'B', 'R', 'P', 'F' };
+static const size_t INDEX_FIXED_SIZE = 8;
+// Bounded by XLEN(16 bits) of gzip headers.
+static const size_t MAX_FRAMES = 4096;
+// One of the magic numbers of skippable frames of zstd and lz4.
+static const uint32_t SKIPPABLE_MAGIC = 0x184D2A5B;
+static const size_t SKIPPABLE_HEADER_SIZE = 8;
+// Fixed fields of gzip header(10 bytes), XLEN and the subfield header.
+static const size_t GZIP_HEADER_SIZE = 16;
+// Empty deflate stream, CRC32 and ISIZE of an empty member.
+static const char GZIP_EMPTY_TRAILER[10] = { 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+static bool IsFramedType(CompressType type) {
+    return type == COMPRESS_TYPE_GZIP || type == COMPRESS_TYPE_ZSTD ||
+        type == COMPRESS_TYPE_LZ4;
+}
+
+static void AppendLE16(std::string* s, uint32_t v) {
+    s->push_back((char)(v & 0xFF));
+    s->push_back((char)((v >> 8) & 0xFF));
+}
+
+static void AppendLE32(std::string* s, uint32_t v) {
+    AppendLE16(s, v & 0xFFFF);
+    AppendLE16(s, v >> 16);
+}
+
+static uint32_t ReadLE16(const char* p) {
+    const unsigned char* q = (const unsigned char*)p;
+    return q[0] | ((uint32_t)q[1] << 8);
+}
+
+static uint32_t ReadLE32(const char* p) {
+    return ReadLE16(p) | (ReadLE16(p + 2) << 16);
+}
+
+static void AppendIndex(CompressType type, const std::vector<uint32_t>& sizes,
+                        butil::IOBuf* out) {
+    std::string payload;
+    payload.append(INDEX_TAG, sizeof(INDEX_TAG));
+    AppendLE32(&payload, sizes.size());
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        AppendLE32(&payload, sizes[i]);
+    }
+    std::string header;
+    if (type == COMPRESS_TYPE_GZIP) {
+        // ID1 ID2 CM=deflate FLG=FEXTRA MTIME(4) XFL OS=unknown
+        const char fixed[10] = { 0x1f, (char)0x8b, 0x08, 0x04,
+                                 0, 0, 0, 0, 0, (char)0xff };
+        header.append(fixed, sizeof(fixed));
+        AppendLE16(&header, 4 + payload.size());
+        header.push_back('B');
+        header.push_back('P');
+        AppendLE16(&header, payload.size());
+        out->append(header);
+        out->append(payload);
+        out->append(GZIP_EMPTY_TRAILER, sizeof(GZIP_EMPTY_TRAILER));
+    } else {
+        AppendLE32(&header, SKIPPABLE_MAGIC);
+        AppendLE32(&header, payload.size());
+        out->append(header);
+        out->append(payload);
+    }
+}
+
+// Returns bytes of the index at front of `in' and fills `sizes', 0 if `in'
+// does not begin with an index.
+static size_t ParseIndex(const butil::IOBuf& in, CompressType type,
+                         std::vector<uint32_t>* sizes) {
+    char header[GZIP_HEADER_SIZE];
+    size_t payload_pos = 0;
+    size_t payload_len = 0;
+    size_t trailer_len = 0;
+    if (type == COMPRESS_TYPE_GZIP) {
+        if (in.copy_to(header, GZIP_HEADER_SIZE) != GZIP_HEADER_SIZE ||
+            header[0] != 0x1f || header[1] != (char)0x8b ||
+            header[2] != 0x08 || header[3] != 0x04 ||
+            header[12] != 'B' || header[13] != 'P') {
+            return 0;
+        }
+        payload_len = ReadLE16(header + 14);
+        if (ReadLE16(header + 10) != payload_len + 4) {
+            return 0;
+        }
+        payload_pos = GZIP_HEADER_SIZE;
+        trailer_len = sizeof(GZIP_EMPTY_TRAILER);
+    } else if (type == COMPRESS_TYPE_ZSTD || type == COMPRESS_TYPE_LZ4) {
+        if (in.copy_to(header, SKIPPABLE_HEADER_SIZE) != SKIPPABLE_HEADER_SIZE ||
+            ReadLE32(header) != SKIPPABLE_MAGIC) {
+            return 0;
+        }
+        payload_len = ReadLE32(header + 4);
+        payload_pos = SKIPPABLE_HEADER_SIZE;
+    } else {
+        return 0;
+    }
+    if (payload_len < INDEX_FIXED_SIZE ||
+        payload_len > INDEX_FIXED_SIZE + MAX_FRAMES * 4) {
+        return 0;
+    }
+    std::string payload;
+    if (in.copy_to(&payload, payload_len, payload_pos) != payload_len ||
+        memcmp(payload.data(), INDEX_TAG, sizeof(INDEX_TAG)) != 0) {
+        return 0;
+    }
+    const size_t nframe = ReadLE32(payload.data() + 4);
+    if (nframe > MAX_FRAMES || INDEX_FIXED_SIZE + nframe * 4 != payload_len) {
+        return 0;
+    }
+    sizes->resize(nframe);
+    for (size_t i = 0; i < nframe; ++i) {
+        (*sizes)[i] = ReadLE32(payload.data() + INDEX_FIXED_SIZE + i * 4);
+    }
+    return payload_pos + payload_len + trailer_len;
+}
+
+struct FrameTask {
+    butil::IOBuf in;
+    butil::IOBuf out;
+    CompressType type;
+    const google::protobuf::Descriptor* msg_type;
+    bool compress;
+    bool ok;
+};
+
+static void* RunFrameTask(void* arg) {
+    FrameTask* t = static_cast<FrameTask*>(arg);
+    switch (t->type) {
+    case COMPRESS_TYPE_GZIP:
+        t->ok = (t->compress ? GzipCompress(t->in, &t->out, NULL)
+                 : GzipDecompress(t->in, &t->out));
+        break;
+    case COMPRESS_TYPE_ZSTD:
+        t->ok = (t->compress ? ZstdCompress(t->in, &t->out, t->msg_type)
+                 : ZstdDecompress(t->in, &t->out, t->msg_type));
+        break;
+    case COMPRESS_TYPE_LZ4:
+        t->ok = (t->compress ? Lz4Compress(t->in, &t->out)
+                 : Lz4Decompress(t->in, &t->out));
+        break;
+    default:
+        t->ok = false;
+        break;
+    }
+    return NULL;
+}
+
+// Run tasks[1..] in new bthreads and tasks[0] in the calling one.
+static bool RunFrameTasks(std::vector<FrameTask>& tasks) {
+    std::vector<bthread_t> tids(tasks.size(), INVALID_BTHREAD);
+    for (size_t i = 1; i < tasks.size(); ++i) {
+        if (bthread_start_background(&tids[i], NULL,
+                                     RunFrameTask, &tasks[i]) != 0) {
+            tids[i] = INVALID_BTHREAD;
+            RunFrameTask(&tasks[i]);
+        }
+    }
+    if (!tasks.empty()) {
+        RunFrameTask(&tasks[0]);
+    }
+    bool ok = true;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (tids[i] != INVALID_BTHREAD) {
+            bthread_join(tids[i], NULL);
+        }
+        ok = ok && tasks[i].ok;
+    }
+    return ok;
+}
+
+bool ShouldCompressInParallel(CompressType type,
+                              const google::protobuf::Message& msg) {
+    const int min_size = FLAGS_parallel_compress_min_size;
+    if (min_size <= 0 || !IsFramedType(type)) {
+        return false;
+    }
+    const int size = msg.ByteSize();
+    return size >= min_size && size > FLAGS_parallel_compress_frame_size;
+}
+
+bool ParallelCompress(const butil::IOBuf& in, CompressType type,
+                      const google::protobuf::Descriptor* msg_type,
+                      butil::IOBuf* out) {
+    if (!IsFramedType(type)) {
+        return false;
+    }
+    const size_t frame_size =
+        std::max((size_t)FLAGS_parallel_compress_frame_size,
+                 (in.size() + MAX_FRAMES - 1) / MAX_FRAMES);
+    std::vector<size_t> lens;
+    size_t len = 0;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        len += in.backing_block(i).size();
+        if (len >= frame_size || i + 1 == nblock) {
+            lens.push_back(len);
+            len = 0;
+        }
+    }
+    if (lens.empty()) {
+        // Empty payload is compressed as one frame.
+        lens.push_back(0);
+    }
+    std::vector<FrameTask> tasks(lens.size());
+    butil::IOBuf rest = in;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        rest.cutn(&tasks[i].in, lens[i]);
+        tasks[i].type = type;
+        tasks[i].msg_type = msg_type;
+        tasks[i].compress = true;
+        tasks[i].ok = false;
+    }
+    if (!RunFrameTasks(tasks)) {
+        return false;
+    }
+    std::vector<uint32_t> sizes(tasks.size());
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        sizes[i] = tasks[i].out.size();
+    }
+    AppendIndex(type, sizes, out);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        out->append(tasks[i].out);
+    }
+    return true;
+}
+
+bool IsCompressedInParallel(const butil::IOBuf& in, CompressType type) {
+    std::vector<uint32_t> sizes;
+    return IsFramedType(type) && ParseIndex(in, type, &sizes) != 0;
+}
+
+bool ParallelDecompress(const butil::IOBuf& in, CompressType type,
+                        const google::protobuf::Descriptor* msg_type,
+                        butil::IOBuf* out) {
+    std::vector<uint32_t> sizes;
+    const size_t index_size = ParseIndex(in, type, &sizes);
+    if (index_size == 0) {
+        LOG(WARNING) << "Fail to parse index of parallel frames";
+        return false;
+    }
+    size_t total = index_size;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        total += sizes[i];
+    }
+    if (total != in.size()) {
+        LOG(WARNING) << "Frames of " << total << " bytes mismatch payload of "
+                     << in.size() << " bytes";
+        return false;
+    }
+    std::vector<FrameTask> tasks(sizes.size());
+    butil::IOBuf rest = in;
+    rest.pop_front(index_size);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        rest.cutn(&tasks[i].in, sizes[i]);
+        tasks[i].type = type;
+        tasks[i].msg_type = msg_type;
+        tasks[i].compress = false;
+        tasks[i].ok = false;
+    }
+    if (!RunFrameTasks(tasks)) {
+        return false;
+    }
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        out->append(tasks[i].out);
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,61 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_PARALLEL_COMPRESS_H
+#define BRPC_POLICY_PARALLEL_COMPRESS_H
+
+#include <google/protobuf/message.h>          // Message
+#include <google/protobuf/descriptor.h>       // Descriptor
+#include "butil/iobuf.h"                       // IOBuf
+#include "brpc/options.pb.h"                 // CompressType
+
+
+namespace brpc {
+namespace policy {
+
+// Large payloads of gzip, zstd and lz4 are split at block boundaries into
+// frames of about -parallel_compress_frame_size bytes, which are compressed
+// independently in parallel bthreads and concatenated. Concatenated frames
+// are valid data of the three formats and decodable by any decompressor.
+// An index of sizes of the frames is put ahead in a frame ignored by
+// decompressors(a skippable frame of zstd/lz4, an empty gzip member with
+// the index in the extra field), so that the receiver decompresses frames
+// in parallel as well.
+
+// True if `msg' should be serialized and compressed by ParallelCompress().
+bool ShouldCompressInParallel(CompressType type,
+                              const google::protobuf::Message& msg);
+
+// Put compressed `in' into `out' in parallel frames. `msg_type' is the
+// message serialized as `in' or NULL, which selects dictionaries of zstd.
+// Returns true on success, false otherwise.
+bool ParallelCompress(const butil::IOBuf& in, CompressType type,
+                      const google::protobuf::Descriptor* msg_type,
+                      butil::IOBuf* out);
+
+// True if `in' of `type' begins with an index of parallel frames.
+bool IsCompressedInParallel(const butil::IOBuf& in, CompressType type);
+
+// Put decompressed `in' which IsCompressedInParallel() into `out'.
+// Returns true on success, false otherwise.
+bool ParallelDecompress(const butil::IOBuf& in, CompressType type,
+                        const google::protobuf::Descriptor* msg_type,
+                        butil::IOBuf* out);
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_PARALLEL_COMPRESS_H
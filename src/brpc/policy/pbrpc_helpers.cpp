@@ -0,0 +1,137 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <google/protobuf/descriptor.h>         // MethodDescriptor
+#include <google/protobuf/service.h>            // Service
+#include "brpc/controller.h"                    // Controller
+#include "brpc/compress.h"                      // ParseFromCompressedData
+#include "brpc/details/method_status.h"         // MethodStatus
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/pb_arena.h"               // NewMessageOnArena
+#include "brpc/details/message_pool.h"           // MessagePool
+#include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/snappy_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/policy/parallel_compress.h"
+#include "brpc/policy/pbrpc_helpers.h"
+
+
+namespace brpc {
+namespace policy {
+
+bool DecompressData(const butil::IOBuf& data, CompressType type,
+                    const google::protobuf::Descriptor* msg_type,
+                    butil::IOBuf* out) {
+    if (IsCompressedInParallel(data, type)) {
+        return ParallelDecompress(data, type, msg_type, out);
+    }
+    switch (type) {
+    case COMPRESS_TYPE_NONE:
+        out->append(data);
+        return true;
+    case COMPRESS_TYPE_SNAPPY:
+        return SnappyDecompress(data, out);
+    case COMPRESS_TYPE_GZIP:
+        return GzipDecompress(data, out);
+    case COMPRESS_TYPE_ZLIB:
+        return ZlibDecompress(data, out);
+    case COMPRESS_TYPE_LZ4:
+        return Lz4Decompress(data, out);
+    case COMPRESS_TYPE_ZSTD:
+        return ZstdDecompress(data, out, msg_type);
+    default:
+        return false;
+    }
+}
+
+static google::protobuf::Message* NewServerMessage(
+    const google::protobuf::Message& prototype, MessagePool* pool,
+    Controller* cntl) {
+    ControllerPrivateAccessor accessor(cntl);
+    if (accessor.messages_on_arena()) {
+        return NewMessageOnArena(prototype, accessor.pb_arena());
+    }
+    if (pool) {
+        return pool->Borrow();
+    }
+    return prototype.New();
+}
+
+google::protobuf::Message* NewServerRequest(
+    google::protobuf::Service* svc,
+    const google::protobuf::MethodDescriptor* method,
+    MethodStatus* method_status, Controller* cntl) {
+    ControllerPrivateAccessor accessor(cntl);
+    if (method_status && method_status->use_arena() &&
+        accessor.pb_arena() == NULL) {
+        // Leave the messages on heap if arenas are not supported.
+        accessor.set_pb_arena(GetPooledPBArena());
+    }
+    MessagePool* pool = NULL;
+    if (method_status && method_status->reuse_messages()) {
+        pool = method_status->request_pool();
+    }
+    return NewServerMessage(svc->GetRequestPrototype(method), pool, cntl);
+}
+
+google::protobuf::Message* NewServerResponse(
+    google::protobuf::Service* svc,
+    const google::protobuf::MethodDescriptor* method,
+    MethodStatus* method_status, Controller* cntl) {
+    MessagePool* pool = NULL;
+    if (method_status && method_status->reuse_messages()) {
+        pool = method_status->response_pool();
+    }
+    return NewServerMessage(svc->GetResponsePrototype(method), pool, cntl);
+}
+
+bool ParseServerRequest(const butil::IOBuf& data, CompressType type,
+                        const google::protobuf::MethodDescriptor* method,
+                        MethodStatus* method_status, Controller* cntl,
+                        google::protobuf::Message* req) {
+    if (method_status && method_status->parse_request_lazily()) {
+        return DecompressData(data, type, method->input_type(),
+                              &cntl->unparsed_request());
+    }
+    return ParseFromCompressedData(data, req, type);
+}
+
+ScopedServerMessages::ScopedServerMessages(
+    const Controller* cntl, const MethodStatus* method_status,
+    const google::protobuf::Message* req,
+    const google::protobuf::Message* res)
+    : _method_status(NULL)
+    , _req(req)
+    , _res(res) {
+    // Messages on the arena are destroyed along with `cntl'.
+    if (ControllerPrivateAccessor(const_cast<Controller*>(cntl))
+        .messages_on_arena()) {
+        _req = NULL;
+        _res = NULL;
+    } else if (method_status && method_status->reuse_messages()) {
+        _method_status = method_status;
+    }
+}
+
+ScopedServerMessages::~ScopedServerMessages() {
+    ReturnMessageOrDelete(_method_status ?
+                          _method_status->request_pool() : NULL)(_req);
+    ReturnMessageOrDelete(_method_status ?
+                          _method_status->response_pool() : NULL)(_res);
+}
+
+} // namespace policy
+} // namespace brpc
@@ -0,0 +1,123 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_PBRPC_HELPERS_H
+#define BRPC_POLICY_PBRPC_HELPERS_H
+
+// Helpers shared by protobuf-based protocols with fixed-size headers
+// followed by a meta message and the payload: baidu_std, hulu_pbrpc and
+// sofa_pbrpc. Payloads are always referenced rather than copied.
+
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/io/coded_stream.h>
+#include "butil/logging.h"
+#include "butil/iobuf.h"
+#include "brpc/options.pb.h"                 // CompressType
+
+namespace google {
+namespace protobuf {
+class Service;
+class MethodDescriptor;
+}
+}
+
+namespace brpc {
+class Controller;
+class MethodStatus;
+namespace policy {
+
+// Append the header of HEADER_SIZE bytes packed by `pack_header' along with
+// the serialized `meta' to `out'. Most metas are small and serialized along
+// with the header in one append.
+template <int HEADER_SIZE, typename Meta>
+void SerializeHeaderAndMeta(butil::IOBuf* out, const Meta& meta,
+                            int payload_size,
+                            void (*pack_header)(char*, int, int)) {
+    const int meta_size = meta.ByteSize();
+    if (meta_size <= 256 - HEADER_SIZE) { // most common cases
+        char header_and_meta[HEADER_SIZE + meta_size];
+        pack_header(header_and_meta, meta_size, payload_size);
+        ::google::protobuf::io::ArrayOutputStream arr_out(
+            header_and_meta + HEADER_SIZE, meta_size);
+        ::google::protobuf::io::CodedOutputStream coded_out(&arr_out);
+        meta.SerializeWithCachedSizes(&coded_out); // not calling ByteSize again
+        CHECK(!coded_out.HadError());
+        out->append(header_and_meta, sizeof(header_and_meta));
+    } else {
+        char header[HEADER_SIZE];
+        pack_header(header, meta_size, payload_size);
+        out->append(header, sizeof(header));
+        butil::IOBufAsZeroCopyOutputStream buf_stream(out);
+        ::google::protobuf::io::CodedOutputStream coded_out(&buf_stream);
+        meta.SerializeWithCachedSizes(&coded_out);
+        CHECK(!coded_out.HadError());
+    }
+}
+
+// Decompress `data' of message `msg_type' into `out' without parsing it.
+// Uncompressed `data' is referenced rather than copied.
+bool DecompressData(const butil::IOBuf& data, CompressType type,
+                    const google::protobuf::Descriptor* msg_type,
+                    butil::IOBuf* out);
+
+// Create the request of `method' which is about to be processed with `cntl'
+// at server-side. Following options of the method are respected:
+//   - Server::SetUseArena(): the message is on a pooled arena owned by
+//     `cntl', which is created at the first call.
+//   - Server::SetReuseMessages(): the message is borrowed from the pool.
+// `method_status' could be NULL.
+google::protobuf::Message* NewServerRequest(
+    google::protobuf::Service* svc,
+    const google::protobuf::MethodDescriptor* method,
+    MethodStatus* method_status, Controller* cntl);
+
+// Create the response, the counterpart of NewServerRequest().
+google::protobuf::Message* NewServerResponse(
+    google::protobuf::Service* svc,
+    const google::protobuf::MethodDescriptor* method,
+    MethodStatus* method_status, Controller* cntl);
+
+// Parse `data' compressed with `type' into `req', or leave the decompressed
+// data in cntl->unparsed_request() if the method parses requests lazily.
+// Returns true on success.
+bool ParseServerRequest(const butil::IOBuf& data, CompressType type,
+                        const google::protobuf::MethodDescriptor* method,
+                        MethodStatus* method_status, Controller* cntl,
+                        google::protobuf::Message* req);
+
+// Recycle request and response created by NewServerRequest() and
+// NewServerResponse() when this object is destroyed: messages on the arena
+// are left to `cntl', reused messages are returned to pools of the method,
+// others are deleted. Must be destroyed before `cntl'.
+class ScopedServerMessages {
+public:
+    ScopedServerMessages(const Controller* cntl,
+                         const MethodStatus* method_status,
+                         const google::protobuf::Message* req,
+                         const google::protobuf::Message* res);
+    ~ScopedServerMessages();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedServerMessages);
+    const MethodStatus* _method_status;
+    const google::protobuf::Message* _req;
+    const google::protobuf::Message* _res;
+};
+
+} // namespace policy
+} // namespace brpc
+
+#endif // BRPC_POLICY_PBRPC_HELPERS_H
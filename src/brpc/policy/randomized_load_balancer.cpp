@@ -102,7 +102,7 @@ size_t RandomizedLoadBalancer::RemoveServersInBatch(
 }
 
 int RandomizedLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
-    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    butil::DoublyBufferedData<Servers, butil::Void, true>::ScopedPtr s;
     if (_db_servers.Read(&s) != 0) {
         return ENOMEM;
     }
@@ -149,7 +149,7 @@ void RandomizedLoadBalancer::Describe(
         return;
     }
     os << "Randomized{";
-    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    butil::DoublyBufferedData<Servers, butil::Void, true>::ScopedPtr s;
     if (_db_servers.Read(&s) != 0) {
         os << "fail to read _db_servers";
     } else {
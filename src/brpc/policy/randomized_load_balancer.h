@@ -50,7 +50,7 @@ private:
     static size_t BatchAdd(Servers& bg, const std::vector<ServerId>& servers);
     static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
 
-    butil::DoublyBufferedData<Servers> _db_servers;
+    butil::DoublyBufferedData<Servers, butil::Void, true> _db_servers;
 };
 
 }  // namespace policy
@@ -14,12 +14,14 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <algorithm>
 #include <google/protobuf/descriptor.h>         // MethodDescriptor
 #include <google/protobuf/message.h>            // Message
 #include <gflags/gflags.h>
 #include "butil/logging.h"                       // LOG()
 #include "butil/time.h"
 #include "butil/iobuf.h"                         // butil::IOBuf
+#include "butil/string_printf.h"
 #include "brpc/controller.h"               // Controller
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/socket.h"                   // Socket
@@ -27,6 +29,7 @@
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/span.h"
 #include "brpc/redis.h"
+#include "brpc/redis_command.h"
 #include "brpc/policy/redis_protocol.h"
 
 
@@ -49,12 +52,96 @@ struct InputResponse : public InputMessageBase {
     }
 };
 
-// "Message" = "Response" as we only implement the client for redis.
+// Context of a redis connection at server-side.
+class RedisConnContext : public Destroyable {
+public:
+    // @Destroyable
+    void Destroy() { delete this; }
+
+    RedisCommandParser parser;
+};
+
+static void HandleRedisCommand(const RedisService* rs,
+                               const std::vector<butil::StringPiece>& args,
+                               RedisReplyWriter* writer) {
+    RedisCommandHandler* handler = rs->FindCommandHandler(args[0]);
+    if (handler == NULL) {
+        writer->AppendError(butil::string_printf(
+                "ERR unknown command '%.*s'", (int)std::min(args[0].size(), (size_t)128),
+                args[0].data()));
+        return;
+    }
+    handler->Run(args, writer);
+}
+
+// Run handlers of all intact commands in `source' in place and send the
+// replies together. Handling commands in the order of being received is
+// required by pipelining, which is impossible if the commands are processed
+// in separate bthreads as other protocols do.
+static ParseResult ParseRedisCommands(butil::IOBuf* source, Socket* socket,
+                                      const Server* server) {
+    const RedisService* rs = server->options().redis_service;
+    if (rs == NULL) {
+        return MakeParseError(PARSE_ERROR_TRY_OTHERS);
+    }
+    RedisConnContext* ctx = static_cast<RedisConnContext*>(socket->parsing_context());
+    if (ctx == NULL) {
+        // Commands from redis clients are arrays.
+        if (*(const char*)source->fetch1() != '*') {
+            return MakeParseError(PARSE_ERROR_TRY_OTHERS);
+        }
+        ctx = new RedisConnContext;
+        socket->reset_parsing_context(ctx);
+    }
+    std::vector<butil::StringPiece> args;
+    butil::IOBuf replies;
+    RedisReplyWriter writer(&replies);
+    int ncommand = 0;
+    ParseError err = PARSE_OK;
+    while ((err = ctx->parser.Consume(*source, &args)) == PARSE_OK) {
+        const size_t old_size = replies.size();
+        HandleRedisCommand(rs, args, &writer);
+        ++ncommand;
+        if (FLAGS_redis_verbose) {
+            std::cerr << "[REDIS COMMAND]";
+            for (size_t i = 0; i < args.size(); ++i) {
+                std::cerr << ' ' << args[i];
+            }
+            std::cerr << "\n[REDIS REPLY] ";
+            butil::IOBuf reply;
+            replies.append_to(&reply, replies.size() - old_size, old_size);
+            std::cerr << butil::PrintedAsBinary(reply) << std::endl;
+        }
+    }
+    if (!replies.empty()) {
+        Socket::WriteOptions wopt;
+        wopt.ignore_eovercrowded = true;
+        if (socket->Write(&replies, &wopt) != 0) {
+            LOG(WARNING) << "Fail to send redis replies to "
+                         << socket->remote_side();
+        }
+    }
+    if (err != PARSE_ERROR_NOT_ENOUGH_DATA) {
+        return MakeParseError(err);
+    }
+    if (ncommand == 0) {
+        return MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+    }
+    // Commands were handled, nothing to process.
+    return MakeMessage(NULL);
+}
+
+// Parse redis responses at client-side, or handle redis commands at
+// server-side(`arg' is the server).
 ParseResult ParseRedisMessage(butil::IOBuf* source, Socket* socket,
-                              bool /*read_eof*/, const void* /*arg*/) {
+                              bool /*read_eof*/, const void* arg) {
     if (source->empty()) {
         return MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
     }
+    const Server* server = static_cast<const Server*>(arg);
+    if (server != NULL) {
+        return ParseRedisCommands(source, socket, server);
+    }
     // NOTE(gejun): PopPipelinedInfo() is actually more contended than what
     // I thought before. The Socket._pipeline_q is a SPSC queue pushed before
     // sending and popped when response comes back, being protected by a
@@ -108,6 +195,10 @@ ParseResult ParseRedisMessage(butil::IOBuf* source, Socket* socket,
     return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
 }
 
+void ProcessRedisRequest(InputMessageBase* /*msg*/) {
+    CHECK(false) << "Should never be called";
+}
+
 void ProcessRedisResponse(InputMessageBase* msg_base) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
     DestroyingPtr<InputResponse> msg(static_cast<InputResponse*>(msg_base));
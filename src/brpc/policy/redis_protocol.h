@@ -23,10 +23,15 @@
 namespace brpc {
 namespace policy {
 
-// Parse redis response.
+// Parse redis responses at client-side. Commands are handled inside at
+// server-side, in the order of being received.
 ParseResult ParseRedisMessage(butil::IOBuf* source, Socket *socket, bool read_eof,
                               const void *arg);
 
+// Commands are handled in ParseRedisMessage, this function should never
+// be called.
+void ProcessRedisRequest(InputMessageBase* msg);
+
 // Actions to a redis response.
 void ProcessRedisResponse(InputMessageBase* msg);
 
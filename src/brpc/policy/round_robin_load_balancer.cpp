@@ -102,7 +102,7 @@ size_t RoundRobinLoadBalancer::RemoveServersInBatch(
 }
 
 int RoundRobinLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
-    butil::DoublyBufferedData<Servers, TLS>::ScopedPtr s;
+    butil::DoublyBufferedData<Servers, TLS, true>::ScopedPtr s;
     if (_db_servers.Read(&s) != 0) {
         return ENOMEM;
     }
@@ -146,7 +146,7 @@ void RoundRobinLoadBalancer::Describe(
         return;
     }
     os << "RoundRobin{";
-    butil::DoublyBufferedData<Servers, TLS>::ScopedPtr s;
+    butil::DoublyBufferedData<Servers, TLS, true>::ScopedPtr s;
     if (_db_servers.Read(&s) != 0) {
         os << "fail to read _db_servers";
     } else {
@@ -54,7 +54,7 @@ private:
     static size_t BatchAdd(Servers& bg, const std::vector<ServerId>& servers);
     static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
 
-    butil::DoublyBufferedData<Servers, TLS> _db_servers;
+    butil::DoublyBufferedData<Servers, TLS, true> _db_servers;
 };
 
 }  // namespace policy
@@ -807,6 +807,26 @@ RtmpUnsentMessage::AppendAndDestroySelf(butil::IOBuf* out, Socket* s) {
     return p->AppendAndDestroySelf(out, s);
 }
 
+butil::Status
+RtmpUnsentSharedMessage::AppendAndDestroySelf(butil::IOBuf* out, Socket* s) {
+    std::unique_ptr<RtmpUnsentSharedMessage> destroy_self(this);
+    if (s == NULL) { // abandoned
+        RPC_VLOG << "Socket=NULL";
+        return butil::Status::OK();
+    }
+    RtmpContext* ctx = static_cast<RtmpContext*>(s->parsing_context());
+    RtmpChunkStream* cstream = ctx->GetChunkStream(chunk_stream_id);
+    if (cstream == NULL) {
+        s->SetFailed(EINVAL, "Invalid chunk_stream_id=%u", chunk_stream_id);
+        return butil::Status(EINVAL, "Invalid chunk_stream_id=%u", chunk_stream_id);
+    }
+    if (cstream->SerializeSharedMessage(out, msg.get(), stream_id) != 0) {
+        s->SetFailed(EINVAL, "Fail to serialize message");
+        return butil::Status(EINVAL, "Fail to serialize message");
+    }
+    return butil::Status::OK();
+}
+
 RtmpContext::SubChunkArray::SubChunkArray() {
     memset(ptrs, 0, sizeof(ptrs));
 }
@@ -1641,6 +1661,57 @@ ParseResult RtmpChunkStream::Feed(const RtmpBasicHeader& bh,
     return MakeMessage(NULL);
 }
 
+void SerializeRtmpChunksFromScratch(butil::IOBuf* buf,
+                                    const RtmpMessageHeader& mh,
+                                    uint32_t cs_id, uint32_t chunk_size,
+                                    const butil::IOBuf& body) {
+    const bool has_extended_ts = (mh.timestamp >= 0xFFFFFFu);
+    // Cutting from a copy references blocks of `body' without copying data.
+    butil::IOBuf left_body = body;
+    uint32_t left_size = mh.message_length;
+    RtmpChunkType chunk_type = RTMP_CHUNK_TYPE0;
+    do {
+        char header_buf[32]; // enough
+        char* p = header_buf;
+        WriteBasicHeader(&p, chunk_type, cs_id);
+        if (chunk_type == RTMP_CHUNK_TYPE0) {
+            WriteBigEndian3Bytes(&p, (has_extended_ts ? 0xFFFFFFu : mh.timestamp));
+            WriteBigEndian3Bytes(&p, mh.message_length);
+            *p++ = mh.message_type;
+            WriteLittleEndian4Bytes(&p, mh.stream_id);
+        }
+        if (has_extended_ts) {
+            WriteBigEndian4Bytes(&p, mh.timestamp);
+        }
+        buf->append(header_buf, p - header_buf);
+        const uint32_t cur_chunk_size = std::min(chunk_size, left_size);
+        left_body.cutn(buf, cur_chunk_size);
+        left_size -= cur_chunk_size;
+        chunk_type = RTMP_CHUNK_TYPE3;
+    } while (left_size > 0);
+}
+
+int RtmpChunkStream::SerializeSharedMessage(butil::IOBuf* buf,
+                                            RtmpSharedMessage* msg,
+                                            uint32_t stream_id) {
+    if (GetBasicHeaderLength(_cs_id) == 0) {
+        CHECK(false) << "Invalid chunk_stream_id=" << _cs_id;
+        return -1;
+    }
+    RtmpMessageHeader mh;
+    mh.timestamp = msg->timestamp();
+    mh.message_length = msg->body().size();
+    mh.message_type = msg->message_type();
+    mh.stream_id = stream_id;
+    msg->AppendChunks(connection_context()->_chunk_size_out,
+                      _cs_id, stream_id, buf);
+    // Same as sending a type-0 chunk in SerializeMessage()
+    _w.last_has_extended_ts = (mh.timestamp >= 0xFFFFFFu);
+    _w.last_timestamp_delta = mh.timestamp;
+    _w.last_msg_header = mh;
+    return 0;
+}
+
 int RtmpChunkStream::SerializeMessage(butil::IOBuf* buf,
                                       const RtmpMessageHeader& mh,
                                       butil::IOBuf* body) {
@@ -178,6 +178,19 @@ public:
     butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*);
 };
 
+// A RtmpSharedMessage to be sent over a chunk stream. The chunks are shared
+// with other streams.
+class RtmpUnsentSharedMessage : public SocketMessage {
+public:
+    butil::intrusive_ptr<RtmpSharedMessage> msg;
+    uint32_t chunk_stream_id;
+    uint32_t stream_id;
+public:
+    RtmpUnsentSharedMessage() : chunk_stream_id(0), stream_id(0) {}
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*);
+};
+
 // Notice that we can't directly pack CreateStream command in PackRtmpRequest, because 
 // we need to pack an AMFObject according to ctx->can_stream_be_created_with_play_or_publish(),
 // which is in the response of Connect command(sent in RtmpConnect::StartConnect).
@@ -219,6 +232,13 @@ void WriteBigEndian4Bytes(char** buf, uint32_t val);
 void WriteLittleEndian4Bytes(char** buf, uint32_t val);
 
 // Append the control message into `msg_buf' which is writable to Socket. 
+// Serialize `body' into chunks of at most `chunk_size' bytes. The first
+// chunk is type-0 which does not depend on previous messages.
+void SerializeRtmpChunksFromScratch(butil::IOBuf* buf,
+                                    const RtmpMessageHeader& mh,
+                                    uint32_t cs_id, uint32_t chunk_size,
+                                    const butil::IOBuf& body);
+
 RtmpUnsentMessage* MakeUnsentControlMessage(
     uint8_t message_type, const void* body, size_t size);
 RtmpUnsentMessage* MakeUnsentControlMessage(
@@ -423,6 +443,11 @@ public:
 
     int SerializeMessage(butil::IOBuf* buf, const RtmpMessageHeader& mh,
                          butil::IOBuf* body);
+
+    // Append chunks of `msg' into `buf' and make following messages be
+    // serialized relative to it.
+    int SerializeSharedMessage(butil::IOBuf* buf, RtmpSharedMessage* msg,
+                               uint32_t stream_id);
     
     bool OnMessage(
         const RtmpBasicHeader& bh, const RtmpMessageHeader& mh,
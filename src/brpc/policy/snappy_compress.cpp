@@ -14,6 +14,7 @@
 
 // Authors: Jiang,Lin (jianglin05@baidu.com)
 
+#include <vector>
 #include "butil/logging.h"
 #include "butil/third_party/snappy/snappy.h"
 #include "brpc/policy/snappy_compress.h"
@@ -23,6 +24,54 @@
 namespace brpc {
 namespace policy {
 
+// A snappy tag of 3 bytes expands to at most 64 bytes, a header claiming
+// more than this ratio can't be valid and is rejected before allocating.
+static const size_t MAX_SNAPPY_EXPANSION = 22;
+
+// Decompress `in' directly into blocks appended to `out' which are sized
+// by the length in the snappy header, instead of letting snappy allocate
+// scattered buffers and copying them into `out' afterwards, which doubles
+// the peak memory for large payloads.
+static bool SnappyUncompressToIOBuf(const butil::IOBuf& in, butil::IOBuf* out) {
+    char header[5];  // the varint32 of uncompressed length
+    const size_t nheader = in.copy_to(header, sizeof(header));
+    size_t uncompressed_len = 0;
+    if (!butil::snappy::GetUncompressedLength(header, nheader, &uncompressed_len)
+        || uncompressed_len > in.size() * MAX_SNAPPY_EXPANSION) {
+        return false;
+    }
+    const size_t old_size = out->size();
+    std::vector<butil::snappy::iovec> iov;
+    iov.reserve(uncompressed_len / butil::IOBuf::DEFAULT_PAYLOAD + 2);
+    {
+        butil::IOBufAsZeroCopyOutputStream wrapper(out);
+        size_t reserved = 0;
+        while (reserved < uncompressed_len) {
+            void* data = NULL;
+            int size = 0;
+            if (!wrapper.Next(&data, &size)) {
+                out->pop_back(out->size() - old_size);
+                return false;
+            }
+            butil::snappy::iovec v = { data, (size_t)size };
+            iov.push_back(v);
+            reserved += size;
+        }
+        if (reserved > uncompressed_len) {
+            // Give back the unused tail of the last block.
+            wrapper.BackUp(reserved - uncompressed_len);
+            iov.back().iov_len -= reserved - uncompressed_len;
+        }
+    }
+    butil::IOBufAsSnappySource source(in);
+    if (!butil::snappy::RawUncompressToIOVec(
+            &source, (iov.empty() ? NULL : &iov[0]), iov.size())) {
+        out->pop_back(out->size() - old_size);
+        return false;
+    }
+    return true;
+}
+
 bool SnappyCompress(const google::protobuf::Message& res, butil::IOBuf* buf) {
     butil::IOBuf serialized_pb;
     butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
@@ -36,10 +85,8 @@ bool SnappyCompress(const google::protobuf::Message& res, butil::IOBuf* buf) {
 }
 
 bool SnappyDecompress(const butil::IOBuf& data, google::protobuf::Message* req) {
-    butil::IOBufAsSnappySource source(data);
     butil::IOBuf binary_pb;
-    butil::IOBufAsSnappySink sink(binary_pb);
-    if (butil::snappy::Uncompress(&source, &sink)) {
+    if (SnappyUncompressToIOBuf(data, &binary_pb)) {
         return ParsePbFromIOBuf(req, binary_pb);
     }
     LOG(WARNING) << "Fail to snappy::Uncompress, size=" << data.size();
@@ -53,9 +100,7 @@ bool SnappyCompress(const butil::IOBuf& in, butil::IOBuf* out) {
 }
 
 bool SnappyDecompress(const butil::IOBuf& in, butil::IOBuf* out) {
-    butil::IOBufAsSnappySource source(in);
-    butil::IOBufAsSnappySink sink(*out);
-    return butil::snappy::Uncompress(&source, &sink);
+    return SnappyUncompressToIOBuf(in, out);
 }
 
 }  // namespace policy
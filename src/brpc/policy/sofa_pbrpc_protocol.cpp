@@ -16,8 +16,6 @@
 
 #include <google/protobuf/descriptor.h>          // MethodDescriptor
 #include <google/protobuf/message.h>             // Message
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
-#include <google/protobuf/io/coded_stream.h>
 #include "butil/time.h"
 #include "brpc/controller.h"                // Controller
 #include "brpc/socket.h"                    // Socket
@@ -27,9 +25,11 @@
 #include "brpc/compress.h"                  // ParseFromCompressedData
 #include "brpc/rpc_dump.h"
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/continuous_profiler.h"
 #include "brpc/policy/most_common_message.h"
 #include "brpc/policy/sofa_pbrpc_meta.pb.h" // SofaRpcMeta
 #include "brpc/policy/sofa_pbrpc_protocol.h"
+#include "brpc/policy/pbrpc_helpers.h"      // SerializeHeaderAndMeta
 #include "brpc/details/usercode_backup_pool.h"
 
 extern "C" {
@@ -76,6 +76,9 @@ SofaCompressType CompressType2Sofa(CompressType type) {
     case COMPRESS_TYPE_LZ4:
         LOG(ERROR) << "sofa-pbrpc does not support LZ4";
         return SOFA_COMPRESS_TYPE_NONE;
+    case COMPRESS_TYPE_ZSTD:
+        LOG(ERROR) << "sofa-pbrpc does not support ZSTD";
+        return SOFA_COMPRESS_TYPE_NONE;
     default:
         LOG(ERROR) << "Unknown SofaCompressType=" << type;
         return SOFA_COMPRESS_TYPE_NONE;
@@ -138,24 +141,7 @@ inline void PackSofaHeader(char* sofa_header, int meta_size, int body_size) {
 
 static void SerializeSofaHeaderAndMeta(
     butil::IOBuf* out, const SofaRpcMeta& meta, int payload_size) {
-    const int meta_size = meta.ByteSize();
-    if (meta_size <= 232) { // most common cases
-        char header_and_meta[24 + meta_size];
-        PackSofaHeader(header_and_meta, meta_size, payload_size);
-        ::google::protobuf::io::ArrayOutputStream arr_out(header_and_meta + 24, meta_size);
-        ::google::protobuf::io::CodedOutputStream coded_out(&arr_out);
-        meta.SerializeWithCachedSizes(&coded_out); // not calling ByteSize again
-        CHECK(!coded_out.HadError());
-        out->append(header_and_meta, sizeof(header_and_meta));
-    } else {
-        char header[24];
-        PackSofaHeader(header, meta_size, payload_size);
-        out->append(header, sizeof(header));
-        butil::IOBufAsZeroCopyOutputStream buf_stream(out);
-        ::google::protobuf::io::CodedOutputStream coded_out(&buf_stream);
-        meta.SerializeWithCachedSizes(&coded_out);
-        CHECK(!coded_out.HadError());
-    }
+    SerializeHeaderAndMeta<24>(out, meta, payload_size, PackSofaHeader);
 }
 
 ParseResult ParseSofaMessage(butil::IOBuf* source, Socket* socket,
@@ -215,11 +201,11 @@ static void SendSofaResponse(int64_t correlation_id,
     if (span) {
         span->set_start_send_us(butil::cpuwide_time_us());
     }
+    accessor.mark_phase(RPC_SERVER_START_SEND);
     ScopedMethodStatus method_status(method_status_raw);
     Socket* sock = accessor.get_sending_socket();
     std::unique_ptr<Controller, LogErrorTextAndDelete> recycle_cntl(cntl);
-    std::unique_ptr<const google::protobuf::Message> recycle_req(req);
-    std::unique_ptr<const google::protobuf::Message> recycle_res(res);
+    ScopedServerMessages recycle_messages(cntl, method_status_raw, req, res);
     ScopedRemoveConcurrency remove_concurrency_dummy(server, cntl);
 
     if (cntl->IsCloseConnection()) {
@@ -276,8 +262,14 @@ static void SendSofaResponse(int64_t correlation_id,
     if (append_body) {
         res_buf.append(res_body.movable());
     }
+    accessor.mark_phase(RPC_SERVER_SERIALIZED);
     if (span) {
         span->set_response_size(res_buf.size());
+        if (FLAGS_rpc_phase_latency) {
+            span->Annotate("Serialized response in %lldus",
+                           (long long)accessor.phase_times().Between(
+                               RPC_SERVER_START_SEND, RPC_SERVER_SERIALIZED));
+        }
     }
     // Have the risk of unlimited pending responses, in which case, tell
     // users to set max_concurrency.
@@ -290,11 +282,15 @@ static void SendSofaResponse(int64_t correlation_id,
                         sock->description().c_str());
         return;
     }
+    accessor.mark_phase(RPC_SERVER_WRITTEN);
     if (span) {
         // TODO: this is not sent
         span->set_sent_us(butil::cpuwide_time_us());
     }
     if (method_status) {
+        if (FLAGS_rpc_phase_latency && !cntl->Failed()) {
+            method_status_raw->OnPhases(accessor.phase_times());
+        }
         method_status.release()->OnResponded(
             !cntl->Failed(), butil::cpuwide_time_us() - start_parse_us);
     }
@@ -344,6 +340,7 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
     std::unique_ptr<google::protobuf::Message> res;
 
     ControllerPrivateAccessor accessor(cntl.get());
+    accessor.mark_phase(RPC_SERVER_START_PARSE, start_parse_us);
     ServerPrivateAccessor server_accessor(server);
     const int64_t correlation_id = meta.sequence_id();
     const bool security_mode = server->options().security_mode() &&
@@ -390,6 +387,10 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
             break;
         }
 
+        if (!server_accessor.AddTenantConcurrency(cntl.get())) {
+            cntl->SetFailed(ELIMIT, "Reached quota of the tenant");
+            break;
+        }
         if (!server_accessor.AddConcurrency(cntl.get())) {
             cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
                             server->options().max_concurrency);
@@ -415,7 +416,13 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
             if (!method_status->OnRequested()) {
                 cntl->SetFailed(ELIMIT, "Reached %s's max_concurrency=%d",
                                 sp->method->full_name().c_str(),
-                                method_status->max_concurrency());
+                                method_status->MaxConcurrency());
+                break;
+            }
+            if (!method_status->OnDispatched(msg->received_us())) {
+                cntl->SetFailed(ELIMIT, "%s is overloaded and the request has "
+                                "been queued for too long",
+                                sp->method->full_name().c_str());
                 break;
             }
         }
@@ -425,8 +432,9 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
         if (span) {
             span->ResetServerSpanName(method->full_name());
         }
-        req.reset(svc->GetRequestPrototype(method).New());
-        if (!ParseFromCompressedData(msg->payload, req.get(), req_cmp_type)) {
+        req.reset(NewServerRequest(svc, method, method_status, cntl.get()));
+        if (!ParseServerRequest(msg->payload, req_cmp_type, method,
+                                method_status, cntl.get(), req.get())) {
             cntl->SetFailed(EREQUEST, "Fail to parse request message, "
                             "CompressType=%d, size=%d", 
                             req_cmp_type, (int)msg->payload.size());
@@ -434,7 +442,7 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
         }
         msg.reset();  // optional, just release resourse ASAP
 
-        res.reset(svc->GetResponsePrototype(method).New());
+        res.reset(NewServerResponse(svc, method, method_status, cntl.get()));
         // `socket' will be held until response has been sent
         google::protobuf::Closure* done = ::brpc::NewCallback<
             int64_t, Controller*, const google::protobuf::Message*,
@@ -444,10 +452,12 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
                     req.get(), res.get(), server,
                     method_status, start_parse_us);
         // `cntl', `req' and `res' will be deleted inside `done'
+        accessor.mark_phase(RPC_SERVER_START_CALLBACK);
         if (span) {
             span->set_start_callback_us(butil::cpuwide_time_us());
             span->AsParent();
         }
+        ScopedProfiledMethod profiled_method(method);
         if (!FLAGS_usercode_in_pthread) {
             return svc->CallMethod(method, cntl.release(), 
                                    req.release(), res.release(), done);
@@ -498,6 +508,7 @@ void ProcessSofaResponse(InputMessageBase* msg_base) {
     }
     
     ControllerPrivateAccessor accessor(cntl);
+    accessor.mark_phase(RPC_CLIENT_RECEIVED, msg->received_us());
     Span* span = accessor.span();
     if (span) {
         span->set_base_real_us(msg->base_real_us());
@@ -33,6 +33,7 @@
 #include "brpc/policy/most_common_message.h"
 #include "brpc/policy/thrift_protocol.h"
 #include "brpc/details/usercode_backup_pool.h"
+#include "brpc/details/thrift_utils.h"
 
 #include <thrift/Thrift.h>
 #include <thrift/transport/TBufferTransports.h>
@@ -123,10 +124,10 @@ void ThriftClosure::Run() {
                 return;
             }
 
-            auto out_buffer =
-                THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-            auto oprot =
-                THRIFT_STDCXX::make_shared<apache::thrift::protocol::TBinaryProtocol>(out_buffer);
+            auto out_buffer = THRIFT_STDCXX::make_shared<ThriftIOBufTransport>(
+                (butil::IOBuf*)NULL);
+            auto oprot = create_thrift_protocol(
+                out_buffer, _request.use_compact_protocol);
 
             // The following code was taken and modified from thrift auto generated code
             oprot->writeMessageBegin(method_name,
@@ -156,10 +157,7 @@ void ThriftClosure::Run() {
             oprot->getTransport()->flush();
             // End thrfit auto generated code
 
-            uint8_t* buf;
-            uint32_t sz;
-            out_buffer->getBuffer(&buf, &sz);
-            _response.body.append(buf, sz);
+            out_buffer->move_written_to(&_response.body);
         }
 
         uint32_t length = _response.body.length();
@@ -218,7 +216,10 @@ ParseResult ParseThriftMessage(butil::IOBuf* source,
     const void* dummy = header_buf + sizeof(thrift_head_t);
     const int32_t sz = ntohl(*(int32_t*)dummy);
     int32_t version = sz & THRIFT_HEAD_VERSION_MASK;
-    if (version != THRIFT_HEAD_VERSION_1) {
+    // TCompactProtocol: protocol id, then version(5 bits) and type(3 bits).
+    const uint8_t* compact = (const uint8_t*)dummy;
+    if (version != THRIFT_HEAD_VERSION_1 &&
+        !(compact[0] == THRIFT_COMPACT_PROTOCOL_ID && (compact[1] & 0x1f) == 1)) {
         RPC_VLOG << "magic_num=" << version
                  << " doesn't match THRIFT_MAGIC_NUM=" << THRIFT_HEAD_VERSION_1;
         return MakeParseError(PARSE_ERROR_TRY_OTHERS);
@@ -320,6 +321,7 @@ void ProcessThriftRequest(InputMessageBase* msg_base) {
 
     req->head = *req_head;
     msg->payload.swap(req->body);
+    req->use_compact_protocol = is_thrift_compact_message(req->body);
     thrift_done->_start_parse_us = start_parse_us;
     thrift_done->_socket_ptr = socket.get();
     thrift_done->_server = server;
@@ -361,6 +363,10 @@ void ProcessThriftRequest(InputMessageBase* msg_base) {
             cntl->SetFailed(ELOGOFF, "Server is stopping");
             break;
         }
+        if (!server_accessor.AddTenantConcurrency(cntl)) {
+            cntl->SetFailed(ELIMIT, "Reached quota of the tenant");
+            break;
+        }
         if (!server_accessor.AddConcurrency(cntl)) {
             cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
                             server->options().max_concurrency);
@@ -432,23 +438,13 @@ void ProcessThriftResponse(InputMessageBase* msg_base) {
         msg->meta.copy_to(&response->head, sizeof(thrift_head_t));
         response->head.body_len = ntohl(response->head.body_len);
         msg->payload.swap(response->body);
+        response->use_compact_protocol = is_thrift_compact_message(response->body);
 
-        uint32_t body_len = response->head.body_len;
-        // Deserialize binary message to thrift message
-        std::unique_ptr<uint8_t[]>thrift_buffer(new uint8_t[body_len]);
-
-        const size_t k = response->body.copy_to(thrift_buffer.get(), body_len);
-        if ( k != body_len) {
-          cntl->SetFailed("copy response body to thrift buffer failed!");
-          return;
-        }
-
-        auto in_buffer =
-            THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-        auto in_portocol =
-            THRIFT_STDCXX::make_shared<apache::thrift::protocol::TBinaryProtocol>(in_buffer);
-
-        in_buffer->resetBuffer(thrift_buffer.get(), body_len);
+        // Deserialize the thrift message from blocks of the body directly.
+        butil::IOBuf in_buf(response->body);
+        auto in_buffer = THRIFT_STDCXX::make_shared<ThriftIOBufTransport>(&in_buf);
+        auto in_portocol = create_thrift_protocol(
+            in_buffer, response->use_compact_protocol);
 
         // The following code was taken from thrift auto generate code
         int32_t rseqid = 0;
@@ -544,10 +540,10 @@ void SerializeThriftRequest(butil::IOBuf* request_buf, Controller* cntl,
 
     thrift_head_t head = req->head;
 
-    auto out_buffer =
-        THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-    auto out_portocol =
-        THRIFT_STDCXX::make_shared<apache::thrift::protocol::TBinaryProtocol>(out_buffer);
+    auto out_buffer = THRIFT_STDCXX::make_shared<ThriftIOBufTransport>(
+        (butil::IOBuf*)NULL);
+    auto out_portocol = create_thrift_protocol(
+        out_buffer, req->use_compact_protocol);
 
     std::string thrift_method_name = cntl->thrift_method_name();
     // we should do more check on the thrift method name, but since it is rare when
@@ -590,15 +586,14 @@ void SerializeThriftRequest(butil::IOBuf* request_buf, Controller* cntl,
     // end send_xxx
     // end thrift auto generated code
 
-    uint8_t* buf;
-    uint32_t sz;
-    out_buffer->getBuffer(&buf, &sz);
+    butil::IOBuf body;
+    out_buffer->move_written_to(&body);
 
-    head.body_len = ntohl(sz);
+    head.body_len = htonl(body.size());
     request_buf->append(&head, sizeof(head));
     // end auto generate code
 
-    request_buf->append(buf, sz);
+    request_buf->append(body.movable());
 
 }
 
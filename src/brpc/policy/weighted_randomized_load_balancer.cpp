@@ -0,0 +1,261 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>                                   // std::min
+#include "butil/fast_rand.h"
+#include "butil/string_splitter.h"
+#include "butil/strings/string_number_conversions.h"
+#include "brpc/socket.h"
+#include "brpc/policy/weighted_randomized_load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Servers picked by weights before trying others one by one.
+static const size_t MAX_WEIGHTED_TRIES = 4;
+
+uint32_t WeightedRandomizedLoadBalancer::ParseWeight(const std::string& tag) {
+    uint32_t weight = 1;
+    for (butil::StringSplitter sp(tag.data(), tag.data() + tag.size(), ',');
+         sp; ++sp) {
+        const butil::StringPiece item(sp.field(), sp.length());
+        if (item.empty() || item.find('=') != butil::StringPiece::npos) {
+            // Other items such as "zone=NAME".
+            continue;
+        }
+        if (!butil::StringToUint(item, &weight) || weight == 0) {
+            return 0;
+        }
+    }
+    return weight;
+}
+
+bool WeightedRandomizedLoadBalancer::AddOne(Servers& bg, const ServerId& id) {
+    const uint32_t weight = ParseWeight(id.tag);
+    if (weight == 0) {
+        LOG(ERROR) << "Invalid weight in tag=" << id.tag;
+        return false;
+    }
+    if (!bg.server_map.emplace(id.id, bg.server_list.size()).second) {
+        return false;
+    }
+    bg.server_list.emplace_back(id.id, weight);
+    bg.weight_sum += weight;
+    return true;
+}
+
+bool WeightedRandomizedLoadBalancer::RemoveOne(Servers& bg, const ServerId& id) {
+    std::map<SocketId, size_t>::iterator it = bg.server_map.find(id.id);
+    if (it == bg.server_map.end()) {
+        return false;
+    }
+    const size_t index = it->second;
+    bg.weight_sum -= bg.server_list[index].weight;
+    bg.server_list[index] = bg.server_list.back();
+    bg.server_map[bg.server_list[index].id] = index;
+    bg.server_list.pop_back();
+    bg.server_map.erase(it);
+    return true;
+}
+
+// Vose's alias method with integers: weights are scaled by n so that each
+// bucket holds weight_sum, which is split between the server with less
+// weight and an alias with more.
+void WeightedRandomizedLoadBalancer::BuildTable(Servers& bg) {
+    const size_t n = bg.server_list.size();
+    bg.table.resize(n);
+    if (n == 0) {
+        return;
+    }
+    std::vector<uint64_t> scaled(n);
+    std::vector<size_t> small;
+    std::vector<size_t> large;
+    small.reserve(n);
+    large.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        scaled[i] = (uint64_t)bg.server_list[i].weight * n;
+        if (scaled[i] < bg.weight_sum) {
+            small.push_back(i);
+        } else {
+            large.push_back(i);
+        }
+    }
+    while (!small.empty() && !large.empty()) {
+        const size_t s = small.back();
+        small.pop_back();
+        const size_t l = large.back();
+        Bucket& b = bg.table[s];
+        b.threshold = scaled[s];
+        b.id = bg.server_list[s].id;
+        b.alias = bg.server_list[l].id;
+        scaled[l] -= bg.weight_sum - scaled[s];
+        if (scaled[l] < bg.weight_sum) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Remaining buckets are full, which are all in `large' or in `small'
+    // as the result of (exactly) matched leftovers.
+    for (size_t i = 0; i < large.size(); ++i) {
+        Bucket& b = bg.table[large[i]];
+        b.threshold = bg.weight_sum;
+        b.id = bg.server_list[large[i]].id;
+        b.alias = b.id;
+    }
+    for (size_t i = 0; i < small.size(); ++i) {
+        Bucket& b = bg.table[small[i]];
+        b.threshold = bg.weight_sum;
+        b.id = bg.server_list[small[i]].id;
+        b.alias = b.id;
+    }
+}
+
+bool WeightedRandomizedLoadBalancer::Add(Servers& bg, const ServerId& id) {
+    if (!AddOne(bg, id)) {
+        return false;
+    }
+    BuildTable(bg);
+    return true;
+}
+
+bool WeightedRandomizedLoadBalancer::Remove(Servers& bg, const ServerId& id) {
+    if (!RemoveOne(bg, id)) {
+        return false;
+    }
+    BuildTable(bg);
+    return true;
+}
+
+size_t WeightedRandomizedLoadBalancer::BatchAdd(
+    Servers& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!AddOne(bg, servers[i]);
+    }
+    if (count) {
+        BuildTable(bg);
+    }
+    return count;
+}
+
+size_t WeightedRandomizedLoadBalancer::BatchRemove(
+    Servers& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!RemoveOne(bg, servers[i]);
+    }
+    if (count) {
+        BuildTable(bg);
+    }
+    return count;
+}
+
+bool WeightedRandomizedLoadBalancer::AddServer(const ServerId& id) {
+    return _db_servers.Modify(Add, id);
+}
+
+bool WeightedRandomizedLoadBalancer::RemoveServer(const ServerId& id) {
+    return _db_servers.Modify(Remove, id);
+}
+
+size_t WeightedRandomizedLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.Modify(BatchAdd, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t WeightedRandomizedLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.Modify(BatchRemove, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+int WeightedRandomizedLoadBalancer::SelectServer(
+    const SelectIn& in, SelectOut* out) {
+    butil::DoublyBufferedData<Servers, butil::Void, true>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->table.size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    const size_t ntry = std::min(n, MAX_WEIGHTED_TRIES);
+    for (size_t i = 0; i < ntry; ++i) {
+        const Bucket& b = s->table[butil::fast_rand_less_than(n)];
+        const SocketId id =
+            (butil::fast_rand_less_than(s->weight_sum) < b.threshold ?
+             b.id : b.alias);
+        if (!ExcludedServers::IsExcluded(in.excluded, id)
+            && Socket::Address(id, out->ptr) == 0
+            && !(*out->ptr)->IsLogOff()) {
+            return 0;
+        }
+    }
+    // Selected servers are unavailable, try all servers from a random
+    // position regardless of weights.
+    size_t offset = butil::fast_rand_less_than(n);
+    for (size_t i = 0; i < n; ++i) {
+        const SocketId id = s->server_list[offset].id;
+        if (((i + 1) == n  // always take last chance
+             || !ExcludedServers::IsExcluded(in.excluded, id))
+            && Socket::Address(id, out->ptr) == 0
+            && !(*out->ptr)->IsLogOff()) {
+            return 0;
+        }
+        if (++offset == n) {
+            offset = 0;
+        }
+    }
+    return EHOSTDOWN;
+}
+
+WeightedRandomizedLoadBalancer* WeightedRandomizedLoadBalancer::New() const {
+    return new (std::nothrow) WeightedRandomizedLoadBalancer;
+}
+
+void WeightedRandomizedLoadBalancer::Destroy() {
+    delete this;
+}
+
+void WeightedRandomizedLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "wr";
+        return;
+    }
+    os << "WeightedRandomized{";
+    butil::DoublyBufferedData<Servers, butil::Void, true>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << "fail to read _db_servers";
+    } else {
+        os << "n=" << s->server_list.size() << ':';
+        for (size_t i = 0; i < s->server_list.size(); ++i) {
+            os << ' ' << s->server_list[i].id
+               << '(' << s->server_list[i].weight << ')';
+        }
+    }
+    os << '}';
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,86 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_WEIGHTED_RANDOMIZED_LOAD_BALANCER_H
+#define BRPC_POLICY_WEIGHTED_RANDOMIZED_LOAD_BALANCER_H
+
+#include <vector>                                      // std::vector
+#include <map>                                         // std::map
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// This LoadBalancer selects servers randomly with chances proportional to
+// their weights, which are set in tags of ServerId as positive integers,
+// optionally along with other items separated by commas, say "zone=bj,10".
+// Servers without weights in tags weigh 1.
+// An alias table (Vose's method) is rebuilt whenever servers are changed,
+// so that each selection is done in O(1) by two random numbers and one
+// access to the table, no matter how many servers there are.
+class WeightedRandomizedLoadBalancer : public LoadBalancer {
+public:
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    WeightedRandomizedLoadBalancer* New() const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+    // Get weight from `tag', returns 0 if the weight is invalid.
+    static uint32_t ParseWeight(const std::string& tag);
+
+private:
+    struct Server {
+        Server(SocketId s_id = 0, uint32_t s_w = 0) : id(s_id), weight(s_w) {}
+        SocketId id;
+        uint32_t weight;
+    };
+    // Bucket of the alias table. `id' is chosen if a random number less
+    // than weight_sum is less than `threshold', otherwise `alias' is chosen.
+    struct Bucket {
+        uint64_t threshold;
+        SocketId id;
+        SocketId alias;
+    };
+    struct Servers {
+        std::vector<Server> server_list;
+        // The value is the index of the server in "server_list".
+        std::map<SocketId, size_t> server_map;
+        uint64_t weight_sum;
+        std::vector<Bucket> table;
+
+        Servers() : weight_sum(0) {}
+    };
+    static bool Add(Servers& bg, const ServerId& id);
+    static bool Remove(Servers& bg, const ServerId& id);
+    static size_t BatchAdd(Servers& bg, const std::vector<ServerId>& servers);
+    static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
+    static bool AddOne(Servers& bg, const ServerId& id);
+    static bool RemoveOne(Servers& bg, const ServerId& id);
+    static void BuildTable(Servers& bg);
+
+    butil::DoublyBufferedData<Servers, butil::Void, true> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_WEIGHTED_RANDOMIZED_LOAD_BALANCER_H
@@ -150,7 +150,7 @@ size_t WeightedRoundRobinLoadBalancer::RemoveServersInBatch(
 }
 
 int WeightedRoundRobinLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
-    butil::DoublyBufferedData<Servers, TLS>::ScopedPtr s;
+    butil::DoublyBufferedData<Servers, TLS, true>::ScopedPtr s;
     if (_db_servers.Read(&s) != 0) {
         return ENOMEM;
     }
@@ -228,7 +228,7 @@ void WeightedRoundRobinLoadBalancer::Describe(
         return;
     }
     os << "WeightedRoundRobin{";
-    butil::DoublyBufferedData<Servers, TLS>::ScopedPtr s;
+    butil::DoublyBufferedData<Servers, TLS, true>::ScopedPtr s;
     if (_db_servers.Read(&s) != 0) {
         os << "fail to read _db_servers";
     } else {
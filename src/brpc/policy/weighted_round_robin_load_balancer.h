@@ -77,7 +77,7 @@ private:
     static SocketId GetServerInNextStride(const std::vector<Server>& server_list,
                                          TLS& tls);
 
-    butil::DoublyBufferedData<Servers, TLS> _db_servers;
+    butil::DoublyBufferedData<Servers, TLS, true> _db_servers;
 };
 
 }  // namespace policy
@@ -0,0 +1,326 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/socket.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_string(local_zone, "", "Zone of this process, servers tagged with "
+              "the same zone are preferred by zone-aware load balancers. "
+              "Empty means no preference");
+DEFINE_double(zone_overprovisioning_factor, 1.4, "Local servers are "
+              "considered to have enough capacity when healthy ones are "
+              "more than 1/factor of all");
+BRPC_VALIDATE_GFLAG(zone_overprovisioning_factor, PassValidate);
+DEFINE_double(zone_load_epsilon, 0.5, "Requests spill over to other zones "
+              "when local servers have more in-flight requests on average "
+              "than (1 + epsilon) times of remote servers");
+BRPC_VALIDATE_GFLAG(zone_load_epsilon, PassValidate);
+
+// Interval of counting healthy local servers.
+static const int64_t HEALTH_CHECK_INTERVAL_US = 100000;
+
+static pthread_once_t s_zone_counters_once = PTHREAD_ONCE_INIT;
+static butil::Mutex* s_zone_counters_mutex = NULL;
+static std::map<std::string, bvar::Adder<int64_t>*>* s_zone_counters = NULL;
+
+static void InitZoneCounters() {
+    s_zone_counters_mutex = new butil::Mutex;
+    s_zone_counters = new std::map<std::string, bvar::Adder<int64_t>*>;
+}
+
+// Counters are shared by all load balancers and never deleted, because
+// number of zones is small.
+static bvar::Adder<int64_t>* GetZoneSelectionCounter(const std::string& zone) {
+    pthread_once(&s_zone_counters_once, InitZoneCounters);
+    const std::string key = (zone.empty() ? "unknown" : zone);
+    BAIDU_SCOPED_LOCK(*s_zone_counters_mutex);
+    bvar::Adder<int64_t>*& counter = (*s_zone_counters)[key];
+    if (counter == NULL) {
+        std::string name;
+        bvar::to_underscored_name(&name, "rpc_zone_" + key + "_selection");
+        counter = new bvar::Adder<int64_t>(name);
+    }
+    return counter;
+}
+
+ZoneAwareLoadBalancer::ZoneAwareLoadBalancer(const LoadBalancer* inner)
+    : _inner(inner)
+    , _local_lb(inner->New())
+    , _remote_lb(inner->New())
+    , _nlocal(0)
+    , _nremote(0)
+    , _nhealthy_local(0)
+    , _last_health_check_us(0)
+    , _local_inflight(0)
+    , _remote_inflight(0) {
+}
+
+ZoneAwareLoadBalancer::~ZoneAwareLoadBalancer() {
+    if (_local_lb) {
+        _local_lb->Destroy();
+        _local_lb = NULL;
+    }
+    if (_remote_lb) {
+        _remote_lb->Destroy();
+        _remote_lb = NULL;
+    }
+}
+
+bool ZoneAwareLoadBalancer::Add(Servers& bg, const ServerId& id,
+                                const Member& m) {
+    if (!bg.members.insert(std::make_pair(id.id, m)).second) {
+        return false;
+    }
+    if (m.local) {
+        bg.local_servers.push_back(id.id);
+    }
+    return true;
+}
+
+bool ZoneAwareLoadBalancer::Remove(Servers& bg, const ServerId& id) {
+    std::map<SocketId, Member>::iterator it = bg.members.find(id.id);
+    if (it == bg.members.end()) {
+        return false;
+    }
+    if (it->second.local) {
+        for (size_t i = 0; i < bg.local_servers.size(); ++i) {
+            if (bg.local_servers[i] == id.id) {
+                bg.local_servers[i] = bg.local_servers.back();
+                bg.local_servers.pop_back();
+                break;
+            }
+        }
+    }
+    bg.members.erase(it);
+    return true;
+}
+
+bool ZoneAwareLoadBalancer::AddServer(const ServerId& id) {
+    const std::string zone = id.zone();
+    Member m;
+    m.local = (FLAGS_local_zone.empty() || zone == FLAGS_local_zone);
+    m.nselection = GetZoneSelectionCounter(zone);
+    if (!_db_servers.Modify(Add, id, m)) {
+        return false;
+    }
+    if (m.local) {
+        _local_lb->AddServer(id);
+        _nlocal.fetch_add(1, butil::memory_order_relaxed);
+        _nhealthy_local.fetch_add(1, butil::memory_order_relaxed);
+    } else {
+        _remote_lb->AddServer(id);
+        _nremote.fetch_add(1, butil::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool ZoneAwareLoadBalancer::RemoveServer(const ServerId& id) {
+    bool local = false;
+    {
+        butil::DoublyBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return false;
+        }
+        std::map<SocketId, Member>::const_iterator it = s->members.find(id.id);
+        if (it == s->members.end()) {
+            return false;
+        }
+        local = it->second.local;
+    }
+    if (!_db_servers.Modify(Remove, id)) {
+        return false;
+    }
+    if (local) {
+        _local_lb->RemoveServer(id);
+        _nlocal.fetch_sub(1, butil::memory_order_relaxed);
+    } else {
+        _remote_lb->RemoveServer(id);
+        _nremote.fetch_sub(1, butil::memory_order_relaxed);
+    }
+    return true;
+}
+
+size_t ZoneAwareLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    size_t n = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        n += !!AddServer(servers[i]);
+    }
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t ZoneAwareLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    size_t n = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        n += !!RemoveServer(servers[i]);
+    }
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+void ZoneAwareLoadBalancer::UpdateHealthyLocalServers(int64_t now_us) {
+    int64_t last = _last_health_check_us.load(butil::memory_order_relaxed);
+    if (now_us - last < HEALTH_CHECK_INTERVAL_US ||
+        !_last_health_check_us.compare_exchange_strong(
+            last, now_us, butil::memory_order_relaxed)) {
+        return;
+    }
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return;
+    }
+    int64_t nhealthy = 0;
+    for (size_t i = 0; i < s->local_servers.size(); ++i) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(s->local_servers[i], &ptr) == 0 &&
+            !ptr->IsLogOff()) {
+            ++nhealthy;
+        }
+    }
+    _nhealthy_local.store(nhealthy, butil::memory_order_relaxed);
+}
+
+double ZoneAwareLoadBalancer::SpillRatio() {
+    const int64_t nlocal = _nlocal.load(butil::memory_order_relaxed);
+    const int64_t nremote = _nremote.load(butil::memory_order_relaxed);
+    if (nremote <= 0) {
+        return 0;
+    }
+    if (nlocal <= 0) {
+        return 1;
+    }
+    const int64_t nhealthy = std::min(
+        _nhealthy_local.load(butil::memory_order_relaxed), nlocal);
+    double spill = 0;
+    const double capacity =
+        (double)nhealthy / nlocal * FLAGS_zone_overprovisioning_factor;
+    if (capacity < 1) {
+        spill = 1 - std::max(capacity, 0.0);
+    }
+    if (nhealthy > 0) {
+        const double local_load =
+            (double)_local_inflight.load(butil::memory_order_relaxed) / nhealthy;
+        const double remote_load =
+            (double)_remote_inflight.load(butil::memory_order_relaxed) / nremote;
+        // Loads lower than one request per server are not compared.
+        const double limit = (1 + std::max(FLAGS_zone_load_epsilon, 0.0))
+            * std::max(remote_load, 1.0);
+        if (local_load > limit) {
+            spill = std::max(spill, 1 - limit / local_load);
+        }
+    }
+    return spill;
+}
+
+int ZoneAwareLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    UpdateHealthyLocalServers(butil::gettimeofday_us());
+    const double spill = SpillRatio();
+    bool remote = (spill > 0 && butil::fast_rand_double() < spill);
+    int rc = (remote ? _remote_lb : _local_lb)->SelectServer(in, out);
+    if (rc != 0) {
+        // Try the other side anyway.
+        remote = !remote;
+        const int rc2 = (remote ? _remote_lb : _local_lb)->SelectServer(in, out);
+        if (rc2 != 0) {
+            return rc2 == ENODATA ? rc : rc2;
+        }
+    }
+    {
+        butil::DoublyBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) == 0) {
+            std::map<SocketId, Member>::const_iterator it =
+                s->members.find((*out->ptr)->id());
+            if (it != s->members.end()) {
+                *it->second.nselection << 1;
+            }
+        }
+    }
+    (remote ? _remote_inflight : _local_inflight).fetch_add(
+        1, butil::memory_order_relaxed);
+    // Inner load balancers receive feedbacks of all their selections.
+    out->need_feedback = true;
+    return 0;
+}
+
+void ZoneAwareLoadBalancer::Feedback(const CallInfo& info) {
+    bool local = false;
+    {
+        butil::DoublyBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return;
+        }
+        std::map<SocketId, Member>::const_iterator it =
+            s->members.find(info.server_id);
+        if (it == s->members.end()) {
+            return;
+        }
+        local = it->second.local;
+    }
+    if (local) {
+        _local_inflight.fetch_sub(1, butil::memory_order_relaxed);
+        _local_lb->Feedback(info);
+    } else {
+        _remote_inflight.fetch_sub(1, butil::memory_order_relaxed);
+        _remote_lb->Feedback(info);
+    }
+}
+
+ZoneAwareLoadBalancer* ZoneAwareLoadBalancer::New() const {
+    return new (std::nothrow) ZoneAwareLoadBalancer(_inner);
+}
+
+void ZoneAwareLoadBalancer::Destroy() {
+    delete this;
+}
+
+void ZoneAwareLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "zone_";
+        _local_lb->Describe(os, options);
+        return;
+    }
+    os << "ZoneAware{local_zone=" << FLAGS_local_zone
+       << " local=" << _nlocal.load(butil::memory_order_relaxed)
+       << " healthy_local=" << _nhealthy_local.load(butil::memory_order_relaxed)
+       << " remote=" << _nremote.load(butil::memory_order_relaxed)
+       << " local_inflight=" << _local_inflight.load(butil::memory_order_relaxed)
+       << " remote_inflight=" << _remote_inflight.load(butil::memory_order_relaxed)
+       << " spill_ratio=" << SpillRatio()
+       << " local_lb=";
+    _local_lb->Describe(os, options);
+    os << " remote_lb=";
+    _remote_lb->Describe(os, options);
+    os << '}';
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,86 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+#define BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+
+#include <map>                                         // std::map
+#include <vector>                                      // std::vector
+#include "butil/atomicops.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "bvar/reducer.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Prefer servers in the same zone with this process (-local_zone), zones
+// of servers are from their tags, see ServerId::zone(). Requests spill
+// over to servers in other zones only when the local zone lacks capacity:
+//  - Healthy local servers are fewer than 1 / -zone_overprovisioning_factor
+//    of all local servers, the part of missing capacity spills.
+//  - Local servers have more in-flight requests on average than
+//    (1 + -zone_load_epsilon) times of remote servers, the part of excess
+//    load spills.
+// Servers in each side are selected by a load balancer created from
+// `inner', which receives all Feedback() of its servers. Selections of each
+// zone are counted in bvar "rpc_zone_<zone>_selection".
+class ZoneAwareLoadBalancer : public LoadBalancer {
+public:
+    explicit ZoneAwareLoadBalancer(const LoadBalancer* inner);
+    ~ZoneAwareLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    ZoneAwareLoadBalancer* New() const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    struct Member {
+        bool local;
+        bvar::Adder<int64_t>* nselection;  // of the zone, never deleted
+    };
+    struct Servers {
+        std::map<SocketId, Member> members;
+        std::vector<SocketId> local_servers;
+    };
+    static bool Add(Servers& bg, const ServerId& id, const Member& m);
+    static bool Remove(Servers& bg, const ServerId& id);
+    // Probability of sending a request to other zones.
+    double SpillRatio();
+    void UpdateHealthyLocalServers(int64_t now_us);
+
+    const LoadBalancer* _inner;
+    LoadBalancer* _local_lb;
+    LoadBalancer* _remote_lb;
+    butil::atomic<int64_t> _nlocal;
+    butil::atomic<int64_t> _nremote;
+    butil::atomic<int64_t> _nhealthy_local;
+    butil::atomic<int64_t> _last_health_check_us;
+    butil::atomic<int64_t> _local_inflight;
+    butil::atomic<int64_t> _remote_inflight;
+    butil::DoublyBufferedData<Servers> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
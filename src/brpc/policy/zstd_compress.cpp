@@ -0,0 +1,312 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <map>
+#include <gflags/gflags.h>
+#ifdef BRPC_WITH_ZSTD
+#include <zstd.h>
+#endif
+#include "butil/logging.h"
+#include "butil/thread_local.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/protocol.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(zstd_compression_level, 3, "Compression level of zstd, "
+             "higher levels have better ratios and are slower. Messages "
+             "with dictionaries use the level at registration");
+BRPC_VALIDATE_GFLAG(zstd_compression_level, PassValidate);
+
+#ifdef BRPC_WITH_ZSTD
+
+struct ZstdDictionary {
+    ZSTD_CDict* cdict;
+    ZSTD_DDict* ddict;
+};
+
+// Only modified before compressions, see comments of RegisterZstdDictionary.
+typedef std::map<const google::protobuf::Descriptor*, ZstdDictionary> ZstdDictionaryMap;
+static ZstdDictionaryMap* s_zstd_dicts = NULL;
+
+static const ZstdDictionary* FindZstdDictionary(
+    const google::protobuf::Descriptor* type) {
+    if (s_zstd_dicts == NULL) {
+        return NULL;
+    }
+    ZstdDictionaryMap::const_iterator it = s_zstd_dicts->find(type);
+    return (it != s_zstd_dicts->end() ? &it->second : NULL);
+}
+
+struct ZstdThreadContext {
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+};
+
+static BAIDU_THREAD_LOCAL ZstdThreadContext* tls_zstd_ctx = NULL;
+
+static void DestroyZstdThreadContext(void* arg) {
+    ZstdThreadContext* ctx = static_cast<ZstdThreadContext*>(arg);
+    ZSTD_freeCCtx(ctx->cctx);
+    ZSTD_freeDCtx(ctx->dctx);
+    delete ctx;
+    tls_zstd_ctx = NULL;
+}
+
+static ZstdThreadContext* GetZstdThreadContext() {
+    ZstdThreadContext* ctx = tls_zstd_ctx;
+    if (ctx != NULL) {
+        return ctx;
+    }
+    ctx = new (std::nothrow) ZstdThreadContext;
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->cctx = ZSTD_createCCtx();
+    ctx->dctx = ZSTD_createDCtx();
+    if (ctx->cctx == NULL || ctx->dctx == NULL) {
+        LOG(ERROR) << "Fail to create zstd contexts";
+        DestroyZstdThreadContext(ctx);
+        return NULL;
+    }
+    tls_zstd_ctx = ctx;
+    butil::thread_atexit(DestroyZstdThreadContext, ctx);
+    return ctx;
+}
+
+static bool ZstdCompressWithDict(const butil::IOBuf& in, butil::IOBuf* out,
+                                 const ZstdDictionary* dict) {
+    ZstdThreadContext* ctx = GetZstdThreadContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    ZSTD_CCtx* cctx = ctx->cctx;
+    // Drop the state and the dictionary of the previous compression.
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                           FLAGS_zstd_compression_level);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, in.size());
+    if (dict != NULL) {
+        ZSTD_CCtx_refCDict(cctx, dict->cdict);
+    }
+    butil::IOBufAsZeroCopyOutputStream wrapper(out);
+    void* buf = NULL;
+    int size = 0;
+    if (!wrapper.Next(&buf, &size)) {
+        return false;
+    }
+    ZSTD_outBuffer output = { buf, (size_t)size, 0 };
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i <= nblock; ++i) {
+        // The extra round with empty input ends the frame.
+        const butil::StringPiece block =
+            (i < nblock ? in.backing_block(i) : butil::StringPiece());
+        const ZSTD_EndDirective mode = (i < nblock ? ZSTD_e_continue : ZSTD_e_end);
+        ZSTD_inBuffer input = { block.data(), block.size(), 0 };
+        size_t rc = 0;
+        do {
+            if (output.pos == output.size) {
+                if (!wrapper.Next(&buf, &size)) {
+                    return false;
+                }
+                output.dst = buf;
+                output.size = size;
+                output.pos = 0;
+            }
+            rc = ZSTD_compressStream2(cctx, &output, &input, mode);
+            if (ZSTD_isError(rc)) {
+                LOG(WARNING) << "Fail to ZSTD_compressStream2: "
+                             << ZSTD_getErrorName(rc);
+                wrapper.BackUp(output.size - output.pos);
+                return false;
+            }
+        } while (input.pos < input.size || (mode == ZSTD_e_end && rc != 0));
+    }
+    wrapper.BackUp(output.size - output.pos);
+    return true;
+}
+
+static bool ZstdDecompressWithDict(const butil::IOBuf& in, butil::IOBuf* out,
+                                   const ZstdDictionary* dict) {
+    ZstdThreadContext* ctx = GetZstdThreadContext();
+    if (ctx == NULL) {
+        return false;
+    }
+    ZSTD_DCtx* dctx = ctx->dctx;
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+    if (dict != NULL) {
+        ZSTD_DCtx_refDDict(dctx, dict->ddict);
+    }
+    butil::IOBufAsZeroCopyOutputStream wrapper(out);
+    void* buf = NULL;
+    int size = 0;
+    if (!wrapper.Next(&buf, &size)) {
+        return false;
+    }
+    ZSTD_outBuffer output = { buf, (size_t)size, 0 };
+    size_t rc = 1;  // non-zero until the frame is fully decoded
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i <= nblock; ++i) {
+        // The extra round with empty input flushes output held in dctx.
+        const butil::StringPiece block =
+            (i < nblock ? in.backing_block(i) : butil::StringPiece());
+        ZSTD_inBuffer input = { block.data(), block.size(), 0 };
+        while (input.pos < input.size || (i == nblock && rc != 0)) {
+            if (output.pos == output.size) {
+                if (!wrapper.Next(&buf, &size)) {
+                    return false;
+                }
+                output.dst = buf;
+                output.size = size;
+                output.pos = 0;
+            }
+            const size_t last_pos = output.pos;
+            rc = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(rc)) {
+                LOG(WARNING) << "Fail to ZSTD_decompressStream: "
+                             << ZSTD_getErrorName(rc);
+                wrapper.BackUp(output.size - output.pos);
+                return false;
+            }
+            if (i == nblock && rc != 0 && output.pos == last_pos) {
+                LOG(WARNING) << "Fail to ZSTD_decompressStream: truncated frame";
+                wrapper.BackUp(output.size - output.pos);
+                return false;
+            }
+        }
+    }
+    wrapper.BackUp(output.size - output.pos);
+    return true;
+}
+
+int RegisterZstdDictionary(const google::protobuf::Descriptor* type,
+                           const std::string& dict) {
+    if (type == NULL || dict.empty()) {
+        LOG(ERROR) << "Invalid type or dictionary";
+        return -1;
+    }
+    if (s_zstd_dicts == NULL) {
+        s_zstd_dicts = new ZstdDictionaryMap;
+    }
+    if (s_zstd_dicts->find(type) != s_zstd_dicts->end()) {
+        LOG(ERROR) << "Dictionary of " << type->full_name()
+                   << " was registered";
+        return -1;
+    }
+    ZstdDictionary d;
+    d.cdict = ZSTD_createCDict(dict.data(), dict.size(),
+                               FLAGS_zstd_compression_level);
+    d.ddict = ZSTD_createDDict(dict.data(), dict.size());
+    if (d.cdict == NULL || d.ddict == NULL) {
+        LOG(ERROR) << "Fail to create zstd dictionary of " << type->full_name();
+        ZSTD_freeCDict(d.cdict);
+        ZSTD_freeDDict(d.ddict);
+        return -1;
+    }
+    (*s_zstd_dicts)[type] = d;
+    return 0;
+}
+
+#else  // BRPC_WITH_ZSTD
+
+struct ZstdDictionary;
+
+static const ZstdDictionary* FindZstdDictionary(
+    const google::protobuf::Descriptor*) {
+    return NULL;
+}
+
+static bool ZstdCompressWithDict(const butil::IOBuf&, butil::IOBuf*,
+                                 const ZstdDictionary*) {
+    LOG(ERROR) << "brpc is not compiled with zstd";
+    return false;
+}
+
+static bool ZstdDecompressWithDict(const butil::IOBuf&, butil::IOBuf*,
+                                   const ZstdDictionary*) {
+    LOG(ERROR) << "brpc is not compiled with zstd";
+    return false;
+}
+
+int RegisterZstdDictionary(const google::protobuf::Descriptor*,
+                           const std::string&) {
+    LOG(ERROR) << "brpc is not compiled with zstd";
+    return -1;
+}
+
+#endif  // BRPC_WITH_ZSTD
+
+int RegisterZstdDictionary(const google::protobuf::MethodDescriptor* method,
+                           const std::string& request_dict,
+                           const std::string& response_dict) {
+    if (method == NULL) {
+        LOG(ERROR) << "Param[method] is NULL";
+        return -1;
+    }
+    if (!request_dict.empty() &&
+        RegisterZstdDictionary(method->input_type(), request_dict) != 0) {
+        return -1;
+    }
+    if (!response_dict.empty() &&
+        RegisterZstdDictionary(method->output_type(), response_dict) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    return ZstdCompressWithDict(in, out, NULL);
+}
+
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    return ZstdDecompressWithDict(in, out, NULL);
+}
+
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out,
+                  const google::protobuf::Descriptor* type) {
+    return ZstdCompressWithDict(in, out, FindZstdDictionary(type));
+}
+
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out,
+                    const google::protobuf::Descriptor* type) {
+    return ZstdDecompressWithDict(in, out, FindZstdDictionary(type));
+}
+
+bool ZstdCompress(const google::protobuf::Message& res, butil::IOBuf* buf) {
+    butil::IOBuf serialized_pb;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
+    if (res.SerializeToZeroCopyStream(&wrapper)) {
+        return ZstdCompressWithDict(serialized_pb, buf,
+                                    FindZstdDictionary(res.GetDescriptor()));
+    }
+    LOG(WARNING) << "Fail to serialize input pb=" << &res;
+    return false;
+}
+
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* req) {
+    butil::IOBuf binary_pb;
+    if (ZstdDecompressWithDict(data, &binary_pb,
+                               FindZstdDictionary(req->GetDescriptor()))) {
+        return ParsePbFromIOBuf(req, binary_pb);
+    }
+    LOG(WARNING) << "Fail to zstd decompress, size=" << data.size();
+    return false;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,77 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_POLICY_ZSTD_COMPRESS_H
+#define BRPC_POLICY_ZSTD_COMPRESS_H
+
+#include <string>
+#include <google/protobuf/message.h>          // Message
+#include <google/protobuf/descriptor.h>       // Descriptor
+#include "butil/iobuf.h"                       // IOBuf
+
+
+namespace brpc {
+namespace policy {
+
+// The data is encoded in zstd frame format and compressed/decompressed
+// block by block without flattening the IOBuf. Compression level is set by
+// -zstd_compression_level. Available when brpc is built with zstd
+// (-DBRPC_WITH_ZSTD=ON or --with-zstd), otherwise all functions fail.
+
+// Compress serialized `msg' into `buf'.
+bool ZstdCompress(const google::protobuf::Message& msg, butil::IOBuf* buf);
+
+// Parse `msg' from decompressed `buf'
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* msg);
+
+// Put compressed `in' into `out'.
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out);
+
+// Put decompressed `in' into `out'.
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out);
+
+// Put compressed `in' which is serialized from a message of `type' into
+// `out', using the dictionary registered for `type' if any.
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out,
+                  const google::protobuf::Descriptor* type);
+
+// Put decompressed `in' which is serialized from a message of `type' into
+// `out', using the dictionary registered for `type' if any.
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out,
+                    const google::protobuf::Descriptor* type);
+
+// Compress and decompress messages of `type' with dictionary `dict', which
+// is often trained by `zstd --train' from samples of the messages and
+// improves ratios of small similar messages a lot. Both sides must register
+// the same dictionary, since frames compressed with a dictionary cannot be
+// decoded without it.
+// [NOT thread-safe] Call this before any message of `type' is compressed
+// or decompressed, e.g. before starting servers and channels.
+// Returns 0 on success, -1 otherwise.
+int RegisterZstdDictionary(const google::protobuf::Descriptor* type,
+                           const std::string& dict);
+
+// Register dictionaries for request and response of `method'. An empty
+// dictionary leaves the corresponding message type unchanged.
+// Returns 0 on success, -1 otherwise.
+int RegisterZstdDictionary(const google::protobuf::MethodDescriptor* method,
+                           const std::string& request_dict,
+                           const std::string& response_dict);
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_ZSTD_COMPRESS_H
@@ -31,6 +31,8 @@ namespace brpc {
 //   ...
 //   cntl.ReadProgressiveAttachmentBy(new MyProgressiveReader); // after RPC
 //   ...
+// Server-side usage (ServiceOptions.enable_progressive_read is true):
+//   cntl->ReadProgressiveAttachmentBy(new MyProgressiveReader); // in method
 class ProgressiveReader {
 public:
     // Called when one part was read.
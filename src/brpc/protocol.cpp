@@ -29,12 +29,15 @@ const uint64_t PB_TOTAL_BYETS_LIMITS =
 #include <gflags/gflags.h>
 #include "butil/logging.h"
 #include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/object_pool.h"
 #include "brpc/protocol.h"
 #include "brpc/controller.h"
 #include "brpc/compress.h"
+#include "brpc/adaptive_compressor.h"
 #include "brpc/global.h"
 #include "brpc/serialized_request.h"
 #include "brpc/input_messenger.h"
+#include "brpc/details/controller_private_accessor.h"
 
 
 namespace brpc {
@@ -47,6 +50,11 @@ DEFINE_bool(log_error_text, false,
             " respond a failed RPC");
 BRPC_VALIDATE_GFLAG(log_error_text, PassValidate);
 
+DEFINE_bool(reuse_server_controller, false, "Reuse Controllers of servers "
+            "between RPCs (baidu_std only) to save allocations. Reused "
+            "Controllers are counted in rpc_controller_count");
+BRPC_VALIDATE_GFLAG(reuse_server_controller, PassValidate);
+
 // Not using ProtocolType_MAX as the boundary because others may define new
 // protocols outside brpc.
 const size_t MAX_PROTOCOL_SIZE = 128;
@@ -136,6 +144,20 @@ void SerializeRequestDefault(butil::IOBuf* buf,
             EREQUEST, "Missing required fields in request: %s",
             request->InitializationErrorString().c_str());
     }
+    if (cntl->request_compress_type() == COMPRESS_TYPE_AUTO) {
+        if (cntl->request_protocol() != PROTOCOL_BAIDU_STD) {
+            return cntl->SetFailed(
+                EREQUEST, "COMPRESS_TYPE_AUTO is only supported by baidu_std");
+        }
+        // The picked type replaces AUTO and is packed into the meta.
+        CompressType type = COMPRESS_TYPE_NONE;
+        if (!AdaptiveCompressor::ForRequestsOf(cntl->method())->Serialize(
+                *request, buf, &type)) {
+            return cntl->SetFailed(EREQUEST, "Fail to compress request");
+        }
+        cntl->set_request_compress_type(type);
+        return;
+    }
     if (!SerializeAsCompressedData(*request, buf, cntl->request_compress_type())) {
         return cntl->SetFailed(
             EREQUEST, "Fail to compress request, compress_tpye=%d",
@@ -158,6 +180,10 @@ ProtocolType StringToProtocolType(const butil::StringPiece& name,
     // Force init of s_protocol_name.
     GlobalInitializeOrDie();
 
+    // "h2c" is http2 over cleartext, which is just "h2" without ssl.
+    if (CompareStringPieceWithoutCase(name, "h2c")) {
+        return PROTOCOL_H2;
+    }
     ProtocolEntry* const protocol_map = get_protocol_map();
     for (size_t i = 0; i < MAX_PROTOCOL_SIZE; ++i) {
         if (protocol_map[i].valid.load(butil::memory_order_acquire) &&
@@ -243,8 +269,24 @@ void LogErrorTextAndDelete::operator()(Controller* c) const {
         }
     }
     if (_delete_cntl) {
-        delete c;
+        if (ControllerPrivateAccessor(c).is_from_pool()) {
+            c->Reset();
+            butil::return_object(c);
+        } else {
+            delete c;
+        }
+    }
+}
+
+Controller* NewServerController() {
+    if (!FLAGS_reuse_server_controller) {
+        return new (std::nothrow) Controller;
+    }
+    Controller* cntl = butil::get_object<Controller>();
+    if (cntl) {
+        ControllerPrivateAccessor(cntl).set_from_pool();
     }
+    return cntl;
 }
 
 } // namespace brpc
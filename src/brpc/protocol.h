@@ -195,8 +195,14 @@ bool ParsePbFromIOBuf(google::protobuf::Message* msg, const butil::IOBuf& buf);
 bool ParsePbFromArray(google::protobuf::Message* msg, const void* data, size_t size);
 bool ParsePbFromString(google::protobuf::Message* msg, const std::string& str);
 
+// Create a Controller to process a request on server-side, which is got
+// from an object pool when -reuse_server_controller is on. The controller
+// must be destroyed by LogErrorTextAndDelete. Returns NULL on error.
+Controller* NewServerController();
+
 // Deleter for unique_ptr to print error_text of the controller when
-// -log_error_text is on, then delete the controller if `delete_cntl' is true
+// -log_error_text is on, then delete the controller if `delete_cntl' is true.
+// Controllers from NewServerController() are reset and returned to the pool.
 class LogErrorTextAndDelete {
 public:
     explicit LogErrorTextAndDelete(bool delete_cntl = true)
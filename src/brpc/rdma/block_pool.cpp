@@ -16,10 +16,14 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <vector>
+#include <butil/atomicops.h>
 #include <butil/fast_rand.h>
 #include <butil/object_pool.h>
+#include <butil/string_printf.h>
 #include <bthread/bthread.h>
+#include <bvar/bvar.h>
 #include <gflags/gflags.h>
 #include "brpc/rdma/block_pool.h"
 
@@ -28,6 +32,8 @@ namespace rdma {
 
 // Number of bytes in 1MB
 static const size_t BYTES_IN_MB = 1048576;
+// Regions backed by hugepages are mapped in units of this size
+static const size_t HUGEPAGE_SIZE = 2 * BYTES_IN_MB;
 
 DEFINE_int32(rdma_memory_pool_initial_size_mb, 1024,
              "Initial size of memory pool for RDMA (MB), should >=64");
@@ -35,6 +41,13 @@ DEFINE_int32(rdma_memory_pool_increase_size_mb, 1024,
              "Increased size of memory pool for RDMA (MB), should >=64");
 DEFINE_int32(rdma_memory_pool_max_regions, 16, "Max number of regions");
 DEFINE_int32(rdma_memory_pool_buckets, 4, "Number of buckets to reduce race");
+DEFINE_bool(rdma_memory_pool_use_hugepage, false, "Back regions with "
+            "hugepages (MAP_HUGETLB), which fall back to normal pages if "
+            "hugepages are not enough");
+DEFINE_int32(rdma_memory_pool_extend_watermark, 0, "When usage of blocks of "
+             "a size is above so many percents, the next region is allocated "
+             "and registered in background to avoid stalling the allocating "
+             "thread. 0 means extending on demand only");
 
 struct IdleNode {
     void* start;
@@ -47,6 +60,7 @@ struct Region {
     size_t size;
     uint32_t block_type;
     uint32_t id;  // lkey
+    size_t map_size;  // non-zero if the region is mmap-ed with hugepages
 };
 
 static const int MAX_REGIONS = 16;
@@ -69,12 +83,17 @@ static const int BLOCK_DEFAULT = 0;
 static const int BLOCK_2_DEFAULT = 1;
 static const int BLOCK_4_DEFAULT = 2;
 static const int BLOCK_8_DEFAULT = 3;
-static const int BLOCK_SIZE_COUNT = 4;
+// Larger sizes are not used by IOBuf, but by users who allocate buffers from
+// the pool directly.
+static const int BLOCK_16_DEFAULT = 4;
+static const int BLOCK_32_DEFAULT = 5;
+static const int BLOCK_SIZE_COUNT = 6;
 static const size_t BLOCK_SIZE[BLOCK_SIZE_COUNT] =
 #ifdef IOBUF_HUGE_BLOCK
-        { 256 * 1024, 512 * 1024, 1024 * 1024, 2048 * 1024 };
+        { 256 * 1024, 512 * 1024, 1024 * 1024, 2048 * 1024,
+          4096 * 1024, 8192 * 1024 };
 #else
-        { 8192, 16384, 32768, 65536 };
+        { 8192, 16384, 32768, 65536, 131072, 262144 };
 #endif
 
 // For each block size, there are some buckets of idle list to reduce race.
@@ -83,6 +102,13 @@ static std::vector<butil::Mutex*> g_lock[BLOCK_SIZE_COUNT];
 static butil::Mutex g_extend_lock;
 static IdleNode* g_ready_list[BLOCK_SIZE_COUNT];
 
+// Bytes of blocks in regions and bytes allocated, for each block size
+static butil::atomic<int64_t> g_total_bytes[BLOCK_SIZE_COUNT];
+static butil::atomic<int64_t> g_used_bytes[BLOCK_SIZE_COUNT];
+static butil::atomic<int64_t> g_hugepage_bytes(0);
+// Whether a region is being extended in background for each block size
+static butil::atomic<bool> g_extending[BLOCK_SIZE_COUNT];
+
 static inline Region* GetRegion(const void* buf) {
     if (!buf) {
         errno = EINVAL;
@@ -111,8 +137,18 @@ uint32_t GetRegionId(const void* buf) {
     return r->id;
 }
 
-// Extend the block pool with a new region (with different region ID)
-static void* ExtendBlockPool(size_t region_size, int block_type) {
+static void FreeRegionMemory(Region* region) {
+    if (region->map_size > 0) {
+        munmap((void*)region->start, region->map_size);
+        g_hugepage_bytes.fetch_sub(region->map_size, butil::memory_order_relaxed);
+    } else {
+        free((void*)region->start);
+    }
+}
+
+// Allocate and register the memory of a new region, which may take long
+// for large regions. The region is not visible until it's added.
+static Region* CreateRegion(size_t region_size, int block_type) {
     if (region_size < 64) {
         errno = EINVAL;
         return NULL;
@@ -132,20 +168,51 @@ static void* ExtendBlockPool(size_t region_size, int block_type) {
         PLOG_EVERY_SECOND(ERROR) << "Memory not enough";
         return NULL;
     }
+    region->map_size = 0;
 
     void* region_base = NULL;
-    if (posix_memalign(&region_base, 4096, region_size) != 0) {
+    if (FLAGS_rdma_memory_pool_use_hugepage) {
+        const size_t map_size = (region_size + HUGEPAGE_SIZE - 1)
+                                / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+        region_base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region_base == MAP_FAILED) {
+            PLOG_EVERY_SECOND(WARNING) << "Fail to mmap " << map_size
+                    << " bytes of hugepages, use normal pages instead";
+            region_base = NULL;
+        } else {
+            region->map_size = map_size;
+            g_hugepage_bytes.fetch_add(map_size, butil::memory_order_relaxed);
+        }
+    }
+    if (region_base == NULL &&
+        posix_memalign(&region_base, 4096, region_size) != 0) {
         PLOG_EVERY_SECOND(ERROR) << "Memory not enough";
         delete region;
         return NULL;
     }
+    region->start = (uintptr_t)region_base;
+    region->size = region_size;
+    region->block_type = block_type;
 
     uint32_t id = g_cb(region_base, region_size);
     if (id == 0) {
-        free(region_base);
+        FreeRegionMemory(region);
         delete region;
         return NULL;
     }
+    region->id = id;
+    return region;
+}
+
+// Add the region created by CreateRegion to the pool, with g_extend_lock held
+// Return the address of the region, NULL if failed and errno is set, in
+// which case the region is not owned by the pool.
+static void* AddRegion(Region* region) {
+    if (g_region_num == g_max_regions) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
     IdleNode* node[g_buckets];
     for (int i = 0; i < g_buckets; ++i) {
@@ -155,17 +222,15 @@ static void* ExtendBlockPool(size_t region_size, int block_type) {
             for (int j = 0; j < i; ++j) {
                 butil::return_object<IdleNode>(node[j]);
             }
-            free(region_base);
-            delete region;
             return NULL;
         }
     }
- 
-    region->start = (uintptr_t)region_base;
-    region->size = region_size;
-    region->id = id;
-    region->block_type = block_type;
+
+    const int block_type = region->block_type;
+    const size_t region_size = region->size;
     g_regions[g_region_num++] = region;
+    g_total_bytes[block_type].fetch_add(region_size,
+                                        butil::memory_order_relaxed);
 
     for (int i = 0; i < g_buckets; ++i) {
         node[i]->start = (void*)(region->start + i * (region_size / g_buckets));
@@ -174,9 +239,104 @@ static void* ExtendBlockPool(size_t region_size, int block_type) {
         g_ready_list[block_type] = node[i];
     }
 
+    return (void*)region->start;
+}
+
+// Extend the block pool with a new region (with different region ID)
+static void* ExtendBlockPool(size_t region_size, int block_type) {
+    Region* region = CreateRegion(region_size, block_type);
+    if (!region) {
+        return NULL;
+    }
+    void* region_base = AddRegion(region);
+    if (!region_base) {
+        FreeRegionMemory(region);
+        delete region;
+    }
     return region_base;
 }
 
+static void* ExtendBlockPoolInBackground(void* arg) {
+    const int block_type = (int)(intptr_t)arg;
+    // Allocating and registering memory without locks, which do not block
+    // other threads allocating blocks.
+    Region* region = CreateRegion(FLAGS_rdma_memory_pool_increase_size_mb,
+                                  block_type);
+    if (region) {
+        BAIDU_SCOPED_LOCK(g_extend_lock);
+        if (!AddRegion(region)) {
+            FreeRegionMemory(region);
+            delete region;
+        }
+    } else {
+        LOG_EVERY_SECOND(WARNING) << "Fail to extend new region in background";
+    }
+    g_extending[block_type].store(false, butil::memory_order_release);
+    return NULL;
+}
+
+// Start extending the pool in background if the usage is above watermark
+static inline void MaybeExtendBlockPool(int block_type) {
+    const int64_t watermark = FLAGS_rdma_memory_pool_extend_watermark;
+    if (watermark <= 0 || g_region_num >= g_max_regions) {
+        return;
+    }
+    const int64_t total =
+        g_total_bytes[block_type].load(butil::memory_order_relaxed);
+    const int64_t used =
+        g_used_bytes[block_type].load(butil::memory_order_relaxed);
+    if (total == 0 || used * 100 < total * watermark) {
+        return;
+    }
+    if (g_extending[block_type].exchange(true, butil::memory_order_acquire)) {
+        // Already extending
+        return;
+    }
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, ExtendBlockPoolInBackground,
+                                 (void*)(intptr_t)block_type) != 0) {
+        g_extending[block_type].store(false, butil::memory_order_release);
+    }
+}
+
+static int64_t GetRegionNumOfPool(void*) {
+    return g_region_num;
+}
+
+static int64_t GetHugepageBytes(void*) {
+    return g_hugepage_bytes.load(butil::memory_order_relaxed);
+}
+
+static int64_t GetTotalBytes(void* arg) {
+    return g_total_bytes[(intptr_t)arg].load(butil::memory_order_relaxed);
+}
+
+static int64_t GetUsedBytes(void* arg) {
+    return g_used_bytes[(intptr_t)arg].load(butil::memory_order_relaxed);
+}
+
+static void ExposeBlockPoolVars() {
+    static bool exposed = false;
+    if (exposed) {
+        return;
+    }
+    exposed = true;
+    new bvar::PassiveStatus<int64_t>(
+            "rdma_block_pool_region_num", GetRegionNumOfPool, NULL);
+    new bvar::PassiveStatus<int64_t>(
+            "rdma_block_pool_hugepage_bytes", GetHugepageBytes, NULL);
+    for (intptr_t i = 0; i < BLOCK_SIZE_COUNT; ++i) {
+        new bvar::PassiveStatus<int64_t>(
+                butil::string_printf("rdma_block_pool_%lu_total_bytes",
+                                     (unsigned long)BLOCK_SIZE[i]),
+                GetTotalBytes, (void*)i);
+        new bvar::PassiveStatus<int64_t>(
+                butil::string_printf("rdma_block_pool_%lu_used_bytes",
+                                     (unsigned long)BLOCK_SIZE[i]),
+                GetUsedBytes, (void*)i);
+    }
+}
+
 void* InitBlockPool(Callback cb) {
     if (!cb) {
         errno = EINVAL;
@@ -218,6 +378,7 @@ void* InitBlockPool(Callback cb) {
             }
         }
     }
+    ExposeBlockPoolVars();
     return ExtendBlockPool(FLAGS_rdma_memory_pool_initial_size_mb,
                            BLOCK_DEFAULT);
 }
@@ -228,7 +389,7 @@ static inline void PickReadyBlocks(int block_type, uint64_t index) {
     g_idle_list[block_type][index]->next = NULL;
 }
 
-static void* AllocBlockFrom(int block_type) {
+static void* AllocBlockFromBucket(int block_type) {
     void* ptr = NULL;
     uint64_t index = butil::fast_rand_less_than(g_buckets);
     BAIDU_SCOPED_LOCK(*g_lock[block_type][index]);
@@ -265,6 +426,16 @@ static void* AllocBlockFrom(int block_type) {
     return ptr;
 }
 
+static void* AllocBlockFrom(int block_type) {
+    void* ptr = AllocBlockFromBucket(block_type);
+    if (ptr) {
+        g_used_bytes[block_type].fetch_add(BLOCK_SIZE[block_type],
+                                           butil::memory_order_relaxed);
+        MaybeExtendBlockPool(block_type);
+    }
+    return ptr;
+}
+
 void* AllocBlock(size_t size) {
     if (size == 0 || size > BLOCK_SIZE[BLOCK_SIZE_COUNT - 1]) {
         errno = EINVAL;
@@ -311,11 +482,17 @@ int DeallocBlock(void* buf) {
         node->next = head;
         g_idle_list[block_type][index] = node;
     }
+    g_used_bytes[block_type].fetch_sub(block_size, butil::memory_order_relaxed);
     return 0;
 }
 
 // Just for UT
 void DestroyBlockPool() {
+    for (int i = 0; i < BLOCK_SIZE_COUNT; ++i) {
+        while (g_extending[i].load(butil::memory_order_acquire)) {
+            bthread_usleep(1000);
+        }
+    }
     for (int i = 0; i < BLOCK_SIZE_COUNT; ++i) {
         for (int j = 0; j < g_buckets; ++j) {
             IdleNode* node = g_idle_list[i][j];
@@ -333,13 +510,15 @@ void DestroyBlockPool() {
             node = tmp;
         }
         g_ready_list[i] = NULL;
+        g_total_bytes[i].store(0, butil::memory_order_relaxed);
+        g_used_bytes[i].store(0, butil::memory_order_relaxed);
     }
     for (int i = 0; i < g_region_num; ++i) {
         Region* r = g_regions[i];
         if (!r) {
             break;
         }
-        free((void*)r->start);
+        FreeRegionMemory(r);
         delete r;
         g_regions[i] = NULL;
     }
@@ -361,6 +540,11 @@ size_t GetBlockSize(int type) {
     return BLOCK_SIZE[type];
 }
 
+// Just for UT
+int GetBlockSizeCount() {
+    return BLOCK_SIZE_COUNT;
+}
+
 // Just for UT
 size_t GetGlobalLen(int block_type) {
     size_t len = 0;
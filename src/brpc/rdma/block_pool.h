@@ -44,12 +44,20 @@ namespace rdma {
 //
 // Since IOBuf supports different block size (max: 64KB, when IOBUF_HUGE_BLOCK
 // is not defined), the block_pool also supports several block sizes: 8KB, 16KB,
-// 32KB and 64KB (when IOBUF_HUGE_BLOCK is not defined). The block allocated
+// 32KB and 64KB (when IOBUF_HUGE_BLOCK is not defined), plus 128KB and 256KB
+// for users allocating larger buffers directly. The block allocated
 // to the caller is the block with minimum size which is larger than the
 // applied size. For example, if the caller needs a buffer with a size of 9KB,
 // block_pool will allocate a 16KB-block for it. Please remember that
 // different-size blocks are in different regions.
 //
+// Registering a large region takes long, which stalls the thread allocating
+// a block when the pool is used up. Set -rdma_memory_pool_extend_watermark to
+// allocate and register the next region in background before that. Regions
+// can be backed by hugepages with -rdma_memory_pool_use_hugepage, which makes
+// registration faster and reduces TLB misses of the NIC. Usage of the pool is
+// exposed as bvars prefixed with rdma_block_pool.
+//
 // Currently, the block_pool supports 16 regions at most. If there is more than
 // one region, the complexity of finding which region an address belongs to
 // is O(n). Here n is the number of regions. In order to avoid race conditions
@@ -30,6 +30,9 @@
 namespace brpc {
 namespace rdma {
 
+DECLARE_int32(rdma_rendezvous_threshold);
+DECLARE_bool(rdma_use_srq);
+
 DEFINE_int32(rdma_backlog, 1024, "The backlog for rdma connection.");
 DEFINE_int32(rdma_conn_timeout_ms, 500, "The timeout (ms) for RDMA connection"
                                         "establishment.");
@@ -37,6 +40,9 @@ DEFINE_int32(rdma_conn_timeout_ms, 500, "The timeout (ms) for RDMA connection"
 static const int FLOW_CONTROL = 1;          // for creating QP
 static const int RETRY_COUNT = 1;           // for creating QP
 static const int RNR_RETRY_COUNT = 0;       // for creating QP
+// Receive buffers of a SRQ may be used up by other connections temporarily,
+// let the sender retry until they are replenished.
+static const int SRQ_RNR_RETRY_COUNT = 6;   // for creating QP
 
 RdmaCommunicationManager::RdmaCommunicationManager(void* cm_id)
     : _cm_id(cm_id)
@@ -161,7 +167,13 @@ void InitRdmaConnParam(rdma_conn_param* p, const char* data, size_t len) {
     }
     p->flow_control = FLOW_CONTROL;
     p->retry_count = RETRY_COUNT;
-    p->rnr_retry_count = RNR_RETRY_COUNT;
+    p->rnr_retry_count = FLAGS_rdma_use_srq ?
+                         SRQ_RNR_RETRY_COUNT : RNR_RETRY_COUNT;
+    if (FLAGS_rdma_rendezvous_threshold > 0) {
+        // Allow peers to RDMA READ from each other.
+        p->responder_resources = GetRdmaMaxRdAtomic();
+        p->initiator_depth = GetRdmaMaxRdAtomic();
+    }
 }
 #endif
 
@@ -281,7 +293,7 @@ RdmaCMEvent RdmaCommunicationManager::GetCMEvent() {
 }
 
 void* RdmaCommunicationManager::CreateQP(
-        uint32_t sq_size, uint32_t rq_size, void* cq, uint64_t id) {
+        uint32_t sq_size, uint32_t rq_size, void* cq, void* srq, uint64_t id) {
 #ifndef BRPC_RDMA
     CHECK(false) << "This should not happen";
     return NULL;
@@ -295,6 +307,7 @@ void* RdmaCommunicationManager::CreateQP(
     qp_attr.qp_context = (void*)id;
     qp_attr.send_cq = (ibv_cq*)cq;
     qp_attr.recv_cq = (ibv_cq*)cq;
+    qp_attr.srq = (ibv_srq*)srq;
     qp_attr.qp_type = IBV_QPT_RC;
     qp_attr.sq_sig_all = 0;
     qp_attr.cap.max_send_wr = sq_size;
@@ -106,11 +106,13 @@ public:
     //     sq_size: the capacity of Send Queue
     //     rq_size: the capacity of Recv Queue
     //     cq:      associated CQ
+    //     srq:     associated SRQ, NULL if the QP has its own Recv Queue
     //     id:      SocketId of associated Socket
     // Return:
     //     QP created:   success
     //     NULL:  failed, errno set
-    void* CreateQP(uint32_t sq_size, uint32_t rq_size, void* cq, uint64_t id);
+    void* CreateQP(uint32_t sq_size, uint32_t rq_size, void* cq, void* srq,
+                   uint64_t id);
 
     // Get rdmacm fd
     int GetFD() const;
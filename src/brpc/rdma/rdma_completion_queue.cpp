@@ -23,7 +23,9 @@
 #include <butil/logging.h>                           // LOG
 #include <butil/object_pool.h>                       // butil::get_object
 #include <butil/rand_util.h>                         // butil::RandGenerator
+#include <butil/scoped_lock.h>                       // BAIDU_SCOPED_LOCK
 #include <bthread/execution_queue.h>
+#include <bvar/bvar.h>
 #include <gflags/gflags.h>
 #include "brpc/input_messenger.h"
 #include "brpc/socket.h"                             // Socket::Address
@@ -45,9 +47,33 @@ DEFINE_int32(rdma_cq_num, 0, "CQ num used when CQs are shared by connections. "
 // are bound to this core. Therefore we use an offset to specify the first
 // core to start shared CQ.
 DEFINE_int32(rdma_cq_offset, 4, "The first core index to start CQ");
+DEFINE_bool(rdma_use_srq, false, "Connections sharing a CQ receive data from "
+            "a Shared Receive Queue of the CQ instead of posting their own "
+            "receive buffers, which saves memory with many connections. "
+            "Only valid when -rdma_cq_num > 0.");
+DEFINE_int32(rdma_srq_size, 4096, "The number of receive buffers in each SRQ");
+DEFINE_bool(rdma_use_hybrid_polling, false, "In event mode, keep polling CQs "
+            "while completions keep arriving and wait for events after CQs "
+            "are idle for a while, which is tuned by recent intervals between "
+            "completions.");
+DEFINE_int32(rdma_hybrid_max_spin_us, 50, "Maximum time (us) to keep polling "
+             "an empty CQ in hybrid mode. CQs whose completions arrive less "
+             "frequently wait for events directly");
+
+// SocketIds never use the highest bit unless a Socket is reused for 2^31
+// times, which is uncommon enough to tell the WRs of SRQ from others.
+static const uint64_t SRQ_WR_ID_FLAG = 1ULL << 63;
+static const SocketId INVALID_SOCKET_ID = (SocketId)-1;
+
+static bvar::Adder<int64_t> g_srq_available("rdma_srq_available");
+static bvar::Miner<int64_t> g_srq_min_available;
+static bvar::Window<bvar::Miner<int64_t> > g_srq_watermark(
+        "rdma_srq_watermark", &g_srq_min_available, 10);
+static bvar::Adder<int64_t> g_rnr_retry_exceeded("rdma_rnr_retry_exceeded");
 
 static const int MAX_COMPLETIONS_ONCE = 32;
 static const int MAX_CQ_EVENTS = 128;
+static const int COMPLETION_RATE_WINDOW_S = 10;
 static const size_t CORE_NUM = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
 
 int g_cq_num = 0;
@@ -66,6 +92,11 @@ RdmaCompletionQueue::RdmaCompletionQueue()
     , _sid(0)
     , _ep_sid(0)
     , _stop(false)
+    , _srq(NULL)
+    , _last_completion_us(0)
+    , _avg_interval_us(INT64_MAX)
+    , _completions(NULL)
+    , _completion_second(NULL)
 {
 }
 
@@ -83,6 +114,133 @@ void* RdmaCompletionQueue::GetCQ() const {
     return _cq;
 }
 
+int64_t RdmaCompletionQueue::GetCompletionRate() const {
+    return _completion_second ? _completion_second->get_value(COMPLETION_RATE_WINDOW_S) : 0;
+}
+
+void RdmaCompletionQueue::OnCompletions(int cnt, int64_t now_us) {
+    if (_completions) {
+        *_completions << cnt;
+    }
+    if (_last_completion_us > 0) {
+        const int64_t interval = now_us - _last_completion_us;
+        if (_avg_interval_us == INT64_MAX) {
+            _avg_interval_us = interval;
+        } else {
+            _avg_interval_us = (_avg_interval_us * 7 + interval) / 8;
+        }
+    }
+    _last_completion_us = now_us;
+}
+
+bool RdmaCompletionQueue::ShouldSpin(int64_t now_us) const {
+    if (_avg_interval_us > FLAGS_rdma_hybrid_max_spin_us) {
+        // Completions are sparse, polling just burns the cpu
+        return false;
+    }
+    // Wait for twice the usual interval before going to sleep
+    return now_us - _last_completion_us < 2 * _avg_interval_us + 1;
+}
+
+void* RdmaCompletionQueue::GetSRQ() const {
+    return _srq;
+}
+
+int RdmaCompletionQueue::AddQP(uint32_t qp_num, SocketId sid) {
+    BAIDU_SCOPED_LOCK(_qp_map_mutex);
+    if (_qp_map.insert(qp_num, sid) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+void RdmaCompletionQueue::RemoveQP(uint32_t qp_num) {
+    BAIDU_SCOPED_LOCK(_qp_map_mutex);
+    _qp_map.erase(qp_num);
+}
+
+SocketId RdmaCompletionQueue::FindQP(uint32_t qp_num) {
+    BAIDU_SCOPED_LOCK(_qp_map_mutex);
+    SocketId* sid = _qp_map.seek(qp_num);
+    return sid ? *sid : INVALID_SOCKET_ID;
+}
+
+int RdmaCompletionQueue::InitSRQ() {
+#ifndef BRPC_RDMA
+    CHECK(false) << "This should not happen";
+    return -1;
+#else
+    if (FLAGS_rdma_srq_size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (_qp_map.init(1024) != 0) {
+        return -1;
+    }
+    ibv_srq_init_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.attr.max_wr = FLAGS_rdma_srq_size;
+    attr.attr.max_sge = 1;
+    ibv_srq* srq = ibv_create_srq(
+            (ibv_pd*)GetRdmaProtectionDomain(), &attr);
+    if (!srq) {
+        return -1;
+    }
+    _srq = srq;
+
+    _srq_bufs.resize(FLAGS_rdma_srq_size);
+    _srq_data.resize(FLAGS_rdma_srq_size);
+    _srq_free.reserve(FLAGS_rdma_srq_size);
+    for (int i = FLAGS_rdma_srq_size - 1; i >= 0; --i) {
+        _srq_free.push_back(i);
+    }
+    return ReplenishSRQ();
+#endif
+}
+
+int RdmaCompletionQueue::ReplenishSRQ() {
+#ifndef BRPC_RDMA
+    CHECK(false) << "This should not happen";
+    return -1;
+#else
+    while (!_srq_free.empty()) {
+        const uint32_t index = _srq_free.back();
+        butil::IOBuf& buf = _srq_bufs[index];
+        buf.clear();
+        butil::IOBufAsZeroCopyOutputStream os(
+                &buf, butil::IOBuf::DEFAULT_BLOCK_SIZE);
+        int size = 0;
+        if (!os.Next(&_srq_data[index], &size) ||
+                (uint64_t)size < butil::IOBuf::DEFAULT_PAYLOAD) {
+            // Memory is not enough for preparing a block
+            buf.clear();
+            errno = ENOMEM;
+            return -1;
+        }
+
+        ibv_sge sge;
+        sge.addr = (uint64_t)_srq_data[index];
+        sge.length = butil::IOBuf::DEFAULT_PAYLOAD;
+        sge.lkey = GetLKey((char*)_srq_data[index] +
+                butil::IOBuf::DEFAULT_PAYLOAD - butil::IOBuf::DEFAULT_BLOCK_SIZE);
+        ibv_recv_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = SRQ_WR_ID_FLAG | index;
+        wr.num_sge = 1;
+        wr.sg_list = &sge;
+        ibv_recv_wr* bad = NULL;
+        if (ibv_post_srq_recv((ibv_srq*)_srq, &wr, &bad) < 0) {
+            PLOG(WARNING) << "Fail to ibv_post_srq_recv";
+            buf.clear();
+            return -1;
+        }
+        _srq_free.pop_back();
+        g_srq_available << 1;
+    }
+    return 0;
+#endif
+}
+
 RdmaCompletionQueue* RdmaCompletionQueue::GetOne(Socket* s, int cq_size) {
 #ifndef BRPC_RDMA
     CHECK(false) << "This should not happen";
@@ -141,6 +299,23 @@ int RdmaCompletionQueue::Init(int cpu) {
     }
     _cq = cq;
 
+    if (IsShared()) {
+        // Shared CQs are bound to different cores
+        char name[48];
+        snprintf(name, sizeof(name), "rdma_cq_cpu%d_completion_second",
+                 _cpu_index);
+        _completions = new bvar::Adder<int64_t>;
+        _completion_second = new bvar::PerSecond<bvar::Adder<int64_t> >(
+                name, _completions, COMPLETION_RATE_WINDOW_S);
+    }
+
+    if (IsShared() && FLAGS_rdma_use_srq) {
+        if (InitSRQ() < 0) {
+            PLOG(WARNING) << "Fail to initialize SRQ";
+            return -1;
+        }
+    }
+
     SocketOptions options;
     options.user = this;
     options.keytable_pool = _keytable_pool;
@@ -191,6 +366,18 @@ void RdmaCompletionQueue::CleanUp() {
         _cq_channel = NULL;
     }
     _cq_events = 0;
+    if (_srq) {
+        ibv_destroy_srq((ibv_srq*)_srq);
+        _srq = NULL;
+        g_srq_available << -(int64_t)(_srq_bufs.size() - _srq_free.size());
+    }
+    _srq_bufs.clear();
+    _srq_data.clear();
+    _srq_free.clear();
+    delete _completion_second;
+    _completion_second = NULL;
+    delete _completions;
+    _completions = NULL;
     if (cq) {
         ibv_destroy_cq(cq);
         _cq = NULL;
@@ -307,6 +494,10 @@ void RdmaCompletionQueue::PollCQ(Socket* m) {
         }
         if (cnt == 0) {
             if (!g_use_polling) {
+                if (!notified && FLAGS_rdma_use_hybrid_polling &&
+                    rcq->ShouldSpin(butil::cpuwide_time_us())) {
+                    continue;
+                }
                 if (!notified) {
                     // Since RDMA only provides one shot event, we have to call the
                     // notify function every time. Because there is a possibility
@@ -343,11 +534,35 @@ void RdmaCompletionQueue::PollCQ(Socket* m) {
         notified = false;
 
         const int64_t received_us = butil::cpuwide_time_us();
+        rcq->OnCompletions(cnt, received_us);
         const int64_t base_realtime = butil::gettimeofday_us() - received_us;
         for (int i = 0; i < cnt; ++i) {
-            if (s == NULL || s->id() != wc[i].wr_id) {
+            SocketId sid = wc[i].wr_id;
+            butil::IOBuf srq_data;
+            if (wc[i].wr_id & SRQ_WR_ID_FLAG) {
+                // The receive buffer is consumed whatever the status is
+                const uint32_t index = (uint32_t)wc[i].wr_id;
+                if (wc[i].status == IBV_WC_SUCCESS) {
+                    rcq->_srq_bufs[index].cutn(&srq_data, wc[i].byte_len);
+                }
+                rcq->_srq_bufs[index].clear();
+                rcq->_srq_free.push_back(index);
+                g_srq_available << -1;
+                g_srq_min_available << (int64_t)(rcq->_srq_bufs.size()
+                                                 - rcq->_srq_free.size());
+                if (rcq->ReplenishSRQ() < 0) {
+                    // Retry at the next completion, senders wait at RNR
+                    LOG_EVERY_SECOND(WARNING) << "Fail to replenish SRQ, "
+                        << rcq->_srq_free.size() << " buffers are missing";
+                }
+                sid = rcq->FindQP(wc[i].qp_num);
+            }
+            if (wc[i].status == IBV_WC_RNR_RETRY_EXC_ERR) {
+                g_rnr_retry_exceeded << 1;
+            }
+            if (s == NULL || s->id() != sid) {
                 s.reset(NULL);
-                if (Socket::Address(wc[i].wr_id, &s) < 0) {
+                if (Socket::Address(sid, &s) < 0) {
                     continue;
                 }
             }
@@ -381,11 +596,16 @@ void RdmaCompletionQueue::PollCQ(Socket* m) {
                 rc->type = RDMA_EVENT_WRITE;
                 break;
             }
+            case IBV_WC_RDMA_READ: {
+                rc->type = RDMA_EVENT_READ;
+                break;
+            }
             default:
                 rc->type = RDMA_EVENT_ERROR;
             }
             rc->len = wc[i].byte_len;
             rc->imm = ntohl(wc[i].imm_data);
+            rc->data.swap(srq_data);
 
             if (g_cq_num == 0) {
                 ssize_t nr = s->_rdma_ep->HandleCompletion(*rc);
@@ -474,15 +694,16 @@ LeastUtilizedRdmaCQAssignPolicy::LeastUtilizedRdmaCQAssignPolicy(uint32_t range)
 }
 
 uint32_t LeastUtilizedRdmaCQAssignPolicy::Assign() {
+    // Shared CQs are compared by recent completion rates at first, then
+    // by the number of connections.
+    int64_t min_rate = INT64_MAX;
     uint32_t min = 0xffffffff;
     size_t index = 0;
     BAIDU_SCOPED_LOCK(_lock);
     for (size_t i = 0; i < _list.size(); ++i) {
-        if (_list[i] == 0) {
-            index = i;
-            break;
-        }
-        if (min > _list[i]) {
+        const int64_t rate = (g_cq_num > 0 ? g_cq[i].GetCompletionRate() : 0);
+        if (rate < min_rate || (rate == min_rate && _list[i] < min)) {
+            min_rate = rate;
             min = _list[i];
             index = i;
         }
@@ -506,6 +727,9 @@ int GlobalCQInit() {
     }
     if (g_cq_num == 0) {
         g_use_polling = false;
+        if (FLAGS_rdma_use_srq) {
+            LOG(WARNING) << "-rdma_use_srq is ignored since CQs are not shared";
+        }
     } else {
         g_use_polling = FLAGS_rdma_use_polling;
         g_bind_cpu = FLAGS_rdma_bind_cpu;
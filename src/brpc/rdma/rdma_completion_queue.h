@@ -18,8 +18,11 @@
 #define BRPC_RDMA_COMPLETION_QUEUE_H
 
 #include <vector>                               // std::vector
+#include <butil/containers/flat_map.h>          // butil::FlatMap
+#include <butil/iobuf.h>                        // butil::IOBuf
 #include <butil/macros.h>                       // DISALLOW_COPY_AND_ASSIGN
 #include <bthread/bthread.h>                    // butil::Mutex
+#include <bvar/bvar.h>                          // bvar::PerSecond
 #include "brpc/socket.h"
 
 namespace brpc {
@@ -32,6 +35,7 @@ enum RdmaEvent {
     RDMA_EVENT_WRITE,           // opcode==IBV_WC_WRITE
     RDMA_EVENT_RECV,            // opcode==IBV_WC_RECV
     RDMA_EVENT_RECV_WITH_IMM,   // opcode==IBV_WC_RECV_RDMA_WITH_IMM
+    RDMA_EVENT_READ,            // opcode==IBV_WC_RDMA_READ
     RDMA_EVENT_ERROR            // status!=IBV_WC_SUCCESS
 };
 
@@ -41,6 +45,7 @@ struct RdmaCompletion {
     Socket* socket;
     uint32_t len;           // byte_len in ibv_wc
     uint32_t imm;           // imm_data in ibv_wc
+    butil::IOBuf data;      // data received from the SRQ
 };
 
 // A wrapper for CQ processing.
@@ -69,6 +74,22 @@ public:
     // Get CQ
     void* GetCQ() const;
 
+    // Completions per second in recent seconds, only counted for shared CQ
+    int64_t GetCompletionRate() const;
+
+    // Get the Shared Receive Queue of this CQ, NULL if connections post
+    // their own receive buffers.
+    // See -rdma_use_srq for details.
+    void* GetSRQ() const;
+
+    // Map the QP number of a connection using the SRQ to its SocketId, which
+    // is how completions of the SRQ find their connections.
+    // Return 0 if success, -1 if failed.
+    int AddQP(uint32_t qp_num, SocketId sid);
+
+    // Remove the QP number added by AddQP
+    void RemoveQP(uint32_t qp_num);
+
 private:
     DISALLOW_COPY_AND_ASSIGN(RdmaCompletionQueue);
 
@@ -81,6 +102,26 @@ private:
     // Clean the resources, not including the PollCQ thread
     void CleanUp();
 
+    // Create the SRQ and post all its receive buffers.
+    // Return 0 if success, -1 if failed.
+    int InitSRQ();
+
+    // Post receive buffers to the SRQ for all consumed WRs.
+    // Called in PollCQ only.
+    // Return 0 if success, -1 if failed.
+    int ReplenishSRQ();
+
+    // Find the SocketId of the QP number, INVALID_SOCKET_ID if absent.
+    SocketId FindQP(uint32_t qp_num);
+
+    // Record a non-empty poll to tune the hybrid polling.
+    void OnCompletions(int cnt, int64_t now_us);
+
+    // Whether to keep polling the empty CQ instead of waiting for events,
+    // which is true if completions arrived in recent few intervals.
+    // See -rdma_use_hybrid_polling for details.
+    bool ShouldSpin(int64_t now_us) const;
+
     // Get and ACK the CQ events.
     // Return 0 if success, -1 if failed.
     int GetAndAckEvents();
@@ -114,6 +155,29 @@ private:
 
     // If the poll CQ thread should be stopped
     bool _stop;
+
+    // SRQ, only used for shared CQ when -rdma_use_srq is on
+    void* _srq;
+
+    // Receive buffers posted to the SRQ, indexed by the wr_id of WRs
+    std::vector<butil::IOBuf> _srq_bufs;
+    std::vector<void*> _srq_data;
+
+    // Indexes of _srq_bufs consumed and not re-posted
+    std::vector<uint32_t> _srq_free;
+
+    // QP number -> SocketId of connections using the SRQ
+    butil::Mutex _qp_map_mutex;
+    butil::FlatMap<uint32_t, SocketId> _qp_map;
+
+    // Time of the last non-empty poll
+    int64_t _last_completion_us;
+    // Moving average of intervals between non-empty polls
+    int64_t _avg_interval_us;
+
+    // Number of completions and its rate, only used for shared CQ
+    bvar::Adder<int64_t>* _completions;
+    bvar::PerSecond<bvar::Adder<int64_t> >* _completion_second;
 };
 
 // The policy to assign a CQ to a connection (in shared CQ case)
@@ -42,20 +42,49 @@ namespace rdma {
 DEFINE_int32(rdma_sbuf_size, 1048576, "Send buffer size for RDMA");
 DEFINE_int32(rdma_rbuf_size, 1048576, "Recv buffer size for RDMA");
 DEFINE_bool(rdma_recv_zerocopy, true, "Enable zerocopy for receive side");
+DEFINE_int32(rdma_rendezvous_threshold, 0, "Registered blocks of at least so "
+             "many bytes at the beginning of data to send are read by the "
+             "receiver with RDMA READ instead of being sent through the recv "
+             "buffers, 0 means disabled. Must be set on both sides before "
+             "RDMA is initialized, which makes block_pool readable by peers");
 
 // DO NOT change this value unless you know the safe value!!!
 // This is the number of reserved WRs in SQ/RQ for pure ACK.
 static const size_t RESERVED_WR_NUM = 3;
 
+// The number of WRs in SQ reserved for RDMA READ, and the max number of
+// blocks advertised in one WR. A block is read with at most 2 WRs since the
+// local block may end before the remote one.
+static const size_t RDMA_MAX_READ_WR = 128;
+static const size_t RDMA_MAX_READ_BLOCKS = 32;
+
+// The highest bit of imm data in the WR advertising blocks, the rest bits
+// are ACKs as usual.
+static const uint32_t RDMA_IMM_RENDEZVOUS = 0x80000000;
+
+// Bits of `flags' in handshake data
+static const uint32_t RDMA_CONNECT_FLAG_RENDEZVOUS = 1;
+
+// Size of a serialized RdmaRemoteBlock: addr, rkey and len
+static const size_t RDMA_REMOTE_BLOCK_SIZE = 16;
+// Maximum size of the descriptor of advertised blocks
+static const size_t RDMA_MAX_DESC_SIZE =
+        sizeof(uint32_t) + RDMA_MAX_READ_BLOCKS * RDMA_REMOTE_BLOCK_SIZE;
+
+// NOTE: `flags' is appended at the end of handshake data. Private data of
+// rdmacm is padded with zeros, thus it's 0 when got from old versions.
 struct RdmaConnectRequestData {
     void Serialize(char* data) const {
         uint64_t* tmp = (uint64_t*)data;
         *tmp = butil::HostToNet64(sid);
         memcpy(data + sizeof(sid), rand_str, sizeof(rand_str));
-        uint64_t* rq = (uint64_t*)(&data[sizeof(sid) + sizeof(rand_str)]);
+        uint32_t* rq = (uint32_t*)(&data[sizeof(sid) + sizeof(rand_str)]);
         *rq = butil::HostToNet32(rq_size);
-        uint64_t* sq = (uint64_t*)(&data[Length() - sizeof(sq_size)]);
+        uint32_t* sq = (uint32_t*)(&data[sizeof(sid) + sizeof(rand_str) +
+                                         sizeof(rq_size)]);
         *sq = butil::HostToNet32(sq_size);
+        uint32_t* f = (uint32_t*)(&data[Length() - sizeof(flags)]);
+        *f = butil::HostToNet32(flags);
     }
 
     void Deserialize(char* data) {
@@ -65,39 +94,52 @@ struct RdmaConnectRequestData {
                   ((char*)data + sizeof(sid) + sizeof(rand_str)));
         sq_size = butil::NetToHost32(*(uint32_t*)((char*)data + sizeof(sid) +
                   sizeof(rand_str) + sizeof(rq_size)));
+        flags = butil::NetToHost32(*(uint32_t*)
+                ((char*)data + Length() - sizeof(flags)));
     }
 
     size_t Length() const {
-        return sizeof(sid) + sizeof(rand_str) + sizeof(rq_size) + sizeof(sq_size);
+        return sizeof(sid) + sizeof(rand_str) + sizeof(rq_size) +
+            sizeof(sq_size) + sizeof(flags);
     }
 
     uint64_t sid;
     char rand_str[RANDOM_LENGTH];
     uint32_t rq_size;
     uint32_t sq_size;
+    uint32_t flags;
 };
 
 struct RdmaConnectResponseData {
     void Serialize(char* data) const {
         uint32_t* rq = (uint32_t*)data;
         *rq = butil::HostToNet32(rq_size);
-        uint64_t* sq = (uint64_t*)(&data[sizeof(rq_size)]);
+        uint32_t* sq = (uint32_t*)(&data[sizeof(rq_size)]);
         *sq = butil::HostToNet32(sq_size);
+        uint32_t* f = (uint32_t*)(&data[sizeof(rq_size) + sizeof(sq_size)]);
+        *f = butil::HostToNet32(flags);
     }
 
     void Deserialize(char* data) {
         rq_size = butil::NetToHost32(*(uint32_t*)data);
         sq_size = butil::NetToHost32(*(uint32_t*)((char*)data + sizeof(rq_size)));
+        flags = butil::NetToHost32(*(uint32_t*)
+                ((char*)data + sizeof(rq_size) + sizeof(sq_size)));
     }
 
     size_t Length() const {
-        return sizeof(rq_size) + sizeof(sq_size);
+        return sizeof(rq_size) + sizeof(sq_size) + sizeof(flags);
     }
 
     uint32_t rq_size;
     uint32_t sq_size;
+    uint32_t flags;
 };
 
+static uint32_t LocalConnectFlags() {
+    return FLAGS_rdma_rendezvous_threshold > 0 ? RDMA_CONNECT_FLAG_RENDEZVOUS : 0;
+}
+
 RdmaEndpoint::RdmaEndpoint(Socket* s)
     : _socket(s)
     , _rcm(NULL)
@@ -108,6 +150,7 @@ RdmaEndpoint::RdmaEndpoint(Socket* s)
     , _rq_size(FLAGS_rdma_rbuf_size / butil::IOBuf::DEFAULT_PAYLOAD + 1)
     , _sbuf()
     , _rbuf()
+    , _use_srq(false)
     , _handshake_buf()
     , _accumulated_ack(0)
     , _unsolicited(0)
@@ -120,6 +163,8 @@ RdmaEndpoint::RdmaEndpoint(Socket* s)
     , _window_size(_sq_size)
     , _new_rq_wrs(0)
     , _remote_sid(0)
+    , _rendezvous(false)
+    , _outstanding_read_wrs(0)
     , _completion_queue()
 {
     _pipefd[0] = -1;
@@ -163,6 +208,9 @@ void RdmaEndpoint::Reset() {
     _window_size.store(_sq_size, butil::memory_order_relaxed);
     _new_rq_wrs = 0;
     _remote_sid = 0;
+    _rendezvous = false;
+    _pending_reads.clear();
+    _outstanding_read_wrs = 0;
     _sq_sent = 0;
     _rq_received = 0;
 }
@@ -328,6 +376,7 @@ int RdmaEndpoint::HandshakeAtServer(RdmaCMEvent event) {
         RdmaConnectResponseData res;
         res.rq_size = _rq_size;
         res.sq_size = _sq_size;
+        res.flags = LocalConnectFlags();
         char data[res.Length()];
         res.Serialize(data);
 
@@ -487,6 +536,7 @@ int RdmaEndpoint::HandshakeAtClient(RdmaCMEvent event) {
         memcpy(req.rand_str, _rand_str, RANDOM_LENGTH);
         req.rq_size = _rq_size;
         req.sq_size = _sq_size;
+        req.flags = LocalConnectFlags();
         char data[req.Length()];
         req.Serialize(data);
 
@@ -518,6 +568,8 @@ int RdmaEndpoint::HandshakeAtClient(RdmaCMEvent event) {
         if (res.sq_size < _rq_size) {
             _remote_window_capacity = res.sq_size;
         }
+        _rendezvous = (LocalConnectFlags() & res.flags
+                       & RDMA_CONNECT_FLAG_RENDEZVOUS);
 
         _status = ESTABLISHED;
         _socket->_rdma_state = Socket::RDMA_ON;
@@ -545,6 +597,10 @@ bool RdmaEndpoint::IsWritable() const {
     return _window_size.load(butil::memory_order_relaxed) > 0;
 }
 
+size_t RdmaEndpoint::GetWindowBytes() const {
+    return (size_t)_local_window_capacity * butil::IOBuf::DEFAULT_PAYLOAD;
+}
+
 // RdmaIOBuf inherits from IOBuf to provide a new function.
 // The reason is that we need to use some protected member function of IOBuf.
 class RdmaIOBuf : public butil::IOBuf {
@@ -568,13 +624,15 @@ private:
                 break;
             }
             butil::IOBuf::BlockRef const& r = _ref_at(i);
-            uint32_t this_lkey = GetLKey(backing_block(i).data());
+            char* start = (char*)backing_block(i).data();
+            // Look up with the beginning of the payload, which is the address
+            // registered for user data (see IOBuf::append_user_data)
+            uint32_t this_lkey = GetLKey(start - r.offset);
             if (*lkey == 0) {
                 *lkey = this_lkey;
             } else if (this_lkey != *lkey) {
                 break;
             }
-            char* start = (char*)backing_block(i).data();
             if (*lkey == 0) {
                 // This block is not in the registered memory. It may be
                 // allocated before we call GlobalRdmaInitializeOrDie. We try
@@ -614,6 +672,31 @@ private:
         return len;
 #endif
     }
+
+    // Fill `blocks' with at most max_blocks leading blocks which are
+    // readable by the remote side.
+    // Return: the bytes included in the blocks
+    size_t get_remote_readable_blocks(RdmaRemoteBlock* blocks,
+            size_t max_blocks, size_t* nblock) {
+        size_t len = 0;
+        size_t n = 0;
+        const size_t nref = _ref_num();
+        for (size_t i = 0; i < nref && n < max_blocks; ++i) {
+            butil::IOBuf::BlockRef const& r = _ref_at(i);
+            const char* start = (const char*)backing_block(i).data();
+            const uint32_t rkey = GetRKey(start);
+            if (rkey == 0) {
+                break;
+            }
+            blocks[n].addr = (uint64_t)start;
+            blocks[n].rkey = rkey;
+            blocks[n].len = r.length;
+            len += r.length;
+            ++n;
+        }
+        *nblock = n;
+        return len;
+    }
 };
 
 // Note this function is coupled with the implementation of IOBuf
@@ -716,6 +799,85 @@ ssize_t RdmaEndpoint::DoCutFromIOBufList(
 #endif
 }
 
+ssize_t RdmaEndpoint::DoCutIntoRendezvous(
+        butil::IOBuf** from, size_t ndata, butil::IOBuf* to, uint32_t imm) {
+#ifndef BRPC_RDMA
+    CHECK(false) << "This should not happen";
+    return -1;
+#else
+    size_t current = 0;
+    while (current < ndata && from[current]->empty()) {
+        ++current;
+    }
+    if (current == ndata ||
+        from[current]->size() < (size_t)FLAGS_rdma_rendezvous_threshold) {
+        return 0;
+    }
+    RdmaIOBuf* data = (RdmaIOBuf*)from[current];
+    RdmaRemoteBlock blocks[RDMA_MAX_READ_BLOCKS];
+    size_t nblock = 0;
+    const size_t total_len = data->get_remote_readable_blocks(
+            blocks, RDMA_MAX_READ_BLOCKS, &nblock);
+    if (total_len < (size_t)FLAGS_rdma_rendezvous_threshold) {
+        return 0;
+    }
+
+    // The descriptor: number of blocks followed by the blocks.
+    char buf[RDMA_MAX_DESC_SIZE];
+    char* p = buf;
+    *(uint32_t*)p = butil::HostToNet32(nblock);
+    p += sizeof(uint32_t);
+    for (size_t i = 0; i < nblock; ++i) {
+        *(uint64_t*)p = butil::HostToNet64(blocks[i].addr);
+        *(uint32_t*)(p + 8) = butil::HostToNet32(blocks[i].rkey);
+        *(uint32_t*)(p + 12) = butil::HostToNet32(blocks[i].len);
+        p += RDMA_REMOTE_BLOCK_SIZE;
+    }
+    butil::IOBuf desc;
+    desc.append(buf, p - buf);
+    const size_t nsge = desc.backing_block_num();
+    ibv_sge sglist[nsge];
+    for (size_t i = 0; i < nsge; ++i) {
+        butil::StringPiece b = desc.backing_block(i);
+        sglist[i].addr = (uint64_t)b.data();
+        sglist[i].length = b.size();
+        sglist[i].lkey = GetLKey(b.data());
+        if (sglist[i].lkey == 0) {
+            // Not in block_pool, send the data as usual.
+            return 0;
+        }
+    }
+
+    ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = _socket->id();
+    wr.sg_list = sglist;
+    wr.num_sge = nsge;
+    wr.opcode = IBV_WR_SEND_WITH_IMM;
+    wr.imm_data = butil::HostToNet32(imm | RDMA_IMM_RENDEZVOUS);
+    // The remote side must start reading as soon as possible.
+    wr.send_flags |= IBV_SEND_SOLICITED;
+    _unsolicited = 0;
+    _accumulated_ack = 0;
+    ++_sq_unsignaled;
+    if (_sq_unsignaled >= _local_window_capacity / 4) {
+        wr.send_flags |= IBV_SEND_SIGNALED;
+        _sq_unsignaled = 0;
+    }
+
+    ibv_send_wr* bad = NULL;
+    if (ibv_post_send((ibv_qp*)_qp, &wr, &bad) < 0) {
+        PLOG(WARNING) << "Fail to ibv_post_send";
+        return -1;
+    }
+    // Keep the blocks until the WR is acked, which means the remote side
+    // completed reading.
+    data->cutn(to, total_len);
+    to->append(desc);
+    return total_len;
+#endif
+}
+
 ssize_t RdmaEndpoint::CutFromIOBufList(
         butil::IOBuf** data_list, size_t ndata) {
     if (_window_size.load(butil::memory_order_relaxed) == 0) {
@@ -726,8 +888,14 @@ ssize_t RdmaEndpoint::CutFromIOBufList(
 
     CHECK(_sbuf[_sq_current].size() == 0);
 
-    ssize_t nw = DoCutFromIOBufList(data_list, ndata, &_sbuf[_sq_current],
-            _new_rq_wrs.exchange(0, butil::memory_order_relaxed));
+    const uint32_t imm = _new_rq_wrs.exchange(0, butil::memory_order_relaxed);
+    ssize_t nw = 0;
+    if (_rendezvous) {
+        nw = DoCutIntoRendezvous(data_list, ndata, &_sbuf[_sq_current], imm);
+    }
+    if (nw == 0) {
+        nw = DoCutFromIOBufList(data_list, ndata, &_sbuf[_sq_current], imm);
+    }
     ++_sq_current;
     if (_sq_current == _sq_size) {
         _sq_current = 0;
@@ -779,16 +947,41 @@ ssize_t RdmaEndpoint::HandleCompletion(RdmaCompletion& rc) {
         // Do nothing
         break;
     }
+    case RDMA_EVENT_READ: {  // read completion of advertised blocks
+        return HandleReadCompletion();
+    }
     case RDMA_EVENT_RECV: {  // recv completion of data
         CHECK(rc.len > 0);
-        // Please note that only the first rc.len bytes is valid
-        if (FLAGS_rdma_recv_zerocopy) {
-            butil::IOBuf tmp;
-            _rbuf[_rq_received].cutn(&tmp, rc.len);
-            _socket->_read_buf.append(tmp);
+        // Data from the SRQ is already cut into rc.data
+        butil::IOBuf* rbuf = _use_srq ? &rc.data : &_rbuf[_rq_received];
+        if (rc.imm & RDMA_IMM_RENDEZVOUS) {
+            rc.imm &= ~RDMA_IMM_RENDEZVOUS;
+            const void* desc = _use_srq ? NULL : _rbuf_data[_rq_received];
+            char buf[RDMA_MAX_DESC_SIZE];
+            if (_use_srq) {
+                if (rc.len > sizeof(buf)) {
+                    errno = EPROTO;
+                    return -1;
+                }
+                rbuf->cutn(buf, rc.len);
+                desc = buf;
+            }
+            if (HandleRendezvous(desc, rc.len) < 0) {
+                return -1;
+            }
         } else {
-            // Copy data when the receive data is really small
-            _socket->_read_buf.append(_rbuf_data[_rq_received], rc.len);
+            // Data received after pending reads must wait for them
+            butil::IOBuf* dest = _pending_reads.empty() ?
+                &_socket->_read_buf : &_pending_reads.back().after;
+            // Please note that only the first rc.len bytes is valid
+            if (FLAGS_rdma_recv_zerocopy || _use_srq) {
+                butil::IOBuf tmp;
+                rbuf->cutn(&tmp, rc.len);
+                dest->append(tmp);
+            } else {
+                // Copy data when the receive data is really small
+                dest->append(_rbuf_data[_rq_received], rc.len);
+            }
         }
         // Do not break here
     }
@@ -809,10 +1002,15 @@ ssize_t RdmaEndpoint::HandleCompletion(RdmaCompletion& rc) {
                 _socket->WakeAsEpollOut();
             }
         }
-        // We must re-post recv WR
-        if (PostRecv(1) < 0) {
+        // We must re-post recv WR, the SRQ is replenished by the CQ
+        if (!_use_srq && PostRecv(1) < 0) {
             return -1;
         }
+        if (rc.len > 0 && !_pending_reads.empty()) {
+            // ACK after reading so that the remote side keeps the blocks
+            ++_pending_reads.back().nack;
+            return 0;
+        }
         if (rc.len > 0 && _new_rq_wrs.fetch_add(1, butil::memory_order_relaxed)
                                       > _remote_window_capacity / 2) {
             // Send a pure ACK
@@ -831,6 +1029,134 @@ ssize_t RdmaEndpoint::HandleCompletion(RdmaCompletion& rc) {
     return 0;
 }
 
+int RdmaEndpoint::HandleRendezvous(const void* desc, size_t len) {
+    const char* p = (const char*)desc;
+    if (len < sizeof(uint32_t)) {
+        errno = EPROTO;
+        return -1;
+    }
+    const uint32_t nblock = butil::NetToHost32(*(const uint32_t*)p);
+    p += sizeof(uint32_t);
+    if (nblock == 0 || nblock > RDMA_MAX_READ_BLOCKS ||
+        len != sizeof(uint32_t) + nblock * RDMA_REMOTE_BLOCK_SIZE) {
+        LOG(WARNING) << "Invalid rendezvous descriptor of " << len << " bytes";
+        errno = EPROTO;
+        return -1;
+    }
+    _pending_reads.push_back(PendingRead());
+    PendingRead& pr = _pending_reads.back();
+    pr.blocks.resize(nblock);
+    for (uint32_t i = 0; i < nblock; ++i) {
+        pr.blocks[i].addr = butil::NetToHost64(*(const uint64_t*)p);
+        pr.blocks[i].rkey = butil::NetToHost32(*(const uint32_t*)(p + 8));
+        pr.blocks[i].len = butil::NetToHost32(*(const uint32_t*)(p + 12));
+        p += RDMA_REMOTE_BLOCK_SIZE;
+    }
+    // The recv WR of the descriptor is counted in HandleCompletion
+    pr.nack = 0;
+    pr.nwr = 0;
+    pr.posted = false;
+    return PostPendingReads();
+}
+
+int RdmaEndpoint::PostPendingReads() {
+#ifndef BRPC_RDMA
+    CHECK(false) << "This should not happen";
+    return -1;
+#else
+    for (std::deque<PendingRead>::iterator it = _pending_reads.begin();
+            it != _pending_reads.end(); ++it) {
+        PendingRead& pr = *it;
+        if (pr.posted) {
+            continue;
+        }
+        if (_outstanding_read_wrs > 0 &&
+            _outstanding_read_wrs + 2 * pr.blocks.size() > RDMA_MAX_READ_WR) {
+            // Wait for previous reads
+            return 0;
+        }
+        const size_t max_wr = 2 * pr.blocks.size();
+        ibv_send_wr wrs[max_wr];
+        ibv_sge sges[max_wr];
+        size_t nwr = 0;
+        butil::IOBufAsZeroCopyOutputStream os(
+                &pr.data, butil::IOBuf::MAX_BLOCK_SIZE);
+        for (size_t i = 0; i < pr.blocks.size(); ++i) {
+            const RdmaRemoteBlock& b = pr.blocks[i];
+            uint32_t offset = 0;
+            while (offset < b.len) {
+                void* buf = NULL;
+                int size = 0;
+                if (nwr == max_wr || !os.Next(&buf, &size)) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                const uint32_t n = std::min((uint32_t)size, b.len - offset);
+                if (n < (uint32_t)size) {
+                    os.BackUp(size - n);
+                }
+                sges[nwr].addr = (uint64_t)buf;
+                sges[nwr].length = n;
+                sges[nwr].lkey = GetLKey(buf);
+                if (sges[nwr].lkey == 0) {
+                    LOG(WARNING) << "Fail to read into memory not in block_pool";
+                    errno = ENOMEM;
+                    return -1;
+                }
+                ibv_send_wr& wr = wrs[nwr];
+                memset(&wr, 0, sizeof(wr));
+                wr.wr_id = _socket->id();
+                wr.opcode = IBV_WR_RDMA_READ;
+                wr.sg_list = &sges[nwr];
+                wr.num_sge = 1;
+                wr.wr.rdma.remote_addr = b.addr + offset;
+                wr.wr.rdma.rkey = b.rkey;
+                if (nwr > 0) {
+                    wrs[nwr - 1].next = &wr;
+                }
+                ++nwr;
+                offset += n;
+            }
+        }
+        // WRs in the SQ complete in order, signal the last one only.
+        wrs[nwr - 1].send_flags |= IBV_SEND_SIGNALED;
+        ibv_send_wr* bad = NULL;
+        if (ibv_post_send((ibv_qp*)_qp, &wrs[0], &bad) < 0) {
+            PLOG(WARNING) << "Fail to ibv_post_send";
+            return -1;
+        }
+        pr.nwr = nwr;
+        pr.posted = true;
+        _outstanding_read_wrs += nwr;
+    }
+    return 0;
+#endif
+}
+
+ssize_t RdmaEndpoint::HandleReadCompletion() {
+    if (_pending_reads.empty() || !_pending_reads.front().posted) {
+        LOG(ERROR) << "Unexpected RDMA READ completion";
+        errno = EPROTO;
+        return -1;
+    }
+    PendingRead& pr = _pending_reads.front();
+    _outstanding_read_wrs -= pr.nwr;
+    const ssize_t nr = pr.data.size() + pr.after.size();
+    _socket->_read_buf.append(pr.data);
+    _socket->_read_buf.append(pr.after);
+    const uint32_t nack = pr.nack;
+    _pending_reads.pop_front();
+    if (nack > 0 && _new_rq_wrs.fetch_add(nack, butil::memory_order_relaxed)
+                             + nack > _remote_window_capacity / 2) {
+        // Send a pure ACK to release the blocks at the remote side
+        SendImm(_new_rq_wrs.exchange(0, butil::memory_order_relaxed));
+    }
+    if (PostPendingReads() < 0) {
+        return -1;
+    }
+    return nr;
+}
+
 int RdmaEndpoint::DoPostRecv(void* block, size_t block_size) {
 #ifndef BRPC_RDMA
     CHECK(false) << "This should not happen";
@@ -896,7 +1222,8 @@ int RdmaEndpoint::AllocateResources() {
 
     // The capacity size of CQ is not easy to estimate.
     // Empirically, we use twice the sum of SQ+RQ size.
-    _rcq = RdmaCompletionQueue::GetOne(_socket, 2 * (_sq_size + _rq_size));
+    _rcq = RdmaCompletionQueue::GetOne(
+            _socket, 2 * (_sq_size + _rq_size + RDMA_MAX_READ_WR));
     if (!_rcq) {
         return -1;
     }
@@ -911,15 +1238,22 @@ int RdmaEndpoint::AllocateResources() {
         }
     }
 
-    _qp = _rcm->CreateQP(_sq_size + RESERVED_WR_NUM,
-                         _rq_size + RESERVED_WR_NUM,
-                         (ibv_cq*)_rcq->GetCQ(), _socket->id());
+    // The window to the remote side is still _rq_size with SRQ, which
+    // oversubscribes the SRQ shared by connections.
+    _use_srq = (_rcq->GetSRQ() != NULL);
+    _qp = _rcm->CreateQP(_sq_size + RESERVED_WR_NUM + RDMA_MAX_READ_WR,
+                         _use_srq ? 0 : _rq_size + RESERVED_WR_NUM,
+                         (ibv_cq*)_rcq->GetCQ(), _rcq->GetSRQ(),
+                         _socket->id());
 
     if (!_qp) {
         return -1;
     }
     // Reserve blocks for _sbuf and _rbuf for flow control
     _sbuf.resize(_sq_size);
+    if (_use_srq) {
+        return _rcq->AddQP(((ibv_qp*)_qp)->qp_num, _socket->id());
+    }
     _rbuf.resize(_rq_size + RESERVED_WR_NUM);
     _rbuf_data.resize(_rq_size + RESERVED_WR_NUM);
 
@@ -938,6 +1272,12 @@ void RdmaEndpoint::DeallocateResources() {
     _rbuf.clear();
     _rbuf_data.clear();
 
+#ifdef BRPC_RDMA
+    if (_use_srq && _qp) {
+        _rcq->RemoveQP(((ibv_qp*)_qp)->qp_num);
+    }
+#endif
+    _use_srq = false;
     delete _rcm;
     _rcm = NULL;
     if (_rcq) {
@@ -1001,6 +1341,8 @@ int RdmaEndpoint::InitializeFromAccept(
     if (ep->_rq_size > req.sq_size) {
         ep->_remote_window_capacity = req.sq_size;
     }
+    ep->_rendezvous = (LocalConnectFlags() & req.flags
+                       & RDMA_CONNECT_FLAG_RENDEZVOUS);
 
     char tmp = 0;  // we don't care about the content
     ssize_t nw = -1;
@@ -1025,11 +1367,13 @@ int RdmaEndpoint::CompletionThread(void* arg,
         CHECK(rc->socket != NULL);
         s.reset(rc->socket);
         if (iter.is_queue_stopped() || s->Failed()) {
+            rc->data.clear();
             butil::return_object<RdmaCompletion>(rc);
             continue;
         }
 
         ssize_t nr = ep->HandleCompletion(*rc);
+        rc->data.clear();
         butil::return_object<RdmaCompletion>(rc);
         if (nr < 0) {
             PLOG(WARNING) << "Fail to handle RDMA completion";
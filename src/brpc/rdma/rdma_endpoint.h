@@ -18,6 +18,7 @@
 #define BRPC_RDMA_ENDPOINT_H
 
 #include <cstring>
+#include <deque>                     // std::deque
 #include <string>
 #include <vector>                    // std::vector
 #include <butil/atomicops.h>         // butil::atomic
@@ -39,6 +40,13 @@ const size_t RANDOM_LENGTH = 4;
 // The length of hello message from client (magic+random)
 const size_t HELLO_LENGTH = MAGIC_LENGTH + RANDOM_LENGTH;
 
+// A registered block of the sender to be read by the receiver
+struct RdmaRemoteBlock {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t len;
+};
+
 class BAIDU_CACHELINE_ALIGNMENT RdmaEndpoint {
 friend class RdmaCompletionQueue;
 public:
@@ -69,6 +77,10 @@ public:
     // Whether the endpoint can send more data
     bool IsWritable() const;
 
+    // Bytes the remote side can receive without acking, namely the window
+    // of WRs times the size of a receive buffer
+    size_t GetWindowBytes() const;
+
 private:
     enum Status {
         UNINITIALIZED,
@@ -114,6 +126,28 @@ private:
     ssize_t DoCutFromIOBufList(
         butil::IOBuf** from, size_t ndata, butil::IOBuf* to, uint32_t imm);
 
+    // Post one WR advertising registered blocks at the beginning of the
+    // IOBufList to the remote side, which reads the blocks with RDMA READ.
+    // The blocks are moved to `to' and kept until the WR is acked.
+    // Return:
+    //     bytes of data advertised if success
+    //     0 if the data is not large enough or not readable by the remote
+    //     -1 if failed, errno set
+    ssize_t DoCutIntoRendezvous(
+        butil::IOBuf** from, size_t ndata, butil::IOBuf* to, uint32_t imm);
+
+    // Parse the blocks advertised by the remote side and read them
+    // Return 0 if success, -1 if failed and errno set
+    int HandleRendezvous(const void* desc, size_t len);
+
+    // Post RDMA READs for pending reads as long as the SQ has room
+    // Return 0 if success, -1 if failed and errno set
+    int PostPendingReads();
+
+    // Deliver the data of the first pending read which is just completed
+    // Return bytes appended if success, -1 if failed and errno set
+    ssize_t HandleReadCompletion();
+
     // Send Imm data to the remote side
     // Arguments:
     //     imm: imm data in the WR
@@ -169,6 +203,9 @@ private:
     // Data address of _rbuf
     std::vector<void*> _rbuf_data;
 
+    // Whether recv WRs come from the SRQ of _rcq instead of _rbuf
+    bool _use_srq;
+
     // Receive buffer during handshake
     butil::IOPortal _handshake_buf;
 
@@ -197,6 +234,25 @@ private:
     // Remote side SocketId
     uint64_t _remote_sid;
 
+    // Whether both sides read large payloads from each other with RDMA READ
+    // instead of SEND/RECV, see -rdma_rendezvous_threshold.
+    bool _rendezvous;
+
+    // Blocks advertised by the remote side in order. Data received after
+    // a pending read is delivered after it, and recv WRs are acked after
+    // it as well so that the remote side keeps the advertised blocks.
+    struct PendingRead {
+        std::vector<RdmaRemoteBlock> blocks;
+        butil::IOBuf data;
+        butil::IOBuf after;
+        uint32_t nack;
+        uint32_t nwr;
+        bool posted;
+    };
+    std::deque<PendingRead> _pending_reads;
+    // The number of RDMA READ WRs in the local Send Queue
+    uint32_t _outstanding_read_wrs;
+
     // Only used when shared CQ is enabled
     bthread::ExecutionQueueId<RdmaCompletion*> _completion_queue;
 
@@ -51,6 +51,7 @@ extern int g_cq_num;
 
 static in_addr g_rdma_ip = { 0 };
 static int g_max_sge = 0;
+static int g_max_rd_atomic = 0;
 
 #ifdef BRPC_RDMA
 DEFINE_string(rdma_cluster, "0.0.0.0/0",
@@ -70,6 +71,19 @@ static SocketId g_async_socket;
 static ibv_pd* g_pd = NULL;
 static std::vector<ibv_mr*>* g_mrs = NULL;
 
+// Regions of block_pool are readable by peers if rendezvous is enabled at
+// initialization. rkeys of the regions are kept separately from g_mrs to be
+// looked up without locks.
+DECLARE_int32(rdma_rendezvous_threshold);
+static int g_mr_access = IBV_ACCESS_LOCAL_WRITE;
+struct RegionKey {
+    uint32_t lkey;
+    uint32_t rkey;
+};
+static const int MAX_REGION_KEYS = 16;
+static RegionKey g_region_keys[MAX_REGION_KEYS];
+static butil::atomic<int> g_nregion_keys(0);
+
 // Store the original IOBuf memalloc and memdealloc functions
 static void* (*g_mem_alloc)(size_t) = NULL;
 static void (*g_mem_dealloc)(void*) = NULL;
@@ -127,12 +141,18 @@ static void GlobalRelease() {
 uint32_t RdmaRegisterMemory(void* buf, size_t size) {
     // Register the memory as callback in block_pool
     // The thread-safety should be guaranteed by the caller
-    ibv_mr* mr = ibv_reg_mr(g_pd, buf, size, IBV_ACCESS_LOCAL_WRITE);
+    ibv_mr* mr = ibv_reg_mr(g_pd, buf, size, g_mr_access);
     if (!mr) {
         PLOG(ERROR) << "Fail to register memory";
         return 0;
     }
     g_mrs->push_back(mr);
+    const int n = g_nregion_keys.load(butil::memory_order_relaxed);
+    if (n < MAX_REGION_KEYS) {
+        g_region_keys[n].lkey = mr->lkey;
+        g_region_keys[n].rkey = mr->rkey;
+        g_nregion_keys.store(n + 1, butil::memory_order_release);
+    }
     return mr->lkey;
 }
 
@@ -392,6 +412,10 @@ static void GlobalRdmaInitializeOrDieImpl() {
         exit(1);
     }
     g_max_sge = attr.max_sge;
+    g_max_rd_atomic = std::min(attr.max_qp_rd_atom, 16);
+    if (FLAGS_rdma_rendezvous_threshold > 0) {
+        g_mr_access |= IBV_ACCESS_REMOTE_READ;
+    }
 
     // Initialize RDMA memory pool (block_pool)
     if (!InitBlockPool(RdmaRegisterMemory)) {
@@ -513,6 +537,10 @@ int GetRdmaMaxSge() {
     return g_max_sge;
 }
 
+int GetRdmaMaxRdAtomic() {
+    return g_max_rd_atomic;
+}
+
 void* GetRdmaContext() {
 #ifdef BRPC_RDMA
     return g_context[g_device_index];
@@ -546,6 +574,29 @@ uint32_t GetLKey(const void* buf) {
 #endif
 }
 
+uint32_t GetRKey(const void* buf) {
+#ifndef BRPC_RDMA
+    CHECK(false) << "This should not happen";
+    return 0;
+#else
+    if (!(g_mr_access & IBV_ACCESS_REMOTE_READ)) {
+        return 0;
+    }
+    // Only blocks of block_pool are readable by peers.
+    const uint32_t lkey = GetRegionId(buf);
+    if (lkey == 0) {
+        return 0;
+    }
+    const int n = g_nregion_keys.load(butil::memory_order_acquire);
+    for (int i = 0; i < n; ++i) {
+        if (g_region_keys[i].lkey == lkey) {
+            return g_region_keys[i].rkey;
+        }
+    }
+    return 0;
+#endif
+}
+
 bool SupportedByRdma(std::string protocol) {
     if (protocol.compare("baidu_std") == 0 ||
         protocol.compare("hulu_pbrpc") == 0 ||
@@ -48,9 +48,15 @@ in_addr GetRdmaIP();
 // Return lkey of the given address
 uint32_t GetLKey(const void* buf);
 
+// Return rkey of the given address if it's readable by peers, 0 otherwise
+uint32_t GetRKey(const void* buf);
+
 // Get max_sge supported by the device
 int GetRdmaMaxSge();
 
+// Get max number of outstanding RDMA READs as initiator or responder
+int GetRdmaMaxRdAtomic();
+
 // If the given protocol supported by RDMA
 bool SupportedByRdma(std::string protocol);
 
@@ -373,6 +373,7 @@ RedisResponse::RedisResponse(const RedisResponse& from)
 
 void RedisResponse::SharedCtor() {
     _other_replies = NULL;
+    _iobuf_strings = NULL;
     _cached_size_ = 0;
     _nreply = 0;
 }
@@ -382,8 +383,8 @@ RedisResponse::~RedisResponse() {
 }
 
 void RedisResponse::SharedDtor() {
-    if (this != default_instance_) {
-    }
+    RedisReply::ReleaseIOBufStrings(_iobuf_strings);
+    _iobuf_strings = NULL;
 }
 
 void RedisResponse::SetCachedSize(int size) const {
@@ -410,6 +411,8 @@ RedisResponse* RedisResponse::New() const {
 void RedisResponse::Clear() {
     _first_reply.Clear();
     _other_replies = NULL;
+    RedisReply::ReleaseIOBufStrings(_iobuf_strings);
+    _iobuf_strings = NULL;
     _arena.clear();
     _nreply = 0;
     _cached_size_ = 0;
@@ -500,6 +503,7 @@ void RedisResponse::Swap(RedisResponse* other) {
         _first_reply.Swap(other->_first_reply);
         std::swap(_other_replies, other->_other_replies);
         _arena.swap(other->_arena);
+        std::swap(_iobuf_strings, other->_iobuf_strings);
         std::swap(_nreply, other->_nreply);
         std::swap(_cached_size_, other->_cached_size_);
     }
@@ -518,7 +522,7 @@ void RedisResponse::Swap(RedisResponse* other) {
 bool RedisResponse::ConsumePartialIOBuf(butil::IOBuf& buf, int reply_count) {
     size_t oldsize = buf.size();
     if (reply_size() == 0) {
-        if (!_first_reply.ConsumePartialIOBuf(buf, &_arena)) {
+        if (!_first_reply.ConsumePartialIOBuf(buf, &_arena, &_iobuf_strings)) {
             return false;
         }
         const size_t newsize = buf.size();
@@ -539,7 +543,7 @@ bool RedisResponse::ConsumePartialIOBuf(butil::IOBuf& buf, int reply_count) {
             }
         }
         for (int i = reply_size(); i < reply_count; ++i) {
-            if (!_other_replies[i - 1].ConsumePartialIOBuf(buf, &_arena)) {
+            if (!_other_replies[i - 1].ConsumePartialIOBuf(buf, &_arena, &_iobuf_strings)) {
                 return false;
             }
             const size_t newsize = buf.size();
@@ -569,4 +573,37 @@ std::ostream& operator<<(std::ostream& os, const RedisResponse& response) {
     return os;
 }
  
+RedisService::RedisService() {
+    CHECK_EQ(0, _command_map.init(64));
+}
+
+RedisService::~RedisService() {}
+
+bool RedisService::AddCommandHandler(const std::string& name,
+                                     RedisCommandHandler* handler) {
+    if (name.empty() || handler == NULL) {
+        LOG(ERROR) << "Invalid command handler of `" << name << '\'';
+        return false;
+    }
+    if (_command_map.seek(name) != NULL) {
+        LOG(ERROR) << "redis command=`" << name << "' was added before";
+        return false;
+    }
+    _command_map[name] = handler;
+    return true;
+}
+
+RedisCommandHandler*
+RedisService::FindCommandHandler(const butil::StringPiece& name) const {
+    // Names of commands are short, seek them without creating strings.
+    char buf[64];
+    if (name.size() >= sizeof(buf)) {
+        return NULL;
+    }
+    memcpy(buf, name.data(), name.size());
+    buf[name.size()] = '\0';
+    RedisCommandHandler* const* handler = _command_map.seek(buf);
+    return handler ? *handler : NULL;
+}
+
 } // namespace brpc
@@ -29,11 +29,14 @@
 #include "butil/iobuf.h"
 #include "butil/strings/string_piece.h"
 #include "butil/arena.h"
+#include "butil/containers/case_ignored_flat_map.h"
 #include "redis_reply.h"
 
 
 namespace brpc {
 
+class RedisClusterChannel;
+
 // Request to redis.
 // Notice that you can pipeline multiple commands in one request and sent
 // them to ONE redis-server together.
@@ -147,6 +150,8 @@ friend void protobuf_ShutdownFile_baidu_2frpc_2fredis_5fbase_2eproto();
   
     void InitAsDefaultInstance();
     static RedisRequest* default_instance_;
+
+friend class RedisClusterChannel;
 };
 
 // Response from Redis.
@@ -210,6 +215,8 @@ private:
     RedisReply _first_reply;
     RedisReply* _other_replies;
     butil::Arena _arena;
+    // Long bulk strings referencing blocks of read buffers.
+    RedisIOBufString* _iobuf_strings;
     int _nreply;
     mutable int _cached_size_;
 
@@ -222,6 +229,65 @@ friend void protobuf_ShutdownFile_baidu_2frpc_2fredis_5fbase_2eproto();
     static RedisResponse* default_instance_;
 };
 
+// Handler of a redis command at server-side.
+class RedisCommandHandler {
+public:
+    virtual ~RedisCommandHandler() {}
+
+    // Called for each command(in the order of being received) named by
+    // this handler, args[0] is the name and args[1..] are arguments of the
+    // command. Components are null-terminated and valid during the call.
+    // Exactly one reply must be written with `writer'. Replies of pipelined
+    // commands are sent together after running their handlers.
+    // NOTE: Handlers are called in the bthread reading the connection,
+    // don't block. Commands from different connections are handled
+    // concurrently.
+    virtual void Run(const std::vector<butil::StringPiece>& args,
+                     RedisReplyWriter* writer) = 0;
+};
+
+// Set ServerOptions.redis_service to let the brpc server understand
+// redis commands, e.g. to build a redis-compatible cache on top of brpc.
+// Commands without handlers are replied with errors. Example:
+//
+//   class GetCommandHandler : public brpc::RedisCommandHandler {
+//   public:
+//       void Run(const std::vector<butil::StringPiece>& args,
+//                brpc::RedisReplyWriter* writer) {
+//           if (args.size() != 2) {
+//               writer->AppendError("ERR wrong number of arguments for 'get' command");
+//               return;
+//           }
+//           ... look up args[1] ...
+//           writer->AppendString(value);  // or AppendNil() if absent
+//       }
+//   };
+//   brpc::RedisService* rs = new brpc::RedisService;
+//   rs->AddCommandHandler("get", &get_handler);
+//   options.redis_service = rs;  // owned by the server.
+class RedisService {
+public:
+    RedisService();
+    virtual ~RedisService();
+
+    // Handle commands named `name'(case-insensitive) with `handler', which
+    // is not owned by the service and must be valid during the lifetime
+    // of the service. Returns false if the name was added before.
+    // Not thread-safe, call this before the server is started.
+    bool AddCommandHandler(const std::string& name,
+                           RedisCommandHandler* handler);
+
+    // Returns the handler of the command named `name'(case-insensitive),
+    // NULL if absent.
+    RedisCommandHandler* FindCommandHandler(const butil::StringPiece& name) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RedisService);
+
+    typedef butil::CaseIgnoredFlatMap<RedisCommandHandler*> CommandMap;
+    CommandMap _command_map;
+};
+
 std::ostream& operator<<(std::ostream& os, const RedisRequest&);
 std::ostream& operator<<(std::ostream& os, const RedisResponse&);
 
@@ -0,0 +1,604 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <inttypes.h>
+#include <strings.h>                          // strcasecmp
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "bthread/bthread.h"
+#include "butil/time.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
+#include "butil/string_splitter.h"
+#include "brpc/redis_command.h"
+#include "brpc/redis_cluster_channel.h"
+
+namespace brpc {
+
+DECLARE_bool(usercode_in_pthread);
+
+// CRC16-CCITT(XMODEM) used by redis cluster.
+static const uint16_t s_crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static uint16_t RedisCRC16(const char* data, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc = (crc << 8) ^ s_crc16_table[((crc >> 8) ^ (uint8_t)data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+int RedisClusterSlot(const butil::StringPiece& key) {
+    const size_t begin = key.find('{');
+    if (begin != butil::StringPiece::npos) {
+        const size_t end = key.find('}', begin + 1);
+        if (end != butil::StringPiece::npos && end != begin + 1) {
+            return RedisCRC16(key.data() + begin + 1, end - begin - 1)
+                & (REDIS_CLUSTER_SLOTS - 1);
+        }
+    }
+    return RedisCRC16(key.data(), key.size()) & (REDIS_CLUSTER_SLOTS - 1);
+}
+
+// Find the key deciding the slot of a command whose components are
+// null-terminated. Returns false if the command has no keys.
+static bool GetCommandKey(const std::vector<butil::StringPiece>& args,
+                          butil::StringPiece* key) {
+    static const char* const keyless_commands[] = {
+        "auth", "client", "cluster", "command", "config", "dbsize", "echo",
+        "flushall", "flushdb", "info", "ping", "quit", "randomkey",
+        "readonly", "readwrite", "script", "select", "time"
+    };
+    const char* name = args[0].data();
+    if (strcasecmp(name, "eval") == 0 || strcasecmp(name, "evalsha") == 0) {
+        // EVAL script numkeys key [key ...] arg [arg ...]
+        if (args.size() > 3 && strtol(args[2].data(), NULL, 10) > 0) {
+            *key = args[3];
+            return true;
+        }
+        return false;
+    }
+    for (size_t i = 0; i < arraysize(keyless_commands); ++i) {
+        if (strcasecmp(name, keyless_commands[i]) == 0) {
+            return false;
+        }
+    }
+    if (args.size() < 2) {
+        return false;
+    }
+    *key = args[1];
+    return true;
+}
+
+RedisClusterChannelOptions::RedisClusterChannelOptions()
+    : max_redirect(5) {
+}
+
+struct RedisClusterChannel::Command {
+    Command() : slot(-1), target(NULL), asking(false), nredirect(0) {}
+
+    // The command in the format of redis.
+    butil::IOBuf raw;
+    // Slot of the key, -1 if the command has no keys.
+    int slot;
+    // Node that the command was redirected to, NULL to use the slot map.
+    Channel* target;
+    // Send ASKING before the command, set by ASK redirections.
+    bool asking;
+    int nredirect;
+};
+
+// Commands sent to one node.
+struct RedisClusterChannel::SubCall {
+    SubCall() : chan(NULL), sent(false) {}
+
+    Channel* chan;
+    bool sent;
+    // Indexes of the commands.
+    std::vector<size_t> commands;
+    RedisRequest request;
+    RedisResponse response;
+    Controller cntl;
+};
+
+struct RedisClusterChannel::AsyncCall {
+    RedisClusterChannel* channel;
+    Controller* cntl;
+    const RedisRequest* request;
+    RedisResponse* response;
+    google::protobuf::Closure* done;
+    CallId cid;
+};
+
+RedisClusterChannel::RedisClusterChannel()
+    : _refreshing(false) {
+}
+
+RedisClusterChannel::~RedisClusterChannel() {
+    for (std::map<std::string, Channel*>::iterator
+             it = _channels.begin(); it != _channels.end(); ++it) {
+        delete it->second;
+    }
+    _channels.clear();
+}
+
+int RedisClusterChannel::Init(const char* seeds,
+                              const RedisClusterChannelOptions* options) {
+    if (!_seeds.empty()) {
+        LOG(ERROR) << "RedisClusterChannel=" << this << " was initialized";
+        return -1;
+    }
+    if (options) {
+        _options = *options;
+    }
+    _options.channel_options.protocol = PROTOCOL_REDIS;
+    if (_options.max_redirect < 0) {
+        _options.max_redirect = 0;
+    }
+    std::vector<std::string> seed_list;
+    for (butil::StringMultiSplitter sp(seeds, ", "); sp; ++sp) {
+        const std::string addr(sp.field(), sp.length());
+        if (GetChannel(addr) == NULL) {
+            return -1;
+        }
+        seed_list.push_back(addr);
+    }
+    if (seed_list.empty()) {
+        LOG(ERROR) << "No seeds in `" << seeds << '\'';
+        return -1;
+    }
+    _seeds.swap(seed_list);
+    if (RefreshSlots() != 0) {
+        LOG(ERROR) << "Fail to get slots of redis cluster `" << seeds << '\'';
+        _seeds.clear();
+        return -1;
+    }
+    return 0;
+}
+
+Channel* RedisClusterChannel::GetChannel(const std::string& addr) {
+    BAIDU_SCOPED_LOCK(_channels_mutex);
+    Channel*& chan = _channels[addr];
+    if (chan == NULL) {
+        Channel* new_chan = new Channel;
+        if (new_chan->Init(addr.c_str(), &_options.channel_options) != 0) {
+            LOG(ERROR) << "Fail to init channel to redis node=" << addr;
+            delete new_chan;
+            _channels.erase(addr);
+            return NULL;
+        }
+        chan = new_chan;
+    }
+    return chan;
+}
+
+Channel* RedisClusterChannel::GetChannelOfSlot(int slot) {
+    if (slot >= 0) {
+        butil::DoublyBufferedData<SlotMap>::ScopedPtr ptr;
+        if (_slot_map.Read(&ptr) == 0 && (size_t)slot < ptr->size()) {
+            Channel* chan = (*ptr)[slot];
+            if (chan) {
+                return chan;
+            }
+        }
+    }
+    // Commands without keys or of slots not served are sent to any node,
+    // which redirects the commands if needed.
+    return GetChannel(_seeds[0]);
+}
+
+size_t RedisClusterChannel::SetSlots(SlotMap& bg, const SlotMap& slots) {
+    bg = slots;
+    return 1;
+}
+
+int RedisClusterChannel::RefreshSlotsFrom(const std::string& addr,
+                                          Channel* chan) {
+    RedisRequest request;
+    request.AddCommand("CLUSTER SLOTS");
+    RedisResponse response;
+    Controller cntl;
+    chan->CallMethod(NULL, &cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+        LOG(WARNING) << "Fail to get slots from " << addr << ": "
+                     << cntl.ErrorText();
+        return -1;
+    }
+    const RedisReply& reply = response.reply(0);
+    if (!reply.is_array()) {
+        LOG(WARNING) << "Fail to get slots from " << addr << ": " << reply;
+        return -1;
+    }
+    // Hosts may be empty which means the host of the node replying.
+    const std::string default_host =
+        butil::ip2str(cntl.remote_side().ip).c_str();
+    SlotMap slots(REDIS_CLUSTER_SLOTS, NULL);
+    for (size_t i = 0; i < reply.size(); ++i) {
+        // [start, end, [host, port, ...](master), replicas...]
+        const RedisReply& range = reply[i];
+        if (range.size() < 3 || !range[0].is_integer() ||
+            !range[1].is_integer() || range[2].size() < 2 ||
+            !range[2][0].is_string() || !range[2][1].is_integer()) {
+            LOG(WARNING) << "Invalid slot range from " << addr << ": " << range;
+            return -1;
+        }
+        const int64_t start = range[0].integer();
+        const int64_t end = range[1].integer();
+        if (start < 0 || end >= REDIS_CLUSTER_SLOTS || start > end) {
+            LOG(WARNING) << "Invalid slot range from " << addr << ": " << range;
+            return -1;
+        }
+        const butil::StringPiece host = range[2][0].data();
+        Channel* node = GetChannel(butil::string_printf(
+                "%s:%" PRId64, (host.empty() ? default_host : host.as_string()).c_str(),
+                range[2][1].integer()));
+        if (node == NULL) {
+            return -1;
+        }
+        for (int64_t slot = start; slot <= end; ++slot) {
+            slots[slot] = node;
+        }
+    }
+    _slot_map.Modify(SetSlots, slots);
+    return 0;
+}
+
+int RedisClusterChannel::RefreshSlots() {
+    // Try seeds first, then other known nodes.
+    std::vector<std::pair<std::string, Channel*> > nodes;
+    {
+        BAIDU_SCOPED_LOCK(_channels_mutex);
+        for (size_t i = 0; i < _seeds.size(); ++i) {
+            nodes.push_back(std::make_pair(_seeds[i], _channels[_seeds[i]]));
+        }
+        for (std::map<std::string, Channel*>::const_iterator
+                 it = _channels.begin(); it != _channels.end(); ++it) {
+            if (std::find(_seeds.begin(), _seeds.end(), it->first) ==
+                _seeds.end()) {
+                nodes.push_back(*it);
+            }
+        }
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (RefreshSlotsFrom(nodes[i].first, nodes[i].second) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void RedisClusterChannel::RefreshSlotsIfNeeded() {
+    // Concurrent refreshings get same results, avoid them.
+    if (_refreshing.exchange(true, butil::memory_order_acquire)) {
+        return;
+    }
+    RefreshSlots();
+    _refreshing.store(false, butil::memory_order_release);
+}
+
+static const butil::StringPiece ASKING_COMMAND("*1\r\n$6\r\nASKING\r\n");
+
+void RedisClusterChannel::RunCommands(Controller* cntl,
+                                      const RedisRequest& request,
+                                      RedisResponse* response) {
+    // Split the request into commands.
+    std::vector<Command> commands(request.command_size());
+    {
+        butil::IOBuf buf;
+        if (!request.SerializeTo(&buf)) {
+            return cntl->SetFailed(EREQUEST, "Fail to serialize RedisRequest");
+        }
+        butil::IOBuf parsing = buf;
+        RedisCommandParser parser;
+        std::vector<butil::StringPiece> args;
+        for (size_t i = 0; i < commands.size(); ++i) {
+            const size_t old_size = parsing.size();
+            if (parser.Consume(parsing, &args) != PARSE_OK) {
+                return cntl->SetFailed(EREQUEST, "Invalid command[%d]", (int)i);
+            }
+            buf.cutn(&commands[i].raw, old_size - parsing.size());
+            butil::StringPiece key;
+            if (GetCommandKey(args, &key)) {
+                commands[i].slot = RedisClusterSlot(key);
+            }
+        }
+    }
+
+    int64_t timeout_ms = cntl->timeout_ms();
+    if (timeout_ms == UNSET_MAGIC_NUM) {
+        timeout_ms = _options.channel_options.timeout_ms;
+    }
+    const int64_t deadline_us =
+        (timeout_ms >= 0 ? butil::gettimeofday_us() + timeout_ms * 1000L : -1);
+    std::vector<butil::IOBuf> replies(commands.size());
+    std::vector<size_t> pending(commands.size());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        pending[i] = i;
+    }
+    bool need_refresh = false;
+    while (!pending.empty() && !cntl->FailedInline()) {
+        // Group commands by nodes, in the order of the commands.
+        std::map<Channel*, SubCall*> subcalls;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            Command& cmd = commands[pending[i]];
+            Channel* chan = (cmd.target ? cmd.target : GetChannelOfSlot(cmd.slot));
+            if (chan == NULL) {
+                cntl->SetFailed(EHOSTDOWN, "No channel to the node of slot=%d",
+                                cmd.slot);
+                break;
+            }
+            SubCall*& sc = subcalls[chan];
+            if (sc == NULL) {
+                sc = new SubCall;
+                sc->chan = chan;
+            }
+            if (cmd.asking) {
+                sc->request._buf.append(ASKING_COMMAND.data(),
+                                        ASKING_COMMAND.size());
+                ++sc->request._ncommand;
+            }
+            sc->request._buf.append(cmd.raw);
+            ++sc->request._ncommand;
+            sc->commands.push_back(pending[i]);
+        }
+        pending.clear();
+        // Send to nodes in parallel.
+        int64_t timeout_left_ms = -1;
+        if (deadline_us >= 0 && !cntl->FailedInline()) {
+            timeout_left_ms = (deadline_us - butil::gettimeofday_us()) / 1000L;
+            if (timeout_left_ms <= 0) {
+                cntl->SetFailed(ERPCTIMEDOUT, "Reached timeout=%" PRId64 "ms",
+                                timeout_ms);
+            }
+        }
+        for (std::map<Channel*, SubCall*>::iterator
+                 it = subcalls.begin(); it != subcalls.end(); ++it) {
+            SubCall* sc = it->second;
+            if (cntl->FailedInline()) {
+                continue;
+            }
+            if (timeout_left_ms >= 0) {
+                sc->cntl.set_timeout_ms(timeout_left_ms);
+            }
+            if (cntl->has_log_id()) {
+                sc->cntl.set_log_id(cntl->log_id());
+            }
+            sc->chan->CallMethod(NULL, &sc->cntl, &sc->request,
+                                 &sc->response, DoNothing());
+            sc->sent = true;
+        }
+        for (std::map<Channel*, SubCall*>::iterator
+                 it = subcalls.begin(); it != subcalls.end(); ++it) {
+            if (it->second->sent) {
+                Join(it->second->cntl.call_id());
+            }
+        }
+        // Collect replies, follow redirections.
+        for (std::map<Channel*, SubCall*>::iterator
+                 it = subcalls.begin(); it != subcalls.end(); ++it) {
+            SubCall* sc = it->second;
+            if (!sc->sent || cntl->FailedInline()) {
+                continue;
+            }
+            if (sc->cntl.Failed()) {
+                cntl->SetFailed(sc->cntl.ErrorCode(), "Fail to access redis node=%s: %s",
+                                butil::endpoint2str(sc->cntl.remote_side()).c_str(),
+                                sc->cntl.ErrorText().c_str());
+                // The node may be down and replaced.
+                need_refresh = true;
+                continue;
+            }
+            int ireply = 0;
+            for (size_t i = 0; i < sc->commands.size(); ++i) {
+                Command& cmd = commands[sc->commands[i]];
+                if (cmd.asking) {
+                    ++ireply;  // reply of ASKING
+                    cmd.asking = false;
+                }
+                const RedisReply& reply = sc->response.reply(ireply++);
+                if (reply.is_error() && cmd.nredirect < _options.max_redirect) {
+                    // "MOVED <slot> <host>:<port>" or "ASK <slot> <host>:<port>"
+                    const char* msg = reply.error_message();
+                    const bool moved = (strncmp(msg, "MOVED ", 6) == 0);
+                    const bool ask = (strncmp(msg, "ASK ", 4) == 0);
+                    const char* addr = ((moved || ask) ? strrchr(msg, ' ') : NULL);
+                    if (addr && addr[1] != '\0') {
+                        std::string target(addr + 1);
+                        if (target[0] == ':') {
+                            // Empty host means the host of the replying node.
+                            target.insert(0, butil::ip2str(sc->cntl.remote_side().ip).c_str());
+                        }
+                        cmd.target = GetChannel(target);
+                        if (cmd.target) {
+                            cmd.asking = ask;
+                            ++cmd.nredirect;
+                            need_refresh = (need_refresh || moved);
+                            pending.push_back(sc->commands[i]);
+                            continue;
+                        }
+                    }
+                }
+                RedisReplyWriter writer(&replies[sc->commands[i]]);
+                writer.AppendReply(reply);
+            }
+        }
+        for (std::map<Channel*, SubCall*>::iterator
+                 it = subcalls.begin(); it != subcalls.end(); ++it) {
+            delete it->second;
+        }
+        // Redirected commands are sent in the order of the request.
+        std::sort(pending.begin(), pending.end());
+    }
+    if (need_refresh) {
+        RefreshSlotsIfNeeded();
+    }
+    if (cntl->FailedInline()) {
+        return;
+    }
+    butil::IOBuf buf;
+    for (size_t i = 0; i < replies.size(); ++i) {
+        buf.append(butil::IOBuf::Movable(replies[i]));
+    }
+    response->Clear();
+    if (!response->ConsumePartialIOBuf(buf, commands.size())) {
+        cntl->SetFailed(ERESPONSE, "Fail to merge replies");
+    }
+}
+
+void RedisClusterChannel::CallMethod(
+    const google::protobuf::MethodDescriptor* /*method*/,
+    google::protobuf::RpcController* cntl_base,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    Controller* cntl = static_cast<Controller*>(cntl_base);
+    cntl->OnRPCBegin(butil::gettimeofday_us());
+    const CallId cid = cntl->call_id();
+    const int rc = bthread_id_lock(cid, NULL);
+    if (rc != 0) {
+        CHECK_EQ(EINVAL, rc);
+        if (!cntl->FailedInline()) {
+            cntl->SetFailed(EINVAL, "Fail to lock call_id=%" PRId64, cid.value);
+        }
+        LOG_IF(ERROR, cntl->is_used_by_rpc())
+            << "Controller=" << cntl << " was used by another RPC before. "
+            "Did you forget to Reset() it before reuse?";
+        // Have to run done in-place.
+        // Read comment in CallMethod() in channel.cpp for details.
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    cntl->set_used_by_rpc();
+
+    if (cntl->FailedInline()) {
+        // The call_id is cancelled before RPC.
+    } else if (_seeds.empty()) {
+        cntl->SetFailed(EINVAL, "RedisClusterChannel=%p is not initialized", this);
+    } else if (request == NULL ||
+               request->GetDescriptor() != RedisRequest::descriptor()) {
+        cntl->SetFailed(EREQUEST, "The request is not a RedisRequest");
+    } else if (response == NULL ||
+               response->GetDescriptor() != RedisResponse::descriptor()) {
+        cntl->SetFailed(EINVAL, "The response is not a RedisResponse");
+    } else if (done == NULL) {
+        RunCommands(cntl, *static_cast<const RedisRequest*>(request),
+                    static_cast<RedisResponse*>(response));
+    } else {
+        AsyncCall* call = new AsyncCall;
+        call->channel = this;
+        call->cntl = cntl;
+        call->request = static_cast<const RedisRequest*>(request);
+        call->response = static_cast<RedisResponse*>(response);
+        call->done = done;
+        call->cid = cid;
+        bthread_t th;
+        bthread_attr_t attr = (FLAGS_usercode_in_pthread ?
+                               BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL);
+        if (bthread_start_background(&th, &attr, RunAsyncCall, call) != 0) {
+            LOG(FATAL) << "Fail to start bthread";
+            RunAsyncCall(call);
+        }
+        return;
+    }
+    cntl->OnRPCEnd(butil::gettimeofday_us());
+    if (done) {
+        done->Run();
+    }
+    CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+}
+
+void* RedisClusterChannel::RunAsyncCall(void* arg) {
+    AsyncCall* call = static_cast<AsyncCall*>(arg);
+    call->channel->RunCommands(call->cntl, *call->request, call->response);
+    Controller* cntl = call->cntl;
+    google::protobuf::Closure* done = call->done;
+    // Save call_id from the controller which may be deleted after Run().
+    const CallId cid = call->cid;
+    delete call;
+    cntl->OnRPCEnd(butil::gettimeofday_us());
+    done->Run();
+    CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+    return NULL;
+}
+
+int RedisClusterChannel::CheckHealth() {
+    if (_seeds.empty()) {
+        return -1;
+    }
+    butil::DoublyBufferedData<SlotMap>::ScopedPtr ptr;
+    if (_slot_map.Read(&ptr) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < ptr->size(); ++i) {
+        ChannelBase* node = (*ptr)[i];
+        if (node && node->CheckHealth() == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void RedisClusterChannel::Describe(std::ostream& os,
+                                   const DescribeOptions&) const {
+    os << "RedisClusterChannel[seeds=";
+    for (size_t i = 0; i < _seeds.size(); ++i) {
+        if (i) {
+            os << ',';
+        }
+        os << _seeds[i];
+    }
+    {
+        BAIDU_SCOPED_LOCK(_channels_mutex);
+        os << " nodes=" << _channels.size();
+    }
+    os << " max_redirect=" << _options.max_redirect << ']';
+}
+
+} // namespace brpc
@@ -0,0 +1,126 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_REDIS_CLUSTER_CHANNEL_H
+#define BRPC_REDIS_CLUSTER_CHANNEL_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include <map>
+#include <string>
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/channel.h"
+#include "brpc/redis.h"
+
+namespace brpc {
+
+// Number of hash slots in a redis cluster.
+static const int REDIS_CLUSTER_SLOTS = 16384;
+
+// Hash slot of `key' in a redis cluster, namely CRC16 of the key modulo
+// 16384. Only the part inside the first "{...}" is hashed if it's non-empty
+// so that keys with same hash tags are put into the same slot.
+int RedisClusterSlot(const butil::StringPiece& key);
+
+struct RedisClusterChannelOptions {
+    // Constructed with default options.
+    RedisClusterChannelOptions();
+
+    // Options of channels to nodes of the cluster, `protocol' is always
+    // redis.
+    ChannelOptions channel_options;
+
+    // A command follows MOVED or ASK redirections at most so many times,
+    // the last redirection is replied to the user.
+    // Default: 5
+    int max_redirect;
+};
+
+// Access a redis cluster directly rather than through proxies, which saves
+// a hop. The mapping from hash slots to nodes is fetched by CLUSTER SLOTS
+// at Init() and after MOVED redirections or failed calls.
+// Commands in a RedisRequest are grouped by nodes of their keys and sent
+// in parallel, replies are put into the RedisResponse in the order of the
+// commands. Commands are redirected by MOVED or ASK transparently.
+// Notes:
+//  - A command is routed by its first key, commands with keys of different
+//    slots (e.g. MGET k1 k2) are not split and usually fail with CROSSSLOT,
+//    use hash tags or separate commands instead.
+//  - Commands without keys (e.g. PING) are sent to any node.
+//  - Transactions (MULTI/EXEC) are not supported.
+class RedisClusterChannel : public ChannelBase {
+public:
+    RedisClusterChannel();
+    ~RedisClusterChannel();
+
+    // Access the cluster containing any of `seeds', which is a list of
+    // "host:port" separated by commas or spaces.
+    // Returns 0 on success, -1 otherwise.
+    int Init(const char* seeds, const RedisClusterChannelOptions* options);
+
+    // `request' must be a RedisRequest and `response' must be a
+    // RedisResponse. If `done' is not NULL, this method returns
+    // immediately and `done->Run()' will be called when the call finishes,
+    // otherwise caller blocks until the call finishes.
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    // Fetch the slot map by CLUSTER SLOTS from any known node.
+    // Returns 0 on success, -1 otherwise.
+    int RefreshSlots();
+
+    int CheckHealth();
+
+    void Describe(std::ostream& os, const DescribeOptions&) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RedisClusterChannel);
+
+    struct Command;
+    struct SubCall;
+    struct AsyncCall;
+    // Channels of slots, NULL for slots not served.
+    typedef std::vector<Channel*> SlotMap;
+    static size_t SetSlots(SlotMap& bg, const SlotMap& slots);
+
+    // Get the channel to node `addr', create it if absent.
+    Channel* GetChannel(const std::string& addr);
+    Channel* GetChannelOfSlot(int slot);
+    int RefreshSlotsFrom(const std::string& addr, Channel* chan);
+    void RefreshSlotsIfNeeded();
+    void RunCommands(Controller* cntl, const RedisRequest& request,
+                     RedisResponse* response);
+    static void* RunAsyncCall(void* arg);
+
+    RedisClusterChannelOptions _options;
+    std::vector<std::string> _seeds;
+    butil::DoublyBufferedData<SlotMap> _slot_map;
+    // Channels are never removed before dtor since slot maps being read
+    // may reference them.
+    mutable butil::Mutex _channels_mutex;
+    std::map<std::string, Channel*> _channels;
+    butil::atomic<bool> _refreshing;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_REDIS_CLUSTER_CHANNEL_H
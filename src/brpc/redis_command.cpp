@@ -14,6 +14,7 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <gflags/gflags.h>
 #include "butil/logging.h"
 #include "brpc/log.h"
 #include "brpc/redis_command.h"
@@ -23,6 +24,8 @@ void* fast_memcpy(void *__restrict dest, const void *__restrict src, size_t n);
 
 namespace brpc {
 
+DECLARE_uint64(max_body_size);
+
 // Much faster than snprintf(..., "%lu", d);
 inline size_t AppendDecimal(char* outbuf, unsigned long d) {
     char buf[24];  // enough for decimal 64-bit integers
@@ -337,4 +340,108 @@ butil::Status RedisCommandByComponents(butil::IOBuf* output,
     return butil::Status::OK();
 }
 
+// Same as the limit of redis-server.
+static const int64_t REDIS_MAX_COMPONENTS = 1024 * 1024;
+
+// Components larger than this are not cached in the parser after the
+// command is consumed.
+static const size_t REDIS_MAX_CACHED_COMPONENTS_SIZE = 1024 * 1024;
+
+// Parse "<fc><integer>\r\n" at the front side of `buf' without changing it.
+// Returns length of the line, 0 if the line is incomplete, -1 if the line
+// is invalid.
+static ssize_t ParseIntegerLine(const butil::IOBuf& buf, char fc,
+                                int64_t* value) {
+    char intbuf[32];  // enough for fc + 64-bit decimal + \r\n
+    const size_t ncopied = buf.copy_to(intbuf, sizeof(intbuf) - 1);
+    if (ncopied == 0) {
+        return 0;
+    }
+    if (intbuf[0] != fc) {
+        return -1;
+    }
+    intbuf[ncopied] = '\0';
+    const size_t crlf_pos = butil::StringPiece(intbuf, ncopied).find("\r\n");
+    if (crlf_pos == butil::StringPiece::npos) {
+        return (ncopied == sizeof(intbuf) - 1 ? -1 : 0);
+    }
+    char* endptr = NULL;
+    const int64_t v = strtoll(intbuf + 1/*skip fc*/, &endptr, 10);
+    if (crlf_pos == 1 || endptr != intbuf + crlf_pos) {
+        return -1;
+    }
+    *value = v;
+    return crlf_pos + 2/*CRLF*/;
+}
+
+RedisCommandParser::RedisCommandParser() : _length(0) {}
+
+ParseError RedisCommandParser::Consume(butil::IOBuf& buf,
+                                       std::vector<butil::StringPiece>* args) {
+    // Notice that all branches returning PARSE_ERROR_NOT_ENOUGH_DATA must
+    // cut off intact lines or components only.
+    while (_length == 0) {
+        int64_t count = 0;
+        const ssize_t n = ParseIntegerLine(buf, '*', &count);
+        if (n == 0) {
+            return PARSE_ERROR_NOT_ENOUGH_DATA;
+        } else if (n < 0) {
+            LOG(ERROR) << "Invalid redis command, expecting an array";
+            return PARSE_ERROR_ABSOLUTELY_WRONG;
+        }
+        if (count > REDIS_MAX_COMPONENTS) {
+            LOG(ERROR) << "Too many components=" << count
+                       << " in a redis command";
+            return PARSE_ERROR_ABSOLUTELY_WRONG;
+        }
+        buf.pop_front(n);
+        // Empty arrays are ignored, just like redis-server.
+        if (count > 0) {
+            _length = count;
+            if (_components.capacity() > REDIS_MAX_CACHED_COMPONENTS_SIZE) {
+                std::string().swap(_components);
+            } else {
+                _components.clear();
+            }
+            _ends.clear();
+        }
+    }
+    while ((int64_t)_ends.size() < _length) {
+        int64_t len = 0;
+        const ssize_t n = ParseIntegerLine(buf, '$', &len);
+        if (n == 0) {
+            return PARSE_ERROR_NOT_ENOUGH_DATA;
+        } else if (n < 0 || len < 0) {
+            LOG(ERROR) << "Invalid redis command, expecting a bulk string";
+            return PARSE_ERROR_ABSOLUTELY_WRONG;
+        }
+        if ((uint64_t)len > FLAGS_max_body_size) {
+            return PARSE_ERROR_TOO_BIG_DATA;
+        }
+        if (buf.size() < n + (size_t)len + 2/*CRLF*/) {
+            return PARSE_ERROR_NOT_ENOUGH_DATA;
+        }
+        buf.pop_front(n);
+        const size_t offset = _components.size();
+        _components.resize(offset + len + 1);
+        buf.cutn(&_components[offset], len);
+        _components[offset + len] = '\0';
+        char crlf[2];
+        buf.cutn(crlf, sizeof(crlf));
+        if (crlf[0] != '\r' || crlf[1] != '\n') {
+            LOG(ERROR) << "Bulk string is not ended with CRLF";
+            return PARSE_ERROR_ABSOLUTELY_WRONG;
+        }
+        _ends.push_back(offset + len);
+    }
+    args->resize(_ends.size());
+    size_t begin = 0;
+    for (size_t i = 0; i < _ends.size(); ++i) {
+        (*args)[i].set(_components.data() + begin, _ends[i] - begin);
+        begin = _ends[i] + 1;
+    }
+    _length = 0;
+    return PARSE_OK;
+}
+
 } // namespace brpc
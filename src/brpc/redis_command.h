@@ -17,8 +17,10 @@
 #ifndef BRPC_REDIS_COMMAND_H
 #define BRPC_REDIS_COMMAND_H
 
+#include <vector>
 #include "butil/iobuf.h"
 #include "butil/status.h"
+#include "brpc/parse_result.h"
 
 
 namespace brpc {
@@ -37,6 +39,40 @@ butil::Status RedisCommandByComponents(butil::IOBuf* buf,
                                       const butil::StringPiece* components,
                                       size_t num_components);
 
+// Parse commands sent by redis clients, namely arrays of bulk strings such
+// as "*2\r\n$3\r\nget\r\n$3\r\nkey\r\n".
+class RedisCommandParser {
+public:
+    RedisCommandParser();
+
+    // Parse a command from the front side of `buf'. Components of the
+    // command are put into `args'(args[0] is the name of the command), which
+    // reference(null-terminated) memory inside the parser and are valid
+    // until next call to this function.
+    // Returns PARSE_OK when an intact command is cut off from `buf'.
+    // Returns PARSE_ERROR_NOT_ENOUGH_DATA if `buf' ends inside a command.
+    // Components parsed so far are cut off and the parsing is continued in
+    // next calls, thus a command is parsed in O(N) even if it's received
+    // byte by byte.
+    // Other errors are returned on invalid commands or components larger
+    // than -max_body_size.
+    ParseError Consume(butil::IOBuf& buf,
+                       std::vector<butil::StringPiece>* args);
+
+    // True if a command is partially parsed.
+    bool in_progress() const { return _length > 0; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RedisCommandParser);
+
+    // Number of components of the command being parsed, 0 if absent.
+    int64_t _length;
+    // Components parsed so far, each ends with '\0'.
+    std::string _components;
+    // End offsets of components(before '\0') in _components.
+    std::vector<size_t> _ends;
+};
+
 } // namespace brpc
 
 
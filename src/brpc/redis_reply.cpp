@@ -14,12 +14,26 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <stdlib.h>
+#include <string.h>
 #include <limits>
+#include <gflags/gflags.h>
 #include "butil/logging.h"
 #include "brpc/redis_reply.h"
 
 namespace brpc {
 
+DEFINE_int32(redis_reply_zero_copy_size, 16384,
+             "Bulk strings in redis replies not shorter than this value "
+             "reference blocks of the read buffer rather than being copied");
+
+struct RedisIOBufString {
+    butil::IOBuf buf;
+    // Flattened content ended with \0, allocated by malloc.
+    char* flat;
+    RedisIOBufString* next;
+};
+
 //BAIDU_CASSERT(sizeof(RedisReply) == 24, size_match);
 
 const char* RedisReplyTypeToString(RedisReplyType type) {
@@ -35,12 +49,17 @@ const char* RedisReplyTypeToString(RedisReplyType type) {
 }
 
 bool RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena) {
+    return ConsumePartialIOBuf(buf, arena, NULL);
+}
+
+bool RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena,
+                                     RedisIOBufString** iobuf_strings) {
     if (_type == REDIS_REPLY_ARRAY && _data.array.last_index >= 0) {
         // The parsing was suspended while parsing sub replies,
         // continue the parsing.
         RedisReply* subs = (RedisReply*)_data.array.replies;
         for (uint32_t i = _data.array.last_index; i < _length; ++i) {
-            if (!subs[i].ConsumePartialIOBuf(buf, arena)) {
+            if (!subs[i].ConsumePartialIOBuf(buf, arena, iobuf_strings)) {
                 return false;
             }
             ++_data.array.last_index;
@@ -79,7 +98,8 @@ bool RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena) {
         CHECK_EQ(len, str.copy_to_cstr(d, (size_t)-1L, 1/*skip fc*/));
         _type = (fc == '-' ? REDIS_REPLY_ERROR : REDIS_REPLY_STATUS);
         _length = len;
-        _data.long_str = d;
+        _data.long_str.str = d;
+        _data.long_str.ref = NULL;
         return true;
     }
     case '$':   // Bulk String   "$<length>\r\n<string>\r\n"
@@ -130,6 +150,25 @@ bool RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena) {
                 buf.pop_front(crlf_pos + 2);
                 buf.cutn(_data.short_str, len);
                 _data.short_str[len] = '\0';
+            } else if (iobuf_strings != NULL &&
+                       len >= FLAGS_redis_reply_zero_copy_size) {
+                // Reference the blocks to avoid copying long strings.
+                RedisIOBufString* ref = (RedisIOBufString*)
+                    arena->allocate(sizeof(RedisIOBufString));
+                if (ref == NULL) {
+                    LOG(FATAL) << "Fail to allocate RedisIOBufString";
+                    return false;
+                }
+                new (&ref->buf) butil::IOBuf;
+                ref->flat = NULL;
+                ref->next = *iobuf_strings;
+                *iobuf_strings = ref;
+                buf.pop_front(crlf_pos + 2/*CRLF*/);
+                buf.cutn(&ref->buf, len);
+                _type = REDIS_REPLY_STRING;
+                _length = len;
+                _data.long_str.str = NULL;
+                _data.long_str.ref = ref;
             } else {
                 char* d = (char*)arena->allocate((len/8 + 1)*8);
                 if (d == NULL) {
@@ -141,7 +180,8 @@ bool RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena) {
                 d[len] = '\0';
                 _type = REDIS_REPLY_STRING;
                 _length = len;
-                _data.long_str = d;
+                _data.long_str.str = d;
+                _data.long_str.ref = NULL;
             }
             char crlf[2];
             buf.cutn(crlf, sizeof(crlf));
@@ -189,7 +229,7 @@ bool RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena) {
             // be continued in next calls by tracking _data.array.last_index.
             _data.array.last_index = 0;
             for (int64_t i = 0; i < count; ++i) {
-                if (!subs[i].ConsumePartialIOBuf(buf, arena)) {
+                if (!subs[i].ConsumePartialIOBuf(buf, arena, iobuf_strings)) {
                     return false;
                 }
                 ++_data.array.last_index;
@@ -205,6 +245,49 @@ bool RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena) {
     return false;
 }
 
+void RedisReply::ReleaseIOBufStrings(RedisIOBufString* iobuf_strings) {
+    while (iobuf_strings) {
+        RedisIOBufString* next = iobuf_strings->next;
+        free(iobuf_strings->flat);
+        iobuf_strings->buf.~IOBuf();
+        iobuf_strings = next;
+    }
+}
+
+void RedisReply::FlattenIOBufString() const {
+    RedisIOBufString* ref = _data.long_str.ref;
+    char* flat = (char*)malloc(_length + 1);
+    if (flat == NULL) {
+        LOG(FATAL) << "Fail to allocate string[" << _length << "]";
+        return;
+    }
+    ref->buf.copy_to_cstr(flat, _length + 1);
+    ref->flat = flat;
+    const_cast<RedisReply*>(this)->_data.long_str.str = flat;
+}
+
+const butil::IOBuf* RedisReply::iobuf_string() const {
+    if (is_string() && _length >= sizeof(_data.short_str)) {
+        return (_data.long_str.ref ? &_data.long_str.ref->buf : NULL);
+    }
+    return NULL;
+}
+
+butil::IOBuf RedisReply::iobuf_data() const {
+    butil::IOBuf buf;
+    const butil::IOBuf* ref = iobuf_string();
+    if (ref) {
+        buf = *ref;
+    } else if (is_string()) {
+        const butil::StringPiece str = data();
+        buf.append(str.data(), str.size());
+    } else {
+        CHECK(false) << "The reply is " << RedisReplyTypeToString(_type)
+                     << ", not a string";
+    }
+    return buf;
+}
+
 static void PrintBinaryData(std::ostream& os, const butil::StringPiece& s) {
     // Check for non-ascii characters first so that we can print ascii data
     // (most cases) fast, rather than printing char-by-char as we do in the
@@ -242,7 +325,7 @@ void RedisReply::Print(std::ostream& os) const {
         if (_length < sizeof(_data.short_str)) {
             os << _data.short_str;
         } else {
-            PrintBinaryData(os, butil::StringPiece(_data.long_str, _length));
+            PrintBinaryData(os, butil::StringPiece(long_str(), _length));
         }
         os << '"';
         break;
@@ -269,7 +352,7 @@ void RedisReply::Print(std::ostream& os) const {
         if (_length < sizeof(_data.short_str)) {
             os << _data.short_str;
         } else {
-            PrintBinaryData(os, butil::StringPiece(_data.long_str, _length));
+            PrintBinaryData(os, butil::StringPiece(long_str(), _length));
         }
         break;
     default:
@@ -293,10 +376,11 @@ void RedisReply::CopyFromDifferentArena(const RedisReply& other,
             new (&subs[i]) RedisReply;
         }
         _data.array.last_index = other._data.array.last_index;
-        if (_data.array.last_index > 0) {
-            for (int i = 0; i < _data.array.last_index; ++i) {
-                subs[i].CopyFromDifferentArena(other._data.array.replies[i], arena);
-            }
+        // Copy parsed sub replies only if the parsing was suspended.
+        const uint32_t ncopied = (_data.array.last_index >= 0 ?
+                                  (uint32_t)_data.array.last_index : _length);
+        for (uint32_t i = 0; i < ncopied; ++i) {
+            subs[i].CopyFromDifferentArena(other._data.array.replies[i], arena);
         }
         _data.array.replies = subs;
     }
@@ -319,10 +403,129 @@ void RedisReply::CopyFromDifferentArena(const RedisReply& other,
                 LOG(FATAL) << "Fail to allocate string[" << _length << "]";
                 return;
             }
-            memcpy(d, other._data.long_str, _length + 1);
-            _data.long_str = d;
+            if (other._data.long_str.str) {
+                memcpy(d, other._data.long_str.str, _length + 1);
+            } else {
+                other._data.long_str.ref->buf.copy_to_cstr(d, _length + 1);
+            }
+            _data.long_str.str = d;
+            _data.long_str.ref = NULL;
+        }
+        break;
+    }
+}
+
+// Format "<fc><value>\r\n" into `line' which has at least 32 bytes.
+// Returns length of the line.
+static size_t FormatIntegerLine(char* line, char fc, int64_t value) {
+    size_t len = 0;
+    line[len++] = fc;
+    uint64_t d = (uint64_t)value;
+    if (value < 0) {
+        line[len++] = '-';
+        d = (uint64_t)0 - d;
+    }
+    char digits[24];  // enough for decimal 64-bit integers
+    size_t n = sizeof(digits);
+    do {
+        digits[--n] = '0' + d % 10;
+        d /= 10;
+    } while (d);
+    memcpy(line + len, digits + n, sizeof(digits) - n);
+    len += sizeof(digits) - n;
+    line[len++] = '\r';
+    line[len++] = '\n';
+    return len;
+}
+
+static void AppendIntegerLine(butil::IOBuf* buf, char fc, int64_t value) {
+    char line[32];
+    buf->append(line, FormatIntegerLine(line, fc, value));
+}
+
+void RedisReplyWriter::AppendLine(char fc, const butil::StringPiece& line) {
+    char stack_buf[128];
+    if (line.size() + 3 <= sizeof(stack_buf)) {
+        // Most replies are short, append them at once.
+        stack_buf[0] = fc;
+        memcpy(stack_buf + 1, line.data(), line.size());
+        stack_buf[line.size() + 1] = '\r';
+        stack_buf[line.size() + 2] = '\n';
+        _buf->append(stack_buf, line.size() + 3);
+    } else {
+        _buf->push_back(fc);
+        _buf->append(line.data(), line.size());
+        _buf->append("\r\n", 2);
+    }
+}
+
+void RedisReplyWriter::AppendStatus(const butil::StringPiece& status) {
+    AppendLine('+', status);
+}
+
+void RedisReplyWriter::AppendError(const butil::StringPiece& message) {
+    AppendLine('-', message);
+}
+
+void RedisReplyWriter::AppendInteger(int64_t value) {
+    AppendIntegerLine(_buf, ':', value);
+}
+
+void RedisReplyWriter::AppendString(const butil::StringPiece& str) {
+    char stack_buf[128];
+    if (str.size() + 32 <= sizeof(stack_buf)) {
+        const size_t len = FormatIntegerLine(stack_buf, '$', str.size());
+        memcpy(stack_buf + len, str.data(), str.size());
+        memcpy(stack_buf + len + str.size(), "\r\n", 2);
+        _buf->append(stack_buf, len + str.size() + 2);
+    } else {
+        AppendIntegerLine(_buf, '$', str.size());
+        _buf->append(str.data(), str.size());
+        _buf->append("\r\n", 2);
+    }
+}
+
+void RedisReplyWriter::AppendString(const butil::IOBuf& str) {
+    AppendIntegerLine(_buf, '$', str.size());
+    _buf->append(str);
+    _buf->append("\r\n", 2);
+}
+
+void RedisReplyWriter::AppendNil() {
+    _buf->append("$-1\r\n", 5);
+}
+
+void RedisReplyWriter::AppendArray(size_t size) {
+    AppendIntegerLine(_buf, '*', size);
+}
+
+void RedisReplyWriter::AppendReply(const RedisReply& reply) {
+    switch (reply.type()) {
+    case REDIS_REPLY_STRING:
+        if (reply.iobuf_string()) {
+            AppendString(*reply.iobuf_string());
+        } else {
+            AppendString(reply.data());
+        }
+        break;
+    case REDIS_REPLY_ARRAY:
+        AppendArray(reply.size());
+        for (size_t i = 0; i < reply.size(); ++i) {
+            AppendReply(reply[i]);
         }
         break;
+    case REDIS_REPLY_INTEGER:
+        AppendInteger(reply.integer());
+        break;
+    case REDIS_REPLY_NIL:
+        AppendNil();
+        break;
+    case REDIS_REPLY_STATUS:
+        AppendStatus(reply.data());
+        break;
+    case REDIS_REPLY_ERROR:
+        AppendError(reply.error_message());
+        break;
     }
 }
 
@@ -37,6 +37,9 @@ enum RedisReplyType {
 
 const char* RedisReplyTypeToString(RedisReplyType);
 
+// A long bulk string referencing blocks of the read buffer.
+struct RedisIOBufString;
+
 // A reply from redis-server.
 class RedisReply {
 public:
@@ -68,8 +71,15 @@ public:
     // Convert the reply to a StringPiece. If the reply is not a string,
     // call stacks are logged and "" is returned. 
     // If you need a std::string, call .data().as_string() (which allocates mem)
+    // Long bulk strings referencing the read buffer are flattened at the
+    // first call to c_str() or data(), prefer iobuf_data() for them.
     butil::StringPiece data() const;
 
+    // Get the string as an IOBuf. Long bulk strings referencing the read
+    // buffer are returned without copying. If the reply is not a string,
+    // call stacks are logged and an empty IOBuf is returned.
+    butil::IOBuf iobuf_data() const;
+
     // Return number of sub replies in the array. If this reply is not an array,
     // 0 is returned (call stacks are not logged).
     size_t size() const;
@@ -88,6 +98,17 @@ public:
     // intact, the complexity in worst case may be O(N^2).
     bool ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena);
 
+    // Same as above except that bulk strings not shorter than
+    // -redis_reply_zero_copy_size are kept as references to blocks of `buf'
+    // rather than copied into `arena'. The references are chained into
+    // `iobuf_strings' which must be released by ReleaseIOBufStrings() before
+    // clearing `arena'.
+    bool ConsumePartialIOBuf(butil::IOBuf& buf, butil::Arena* arena,
+                             RedisIOBufString** iobuf_strings);
+
+    // Release referenced blocks chained by ConsumePartialIOBuf().
+    static void ReleaseIOBufStrings(RedisIOBufString* iobuf_strings);
+
     // Swap internal fields with another reply.
     void Swap(RedisReply& other);
 
@@ -98,7 +119,7 @@ public:
     void Print(std::ostream& os) const;
 
     // Copy from another reply allocating on a different Arena, and allocate
-    // required memory with `self_arena'.
+    // required memory with `self_arena'. Referenced bulk strings are copied.
     void CopyFromDifferentArena(const RedisReply& other,
                                 butil::Arena* self_arena);
 
@@ -109,13 +130,24 @@ private:
     // RedisReply does not own the memory of fields, copying must be done
     // by calling CopyFrom[Different|Same]Arena.
     DISALLOW_COPY_AND_ASSIGN(RedisReply);
+
+friend class RedisReplyWriter;
+    const char* long_str() const;
+    void FlattenIOBufString() const;
+    // Referenced blocks of a long bulk string, NULL otherwise.
+    const butil::IOBuf* iobuf_string() const;
     
     RedisReplyType _type;
     uint32_t _length;  // length of short_str/long_str, count of replies
     union {
         int64_t integer;
         char short_str[16];
-        const char* long_str;
+        struct {
+            // NULL if `ref' is not flattened yet.
+            const char* str;
+            // Non-NULL if the string references blocks of the read buffer.
+            RedisIOBufString* ref;
+        } long_str;
         struct {
             int32_t last_index;  // >= 0 if previous parsing suspends on replies.
             RedisReply* replies;
@@ -124,6 +156,47 @@ private:
     } _data;
 };
 
+// Write replies to redis commands into an IOBuf in the format of RESP.
+// Used by handlers of RedisService(in brpc/redis.h), each command must be
+// answered with exactly one reply. An array counts as one reply, whose sub
+// replies are written right after AppendArray().
+class RedisReplyWriter {
+public:
+    explicit RedisReplyWriter(butil::IOBuf* buf) : _buf(buf) {}
+
+    // "+<status>\r\n", e.g. "OK". `status' must not contain CR or LF.
+    void AppendStatus(const butil::StringPiece& status);
+
+    // "-<message>\r\n", e.g. "ERR syntax error". `message' must not
+    // contain CR or LF.
+    void AppendError(const butil::StringPiece& message);
+
+    // ":<value>\r\n"
+    void AppendInteger(int64_t value);
+
+    // "$<length>\r\n<str>\r\n"
+    void AppendString(const butil::StringPiece& str);
+    // Blocks of `str' are referenced rather than copied, values cached in
+    // IOBuf are replied without copying.
+    void AppendString(const butil::IOBuf& str);
+
+    // "$-1\r\n"
+    void AppendNil();
+
+    // "*<size>\r\n", must be followed by `size' sub replies.
+    void AppendArray(size_t size);
+
+    // Write `reply'(and sub replies) as it was received.
+    void AppendReply(const RedisReply& reply);
+
+    butil::IOBuf* buf() const { return _buf; }
+
+private:
+    void AppendLine(char fc, const butil::StringPiece& line);
+
+    butil::IOBuf* _buf;
+};
+
 // =========== inline impl. ==============
 
 inline std::ostream& operator<<(std::ostream& os, const RedisReply& r) {
@@ -159,7 +232,7 @@ inline const char* RedisReply::c_str() const {
         if (_length < sizeof(_data.short_str)) { // SSO
             return _data.short_str;
         } else {
-            return _data.long_str;
+            return long_str();
         }
     }
     CHECK(false) << "The reply is " << RedisReplyTypeToString(_type)
@@ -172,7 +245,7 @@ inline butil::StringPiece RedisReply::data() const {
         if (_length < sizeof(_data.short_str)) { // SSO
             return butil::StringPiece(_data.short_str, _length);
         } else {
-            return butil::StringPiece(_data.long_str, _length);
+            return butil::StringPiece(long_str(), _length);
         }
     }
     CHECK(false) << "The reply is " << RedisReplyTypeToString(_type)
@@ -185,7 +258,7 @@ inline const char* RedisReply::error_message() const {
         if (_length < sizeof(_data.short_str)) { // SSO
             return _data.short_str;
         } else {
-            return _data.long_str;
+            return long_str();
         }
     }
     CHECK(false) << "The reply is " << RedisReplyTypeToString(_type)
@@ -193,6 +266,13 @@ inline const char* RedisReply::error_message() const {
     return "";
 }
 
+inline const char* RedisReply::long_str() const {
+    if (_data.long_str.str == NULL) {
+        FlattenIOBufString();
+    }
+    return _data.long_str.str;
+}
+
 inline size_t RedisReply::size() const {
     return (is_array() ? _length : 0);
 }
@@ -14,6 +14,8 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <string.h>
+#include <algorithm>
 #include <google/protobuf/descriptor.h>
 #include "brpc/log.h"
 #include "brpc/restful.h"
@@ -299,7 +301,7 @@ bool RestfulMap::AddMethod(const RestfulMethodPath& path,
 }
 
 void RestfulMap::ClearMethods() {
-    _sorted_paths.clear();
+    _trie.clear();
     for (DedupMap::iterator it = _dedup_map.begin();
          it != _dedup_map.end(); ++it) {
         if (it->second.own_method_status) {
@@ -309,202 +311,179 @@ void RestfulMap::ClearMethods() {
     _dedup_map.clear();
 }
 
-struct CompareItemInPathList {
-    bool operator()(const RestfulMethodProperty* e1,
-                    const RestfulMethodProperty* e2) const {
-        const int rc1 = e1->path.prefix.compare(e2->path.prefix);
-        if (rc1 != 0) {
-            return rc1 < 0;
-        }
-        // /A/*/B is put before /A/B so that we try exact patterns first
-        // (the matching is in reversed order)
-        if (e1->path.has_wildcard != e2->path.has_wildcard) {
-            return e1->path.has_wildcard > e2->path.has_wildcard;
-        }
-        // Compare postfix from back to front.
-        // TODO: Optimize this.
-        std::string::const_reverse_iterator it1 = e1->path.postfix.rbegin();
-        std::string::const_reverse_iterator it2 = e2->path.postfix.rbegin();
-        while (it1 != e1->path.postfix.rend() &&
-               it2 != e2->path.postfix.rend()) {
-            if (*it1 != *it2) {
-                return (*it1 < *it2);
-            }
-            ++it1;
-            ++it2;
-        }
-        return (it1 == e1->path.postfix.rend())
-            > (it2 == e2->path.postfix.rend());
+namespace {
+struct ChildLess {
+    bool operator()(const std::pair<std::string, int>& child,
+                    const butil::StringPiece& name) const {
+        return butil::StringPiece(child.first) < name;
+    }
+};
+
+struct LongerPostfix {
+    bool operator()(const RestfulMethodProperty* p1,
+                    const RestfulMethodProperty* p2) const {
+        return p1->path.postfix.size() > p2->path.postfix.size();
     }
 };
+} // namespace
+
+int RestfulMap::FindChild(int node, const butil::StringPiece& name) const {
+    const std::vector<std::pair<std::string, int> >& children =
+        _trie[node].children;
+    std::vector<std::pair<std::string, int> >::const_iterator it =
+        std::lower_bound(children.begin(), children.end(), name, ChildLess());
+    if (it != children.end() && it->first == name) {
+        return it->second;
+    }
+    return -1;
+}
 
 void RestfulMap::PrepareForFinding() {
-    _sorted_paths.clear();
-    _sorted_paths.reserve(_dedup_map.size());
+    _trie.clear();
+    _trie.resize(1);
+    _trie[0].parent = -1;
+    _trie[0].prefix_size = 1;
+    _trie[0].exact = NULL;
     for (DedupMap::iterator it = _dedup_map.begin(); it != _dedup_map.end();
          ++it) {
-        _sorted_paths.push_back(&it->second);
+        const RestfulMethodProperty* mp = &it->second;
+        const std::string& prefix = mp->path.prefix;
+        int node = 0;
+        for (butil::StringSplitter sp(prefix.data(),
+                                      prefix.data() + prefix.size(), '/');
+             sp; ++sp) {
+            const butil::StringPiece name(sp.field(), sp.length());
+            int child = FindChild(node, name);
+            if (child < 0) {
+                child = (int)_trie.size();
+                _trie.resize(_trie.size() + 1);
+                TrieNode& n = _trie.back();
+                n.parent = node;
+                n.prefix_size = _trie[node].prefix_size + name.size() + 1;
+                n.exact = NULL;
+                std::vector<std::pair<std::string, int> >& children =
+                    _trie[node].children;
+                children.insert(std::lower_bound(children.begin(),
+                                                 children.end(),
+                                                 name, ChildLess()),
+                                std::make_pair(name.as_string(), child));
+            }
+            node = child;
+        }
+        if (mp->path.has_wildcard) {
+            _trie[node].wildcards.push_back(mp);
+        } else {
+            // Paths are deduplicated by to_string().
+            _trie[node].exact = mp;
+        }
+    }
+    for (size_t i = 0; i < _trie.size(); ++i) {
+        // Postfixes matching a same path are suffixes of each other, try
+        // the longer(more specific) one first.
+        std::stable_sort(_trie[i].wildcards.begin(), _trie[i].wildcards.end(),
+                         LongerPostfix());
     }
-    std::sort(_sorted_paths.begin(), _sorted_paths.end(),
-              CompareItemInPathList());
     if (VLOG_IS_ON(RPC_VLOG_LEVEL + 1)) {
         std::ostringstream os;
-        os << "_sorted_paths(" << _service_name << "):";
-        for (PathList::const_iterator it = _sorted_paths.begin();
-             it != _sorted_paths.end(); ++it) {
-            os << ' ' << (*it)->path;
+        os << "paths(" << _service_name << "):";
+        for (DedupMap::const_iterator it = _dedup_map.begin();
+             it != _dedup_map.end(); ++it) {
+            os << ' ' << it->second.path;
         }
+        os << " trie_nodes=" << _trie.size();
         VLOG(RPC_VLOG_LEVEL + 1) << os.str();
     }
 }
 
-// Remove last component from the (normalized) path:
-// Say /A/B/C/ -> /A/B/
-// Notice that /A/ is modified to / and returns true.
-static bool RemoveLastComponent(butil::StringPiece* path) {
-    if (path->empty()) {
-        return false;
-    }
-    if (path->back() == '/') {
-        path->remove_suffix(1);
-    }
-    size_t slash_pos = path->rfind('/');
-    if (slash_pos == std::string::npos) {
-        return false;
-    }
-    path->remove_suffix(path->size() - slash_pos - 1); // keep the slash
-    return true;
-}
-
-// Normalized as /A/B/C/
-static std::string NormalizeSlashes(const butil::StringPiece& path) {
-    std::string out_path;
-    out_path.reserve(path.size() + 2);
+// Normalized `path' as /A/B/C/ into `out' which has path.size() + 2 bytes
+// at least. Returns length of the normalized path.
+static size_t NormalizeSlashesTo(const butil::StringPiece& path, char* out) {
+    char* p = out;
     butil::StringSplitter sp(path.data(), path.data() + path.size(), '/');
     for (; sp; ++sp) {
-        out_path.push_back('/');
-        out_path.append(sp.field(), sp.length());
+        *p++ = '/';
+        memcpy(p, sp.field(), sp.length());
+        p += sp.length();
     }
-    out_path.push_back('/');
-    return out_path;
+    *p++ = '/';
+    return p - out;
 }
 
 size_t RestfulMap::RemoveByPathString(const std::string& path) {
-    // removal only happens when server stops, clear _sorted_paths to make
-    // sure wild pointers do not exist.
-    if (!_sorted_paths.empty()) {
-        _sorted_paths.clear();
+    // removal only happens when server stops, clear _trie to make sure
+    // wild pointers do not exist.
+    if (!_trie.empty()) {
+        _trie.clear();
     }
     return _dedup_map.erase(path);
 }
 
-struct PrefixLess {
-    bool operator()(const butil::StringPiece& path,
-                    const RestfulMethodProperty* p) const {
-        return path < p->path.prefix;
-    }
-};
-
 const Server::MethodProperty*
 RestfulMap::FindMethodProperty(const butil::StringPiece& method_path,
                                std::string* unresolved_path) const {
-    if (_sorted_paths.empty()) {
-        LOG(ERROR) << "_sorted_paths is empty, method_path=" << method_path;
+    if (_trie.empty()) {
+        LOG(ERROR) << "_trie is empty, method_path=" << method_path;
         return NULL;
     }
-    const std::string full_path = NormalizeSlashes(method_path);
-    butil::StringPiece sub_path = full_path;
-    PathList::const_iterator last_find_pos = _sorted_paths.end();
-    do {
-        if (last_find_pos == _sorted_paths.begin()) {
-            return NULL;
-        }
-        // Note: stop trying places that we already visited or skipped.
-        PathList::const_iterator it =
-            std::upper_bound(_sorted_paths.begin(), last_find_pos/*note*/,
-                             sub_path, PrefixLess());
-        if (it != _sorted_paths.begin()) {
-            --it;
+    // Normalize the path on stack unless it's too long.
+    char stack_buf[512];
+    std::string heap_buf;
+    char* full_path = stack_buf;
+    if (method_path.size() + 2 > sizeof(stack_buf)) {
+        heap_buf.resize(method_path.size() + 2);
+        full_path = &heap_buf[0];
+    }
+    const size_t full_size = NormalizeSlashesTo(method_path, full_path);
+
+    // Go down to the deepest node matching a prefix of the path.
+    int node = 0;
+    for (size_t pos = 1; pos < full_size;) {
+        const char* end = (const char*)memchr(
+            full_path + pos, '/', full_size - pos);
+        const int child = FindChild(
+            node, butil::StringPiece(full_path + pos, end - full_path - pos));
+        if (child < 0) {
+            break;
         }
-        
-        bool matched = false;
-        bool remove_heading_slash_from_unresolved = false;
-        butil::StringPiece left;
-        do {
-            const RestfulMethodPath& rpath = (*it)->path;
-            if (!sub_path.starts_with(rpath.prefix)) {
-                VLOG(RPC_VLOG_LEVEL + 1)
-                    << "sub_path=" << sub_path << " does not match prefix="
-                    << rpath.prefix << " full_path=" << full_path
-                    << " candidate=" << DebugPrinter(rpath);
-                // NOTE: We can stop trying patterns before *it because pattern
-                // "/A*B => M" is disabled which makes prefixes of all restful
-                // paths end with /. If `full_path' matches with a prefix, the
-                // prefix must be a sub path of the full_path, which makes 
-                // prefix matching runs at most #components-of-path times.
-                // Otherwise we have to match all "/A*B" patterns before *it,
-                // which is more complicated but rarely needed by users.
-                break;
-            }
-            left = full_path;
-            // Remove matched prefix from `left'.
-            if (!rpath.prefix.empty()) {
-                // make sure `left' is still starting with /
-                size_t removal = rpath.prefix.size();
-                if (rpath.prefix[removal - 1] == '/') {
-                    --removal;
-                    remove_heading_slash_from_unresolved = true;
-                }
-                left.remove_prefix(removal);
-            }
-            // Match postfix.
-            if (left.ends_with(rpath.postfix)) {
-                left.remove_suffix(rpath.postfix.size());
-                if (!left.empty() && !rpath.has_wildcard) {
-                    VLOG(RPC_VLOG_LEVEL + 1)
-                        << "Unmatched extra=" << left
-                        << " sub_path=" << sub_path
-                        << " full_path=" << full_path
-                        << " candidate=" << DebugPrinter(rpath);
-                } else {
-                    matched = true;
-                    VLOG(RPC_VLOG_LEVEL + 1)
-                        << "Matched sub_path=" << sub_path
-                        << " full_path=" << full_path
-                        << " with restful_path=" << DebugPrinter(rpath);
+        node = child;
+        pos = end - full_path + 1;
+    }
+    // Patterns with longer prefixes are tried first, and for a same prefix,
+    // the exact one is tried before wildcards.
+    for (; node >= 0; node = _trie[node].parent) {
+        const TrieNode& n = _trie[node];
+        // Remaining part of the path after the prefix, starting with /
+        butil::StringPiece left(full_path + n.prefix_size - 1,
+                                full_size - n.prefix_size + 1);
+        const RestfulMethodProperty* matched = NULL;
+        if (n.exact != NULL && left.size() == 1) {
+            matched = n.exact;
+            left.clear();
+        } else {
+            for (size_t i = 0; i < n.wildcards.size(); ++i) {
+                const std::string& postfix = n.wildcards[i]->path.postfix;
+                if (left.ends_with(postfix)) {
+                    matched = n.wildcards[i];
+                    left.remove_suffix(postfix.size());
                     break;
                 }
             }
-            if (it == _sorted_paths.begin()) {
-                VLOG(RPC_VLOG_LEVEL + 1)
-                    << "Hit beginning, sub_path=" << sub_path
-                    << " full_path=" << full_path
-                    << " candidate=" << DebugPrinter(rpath);
-                return NULL;
-            }
-            // Matched with prefix but postfix or wildcard, moving forward
-            --it;
-        } while (true);
-        last_find_pos = it;
-        
-        if (!matched) {
+        }
+        if (matched == NULL) {
             continue;
         }
+        VLOG(RPC_VLOG_LEVEL + 1)
+            << "Matched full_path="
+            << butil::StringPiece(full_path, full_size)
+            << " with restful_path=" << DebugPrinter(matched->path);
         if (unresolved_path) {
-            if (!left.empty()) {
-                if (remove_heading_slash_from_unresolved && left[0] == '/') {
-                    unresolved_path->assign(left.data() + 1, left.size() - 1);
-                } else {
-                    unresolved_path->assign(left.data(), left.size());
-                }
-            } else {
-                unresolved_path->clear();
+            if (!left.empty() && left[0] == '/') {
+                left.remove_prefix(1);
             }
+            unresolved_path->assign(left.data(), left.size());
         }
-        return *it;
-    } while (RemoveLastComponent(&sub_path));
-    //                            ^^^^^^^^
-    // sub_path can be / to match patterns like "*.flv => M" whose prefix is /
+        return matched;
+    }
     return NULL;
 }
 
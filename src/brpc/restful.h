@@ -60,7 +60,6 @@ struct RestfulMethodProperty : public Server::MethodProperty {
 class RestfulMap {
 public:
     typedef std::map<std::string, RestfulMethodProperty> DedupMap;
-    typedef std::vector<RestfulMethodProperty*> PathList;
 
     explicit RestfulMap(const std::string& service_name)
         : _service_name(service_name) {}
@@ -81,11 +80,14 @@ public:
     // Remove all methods.
     void ClearMethods();
 
-    // Called after by Server at starting moment, to refresh _sorted_paths
+    // Called after by Server at starting moment, to compile paths into
+    // the trie for finding.
     void PrepareForFinding();
     
     // Find the method by path.
-    // Time complexity in worst-case is #slashes-in-input * log(#paths-stored)
+    // Time complexity is O(#components-in-input * log(#children-per-node))
+    // plus matching wildcard patterns along the path, independent of the
+    // number of paths stored.
     const Server::MethodProperty*
     FindMethodProperty(const butil::StringPiece& method_path,
                        std::string* unresolved_path) const;
@@ -98,9 +100,26 @@ public:
 private:
     DISALLOW_COPY_AND_ASSIGN(RestfulMap);
     
+    // Node of the trie, each edge is a component of prefixes of the paths.
+    struct TrieNode {
+        // Index of the parent node, -1 for the root.
+        int parent;
+        // Size of the normalized prefix "/A/B/" ended at this node.
+        size_t prefix_size;
+        // Method mapped to the prefix exactly, NULL if absent.
+        const RestfulMethodProperty* exact;
+        // Methods mapped to the prefix with a wildcard, longer postfixes
+        // are matched first.
+        std::vector<const RestfulMethodProperty*> wildcards;
+        // Sorted by names of the components.
+        std::vector<std::pair<std::string, int> > children;
+    };
+    int FindChild(int node, const butil::StringPiece& name) const;
+
     std::string _service_name;
-    // refreshed each time 
-    PathList _sorted_paths;
+    // refreshed each time PrepareForFinding() is called, the root is the
+    // first one.
+    std::vector<TrieNode> _trie;
     DedupMap _dedup_map;
 };
 
@@ -14,6 +14,7 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <algorithm>
 #include "brpc/retry_policy.h"
 
 
@@ -56,4 +57,56 @@ const RetryPolicy* DefaultRetryPolicy() {
     return g_default_policy;
 }
 
+static const int64_t BUDGET_UNIT = 1000;
+
+RetryBudgetOptions::RetryBudgetOptions()
+    : retry_ratio(0.1)
+    , max_retry_burst(10) {
+}
+
+static RetryBudgetOptions NormalizeOptions(const RetryBudgetOptions& options) {
+    RetryBudgetOptions opt = options;
+    opt.retry_ratio = std::min(std::max(opt.retry_ratio, 0.0), 1000.0);
+    opt.max_retry_burst = std::max(opt.max_retry_burst, 0);
+    return opt;
+}
+
+RetryBudget::RetryBudget()
+    : _options(NormalizeOptions(RetryBudgetOptions()))
+    , _budget(_options.max_retry_burst * BUDGET_UNIT) {
+}
+
+RetryBudget::RetryBudget(const RetryBudgetOptions& options)
+    : _options(NormalizeOptions(options))
+    , _budget(_options.max_retry_burst * BUDGET_UNIT) {
+}
+
+bool RetryBudget::Withdraw() {
+    int64_t budget = _budget.load(butil::memory_order_relaxed);
+    while (budget >= BUDGET_UNIT) {
+        if (_budget.compare_exchange_weak(budget, budget - BUDGET_UNIT,
+                                          butil::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RetryBudget::Deposit() {
+    const int64_t inc = (int64_t)(_options.retry_ratio * BUDGET_UNIT);
+    const int64_t max_budget = _options.max_retry_burst * BUDGET_UNIT;
+    int64_t budget = _budget.load(butil::memory_order_relaxed);
+    while (budget < max_budget) {
+        if (_budget.compare_exchange_weak(
+                budget, std::min(budget + inc, max_budget),
+                butil::memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+int RetryBudget::remaining_retries() const {
+    return _budget.load(butil::memory_order_relaxed) / BUDGET_UNIT;
+}
+
 } // namespace brpc
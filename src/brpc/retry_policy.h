@@ -17,6 +17,8 @@
 #ifndef BRPC_RETRY_POLICY_H
 #define BRPC_RETRY_POLICY_H
 
+#include "butil/macros.h"
+#include "butil/atomicops.h"
 #include "brpc/controller.h"
 
 
@@ -71,6 +73,47 @@ public:
 // Get the RetryPolicy used by brpc.
 const RetryPolicy* DefaultRetryPolicy();
 
+struct RetryBudgetOptions {
+    RetryBudgetOptions();
+
+    // Retries allowed per successful RPC. For example, 0.1 allows retries
+    // of at most 10% of successful RPCs in long term.
+    // Default: 0.1
+    double retry_ratio;
+
+    // Max retries that can be done in a row without successful RPCs between
+    // them, which is also the initial budget.
+    // Default: 10
+    int max_retry_burst;
+};
+
+// A token bucket limiting retries of channels as a ratio of successful RPCs.
+// RetryPolicy decides per RPC and retries multiply the load on backends
+// when most RPCs fail, this budget stops retrying in such brownouts while
+// leaving occasional failures retried. Can be shared by multiple channels.
+class RetryBudget {
+public:
+    RetryBudget();
+    explicit RetryBudget(const RetryBudgetOptions& options);
+
+    // Take the budget of one retry. Returns false if the budget is used up
+    // and the RPC should not be retried.
+    bool Withdraw();
+
+    // Called when an RPC succeeds.
+    void Deposit();
+
+    // Retries that can be done right now.
+    int remaining_retries() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RetryBudget);
+
+    const RetryBudgetOptions _options;
+    // In thousandths of retries.
+    butil::atomic<int64_t> _budget;
+};
+
 } // namespace brpc
 
 
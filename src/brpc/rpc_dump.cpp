@@ -16,6 +16,7 @@
 
 #include <gflags/gflags.h>
 #include <fcntl.h>                    // O_CREAT
+#include <sys/stat.h>                 // fstat
 #include "butil/file_util.h"
 #include "butil/raw_pack.h"
 #include "butil/unique_ptr.h"
@@ -26,6 +27,8 @@
 #include "brpc/reloadable_flags.h"
 #include "brpc/rpc_dump.h"
 #include "brpc/protocol.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/details/iobuf_block_tag.h"
 
 namespace bvar {
 std::string read_command_name();
@@ -56,10 +59,24 @@ DEFINE_int32(rpc_dump_max_files, 32,
              "If new file is needed, oldest file is removed.");
 DEFINE_int32(rpc_dump_max_requests_in_one_file, 1000,
              "Max number of requests in one dumped file");
+DEFINE_bool(rpc_dump_zstd, false,
+            "Compress dumped requests with zstd to save disk, at the cost "
+            "of decompressing them when being replayed");
 
 BRPC_VALIDATE_GFLAG(rpc_dump, PassValidate);
 BRPC_VALIDATE_GFLAG(rpc_dump_max_requests_in_one_file, PositiveInteger);
 BRPC_VALIDATE_GFLAG(rpc_dump_max_files, PositiveInteger);
+BRPC_VALIDATE_GFLAG(rpc_dump_zstd, PassValidate);
+
+// Every record starts with a 12-byte header: magic(4) body_size(4) and
+// meta_size(4) or body_size(4) again for the index.
+static const size_t RECORD_HEADER_SIZE = 12;
+// magic of a plain request: RpcDumpMeta + serialized request.
+#define PLAIN_SAMPLE_MAGIC "PRPC"
+// magic of a request compressed by zstd, meta_size is of the uncompressed.
+#define ZSTD_SAMPLE_MAGIC "ZRPC"
+// magic of the index at the end of a file, see WriteIndex().
+#define SAMPLE_INDEX_MAGIC "PIDX"
 
 static const size_t UNWRITTEN_BUFSIZE = 1024 * 1024;
 static const int64_t FLUSH_TIMEOUT = 2000000L; // 2s
@@ -77,6 +94,7 @@ public:
     RpcDumpContext()
         : _cur_req_count(0)
         , _cur_fd(-1)
+        , _cur_file_size(0)
         , _last_round(0)
         , _max_requests_in_one_file(0)
         , _max_files(0)
@@ -97,8 +115,14 @@ public:
     
 private:
     std::string _command_name;
+    void WriteIndex();
+    void CloseFile();
+
     int _cur_req_count; // written #req in current file
     int _cur_fd;        // fd of current file
+    uint64_t _cur_file_size; // written bytes to current file
+    // offsets of requests in current file.
+    std::vector<uint64_t> _cur_offsets;
     size_t _last_round;
     // save gflags which could be reloaded at anytime.
     int _max_requests_in_one_file;
@@ -120,8 +144,11 @@ static RpcDumpContext* g_rpc_dump_ctx = NULL;
 void SampledRequest::dump_and_destroy(size_t round) {
     static bvar::DisplaySamplingRatio sampling_ratio_var(
         "rpc_dump_sampling_ratio", &g_rpc_dump_sl);
+    static bvar::DisplayDroppedSamples dropped_samples_var(
+        "rpc_dump_dropped_samples", &g_rpc_dump_sl);
     
     // Safe to modify g_rpc_dump_ctx w/o locking.
+    butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_RPC_DUMP);
     RpcDumpContext* rpc_dump_ctx = g_rpc_dump_ctx;
     if (rpc_dump_ctx == NULL) {
         rpc_dump_ctx = new RpcDumpContext;
@@ -157,9 +184,11 @@ void RpcDumpContext::Dump(size_t round, SampledRequest* sample) {
         SaveFlags();
     }
 
+    const uint64_t offset = _cur_file_size + _unwritten_buf.size();
     if (!Serialize(_unwritten_buf, sample)) {
         return;
     }
+    _cur_offsets.push_back(offset);
     ++_cur_req_count;
     if (_cur_req_count >= _max_requests_in_one_file) {
         // Reach the limit of #request in a file.
@@ -209,51 +238,92 @@ void RpcDumpContext::Dump(size_t round, SampledRequest* sample) {
         _last_file_time = cur_file_time;
         _filenames.push_back(_cur_filename);
     }
+    if (_cur_req_count >= _max_requests_in_one_file) {
+        WriteIndex();
+    }
     // Write all data in _unwritten_buf. This is different from writing
     // into a socket: local file should always be writable unless error occurs
     bool fail_to_write = false;
     while (!_unwritten_buf.empty()) {
-        if (_unwritten_buf.cut_into_file_descriptor(_cur_fd) < 0) {
+        const ssize_t nw = _unwritten_buf.cut_into_file_descriptor(_cur_fd);
+        if (nw < 0) {
             if (errno != EINTR && errno != EAGAIN) {
                 PLOG(ERROR) << "Fail to write into " << _cur_filename;
                 fail_to_write = true;
                 break;
             }
+        } else {
+            _cur_file_size += nw;
         }
     }
     _unwritten_buf.clear();
     _sched_write_time = butil::gettimeofday_us() + FLUSH_TIMEOUT;
     if (fail_to_write || _cur_req_count >= _max_requests_in_one_file) {
-        // clean up
-        if (_cur_fd >= 0) {
-            close(_cur_fd);
-            _cur_fd = -1;
-        }
-        _cur_req_count = 0;
+        CloseFile();
     }
 }
 
+// Append offsets of requests in current file so that readers can access
+// the requests randomly without scanning the file:
+//   "PIDX" body_size(4) offset1(8) offset2(8) ... body_size(4)
+// The trailing body_size locates the index from the end of the file.
+// Files without the index(e.g. the process quit before they're full) are
+// still readable by scanning.
+void RpcDumpContext::WriteIndex() {
+    const uint32_t body_size = _cur_offsets.size() * 8;
+    char header[RECORD_HEADER_SIZE];
+    memcpy(header, SAMPLE_INDEX_MAGIC, 4);
+    butil::RawPacker(header + 4).pack32(body_size).pack32(body_size);
+    _unwritten_buf.append(header, 8);
+    for (size_t i = 0; i < _cur_offsets.size(); ++i) {
+        char buf[8];
+        butil::RawPacker(buf).pack64(_cur_offsets[i]);
+        _unwritten_buf.append(buf, sizeof(buf));
+    }
+    _unwritten_buf.append(header + 8, 4);
+}
+
+void RpcDumpContext::CloseFile() {
+    if (_cur_fd >= 0) {
+        close(_cur_fd);
+        _cur_fd = -1;
+    }
+    _cur_req_count = 0;
+    _cur_file_size = 0;
+    _cur_offsets.clear();
+}
+
 bool RpcDumpContext::Serialize(butil::IOBuf& buf, SampledRequest* sample) {
+    butil::IOBuf body;
+    {
+        butil::IOBufAsZeroCopyOutputStream body_stream(&body);
+        if (!sample->SerializeToZeroCopyStream(&body_stream)) {
+            LOG(ERROR) << "Fail to serialize";
+            return false;
+        }
+    }
+    const size_t meta_size = body.size();
+    body.append(sample->request);
+    const char* magic = PLAIN_SAMPLE_MAGIC;
+    if (FLAGS_rpc_dump_zstd) {
+        butil::IOBuf compressed;
+        if (policy::ZstdCompress(body, &compressed)) {
+            magic = ZSTD_SAMPLE_MAGIC;
+            body.swap(compressed);
+        } else {
+            LOG_EVERY_SECOND(WARNING) << "Fail to compress dumped requests "
+                "with zstd, is brpc built with zstd?";
+        }
+    }
+
     // Use the header of baidu_std.
-    char rpc_header[12];
-    butil::IOBuf::Area header_area = buf.reserve(sizeof(rpc_header));
-    
-    const size_t starting_size = buf.size();
-    butil::IOBufAsZeroCopyOutputStream buf_stream(&buf);
-    if (!sample->SerializeToZeroCopyStream(&buf_stream)) {
-        LOG(ERROR) << "Fail to serialize";
-        return false;
-    }
-    const size_t meta_size = buf.size() - starting_size;
-    buf.append(sample->request);
-
-    // dummy supresses strict-aliasing warning.
-    uint32_t* dummy = (uint32_t*)rpc_header;
-    *dummy = *(uint32_t*)"PRPC";
+    char rpc_header[RECORD_HEADER_SIZE];
+    memcpy(rpc_header, magic, 4);
     butil::RawPacker(rpc_header + 4)
-        .pack32(meta_size + sample->request.size())
+        .pack32(body.size())
         .pack32(meta_size);
-    CHECK_EQ(0, buf.unsafe_assign(header_area, rpc_header));
+    buf.append(rpc_header, sizeof(rpc_header));
+    buf.append(body.movable());
     return true;
 }
 
@@ -319,20 +389,51 @@ SampledRequest* SampleIterator::Next() {
     }
 }
 
+// Parse the record with `header' and `body'. Returns the sample which
+// should be deleted by caller, NULL on error.
+static SampledRequest* ParseSample(const char* header, butil::IOBuf* body) {
+    uint32_t body_size;
+    uint32_t meta_size;
+    butil::RawUnpacker(header + 4).unpack32(body_size).unpack32(meta_size);
+    if (memcmp(header, ZSTD_SAMPLE_MAGIC, 4) == 0) {
+        butil::IOBuf uncompressed;
+        if (!policy::ZstdDecompress(*body, &uncompressed)) {
+            LOG(ERROR) << "Fail to decompress dumped request with zstd";
+            return NULL;
+        }
+        body->swap(uncompressed);
+    }
+    if (meta_size > body->size()) {
+        LOG(ERROR) << "meta_size=" << meta_size << " is bigger than body_size="
+                   << body->size();
+        return NULL;
+    }
+    butil::IOBuf meta_buf;
+    body->cutn(&meta_buf, meta_size);
+    std::unique_ptr<SampledRequest> req(new SampledRequest);
+    if (!ParsePbFromIOBuf(req.get(), meta_buf)) {
+        LOG(ERROR) << "Fail to parse RpcDumpMeta";
+        return NULL;
+    }
+    req->request.swap(*body);
+    return req.release();
+}
+
 SampledRequest* SampleIterator::Pop(butil::IOBuf& buf, bool* format_error) {
-    char backing_buf[12];
+    char backing_buf[RECORD_HEADER_SIZE];
     const char* p = (const char*)buf.fetch(backing_buf, sizeof(backing_buf));
     if (NULL == p) {  // buf.length() < sizeof(backing_buf)
         return NULL;
     }
-    if (*(const uint32_t*)p != *(const uint32_t*)"PRPC") {
+    const bool is_index = (memcmp(p, SAMPLE_INDEX_MAGIC, 4) == 0);
+    if (!is_index && memcmp(p, PLAIN_SAMPLE_MAGIC, 4) != 0 &&
+        memcmp(p, ZSTD_SAMPLE_MAGIC, 4) != 0) {
         LOG(ERROR) << "Unmatched magic string";
         *format_error = true;
         return NULL;
     }
     uint32_t body_size;
-    uint32_t meta_size;
-    butil::RawUnpacker(p + 4).unpack32(body_size).unpack32(meta_size);
+    butil::RawUnpacker(p + 4).unpack32(body_size);
     if (body_size > FLAGS_max_body_size) {
         LOG(ERROR) << "Too big body=" << body_size;
         *format_error = true;
@@ -340,25 +441,127 @@ SampledRequest* SampleIterator::Pop(butil::IOBuf& buf, bool* format_error) {
     } else if (buf.length() < sizeof(backing_buf) + body_size) {
         return NULL;
     }
-    if (meta_size > body_size) {
-        LOG(ERROR) << "meta_size=" << meta_size << " is bigger than body_size="
-                   << body_size;
+    if (is_index) {
+        // Not needed for reading sequentially.
+        buf.pop_front(sizeof(backing_buf) + body_size);
+        return Pop(buf, format_error);
+    }
+    char header[RECORD_HEADER_SIZE];
+    memcpy(header, p, sizeof(header));
+    buf.pop_front(sizeof(header));
+    butil::IOBuf body;
+    buf.cutn(&body, body_size);
+    SampledRequest* req = ParseSample(header, &body);
+    if (req == NULL) {
         *format_error = true;
+    }
+    return req;
+}
+
+int SampleFile::Open(const std::string& path) {
+    _file.clear();
+    _offsets.clear();
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << path;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        PLOG(ERROR) << "Fail to fstat " << path;
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0 && _file.append_mapped_file(fd, 0, st.st_size) != 0) {
+        PLOG(ERROR) << "Fail to map " << path;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if (LoadIndex() != 0) {
+        ScanSamples();
+    }
+    return 0;
+}
+
+int SampleFile::LoadIndex() {
+    const size_t file_size = _file.size();
+    char buf[RECORD_HEADER_SIZE];
+    if (file_size < sizeof(buf) ||
+        _file.copy_to(buf, 4, file_size - 4) != 4) {
+        return -1;
+    }
+    uint32_t body_size;
+    butil::RawUnpacker(buf).unpack32(body_size);
+    if (body_size % 8 != 0 || body_size > file_size - sizeof(buf)) {
+        return -1;
+    }
+    const size_t index_offset = file_size - sizeof(buf) - body_size;
+    if (_file.copy_to(buf, 8, index_offset) != 8 ||
+        memcmp(buf, SAMPLE_INDEX_MAGIC, 4) != 0) {
+        return -1;
+    }
+    uint32_t header_body_size;
+    butil::RawUnpacker(buf + 4).unpack32(header_body_size);
+    if (header_body_size != body_size) {
+        return -1;
+    }
+    std::string index;
+    _file.copy_to(&index, body_size, index_offset + 8);
+    _offsets.resize(body_size / 8);
+    for (size_t i = 0; i < _offsets.size(); ++i) {
+        butil::RawUnpacker(index.data() + i * 8).unpack64(_offsets[i]);
+        if (_offsets[i] + RECORD_HEADER_SIZE > index_offset) {
+            LOG(ERROR) << "Invalid offset=" << _offsets[i] << " in the index";
+            _offsets.clear();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void SampleFile::ScanSamples() {
+    const size_t file_size = _file.size();
+    size_t offset = 0;
+    char header[RECORD_HEADER_SIZE];
+    while (_file.copy_to(header, sizeof(header), offset) == sizeof(header)) {
+        if (memcmp(header, PLAIN_SAMPLE_MAGIC, 4) != 0 &&
+            memcmp(header, ZSTD_SAMPLE_MAGIC, 4) != 0) {
+            break;
+        }
+        uint32_t body_size;
+        butil::RawUnpacker(header + 4).unpack32(body_size);
+        if (body_size > file_size - offset - sizeof(header)) {
+            break;  // Partially written.
+        }
+        _offsets.push_back(offset);
+        offset += sizeof(header) + body_size;
+    }
+}
+
+SampledRequest* SampleFile::Get(size_t index) const {
+    if (index >= _offsets.size()) {
         return NULL;
     }
-    buf.pop_front(sizeof(backing_buf));
-    butil::IOBuf meta_buf;
-    buf.cutn(&meta_buf, meta_size);
-    std::unique_ptr<SampledRequest> req(new SampledRequest);
-    if (!ParsePbFromIOBuf(req.get(), meta_buf)) {
-        LOG(ERROR) << "Fail to parse RpcDumpMeta";
-        *format_error = true;
+    const size_t offset = _offsets[index];
+    char header[RECORD_HEADER_SIZE];
+    if (_file.copy_to(header, sizeof(header), offset) != sizeof(header)) {
         return NULL;
     }
-    buf.cutn(&req->request, body_size - meta_size);
-    return req.release();
+    uint32_t body_size;
+    butil::RawUnpacker(header + 4).unpack32(body_size);
+    if (body_size > _file.size() - offset - sizeof(header)) {
+        LOG(ERROR) << "Too big body=" << body_size;
+        return NULL;
+    }
+    butil::IOBuf body;
+    _file.append_to(&body, body_size, offset + sizeof(header));
+    return ParseSample(header, &body);
 }
 
 #undef DUMPED_FILE_PREFIX
+#undef PLAIN_SAMPLE_MAGIC
+#undef ZSTD_SAMPLE_MAGIC
+#undef SAMPLE_INDEX_MAGIC
 
 } // namespace brpc
@@ -1386,6 +1386,190 @@ int RtmpStreamBase::SendUserMessage(void*) {
     return 0; 
 }
 
+int RtmpStreamBase::SendSharedMessage(
+    const butil::intrusive_ptr<RtmpSharedMessage>& msg) {
+    if (_rtmpsock == NULL) {
+        errno = EPERM;
+        return -1;
+    }
+    if (_chunk_stream_id == 0) {
+        LOG(ERROR) << __FUNCTION__ << " can't be called before play() is received";
+        errno = EPERM;
+        return -1;
+    }
+    if (msg == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (_paused && !msg->is_metadata()) {
+        errno = EPERM;
+        return -1;
+    }
+    SocketMessagePtr<policy::RtmpUnsentSharedMessage> msg2(
+        new policy::RtmpUnsentSharedMessage);
+    msg2->msg = msg;
+    msg2->chunk_stream_id = _chunk_stream_id;
+    msg2->stream_id = _message_stream_id;
+    return _rtmpsock->Write(msg2);
+}
+
+RtmpSharedMessage::RtmpSharedMessage(uint32_t timestamp, uint8_t message_type)
+    : _timestamp(timestamp)
+    , _message_type(message_type)
+    , _is_key_frame(false)
+    , _is_sequence_header(false)
+    , _is_metadata(false) {
+}
+
+RtmpSharedMessage::~RtmpSharedMessage() {}
+
+butil::intrusive_ptr<RtmpSharedMessage>
+RtmpSharedMessage::Create(const RtmpVideoMessage& msg) {
+    butil::intrusive_ptr<RtmpSharedMessage> m(
+        new RtmpSharedMessage(msg.timestamp, policy::RTMP_MESSAGE_VIDEO));
+    m->_is_sequence_header =
+        (msg.IsAVCSequenceHeader() || msg.IsHEVCSequenceHeader());
+    m->_is_key_frame = (!m->_is_sequence_header &&
+                        msg.frame_type == FLV_VIDEO_FRAME_KEYFRAME);
+    const char video_head = ((msg.frame_type & 0xF) << 4) | (msg.codec & 0xF);
+    m->_body.push_back(video_head);
+    m->_body.append(msg.data);
+    return m;
+}
+
+butil::intrusive_ptr<RtmpSharedMessage>
+RtmpSharedMessage::Create(const RtmpAudioMessage& msg) {
+    butil::intrusive_ptr<RtmpSharedMessage> m(
+        new RtmpSharedMessage(msg.timestamp, policy::RTMP_MESSAGE_AUDIO));
+    m->_is_sequence_header = msg.IsAACSequenceHeader();
+    const char audio_head =
+        ((msg.codec & 0xF) << 4)
+        | ((msg.rate & 0x3) << 2)
+        | ((msg.bits & 0x1) << 1)
+        | (msg.type & 0x1);
+    m->_body.push_back(audio_head);
+    m->_body.append(msg.data);
+    return m;
+}
+
+butil::intrusive_ptr<RtmpSharedMessage>
+RtmpSharedMessage::Create(const RtmpMetaData& metadata,
+                          const butil::StringPiece& name) {
+    butil::intrusive_ptr<RtmpSharedMessage> m(
+        new RtmpSharedMessage(metadata.timestamp,
+                              policy::RTMP_MESSAGE_DATA_AMF0));
+    m->_is_metadata = true;
+    {
+        butil::IOBufAsZeroCopyOutputStream zc_stream(&m->_body);
+        AMFOutputStream ostream(&zc_stream);
+        WriteAMFString(name, &ostream);
+        WriteAMFObject(metadata.data, &ostream);
+        if (!ostream.good()) {
+            LOG(ERROR) << "Fail to serialize metadata";
+            return NULL;
+        }
+    }
+    return m;
+}
+
+void RtmpSharedMessage::AppendChunks(uint32_t chunk_size,
+                                     uint32_t chunk_stream_id,
+                                     uint32_t message_stream_id,
+                                     butil::IOBuf* out) {
+    BAIDU_SCOPED_LOCK(_chunks_mutex);
+    for (size_t i = 0; i < _chunks_list.size(); ++i) {
+        const Chunks& c = _chunks_list[i];
+        if (c.chunk_size == chunk_size &&
+            c.chunk_stream_id == chunk_stream_id &&
+            c.message_stream_id == message_stream_id) {
+            out->append(c.data);
+            return;
+        }
+    }
+    _chunks_list.push_back(Chunks());
+    Chunks& c = _chunks_list.back();
+    c.chunk_size = chunk_size;
+    c.chunk_stream_id = chunk_stream_id;
+    c.message_stream_id = message_stream_id;
+    policy::RtmpMessageHeader mh;
+    mh.timestamp = _timestamp;
+    mh.message_length = _body.size();
+    mh.message_type = _message_type;
+    mh.stream_id = message_stream_id;
+    policy::SerializeRtmpChunksFromScratch(
+        &c.data, mh, chunk_stream_id, chunk_size, _body);
+    out->append(c.data);
+}
+
+RtmpGopCache::RtmpGopCache(size_t max_messages)
+    : _max_messages(max_messages) {
+}
+
+RtmpGopCache::~RtmpGopCache() {}
+
+void RtmpGopCache::Add(const butil::intrusive_ptr<RtmpSharedMessage>& msg) {
+    if (msg == NULL) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (msg->is_metadata()) {
+        _metadata = msg;
+    } else if (msg->is_sequence_header()) {
+        if (msg->message_type() == policy::RTMP_MESSAGE_VIDEO) {
+            _video_sequence_header = msg;
+        } else {
+            _audio_sequence_header = msg;
+        }
+    } else if (msg->is_key_frame()) {
+        _gop.clear();
+        _gop.push_back(msg);
+    } else if (!_gop.empty()) {
+        // Messages before the first key frame are useless to new players.
+        if (_gop.size() >= _max_messages) {
+            _gop.clear();
+        } else {
+            _gop.push_back(msg);
+        }
+    }
+}
+
+int RtmpGopCache::SendTo(RtmpStreamBase* stream) const {
+    std::vector<butil::intrusive_ptr<RtmpSharedMessage> > msgs;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        msgs.reserve(_gop.size() + 3);
+        if (_metadata) {
+            msgs.push_back(_metadata);
+        }
+        if (_video_sequence_header) {
+            msgs.push_back(_video_sequence_header);
+        }
+        if (_audio_sequence_header) {
+            msgs.push_back(_audio_sequence_header);
+        }
+        msgs.insert(msgs.end(), _gop.begin(), _gop.end());
+    }
+    for (size_t i = 0; i < msgs.size(); ++i) {
+        if (stream->SendSharedMessage(msgs[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+size_t RtmpGopCache::gop_size() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _gop.size();
+}
+
+void RtmpGopCache::Clear() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _metadata.reset();
+    _video_sequence_header.reset();
+    _audio_sequence_header.reset();
+    _gop.clear();
+}
+
 int RtmpStreamBase::SendVideoMessage(const RtmpVideoMessage& msg) {
     if (_rtmpsock == NULL) {
         errno = EPERM;
@@ -18,8 +18,10 @@
 #ifndef BRPC_RTMP_H
 #define BRPC_RTMP_H
 
+#include <vector>
 #include "butil/strings/string_piece.h"   // butil::StringPiece
 #include "butil/endpoint.h"               // butil::EndPoint
+#include "butil/synchronization/lock.h"   // butil::Mutex
 #include "brpc/shared_object.h"          // SharedObject, intrusive_ptr
 #include "brpc/socket_id.h"              // SocketUniquePtr
 #include "brpc/controller.h"             // Controller, IOBuf
@@ -37,6 +39,7 @@ class OnServerStreamCreated;
 class RtmpClientImpl;
 class RtmpClientStream;
 class RtmpServerStream;
+class RtmpStreamBase;
 class StatusService;
 
 // ======= Audio =======
@@ -499,6 +502,99 @@ enum RtmpLimitType {
     RTMP_LIMIT_DYNAMIC = 2
 };
 
+// A media message shared by players of a live stream. Chunks of the message
+// are serialized once for each combination of chunk size and chunk/message
+// stream ids of the players, and blocks of the chunks are referenced by all
+// players rather than copied.
+// Example:
+//   butil::intrusive_ptr<RtmpSharedMessage> msg =
+//       RtmpSharedMessage::Create(video_msg);
+//   gop_cache.Add(msg);
+//   for (each player) {
+//       player->SendSharedMessage(msg);
+//   }
+class RtmpSharedMessage : public SharedObject {
+public:
+    // Returns NULL on error.
+    static butil::intrusive_ptr<RtmpSharedMessage> Create(
+        const RtmpVideoMessage& msg);
+    static butil::intrusive_ptr<RtmpSharedMessage> Create(
+        const RtmpAudioMessage& msg);
+    static butil::intrusive_ptr<RtmpSharedMessage> Create(
+        const RtmpMetaData& metadata,
+        const butil::StringPiece& name = "onMetaData");
+
+    uint32_t timestamp() const { return _timestamp; }
+    uint8_t message_type() const { return _message_type; }
+    const butil::IOBuf& body() const { return _body; }
+
+    // True iff this message is a video key frame(not sequence header).
+    bool is_key_frame() const { return _is_key_frame; }
+    // True iff this message is a sequence header of AVC/HEVC/AAC.
+    bool is_sequence_header() const { return _is_sequence_header; }
+    bool is_metadata() const { return _is_metadata; }
+
+    // Append chunks of this message into `out'. The first chunk is always
+    // type-0 so that the chunks do not depend on previous messages.
+    void AppendChunks(uint32_t chunk_size, uint32_t chunk_stream_id,
+                      uint32_t message_stream_id, butil::IOBuf* out);
+
+private:
+    RtmpSharedMessage(uint32_t timestamp, uint8_t message_type);
+    ~RtmpSharedMessage();
+
+    struct Chunks {
+        uint32_t chunk_size;
+        uint32_t chunk_stream_id;
+        uint32_t message_stream_id;
+        butil::IOBuf data;
+    };
+    uint32_t _timestamp;
+    uint8_t _message_type;
+    bool _is_key_frame;
+    bool _is_sequence_header;
+    bool _is_metadata;
+    butil::IOBuf _body;
+    // Players generally share few chunk sizes, a vector is enough.
+    butil::Mutex _chunks_mutex;
+    std::vector<Chunks> _chunks_list;
+};
+
+// Messages of a live stream since the latest key frame(the GOP), along with
+// latest metadata and sequence headers, for new players to start from a key
+// frame immediately rather than waiting for the next one.
+// Thread-safe.
+class RtmpGopCache {
+public:
+    // At most `max_messages' messages are cached, the GOP is dropped when
+    // it's too long and new players wait for the next key frame.
+    explicit RtmpGopCache(size_t max_messages = 4096);
+    ~RtmpGopCache();
+
+    // Add a message published to the live stream.
+    void Add(const butil::intrusive_ptr<RtmpSharedMessage>& msg);
+
+    // Send metadata, sequence headers and messages of the GOP to `stream',
+    // generally a player just created.
+    // Returns 0 on success, -1 otherwise.
+    int SendTo(RtmpStreamBase* stream) const;
+
+    // Number of cached messages in the GOP.
+    size_t gop_size() const;
+
+    void Clear();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RtmpGopCache);
+
+    size_t _max_messages;
+    mutable butil::Mutex _mutex;
+    butil::intrusive_ptr<RtmpSharedMessage> _metadata;
+    butil::intrusive_ptr<RtmpSharedMessage> _video_sequence_header;
+    butil::intrusive_ptr<RtmpSharedMessage> _audio_sequence_header;
+    std::vector<butil::intrusive_ptr<RtmpSharedMessage> > _gop;
+};
+
 // The common part of RtmpClientStream and RtmpServerStream.
 class RtmpStreamBase : public SharedObject 
                      , public Destroyable {
@@ -547,6 +643,10 @@ public:
     virtual int SendAVCMessage(const RtmpAVCMessage& msg);
     // msg is owned by the caller of this function
     virtual int SendUserMessage(void* msg);
+    // Send a message shared with other streams, namely chunks of the message
+    // are not serialized again if another stream with same chunk size and
+    // ids sent it before.
+    int SendSharedMessage(const butil::intrusive_ptr<RtmpSharedMessage>& msg);
 
     // Send a message to the peer to make it stop. The concrete message depends
     // on implementation of the stream.
@@ -21,12 +21,15 @@
 #include <arpa/inet.h>                              // inet_aton
 #include <fcntl.h>                                  // O_CREAT
 #include <sys/stat.h>                               // mkdir
+#include <sys/epoll.h>                              // EPOLLIN
 #include <gflags/gflags.h>
 #include <google/protobuf/descriptor.h>             // ServiceDescriptor
 #include "idl_options.pb.h"                         // option(idl_support)
 #include "bthread/unstable.h"                       // bthread_keytable_pool_init
 #include "butil/macros.h"                            // ARRAY_SIZE
 #include "butil/fd_guard.h"                          // fd_guard
+#include "butil/fd_utility.h"                        // make_non_blocking
+#include "butil/unix_socket.h"                       // unix_socket_listen
 #include "butil/logging.h"                           // CHECK
 #include "butil/time.h"
 #include "butil/class_name.h"
@@ -38,9 +41,13 @@
 #include "brpc/socket_map.h"                   // SocketMapList
 #include "brpc/acceptor.h"                     // Acceptor
 #include "brpc/details/ssl_helper.h"           // CreateServerSSLContext
+#include "brpc/details/hot_restart.h"          // HandedOverSockets
+#include "brpc/details/pb_arena.h"             // IsPBArenaSupported
 #include "brpc/protocol.h"                     // ListProtocols
 #include "brpc/nshead_service.h"               // NsheadService
+#include "brpc/tenant_quota.h"                // TenantQuotas
 #include "brpc/thrift_service.h"               // ThriftService
+#include "brpc/redis.h"                        // RedisService
 #include "brpc/builtin/bad_method_service.h"   // BadMethodService
 #include "brpc/builtin/get_favicon_service.h"
 #include "brpc/builtin/get_js_service.h"
@@ -62,12 +69,17 @@
 #include "brpc/builtin/ids_service.h"          // IdsService
 #include "brpc/builtin/sockets_service.h"      // SocketsService
 #include "brpc/builtin/hotspots_service.h"     // HotspotsService
+#include "brpc/builtin/prometheus_metrics_service.h" // PrometheusMetricsService
 #include "brpc/details/method_status.h"
+#include "brpc/details/response_cache.h"
+#include "brpc/details/request_coalescer.h"
+#include "brpc/details/usercode_pool.h"
 #include "brpc/load_balancer.h"
 #include "brpc/naming_service.h"
 #include "brpc/simple_data_pool.h"
 #include "brpc/server.h"
 #include "brpc/trackme.h"
+#include "brpc/bvar_push.h"
 #include "brpc/restful.h"
 #include "brpc/rtmp.h"
 #include "brpc/builtin/common.h"               // GetProgramName
@@ -106,12 +118,25 @@ butil::static_atomic<int> g_running_server_count = BUTIL_STATIC_ATOMIC_INIT(0);
 DEFINE_bool(reuse_addr, true, "Bind to ports in TIME_WAIT state");
 BRPC_VALIDATE_GFLAG(reuse_addr, PassValidate);
 
+DEFINE_bool(reuse_port, false, "Listen to the port with -event_dispatcher_num "
+            "sockets using SO_REUSEPORT, connections accepted from the i-th "
+            "socket are handled by the i-th event dispatcher");
+DEFINE_bool(reuse_port_incoming_cpu, false, "Set SO_INCOMING_CPU of the i-th "
+            "listening socket to i so that connections received on cpu i "
+            "prefer the i-th socket. Only works with -reuse_port");
+
+DEFINE_int32(hot_restart_drain_timeout_ms, 10000, "Max time of draining "
+             "connections after listening sockets were handed over to the "
+             "hot-restarted process, the server is asked to quit after that");
+BRPC_VALIDATE_GFLAG(hot_restart_drain_timeout_ms, NonNegativeInteger);
+
 // Following services may have security issues and are disabled by default.
 DEFINE_bool(enable_dir_service, false, "Enable /dir");
 DEFINE_bool(enable_threads_service, false, "Enable /threads");
 
 DECLARE_int32(usercode_backup_threads);
 DECLARE_bool(usercode_in_pthread);
+DECLARE_int32(event_dispatcher_num);
 
 const int INITIAL_SERVICE_CAP = 64;
 const int INITIAL_CERT_MAP = 64;
@@ -124,10 +149,12 @@ ServerOptions::ServerOptions()
     , nshead_service(NULL)
     , thrift_service(NULL)
     , mongo_service_adaptor(NULL)
+    , redis_service(NULL)
     , auth(NULL)
     , server_owns_auth(false)
     , num_threads(8)
     , max_concurrency(0)
+    , tenant_quotas(NULL)
     , session_local_data_factory(NULL)
     , reserved_session_local_data(0)
     , thread_local_data_factory(NULL)
@@ -135,12 +162,14 @@ ServerOptions::ServerOptions()
     , bthread_init_fn(NULL)
     , bthread_init_args(NULL)
     , bthread_init_count(0)
+    , bthread_tag(BTHREAD_TAG_DEFAULT)
     , internal_port(-1) 
     , has_builtin_services(true)
     , http_master_service(NULL)
     , health_reporter(NULL)
     , rtmp_service(NULL) 
-    , use_rdma(false) {
+    , use_rdma(false)
+    , use_shm(false) {
     if (s_ncore > 0) {
         num_threads = s_ncore + 1;
     }
@@ -149,7 +178,8 @@ ServerOptions::ServerOptions()
 Server::MethodProperty::OpaqueParams::OpaqueParams()
     : is_tabbed(false)
     , allow_http_body_to_pb(true)
-    , pb_bytes_to_base64(false) {
+    , pb_bytes_to_base64(false)
+    , enable_progressive_read(false) {
 }
 
 Server::MethodProperty::MethodProperty()
@@ -216,7 +246,7 @@ static void PrintEnabledProfilers(std::ostream& os, void*) {
             os << "heap(no TCMALLOC_SAMPLE_PARAMETER in env) ";
         }
     }
-    os << "contention";
+    os << "contention offcpu";
 }
 
 static bvar::PassiveStatus<std::string> s_lb_st(
@@ -262,6 +292,10 @@ static bvar::Vector<unsigned, 2> GetSessionLocalDataCount(void* arg) {
 }
 
 std::string Server::ServerPrefix() const {
+    if (butil::is_unix_endpoint(listen_address())) {
+        return butil::string_printf("rpc_server_unix_%d",
+                                    listen_address().port);
+    }
     return butil::string_printf("rpc_server_%d", listen_address().port);
 }
 
@@ -311,6 +345,9 @@ void* Server::UpdateDerivedVars(void* arg) {
     if (server->options().nshead_service) {
         server->options().nshead_service->Expose(prefix);
     }
+    if (server->options().tenant_quotas) {
+        server->options().tenant_quotas->Expose(prefix);
+    }
 
 #ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
     if (server->options().thrift_service) {
@@ -382,6 +419,9 @@ Server::Server(ProfilerLinker)
     , _global_restful_map(NULL)
     , _last_start_time(0)
     , _derivative_thread(INVALID_BTHREAD)
+    , _hot_restart_fd(-1)
+    , _hot_restart_thread(INVALID_BTHREAD)
+    , _handed_over(false)
     , _keytable_pool(NULL)
     , _concurrency(0) {
     BAIDU_CASSERT(offsetof(Server, _concurrency) % 64 == 0,
@@ -405,6 +445,9 @@ Server::~Server() {
     _options.thrift_service = NULL;
 #endif
 
+    delete _options.redis_service;
+    _options.redis_service = NULL;
+
     delete _options.http_master_service;
     _options.http_master_service = NULL;
     
@@ -522,6 +565,10 @@ int Server::AddBuiltinServices() {
         LOG(ERROR) << "Fail to add GetJsService";
         return -1;
     }
+    if (AddBuiltinService(new (std::nothrow) PrometheusMetricsService)) {
+        LOG(ERROR) << "Fail to add PrometheusMetricsService";
+        return -1;
+    }
     return 0;
 }
 
@@ -542,11 +589,13 @@ Acceptor* Server::BuildAcceptor() {
         whitelist.insert(protocol);
     }
     const bool has_whitelist = !whitelist.empty();
-    Acceptor* acceptor = new (std::nothrow) Acceptor(_keytable_pool);
+    Acceptor* acceptor = new (std::nothrow) Acceptor(
+        _keytable_pool, _options.bthread_tag);
     if (NULL == acceptor) {
         LOG(ERROR) << "Fail to new Acceptor";
         return NULL;
     }
+    acceptor->set_use_shm(_options.use_shm);
     InputMessageHandler handler;
     std::vector<Protocol> protocols;
     ListProtocols(&protocols);
@@ -663,6 +712,44 @@ static int get_port_from_fd(int fd) {
     return ntohs(addr.sin_port);
 }
 
+static int TakeFd(int* fd) {
+    const int taken = *fd;
+    *fd = -1;
+    return taken;
+}
+
+static void SetIncomingCpu(int fd, int cpu) {
+#if defined(SO_INCOMING_CPU)
+    if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0) {
+        PLOG(WARNING) << "Fail to set SO_INCOMING_CPU of fd=" << fd
+                      << " to " << cpu;
+    }
+#else
+    LOG_ONCE(WARNING) << "SO_INCOMING_CPU is not supported";
+#endif
+}
+
+// Add more sockets listening to `pt' with SO_REUSEPORT into `listened_fds'
+// which has the first one, so that each event dispatcher has one.
+static void ListenReusePortShards(const butil::EndPoint& pt,
+                                  std::vector<int>* listened_fds) {
+    const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < FLAGS_event_dispatcher_num; ++i) {
+        const int fd = tcp_listen(pt, FLAGS_reuse_addr, true);
+        if (fd < 0) {
+            // Not fatal, connections are accepted by other sockets.
+            PLOG(WARNING) << "Fail to listen " << pt << " with SO_REUSEPORT";
+            break;
+        }
+        listened_fds->push_back(fd);
+    }
+    if (FLAGS_reuse_port_incoming_cpu && ncpu > 0) {
+        for (size_t i = 0; i < listened_fds->size(); ++i) {
+            SetIncomingCpu((*listened_fds)[i], i % ncpu);
+        }
+    }
+}
+
 #ifdef BRPC_RDMA
 static bool OptionsAvailableOverRdma(const ServerOptions* opt) {
     if (opt->rtmp_service) {
@@ -730,6 +817,12 @@ int Server::StartInternal(const butil::ip_t& ip,
 #endif
     }
 
+    if (bthread_getconcurrency_by_tag(_options.bthread_tag) < 0) {
+        LOG(ERROR) << "Invalid bthread_tag=" << _options.bthread_tag
+                   << ", must be in [0, -task_group_ntags)";
+        return -1;
+    }
+
     if (_options.http_master_service) {
         // Check requirements for http_master_service:
         //  has "default_method" & request/response have no fields
@@ -753,6 +846,17 @@ int Server::StartInternal(const butil::ip_t& ip,
         }
     }
 
+    for (MethodMap::iterator it = _method_map.begin();
+         it != _method_map.end(); ++it) {
+        MethodStatus* st = it->second.status;
+        if (st != NULL && !it->second.is_builtin_service &&
+            st->SetConcurrencyLimiter() != 0) {
+            LOG(ERROR) << "Fail to set max_concurrency of method="
+                       << it->first << " to " << st->max_concurrency();
+            return -1;
+        }
+    }
+
     // CAUTION:
     //   Following code may run multiple times if this server is started and
     //   stopped more than once. Reuse or delete previous resources!
@@ -814,6 +918,7 @@ int Server::StartInternal(const butil::ip_t& ip,
             init_args[i].stop = false;
             bthread_attr_t tmp = BTHREAD_ATTR_NORMAL;
             tmp.keytable_pool = _keytable_pool;
+            tmp.tag = _options.bthread_tag;
             if (bthread_start_background(
                     &init_args[i].th, &tmp, BthreadInitEntry, &init_args[i]) != 0) {
                 break;
@@ -902,7 +1007,11 @@ int Server::StartInternal(const butil::ip_t& ip,
         if (_options.num_threads < BTHREAD_MIN_CONCURRENCY) {
             _options.num_threads = BTHREAD_MIN_CONCURRENCY;
         }
-        bthread_setconcurrency(_options.num_threads);
+        // Workers are shared by all servers and channels in the process,
+        // never reduce them.
+        if (_options.num_threads > bthread_getconcurrency()) {
+            bthread_setconcurrency(_options.num_threads);
+        }
     }
 
     // Create listening ports
@@ -911,10 +1020,36 @@ int Server::StartInternal(const butil::ip_t& ip,
                    << port_range.max_port << ']';
         return -1;
     }
+    int min_port = port_range.min_port;
+    int max_port = port_range.max_port;
+    // Take over listening sockets from the old process of hot restarts
+    // instead of listening to the port again.
+    HandedOverSockets handed;
+    _handed_over = false;
+    if (!_options.hot_restart_path.empty() &&
+        TakeOverListenedSockets(_options.hot_restart_path.c_str(),
+                                &handed) == 0) {
+        const int handed_port = get_port_from_fd(handed.fds[0]);
+        if (handed_port > 0 && (max_port == 0 ||
+            (handed_port >= min_port && handed_port <= max_port))) {
+            min_port = handed_port;
+            max_port = handed_port;
+        } else {
+            LOG(WARNING) << "Ignore listening sockets of port=" << handed_port
+                         << " handed over from "
+                         << _options.hot_restart_path;
+            handed.Reset();
+        }
+    }
     _listen_addr.ip = ip;
-    for (int port = port_range.min_port; port <= port_range.max_port; ++port) {
+    for (int port = min_port; port <= max_port; ++port) {
         _listen_addr.port = port;
-        butil::fd_guard sockfd(tcp_listen(_listen_addr, FLAGS_reuse_addr));
+        // SO_REUSEPORT is not supported by unix domain sockets.
+        const bool reuse_port =
+            FLAGS_reuse_port && !butil::is_unix_endpoint(_listen_addr);
+        butil::fd_guard sockfd(
+            !handed.fds.empty() ? TakeFd(&handed.fds[0]) :
+            tcp_listen(_listen_addr, FLAGS_reuse_addr, reuse_port));
         if (sockfd < 0) {
             if (port != port_range.max_port) { // not the last port, try next
                 continue;
@@ -958,10 +1093,22 @@ int Server::StartInternal(const butil::ip_t& ip,
         GenerateVersionIfNeeded();
         g_running_server_count.fetch_add(1, butil::memory_order_relaxed);
 
-        // Pass ownership of `sockfd' to `_am'
-        if (_am->StartAccept(sockfd, rh.get(), _options.idle_timeout_sec,
+        std::vector<int> listened_fds(1, sockfd);
+        if (!handed.fds.empty()) {
+            // Shards listening with SO_REUSEPORT in the old process
+            listened_fds.insert(listened_fds.end(),
+                                handed.fds.begin() + 1, handed.fds.end());
+            handed.fds.clear();
+        } else if (FLAGS_reuse_port && !butil::is_unix_endpoint(_listen_addr)) {
+            ListenReusePortShards(_listen_addr, &listened_fds);
+        }
+        // Pass ownership of `sockfd' and shards to `_am'
+        if (_am->StartAccept(listened_fds, rh.get(), _options.idle_timeout_sec,
                              _default_ssl_ctx) != 0) {
             LOG(ERROR) << "Fail to start acceptor";
+            for (size_t i = 1; i < listened_fds.size(); ++i) {
+                close(listened_fds[i]);
+            }
             return -1;
         }
         sockfd.release();
@@ -969,6 +1116,11 @@ int Server::StartInternal(const butil::ip_t& ip,
         break; // stop trying
     }
     if (_options.internal_port >= 0 && _options.has_builtin_services) {
+        if (butil::is_unix_endpoint(_listen_addr)) {
+            LOG(ERROR) << "ServerOptions.internal_port is not supported by "
+                "server listening to " << _listen_addr;
+            return -1;
+        }
         if (_options.internal_port  == _listen_addr.port) {
             LOG(ERROR) << "ServerOptions.internal_port=" << _options.internal_port
                        << " is same with port=" << _listen_addr.port << " to Start()";
@@ -991,7 +1143,11 @@ int Server::StartInternal(const butil::ip_t& ip,
         }
         butil::EndPoint internal_point = _listen_addr;
         internal_point.port = _options.internal_port;
-        butil::fd_guard sockfd(tcp_listen(internal_point, FLAGS_reuse_addr));
+        const bool handed_internal = (handed.internal_fd >= 0 &&
+            get_port_from_fd(handed.internal_fd) == _options.internal_port);
+        butil::fd_guard sockfd(
+            handed_internal ? TakeFd(&handed.internal_fd) :
+            tcp_listen(internal_point, FLAGS_reuse_addr));
         if (sockfd < 0) {
             LOG(ERROR) << "Fail to listen " << internal_point << " (internal)";
             return -1;
@@ -1023,9 +1179,35 @@ int Server::StartInternal(const butil::ip_t& ip,
         return -1;
     }
 
+    if (!_options.hot_restart_path.empty()) {
+        const char* path = _options.hot_restart_path.c_str();
+        if (handed.conn >= 0 && AckHandOver(&handed) == 0) {
+            LOG(INFO) << "Took over listening sockets from " << path;
+        }
+        handed.Reset();
+        // Replace the path of the old process which closes its one after
+        // receiving the ack.
+        _hot_restart_fd = butil::unix_socket_listen(path, true);
+        if (_hot_restart_fd < 0) {
+            LOG(ERROR) << "Fail to listen hot-restart path=" << path;
+        } else if (butil::make_non_blocking(_hot_restart_fd) != 0 ||
+                   bthread_start_background(&_hot_restart_thread, NULL,
+                                            ServeHotRestart, this) != 0) {
+            LOG(ERROR) << "Fail to serve hot-restart path=" << path;
+            close(_hot_restart_fd);
+            _hot_restart_fd = -1;
+        }
+    }
+
     // Print tips to server launcher.
     int http_port = _listen_addr.port;
     std::ostringstream server_info;
+    if (butil::is_unix_endpoint(_listen_addr)) {
+        LOG(INFO) << "Server[" << version() << "] is serving on "
+                  << _listen_addr << '.';
+        revert_server.release();
+        return 0;
+    }
     server_info << "Server[" << version() << "] is serving on port="
                 << _listen_addr.port;
     if (_options.internal_port >= 0 && _options.has_builtin_services) {
@@ -1041,12 +1223,76 @@ int Server::StartInternal(const butil::ip_t& ip,
         LOG(WARNING) << "Builtin services are disabled according to "
             "ServerOptions.has_builtin_services";
     }
-    // For trackme reporting
+    // For trackme reporting and bvar pushing
     SetTrackMeAddress(butil::EndPoint(butil::my_ip(), http_port));
+    SetBvarPushAddress(butil::EndPoint(butil::my_ip(), http_port));
     revert_server.release();
     return 0;
 }
 
+void* Server::ServeHotRestart(void* arg) {
+    Server* server = static_cast<Server*>(arg);
+    const int listened_fd = server->_hot_restart_fd;
+    while (!bthread_stopped(bthread_self())) {
+        const timespec abstime = butil::milliseconds_from_now(500);
+        if (bthread_fd_timedwait(listened_fd, EPOLLIN, &abstime) != 0) {
+            if (errno == ETIMEDOUT || errno == EINTR || errno == ESTOP) {
+                continue;
+            }
+            PLOG(ERROR) << "Fail to wait for hot-restart path";
+            break;
+        }
+        butil::fd_guard conn(accept(listened_fd, NULL, NULL));
+        if (conn < 0) {
+            continue;
+        }
+        std::vector<int> fds;
+        server->_am->ListListenedFds(&fds);
+        const int internal_fd = (server->_internal_am ?
+                                 server->_internal_am->listened_fd() : -1);
+        if (HandOverListenedSockets(conn, fds, internal_fd) == 0) {
+            LOG(INFO) << "Server[" << server->version() << "] handed over "
+                "listening sockets to the hot-restarted process";
+            server->DrainAfterHandOver();
+            break;
+        }
+    }
+    server->_hot_restart_fd = -1;
+    bthread_close(listened_fd);
+    return NULL;
+}
+
+void Server::DrainAfterHandOver() {
+    // Make responses carry goaway hints (Connection: close).
+    _handed_over = true;
+    // Stop accepting without changing the status, so that requests still
+    // on the connections are processed rather than rejected as ELOGOFF.
+    // Connections are closed once in-flight requests on them are done,
+    // clients reconnect to the new process after that.
+    if (_am) {
+        _am->StopAccept(0);
+    }
+    if (_internal_am) {
+        _internal_am->StopAccept(0);
+    }
+    const int64_t deadline_us = butil::gettimeofday_us() +
+        FLAGS_hot_restart_drain_timeout_ms * 1000L;
+    while ((_am && _am->ConnectionCount() != 0) ||
+           (_internal_am && _internal_am->ConnectionCount() != 0)) {
+        if (butil::gettimeofday_us() >= deadline_us) {
+            LOG(WARNING) << "Server[" << version() << "] can't drain all "
+                "connections in " << FLAGS_hot_restart_drain_timeout_ms << "ms";
+            break;
+        }
+        if (bthread_usleep(10000) != 0) {
+            return;  // stopped
+        }
+    }
+    LOG(INFO) << "Server[" << version() << "] drained connections after "
+        "hand-over, ask to quit";
+    AskToQuit();
+}
+
 int Server::Start(const butil::EndPoint& endpoint, const ServerOptions* opt) {
     return StartInternal(
         endpoint.ip, PortRange(endpoint.port, endpoint.port), opt);
@@ -1092,6 +1338,9 @@ int Server::Stop(int timeout_ms) {
     
     LOG(INFO) << "Server[" << version() << "] is going to quit";
 
+    if (_hot_restart_thread != INVALID_BTHREAD) {
+        bthread_stop(_hot_restart_thread);
+    }
     if (_am) {
         _am->StopAccept(timeout_ms);
     }
@@ -1147,6 +1396,11 @@ int Server::Join() {
         bthread_join(_derivative_thread, NULL);
         _derivative_thread = INVALID_BTHREAD;
     }
+    if (_hot_restart_thread != INVALID_BTHREAD) {
+        bthread_stop(_hot_restart_thread);
+        bthread_join(_hot_restart_thread, NULL);
+        _hot_restart_thread = INVALID_BTHREAD;
+    }
     
     g_running_server_count.fetch_sub(1, butil::memory_order_relaxed);
     _status = READY;
@@ -1202,6 +1456,7 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
         mp.params.is_tabbed = !!tabbed;
         mp.params.allow_http_body_to_pb = svc_opt.allow_http_body_to_pb;
         mp.params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
+        mp.params.enable_progressive_read = svc_opt.enable_progressive_read;
         mp.service = service;
         mp.method = md;
         mp.status = new MethodStatus;
@@ -1288,6 +1543,7 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
                 params.is_tabbed = !!tabbed;
                 params.allow_http_body_to_pb = svc_opt.allow_http_body_to_pb;
                 params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
+                params.enable_progressive_read = svc_opt.enable_progressive_read;
                 if (!_global_restful_map->AddMethod(
                         mappings[i].path, service, params,
                         mappings[i].method_name, mp->status)) {
@@ -1325,6 +1581,7 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
             params.is_tabbed = !!tabbed;
             params.allow_http_body_to_pb = svc_opt.allow_http_body_to_pb;
             params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
+            params.enable_progressive_read = svc_opt.enable_progressive_read;
             if (!m->AddMethod(mappings[i].path, service, params,
                               mappings[i].method_name, mp->status)) {
                 LOG(ERROR) << "Fail to map `" << mappings[i].path << "' to `"
@@ -1383,6 +1640,7 @@ ServiceOptions::ServiceOptions()
 #else
     , pb_bytes_to_base64(true)
 #endif
+    , enable_progressive_read(false)
     {}
 
 int Server::AddService(google::protobuf::Service* service,
@@ -1579,7 +1837,8 @@ void Server::GenerateVersionIfNeeded() {
     if (!_version.empty()) {
         return;
     }
-    int extra_count = !!_options.nshead_service + !!_options.rtmp_service + !!_options.thrift_service;
+    int extra_count = !!_options.nshead_service + !!_options.rtmp_service +
+        !!_options.thrift_service + !!_options.redis_service;
     _version.reserve((extra_count + service_count()) * 20);
     for (ServiceMap::const_iterator it = _fullname_service_map.begin();
          it != _fullname_service_map.end(); ++it) {
@@ -1612,6 +1871,13 @@ void Server::GenerateVersionIfNeeded() {
         }
         _version.append(butil::class_name_str(*_options.rtmp_service));
     }
+
+    if (_options.redis_service) {
+        if (!_version.empty()) {
+            _version.push_back('+');
+        }
+        _version.append(butil::class_name_str(*_options.redis_service));
+    }
 }
 
 static std::string ExpandPath(const std::string &path) {
@@ -2021,9 +2287,9 @@ int Server::ResetMaxConcurrency(int max_concurrency) {
     return 0;
 }
 
-static int g_default_max_concurrency_of_method = 0;
+static AdaptiveMaxConcurrency g_default_max_concurrency_of_method;
 
-int& Server::MaxConcurrencyOf(MethodProperty* mp) {
+AdaptiveMaxConcurrency& Server::MaxConcurrencyOf(MethodProperty* mp) {
     if (mp->status == NULL) {
         LOG(ERROR) << "method=" << mp->method->full_name()
                    << " does not support max_concurrency";
@@ -2037,10 +2303,11 @@ int Server::MaxConcurrencyOf(const MethodProperty* mp) const {
     if (mp == NULL || mp->status == NULL) {
         return 0;
     }
-    return mp->status->max_concurrency();
+    return mp->status->MaxConcurrency();
 }
 
-int& Server::MaxConcurrencyOf(const butil::StringPiece& full_method_name) {
+AdaptiveMaxConcurrency& Server::MaxConcurrencyOf(
+    const butil::StringPiece& full_method_name) {
     MethodProperty* mp = _method_map.seek(full_method_name);
     if (mp == NULL) {
         LOG(ERROR) << "Fail to find method=" << full_method_name;
@@ -2054,8 +2321,9 @@ int Server::MaxConcurrencyOf(const butil::StringPiece& full_method_name) const {
     return MaxConcurrencyOf(_method_map.seek(full_method_name));
 }
 
-int& Server::MaxConcurrencyOf(const butil::StringPiece& full_service_name,
-                              const butil::StringPiece& method_name) {
+AdaptiveMaxConcurrency& Server::MaxConcurrencyOf(
+    const butil::StringPiece& full_service_name,
+    const butil::StringPiece& method_name) {
     MethodProperty* mp = const_cast<MethodProperty*>(
         FindMethodPropertyByFullName(full_service_name, method_name));
     if (mp == NULL) {
@@ -2073,8 +2341,9 @@ int Server::MaxConcurrencyOf(const butil::StringPiece& full_service_name,
                                 full_service_name, method_name));
 }
 
-int& Server::MaxConcurrencyOf(google::protobuf::Service* service,
-                              const butil::StringPiece& method_name) {
+AdaptiveMaxConcurrency& Server::MaxConcurrencyOf(
+    google::protobuf::Service* service,
+    const butil::StringPiece& method_name) {
     return MaxConcurrencyOf(service->GetDescriptor()->full_name(), method_name);
 }
 
@@ -2083,6 +2352,183 @@ int Server::MaxConcurrencyOf(google::protobuf::Service* service,
     return MaxConcurrencyOf(service->GetDescriptor()->full_name(), method_name);
 }
 
+int Server::SetHighPriority(const butil::StringPiece& full_method_name,
+                            bool high) {
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (mp->status == NULL) {
+        LOG(ERROR) << "method=" << full_method_name
+                   << " does not support priority";
+        return -1;
+    }
+    mp->status->set_high_priority(high);
+    return 0;
+}
+
+bool Server::IsHighPriority(const butil::StringPiece& full_method_name) const {
+    const MethodProperty* mp = _method_map.seek(full_method_name);
+    return mp != NULL && mp->status != NULL && mp->status->high_priority();
+}
+
+int Server::SetUseArena(const butil::StringPiece& full_method_name,
+                        bool use) {
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (mp->status == NULL) {
+        LOG(ERROR) << "method=" << full_method_name
+                   << " does not support arenas";
+        return -1;
+    }
+    if (use && !IsPBArenaSupported()) {
+        LOG(ERROR) << "Arenas are not supported by protobuf of this build";
+        return -1;
+    }
+    mp->status->set_use_arena(use);
+    return 0;
+}
+
+bool Server::IsUsingArena(const butil::StringPiece& full_method_name) const {
+    const MethodProperty* mp = _method_map.seek(full_method_name);
+    return mp != NULL && mp->status != NULL && mp->status->use_arena();
+}
+
+int Server::SetReuseMessages(const butil::StringPiece& full_method_name,
+                             bool reuse) {
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (mp->status == NULL || mp->service == NULL) {
+        LOG(ERROR) << "method=" << full_method_name
+                   << " does not support reusing messages";
+        return -1;
+    }
+    mp->status->SetReuseMessages(
+        reuse, &mp->service->GetRequestPrototype(mp->method),
+        &mp->service->GetResponsePrototype(mp->method));
+    return 0;
+}
+
+bool Server::IsReusingMessages(
+    const butil::StringPiece& full_method_name) const {
+    const MethodProperty* mp = _method_map.seek(full_method_name);
+    return mp != NULL && mp->status != NULL && mp->status->reuse_messages();
+}
+
+int Server::SetParseRequestLazily(const butil::StringPiece& full_method_name,
+                                  bool lazy) {
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (mp->status == NULL) {
+        LOG(ERROR) << "method=" << full_method_name
+                   << " does not support parsing requests lazily";
+        return -1;
+    }
+    mp->status->set_parse_request_lazily(lazy);
+    return 0;
+}
+
+bool Server::IsParsingRequestLazily(
+    const butil::StringPiece& full_method_name) const {
+    const MethodProperty* mp = _method_map.seek(full_method_name);
+    return mp != NULL && mp->status != NULL &&
+        mp->status->parse_request_lazily();
+}
+
+int Server::SetResponseCache(const butil::StringPiece& full_method_name,
+                             int ttl_ms, int64_t max_bytes) {
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (mp->status == NULL) {
+        LOG(ERROR) << "method=" << full_method_name
+                   << " does not support caching responses";
+        return -1;
+    }
+    if (ttl_ms > 0 && max_bytes <= 0) {
+        LOG(ERROR) << "max_bytes=" << max_bytes << " must be positive";
+        return -1;
+    }
+    mp->status->SetResponseCache(ttl_ms, max_bytes);
+    return 0;
+}
+
+bool Server::IsCachingResponses(
+    const butil::StringPiece& full_method_name) const {
+    const MethodProperty* mp = _method_map.seek(full_method_name);
+    return mp != NULL && mp->status != NULL &&
+        mp->status->response_cache() != NULL &&
+        mp->status->response_cache()->enabled();
+}
+
+int Server::SetCoalesceRequests(const butil::StringPiece& full_method_name,
+                                bool coalesce) {
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (mp->status == NULL) {
+        LOG(ERROR) << "method=" << full_method_name
+                   << " does not support coalescing requests";
+        return -1;
+    }
+    mp->status->SetCoalesceRequests(coalesce);
+    return 0;
+}
+
+bool Server::IsCoalescingRequests(
+    const butil::StringPiece& full_method_name) const {
+    const MethodProperty* mp = _method_map.seek(full_method_name);
+    return mp != NULL && mp->status != NULL &&
+        mp->status->request_coalescer() != NULL &&
+        mp->status->request_coalescer()->enabled();
+}
+
+int Server::SetUserCodePool(const butil::StringPiece& full_method_name,
+                            int min_threads, int max_threads,
+                            int max_queue_size) {
+    if (min_threads < 0 || max_threads < 0 || min_threads > max_threads ||
+        max_queue_size < 0) {
+        LOG(ERROR) << "Invalid min_threads=" << min_threads
+                   << " max_threads=" << max_threads
+                   << " max_queue_size=" << max_queue_size;
+        return -1;
+    }
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (mp->status == NULL) {
+        LOG(ERROR) << "method=" << full_method_name
+                   << " does not support usercode pool";
+        return -1;
+    }
+    mp->status->SetUserCodePool(min_threads, max_threads, max_queue_size);
+    return 0;
+}
+
+bool Server::IsUsingUserCodePool(
+    const butil::StringPiece& full_method_name) const {
+    const MethodProperty* mp = _method_map.seek(full_method_name);
+    return mp != NULL && mp->status != NULL &&
+        mp->status->usercode_pool() != NULL &&
+        mp->status->usercode_pool()->enabled();
+}
+
 #ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
 int Server::SSLSwitchCTXByHostname(struct ssl_st* ssl,
                                    int* al, Server* server) {
@@ -36,6 +36,7 @@
 #include "brpc/builtin/tabbed.h"
 #include "brpc/details/profiler_linker.h"
 #include "brpc/health_reporter.h"
+#include "brpc/adaptive_max_concurrency.h"
 
 extern "C" {
 struct ssl_ctx_st;
@@ -49,8 +50,10 @@ class NsheadService;
 class ThriftService;
 class SimpleDataPool;
 class MongoServiceAdaptor;
+class RedisService;
 class RestfulMap;
 class RtmpService;
+class TenantQuotas;
 
 struct ServerOptions {
     // Constructed with default options.
@@ -80,6 +83,11 @@ struct ServerOptions {
     // and must remain valid when server is running.
     const MongoServiceAdaptor* mongo_service_adaptor;
 
+    // Process redis commands, check src/brpc/redis.h for details.
+    // Owned by Server and deleted in server's destructor
+    // Default: NULL
+    RedisService* redis_service;
+
     // Turn on authentication for all services if `auth' is not NULL.
     // Default: NULL
     const Authenticator* auth;
@@ -116,6 +124,14 @@ struct ServerOptions {
     // Default: 0 (unlimited)
     int max_concurrency;
 
+    // Admit requests by quotas of their tenants(callers), check
+    // src/brpc/tenant_quota.h for details. Tenants share max_concurrency
+    // above fairly.
+    // Not owned by server and must remain valid when server is running.
+    // NOTE: accesses to builtin services are not limited by this option.
+    // Default: NULL
+    TenantQuotas* tenant_quotas;
+
     // -------------------------------------------------------
     // Differences between session-local and thread-local data
     // -------------------------------------------------------
@@ -174,6 +190,14 @@ struct ServerOptions {
     void* bthread_init_args;             // default: NULL
     size_t bthread_init_count;           // default: 0
 
+    // Run bthreads reading connections and processing requests of this
+    // server on workers of this tag only, which isolates the server from
+    // other servers and channels running on other tags. Number of tags is
+    // set by -task_group_ntags and workers of a tag are added by
+    // bthread_setconcurrency_by_tag().
+    // Default: BTHREAD_TAG_DEFAULT
+    bthread_tag_t bthread_tag;
+
     // Provide builtin services at this port rather than the port to Start().
     // When your server needs to be accessed from public (including traffic
     // redirected by nginx or other http front-end servers), set this port
@@ -227,6 +251,24 @@ struct ServerOptions {
     // Whether the server uses rdma or not
     // Default: false
     bool use_rdma;
+
+    // Accept shared memory proposed by local clients enabling
+    // ChannelOptions.use_shm. Proposals are refused if this is false.
+    // Default: false
+    bool use_shm;
+
+    // Path of the unix domain socket for hot restarts. If this field is set,
+    // Start() takes over listening sockets from the old process serving at
+    // the path(if any) instead of listening to the port again, then serves
+    // at the path to hand over the sockets to the next process. After the
+    // hand-over, the old process stops accepting, responds remaining
+    // requests with "Connection: close"(http) and closes the connections
+    // once in-flight requests are done, then is asked to quit as if SIGINT
+    // were received (checkout IsAskedToQuit()). Clients reconnect to the
+    // new process without the listening socket being closed, upgrading
+    // with zero downtime. The new process must listen to the same port.
+    // Default: "" (disabled)
+    std::string hot_restart_path;
 };
 
 // This struct is originally designed to contain basic statistics of the
@@ -274,6 +316,15 @@ struct ServiceOptions {
     // option is turned on.
     // Default: false if BAIDU_INTERNAL is defined, otherwise true
     bool pb_bytes_to_base64;
+
+    // If this flag is true, methods of the service are called once headers
+    // of HTTP/1.x requests are parsed, and the body is read progressively by
+    // Controller::ReadProgressiveAttachmentBy() inside the methods, which
+    // keeps memory of large uploads bounded. The request must not be
+    // converted from the body (pb schema is empty or allow_http_body_to_pb
+    // is false).
+    // Default: false
+    bool enable_progressive_read;
 };
 
 // Represent ports inside [min_port, max_port]
@@ -322,6 +373,7 @@ public:
             bool is_tabbed;
             bool allow_http_body_to_pb;
             bool pb_bytes_to_base64;
+            bool enable_progressive_read;
             OpaqueParams();
         };
         OpaqueParams params;        
@@ -452,6 +504,10 @@ public:
     // Return true iff this server is serving requests.
     bool IsRunning() const { return status() == RUNNING; }
 
+    // True if listening sockets were handed over to a hot-restarted process
+    // and connections of this server are being drained.
+    bool IsHandedOver() const { return _handed_over; }
+
     // Return the first service added to this server. If a service was once
     // returned by first_service() and then removed, first_service() will
     // always be NULL.
@@ -492,19 +548,128 @@ public:
     //    server.MaxConcurrencyOf("example.EchoService.Echo") = 10;
     // or server.MaxConcurrencyOf("example.EchoService", "Echo") = 10;
     // or server.MaxConcurrencyOf(&service, "Echo") = 10;
-    int& MaxConcurrencyOf(const butil::StringPiece& full_method_name);
+    // Set to "auto" to adjust the limit according to the peak qps and the
+    // latency without queueing, which are measured at runtime. Read
+    // docs/cn/server.md for details. Unlike constants which take effect
+    // immediately, limiters are created when the server starts.
+    // The const versions return current limit of concurrency.
+    AdaptiveMaxConcurrency& MaxConcurrencyOf(
+        const butil::StringPiece& full_method_name);
     int MaxConcurrencyOf(const butil::StringPiece& full_method_name) const;
     
-    int& MaxConcurrencyOf(const butil::StringPiece& full_service_name,
-                          const butil::StringPiece& method_name);
+    AdaptiveMaxConcurrency& MaxConcurrencyOf(
+        const butil::StringPiece& full_service_name,
+        const butil::StringPiece& method_name);
     int MaxConcurrencyOf(const butil::StringPiece& full_service_name,
                          const butil::StringPiece& method_name) const;
 
-    int& MaxConcurrencyOf(google::protobuf::Service* service,
-                          const butil::StringPiece& method_name);
+    AdaptiveMaxConcurrency& MaxConcurrencyOf(
+        google::protobuf::Service* service,
+        const butil::StringPiece& method_name);
     int MaxConcurrencyOf(google::protobuf::Service* service,
                          const butil::StringPiece& method_name) const;
 
+    // Get/set priority of a method. bthreads processing requests to methods
+    // of high priority are scheduled before other bthreads, so that
+    // latency-critical methods are not delayed by floods of batch requests.
+    // See BTHREAD_PRIORITY_HIGH in bthread/types.h for details.
+    // Example:
+    //    server.SetHighPriority("example.EchoService.Echo", true);
+    // Returns 0 on success, -1 otherwise.
+    int SetHighPriority(const butil::StringPiece& full_method_name, bool high);
+    bool IsHighPriority(const butil::StringPiece& full_method_name) const;
+
+    // Allocate request and response of a method on a protobuf Arena reused
+    // between RPCs, which saves malloc/free of messages with lots of nested
+    // messages or repeated fields. The messages are destroyed along with
+    // the arena after done->Run(), they must not be deleted or referenced
+    // after that. Only baidu_std supports this right now, requests with
+    // other protocols are allocated on heap.
+    // Example:
+    //    server.SetUseArena("example.EchoService.Echo", true);
+    // Returns 0 on success, -1 otherwise(e.g. protobuf < 3.0).
+    int SetUseArena(const butil::StringPiece& full_method_name, bool use);
+    bool IsUsingArena(const butil::StringPiece& full_method_name) const;
+
+    // Reuse request and response of a method between RPCs: they're Clear()-ed
+    // and put into pools of the method after done->Run() instead of being
+    // deleted, which saves allocations of small messages in high-QPS
+    // services. Memory of strings and repeated fields is kept by the pooled
+    // messages, don't enable this for methods with occasionally huge
+    // messages. Ignored when the method uses arenas. Only baidu_std supports
+    // this right now. Controllers can be reused by -reuse_server_controller.
+    // Example:
+    //    server.SetReuseMessages("example.EchoService.Echo", true);
+    // Returns 0 on success, -1 otherwise.
+    int SetReuseMessages(const butil::StringPiece& full_method_name,
+                         bool reuse);
+    bool IsReusingMessages(const butil::StringPiece& full_method_name) const;
+
+    // Don't parse requests of a method, the serialized requests are put in
+    // Controller.unparsed_request() which references the buffer received
+    // from network, and the request messages passed to the method are
+    // empty. Big bytes fields can be cut out by CutPbBytesField() and
+    // passed without copying, then the rest is parsed by ParsePbFromIOBuf().
+    // Requests compressed by types other than snappy, gzip, zlib, lz4 and
+    // zstd are rejected. Only baidu_std supports this right now, requests of other
+    // protocols are parsed as usual.
+    // Example:
+    //    server.SetParseRequestLazily("example.EchoService.Echo", true);
+    // Returns 0 on success, -1 otherwise.
+    int SetParseRequestLazily(const butil::StringPiece& full_method_name,
+                              bool lazy);
+    bool IsParsingRequestLazily(
+        const butil::StringPiece& full_method_name) const;
+
+    // Cache serialized responses of a method for `ttl_ms', which are keyed
+    // by hashes of serialized requests along with attachments and sent to
+    // identical requests directly without calling the method. Responses
+    // use at most `max_bytes' of memory, the least recently used ones are
+    // evicted. Only cache methods whose responses are decided by requests
+    // alone, failed calls and responses of streams are not cached. Only
+    // baidu_std supports this right now. Set `ttl_ms' to 0 to stop caching.
+    // Example:
+    //    server.SetResponseCache("example.EchoService.Echo", 1000, 64 << 20);
+    // Returns 0 on success, -1 otherwise.
+    int SetResponseCache(const butil::StringPiece& full_method_name,
+                         int ttl_ms, int64_t max_bytes);
+    bool IsCachingResponses(const butil::StringPiece& full_method_name) const;
+
+    // Coalesce concurrent identical requests of a method: while a request
+    // is being processed, following requests with the same hash of
+    // serialized request and attachment don't call the method but wait
+    // for the first one and are answered with its serialized response, or
+    // its error if it failed. Waiting requests still count in
+    // max_concurrency of the method. Only coalesce methods whose responses
+    // are decided by requests alone. Requests with streams are not
+    // coalesced. Only baidu_std supports this right now. Works along with
+    // SetResponseCache() which answers identical requests arriving after
+    // the first one is done.
+    // Example:
+    //    server.SetCoalesceRequests("example.EchoService.Echo", true);
+    // Returns 0 on success, -1 otherwise.
+    int SetCoalesceRequests(const butil::StringPiece& full_method_name,
+                            bool coalesce);
+    bool IsCoalescingRequests(
+        const butil::StringPiece& full_method_name) const;
+
+    // Run a method in a dedicated elastic pool of pthreads instead of
+    // bthread workers or the global pool of -usercode_in_pthread, so that
+    // a method blocking pthreads neither stalls the server nor other
+    // methods. The pool keeps `min_threads' threads and creates more on
+    // demand up to `max_threads', threads beyond `min_threads' quit after
+    // being idle for -usercode_pool_idle_timeout_ms. When all threads are
+    // busy, at most `max_queue_size' requests wait for threads, others are
+    // rejected with ELIMIT at once. Time waiting for threads is exposed as
+    // <method>_pool_wait_*. Only baidu_std supports this right now. Set
+    // `max_threads' to 0 to stop using the pool.
+    // Example:
+    //    server.SetUserCodePool("example.EchoService.Echo", 2, 16, 64);
+    // Returns 0 on success, -1 otherwise.
+    int SetUserCodePool(const butil::StringPiece& full_method_name,
+                        int min_threads, int max_threads, int max_queue_size);
+    bool IsUsingUserCodePool(const butil::StringPiece& full_method_name) const;
+
 private:
 friend class StatusService;
 friend class ProtobufsService;
@@ -547,6 +712,11 @@ friend class Controller;
 
     static void* UpdateDerivedVars(void*);
 
+    // Hand over listening sockets to new processes at hot_restart_path.
+    static void* ServeHotRestart(void*);
+    // Stop accepting and drain connections after the hand-over.
+    void DrainAfterHandOver();
+
     void GenerateVersionIfNeeded();
     void PutPidFileIfNeeded();
 
@@ -594,7 +764,7 @@ friend class Controller;
     static bool ResetCertMappings(CertMaps& bg, const SSLContextMap& ctx_map);
     static bool ClearCertMapping(CertMaps& bg);
 
-    int& MaxConcurrencyOf(MethodProperty*);
+    AdaptiveMaxConcurrency& MaxConcurrencyOf(MethodProperty*);
     int MaxConcurrencyOf(const MethodProperty*) const;
     
     DISALLOW_COPY_AND_ASSIGN(Server);
@@ -647,6 +817,11 @@ friend class Controller;
     std::string _version;
     time_t _last_start_time;
     bthread_t _derivative_thread;
+
+    // Listening to ServerOptions.hot_restart_path
+    int _hot_restart_fd;
+    bthread_t _hot_restart_thread;
+    bool _handed_over;
     
     bthread_keytable_pool_t* _keytable_pool;
 
@@ -19,6 +19,25 @@
 
 namespace brpc {
 
+std::string ServerId::zone() const {
+    static const char ZONE_PREFIX[] = "zone=";
+    static const size_t ZONE_PREFIX_LEN = sizeof(ZONE_PREFIX) - 1;
+    size_t begin = 0;
+    while (begin < tag.size()) {
+        size_t end = tag.find(',', begin);
+        if (end == std::string::npos) {
+            end = tag.size();
+        }
+        if (end - begin > ZONE_PREFIX_LEN &&
+            tag.compare(begin, ZONE_PREFIX_LEN, ZONE_PREFIX) == 0) {
+            return tag.substr(begin + ZONE_PREFIX_LEN,
+                              end - begin - ZONE_PREFIX_LEN);
+        }
+        begin = end + 1;
+    }
+    return std::string();
+}
+
 ServerId2SocketIdMapper::ServerId2SocketIdMapper() {
     _tmp.reserve(128);
     CHECK_EQ(0, _nref_map.init(128));
@@ -34,6 +34,11 @@ struct ServerId {
     ServerId(SocketId id_in, const std::string& tag_in)
         : id(id_in), tag(tag_in) {}
 
+    // Zone (e.g. availability zone) of the server, which is set in the tag
+    // as "zone=NAME", optionally along with other items separated by commas,
+    // say "zone=NAME,10". Returns empty string if the tag has no zone.
+    std::string zone() const;
+
     SocketId id;
     std::string tag;
 };
@@ -0,0 +1,380 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <inttypes.h>
+#include <string.h>
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "bthread/bthread.h"
+#include "butil/time.h"
+#include "butil/sys_byteorder.h"
+#include "butil/string_splitter.h"
+#include "brpc/policy/hasher.h"
+#include "brpc/policy/memcache_binary_header.h"
+#include "brpc/sharded_memcache_channel.h"
+
+namespace brpc {
+
+DECLARE_bool(usercode_in_pthread);
+namespace policy {
+DECLARE_int32(chash_num_replicas);
+}
+
+// Keys sent to one server.
+struct ShardedMemcacheChannel::SubCall {
+    SubCall() : nbatch(0) {}
+
+    MemcacheRequest request;
+    MemcacheResponse response;
+    Controller cntl;
+    // Number of MultiGet batches in `request'.
+    int nbatch;
+};
+
+struct ShardedMemcacheChannel::AsyncCall {
+    ShardedMemcacheChannel* channel;
+    Controller* cntl;
+    const MemcacheRequest* request;
+    MemcacheResponse* response;
+    google::protobuf::Closure* done;
+    CallId cid;
+};
+
+ShardedMemcacheChannel::ShardedMemcacheChannel()
+    : _hash(NULL) {
+}
+
+ShardedMemcacheChannel::~ShardedMemcacheChannel() {
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        delete _shards[i];
+    }
+    _shards.clear();
+}
+
+int ShardedMemcacheChannel::Init(const char* servers, const char* lb_name,
+                                 const ChannelOptions* options) {
+    if (!_shards.empty()) {
+        LOG(ERROR) << "ShardedMemcacheChannel=" << this << " was initialized";
+        return -1;
+    }
+    if (lb_name != NULL && strcmp(lb_name, "c_murmurhash") == 0) {
+        _hash = policy::MurmurHash32;
+    } else if (lb_name != NULL && strcmp(lb_name, "c_md5") == 0) {
+        _hash = policy::MD5Hash32;
+    } else if (lb_name != NULL && strcmp(lb_name, "c_wyhash") == 0) {
+        _hash = policy::WyHash32;
+    } else {
+        LOG(ERROR) << "Unsupported load balancer=`" << (lb_name ? lb_name : "")
+                   << "', must be c_murmurhash, c_md5 or c_wyhash";
+        return -1;
+    }
+    if (options) {
+        _options = *options;
+    }
+    _options.protocol = PROTOCOL_MEMCACHE;
+    std::vector<Channel*> shards;
+    std::vector<std::string> addrs;
+    std::vector<Node> ring;
+    bool ok = true;
+    for (butil::StringMultiSplitter sp(servers, ", "); sp; ++sp) {
+        const std::string addr(sp.field(), sp.length());
+        butil::EndPoint pt;
+        if (butil::hostname2endpoint(addr.c_str(), &pt) != 0) {
+            LOG(ERROR) << "Invalid memcached server=" << addr;
+            ok = false;
+            break;
+        }
+        Channel* chan = new Channel;
+        if (chan->Init(pt, &_options) != 0) {
+            LOG(ERROR) << "Fail to init channel to memcached server=" << addr;
+            delete chan;
+            ok = false;
+            break;
+        }
+        // Same virtual nodes as ConsistentHashingLoadBalancer.
+        for (int rep = 0; rep < policy::FLAGS_chash_num_replicas; ++rep) {
+            char host[32];
+            const int len = snprintf(host, sizeof(host), "%s-%d",
+                                     endpoint2str(pt).c_str(), rep);
+            Node node = { _hash(host, len), shards.size() };
+            ring.push_back(node);
+        }
+        shards.push_back(chan);
+        addrs.push_back(addr);
+    }
+    if (!ok || ring.empty()) {
+        for (size_t i = 0; i < shards.size(); ++i) {
+            delete shards[i];
+        }
+        LOG(ERROR) << "Fail to init ShardedMemcacheChannel with `"
+                   << servers << '\'';
+        return -1;
+    }
+    std::sort(ring.begin(), ring.end());
+    _shards.swap(shards);
+    _addrs.swap(addrs);
+    _ring.swap(ring);
+    return 0;
+}
+
+size_t ShardedMemcacheChannel::GetShard(const butil::StringPiece& key) const {
+    const Node code = { _hash(key.data(), key.size()), 0 };
+    std::vector<Node>::const_iterator it =
+        std::lower_bound(_ring.begin(), _ring.end(), code);
+    if (it == _ring.end()) {
+        it = _ring.begin();
+    }
+    return it->shard;
+}
+
+static const policy::MemcacheResponseHeader NOOP_RESPONSE_HEADER = {
+    policy::MC_MAGIC_RESPONSE, policy::MC_BINARY_NOOP, 0, 0,
+    policy::MC_BINARY_RAW_BYTES, 0, 0, 0, 0
+};
+
+void ShardedMemcacheChannel::RunMultiGet(Controller* cntl,
+                                         const MemcacheRequest& request,
+                                         MemcacheResponse* response) {
+    // Split keys of batches to servers, ops are referenced without copying.
+    std::vector<SubCall*> subcalls(_shards.size(), NULL);
+    int nbatch = 0;
+    bool in_batch = false;
+    butil::IOBuf buf = request.raw_buffer();
+    while (!buf.empty()) {
+        policy::MemcacheRequestHeader header;
+        if (buf.copy_to(&header, sizeof(header)) != sizeof(header)) {
+            cntl->SetFailed(EREQUEST, "Incomplete MemcacheRequest");
+            break;
+        }
+        const uint16_t key_length = butil::NetToHost16(header.key_length);
+        const uint32_t body_length = butil::NetToHost32(header.total_body_length);
+        if (buf.size() < sizeof(header) + body_length ||
+            key_length + header.extras_length > body_length) {
+            cntl->SetFailed(EREQUEST, "Incomplete MemcacheRequest");
+            break;
+        }
+        if (header.command == (uint8_t)policy::MC_BINARY_NOOP) {
+            buf.pop_front(sizeof(header) + body_length);
+            for (size_t i = 0; i < subcalls.size(); ++i) {
+                if (subcalls[i]) {
+                    subcalls[i]->request.MultiGet(NULL, 0);
+                    ++subcalls[i]->nbatch;
+                }
+            }
+            ++nbatch;
+            in_batch = false;
+            continue;
+        }
+        if (header.command != (uint8_t)policy::MC_BINARY_GETKQ) {
+            cntl->SetFailed(EREQUEST, "Only MultiGet is supported by "
+                            "ShardedMemcacheChannel, command=%d",
+                            (int)header.command);
+            break;
+        }
+        // Keys of memcached are not longer than 250 bytes.
+        char key_buf[512];
+        const size_t key_end = sizeof(header) + header.extras_length + key_length;
+        if (key_end > sizeof(key_buf)) {
+            cntl->SetFailed(EREQUEST, "Too long key_length=%d", (int)key_length);
+            break;
+        }
+        const char* p = (const char*)buf.fetch(key_buf, key_end);
+        const butil::StringPiece key(p + key_end - key_length, key_length);
+        SubCall*& sc = subcalls[GetShard(key)];
+        if (sc == NULL) {
+            sc = new SubCall;
+            // Align batches of all servers.
+            for (; sc->nbatch < nbatch; ++sc->nbatch) {
+                sc->request.MultiGet(NULL, 0);
+            }
+        }
+        buf.cutn(&sc->request._buf, sizeof(header) + body_length);
+        in_batch = true;
+    }
+    if (in_batch && !cntl->FailedInline()) {
+        cntl->SetFailed(EREQUEST, "MemcacheRequest is not made of MultiGet");
+    }
+
+    if (!cntl->FailedInline()) {
+        int64_t timeout_ms = cntl->timeout_ms();
+        if (timeout_ms == UNSET_MAGIC_NUM) {
+            timeout_ms = _options.timeout_ms;
+        }
+        for (size_t i = 0; i < subcalls.size(); ++i) {
+            SubCall* sc = subcalls[i];
+            if (sc == NULL) {
+                continue;
+            }
+            sc->cntl.set_timeout_ms(timeout_ms);
+            if (cntl->has_log_id()) {
+                sc->cntl.set_log_id(cntl->log_id());
+            }
+            _shards[i]->CallMethod(NULL, &sc->cntl, &sc->request,
+                                   &sc->response, DoNothing());
+        }
+        for (size_t i = 0; i < subcalls.size(); ++i) {
+            if (subcalls[i]) {
+                Join(subcalls[i]->cntl.call_id());
+            }
+        }
+    }
+
+    // Merge responses batch by batch.
+    butil::IOBuf merged;
+    for (size_t i = 0; i < subcalls.size() && !cntl->FailedInline(); ++i) {
+        if (subcalls[i] && subcalls[i]->cntl.Failed()) {
+            cntl->SetFailed(subcalls[i]->cntl.ErrorCode(),
+                            "Fail to access memcached server=%s: %s",
+                            _addrs[i].c_str(),
+                            subcalls[i]->cntl.ErrorText().c_str());
+        }
+    }
+    for (int b = 0; b < nbatch && !cntl->FailedInline(); ++b) {
+        for (size_t i = 0; i < subcalls.size(); ++i) {
+            if (subcalls[i] == NULL) {
+                continue;
+            }
+            butil::IOBuf& resbuf = subcalls[i]->response.raw_buffer();
+            while (true) {
+                policy::MemcacheResponseHeader header;
+                if (resbuf.copy_to(&header, sizeof(header)) != sizeof(header) ||
+                    resbuf.size() < sizeof(header) + header.total_body_length) {
+                    cntl->SetFailed(ERESPONSE, "Incomplete response from "
+                                    "memcached server=%s", _addrs[i].c_str());
+                    break;
+                }
+                if (header.command == (uint8_t)policy::MC_BINARY_NOOP) {
+                    resbuf.pop_front(sizeof(header) + header.total_body_length);
+                    break;
+                }
+                resbuf.cutn(&merged, sizeof(header) + header.total_body_length);
+            }
+        }
+        merged.append(&NOOP_RESPONSE_HEADER, sizeof(NOOP_RESPONSE_HEADER));
+    }
+    for (size_t i = 0; i < subcalls.size(); ++i) {
+        delete subcalls[i];
+    }
+    if (!cntl->FailedInline()) {
+        response->Clear();
+        response->raw_buffer().swap(merged);
+    }
+}
+
+void ShardedMemcacheChannel::CallMethod(
+    const google::protobuf::MethodDescriptor* /*method*/,
+    google::protobuf::RpcController* cntl_base,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    Controller* cntl = static_cast<Controller*>(cntl_base);
+    cntl->OnRPCBegin(butil::gettimeofday_us());
+    const CallId cid = cntl->call_id();
+    const int rc = bthread_id_lock(cid, NULL);
+    if (rc != 0) {
+        CHECK_EQ(EINVAL, rc);
+        if (!cntl->FailedInline()) {
+            cntl->SetFailed(EINVAL, "Fail to lock call_id=%" PRId64, cid.value);
+        }
+        LOG_IF(ERROR, cntl->is_used_by_rpc())
+            << "Controller=" << cntl << " was used by another RPC before. "
+            "Did you forget to Reset() it before reuse?";
+        // Have to run done in-place.
+        // Read comment in CallMethod() in channel.cpp for details.
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    cntl->set_used_by_rpc();
+
+    if (cntl->FailedInline()) {
+        // The call_id is cancelled before RPC.
+    } else if (_shards.empty()) {
+        cntl->SetFailed(EINVAL, "ShardedMemcacheChannel=%p is not initialized",
+                        this);
+    } else if (request == NULL ||
+               request->GetDescriptor() != MemcacheRequest::descriptor()) {
+        cntl->SetFailed(EREQUEST, "The request is not a MemcacheRequest");
+    } else if (response == NULL ||
+               response->GetDescriptor() != MemcacheResponse::descriptor()) {
+        cntl->SetFailed(EINVAL, "The response is not a MemcacheResponse");
+    } else if (done == NULL) {
+        RunMultiGet(cntl, *static_cast<const MemcacheRequest*>(request),
+                    static_cast<MemcacheResponse*>(response));
+    } else {
+        AsyncCall* call = new AsyncCall;
+        call->channel = this;
+        call->cntl = cntl;
+        call->request = static_cast<const MemcacheRequest*>(request);
+        call->response = static_cast<MemcacheResponse*>(response);
+        call->done = done;
+        call->cid = cid;
+        bthread_t th;
+        bthread_attr_t attr = (FLAGS_usercode_in_pthread ?
+                               BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL);
+        if (bthread_start_background(&th, &attr, RunAsyncCall, call) != 0) {
+            LOG(FATAL) << "Fail to start bthread";
+            RunAsyncCall(call);
+        }
+        return;
+    }
+    cntl->OnRPCEnd(butil::gettimeofday_us());
+    if (done) {
+        done->Run();
+    }
+    CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+}
+
+void* ShardedMemcacheChannel::RunAsyncCall(void* arg) {
+    AsyncCall* call = static_cast<AsyncCall*>(arg);
+    call->channel->RunMultiGet(call->cntl, *call->request, call->response);
+    Controller* cntl = call->cntl;
+    google::protobuf::Closure* done = call->done;
+    // Save call_id from the controller which may be deleted after Run().
+    const CallId cid = call->cid;
+    delete call;
+    cntl->OnRPCEnd(butil::gettimeofday_us());
+    done->Run();
+    CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+    return NULL;
+}
+
+int ShardedMemcacheChannel::CheckHealth() {
+    if (_shards.empty()) {
+        return -1;
+    }
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        ChannelBase* shard = _shards[i];
+        if (shard->CheckHealth() != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void ShardedMemcacheChannel::Describe(std::ostream& os,
+                                      const DescribeOptions&) const {
+    os << "ShardedMemcacheChannel[";
+    for (size_t i = 0; i < _addrs.size(); ++i) {
+        if (i) {
+            os << ',';
+        }
+        os << _addrs[i];
+    }
+    os << ']';
+}
+
+} // namespace brpc
@@ -0,0 +1,97 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_SHARDED_MEMCACHE_CHANNEL_H
+#define BRPC_SHARDED_MEMCACHE_CHANNEL_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include <string>
+#include <vector>
+#include "brpc/channel.h"
+#include "brpc/memcache.h"
+
+namespace brpc {
+
+// Access a pool of memcached servers sharded by consistent hashing of keys.
+// Keys of MemcacheRequest::MultiGet() are grouped by servers and sent in
+// parallel, values are merged into one MemcacheResponse which can be popped
+// by PopMultiGet() as if a single server were accessed.
+// Servers of keys are same as the ones chosen by a Channel with the same
+// load balancer and request_code set to the hash of the key(libmemcached
+// distributes keys in the same way), so that both ways can be mixed.
+// Notes:
+//  - Only requests made of MultiGet() are supported, send other operations
+//    with a Channel using the same load balancer.
+//  - The servers are fixed after Init().
+class ShardedMemcacheChannel : public ChannelBase {
+public:
+    ShardedMemcacheChannel();
+    ~ShardedMemcacheChannel();
+
+    // Access memcached servers in `servers', which is a list of "host:port"
+    // separated by commas or spaces. Keys are distributed by `lb_name' which
+    // is "c_murmurhash", "c_md5" or "c_wyhash". `protocol' of `options' is
+    // always memcache.
+    // Returns 0 on success, -1 otherwise.
+    int Init(const char* servers, const char* lb_name,
+             const ChannelOptions* options);
+
+    // `request' must be a MemcacheRequest and `response' must be a
+    // MemcacheResponse. If `done' is not NULL, this method returns
+    // immediately and `done->Run()' will be called when the call finishes,
+    // otherwise caller blocks until the call finishes.
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    // Index of the server storing `key'.
+    size_t GetShard(const butil::StringPiece& key) const;
+
+    size_t shard_count() const { return _shards.size(); }
+
+    int CheckHealth();
+
+    void Describe(std::ostream& os, const DescribeOptions&) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ShardedMemcacheChannel);
+
+    struct SubCall;
+    struct AsyncCall;
+    struct Node {
+        uint32_t hash;
+        size_t shard;
+        bool operator<(const Node& rhs) const { return hash < rhs.hash; }
+    };
+
+    void RunMultiGet(Controller* cntl, const MemcacheRequest& request,
+                     MemcacheResponse* response);
+    static void* RunAsyncCall(void* arg);
+
+    ChannelOptions _options;
+    uint32_t (*_hash)(const void* key, size_t len);
+    std::vector<std::string> _addrs;
+    std::vector<Channel*> _shards;
+    // Sorted virtual nodes of servers.
+    std::vector<Node> _ring;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_SHARDED_MEMCACHE_CHANNEL_H
@@ -0,0 +1,467 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <gflags/gflags.h>
+#include <butil/build_config.h>         // OS_LINUX
+#include <butil/fast_rand.h>            // butil::fast_rand
+#include <butil/fd_utility.h>           // butil::make_no_delay
+#include <butil/logging.h>
+#include "brpc/reloadable_flags.h"
+#include "brpc/socket.h"
+#include "brpc/details/iobuf_block_tag.h"
+#include "brpc/shm/shm_endpoint.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+namespace brpc {
+namespace shm {
+
+static bool validate_shm_ring_size(const char*, int32_t val) {
+    return val >= 4096 && val <= (64 << 20) && (val & (val - 1)) == 0;
+}
+DEFINE_int32(shm_ring_size, 1048576, "Bytes of each of the two rings "
+             "created for a connection using shared memory, must be a power "
+             "of 2 between 4096 and 64M");
+BRPC_VALIDATE_GFLAG(shm_ring_size, validate_shm_ring_size);
+
+DEFINE_int32(shm_handshake_timeout_ms, 500, "Timeout for the server to reply "
+             "the proposal of using shared memory");
+
+static const char MAGIC_STR[4] = { 'S', 'H', 'M', '1' };
+static const uint64_t SEGMENT_MAGIC = 0x314D48535F435052ULL;  // "RPC_SHM1"
+
+// Written by the client at the beginning of the connection. Both sides are
+// on the same machine, no need to convert byte orders.
+struct ShmHello {
+    char magic[4];
+    int32_t pid;
+    int32_t memfd;
+    uint32_t ring_size;
+    uint64_t cookie;
+};
+
+// Written by the server after reading ShmHello.
+struct ShmHelloReply {
+    char magic[4];
+    // 0 if the shared memory is used, the error otherwise.
+    int32_t error_code;
+};
+
+// At the beginning of the shared memory, followed by the ring from client
+// to server and the ring from server to client.
+struct ShmSegmentHeader {
+    uint64_t magic;
+    uint64_t cookie;
+    uint64_t ring_size;
+};
+
+static size_t SegmentSize(size_t ring_size) {
+    return ShmRing::HEADER_SIZE + 2 * ShmRing::MemorySize(ring_size);
+}
+
+bool IsLocalPeer(const butil::EndPoint& remote_side) {
+    if (butil::is_unix_endpoint(remote_side)) {
+        return true;
+    }
+    if ((ntohl(butil::ip2int(remote_side.ip)) >> 24) == 127) {
+        return true;
+    }
+    return remote_side.ip != butil::IP_ANY && remote_side.ip == butil::my_ip();
+}
+
+// Returns 1 if a complete hello is cut from `buf', 0 if `buf' does not start
+// with a hello, -1 if more bytes are needed to tell.
+static int CutHello(butil::IOBuf* buf, ShmHello* hello) {
+    char tmp[sizeof(MAGIC_STR)];
+    const size_t n = buf->copy_to(tmp, sizeof(tmp));
+    if (memcmp(tmp, MAGIC_STR, n) != 0) {
+        return 0;
+    }
+    if (buf->size() < sizeof(ShmHello)) {
+        return -1;
+    }
+    buf->cutn(hello, sizeof(*hello));
+    return 1;
+}
+
+// Write a few bytes at the beginning of the connection, in almost all cases
+// they're written at once.
+static int WriteFully(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        const ssize_t nw = write(fd, p, len);
+        if (nw < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += nw;
+        len -= nw;
+    }
+    return 0;
+}
+
+ShmEndpoint::ShmEndpoint(Socket* s)
+    : _socket(s)
+    , _status(UNINITIALIZED)
+    , _memfd(-1)
+    , _mem(NULL)
+    , _mem_size(0)
+    , _eof(false) {
+}
+
+ShmEndpoint::~ShmEndpoint() {
+    Unmap();
+}
+
+void ShmEndpoint::Reset() {
+    Unmap();
+    _status = UNINITIALIZED;
+    _eof = false;
+}
+
+void ShmEndpoint::Unmap() {
+    _in.Detach();
+    _out.Detach();
+    if (_mem) {
+        munmap(_mem, _mem_size);
+        _mem = NULL;
+        _mem_size = 0;
+    }
+    if (_memfd >= 0) {
+        close(_memfd);
+        _memfd = -1;
+    }
+}
+
+int ShmEndpoint::CreateSegment(size_t ring_size, ShmHello* hello) {
+#if defined(OS_LINUX) && defined(__NR_memfd_create)
+    const int fd = syscall(__NR_memfd_create, "brpc_shm",
+                           MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    const size_t size = SegmentSize(ring_size);
+    // Seal the size so that the server never gets SIGBUS by accessing pages
+    // truncated by the client.
+    if (ftruncate(fd, size) != 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        const int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        const int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    _memfd = fd;
+    _mem = mem;
+    _mem_size = size;
+    ShmSegmentHeader* h = static_cast<ShmSegmentHeader*>(mem);
+    h->magic = SEGMENT_MAGIC;
+    h->cookie = butil::fast_rand();
+    h->ring_size = ring_size;
+    char* const first = static_cast<char*>(mem) + ShmRing::HEADER_SIZE;
+    _out.Attach(first, ring_size);
+    _in.Attach(first + ShmRing::MemorySize(ring_size), ring_size);
+    // Nobody reads the rings yet, ring the doorbell for the first message.
+    _out.header()->consumer_sleeping.store(1, butil::memory_order_relaxed);
+    _in.header()->consumer_sleeping.store(1, butil::memory_order_relaxed);
+
+    memcpy(hello->magic, MAGIC_STR, sizeof(MAGIC_STR));
+    hello->pid = getpid();
+    hello->memfd = fd;
+    hello->ring_size = ring_size;
+    hello->cookie = h->cookie;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ShmEndpoint::AcceptSegment(const ShmHello& hello) {
+#if defined(OS_LINUX)
+    const size_t ring_size = hello.ring_size;
+    if (!validate_shm_ring_size(NULL, (int32_t)ring_size)) {
+        return EINVAL;
+    }
+    // The memfd is opened through /proc which requires the privilege to
+    // read the client's fds, refused otherwise.
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", hello.pid, hello.memfd);
+    const int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+    const size_t size = SegmentSize(ring_size);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+        close(fd);
+        return EINVAL;
+    }
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        close(fd);
+        return EPERM;
+    }
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int saved_errno = errno;
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return saved_errno;
+    }
+    const ShmSegmentHeader* h = static_cast<const ShmSegmentHeader*>(mem);
+    if (h->magic != SEGMENT_MAGIC || h->cookie != hello.cookie ||
+        h->ring_size != ring_size) {
+        munmap(mem, size);
+        return EINVAL;
+    }
+    _mem = mem;
+    _mem_size = size;
+    char* const first = static_cast<char*>(mem) + ShmRing::HEADER_SIZE;
+    _in.Attach(first, ring_size);
+    _out.Attach(first + ShmRing::MemorySize(ring_size), ring_size);
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+int ShmEndpoint::StartHandshake() {
+    CHECK_EQ(UNINITIALIZED, _status);
+    ShmHello hello;
+    if (CreateSegment(FLAGS_shm_ring_size, &hello) != 0) {
+        PLOG_EVERY_SECOND(WARNING) << "Fail to create shared memory for "
+                                   << *_socket << ", use the connection";
+        _socket->_shm_state = Socket::SHM_OFF;
+        return 0;
+    }
+    _status = HELLO_C;
+    return WriteFully(_socket->fd(), &hello, sizeof(hello));
+}
+
+ssize_t ShmEndpoint::HandshakeAtServer(Socket* s, size_t size_hint) {
+    ssize_t nr = 0;
+    {
+        butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_READ_BUFFER);
+        nr = s->_read_buf.append_from_file_descriptor(s->fd(), size_hint);
+    }
+    if (nr <= 0) {
+        return nr;
+    }
+    ShmHello hello;
+    const int rc = CutHello(&s->_read_buf, &hello);
+    if (rc < 0) {
+        // Read again for the rest of hello.
+        errno = EINTR;
+        return -1;
+    }
+    if (rc == 0) {
+        // The client does not propose shared memory, bytes read are
+        // messages.
+        s->_shm_state = Socket::SHM_OFF;
+        return nr;
+    }
+    ShmEndpoint* ep = s->_shm_ep;
+    ShmHelloReply reply;
+    memcpy(reply.magic, MAGIC_STR, sizeof(MAGIC_STR));
+    reply.error_code = (ep ? ep->AcceptSegment(hello) : ENOPROTOOPT);
+    if (reply.error_code == 0) {
+        ep->_status = ESTABLISHED;
+        s->_shm_state = Socket::SHM_ON;
+        // Doorbells are single bytes which should not be delayed.
+        butil::make_no_delay(s->fd());
+    } else {
+        LOG_IF(WARNING, ep != NULL) << "Refuse shared memory from " << *s
+                                    << ": " << berror(reply.error_code);
+        s->_shm_state = Socket::SHM_OFF;
+    }
+    if (WriteFully(s->fd(), &reply, sizeof(reply)) != 0) {
+        return -1;
+    }
+    // The client writes nothing before the reply, read again.
+    errno = EINTR;
+    return -1;
+}
+
+ssize_t ShmEndpoint::HandshakeAtClient() {
+    ShmHelloReply reply;
+    butil::IOPortal& buf = _socket->_read_buf;
+    if (buf.size() < sizeof(reply)) {
+        const ssize_t nr = buf.append_from_file_descriptor(
+            _socket->fd(), sizeof(reply) - buf.size());
+        if (nr <= 0) {
+            return nr;
+        }
+        if (buf.size() < sizeof(reply)) {
+            errno = EINTR;
+            return -1;
+        }
+    }
+    buf.cutn(&reply, sizeof(reply));
+    if (memcmp(reply.magic, MAGIC_STR, sizeof(MAGIC_STR)) != 0) {
+        LOG(WARNING) << "Bad reply to shared memory hello from " << *_socket;
+        errno = EPROTO;
+        return -1;
+    }
+    // The server has opened the memfd or given up.
+    close(_memfd);
+    _memfd = -1;
+    if (reply.error_code == 0) {
+        _status = ESTABLISHED;
+        _socket->_shm_state = Socket::SHM_ON;
+        butil::make_no_delay(_socket->fd());
+    } else {
+        LOG_EVERY_SECOND(WARNING) << *_socket << " refused shared memory: "
+                                  << berror(reply.error_code);
+        Unmap();
+        _socket->_shm_state = Socket::SHM_OFF;
+    }
+    // Wake up KeepWrite waiting for the handshake.
+    _socket->WakeAsEpollOut();
+    errno = EINTR;
+    return -1;
+}
+
+ssize_t ShmEndpoint::Read(size_t size_hint) {
+    switch (_status) {
+    case ESTABLISHED:
+        return ReadEstablished(size_hint);
+    case HELLO_C:
+        return HandshakeAtClient();
+    case UNINITIALIZED:
+        if (!_socket->CreatedByConnect()) {
+            return HandshakeAtServer(_socket, size_hint);
+        }
+        break;
+    }
+    // The server speaks before the hello, which should not happen.
+    butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_READ_BUFFER);
+    return _socket->_read_buf.append_from_file_descriptor(
+        _socket->fd(), size_hint);
+}
+
+ssize_t ShmEndpoint::ReadEstablished(size_t size_hint) {
+    // Drain doorbells, the content does not matter.
+    bool rung = false;
+    while (!_eof) {
+        char buf[64];
+        const ssize_t nr = read(_socket->fd(), buf, sizeof(buf));
+        if (nr > 0) {
+            rung = true;
+            if ((size_t)nr < sizeof(buf)) {
+                break;
+            }
+        } else if (nr == 0) {
+            _eof = true;
+        } else if (errno == EAGAIN) {
+            break;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (rung) {
+        // The peer may free space of _out as well.
+        _socket->WakeAsEpollOut();
+    }
+    while (true) {
+        ssize_t n = 0;
+        {
+            butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_READ_BUFFER);
+            n = _in.Read(&_socket->_read_buf, size_hint);
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n > 0) {
+            if (_in.ProducerShouldBeWoken()) {
+                RingDoorbell();
+            }
+            return n;
+        }
+        if (_eof) {
+            return 0;
+        }
+        if (_in.TrySleepAsConsumer()) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+
+ssize_t ShmEndpoint::CutFromIOBufList(butil::IOBuf** data, size_t ndata) {
+    size_t nw = _out.Write(data, ndata);
+    if (nw == 0) {
+        size_t nbytes = 0;
+        for (size_t i = 0; i < ndata; ++i) {
+            nbytes += data[i]->size();
+        }
+        if (nbytes == 0) {
+            return 0;
+        }
+        if (!_out.TryWaitAsProducer()) {
+            nw = _out.Write(data, ndata);
+        }
+        if (nw == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    if (_out.ConsumerShouldBeWoken()) {
+        RingDoorbell();
+    }
+    return nw;
+}
+
+bool ShmEndpoint::IsWritable() const {
+    return _out.attached() && _out.free_bytes() > 0;
+}
+
+void ShmEndpoint::RingDoorbell() {
+    const char c = 0;
+    // Errors are ignored: EAGAIN means that unread doorbells are in the
+    // connection already, other errors are found by reading.
+    const ssize_t nw = write(_socket->fd(), &c, 1);
+    (void)nw;
+}
+
+}  // namespace shm
+}  // namespace brpc
@@ -0,0 +1,135 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_SHM_ENDPOINT_H
+#define BRPC_SHM_ENDPOINT_H
+
+#include <stdint.h>
+#include <butil/endpoint.h>          // butil::EndPoint
+#include <butil/iobuf.h>             // butil::IOBuf
+#include <butil/macros.h>
+#include "brpc/shm/shm_ring.h"
+
+namespace brpc {
+
+class Socket;
+
+namespace shm {
+
+// True if `remote_side' is on this machine: unix domain sockets, loopback
+// addresses and the address of this machine.
+bool IsLocalPeer(const butil::EndPoint& remote_side);
+
+struct ShmHello;
+
+// Transfer data of a connection between co-located processes through a pair
+// of ShmRing in a memfd mapped by both sides.
+//
+// Similar to RDMA, the connection is still established as usual and starts
+// with a handshake: the client creates the memfd and writes a hello carrying
+// its pid, the memfd and a random cookie; the server maps the memfd through
+// /proc/<pid>/fd, checks the cookie and replies. After that, messages are
+// written into the rings while the connection only carries doorbells: a
+// byte is written into it when the peer is found sleeping on an empty ring
+// (or waiting on a full one), which wakes up the peer via the usual epoll
+// events. Closing and failures of the connection are detected as before.
+// If either side can't or doesn't want to use shared memory, the connection
+// is used as if nothing happened.
+class ShmEndpoint {
+public:
+    explicit ShmEndpoint(Socket* s);
+    ~ShmEndpoint();
+
+    // Unmap the shared memory of the last connection to connect again.
+    void Reset();
+
+    // [Client] Create the shared memory and write the hello into the
+    // connection. The socket uses the connection only if the shared memory
+    // can't be created.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int StartHandshake();
+
+    // Process the handshake and doorbells, append data from the peer to the
+    // read buffer of the socket. Same return value as Socket::DoRead().
+    ssize_t Read(size_t size_hint);
+
+    // [Server] Read the hello of a local client from the connection of `s',
+    // reply it and turn shared memory on if `s' has an endpoint. Sockets
+    // without endpoints read hello with this function as well to refuse it.
+    // Same return value as Socket::DoRead().
+    static ssize_t HandshakeAtServer(Socket* s, size_t size_hint);
+
+    // Cut data from the given IOBuf list into the ring to the peer.
+    // Returns bytes cut if success, -1 if failed and errno set (EAGAIN if
+    // the ring is full).
+    ssize_t CutFromIOBufList(butil::IOBuf** data, size_t ndata);
+
+    // Whether more data can be written into the ring to the peer.
+    bool IsWritable() const;
+
+private:
+    enum Status {
+        UNINITIALIZED,
+        HELLO_C,            // only valid at client
+        ESTABLISHED
+    };
+
+    // Read reply of the server to the hello.
+    ssize_t HandshakeAtClient();
+
+    // Read doorbells and data of an established endpoint.
+    ssize_t ReadEstablished(size_t size_hint);
+
+    // Create the shared memory and fill `hello' to propose it.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int CreateSegment(size_t ring_size, ShmHello* hello);
+
+    // Map the shared memory proposed by `hello'.
+    // Returns 0 on success, an error code otherwise.
+    int AcceptSegment(const ShmHello& hello);
+
+    void Unmap();
+
+    // Tell the peer that it should check the rings.
+    void RingDoorbell();
+
+    // Not owner
+    Socket* _socket;
+
+    Status _status;
+
+    // The memfd created at client, closed after the server replies.
+    int _memfd;
+
+    // Mapped memory of the rings
+    void* _mem;
+    size_t _mem_size;
+
+    // Data from and to the peer.
+    ShmRing _in;
+    ShmRing _out;
+
+    // The connection was closed by the peer, remaining data in _in is still
+    // delivered.
+    bool _eof;
+
+    DISALLOW_COPY_AND_ASSIGN(ShmEndpoint);
+};
+
+}  // namespace shm
+}  // namespace brpc
+
+#endif  // BRPC_SHM_ENDPOINT_H
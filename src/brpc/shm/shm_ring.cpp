@@ -0,0 +1,143 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <errno.h>
+#include <algorithm>                    // std::min
+#include <butil/logging.h>
+#include "brpc/shm/shm_ring.h"
+
+namespace brpc {
+namespace shm {
+
+void ShmRing::Attach(void* mem, size_t capacity) {
+    CHECK(capacity > 0 && (capacity & (capacity - 1)) == 0)
+        << "capacity=" << capacity << " is not a power of 2";
+    _header = static_cast<ShmRingHeader*>(mem);
+    _data = static_cast<char*>(mem) + HEADER_SIZE;
+    _capacity = capacity;
+}
+
+void ShmRing::Detach() {
+    _header = NULL;
+    _data = NULL;
+    _capacity = 0;
+}
+
+size_t ShmRing::free_bytes() const {
+    const uint64_t head = _header->head.load(butil::memory_order_relaxed);
+    const uint64_t tail = _header->tail.load(butil::memory_order_acquire);
+    // The peer may write anything into the shared memory, never trust it.
+    if (head - tail > _capacity) {
+        return 0;
+    }
+    return _capacity - (size_t)(head - tail);
+}
+
+size_t ShmRing::Write(butil::IOBuf* const* from, size_t ndata) {
+    const uint64_t head = _header->head.load(butil::memory_order_relaxed);
+    size_t room = free_bytes();
+    uint64_t pos = head;
+    for (size_t i = 0; i < ndata && room > 0; ++i) {
+        butil::IOBuf* buf = from[i];
+        while (!buf->empty() && room > 0) {
+            const size_t offset = pos & (_capacity - 1);
+            const size_t n = std::min(std::min(room, _capacity - offset),
+                                      buf->size());
+            buf->cutn(_data + offset, n);
+            pos += n;
+            room -= n;
+        }
+    }
+    if (pos != head) {
+        // Release fence makes the consumer see the copied bytes.
+        _header->head.store(pos, butil::memory_order_release);
+    }
+    return pos - head;
+}
+
+bool ShmRing::empty() const {
+    return _header->head.load(butil::memory_order_acquire) ==
+        _header->tail.load(butil::memory_order_relaxed);
+}
+
+ssize_t ShmRing::Read(butil::IOBuf* to, size_t max_bytes) {
+    const uint64_t tail = _header->tail.load(butil::memory_order_relaxed);
+    const uint64_t head = _header->head.load(butil::memory_order_acquire);
+    if (head - tail > _capacity) {
+        errno = EPROTO;
+        return -1;
+    }
+    const size_t n = std::min((size_t)(head - tail), max_bytes);
+    uint64_t pos = tail;
+    for (size_t left = n; left > 0;) {
+        const size_t offset = pos & (_capacity - 1);
+        const size_t len = std::min(left, _capacity - offset);
+        to->append(_data + offset, len);
+        pos += len;
+        left -= len;
+    }
+    if (n > 0) {
+        // Bytes must be copied out before the producer overwrites them.
+        _header->tail.store(pos, butil::memory_order_release);
+    }
+    return n;
+}
+
+// The sleeping side stores its flag and then checks the ring, the other side
+// updates the ring and then checks the flag. With full fences in between,
+// at least one of them sees the change of the other one, so that either the
+// sleeping side does not sleep or it's woken up.
+
+bool ShmRing::TrySleepAsConsumer() {
+    _header->consumer_sleeping.store(1, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (!empty()) {
+        _header->consumer_sleeping.store(0, butil::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::ConsumerShouldBeWoken() {
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (_header->consumer_sleeping.load(butil::memory_order_relaxed) == 0) {
+        return false;
+    }
+    return _header->consumer_sleeping.exchange(
+        0, butil::memory_order_relaxed) != 0;
+}
+
+bool ShmRing::TryWaitAsProducer() {
+    _header->producer_waiting.store(1, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (free_bytes() > 0) {
+        _header->producer_waiting.store(0, butil::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::ProducerShouldBeWoken() {
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (_header->producer_waiting.load(butil::memory_order_relaxed) == 0) {
+        return false;
+    }
+    return _header->producer_waiting.exchange(
+        0, butil::memory_order_relaxed) != 0;
+}
+
+}  // namespace shm
+}  // namespace brpc
@@ -0,0 +1,117 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef BRPC_SHM_RING_H
+#define BRPC_SHM_RING_H
+
+#include <stdint.h>
+#include <sys/types.h>               // ssize_t
+#include <butil/atomicops.h>         // butil::atomic
+#include <butil/iobuf.h>             // butil::IOBuf
+#include <butil/macros.h>
+
+namespace brpc {
+namespace shm {
+
+// Control words of a ShmRing, shared by the two processes mapping the ring.
+// `head' and `tail' are monotonic byte counters so that a full ring and an
+// empty ring are distinguishable. Words written by different sides are put
+// in separated cachelines.
+struct ShmRingHeader {
+    // Bytes ever written into the ring, only stored by the producer.
+    butil::atomic<uint64_t> BAIDU_CACHELINE_ALIGNMENT head;
+    // Non-zero when the consumer found the ring empty and is going to wait
+    // for a doorbell, cleared by the producer ringing it.
+    butil::atomic<uint32_t> consumer_sleeping;
+
+    // Bytes ever read from the ring, only stored by the consumer.
+    butil::atomic<uint64_t> BAIDU_CACHELINE_ALIGNMENT tail;
+    // Non-zero when the producer found the ring full and is going to wait
+    // for a doorbell, cleared by the consumer ringing it.
+    butil::atomic<uint32_t> producer_waiting;
+};
+
+// A single-producer-single-consumer ring of bytes in shared memory. One
+// process writes and the other one reads, no locks are involved. The ring
+// does not wake up anyone, callers check the sleeping/waiting flags after
+// Write() and Read() to decide whether the peer should be notified.
+class ShmRing {
+public:
+    // Bytes of the header in the memory of a ring, the data starts at a
+    // page boundary.
+    static const size_t HEADER_SIZE = 4096;
+
+    ShmRing() : _header(NULL), _data(NULL), _capacity(0) {}
+
+    // Bytes of memory needed by a ring holding `capacity' bytes.
+    static size_t MemorySize(size_t capacity) { return HEADER_SIZE + capacity; }
+
+    // Use `mem' of MemorySize(capacity) bytes as the ring. `capacity' must
+    // be a power of 2. Zeroed memory is an empty ring.
+    void Attach(void* mem, size_t capacity);
+
+    // Stop using the memory, which is not released.
+    void Detach();
+
+    bool attached() const { return _header != NULL; }
+    size_t capacity() const { return _capacity; }
+    ShmRingHeader* header() const { return _header; }
+
+    // [Producer] Cut bytes from front side of `from[0...ndata-1]' into the
+    // ring as much as possible.
+    // Returns bytes written, 0 if the ring is full.
+    size_t Write(butil::IOBuf* const* from, size_t ndata);
+
+    // [Producer] Free bytes of the ring.
+    size_t free_bytes() const;
+
+    // [Consumer] Append at most `max_bytes' bytes in the ring to `to'.
+    // Returns bytes read, 0 if the ring is empty, -1 if indexes in the
+    // shared memory are corrupted and errno is set to EPROTO.
+    ssize_t Read(butil::IOBuf* to, size_t max_bytes);
+
+    // [Consumer] True if there's nothing to read.
+    bool empty() const;
+
+    // [Consumer] Mark the consumer as sleeping and check again, which pairs
+    // with ConsumerShouldBeWoken() to avoid lost doorbells.
+    // Returns true if the ring is still empty and the caller should wait,
+    // false otherwise (the flag is cleared).
+    bool TrySleepAsConsumer();
+
+    // [Producer] Called after Write(). Returns true if the consumer is
+    // sleeping and should be woken by the caller, the flag is cleared.
+    bool ConsumerShouldBeWoken();
+
+    // [Producer] Same as TrySleepAsConsumer() for a full ring.
+    bool TryWaitAsProducer();
+
+    // [Consumer] Called after Read(). Returns true if the producer is
+    // waiting for free space and should be woken by the caller.
+    bool ProducerShouldBeWoken();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ShmRing);
+
+    ShmRingHeader* _header;
+    char* _data;
+    size_t _capacity;
+};
+
+}  // namespace shm
+}  // namespace brpc
+
+#endif  // BRPC_SHM_RING_H
@@ -19,9 +19,17 @@
 #include "butil/compat.h"                        // OS_MACOSX
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <map>
 #include <netinet/tcp.h>                         // getsockopt
+#include <sys/ioctl.h>                            // FIONREAD
+#if defined(OS_LINUX)
+#include <linux/errqueue.h>                      // sock_extended_err
+#endif
 #include <gflags/gflags.h>
 #include "bthread/unstable.h"                    // bthread_timer_del
+#include "bthread/processor.h"                   // cpu_relax
+#include "bthread/mutex.h"                       // bthread::Mutex
+#include "bthread/condition_variable.h"          // bthread::ConditionVariable
 #include "butil/fd_utility.h"                     // make_non_blocking
 #include "butil/fd_guard.h"                       // fd_guard
 #include "butil/time.h"                           // cpuwide_time_us
@@ -29,6 +37,7 @@
 #include "butil/logging.h"                        // CHECK
 #include "butil/macros.h"
 #include "butil/class_name.h"                     // butil::class_name
+#include "butil/thread_local.h"                   // BAIDU_THREAD_LOCAL
 #include "bvar/bvar.h"
 #include "brpc/log.h"
 #include "brpc/reloadable_flags.h"          // BRPC_VALIDATE_GFLAG
@@ -38,10 +47,14 @@
 #include "brpc/describable.h"               // Describable
 #include "brpc/input_messenger.h"
 #include "brpc/details/sparse_minute_counter.h"
+#include "brpc/details/io_uring_engine.h"
+#include "brpc/details/stream_frame_queue.h"
 #include "brpc/stream_impl.h"
 #include "brpc/shared_object.h"
 #include "brpc/policy/rtmp_protocol.h"  // FIXME
 #include "brpc/rdma/rdma_endpoint.h"
+#include "brpc/shm/shm_endpoint.h"
+#include "brpc/details/iobuf_block_tag.h"
 #if defined(OS_MACOSX)
 #include <sys/event.h>
 #endif
@@ -56,6 +69,9 @@ namespace brpc {
 namespace rdma {
 DECLARE_int32(rdma_conn_timeout_ms);
 }
+namespace shm {
+DECLARE_int32(shm_handshake_timeout_ms);
+}
 
 // NOTE: This flag was true by default before r31206. Connected to somewhere
 // is not an important event now, we can check the connection in /connections
@@ -76,14 +92,126 @@ DEFINE_int32(socket_send_buffer_size, -1,
 
 DEFINE_int32(ssl_bio_buffer_size, 16*1024, "Set buffer size for SSL read/write");
 
+DEFINE_bool(ssl_ktls, false, "Encrypt SSL connections in the kernel (kTLS) "
+            "after handshakes so that writes go through plain writev, if "
+            "it's supported by the kernel and OpenSSL(3.0+)");
+BRPC_VALIDATE_GFLAG(ssl_ktls, PassValidate);
+
+DEFINE_int32(ssl_max_concurrent_handshakes, 0, "Maximum number of "
+             "SSL_do_handshake running at the same time, others wait in "
+             "their bthreads without occupying workers. <=0 means unlimited");
+BRPC_VALIDATE_GFLAG(ssl_max_concurrent_handshakes, PassValidate);
+
+DEFINE_int32(ssl_max_handshakes_per_second, 0, "Maximum number of SSL "
+             "handshakes started per second in this process, excessive ones "
+             "are delayed. <=0 means unlimited");
+BRPC_VALIDATE_GFLAG(ssl_max_handshakes_per_second, PassValidate);
+
+DEFINE_int32(health_check_max_rate, 1000, "Maximum number of health checks "
+             "started per second, no limit for non-positive values");
+BRPC_VALIDATE_GFLAG(health_check_max_rate, PassValidate);
+
+DEFINE_string(health_check_path, "", "Revive a socket only when it responds "
+              "to a http GET of this path with status 200, e.g. /health. "
+              "Checking TCP connectivity only if this flag is empty. Not "
+              "applicable to SSL connections");
+DEFINE_int32(health_check_timeout_ms, 500, "Timeout of the http GET of "
+             "-health_check_path");
+BRPC_VALIDATE_GFLAG(health_check_timeout_ms, PositiveInteger);
+DEFINE_int32(health_check_slow_start_ms, 0, "Traffic to a revived socket is "
+             "ramped up linearly in so many milliseconds by load balancers, "
+             "no slow start for non-positive values");
+BRPC_VALIDATE_GFLAG(health_check_slow_start_ms, PassValidate);
+
+DEFINE_string(socket_io_engine, "epoll", "How sockets read and write their "
+              "fds: `epoll' (readiness by epoll and readv/writev) or "
+              "`io_uring' (multishot recv and batched sendmsg by io_uring, "
+              "linux 6.0+). Only affects sockets created after setting this "
+              "flag, see brpc::SocketIoEngine for sockets using io_uring");
+static bool ValidateSocketIoEngine(const char*, const std::string& value) {
+    return value == "epoll" || value == "io_uring";
+}
+const bool ALLOW_UNUSED dummy_socket_io_engine =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_socket_io_engine,
+                                       ValidateSocketIoEngine);
+
+DEFINE_int32(socket_busy_poll_us, 0,
+             "Set SO_BUSY_POLL of sockets to so many microseconds if this value "
+             "is positive, making the kernel busy poll the device queue when "
+             "the socket is read or polled with no data, which works with "
+             "-event_dispatcher_busy_poll to reduce latency. Values larger than "
+             "/proc/sys/net/core/busy_read need CAP_NET_ADMIN. Linux only");
+
 DEFINE_int64(socket_max_unwritten_bytes, 64 * 1024 * 1024,
              "Max unwritten bytes in each socket, if the limit is reached,"
              " Socket.Write fails with EOVERCROWDED");
 
+DEFINE_int64(socket_max_total_unwritten_bytes, 0,
+             "Max unwritten bytes of all sockets in this process. If the limit "
+             "is reached, Socket.Write to sockets holding more than their "
+             "share (the limit divided by number of sockets with unwritten "
+             "data) fails with EOVERCROWDED. 0 means unlimited");
+BRPC_VALIDATE_GFLAG(socket_max_total_unwritten_bytes, NonNegativeInteger);
+
+DEFINE_int64(socket_max_total_read_buffer_bytes, 0,
+             "Max bytes of incomplete messages buffered by all sockets in "
+             "this process. If the limit is reached, sockets buffering more "
+             "than their share stop reading for -socket_read_pause_ms, "
+             "pushing back their peers by TCP flow control. 0 means unlimited");
+BRPC_VALIDATE_GFLAG(socket_max_total_read_buffer_bytes, NonNegativeInteger);
+
+DEFINE_int32(socket_read_pause_ms, 20,
+             "Milliseconds that a socket stops reading when it buffers too "
+             "much for -socket_max_total_read_buffer_bytes");
+BRPC_VALIDATE_GFLAG(socket_read_pause_ms, PositiveInteger);
+
+DEFINE_int32(socket_write_coalesce_us, 0,
+             "If this value is positive, the thread getting the right to write "
+             "a socket waits at most so many microseconds for requests from "
+             "concurrent writers and writes them together in one syscall. "
+             "This trades a few microseconds of latency for fewer syscalls "
+             "when many small responses are written to a socket");
+BRPC_VALIDATE_GFLAG(socket_write_coalesce_us, NonNegativeInteger);
+
+DEFINE_int32(socket_write_coalesce_bytes, 16384,
+             "Stop waiting for concurrent writers when so many bytes are "
+             "gathered, requests not smaller than this value are never delayed");
+BRPC_VALIDATE_GFLAG(socket_write_coalesce_bytes, PositiveInteger);
+
+DEFINE_int64(socket_zerocopy_threshold, 0,
+             "Write with MSG_ZEROCOPY when there're at least so many bytes "
+             "to write in one batch, written blocks are referenced until the "
+             "kernel notifies the completion. 0 disables zero-copy. Linux "
+             "4.14+ only");
+BRPC_VALIDATE_GFLAG(socket_zerocopy_threshold, NonNegativeInteger);
+
 DEFINE_int32(max_connection_pool_size, 100,
              "maximum pooled connection count to a single endpoint");
 BRPC_VALIDATE_GFLAG(max_connection_pool_size, PassValidate);
 
+DEFINE_bool(connection_pool_adaptive_size, false,
+            "Close idle pooled connections beyond recent demand every second. "
+            "The surplus is smoothed by EWMA of the minimum number of idle "
+            "connections in each second, connections warmed up by channels "
+            "are kept");
+BRPC_VALIDATE_GFLAG(connection_pool_adaptive_size, PassValidate);
+
+DEFINE_int32(single_connection_num, 1,
+             "Number of multiplexed connections to each server for "
+             "connection_type=single, calls are spread over them so that "
+             "throughput to one busy server scales across cores. At most 64");
+BRPC_VALIDATE_GFLAG(single_connection_num, PositiveInteger);
+
+DEFINE_bool(single_connection_by_unwritten_bytes, false,
+            "Send calls over the multiplexed connection with fewest unwritten "
+            "bytes instead of the one mapped to the calling worker");
+BRPC_VALIDATE_GFLAG(single_connection_by_unwritten_bytes, PassValidate);
+
+DEFINE_int32(stream_write_quantum, 16384, "Bytes that each stream over a "
+             "connection writes in a round of weighted round-robin, multiplied "
+             "by StreamOptions.weight");
+BRPC_VALIDATE_GFLAG(stream_write_quantum, PositiveInteger);
+
 DEFINE_int32(connect_timeout_as_unreachable, 3,
              "If the socket failed to connect due to ETIMEDOUT for so many "
              "times *continuously*, the error is changed to ENETUNREACH which "
@@ -99,6 +227,57 @@ BRPC_VALIDATE_GFLAG(connect_timeout_as_unreachable,
 
 const int WAIT_EPOLLOUT_TIMEOUT_MS = 50;
 
+#if defined(OS_LINUX)
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif  // OS_LINUX
+
+struct ZeroCopyContext {
+    ZeroCopyContext() : enabled(false), first_seq(0), pending_bytes(0) {}
+
+    // False if SO_ZEROCOPY can't be set on the fd.
+    bool enabled;
+    butil::Mutex mutex;
+    // Each successful sendmsg with MSG_ZEROCOPY gets a sequence number
+    // from 0, which is notified in completions. pending[i] is the data
+    // sent with sequence number `first_seq + i'.
+    uint32_t first_seq;
+    std::deque<butil::IOBuf> pending;
+    size_t pending_bytes;
+};
+
+// Rarely used states of Socket, see Socket::_lazy_part.
+struct Socket::LazyPart {
+    LazyPart()
+        : initial_parsing_context(NULL)
+        , next_ordered_slot(0)
+        , next_written_slot(0) {}
+
+    // Copied from SocketOptions to create pooled or short sockets.
+    std::string sni_name;
+    Destroyable* initial_parsing_context;
+
+    butil::Mutex pipeline_mutex;
+    std::deque<PipelinedInfo> pipeline_q;
+
+    butil::Mutex stream_mutex;
+    std::set<StreamId> stream_set;
+    StreamFrameQueue stream_frame_queue;
+
+    butil::Mutex ordered_write_mutex;
+    uint64_t next_ordered_slot;
+    uint64_t next_written_slot;
+    // Data of slots waiting for previous ones.
+    std::map<uint64_t, butil::IOBuf> ordered_writes;
+};
+
 #ifdef BAIDU_INTERNAL
 #define BRPC_AUXTHREAD_ATTR                                        \
     (sizeof(com_device_t) > 32*1024 ? BTHREAD_ATTR_NORMAL : BTHREAD_ATTR_SMALL)
@@ -106,6 +285,9 @@ const int WAIT_EPOLLOUT_TIMEOUT_MS = 50;
 #define BRPC_AUXTHREAD_ATTR BTHREAD_ATTR_SMALL
 #endif
 
+// Max size of SocketPool::_new_sockets.
+static const size_t MAX_NEW_SOCKETS = 65536;
+
 class BAIDU_CACHELINE_ALIGNMENT SocketPool {
 public:
     explicit SocketPool(const SocketOptions& opt);
@@ -121,15 +303,47 @@ public:
     
     // Get all pooled sockets inside.
     void ListSockets(std::vector<SocketId>* list, size_t max_count);
-    
+
+    // Move sockets created since last call into `list'.
+    void ListNewSockets(std::vector<SocketId>* list);
+
+    // Create and connect sockets until there're `n' free sockets in this
+    // pool. Each connection takes at most `connect_timeout_ms', <= 0
+    // means no limit. Stop at the first failure.
+    void WarmUp(int n, int connect_timeout_ms);
+
+    // Close free sockets which were not used recently. Called every second
+    // by one thread.
+    void Trim();
+
 private:
+    // Create a new socket with _options.
+    int CreateSocket(SocketUniquePtr* ptr);
+
+    static int GetFreeCount(void* arg) {
+        return static_cast<SocketPool*>(arg)->_count.load(
+            butil::memory_order_relaxed);
+    }
+
     // options used to create this instance
     SocketOptions _options;
     butil::Mutex _mutex;
     std::vector<SocketId> _pool;
+    // Sockets created but not listed by ListNewSockets() yet.
+    std::vector<SocketId> _new_sockets;
     butil::EndPoint _remote_side;
     // #free-sockets in all sub pools.
     butil::atomic<int> _count;
+    // Minimum size of _pool since last Trim(), protected by _mutex.
+    int _low_water;
+    // Trim() never makes the pool smaller than this (the size warmed up).
+    butil::atomic<int> _min_size;
+    // Smoothed _low_water, only accessed in Trim().
+    double _ewma_surplus;
+
+    bvar::PassiveStatus<int> _nfree_var;
+    bvar::Adder<int64_t> _ncreated;
+    bvar::Adder<int64_t> _ntrimmed;
 };
 
 // NOTE: sizeof of this class is 1200 bytes. If we have 10K sockets, total
@@ -158,6 +372,28 @@ struct ExtendedSocketStat : public SocketStat {
     }
 };
 
+// Sockets connecting to the same server as the main socket which are used
+// like the main one, see -single_connection_num.
+struct MultiplexedSockets {
+    static const int MAX_NUM = 64;
+
+    MultiplexedSockets() {
+        for (int i = 0; i < MAX_NUM; ++i) {
+            ids[i].store((SocketId)-1, butil::memory_order_relaxed);
+        }
+    }
+    ~MultiplexedSockets() {
+        for (int i = 0; i < MAX_NUM; ++i) {
+            Socket::SetFailed(ids[i].load(butil::memory_order_relaxed));
+        }
+    }
+
+    // Serialize creations of sockets.
+    butil::Mutex mutex;
+    // ids[0] is unused, which is the main socket.
+    butil::atomic<SocketId> ids[MAX_NUM];
+};
+
 // Shared by main socket and derivative sockets.
 class Socket::SharedPart : public SharedObject {
 public:
@@ -169,6 +405,9 @@ public:
     // which has the disadvantage that accesses to different pools contend
     // with each other.
     butil::atomic<SocketPool*> socket_pool;
+
+    // Created when -single_connection_num > 1.
+    butil::atomic<MultiplexedSockets*> multiplexed_sockets;
     
     // The socket newing this object.
     SocketId creator_socket_id;
@@ -195,6 +434,7 @@ public:
 
 Socket::SharedPart::SharedPart(SocketId creator_socket_id2)
     : socket_pool(NULL)
+    , multiplexed_sockets(NULL)
     , creator_socket_id(creator_socket_id2)
     , num_continuous_connect_timeouts(0)
     , in_size(0)
@@ -208,6 +448,7 @@ Socket::SharedPart::~SharedPart() {
     delete extended_stat;
     extended_stat = NULL;
     delete socket_pool.exchange(NULL, butil::memory_order_relaxed);
+    delete multiplexed_sockets.exchange(NULL, butil::memory_order_relaxed);
 }
 
 void Socket::SharedPart::UpdateStatsEverySecond(int64_t now_ms) {
@@ -269,6 +510,69 @@ void Socket::SharedPart::UpdateStatsEverySecond(int64_t now_ms) {
     }
 }
 
+// Bytes buffered by all sockets for -socket_max_total_unwritten_bytes and
+// -socket_max_total_read_buffer_bytes. Sockets are charged in units of
+// BUFFER_BUDGET_UNIT bytes, so that small buffers emptied soon, which are
+// the common case, don't touch these counters shared by all threads.
+static const int64_t BUFFER_BUDGET_UNIT = 65536;
+struct BAIDU_CACHELINE_ALIGNMENT BufferBudget {
+    BufferBudget() : total(0), nsocket(0) {}
+    // Charged bytes of all sockets
+    butil::atomic<int64_t> total;
+    // Number of sockets charged with at least one unit
+    butil::atomic<int64_t> nsocket;
+};
+static BufferBudget g_write_budget;
+static BufferBudget g_read_budget;
+
+// Charge the change of buffered bytes of a socket from `before' to `after'.
+// Concurrent changes of one socket are charged correctly as long as each
+// of them is reported with values returned by an atomic operation.
+static void ChargeBufferBudget(BufferBudget* b, int64_t before, int64_t after) {
+    const int64_t units_before = before / BUFFER_BUDGET_UNIT;
+    const int64_t units_after = after / BUFFER_BUDGET_UNIT;
+    if (units_before == units_after) {
+        return;
+    }
+    b->total.fetch_add((units_after - units_before) * BUFFER_BUDGET_UNIT,
+                       butil::memory_order_relaxed);
+    if (units_before == 0) {
+        b->nsocket.fetch_add(1, butil::memory_order_relaxed);
+    } else if (units_after == 0) {
+        b->nsocket.fetch_sub(1, butil::memory_order_relaxed);
+    }
+}
+
+// True if `b' exceeds `limit' and a socket buffering `bytes' holds more
+// than its share. Sockets within their shares are never pushed back, so
+// that one greedy connection can't starve others.
+static bool IsOverBufferBudget(const BufferBudget& b, int64_t limit,
+                               int64_t bytes) {
+    if (limit <= 0 || bytes < BUFFER_BUDGET_UNIT ||
+        b.total.load(butil::memory_order_relaxed) <= limit) {
+        return false;
+    }
+    const int64_t nsocket =
+        std::max(b.nsocket.load(butil::memory_order_relaxed), (int64_t)1);
+    return bytes > limit / nsocket;
+}
+
+static int64_t GetTotalUnwrittenBytes(void*) {
+    return g_write_budget.total.load(butil::memory_order_relaxed);
+}
+static int64_t GetTotalReadBufferBytes(void*) {
+    return g_read_budget.total.load(butil::memory_order_relaxed);
+}
+// Ratio of buffered bytes to the limit, 0 when the limit is unset.
+static double GetWritePressure(void*) {
+    const int64_t limit = FLAGS_socket_max_total_unwritten_bytes;
+    return limit > 0 ? (double)GetTotalUnwrittenBytes(NULL) / limit : 0;
+}
+static double GetReadPressure(void*) {
+    const int64_t limit = FLAGS_socket_max_total_read_buffer_bytes;
+    return limit > 0 ? (double)GetTotalReadBufferBytes(NULL) / limit : 0;
+}
+
 struct SocketVarsCollector {
     SocketVarsCollector()
         : nsocket("rpc_socket_count")
@@ -278,6 +582,25 @@ struct SocketVarsCollector {
         , nkeepwrite_second("rpc_keepwrite_second", &nkeepwrite)
         , nwaitepollout("rpc_waitepollout_count")
         , nwaitepollout_second("rpc_waitepollout_second", &nwaitepollout)
+        , zerocopy_bytes("rpc_zerocopy_bytes")
+        , zerocopy_fallback("rpc_zerocopy_fallback_count")
+        , zerocopy_copied("rpc_zerocopy_copied_count")
+        , input_event_delay("rpc_input_event_delay")
+        , ninline_event("rpc_inline_event_count")
+        , write_batch_size("rpc_socket_write_batch_size")
+        , ncoalesced_write("rpc_socket_coalesced_write_count")
+        , nprioritized_write("rpc_socket_prioritized_write_count")
+        , ssl_handshake("rpc_ssl_handshake")
+        , ssl_handshake_fail("rpc_ssl_handshake_fail_count")
+        , ssl_handshake_delayed("rpc_ssl_handshake_delayed_count")
+        , total_unwritten_bytes("rpc_socket_total_unwritten_bytes",
+                                GetTotalUnwrittenBytes, NULL)
+        , total_read_buffer_bytes("rpc_socket_total_read_buffer_bytes",
+                                  GetTotalReadBufferBytes, NULL)
+        , write_pressure("rpc_socket_write_pressure", GetWritePressure, NULL)
+        , read_pressure("rpc_socket_read_pressure", GetReadPressure, NULL)
+        , nwrite_over_budget("rpc_socket_write_over_budget_count")
+        , nread_paused("rpc_socket_read_paused_count")
     {}
 
     bvar::Adder<int64_t> nsocket;
@@ -289,13 +612,208 @@ struct SocketVarsCollector {
     bvar::PerSecond<bvar::Adder<int64_t> > nkeepwrite_second;
     bvar::Adder<int64_t> nwaitepollout;
     bvar::PerSecond<bvar::Adder<int64_t> > nwaitepollout_second;
+    // Bytes written with MSG_ZEROCOPY
+    bvar::Adder<int64_t> zerocopy_bytes;
+    // Writes expected to be zero-copy but done with writev
+    bvar::Adder<int64_t> zerocopy_fallback;
+    // Zero-copy sends that the kernel copied anyway (e.g. on loopback)
+    bvar::Adder<int64_t> zerocopy_copied;
+    // Microseconds from the dispatcher seeing input events to the start of
+    // processing them, mostly the cost of starting a bthread.
+    bvar::LatencyRecorder input_event_delay;
+    // Input events processed inside busy-polling dispatchers
+    bvar::Adder<int64_t> ninline_event;
+    // Number of WriteRequests written by each write syscall
+    bvar::IntRecorder write_batch_size;
+    // WriteRequests gathered by -socket_write_coalesce_us
+    bvar::Adder<int64_t> ncoalesced_write;
+    // Times that queued WriteRequests were reordered by priority
+    bvar::Adder<int64_t> nprioritized_write;
+    // Rate and latency of successful SSL handshakes
+    bvar::LatencyRecorder ssl_handshake;
+    bvar::Adder<int64_t> ssl_handshake_fail;
+    // Times that handshakes waited for -ssl_max_handshakes_per_second or
+    // -ssl_max_concurrent_handshakes
+    bvar::Adder<int64_t> ssl_handshake_delayed;
+    // Memory buffered by all sockets, see -socket_max_total_unwritten_bytes
+    // and -socket_max_total_read_buffer_bytes
+    bvar::PassiveStatus<int64_t> total_unwritten_bytes;
+    bvar::PassiveStatus<int64_t> total_read_buffer_bytes;
+    bvar::PassiveStatus<double> write_pressure;
+    bvar::PassiveStatus<double> read_pressure;
+    // Writes failed with EOVERCROWDED by the process-wide limit
+    bvar::Adder<int64_t> nwrite_over_budget;
+    // Times that sockets stopped reading by the process-wide limit
+    bvar::Adder<int64_t> nread_paused;
+};
+
+// Throttles SSL handshakes of all sockets, so that the RSA/ECDHE cost of
+// reconnecting storms does not occupy all workers and delay other traffic.
+class SSLHandshakeLimiter {
+public:
+    SSLHandshakeLimiter() : _nrunning(0), _next_start_us(0) {}
+
+    // Wait until a new handshake can be started according to
+    // -ssl_max_handshakes_per_second. Returns true if it waited.
+    bool WaitForStart() {
+        const int max_rate = FLAGS_ssl_max_handshakes_per_second;
+        if (max_rate <= 0) {
+            return false;
+        }
+        const int64_t interval_us = std::max(1000000L / max_rate, 1L);
+        const int64_t now_us = butil::gettimeofday_us();
+        int64_t start_us = _next_start_us.load(butil::memory_order_relaxed);
+        int64_t my_start_us = 0;
+        do {
+            my_start_us = std::max(start_us, now_us);
+        } while (!_next_start_us.compare_exchange_weak(
+                     start_us, my_start_us + interval_us,
+                     butil::memory_order_relaxed));
+        if (my_start_us <= now_us) {
+            return false;
+        }
+        bthread_usleep(my_start_us - now_us);
+        return true;
+    }
+
+    // Wait for a slot to run SSL_do_handshake according to
+    // -ssl_max_concurrent_handshakes. Release() must be called after
+    // SSL_do_handshake if this function returns true.
+    bool Acquire(bool* delayed) {
+        const int max_running = FLAGS_ssl_max_concurrent_handshakes;
+        if (max_running <= 0) {
+            return false;
+        }
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        while (_nrunning >= max_running) {
+            *delayed = true;
+            _cond.wait(mu);
+        }
+        ++_nrunning;
+        return true;
+    }
+
+    void Release() {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        --_nrunning;
+        mu.unlock();
+        _cond.notify_one();
+    }
+
+private:
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+    int _nrunning;
+    butil::atomic<int64_t> _next_start_us;
+};
+
+// Runs health checks of all failed sockets from one bthread rather than one
+// sleeping bthread per socket, and starts at most -health_check_max_rate
+// checks per second so that a lot of connections failing together (say the
+// server restarts) are not reconnected all at once.
+class HealthCheckScheduler {
+public:
+    HealthCheckScheduler() : _started(false), _next_start_us(0) {}
+
+    // Check health of `id' after `delay_us'.
+    void Schedule(SocketId id, int64_t delay_us, bool first_time) {
+        Task task = { id, first_time };
+        const int64_t due_us = butil::gettimeofday_us() + delay_us;
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        if (!_started) {
+            bthread_t th;
+            if (bthread_start_background(&th, &BRPC_AUXTHREAD_ATTR,
+                                         RunScheduler, this) != 0) {
+                mu.unlock();
+                LOG(FATAL) << "Fail to start health checking scheduler";
+                return;
+            }
+            _started = true;
+        }
+        const bool earliest = (_tasks.empty() || due_us < _tasks.begin()->first);
+        _tasks.insert(std::make_pair(due_us, task));
+        mu.unlock();
+        if (earliest) {
+            _cond.notify_one();
+        }
+    }
+
+private:
+    struct Task {
+        SocketId id;
+        bool first_time;
+    };
+
+    static void* RunScheduler(void* arg) {
+        static_cast<HealthCheckScheduler*>(arg)->Run();
+        return NULL;
+    }
+
+    static void* RunCheck(void* arg);
+
+    void Run() {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        while (true) {
+            if (_tasks.empty()) {
+                _cond.wait(mu);
+                continue;
+            }
+            const int max_rate = FLAGS_health_check_max_rate;
+            const int64_t now_us = butil::gettimeofday_us();
+            int64_t start_us = _tasks.begin()->first;
+            if (max_rate > 0) {
+                start_us = std::max(start_us, _next_start_us);
+            }
+            if (start_us > now_us) {
+                _cond.wait_for(mu, start_us - now_us);
+                continue;
+            }
+            if (max_rate > 0) {
+                _next_start_us = std::max(_next_start_us, now_us) +
+                    std::max(1000000L / max_rate, 1L);
+            }
+            Task* task = new Task(_tasks.begin()->second);
+            _tasks.erase(_tasks.begin());
+            mu.unlock();
+            // Checks may block on connecting, run them in separate bthreads.
+            bthread_t th;
+            if (bthread_start_background(&th, &BRPC_AUXTHREAD_ATTR,
+                                         RunCheck, task) != 0) {
+                RunCheck(task);
+            }
+            mu.lock();
+        }
+    }
+
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+    // Sockets to check, ordered by time to check.
+    std::multimap<int64_t, Task> _tasks;
+    bool _started;
+    // Time to start next check according to -health_check_max_rate, only
+    // accessed in Run().
+    int64_t _next_start_us;
 };
 
 static SocketVarsCollector* s_vars = NULL;
+static SSLHandshakeLimiter* s_ssl_limiter = NULL;
+static HealthCheckScheduler* s_hc_scheduler = NULL;
+
+void* HealthCheckScheduler::RunCheck(void* arg) {
+    Task* task = static_cast<Task*>(arg);
+    const int64_t delay_us = Socket::CheckHealthOnce(task->id, task->first_time);
+    if (delay_us >= 0) {
+        s_hc_scheduler->Schedule(task->id, delay_us, false);
+    }
+    delete task;
+    return NULL;
+}
 
 static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
 static void CreateVars() {
     s_vars = new SocketVarsCollector;
+    s_ssl_limiter = new SSLHandshakeLimiter;
+    s_hc_scheduler = new HealthCheckScheduler;
 }
 
 void Socket::CreateVarsOnce() {
@@ -315,7 +833,15 @@ struct BAIDU_CACHELINE_ALIGNMENT Socket::WriteRequest {
     butil::IOBuf data;
     WriteRequest* next;
     bthread_id_t id_wait;
-    Socket* socket;
+    // Sharing the space to keep the struct in one cacheline.
+    union {
+        // Set when this request starts connecting or KeepWrite, namely being
+        // the first one of the list.
+        Socket* socket;
+        // WriteOptions.priority, only read when this request is queued after
+        // the first one.
+        int priority;
+    };
     
     uint32_t pipelined_count() const {
         return (_pc_and_udmsg >> 48) & 0x7FFF;
@@ -357,6 +883,24 @@ struct BAIDU_CACHELINE_ALIGNMENT Socket::WriteRequest {
 
     // Register pipelined_count and user_message
     void Setup(Socket* s);
+
+    // Exchange everything except links with `rhs'. Called after Setup().
+    void SwapPayload(WriteRequest* rhs) {
+        data.swap(rhs->data);
+        std::swap(id_wait, rhs->id_wait);
+        std::swap(priority, rhs->priority);
+        std::swap(_pc_and_udmsg, rhs->_pc_and_udmsg);
+    }
+
+    // Orders indexes of requests by descending priority.
+    struct PriorityLess {
+        explicit PriorityLess(const std::vector<WriteRequest*>& reqs)
+            : _reqs(&reqs) {}
+        bool operator()(size_t a, size_t b) const {
+            return (*_reqs)[a]->priority > (*_reqs)[b]->priority;
+        }
+        const std::vector<WriteRequest*>* _reqs;
+    };
     
 private:
     uint64_t _pc_and_udmsg;
@@ -377,6 +921,8 @@ void Socket::WriteRequest::Setup(Socket* s) {
         }
         const int64_t before_write =
             s->_unwritten_bytes.fetch_add(data.size(), butil::memory_order_relaxed);
+        ChargeBufferBudget(&g_write_budget, before_write,
+                           before_write + (int64_t)data.size());
         if (before_write + (int64_t)data.size() >= FLAGS_socket_max_unwritten_bytes) {
             s->_overcrowded = true;
         }
@@ -431,6 +977,12 @@ Socket::Socket(Forbidden)
     , _shared_part(NULL)
     , _nevent(0)
     , _keytable_pool(NULL)
+    , _bthread_tag(BTHREAD_TAG_INVALID)
+    , _edisp_index(-1)
+    , _input_event_start_us(0)
+    , _io_engine(SOCKET_IO_ENGINE_DEFAULT)
+    , _io_uring(NULL)
+    , _io_uring_slot(-1)
     , _fd(-1)
     , _tos(0)
     , _reset_fd_real_us(-1)
@@ -441,8 +993,12 @@ Socket::Socket(Forbidden)
     , _this_id(0)
     , _preferred_index(-1)
     , _hc_count(0)
+    , _revive_time_us(0)
     , _last_msg_size(0)
     , _avg_msg_size(0)
+    , _read_size_hint(0)
+    , _read_buf_charged(0)
+    , _read_paused(false)
     , _last_readtime_us(0)
     , _parsing_context(NULL)
     , _correlation_id(0)
@@ -453,25 +1009,29 @@ Socket::Socket(Forbidden)
     , _auth_context(NULL)
     , _ssl_state(SSL_UNKNOWN)
     , _ssl_session(NULL)
+    , _ssl_ktls(false)
     , _connection_type_for_progressive_read(CONNECTION_TYPE_UNKNOWN)
     , _controller_released_socket(false)
     , _overcrowded(false)
     , _fail_me_at_server_stop(false)
+    , _owns_ssl_ctx(false)
     , _logoff_flag(false)
     , _recycle_flag(false)
     , _error_code(0)
-    , _pipeline_q(NULL)
     , _last_writetime_us(0)
     , _unwritten_bytes(0)
     , _epollout_butex(NULL)
     , _write_head(NULL)
-    , _stream_set(NULL)
+    , _lazy_part(NULL)
+    , _zerocopy_ctx(NULL)
     , _rdma_ep(NULL)
 #ifdef BRPC_RDMA
     , _rdma_state(RDMA_UNKNOWN)
 #else
     , _rdma_state(RDMA_OFF)
 #endif
+    , _shm_ep(NULL)
+    , _shm_state(SHM_OFF)
 {
     CreateVarsOnce();
     pthread_mutex_init(&_id_wait_list_mutex, NULL);
@@ -482,6 +1042,9 @@ Socket::~Socket() {
     pthread_mutex_destroy(&_id_wait_list_mutex);
     bthread::butex_destroy(_epollout_butex);
     delete _rdma_ep;
+    delete _shm_ep;
+    delete _zerocopy_ctx.load(butil::memory_order_relaxed);
+    delete _lazy_part.load(butil::memory_order_relaxed);
 }
 
 void Socket::ReturnSuccessfulWriteRequest(Socket::WriteRequest* p) {
@@ -535,14 +1098,58 @@ void Socket::ReleaseAllFailedWriteRequests(Socket::WriteRequest* req) {
     ReturnFailedWriteRequest(req, error_code, error_text);
 }
 
+int Socket::AddIntoIoUring(int fd) {
+    SocketIoEngine engine = _io_engine;
+    if (engine == SOCKET_IO_ENGINE_DEFAULT) {
+        engine = (FLAGS_socket_io_engine == "io_uring" ?
+                  SOCKET_IO_ENGINE_IO_URING : SOCKET_IO_ENGINE_EPOLL);
+    }
+    // Other callbacks read the fd by themselves, SSL, RDMA and shared
+    // memory read the fd in DoRead() without going through _read_buf.
+    if (engine != SOCKET_IO_ENGINE_IO_URING ||
+        _on_edge_triggered_events != InputMessenger::OnNewMessages ||
+        _ssl_state != SSL_OFF || _rdma_ep != NULL ||
+        _shm_state != SHM_OFF || _conn != NULL) {
+        return -1;
+    }
+    IoUringEngine* io_uring =
+        GetGlobalEventDispatcher(fd, _edisp_index).GetIoUringEngine();
+    if (io_uring == NULL) {
+        return -1;
+    }
+    const int slot = io_uring->AddConsumer(id(), fd);
+    if (slot < 0) {
+        PLOG_EVERY_SECOND(WARNING) << "Fail to add fd=" << fd
+                                   << " into io_uring, use epoll instead";
+        return -1;
+    }
+    _io_uring = io_uring;
+    _io_uring_slot = slot;
+    return 0;
+}
+
+void Socket::RemoveConsumer(int fd) {
+    if (_io_uring) {
+        _io_uring->RemoveConsumer(_io_uring_slot);
+        _io_uring = NULL;
+        _io_uring_slot = -1;
+        return;
+    }
+    GetGlobalEventDispatcher(fd, _edisp_index).RemoveConsumer(fd);
+}
+
 int Socket::ResetFileDescriptor(int fd) {
     // Reset message sizes when fd is changed.
     _last_msg_size = 0;
     _avg_msg_size = 0;
+    _read_size_hint = 0;
+    _read_paused.store(false, butil::memory_order_relaxed);
     // MUST store `_fd' before adding itself into epoll device to avoid
     // race conditions with the callback function inside epoll
     _fd.store(fd, butil::memory_order_release);
     _reset_fd_real_us = butil::gettimeofday_us();
+    // Sequence numbers of zero-copy completions restart with the new fd.
+    delete _zerocopy_ctx.exchange(NULL, butil::memory_order_relaxed);
     if (!ValidFileDescriptor(fd)) {
         return 0;
     }
@@ -587,8 +1194,25 @@ int Socket::ResetFileDescriptor(int fd) {
         }
     }
 
+    if (FLAGS_socket_busy_poll_us > 0) {
+#if defined(SO_BUSY_POLL)
+        int busy_poll_us = FLAGS_socket_busy_poll_us;
+        // OK to fail, namely unix domain socket does not support this.
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                       &busy_poll_us, sizeof(busy_poll_us)) != 0) {
+            PLOG_ONCE(WARNING) << "Fail to set SO_BUSY_POLL of fd=" << fd
+                               << " to " << busy_poll_us;
+        }
+#else
+        LOG_ONCE(WARNING) << "SO_BUSY_POLL is not supported";
+#endif
+    }
+
     if (_on_edge_triggered_events) {
-        if (GetGlobalEventDispatcher(fd).AddConsumer(id(), fd) != 0) {
+        if (AddIntoIoUring(fd) == 0) {
+            return 0;
+        }
+        if (GetGlobalEventDispatcher(fd, _edisp_index).AddConsumer(id(), fd) != 0) {
             PLOG(ERROR) << "Fail to add SocketId=" << id() 
                         << " into EventDispatcher";
             _fd.store(-1, butil::memory_order_release);
@@ -612,6 +1236,11 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     CHECK(NULL == m->_shared_part.load(butil::memory_order_relaxed));
     m->_nevent.store(0, butil::memory_order_relaxed);
     m->_keytable_pool = options.keytable_pool;
+    m->_bthread_tag = options.bthread_tag;
+    m->_edisp_index = options.event_dispatcher_index;
+    m->_io_engine = options.io_engine;
+    m->_io_uring = NULL;
+    m->_io_uring_slot = -1;
     m->_tos = 0;
     m->_remote_side = options.remote_side;
     m->_on_edge_triggered_events = options.on_edge_triggered_events;
@@ -627,12 +1256,14 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
                     1, butil::memory_order_release)), slot);
     m->_preferred_index = -1;
     m->_hc_count = 0;
+    m->_revive_time_us.store(0, butil::memory_order_relaxed);
     CHECK(m->_read_buf.empty());
     const int64_t cpuwide_now = butil::cpuwide_time_us();
     m->_last_readtime_us.store(cpuwide_now, butil::memory_order_relaxed);
     m->reset_parsing_context(options.initial_parsing_context);
     m->_correlation_id = 0;
     m->_health_check_interval_s = options.health_check_interval_s;
+    m->_circuit_breaker.Reset();
     m->_ninprocess.store(1, butil::memory_order_relaxed);
     m->_auth_flag_error.store(0, butil::memory_order_relaxed);
     const int rc2 = bthread_id_create(&m->_auth_id, NULL, NULL);
@@ -644,11 +1275,20 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     // Disable SSL check if there is no SSL context
     m->_ssl_state = (options.ssl_ctx == NULL ? SSL_OFF : SSL_UNKNOWN);
     m->_ssl_session = NULL;
+    m->_ssl_ktls = false;
     m->_connection_type_for_progressive_read = CONNECTION_TYPE_UNKNOWN;
     m->_controller_released_socket.store(false, butil::memory_order_relaxed);
     m->_overcrowded = false;
     // May be non-zero for RTMP connections.
     m->_fail_me_at_server_stop = false;
+    m->_ssl_ctx = options.ssl_ctx;
+    m->_owns_ssl_ctx = options.owns_ssl_ctx;
+    CHECK(NULL == m->_lazy_part.load(butil::memory_order_relaxed));
+    if (!options.sni_name.empty() || options.initial_parsing_context) {
+        LazyPart* lp = m->GetOrNewLazyPart();
+        lp->sni_name = options.sni_name;
+        lp->initial_parsing_context = options.initial_parsing_context;
+    }
     m->_logoff_flag.store(false, butil::memory_order_relaxed);
     m->_recycle_flag.store(false, butil::memory_order_relaxed);
     m->_error_code = 0;
@@ -663,6 +1303,25 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
             return -1;
         }
     }
+    // Local clients may propose shared memory to accepted sockets even if
+    // it's not enabled, the hello is read to refuse it.
+    m->_shm_state = SHM_OFF;
+    if (options.ssl_ctx == NULL && !options.use_rdma &&
+        options.conn == NULL && options.app_connect == NULL &&
+        (options.fd < 0 ? options.use_shm :
+         shm::IsLocalPeer(options.remote_side))) {
+        m->_shm_state = SHM_UNKNOWN;
+    }
+    if (options.use_shm && m->_shm_state == SHM_UNKNOWN) {
+        m->_shm_ep = new (std::nothrow) shm::ShmEndpoint(m);
+        if (!m->_shm_ep) {
+            const int saved_errno = errno;
+            PLOG(ERROR) << "Fail to create ShmEndpoint";
+            m->SetFailed(saved_errno, "Fail to create ShmEndpoint: %s",
+                         berror(saved_errno));
+            return -1;
+        }
+    }
     // NOTE: last two params are useless in bthread > r32787
     const int rc = bthread_id_list_init(&m->_id_wait_list, 512, 512);
     if (rc) {
@@ -672,7 +1331,6 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     }
     m->_last_writetime_us.store(cpuwide_now, butil::memory_order_relaxed);
     m->_unwritten_bytes.store(0, butil::memory_order_relaxed);
-    m->_options = options;
     CHECK(NULL == m->_write_head.load(butil::memory_order_relaxed));
     // Must be last one! Internal fields of this Socket may be access
     // just after calling ResetFileDescriptor.
@@ -717,7 +1375,7 @@ int Socket::WaitAndReset(int32_t expected_nref) {
     const int prev_fd = _fd.exchange(-1, butil::memory_order_relaxed);
     if (ValidFileDescriptor(prev_fd)) {
         if (_on_edge_triggered_events != NULL) {
-            GetGlobalEventDispatcher(prev_fd).RemoveConsumer(prev_fd);
+            RemoveConsumer(prev_fd);
         }
         close(prev_fd);
         if (CreatedByConnect()) {
@@ -731,10 +1389,14 @@ int Socket::WaitAndReset(int32_t expected_nref) {
 #ifdef BRPC_RDMA
     _rdma_state = RDMA_UNKNOWN;
 #endif
+    if (_shm_ep) {
+        _shm_ep->Reset();
+        _shm_state = SHM_UNKNOWN;
+    }
 
     _local_side = butil::EndPoint();
     if (_ssl_session) {
-        SSL_free(_ssl_session);
+        FreeSSLSession(_ssl_session);
         _ssl_session = NULL;
     }        
     _ssl_state = SSL_UNKNOWN;
@@ -745,6 +1407,7 @@ int Socket::WaitAndReset(int32_t expected_nref) {
     // Must clear _read_buf otehrwise even if the connections is recovered,
     // the kept old data is likely to make parsing fail.
     _read_buf.clear();
+    UpdateReadBufferUsage();
     _ninprocess.store(1, butil::memory_order_relaxed);
     _auth_flag_error.store(0, butil::memory_order_relaxed);
     const int rc = bthread_id_create(&_auth_id, NULL, NULL);
@@ -757,11 +1420,10 @@ int Socket::WaitAndReset(int32_t expected_nref) {
     _last_readtime_us.store(cpuwide_now, butil::memory_order_relaxed);
     _last_writetime_us.store(cpuwide_now, butil::memory_order_relaxed);
     _logoff_flag.store(false, butil::memory_order_relaxed);
-    {
-        BAIDU_SCOPED_LOCK(_pipeline_mutex);
-        if (_pipeline_q) {
-            _pipeline_q->clear();
-        }
+    LazyPart* lp = GetLazyPart();
+    if (lp) {
+        BAIDU_SCOPED_LOCK(lp->pipeline_mutex);
+        lp->pipeline_q.clear();
     }
     CHECK(NULL == _write_head.load(butil::memory_order_relaxed));
     CHECK_EQ(0, _unwritten_bytes.load(butil::memory_order_relaxed));
@@ -846,10 +1508,7 @@ int Socket::SetFailed(int error_code, const char* error_fmt, ...) {
             // by Channel to revive never-connected socket when server side
             // comes online.
             if (_health_check_interval_s > 0) {
-                bthread_t th = 0;
-                int rc = bthread_start_background(
-                    &th, &BRPC_AUXTHREAD_ATTR, HealthCheckThread, (void*)id());
-                CHECK_EQ(0, rc);
+                s_hc_scheduler->Schedule(id(), 100000/*100ms*/, true);
             }
             // Wake up all threads waiting on EPOLLOUT when closing fd
             _epollout_butex->fetch_add(1, butil::memory_order_relaxed);
@@ -947,80 +1606,85 @@ int Socket::Status(SocketId id, int32_t* nref) {
     return -1;
 }
 
-void* Socket::HealthCheckThread(void* void_arg) {
-    SocketId socket_id = (SocketId)void_arg;
-    bool first_time = true;
-    if (bthread_usleep(100000) < 0) {
-        PLOG_IF(FATAL, errno != ESTOP) << "Fail to sleep";
-        return NULL;
+int64_t Socket::CheckHealthOnce(SocketId socket_id, bool first_time) {
+    SocketUniquePtr ptr;
+    const int rc = AddressFailedAsWell(socket_id, &ptr);
+    CHECK(rc != 0);
+    if (rc < 0) {
+        RPC_VLOG << "SocketId=" << socket_id
+                 << " was abandoned before health checking";
+        return -1;
+    }
+    // Note: Making a Socket re-addessable is hard. An alternative is
+    // creating another Socket with selected internal fields to replace
+    // failed Socket. Although it avoids concurrent issues with in-place
+    // revive, it changes SocketId: many code need to watch SocketId 
+    // and update on change, which is impractical. Another issue with
+    // this method is that it has to move "selected internal fields" 
+    // which may be accessed in parallel, not trivial to be moved.
+    // Finally we choose a simple-enough solution: wait until the
+    // reference count hits `expected_nref', which basically means no
+    // one is addressing the Socket(except here). Because the Socket 
+    // is not addressable, the reference count will not increase 
+    // again. This solution is not perfect because the `expected_nref'
+    // is implementation specific. In our case, one reference comes 
+    // from SocketMapInsert(socket_map.cpp), one reference is here. 
+    // Although WaitAndReset() could hang when someone is addressing
+    // the failed Socket forever (also indicating bug), this is not an 
+    // issue in current code. 
+    if (first_time) {  // Only check at first time.
+        if (ptr->WaitAndReset(2/*note*/) != 0) {
+            LOG(INFO) << "Cancel checking " << *ptr;
+            return -1;
+        }
     }
 
-    for (;;) {
-        butil::EndPoint remote_side;
-        int check_interval_s = 0;
-        do {
-            SocketUniquePtr ptr;
-            const int rc = AddressFailedAsWell(socket_id, &ptr);
-            CHECK(rc != 0);
-            if (rc < 0) {
-                RPC_VLOG << "SocketId=" << socket_id
-                         << " was abandoned before health checking";
-                return NULL;
-            }
-            remote_side = ptr->remote_side();
-            check_interval_s = ptr->_health_check_interval_s;
-            // Note: Making a Socket re-addessable is hard. An alternative is
-            // creating another Socket with selected internal fields to replace
-            // failed Socket. Although it avoids concurrent issues with in-place
-            // revive, it changes SocketId: many code need to watch SocketId 
-            // and update on change, which is impractical. Another issue with
-            // this method is that it has to move "selected internal fields" 
-            // which may be accessed in parallel, not trivial to be moved.
-            // Finally we choose a simple-enough solution: wait until the
-            // reference count hits `expected_nref', which basically means no
-            // one is addressing the Socket(except here). Because the Socket 
-            // is not addressable, the reference count will not increase 
-            // again. This solution is not perfect because the `expected_nref'
-            // is implementation specific. In our case, one reference comes 
-            // from SocketMapInsert(socket_map.cpp), one reference is here. 
-            // Although WaitAndReset() could hang when someone is addressing
-            // the failed Socket forever (also indicating bug), this is not an 
-            // issue in current code. 
-            if (first_time) {  // Only check at first time.
-                first_time = false;
-                if (ptr->WaitAndReset(2/*note*/) != 0) {
-                    LOG(INFO) << "Cancel checking " << *ptr;
-                    return NULL;
-                }
-            }
-
-            s_vars->nhealthcheck << 1;
-            int hc = 0;
-            if (ptr->_user) {
-                hc = ptr->_user->CheckHealth(ptr.get());
-            } else {
-                hc = ptr->CheckHealth();
-            }
-            if (hc == 0) {
-                if (ptr->CreatedByConnect()) {
-                    s_vars->channel_conn << -1;
-                }
-                ptr->Revive();
-                ptr->_hc_count = 0;
-                return NULL;
-            } else if (hc == ESTOP) {
-                LOG(INFO) << "Cancel checking " << *ptr;
-                return NULL;
-            }
-            ++ ptr->_hc_count;
-        } while (0);
-        CHECK_GT(check_interval_s, 0);
-        if (bthread_usleep(check_interval_s * 1000000L) < 0) {
-            PLOG_IF(FATAL, errno != ESTOP) << "Fail to sleep";
-            LOG(INFO) << "Cancel checking SocketId="
-                      << socket_id  << '@' << remote_side;
-            return NULL;
+    s_vars->nhealthcheck << 1;
+    int hc = 0;
+    if (ptr->_user) {
+        hc = ptr->_user->CheckHealth(ptr.get());
+    } else {
+        hc = ptr->CheckHealth();
+    }
+    if (hc == 0) {
+        const int64_t isolation_us =
+            ptr->_circuit_breaker.isolation_remaining_us();
+        if (isolation_us > 0) {
+            // Isolated by the circuit breaker, check again after
+            // the isolation.
+            return isolation_us;
+        }
+        if (ptr->CreatedByConnect()) {
+            s_vars->channel_conn << -1;
         }
+        ptr->_circuit_breaker.OnRevived();
+        if (FLAGS_health_check_slow_start_ms > 0) {
+            ptr->_revive_time_us.store(butil::cpuwide_time_us(),
+                                       butil::memory_order_relaxed);
+        }
+        ptr->Revive();
+        ptr->_hc_count = 0;
+        return -1;
+    } else if (hc == ESTOP) {
+        LOG(INFO) << "Cancel checking " << *ptr;
+        return -1;
+    }
+    ++ ptr->_hc_count;
+    CHECK_GT(ptr->_health_check_interval_s, 0);
+    return ptr->_health_check_interval_s * 1000000L;
+}
+
+void Socket::FeedbackCircuitBreaker(int error_code, int64_t latency_us) {
+    if (_health_check_interval_s <= 0) {
+        // Never revived after being isolated.
+        return;
+    }
+    if (!_circuit_breaker.OnCallEnd(error_code, latency_us)) {
+        LOG(ERROR) << "Isolate " << *this << " for "
+                   << _circuit_breaker.isolation_duration_ms()
+                   << "ms by the circuit breaker";
+        SetFailed(EHOSTDOWN, "Isolated by the circuit breaker for %dms",
+                  _circuit_breaker.isolation_duration_ms());
     }
 }
 
@@ -1048,7 +1712,7 @@ void Socket::OnRecycle() {
     const int prev_fd = _fd.exchange(-1, butil::memory_order_relaxed);
     if (ValidFileDescriptor(prev_fd)) {
         if (_on_edge_triggered_events != NULL) {
-            GetGlobalEventDispatcher(prev_fd).RemoveConsumer(prev_fd);
+            RemoveConsumer(prev_fd);
         }
         close(prev_fd);
         if (create_by_connect) {
@@ -1063,9 +1727,15 @@ void Socket::OnRecycle() {
 #ifdef BRPC_RDMA
     _rdma_state = RDMA_UNKNOWN;
 #endif
+    if (_shm_ep) {
+        delete _shm_ep;
+        _shm_ep = NULL;
+    }
+    _shm_state = SHM_OFF;
 
     reset_parsing_context(NULL);
     _read_buf.clear();
+    UpdateReadBufferUsage();
 
     _auth_flag_error.store(0, butil::memory_order_relaxed);
     bthread_id_error(_auth_id, 0);
@@ -1073,22 +1743,25 @@ void Socket::OnRecycle() {
     bthread_id_list_destroy(&_id_wait_list);
 
     if (_ssl_session) {
-        SSL_free(_ssl_session);
+        FreeSSLSession(_ssl_session);
         _ssl_session = NULL;
     }
 
-    if (_options.owns_ssl_ctx && _options.ssl_ctx) {
-        SSL_CTX_free(_options.ssl_ctx);
+    if (_owns_ssl_ctx && _ssl_ctx) {
+        SSL_CTX_free(_ssl_ctx);
     }
-    
-    delete _pipeline_q;
-    _pipeline_q = NULL;
+    _ssl_ctx = NULL;
+    _owns_ssl_ctx = false;
 
     delete _auth_context;
     _auth_context = NULL;
 
-    delete _stream_set;
-    _stream_set = NULL;
+    // Pipelined infos and streams are cleared by SetFailed() and nobody
+    // can add more after the socket is recycled.
+    delete _lazy_part.exchange(NULL, butil::memory_order_relaxed);
+
+    // The fd is closed, pages pinned by the kernel don't rely on the data.
+    delete _zerocopy_ctx.exchange(NULL, butil::memory_order_relaxed);
     
     s_vars->nsocket << -1;
 }
@@ -1096,6 +1769,8 @@ void Socket::OnRecycle() {
 void* Socket::ProcessEvent(void* arg) {
     // the enclosed Socket is valid and free to access inside this function.
     SocketUniquePtr s(static_cast<Socket*>(arg));
+    s_vars->input_event_delay << 
+        butil::cpuwide_time_us() - s->_input_event_start_us;
     s->_on_edge_triggered_events(s.get());
     return NULL;
 }
@@ -1170,7 +1845,18 @@ int Socket::WaitEpollOut(int fd, bool pollin, const timespec* abstime) {
     // Do not need to check addressable since it will be called by
     // health checker which called `SetFailed' before
     const int expected_val = _epollout_butex->load(butil::memory_order_relaxed);
-    EventDispatcher& edisp = GetGlobalEventDispatcher(fd);
+    if (_io_uring) {
+        // Woken up by IoUringEngine when unsent bytes drop.
+        if (_io_uring->Writable(_io_uring_slot)) {
+            return 0;
+        }
+        int rc = bthread::butex_wait(_epollout_butex, expected_val, abstime);
+        if (rc < 0 && errno == EWOULDBLOCK) {
+            rc = 0;
+        }
+        return rc;
+    }
+    EventDispatcher& edisp = GetGlobalEventDispatcher(fd, _edisp_index);
     if (edisp.AddEpollOut(id(), fd, pollin) != 0) {
         return -1;
     }
@@ -1191,12 +1877,21 @@ int Socket::WaitEpollOut(int fd, bool pollin, const timespec* abstime) {
 
 int Socket::Connect(const timespec* abstime,
                     int (*on_connect)(int, int, void*), void* data) {
-    if (_options.ssl_ctx) {
+    if (_ssl_ctx) {
         _ssl_state = SSL_CONNECTING;
     } else {
         _ssl_state = SSL_OFF;
     }
-    butil::fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    // Unix domain sockets for "unix:" endpoints.
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_len = 0;
+    if (butil::endpoint2sockaddr(remote_side(), &serv_addr,
+                                 &serv_addr_len) != 0) {
+        LOG(ERROR) << "Invalid remote_side=" << remote_side();
+        errno = EINVAL;
+        return -1;
+    }
+    butil::fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         PLOG(ERROR) << "Fail to create socket";
         return -1;
@@ -1205,14 +1900,8 @@ int Socket::Connect(const timespec* abstime,
     // We need to do async connect (to manage the timeout by ourselves).
     CHECK_EQ(0, butil::make_non_blocking(sockfd));
     
-    
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = remote_side().ip;
-    serv_addr.sin_port = htons(remote_side().port);
     const int rc = ::connect(
-        sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+        sockfd, (struct sockaddr*)&serv_addr, serv_addr_len);
     if (rc != 0 && errno != EINPROGRESS) {
         PLOG(WARNING) << "Fail to connect to " << remote_side();
         return -1;
@@ -1299,13 +1988,12 @@ int Socket::CheckConnected(int sockfd) {
         return -1;
     }
 
-    struct sockaddr_in client;
-    socklen_t size = sizeof(client);
-    CHECK_EQ(0, getsockname(sockfd, (struct sockaddr*) &client, &size));
+    butil::EndPoint local;
+    CHECK_EQ(0, butil::get_local_side(sockfd, &local));
     LOG_IF(INFO, FLAGS_log_connected)
             << "Connected to " << remote_side()
             << " via fd=" << (int)sockfd << " SocketId=" << id()
-            << " local_port=" << ntohs(client.sin_port);
+            << " local_side=" << local;
     if (CreatedByConnect()) {
         s_vars->channel_conn << 1;
     }
@@ -1534,7 +2222,7 @@ int Socket::Write(butil::IOBuf* data, const WriteOptions* options_in) {
         }
     }
 
-    if (!opt.ignore_eovercrowded && _overcrowded) {
+    if (!opt.ignore_eovercrowded && (_overcrowded || IsOverWriteBudget())) {
         return SetError(opt.id_wait, EOVERCROWDED);
     }
 
@@ -1550,6 +2238,8 @@ int Socket::Write(butil::IOBuf* data, const WriteOptions* options_in) {
     req->id_wait = opt.id_wait;
     req->set_pipelined_count_and_user_message(
         opt.pipelined_count, DUMMY_USER_MESSAGE, opt.with_auth);
+    // Reordering breaks positional correspondence of pipelined requests.
+    req->priority = (opt.pipelined_count ? 0 : opt.priority);
     return StartWrite(req, opt);
 }
 
@@ -1571,7 +2261,7 @@ int Socket::Write(SocketMessagePtr<>& msg, const WriteOptions* options_in) {
         }
     }
     
-    if (!opt.ignore_eovercrowded && _overcrowded) {
+    if (!opt.ignore_eovercrowded && (_overcrowded || IsOverWriteBudget())) {
         return SetError(opt.id_wait, EOVERCROWDED);
     }
     
@@ -1585,6 +2275,7 @@ int Socket::Write(SocketMessagePtr<>& msg, const WriteOptions* options_in) {
     req->next = WriteRequest::UNCONNECTED;
     req->id_wait = opt.id_wait;
     req->set_pipelined_count_and_user_message(opt.pipelined_count, msg.release(), opt.with_auth);
+    req->priority = (opt.pipelined_count ? 0 : opt.priority);
     return StartWrite(req, opt);
 }
 
@@ -1606,6 +2297,8 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
     bthread_t th;
     SocketUniquePtr ptr_for_keep_write;
     ssize_t nw = 0;
+    // Last request of the list written in the calling thread.
+    WriteRequest* batch_tail = req;
 
     // We've got the right to write.
     req->next = NULL;
@@ -1632,14 +2325,29 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
         // in the background.
         goto KEEPWRITE_IN_BACKGROUND;
     }
+
+    if (_shm_state == SHM_UNKNOWN && _shm_ep) {
+        // Propose shared memory and wait for the reply in KeepWrite.
+        goto KEEPWRITE_IN_BACKGROUND;
+    }
     
+    if (FLAGS_socket_write_coalesce_us > 0 && !req->data.empty() &&
+        req->data.size() < (size_t)FLAGS_socket_write_coalesce_bytes) {
+        batch_tail = CoalesceWriteRequests(req);
+    }
+
     // Write once in the calling thread. If the write is not complete,
     // continue it in KeepWrite thread.
-    if (_conn) {
+    if (batch_tail != req) {
+        nw = DoWrite(req);
+    } else if (_conn) {
         butil::IOBuf* data_arr[1] = { &req->data };
         nw = _conn->CutMessageIntoFileDescriptor(fd(), data_arr, 1);
     } else {
-        if (_rdma_ep && _rdma_state == RDMA_ON) {
+        if (_shm_state == SHM_ON) {
+            butil::IOBuf* data_arr[1] = { &req->data };
+            nw = _shm_ep->CutFromIOBufList(data_arr, 1);
+        } else if (_rdma_ep && _rdma_state == RDMA_ON) {
             butil::IOBuf* data_arr[1] = { &req->data };
             nw = _rdma_ep->CutFromIOBufList(data_arr, 1);
         } else {
@@ -1658,6 +2366,20 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
         }
     } else {
         AddOutputBytes(nw);
+        if (batch_tail == req) {
+            s_vars->write_batch_size << 1;
+        }
+    }
+    if (batch_tail != req) {
+        // Release written requests until non-empty data or the last one.
+        while (req->next != NULL && req->data.empty()) {
+            WriteRequest* const saved_req = req;
+            req = req->next;
+            ReturnSuccessfulWriteRequest(saved_req);
+        }
+        if (req != batch_tail) {
+            goto KEEPWRITE_IN_BACKGROUND;
+        }
     }
     if (IsWriteComplete(req, true, NULL)) {
         ReturnSuccessfulWriteRequest(req);
@@ -1685,11 +2407,102 @@ FAIL_TO_WRITE:
 
 static const size_t DATA_LIST_MAX = 256;
 
+Socket::WriteRequest* Socket::CoalesceWriteRequests(WriteRequest* req) {
+    const int64_t deadline =
+        butil::cpuwide_time_us() + FLAGS_socket_write_coalesce_us;
+    const size_t max_bytes = FLAGS_socket_write_coalesce_bytes;
+    size_t nbytes = req->data.size();
+    size_t nreq = 1;
+    WriteRequest* tail = req;
+    do {
+        if (_write_head.load(butil::memory_order_relaxed) == tail) {
+            cpu_relax();
+            continue;
+        }
+        // Link requests pushed by other writers after `tail', never
+        // complete since `req' is not written yet.
+        WriteRequest* const prev_tail = tail;
+        IsWriteComplete(prev_tail, (req == prev_tail), &tail);
+        for (WriteRequest* p = prev_tail->next; p != NULL; p = p->next) {
+            nbytes += p->data.size();
+            ++nreq;
+        }
+    } while (nbytes < max_bytes && nreq < DATA_LIST_MAX &&
+             butil::cpuwide_time_us() < deadline);
+    if (nreq > 1) {
+        s_vars->ncoalesced_write << nreq - 1;
+    }
+    return tail;
+}
+
+void Socket::PrioritizeWriteRequests(WriteRequest* head,
+                                     WriteRequest* prev_tail) {
+    WriteRequest* p = prev_tail->next;
+    for (; p != NULL && p->priority == 0; p = p->next) {}
+    if (p == NULL) {
+        return;
+    }
+    // `head' may be partially written and new requests are linked after the
+    // last one which is referenced by _write_head, so nodes stay in place
+    // and their payloads are permuted instead.
+    std::vector<WriteRequest*> nodes;
+    for (p = head->next; p != NULL; p = p->next) {
+        nodes.push_back(p);
+    }
+    // order[i] is the index of the payload moved into nodes[i].
+    std::vector<size_t> order(nodes.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), WriteRequest::PriorityLess(nodes));
+    std::vector<bool> done(nodes.size(), false);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (done[i]) {
+            continue;
+        }
+        size_t j = i;
+        for (; order[j] != i; j = order[j]) {
+            nodes[j]->SwapPayload(nodes[order[j]]);
+            done[j] = true;
+        }
+        done[j] = true;
+    }
+    s_vars->nprioritized_write << 1;
+}
+
 void* Socket::KeepWrite(void* void_arg) {
     s_vars->nkeepwrite << 1;
     WriteRequest* req = static_cast<WriteRequest*>(void_arg);
     SocketUniquePtr s(req->socket);
 
+    if (s->_shm_state == SHM_UNKNOWN && s->_shm_ep) {
+        if (s->_shm_ep->StartHandshake() < 0) {
+            const int saved_errno = errno;
+            s->SetFailed(saved_errno, "Fail to propose shared memory to %s: %s",
+                         s->description().c_str(), berror(saved_errno));
+        }
+        const timespec duetime = butil::milliseconds_from_now(
+            shm::FLAGS_shm_handshake_timeout_ms);
+        while (!s->Failed()) {
+            const int expected_val = s->_epollout_butex
+                ->load(butil::memory_order_acquire);
+            if (s->_shm_state != SHM_UNKNOWN) {
+                break;
+            }
+            if (bthread::butex_wait(s->_epollout_butex,
+                    expected_val, &duetime) < 0 &&
+                errno != EAGAIN && errno != EINTR) {
+                s->SetFailed(errno, "Shared memory handshake with %s timeout",
+                             s->description().c_str());
+                break;
+            }
+        }
+        if (s->Failed()) {
+            s->ReleaseAllFailedWriteRequests(req);
+            return NULL;
+        }
+    }
+
 #ifdef BRPC_RDMA
     if (s->_rdma_state == RDMA_UNKNOWN) {
         rdma::RdmaEndpoint* ep = s->_rdma_ep;
@@ -1764,6 +2577,23 @@ void* Socket::KeepWrite(void* void_arg) {
             // growing infinitely.
             const timespec duetime =
                 butil::milliseconds_from_now(WAIT_EPOLLOUT_TIMEOUT_MS);
+            if (s->_shm_state == SHM_ON) {
+                // Woken by doorbells from the peer after it reads.
+                const int expected_val = s->_epollout_butex
+                    ->load(butil::memory_order_acquire);
+                if (!s->_shm_ep->IsWritable() &&
+                    bthread::butex_wait(s->_epollout_butex,
+                                        expected_val, &duetime) < 0 &&
+                    errno != EAGAIN && errno != ETIMEDOUT &&
+                    errno != EINTR) {
+                    s->SetFailed(errno, "Fail to wait for shared memory of %s",
+                                 s->description().c_str());
+                    break;
+                }
+                if (s->Failed()) {
+                    break;
+                }
+            } else
 #ifndef BRPC_RDMA
             if (BAIDU_UNLIKELY(s->_rdma_state == RDMA_ON)) {
 #else
@@ -1803,14 +2633,19 @@ void* Socket::KeepWrite(void* void_arg) {
         if (NULL == cur_tail) {
             for (cur_tail = req; cur_tail->next != NULL;
                  cur_tail = cur_tail->next);
+            s->PrioritizeWriteRequests(req, req);
         }
         // Return when there's no more WriteRequests and req is completely
         // written.
+        WriteRequest* const prev_tail = cur_tail;
         if (s->IsWriteComplete(cur_tail, (req == cur_tail), &cur_tail)) {
             CHECK_EQ(cur_tail, req);
             s->ReturnSuccessfulWriteRequest(req);
             return NULL;
         }
+        if (cur_tail != prev_tail) {
+            s->PrioritizeWriteRequests(req, prev_tail);
+        }
     } while (1);
 
     // Error occurred, release all requests until no new requests.
@@ -1826,15 +2661,35 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
          p = p->next) {
         data_list[ndata++] = &p->data;
     }
+    s_vars->write_batch_size << ndata;
 
     if (ssl_state() == SSL_OFF) {
         // Write IOBuf in the batch array into the fd.
         if (_conn) {
             return _conn->CutMessageIntoFileDescriptor(fd(), data_list, ndata);
         } else {
+            if (_shm_state == SHM_ON) {
+                return _shm_ep->CutFromIOBufList(data_list, ndata);
+            }
             if (_rdma_ep && _rdma_state == RDMA_ON) {
                 return _rdma_ep->CutFromIOBufList(data_list, ndata);
             }
+            if (_io_uring) {
+                return _io_uring->Write(_io_uring_slot, data_list, ndata);
+            }
+            if (_zerocopy_ctx.load(butil::memory_order_relaxed) != NULL) {
+                ReapZeroCopyCompletions();
+            }
+            const int64_t zerocopy_threshold = FLAGS_socket_zerocopy_threshold;
+            if (zerocopy_threshold > 0) {
+                size_t nbytes = 0;
+                for (size_t i = 0; i < ndata; ++i) {
+                    nbytes += data_list[i]->size();
+                }
+                if (nbytes >= (size_t)zerocopy_threshold) {
+                    return DoZeroCopyWrite(data_list, ndata);
+                }
+            }
             return butil::IOBuf::cut_multiple_into_file_descriptor(
                     fd(), data_list, ndata);
         }
@@ -1845,6 +2700,10 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
         // TODO: Separate SSL stuff from SocketConnection
         return _conn->CutMessageIntoSSLChannel(_ssl_session, data_list, ndata);
     }
+    if (_ssl_ktls) {
+        return butil::IOBuf::cut_multiple_into_file_descriptor(
+            fd(), data_list, ndata);
+    }
     int ssl_error = 0;
     ssize_t nw = butil::IOBuf::cut_multiple_into_SSL_channel(
         _ssl_session, data_list, ndata, &ssl_error);
@@ -1877,8 +2736,98 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
     return nw;
 }
 
+ssize_t Socket::DoZeroCopyWrite(butil::IOBuf* const* data_list, size_t ndata) {
+    ZeroCopyContext* ctx = _zerocopy_ctx.load(butil::memory_order_relaxed);
+    if (ctx == NULL) {
+        ctx = new ZeroCopyContext;
+#if defined(OS_LINUX)
+        const int on = 1;
+        if (setsockopt(fd(), SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+            ctx->enabled = true;
+        } else {
+            PLOG_EVERY_SECOND(WARNING) << "Fail to set SO_ZEROCOPY on " << *this;
+        }
+#endif
+        _zerocopy_ctx.store(ctx, butil::memory_order_release);
+    }
+    if (ctx->enabled) {
+        // Send with the lock held, otherwise the completion may be reaped
+        // by DoRead() before the sent data is pushed into `pending'.
+        std::unique_lock<butil::Mutex> mu(ctx->mutex);
+        if (ctx->pending_bytes < (size_t)FLAGS_socket_max_unwritten_bytes) {
+            butil::IOBuf sent;
+            const ssize_t nw = butil::IOBuf::cut_multiple_into_socket_zerocopy(
+                fd(), data_list, ndata, &sent);
+            if (nw > 0) {
+                ctx->pending.push_back(butil::IOBuf());
+                ctx->pending.back().swap(sent);
+                ctx->pending_bytes += nw;
+                mu.unlock();
+                s_vars->zerocopy_bytes << nw;
+                return nw;
+            }
+            if (nw == 0 || errno != ENOBUFS) {
+                return nw;
+            }
+        }
+    }
+    s_vars->zerocopy_fallback << 1;
+    return butil::IOBuf::cut_multiple_into_file_descriptor(
+        fd(), data_list, ndata);
+}
+
+void Socket::ReapZeroCopyCompletions() {
+#if defined(OS_LINUX)
+    ZeroCopyContext* ctx = _zerocopy_ctx.load(butil::memory_order_acquire);
+    if (ctx == NULL || !ctx->enabled) {
+        return;
+    }
+    // Blocks are released outside the lock.
+    std::deque<butil::IOBuf> completed;
+    while (true) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            // EAGAIN: no more completions.
+            break;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            const struct sock_extended_err* serr =
+                (const struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            // Sends with sequence numbers in [ee_info, ee_data] are completed.
+            // Completions of a TCP connection are in order, so sends before
+            // ee_info were completed as well.
+            const uint32_t hi = serr->ee_data;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                s_vars->zerocopy_copied << (hi - serr->ee_info + 1);
+            }
+            BAIDU_SCOPED_LOCK(ctx->mutex);
+            while (!ctx->pending.empty() &&
+                   (int32_t)(hi - ctx->first_seq) >= 0) {
+                ctx->pending_bytes -= ctx->pending.front().size();
+                completed.push_back(butil::IOBuf());
+                completed.back().swap(ctx->pending.front());
+                ctx->pending.pop_front();
+                ++ctx->first_seq;
+            }
+        }
+    }
+#endif
+}
+
 int Socket::SSLHandshake(int fd, bool server_mode) {
-    if (_options.ssl_ctx == NULL) {
+    if (_ssl_ctx == NULL) {
         if (server_mode) {
             LOG(ERROR) << "Lack SSL configuration to handle SSL request";
             return -1;
@@ -1886,33 +2835,53 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
         return 0;
     }
 
-    // TODO: Reuse ssl session id for client
     if (_ssl_session) {
         // Free the last session, which may be deprecated when socket failed
-        SSL_free(_ssl_session);
+        FreeSSLSession(_ssl_session);
     }
-    _ssl_session = CreateSSLSession(_options.ssl_ctx, id(), fd, server_mode);
+    _ssl_ktls = false;
+    _ssl_session = CreateSSLSession(_ssl_ctx, id(), fd, server_mode,
+                                    FLAGS_ssl_ktls);
     if (_ssl_session == NULL) {
         return -1;
     }
 #ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
-    if (!_options.sni_name.empty()) {
-        SSL_set_tlsext_host_name(_ssl_session, _options.sni_name.c_str());
+    const LazyPart* lp = GetLazyPart();
+    if (lp && !lp->sni_name.empty()) {
+        SSL_set_tlsext_host_name(_ssl_session, lp->sni_name.c_str());
     }
 #endif // SSL_CTRL_SET_TLSEXT_HOSTNAME
     _ssl_state = SSL_CONNECTING;
 
+    const int64_t start_us = butil::cpuwide_time_us();
+    bool delayed = s_ssl_limiter->WaitForStart();
     // Loop until SSL handshake has completed. For SSL_ERROR_WANT_READ/WRITE,
     // we use bthread_fd_wait as polling mechanism instead of EventDispatcher
     // as it may confuse the origin event processing code.
     while (true) {
+        // Only computations are limited, waiting for the peer is not.
+        const bool limited = s_ssl_limiter->Acquire(&delayed);
         int rc = SSL_do_handshake(_ssl_session);
+        if (limited) {
+            s_ssl_limiter->Release();
+        }
+        if (delayed) {
+            s_vars->ssl_handshake_delayed << 1;
+            delayed = false;
+        }
         if (rc == 1) {
             _ssl_state = SSL_CONNECTED;
+            s_vars->ssl_handshake << butil::cpuwide_time_us() - start_us;
             if (FLAGS_http_verbose) {
                 std::cerr << _ssl_session << std::endl;
             }
-            AddBIOBuffer(_ssl_session, fd, FLAGS_ssl_bio_buffer_size);
+            if (IsKernelTLSSendEnabled(_ssl_session)) {
+                // OpenSSL must write into the fd directly which is
+                // encrypted by the kernel.
+                _ssl_ktls = true;
+            } else {
+                AddBIOBuffer(_ssl_session, fd, FLAGS_ssl_bio_buffer_size);
+            }
             return 0;
         }
 
@@ -1924,6 +2893,7 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
 #elif defined(OS_MACOSX)
             if (bthread_fd_wait(fd, EVFILT_READ) != 0) {
 #endif
+                s_vars->ssl_handshake_fail << 1;
                 return -1;
             }
             break;
@@ -1934,6 +2904,7 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
 #elif defined(OS_MACOSX)
             if (bthread_fd_wait(fd, EVFILT_WRITE) != 0) {
 #endif
+                s_vars->ssl_handshake_fail << 1;
                 return -1;
             }
             break;
@@ -1949,6 +2920,7 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
                 errno = ESSL;
                 LOG(ERROR) << "Fail to SSL_do_handshake: " << SSLError(e);
             }
+            s_vars->ssl_handshake_fail << 1;
             return -1;
         }
         }
@@ -1956,6 +2928,15 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
 }
 
 ssize_t Socket::DoRead(size_t size_hint) {
+    if (_io_uring) {
+        // Received already, see Socket::AddIntoIoUring().
+        butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_READ_BUFFER);
+        return _io_uring->Read(_io_uring_slot, &_read_buf, size_hint);
+    }
+    // Completions of zero-copy writes wake up input events with EPOLLERR.
+    if (_zerocopy_ctx.load(butil::memory_order_relaxed) != NULL) {
+        ReapZeroCopyCompletions();
+    }
     if (ssl_state() == SSL_UNKNOWN) {
         int error_code = 0;
         _ssl_state = DetectSSLState(fd(), &error_code);
@@ -1985,6 +2966,13 @@ ssize_t Socket::DoRead(size_t size_hint) {
     }
     // _ssl_state has been set
     if (ssl_state() == SSL_OFF) {
+        if (_shm_state != SHM_OFF) {
+            if (_shm_ep) {
+                return _shm_ep->Read(size_hint);
+            }
+            // Local clients are refused.
+            return shm::ShmEndpoint::HandshakeAtServer(this, size_hint);
+        }
 #ifdef BRPC_RDMA
         if (_rdma_state == RDMA_UNKNOWN) {
             if (_rdma_ep) {
@@ -2023,13 +3011,18 @@ ssize_t Socket::DoRead(size_t size_hint) {
             return rc;
         }
 #endif
+        butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_READ_BUFFER);
         return _read_buf.append_from_file_descriptor(fd(), size_hint);
     }
 
     CHECK_EQ(SSL_CONNECTED, ssl_state());
     _rdma_state = RDMA_OFF;
     int ssl_error = 0;
-    ssize_t nr = _read_buf.append_from_SSL_channel(_ssl_session, &ssl_error, size_hint);
+    ssize_t nr = 0;
+    {
+        butil::ScopedIOBufBlockTag block_tag(IOBUF_BLOCK_TAG_READ_BUFFER);
+        nr = _read_buf.append_from_SSL_channel(_ssl_session, &ssl_error, size_hint);
+    }
     switch (ssl_error) {
     case SSL_ERROR_NONE:  // `nr' > 0
         break;
@@ -2111,7 +3104,8 @@ AuthContext* Socket::mutable_auth_context() {
 }
 
 int Socket::StartInputEvent(SocketId id, uint32_t events,
-                            const bthread_attr_t& thread_attr) {
+                            const bthread_attr_t& thread_attr,
+                            size_t inline_max_bytes) {
     SocketUniquePtr s;
     if (Address(id, &s) < 0) {
         return -1;
@@ -2140,6 +3134,12 @@ int Socket::StartInputEvent(SocketId id, uint32_t events,
         // According to the stats, above fetch_add is very effective. In a
         // server processing 1 million requests per second, this counter
         // is just 1500~1700/s
+        s->_input_event_start_us = butil::cpuwide_time_us();
+        if (inline_max_bytes > 0 && s->CanProcessEventInline(inline_max_bytes)) {
+            s_vars->ninline_event << 1;
+            ProcessEvent(s.release());
+            return 0;
+        }
         s_vars->neventthread << 1;
 
         bthread_t tid;
@@ -2148,6 +3148,9 @@ int Socket::StartInputEvent(SocketId id, uint32_t events,
 
         bthread_attr_t attr = thread_attr;
         attr.keytable_pool = p->_keytable_pool;
+        if (p->_bthread_tag != BTHREAD_TAG_INVALID) {
+            attr.tag = p->_bthread_tag;
+        }
         if (bthread_start_urgent(&tid, &attr, ProcessEvent, p) != 0) {
             LOG(FATAL) << "Fail to start ProcessEvent";
             ProcessEvent(p);
@@ -2156,6 +3159,25 @@ int Socket::StartInputEvent(SocketId id, uint32_t events,
     return 0;
 }
 
+bool Socket::CanProcessEventInline(size_t max_bytes) const {
+    // Messages of tagged servers must be processed by workers of the tag.
+    if (_bthread_tag != BTHREAD_TAG_INVALID &&
+        _bthread_tag != BTHREAD_TAG_DEFAULT) {
+        return false;
+    }
+    // Data of RDMA and shared memory is not counted by FIONREAD, data of
+    // io_uring is received already.
+    if (_rdma_state == RDMA_ON || _shm_state == SHM_ON || _io_uring != NULL) {
+        return false;
+    }
+    int nreadable = 0;
+    if (ioctl(fd(), FIONREAD, &nreadable) != 0) {
+        return false;
+    }
+    // 0 means EOF or errors which are processed in bthreads as usual.
+    return nreadable > 0 && (size_t)nreadable <= max_bytes;
+}
+
 void DereferenceSocket(Socket* s) {
     if (s) {
         s->Dereference();
@@ -2186,6 +3208,13 @@ std::ostream& operator<<(std::ostream& os, const ObjectPtr<T>& obj) {
     return os << obj._obj;
 }
 
+size_t Socket::rdma_window_bytes() const {
+    if (_rdma_ep == NULL || _rdma_state != RDMA_ON) {
+        return 0;
+    }
+    return _rdma_ep->GetWindowBytes();
+}
+
 void Socket::DebugSocket(std::ostream& os, SocketId id) {
     SocketUniquePtr ptr;
     int ret = Socket::AddressFailedAsWell(id, &ptr);
@@ -2206,11 +3235,10 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
     size_t npipelined = 0;
     size_t idsizes[4];
     size_t nidsize = 0;
-    {
-        BAIDU_SCOPED_LOCK(ptr->_pipeline_mutex);
-        if (ptr->_pipeline_q) {
-            npipelined = ptr->_pipeline_q->size();
-        }
+    LazyPart* lp = ptr->GetLazyPart();
+    if (lp) {
+        BAIDU_SCOPED_LOCK(lp->pipeline_mutex);
+        npipelined = lp->pipeline_q.size();
     }
     {
         BAIDU_SCOPED_LOCK(ptr->_id_wait_list_mutex);
@@ -2267,7 +3295,11 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
     }
     const int64_t cpuwide_now = butil::cpuwide_time_us();
     os << "\nhc_count=" << ptr->_hc_count
+       << "\ncircuit_breaker_broken=" << ptr->_circuit_breaker.broken()
+       << "\ncircuit_breaker_admission_permille="
+       << ptr->_circuit_breaker.admission_permille()
        << "\navg_input_msg_size=" << ptr->_avg_msg_size
+       << "\nread_size_hint=" << ptr->_read_size_hint
         // NOTE: We're assuming that butil::IOBuf.size() is thread-safe, it is now
         // however it's not guaranteed.
        << "\nread_buf=" << ptr->_read_buf.size()
@@ -2293,15 +3325,17 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
     } else {
         os << "\nparsing_context=" << ShowObject(parsing_context);
     }
-    os << "\npipeline_q=" << npipelined
+    os << "\nmemory_usage=" << ptr->MemoryUsage()
+       << "\npipeline_q=" << npipelined
        << "\nhc_interval_s=" << ptr->_health_check_interval_s
        << "\nninprocess=" << ptr->_ninprocess.load(butil::memory_order_relaxed)
        << "\nauth_flag_error=" << ptr->_auth_flag_error.load(butil::memory_order_relaxed)
        << "\nauth_id=" << ptr->_auth_id.value
        << "\nauth_context=" << ptr->_auth_context
        << "\nssl_state=" << SSLStateToString(ptr->_ssl_state)
-       << "\nssl_ctx=" << (void*)ptr->_options.ssl_ctx
+       << "\nssl_ctx=" << (void*)ptr->_ssl_ctx
        << "\nssl_session=" << (void*)ptr->_ssl_session
+       << "\nssl_ktls=" << ptr->_ssl_ktls
        << "\nlogoff_flag=" << ptr->_logoff_flag.load(butil::memory_order_relaxed)
        << "\nrecycle_flag=" << ptr->_recycle_flag.load(butil::memory_order_relaxed)
        << "\ncid=" << ptr->_correlation_id
@@ -2365,6 +3399,60 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
 #endif
 }
 
+#if defined(OS_LINUX)
+static const unsigned HC_IN = EPOLLIN;
+static const unsigned HC_OUT = EPOLLOUT;
+#elif defined(OS_MACOSX)
+static const unsigned HC_IN = EVFILT_READ;
+static const unsigned HC_OUT = EVFILT_WRITE;
+#endif
+
+// GET `path' from the server over the connected `fd' and wait for the
+// status line of the response. Returns 0 when the status is 200.
+static int CheckHealthByHttp(int fd, const butil::EndPoint& remote_side,
+                             const std::string& path) {
+    const timespec abstime = butil::milliseconds_from_now(
+        FLAGS_health_check_timeout_ms);
+    butil::IOBuf req;
+    req.append("GET ");
+    req.append(path);
+    req.append(" HTTP/1.1\r\nHost: ");
+    req.append(butil::endpoint2str(remote_side).c_str());
+    req.append("\r\nConnection: close\r\n\r\n");
+    while (!req.empty()) {
+        const ssize_t nw = req.cut_into_file_descriptor(fd);
+        if (nw < 0) {
+            if (errno != EAGAIN) {
+                return errno;
+            }
+            if (bthread_fd_timedwait(fd, HC_OUT, &abstime) != 0) {
+                return errno;
+            }
+        }
+    }
+    // "HTTP/1.x 200" is enough to tell the result.
+    char buf[64];
+    size_t len = 0;
+    while (len < 12) {
+        const ssize_t nr = read(fd, buf + len, sizeof(buf) - len);
+        if (nr > 0) {
+            len += nr;
+        } else if (nr == 0) {
+            return ECONNRESET;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            return errno;
+        } else if (bthread_fd_timedwait(fd, HC_IN, &abstime) != 0) {
+            return errno;
+        }
+    }
+    if (memcmp(buf, "HTTP/1.", 7) != 0 || memcmp(buf + 8, " 200", 4) != 0) {
+        LOG(WARNING) << "Unhealthy response from " << remote_side << ": "
+                     << butil::StringPiece(buf, std::min(len, (size_t)12));
+        return EHOSTDOWN;
+    }
+    return 0;
+}
+
 int Socket::CheckHealth() {
     if (_hc_count == 0) {
         LOG(INFO) << "Checking " << *this;
@@ -2375,49 +3463,90 @@ int Socket::CheckHealth() {
     // revive the socket.
     const int connected_fd = Connect(NULL/*Note*/, NULL, NULL);
     if (connected_fd >= 0) {
+        int rc = 0;
+        if (!FLAGS_health_check_path.empty() && _ssl_ctx == NULL) {
+            // Servers accepting connections may still be unable to serve,
+            // e.g. overloaded or warming up.
+            rc = CheckHealthByHttp(connected_fd, remote_side(),
+                                   FLAGS_health_check_path);
+        }
         ::close(connected_fd);
-        return 0;
+        return rc;
     }
     return errno;
 }
 
+int Socket::slow_start_permille() const {
+    const int64_t revive_time_us =
+        _revive_time_us.load(butil::memory_order_relaxed);
+    if (revive_time_us == 0) {
+        return 1000;
+    }
+    const int64_t slow_start_us = FLAGS_health_check_slow_start_ms * 1000L;
+    const int64_t elapsed_us = butil::cpuwide_time_us() - revive_time_us;
+    if (elapsed_us >= slow_start_us) {
+        _revive_time_us.store(0, butil::memory_order_relaxed);
+        return 1000;
+    }
+    return (int)(elapsed_us * 1000 / slow_start_us);
+}
+
 int Socket::AddStream(StreamId stream_id) {
-    _stream_mutex.lock();
+    LazyPart* lp = GetOrNewLazyPart();
+    lp->stream_mutex.lock();
     if (Failed()) {
-        _stream_mutex.unlock();
+        lp->stream_mutex.unlock();
         return -1;
     }
-    if (_stream_set == NULL) {
-        _stream_set = new std::set<StreamId>();
-    }
-    _stream_set->insert(stream_id);
-    _stream_mutex.unlock();
+    lp->stream_set.insert(stream_id);
+    lp->stream_mutex.unlock();
     return 0;
 }
 
 int Socket::RemoveStream(StreamId stream_id) {
-    _stream_mutex.lock();
-    if (_stream_set == NULL) {
-        _stream_mutex.unlock();
+    LazyPart* lp = GetLazyPart();
+    if (lp == NULL) {
         CHECK(false) << "AddStream was not called";
         return -1;
     }
-    _stream_set->erase(stream_id);
-    _stream_mutex.unlock();
+    lp->stream_mutex.lock();
+    lp->stream_set.erase(stream_id);
+    lp->stream_mutex.unlock();
+    return 0;
+}
+
+int Socket::WriteStreamFrames(StreamId stream_id, int weight,
+                              std::deque<butil::IOBuf>* frames) {
+    LazyPart* lp = GetOrNewLazyPart();
+    if (!lp->stream_frame_queue.Push(stream_id, weight, frames)) {
+        // Written by another thread.
+        return 0;
+    }
+    butil::IOBuf batch;
+    while (lp->stream_frame_queue.PickFrames(FLAGS_stream_write_quantum, &batch)) {
+        // Frames of other streams are queued during waiting, which makes
+        // following rounds fair.
+        if (BRPC_HANDLE_EOVERCROWDED(Write(&batch)) != 0) {
+            lp->stream_frame_queue.Clear();
+            return -1;
+        }
+        batch.clear();
+    }
     return 0;
 }
 
 void Socket::ResetAllStreams() {
     DCHECK(Failed());
     std::set<StreamId> saved_stream_set;
-    _stream_mutex.lock();
-    if (_stream_set != NULL) {
-        // Not delete _stream_set because there are likely more streams added
-        // after reviving if the Socket is still in use, or it is to be deleted in 
-        // OnRecycle()
-        saved_stream_set.swap(*_stream_set);
-    }
-    _stream_mutex.unlock();
+    LazyPart* lp = GetLazyPart();
+    if (lp != NULL) {
+        // Not delete the set because there are likely more streams added
+        // after reviving if the Socket is still in use, or it is to be
+        // deleted in OnRecycle()
+        lp->stream_mutex.lock();
+        saved_stream_set.swap(lp->stream_set);
+        lp->stream_mutex.unlock();
+    }
     for (std::set<StreamId>::const_iterator 
             it = saved_stream_set.begin(); it != saved_stream_set.end(); ++it) {
         Stream::SetFailed(*it);
@@ -2435,7 +3564,24 @@ void SocketUser::AfterRevived(Socket* ptr) {
 ////////// SocketPool //////////////
 
 inline SocketPool::SocketPool(const SocketOptions& opt)
-    : _options(opt), _remote_side(opt.remote_side), _count(0) {
+    : _options(opt)
+    , _remote_side(opt.remote_side)
+    , _count(0)
+    , _low_water(0)
+    , _min_size(0)
+    , _ewma_surplus(0)
+    , _nfree_var(GetFreeCount, this) {
+    // Pools to the same endpoint with different SSL or auth settings are
+    // told apart by a sequence number.
+    static butil::atomic<int> s_npool(0);
+    std::string prefix = "rpc_socket_pool_";
+    prefix.append(butil::endpoint2str(_remote_side).c_str());
+    if (!bvar::Variable::describe_exposed(prefix + "_free_count").empty()) {
+        butil::string_appendf(&prefix, "_%d", s_npool.fetch_add(1) + 1);
+    }
+    _nfree_var.expose_as(prefix, "free_count");
+    _ncreated.expose_as(prefix, "created_count");
+    _ntrimmed.expose_as(prefix, "trimmed_count");
 }
 
 inline SocketPool::~SocketPool() {
@@ -2475,6 +3621,9 @@ inline int SocketPool::GetSocket(SocketUniquePtr* ptr) {
                 }
                 sid = _pool.back();
                 _pool.pop_back();
+                if ((int)_pool.size() < _low_water) {
+                    _low_water = _pool.size();
+                }
             }
             _count.fetch_sub(1, butil::memory_order_relaxed);
             // Not address inside the lock since at most time the pooled socket
@@ -2484,12 +3633,32 @@ inline int SocketPool::GetSocket(SocketUniquePtr* ptr) {
             }
         }
     }
-    // Not found in pool
+    // Not found in pool, all free sockets are in use.
+    if (connection_pool_size > 0) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _low_water = 0;
+    }
+    return CreateSocket(ptr);
+}
+
+inline int SocketPool::CreateSocket(SocketUniquePtr* ptr) {
     SocketOptions opt = _options;
     // Only main socket can be the owner of ssl_ctx
     opt.owns_ssl_ctx = false;
     opt.health_check_interval_s = -1;
+    SocketId sid;
     if (get_client_side_messenger()->Create(opt, &sid) == 0) {
+        _ncreated << 1;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            // Not drained when the SocketMap does not close idle
+            // connections, don't grow infinitely.
+            if (_new_sockets.size() >= MAX_NEW_SOCKETS) {
+                _new_sockets.erase(_new_sockets.begin(),
+                                   _new_sockets.begin() + MAX_NEW_SOCKETS / 2);
+            }
+            _new_sockets.push_back(sid);
+        }
         return Socket::Address(sid, ptr);
     }
     return -1;
@@ -2536,6 +3705,80 @@ inline void SocketPool::ListSockets(std::vector<SocketId>* out, size_t max_count
     _mutex.unlock();
 }
 
+inline void SocketPool::ListNewSockets(std::vector<SocketId>* out) {
+    out->clear();
+    BAIDU_SCOPED_LOCK(_mutex);
+    out->swap(_new_sockets);
+}
+
+void SocketPool::WarmUp(int n, int connect_timeout_ms) {
+    int cur_min = _min_size.load(butil::memory_order_relaxed);
+    while (cur_min < n && !_min_size.compare_exchange_weak(
+               cur_min, n, butil::memory_order_relaxed)) {}
+    // Sockets with customized connecting are connected by the first write.
+    if (_options.conn != NULL || _options.app_connect != NULL) {
+        return;
+    }
+    while (_count.load(butil::memory_order_relaxed) < n) {
+        SocketUniquePtr ptr;
+        if (CreateSocket(&ptr) != 0) {
+            return;
+        }
+        timespec abstime;
+        if (connect_timeout_ms > 0) {
+            abstime = butil::milliseconds_from_now(connect_timeout_ms);
+        }
+        // Connect synchronously, SSL handshake included.
+        butil::fd_guard sockfd(ptr->Connect(
+            (connect_timeout_ms > 0 ? &abstime : NULL), NULL, NULL));
+        if (sockfd < 0 || ptr->ResetFileDescriptor(sockfd) != 0) {
+            const int saved_errno = (errno ? errno : EINVAL);
+            ptr->SetFailed(saved_errno, "Fail to warm up pooled socket: %s",
+                           berror(saved_errno));
+            return;
+        }
+        sockfd.release();
+        ReturnSocket(ptr.get());
+    }
+}
+
+void SocketPool::Trim() {
+    const int min_size = _min_size.load(butil::memory_order_relaxed);
+    int low_water = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        low_water = _low_water;
+        _low_water = _pool.size();
+    }
+    // Free sockets not used in last second are surplus. Smooth it so that
+    // sockets closed are not likely to be re-created soon by bursts.
+    _ewma_surplus = _ewma_surplus * 0.7 + low_water * 0.3;
+    const int ntrim = std::min(low_water, (int)_ewma_surplus);
+    if (ntrim <= 0) {
+        return;
+    }
+    std::vector<SocketId> trimmed;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        // Sockets are got from the back, the front ones are least used.
+        const int n = std::min(ntrim, (int)_pool.size() - min_size);
+        if (n <= 0) {
+            return;
+        }
+        trimmed.assign(_pool.begin(), _pool.begin() + n);
+        _pool.erase(_pool.begin(), _pool.begin() + n);
+        _low_water = _pool.size();
+    }
+    _count.fetch_sub(trimmed.size(), butil::memory_order_relaxed);
+    _ntrimmed << trimmed.size();
+    for (size_t i = 0; i < trimmed.size(); ++i) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(trimmed[i], &ptr) == 0) {
+            ptr->SetFailed(EUNUSED, "Close surplus pooled socket");
+        }
+    }
+}
+
 Socket::SharedPart* Socket::GetOrNewSharedPartSlower() {
     // Create _shared_part optimistically.
     SharedPart* shared_part = GetSharedPart();
@@ -2553,6 +3796,128 @@ Socket::SharedPart* Socket::GetOrNewSharedPartSlower() {
     return shared_part;
 }
 
+Socket::LazyPart* Socket::GetOrNewLazyPart() {
+    LazyPart* lp = GetLazyPart();
+    if (lp == NULL) {
+        lp = new LazyPart;
+        LazyPart* expected = NULL;
+        if (!_lazy_part.compare_exchange_strong(
+                expected, lp, butil::memory_order_acq_rel)) {
+            delete lp;
+            CHECK(expected);
+            lp = expected;
+        }
+    }
+    return lp;
+}
+
+// NOTE: Push/Pop may be called from different threads simultaneously.
+void Socket::PushPipelinedInfo(const PipelinedInfo& pi) {
+    LazyPart* lp = GetOrNewLazyPart();
+    BAIDU_SCOPED_LOCK(lp->pipeline_mutex);
+    lp->pipeline_q.push_back(pi);
+}
+
+bool Socket::PopPipelinedInfo(PipelinedInfo* info) {
+    LazyPart* lp = GetLazyPart();
+    if (lp == NULL) {
+        return false;
+    }
+    BAIDU_SCOPED_LOCK(lp->pipeline_mutex);
+    if (!lp->pipeline_q.empty()) {
+        *info = lp->pipeline_q.front();
+        lp->pipeline_q.pop_front();
+        return true;
+    }
+    return false;
+}
+
+void Socket::GivebackPipelinedInfo(const PipelinedInfo& pi) {
+    LazyPart* lp = GetLazyPart();
+    if (lp != NULL) {
+        BAIDU_SCOPED_LOCK(lp->pipeline_mutex);
+        lp->pipeline_q.push_front(pi);
+    }
+}
+
+uint64_t Socket::ReserveOrderedWrite() {
+    LazyPart* lp = GetOrNewLazyPart();
+    BAIDU_SCOPED_LOCK(lp->ordered_write_mutex);
+    return lp->next_ordered_slot++;
+}
+
+int Socket::WriteInOrder(uint64_t slot, butil::IOBuf* data) {
+    LazyPart* lp = GetOrNewLazyPart();
+    WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    // Write() with IOBuf does not call back, holding the mutex guarantees
+    // that data of consecutive slots enter the write queue in order.
+    BAIDU_SCOPED_LOCK(lp->ordered_write_mutex);
+    if (slot != lp->next_written_slot) {
+        lp->ordered_writes[slot].swap(*data);
+        return 0;
+    }
+    const int rc = (data->empty() ? 0 : Write(data, &wopt));
+    ++lp->next_written_slot;
+    while (!lp->ordered_writes.empty()) {
+        std::map<uint64_t, butil::IOBuf>::iterator it =
+            lp->ordered_writes.begin();
+        if (it->first != lp->next_written_slot) {
+            break;
+        }
+        if (!it->second.empty()) {
+            // Failures mean that the socket is failed, which is noticed by
+            // writers of the slots from other places.
+            Write(&it->second, &wopt);
+        }
+        lp->ordered_writes.erase(it);
+        ++lp->next_written_slot;
+    }
+    return rc;
+}
+
+void Socket::GetOriginalOptions(SocketOptions* opt) const {
+    opt->fd = -1;
+    opt->remote_side = _remote_side;
+    opt->user = _user;
+    opt->on_edge_triggered_events = _on_edge_triggered_events;
+    opt->health_check_interval_s = _health_check_interval_s;
+    opt->owns_ssl_ctx = _owns_ssl_ctx;
+    opt->ssl_ctx = _ssl_ctx;
+    opt->use_rdma = (_rdma_ep != NULL);
+    opt->use_shm = (_shm_ep != NULL);
+    opt->keytable_pool = _keytable_pool;
+    opt->bthread_tag = _bthread_tag;
+    opt->event_dispatcher_index = _edisp_index;
+    opt->io_engine = _io_engine;
+    opt->conn = _conn;
+    opt->app_connect = _app_connect;
+    const LazyPart* lp = GetLazyPart();
+    if (lp) {
+        opt->sni_name = lp->sni_name;
+        opt->initial_parsing_context = lp->initial_parsing_context;
+    }
+}
+
+size_t Socket::MemoryUsage() const {
+    size_t n = sizeof(Socket);
+    // Blocks may be shared with messages being processed, counted fully.
+    n += _read_buf.backing_block_num() * butil::IOBuf::DEFAULT_BLOCK_SIZE;
+    n += _unwritten_bytes.load(butil::memory_order_relaxed);
+    const LazyPart* lp = GetLazyPart();
+    if (lp) {
+        n += sizeof(LazyPart) + lp->sni_name.capacity();
+        // Not locked, the sizes are for display only.
+        n += lp->pipeline_q.size() * sizeof(PipelinedInfo);
+        // Nodes of std::set have 4 extra pointer-sized fields.
+        n += lp->stream_set.size() * (sizeof(StreamId) + 4 * sizeof(void*));
+    }
+    if (_zerocopy_ctx.load(butil::memory_order_relaxed)) {
+        n += sizeof(ZeroCopyContext);
+    }
+    return n;
+}
+
 void Socket::ShareStats(Socket* main_socket) {
     SharedPart* main_sp = main_socket->GetOrNewSharedPart();
     main_sp->AddRefManually();
@@ -2563,21 +3928,18 @@ void Socket::ShareStats(Socket* main_socket) {
     }
 }
 
-int Socket::GetPooledSocket(Socket* main_socket,
-                            SocketUniquePtr* pooled_socket) {
-    if (main_socket == NULL || pooled_socket == NULL) {
-        LOG(ERROR) << "main_socket or pooled_socket is NULL";
-        return -1;
-    }
+SocketPool* Socket::GetOrNewSocketPool(Socket* main_socket) {
     SharedPart* main_sp = main_socket->GetOrNewSharedPart();
     if (main_sp == NULL) {
         LOG(ERROR) << "main_socket->_shared_part is NULL";
-        return -1;
+        return NULL;
     }
     // Create socket_pool optimistically.
     SocketPool* socket_pool = main_sp->socket_pool.load(butil::memory_order_consume);
     if (socket_pool == NULL) {
-        socket_pool = new SocketPool(main_socket->_options);
+        SocketOptions opt;
+        main_socket->GetOriginalOptions(&opt);
+        socket_pool = new SocketPool(opt);
         SocketPool* expected = NULL;
         if (!main_sp->socket_pool.compare_exchange_strong(
                 expected, socket_pool, butil::memory_order_acq_rel)) {
@@ -2586,6 +3948,19 @@ int Socket::GetPooledSocket(Socket* main_socket,
             socket_pool = expected;
         }
     }
+    return socket_pool;
+}
+
+int Socket::GetPooledSocket(Socket* main_socket,
+                            SocketUniquePtr* pooled_socket) {
+    if (main_socket == NULL || pooled_socket == NULL) {
+        LOG(ERROR) << "main_socket or pooled_socket is NULL";
+        return -1;
+    }
+    SocketPool* socket_pool = GetOrNewSocketPool(main_socket);
+    if (socket_pool == NULL) {
+        return -1;
+    }
     if (socket_pool->GetSocket(pooled_socket) != 0) {
         return -1;
     }
@@ -2637,7 +4012,162 @@ void Socket::ListPooledSockets(std::vector<SocketId>* out, size_t max_count) {
     }
     pool->ListSockets(out, max_count);
 }
+
+void Socket::ListNewPooledSockets(std::vector<SocketId>* out) {
+    out->clear();
+    SharedPart* sp = GetSharedPart();
+    if (sp == NULL) {
+        return;
+    }
+    SocketPool* pool = sp->socket_pool.load(butil::memory_order_consume);
+    if (pool == NULL) {
+        return;
+    }
+    pool->ListNewSockets(out);
+}
     
+// Index of the calling thread, assigned in round-robin to spread workers
+// over multiplexed sockets uniformly.
+static BAIDU_THREAD_LOCAL int tls_multiplexed_index = -1;
+static butil::atomic<int> s_nmultiplexed_thread(0);
+
+int Socket::GetMultiplexedSocket(Socket* main_socket,
+                                 SocketUniquePtr* out,
+                                 int designated_index) {
+    if (main_socket == NULL || out == NULL) {
+        LOG(ERROR) << "main_socket or out is NULL";
+        return -1;
+    }
+    const int n = std::min((int)FLAGS_single_connection_num,
+                           (int)MultiplexedSockets::MAX_NUM);
+    SharedPart* main_sp = NULL;
+    if (n <= 1 || (main_sp = main_socket->GetOrNewSharedPart()) == NULL) {
+        main_socket->ReAddress(out);
+        return 0;
+    }
+    MultiplexedSockets* ms =
+        main_sp->multiplexed_sockets.load(butil::memory_order_consume);
+    if (ms == NULL) {
+        ms = new MultiplexedSockets;
+        MultiplexedSockets* expected = NULL;
+        if (!main_sp->multiplexed_sockets.compare_exchange_strong(
+                expected, ms, butil::memory_order_acq_rel)) {
+            delete ms;
+            ms = expected;
+        }
+    }
+    int index = 0;
+    if (designated_index >= 0) {
+        index = designated_index % n;
+    } else if (FLAGS_single_connection_by_unwritten_bytes) {
+        int64_t min_unwritten =
+            main_socket->_unwritten_bytes.load(butil::memory_order_relaxed);
+        SocketUniquePtr best;
+        for (int i = 1; i < n && min_unwritten > 0; ++i) {
+            SocketUniquePtr ptr;
+            if (Socket::Address(ms->ids[i].load(butil::memory_order_relaxed),
+                                &ptr) != 0) {
+                // Not created or broken, nothing to write.
+                index = i;
+                best.reset();
+                break;
+            }
+            const int64_t unwritten =
+                ptr->_unwritten_bytes.load(butil::memory_order_relaxed);
+            if (unwritten < min_unwritten) {
+                min_unwritten = unwritten;
+                index = i;
+                best.reset(ptr.release());
+            }
+        }
+        if (best != NULL) {
+            out->reset(best.release());
+            return 0;
+        }
+    } else {
+        if (tls_multiplexed_index < 0) {
+            tls_multiplexed_index = s_nmultiplexed_thread.fetch_add(
+                1, butil::memory_order_relaxed) & 0x7FFFFFFF;
+        }
+        index = tls_multiplexed_index % n;
+    }
+    if (index == 0) {
+        main_socket->ReAddress(out);
+        return 0;
+    }
+    if (Socket::Address(ms->ids[index].load(butil::memory_order_acquire),
+                        out) == 0) {
+        return 0;
+    }
+    BAIDU_SCOPED_LOCK(ms->mutex);
+    // Created by another thread just now.
+    if (Socket::Address(ms->ids[index].load(butil::memory_order_relaxed),
+                        out) == 0) {
+        return 0;
+    }
+    SocketOptions opt;
+    main_socket->GetOriginalOptions(&opt);
+    // Only main socket can be the owner of ssl_ctx
+    opt.owns_ssl_ctx = false;
+    // Replaced with a new one when broken.
+    opt.health_check_interval_s = -1;
+    SocketId sid;
+    if (get_client_side_messenger()->Create(opt, &sid) != 0) {
+        return -1;
+    }
+    // Fail the previous one in case that it's revived by someone.
+    Socket::SetFailed(ms->ids[index].exchange(sid, butil::memory_order_release));
+    return Socket::Address(sid, out);
+}
+
+struct WarmUpPooledSocketsArg {
+    SocketId main_socket_id;
+    int n;
+    int connect_timeout_ms;
+};
+
+void* Socket::WarmUpPooledSocketsThread(void* void_arg) {
+    std::unique_ptr<WarmUpPooledSocketsArg> arg(
+        static_cast<WarmUpPooledSocketsArg*>(void_arg));
+    SocketUniquePtr main_socket;
+    if (Socket::Address(arg->main_socket_id, &main_socket) != 0) {
+        return NULL;
+    }
+    SocketPool* pool = Socket::GetOrNewSocketPool(main_socket.get());
+    if (pool != NULL) {
+        pool->WarmUp(arg->n, arg->connect_timeout_ms);
+    }
+    return NULL;
+}
+
+void Socket::WarmUpPooledSockets(Socket* main_socket, int n,
+                                 int connect_timeout_ms) {
+    if (main_socket == NULL || n <= 0) {
+        return;
+    }
+    WarmUpPooledSocketsArg* arg = new WarmUpPooledSocketsArg;
+    arg->main_socket_id = main_socket->id();
+    arg->n = n;
+    arg->connect_timeout_ms = connect_timeout_ms;
+    bthread_t th;
+    if (bthread_start_background(&th, &BTHREAD_ATTR_NORMAL,
+                                 WarmUpPooledSocketsThread, arg) != 0) {
+        LOG(WARNING) << "Fail to start bthread to warm up pooled sockets";
+        delete arg;
+    }
+}
+
+void Socket::TrimPooledSockets() {
+    SharedPart* sp = GetSharedPart();
+    if (sp == NULL) {
+        return;
+    }
+    SocketPool* pool = sp->socket_pool.load(butil::memory_order_consume);
+    if (pool != NULL) {
+        pool->Trim();
+    }
+}
+
 int Socket::GetShortSocket(Socket* main_socket,
                            SocketUniquePtr* short_socket) {
     if (main_socket == NULL || short_socket == NULL) {
@@ -2645,7 +4175,8 @@ int Socket::GetShortSocket(Socket* main_socket,
         return -1;
     }
     SocketId id;
-    SocketOptions opt = main_socket->_options;
+    SocketOptions opt;
+    main_socket->GetOriginalOptions(&opt);
     // Only main socket can be the owner of ssl_ctx
     opt.owns_ssl_ctx = false;
     opt.health_check_interval_s = -1;
@@ -2680,16 +4211,91 @@ void Socket::AddInputMessages(size_t count) {
 void Socket::CancelUnwrittenBytes(size_t bytes) {
     const int64_t before_minus =
         _unwritten_bytes.fetch_sub(bytes, butil::memory_order_relaxed);
+    ChargeBufferBudget(&g_write_budget, before_minus,
+                       before_minus - (int64_t)bytes);
     if (before_minus < (int64_t)bytes + FLAGS_socket_max_unwritten_bytes) {
         _overcrowded = false;
     }
 }
+bool Socket::IsOverWriteBudget() const {
+    if (!IsOverBufferBudget(
+            g_write_budget, FLAGS_socket_max_total_unwritten_bytes,
+            _unwritten_bytes.load(butil::memory_order_relaxed))) {
+        return false;
+    }
+    s_vars->nwrite_over_budget << 1;
+    return true;
+}
+
+bool Socket::UpdateReadBufferUsage() {
+    const int64_t size = _read_buf.size();
+    ChargeBufferBudget(&g_read_budget, _read_buf_charged, size);
+    _read_buf_charged = size;
+    return IsOverBufferBudget(
+        g_read_budget, FLAGS_socket_max_total_read_buffer_bytes, size);
+}
+
+bool Socket::PauseReading() {
+    const int fd = this->fd();
+    if (fd < 0 || _io_uring != NULL) {
+        // Reads of io_uring are submitted by the engine.
+        return false;
+    }
+    if (!_read_paused.exchange(true, butil::memory_order_relaxed)) {
+        EventDispatcher& edisp = GetGlobalEventDispatcher(fd, _edisp_index);
+        if (edisp.PauseInput(id(), fd) != 0) {
+            _read_paused.store(false, butil::memory_order_relaxed);
+            return false;
+        }
+        bthread_timer_t timer;
+        if (bthread_timer_add(
+                &timer, butil::milliseconds_from_now(FLAGS_socket_read_pause_ms),
+                ResumeReading, (void*)id()) != 0) {
+            edisp.ResumeInput(id(), fd);
+            _read_paused.store(false, butil::memory_order_relaxed);
+            return false;
+        }
+        s_vars->nread_paused << 1;
+    }
+    // Otherwise the socket was resumed by waiting for EPOLLOUT which watches
+    // EPOLLIN as well, and the pending timer resumes it again.
+    // Events arrived before pausing are not lost since ResumeReading()
+    // starts processing anyway.
+    _nevent.store(0, butil::memory_order_release);
+    return true;
+}
+
+void Socket::ResumeReading(void* arg) {
+    const SocketId id = (SocketId)arg;
+    SocketUniquePtr s;
+    if (Address(id, &s) != 0) {
+        return;
+    }
+    s->_read_paused.store(false, butil::memory_order_relaxed);
+    const int fd = s->fd();
+    if (fd < 0 ||
+        GetGlobalEventDispatcher(fd, s->_edisp_index).ResumeInput(id, fd) != 0) {
+        return;
+    }
+    // Process the data arrived during the pause, which are not notified
+    // by epoll again, as well as the buffered data of SSL or shared memory.
+#if defined(OS_LINUX)
+    StartInputEvent(id, EPOLLIN, BTHREAD_ATTR_NORMAL);
+#elif defined(OS_MACOSX)
+    StartInputEvent(id, EVFILT_READ, BTHREAD_ATTR_NORMAL);
+#endif
+}
+
 void Socket::AddOutputBytes(size_t bytes) {
     GetOrNewSharedPart()->out_size.fetch_add(bytes, butil::memory_order_relaxed);
     _last_writetime_us.store(butil::cpuwide_time_us(),
                              butil::memory_order_relaxed);
     CancelUnwrittenBytes(bytes);
 }
+size_t Socket::written_bytes() const {
+    SharedPart* sp = GetSharedPart();
+    return sp ? sp->out_size.load(butil::memory_order_relaxed) : 0;
+}
 void Socket::AddOutputMessages(size_t count) {
     GetOrNewSharedPart()->out_num_messages.fetch_add(count, butil::memory_order_relaxed);
 }
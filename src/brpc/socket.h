@@ -37,11 +37,15 @@
 #include "brpc/options.pb.h"              // ConnectionType
 #include "brpc/socket_id.h"               // SocketId
 #include "brpc/socket_message.h"          // SocketMessagePtr
+#include "brpc/circuit_breaker.h"         // CircuitBreaker
 
 
 namespace brpc {
 namespace policy {
 class ConsistentHashingLoadBalancer;
+class MaglevLoadBalancer;
+class JumpHashLoadBalancer;
+class ApertureLoadBalancer;
 class RtmpContext;
 }  // namespace policy
 namespace schan {
@@ -51,11 +55,17 @@ namespace rdma {
 class RdmaCompletionQueue;
 class RdmaEndpoint;
 }
+namespace shm {
+class ShmEndpoint;
+}
 
 class Socket;
 class AuthContext;
 class EventDispatcher;
 class Stream;
+class IoUringEngine;
+struct ZeroCopyContext;
+class SocketPool;
 
 // A special closure for processing the about-to-recycle socket. Socket does
 // not delete SocketUser, if you want, `delete this' at the end of
@@ -141,6 +151,18 @@ struct PipelinedInfo {
     bthread_id_t id_wait;
 };
 
+// How a Socket reads and writes its fd.
+enum SocketIoEngine {
+    // Specified by -socket_io_engine
+    SOCKET_IO_ENGINE_DEFAULT = 0,
+    // epoll + readv/writev
+    SOCKET_IO_ENGINE_EPOLL = 1,
+    // io_uring, see details/io_uring_engine.h. Only sockets reading messages
+    // by InputMessenger without SSL or RDMA use io_uring, others and sockets
+    // failed to be added into io_uring fall back to epoll.
+    SOCKET_IO_ENGINE_IO_URING = 2,
+};
+
 // TODO: Comment fields
 struct SocketOptions {
     SocketOptions();
@@ -162,8 +184,20 @@ struct SocketOptions {
     bool owns_ssl_ctx;
     SSL_CTX* ssl_ctx;
     bool use_rdma;
+    // Transfer data through shared memory if the remote side is on this
+    // machine and agrees (see shm/shm_endpoint.h). Sockets created by
+    // connecting propose it, accepted sockets accept it.
+    bool use_shm;
     std::string sni_name;
     bthread_keytable_pool_t* keytable_pool;
+    // Tag of workers running bthreads that read this socket. If it's
+    // BTHREAD_TAG_INVALID, the bthreads run on tag of the thread
+    // triggering the events.
+    bthread_tag_t bthread_tag;
+    // Index of the global EventDispatcher handling the fd. If it's negative,
+    // the dispatcher is chosen by hash of the fd.
+    int event_dispatcher_index;
+    SocketIoEngine io_engine;
     SocketConnection* conn;
     AppConnect* app_connect;
     // The created socket will set parsing_context with this value.
@@ -181,11 +215,20 @@ friend class SocketUser;
 friend class Stream;
 friend class Controller;
 friend class policy::ConsistentHashingLoadBalancer;
+friend class policy::MaglevLoadBalancer;
+friend class policy::JumpHashLoadBalancer;
+friend class policy::ApertureLoadBalancer;
 friend class policy::RtmpContext;
 friend class schan::ChannelBalancer;
 friend class rdma::RdmaCompletionQueue;  // for use of keytable_pool
 friend class rdma::RdmaEndpoint;
+friend class shm::ShmEndpoint;
+friend class IoUringEngine;
+friend class SocketPool;
+friend class HealthCheckScheduler;
+friend struct butil::ResourcePoolReclaimer<Socket>;
     class SharedPart;
+    struct LazyPart;
     struct Forbidden {};
     struct WriteRequest;
 
@@ -235,10 +278,21 @@ public:
         // Default: false
         bool ignore_eovercrowded;
 
+        // Queued writes with larger priority are written before queued
+        // writes with smaller priority, writes with the same priority keep
+        // their order. A write being partially written is never interrupted,
+        // so this only helps protocols whose messages can be reordered on
+        // the connection, e.g. responses matched by correlation ids. Bulk
+        // messages could be written with a negative priority to not block
+        // small ones queued after them.
+        // Ignored when pipelined_count is non-zero.
+        // Default: 0
+        int priority;
+
         WriteOptions()
             : id_wait(INVALID_BTHREAD_ID), abstime(NULL)
             , pipelined_count(0), with_auth(false)
-            , ignore_eovercrowded(false) {}
+            , ignore_eovercrowded(false), priority(0) {}
     };
     int Write(butil::IOBuf *msg, const WriteOptions* options = NULL);
     
@@ -304,7 +358,7 @@ public:
 
     // Mark this Socket or the Socket associated with `id' as failed.
     // Any later Address() of the identifier shall return NULL unless the
-    // Socket was revivied by HealthCheckThread. The Socket is NOT recycled
+    // Socket was revivied by health checking. The Socket is NOT recycled
     // after calling this function, instead it will be recycled when no one
     // references it. Internal fields of the Socket are still accessible
     // after calling this function. Calling SetFailed() of a Socket more
@@ -339,11 +393,15 @@ public:
     // Once set, this flag can only be cleared inside `WaitAndReset'
     void SetLogOff();
     bool IsLogOff() const;
+
     
     // Start to process edge-triggered events from the fd.
-    // This function does not block caller.
+    // This function does not block caller unless `inline_max_bytes' is
+    // positive and no more than so many bytes are readable from the fd, in
+    // which case the events are processed in the calling thread.
     static int StartInputEvent(SocketId id, uint32_t events,
-                               const bthread_attr_t& thread_attr);
+                               const bthread_attr_t& thread_attr,
+                               size_t inline_max_bytes = 0);
 
     static const int PROGRESS_INIT = 1;
     bool MoreReadEvents(int* progress);
@@ -378,6 +436,24 @@ public:
     // Undo previous PopPipelinedInfo
     void GivebackPipelinedInfo(const PipelinedInfo&);
 
+    // [Server-side] Responses to pipelined requests of protocols without
+    // correlation ids (HTTP/1.x) must be written in the order of requests.
+    // Reserve a slot for each request in the order of parsing and write the
+    // response with WriteInOrder(), which holds `data' until data of all
+    // previous slots are written. Every reserved slot must be written
+    // (possibly with empty data), otherwise following ones are stuck.
+    // EOVERCROWDED is never returned.
+    uint64_t ReserveOrderedWrite();
+    int WriteInOrder(uint64_t slot, butil::IOBuf* data);
+
+    // Write `frames' of stream `stream_id', frames of streams over this
+    // socket are written in weighted round-robin, each stream gets `weight'
+    // times -stream_write_quantum bytes in each round. The caller may write
+    // frames of other streams when the socket is overcrowded, which is
+    // never returned. `frames' is cleared.
+    int WriteStreamFrames(StreamId stream_id, int weight,
+                          std::deque<butil::IOBuf>* frames);
+
     void set_preferred_index(int index) { _preferred_index = index; }
     int preferred_index() const { return _preferred_index; }
     
@@ -390,6 +466,10 @@ public:
     // fields will be zero.
     void GetStat(SocketStat* out) const;
 
+    // Approximate bytes of memory held by this socket, including buffered
+    // input/output and states allocated on demand.
+    size_t MemoryUsage() const;
+
     // Call this when you receive an EOF event. `SetFailed' will be
     // called at last if EOF event is no longer postponed
     void SetEOF();
@@ -398,6 +478,10 @@ public:
     void CheckEOF();
     
     SSLState ssl_state() const { return _ssl_state; }
+
+    // Bytes the remote side can receive before crediting the receive buffers
+    // back, which bounds bytes in flight over RDMA. 0 if RDMA is not on.
+    size_t rdma_window_bytes() const;
     X509* GetPeerCertificate() const;
     
     // Print debugging inforamtion of `id' into the ostream.
@@ -406,6 +490,19 @@ public:
     // Number of Heahth checking since last socket failure.
     int health_check_count() const { return _hc_count; }
 
+    // Feed the circuit breaker with a call to the server, and isolate this
+    // socket if the server is broken. The socket is revived by health
+    // checking after the isolation, circuit breaking is off when health
+    // checking is off.
+    void FeedbackCircuitBreaker(int error_code, int64_t latency_us);
+
+    const CircuitBreaker& circuit_breaker() const { return _circuit_breaker; }
+
+    // Chance in thousandths that a call should be sent to the server, which
+    // grows linearly to 1000 in -health_check_slow_start_ms after the socket
+    // is revived by health checking.
+    int slow_start_permille() const;
+
     // True if this socket was created by Connect.
     bool CreatedByConnect() const;
 
@@ -421,10 +518,35 @@ public:
     // Put all sockets in _shared_part->socket_pool into `list'.
     void ListPooledSockets(std::vector<SocketId>* list, size_t max_count = 0);
 
+    // Put pooled sockets created since last call into `list'. Called by
+    // SocketMap to watch idle pooled sockets.
+    void ListNewPooledSockets(std::vector<SocketId>* list);
+
+    // Connect pooled sockets of main_socket in background until there're
+    // `n' free ones in the pool, which are not closed by
+    // TrimPooledSockets() either. Each connection takes at most
+    // `connect_timeout_ms', <= 0 means no limit.
+    static void WarmUpPooledSockets(Socket* main_socket, int n,
+                                    int connect_timeout_ms);
+
+    // Close free pooled sockets beyond recent demand, see
+    // -connection_pool_adaptive_size. Called every second by SocketMap.
+    void TrimPooledSockets();
+
     // Create a socket connecting to the same place of main_socket.
     static int GetShortSocket(Socket* main_socket,
                               SocketUniquePtr* short_socket);
 
+    // Get one of -single_connection_num multiplexed sockets connecting to
+    // the same place of main_socket, main_socket itself included. Broken
+    // sockets other than main_socket are replaced with new ones.
+    // If `index' is non-negative, the (index % -single_connection_num)-th
+    // socket is chosen, otherwise the socket is chosen by the calling thread
+    // or -single_connection_by_unwritten_bytes.
+    static int GetMultiplexedSocket(Socket* main_socket,
+                                    SocketUniquePtr* out,
+                                    int index = -1);
+
     // Where the stats of this socket are accumulated to.
     SocketId main_socket_id() const;
 
@@ -465,6 +587,10 @@ public:
     // Returns true if the remote side is overcrowded.
     bool is_overcrowded() const { return _overcrowded; }
 
+    // Bytes written into the fd so far, including bytes written by sockets
+    // sharing stats with this socket, see ShareStats().
+    size_t written_bytes() const;
+
 private:
     DISALLOW_COPY_AND_ASSIGN(Socket);
 
@@ -494,6 +620,24 @@ friend void DereferenceSocket(Socket*);
     // success, -1 otherwise and errno is set
     ssize_t DoWrite(WriteRequest* req);
 
+    // Wait for at most -socket_write_coalesce_us for WriteRequests from
+    // concurrent writers and link them after `req' which is the only
+    // request being written. Returns the last request of the list.
+    WriteRequest* CoalesceWriteRequests(WriteRequest* req);
+
+    // Sort requests after `head' by priority if any request after
+    // `prev_tail' has non-zero priority.
+    void PrioritizeWriteRequests(WriteRequest* head, WriteRequest* prev_tail);
+
+    // Write `data_list' into fd with MSG_ZEROCOPY, fall back to writev
+    // when zero-copy is not possible. Returns written bytes on success,
+    // -1 otherwise and errno is set
+    ssize_t DoZeroCopyWrite(butil::IOBuf* const* data_list, size_t ndata);
+
+    // Release data sent with MSG_ZEROCOPY whose completions have been
+    // notified in the error queue of fd.
+    void ReapZeroCopyCompletions();
+
     // Called before returning to pool.
     void OnRecycle();
 
@@ -522,7 +666,9 @@ friend void DereferenceSocket(Socket*);
     int ConnectIfNot(const timespec* abstime, WriteRequest* req);
     
     int ResetFileDescriptor(int fd);
-    static void* HealthCheckThread(void*);
+    // Check health of a failed socket once, called by HealthCheckScheduler.
+    // Returns microseconds to check again, -1 to stop checking.
+    static int64_t CheckHealthOnce(SocketId id, bool first_time);
 
     // Returns 0 on success, 1 on failed socket, -1 on recycled.
     static int AddressFailedAsWell(SocketId id, SocketUniquePtr* ptr);
@@ -535,7 +681,19 @@ friend void DereferenceSocket(Socket*);
 
     static void* ProcessEvent(void*);
 
+    // True if events of this socket can be processed in the dispatcher
+    // when at most `max_bytes' are readable.
+    bool CanProcessEventInline(size_t max_bytes) const;
+
+    // Put `fd' into io_uring of its dispatcher if this socket should use
+    // io_uring. Returns 0 on success, -1 otherwise.
+    int AddIntoIoUring(int fd);
+
+    // Stop watching events of `fd' in io_uring or epoll.
+    void RemoveConsumer(int fd);
+
     static void* KeepWrite(void*);
+    static void* WarmUpPooledSocketsThread(void*);
 
     bool IsWriteComplete(WriteRequest* old_head, bool singular_node,
                          WriteRequest** new_tail);
@@ -559,7 +717,7 @@ friend void DereferenceSocket(Socket*);
     static void HandleEpollOutTimeout(void* arg);
 
     // Try to wake socket just like epollout has arrived
-    // Used by RdmaEndpoint
+    // Used by RdmaEndpoint and ShmEndpoint
     void WakeAsEpollOut();
 
     // Callback when connection event reaches (succeeded or not)
@@ -593,6 +751,16 @@ friend void DereferenceSocket(Socket*);
     SharedPart* GetOrNewSharedPart();
     SharedPart* GetOrNewSharedPartSlower();
 
+    // Get or create the pool of pooled sockets. NULL on error.
+    static SocketPool* GetOrNewSocketPool(Socket* main_socket);
+
+    LazyPart* GetLazyPart() const;
+    LazyPart* GetOrNewLazyPart();
+
+    // Options to create sockets sharing the connection settings of this
+    // socket (pooled or short connections). fd is always -1.
+    void GetOriginalOptions(SocketOptions* opt) const;
+
     void CheckEOFInternal();
     
     // _error_code is set after a socket becomes failed, during the time
@@ -607,6 +775,22 @@ friend void DereferenceSocket(Socket*);
     void CancelUnwrittenBytes(size_t bytes);
 
 private:
+    // True if unwritten bytes of all sockets exceed
+    // -socket_max_total_unwritten_bytes and this socket holds more than
+    // its share.
+    bool IsOverWriteBudget() const;
+
+    // Charge the size of _read_buf to -socket_max_total_read_buffer_bytes.
+    // Returns true if the budget is exceeded and this socket buffers more
+    // than its share, in which case reading should be paused.
+    // Called by the thread reading this socket only.
+    bool UpdateReadBufferUsage();
+
+    // Stop watching input events of this socket for -socket_read_pause_ms.
+    // Returns false if reading of this socket can't be paused.
+    bool PauseReading();
+    static void ResumeReading(void* arg);
+
     // The on/off state of RDMA
     enum RdmaState {
         RDMA_ON,
@@ -614,6 +798,14 @@ private:
         RDMA_UNKNOWN
     };
 
+    // The on/off state of shared memory. Sockets proposing or possibly
+    // being proposed shared memory are SHM_UNKNOWN until the handshake ends.
+    enum ShmState {
+        SHM_ON,
+        SHM_OFF,
+        SHM_UNKNOWN
+    };
+
     // unsigned 32-bit version + signed 32-bit referenced-count.
     // Meaning of version:
     // * Created version: no SetFailed() is called on the Socket yet. Must be
@@ -639,6 +831,24 @@ private:
     // May be set by Acceptor to share keytables between reading threads
     // on sockets created by the Acceptor.
     bthread_keytable_pool_t* _keytable_pool;
+
+    // May be set by Acceptor to run reading bthreads on workers of the tag.
+    bthread_tag_t _bthread_tag;
+
+    // May be set by Acceptor to handle the fd in the dispatcher owning the
+    // listening fd, see -reuse_port.
+    int _edisp_index;
+
+    // cpuwide_time_us when the dispatcher started a thread to process
+    // events, to measure the delay before processing.
+    int64_t _input_event_start_us;
+
+    // Set in Create(), see SocketIoEngine.
+    SocketIoEngine _io_engine;
+    // Non-NULL when the fd is read and written by io_uring, in the slot
+    // `_io_uring_slot' of the engine.
+    IoUringEngine* _io_uring;
+    int _io_uring_slot;
     
     // [ Set in ResetFileDescriptor ] 
     butil::atomic<int> _fd;  // -1 when not connected.
@@ -656,8 +866,9 @@ private:
     // carefully before implementing the callback.
     void (*_on_edge_triggered_events)(Socket*);
 
-    // Original options used to create this Socket
-    SocketOptions _options;
+    // Initialized by SocketOptions.ssl_ctx, freed in OnRecycle() if
+    // SocketOptions.owns_ssl_ctx is true.
+    SSL_CTX* _ssl_ctx;
 
     // A set of callbacks to monitor important events of this socket.
     // Initialized by SocketOptions.user
@@ -678,16 +889,27 @@ private:
     int _preferred_index;
 
     // Number of HC since the last SetFailed() was called. Set to 0 when the
-    // socket is revived. Only set in HealthCheckThread
+    // socket is revived. Only set in health checking
     int _hc_count;
 
+    // cpuwide time when the socket was revived by health checking, 0 when
+    // the socket is not in slow start.
+    mutable butil::atomic<int64_t> _revive_time_us;
+
     // Size of current incomplete message, set to 0 on complete.
     uint32_t _last_msg_size;
     // Average message size of last #MSG_SIZE_WINDOW messages (roughly)
     uint32_t _avg_msg_size;
+    // Bytes to read next time predicted from recent reads, grown when
+    // reads fill the buffer and shrunk when reads get much less.
+    uint32_t _read_size_hint;
 
     // Storing data read from `_fd' but cut-off yet.
     butil::IOPortal _read_buf;
+    // Size of _read_buf charged to -socket_max_total_read_buffer_bytes
+    int64_t _read_buf_charged;
+    // True when input events are not watched, see PauseReading()
+    butil::atomic<bool> _read_paused;
 
     // Set with cpuwide_time_us() at last read operation
     butil::atomic<int64_t> _last_readtime_us;
@@ -703,6 +925,9 @@ private:
     // Non-zero when health-checking is on.
     int _health_check_interval_s;
 
+    // Isolates this socket on spikes of errors or latencies of calls.
+    CircuitBreaker _circuit_breaker;
+
     // +-1 bit-+---31 bit---+
     // |  flag |   counter  |
     // +-------+------------+
@@ -726,6 +951,8 @@ private:
 
     SSLState _ssl_state;
     SSL* _ssl_session;               // owner
+    // True if writes of _ssl_session are encrypted by kernel.
+    bool _ssl_ktls;
 
     // Pass from controller, for progressive reading.
     ConnectionType _connection_type_for_progressive_read;
@@ -736,6 +963,9 @@ private:
 
     bool _fail_me_at_server_stop;
 
+    // Initialized by SocketOptions.owns_ssl_ctx
+    bool _owns_ssl_ctx;
+
     // Set by SetLogOff
     butil::atomic<bool> _logoff_flag;
 
@@ -749,9 +979,6 @@ private:
     int _error_code;
     std::string _error_text;
 
-    butil::Mutex _pipeline_mutex;
-    std::deque<PipelinedInfo>* _pipeline_q;
-
     // For storing call-id of in-progress RPC.
     pthread_mutex_t _id_wait_list_mutex;
     bthread_id_list_t _id_wait_list;
@@ -767,17 +994,36 @@ private:
     // Storing data that are not flushed into `fd' yet.
     butil::atomic<WriteRequest*> _write_head;
 
-    butil::Mutex _stream_mutex;
-    std::set<StreamId> *_stream_set;
+    // Pipelined infos, streams and rarely used options. Created on first
+    // use to keep idle sockets small.
+    butil::atomic<LazyPart*> _lazy_part;
+
+    // Data sent with MSG_ZEROCOPY but not completed yet. Created at the
+    // first zero-copy write.
+    butil::atomic<ZeroCopyContext*> _zerocopy_ctx;
 
     // The RdmaEndpoint
     rdma::RdmaEndpoint* _rdma_ep;
     // Should use RDMA or not
     RdmaState _rdma_state;
+
+    // The ShmEndpoint, NULL if shared memory is not enabled
+    shm::ShmEndpoint* _shm_ep;
+    // Should use shared memory or not
+    ShmState _shm_state;
 };
 
 } // namespace brpc
 
+namespace butil {
+// Memory of idle Sockets can be returned to the system, versions are kept
+// so that SocketIds of recycled Sockets never address new ones.
+template <> struct ResourcePoolReclaimer<brpc::Socket> {
+    static const bool enabled = true;
+    static uint64_t save(const brpc::Socket* s);
+    static void restore(brpc::Socket* s, uint64_t version);
+};
+}  // namespace butil
 
 // Sleep a while when `write_expr' returns negative with errno=EOVERCROWDED
 // Implemented as a macro rather than a field of Socket.WriteOptions because
@@ -57,7 +57,11 @@ inline SocketOptions::SocketOptions()
     , owns_ssl_ctx(false)
     , ssl_ctx(NULL)
     , use_rdma(false)
+    , use_shm(false)
     , keytable_pool(NULL)
+    , bthread_tag(BTHREAD_TAG_INVALID)
+    , event_dispatcher_index(-1)
+    , io_engine(SOCKET_IO_ENGINE_DEFAULT)
     , conn(NULL)
     , app_connect(NULL)
     , initial_parsing_context(NULL)
@@ -305,36 +309,14 @@ bool Socket::initialize_parsing_context(T** ctx) {
     }
 }
 
-// NOTE: Push/Pop may be called from different threads simultaneously.
-inline void Socket::PushPipelinedInfo(const PipelinedInfo& pi) {
-    BAIDU_SCOPED_LOCK(_pipeline_mutex);
-    if (_pipeline_q == NULL) {
-        _pipeline_q = new std::deque<PipelinedInfo>;
-    }
-    _pipeline_q->push_back(pi);
-}
-
-inline bool Socket::PopPipelinedInfo(PipelinedInfo* info) {
-    BAIDU_SCOPED_LOCK(_pipeline_mutex);
-    if (_pipeline_q != NULL && !_pipeline_q->empty()) {
-        *info = _pipeline_q->front();
-        _pipeline_q->pop_front();
-        return true;
-    }
-    return false;
-}
-
-inline void Socket::GivebackPipelinedInfo(const PipelinedInfo& pi) {
-    BAIDU_SCOPED_LOCK(_pipeline_mutex);
-    if (_pipeline_q != NULL) {
-        _pipeline_q->push_front(pi);
-    }
-}
-
 inline bool Socket::ValidFileDescriptor(int fd) {
     return fd >= 0 && fd != STREAM_FAKE_FD;
 }
 
+inline Socket::LazyPart* Socket::GetLazyPart() const {
+    return _lazy_part.load(butil::memory_order_consume);
+}
+
 inline Socket::SharedPart* Socket::GetSharedPart() const {
     return _shared_part.load(butil::memory_order_consume);
 }
@@ -349,5 +331,21 @@ inline Socket::SharedPart* Socket::GetOrNewSharedPart() {
 
 } // namespace brpc
 
+namespace butil {
+
+inline uint64_t ResourcePoolReclaimer<brpc::Socket>::save(
+    const brpc::Socket* s) {
+    return brpc::VersionOfVRef(
+        s->_versioned_ref.load(butil::memory_order_relaxed));
+}
+
+inline void ResourcePoolReclaimer<brpc::Socket>::restore(
+    brpc::Socket* s, uint64_t version) {
+    s->_versioned_ref.store(brpc::MakeVRef(version, 0),
+                            butil::memory_order_relaxed);
+}
+
+}  // namespace butil
+
 
 #endif  // BRPC_SOCKET_INL_H
@@ -17,6 +17,7 @@
 
 #include <gflags/gflags.h>
 #include <map>
+#include <algorithm>                                  // std::max
 #include "bthread/bthread.h"
 #include "butil/time.h"
 #include "butil/scoped_lock.h"
@@ -32,6 +33,8 @@
 
 namespace brpc {
 
+DECLARE_bool(connection_pool_adaptive_size);
+
 DEFINE_int32(health_check_interval, 3, 
              "seconds between consecutive health-checkings");
 // NOTE: Must be limited to positive to guarantee correctness of SocketMapRemove.
@@ -110,6 +113,7 @@ void ComputeSocketMapKeyChecksum(const SocketMapKey& key,
     SAFE_MEMCOPY(buf, cur_len, &ephash, sizeof(ephash));
     SAFE_MEMCOPY(buf, cur_len, &key.auth, sizeof(key.auth));
     SAFE_MEMCOPY(buf, cur_len, &key.use_rdma, sizeof(key.use_rdma));
+    SAFE_MEMCOPY(buf, cur_len, &key.use_shm, sizeof(key.use_shm));
 
     const ChannelSSLOptions& ssl = key.ssl_options;
     SAFE_MEMCOPY(buf, cur_len, &ssl.enable, sizeof(ssl.enable));
@@ -196,24 +200,25 @@ SocketMap::~SocketMap() {
         bthread_stop(_close_idle_thread);
         bthread_join(_close_idle_thread, NULL);
     }
-    if (!_map.empty()) {
-        std::ostringstream err;
-        int nleft = 0;
-        for (Map::iterator it = _map.begin(); it != _map.end(); ++it) {
+    std::ostringstream err;
+    int nleft = 0;
+    for (size_t i = 0; i < NSHARD; ++i) {
+        Map& m = _shards[i].map;
+        for (Map::iterator it = m.begin(); it != m.end(); ++it) {
             SingleConnection* sc = &it->second;
             if ((!sc->socket->Failed() ||
                  sc->socket->health_check_interval() > 0/*HC enabled*/) &&
                 sc->ref_count != 0) {
-                ++nleft;
                 if (nleft == 0) {
                     err << "Left in SocketMap(" << this << "):";
                 }
+                ++nleft;
                 err << ' ' << *sc->socket;
             }
         }
-        if (nleft) {
-            LOG(ERROR) << err.str();
-        }
+    }
+    if (nleft) {
+        LOG(ERROR) << err.str();
     }
 
     delete _this_map_bvar;
@@ -233,8 +238,16 @@ int SocketMap::Init(const SocketMapOptions& options) {
         LOG(ERROR) << "SocketOptions.socket_creator must be set";
         return -1;
     }
-    if (_map.init(_options.suggested_map_size, 70) != 0) {
-        LOG(ERROR) << "Fail to init _map";
+    const size_t shard_map_size =
+        std::max(_options.suggested_map_size / NSHARD, (size_t)16);
+    for (size_t i = 0; i < NSHARD; ++i) {
+        if (_shards[i].map.init(shard_map_size, 70) != 0) {
+            LOG(ERROR) << "Fail to init map of shard " << i;
+            return -1;
+        }
+    }
+    if (_id_map.init(_options.suggested_map_size) != 0) {
+        LOG(ERROR) << "Fail to init _id_map";
         return -1;
     }
     if (_options.idle_timeout_second_dynamic != NULL ||
@@ -252,9 +265,9 @@ int SocketMap::Init(const SocketMapOptions& options) {
 void SocketMap::Print(std::ostream& os) {
     // TODO: Elaborate.
     size_t count = 0;
-    {
-        std::unique_lock<butil::Mutex> mu(_mutex);
-        count = _map.size();
+    for (size_t i = 0; i < NSHARD; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        count += _shards[i].map.size();
     }
     os << "count=" << count;
 }
@@ -263,10 +276,30 @@ void SocketMap::PrintSocketMap(std::ostream& os, void* arg) {
     static_cast<SocketMap*>(arg)->Print(os);
 }
 
+void SocketMap::ExposeInBvarIfNeeded() {
+    if (FLAGS_show_socketmap_in_vars &&
+        !_exposed_in_bvar.load(butil::memory_order_relaxed) &&
+        !_exposed_in_bvar.exchange(true, butil::memory_order_relaxed)) {
+        char namebuf[32];
+        int len = snprintf(namebuf, sizeof(namebuf), "rpc_socketmap_%p", this);
+        _this_map_bvar = new bvar::PassiveStatus<std::string>(
+            butil::StringPiece(namebuf, len), PrintSocketMap, this);
+    }
+}
+
+SocketMap::Shard& SocketMap::GetShard(const SocketMapKeyChecksum& ck) {
+    // Not the bytes used by Checksum2Hash, otherwise keys in one shard
+    // would be clustered in buckets of the map.
+    uint32_t hash;
+    memcpy(&hash, ck.checksum + 12, sizeof(hash));
+    return _shards[hash % NSHARD];
+}
+
 int SocketMap::Insert(const SocketMapKey& key, SocketId* id) {
     SocketMapKeyChecksum ck(key);
-    std::unique_lock<butil::Mutex> mu(_mutex);
-    SingleConnection* sc = _map.seek(ck);
+    Shard& shard = GetShard(ck);
+    std::unique_lock<butil::Mutex> mu(shard.mutex);
+    SingleConnection* sc = shard.map.seek(ck);
     if (sc) {
         if (!sc->socket->Failed() ||
             sc->socket->health_check_interval() > 0/*HC enabled*/) {
@@ -276,7 +309,8 @@ int SocketMap::Insert(const SocketMapKey& key, SocketId* id) {
         }
         // A socket w/o HC is failed (permanently), replace it.
         SocketUniquePtr ptr(sc->socket);  // Remove the ref added at insertion.
-        _map.erase(ck); // in principle, we can override the entry in map w/o
+        _id_map.erase(ck);
+        shard.map.erase(ck); // in principle, we can override the entry in map w/o
         // removing and inserting it again. But this would make error branches
         // below have to remove the entry before returning, which is
         // error-prone. We prefer code maintainability here.
@@ -291,6 +325,7 @@ int SocketMap::Insert(const SocketMapKey& key, SocketId* id) {
     SocketOptions opt;
     opt.remote_side = key.peer;
     opt.use_rdma = key.use_rdma;
+    opt.use_shm = key.use_shm;
     // Can't save SSL_CTX in SocketMap since SingleConnection's desctruction
     // may happen before Socket's destruction (remove Channel before RPC complete)
     opt.owns_ssl_ctx = true;
@@ -310,33 +345,25 @@ int SocketMap::Insert(const SocketMapKey& key, SocketId* id) {
         return -1;
     }
     SingleConnection new_sc = { 1, ptr.release(), 0 };
-    _map[ck] = new_sc;
+    shard.map[ck] = new_sc;
+    // Find() falls back to maps of shards when the insertion fails.
+    _id_map.insert(ck, tmp_id);
     *id = tmp_id;
-    bool need_to_create_bvar = false;
-    if (FLAGS_show_socketmap_in_vars && !_exposed_in_bvar) {
-        _exposed_in_bvar = true;
-        need_to_create_bvar = true;
-    }
     mu.unlock();
-    if (need_to_create_bvar) {
-        char namebuf[32];
-        int len = snprintf(namebuf, sizeof(namebuf), "rpc_socketmap_%p", this);
-        _this_map_bvar = new bvar::PassiveStatus<std::string>(
-            butil::StringPiece(namebuf, len), PrintSocketMap, this);
-    }
+    ExposeInBvarIfNeeded();
     return 0;
 }
 
 void SocketMap::Remove(const SocketMapKey& key, SocketId expected_id) {
-    return RemoveInternal(key, expected_id, false);
+    return RemoveInternal(SocketMapKeyChecksum(key), expected_id, false);
 }
 
-void SocketMap::RemoveInternal(const SocketMapKey& key,
+void SocketMap::RemoveInternal(const SocketMapKeyChecksum& ck,
                                SocketId expected_id,
                                bool remove_orphan) {
-    SocketMapKeyChecksum ck(key);
-    std::unique_lock<butil::Mutex> mu(_mutex);
-    SingleConnection* sc = _map.seek(ck);
+    Shard& shard = GetShard(ck);
+    std::unique_lock<butil::Mutex> mu(shard.mutex);
+    SingleConnection* sc = shard.map.seek(ck);
     if (!sc) {
         return;
     }
@@ -354,19 +381,10 @@ void SocketMap::RemoveInternal(const SocketMapKey& key,
             sc->no_ref_us = butil::cpuwide_time_us();
         } else {
             Socket* const s = sc->socket;
-            _map.erase(ck);
-            bool need_to_create_bvar = false;
-            if (FLAGS_show_socketmap_in_vars && !_exposed_in_bvar) {
-                _exposed_in_bvar = true;
-                need_to_create_bvar = true;
-            }
+            _id_map.erase(ck);
+            shard.map.erase(ck);
             mu.unlock();
-            if (need_to_create_bvar) {
-                char namebuf[32];
-                int len = snprintf(namebuf, sizeof(namebuf), "rpc_socketmap_%p", this);
-                _this_map_bvar = new bvar::PassiveStatus<std::string>(
-                    butil::StringPiece(namebuf, len), PrintSocketMap, this);
-            }
+            ExposeInBvarIfNeeded();
             s->ReleaseAdditionalReference(); // release extra ref
             SocketUniquePtr ptr(s);  // Dereference
         }
@@ -375,8 +393,12 @@ void SocketMap::RemoveInternal(const SocketMapKey& key,
 
 int SocketMap::Find(const SocketMapKey& key, SocketId* id) {
     SocketMapKeyChecksum ck(key);
-    BAIDU_SCOPED_LOCK(_mutex);
-    SingleConnection* sc = _map.seek(ck);
+    if (_id_map.seek(ck, id)) {
+        return 0;
+    }
+    Shard& shard = GetShard(ck);
+    BAIDU_SCOPED_LOCK(shard.mutex);
+    SingleConnection* sc = shard.map.seek(ck);
     if (sc) {
         *id = sc->socket->id();
         return 0;
@@ -386,28 +408,43 @@ int SocketMap::Find(const SocketMapKey& key, SocketId* id) {
 
 void SocketMap::List(std::vector<SocketId>* ids) {
     ids->clear();
-    BAIDU_SCOPED_LOCK(_mutex);
-    for (Map::iterator it = _map.begin(); it != _map.end(); ++it) {
-        ids->push_back(it->second.socket->id());
+    for (size_t i = 0; i < NSHARD; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        Map& m = _shards[i].map;
+        for (Map::iterator it = m.begin(); it != m.end(); ++it) {
+            ids->push_back(it->second.socket->id());
+        }
     }
 }
 
 void SocketMap::List(std::vector<butil::EndPoint>* pts) {
     pts->clear();
-    BAIDU_SCOPED_LOCK(_mutex);
-    for (Map::iterator it = _map.begin(); it != _map.end(); ++it) {
-        pts->push_back(it->second.socket->remote_side());
+    for (size_t i = 0; i < NSHARD; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        Map& m = _shards[i].map;
+        for (Map::iterator it = m.begin(); it != m.end(); ++it) {
+            pts->push_back(it->second.socket->remote_side());
+        }
+    }
+}
+
+void SocketMap::ListShard(Shard& shard, std::vector<SocketId>* ids) {
+    ids->clear();
+    BAIDU_SCOPED_LOCK(shard.mutex);
+    for (Map::iterator it = shard.map.begin(); it != shard.map.end(); ++it) {
+        ids->push_back(it->second.socket->id());
     }
 }
 
-void SocketMap::ListOrphans(int64_t defer_us, std::vector<butil::EndPoint>* out) {
+void SocketMap::ListOrphans(Shard& shard, int64_t defer_us,
+                            std::vector<SocketMapKeyChecksum>* out) {
     out->clear();
     const int64_t now = butil::cpuwide_time_us();
-    BAIDU_SCOPED_LOCK(_mutex);
-    for (Map::iterator it = _map.begin(); it != _map.end(); ++it) {
+    BAIDU_SCOPED_LOCK(shard.mutex);
+    for (Map::iterator it = shard.map.begin(); it != shard.map.end(); ++it) {
         SingleConnection& sc = it->second;
         if (sc.ref_count == 0 && now - sc.no_ref_us >= defer_us) {
-            out->push_back(it->first.peer);
+            out->push_back(it->first);
         }
     }
 }
@@ -420,40 +457,48 @@ void* SocketMap::RunWatchConnections(void* arg) {
 void SocketMap::WatchConnections() {
     std::vector<SocketId> main_sockets;
     std::vector<SocketId> pooled_sockets;
-    std::vector<butil::EndPoint> orphan_sockets;
+    std::vector<SocketMapKeyChecksum> orphan_sockets;
     const uint64_t CHECK_INTERVAL_US = 1000000UL;
     while (bthread_usleep(CHECK_INTERVAL_US) == 0) {
-        // NOTE: save the gflag which may be reloaded at any time.
+        // NOTE: save the gflags which may be reloaded at any time.
         const int idle_seconds = _options.idle_timeout_second_dynamic ?
             *_options.idle_timeout_second_dynamic
             : _options.idle_timeout_second;
-        if (idle_seconds > 0) {
-            // Check idle pooled connections
-            List(&main_sockets);
-            for (size_t i = 0; i < main_sockets.size(); ++i) {
+        const int defer_seconds = _options.defer_close_second_dynamic ?
+            *_options.defer_close_second_dynamic :
+            _options.defer_close_second;
+        // Scan shards one by one, each of which is locked only for listing
+        // its own sockets.
+        for (size_t i = 0; i < NSHARD; ++i) {
+            Shard& shard = _shards[i];
+            // Add new pooled connections into the wheel, main sockets are
+            // much less than pooled ones.
+            const int64_t now_us = butil::cpuwide_time_us();
+            ListShard(shard, &main_sockets);
+            for (size_t j = 0; j < main_sockets.size(); ++j) {
                 SocketUniquePtr s;
-                if (Socket::Address(main_sockets[i], &s) == 0) {
-                    s->ListPooledSockets(&pooled_sockets);
-                    for (size_t i = 0; i < pooled_sockets.size(); ++i) {
-                        SocketUniquePtr s2;
-                        if (Socket::Address(pooled_sockets[i], &s2) == 0) {
-                            s2->ReleaseReferenceIfIdle(idle_seconds);
-                        }
+                if (Socket::Address(main_sockets[j], &s) == 0) {
+                    s->ListNewPooledSockets(&pooled_sockets);
+                    for (size_t k = 0; k < pooled_sockets.size(); ++k) {
+                        _idle_wheel.Add(pooled_sockets[k], now_us +
+                                        std::max(idle_seconds, 1) * 1000000L);
+                    }
+                    if (FLAGS_connection_pool_adaptive_size) {
+                        // Close pooled connections beyond recent demand
+                        s->TrimPooledSockets();
                     }
                 }
             }
+            // Check connections without Channel. This works when
+            // `defer_seconds' <= 0, in which case orphan connections will
+            // be closed immediately
+            ListOrphans(shard, defer_seconds * 1000000L, &orphan_sockets);
+            for (size_t j = 0; j < orphan_sockets.size(); ++j) {
+                RemoveInternal(orphan_sockets[j], (SocketId)-1, true);
+            }
         }
-
-        // Check connections without Channel. This works when `defer_seconds'
-        // <= 0, in which case orphan connections will be closed immediately
-        // NOTE: save the gflag which may be reloaded at any time
-        const int defer_seconds = _options.defer_close_second_dynamic ?
-            *_options.defer_close_second_dynamic :
-            _options.defer_close_second;
-        ListOrphans(defer_seconds * 1000000L, &orphan_sockets);
-        for (size_t i = 0; i < orphan_sockets.size(); ++i) {
-            RemoveInternal(orphan_sockets[i], (SocketId)-1, true);
-        }
+        // Check idle pooled connections whose deadlines expired.
+        _idle_wheel.CloseIdleConnections(idle_seconds);
     }
 }
 
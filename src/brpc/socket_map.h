@@ -20,10 +20,12 @@
 #include <vector>                                  // std::vector
 #include "bvar/bvar.h"                             // bvar::PassiveStatus
 #include "butil/containers/flat_map.h"             // FlatMap
+#include "butil/containers/concurrent_flat_map.h"  // ConcurrentFlatMap
 #include "brpc/socket_id.h"                   // SockdetId
 #include "brpc/options.pb.h"                  // ProtocolType
 #include "brpc/ssl_option.h"                  // ChannelSSLOptions
 #include "brpc/input_messenger.h"             // InputMessageHandler
+#include "brpc/details/idle_connection_wheel.h"  // IdleConnectionWheel
 
 
 namespace brpc {
@@ -36,11 +38,13 @@ struct SocketMapKey {
     SocketMapKey(const butil::EndPoint& pt, bool rdma = false,
                  ChannelSSLOptions ssl = ChannelSSLOptions(),
                  const Authenticator* auth2 = NULL)
-            : peer(pt), use_rdma(rdma), ssl_options(ssl), auth(auth2)
+            : peer(pt), use_rdma(rdma), use_shm(false), ssl_options(ssl)
+            , auth(auth2)
     {}
 
     butil::EndPoint peer;
     bool use_rdma;
+    bool use_shm;
     ChannelSSLOptions ssl_options;
     const Authenticator* auth;
 };
@@ -119,9 +123,6 @@ public:
     const SocketMapOptions& options() const { return _options; }
 
 private:
-    void RemoveInternal(const SocketMapKey& key, SocketId id,
-                        bool remove_orphan);
-    void ListOrphans(int64_t defer_us, std::vector<butil::EndPoint>* out);
     void WatchConnections();
     static void* RunWatchConnections(void*);
     void Print(std::ostream& os);
@@ -163,17 +164,39 @@ private:
         }
     };
 
-    // TODO: When RpcChannels connecting to one EndPoint are frequently created
-    //       and destroyed, a single map+mutex may become hot-spots.
     typedef butil::FlatMap<SocketMapKeyChecksum,
                            SingleConnection, Checksum2Hash> Map;
+    // Mirror of maps in shards for lock-free Find(), modified with the
+    // mutex of the shard locked.
+    typedef butil::ConcurrentFlatMap<SocketMapKeyChecksum,
+                                     SocketId, Checksum2Hash> IdMap;
+
+    // Keys are distributed into shards by their checksums, so that
+    // RpcChannels connecting to different EndPoints and the scans of
+    // WatchConnections() don't contend for one mutex.
+    static const size_t NSHARD = 32;
+    struct Shard {
+        butil::Mutex mutex;
+        Map map;
+    };
+
+    Shard& GetShard(const SocketMapKeyChecksum& ck);
+    void RemoveInternal(const SocketMapKeyChecksum& ck, SocketId id,
+                        bool remove_orphan);
+    void ListShard(Shard& shard, std::vector<SocketId>* ids);
+    void ListOrphans(Shard& shard, int64_t defer_us,
+                     std::vector<SocketMapKeyChecksum>* out);
+    void ExposeInBvarIfNeeded();
+
     SocketMapOptions _options;
-    butil::Mutex _mutex;
-    Map _map;
-    bool _exposed_in_bvar;
+    Shard _shards[NSHARD];
+    IdMap _id_map;
+    butil::atomic<bool> _exposed_in_bvar;
     bvar::PassiveStatus<std::string>* _this_map_bvar;
     bool _has_close_idle_thread;
     bthread_t _close_idle_thread;
+    // Pooled connections to be checked by WatchConnections.
+    IdleConnectionWheel _idle_wheel;
 };
 
 } // namespace brpc
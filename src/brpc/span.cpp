@@ -30,6 +30,7 @@
 #include "brpc/shared_object.h"
 #include "brpc/reloadable_flags.h"
 #include "brpc/span.h"
+#include "brpc/span_exporter.h"
 
 #define BRPC_SPAN_INFO_SEP "\1"
 
@@ -41,15 +42,10 @@ const int64_t SPAN_DELETE_INTERVAL_US = 10000000L/*10s*/;
 DEFINE_string(rpcz_database_dir, "./rpc_data/rpcz",
               "For storing requests/contexts collected by rpcz.");
 
-// TODO: collected per second is customizable.
-// const int32_t MAX_RPCZ_MAX_SPAN_PER_SECOND = 10000;
-// DEFINE_int32(rpcz_max_span_per_second, MAX_RPCZ_MAX_SPAN_PER_SECOND,
-//              "Index so many spans per second at most");
-// static bool validate_rpcz_max_span_per_second(const char*, int32_t val) {
-//     return (val >= 1 && val <= MAX_RPCZ_MAX_SPAN_PER_SECOND);
-// }
-// BRPC_VALIDATE_GFLAG(rpcz_max_span_per_second,
-//                          validate_rpcz_max_span_per_second);
+DEFINE_int32(rpcz_expected_span_per_second, 0,
+             "Expected number of spans to be collected per second, "
+             "-bvar_collector_expected_per_second is used when it's 0");
+BRPC_VALIDATE_GFLAG(rpcz_expected_span_per_second, NonNegativeInteger);
 
 DEFINE_int32(rpcz_keep_span_seconds, 3600,
              "Keep spans for at most so many seconds");
@@ -57,6 +53,22 @@ BRPC_VALIDATE_GFLAG(rpcz_keep_span_seconds, PositiveInteger);
 
 DEFINE_bool(rpcz_keep_span_db, false, "Don't remove DB of rpcz at program's exit");
 
+DEFINE_bool(rpcz_save_spans_to_db, true, "Store spans into leveldb under "
+            "-rpcz_database_dir to be browsed in /rpcz. Turn this off when "
+            "spans are only exported to collectors");
+BRPC_VALIDATE_GFLAG(rpcz_save_spans_to_db, PassValidate);
+
+DEFINE_bool(rpcz_tail_sampling, false, "Create spans for all requests and "
+            "keep the ones failed or slower than -rpcz_tail_sampling_latency_us"
+            " besides the randomly sampled ones");
+BRPC_VALIDATE_GFLAG(rpcz_tail_sampling, PassValidate);
+
+DEFINE_int64(rpcz_tail_sampling_latency_us, 100000, "Requests slower than "
+             "this are always kept with -rpcz_tail_sampling");
+BRPC_VALIDATE_GFLAG(rpcz_tail_sampling_latency_us, NonNegativeInteger);
+
+__thread bool tls_exporting_spans = false;
+
 struct IdGen {
     bool init;
     uint16_t seq;
@@ -347,9 +359,13 @@ static bool g_span_ending = false;  // don't open span again if this var is true
 // Can't use intrusive_ptr which has ctor/dtor issues.
 static SpanDB* g_span_db = NULL;
 bool has_span_db() { return !!g_span_db; }
-bvar::CollectorSpeedLimit g_span_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
+// Spans are dropped after other samples when the collector is too busy.
+bvar::CollectorSpeedLimit g_span_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH(
+    &FLAGS_rpcz_expected_span_per_second, 1);
 static bvar::DisplaySamplingRatio s_display_sampling_ratio(
     "rpcz_sampling_ratio", &g_span_sl);
+static bvar::DisplayDroppedSamples s_display_dropped_samples(
+    "rpcz_dropped_spans", &g_span_sl);
 
 struct SpanEarlier {
     bool operator()(bvar::Collected* c1, bvar::Collected* c2) const {
@@ -418,6 +434,14 @@ inline int GetSpanDB(butil::intrusive_ptr<SpanDB>* db) {
 
 void Span::Submit(Span* span, int64_t cpuwide_time_us) {
     if (span->local_parent() == NULL) {
+        if (FLAGS_rpcz_tail_sampling && span->_error_code == 0 &&
+            span->GetEndRealTimeUs() - span->GetStartRealTimeUs() <
+            FLAGS_rpcz_tail_sampling_latency_us &&
+            !bvar::is_collectable(&g_span_sl)) {
+            // Neither interesting nor sampled.
+            span->destroy();
+            return;
+        }
         span->submit(cpuwide_time_us);
     }
 }
@@ -446,6 +470,19 @@ static void Span2Proto(const Span* span, RpczSpan* out) {
     out->set_error_code(span->error_code());
 }
 
+void Span::ToProto(RpczSpan* out) const {
+    Span2Proto(this, out);
+    // client spans should be reversed.
+    size_t client_span_count = CountClientSpans();
+    for (size_t i = 0; i < client_span_count; ++i) {
+        out->add_client_spans();
+    }
+    size_t i = 0;
+    for (const Span* p = _next_client; p; p = p->_next_client, ++i) {
+        Span2Proto(p, out->mutable_client_spans(client_span_count - i - 1));
+    }
+}
+
 inline void ToBigEndian(uint64_t n, uint32_t* buf) {
     buf[0] = htonl(n >> 32);
     buf[1] = htonl(n & 0xFFFFFFFFUL);
@@ -568,16 +605,7 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
     ToBigEndian(span->span_id(), key_data + 2);
     leveldb::Slice key((char*)key_data, sizeof(key_data));
     RpczSpan value_proto;
-    Span2Proto(span, &value_proto);
-    // client spans should be reversed.
-    size_t client_span_count = span->CountClientSpans();
-    for (size_t i = 0; i < client_span_count; ++i) {
-        value_proto.add_client_spans();
-    }
-    size_t i = 0;
-    for (const Span* p = span->_next_client; p; p = p->_next_client, ++i) {
-        Span2Proto(p, value_proto.mutable_client_spans(client_span_count - i - 1));
-    }
+    span->ToProto(&value_proto);
     if (!value_proto.SerializeToString(value_buf)) {
         return leveldb::Status::InvalidArgument(
             leveldb::Slice("Fail to serialize RpczSpan"));
@@ -632,6 +660,15 @@ leveldb::Status SpanDB::RemoveSpansBefore(int64_t tm) {
 
 // Write span into leveldb.
 void Span::dump_and_destroy(size_t /*round*/) {
+    if (IsExportingSpans()) {
+        RpczSpan proto;
+        ToProto(&proto);
+        ExportSpan(&proto);
+    }
+    if (!FLAGS_rpcz_save_spans_to_db) {
+        destroy();
+        return;
+    }
     StartIndexingIfNeeded();
     
     std::string value_buf;
@@ -39,6 +39,10 @@ extern __thread bthread::LocalStorage tls_bls;
 namespace brpc {
 
 DECLARE_bool(enable_rpcz);
+DECLARE_bool(rpcz_tail_sampling);
+
+// True in threads sending spans to collectors, RPCs in which are not traced.
+extern __thread bool tls_exporting_spans;
 
 // Collect information required by /rpcz and tracing system whose idea is
 // described in http://static.googleusercontent.com/media/research.google.com/en//pubs/archive/36356.pdf
@@ -140,6 +144,8 @@ private:
 
     void dump_and_destroy(size_t round_index);
     void destroy();
+    // Serialize this span along with its client spans.
+    void ToProto(RpczSpan* out) const;
     bvar::CollectorSpeedLimit* speed_limit();
     bvar::CollectorPreprocessor* preprocessor();
 
@@ -225,10 +231,13 @@ void ListSpans(SpanDB* db, int64_t before_this_time, size_t max_scan,
 
 // Check this function first before creating a span.
 // If rpcz of upstream is enabled, local rpcz is enabled automatically.
+// With -rpcz_tail_sampling, spans are created for all requests and sampled
+// in Span::Submit() after the results are known.
 inline bool IsTraceable(bool is_upstream_traced) {
     extern bvar::CollectorSpeedLimit g_span_sl;
     return is_upstream_traced ||
-        (FLAGS_enable_rpcz && bvar::is_collectable(&g_span_sl));
+        (FLAGS_enable_rpcz && !tls_exporting_spans &&
+         (FLAGS_rpcz_tail_sampling || bvar::is_collectable(&g_span_sl)));
 }
 
 } // namespace brpc
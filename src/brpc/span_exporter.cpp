@@ -0,0 +1,290 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <pthread.h>
+#include <deque>
+#include <limits>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
+#include "butil/time.h"
+#include "bvar/bvar.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/adaptive_protocol_type.h"    // ProtocolTypeToString
+#include "brpc/reloadable_flags.h"
+#include "brpc/builtin/common.h"            // GetProgramName
+#include "brpc/span.h"
+#include "brpc/span_exporter.h"
+
+
+namespace brpc {
+
+DEFINE_string(rpcz_otlp_collector_url, "",
+              "Export spans collected by rpcz to this OTLP/HTTP endpoint, "
+              "e.g. http://127.0.0.1:4318/v1/traces");
+DEFINE_string(rpcz_otlp_service_name, "",
+              "service.name of exported spans, name of the program if empty");
+DEFINE_int32(rpcz_otlp_batch_size, 512,
+             "Send at most so many spans to the collector in one request");
+BRPC_VALIDATE_GFLAG(rpcz_otlp_batch_size, PositiveInteger);
+DEFINE_int32(rpcz_otlp_flush_interval_ms, 1000,
+             "Send spans to the collector at least so often");
+BRPC_VALIDATE_GFLAG(rpcz_otlp_flush_interval_ms, PositiveInteger);
+DEFINE_int32(rpcz_otlp_max_pending_spans, 65536,
+             "Drop spans when so many spans are waiting to be exported");
+BRPC_VALIDATE_GFLAG(rpcz_otlp_max_pending_spans, PositiveInteger);
+DEFINE_int32(rpcz_otlp_timeout_ms, 3000,
+             "Timeout for sending spans to the collector");
+BRPC_VALIDATE_GFLAG(rpcz_otlp_timeout_ms, PositiveInteger);
+
+static bvar::Adder<int64_t> g_otlp_exported("rpcz_otlp_exported_spans");
+static bvar::Adder<int64_t> g_otlp_dropped("rpcz_otlp_dropped_spans");
+
+static pthread_once_t g_export_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_export_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_export_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<RpczSpan>* g_pending_spans = NULL;
+
+bool IsExportingSpans() {
+    return !FLAGS_rpcz_otlp_collector_url.empty();
+}
+
+static void AppendJsonString(std::string* out, const std::string& s) {
+    out->push_back('"');
+    for (size_t i = 0; i < s.size(); ++i) {
+        const unsigned char c = s[i];
+        switch (c) {
+        case '"': out->append("\\\""); break;
+        case '\\': out->append("\\\\"); break;
+        case '\n': out->append("\\n"); break;
+        case '\r': out->append("\\r"); break;
+        case '\t': out->append("\\t"); break;
+        default:
+            if (c < 0x20) {
+                butil::string_appendf(out, "\\u%04x", c);
+            } else {
+                out->push_back(c);
+            }
+        }
+    }
+    out->push_back('"');
+}
+
+static void AppendStringAttribute(std::string* out, const char* key,
+                                  const std::string& value) {
+    butil::string_appendf(out, "{\"key\":\"%s\",\"value\":{\"stringValue\":",
+                          key);
+    AppendJsonString(out, value);
+    out->append("}},");
+}
+
+static void AppendIntAttribute(std::string* out, const char* key,
+                               int64_t value) {
+    butil::string_appendf(out, "{\"key\":\"%s\",\"value\":{\"intValue\":"
+                          "\"%lld\"}},", key, (long long)value);
+}
+
+// Close a json list by replacing the trailing comma if any.
+static void CloseList(std::string* out) {
+    if ((*out)[out->size() - 1] == ',') {
+        (*out)[out->size() - 1] = ']';
+    } else {
+        out->push_back(']');
+    }
+}
+
+static void AppendOtlpSpan(std::string* out, const RpczSpan& span) {
+    // OTLP ids are 128/64 bits in hex while ours are all 64 bits.
+    butil::string_appendf(
+        out, "{\"traceId\":\"%016llx%016llx\",\"spanId\":\"%016llx\",",
+        0ULL, (unsigned long long)span.trace_id(),
+        (unsigned long long)span.span_id());
+    if (span.parent_span_id()) {
+        butil::string_appendf(out, "\"parentSpanId\":\"%016llx\",",
+                              (unsigned long long)span.parent_span_id());
+    }
+    out->append("\"name\":");
+    AppendJsonString(out, span.full_method_name());
+    const bool server = (span.type() == SPAN_TYPE_SERVER);
+    const int64_t start_us = (server ? span.received_real_us()
+                              : span.start_send_real_us());
+    int64_t end_us = std::max(span.received_real_us(), span.start_parse_real_us());
+    end_us = std::max(end_us, span.start_callback_real_us());
+    end_us = std::max(end_us, span.start_send_real_us());
+    end_us = std::max(end_us, span.sent_real_us());
+    // SPAN_KIND_SERVER=2, SPAN_KIND_CLIENT=3
+    butil::string_appendf(
+        out, ",\"kind\":%d,\"startTimeUnixNano\":\"%lld000\","
+        "\"endTimeUnixNano\":\"%lld000\",\"attributes\":[",
+        (server ? 2 : 3), (long long)start_us, (long long)end_us);
+    AppendStringAttribute(out, "rpc.system", "brpc");
+    AppendStringAttribute(out, "brpc.protocol",
+                          ProtocolTypeToString(span.protocol()));
+    if (span.has_remote_ip()) {
+        const butil::ip_t ip = butil::int2ip(span.remote_ip());
+        AppendStringAttribute(out, "net.peer.ip", butil::ip2str(ip).c_str());
+        AppendIntAttribute(out, "net.peer.port", span.remote_port());
+    }
+    if (span.log_id()) {
+        AppendIntAttribute(out, "brpc.log_id", span.log_id());
+    }
+    AppendIntAttribute(out, "brpc.request_size", span.request_size());
+    AppendIntAttribute(out, "brpc.response_size", span.response_size());
+    if (span.error_code()) {
+        AppendIntAttribute(out, "brpc.error_code", span.error_code());
+    }
+    CloseList(out);
+    out->append(",\"events\":[");
+    SpanInfoExtractor extractor(span.info().c_str());
+    int64_t anno_time = 0;
+    std::string anno;
+    while (extractor.PopAnnotation(std::numeric_limits<int64_t>::max(),
+                                   &anno_time, &anno)) {
+        butil::string_appendf(out, "{\"timeUnixNano\":\"%lld000\",\"name\":",
+                              (long long)anno_time);
+        AppendJsonString(out, anno);
+        out->append("},");
+    }
+    CloseList(out);
+    // STATUS_CODE_ERROR=2
+    if (span.error_code()) {
+        out->append(",\"status\":{\"code\":2}},");
+    } else {
+        out->append(",\"status\":{}},");
+    }
+}
+
+void SpansToOtlpJson(const std::vector<RpczSpan>& spans,
+                     const std::string& service_name,
+                     std::string* out) {
+    out->append("{\"resourceSpans\":[{\"resource\":{\"attributes\":[");
+    AppendStringAttribute(out, "service.name", service_name);
+    CloseList(out);
+    out->append("},\"scopeSpans\":[{\"scope\":{\"name\":\"brpc\"},"
+                "\"spans\":[");
+    for (size_t i = 0; i < spans.size(); ++i) {
+        AppendOtlpSpan(out, spans[i]);
+        for (int j = 0; j < spans[i].client_spans_size(); ++j) {
+            AppendOtlpSpan(out, spans[i].client_spans(j));
+        }
+    }
+    CloseList(out);
+    out->append("}]}]}");
+}
+
+static size_t CountSpans(const std::vector<RpczSpan>& spans) {
+    size_t n = spans.size();
+    for (size_t i = 0; i < spans.size(); ++i) {
+        n += spans[i].client_spans_size();
+    }
+    return n;
+}
+
+static int SendSpans(Channel* channel, const std::vector<RpczSpan>& spans) {
+    Controller cntl;
+    cntl.http_request().uri() = FLAGS_rpcz_otlp_collector_url;
+    cntl.http_request().set_method(HTTP_METHOD_POST);
+    cntl.http_request().set_content_type("application/json");
+    std::string json;
+    SpansToOtlpJson(spans, (!FLAGS_rpcz_otlp_service_name.empty() ?
+                            FLAGS_rpcz_otlp_service_name :
+                            std::string(GetProgramName())), &json);
+    cntl.request_attachment().append(json);
+    channel->CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        LOG_EVERY_SECOND(WARNING) << "Fail to export " << CountSpans(spans)
+                                  << " spans to " << FLAGS_rpcz_otlp_collector_url
+                                  << ": " << cntl.ErrorText();
+        return -1;
+    }
+    return 0;
+}
+
+static void* ExportSpansThread(void*) {
+    // RPCs to the collector should not generate spans to export.
+    tls_exporting_spans = true;
+    Channel channel;
+    ChannelOptions options;
+    options.protocol = PROTOCOL_HTTP;
+    options.timeout_ms = FLAGS_rpcz_otlp_timeout_ms;
+    options.max_retry = 0;
+    if (channel.Init(FLAGS_rpcz_otlp_collector_url.c_str(), "", &options) != 0) {
+        LOG(ERROR) << "Fail to init channel to "
+                   << FLAGS_rpcz_otlp_collector_url << ", spans are not exported";
+        BAIDU_SCOPED_LOCK(g_export_mutex);
+        delete g_pending_spans;
+        g_pending_spans = NULL;
+        return NULL;
+    }
+    std::vector<RpczSpan> batch;
+    while (true) {
+        {
+            BAIDU_SCOPED_LOCK(g_export_mutex);
+            if (g_pending_spans->size() < (size_t)FLAGS_rpcz_otlp_batch_size) {
+                const timespec due = butil::milliseconds_from_now(
+                    FLAGS_rpcz_otlp_flush_interval_ms);
+                pthread_cond_timedwait(&g_export_cond, &g_export_mutex, &due);
+            }
+            const size_t n = std::min(g_pending_spans->size(),
+                                      (size_t)FLAGS_rpcz_otlp_batch_size);
+            batch.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                batch[i].Swap(&g_pending_spans->front());
+                g_pending_spans->pop_front();
+            }
+        }
+        if (batch.empty()) {
+            continue;
+        }
+        if (SendSpans(&channel, batch) == 0) {
+            g_otlp_exported << CountSpans(batch);
+        } else {
+            g_otlp_dropped << CountSpans(batch);
+        }
+        batch.clear();
+    }
+    return NULL;
+}
+
+static void StartExportingSpans() {
+    g_pending_spans = new std::deque<RpczSpan>;
+    pthread_t th;
+    if (pthread_create(&th, NULL, ExportSpansThread, NULL) != 0) {
+        LOG(ERROR) << "Fail to create thread for exporting spans";
+        delete g_pending_spans;
+        g_pending_spans = NULL;
+        return;
+    }
+    pthread_detach(th);
+}
+
+void ExportSpan(RpczSpan* span) {
+    pthread_once(&g_export_once, StartExportingSpans);
+    BAIDU_SCOPED_LOCK(g_export_mutex);
+    if (g_pending_spans == NULL ||
+        g_pending_spans->size() >= (size_t)FLAGS_rpcz_otlp_max_pending_spans) {
+        g_otlp_dropped << 1 + span->client_spans_size();
+        return;
+    }
+    g_pending_spans->push_back(RpczSpan());
+    g_pending_spans->back().Swap(span);
+    if (g_pending_spans->size() >= (size_t)FLAGS_rpcz_otlp_batch_size) {
+        pthread_cond_signal(&g_export_cond);
+    }
+}
+
+} // namespace brpc
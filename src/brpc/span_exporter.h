@@ -0,0 +1,50 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_SPAN_EXPORTER_H
+#define BRPC_SPAN_EXPORTER_H
+
+// NOTE: RPC users are not supposed to include this file.
+
+#include <string>
+#include <vector>
+#include "brpc/span.pb.h"
+
+namespace brpc {
+
+// Spans collected by rpcz can be sent to a tracing collector in the
+// OTLP/HTTP json format(https://opentelemetry.io/docs/specs/otlp/) by
+// setting -rpcz_otlp_collector_url, e.g. http://127.0.0.1:4318/v1/traces
+// Spans are batched and sent in a separate thread so that the collecting
+// thread of rpcz is never blocked by the collector. Spans are dropped when
+// the collector can't keep up.
+
+// True if -rpcz_otlp_collector_url is set.
+bool IsExportingSpans();
+
+// Queue `span' and its client spans to be exported, content of `span' is
+// taken. Called by the collecting thread of rpcz.
+void ExportSpan(RpczSpan* span);
+
+// Append spans(including client spans) as an OTLP ExportTraceServiceRequest
+// in json to `out'.
+void SpansToOtlpJson(const std::vector<RpczSpan>& spans,
+                     const std::string& service_name,
+                     std::string* out);
+
+} // namespace brpc
+
+
+#endif // BRPC_SPAN_EXPORTER_H
@@ -21,6 +21,7 @@
 #include "butil/object_pool.h"
 #include "butil/unique_ptr.h"
 #include "bthread/unstable.h"
+#include "bvar/bvar.h"
 #include "brpc/log.h"
 #include "brpc/socket.h"
 #include "brpc/controller.h"
@@ -35,6 +36,36 @@ namespace brpc {
 DECLARE_bool(usercode_in_pthread);
 
 const static butil::IOBuf *TIMEOUT_TASK = (butil::IOBuf*)-1L;
+const static butil::IOBuf *FEEDBACK_TASK = (butil::IOBuf*)-2L;
+
+struct StreamVarsCollector {
+    StreamVarsCollector()
+        : written_bytes("rpc_stream_written_bytes")
+        , written_bytes_second("rpc_stream_written_bytes_second", &written_bytes)
+        , received_bytes("rpc_stream_received_bytes")
+        , received_bytes_second("rpc_stream_received_bytes_second", &received_bytes)
+        , ndata_frame("rpc_stream_data_frame_count")
+        , ncoalesced_message("rpc_stream_coalesced_message_count")
+        , nfeedback("rpc_stream_feedback_count")
+    {}
+
+    // Data of messages written into and received from host sockets.
+    bvar::Adder<int64_t> written_bytes;
+    bvar::PerSecond<bvar::Adder<int64_t> > written_bytes_second;
+    bvar::Adder<int64_t> received_bytes;
+    bvar::PerSecond<bvar::Adder<int64_t> > received_bytes_second;
+    bvar::Adder<int64_t> ndata_frame;
+    // Messages sent in frames along with other messages
+    bvar::Adder<int64_t> ncoalesced_message;
+    bvar::Adder<int64_t> nfeedback;
+};
+
+static StreamVarsCollector* s_stream_vars = NULL;
+
+static pthread_once_t s_create_stream_vars_once = PTHREAD_ONCE_INIT;
+static void CreateStreamVars() {
+    s_stream_vars = new StreamVarsCollector;
+}
 
 Stream::Stream() 
     : _host_socket(NULL)
@@ -44,6 +75,8 @@ Stream::Stream()
     , _produced(0)
     , _remote_consumed(0)
     , _local_consumed(0)
+    , _acked_consumed(0)
+    , _feedback_timer_started(false)
     , _parse_rpc_response(false)
     , _pending_buf(NULL)
     , _start_idle_timer_us(0)
@@ -64,6 +97,7 @@ Stream::~Stream() {
 int Stream::Create(const StreamOptions &options, 
                    const StreamSettings *remote_settings,
                    StreamId *id) {
+    CHECK_EQ(0, pthread_once(&s_create_stream_vars_once, CreateStreamVars));
     Stream* s = new Stream();
     s->_host_socket = NULL;
     s->_fake_socket_weak_ref = NULL;
@@ -107,11 +141,16 @@ void Stream::BeforeRecycle(Socket *) {
     // No one holds reference now, so we don't need lock here
     bthread_id_list_reset(&_writable_wait_list, ECONNRESET);
     if (_connected) {
-        // Send CLOSE frame
+        // Send CLOSE frame after pending DATA frames.
         RPC_VLOG << "Send close frame";
         CHECK(_host_socket != NULL);
-        policy::SendStreamClose(_host_socket,
-                                _remote_settings.stream_id(), id());
+        StreamFrameMeta fm;
+        fm.set_stream_id(_remote_settings.stream_id());
+        fm.set_source_stream_id(id());
+        fm.set_frame_type(FRAME_TYPE_CLOSE);
+        std::deque<butil::IOBuf> frames(1);
+        policy::PackStreamMessage(&frames[0], fm, NULL);
+        _host_socket->WriteStreamFrames(id(), _options.weight, &frames);
     }
 
     if (_host_socket) {
@@ -138,23 +177,70 @@ ssize_t Stream::CutMessageIntoFileDescriptor(int /*fd*/,
         errno = EBADF;
         return -1;
     }
-    butil::IOBuf out;
+    const size_t max_coalesced_size =
+        (_remote_settings.batched_messages() && _options.max_coalesced_size > 0)
+        ? _options.max_coalesced_size : 0;
+    std::deque<butil::IOBuf> frames;
     ssize_t len = 0;
-    for (size_t i = 0; i < size; ++i) {
+    for (size_t i = 0; i < size;) {
         StreamFrameMeta fm;
         fm.set_stream_id(_remote_settings.stream_id());
         fm.set_source_stream_id(id());
         fm.set_frame_type(FRAME_TYPE_DATA);
-        // TODO: split large data
         fm.set_has_continuation(false);
-        policy::PackStreamMessage(&out, fm, data_list[i]);
-        len += data_list[i]->length();
-        data_list[i]->clear();
+        if (max_coalesced_size == 0 || i + 1 == size ||
+            data_list[i]->length() >= max_coalesced_size) {
+            len += data_list[i]->length();
+            PackDataFrames(fm, data_list[i], &frames);
+            ++i;
+            continue;
+        }
+        // Coalesce following messages into one frame, the remote side
+        // splits them by message_sizes.
+        butil::IOBuf frame;
+        const size_t begin = i;
+        do {
+            fm.add_message_sizes(data_list[i]->length());
+            frame.append(butil::IOBuf::Movable(*data_list[i]));
+            ++i;
+        } while (i < size && frame.length() < max_coalesced_size);
+        if (i - begin == 1) {
+            fm.clear_message_sizes();
+        } else {
+            s_stream_vars->ncoalesced_message << (i - begin);
+        }
+        len += frame.length();
+        PackDataFrames(fm, &frame, &frames);
     }
-    WriteToHostSocket(&out);
+    s_stream_vars->ndata_frame << frames.size();
+    s_stream_vars->written_bytes << len;
+    _host_socket->WriteStreamFrames(id(), _options.weight, &frames);
     return len;
 }
 
+void Stream::PackDataFrames(const StreamFrameMeta& fm, butil::IOBuf* data,
+                            std::deque<butil::IOBuf>* frames) {
+    if (_options.max_frame_size > 0) {
+        // The receiver concatenates frames until the one without
+        // continuation, which carries message_sizes if any.
+        const size_t max_frame_size = _options.max_frame_size;
+        while (data->length() > max_frame_size) {
+            StreamFrameMeta cfm;
+            cfm.set_stream_id(fm.stream_id());
+            cfm.set_source_stream_id(fm.source_stream_id());
+            cfm.set_frame_type(FRAME_TYPE_DATA);
+            cfm.set_has_continuation(true);
+            butil::IOBuf piece;
+            data->cutn(&piece, max_frame_size);
+            frames->push_back(butil::IOBuf());
+            policy::PackStreamMessage(&frames->back(), cfm, &piece);
+        }
+    }
+    frames->push_back(butil::IOBuf());
+    policy::PackStreamMessage(&frames->back(), fm, data);
+    data->clear();
+}
+
 void Stream::WriteToHostSocket(butil::IOBuf* b) {
     BRPC_HANDLE_EOVERCROWDED(_host_socket->Write(b));
 }
@@ -227,6 +313,7 @@ void Stream::SetConnected(const StreamSettings* remote_settings) {
         CHECK(_remote_settings.IsInitialized());
     }
     CHECK(_host_socket != NULL);
+    FitRdmaWindow();
     RPC_VLOG << "stream=" << id() << " is connected to stream_id=" 
              << _remote_settings.stream_id() << " at host_socket=" << *_host_socket;
     _connected = true;
@@ -240,6 +327,35 @@ void Stream::SetConnected(const StreamSettings* remote_settings) {
     }
 }
 
+void Stream::FitRdmaWindow() {
+    // Frames over RDMA are received into the limited receive buffers of the
+    // host connection, which are credited back to the sender only after the
+    // data is received. More unconsumed data than the buffers just queues
+    // in the host socket and delays frames of other streams on it.
+    const size_t window = _host_socket->rdma_window_bytes();
+    if (window == 0) {
+        return;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+        if (_options.max_buf_size > 0 &&
+            (size_t)_options.max_buf_size > window) {
+            _options.max_buf_size = window;
+        }
+    }
+    if (_remote_settings.has_max_buf_size() &&
+        (size_t)_remote_settings.max_buf_size() > window) {
+        // The remote side is limited by the window as well, feedback
+        // earlier.
+        _remote_settings.set_max_buf_size(window);
+    }
+    if (_options.max_frame_size <= 0) {
+        // One frame occupies at most a quarter of the window so that
+        // frames of different streams interleave.
+        _options.max_frame_size = std::max(window / 4, (size_t)1);
+    }
+}
+
 void Stream::TriggerOnConnectIfNeed() {
     if (_connect_meta.on_connect != NULL) {
         ConnectMeta* meta = new ConnectMeta;
@@ -414,6 +530,7 @@ int Stream::OnReceived(const StreamFrameMeta& fm, butil::IOBuf *buf, Socket* soc
         CHECK(buf->empty());
         break;
     case FRAME_TYPE_DATA:
+        s_stream_vars->received_bytes << buf->length();
         if (_pending_buf != NULL) {
             _pending_buf->append(*buf);
             buf->clear();
@@ -424,6 +541,19 @@ int Stream::OnReceived(const StreamFrameMeta& fm, butil::IOBuf *buf, Socket* soc
         if (!fm.has_continuation()) {
             butil::IOBuf *tmp = _pending_buf;
             _pending_buf = NULL;
+            // Split messages coalesced by the writer, the last one is
+            // pushed as `tmp'.
+            for (int i = 0; i + 1 < fm.message_sizes_size(); ++i) {
+                butil::IOBuf* m = new butil::IOBuf;
+                tmp->cutn(m, fm.message_sizes(i));
+                if (bthread::execution_queue_execute(_consumer_queue, m) != 0) {
+                    CHECK(false) << "Fail to push into channel";
+                    delete m;
+                    delete tmp;
+                    Close();
+                    return 0;
+                }
+            }
             if (bthread::execution_queue_execute(_consumer_queue, tmp) != 0) {
                 CHECK(false) << "Fail to push into channel";
                 delete tmp;
@@ -502,10 +632,14 @@ int Stream::Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter) {
     DEFINE_SMALL_ARRAY(butil::IOBuf*, buf_list, s->_options.messages_in_batch, 256);
     MessageBatcher mb(buf_list, s->_options.messages_in_batch, s);
     bool has_timeout_task = false;
+    bool has_feedback_task = false;
     for (; iter; ++iter) {
         butil::IOBuf* t= *iter;
         if (t == TIMEOUT_TASK) {
             has_timeout_task = true;
+        } else if (t == FEEDBACK_TASK) {
+            has_feedback_task = true;
+            s->_feedback_timer_started = false;
         } else {
             if (s->_parse_rpc_response) {
                 s->_parse_rpc_response = false;
@@ -521,20 +655,59 @@ int Stream::Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter) {
         }
     }
     mb.flush();
-    if (s->_remote_settings.need_feedback() && mb.total_length() > 0) {
+    if (s->_remote_settings.need_feedback()) {
         s->_local_consumed += mb.total_length();
-        s->SendFeedback();
+        s->SendFeedbackIfNeeded(has_feedback_task);
     }
     s->StartIdleTimer();
     return 0;
 }
 
+void Stream::SendFeedbackIfNeeded(bool delay_expired) {
+    const int64_t unacked = _local_consumed - _acked_consumed;
+    if (unacked <= 0) {
+        return;
+    }
+    int64_t min_feedback_size = 0;
+    if (_remote_settings.has_max_buf_size()) {
+        // Old remote sides don't tell max_buf_size, which are acknowledged
+        // for each batch.
+        min_feedback_size = std::min((int64_t)_options.min_feedback_size,
+                                     _remote_settings.max_buf_size() / 2);
+    }
+    if (delay_expired || unacked >= min_feedback_size) {
+        return SendFeedback();
+    }
+    if (!_feedback_timer_started && _options.feedback_delay_ms >= 0) {
+        StartFeedbackTimer();
+    }
+}
+
+void OnFeedbackDelayExpired(void *arg) {
+    bthread::ExecutionQueueId<butil::IOBuf*> q = { (uint64_t)arg };
+    bthread::execution_queue_execute(q, (butil::IOBuf*)FEEDBACK_TASK);
+}
+
+void Stream::StartFeedbackTimer() {
+    bthread_timer_t timer;
+    timespec due_time = butil::milliseconds_from_now(_options.feedback_delay_ms);
+    const int rc = bthread_timer_add(&timer, due_time, OnFeedbackDelayExpired,
+                                     (void*)(_consumer_queue.value));
+    if (rc != 0) {
+        LOG(WARNING) << "Fail to add timer, " << berror(rc);
+        return SendFeedback();
+    }
+    _feedback_timer_started = true;
+}
+
 void Stream::SendFeedback() {
     StreamFrameMeta fm;
     fm.set_frame_type(FRAME_TYPE_FEEDBACK);
     fm.set_stream_id(_remote_settings.stream_id());
     fm.set_source_stream_id(id());
     fm.mutable_feedback()->set_consumed_size(_local_consumed);
+    _acked_consumed = _local_consumed;
+    s_stream_vars->nfeedback << 1;
     butil::IOBuf out;
     policy::PackStreamMessage(&out, fm, NULL);
     WriteToHostSocket(&out);
@@ -559,6 +732,10 @@ void Stream::FillSettings(StreamSettings *settings) {
     settings->set_stream_id(id());
     settings->set_need_feedback(_options.max_buf_size > 0);
     settings->set_writable(_options.handler != NULL);
+    if (_options.max_buf_size > 0) {
+        settings->set_max_buf_size(_options.max_buf_size);
+    }
+    settings->set_batched_messages(true);
 }
 
 void OnIdleTimeout(void *arg) {
@@ -733,7 +910,7 @@ int StreamAccept(StreamId* response_stream, Controller &cntl,
         opt = *options;
     }
     StreamId stream_id;
-    if (Stream::Create(opt, cntl._remote_stream_settings, &stream_id) != 0) {
+    if (Stream::Create(opt, cntl._ext->remote_stream_settings, &stream_id) != 0) {
         LOG(ERROR) << "Fail to create stream";
         return -1;
     }
@@ -49,6 +49,11 @@ struct StreamOptions {
         : max_buf_size(2 * 1024 * 1024)
         , idle_timeout_ms(-1)
         , messages_in_batch(128)
+        , min_feedback_size(0)
+        , feedback_delay_ms(10)
+        , max_coalesced_size(64 * 1024)
+        , max_frame_size(0)
+        , weight(1)
         , handler(NULL)
     {}
 
@@ -67,6 +72,41 @@ struct StreamOptions {
     // default: 128
     size_t messages_in_batch;
 
+    // Consumed data is acknowledged to the remote side only when it's at
+    // least |min_feedback_size| bytes, which saves feedback frames of streams
+    // with many small messages. The value is capped to half of max_buf_size
+    // of the remote side so that the writer is not blocked by unacknowledged
+    // data. If |min_feedback_size| <= 0, feedback is sent after consuming
+    // each batch of messages.
+    // default: 0
+    int min_feedback_size;
+
+    // Consumed data less than |min_feedback_size| is acknowledged after at
+    // most |feedback_delay_ms| milliseconds. If |feedback_delay_ms| < 0, it's
+    // acknowledged along with data consumed later.
+    // default: 10
+    long feedback_delay_ms;
+
+    // Messages written in batch are coalesced into one frame until the frame
+    // has at least |max_coalesced_size| bytes, which saves framing overhead of
+    // small messages. Works only if the remote side splits coalesced frames.
+    // If |max_coalesced_size| <= 0, each message is sent in one frame.
+    // default: 65536
+    int max_coalesced_size;
+
+    // Messages larger than |max_frame_size| are split into frames of at most
+    // so many bytes, so that frames of other streams over the same
+    // connection are not delayed by large messages for long.
+    // If |max_frame_size| <= 0, each message is sent in one frame.
+    // default: 0
+    int max_frame_size;
+
+    // Frames of streams over the same connection are written in weighted
+    // round-robin, this stream gets |weight| times more bytes than a stream
+    // with weight 1 in each round, see -stream_write_quantum.
+    // default: 1
+    int weight;
+
     // Handle input message, if handler is NULL, the remote side is not allowd to
     // write any message, who will get EBADF on writting
     // default: NULL
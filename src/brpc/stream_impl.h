@@ -69,14 +69,20 @@ friend class MessageBatcher;
     ~Stream();
     int Init(const StreamOptions options);
     void SetRemoteConsumed(size_t _remote_consumed);
+    // Fit the flow control into the RDMA window of the host socket
+    void FitRdmaWindow();
     void TriggerOnConnectIfNeed();
     void Wait(void (*on_writable)(StreamId, void*, int), void* arg, 
               const timespec* due_time, bool new_thread, bthread_id_t *join_id);
     void SendFeedback();
+    void SendFeedbackIfNeeded(bool delay_expired);
+    void StartFeedbackTimer();
     void StartIdleTimer();
     void StopIdleTimer();
     void HandleRpcResponse(butil::IOBuf* response_buffer);
     void WriteToHostSocket(butil::IOBuf* b);
+    void PackDataFrames(const StreamFrameMeta& fm, butil::IOBuf* data,
+                        std::deque<butil::IOBuf>* frames);
 
     static int Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter);
     static int TriggerOnWritable(bthread_id_t id, void *data, int error_code);
@@ -115,6 +121,8 @@ friend class MessageBatcher;
     bthread_id_list_t _writable_wait_list;
 
     int64_t _local_consumed;
+    int64_t _acked_consumed;  // _local_consumed in the last feedback
+    bool _feedback_timer_started;
     StreamSettings _remote_settings;   
 
     bool _parse_rpc_response;
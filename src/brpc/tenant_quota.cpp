@@ -0,0 +1,373 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "bvar/bvar.h"
+#include "brpc/controller.h"
+#include "brpc/authenticator.h"
+#include "brpc/tenant_quota.h"
+
+namespace brpc {
+
+// Fair shares are re-divided in this interval by the demands in last one.
+static const int64_t FAIR_SHARE_INTERVAL_US = 100000;
+
+TenantQuota::TenantQuota()
+    : max_qps(0)
+    , burst(0)
+    , max_concurrency(0)
+    , weight(1) {
+}
+
+static int get_atomic_int(void* arg) {
+    return static_cast<butil::atomic<int>*>(arg)->load(
+        butil::memory_order_relaxed);
+}
+
+class TenantStatus {
+public:
+    TenantStatus(const std::string& name, const TenantQuota& quota)
+        : _name(name)
+        , _tat_ns(0)
+        , _concurrency(0)
+        , _peak_concurrency(0)
+        , _starved(false)
+        , _fair_share(0)
+        , _concurrency_bvar(get_atomic_int, &_concurrency)
+        , _fair_share_bvar(get_atomic_int, &_fair_share) {
+        SetQuota(quota);
+    }
+
+    void SetQuota(const TenantQuota& quota) {
+        _quota = quota;
+        if (_quota.weight <= 0) {
+            _quota.weight = 1;
+        }
+        _emission_ns = (quota.max_qps > 0 ? 1000000000L / quota.max_qps : 0);
+        _tolerance_ns = _emission_ns *
+            (quota.burst > 0 ? quota.burst : quota.max_qps);
+    }
+
+    // Take a token from the bucket. The bucket is simulated by the time
+    // when it's refilled next time (GCRA), which is cheaper than refilling
+    // tokens periodically.
+    bool TakeToken() {
+        if (_emission_ns <= 0) {
+            return true;
+        }
+        const int64_t now_ns = butil::cpuwide_time_ns();
+        int64_t tat_ns = _tat_ns.load(butil::memory_order_relaxed);
+        int64_t new_tat_ns = 0;
+        do {
+            new_tat_ns = std::max(tat_ns, now_ns) + _emission_ns;
+            if (new_tat_ns - now_ns > _tolerance_ns) {
+                return false;
+            }
+        } while (!_tat_ns.compare_exchange_weak(
+                     tat_ns, new_tat_ns, butil::memory_order_relaxed));
+        return true;
+    }
+
+    bool OnRequested(bool check_fair_share) {
+        const int nconcurrency =
+            _concurrency.fetch_add(1, butil::memory_order_relaxed) + 1;
+        if (_quota.max_concurrency > 0 &&
+            nconcurrency > _quota.max_concurrency) {
+            return Reject();
+        }
+        if (check_fair_share) {
+            const int share = _fair_share.load(butil::memory_order_relaxed);
+            if (share > 0 && nconcurrency > share) {
+                _starved.store(true, butil::memory_order_relaxed);
+                return Reject();
+            }
+        }
+        if (!TakeToken()) {
+            return Reject();
+        }
+        int peak = _peak_concurrency.load(butil::memory_order_relaxed);
+        while (nconcurrency > peak &&
+               !_peak_concurrency.compare_exchange_weak(
+                   peak, nconcurrency, butil::memory_order_relaxed)) {}
+        _nrequest << 1;
+        return true;
+    }
+
+    void OnResponded() {
+        _concurrency.fetch_sub(1, butil::memory_order_relaxed);
+    }
+
+    int Expose(const std::string& prefix) {
+        std::string tprefix = prefix;
+        tprefix.append("_tenant_");
+        bvar::to_underscored_name(
+            &tprefix, _name.empty() ? std::string("anonymous") : _name);
+        if (_nrequest.expose_as(tprefix, "count") != 0 ||
+            _nrejected.expose_as(tprefix, "rejected") != 0 ||
+            _concurrency_bvar.expose_as(tprefix, "processing") != 0 ||
+            _fair_share_bvar.expose_as(tprefix, "fair_share") != 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    void Describe(std::ostream& os, bool use_html) const {
+        os << (use_html ? "<p>" : "")
+           << "tenant=" << (_name.empty() ? "(anonymous)" : _name)
+           << " count=" << _nrequest.get_value()
+           << " rejected=" << _nrejected.get_value()
+           << " processing=" << _concurrency.load(butil::memory_order_relaxed);
+        const int share = _fair_share.load(butil::memory_order_relaxed);
+        if (share > 0) {
+            os << " fair_share=" << share;
+        }
+        if (_quota.max_qps > 0) {
+            os << " max_qps=" << _quota.max_qps;
+            if (_quota.burst > 0) {
+                os << " burst=" << _quota.burst;
+            }
+        }
+        if (_quota.max_concurrency > 0) {
+            os << " max_concurrency=" << _quota.max_concurrency;
+        }
+        os << " weight=" << _quota.weight << (use_html ? "</p>\n" : "\n");
+    }
+
+private:
+friend class TenantQuotas;
+    bool Reject() {
+        _concurrency.fetch_sub(1, butil::memory_order_relaxed);
+        _nrejected << 1;
+        return false;
+    }
+
+    const std::string _name;
+    TenantQuota _quota;
+    int64_t _emission_ns;
+    int64_t _tolerance_ns;
+    butil::atomic<int64_t> _tat_ns;
+    butil::atomic<int> _concurrency;
+    // Max concurrency since last update of fair shares.
+    butil::atomic<int> _peak_concurrency;
+    // Rejected by the fair share or max_concurrency of the server since
+    // last update of fair shares.
+    butil::atomic<bool> _starved;
+    // 0 means unlimited
+    butil::atomic<int> _fair_share;
+    bvar::Adder<int64_t> _nrequest;
+    bvar::Adder<int64_t> _nrejected;
+    bvar::PassiveStatus<int> _concurrency_bvar;
+    bvar::PassiveStatus<int> _fair_share_bvar;
+};
+
+TenantQuotas::TenantQuotas()
+    : _max_tenants(1024)
+    , _next_update_us(0)
+    , _anonymous(NULL) {
+    _status_map.Modify(InitMap);
+}
+
+TenantQuotas::~TenantQuotas() {
+    for (size_t i = 0; i < _all_status.size(); ++i) {
+        delete _all_status[i];
+    }
+    _all_status.clear();
+}
+
+size_t TenantQuotas::InitMap(TenantMap& m) {
+    CHECK_EQ(0, m.init(64));
+    return 1;
+}
+
+size_t TenantQuotas::AddToMap(TenantMap& m, TenantStatus* status) {
+    m[status->_name] = status;
+    return 1;
+}
+
+void TenantQuotas::SetQuota(const std::string& tenant,
+                            const TenantQuota& quota) {
+    TenantStatus* status = GetStatus(tenant);
+    if (status->_name != tenant) {
+        LOG(ERROR) << "Fail to set quota of tenant=" << tenant
+                   << ", more than " << _max_tenants << " tenants";
+        return;
+    }
+    status->SetQuota(quota);
+}
+
+TenantStatus* TenantQuotas::GetStatus(const std::string& tenant) {
+    {
+        butil::DoublyBufferedData<TenantMap>::ScopedPtr ptr;
+        if (_status_map.Read(&ptr) == 0) {
+            TenantStatus* const* p = ptr->seek(tenant);
+            if (p) {
+                return *p;
+            }
+        }
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    {
+        butil::DoublyBufferedData<TenantMap>::ScopedPtr ptr;
+        if (_status_map.Read(&ptr) == 0) {
+            TenantStatus* const* p = ptr->seek(tenant);
+            if (p) {
+                return *p;
+            }
+        }
+    }
+    if (!tenant.empty() && _all_status.size() >= _max_tenants) {
+        if (_anonymous) {
+            return _anonymous;
+        }
+        return GetStatusLocked("");
+    }
+    return GetStatusLocked(tenant);
+}
+
+TenantStatus* TenantQuotas::GetStatusLocked(const std::string& tenant) {
+    TenantStatus* status = new TenantStatus(tenant, _default_quota);
+    _all_status.push_back(status);
+    if (tenant.empty()) {
+        _anonymous = status;
+    }
+    if (!_expose_prefix.empty()) {
+        status->Expose(_expose_prefix);
+    }
+    _status_map.Modify(AddToMap, status);
+    return status;
+}
+
+bool TenantQuotas::OnRequested(const Controller* cntl,
+                               int server_max_concurrency,
+                               TenantStatus** status) {
+    const std::string* tenant = NULL;
+    const AuthContext* auth_ctx = cntl->auth_context();
+    if (auth_ctx && !auth_ctx->user().empty()) {
+        tenant = &auth_ctx->user();
+    } else if (!_http_header.empty() && cntl->has_http_request()) {
+        tenant = cntl->http_request().GetHeader(_http_header);
+    }
+    TenantStatus* st = GetStatus(tenant ? *tenant : std::string());
+    if (server_max_concurrency > 0) {
+        const int64_t now_us = butil::cpuwide_time_us();
+        int64_t next_us = _next_update_us.load(butil::memory_order_relaxed);
+        if (now_us >= next_us &&
+            _next_update_us.compare_exchange_strong(
+                next_us, now_us + FAIR_SHARE_INTERVAL_US,
+                butil::memory_order_relaxed)) {
+            UpdateFairShares(server_max_concurrency);
+        }
+    }
+    if (!st->OnRequested(server_max_concurrency > 0)) {
+        return false;
+    }
+    *status = st;
+    return true;
+}
+
+void TenantQuotas::OnServerLimited(TenantStatus* status) {
+    status->_starved.store(true, butil::memory_order_relaxed);
+}
+
+void TenantQuotas::OnResponded(TenantStatus* status) {
+    status->OnResponded();
+}
+
+struct TenantDemand {
+    TenantStatus* status;
+    int demand;
+    int weight;
+    bool operator<(const TenantDemand& rhs) const {
+        return (int64_t)demand * rhs.weight < (int64_t)rhs.demand * weight;
+    }
+};
+
+// Weighted max-min fairness: tenants demanding less than their shares get
+// what they demand, the rest is divided in proportion to weights.
+void TenantQuotas::UpdateFairShares(int server_max_concurrency) {
+    std::vector<TenantStatus*> all_status;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        all_status = _all_status;
+    }
+    std::vector<TenantDemand> demands;
+    demands.reserve(all_status.size());
+    int64_t total_weight = 0;
+    for (size_t i = 0; i < all_status.size(); ++i) {
+        TenantStatus* st = all_status[i];
+        const int cur = st->_concurrency.load(butil::memory_order_relaxed);
+        const int peak = st->_peak_concurrency.exchange(
+            cur, butil::memory_order_relaxed);
+        const bool starved =
+            st->_starved.exchange(false, butil::memory_order_relaxed);
+        int demand = (starved ? server_max_concurrency : std::max(peak, cur));
+        if (st->_quota.max_concurrency > 0) {
+            demand = std::min(demand, st->_quota.max_concurrency);
+        }
+        if (demand <= 0) {
+            // Inactive tenants are not limited until next update.
+            st->_fair_share.store(0, butil::memory_order_relaxed);
+            continue;
+        }
+        TenantDemand d = { st, demand, st->_quota.weight };
+        demands.push_back(d);
+        total_weight += d.weight;
+    }
+    std::sort(demands.begin(), demands.end());
+    double remaining = server_max_concurrency;
+    // Concurrency per weight given to unsatisfied tenants, negative when
+    // all tenants are satisfied.
+    double level = -1;
+    for (size_t i = 0; i < demands.size(); ++i) {
+        if (demands[i].demand * (double)total_weight >
+            remaining * demands[i].weight) {
+            level = remaining / total_weight;
+            break;
+        }
+        remaining -= demands[i].demand;
+        total_weight -= demands[i].weight;
+    }
+    for (size_t i = 0; i < demands.size(); ++i) {
+        int share = 0;
+        if (level >= 0) {
+            share = std::max(1, (int)(demands[i].weight * level));
+        }
+        demands[i].status->_fair_share.store(
+            share, butil::memory_order_relaxed);
+    }
+}
+
+int TenantQuotas::Expose(const butil::StringPiece& prefix) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _expose_prefix.assign(prefix.data(), prefix.size());
+    int rc = 0;
+    for (size_t i = 0; i < _all_status.size(); ++i) {
+        if (_all_status[i]->Expose(_expose_prefix) != 0) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+void TenantQuotas::Describe(std::ostream& os,
+                            const DescribeOptions& options) const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = 0; i < _all_status.size(); ++i) {
+        _all_status[i]->Describe(os, options.use_html);
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,143 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BRPC_TENANT_QUOTA_H
+#define BRPC_TENANT_QUOTA_H
+
+#include <string>
+#include <vector>
+#include "butil/macros.h"
+#include "butil/atomicops.h"
+#include "butil/synchronization/lock.h"
+#include "butil/containers/flat_map.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/describable.h"
+
+namespace brpc {
+
+class Controller;
+class TenantStatus;
+
+// Limits of requests from one tenant (a caller sharing the server).
+struct TenantQuota {
+    TenantQuota();
+
+    // Requests per second of the tenant, taken from a token bucket refilled
+    // at this rate.
+    // Default: 0 (unlimited)
+    int64_t max_qps;
+
+    // Capacity of the token bucket, namely the max burst of requests.
+    // Default: 0 (same as max_qps)
+    int64_t burst;
+
+    // Max requests of the tenant processed in parallel.
+    // Default: 0 (unlimited)
+    int max_concurrency;
+
+    // When ServerOptions.max_concurrency is set, requests of one tenant can
+    // use up all the concurrency and starve others. To prevent this, the
+    // concurrency is shared by tenants in proportion to their weights: a
+    // tenant using less than its share gives the rest to others, a tenant
+    // exceeding its share while others are starving is rejected.
+    // Default: 1
+    int weight;
+};
+
+// Admit requests by quotas of their tenants, set into
+// ServerOptions.tenant_quotas. Example:
+//   brpc::TenantQuotas quotas;
+//   quotas.default_quota().max_qps = 1000;
+//   brpc::TenantQuota q;
+//   q.weight = 3;
+//   quotas.SetQuota("important_caller", q);
+//   options.tenant_quotas = &quotas;
+//
+// The tenant of a request is AuthContext::user() filled by the
+// Authenticator of the server, or the http header set by set_http_header()
+// if there's no authentication or the user is empty. Requests without
+// tenants are accounted to the anonymous tenant (with the name "").
+// Rejected requests fail with ELIMIT before running user code.
+class TenantQuotas : public Describable {
+public:
+    TenantQuotas();
+    ~TenantQuotas();
+
+    // Set quota of `tenant'. Tenants without quotas use default_quota().
+    // Must be called before the server starts.
+    void SetQuota(const std::string& tenant, const TenantQuota& quota);
+
+    // Quota of the tenants not set by SetQuota().
+    TenantQuota& default_quota() { return _default_quota; }
+    const TenantQuota& default_quota() const { return _default_quota; }
+
+    // Read tenants of http requests from the header named `header' when
+    // there's no user in AuthContext. Must be called before the server
+    // starts. Default: "" (not read)
+    void set_http_header(const std::string& header) { _http_header = header; }
+    const std::string& http_header() const { return _http_header; }
+
+    // At most so many tenants are tracked separately, requests from more
+    // tenants are accounted to the anonymous tenant, so that forged tenants
+    // can't exhaust memory. Default: 1024
+    void set_max_tenants(size_t max_tenants) { _max_tenants = max_tenants; }
+
+    // [Internal] Called before ServerOptions.max_concurrency is checked.
+    // Returns true and sets `*status' which should be given to
+    // OnResponded() if the request is admitted, false otherwise.
+    bool OnRequested(const Controller* cntl, int server_max_concurrency,
+                     TenantStatus** status);
+
+    // [Internal] The admitted request was rejected by max_concurrency of
+    // the server, the tenant deserves a larger share.
+    void OnServerLimited(TenantStatus* status);
+
+    // [Internal] The admitted request is responded.
+    void OnResponded(TenantStatus* status);
+
+    // Expose bvars of tenants as <prefix>_tenant_<name>_xxx.
+    // Return 0 on success, -1 otherwise.
+    int Expose(const butil::StringPiece& prefix);
+
+    // Describe quotas and stats of tenants, used by /status
+    void Describe(std::ostream& os, const DescribeOptions&) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(TenantQuotas);
+    typedef butil::FlatMap<std::string, TenantStatus*> TenantMap;
+    static size_t InitMap(TenantMap& m);
+    static size_t AddToMap(TenantMap& m, TenantStatus* status);
+
+    // Find status of `tenant' or create it.
+    TenantStatus* GetStatus(const std::string& tenant);
+    // Create status of `tenant' with _mutex held.
+    TenantStatus* GetStatusLocked(const std::string& tenant);
+    // Re-divide `server_max_concurrency' into shares of active tenants.
+    void UpdateFairShares(int server_max_concurrency);
+
+    TenantQuota _default_quota;
+    std::string _http_header;
+    size_t _max_tenants;
+    butil::DoublyBufferedData<TenantMap> _status_map;
+    butil::atomic<int64_t> _next_update_us;
+    // Protects fields below
+    mutable butil::Mutex _mutex;
+    std::vector<TenantStatus*> _all_status;
+    TenantStatus* _anonymous;
+    std::string _expose_prefix;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_TENANT_QUOTA_H
@@ -128,6 +128,7 @@ void ThriftFramedMessage::SharedCtor() {
     thrift_raw_instance = nullptr;
     thrift_message_seq_id = 0;
     method_name = "";    
+    use_compact_protocol = false;
     //RegisterThriftProtocolDummy dummy;
 }
 
@@ -209,6 +210,7 @@ void ThriftFramedMessage::MergeFrom(const ThriftFramedMessage& from) {
     GOOGLE_CHECK_NE(&from, this);
     head = from.head;
     body = from.body;
+    use_compact_protocol = from.use_compact_protocol;
 }
 
 void ThriftFramedMessage::CopyFrom(const ::google::protobuf::Message& from) {
@@ -233,6 +235,7 @@ void ThriftFramedMessage::Swap(ThriftFramedMessage* other) {
         other->head = head;
         head = tmp;
         body.swap(other->body);
+        std::swap(use_compact_protocol, other->use_compact_protocol);
     }
 }
 
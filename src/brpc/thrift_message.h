@@ -58,6 +58,10 @@ public:
 
     int32_t thrift_message_seq_id;
     std::string method_name;
+    // Serialize the message in TCompactProtocol instead of TBinaryProtocol.
+    // Set by brpc for received messages, server replies in the protocol of
+    // the request.
+    bool use_compact_protocol;
 
 public:
     ThriftFramedMessage();
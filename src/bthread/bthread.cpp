@@ -24,6 +24,7 @@
 #include "bthread/timer_thread.h"
 #include "bthread/list_of_abafree_id.h"
 #include "bthread/bthread.h"
+#include "bthread/unstable.h"                 // bthread_stat_t
 
 namespace bthread {
 
@@ -116,6 +117,26 @@ static bool validate_bthread_min_concurrency(const char*, int32_t val) {
 }
 
 __thread TaskGroup* tls_task_group_nosignal = NULL;
+// TaskControl::nretired() when tls_task_group_nosignal was checked.
+__thread int64_t tls_nretired_nosignal = 0;
+
+// Get tls_task_group_nosignal, or NULL if the group was retired, which may
+// be deleted already. Tasks in a retired group are run or moved to other
+// groups by the group itself, they don't need flushing.
+inline TaskGroup* get_task_group_nosignal(TaskControl* c) {
+    TaskGroup* g = tls_task_group_nosignal;
+    if (g != NULL) {
+        const int64_t nretired = c->nretired();
+        if (nretired != tls_nretired_nosignal) {
+            tls_nretired_nosignal = nretired;
+            if (!c->is_active_group(g)) {
+                tls_task_group_nosignal = NULL;
+                return NULL;
+            }
+        }
+    }
+    return g;
+}
 
 BUTIL_FORCE_INLINE int
 start_from_non_worker(bthread_t* __restrict tid,
@@ -126,22 +147,44 @@ start_from_non_worker(bthread_t* __restrict tid,
     if (NULL == c) {
         return ENOMEM;
     }
+    bthread_tag_t tag = BTHREAD_TAG_DEFAULT;
+    if (attr != NULL && attr->tag != BTHREAD_TAG_INVALID) {
+        tag = attr->tag;
+        if (tag < 0 || tag >= c->ntags()) {
+            return EINVAL;
+        }
+    }
     if (attr != NULL && (attr->flags & BTHREAD_NOSIGNAL)) {
         // Remember the TaskGroup to insert NOSIGNAL tasks for 2 reasons:
         // 1. NOSIGNAL is often for creating many bthreads in batch,
         //    inserting into the same TaskGroup maximizes the batch.
         // 2. bthread_flush() needs to know which TaskGroup to flush.
-        TaskGroup* g = tls_task_group_nosignal;
+        TaskGroup* g = get_task_group_nosignal(c);
+        if (g != NULL && g->tag() != tag) {
+            // Only one group is remembered, flush the previous one.
+            g->flush_nosignal_tasks_remote();
+            g = NULL;
+        }
         if (NULL == g) {
-            g = c->choose_one_group();
+            // Read before choosing so that retirement of the chosen group
+            // is always noticed.
+            tls_nretired_nosignal = c->nretired();
+            g = c->choose_one_group(tag);
             tls_task_group_nosignal = g;
         }
         return g->start_background<true>(tid, attr, fn, arg);
     }
-    return c->choose_one_group()->start_background<true>(
+    return c->choose_one_group(tag)->start_background<true>(
         tid, attr, fn, arg);
 }
 
+// True if the bthread should be started in another tag rather than the tag
+// of calling worker `g'.
+inline bool is_other_tag(const TaskGroup* g, const bthread_attr_t* attr) {
+    return attr != NULL && attr->tag != BTHREAD_TAG_INVALID &&
+        attr->tag != g->tag();
+}
+
 struct TidTraits {
     static const size_t BLOCK_SIZE = 63;
     static const size_t MAX_ENTRIES = 65536;
@@ -162,6 +205,19 @@ struct TidJoiner {
     }
 };
 
+// defined in bthread/mutex.cpp
+extern size_t offcpu_sampling_range();
+extern void submit_offcpu(int64_t duration_ns, size_t sampling_range,
+                          int64_t now_ns);
+
+static int usleep_impl(uint64_t microseconds) {
+    TaskGroup* g = tls_task_group;
+    if (NULL != g && !g->is_current_pthread_task()) {
+        return TaskGroup::usleep(&g, microseconds);
+    }
+    return ::usleep(microseconds);
+}
+
 }  // namespace bthread
 
 extern "C" {
@@ -171,7 +227,7 @@ int bthread_start_urgent(bthread_t* __restrict tid,
                          void * (*fn)(void*),
                          void* __restrict arg) {
     bthread::TaskGroup* g = bthread::tls_task_group;
-    if (g) {
+    if (g && !bthread::is_other_tag(g, attr)) {
         // start from worker
         return bthread::TaskGroup::start_foreground(&g, tid, attr, fn, arg);
     }
@@ -183,7 +239,7 @@ int bthread_start_background(bthread_t* __restrict tid,
                              void * (*fn)(void*),
                              void* __restrict arg) {
     bthread::TaskGroup* g = bthread::tls_task_group;
-    if (g) {
+    if (g && !bthread::is_other_tag(g, attr)) {
         // start from worker
         return g->start_background<false>(tid, attr, fn, arg);
     }
@@ -193,9 +249,18 @@ int bthread_start_background(bthread_t* __restrict tid,
 void bthread_flush() {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g) {
+        // NOSIGNAL tasks of other tags were inserted into
+        // tls_task_group_nosignal by start_from_non_worker().
+        bthread::TaskGroup* other =
+            bthread::get_task_group_nosignal(g->control());
+        if (other) {
+            bthread::tls_task_group_nosignal = NULL;
+            other->flush_nosignal_tasks_remote();
+        }
         return g->flush_nosignal_tasks();
     }
-    g = bthread::tls_task_group_nosignal;
+    bthread::TaskControl* c = bthread::get_task_control();
+    g = (c ? bthread::get_task_group_nosignal(c) : NULL);
     if (g) {
         // NOSIGNAL tasks were created in this non-worker.
         bthread::tls_task_group_nosignal = NULL;
@@ -203,6 +268,30 @@ void bthread_flush() {
     }
 }
 
+int bthread_start_batch(bthread_t* __restrict tids, size_t n,
+                        const bthread_attr_t* __restrict attr,
+                        void * (*fn)(void*),
+                        void* const* __restrict args) {
+    bthread_attr_t nosignal_attr = (attr ? *attr : BTHREAD_ATTR_NORMAL);
+    const bool flush = !(nosignal_attr.flags & BTHREAD_NOSIGNAL);
+    nosignal_attr.flags |= BTHREAD_NOSIGNAL;
+    int rc = 0;
+    size_t i = 0;
+    for (; i < n; ++i) {
+        rc = bthread_start_background(&tids[i], &nosignal_attr, fn, args[i]);
+        if (rc != 0) {
+            break;
+        }
+    }
+    for (size_t j = i; j < n; ++j) {
+        tids[j] = INVALID_BTHREAD;
+    }
+    if (flush && i > 0) {
+        bthread_flush();
+    }
+    return rc;
+}
+
 int bthread_interrupt(bthread_t tid) {
     return bthread::TaskGroup::interrupt(tid, bthread::get_task_control());
 }
@@ -277,12 +366,8 @@ int bthread_setconcurrency(int num) {
         return 0;
     }
     bthread::TaskControl* c = bthread::get_task_control();
-    if (c != NULL) {
-        if (num < c->concurrency()) {
-            return EPERM;
-        } else if (num == c->concurrency()) {
-            return 0;
-        }
+    if (c != NULL && num == c->concurrency()) {
+        return 0;
     }
     BAIDU_SCOPED_LOCK(bthread::g_task_control_mutex);
     c = bthread::get_task_control();
@@ -307,9 +392,57 @@ int bthread_setconcurrency(int num) {
             c->add_workers(num - bthread::FLAGS_bthread_concurrency);
         return 0;
     }
+    if (num < bthread::FLAGS_bthread_concurrency) {
+        // Retire workers, which quit after running tasks left in their
+        // runqueues.
+        bthread::FLAGS_bthread_concurrency -=
+            c->remove_workers(bthread::FLAGS_bthread_concurrency - num);
+    }
     return (num == bthread::FLAGS_bthread_concurrency ? 0 : EPERM);
 }
 
+int bthread_getconcurrency_by_tag(bthread_tag_t tag) {
+    bthread::TaskControl* c = bthread::get_or_new_task_control();
+    if (c == NULL || tag < 0 || tag >= c->ntags()) {
+        return -1;
+    }
+    return c->concurrency(tag);
+}
+
+int bthread_setconcurrency_by_tag(int num, bthread_tag_t tag) {
+    bthread::TaskControl* c = bthread::get_or_new_task_control();
+    if (c == NULL) {
+        return ENOMEM;
+    }
+    if (tag < 0 || tag >= c->ntags()) {
+        return EINVAL;
+    }
+    if (num <= 0) {
+        return EINVAL;
+    }
+    BAIDU_SCOPED_LOCK(bthread::g_task_control_mutex);
+    const int cur = c->concurrency(tag);
+    if (num < cur) {
+        const int removed = c->remove_workers(cur - num, tag);
+        bthread::FLAGS_bthread_concurrency -= removed;
+        if (removed != cur - num) {
+            return EPERM;
+        }
+    } else if (num > cur) {
+        const int added = c->add_workers(num - cur, tag);
+        bthread::FLAGS_bthread_concurrency += added;
+        if (added != num - cur) {
+            return EAGAIN;
+        }
+    }
+    return 0;
+}
+
+bthread_tag_t bthread_self_tag(void) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    return g ? g->tag() : BTHREAD_TAG_INVALID;
+}
+
 int bthread_about_to_quit() {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g != NULL) {
@@ -319,6 +452,33 @@ int bthread_about_to_quit() {
     return EPERM;
 }
 
+int bthread_set_high_priority(int high) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g != NULL) {
+        bthread::TaskMeta* m = g->current_task();
+        if (high) {
+            m->attr.flags |= BTHREAD_PRIORITY_HIGH;
+        } else {
+            m->attr.flags &= ~BTHREAD_PRIORITY_HIGH;
+        }
+        return 0;
+    }
+    return EPERM;
+}
+
+int bthread_self_stat(bthread_stat_t* stat) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL || g->is_current_pthread_task()) {
+        return EPERM;
+    }
+    const bthread::TaskStatistics s = g->current_stat();
+    stat->cputime_ns = s.cputime_ns;
+    stat->queue_ns = s.queue_ns;
+    stat->last_queue_ns = s.last_queue_ns;
+    stat->nswitch = s.nswitch;
+    return 0;
+}
+
 int bthread_timer_add(bthread_timer_t* id, timespec abstime,
                       void (*on_timer)(void*), void* arg) {
     bthread::TaskControl* c = bthread::get_or_new_task_control();
@@ -353,11 +513,15 @@ int bthread_timer_del(bthread_timer_t id) {
 }
 
 int bthread_usleep(uint64_t microseconds) {
-    bthread::TaskGroup* g = bthread::tls_task_group;
-    if (NULL != g && !g->is_current_pthread_task()) {
-        return bthread::TaskGroup::usleep(&g, microseconds);
-    }
-    return ::usleep(microseconds);
+    const size_t sampling_range = bthread::offcpu_sampling_range();
+    if (!sampling_range) {
+        return bthread::usleep_impl(microseconds);
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const int rc = bthread::usleep_impl(microseconds);
+    const int64_t end_ns = butil::cpuwide_time_ns();
+    bthread::submit_offcpu(end_ns - start_ns, sampling_range, end_ns);
+    return rc;
 }
 
 int bthread_yield(void) {
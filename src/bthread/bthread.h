@@ -27,6 +27,7 @@
 #if defined(__cplusplus)
 #  include <iostream>
 #  include "bthread/mutex.h"        // use bthread_mutex_t in the RAII way
+#  include "bthread/rwlock.h"       // use bthread_rwlock_t in the RAII way
 #endif
 
 #include "bthread/id.h"
@@ -52,6 +53,20 @@ extern int bthread_start_background(bthread_t* __restrict tid,
                                     void * (*fn)(void*),
                                     void* __restrict args);
 
+// Create `n' bthreads `fn(args[i])' with attributes `attr' and put the
+// identifiers into `tids[i]'. Same as calling bthread_start_background()
+// `n' times, but workers are signalled once for all bthreads rather than
+// once per bthread, which is much cheaper for fanning out many tasks. If
+// `attr' has BTHREAD_NOSIGNAL, workers are not signalled until
+// bthread_flush() is called.
+// Returns 0 if all bthreads were created, errno otherwise, in which case
+// tids of bthreads not created are INVALID_BTHREAD while created bthreads
+// still run.
+extern int bthread_start_batch(bthread_t* __restrict tids, size_t n,
+                               const bthread_attr_t* __restrict attr,
+                               void * (*fn)(void*),
+                               void* const* __restrict args);
+
 // Wake up operations blocking the thread. Different functions may behave
 // differently:
 //   bthread_usleep(): returns -1 and sets errno to ESTOP if bthread_stop()
@@ -139,10 +154,25 @@ extern int bthread_getconcurrency(void);
 
 // Set number of worker pthreads to `num'. After a successful call,
 // bthread_getconcurrency() shall return new set number, but workers may
-// take some time to quit or create.
-// NOTE: currently concurrency cannot be reduced after any bthread created.
+// take some time to quit or create. Workers to quit stop stealing bthreads
+// from others and quit after running bthreads left in their runqueues.
+// Returns EPERM if the concurrency can't be reduced to `num', since each
+// tag keeps at least one worker.
 extern int bthread_setconcurrency(int num);
 
+// Get number of worker pthreads of `tag', -1 if `tag' is not in
+// [0, task_group_ntags).
+extern int bthread_getconcurrency_by_tag(bthread_tag_t tag);
+
+// Add or retire worker pthreads of `tag' until the tag has `num' workers,
+// which also changes bthread_getconcurrency().
+// Returns 0 on success, EINVAL if `tag' is invalid or `num' is not
+// positive.
+extern int bthread_setconcurrency_by_tag(int num, bthread_tag_t tag);
+
+// Get tag of the calling worker, BTHREAD_TAG_INVALID for non-workers.
+extern bthread_tag_t bthread_self_tag(void);
+
 // Yield processor to another bthread. 
 // Notice that current implementation is not fair, which means that 
 // even if bthread_yield() is called, suspended threads may still starve.
@@ -158,8 +188,6 @@ extern int bthread_usleep(uint64_t microseconds);
 
 // Initialize `mutex' using attributes in `mutex_attr', or use the
 // default values if later is NULL.
-// NOTE: mutexattr is not used in current mutex implementation. User shall
-//       always pass a NULL attribute.
 extern int bthread_mutex_init(bthread_mutex_t* __restrict mutex,
                               const bthread_mutexattr_t* __restrict mutex_attr);
 
@@ -179,6 +207,20 @@ extern int bthread_mutex_timedlock(bthread_mutex_t* __restrict mutex,
 // Unlock `mutex'.
 extern int bthread_mutex_unlock(bthread_mutex_t* mutex);
 
+// Initialize/destroy `attr' of mutex.
+extern int bthread_mutexattr_init(bthread_mutexattr_t* attr);
+extern int bthread_mutexattr_destroy(bthread_mutexattr_t* attr);
+
+// By default, an unlocking bthread wakes up one waiter which competes with
+// newcomers for the lock, a waiter may lose repeatedly under contention.
+// If `handoff' is non-zero, the lock is handed over to the woken waiter
+// directly and newcomers can't grab it meanwhile, which bounds the waiting
+// time of waiters (ordered by the time they started waiting) at the cost
+// of lower throughput.
+extern int bthread_mutexattr_sethandoff(bthread_mutexattr_t* attr, int handoff);
+extern int bthread_mutexattr_gethandoff(const bthread_mutexattr_t* attr,
+                                        int* handoff);
+
 // -----------------------------------------------
 // Functions for handling conditional variables.
 // -----------------------------------------------
@@ -324,6 +366,26 @@ extern int bthread_setspecific(bthread_key_t key, void* data);
 // If the key is invalid or deleted, return NULL.
 extern void* bthread_getspecific(bthread_key_t key);
 
+// Fast slots are at most BTHREAD_FAST_SLOT_NUM thread-specific slots stored
+// in bthreads directly. Getting or setting them is an array access without
+// looking up tables or checking versions, suitable for data accessed many
+// times in each bthread, e.g. context of the request being processed.
+// Unlike keys, slots can't be deleted, create them at initialization.
+
+// Reserve a fast slot. `destructor', if non-NULL, is called with the value
+// in the slot when the bthread (or pthread) ends and the value is not NULL.
+// Returns 0 on success, EAGAIN when all slots are reserved.
+extern int bthread_fast_slot_create(bthread_fast_slot_t* slot,
+                                    void (*destructor)(void* data));
+
+// Store `data' in the fast slot of current bthread or pthread.
+// Returns 0 on success, EINVAL if the slot is not created.
+extern int bthread_fast_slot_set(bthread_fast_slot_t slot, void* data);
+
+// Return value in the fast slot of current bthread or pthread, NULL if
+// it's never set or the slot is not created.
+extern void* bthread_fast_slot_get(bthread_fast_slot_t slot);
+
 __END_DECLS
 
 #endif  // BTHREAD_BTHREAD_H
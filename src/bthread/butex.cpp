@@ -164,6 +164,11 @@ int wait_pthread(ButexPthreadWaiter& pw, timespec* ptimeout) {
 
 extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
 
+// defined in bthread/mutex.cpp
+extern size_t offcpu_sampling_range();
+extern void submit_offcpu(int64_t duration_ns, size_t sampling_range,
+                          int64_t now_ns);
+
 // Returns 0 when no need to unschedule or successfully unscheduled,
 // -1 otherwise.
 inline int unsleep_if_necessary(ButexBthreadWaiter* w,
@@ -253,42 +258,96 @@ void butex_destroy(void* butex) {
     butil::return_object(b);
 }
 
-inline TaskGroup* get_task_group(TaskControl* c) {
+// Returns the group to run a woken-up bthread of `tag', which is the calling
+// worker if it's of the same tag.
+inline TaskGroup* get_task_group(TaskControl* c, bthread_tag_t tag) {
     TaskGroup* g = tls_task_group;
-    return g ? g : c->choose_one_group();
+    return (g && g->tag() == tag) ? g : c->choose_one_group(tag);
 }
 
-int butex_wake(void* arg) {
-    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
-    ButexWaiter* front = NULL;
-    {
-        BAIDU_SCOPED_LOCK(b->waiter_lock);
-        if (b->waiters.empty()) {
-            return 0;
-        }
-        front = b->waiters.head()->value();
-        front->RemoveFromList();
-        front->container.store(NULL, butil::memory_order_relaxed);
-    }
-    if (front->tid == 0) {
-        wakeup_pthread(static_cast<ButexPthreadWaiter*>(front));
-        return 1;
-    }
-    ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
-    unsleep_if_necessary(bbw, get_global_timer_thread());
+// Run the woken-up bthread in the calling worker immediately if the worker
+// is of the same tag, otherwise in a group of its tag.
+inline void run_in_local_task_group(ButexBthreadWaiter* bbw) {
     TaskGroup* g = tls_task_group;
-    if (g) {
+    const bthread_tag_t tag = bbw->task_meta->attr.tag;
+    if (g && g->tag() == tag) {
         TaskGroup::exchange(&g, bbw->tid);
     } else {
-        bbw->control->choose_one_group()->ready_to_run_remote(bbw->tid);
+        bbw->control->choose_one_group(tag)->ready_to_run_remote(bbw->tid);
     }
-    return 1;
 }
 
-int butex_wake_all(void* arg) {
-    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+// Max bthreads pushed into a remote runqueue with one locking. Waiters beyond
+// are pushed into other groups so that a group is not flooded by thousands of
+// waiters of a butex.
+static const size_t REMOTE_WAKEUP_BATCH = 64;
+
+// Collect woken-up bthreads which can't be run in the calling worker, and
+// push them into remote runqueues in batches.
+class RemoteWakeupBatch {
+public:
+    RemoteWakeupBatch() : _control(NULL), _tag(BTHREAD_TAG_DEFAULT), _n(0) {}
+    ~RemoteWakeupBatch() { flush(); }
+
+    void push(TaskControl* c, bthread_tag_t tag, bthread_t tid) {
+        if (_n == REMOTE_WAKEUP_BATCH || (_n && (c != _control || tag != _tag))) {
+            flush();
+        }
+        _control = c;
+        _tag = tag;
+        _tids[_n++] = tid;
+    }
 
-    ButexWaiterList bthread_waiters;
+    void flush() {
+        if (_n) {
+            _control->choose_one_group(_tag)->ready_to_run_remote_batch(_tids, _n);
+            _n = 0;
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RemoteWakeupBatch);
+    TaskControl* _control;
+    bthread_tag_t _tag;
+    size_t _n;
+    bthread_t _tids[REMOTE_WAKEUP_BATCH];
+};
+
+// Wake up all bthreads in `waiters' which were removed from the butex, in
+// reversed order. Waiters sharing tag with the calling worker are pushed
+// into its local runqueue and signalled once unless `nosignal' is true,
+// others are pushed in batches with RemoteWakeupBatch. Returns number of
+// woken-up bthreads.
+static int wake_up_bthread_waiters(ButexWaiterList* waiters,
+                                   RemoteWakeupBatch* remote,
+                                   bool nosignal = false) {
+    TaskGroup* g = tls_task_group;
+    int nwakeup = 0;
+    int nlocal = 0;
+    while (!waiters->empty()) {
+        // pop reversely
+        ButexBthreadWaiter* w = static_cast<ButexBthreadWaiter*>(
+            waiters->tail()->value());
+        w->RemoveFromList();
+        unsleep_if_necessary(w, get_global_timer_thread());
+        const bthread_tag_t w_tag = w->task_meta->attr.tag;
+        if (g && g->tag() == w_tag) {
+            g->ready_to_run(w->tid, true);
+            ++nlocal;
+        } else {
+            remote->push(w->control, w_tag, w->tid);
+        }
+        ++nwakeup;
+    }
+    if (nlocal && !nosignal) {
+        g->flush_nosignal_tasks();
+    }
+    return nwakeup;
+}
+
+// Remove all waiters from `b', wake up pthreads among them and move
+// bthreads into `bthread_waiters'. Returns number of woken-up pthreads.
+static int take_all_waiters(Butex* b, ButexWaiterList* bthread_waiters) {
     ButexWaiterList pthread_waiters;
     {
         BAIDU_SCOPED_LOCK(b->waiter_lock);
@@ -297,7 +356,7 @@ int butex_wake_all(void* arg) {
             bw->RemoveFromList();
             bw->container.store(NULL, butil::memory_order_relaxed);
             if (bw->tid) {
-                bthread_waiters.Append(bw);
+                bthread_waiters->Append(bw);
             } else {
                 pthread_waiters.Append(bw);
             }
@@ -312,6 +371,36 @@ int butex_wake_all(void* arg) {
         wakeup_pthread(bw);
         ++nwakeup;
     }
+    return nwakeup;
+}
+
+int butex_wake(void* arg) {
+    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+    ButexWaiter* front = NULL;
+    {
+        BAIDU_SCOPED_LOCK(b->waiter_lock);
+        if (b->waiters.empty()) {
+            return 0;
+        }
+        front = b->waiters.head()->value();
+        front->RemoveFromList();
+        front->container.store(NULL, butil::memory_order_relaxed);
+    }
+    if (front->tid == 0) {
+        wakeup_pthread(static_cast<ButexPthreadWaiter*>(front));
+        return 1;
+    }
+    ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
+    unsleep_if_necessary(bbw, get_global_timer_thread());
+    run_in_local_task_group(bbw);
+    return 1;
+}
+
+int butex_wake_all(void* arg) {
+    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+
+    ButexWaiterList bthread_waiters;
+    int nwakeup = take_all_waiters(b, &bthread_waiters);
     if (bthread_waiters.empty()) {
         return nwakeup;
     }
@@ -321,28 +410,36 @@ int butex_wake_all(void* arg) {
     next->RemoveFromList();
     unsleep_if_necessary(next, get_global_timer_thread());
     ++nwakeup;
-    TaskGroup* g = get_task_group(next->control);
-    const int saved_nwakeup = nwakeup;
-    while (!bthread_waiters.empty()) {
-        // pop reversely
-        ButexBthreadWaiter* w = static_cast<ButexBthreadWaiter*>(
-            bthread_waiters.tail()->value());
-        w->RemoveFromList();
-        unsleep_if_necessary(w, get_global_timer_thread());
-        g->ready_to_run_general(w->tid, true);
-        ++nwakeup;
-    }
-    if (saved_nwakeup != nwakeup) {
-        g->flush_nosignal_tasks_general();
-    }
-    if (g == tls_task_group) {
+    RemoteWakeupBatch remote;
+    nwakeup += wake_up_bthread_waiters(&bthread_waiters, &remote);
+    TaskGroup* g = tls_task_group;
+    const bthread_tag_t tag = next->task_meta->attr.tag;
+    if (g && g->tag() == tag) {
+        remote.flush();
         TaskGroup::exchange(&g, next->tid);
     } else {
-        g->ready_to_run_remote(next->tid);
+        remote.push(next->control, tag, next->tid);
     }
     return nwakeup;
 }
 
+int butex_wake_all_nosignal(void* arg) {
+    Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
+
+    ButexWaiterList bthread_waiters;
+    int nwakeup = take_all_waiters(b, &bthread_waiters);
+    RemoteWakeupBatch remote;
+    nwakeup += wake_up_bthread_waiters(&bthread_waiters, &remote, true);
+    return nwakeup;
+}
+
+void butex_flush_nosignal_wakeups() {
+    TaskGroup* g = tls_task_group;
+    if (g) {
+        g->flush_nosignal_tasks();
+    }
+}
+
 int butex_wake_except(void* arg, bthread_t excluded_bthread) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
 
@@ -385,23 +482,8 @@ int butex_wake_except(void* arg, bthread_t excluded_bthread) {
     if (bthread_waiters.empty()) {
         return nwakeup;
     }
-    ButexBthreadWaiter* front = static_cast<ButexBthreadWaiter*>(
-                bthread_waiters.head()->value());
-
-    TaskGroup* g = get_task_group(front->control);
-    const int saved_nwakeup = nwakeup;
-    do {
-        // pop reversely
-        ButexBthreadWaiter* w = static_cast<ButexBthreadWaiter*>(
-            bthread_waiters.tail()->value());
-        w->RemoveFromList();
-        unsleep_if_necessary(w, get_global_timer_thread());
-        g->ready_to_run_general(w->tid, true);
-        ++nwakeup;
-    } while (!bthread_waiters.empty());
-    if (saved_nwakeup != nwakeup) {
-        g->flush_nosignal_tasks_general();
-    }
+    RemoteWakeupBatch remote;
+    nwakeup += wake_up_bthread_waiters(&bthread_waiters, &remote);
     return nwakeup;
 }
 
@@ -436,12 +518,7 @@ int butex_requeue(void* arg, void* arg2) {
     }
     ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
     unsleep_if_necessary(bbw, get_global_timer_thread());
-    TaskGroup* g = tls_task_group;
-    if (g) {
-        TaskGroup::exchange(&g, front->tid);
-    } else {
-        bbw->control->choose_one_group()->ready_to_run_remote(front->tid);
-    }
+    run_in_local_task_group(bbw);
     return 1;
 }
 
@@ -478,7 +555,8 @@ inline bool erase_from_butex(ButexWaiter* bw, bool wakeup, WaiterState state) {
     if (erased && wakeup) {
         if (bw->tid) {
             ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(bw);
-            get_task_group(bbw->control)->ready_to_run_general(bw->tid);
+            get_task_group(bbw->control, bbw->task_meta->attr.tag)
+                ->ready_to_run_general(bw->tid);
         } else {
             ButexPthreadWaiter* pw = static_cast<ButexPthreadWaiter*>(bw);
             wakeup_pthread(pw);
@@ -604,7 +682,8 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     return rc;
 }
 
-int butex_wait(void* arg, int expected_value, const timespec* abstime) {
+static int butex_wait_impl(void* arg, int expected_value,
+                           const timespec* abstime) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
     if (b->value.load(butil::memory_order_relaxed) != expected_value) {
         errno = EWOULDBLOCK;
@@ -615,6 +694,10 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     }
     TaskGroup* g = tls_task_group;
     if (NULL == g || g->is_current_pthread_task()) {
+        if (g && g->current_task()->stack_type() == STACK_TYPE_SHARED) {
+            LOG_EVERY_SECOND(WARNING) << "bthread=" << g->current_tid()
+                << " with BTHREAD_STACKTYPE_SHARED blocks the worker";
+        }
         return butex_wait_from_pthread(g, b, expected_value, abstime);
     }
     ButexBthreadWaiter bbw;
@@ -689,6 +772,22 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     return 0;
 }
 
+int butex_wait(void* arg, int expected_value, const timespec* abstime) {
+    // Don't sample when off-CPU profiler is off.
+    const size_t sampling_range = offcpu_sampling_range();
+    if (!sampling_range) {
+        return butex_wait_impl(arg, expected_value, abstime);
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const int rc = butex_wait_impl(arg, expected_value, abstime);
+    // Unmatched values don't block.
+    if (rc == 0 || errno != EWOULDBLOCK) {
+        const int64_t end_ns = butil::cpuwide_time_ns();
+        submit_offcpu(end_ns - start_ns, sampling_range, end_ns);
+    }
+    return rc;
+}
+
 }  // namespace bthread
 
 namespace butil {
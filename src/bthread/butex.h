@@ -49,6 +49,16 @@ int butex_wake(void* butex);
 // Returns # of threads woken up.
 int butex_wake_all(void* butex);
 
+// Wake up all threads waiting on |butex| without switching to any of them
+// or signalling idle workers. Call butex_flush_nosignal_wakeups() after
+// waking up a batch of butexes to signal workers once for all of them.
+// Returns # of threads woken up.
+int butex_wake_all_nosignal(void* butex);
+
+// Signal workers to run bthreads woken up by butex_wake_all_nosignal() in
+// the calling worker.
+void butex_flush_nosignal_wakeups();
+
 // Wake up all threads waiting on |butex| except a bthread whose identifier
 // is |excluded_bthread|. This function does not yield.
 // Returns # of threads woken up.
@@ -45,9 +45,14 @@ inline uint64_t make_id(uint32_t version, slot_id_t slot) {
 }  // namespace anonymous
 
 struct ExecutionQueueVars {
+    // Tasks submitted and not finished in all queues, namely total depth.
     bvar::Adder<int64_t> running_task_count;
     bvar::Adder<int64_t> execq_count;
     bvar::Adder<int64_t> execq_active_count;
+    // Number of tasks passed to each call of execute.
+    bvar::IntRecorder batch_size;
+    bvar::Maxer<int64_t> max_batch_size;
+    bvar::Window<bvar::Maxer<int64_t> > max_batch_size_window;
     
     ExecutionQueueVars();
 };
@@ -55,7 +60,10 @@ struct ExecutionQueueVars {
 ExecutionQueueVars::ExecutionQueueVars()
     : running_task_count("bthread_execq_running_task_count")
     , execq_count("bthread_execq_count")
-    , execq_active_count("bthread_execq_active_count") {
+    , execq_active_count("bthread_execq_active_count")
+    , batch_size("bthread_execq_batch_size")
+    , max_batch_size_window("bthread_execq_max_batch_size", &max_batch_size,
+                            -1) {
 }
 
 inline ExecutionQueueVars* get_execq_vars() {
@@ -74,6 +82,15 @@ void ExecutionQueueBase::start_execute(TaskNode* node) {
         // point, we think it's just fine.
         _high_priority_tasks.fetch_add(1, butil::memory_order_relaxed);
     }
+    if (_options.max_batch_delay_us > 0) {
+        const int npending =
+            _npending_butex->fetch_add(1, butil::memory_order_release) + 1;
+        if (node->high_priority || node->stop_task ||
+            npending == _options.max_batch_size) {
+            // End _wait_for_batch() of the executor, if any.
+            butex_wake(_npending_butex);
+        }
+    }
     TaskNode* const prev_head = _head.exchange(node, butil::memory_order_release);
     if (prev_head != NULL) {
         node->next = prev_head;
@@ -119,6 +136,13 @@ void* ExecutionQueueBase::_execute_tasks(void* arg) {
     ExecutionQueueBase* m = (ExecutionQueueBase*)head->q;
     TaskNode* cur_tail = NULL;
     bool destroy_queue = false;
+    if (m->_options.max_batch_delay_us > 0 && !head->stop_task) {
+        m->_wait_for_batch();
+        // Link tasks arrived during the wait after head so that they're
+        // executed in the same batch. head is not iterated yet, thus this
+        // always returns true.
+        m->_more_tasks(head, &cur_tail, true);
+    }
     for (;;) {
         if (head->iterated) {
             CHECK(head->next != NULL);
@@ -179,7 +203,28 @@ void* ExecutionQueueBase::_execute_tasks(void* arg) {
     return NULL;
 }
 
+void ExecutionQueueBase::_wait_for_batch() {
+    const timespec abstime =
+        butil::microseconds_from_now(_options.max_batch_delay_us);
+    while (_high_priority_tasks.load(butil::memory_order_relaxed) == 0) {
+        const int npending = _npending_butex->load(butil::memory_order_acquire);
+        if (_options.max_batch_size > 0 &&
+            npending >= _options.max_batch_size) {
+            return;
+        }
+        // Returns 0 when woken up by start_execute(), which means that the
+        // batch is full, or a high-priority/stop task came.
+        if (butex_wait(_npending_butex, npending, &abstime) == 0 ||
+            errno == ETIMEDOUT) {
+            return;
+        }
+    }
+}
+
 void ExecutionQueueBase::return_task_node(TaskNode* node) {
+    if (_options.max_batch_delay_us > 0) {
+        _npending_butex->fetch_sub(1, butil::memory_order_relaxed);
+    }
     node->clear_before_return(_clear_func);
     butil::return_object<TaskNode>(node);
     get_execq_vars()->running_task_count << -1;
@@ -260,6 +305,9 @@ int ExecutionQueueBase::_execute(TaskNode* head, bool high_priority, int* nitera
     TaskIteratorBase iter(head, this, false, high_priority);
     if (iter) {
         _execute_func(_meta, _type_specific_function, iter);
+        ExecutionQueueVars* const vars = get_execq_vars();
+        vars->batch_size << iter.num_iterated();
+        vars->max_batch_size << iter.num_iterated();
     }
     // We must assign |niterated| with num_iterated even if we couldn't peek
     // any task to execute at the begining, in which case all the iterated 
@@ -350,6 +398,7 @@ int ExecutionQueueBase::create(uint64_t* id, const ExecutionQueueOptions* option
             opt = *options;   
         }
         m->_options = opt;
+        m->_npending_butex->store(0, butil::memory_order_relaxed);
         m->_stopped.store(false, butil::memory_order_relaxed);
         m->_this_id = make_id(
                 _version_of_vref(m->_versioned_ref.fetch_add(
@@ -370,6 +419,15 @@ inline bool TaskIteratorBase::should_break_for_high_priority_tasks() {
     return false;
 }
 
+inline bool TaskIteratorBase::should_break_for_full_batch() {
+    if (_q->_options.max_batch_size > 0 &&
+            _num_iterated >= _q->_options.max_batch_size) {
+        _should_break = true;
+        return true;
+    }
+    return false;
+}
+
 void TaskIteratorBase::operator++() {
     if (!(*this)) {
         return;
@@ -380,6 +438,9 @@ void TaskIteratorBase::operator++() {
     if (should_break_for_high_priority_tasks()) {
         return;
     }  // else the next high_priority_task would be delayed for at most one task
+    if (should_break_for_full_batch()) {
+        return;
+    }
 
     while (_cur_node && !_cur_node->stop_task) {
         if (_high_priority == _cur_node->high_priority) {
@@ -59,6 +59,7 @@ protected:
 private:
     int num_iterated() const { return _num_iterated; }
     bool should_break_for_high_priority_tasks();
+    bool should_break_for_full_batch();
 
     TaskNode*               _cur_node;
     TaskNode*               _head;
@@ -133,6 +134,20 @@ struct ExecutionQueueOptions {
     // Attribute of the bthread which execute runs on
     // default: BTHREAD_ATTR_NORMAL
     bthread_attr_t bthread_attr;
+
+    // Maximum number of tasks passed to one call of execute, remaining tasks
+    // are passed in following calls. Non-positive value means no limit.
+    // default: 0
+    int max_batch_size;
+
+    // If this is positive, the executor waits at most so many microseconds
+    // for max_batch_size tasks (any number of tasks if max_batch_size is not
+    // positive) before executing the first task, so that tasks arriving at
+    // a low rate are executed in batches as well. High-priority tasks and
+    // stopping the queue end the wait immediately. Tasks executed in-place
+    // are not delayed.
+    // default: 0
+    int64_t max_batch_delay_us;
 };
 
 // Start a ExecutionQueue. If |options| is NULL, the queue will be created with
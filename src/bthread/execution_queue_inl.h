@@ -168,9 +168,12 @@ public:
     {
         _join_butex = butex_create_checked<butil::atomic<int> >();
         _join_butex->store(0, butil::memory_order_relaxed);
+        _npending_butex = butex_create_checked<butil::atomic<int> >();
+        _npending_butex->store(0, butil::memory_order_relaxed);
     }
 
     ~ExecutionQueueBase() {
+        butex_destroy(_npending_butex);
         butex_destroy(_join_butex);
     }
 
@@ -200,6 +203,8 @@ private:
     void _on_recycle();
     int _execute(TaskNode* head, bool high_priority, int* niterated);
     static void* _execute_tasks(void* arg);
+    // Wait for a batch of tasks according to _options.max_batch_delay_us
+    void _wait_for_batch();
 
     static inline uint32_t _version_of_id(uint64_t id) WARN_UNUSED_RESULT {
         return (uint32_t)(id >> 32);
@@ -231,6 +236,9 @@ private:
     clear_task_mem _clear_func;
     ExecutionQueueOptions _options;
     butil::atomic<int>* _join_butex;
+    // Number of tasks not returned yet, only counted when
+    // _options.max_batch_delay_us is positive.
+    butil::atomic<int>* _npending_butex;
 };
 
 template <typename T>
@@ -318,6 +326,8 @@ public:
 
 inline ExecutionQueueOptions::ExecutionQueueOptions()
     : bthread_attr(BTHREAD_ATTR_NORMAL)
+    , max_batch_size(0)
+    , max_batch_delay_us(0)
 {}
 
 template <typename T>
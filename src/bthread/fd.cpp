@@ -27,8 +27,9 @@
 #include "butil/time.h"
 #include "butil/fd_utility.h"                     // make_non_blocking
 #include "butil/logging.h"
-#include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix32
+#include <gflags/gflags.h>
 #include "bthread/butex.h"                       // butex_*
+#include "bthread/io_uring.h"                    // io_uring_*
 #include "bthread/task_group.h"                  // TaskGroup
 #include "bthread/bthread.h"                             // bthread_start_urgent
 
@@ -36,22 +37,36 @@
 
 namespace bthread {
 
+DEFINE_bool(bthread_fd_wait_use_io_uring, false,
+            "Wait for events of bthread_fd_*wait() through io_uring instead "
+            "of the internal epoll, ignored if io_uring is not available");
+
 extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
 
-template <typename T, size_t NBLOCK, size_t BLOCK_SIZE>
+template <typename T, size_t BLOCK_SIZE>
 class LazyArray {
     struct Block {
         butil::atomic<T> items[BLOCK_SIZE];
     };
 
 public:
-    LazyArray() {
-        memset(_blocks, 0, sizeof(butil::atomic<Block*>) * NBLOCK);
+    LazyArray() : _nblock(0), _blocks(NULL) {}
+
+    // Address `nblock' * BLOCK_SIZE items. Pointers to blocks are calloc-ed
+    // so that pages of unused blocks are never touched.
+    int init(size_t nblock) {
+        _blocks = static_cast<butil::atomic<Block*>*>(
+            calloc(nblock, sizeof(butil::atomic<Block*>)));
+        if (NULL == _blocks) {
+            return -1;
+        }
+        _nblock = nblock;
+        return 0;
     }
 
     butil::atomic<T>* get_or_new(size_t index) {
         const size_t block_index = index / BLOCK_SIZE;
-        if (block_index >= NBLOCK) {
+        if (block_index >= _nblock) {
             return NULL;
         }
         const size_t block_offset = index - block_index * BLOCK_SIZE;
@@ -78,7 +93,7 @@ public:
 
     butil::atomic<T>* get(size_t index) const {
         const size_t block_index = index / BLOCK_SIZE;
-        if (__builtin_expect(block_index < NBLOCK, 1)) {
+        if (__builtin_expect(block_index < _nblock, 1)) {
             const size_t block_offset = index - block_index * BLOCK_SIZE;
             Block* const b = _blocks[block_index].load(butil::memory_order_consume);
             if (__builtin_expect(b != NULL, 1)) {
@@ -89,7 +104,8 @@ public:
     }
 
 private:
-    butil::atomic<Block*> _blocks[NBLOCK];
+    size_t _nblock;
+    butil::atomic<Block*>* _blocks;
 };
 
 typedef butil::atomic<int> EpollButex;
@@ -100,11 +116,37 @@ static EpollButex* const CLOSING_GUARD = (EpollButex*)(intptr_t)-1L;
 butil::static_atomic<int> break_nums = BUTIL_STATIC_ATOMIC_INIT(0);
 #endif
 
-// Able to address 67108864 file descriptors, should be enough.
-LazyArray<EpollButex*, 262144/*NBLOCK*/, 256/*BLOCK_SIZE*/> fd_butexes;
+// Able to address 67108864 file descriptors in total, should be enough.
+static const size_t FD_BUTEX_NBLOCK = 262144;
+static const size_t FD_BUTEX_BLOCK_SIZE = 256;
+typedef LazyArray<EpollButex*, FD_BUTEX_BLOCK_SIZE> FdButexArray;
 
 static const int BTHREAD_DEFAULT_EPOLL_SIZE = 65536;
 
+static const int BTHREAD_MAX_EPOLL_THREAD_NUM = 64;
+
+static bool validate_bthread_epoll_thread_num(const char*, int32_t val) {
+    return val >= 1 && val <= BTHREAD_MAX_EPOLL_THREAD_NUM;
+}
+
+DEFINE_int32(bthread_epoll_thread_num, BTHREAD_EPOLL_THREAD_NUM,
+             "Number of epoll threads serving bthread_fd_*wait(), each of "
+             "which has its own table of file descriptors. Every epoll thread "
+             "occupies a worker, workers are added for ones beyond the "
+             "default. Read at the first call to bthread_fd_*wait() or "
+             "bthread_close()");
+const bool ALLOW_UNUSED dummy_bthread_epoll_thread_num =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_epoll_thread_num,
+                                    validate_bthread_epoll_thread_num);
+
+// Value of -bthread_epoll_thread_num when the epoll threads were initialized.
+static size_t g_nepoll_thread = 0;
+
+// Index of `fd' in the table of butexes of its epoll thread.
+static inline size_t fd_index(int fd) {
+    return (size_t)fd / g_nepoll_thread;
+}
+
 class EpollThread {
 public:
     EpollThread()
@@ -113,6 +155,10 @@ public:
         , _tid(0) {
     }
 
+    int init(size_t nblock) {
+        return _fd_butexes.init(nblock);
+    }
+
     int start(int epoll_size) {
         if (started()) {
             return -1;
@@ -194,7 +240,7 @@ public:
     }
 
     int fd_wait(int fd, unsigned events, const timespec* abstime) {
-        butil::atomic<EpollButex*>* p = fd_butexes.get_or_new(fd);
+        butil::atomic<EpollButex*>* p = _fd_butexes.get_or_new(fd_index(fd));
         if (NULL == p) {
             errno = ENOMEM;
             return -1;
@@ -269,7 +315,7 @@ public:
             errno = EBADF;
             return -1;
         }
-        butil::atomic<EpollButex*>* pbutex = bthread::fd_butexes.get(fd);
+        butil::atomic<EpollButex*>* pbutex = _fd_butexes.get(fd_index(fd));
         if (NULL == pbutex) {
             // Did not call bthread_fd functions, close directly.
             return close(fd);
@@ -310,7 +356,7 @@ private:
 
     void* run() {
         const int initial_epfd = _epfd;
-        const size_t MAX_EVENTS = 32;
+        const size_t MAX_EVENTS = 128;
 #if defined(OS_LINUX)
         epoll_event* e = new (std::nothrow) epoll_event[MAX_EVENTS];
 #elif defined(OS_MACOSX)
@@ -367,7 +413,8 @@ private:
 # ifdef BAIDU_KERNEL_FIXED_EPOLLONESHOT_BUG
                 EpollButex* butex = static_cast<EpollButex*>(e[i].data.ptr);
 # else
-                butil::atomic<EpollButex*>* pbutex = fd_butexes.get(e[i].data.fd);
+                butil::atomic<EpollButex*>* pbutex =
+                    _fd_butexes.get(fd_index(e[i].data.fd));
                 EpollButex* butex = pbutex ?
                     pbutex->load(butil::memory_order_consume) : NULL;
 # endif
@@ -376,9 +423,18 @@ private:
 #endif
                 if (butex != NULL && butex != CLOSING_GUARD) {
                     butex->fetch_add(1, butil::memory_order_relaxed);
-                    butex_wake_all(butex);
+                    butex_wake_all_nosignal(butex);
                 }
             }
+            // Signal workers once for all bthreads woken up by this batch
+            // of events rather than switching to each of them.
+            butex_flush_nosignal_wakeups();
+            TaskGroup* g = tls_task_group;
+            if (g != NULL && g->retired()) {
+                // Move to another worker, otherwise this retired worker
+                // never quits.
+                bthread_yield();
+            }
         }
 
         delete [] e;
@@ -391,18 +447,35 @@ private:
     bool _stop;
     bthread_t _tid;
     butil::Mutex _start_mutex;
+    // Butexes of file descriptors owned by this thread, indexed by
+    // fd_index().
+    FdButexArray _fd_butexes;
 };
 
-EpollThread epoll_thread[BTHREAD_EPOLL_THREAD_NUM];
+EpollThread epoll_thread[BTHREAD_MAX_EPOLL_THREAD_NUM];
+static pthread_once_t epoll_threads_once = PTHREAD_ONCE_INIT;
 
-static inline EpollThread& get_epoll_thread(int fd) {
-    if (BTHREAD_EPOLL_THREAD_NUM == 1UL) {
-        EpollThread& et = epoll_thread[0];
-        et.start(BTHREAD_DEFAULT_EPOLL_SIZE);
-        return et;
+static void init_epoll_threads() {
+    const size_t n = FLAGS_bthread_epoll_thread_num;
+    for (size_t i = 0; i < n; ++i) {
+        // File descriptors are dense, spreading them by values balances
+        // the threads and keeps the address space of all tables unchanged.
+        if (epoll_thread[i].init((FD_BUTEX_NBLOCK + n - 1) / n) != 0) {
+            LOG(FATAL) << "Fail to init table of EpollThread[" << i << ']';
+        }
     }
+    g_nepoll_thread = n;
+    if (n > BTHREAD_EPOLL_THREAD_NUM) {
+        // Keep -bthread_concurrency workers running other bthreads.
+        bthread_setconcurrency(bthread_getconcurrency() +
+                               (int)(n - BTHREAD_EPOLL_THREAD_NUM));
+    }
+}
 
-    EpollThread& et = epoll_thread[butil::fmix32(fd) % BTHREAD_EPOLL_THREAD_NUM];
+static inline EpollThread& get_epoll_thread(int fd) {
+    pthread_once(&epoll_threads_once, init_epoll_threads);
+    EpollThread& et = (g_nepoll_thread == 1UL ? epoll_thread[0] :
+                       epoll_thread[(size_t)fd % g_nepoll_thread]);
     et.start(BTHREAD_DEFAULT_EPOLL_SIZE);
     return et;
 }
@@ -411,7 +484,7 @@ static inline EpollThread& get_epoll_thread(int fd) {
 int stop_and_join_epoll_threads() {
     // Returns -1 if any epoll thread failed to stop.
     int rc = 0;
-    for (size_t i = 0; i < BTHREAD_EPOLL_THREAD_NUM; ++i) {
+    for (size_t i = 0; i < g_nepoll_thread; ++i) {
         if (epoll_thread[i].stop_and_join() < 0) {
             rc = -1;
         }
@@ -495,6 +568,10 @@ int bthread_fd_wait(int fd, unsigned events) {
     }
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (NULL != g && !g->is_current_pthread_task()) {
+        if (bthread::FLAGS_bthread_fd_wait_use_io_uring &&
+            bthread::io_uring_available()) {
+            return bthread::io_uring_fd_wait(fd, events, NULL);
+        }
         return bthread::get_epoll_thread(fd).fd_wait(
             fd, events, NULL);
     }
@@ -512,6 +589,10 @@ int bthread_fd_timedwait(int fd, unsigned events,
     }
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (NULL != g && !g->is_current_pthread_task()) {
+        if (bthread::FLAGS_bthread_fd_wait_use_io_uring &&
+            bthread::io_uring_available()) {
+            return bthread::io_uring_fd_wait(fd, events, abstime);
+        }
         return bthread::get_epoll_thread(fd).fd_wait(
             fd, events, abstime);
     }
@@ -553,7 +634,28 @@ int bthread_connect(int sockfd, const sockaddr* serv_addr,
 
 // This does not wake pthreads calling bthread_fd_*wait.
 int bthread_close(int fd) {
+    if (bthread::FLAGS_bthread_fd_wait_use_io_uring) {
+        bthread::io_uring_cancel_fd_waits(fd);
+    }
     return bthread::get_epoll_thread(fd).fd_close(fd);
 }
 
+ssize_t bthread_pread(int fd, void* buf, size_t count, off_t offset) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (NULL != g && !g->is_current_pthread_task() &&
+        bthread::io_uring_available()) {
+        return bthread::io_uring_pread(fd, buf, count, offset);
+    }
+    return ::pread(fd, buf, count, offset);
+}
+
+ssize_t bthread_pwrite(int fd, const void* buf, size_t count, off_t offset) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (NULL != g && !g->is_current_pthread_task() &&
+        bthread::io_uring_available()) {
+        return bthread::io_uring_pwrite(fd, buf, count, offset);
+    }
+    return ::pwrite(fd, buf, count, offset);
+}
+
 }  // extern "C"
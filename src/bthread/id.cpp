@@ -143,6 +143,11 @@ struct BAIDU_CACHELINE_ALIGNMENT Id {
     
     // also the next "first_ver"
     inline uint32_t end_ver() const { return last_ver() + 1; }
+
+    // The butex is modified by CAS outside `mutex' in fast paths of
+    // locking and unlocking, others modify it inside `mutex'.
+    butil::atomic<uint32_t>* atomic_butex() const
+    { return reinterpret_cast<butil::atomic<uint32_t>*>(butex); }
 };
 
 BAIDU_CASSERT(sizeof(Id) % 64 == 0, sizeof_Id_must_align);
@@ -318,6 +323,54 @@ size_t get_sizes(const bthread_id_list_t* list, size_t* cnt, size_t n) {
 
 const int ID_MAX_RANGE = 1024;
 
+// Lock an unlocked id without touching meta->mutex. Returns true on success.
+// The butex equals first_ver of the id only when the id is unlocked, and
+// versions of a slot keep increasing, thus a successful CAS from first_ver
+// guarantees that the id is still valid and unlocked.
+inline bool id_lock_fast(Id* meta, uint32_t id_ver) {
+    uint32_t expected = meta->first_ver;
+    const uint32_t locked_ver = meta->locked_ver;
+    if (id_ver < expected || id_ver >= locked_ver) {
+        return false;
+    }
+    butil::atomic<uint32_t>* butex = meta->atomic_butex();
+    if (!butex->compare_exchange_strong(
+            expected, locked_ver, butil::memory_order_acquire)) {
+        return false;
+    }
+    // locked_ver may be enlarged by bthread_id_lock_and_reset_range() after
+    // being read, correct the locked version which may be marked as contended
+    // by other lockers concurrently.
+    const uint32_t actual_locked_ver = meta->locked_ver;
+    if (actual_locked_ver != locked_ver) {
+        uint32_t stale_ver = locked_ver;
+        butex->compare_exchange_strong(stale_ver, actual_locked_ver,
+                                       butil::memory_order_relaxed);
+    }
+    return true;
+}
+
+// Unlock a locked id without touching meta->mutex when it's not contended
+// and no errors are pending (errors are pushed after marking contended).
+inline bool id_unlock_fast(Id* meta, uint32_t id_ver) {
+    if (!meta->has_version(id_ver)) {
+        return false;
+    }
+    uint32_t expected = meta->locked_ver;
+    return meta->atomic_butex()->compare_exchange_strong(
+        expected, meta->first_ver, butil::memory_order_release);
+}
+
+// Make sure that the unlocker goes through the slow path to process pending
+// errors or wake up waiters. Must be called inside meta->mutex.
+inline bool id_mark_contended(Id* meta, uint32_t cur) {
+    if (cur == meta->contended_ver() || cur == meta->unlockable_ver()) {
+        return true;
+    }
+    return meta->atomic_butex()->compare_exchange_strong(
+        cur, meta->contended_ver(), butil::memory_order_relaxed);
+}
+
 static int id_create_impl(
     bthread_id_t* id, void* data,
     int (*on_error)(bthread_id_t, void*, int),
@@ -405,13 +458,21 @@ int bthread_id_lock_and_reset_range_verbose(
         return EINVAL;
     }
     const uint32_t id_ver = bthread::get_version(id);
+    if (range == 0 && bthread::id_lock_fast(meta, id_ver)) {
+        meta->lock_location = location;
+        if (pdata) {
+            *pdata = meta->data;
+        }
+        return 0;
+    }
     uint32_t* butex = meta->butex;
+    butil::atomic<uint32_t>* atomic_butex = meta->atomic_butex();
     bool ever_contended = false;
     meta->mutex.lock();
     while (meta->has_version(id_ver)) {
-        if (*butex == meta->first_ver) {
-            // contended locker always wakes up the butex at unlock.
-            meta->lock_location = location;
+        uint32_t cur = atomic_butex->load(butil::memory_order_relaxed);
+        if (cur == meta->first_ver) {
+            uint32_t locked_ver = meta->locked_ver;
             if (range == 0) {
                 // fast path
             } else if (range < 0 ||
@@ -423,17 +484,28 @@ int bthread_id_lock_and_reset_range_verbose(
                     << "max range is " << bthread::ID_MAX_RANGE
                     << ", actually " << range;
             } else {
-                meta->locked_ver = meta->first_ver + range;
+                locked_ver = meta->first_ver + range;
+            }
+            // contended locker always wakes up the butex at unlock.
+            // Lockers in fast path may grab the id before the CAS.
+            if (!atomic_butex->compare_exchange_strong(
+                    cur, (ever_contended ? locked_ver + 1 : locked_ver),
+                    butil::memory_order_acquire)) {
+                continue;
             }
-            *butex = (ever_contended ? meta->contended_ver() : meta->locked_ver);
+            meta->locked_ver = locked_ver;
+            meta->lock_location = location;
             meta->mutex.unlock();
             if (pdata) {
                 *pdata = meta->data;
             }
             return 0;
-        } else if (*butex != meta->unlockable_ver()) {
-            *butex = meta->contended_ver();
-            uint32_t expected_ver = *butex;
+        } else if (cur != meta->unlockable_ver()) {
+            if (!bthread::id_mark_contended(meta, cur)) {
+                // Unlocked in fast path.
+                continue;
+            }
+            const uint32_t expected_ver = meta->contended_ver();
             meta->mutex.unlock();
             ever_contended = true;
             if (bthread::butex_wait(butex, expected_ver, NULL) < 0 &&
@@ -462,6 +534,16 @@ int bthread_id_about_to_destroy(bthread_id_t id) {
     }
     const uint32_t id_ver = bthread::get_version(id);
     uint32_t* butex = meta->butex;
+    butil::atomic<uint32_t>* atomic_butex = meta->atomic_butex();
+    // The caller owns the lock, versions are not changed by others. Nobody
+    // is waiting if the id is not contended.
+    if (meta->has_version(id_ver)) {
+        uint32_t expected = meta->locked_ver;
+        if (atomic_butex->compare_exchange_strong(
+                expected, meta->unlockable_ver(), butil::memory_order_relaxed)) {
+            return 0;
+        }
+    }
     meta->mutex.lock();
     if (!meta->has_version(id_ver)) {
         meta->mutex.unlock();
@@ -472,8 +554,9 @@ int bthread_id_about_to_destroy(bthread_id_t id) {
         LOG(FATAL) << "bthread_id=" << id.value << " is not locked!";
         return EPERM;
     }
+    // The id is locked, lockers and unlockers in fast paths don't change it.
     const bool contended = (*butex == meta->contended_ver());
-    *butex = meta->unlockable_ver();
+    atomic_butex->store(meta->unlockable_ver(), butil::memory_order_relaxed);
     meta->mutex.unlock();
     if (contended) {
         // wake up all waiting lockers.
@@ -494,11 +577,13 @@ int bthread_id_cancel(bthread_id_t id) {
         meta->mutex.unlock();
         return EINVAL;
     }
-    if (*butex != meta->first_ver) {
+    uint32_t expected = meta->first_ver;
+    // Fail lockers in fast path.
+    if (!meta->atomic_butex()->compare_exchange_strong(
+            expected, meta->end_ver(), butil::memory_order_relaxed)) {
         meta->mutex.unlock();
         return EPERM;
-    }       
-    *butex = meta->end_ver();
+    }
     meta->first_ver = *butex;
     meta->locked_ver = *butex;
     meta->mutex.unlock();
@@ -507,6 +592,10 @@ int bthread_id_cancel(bthread_id_t id) {
 }
 
 int bthread_id_join(bthread_id_t id) {
+    return bthread_id_timedjoin(id, NULL);
+}
+
+int bthread_id_timedjoin(bthread_id_t id, const struct timespec* abstime) {
     const bthread::IdResourceId slot = bthread::get_slot(id);
     bthread::Id* const meta = address_resource(slot);
     if (!meta) {
@@ -523,7 +612,7 @@ int bthread_id_join(bthread_id_t id) {
         if (!has_ver) {
             break;
         }
-        if (bthread::butex_wait(join_butex, expected_ver, NULL) < 0 &&
+        if (bthread::butex_wait(join_butex, expected_ver, abstime) < 0 &&
             errno != EWOULDBLOCK && errno != EINTR) {
             return errno;
         }
@@ -536,19 +625,13 @@ int bthread_id_trylock(bthread_id_t id, void** pdata) {
     if (!meta) {
         return EINVAL;
     }
-    uint32_t* butex = meta->butex;
     const uint32_t id_ver = bthread::get_version(id);
-    meta->mutex.lock();
-    if (!meta->has_version(id_ver)) {
-        meta->mutex.unlock();
-        return EINVAL;
-    }
-    if (*butex != meta->first_ver) {
+    if (!bthread::id_lock_fast(meta, id_ver)) {
+        meta->mutex.lock();
+        const bool has_ver = meta->has_version(id_ver);
         meta->mutex.unlock();
-        return EBUSY;
+        return has_ver ? EBUSY : EINVAL;
     }
-    *butex = meta->locked_ver;
-    meta->mutex.unlock();
     if (pdata != NULL) {
         *pdata = meta->data;
     }
@@ -569,6 +652,9 @@ int bthread_id_unlock(bthread_id_t id) {
     // Release fence makes sure all changes made before signal visible to
     // woken-up waiters.
     const uint32_t id_ver = bthread::get_version(id);
+    if (bthread::id_unlock_fast(meta, id_ver)) {
+        return 0;
+    }
     meta->mutex.lock();
     if (!meta->has_version(id_ver)) {
         meta->mutex.unlock();
@@ -591,8 +677,8 @@ int bthread_id_unlock(bthread_id_t id) {
                                    front.error_text);
         }
     } else {
-        const bool contended = (*butex == meta->contended_ver());
-        *butex = meta->first_ver;
+        const bool contended = (meta->atomic_butex()->exchange(
+            meta->first_ver, butil::memory_order_release) == meta->contended_ver());
         meta->mutex.unlock();
         if (contended) {
             // We may wake up already-reused id, but that's OK.
@@ -622,7 +708,7 @@ int bthread_id_unlock_and_destroy(bthread_id_t id) {
         return EPERM;
     }
     const uint32_t next_ver = meta->end_ver();
-    *butex = next_ver;
+    meta->atomic_butex()->store(next_ver, butil::memory_order_release);
     *join_butex = next_ver;
     meta->first_ver = next_ver;
     meta->locked_ver = next_ver;
@@ -710,14 +796,29 @@ int bthread_id_error2_verbose(bthread_id_t id, int error_code,
         return EINVAL;
     }
     const uint32_t id_ver = bthread::get_version(id);
-    uint32_t* butex = meta->butex;
+    butil::atomic<uint32_t>* atomic_butex = meta->atomic_butex();
     meta->mutex.lock();
     if (!meta->has_version(id_ver)) {
         meta->mutex.unlock();
         return EINVAL;
     }
-    if (*butex == meta->first_ver) {
-        *butex = meta->locked_ver;
+    uint32_t cur = atomic_butex->load(butil::memory_order_relaxed);
+    while (true) {
+        if (cur == meta->first_ver) {
+            // Lockers in fast path may grab the id before the CAS.
+            if (atomic_butex->compare_exchange_strong(
+                    cur, meta->locked_ver, butil::memory_order_acquire)) {
+                break;
+            }
+        } else if (bthread::id_mark_contended(meta, cur)) {
+            // The owner can't unlock in fast path without seeing the error.
+            break;
+        } else {
+            // Unlocked in fast path.
+            cur = atomic_butex->load(butil::memory_order_relaxed);
+        }
+    }
+    if (cur == meta->first_ver) {
         meta->lock_location = location;
         meta->mutex.unlock();
         if (meta->on_error) {
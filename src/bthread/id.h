@@ -19,6 +19,7 @@
 #ifndef BTHREAD_ID_H
 #define BTHREAD_ID_H
 
+#include <time.h>                      // timespec
 #include "butil/macros.h"              // BAIDU_SYMBOLSTR
 #include "bthread/types.h"
 
@@ -60,6 +61,12 @@ int bthread_id_create_ranged(
 // Returns 0 on success, error code otherwise.
 int bthread_id_join(bthread_id_t id);
 
+// Wait until `id' being destroyed or the absolute time `abstime' passes.
+// Waiting until a deadline this way is cheaper than adding a timer which
+// errors `id', especially for pthreads which wait on futex directly.
+// Returns 0 on success, ETIMEDOUT on timeout, error code otherwise.
+int bthread_id_timedjoin(bthread_id_t id, const struct timespec* abstime);
+
 // Destroy a created but never-used bthread_id_t.
 // Returns 0 on success, EINVAL otherwise.
 int bthread_id_cancel(bthread_id_t id);
@@ -0,0 +1,512 @@
+// bthread - A M:N threading library to make applications more concurrent.
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bthread/io_uring.h"
+#include <errno.h>
+
+#ifdef BTHREAD_HAS_IO_URING
+#include <poll.h>                                // POLLNVAL
+#include <pthread.h>
+#include <string.h>                              // memset
+#include <unistd.h>                              // syscall
+#include <sys/mman.h>                            // mmap
+#include <sys/syscall.h>                         // __NR_io_uring_*
+#include <sys/uio.h>                             // iovec
+#include <linux/io_uring.h>
+#include <algorithm>                             // std::max
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "butil/containers/linked_list.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
+#include "bthread/butex.h"                       // butex_*
+#include "bthread/mutex.h"                       // FastPthreadMutex
+#include "bthread/task_group.h"                  // TaskGroup
+#endif
+
+namespace bthread {
+
+#ifdef BTHREAD_HAS_IO_URING
+
+extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+
+// defined in bthread/fd.cpp
+extern short epoll_to_poll_events(uint32_t epoll_events);
+
+// Number of io_uring, each of which is reaped by one pthread. Workers are
+// mapped to io_uring by their TaskGroup, thus submissions from one worker
+// always go to the same io_uring.
+static const size_t IO_URING_NUM = 2;
+static const unsigned IO_URING_ENTRIES = 256;
+
+// Set as user_data of operations whose completions are ignored.
+static const uint64_t IGNORED_USER_DATA = 0;
+
+// A pending operation, which lives on the stack of the suspended bthread
+// until the completion is reaped.
+struct IoUringWaiter : public butil::LinkNode<IoUringWaiter> {
+    butil::atomic<int>* done;
+    int res;
+    // File descriptor of poll operations, -1 otherwise.
+    int fd;
+};
+
+class IoUring {
+public:
+    IoUring()
+        : _fd(-1), _sq_head(NULL), _sq_tail(NULL), _sq_mask(0), _sq_entries(0)
+        , _sq_array(NULL), _sqes(NULL), _cq_head(NULL), _cq_tail(NULL)
+        , _cq_mask(0), _cqes(NULL), _nsubmitter(0) {}
+
+    int init(unsigned entries);
+
+    // Push an operation filled by `fill' into the submission queue, and
+    // submit it together with operations pushed by other threads
+    // concurrently.
+    template <typename Fn> void submit(const Fn& fill);
+
+    void add_poll_waiter(IoUringWaiter* w) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _poll_waiters.Append(w);
+    }
+
+    void cancel_poll(IoUringWaiter* w);
+    void cancel_fd_waits(int fd);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(IoUring);
+
+    template <typename Fn> bool push_locked(const Fn& fill);
+    void flush_submissions();
+    void reap_completions();
+    void complete(IoUringWaiter* w, int res);
+
+    static void* run_reaper(void* arg) {
+        static_cast<IoUring*>(arg)->reap_completions();
+        return NULL;
+    }
+
+    static butil::atomic<unsigned>* as_atomic(unsigned* p)
+    { return reinterpret_cast<butil::atomic<unsigned>*>(p); }
+
+    int _fd;
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned* _sq_array;
+    io_uring_sqe* _sqes;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned _cq_mask;
+    io_uring_cqe* _cqes;
+    // Protects the tail of the submission queue and _poll_waiters.
+    internal::FastPthreadMutex _mutex;
+    // Number of threads that pushed operations which are not submitted yet.
+    butil::atomic<int> _nsubmitter;
+    butil::LinkedList<IoUringWaiter> _poll_waiters;
+    pthread_t _reaper;
+};
+
+int IoUring::init(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    const int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP);
+#endif
+    if (single_mmap) {
+        sq_size = std::max(sq_size, cq_size);
+    }
+    char* sq = (char*)mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to mmap submission queue of io_uring";
+        close(fd);
+        return -1;
+    }
+    char* cq = sq;
+    if (!single_mmap) {
+        cq = (char*)mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            PLOG(ERROR) << "Fail to mmap completion queue of io_uring";
+            munmap(sq, sq_size);
+            close(fd);
+            return -1;
+        }
+    }
+    void* sqes = mmap(NULL, p.sq_entries * sizeof(io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to mmap submission entries of io_uring";
+        if (cq != sq) {
+            munmap(cq, cq_size);
+        }
+        munmap(sq, sq_size);
+        close(fd);
+        return -1;
+    }
+    _fd = fd;
+    _sq_head = (unsigned*)(sq + p.sq_off.head);
+    _sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    _sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    _sq_entries = *(unsigned*)(sq + p.sq_off.ring_entries);
+    _sq_array = (unsigned*)(sq + p.sq_off.array);
+    _sqes = (io_uring_sqe*)sqes;
+    _cq_head = (unsigned*)(cq + p.cq_off.head);
+    _cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    _cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    _cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    const int rc = pthread_create(&_reaper, NULL, run_reaper, this);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to create reaper of io_uring, " << berror(rc);
+        return -1;
+    }
+    return 0;
+}
+
+template <typename Fn>
+bool IoUring::push_locked(const Fn& fill) {
+    const unsigned head = as_atomic(_sq_head)->load(butil::memory_order_acquire);
+    const unsigned tail = *_sq_tail;
+    if (tail - head >= _sq_entries) {
+        return false;
+    }
+    const unsigned index = tail & _sq_mask;
+    io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    fill(sqe);
+    _sq_array[index] = index;
+    as_atomic(_sq_tail)->store(tail + 1, butil::memory_order_release);
+    return true;
+}
+
+template <typename Fn>
+void IoUring::submit(const Fn& fill) {
+    while (true) {
+        _mutex.lock();
+        const bool pushed = push_locked(fill);
+        _mutex.unlock();
+        if (pushed) {
+            break;
+        }
+        // The submission queue is full, wait for the submitter to consume.
+        sched_yield();
+    }
+    flush_submissions();
+}
+
+void IoUring::flush_submissions() {
+    // Only one thread enters the kernel at the same time, operations pushed
+    // by others meanwhile are submitted together in next round.
+    if (_nsubmitter.fetch_add(1, butil::memory_order_acq_rel) != 0) {
+        return;
+    }
+    int nsubmitter = 1;
+    while (true) {
+        const int rc = syscall(__NR_io_uring_enter, _fd, _sq_entries, 0, 0,
+                               NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EBUSY) {
+                // Completions are not reaped fast enough.
+                sched_yield();
+                continue;
+            }
+            PLOG(ERROR) << "Fail to submit into io_uring=" << _fd;
+        }
+        const int remain = _nsubmitter.fetch_sub(
+            nsubmitter, butil::memory_order_acq_rel) - nsubmitter;
+        if (remain == 0) {
+            break;
+        }
+        nsubmitter = remain;
+    }
+}
+
+void IoUring::complete(IoUringWaiter* w, int res) {
+    if (w->fd >= 0) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        w->RemoveFromList();
+    }
+    w->res = res;
+    butil::atomic<int>* done = w->done;
+    // `w' may be destroyed after the store, butex is never freed.
+    done->store(1, butil::memory_order_release);
+    butex_wake(done);
+}
+
+void IoUring::reap_completions() {
+    while (true) {
+        const int rc = syscall(__NR_io_uring_enter, _fd, 0, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            PLOG(ERROR) << "Fail to get events from io_uring=" << _fd;
+            usleep(1000);
+            continue;
+        }
+        // This pthread is the only consumer.
+        unsigned head = *_cq_head;
+        const unsigned tail = as_atomic(_cq_tail)->load(butil::memory_order_acquire);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+            if (cqe.user_data != IGNORED_USER_DATA) {
+                complete((IoUringWaiter*)cqe.user_data, cqe.res);
+            }
+        }
+        as_atomic(_cq_head)->store(head, butil::memory_order_release);
+    }
+}
+
+struct PollRemover {
+    uint64_t target;
+    void operator()(io_uring_sqe* sqe) const {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = IGNORED_USER_DATA;
+    }
+};
+
+void IoUring::cancel_poll(IoUringWaiter* w) {
+    const PollRemover remover = { (uint64_t)w };
+    submit(remover);
+}
+
+void IoUring::cancel_fd_waits(int fd) {
+    bool found = false;
+    _mutex.lock();
+    // Waiters are removed from the list by the reaper with _mutex locked,
+    // thus it's safe to refer to them here.
+    butil::LinkNode<IoUringWaiter>* p = _poll_waiters.head();
+    while (p != _poll_waiters.end()) {
+        if (p->value()->fd == fd) {
+            const PollRemover remover = { (uint64_t)p->value() };
+            if (!push_locked(remover)) {
+                // The submission queue is full, restart after submitting.
+                // Removing a poll twice is harmless.
+                _mutex.unlock();
+                flush_submissions();
+                sched_yield();
+                _mutex.lock();
+                p = _poll_waiters.head();
+                continue;
+            }
+            found = true;
+        }
+        p = p->next();
+    }
+    _mutex.unlock();
+    if (found) {
+        flush_submissions();
+    }
+}
+
+static IoUring* g_io_urings = NULL;
+static size_t g_nio_uring = 0;
+static pthread_once_t g_io_uring_once = PTHREAD_ONCE_INIT;
+
+static void init_io_urings() {
+    IoUring* urings = new IoUring[IO_URING_NUM];
+    for (size_t i = 0; i < IO_URING_NUM; ++i) {
+        if (urings[i].init(IO_URING_ENTRIES) != 0) {
+            if (i == 0) {
+                PLOG(WARNING) << "io_uring is not available";
+                // Resources of failed io_uring are leaked deliberately since
+                // the reaper may be running.
+                return;
+            }
+            break;
+        }
+        g_nio_uring = i + 1;
+    }
+    g_io_urings = urings;
+}
+
+inline IoUring* get_io_uring() {
+    pthread_once(&g_io_uring_once, init_io_urings);
+    if (g_io_urings == NULL) {
+        return NULL;
+    }
+    const uint64_t key = (uint64_t)(uintptr_t)tls_task_group;
+    return &g_io_urings[butil::fmix64(key) % g_nio_uring];
+}
+
+bool io_uring_available() {
+    return get_io_uring() != NULL;
+}
+
+// Wait for completion of `w', returns the result of the operation.
+static int wait_for_completion(IoUringWaiter* w) {
+    while (w->done->load(butil::memory_order_acquire) == 0) {
+        // Neither timeout nor interruption stops an operation on the way.
+        butex_wait(w->done, 0, NULL);
+    }
+    return w->res;
+}
+
+struct PollAdder {
+    IoUringWaiter* waiter;
+    short poll_events;
+    void operator()(io_uring_sqe* sqe) const {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = waiter->fd;
+        sqe->poll_events = poll_events;
+        sqe->user_data = (uint64_t)waiter;
+    }
+};
+
+int io_uring_fd_wait(int fd, unsigned epoll_events, const timespec* abstime) {
+    IoUring* uring = get_io_uring();
+    if (uring == NULL) {
+        errno = ENOSYS;
+        return -1;
+    }
+    const short poll_events = epoll_to_poll_events(epoll_events);
+    if (poll_events == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    IoUringWaiter w;
+    w.done = butex_create_checked<butil::atomic<int> >();
+    w.done->store(0, butil::memory_order_relaxed);
+    w.res = 0;
+    w.fd = fd;
+    uring->add_poll_waiter(&w);
+    const PollAdder adder = { &w, poll_events };
+    uring->submit(adder);
+    bool timedout = false;
+    while (w.done->load(butil::memory_order_acquire) == 0) {
+        if (butex_wait(w.done, 0, abstime) < 0 &&
+            (errno == ETIMEDOUT || errno == EINTR)) {
+            // Remove the poll and wait for its completion which refers to
+            // `w' on this stack.
+            timedout = (errno == ETIMEDOUT);
+            uring->cancel_poll(&w);
+            break;
+        }
+    }
+    const int res = wait_for_completion(&w);
+    butex_destroy(w.done);
+    if (res >= 0) {
+        if (res & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+        return 0;
+    }
+    if (res == -ECANCELED) {
+        if (timedout) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        // Interrupted or the fd is being closed.
+        return 0;
+    }
+    errno = -res;
+    return -1;
+}
+
+void io_uring_cancel_fd_waits(int fd) {
+    pthread_once(&g_io_uring_once, init_io_urings);
+    for (size_t i = 0; g_io_urings != NULL && i < g_nio_uring; ++i) {
+        g_io_urings[i].cancel_fd_waits(fd);
+    }
+}
+
+struct ReadWriter {
+    IoUringWaiter* waiter;
+    int fd;
+    uint8_t opcode;
+    const iovec* iov;
+    off_t offset;
+    void operator()(io_uring_sqe* sqe) const {
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)iov;
+        sqe->len = 1;
+        sqe->off = offset;
+        sqe->user_data = (uint64_t)waiter;
+    }
+};
+
+static ssize_t io_uring_rw(uint8_t opcode, int fd, void* buf,
+                           size_t count, off_t offset) {
+    IoUring* uring = get_io_uring();
+    if (uring == NULL) {
+        errno = ENOSYS;
+        return -1;
+    }
+    IoUringWaiter w;
+    w.done = butex_create_checked<butil::atomic<int> >();
+    w.done->store(0, butil::memory_order_relaxed);
+    w.res = 0;
+    w.fd = -1;
+    const iovec iov = { buf, count };
+    const ReadWriter rw = { &w, fd, opcode, &iov, offset };
+    uring->submit(rw);
+    const int res = wait_for_completion(&w);
+    butex_destroy(w.done);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+ssize_t io_uring_pread(int fd, void* buf, size_t count, off_t offset) {
+    return io_uring_rw(IORING_OP_READV, fd, buf, count, offset);
+}
+
+ssize_t io_uring_pwrite(int fd, const void* buf, size_t count, off_t offset) {
+    return io_uring_rw(IORING_OP_WRITEV, fd, const_cast<void*>(buf),
+                       count, offset);
+}
+
+#else  // BTHREAD_HAS_IO_URING
+
+bool io_uring_available() {
+    return false;
+}
+
+int io_uring_fd_wait(int, unsigned, const timespec*) {
+    errno = ENOSYS;
+    return -1;
+}
+
+void io_uring_cancel_fd_waits(int) {}
+
+ssize_t io_uring_pread(int, void*, size_t, off_t) {
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t io_uring_pwrite(int, const void*, size_t, off_t) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif  // BTHREAD_HAS_IO_URING
+
+}  // namespace bthread
@@ -0,0 +1,54 @@
+// bthread - A M:N threading library to make applications more concurrent.
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// I/O of bthreads through io_uring. A worker submits into the io_uring
+// selected by its TaskGroup and suspends the calling bthread only, the
+// completions are reaped by a dedicated pthread of each io_uring.
+
+#ifndef BTHREAD_IO_URING_H
+#define BTHREAD_IO_URING_H
+
+#include <sys/types.h>                         // ssize_t, off_t
+#include <time.h>                              // timespec
+#include "butil/build_config.h"                // OS_LINUX
+
+#if defined(OS_LINUX) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define BTHREAD_HAS_IO_URING 1
+# endif
+#endif
+
+namespace bthread {
+
+// True if io_uring is supported by both headers and the running kernel.
+bool io_uring_available();
+
+// Suspend the calling bthread until `fd' has `epoll_events' or CLOCK_REALTIME
+// reached `abstime' if it's not NULL. Returns 0 on success, -1 otherwise
+// and errno is set. Woken up with 0 when io_uring_cancel_fd_waits(fd) is
+// called, like bthread_close() does for epoll.
+int io_uring_fd_wait(int fd, unsigned epoll_events, const timespec* abstime);
+
+// Cancel io_uring_fd_wait() on `fd', called before closing `fd'.
+void io_uring_cancel_fd_waits(int fd);
+
+// pread(2)/pwrite(2) that suspend the calling bthread only.
+// Must be called when io_uring_available() is true.
+ssize_t io_uring_pread(int fd, void* buf, size_t count, off_t offset);
+ssize_t io_uring_pwrite(int fd, const void* buf, size_t count, off_t offset);
+
+}  // namespace bthread
+
+#endif  // BTHREAD_IO_URING_H
@@ -242,6 +242,45 @@ static void cleanup_pthread(void* arg) {
     }
 }
 
+// Destructors of fast slots, slots in [0, s_nfast_slot) are created.
+typedef void (*FastSlotDtor)(void*);
+static FastSlotDtor s_fast_slot_dtors[BTHREAD_FAST_SLOT_NUM] = {};
+static butil::static_atomic<int> s_nfast_slot = BUTIL_STATIC_ATOMIC_INIT(0);
+// Fast slots of pthreads which are not workers.
+static __thread void* tls_fast_slots[BTHREAD_FAST_SLOT_NUM] = {};
+static __thread bool tls_ever_set_fast_slot = false;
+
+// Called when bthreads end or pthreads exit.
+void run_fast_slot_dtors(void** slots) {
+    const int n = s_nfast_slot.load(butil::memory_order_acquire);
+    // Destructors may set slots again.
+    for (int ntry = 0; ntry < PTHREAD_DESTRUCTOR_ITERATIONS; ++ntry) {
+        bool all_cleared = true;
+        for (int i = 0; i < n; ++i) {
+            void* data = slots[i];
+            if (data != NULL) {
+                slots[i] = NULL;
+                if (s_fast_slot_dtors[i]) {
+                    s_fast_slot_dtors[i](data);
+                    all_cleared = false;
+                }
+            }
+        }
+        if (all_cleared) {
+            return;
+        }
+    }
+}
+
+static void cleanup_pthread_fast_slots(void*) {
+    run_fast_slot_dtors(tls_fast_slots);
+}
+
+static inline void** current_fast_slots() {
+    TaskGroup* const g = tls_task_group;
+    return g ? g->current_task()->fast_slots : tls_fast_slots;
+}
+
 static void arg_as_dtor(void* data, const void* arg) {
     typedef void (*KeyDtor)(void*);
     return ((KeyDtor)arg)(data);
@@ -470,6 +509,41 @@ void* bthread_getspecific(bthread_key_t key) {
     return NULL;
 }
 
+int bthread_fast_slot_create(bthread_fast_slot_t* slot,
+                             void (*destructor)(void* data)) {
+    BAIDU_SCOPED_LOCK(bthread::s_key_mutex);
+    const int n = bthread::s_nfast_slot.load(butil::memory_order_relaxed);
+    if (n >= BTHREAD_FAST_SLOT_NUM) {
+        return EAGAIN;
+    }
+    bthread::s_fast_slot_dtors[n] = destructor;
+    bthread::s_nfast_slot.store(n + 1, butil::memory_order_release);
+    *slot = n;
+    return 0;
+}
+
+int bthread_fast_slot_set(bthread_fast_slot_t slot, void* data) {
+    if ((unsigned)slot >= (unsigned)bthread::s_nfast_slot.load(
+            butil::memory_order_relaxed)) {
+        return EINVAL;
+    }
+    if (bthread::tls_task_group == NULL && !bthread::tls_ever_set_fast_slot) {
+        bthread::tls_ever_set_fast_slot = true;
+        CHECK_EQ(0, butil::thread_atexit(
+                     bthread::cleanup_pthread_fast_slots, NULL));
+    }
+    bthread::current_fast_slots()[slot] = data;
+    return 0;
+}
+
+void* bthread_fast_slot_get(bthread_fast_slot_t slot) {
+    if ((unsigned)slot >= (unsigned)bthread::s_nfast_slot.load(
+            butil::memory_order_relaxed)) {
+        return NULL;
+    }
+    return bthread::current_fast_slots()[slot];
+}
+
 void bthread_assign_data(void* data) {
     bthread::tls_bls.assigned_data = data;
     bthread::TaskGroup* const g = bthread::tls_task_group;
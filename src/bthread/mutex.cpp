@@ -20,6 +20,9 @@
 #include <execinfo.h>
 #include <dlfcn.h>                               // dlsym
 #include <fcntl.h>                               // O_RDONLY
+#include <unistd.h>                              // sysconf
+#include <algorithm>                             // std::min
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"
 #include "bvar/bvar.h"
 #include "bvar/collector.h"
@@ -37,6 +40,7 @@
 #include "bthread/butex.h"                       // butex_*
 #include "bthread/processor.h"                   // cpu_relax, barrier
 #include "bthread/mutex.h"                       // bthread_mutex_t
+#include "bthread/bthread.h"                     // bthread_self
 #include "bthread/sys_futex.h"
 #include "bthread/log.h"
 
@@ -45,6 +49,17 @@ extern void* _dl_sym(void* handle, const char* symbol, void* caller);
 }
 
 namespace bthread {
+
+static bool pass_int32(const char*, int32_t) { return true; }
+
+DEFINE_int32(bthread_mutex_max_spin, 100,
+             "Contended bthread_mutex_t spins at most so many times before "
+             "parking the caller, adapted to recent successful spins. "
+             "Spinning is disabled on single-core machines, 0 to disable");
+const bool ALLOW_UNUSED dummy_bthread_mutex_max_spin =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_mutex_max_spin,
+                                    pass_int32);
+
 // Warm up backtrace before main().
 void* dummy_buf[4];
 const int ALLOW_UNUSED dummy_bt = backtrace(dummy_buf, arraysize(dummy_buf));
@@ -316,6 +331,8 @@ bool ContentionProfilerStart(const char* filename) {
         ("contention_profiler_conflict_hash", get_nconflicthash, NULL);
     static bvar::DisplaySamplingRatio g_sampling_ratio_var(
         "contention_profiler_sampling_ratio", &g_cp_sl);
+    static bvar::DisplayDroppedSamples g_dropped_samples_var(
+        "contention_profiler_dropped_samples", &g_cp_sl);
     
     // Optimistic locking. A not-used ContentionProfiler does not write file.
     std::unique_ptr<ContentionProfiler> ctx(new ContentionProfiler(filename));
@@ -514,6 +531,119 @@ void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns) {
     tls_inside_lock = false;
 }
 
+// Returns non-zero sampling range if a contention should be sampled, used
+// by other bthread locks (e.g. rwlock.cpp) for contention profiling.
+size_t contention_sampling_range() {
+    // Don't sample when contention profiler is off.
+    if (!g_cp) {
+        return 0;
+    }
+    return bvar::is_collectable(&g_cp_sl);
+}
+
+// Off-CPU profiler: samples time that bthreads (and pthreads) spend blocked
+// in butex_wait() and bthread_usleep(), which covers bthread_fd_wait, joins,
+// bthread_id_join (synchronous RPC) and waits of all bthread locks. Samples
+// are written in the same format as contentions, with durations being the
+// blocked time.
+static bvar::CollectorSpeedLimit g_ocp_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
+static ContentionProfiler* BAIDU_CACHELINE_ALIGNMENT g_ocp = NULL;
+static pthread_mutex_t g_ocp_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The bthread waiting for the end of profiling, which is not sampled.
+static bthread_t g_ocp_owner = INVALID_BTHREAD;
+
+struct SampledBlocking : public SampledContention {
+    // Implement bvar::Collected
+    void dump_and_destroy(size_t round);
+    void destroy();
+    bvar::CollectorSpeedLimit* speed_limit() { return &g_ocp_sl; }
+};
+
+void SampledBlocking::dump_and_destroy(size_t /*round*/) {
+    if (g_ocp) {
+        BAIDU_SCOPED_LOCK(g_ocp_mutex);
+        if (g_ocp) {
+            g_ocp->dump_and_destroy(this);
+            return;
+        }
+    }
+    destroy();
+}
+
+void SampledBlocking::destroy() {
+    butil::return_object(this);
+}
+
+bool OffCpuProfilerStart(const char* filename) {
+    if (filename == NULL) {
+        LOG(ERROR) << "Parameter [filename] is NULL";
+        return false;
+    }
+    if (g_ocp) {
+        return false;
+    }
+    static bvar::DisplaySamplingRatio g_sampling_ratio_var(
+        "offcpu_profiler_sampling_ratio", &g_ocp_sl);
+    static bvar::DisplayDroppedSamples g_dropped_samples_var(
+        "offcpu_profiler_dropped_samples", &g_ocp_sl);
+    std::unique_ptr<ContentionProfiler> ctx(new ContentionProfiler(filename));
+    {
+        BAIDU_SCOPED_LOCK(g_ocp_mutex);
+        if (g_ocp) {
+            return false;
+        }
+        g_ocp_owner = bthread_self();
+        g_ocp = ctx.release();
+    }
+    return true;
+}
+
+void OffCpuProfilerStop() {
+    ContentionProfiler* ctx = NULL;
+    if (g_ocp) {
+        std::unique_lock<pthread_mutex_t> mu(g_ocp_mutex);
+        if (g_ocp) {
+            ctx = g_ocp;
+            g_ocp = NULL;
+            mu.unlock();
+            ctx->init_if_needed();
+            delete ctx;
+            return;
+        }
+    }
+    LOG(ERROR) << "Off-CPU profiler is not started!";
+}
+
+// Returns non-zero sampling range if the blocking about to happen should be
+// sampled, used by butex_wait() and bthread_usleep().
+size_t offcpu_sampling_range() {
+    if (!g_ocp) {
+        return 0;
+    }
+    if (g_ocp_owner != INVALID_BTHREAD && g_ocp_owner == bthread_self()) {
+        return 0;
+    }
+    return bvar::is_collectable(&g_ocp_sl);
+}
+
+// Submit the blocking along with stacktrace of the blocked thread. Not
+// inlined so that the skipped frames are always this function and the
+// blocking function.
+void __attribute__((noinline)) submit_offcpu(
+    int64_t duration_ns, size_t sampling_range, int64_t now_ns) {
+    // backtrace() and submit() may lock and modify errno which is the
+    // result of the blocking function.
+    const int saved_errno = errno;
+    tls_inside_lock = true;
+    SampledBlocking* sb = butil::get_object<SampledBlocking>();
+    sb->duration_ns = duration_ns * bvar::COLLECTOR_SAMPLING_BASE / sampling_range;
+    sb->count = bvar::COLLECTOR_SAMPLING_BASE / (double)sampling_range;
+    sb->nframes = backtrace(sb->stack, arraysize(sb->stack));
+    sb->submit(now_ns / 1000);
+    tls_inside_lock = false;
+    errno = saved_errno;
+}
+
 BUTIL_FORCE_INLINE int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
     // Don't change behavior of lock when profiler is off.
     if (!g_cp ||
@@ -612,20 +742,122 @@ BUTIL_FORCE_INLINE int pthread_mutex_unlock_impl(pthread_mutex_t* mutex) {
 struct MutexInternal {
     butil::static_atomic<unsigned char> locked;
     butil::static_atomic<unsigned char> contended;
-    unsigned short padding;
+    // Set at initialization for mutex created with handoff attribute.
+    unsigned char handoff;
+    // Set when the lock is being handed over to a woken waiter.
+    unsigned char handed;
 };
 
-const MutexInternal MUTEX_CONTENDED_RAW = {{1},{1},0};
-const MutexInternal MUTEX_LOCKED_RAW = {{1},{0},0};
+const MutexInternal MUTEX_CONTENDED_RAW = {{1},{1},0,0};
+const MutexInternal MUTEX_LOCKED_RAW = {{1},{0},0,0};
+const MutexInternal MUTEX_HANDOFF_UNLOCKED_RAW = {{0},{0},1,0};
+const MutexInternal MUTEX_HANDOFF_LOCKED_RAW = {{1},{0},1,0};
+const MutexInternal MUTEX_HANDOFF_CONTENDED_RAW = {{1},{1},1,0};
+const MutexInternal MUTEX_HANDOFF_HANDED_RAW = {{1},{1},1,1};
 // Define as macros rather than constants which can't be put in read-only
 // section and affected by initialization-order fiasco.
 #define BTHREAD_MUTEX_CONTENDED (*(const unsigned*)&bthread::MUTEX_CONTENDED_RAW)
 #define BTHREAD_MUTEX_LOCKED (*(const unsigned*)&bthread::MUTEX_LOCKED_RAW)
+#define BTHREAD_MUTEX_HANDOFF_UNLOCKED \
+    (*(const unsigned*)&bthread::MUTEX_HANDOFF_UNLOCKED_RAW)
+#define BTHREAD_MUTEX_HANDOFF_LOCKED \
+    (*(const unsigned*)&bthread::MUTEX_HANDOFF_LOCKED_RAW)
+#define BTHREAD_MUTEX_HANDOFF_CONTENDED \
+    (*(const unsigned*)&bthread::MUTEX_HANDOFF_CONTENDED_RAW)
+#define BTHREAD_MUTEX_HANDOFF_HANDED \
+    (*(const unsigned*)&bthread::MUTEX_HANDOFF_HANDED_RAW)
 
 BAIDU_CASSERT(sizeof(unsigned) == sizeof(MutexInternal),
               sizeof_mutex_internal_must_equal_unsigned);
 
+inline bool is_handoff_mutex(const bthread_mutex_t* m) {
+    return ((const MutexInternal*)m->butex)->handoff;
+}
+
+static bool is_multicore() {
+    static const bool multicore = (sysconf(_SC_NPROCESSORS_ONLN) > 1);
+    return multicore;
+}
+
+// Average spins taken to acquire contended mutexes in this thread.
+static __thread int tls_mutex_spin_avg = 0;
+
+// Spin for a while before parking the caller since the lock is likely to
+// be released soon when critical sections are short. Spinning is bounded
+// by twice of recently successful spins (like PTHREAD_MUTEX_ADAPTIVE_NP)
+// and shrinks when spinning fails, so that long critical sections don't
+// waste CPU.
+inline bool mutex_spin_lock(bthread_mutex_t* m) {
+    const int max_spin = FLAGS_bthread_mutex_max_spin;
+    if (max_spin <= 0 || !is_multicore()) {
+        return false;
+    }
+    MutexInternal* split = (MutexInternal*)m->butex;
+    const int limit = std::min(max_spin, tls_mutex_spin_avg * 2 + 10);
+    for (int i = 0; i < limit; ++i) {
+        cpu_relax();
+        // Locked byte of handed-over mutex is never cleared, thus newcomers
+        // can't grab the lock from the woken waiter.
+        if (!split->locked.load(butil::memory_order_relaxed) &&
+            !split->locked.exchange(1, butil::memory_order_acquire)) {
+            tls_mutex_spin_avg += (i - tls_mutex_spin_avg) / 8;
+            return true;
+        }
+    }
+    tls_mutex_spin_avg -= (tls_mutex_spin_avg + 7) / 8;
+    return false;
+}
+
+// Lock a mutex with handoff attribute. `woken' is true when the caller was
+// just woken up from the mutex (possibly requeued by bthread_cond_t) and
+// may own the handed lock.
+inline int mutex_handoff_lock_contended(
+    bthread_mutex_t* m, const struct timespec* abstime, bool woken) {
+    butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
+    unsigned cur = whole->load(butil::memory_order_relaxed);
+    while (true) {
+        if (cur == BTHREAD_MUTEX_HANDOFF_HANDED) {
+            if (woken) {
+                if (whole->compare_exchange_weak(
+                        cur, BTHREAD_MUTEX_HANDOFF_CONTENDED,
+                        butil::memory_order_acquire)) {
+                    return 0;
+                }
+                continue;
+            }
+        } else if (cur == BTHREAD_MUTEX_HANDOFF_UNLOCKED) {
+            // Nobody is being handed, there may be waiters though.
+            if (whole->compare_exchange_weak(
+                    cur, BTHREAD_MUTEX_HANDOFF_CONTENDED,
+                    butil::memory_order_acquire)) {
+                return 0;
+            }
+            continue;
+        } else if (cur == BTHREAD_MUTEX_HANDOFF_LOCKED) {
+            if (!whole->compare_exchange_weak(
+                    cur, BTHREAD_MUTEX_HANDOFF_CONTENDED,
+                    butil::memory_order_relaxed)) {
+                continue;
+            }
+            cur = BTHREAD_MUTEX_HANDOFF_CONTENDED;
+        }
+        // Waiters are queued in butex in FIFO order.
+        if (bthread::butex_wait(whole, cur, abstime) == 0) {
+            woken = true;
+        } else if (errno != EWOULDBLOCK && errno != EINTR/*note*/) {
+            return errno;
+        }
+        cur = whole->load(butil::memory_order_relaxed);
+    }
+}
+
 inline int mutex_lock_contended(bthread_mutex_t* m) {
+    if (mutex_spin_lock(m)) {
+        return 0;
+    }
+    if (is_handoff_mutex(m)) {
+        return mutex_handoff_lock_contended(m, NULL, false);
+    }
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
         if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, NULL) < 0 &&
@@ -640,6 +872,12 @@ inline int mutex_lock_contended(bthread_mutex_t* m) {
 
 inline int mutex_timedlock_contended(
     bthread_mutex_t* m, const struct timespec* __restrict abstime) {
+    if (mutex_spin_lock(m)) {
+        return 0;
+    }
+    if (is_handoff_mutex(m)) {
+        return mutex_handoff_lock_contended(m, abstime, false);
+    }
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
         if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, abstime) < 0 &&
@@ -652,6 +890,38 @@ inline int mutex_timedlock_contended(
     return 0;
 }
 
+// Release the lock, returns true if a waiter should be woken up.
+inline bool mutex_release(butil::atomic<unsigned>* whole, bool handoff) {
+    if (!handoff) {
+        return whole->exchange(0, butil::memory_order_release)
+            != BTHREAD_MUTEX_LOCKED;
+    }
+    unsigned expected = BTHREAD_MUTEX_HANDOFF_LOCKED;
+    if (whole->compare_exchange_strong(
+            expected, BTHREAD_MUTEX_HANDOFF_UNLOCKED,
+            butil::memory_order_release)) {
+        return false;
+    }
+    // Contended. Keep the lock locked so that newcomers have to wait.
+    whole->store(BTHREAD_MUTEX_HANDOFF_HANDED, butil::memory_order_release);
+    return true;
+}
+
+inline void mutex_wake_waiter(butil::atomic<unsigned>* whole, bool handoff) {
+    if (bthread::butex_wake(whole) == 1 || !handoff) {
+        return;
+    }
+    // Nobody was woken to take over the lock (waiters may be woken by
+    // timeout or not sleeping yet), unlock it and wake up the waiter that
+    // started sleeping just now, if any.
+    unsigned expected = BTHREAD_MUTEX_HANDOFF_HANDED;
+    if (whole->compare_exchange_strong(
+            expected, BTHREAD_MUTEX_HANDOFF_UNLOCKED,
+            butil::memory_order_release)) {
+        bthread::butex_wake(whole);
+    }
+}
+
 #ifdef BTHREAD_USE_FAST_PTHREAD_MUTEX
 namespace internal {
 
@@ -695,13 +965,13 @@ void FastPthreadMutex::unlock() {
 extern "C" {
 
 int bthread_mutex_init(bthread_mutex_t* __restrict m,
-                       const bthread_mutexattr_t* __restrict) {
+                       const bthread_mutexattr_t* __restrict attr) {
     bthread::make_contention_site_invalid(&m->csite);
     m->butex = bthread::butex_create_checked<unsigned>();
     if (!m->butex) {
         return ENOMEM;
     }
-    *m->butex = 0;
+    *m->butex = ((attr && attr->handoff) ? BTHREAD_MUTEX_HANDOFF_UNLOCKED : 0);
     return 0;
 }
 
@@ -718,7 +988,11 @@ int bthread_mutex_trylock(bthread_mutex_t* m) {
     return EBUSY;
 }
 
+// Called by bthread_cond_t after being woken up, the lock may be handed over.
 int bthread_mutex_lock_contended(bthread_mutex_t* m) {
+    if (bthread::is_handoff_mutex(m)) {
+        return bthread::mutex_handoff_lock_contended(m, NULL, true);
+    }
     return bthread::mutex_lock_contended(m);
 }
 
@@ -787,24 +1061,44 @@ int bthread_mutex_unlock(bthread_mutex_t* m) {
         saved_csite = m->csite;
         bthread::make_contention_site_invalid(&m->csite);
     }
-    const unsigned prev = whole->exchange(0, butil::memory_order_release);
+    const bool handoff = bthread::is_handoff_mutex(m);
     // CAUTION: the mutex may be destroyed, check comments before butex_create
-    if (prev == BTHREAD_MUTEX_LOCKED) {
+    if (!bthread::mutex_release(whole, handoff)) {
         return 0;
     }
     // Wakeup one waiter
     if (!bthread::is_contention_site_valid(saved_csite)) {
-        bthread::butex_wake(whole);
+        bthread::mutex_wake_waiter(whole, handoff);
         return 0;
     }
     const int64_t unlock_start_ns = butil::cpuwide_time_ns();
-    bthread::butex_wake(whole);
+    bthread::mutex_wake_waiter(whole, handoff);
     const int64_t unlock_end_ns = butil::cpuwide_time_ns();
     saved_csite.duration_ns += unlock_end_ns - unlock_start_ns;
     bthread::submit_contention(saved_csite, unlock_end_ns);
     return 0;
 }
 
+int bthread_mutexattr_init(bthread_mutexattr_t* attr) {
+    attr->handoff = 0;
+    return 0;
+}
+
+int bthread_mutexattr_destroy(bthread_mutexattr_t*) {
+    return 0;
+}
+
+int bthread_mutexattr_sethandoff(bthread_mutexattr_t* attr, int handoff) {
+    attr->handoff = !!handoff;
+    return 0;
+}
+
+int bthread_mutexattr_gethandoff(const bthread_mutexattr_t* attr,
+                                 int* handoff) {
+    *handoff = attr->handoff;
+    return 0;
+}
+
 int pthread_mutex_lock (pthread_mutex_t *__mutex) {
     return bthread::pthread_mutex_lock_impl(__mutex);
 }
@@ -32,6 +32,11 @@ extern int bthread_mutex_lock(bthread_mutex_t* mutex);
 extern int bthread_mutex_timedlock(bthread_mutex_t* __restrict mutex,
                                    const struct timespec* __restrict abstime);
 extern int bthread_mutex_unlock(bthread_mutex_t* mutex);
+extern int bthread_mutexattr_init(bthread_mutexattr_t* attr);
+extern int bthread_mutexattr_destroy(bthread_mutexattr_t* attr);
+extern int bthread_mutexattr_sethandoff(bthread_mutexattr_t* attr, int handoff);
+extern int bthread_mutexattr_gethandoff(const bthread_mutexattr_t* attr,
+                                        int* handoff);
 __END_DECLS
 
 namespace bthread {
@@ -43,6 +48,8 @@ class Mutex {
 public:
     typedef bthread_mutex_t* native_handler_type;
     Mutex() { CHECK_EQ(0, bthread_mutex_init(&_mutex, NULL)); }
+    explicit Mutex(const bthread_mutexattr_t* attr)
+    { CHECK_EQ(0, bthread_mutex_init(&_mutex, attr)); }
     ~Mutex() { CHECK_EQ(0, bthread_mutex_destroy(&_mutex)); }
     native_handler_type native_handler() { return &_mutex; }
     void lock() { bthread_mutex_lock(&_mutex); }
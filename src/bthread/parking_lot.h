@@ -37,12 +37,19 @@ public:
         int val;
     };
 
-    ParkingLot() : _pending_signal(0) {}
+    ParkingLot() : _pending_signal(0), _nwaiter(0) {}
 
     // Wake up at most `num_task' workers.
     // Returns #workers woken up.
     int signal(int num_task) {
         _pending_signal.fetch_add((num_task << 1), butil::memory_order_release);
+        // Skip the syscall when no worker is parked, which is common when
+        // idle workers are spinning. Pairs with the fence in wait(): either
+        // we see the waiter or the waiter sees the new _pending_signal.
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
+        if (_nwaiter.load(butil::memory_order_relaxed) == 0) {
+            return 0;
+        }
         return futex_wake_private(&_pending_signal, num_task);
     }
 
@@ -54,7 +61,10 @@ public:
     // Wait for tasks.
     // If the `expected_state' does not match, wait() may finish directly.
     void wait(const State& expected_state) {
+        _nwaiter.fetch_add(1, butil::memory_order_relaxed);
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
         futex_wait_private(&_pending_signal, expected_state.val, NULL);
+        _nwaiter.fetch_sub(1, butil::memory_order_relaxed);
     }
 
     // Wakeup suspended wait() and make them unwaitable ever. 
@@ -65,6 +75,8 @@ public:
 private:
     // higher 31 bits for signalling, LSB for stopping.
     butil::atomic<int> _pending_signal;
+    // # of workers inside wait().
+    butil::atomic<int> _nwaiter;
 };
 
 }  // namespace bthread
@@ -19,59 +19,184 @@
 #ifndef BTHREAD_REMOTE_TASK_QUEUE_H
 #define BTHREAD_REMOTE_TASK_QUEUE_H
 
+#include <new>                                      // std::nothrow
+#include "butil/atomicops.h"
+#include "butil/compiler_specific.h"                // BAIDU_CACHELINE_SIZE
 #include "butil/containers/bounded_queue.h"
 #include "butil/macros.h"
+#include "butil/scoped_lock.h"                      // BAIDU_SCOPED_LOCK
+#include "butil/synchronization/lock.h"
+#include "bthread/types.h"                          // bthread_t
 
 namespace bthread {
 
-class TaskGroup;
+// A bounded lock-free queue with multiple producers and consumers. Each
+// cell carries a sequence number telling whether it's ready to be written
+// by the producer or read by the consumer of its position, so that pushing
+// and popping only contend on advancing the positions.
+class MPMCTaskQueue {
+public:
+    MPMCTaskQueue() : _cells(NULL), _mask(0), _push_pos(0), _pop_pos(0) {}
+    ~MPMCTaskQueue() { delete [] _cells; }
+
+    // `cap' is rounded up to power of 2.
+    int init(size_t cap) {
+        size_t n = 1;
+        while (n < cap) {
+            n <<= 1;
+        }
+        _cells = new (std::nothrow) Cell[n];
+        if (_cells == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            _cells[i].seq.store(i, butil::memory_order_relaxed);
+        }
+        _mask = n - 1;
+        return 0;
+    }
+
+    bool push(bthread_t task) {
+        size_t pos = _push_pos.load(butil::memory_order_relaxed);
+        Cell* c;
+        while (true) {
+            c = &_cells[pos & _mask];
+            const size_t seq = c->seq.load(butil::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (_push_pos.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;  // full
+            } else {
+                pos = _push_pos.load(butil::memory_order_relaxed);
+            }
+        }
+        c->task = task;
+        c->seq.store(pos + 1, butil::memory_order_release);
+        return true;
+    }
+
+    bool pop(bthread_t* task) {
+        size_t pos = _pop_pos.load(butil::memory_order_relaxed);
+        Cell* c;
+        while (true) {
+            c = &_cells[pos & _mask];
+            const size_t seq = c->seq.load(butil::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (_pop_pos.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;  // empty
+            } else {
+                pos = _pop_pos.load(butil::memory_order_relaxed);
+            }
+        }
+        *task = c->task;
+        c->seq.store(pos + _mask + 1, butil::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return _mask + 1; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MPMCTaskQueue);
+
+    struct Cell {
+        butil::atomic<size_t> seq;
+        bthread_t task;
+    };
+
+    Cell* _cells;
+    size_t _mask;
+    // Producers and consumers are separated into different cachelines.
+    char _pad0[BAIDU_CACHELINE_SIZE];
+    butil::atomic<size_t> _push_pos;
+    char _pad1[BAIDU_CACHELINE_SIZE];
+    butil::atomic<size_t> _pop_pos;
+    char _pad2[BAIDU_CACHELINE_SIZE];
+};
 
-// A queue for storing bthreads created by non-workers. Since non-workers
-// randomly choose a TaskGroup to push which distributes the contentions,
-// this queue is simply implemented as a queue protected with a lock.
+// A queue for storing bthreads created by non-workers, which are event
+// dispatchers, pthreads running user code and so on. Pushing and popping
+// are lock-free in normal cases. When the lock-free part is full, tasks go
+// to an overflow queue protected with a lock, which is popped before the
+// lock-free part to be drained ASAP. push() fails when both are full.
+// bthreads with BTHREAD_PRIORITY_HIGH are stored separately and always
+// popped before others.
 // The function names should be self-explanatory.
 class RemoteTaskQueue {
 public:
-    RemoteTaskQueue() {}
+    RemoteTaskQueue() : _noverflow(0) {}
 
     int init(size_t cap) {
-        const size_t memsize = sizeof(bthread_t) * cap;
-        void* q_mem = malloc(memsize);
-        if (q_mem == NULL) {
+        if (_tasks.init(cap) != 0 || _high_tasks.init(cap) != 0 ||
+            init_queue(&_overflow_tasks, cap) != 0 ||
+            init_queue(&_overflow_high_tasks, cap) != 0) {
             return -1;
         }
-        butil::BoundedQueue<bthread_t> q(q_mem, memsize, butil::OWNS_STORAGE);
-        _tasks.swap(q);
         return 0;
     }
 
     bool pop(bthread_t* task) {
-        if (_tasks.empty()) {
-            return false;
-        }
-        _mutex.lock();
-        const bool result = _tasks.pop(task);
-        _mutex.unlock();
-        return result;
+        return pop_overflow(&_overflow_high_tasks, task) ||
+            _high_tasks.pop(task) ||
+            pop_overflow(&_overflow_tasks, task) ||
+            _tasks.pop(task);
     }
 
-    bool push(bthread_t task) {
-        _mutex.lock();
-        const bool res = push_locked(task);
-        _mutex.unlock();
-        return res;
+    bool push(bthread_t task, bool high_priority = false) {
+        if ((high_priority ? _high_tasks : _tasks).push(task)) {
+            return true;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        if ((high_priority ? _overflow_high_tasks : _overflow_tasks).push(task)) {
+            _noverflow.fetch_add(1, butil::memory_order_relaxed);
+            return true;
+        }
+        return false;
     }
 
-    bool push_locked(bthread_t task) {
-        return _tasks.push(task);
+    size_t capacity() const {
+        return _tasks.capacity() + _overflow_tasks.capacity();
     }
-
-    size_t capacity() const { return _tasks.capacity(); }
     
 private:
-friend class TaskGroup;
     DISALLOW_COPY_AND_ASSIGN(RemoteTaskQueue);
-    butil::BoundedQueue<bthread_t> _tasks;
+
+    static int init_queue(butil::BoundedQueue<bthread_t>* q, size_t cap) {
+        const size_t memsize = sizeof(bthread_t) * cap;
+        void* q_mem = malloc(memsize);
+        if (q_mem == NULL) {
+            return -1;
+        }
+        butil::BoundedQueue<bthread_t> tmp(q_mem, memsize, butil::OWNS_STORAGE);
+        q->swap(tmp);
+        return 0;
+    }
+
+    bool pop_overflow(butil::BoundedQueue<bthread_t>* q, bthread_t* task) {
+        if (_noverflow.load(butil::memory_order_relaxed) == 0) {
+            return false;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (q->pop(task)) {
+            _noverflow.fetch_sub(1, butil::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    MPMCTaskQueue _tasks;
+    MPMCTaskQueue _high_tasks;
+    butil::atomic<int> _noverflow;
+    butil::BoundedQueue<bthread_t> _overflow_tasks;
+    butil::BoundedQueue<bthread_t> _overflow_high_tasks;
     butil::Mutex _mutex;
 };
 
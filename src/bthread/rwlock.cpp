@@ -0,0 +1,283 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// bthread_rwlock_t prefers writers: readers arriving after a writer are
+// blocked until the writer leaves, and then all of them are woken up in
+// one batch. Readers only modify one atomic word when no writer is present.
+
+#include "butil/build_config.h"                 // OS_LINUX
+#include "butil/atomicops.h"
+#include "butil/time.h"                          // cpuwide_time_ns
+#include "bthread/butex.h"                       // butex_*
+#include "bthread/mutex.h"                       // bthread_mutex_*
+#include "bthread/bthread.h"
+
+namespace bthread {
+
+// defined in bthread/mutex.cpp
+extern size_t contention_sampling_range();
+extern void submit_contention(const bthread_contention_site_t& csite,
+                              int64_t now_ns);
+
+// Set in lock_butex when a writer is waiting for or holding the lock.
+static const unsigned RWLOCK_WRITER = (1u << 31);
+
+inline butil::atomic<unsigned>* lock_word(bthread_rwlock_t* rw) {
+    return (butil::atomic<unsigned>*)rw->lock_butex;
+}
+
+inline butil::atomic<unsigned>* reader_word(bthread_rwlock_t* rw) {
+    return (butil::atomic<unsigned>*)rw->reader_butex;
+}
+
+inline butil::atomic<bool>* wlock_flag(bthread_rwlock_t* rw) {
+    return (butil::atomic<bool>*)&rw->wlock_flag;
+}
+
+inline void rwlock_unrdlock(bthread_rwlock_t* rw) {
+    butil::atomic<unsigned>* whole = lock_word(rw);
+    const unsigned prev = whole->fetch_sub(1, butil::memory_order_release);
+    if (prev == (RWLOCK_WRITER | 1)) {
+        // Last reader leaves, wake up the writer waiting for readers.
+        butex_wake(whole);
+    }
+}
+
+inline int rwlock_rdlock_contended(bthread_rwlock_t* rw,
+                                   const struct timespec* abstime) {
+    butil::atomic<unsigned>* whole = lock_word(rw);
+    butil::atomic<unsigned>* rbutex = reader_word(rw);
+    while (true) {
+        // Read version before checking presence of the writer, otherwise
+        // wakeup from the leaving writer may be missed.
+        const unsigned ver = rbutex->load(butil::memory_order_acquire);
+        if (whole->load(butil::memory_order_acquire) & RWLOCK_WRITER) {
+            if (butex_wait(rbutex, ver, abstime) < 0 &&
+                errno != EWOULDBLOCK && errno != EINTR) {
+                return errno;
+            }
+        }
+        const unsigned prev = whole->fetch_add(1, butil::memory_order_acquire);
+        if (!(prev & RWLOCK_WRITER)) {
+            return 0;
+        }
+        // Another writer came, back off.
+        rwlock_unrdlock(rw);
+    }
+}
+
+inline int rwlock_rdlock(bthread_rwlock_t* rw, const struct timespec* abstime) {
+    butil::atomic<unsigned>* whole = lock_word(rw);
+    const unsigned prev = whole->fetch_add(1, butil::memory_order_acquire);
+    if (!(prev & RWLOCK_WRITER)) {
+        return 0;
+    }
+    rwlock_unrdlock(rw);
+    const size_t sampling_range = contention_sampling_range();
+    if (!sampling_range) {
+        return rwlock_rdlock_contended(rw, abstime);
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const int rc = rwlock_rdlock_contended(rw, abstime);
+    // The lock is shared by readers, submit the contention at acquisition
+    // instead of unlocking.
+    const int64_t end_ns = butil::cpuwide_time_ns();
+    const bthread_contention_site_t csite = { end_ns - start_ns, sampling_range };
+    submit_contention(csite, end_ns);
+    return rc;
+}
+
+inline void rwlock_release_readers(bthread_rwlock_t* rw) {
+    lock_word(rw)->fetch_and(~RWLOCK_WRITER, butil::memory_order_release);
+    butil::atomic<unsigned>* rbutex = reader_word(rw);
+    rbutex->fetch_add(1, butil::memory_order_release);
+    butex_wake_all(rbutex);
+}
+
+// Wait for readers to leave after setting RWLOCK_WRITER.
+inline int rwlock_wait_for_readers(bthread_rwlock_t* rw,
+                                   const struct timespec* abstime) {
+    butil::atomic<unsigned>* whole = lock_word(rw);
+    unsigned cur = whole->load(butil::memory_order_acquire);
+    while (cur != RWLOCK_WRITER) {
+        if (butex_wait(whole, cur, abstime) < 0 &&
+            errno != EWOULDBLOCK && errno != EINTR) {
+            return errno;
+        }
+        cur = whole->load(butil::memory_order_acquire);
+    }
+    return 0;
+}
+
+inline int rwlock_wrlock(bthread_rwlock_t* rw, const struct timespec* abstime) {
+    int rc = (abstime ? bthread_mutex_timedlock(&rw->write_queue_mutex, abstime)
+              : bthread_mutex_lock(&rw->write_queue_mutex));
+    if (rc) {
+        return rc;
+    }
+    butil::atomic<unsigned>* whole = lock_word(rw);
+    // Only one writer can be here, new readers are blocked since then.
+    const unsigned prev = whole->fetch_or(RWLOCK_WRITER, butil::memory_order_acquire);
+    if (prev != 0) {
+        const size_t sampling_range = contention_sampling_range();
+        const int64_t start_ns = (sampling_range ? butil::cpuwide_time_ns() : 0);
+        rc = rwlock_wait_for_readers(rw, abstime);
+        if (rc) {
+            rwlock_release_readers(rw);
+            bthread_mutex_unlock(&rw->write_queue_mutex);
+            return rc;
+        }
+        if (sampling_range) {
+            // Submitted in unlock, like bthread_mutex_t.
+            rw->writer_csite.duration_ns = butil::cpuwide_time_ns() - start_ns;
+            rw->writer_csite.sampling_range = sampling_range;
+        }
+    }
+    wlock_flag(rw)->store(true, butil::memory_order_relaxed);
+    return 0;
+}
+
+inline int rwlock_unwrlock(bthread_rwlock_t* rw) {
+    bthread_contention_site_t saved_csite = rw->writer_csite;
+    rw->writer_csite.sampling_range = 0;
+    wlock_flag(rw)->store(false, butil::memory_order_relaxed);
+    const int64_t unlock_start_ns =
+        (saved_csite.sampling_range ? butil::cpuwide_time_ns() : 0);
+    rwlock_release_readers(rw);
+    bthread_mutex_unlock(&rw->write_queue_mutex);
+    if (saved_csite.sampling_range) {
+        const int64_t unlock_end_ns = butil::cpuwide_time_ns();
+        saved_csite.duration_ns += unlock_end_ns - unlock_start_ns;
+        submit_contention(saved_csite, unlock_end_ns);
+    }
+    return 0;
+}
+
+}  // namespace bthread
+
+extern "C" {
+
+int bthread_rwlock_init(bthread_rwlock_t* __restrict rw,
+                        const bthread_rwlockattr_t* __restrict) {
+    rw->lock_butex = bthread::butex_create_checked<unsigned>();
+    if (!rw->lock_butex) {
+        return ENOMEM;
+    }
+    rw->reader_butex = bthread::butex_create_checked<unsigned>();
+    if (!rw->reader_butex) {
+        bthread::butex_destroy(rw->lock_butex);
+        return ENOMEM;
+    }
+    const int rc = bthread_mutex_init(&rw->write_queue_mutex, NULL);
+    if (rc) {
+        bthread::butex_destroy(rw->reader_butex);
+        bthread::butex_destroy(rw->lock_butex);
+        return rc;
+    }
+    *rw->lock_butex = 0;
+    *rw->reader_butex = 0;
+    rw->wlock_flag = false;
+    rw->writer_csite.duration_ns = 0;
+    rw->writer_csite.sampling_range = 0;
+    return 0;
+}
+
+int bthread_rwlock_destroy(bthread_rwlock_t* rw) {
+    bthread_mutex_destroy(&rw->write_queue_mutex);
+    bthread::butex_destroy(rw->reader_butex);
+    bthread::butex_destroy(rw->lock_butex);
+    return 0;
+}
+
+int bthread_rwlock_rdlock(bthread_rwlock_t* rw) {
+    return bthread::rwlock_rdlock(rw, NULL);
+}
+
+int bthread_rwlock_tryrdlock(bthread_rwlock_t* rw) {
+    butil::atomic<unsigned>* whole = bthread::lock_word(rw);
+    const unsigned prev = whole->fetch_add(1, butil::memory_order_acquire);
+    if (!(prev & bthread::RWLOCK_WRITER)) {
+        return 0;
+    }
+    bthread::rwlock_unrdlock(rw);
+    return EBUSY;
+}
+
+int bthread_rwlock_timedrdlock(bthread_rwlock_t* __restrict rw,
+                               const struct timespec* __restrict abstime) {
+    return bthread::rwlock_rdlock(rw, abstime);
+}
+
+int bthread_rwlock_wrlock(bthread_rwlock_t* rw) {
+    return bthread::rwlock_wrlock(rw, NULL);
+}
+
+int bthread_rwlock_trywrlock(bthread_rwlock_t* rw) {
+    if (bthread_mutex_trylock(&rw->write_queue_mutex) != 0) {
+        return EBUSY;
+    }
+    unsigned expected = 0;
+    if (!bthread::lock_word(rw)->compare_exchange_strong(
+            expected, bthread::RWLOCK_WRITER, butil::memory_order_acquire)) {
+        bthread_mutex_unlock(&rw->write_queue_mutex);
+        return EBUSY;
+    }
+    bthread::wlock_flag(rw)->store(true, butil::memory_order_relaxed);
+    return 0;
+}
+
+int bthread_rwlock_timedwrlock(bthread_rwlock_t* __restrict rw,
+                               const struct timespec* __restrict abstime) {
+    return bthread::rwlock_wrlock(rw, abstime);
+}
+
+int bthread_rwlock_unlock(bthread_rwlock_t* rw) {
+    // No reader holds the lock when the writer does, thus the flag is only
+    // true for the writer.
+    if (bthread::wlock_flag(rw)->load(butil::memory_order_relaxed)) {
+        return bthread::rwlock_unwrlock(rw);
+    }
+    bthread::rwlock_unrdlock(rw);
+    return 0;
+}
+
+int bthread_rwlockattr_init(bthread_rwlockattr_t*) {
+    return 0;
+}
+
+int bthread_rwlockattr_destroy(bthread_rwlockattr_t*) {
+    return 0;
+}
+
+// Writers are always preferred, other kinds are not supported.
+int bthread_rwlockattr_getkind_np(const bthread_rwlockattr_t*, int* pref) {
+#if defined(OS_LINUX)
+    *pref = PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP;
+    return 0;
+#else
+    (void)pref;
+    return ENOTSUP;
+#endif
+}
+
+int bthread_rwlockattr_setkind_np(bthread_rwlockattr_t*, int pref) {
+#if defined(OS_LINUX)
+    return (pref == PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP ? 0 : ENOTSUP);
+#else
+    (void)pref;
+    return ENOTSUP;
+#endif
+}
+
+}  // extern "C"
@@ -0,0 +1,68 @@
+// bthread - A M:N threading library to make applications more concurrent.
+// Copyright (c) 2018 Baidu, Inc.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BTHREAD_RWLOCK_H
+#define  BTHREAD_RWLOCK_H
+
+#include "bthread/types.h"
+#include "butil/scoped_lock.h"
+
+__BEGIN_DECLS
+extern int bthread_rwlock_init(bthread_rwlock_t* __restrict rwlock,
+                               const bthread_rwlockattr_t* __restrict attr);
+extern int bthread_rwlock_destroy(bthread_rwlock_t* rwlock);
+extern int bthread_rwlock_rdlock(bthread_rwlock_t* rwlock);
+extern int bthread_rwlock_tryrdlock(bthread_rwlock_t* rwlock);
+extern int bthread_rwlock_wrlock(bthread_rwlock_t* rwlock);
+extern int bthread_rwlock_trywrlock(bthread_rwlock_t* rwlock);
+extern int bthread_rwlock_unlock(bthread_rwlock_t* rwlock);
+__END_DECLS
+
+namespace bthread {
+
+// The C++ Wrapper of bthread_rwlock, lock()/unlock() are for the writer so
+// that std::lock_guard and std::unique_lock work, and readers use
+// lock_shared()/unlock_shared() or ReadLockGuard.
+class RWLock {
+public:
+    typedef bthread_rwlock_t* native_handler_type;
+    RWLock() { CHECK_EQ(0, bthread_rwlock_init(&_rwlock, NULL)); }
+    ~RWLock() { CHECK_EQ(0, bthread_rwlock_destroy(&_rwlock)); }
+    native_handler_type native_handler() { return &_rwlock; }
+    void lock() { bthread_rwlock_wrlock(&_rwlock); }
+    void unlock() { bthread_rwlock_unlock(&_rwlock); }
+    bool try_lock() { return !bthread_rwlock_trywrlock(&_rwlock); }
+    void lock_shared() { bthread_rwlock_rdlock(&_rwlock); }
+    void unlock_shared() { bthread_rwlock_unlock(&_rwlock); }
+    bool try_lock_shared() { return !bthread_rwlock_tryrdlock(&_rwlock); }
+private:
+    DISALLOW_COPY_AND_ASSIGN(RWLock);
+    bthread_rwlock_t _rwlock;
+};
+
+// Hold read lock of a RWLock in the scope.
+class ReadLockGuard {
+public:
+    explicit ReadLockGuard(RWLock& rwlock) : _rwlock(&rwlock)
+    { _rwlock->lock_shared(); }
+    ~ReadLockGuard() { _rwlock->unlock_shared(); }
+private:
+    DISALLOW_COPY_AND_ASSIGN(ReadLockGuard);
+    RWLock* _rwlock;
+};
+
+}  // namespace bthread
+
+#endif  //BTHREAD_RWLOCK_H
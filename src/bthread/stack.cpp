@@ -17,14 +17,21 @@
 // Date: Sun Sep  7 22:37:39 CST 2014
 
 #include <unistd.h>                               // getpagesize
+#include <pthread.h>
 #include <sys/mman.h>                             // mmap, munmap, mprotect
 #include <algorithm>                              // std::max
+#include <map>
+#include <vector>
 #include <stdlib.h>                               // posix_memalign
+#include "butil/build_config.h"                    // OS_LINUX
 #include "butil/macros.h"                          // BAIDU_CASSERT
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "butil/third_party/dynamic_annotations/dynamic_annotations.h" // RunningOnValgrind
 #include "butil/third_party/valgrind/valgrind.h"   // VALGRIND_STACK_REGISTER
 #include "bvar/passive_status.h"
+#include "bvar/reducer.h"
+#include "bvar/recorder.h"
+#include "bvar/window.h"
 #include "bthread/types.h"                        // BTHREAD_STACKTYPE_*
 #include "bthread/stack.h"
 
@@ -34,6 +41,12 @@ DEFINE_int32(stack_size_large, 8388608, "size of large stacks");
 DEFINE_int32(guard_page_size, 4096, "size of guard page, allocate stacks by malloc if it's 0(not recommended)");
 DEFINE_int32(tc_stack_small, 32, "maximum small stacks cached by each thread");
 DEFINE_int32(tc_stack_normal, 8, "maximum normal stacks cached by each thread");
+DEFINE_int32(stack_reclaim_threshold, 0, "When bthreads end, pages of their "
+             "stacks deeper than so many bytes are released to the system "
+             "if they were written. 0 disables it. Only works on linux");
+DEFINE_int32(stack_usage_sample_interval, 0, "Scan stacks of one of so many "
+             "ended bthreads for peak usage, exposed as bthread_stack_usage. "
+             "0 disables it");
 
 namespace bthread {
 
@@ -41,6 +54,7 @@ BAIDU_CASSERT(BTHREAD_STACKTYPE_PTHREAD == STACK_TYPE_PTHREAD, must_match);
 BAIDU_CASSERT(BTHREAD_STACKTYPE_SMALL == STACK_TYPE_SMALL, must_match);
 BAIDU_CASSERT(BTHREAD_STACKTYPE_NORMAL == STACK_TYPE_NORMAL, must_match);
 BAIDU_CASSERT(BTHREAD_STACKTYPE_LARGE == STACK_TYPE_LARGE, must_match);
+BAIDU_CASSERT(BTHREAD_STACKTYPE_SHARED == STACK_TYPE_SHARED, must_match);
 BAIDU_CASSERT(STACK_TYPE_MAIN == 0, must_be_0);
 
 static butil::static_atomic<int64_t> s_stack_count = BUTIL_STATIC_ATOMIC_INIT(0);
@@ -50,6 +64,64 @@ static int64_t get_stack_count(void*) {
 static bvar::PassiveStatus<int64_t> bvar_stack_count(
     "bthread_stack_count", get_stack_count, NULL);
 
+// Lowest addresses => sizes of stacks allocated by mmap, for counting their
+// resident pages. Stacks are cached and rarely allocated, the lock is cheap.
+static pthread_mutex_t s_stack_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<char*, int>* s_stack_map = NULL;
+
+static void add_to_stack_map(char* begin, int size) {
+    pthread_mutex_lock(&s_stack_map_mutex);
+    if (s_stack_map == NULL) {
+        s_stack_map = new std::map<char*, int>;
+    }
+    (*s_stack_map)[begin] = size;
+    pthread_mutex_unlock(&s_stack_map_mutex);
+}
+
+static void remove_from_stack_map(char* begin) {
+    pthread_mutex_lock(&s_stack_map_mutex);
+    if (s_stack_map) {
+        s_stack_map->erase(begin);
+    }
+    pthread_mutex_unlock(&s_stack_map_mutex);
+}
+
+// Put residency of pages in [begin, begin + size) into `vec'.
+static bool get_resident_pages(char* begin, int size,
+                               std::vector<unsigned char>* vec) {
+    vec->resize(size / getpagesize());
+#if defined(OS_MACOSX)
+    return mincore(begin, size, (char*)&(*vec)[0]) == 0;
+#else
+    return mincore(begin, size, &(*vec)[0]) == 0;
+#endif
+}
+
+static int64_t get_stack_resident_memory(void*) {
+    std::vector<std::pair<char*, int> > stacks;
+    pthread_mutex_lock(&s_stack_map_mutex);
+    if (s_stack_map) {
+        stacks.assign(s_stack_map->begin(), s_stack_map->end());
+    }
+    pthread_mutex_unlock(&s_stack_map_mutex);
+    // Stacks deallocated after the copy make mincore fail and are skipped.
+    int64_t npages = 0;
+    std::vector<unsigned char> vec;
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        if (get_resident_pages(stacks[i].first, stacks[i].second, &vec)) {
+            for (size_t j = 0; j < vec.size(); ++j) {
+                npages += (vec[j] & 1);
+            }
+        }
+    }
+    return npages * getpagesize();
+}
+static bvar::PassiveStatus<int64_t> bvar_stack_resident_memory(
+    "bthread_stack_resident_memory", get_stack_resident_memory, NULL);
+
+static bvar::Adder<int64_t> bvar_stack_reclaim_count(
+    "bthread_stack_reclaim_count");
+
 int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in) {
     const static int PAGESIZE = getpagesize();
     const int PAGESIZE_M1 = PAGESIZE - 1;
@@ -117,6 +189,7 @@ int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in)
         s->bottom = (char*)mem + memsize;
         s->stacksize = stacksize;
         s->guardsize = guardsize;
+        add_to_stack_map((char*)s->bottom - stacksize, stacksize);
         if (RunningOnValgrind()) {
             s->valgrind_stack_id = VALGRIND_STACK_REGISTER(
                 s->bottom, (char*)s->bottom - stacksize);
@@ -139,10 +212,82 @@ void deallocate_stack_storage(StackStorage* s) {
     if (s->guardsize <= 0) {
         free((char*)s->bottom - memsize);
     } else {
+        remove_from_stack_map((char*)s->bottom - s->stacksize);
         munmap((char*)s->bottom - memsize, memsize);
     }
 }
 
+static __thread int tls_nended_stack = 0;
+
+// Scan from the deepest resident page for the first non-zero word. Pages
+// never written or released by madvise are all zeros, so that the result
+// is peak usage of bthreads ran on the stack since it was reclaimed.
+static void sample_stack_usage(char* begin, char* bottom) {
+    std::vector<unsigned char> vec;
+    if (!get_resident_pages(begin, bottom - begin, &vec)) {
+        return;
+    }
+    size_t i = 0;
+    for (; i < vec.size() && !(vec[i] & 1); ++i) {}
+    const intptr_t* w = (const intptr_t*)(begin + i * getpagesize());
+    for (; (const char*)w < bottom && *w == 0; ++w) {}
+    // Created at first use, after bvar is initialized.
+    static bvar::IntRecorder* usage = new bvar::IntRecorder;
+    static bvar::Window<bvar::IntRecorder>* usage_window =
+        new bvar::Window<bvar::IntRecorder>("bthread_stack_usage", usage, 60);
+    static bvar::Maxer<int64_t>* max_usage = new bvar::Maxer<int64_t>;
+    static bvar::Window<bvar::Maxer<int64_t> >* max_usage_window =
+        new bvar::Window<bvar::Maxer<int64_t> >(
+            "bthread_stack_usage_max", max_usage, 60);
+    (void)usage_window;
+    (void)max_usage_window;
+    const int64_t used = bottom - (const char*)w;
+    *usage << used;
+    *max_usage << used;
+}
+
+void inspect_ended_stack_slow(ContextualStack* cs) {
+    const StackStorage& s = cs->storage;
+    if (s.guardsize <= 0 || s.bottom == NULL) {
+        // Allocated by malloc, whose pages may be shared with others.
+        return;
+    }
+    char* const bottom = (char*)s.bottom;
+    char* const begin = bottom - s.stacksize;
+    const int interval = FLAGS_stack_usage_sample_interval;
+    if (interval > 0 && ++tls_nended_stack >= interval) {
+        tls_nended_stack = 0;
+        sample_stack_usage(begin, bottom);
+    }
+#if defined(OS_LINUX)
+    const int PAGESIZE = getpagesize();
+    const int threshold = FLAGS_stack_reclaim_threshold;
+    if (threshold <= 0 || threshold >= s.stacksize) {
+        return;
+    }
+    char* const mark = bottom - ((threshold + PAGESIZE - 1) & ~(PAGESIZE - 1));
+    if (mark <= begin) {
+        return;
+    }
+    // The stack may be passed to the next bthread directly and we're still
+    // running on it, don't release pages in use.
+    char* const sp = (char*)__builtin_frame_address(0);
+    if (sp >= begin && sp < mark + PAGESIZE) {
+        return;
+    }
+    // Stacks grow downwards, bthreads going beyond `mark' must have written
+    // the bytes right below it with high probability.
+    const intptr_t* p = (const intptr_t*)mark - 8;
+    bool written = false;
+    for (int i = 0; i < 8; ++i) {
+        written |= (p[i] != 0);
+    }
+    if (written && madvise(begin, mark - begin, MADV_DONTNEED) == 0) {
+        bvar_stack_reclaim_count << 1;
+    }
+#endif
+}
+
 int* SmallStackClass::stack_size_flag = &FLAGS_stack_size_small;
 int* NormalStackClass::stack_size_flag = &FLAGS_stack_size_normal;
 int* LargeStackClass::stack_size_flag = &FLAGS_stack_size_large;
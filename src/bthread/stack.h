@@ -55,7 +55,8 @@ enum StackType {
     STACK_TYPE_PTHREAD = BTHREAD_STACKTYPE_PTHREAD,
     STACK_TYPE_SMALL = BTHREAD_STACKTYPE_SMALL,
     STACK_TYPE_NORMAL = BTHREAD_STACKTYPE_NORMAL,
-    STACK_TYPE_LARGE = BTHREAD_STACKTYPE_LARGE
+    STACK_TYPE_LARGE = BTHREAD_STACKTYPE_LARGE,
+    STACK_TYPE_SHARED = BTHREAD_STACKTYPE_SHARED
 };
 
 struct ContextualStack {
@@ -69,6 +70,11 @@ struct ContextualStack {
 ContextualStack* get_stack(StackType type, void (*entry)(intptr_t));
 // Recycle a stack. NULL does nothing.
 void return_stack(ContextualStack*);
+// Called when the bthread running on the stack ends. Pages of the stack
+// deeper than -stack_reclaim_threshold are released if they were written,
+// and usage of the stack is sampled every -stack_usage_sample_interval
+// calls. Notice that the stack may still be the current one.
+void inspect_ended_stack(ContextualStack* s);
 // Jump from stack `from' to stack `to'. `from' must be the stack of callsite
 // (to save contexts before jumping)
 void jump_stack(ContextualStack* from, ContextualStack* to);
@@ -22,6 +22,8 @@
 DECLARE_int32(guard_page_size);
 DECLARE_int32(tc_stack_small);
 DECLARE_int32(tc_stack_normal);
+DECLARE_int32(stack_reclaim_threshold);
+DECLARE_int32(stack_usage_sample_interval);
 
 namespace bthread {
 
@@ -93,6 +95,8 @@ template <> struct StackFactory<MainStackClass> {
 inline ContextualStack* get_stack(StackType type, void (*entry)(intptr_t)) {
     switch (type) {
     case STACK_TYPE_PTHREAD:
+    case STACK_TYPE_SHARED:
+        // Run on stack of the worker.
         return NULL;
     case STACK_TYPE_SMALL:
         return StackFactory<SmallStackClass>::get_stack(entry);
@@ -112,6 +116,7 @@ inline void return_stack(ContextualStack* s) {
     }
     switch (s->stacktype) {
     case STACK_TYPE_PTHREAD:
+    case STACK_TYPE_SHARED:
         assert(false);
         return;
     case STACK_TYPE_SMALL:
@@ -125,6 +130,15 @@ inline void return_stack(ContextualStack* s) {
     }
 }
 
+void inspect_ended_stack_slow(ContextualStack* s);
+
+inline void inspect_ended_stack(ContextualStack* s) {
+    if (s != NULL && (FLAGS_stack_reclaim_threshold > 0 ||
+                      FLAGS_stack_usage_sample_interval > 0)) {
+        inspect_ended_stack_slow(s);
+    }
+}
+
 inline void jump_stack(ContextualStack* from, ContextualStack* to) {
     bthread_jump_fcontext(&from->context, to->context, 0/*not skip remained*/);
 }
@@ -15,10 +15,15 @@
 
 // Author: Ge,Jun (gejun@baidu.com)
 // Date: Tue Jul 10 17:40:58 CST 2012
+#include <algorithm>                        // std::max
 
+#include "butil/compat.h"                  // OS_LINUX
 #include "butil/scoped_lock.h"             // BAIDU_SCOPED_LOCK
 #include "butil/errno.h"                   // berror
 #include "butil/logging.h"
+#include "butil/macros.h"                  // ARRAY_SIZE
+#include "butil/numa.h"                    // numa_node_of_cpu
+#include "butil/resource_pool.h"           // describe_resources
 #include "butil/third_party/murmurhash3/murmurhash3.h"
 #include "bthread/sys_futex.h"            // futex_wake_private
 #include "bthread/interrupt_pthread.h"
@@ -33,8 +38,41 @@ DEFINE_int32(task_group_delete_delay, 1,
              "delay deletion of TaskGroup for so many seconds");
 DEFINE_int32(task_group_runqueue_capacity, 4096,
              "capacity of runqueue in each TaskGroup");
+DEFINE_int32(task_group_runqueue_max_capacity, 1048576,
+             "runqueue in each TaskGroup grows from "
+             "-task_group_runqueue_capacity up to so many bthreads when it's "
+             "full, must be power of 2");
 DEFINE_int32(task_group_yield_before_idle, 0,
-             "TaskGroup yields so many times before idle");
+             "TaskGroup yields so many times before idle, after spinning "
+             "for tasks if -bthread_max_spin_us is positive");
+DEFINE_bool(bthread_numa_aware, false,
+            "Pin workers to cpus and prefer TaskGroups on the same NUMA node "
+            "when stealing tasks or waking up workers. Read at initialization"
+            " of bthread and only works on linux");
+
+DEFINE_int32(bthread_concurrency_adjust_interval, 0,
+             "Every so many seconds, add a worker if average usage of workers "
+             "is above -bthread_worker_high_usage, or retire one if it's below "
+             "-bthread_worker_low_usage. Workers are kept within "
+             "[-bthread_min_concurrency, -bthread_concurrency], only works "
+             "when -bthread_min_concurrency is positive. 0 disables the "
+             "adjustment. Read at initialization of bthread");
+DEFINE_double(bthread_worker_low_usage, 0.2,
+              "Retire a worker when average usage of workers is less than "
+              "this value, see -bthread_concurrency_adjust_interval");
+DEFINE_double(bthread_worker_high_usage, 0.8,
+              "Add a worker when average usage of workers is greater than "
+              "this value, see -bthread_concurrency_adjust_interval");
+
+static bool validate_task_group_ntags(const char*, int32_t val) {
+    return val >= 1 && val <= BTHREAD_MAX_TAG_NUM;
+}
+DEFINE_int32(task_group_ntags, 1, "Number of tags of workers, bthreads only "
+             "run on workers of their own tags(bthread_attr_t.tag). Read at "
+             "initialization of bthread");
+const bool ALLOW_UNUSED dummy_task_group_ntags =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_task_group_ntags,
+                                    validate_task_group_ntags);
 
 namespace bthread {
 
@@ -52,14 +90,25 @@ void run_worker_startfn() {
     }
 }
 
+struct WorkerThreadArgs {
+    TaskControl* control;
+    bthread_tag_t tag;
+};
+
 void* TaskControl::worker_thread(void* arg) {
     run_worker_startfn();    
 #ifdef BAIDU_INTERNAL
     logging::ComlogInitializer comlog_initializer;
 #endif
     
-    TaskControl* c = static_cast<TaskControl*>(arg);
-    TaskGroup* g = c->create_group();
+    WorkerThreadArgs* args = static_cast<WorkerThreadArgs*>(arg);
+    TaskControl* c = args->control;
+    const bthread_tag_t tag = args->tag;
+    delete args;
+    if (c->_numa_aware) {
+        c->pin_worker();
+    }
+    TaskGroup* g = c->create_group(tag);
     TaskStatistics stat;
     if (NULL == g) {
         LOG(ERROR) << "Fail to create TaskGroup in pthread=" << pthread_self();
@@ -77,18 +126,76 @@ void* TaskControl::worker_thread(void* arg) {
             << g->main_tid() << " idle=" << stat.cputime_ns / 1000000.0
             << "ms uptime=" << g->current_uptime_ns() / 1000000.0 << "ms";
     tls_task_group = NULL;
+    if (g->retired()) {
+        // Removed from _workers by remove_workers(), nobody joins it.
+        pthread_detach(pthread_self());
+    }
     g->destroy_self();
     c->_nworkers << -1;
     return NULL;
 }
 
-TaskGroup* TaskControl::create_group() {
-    TaskGroup* g = new (std::nothrow) TaskGroup(this);
+void TaskControl::pin_worker() {
+#if defined(OS_LINUX)
+    if (_worker_cpus.empty()) {
+        return;
+    }
+    const size_t index = _next_worker_index.fetch_add(
+        1, butil::memory_order_relaxed);
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(_worker_cpus[index % _worker_cpus.size()], &cs);
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+    if (rc != 0) {
+        LOG(WARNING) << "Fail to pin worker=" << pthread_self() << " to cpu="
+                     << _worker_cpus[index % _worker_cpus.size()] << ", "
+                     << berror(rc);
+    }
+#endif
+}
+
+// Cpus that the process can run on, interleaved by NUMA nodes so that
+// workers are spread evenly over nodes, e.g. node0/cpu0, node1/cpu8,
+// node0/cpu1, node1/cpu9 ...
+static void get_worker_cpus(std::vector<int>* out) {
+    out->clear();
+#if defined(OS_LINUX)
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    if (sched_getaffinity(0, sizeof(cs), &cs) != 0) {
+        PLOG(WARNING) << "Fail to sched_getaffinity";
+        return;
+    }
+    std::vector<int> node_cpus[butil::MAX_NUMA_NODE_NUM];
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &cs)) {
+            node_cpus[butil::numa_node_of_cpu(cpu)].push_back(cpu);
+        }
+    }
+    for (size_t i = 0; ; ++i) {
+        bool added = false;
+        for (int node = 0; node < butil::MAX_NUMA_NODE_NUM; ++node) {
+            if (i < node_cpus[node].size()) {
+                out->push_back(node_cpus[node][i]);
+                added = true;
+            }
+        }
+        if (!added) {
+            break;
+        }
+    }
+#endif
+}
+
+TaskGroup* TaskControl::create_group(bthread_tag_t tag) {
+    TaskGroup* g = new (std::nothrow) TaskGroup(this, tag);
     if (NULL == g) {
         LOG(FATAL) << "Fail to new TaskGroup";
         return NULL;
     }
-    if (g->init(FLAGS_task_group_runqueue_capacity) != 0) {
+    if (g->init(FLAGS_task_group_runqueue_capacity,
+                std::max(FLAGS_task_group_runqueue_max_capacity,
+                         FLAGS_task_group_runqueue_capacity)) != 0) {
         LOG(ERROR) << "Fail to init TaskGroup";
         delete g;
         return NULL;
@@ -117,14 +224,37 @@ static int64_t get_cumulated_signal_count_from_this(void *arg) {
     return static_cast<TaskControl*>(arg)->get_cumulated_signal_count();
 }
 
+// Memory placement of TaskMetas on NUMA machines.
+static void print_task_meta_numa_blocks(std::ostream& os, void*) {
+    const butil::ResourcePoolInfo info = butil::describe_resources<TaskMeta>();
+    for (size_t i = 0; i < info.numa_node_num; ++i) {
+        os << (i ? " " : "") << info.numa_block_num[i];
+    }
+}
+
+static int64_t get_task_meta_remote_free_chunks(void*) {
+    return butil::describe_resources<TaskMeta>().remote_free_chunk_num;
+}
+
 TaskControl::TaskControl()
     // NOTE: all fileds must be initialized before the vars.
     : _ngroup(0)
     , _groups((TaskGroup**)calloc(BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*)))
+    , _ntags(FLAGS_task_group_ntags)
+    , _next_worker_tag(0)
+    , _numa_aware(false)
+    , _next_worker_index(0)
     , _stop(false)
     , _concurrency(0)
+    , _nretired(0)
+    , _destroyed_cputime_ns(0)
+    , _destroyed_nswitch(0)
+    , _destroyed_nsignaled(0)
+    , _last_adjust_us(0)
+    , _last_worker_time(0)
     , _nworkers("bthread_worker_count")
     , _pending_time(NULL)
+    , _sched_latency(NULL)
       // Delay exposure of following two vars because they rely on TC which
       // is not initialized yet.
     , _cumulated_worker_time(get_cumulated_worker_time_from_this, this)
@@ -133,11 +263,26 @@ TaskControl::TaskControl()
     , _switch_per_second(&_cumulated_switch_count)
     , _cumulated_signal_count(get_cumulated_signal_count_from_this, this)
     , _signal_per_second(&_cumulated_signal_count)
+    , _futex_wake_per_second(&_futex_wakes)
     , _status(print_rq_sizes_in_the_tc, this)
     , _nbthreads("bthread_count")
+    , _task_meta_numa_blocks(print_task_meta_numa_blocks, NULL)
+    , _task_meta_remote_free_chunks(get_task_meta_remote_free_chunks, NULL)
 {
     // calloc shall set memory to zero
     CHECK(_groups) << "Fail to create array of groups";
+    for (int i = 0; i < BTHREAD_MAX_TAG_NUM; ++i) {
+        _tagged_ngroup[i].store(0, butil::memory_order_relaxed);
+        _tagged_concurrency[i].store(0, butil::memory_order_relaxed);
+        _tagged_groups[i] = (i < _ntags ? (TaskGroup**)calloc(
+                BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*)) : NULL);
+        CHECK(i >= _ntags || _tagged_groups[i])
+            << "Fail to create array of groups of tag=" << i;
+    }
+    for (int i = 0; i < butil::MAX_NUMA_NODE_NUM; ++i) {
+        _numa_ngroup[i].store(0, butil::memory_order_relaxed);
+        _numa_groups[i] = NULL;
+    }
 }
 
 int TaskControl::init(int concurrency) {
@@ -149,6 +294,11 @@ int TaskControl::init(int concurrency) {
         LOG(ERROR) << "Invalid concurrency=" << concurrency;
         return -1;
     }
+    if (concurrency < _ntags) {
+        LOG(WARNING) << "concurrency=" << concurrency << " is less than "
+            "-task_group_ntags=" << _ntags << ", create one worker per tag";
+        concurrency = _ntags;
+    }
     _concurrency = concurrency;
 
     // Make sure TimerThread is ready.
@@ -157,29 +307,86 @@ int TaskControl::init(int concurrency) {
         return -1;
     }
     
+#if defined(OS_LINUX)
+    if (FLAGS_bthread_numa_aware) {
+        bool ok = true;
+        for (int i = 0; i < butil::numa_node_num(); ++i) {
+            _numa_groups[i] = (TaskGroup**)calloc(
+                BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*));
+            if (_numa_groups[i] == NULL) {
+                ok = false;
+            }
+        }
+        get_worker_cpus(&_worker_cpus);
+        if (ok && !_worker_cpus.empty()) {
+            _numa_aware = true;
+        } else {
+            LOG(WARNING) << "Fail to enable -bthread_numa_aware";
+        }
+    }
+#endif
+
     _workers.resize(_concurrency);   
     for (int i = 0; i < _concurrency; ++i) {
-        const int rc = pthread_create(&_workers[i], NULL, worker_thread, this);
+        const bthread_tag_t tag = i % _ntags;
+        _tagged_concurrency[tag].fetch_add(1, butil::memory_order_relaxed);
+        const int rc = start_worker(&_workers[i], tag);
         if (rc) {
             LOG(ERROR) << "Fail to create _workers[" << i << "], " << berror(rc);
             return -1;
         }
     }
+    _next_worker_tag = _concurrency % _ntags;
     _worker_usage_second.expose("bthread_worker_usage");
     _switch_per_second.expose("bthread_switch_second");
     _signal_per_second.expose("bthread_signal_second");
+    _futex_wake_per_second.expose("bthread_futex_wake_second");
+    _spin_hits.expose("bthread_spin_hit_count");
+    _spin_misses.expose("bthread_spin_miss_count");
+    _rq_grows.expose("bthread_runqueue_grow_count");
+    _rq_fulls.expose("bthread_runqueue_full_count");
     _status.expose("bthread_group_status");
+    if (butil::numa_node_num() > 1) {
+        _task_meta_numa_blocks.expose("bthread_task_meta_numa_block_num");
+        _task_meta_remote_free_chunks.expose(
+            "bthread_task_meta_remote_free_chunk_count");
+    }
+    if (_numa_aware) {
+        _cross_node_steals.expose("bthread_cross_node_steal_count");
+    }
 
-    // Wait for at least one group is added so that choose_one_group()
-    // never returns NULL.
+    // Wait for at least one group of each tag is added so that
+    // choose_one_group() never returns NULL.
     // TODO: Handle the case that worker quits before add_group
-    while (_ngroup == 0) {
-        usleep(100);  // TODO: Elaborate
+    for (int i = 0; i < _ntags; ++i) {
+        while (_tagged_ngroup[i] == 0) {
+            usleep(100);  // TODO: Elaborate
+        }
+    }
+    if (FLAGS_bthread_concurrency_adjust_interval > 0) {
+        adjust_concurrency();
+        get_global_timer_thread()->schedule(
+            adjust_concurrency_periodically, this,
+            butil::seconds_from_now(FLAGS_bthread_concurrency_adjust_interval));
     }
     return 0;
 }
 
-int TaskControl::add_workers(int num) {
+int TaskControl::start_worker(pthread_t* th, bthread_tag_t tag) {
+    WorkerThreadArgs* args = new (std::nothrow) WorkerThreadArgs;
+    if (args == NULL) {
+        return ENOMEM;
+    }
+    args->control = this;
+    args->tag = tag;
+    const int rc = pthread_create(th, NULL, worker_thread, args);
+    if (rc) {
+        delete args;
+    }
+    return rc;
+}
+
+int TaskControl::add_workers(int num, bthread_tag_t tag) {
     if (num <= 0) {
         return 0;
     }
@@ -190,14 +397,21 @@ int TaskControl::add_workers(int num) {
     }
     const int old_concurency = _concurrency.load(butil::memory_order_relaxed);
     for (int i = 0; i < num; ++i) {
+        bthread_tag_t worker_tag = tag;
+        if (worker_tag == BTHREAD_TAG_INVALID) {
+            worker_tag = _next_worker_tag;
+            _next_worker_tag = (_next_worker_tag + 1) % _ntags;
+        }
         // Worker will add itself to _idle_workers, so we have to add
         // _concurrency before create a worker.
         _concurrency.fetch_add(1);
-        const int rc = pthread_create(
-                &_workers[i + old_concurency], NULL, worker_thread, this);
+        _tagged_concurrency[worker_tag].fetch_add(1);
+        const int rc = start_worker(&_workers[i + old_concurency], worker_tag);
         if (rc) {
             LOG(WARNING) << "Fail to create _workers[" << i + old_concurency
                          << "], " << berror(rc);
+            _tagged_concurrency[worker_tag].fetch_sub(
+                1, butil::memory_order_release);
             _concurrency.fetch_sub(1, butil::memory_order_release);
             break;
         }
@@ -207,10 +421,10 @@ int TaskControl::add_workers(int num) {
     return _concurrency.load(butil::memory_order_relaxed) - old_concurency;
 }
 
-TaskGroup* TaskControl::choose_one_group() {
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire);
+TaskGroup* TaskControl::choose_one_group(bthread_tag_t tag) {
+    const size_t ngroup = _tagged_ngroup[tag].load(butil::memory_order_acquire);
     if (ngroup != 0) {
-        return _groups[butil::fast_rand_less_than(ngroup)];
+        return _tagged_groups[tag][butil::fast_rand_less_than(ngroup)];
     }
     CHECK(false) << "Impossible: ngroup is 0";
     return NULL;
@@ -228,9 +442,14 @@ void TaskControl::stop_and_join() {
         BAIDU_SCOPED_LOCK(_modify_group_mutex);
         _stop = true;
         _ngroup.exchange(0, butil::memory_order_relaxed); 
+        for (int i = 0; i < _ntags; ++i) {
+            _tagged_ngroup[i].exchange(0, butil::memory_order_relaxed);
+        }
     }
-    for (int i = 0; i < PARKING_LOT_NUM; ++i) {
-        _pl[i].stop();
+    for (int i = 0; i < _ntags; ++i) {
+        for (size_t j = 0; j < ARRAY_SIZE(_pl[i]); ++j) {
+            _pl[i][j].stop();
+        }
     }
     // Interrupt blocking operations.
     for (size_t i = 0; i < _workers.size(); ++i) {
@@ -246,6 +465,7 @@ TaskControl::~TaskControl() {
     // NOTE: g_task_control is not destructed now because the situation
     //       is extremely racy.
     delete _pending_time.exchange(NULL, butil::memory_order_relaxed);
+    delete _sched_latency.exchange(NULL, butil::memory_order_relaxed);
     _worker_usage_second.hide();
     _switch_per_second.hide();
     _signal_per_second.hide();
@@ -255,6 +475,51 @@ TaskControl::~TaskControl() {
 
     free(_groups);
     _groups = NULL;
+    for (int i = 0; i < BTHREAD_MAX_TAG_NUM; ++i) {
+        free(_tagged_groups[i]);
+        _tagged_groups[i] = NULL;
+    }
+    for (int i = 0; i < butil::MAX_NUMA_NODE_NUM; ++i) {
+        free(_numa_groups[i]);
+        _numa_groups[i] = NULL;
+    }
+}
+
+// Append `g' to groups[0...*ngroup-1], must be called with
+// _modify_group_mutex locked.
+static void add_to_groups(TaskGroup** groups, butil::atomic<size_t>* ngroup,
+                          TaskGroup* g) {
+    const size_t n = ngroup->load(butil::memory_order_relaxed);
+    if (n < (size_t)BTHREAD_MAX_CONCURRENCY) {
+        groups[n] = g;
+        ngroup->store(n + 1, butil::memory_order_release);
+    }
+}
+
+// Remove `g' from groups[0...*ngroup-1], must be called with
+// _modify_group_mutex locked. Returns true if `g' was found.
+static bool remove_from_groups(TaskGroup** groups,
+                               butil::atomic<size_t>* ngroup, TaskGroup* g) {
+    const size_t n = ngroup->load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < n; ++i) {
+        if (groups[i] == g) {
+            // No need for atomic_thread_fence because lock did it.
+            groups[i] = groups[n - 1];
+            // Change ngroup and keep groups unchanged at last so that:
+            //  - If steal_task sees the newest ngroup, it would not touch
+            //    groups[n - 1]
+            //  - If steal_task sees old ngroup and is still iterating on
+            //    groups, it would not miss groups[n - 1] which was
+            //    swapped to groups[i]. Although adding new group would
+            //    overwrite it, since we do signal_task in _add_group(),
+            //    we think the pending tasks of groups[n - 1] would
+            //    not miss.
+            ngroup->store(n - 1, butil::memory_order_release);
+            //groups[n - 1] = NULL;
+            return true;
+        }
+    }
+    return false;
 }
 
 int TaskControl::_add_group(TaskGroup* g) {
@@ -265,15 +530,16 @@ int TaskControl::_add_group(TaskGroup* g) {
     if (_stop) {
         return -1;
     }
-    size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
-    if (ngroup < (size_t)BTHREAD_MAX_CONCURRENCY) {
-        _groups[ngroup] = g;
-        _ngroup.store(ngroup + 1, butil::memory_order_release);
+    add_to_groups(_groups, &_ngroup, g);
+    add_to_groups(_tagged_groups[g->_tag], &_tagged_ngroup[g->_tag], g);
+    if (_numa_aware && g->_numa_node >= 0) {
+        add_to_groups(_numa_groups[g->_numa_node],
+                      &_numa_ngroup[g->_numa_node], g);
     }
     mu.unlock();
-    // See the comments in _destroy_group
+    // See the comments in remove_from_groups
     // TODO: Not needed anymore since non-worker pthread cannot have TaskGroup
-    signal_task(65536);
+    signal_task(65536, g->_tag);
     return 0;
 }
 
@@ -294,25 +560,17 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     bool erased = false;
     {
         BAIDU_SCOPED_LOCK(_modify_group_mutex);
-        const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
-        for (size_t i = 0; i < ngroup; ++i) {
-            if (_groups[i] == g) {
-                // No need for atomic_thread_fence because lock did it.
-                _groups[i] = _groups[ngroup - 1];
-                // Change _ngroup and keep _groups unchanged at last so that:
-                //  - If steal_task sees the newest _ngroup, it would not touch
-                //    _groups[ngroup -1]
-                //  - If steal_task sees old _ngroup and is still iterating on
-                //    _groups, it would not miss _groups[ngroup - 1] which was 
-                //    swapped to _groups[i]. Although adding new group would
-                //    overwrite it, since we do signal_task in _add_group(),
-                //    we think the pending tasks of _groups[ngroup - 1] would
-                //    not miss.
-                _ngroup.store(ngroup - 1, butil::memory_order_release);
-                //_groups[ngroup - 1] = NULL;
-                erased = true;
-                break;
-            }
+        erased = remove_from_groups(_groups, &_ngroup, g);
+        remove_from_groups(_tagged_groups[g->_tag], &_tagged_ngroup[g->_tag], g);
+        if (_numa_aware && g->_numa_node >= 0) {
+            remove_from_groups(_numa_groups[g->_numa_node],
+                               &_numa_ngroup[g->_numa_node], g);
+        }
+        if (erased) {
+            _destroyed_cputime_ns += g->_cumulated_cputime_ns;
+            _destroyed_nswitch += g->_nswitch;
+            _destroyed_nsignaled += g->_nsignaled +
+                g->_remote_nsignaled.load(butil::memory_order_relaxed);
         }
     }
 
@@ -329,22 +587,153 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     return 0;
 }
 
-bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
-    // 1: Acquiring fence is paired with releasing fence in _add_group to
-    // avoid accessing uninitialized slot of _groups.
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire/*1*/);
-    if (0 == ngroup) {
-        return false;
+int TaskControl::remove_workers(int num, bthread_tag_t tag) {
+    if (num <= 0) {
+        return 0;
+    }
+    // Workers just created may not add their groups yet, wait for them so
+    // that they can be retired as well.
+    for (int i = 0; i < 1000; ++i) {
+        bool all_added = true;
+        for (int t = 0; t < _ntags; ++t) {
+            if ((tag == BTHREAD_TAG_INVALID || tag == t) &&
+                _tagged_ngroup[t].load(butil::memory_order_acquire) <
+                (size_t)_tagged_concurrency[t].load(butil::memory_order_acquire)) {
+                all_added = false;
+            }
+        }
+        if (all_added) {
+            break;
+        }
+        usleep(1000);
+    }
+    int nremoved = 0;
+    bool tag_changed[BTHREAD_MAX_TAG_NUM] = { false };
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        if (_stop) {
+            return 0;
+        }
+        for (; nremoved < num; ++nremoved) {
+            bthread_tag_t worker_tag = tag;
+            if (worker_tag == BTHREAD_TAG_INVALID) {
+                worker_tag = 0;
+                for (int i = 1; i < _ntags; ++i) {
+                    if (_tagged_ngroup[i].load(butil::memory_order_relaxed) >
+                        _tagged_ngroup[worker_tag].load(
+                            butil::memory_order_relaxed)) {
+                        worker_tag = i;
+                    }
+                }
+            }
+            const size_t ngroup =
+                _tagged_ngroup[worker_tag].load(butil::memory_order_relaxed);
+            if (ngroup <= 1) {
+                break;
+            }
+            // Retire the latest worker.
+            TaskGroup* g = _tagged_groups[worker_tag][ngroup - 1];
+            // Stop others from stealing tasks of `g' or choosing it to run
+            // new tasks. `g' is still in _groups to be counted in statistics
+            // until the worker quits.
+            remove_from_groups(_tagged_groups[worker_tag],
+                               &_tagged_ngroup[worker_tag], g);
+            if (_numa_aware && g->_numa_node >= 0) {
+                remove_from_groups(_numa_groups[g->_numa_node],
+                                   &_numa_ngroup[g->_numa_node], g);
+            }
+            g->_retired.store(true, butil::memory_order_relaxed);
+            for (size_t i = 0; i < _workers.size(); ++i) {
+                if (pthread_equal(_workers[i], g->_worker_thread)) {
+                    _workers.erase(_workers.begin() + i);
+                    break;
+                }
+            }
+            _tagged_concurrency[worker_tag].fetch_sub(
+                1, butil::memory_order_release);
+            _concurrency.fetch_sub(1, butil::memory_order_release);
+            tag_changed[worker_tag] = true;
+        }
+        _nretired.fetch_add(nremoved, butil::memory_order_release);
+    }
+    // Wake up parked workers to notice the retirement.
+    for (int i = 0; i < _ntags; ++i) {
+        if (tag_changed[i]) {
+            for (size_t j = 0; j < ARRAY_SIZE(_pl[i]); ++j) {
+                _pl[i][j].signal(BTHREAD_MAX_CONCURRENCY);
+            }
+        }
+    }
+    return nremoved;
+}
+
+bool TaskControl::is_active_group(const TaskGroup* g) {
+    BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < ngroup; ++i) {
+        if (_groups[i] == g) {
+            return !g->retired();
+        }
+    }
+    return false;
+}
+
+void TaskControl::adjust_concurrency_periodically(void* arg) {
+    TaskControl* c = static_cast<TaskControl*>(arg);
+    c->adjust_concurrency();
+    get_global_timer_thread()->schedule(
+        adjust_concurrency_periodically, c,
+        butil::seconds_from_now(
+            std::max(FLAGS_bthread_concurrency_adjust_interval, 1)));
+}
+
+void TaskControl::adjust_concurrency() {
+    const int64_t now_us = butil::monotonic_time_us();
+    const double worker_time = get_cumulated_worker_time();
+    const int64_t last_us = _last_adjust_us;
+    const double last_worker_time = _last_worker_time;
+    _last_adjust_us = now_us;
+    _last_worker_time = worker_time;
+    if (last_us == 0 || now_us <= last_us ||
+        FLAGS_bthread_concurrency_adjust_interval <= 0 ||
+        FLAGS_bthread_min_concurrency <= 0) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(g_task_control_mutex);
+    const int n = _concurrency.load(butil::memory_order_relaxed);
+    if (_stop || n <= 0) {
+        return;
     }
+    // Average usage of workers in the last interval. At most one worker is
+    // added or retired in each interval to bound creations and quits of
+    // threads.
+    const double usage = (worker_time - last_worker_time) * 1000000.0 /
+        (now_us - last_us) / n;
+    if (usage > FLAGS_bthread_worker_high_usage) {
+        if (n < FLAGS_bthread_concurrency) {
+            add_workers(1);
+        }
+    } else if (usage < FLAGS_bthread_worker_low_usage &&
+               n > FLAGS_bthread_min_concurrency &&
+               // Don't retire a worker if others would be busy enough to
+               // add it back, which makes the concurrency oscillate.
+               usage * n / (n - 1) < FLAGS_bthread_worker_high_usage) {
+        remove_workers(1);
+    }
+}
 
+bool TaskControl::steal_task_from(TaskGroup* const* groups, size_t ngroup,
+                                  bthread_t* tid, size_t* seed, size_t offset,
+                                  bthread_tag_t tag, int skipped_node) {
     // NOTE: Don't return inside `for' iteration since we need to update |seed|
     bool stolen = false;
     size_t s = *seed;
     for (size_t i = 0; i < ngroup; ++i, s += offset) {
-        TaskGroup* g = _groups[s % ngroup];
+        TaskGroup* g = groups[s % ngroup];
         // g is possibly NULL because of concurrent _destroy_group
-        if (g) {
-            if (g->_rq.steal(tid)) {
+        if (g && g->_tag == tag &&
+            (skipped_node < 0 || g->_numa_node != skipped_node)) {
+            if (g->_high_rq.steal(tid) || g->_rq.steal(tid)) {
                 stolen = true;
                 break;
             }
@@ -358,7 +747,38 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     return stolen;
 }
 
-void TaskControl::signal_task(int num_task) {
+bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                             bthread_tag_t tag, int numa_node) {
+    if (_numa_aware && numa_node >= 0) {
+        // Siblings on the same node share caches and memory, steal from
+        // them first.
+        const size_t nsibling =
+            _numa_ngroup[numa_node].load(butil::memory_order_acquire);
+        if (nsibling != 0 &&
+            steal_task_from(_numa_groups[numa_node], nsibling,
+                            tid, seed, offset, tag, -1)) {
+            return true;
+        }
+    }
+    // Groups of other tags are never stolen.
+    // 1: Acquiring fence is paired with releasing fence in _add_group to
+    // avoid accessing uninitialized slot of _tagged_groups.
+    TaskGroup* const* groups = _tagged_groups[tag];
+    const size_t ngroup = _tagged_ngroup[tag].load(butil::memory_order_acquire/*1*/);
+    if (0 == ngroup) {
+        return false;
+    }
+    if (!_numa_aware || numa_node < 0) {
+        return steal_task_from(groups, ngroup, tid, seed, offset, tag, -1);
+    }
+    if (steal_task_from(groups, ngroup, tid, seed, offset, tag, numa_node)) {
+        _cross_node_steals << 1;
+        return true;
+    }
+    return false;
+}
+
+void TaskControl::signal_task(int num_task, bthread_tag_t tag) {
     if (num_task <= 0) {
         return;
     }
@@ -369,23 +789,44 @@ void TaskControl::signal_task(int num_task) {
     if (num_task > 2) {
         num_task = 2;
     }
+    const int nsignal = num_task;
+    ParkingLot* const tagged_pl = _pl[tag];
     int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM;
-    num_task -= _pl[start_index].signal(1);
-    if (num_task > 0) {
-        for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
-            if (++start_index >= PARKING_LOT_NUM) {
-                start_index = 0;
+    if (!_numa_aware) {
+        num_task -= tagged_pl[start_index].signal(1);
+        if (num_task > 0) {
+            for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
+                if (++start_index >= PARKING_LOT_NUM) {
+                    start_index = 0;
+                }
+                num_task -= tagged_pl[start_index].signal(1);
+            }
+        }
+    } else {
+        // Wake up workers on the node of caller first, which are likely
+        // to steal the tasks from caller without crossing nodes.
+        TaskGroup* g = tls_task_group;
+        const int nnode = butil::numa_node_num();
+        const int start_node = ((g && g->_numa_node >= 0) ? g->_numa_node :
+                                butil::current_numa_node());
+        for (int n = 0; n < nnode && num_task > 0; ++n) {
+            ParkingLot* pl =
+                tagged_pl + ((start_node + n) % nnode) * PARKING_LOT_NUM;
+            for (int i = 0; i < PARKING_LOT_NUM && num_task > 0; ++i) {
+                num_task -= pl[(start_index + i) % PARKING_LOT_NUM].signal(1);
             }
-            num_task -= _pl[start_index].signal(1);
         }
     }
+    if (num_task != nsignal) {
+        _futex_wakes << (nsignal - num_task);
+    }
     if (num_task > 0 &&
         FLAGS_bthread_min_concurrency > 0 &&    // test min_concurrency for performance
         _concurrency.load(butil::memory_order_relaxed) < FLAGS_bthread_concurrency) {
         // TODO: Reduce this lock
         BAIDU_SCOPED_LOCK(g_task_control_mutex);
         if (_concurrency.load(butil::memory_order_acquire) < FLAGS_bthread_concurrency) {
-            add_workers(1);
+            add_workers(1, tag);
         }
     }
 }
@@ -398,7 +839,8 @@ void TaskControl::print_rq_sizes(std::ostream& os) {
         // ngroup > _ngroup: nums[_ngroup ... ngroup-1] = 0
         // ngroup < _ngroup: just ignore _groups[_ngroup ... ngroup-1]
         for (size_t i = 0; i < ngroup; ++i) {
-            nums[i] = (_groups[i] ? _groups[i]->_rq.volatile_size() : 0);
+            nums[i] = (_groups[i] ? _groups[i]->_rq.volatile_size() +
+                       _groups[i]->_high_rq.volatile_size() : 0);
         }
     }
     for (size_t i = 0; i < ngroup; ++i) {
@@ -407,8 +849,8 @@ void TaskControl::print_rq_sizes(std::ostream& os) {
 }
 
 double TaskControl::get_cumulated_worker_time() {
-    int64_t cputime_ns = 0;
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    int64_t cputime_ns = _destroyed_cputime_ns;
     const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
     for (size_t i = 0; i < ngroup; ++i) {
         if (_groups[i]) {
@@ -419,8 +861,8 @@ double TaskControl::get_cumulated_worker_time() {
 }
 
 int64_t TaskControl::get_cumulated_switch_count() {
-    int64_t c = 0;
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    int64_t c = _destroyed_nswitch;
     const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
     for (size_t i = 0; i < ngroup; ++i) {
         if (_groups[i]) {
@@ -431,13 +873,14 @@ int64_t TaskControl::get_cumulated_switch_count() {
 }
 
 int64_t TaskControl::get_cumulated_signal_count() {
-    int64_t c = 0;
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    int64_t c = _destroyed_nsignaled;
     const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
     for (size_t i = 0; i < ngroup; ++i) {
         TaskGroup* g = _groups[i];
         if (g) {
-            c += g->_nsignaled + g->_remote_nsignaled;
+            c += g->_nsignaled +
+                g->_remote_nsignaled.load(butil::memory_order_relaxed);
         }
     }
     return c;
@@ -459,4 +902,21 @@ bvar::LatencyRecorder* TaskControl::create_exposed_pending_time() {
     return pt;
 }
 
+bvar::LatencyRecorder* TaskControl::create_exposed_sched_latency() {
+    bool is_creator = false;
+    _pending_time_mutex.lock();
+    bvar::LatencyRecorder* lr = _sched_latency.load(butil::memory_order_consume);
+    if (!lr) {
+        lr = new bvar::LatencyRecorder;
+        _sched_latency.store(lr, butil::memory_order_release);
+        is_creator = true;
+    }
+    _pending_time_mutex.unlock();
+    if (is_creator) {
+        // bthread_sched_latency, bthread_sched_qps ...
+        lr->expose("bthread_sched");
+    }
+    return lr;
+}
+
 }  // namespace bthread
@@ -27,6 +27,7 @@
 #include "bvar/bvar.h"                          // bvar::PassiveStatus
 #include "bthread/task_meta.h"                  // TaskMeta
 #include "butil/resource_pool.h"                 // ResourcePool
+#include "butil/numa.h"                          // MAX_NUMA_NODE_NUM
 #include "bthread/work_stealing_queue.h"        // WorkStealingQueue
 #include "bthread/parking_lot.h"
 
@@ -42,17 +43,22 @@ public:
     TaskControl();
     ~TaskControl();
 
-    // Must be called before using. `nconcurrency' is # of worker pthreads.
+    // Must be called before using. `nconcurrency' is # of worker pthreads,
+    // which are assigned to tags evenly.
     int init(int nconcurrency);
     
-    // Create a TaskGroup in this control.
-    TaskGroup* create_group();
+    // Create a TaskGroup of `tag' in this control.
+    TaskGroup* create_group(bthread_tag_t tag);
 
-    // Steal a task from a "random" group.
-    bool steal_task(bthread_t* tid, size_t* seed, size_t offset);
+    // Steal a task from a "random" group of `tag'. If `numa_node' is
+    // non-negative, groups on the same node are tried before groups on
+    // other nodes.
+    bool steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                    bthread_tag_t tag, int numa_node);
 
-    // Tell other groups that `n' tasks was just added to caller's runqueue
-    void signal_task(int num_task);
+    // Tell other groups of `tag' that `n' tasks was just added to caller's
+    // runqueue
+    void signal_task(int num_task, bthread_tag_t tag);
 
     // Stop and join worker threads in TaskControl.
     void stop_and_join();
@@ -61,21 +67,59 @@ public:
     int concurrency() const 
     { return _concurrency.load(butil::memory_order_acquire); }
 
+    // Get # of worker threads of `tag'.
+    int concurrency(bthread_tag_t tag) const
+    { return _tagged_concurrency[tag].load(butil::memory_order_acquire); }
+
+    // Number of tags, namely -task_group_ntags when this control was created.
+    int ntags() const { return _ntags; }
+
     void print_rq_sizes(std::ostream& os);
 
     double get_cumulated_worker_time();
     int64_t get_cumulated_switch_count();
     int64_t get_cumulated_signal_count();
 
-    // [Not thread safe] Add more worker threads.
+    // [Not thread safe] Add more worker threads of `tag', or of all tags in
+    // turn if `tag' is BTHREAD_TAG_INVALID.
     // Return the number of workers actually added, which may be less then |num|
-    int add_workers(int num);
-
-    // Choose one TaskGroup (randomly right now).
+    int add_workers(int num, bthread_tag_t tag = BTHREAD_TAG_INVALID);
+
+    // [Not thread safe] Retire worker threads of `tag', or of tags with most
+    // workers if `tag' is BTHREAD_TAG_INVALID. Retired workers stop stealing
+    // tasks from others, run tasks left in their runqueues and quit. Workers
+    // occupied by bthreads that never yield (e.g. blocking syscalls) quit
+    // after the bthreads yield. Each tag keeps at least one worker.
+    // Return the number of workers actually retired, which may be less than
+    // |num|
+    int remove_workers(int num, bthread_tag_t tag = BTHREAD_TAG_INVALID);
+
+    // Number of workers retired by remove_workers() so far.
+    int64_t nretired() const
+    { return _nretired.load(butil::memory_order_acquire); }
+
+    // True if `g' is a group in this control and not retired. `g' does not
+    // have to point to a valid TaskGroup.
+    bool is_active_group(const TaskGroup* g);
+
+    // Choose one TaskGroup of `tag' (randomly right now).
     // If this method is called after init(), it never returns NULL.
-    TaskGroup* choose_one_group();
+    TaskGroup* choose_one_group(bthread_tag_t tag = BTHREAD_TAG_DEFAULT);
+
+    // True if workers are pinned to cpus and scheduled by NUMA nodes,
+    // see -bthread_numa_aware.
+    bool numa_aware() const { return _numa_aware; }
 
 private:
+    // Pin calling worker to next cpu in _worker_cpus.
+    void pin_worker();
+
+    // Steal a task from groups of `tag' in groups[0...ngroup-1], skipping
+    // groups on `skipped_node' if it's non-negative.
+    static bool steal_task_from(TaskGroup* const* groups, size_t ngroup,
+                                bthread_t* tid, size_t* seed, size_t offset,
+                                bthread_tag_t tag, int skipped_node);
+
     // Add/Remove a TaskGroup.
     // Returns 0 on success, -1 otherwise.
     int _add_group(TaskGroup*);
@@ -83,33 +127,86 @@ private:
 
     static void delete_task_group(void* arg);
 
-    static void* worker_thread(void* task_control);
+    // Grow or shrink workers according to their usage, see
+    // -bthread_concurrency_adjust_interval.
+    static void adjust_concurrency_periodically(void* arg);
+    void adjust_concurrency();
+
+    static void* worker_thread(void* worker_args);
+    // Create a worker pthread of `tag'. Returns 0 on success, errno otherwise.
+    int start_worker(pthread_t* th, bthread_tag_t tag);
 
     bvar::LatencyRecorder& exposed_pending_time();
     bvar::LatencyRecorder* create_exposed_pending_time();
+    bvar::LatencyRecorder& exposed_sched_latency();
+    bvar::LatencyRecorder* create_exposed_sched_latency();
 
+    // All groups.
     butil::atomic<size_t> _ngroup;
     TaskGroup** _groups;
     butil::Mutex _modify_group_mutex;
 
+    // Groups of each tag, maintained in the same way as _groups.
+    int _ntags;
+    butil::atomic<size_t> _tagged_ngroup[BTHREAD_MAX_TAG_NUM];
+    TaskGroup** _tagged_groups[BTHREAD_MAX_TAG_NUM];
+    butil::atomic<int> _tagged_concurrency[BTHREAD_MAX_TAG_NUM];
+    // Tag of next worker added by add_workers(n, BTHREAD_TAG_INVALID)
+    int _next_worker_tag;
+
+    // Groups of each NUMA node, only maintained when _numa_aware is true.
+    bool _numa_aware;
+    butil::atomic<size_t> _numa_ngroup[butil::MAX_NUMA_NODE_NUM];
+    TaskGroup** _numa_groups[butil::MAX_NUMA_NODE_NUM];
+    // Cpus to pin workers on, interleaved by NUMA nodes.
+    std::vector<int> _worker_cpus;
+    butil::atomic<size_t> _next_worker_index;
+    bvar::Adder<int64_t> _cross_node_steals;
+
     bool _stop;
     butil::atomic<int> _concurrency;
     std::vector<pthread_t> _workers;
+    butil::atomic<int64_t> _nretired;
+    // Statistics of destroyed groups, which are still counted in
+    // get_cumulated_*().
+    int64_t _destroyed_cputime_ns;
+    int64_t _destroyed_nswitch;
+    int64_t _destroyed_nsignaled;
+    // Sampled by adjust_concurrency().
+    int64_t _last_adjust_us;
+    double _last_worker_time;
 
     bvar::Adder<int64_t> _nworkers;
     butil::Mutex _pending_time_mutex;
     butil::atomic<bvar::LatencyRecorder*> _pending_time;
+    butil::atomic<bvar::LatencyRecorder*> _sched_latency;
     bvar::PassiveStatus<double> _cumulated_worker_time;
     bvar::PerSecond<bvar::PassiveStatus<double> > _worker_usage_second;
     bvar::PassiveStatus<int64_t> _cumulated_switch_count;
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > _switch_per_second;
     bvar::PassiveStatus<int64_t> _cumulated_signal_count;
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > _signal_per_second;
+    bvar::Adder<int64_t> _futex_wakes;
+    bvar::PerSecond<bvar::Adder<int64_t> > _futex_wake_per_second;
+    // Times that idle workers found tasks by spinning or parked after
+    // spinning, see TaskGroup::spin_for_task().
+    bvar::Adder<int64_t> _spin_hits;
+    bvar::Adder<int64_t> _spin_misses;
+    // Times that runqueues of workers were grown, or were full and can't
+    // grow anymore, see TaskGroup::push_rq().
+    bvar::Adder<int64_t> _rq_grows;
+    bvar::Adder<int64_t> _rq_fulls;
     bvar::PassiveStatus<std::string> _status;
     bvar::Adder<int64_t> _nbthreads;
+    bvar::PassiveStatus<std::string> _task_meta_numa_blocks;
+    bvar::PassiveStatus<int64_t> _task_meta_remote_free_chunks;
 
+    // Parking lots of NUMA node N in tag T are _pl[T][N * PARKING_LOT_NUM,
+    // (N+1) * PARKING_LOT_NUM), only node 0 is used when _numa_aware is false.
+    // Workers of different tags never park in the same lot, so that
+    // signal_task() only wakes up workers of the tag.
     static const int PARKING_LOT_NUM = 4;
-    ParkingLot _pl[PARKING_LOT_NUM];
+    ParkingLot _pl[BTHREAD_MAX_TAG_NUM][PARKING_LOT_NUM * butil::MAX_NUMA_NODE_NUM];
 };
 
 inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
@@ -120,6 +217,14 @@ inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
     return *pt;
 }
 
+inline bvar::LatencyRecorder& TaskControl::exposed_sched_latency() {
+    bvar::LatencyRecorder* lr = _sched_latency.load(butil::memory_order_consume);
+    if (!lr) {
+        lr = create_exposed_sched_latency();
+    }
+    return *lr;
+}
+
 }  // namespace bthread
 
 #endif  // BTHREAD_TASK_CONTROL_H
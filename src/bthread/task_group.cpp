@@ -18,11 +18,14 @@
 
 #include <sys/types.h>
 #include <stddef.h>                         // size_t
+#include <sched.h>                          // sched_yield
+#include <algorithm>                        // std::min
 #include <gflags/gflags.h>
 #include "butil/compat.h"                   // OS_MACOSX
 #include "butil/macros.h"                   // ARRAY_SIZE
 #include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
 #include "butil/fast_rand.h"
+#include "butil/numa.h"                     // current_numa_node
 #include "butil/unique_ptr.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h" // fmix64
 #include "bthread/errno.h"                  // ESTOP
@@ -34,10 +37,12 @@
 #include "bthread/timer_thread.h"
 #include "bthread/errno.h"
 
+DECLARE_int32(task_group_yield_before_idle);
+
 namespace bthread {
 
 static const bthread_attr_t BTHREAD_ATTR_TASKGROUP = {
-    BTHREAD_STACKTYPE_UNKNOWN, 0, NULL };
+    BTHREAD_STACKTYPE_UNKNOWN, 0, NULL, BTHREAD_TAG_INVALID };
 
 static bool pass_bool(const char*, bool) { return true; }
 
@@ -54,17 +59,44 @@ const bool ALLOW_UNUSED dummy_show_per_worker_usage_in_vars =
     ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_per_worker_usage_in_vars,
                                     pass_bool);
 
+DEFINE_bool(show_bthread_sched_latency_in_vars, false,
+            "When this flag is on, the time that bthreads waited in runqueues "
+            "before running will be recorded and shown in /vars, per worker "
+            "as well if -show_per_worker_usage_in_vars is on");
+const bool ALLOW_UNUSED dummy_show_bthread_sched_latency_in_vars =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_bthread_sched_latency_in_vars,
+                                    pass_bool);
+
+static bool pass_int32(const char*, int32_t) { return true; }
+
+DEFINE_int32(bthread_high_priority_weight, 0,
+             "Workers pick one bthread of normal priority after picking so "
+             "many bthreads created with BTHREAD_PRIORITY_HIGH in a row, "
+             "0 means that bthreads of high priority are always picked first");
+const bool ALLOW_UNUSED dummy_bthread_high_priority_weight =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_high_priority_weight,
+                                    pass_int32);
+
+DEFINE_int32(bthread_max_spin_us, 20,
+             "Idle workers spin for tasks at most so many microseconds before "
+             "parking if they waited for tasks shorter than this on average "
+             "recently, 0 to disable");
+const bool ALLOW_UNUSED dummy_bthread_max_spin_us =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_max_spin_us,
+                                    pass_int32);
+
 __thread TaskGroup* tls_task_group = NULL;
 __thread LocalStorage tls_bls = BTHREAD_LOCAL_STORAGE_INITIALIZER;
 
 // defined in bthread/key.cpp
 extern void return_keytable(bthread_keytable_pool_t*, KeyTable*);
+extern void run_fast_slot_dtors(void** slots);
 
 // [Hacky] This is a special TLS set by bthread-rpc privately... to save
 // overhead of creation keytable, may be removed later.
 BAIDU_THREAD_LOCAL void* tls_unique_user_ptr = NULL;
 
-const TaskStatistics EMPTY_STAT = { 0, 0 };
+const TaskStatistics EMPTY_STAT = { 0, 0, 0, 0 };
 
 const size_t OFFSET_TABLE[] = {
 #include "bthread/offset_inl.list"
@@ -109,27 +141,95 @@ bool TaskGroup::is_stopped(bthread_t tid) {
     return true;
 }
 
+bool TaskGroup::spin_for_task(bthread_t* tid, int64_t idle_begin_ns) {
+    bool spun = false;
+    const int64_t max_spin_ns = FLAGS_bthread_max_spin_us * 1000L;
+    if (max_spin_ns > 0 && _avg_idle_ns <= max_spin_ns) {
+        // Most tasks arrive within twice of the average idle period.
+        const int64_t end_ns = idle_begin_ns +
+            std::min(max_spin_ns, 2 * _avg_idle_ns + 1000);
+        spun = true;
+        do {
+            if (steal_task(tid)) {
+                _control->_spin_hits << 1;
+                return true;
+            }
+            for (int i = 0; i < 8; ++i) {
+                cpu_relax();
+            }
+        } while (butil::cpuwide_time_ns() < end_ns);
+    }
+    for (int i = 0; i < FLAGS_task_group_yield_before_idle; ++i) {
+        sched_yield();
+        spun = true;
+        if (steal_task(tid)) {
+            _control->_spin_hits << 1;
+            return true;
+        }
+    }
+    if (spun) {
+        _control->_spin_misses << 1;
+    }
+    return false;
+}
+
 bool TaskGroup::wait_task(bthread_t* tid) {
-    do {
+    if (retired()) {
+        return pop_left_task(tid);
+    }
+    const int64_t idle_begin_ns = butil::cpuwide_time_ns();
+    bool found = spin_for_task(tid, idle_begin_ns);
+    while (!found) {
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         if (_last_pl_state.stopped()) {
             return false;
         }
-        _pl->wait(_last_pl_state);
-        if (steal_task(tid)) {
-            return true;
+        // _last_pl_state was saved before checking the retirement, which is
+        // followed by signalling all parking lots in remove_workers(), so
+        // wait() returns if the worker is retired after the check.
+        if (retired()) {
+            return pop_left_task(tid);
         }
+        _pl->wait(_last_pl_state);
+        found = steal_task(tid);
 #else
         const ParkingLot::State st = _pl->get_state();
         if (st.stopped()) {
             return false;
         }
-        if (steal_task(tid)) {
-            return true;
+        if (retired()) {
+            return pop_left_task(tid);
+        }
+        found = steal_task(tid);
+        if (!found) {
+            _pl->wait(st);
         }
-        _pl->wait(st);
 #endif
-    } while (true);
+    }
+    // Cap the sample so that a long idle period does not disable spinning
+    // for too long after the load rises again.
+    const int64_t max_sample_ns = FLAGS_bthread_max_spin_us * 2000L;
+    const int64_t idle_ns = std::min(
+        butil::cpuwide_time_ns() - idle_begin_ns, max_sample_ns);
+    _avg_idle_ns = (_avg_idle_ns * 7 + idle_ns) / 8;
+    return true;
+}
+
+bool TaskGroup::pop_left_task(bthread_t* tid) {
+    // Storing _retired again by this worker (rather than the one calling
+    // remove_workers()) and the fence pair with the fence in
+    // ready_to_run_remote(): either the pusher sees _retired and forwards
+    // the task, or the task is popped here.
+    _retired.store(true, butil::memory_order_relaxed);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    return pop_rq(tid) || _remote_rq.pop(tid);
+}
+
+void TaskGroup::forward_remote_tasks() {
+    bthread_t tid;
+    while (_remote_rq.pop(&tid)) {
+        _control->choose_one_group(_tag)->ready_to_run_remote(tid);
+    }
 }
 
 static double get_cumulated_cputime_from_this(void* arg) {
@@ -140,6 +240,7 @@ void TaskGroup::run_main_task() {
     bvar::PassiveStatus<double> cumulated_cputime(
         get_cumulated_cputime_from_this, this);
     std::unique_ptr<bvar::PerSecond<bvar::PassiveStatus<double> > > usage_bvar;
+    std::unique_ptr<bvar::LatencyRecorder> sched_latency_bvar;
     
     TaskGroup* dummy = this;
     bthread_t tid;
@@ -162,13 +263,28 @@ void TaskGroup::run_main_task() {
             usage_bvar.reset(new bvar::PerSecond<bvar::PassiveStatus<double> >
                              (name, &cumulated_cputime, 1));
         }
+        if (FLAGS_show_per_worker_usage_in_vars &&
+            FLAGS_show_bthread_sched_latency_in_vars && !sched_latency_bvar) {
+            char name[48];
+#if defined(OS_MACOSX)
+            snprintf(name, sizeof(name), "bthread_worker_sched_%" PRIu64,
+                     pthread_numeric_id());
+#else
+            snprintf(name, sizeof(name), "bthread_worker_sched_%ld",
+                     (long)syscall(SYS_gettid));
+#endif
+            // Exposed as bthread_worker_sched_<tid>_latency etc.
+            sched_latency_bvar.reset(new bvar::LatencyRecorder(name));
+            _sched_latency = sched_latency_bvar.get();
+        }
     }
+    _sched_latency = NULL;
     // stop_main_task() was called.
     // Don't forget to add elapse of last wait_task.
     current_task()->stat.cputime_ns += butil::cpuwide_time_ns() - _last_run_ns;
 }
 
-TaskGroup::TaskGroup(TaskControl* c)
+TaskGroup::TaskGroup(TaskControl* c, bthread_tag_t tag)
     :
 #ifndef NDEBUG
     _sched_recursive_guard(0),
@@ -182,15 +298,25 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _nswitch(0)
     , _last_context_remained(NULL)
     , _last_context_remained_arg(NULL)
+    , _tag(tag)
+    , _numa_node(c->numa_aware() ? butil::current_numa_node() : -1)
+    // Groups are created by TaskControl::worker_thread() in the worker.
+    , _worker_thread(pthread_self())
+    , _retired(false)
     , _pl(NULL) 
+    , _avg_idle_ns(0)
+    , _sched_latency(NULL)
     , _main_stack(NULL)
     , _main_tid(0)
+    , _nhigh_in_row(0)
     , _remote_num_nosignal(0)
     , _remote_nsignaled(0)
 {
     _steal_seed = butil::fast_rand();
     _steal_offset = OFFSET_TABLE[_steal_seed % ARRAY_SIZE(OFFSET_TABLE)];
-    _pl = &c->_pl[butil::fmix64(pthread_numeric_id()) % TaskControl::PARKING_LOT_NUM];
+    const int node = (_numa_node > 0 ? _numa_node : 0);
+    _pl = &c->_pl[tag][node * TaskControl::PARKING_LOT_NUM +
+                  butil::fmix64(pthread_numeric_id()) % TaskControl::PARKING_LOT_NUM];
     CHECK(c);
 }
 
@@ -204,11 +330,15 @@ TaskGroup::~TaskGroup() {
     }
 }
 
-int TaskGroup::init(size_t runqueue_capacity) {
-    if (_rq.init(runqueue_capacity) != 0) {
+int TaskGroup::init(size_t runqueue_capacity, size_t runqueue_max_capacity) {
+    if (_rq.init(runqueue_capacity, runqueue_max_capacity) != 0) {
         LOG(FATAL) << "Fail to init _rq";
         return -1;
     }
+    if (_high_rq.init(runqueue_capacity, runqueue_max_capacity) != 0) {
+        LOG(FATAL) << "Fail to init _high_rq";
+        return -1;
+    }
     if (_remote_rq.init(runqueue_capacity / 2) != 0) {
         LOG(FATAL) << "Fail to init _remote_rq";
         return -1;
@@ -239,7 +369,9 @@ int TaskGroup::init(size_t runqueue_capacity) {
     m->local_storage = tls_bls;
     m->cpuwide_start_ns = butil::cpuwide_time_ns();
     m->stat = EMPTY_STAT;
+    m->ready_ns = 0;
     m->attr = BTHREAD_ATTR_TASKGROUP;
+    m->attr.tag = _tag;
     m->tid = make_tid(*m->version_butex, slot);
     m->set_stack(stk);
 
@@ -315,7 +447,9 @@ void TaskGroup::task_runner(intptr_t skip_remained) {
 
         // Clean tls variables, must be done before changing version_butex
         // otherwise another thread just joined this thread may not see side
-        // effects of destructing tls variables.
+        // effects of destructing tls variables. Destructors of fast slots
+        // run first since they may use keys.
+        run_fast_slot_dtors(m->fast_slots);
         KeyTable* kt = m->local_storage.keytable;
         if (kt != NULL) {
             return_keytable(m->attr.keytable_pool, kt);
@@ -348,7 +482,8 @@ void TaskGroup::task_runner(intptr_t skip_remained) {
 
 void TaskGroup::_release_last_context(void* arg) {
     TaskMeta* m = static_cast<TaskMeta*>(arg);
-    if (m->stack_type() != STACK_TYPE_PTHREAD) {
+    if (m->stack_type() != STACK_TYPE_PTHREAD &&
+        m->stack_type() != STACK_TYPE_SHARED) {
         return_stack(m->release_stack()/*may be NULL*/);
     } else {
         // it's _main_stack, don't return.
@@ -380,9 +515,11 @@ int TaskGroup::start_foreground(TaskGroup** pg,
     m->arg = arg;
     CHECK(m->stack == NULL);
     m->attr = using_attr;
+    m->attr.tag = (*pg)->_tag;
     m->local_storage = LOCAL_STORAGE_INIT;
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
+    m->ready_ns = 0;
     m->tid = make_tid(*m->version_butex, slot);
     *th = m->tid;
     if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
@@ -435,9 +572,11 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     m->arg = arg;
     CHECK(m->stack == NULL);
     m->attr = using_attr;
+    m->attr.tag = _tag;
     m->local_storage = LOCAL_STORAGE_INIT;
     m->cpuwide_start_ns = start_ns;
     m->stat = EMPTY_STAT;
+    m->ready_ns = 0;
     m->tid = make_tid(*m->version_butex, slot);
     *th = m->tid;
     if (using_attr.flags & BTHREAD_LOG_START_AND_FINISH) {
@@ -506,18 +645,41 @@ TaskStatistics TaskGroup::main_stat() const {
     return m ? m->stat : EMPTY_STAT;
 }
 
-void TaskGroup::ending_sched(TaskGroup** pg) {
-    TaskGroup* g = *pg;
-    bthread_t next_tid = 0;
-    // Find next task to run, if none, switch to idle thread of the group.
+static inline bool pop_from(WorkStealingQueue<bthread_t>& rq, bthread_t* tid) {
 #ifndef BTHREAD_FAIR_WSQ
     // When BTHREAD_FAIR_WSQ is defined, profiling shows that cpu cost of
     // WSQ::steal() in example/multi_threaded_echo_c++ changes from 1.9%
     // to 2.9%
-    const bool popped = g->_rq.pop(&next_tid);
+    return rq.pop(tid);
 #else
-    const bool popped = g->_rq.steal(&next_tid);
+    return rq.steal(tid);
 #endif
+}
+
+bool TaskGroup::pop_rq(bthread_t* tid) {
+    const int weight = FLAGS_bthread_high_priority_weight;
+    if (weight <= 0 || _nhigh_in_row < weight) {
+        if (pop_from(_high_rq, tid)) {
+            ++_nhigh_in_row;
+            return true;
+        }
+        _nhigh_in_row = 0;
+        return pop_from(_rq, tid);
+    }
+    // Give normal tasks a chance.
+    if (pop_from(_rq, tid)) {
+        _nhigh_in_row = 0;
+        return true;
+    }
+    return pop_from(_high_rq, tid);
+}
+
+void TaskGroup::ending_sched(TaskGroup** pg) {
+    TaskGroup* g = *pg;
+    inspect_ended_stack(g->_cur_meta->stack);
+    bthread_t next_tid = 0;
+    // Find next task to run, if none, switch to idle thread of the group.
+    const bool popped = g->pop_rq(&next_tid);
     if (!popped && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
         next_tid = g->_main_tid;
@@ -535,11 +697,13 @@ void TaskGroup::ending_sched(TaskGroup** pg) {
             if (stk) {
                 next_meta->set_stack(stk);
             } else {
-                // stack_type is BTHREAD_STACKTYPE_PTHREAD or out of memory,
+                // stack_type is BTHREAD_STACKTYPE_PTHREAD/SHARED or out of memory,
                 // In latter case, attr is forced to be BTHREAD_STACKTYPE_PTHREAD.
                 // This basically means that if we can't allocate stack, run
                 // the task in pthread directly.
-                next_meta->attr.stack_type = BTHREAD_STACKTYPE_PTHREAD;
+                if (next_meta->stack_type() != STACK_TYPE_SHARED) {
+                    next_meta->attr.stack_type = BTHREAD_STACKTYPE_PTHREAD;
+                }
                 next_meta->set_stack(g->_main_stack);
             }
         }
@@ -551,11 +715,7 @@ void TaskGroup::sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
-#ifndef BTHREAD_FAIR_WSQ
-    const bool popped = g->_rq.pop(&next_tid);
-#else
-    const bool popped = g->_rq.steal(&next_tid);
-#endif
+    const bool popped = g->pop_rq(&next_tid);
     if (!popped && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
         next_tid = g->_main_tid;
@@ -585,9 +745,24 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta) {
     }
     ++cur_meta->stat.nswitch;
     ++ g->_nswitch;
+    if (next_meta->ready_ns != 0) {
+        const int64_t queue_ns = now - next_meta->ready_ns;
+        next_meta->ready_ns = 0;
+        next_meta->stat.queue_ns += queue_ns;
+        next_meta->stat.last_queue_ns = queue_ns;
+        if (FLAGS_show_bthread_sched_latency_in_vars) {
+            g->_control->exposed_sched_latency() << queue_ns / 1000L;
+            if (g->_sched_latency) {
+                *g->_sched_latency << queue_ns / 1000L;
+            }
+        }
+    }
     // Switch to the task
     if (__builtin_expect(next_meta != cur_meta, 1)) {
         g->_cur_meta = next_meta;
+        // Save the local storage which may be modified without syncing to
+        // TaskMeta, e.g. rpcz_parent_span and rpc_deadline_us.
+        cur_meta->local_storage = tls_bls;
         tls_bls = next_meta->local_storage;
 
         // Logging must be done after switching the local storage, since the logging lib 
@@ -651,7 +826,7 @@ void TaskGroup::ready_to_run(bthread_t tid, bool nosignal) {
         const int additional_signal = _num_nosignal;
         _num_nosignal = 0;
         _nsignaled += 1 + additional_signal;
-        _control->signal_task(1 + additional_signal);
+        _control->signal_task(1 + additional_signal, _tag);
     }
 }
 
@@ -660,41 +835,67 @@ void TaskGroup::flush_nosignal_tasks() {
     if (val) {
         _num_nosignal = 0;
         _nsignaled += val;
-        _control->signal_task(val);
+        _control->signal_task(val, _tag);
     }
 }
 
 void TaskGroup::ready_to_run_remote(bthread_t tid, bool nosignal) {
-    _remote_rq._mutex.lock();
-    while (!_remote_rq.push_locked(tid)) {
-        flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
+    TaskMeta* m = address_meta(tid);
+    const bool high_priority = (m->attr.flags & BTHREAD_PRIORITY_HIGH);
+    m->ready_ns = butil::cpuwide_time_ns();
+    while (!_remote_rq.push(tid, high_priority)) {
+        flush_nosignal_tasks_remote();
         LOG_EVERY_SECOND(ERROR) << "_remote_rq is full, capacity="
                                 << _remote_rq.capacity();
         ::usleep(1000);
-        _remote_rq._mutex.lock();
     }
     if (nosignal) {
-        ++_remote_num_nosignal;
-        _remote_rq._mutex.unlock();
+        _remote_num_nosignal.fetch_add(1, butil::memory_order_relaxed);
     } else {
-        const int additional_signal = _remote_num_nosignal;
-        _remote_num_nosignal = 0;
-        _remote_nsignaled += 1 + additional_signal;
-        _remote_rq._mutex.unlock();
-        _control->signal_task(1 + additional_signal);
+        const int additional_signal = _remote_num_nosignal.exchange(
+            0, butil::memory_order_relaxed);
+        _remote_nsignaled.fetch_add(1 + additional_signal,
+                                    butil::memory_order_relaxed);
+        _control->signal_task(1 + additional_signal, _tag);
+    }
+    // See comments in pop_left_task().
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (__builtin_expect(retired(), 0)) {
+        forward_remote_tasks();
     }
 }
 
-void TaskGroup::flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex) {
-    const int val = _remote_num_nosignal;
-    if (!val) {
-        locked_mutex.unlock();
+void TaskGroup::ready_to_run_remote_batch(const bthread_t* tids, size_t n) {
+    if (n == 0) {
         return;
     }
-    _remote_num_nosignal = 0;
-    _remote_nsignaled += val;
-    locked_mutex.unlock();
-    _control->signal_task(val);
+    const int64_t now_ns = butil::cpuwide_time_ns();
+    for (size_t i = 0; i < n; ++i) {
+        address_meta(tids[i])->ready_ns = now_ns;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        const bool high_priority =
+            (address_meta(tids[i])->attr.flags & BTHREAD_PRIORITY_HIGH);
+        while (!_remote_rq.push(tids[i], high_priority)) {
+            // Let workers consume pushed tasks.
+            _remote_num_nosignal.fetch_add(i, butil::memory_order_relaxed);
+            n -= i;
+            tids += i;
+            i = 0;
+            flush_nosignal_tasks_remote();
+            LOG_EVERY_SECOND(ERROR) << "_remote_rq is full, capacity="
+                                    << _remote_rq.capacity();
+            ::usleep(1000);
+        }
+    }
+    const int nsignal = (int)n + _remote_num_nosignal.exchange(
+        0, butil::memory_order_relaxed);
+    _remote_nsignaled.fetch_add(nsignal, butil::memory_order_relaxed);
+    _control->signal_task(nsignal, _tag);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (__builtin_expect(retired(), 0)) {
+        forward_remote_tasks();
+    }
 }
 
 void TaskGroup::ready_to_run_general(bthread_t tid, bool nosignal) {
@@ -725,13 +926,16 @@ struct SleepArgs {
     uint64_t timeout_us;
     bthread_t tid;
     TaskMeta* meta;
-    TaskGroup* group;
+    // Not the TaskGroup which may be retired and deleted before the timer
+    // expires.
+    TaskControl* control;
+    bthread_tag_t tag;
 };
 
 static void ready_to_run_from_timer_thread(void* arg) {
     CHECK(tls_task_group == NULL);
     const SleepArgs* e = static_cast<const SleepArgs*>(arg);
-    e->group->control()->choose_one_group()->ready_to_run_remote(e->tid);
+    e->control->choose_one_group(e->tag)->ready_to_run_remote(e->tid);
 }
 
 void TaskGroup::_add_sleep_event(void* void_args) {
@@ -739,7 +943,7 @@ void TaskGroup::_add_sleep_event(void* void_args) {
     // thread may be stolen by a worker immediately and the on-stack SleepArgs
     // will be gone.
     SleepArgs e = *static_cast<SleepArgs*>(void_args);
-    TaskGroup* g = e.group;
+    TaskGroup* g = tls_task_group;
     
     TimerThread::TaskId sleep_id;
     sleep_id = get_global_timer_thread()->schedule(
@@ -785,7 +989,8 @@ int TaskGroup::usleep(TaskGroup** pg, uint64_t timeout_us) {
     TaskGroup* g = *pg;
     // We have to schedule timer after we switched to next bthread otherwise
     // the timer may wake up(jump to) current still-running context.
-    SleepArgs e = { timeout_us, g->current_tid(), g->current_task(), g };
+    SleepArgs e = { timeout_us, g->current_tid(), g->current_task(),
+                    g->control(), g->tag() };
     g->set_remained(_add_sleep_event, &e);
     sched(pg);
     g = *pg;
@@ -868,13 +1073,17 @@ int TaskGroup::interrupt(bthread_t tid, TaskControl* c) {
     } else if (sleep_id != 0) {
         if (get_global_timer_thread()->unschedule(sleep_id) == 0) {
             bthread::TaskGroup* g = bthread::tls_task_group;
-            if (g) {
+            const bthread_tag_t tag = address_meta(tid)->attr.tag;
+            if (g && g->tag() == tag) {
                 g->ready_to_run(tid);
             } else {
+                if (g) {
+                    c = g->control();
+                }
                 if (!c) {
                     return EINVAL;
                 }
-                c->choose_one_group()->ready_to_run_remote(tid);
+                c->choose_one_group(tag)->ready_to_run_remote(tid);
             }
         }
     }
@@ -904,7 +1113,8 @@ void print_task(std::ostream& os, bthread_t tid) {
     bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
     bool has_tls = false;
     int64_t cpuwide_start_ns = 0;
-    TaskStatistics stat = {0, 0};
+    TaskStatistics stat = EMPTY_STAT;
+    int64_t ready_ns = 0;
     {
         BAIDU_SCOPED_LOCK(m->version_lock);
         if (given_ver == *m->version_butex) {
@@ -918,11 +1128,13 @@ void print_task(std::ostream& os, bthread_t tid) {
             has_tls = m->local_storage.keytable;
             cpuwide_start_ns = m->cpuwide_start_ns;
             stat = m->stat;
+            ready_ns = m->ready_ns;
         }
     }
     if (!matched) {
         os << "bthread=" << tid << " : not exist now";
     } else {
+        const int64_t now_ns = butil::cpuwide_time_ns();
         os << "bthread=" << tid << " :\nstop=" << stop
            << "\ninterrupted=" << interrupted
            << "\nabout_to_quit=" << about_to_quit
@@ -932,9 +1144,14 @@ void print_task(std::ostream& os, bthread_t tid) {
            << " flags=" << attr.flags
            << " keytable_pool=" << attr.keytable_pool 
            << "}\nhas_tls=" << has_tls
-           << "\nuptime_ns=" << butil::cpuwide_time_ns() - cpuwide_start_ns
+           << "\nuptime_ns=" << now_ns - cpuwide_start_ns
            << "\ncputime_ns=" << stat.cputime_ns
+           << "\nqueue_ns=" << stat.queue_ns
+           << "\nlast_queue_ns=" << stat.last_queue_ns
            << "\nnswitch=" << stat.nswitch;
+        if (ready_ns != 0) {
+            os << "\nqueuing_ns=" << now_ns - ready_ns;
+        }
     }
 }
 
@@ -137,6 +137,12 @@ public:
     // Uptime of current task in nanoseconds.
     int64_t current_uptime_ns() const
     { return butil::cpuwide_time_ns() - _cur_meta->cpuwide_start_ns; }
+    // Statistics of current task, including cputime of the ongoing run.
+    TaskStatistics current_stat() const {
+        TaskStatistics stat = _cur_meta->stat;
+        stat.cputime_ns += butil::cpuwide_time_ns() - _last_run_ns;
+        return stat;
+    }
 
     // True iff current task is the one running run_main_task()
     bool is_current_main_task() const { return current_tid() == _main_tid; }
@@ -154,7 +160,9 @@ public:
 
     // Push a bthread into the runqueue from another non-worker thread.
     void ready_to_run_remote(bthread_t tid, bool nosignal = false);
-    void flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex);
+    // Push `n' bthreads into the runqueue from another non-worker thread
+    // and signal them together.
+    void ready_to_run_remote_batch(const bthread_t* tids, size_t n);
     void flush_nosignal_tasks_remote();
 
     // Automatically decide the caller is remote or local, and call
@@ -165,6 +173,15 @@ public:
     // The TaskControl that this TaskGroup belongs to.
     TaskControl* control() const { return _control; }
 
+    // Tag of this group, bthreads in this group are only stolen by groups
+    // of the same tag.
+    bthread_tag_t tag() const { return _tag; }
+
+    // True if the worker was retired by TaskControl::remove_workers(), it
+    // runs tasks left in its runqueues and quits. Tasks pushed into this
+    // group afterwards are moved to other groups.
+    bool retired() const { return _retired.load(butil::memory_order_relaxed); }
+
     // Call this instead of delete.
     void destroy_self();
 
@@ -175,17 +192,18 @@ public:
     // Get the meta associate with the task.
     static TaskMeta* address_meta(bthread_t tid);
 
-    // Push a task into _rq, if _rq is full, retry after some time. This
-    // process make go on indefinitely.
+    // Push a task into _rq(or _high_rq if the task is created with
+    // BTHREAD_PRIORITY_HIGH), if the queue is full, retry after some time.
+    // This process make go on indefinitely.
     void push_rq(bthread_t tid);
 
 private:
 friend class TaskControl;
 
     // You shall use TaskControl::create_group to create new instance.
-    explicit TaskGroup(TaskControl*);
+    TaskGroup(TaskControl*, bthread_tag_t tag);
 
-    int init(size_t runqueue_capacity);
+    int init(size_t runqueue_capacity, size_t runqueue_max_capacity);
 
     // You shall call destroy_self() instead of destructor because deletion
     // of groups are postponed to avoid race.
@@ -208,6 +226,16 @@ friend class TaskControl;
     // loop calling this function should end.
     bool wait_task(bthread_t* tid);
 
+    // Pop a task from _high_rq or _rq of this group. Tasks in _high_rq are
+    // picked first, unless -bthread_high_priority_weight tasks in _high_rq
+    // were picked in a row while _rq is not empty.
+    bool pop_rq(bthread_t* tid);
+
+    // Spin for tasks before parking when recent idle periods of this worker
+    // are short, so that the worker is likely to find new tasks without
+    // parking and being woken up by futex.
+    bool spin_for_task(bthread_t* tid, int64_t idle_begin_ns);
+
     bool steal_task(bthread_t* tid) {
         if (_remote_rq.pop(tid)) {
             return true;
@@ -215,9 +243,21 @@ friend class TaskControl;
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         _last_pl_state = _pl->get_state();
 #endif
-        return _control->steal_task(tid, &_steal_seed, _steal_offset);
+        // Retired workers only run tasks of their own.
+        if (retired()) {
+            return false;
+        }
+        return _control->steal_task(tid, &_steal_seed, _steal_offset,
+                                    _tag, _numa_node);
     }
 
+    // Pop tasks left in runqueues of a retired group. Returns false when
+    // all of them are empty and the worker should quit.
+    bool pop_left_task(bthread_t* tid);
+
+    // Move tasks in _remote_rq of a retired group to other groups.
+    void forward_remote_tasks();
+
 #ifndef NDEBUG
     int _sched_recursive_guard;
 #endif
@@ -236,18 +276,34 @@ friend class TaskControl;
     RemainedFn _last_context_remained;
     void* _last_context_remained_arg;
 
+    bthread_tag_t _tag;
+    // NUMA node of the worker, -1 when TaskControl is not NUMA-aware.
+    int _numa_node;
+    // The worker pthread running this group.
+    pthread_t _worker_thread;
+    // Set by TaskControl::remove_workers().
+    butil::atomic<bool> _retired;
     ParkingLot* _pl;
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
     ParkingLot::State _last_pl_state;
 #endif
     size_t _steal_seed;
     size_t _steal_offset;
+    // Moving average of periods that the worker waited for tasks.
+    int64_t _avg_idle_ns;
+    // Latencies that tasks waited in runqueues before being run by this
+    // worker, created by run_main_task() on demand.
+    bvar::LatencyRecorder* _sched_latency;
     ContextualStack* _main_stack;
     bthread_t _main_tid;
     WorkStealingQueue<bthread_t> _rq;
+    WorkStealingQueue<bthread_t> _high_rq;
+    // # of tasks picked from _high_rq in a row.
+    int _nhigh_in_row;
     RemoteTaskQueue _remote_rq;
-    int _remote_num_nosignal;
-    int _remote_nsignaled;
+    // Modified by non-workers pushing into _remote_rq concurrently.
+    butil::atomic<int> _remote_num_nosignal;
+    butil::atomic<int> _remote_nsignaled;
 };
 
 }  // namespace bthread
@@ -63,11 +63,13 @@ inline void TaskGroup::sched_to(TaskGroup** pg, bthread_t next_tid) {
         if (stk) {
             next_meta->set_stack(stk);
         } else {
-            // stack_type is BTHREAD_STACKTYPE_PTHREAD or out of memory,
+            // stack_type is BTHREAD_STACKTYPE_PTHREAD/SHARED or out of memory,
             // In latter case, attr is forced to be BTHREAD_STACKTYPE_PTHREAD.
             // This basically means that if we can't allocate stack, run
             // the task in pthread directly.
-            next_meta->attr.stack_type = BTHREAD_STACKTYPE_PTHREAD;
+            if (next_meta->stack_type() != STACK_TYPE_SHARED) {
+                next_meta->attr.stack_type = BTHREAD_STACKTYPE_PTHREAD;
+            }
             next_meta->set_stack((*pg)->_main_stack);
         }
     }
@@ -76,7 +78,21 @@ inline void TaskGroup::sched_to(TaskGroup** pg, bthread_t next_tid) {
 }
 
 inline void TaskGroup::push_rq(bthread_t tid) {
-    while (!_rq.push(tid)) {
+    if (__builtin_expect(retired(), 0)) {
+        // Nobody steals from a retired group, run the task in other groups
+        // rather than delaying the quit of this worker.
+        return _control->choose_one_group(_tag)->ready_to_run_remote(tid);
+    }
+    TaskMeta* m = address_meta(tid);
+    m->ready_ns = butil::cpuwide_time_ns();
+    WorkStealingQueue<bthread_t>& rq =
+        ((m->attr.flags & BTHREAD_PRIORITY_HIGH) ? _high_rq : _rq);
+    while (!rq.push(tid)) {
+        if (rq.grow()) {
+            _control->_rq_grows << 1;
+            continue;
+        }
+        _control->_rq_fulls << 1;
         // Created too many bthreads: a promising approach is to insert the
         // task into another TaskGroup, but we don't use it because:
         // * There're already many bthreads to run, inserting the bthread
@@ -85,7 +101,9 @@ inline void TaskGroup::push_rq(bthread_t tid) {
         //   are busy at creating bthreads (proved by test_input_messenger in
         //   brpc)
         flush_nosignal_tasks();
-        LOG_EVERY_SECOND(ERROR) << "_rq is full, capacity=" << _rq.capacity();
+        LOG_EVERY_SECOND(ERROR) << (&rq == &_rq ? "_rq" : "_high_rq")
+                                << " is full, capacity=" << rq.capacity()
+                                << ", try larger -task_group_runqueue_max_capacity";
         // TODO(gejun): May cause deadlock when all workers are spinning here.
         // A better solution is to pop and run existing bthreads, however which
         // make set_remained()-callbacks do context switches and need extensive
@@ -95,9 +113,13 @@ inline void TaskGroup::push_rq(bthread_t tid) {
 }
 
 inline void TaskGroup::flush_nosignal_tasks_remote() {
-    if (_remote_num_nosignal) {
-        _remote_rq._mutex.lock();
-        flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
+    if (_remote_num_nosignal.load(butil::memory_order_relaxed)) {
+        const int val = _remote_num_nosignal.exchange(
+            0, butil::memory_order_relaxed);
+        if (val) {
+            _remote_nsignaled.fetch_add(val, butil::memory_order_relaxed);
+            _control->signal_task(val, _tag);
+        }
     }
 }
 
@@ -30,6 +30,10 @@ namespace bthread {
 struct TaskStatistics {
     int64_t cputime_ns;
     int64_t nswitch;
+    // Total time waited in runqueues before being run.
+    int64_t queue_ns;
+    // Time waited in the runqueue before the latest run.
+    int64_t last_queue_ns;
 };
 
 class KeyTable;
@@ -39,9 +43,16 @@ struct LocalStorage {
     KeyTable* keytable;
     void* assigned_data;
     void* rpcz_parent_span;
+    // Deadline of the server-side RPC being processed, in microseconds
+    // since the Epoch. 0 if there's none.
+    int64_t rpc_deadline_us;
+    // Method(google::protobuf::MethodDescriptor) of the server-side RPC
+    // being processed, NULL if there's none. CPU samples are attributed to
+    // the method.
+    const void* rpc_method;
 };
 
-#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL }
+#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL, 0, NULL }
 
 const static LocalStorage LOCAL_STORAGE_INIT = BTHREAD_LOCAL_STORAGE_INITIALIZER;
 
@@ -82,10 +93,17 @@ struct TaskMeta {
     // Statistics
     int64_t cpuwide_start_ns;
     TaskStatistics stat;
+    // cpuwide time when the task was pushed into a runqueue, 0 when the
+    // task is running or blocked.
+    int64_t ready_ns;
 
     // bthread local storage.
     LocalStorage local_storage;
 
+    // [Not Reset] values of bthread_fast_slot_t, cleared when the task ends.
+    // Not in LocalStorage to avoid being copied in each context switch.
+    void* fast_slots[BTHREAD_FAST_SLOT_NUM];
+
 public:
     // Only initialize [Not Reset] fields, other fields will be reset in
     // bthread_start* functions
@@ -93,6 +111,9 @@ public:
         : current_waiter(NULL)
         , current_sleep(0)
         , stack(NULL) {
+        for (int i = 0; i < BTHREAD_FAST_SLOT_NUM; ++i) {
+            fast_slots[i] = NULL;
+        }
         pthread_spin_init(&version_lock, 0);
         version_butex = butex_create_checked<uint32_t>();
         *version_butex = 1;
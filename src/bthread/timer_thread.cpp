@@ -16,6 +16,7 @@
 // Author: Ge,Jun (gejun@baidu.com)
 
 #include <queue>                           // heap functions
+#include <gflags/gflags.h>
 #include "butil/scoped_lock.h"
 #include "butil/logging.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
@@ -27,13 +28,22 @@
 
 namespace bthread {
 
+DEFINE_int32(bthread_timer_thread_num, 1, "Number of pthreads running timers "
+             "of bthread(bthread_usleep, butex_wait with timeout ...) and "
+             "RPC. Read at initialization of bthread");
+DEFINE_bool(bthread_timer_use_timing_wheel, false, "Keep timers of bthread "
+            "in hierarchical timing wheels, which makes adding timers O(1). "
+            "Read at initialization of bthread");
+
 // Defined in task_control.cpp
 void run_worker_startfn();
 
 const TimerThread::TaskId TimerThread::INVALID_TASK_ID = 0;
 
 TimerThreadOptions::TimerThreadOptions()
-    : num_buckets(13) {
+    : num_buckets(13)
+    , num_threads(1)
+    , use_timing_wheel(false) {
 }
 
 // A task contains the necessary information for running fn(arg).
@@ -113,24 +123,217 @@ inline bool task_greater(const TimerThread::Task* a, const TimerThread::Task* b)
     return a->run_time > b->run_time;
 }
 
+inline void push_task(std::vector<TimerThread::Task*>* heap,
+                      TimerThread::Task* task) {
+    heap->push_back(task);
+    std::push_heap(heap->begin(), heap->end(), task_greater);
+}
+
+// Hierarchical timing wheel holding tasks of a timer thread, which is only
+// accessed by the timer thread.
+// A task due at tick T(run_time / TICK_US) is put in slot
+// (T >> (SLOT_BITS * L)) & SLOT_MASK of level L, where L is the lowest level
+// covering T - _current_tick. When _current_tick enters a slot of level L > 0,
+// tasks in the slot are added again to fall into lower levels(cascading).
+// When _current_tick enters a slot of level 0, tasks in the slot are pushed
+// into the heap to run at their precise run_time, thus the heap only has
+// tasks in the current tick. Unscheduled tasks are deleted in cascading
+// without going through the heap.
+class TimerThread::TimingWheel {
+public:
+    static const int64_t TICK_US = 1000;
+    static const int SLOT_BITS = 8;
+    static const int NSLOT = (1 << SLOT_BITS);
+    static const int64_t SLOT_MASK = NSLOT - 1;
+    static const int NLEVEL = 4;
+
+    explicit TimingWheel(int64_t now_us)
+        : _current_tick(now_us / TICK_US), _size(0) {
+        memset(_slots, 0, sizeof(_slots));
+        memset(_used, 0, sizeof(_used));
+    }
+
+    // Add `task' into this wheel or into `heap' if the task is already due
+    // or too far from now.
+    void add(Task* task, std::vector<Task*>* heap) {
+        const int64_t tick = task->run_time / TICK_US;
+        const int64_t delta = tick - _current_tick;
+        if (delta < 0) {
+            return push_task(heap, task);
+        }
+        for (int level = 0; level < NLEVEL; ++level) {
+            const int shift = SLOT_BITS * (level + 1);
+            if (delta < ((int64_t)1 << shift)) {
+                const int index = (tick >> (shift - SLOT_BITS)) & SLOT_MASK;
+                task->next = _slots[level][index];
+                _slots[level][index] = task;
+                _used[level][index / 64] |= ((uint64_t)1 << (index % 64));
+                ++_size;
+                return;
+            }
+        }
+        // Beyond the last level, rare enough to be put in the heap.
+        push_task(heap, task);
+    }
+
+    // Move tasks in ticks before or at `now_us' into `heap'.
+    void advance(int64_t now_us, std::vector<Task*>* heap) {
+        const int64_t now_tick = now_us / TICK_US;
+        while (_current_tick <= now_tick) {
+            const int64_t next_tick = next_event_tick();
+            if (next_tick > now_tick) {
+                // Nothing to do in the ticks between.
+                _current_tick = now_tick + 1;
+                return;
+            }
+            _current_tick = next_tick;
+            for (int level = 1; level < NLEVEL; ++level) {
+                const int shift = SLOT_BITS * level;
+                if (_current_tick & (((int64_t)1 << shift) - 1)) {
+                    break;
+                }
+                Task* p = take_slot(level, (_current_tick >> shift) & SLOT_MASK);
+                while (p) {
+                    Task* next = p->next;
+                    if (!p->try_delete()) {
+                        add(p, heap);
+                    }
+                    p = next;
+                }
+            }
+            Task* p = take_slot(0, _current_tick & SLOT_MASK);
+            while (p) {
+                Task* next = p->next;
+                if (!p->try_delete()) {
+                    push_task(heap, p);
+                }
+                p = next;
+            }
+            ++_current_tick;
+        }
+    }
+
+    // Returns the realtime that advance() should be called next.
+    int64_t next_run_time() const {
+        const int64_t tick = next_event_tick();
+        return (tick == std::numeric_limits<int64_t>::max() ?
+                tick : tick * TICK_US);
+    }
+
+private:
+    Task* take_slot(int level, int index) {
+        Task* head = _slots[level][index];
+        _slots[level][index] = NULL;
+        _used[level][index / 64] &= ~((uint64_t)1 << (index % 64));
+        for (Task* p = head; p; p = p->next) {
+            --_size;
+        }
+        return head;
+    }
+
+    // Returns the earliest tick at which a slot may have tasks to move.
+    int64_t next_event_tick() const {
+        int64_t result = std::numeric_limits<int64_t>::max();
+        if (_size == 0) {
+            return result;
+        }
+        for (int level = 0; level < NLEVEL; ++level) {
+            result = std::min(result, next_event_tick(level));
+        }
+        return result;
+    }
+
+    int64_t next_event_tick(int level) const {
+        const int shift = SLOT_BITS * level;
+        const int index = (_current_tick >> shift) & SLOT_MASK;
+        const int64_t base = (_current_tick >> (shift + SLOT_BITS))
+            << (shift + SLOT_BITS);
+        // Slot at `index' of upper levels was entered already unless
+        // _current_tick is at start of the slot.
+        const int start = ((level == 0 ||
+                            !(_current_tick & (((int64_t)1 << shift) - 1)))
+                           ? index : index + 1);
+        const int i = find_used_slot(level, start);
+        if (i >= 0) {
+            return base + ((int64_t)i << shift);
+        }
+        if (find_used_slot(level, 0) >= 0) {
+            // Entered in next round of this level.
+            return base + ((int64_t)1 << (shift + SLOT_BITS));
+        }
+        return std::numeric_limits<int64_t>::max();
+    }
+
+    // Returns index of the first non-empty slot of `level' since `start',
+    // -1 if there's none.
+    int find_used_slot(int level, int start) const {
+        for (int w = start / 64; w < NSLOT / 64; ++w) {
+            uint64_t bits = _used[level][w];
+            if (w == start / 64) {
+                bits &= (~(uint64_t)0 << (start % 64));
+            }
+            if (bits) {
+                return w * 64 + __builtin_ctzll(bits);
+            }
+        }
+        return -1;
+    }
+
+    Task* _slots[NLEVEL][NSLOT];
+    // Bitmaps of non-empty slots.
+    uint64_t _used[NLEVEL][NSLOT / 64];
+    // Next tick to enter.
+    int64_t _current_tick;
+    size_t _size;
+};
+
+TimerThread::Shard::Shard()
+    : owner(NULL)
+    , buckets(NULL)
+    , nearest_run_time(std::numeric_limits<int64_t>::max())
+    , nsignals(0)
+    , thread(0)
+    , nscheduled(0)
+    , ntriggered(0)
+    , busy_seconds(0) {
+}
+
+TimerThread::Shard::~Shard() {
+    delete [] buckets;
+    buckets = NULL;
+}
+
 void* TimerThread::run_this(void* arg) {
-    static_cast<TimerThread*>(arg)->run();
+    Shard* shard = static_cast<Shard*>(arg);
+    shard->owner->run(shard);
     return NULL;
 }
 
+template <typename T, T TimerThread::Shard::*field>
+T TimerThread::sum_of_shards(void* arg) {
+    const TimerThread* tt = static_cast<TimerThread*>(arg);
+    T sum = T();
+    if (tt->_shards) {
+        for (size_t i = 0; i < tt->_options.num_threads; ++i) {
+            sum += tt->_shards[i].*field;
+        }
+    }
+    return sum;
+}
+
 TimerThread::TimerThread()
     : _started(false)
     , _stop(false)
-    , _buckets(NULL)
-    , _nearest_run_time(std::numeric_limits<int64_t>::max())
-    , _nsignals(0)
-    , _thread(0) {
+    , _nscheduled_var(sum_of_shards<size_t, &Shard::nscheduled>, this)
+    , _nscheduled_second(&_nscheduled_var)
+    , _ntriggered_var(sum_of_shards<size_t, &Shard::ntriggered>, this)
+    , _ntriggered_second(&_ntriggered_var)
+    , _busy_seconds_var(sum_of_shards<double, &Shard::busy_seconds>, this)
+    , _busy_seconds_second(&_busy_seconds_var) {
 }
 
 TimerThread::~TimerThread() {
     stop_and_join();
-    delete [] _buckets;
-    _buckets = NULL;
 }
 
 int TimerThread::start(const TimerThreadOptions* options_in) {
@@ -148,14 +351,41 @@ int TimerThread::start(const TimerThreadOptions* options_in) {
         LOG(ERROR) << "num_buckets=" << _options.num_buckets << " is too big";
         return EINVAL;
     }
-    _buckets = new (std::nothrow) Bucket[_options.num_buckets];
-    if (NULL == _buckets) {
-        LOG(ERROR) << "Fail to new _buckets";
+    if (_options.num_threads == 0 || _options.num_threads > 64) {
+        LOG(ERROR) << "num_threads=" << _options.num_threads
+                   << " must be in [1, 64]";
+        return EINVAL;
+    }
+    _shards.reset(new (std::nothrow) Shard[_options.num_threads]);
+    if (NULL == _shards) {
+        LOG(ERROR) << "Fail to new _shards";
         return ENOMEM;
-    }        
-    const int ret = pthread_create(&_thread, NULL, TimerThread::run_this, this);
-    if (ret) {
-        return ret;
+    }
+    for (size_t i = 0; i < _options.num_threads; ++i) {
+        _shards[i].owner = this;
+        _shards[i].buckets = new (std::nothrow) Bucket[_options.num_buckets];
+        if (NULL == _shards[i].buckets) {
+            LOG(ERROR) << "Fail to new buckets";
+            _shards.reset();
+            return ENOMEM;
+        }
+    }
+    for (size_t i = 0; i < _options.num_threads; ++i) {
+        const int ret = pthread_create(&_shards[i].thread, NULL,
+                                       TimerThread::run_this, &_shards[i]);
+        if (ret) {
+            // Stop created threads.
+            _started = true;
+            _options.num_threads = i;
+            stop_and_join();
+            _started = false;
+            return ret;
+        }
+    }
+    if (!_options.bvar_prefix.empty()) {
+        _nscheduled_second.expose_as(_options.bvar_prefix, "scheduled_second");
+        _ntriggered_second.expose_as(_options.bvar_prefix, "triggered_second");
+        _busy_seconds_second.expose_as(_options.bvar_prefix, "usage");
     }
     _started = true;
     return 0;
@@ -218,22 +448,24 @@ TimerThread::TaskId TimerThread::schedule(
         return INVALID_TASK_ID;
     }
     // Hashing by pthread id is better for cache locality.
+    const uint64_t h = butil::fmix64(pthread_numeric_id());
+    Shard& shard = _shards[h % _options.num_threads];
     const Bucket::ScheduleResult result = 
-        _buckets[butil::fmix64(pthread_numeric_id()) % _options.num_buckets]
+        shard.buckets[(h / _options.num_threads) % _options.num_buckets]
         .schedule(fn, arg, abstime);
     if (result.earlier) {
         bool earlier = false;
         const int64_t run_time = butil::timespec_to_microseconds(abstime);
         {
-            BAIDU_SCOPED_LOCK(_mutex);
-            if (run_time < _nearest_run_time) {
-                _nearest_run_time = run_time;
-                ++_nsignals;
+            BAIDU_SCOPED_LOCK(shard.mutex);
+            if (run_time < shard.nearest_run_time) {
+                shard.nearest_run_time = run_time;
+                ++shard.nsignals;
                 earlier = true;
             }
         }
         if (earlier) {
-            futex_wake_private(&_nsignals, 1);
+            futex_wake_private(&shard.nsignals, 1);
         }
     }
     return result.task_id;
@@ -302,12 +534,7 @@ bool TimerThread::Task::try_delete() {
     return false;
 }
 
-template <typename T>
-static T deref_value(void* arg) {
-    return *(T*)arg;
-}
-
-void TimerThread::run() {
+void TimerThread::run(Shard* shard) {
     run_worker_startfn();
 #ifdef BAIDU_INTERNAL
     logging::ComlogInitializer comlog_initializer;
@@ -319,43 +546,40 @@ void TimerThread::run() {
     // min heap of tasks (ordered by run_time)
     std::vector<Task*> tasks;
     tasks.reserve(4096);
-
-    // vars
-    size_t nscheduled = 0;
-    bvar::PassiveStatus<size_t> nscheduled_var(deref_value<size_t>, &nscheduled);
-    bvar::PerSecond<bvar::PassiveStatus<size_t> > nscheduled_second(&nscheduled_var);
-    size_t ntriggered = 0;
-    bvar::PassiveStatus<size_t> ntriggered_var(deref_value<size_t>, &ntriggered);
-    bvar::PerSecond<bvar::PassiveStatus<size_t> > ntriggered_second(&ntriggered_var);
-    double busy_seconds = 0;
-    bvar::PassiveStatus<double> busy_seconds_var(deref_value<double>, &busy_seconds);
-    bvar::PerSecond<bvar::PassiveStatus<double> > busy_seconds_second(&busy_seconds_var);
-    if (!_options.bvar_prefix.empty()) {
-        nscheduled_second.expose_as(_options.bvar_prefix, "scheduled_second");
-        ntriggered_second.expose_as(_options.bvar_prefix, "triggered_second");
-        busy_seconds_second.expose_as(_options.bvar_prefix, "usage");
+    std::unique_ptr<TimingWheel> wheel;
+    if (_options.use_timing_wheel) {
+        wheel.reset(new TimingWheel(last_sleep_time));
     }
-    
+
     while (!_stop.load(butil::memory_order_relaxed)) {
-        // Clear _nearest_run_time before consuming tasks from buckets.
+        // Clear nearest_run_time before consuming tasks from buckets.
         // This helps us to be aware of earliest task of the new tasks before we
         // would run the consumed tasks.
         {
-            BAIDU_SCOPED_LOCK(_mutex);
-            _nearest_run_time = std::numeric_limits<int64_t>::max();
+            BAIDU_SCOPED_LOCK(shard->mutex);
+            shard->nearest_run_time = std::numeric_limits<int64_t>::max();
         }
         
         // Pull tasks from buckets.
         for (size_t i = 0; i < _options.num_buckets; ++i) {
-            Bucket& bucket = _buckets[i];
+            Bucket& bucket = shard->buckets[i];
             for (Task* p = bucket.consume_tasks(); p != NULL;
-                 p = p->next, ++nscheduled) {
+                 ++shard->nscheduled) {
+                // p->next is reused by the wheel.
+                Task* next = p->next;
                 if (!p->try_delete()) { // remove the task if it's unscheduled
-                    tasks.push_back(p);
-                    std::push_heap(tasks.begin(), tasks.end(), task_greater);
+                    if (wheel) {
+                        wheel->add(p, &tasks);
+                    } else {
+                        push_task(&tasks, p);
+                    }
                 }
+                p = next;
             }
         }
+        if (wheel) {
+            wheel->advance(butil::gettimeofday_us(), &tasks);
+        }
 
         bool pull_again = false;
         while (!tasks.empty()) {
@@ -369,18 +593,18 @@ void TimerThread::run() {
                 break;
             }
             // Each time before we run the earliest task (that we think), 
-            // check the globally shared _nearest_run_time. If a task earlier
+            // check the globally shared nearest_run_time. If a task earlier
             // than task1 was scheduled during pulling from buckets, we'll
-            // know. In RPC scenarios, _nearest_run_time is not often changed by
+            // know. In RPC scenarios, nearest_run_time is not often changed by
             // threads because the task needs to be the earliest in its bucket,
             // since run_time of scheduled tasks are often in ascending order,
             // most tasks are unlikely to be "earliest". (If run_time of tasks
             // are in descending orders, all tasks are "earliest" after every
-            // insertion, and they'll grab _mutex and change _nearest_run_time
+            // insertion, and they'll grab mutex and change nearest_run_time
             // frequently, fortunately this is not true at most of time).
             {
-                BAIDU_SCOPED_LOCK(_mutex);
-                if (task1->run_time > _nearest_run_time) {
+                BAIDU_SCOPED_LOCK(shard->mutex);
+                if (task1->run_time > shard->nearest_run_time) {
                     // a task is earlier than task1. We need to check buckets.
                     pull_again = true;
                     break;
@@ -389,7 +613,7 @@ void TimerThread::run() {
             std::pop_heap(tasks.begin(), tasks.end(), task_greater);
             tasks.pop_back();
             if (task1->run_and_delete()) {
-                ++ntriggered;
+                ++shard->ntriggered;
             }
         }
         if (pull_again) {
@@ -404,20 +628,23 @@ void TimerThread::run() {
         } else {
             next_run_time = tasks[0]->run_time;
         }
+        if (wheel) {
+            next_run_time = std::min(next_run_time, wheel->next_run_time());
+        }
         // Similarly with the situation before running tasks, we check
-        // _nearest_run_time to prevent us from waiting on a non-earliest
-        // task. We also use the _nsignal to make sure that if new task 
+        // nearest_run_time to prevent us from waiting on a non-earliest
+        // task. We also use the nsignals to make sure that if new task 
         // is earlier that the realtime that we wait for, we'll wake up.
         int expected_nsignals = 0;
         {
-            BAIDU_SCOPED_LOCK(_mutex);
-            if (next_run_time > _nearest_run_time) {
+            BAIDU_SCOPED_LOCK(shard->mutex);
+            if (next_run_time > shard->nearest_run_time) {
                 // a task is earlier that what we would wait for.
                 // We need to check buckets.
                 continue;
             } else {
-                _nearest_run_time = next_run_time;
-                expected_nsignals = _nsignals;
+                shard->nearest_run_time = next_run_time;
+                expected_nsignals = shard->nsignals;
             }
         }
         timespec* ptimeout = NULL;
@@ -427,8 +654,8 @@ void TimerThread::run() {
             next_timeout = butil::microseconds_to_timespec(next_run_time - now);
             ptimeout = &next_timeout;
         }
-        busy_seconds += (now - last_sleep_time) / 1000000.0;
-        futex_wait_private(&_nsignals, expected_nsignals, ptimeout);
+        shard->busy_seconds += (now - last_sleep_time) / 1000000.0;
+        futex_wait_private(&shard->nsignals, expected_nsignals, ptimeout);
         last_sleep_time = butil::gettimeofday_us();
     }
     BT_VLOG << "Ended TimerThread=" << pthread_self();
@@ -437,17 +664,20 @@ void TimerThread::run() {
 void TimerThread::stop_and_join() {
     _stop.store(true, butil::memory_order_relaxed);
     if (_started) {
-        {
-            BAIDU_SCOPED_LOCK(_mutex);
-             // trigger pull_again and wakeup TimerThread
-            _nearest_run_time = 0;
-            ++_nsignals;
-        }
-        if (pthread_self() != _thread) {
-            // stop_and_join was not called from a running task.
-            // wake up the timer thread in case it is sleeping.
-            futex_wake_private(&_nsignals, 1);
-            pthread_join(_thread, NULL);
+        for (size_t i = 0; i < _options.num_threads; ++i) {
+            Shard& shard = _shards[i];
+            {
+                BAIDU_SCOPED_LOCK(shard.mutex);
+                // trigger pull_again and wakeup TimerThread
+                shard.nearest_run_time = 0;
+                ++shard.nsignals;
+            }
+            if (pthread_self() != shard.thread) {
+                // stop_and_join was not called from a running task.
+                // wake up the timer thread in case it is sleeping.
+                futex_wake_private(&shard.nsignals, 1);
+                pthread_join(shard.thread, NULL);
+            }
         }
     }
 }
@@ -462,6 +692,8 @@ static void init_global_timer_thread() {
     }
     TimerThreadOptions options;
     options.bvar_prefix = "bthread_timer";
+    options.num_threads = FLAGS_bthread_timer_thread_num;
+    options.use_timing_wheel = FLAGS_bthread_timer_use_timing_wheel;
     const int rc = g_timer_thread->start(&options);
     if (rc != 0) {
         LOG(FATAL) << "Fail to start timer_thread, " << berror(rc);
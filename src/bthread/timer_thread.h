@@ -21,7 +21,9 @@
 #include <vector>                     // std::vector
 #include <pthread.h>                  // pthread_*
 #include "butil/atomicops.h" 
+#include "butil/unique_ptr.h"             // std::unique_ptr
 #include "butil/time.h"                // time utilities
+#include "bvar/bvar.h"
 #include "bthread/mutex.h"
 
 namespace bthread {
@@ -35,6 +37,21 @@ struct TimerThreadOptions {
     // Default: 13
     size_t num_buckets;
 
+    // Number of pthreads running tasks. Tasks are scheduled into the thread
+    // chosen by the scheduling pthread, more threads make the timer scale
+    // better with a lot of schedulings, but tasks in different threads may
+    // run concurrently.
+    // Default: 1
+    size_t num_threads;
+
+    // Keep tasks in a hierarchical timing wheel rather than a heap, which
+    // makes adding a task O(1) in the timer thread. Tasks are moved into
+    // the heap when they're about to run so that they still run at precise
+    // time. Suitable for a lot of tasks that are unscheduled before running,
+    // say timeouts of RPC.
+    // Default: false
+    bool use_timing_wheel;
+
     // If this field is not empty, some bvar for reporting stats of TimerThread
     // will be exposed with this prefix.
     // Default: ""
@@ -45,12 +62,14 @@ struct TimerThreadOptions {
 };
 
 // TimerThread is a separate thread to run scheduled tasks at specific time.
-// At most one task runs at any time, don't put time-consuming code in the
-// callback otherwise the task may delay other tasks significantly.
+// At most one task runs at any time in each thread(see num_threads), don't
+// put time-consuming code in the callback otherwise the task may delay other
+// tasks significantly.
 class TimerThread {
 public:
     struct Task;
     class Bucket;
+    class TimingWheel;
 
     typedef uint64_t TaskId;
     const static TaskId INVALID_TASK_ID;
@@ -78,26 +97,48 @@ public:
     //   1   -  The task is just running.
     int unschedule(TaskId task_id);
 
-    // Get identifier of internal pthread.
+    // Get identifier of internal pthread(the first one if there're more).
     // Returns (pthread_t)0 if start() is not called yet.
-    pthread_t thread_id() const { return _thread; }
+    pthread_t thread_id() const { return _shards ? _shards[0].thread : 0; }
     
 private:
-    // the timer thread will run this method.
-    void run();
+    // Tasks scheduled into and run by one pthread.
+    struct BAIDU_CACHELINE_ALIGNMENT Shard {
+        TimerThread* owner;
+        Bucket* buckets;        // list of tasks to be run
+        internal::FastPthreadMutex mutex;    // protect nearest_run_time
+        int64_t nearest_run_time;
+        // the futex for wake up timer thread. can't use nearest_run_time
+        // because it's 64-bit.
+        int nsignals;
+        pthread_t thread;       // all tasks of this shard run on this thread
+        // stats, only modified by `thread'
+        size_t nscheduled;
+        size_t ntriggered;
+        double busy_seconds;
+
+        Shard();
+        ~Shard();
+    };
+
+    // the timer threads will run this method.
+    void run(Shard* shard);
     static void* run_this(void* arg);
 
+    template <typename T, T Shard::*field> static T sum_of_shards(void* arg);
+
     bool _started;            // whether the timer thread was started successfully.
     butil::atomic<bool> _stop;
 
     TimerThreadOptions _options;
-    Bucket* _buckets;        // list of tasks to be run
-    internal::FastPthreadMutex _mutex;    // protect _nearest_run_time
-    int64_t _nearest_run_time;
-    // the futex for wake up timer thread. can't use _nearest_run_time because
-    // it's 64-bit.
-    int _nsignals;
-    pthread_t _thread;       // all scheduled task will be run on this thread
+    // Destroyed after the bvars below which read the shards.
+    std::unique_ptr<Shard[]> _shards;
+    bvar::PassiveStatus<size_t> _nscheduled_var;
+    bvar::PerSecond<bvar::PassiveStatus<size_t> > _nscheduled_second;
+    bvar::PassiveStatus<size_t> _ntriggered_var;
+    bvar::PerSecond<bvar::PassiveStatus<size_t> > _ntriggered_second;
+    bvar::PassiveStatus<double> _busy_seconds_var;
+    bvar::PerSecond<bvar::PassiveStatus<double> > _busy_seconds_second;
 };
 
 // Get the global TimerThread which never quits.
@@ -37,11 +37,22 @@ static const bthread_stacktype_t BTHREAD_STACKTYPE_PTHREAD = 1;
 static const bthread_stacktype_t BTHREAD_STACKTYPE_SMALL = 2;
 static const bthread_stacktype_t BTHREAD_STACKTYPE_NORMAL = 3;
 static const bthread_stacktype_t BTHREAD_STACKTYPE_LARGE = 4;
+static const bthread_stacktype_t BTHREAD_STACKTYPE_SHARED = 5;
+
+// Tag of worker pthreads. Workers are partitioned by tags(-task_group_ntags),
+// bthreads only run on workers of their own tags and are never stolen by
+// workers of other tags.
+typedef int bthread_tag_t;
+static const bthread_tag_t BTHREAD_TAG_INVALID = -1;
+static const bthread_tag_t BTHREAD_TAG_DEFAULT = 0;
 
 typedef unsigned bthread_attrflags_t;
 static const bthread_attrflags_t BTHREAD_LOG_START_AND_FINISH = 8;
 static const bthread_attrflags_t BTHREAD_LOG_CONTEXT_SWITCH = 16;
 static const bthread_attrflags_t BTHREAD_NOSIGNAL = 32;
+// bthreads with this flag are put into separate runqueues which are picked
+// before runqueues of normal bthreads, see -bthread_high_priority_weight.
+static const bthread_attrflags_t BTHREAD_PRIORITY_HIGH = 64;
 
 // Key of thread-local data, created by bthread_key_create.
 typedef struct {
@@ -51,6 +62,11 @@ typedef struct {
 
 static const bthread_key_t INVALID_BTHREAD_KEY = { 0, 0 };
 
+// Slot of thread-local data stored in bthreads directly, created by
+// bthread_fast_slot_create.
+typedef int bthread_fast_slot_t;
+static const int BTHREAD_FAST_SLOT_NUM = 8;
+
 #if defined(__cplusplus)
 // Overload operators for bthread_key_t
 inline bool operator==(bthread_key_t key1, bthread_key_t key2)
@@ -88,12 +104,17 @@ typedef struct bthread_attr_t {
     bthread_stacktype_t stack_type;
     bthread_attrflags_t flags;
     bthread_keytable_pool_t* keytable_pool;
+    // Run the bthread on workers of this tag. BTHREAD_TAG_INVALID means the
+    // tag of the creating worker, or BTHREAD_TAG_DEFAULT when the bthread is
+    // created by a non-worker pthread.
+    bthread_tag_t tag;
 
 #if defined(__cplusplus)
     void operator=(unsigned stacktype_and_flags) {
         stack_type = (stacktype_and_flags & 7);
         flags = (stacktype_and_flags & ~(unsigned)7u);
         keytable_pool = NULL;
+        tag = BTHREAD_TAG_INVALID;
     }
     bthread_attr_t operator|(unsigned other_flags) const {
         CHECK(!(other_flags & 7)) << "flags=" << other_flags;
@@ -111,23 +132,33 @@ typedef struct bthread_attr_t {
 // obvious drawback is that you need more worker pthreads when you have a lot
 // of such bthreads.
 static const bthread_attr_t BTHREAD_ATTR_PTHREAD =
-{ BTHREAD_STACKTYPE_PTHREAD, 0, NULL };
+{ BTHREAD_STACKTYPE_PTHREAD, 0, NULL, BTHREAD_TAG_INVALID };
+
+// bthreads started with this attribute run on the stack of worker pthread
+// shared by all such bthreads, thus no stack is allocated or touched for them,
+// which suits short non-blocking functions, say done closures or timer
+// callbacks. Such bthreads must not block: blocking functions(bthread_mutex,
+// bthread_cond, bthread_join, butex_wait ...) block the worker pthread like
+// BTHREAD_ATTR_PTHREAD and are warned in log.
+static const bthread_attr_t BTHREAD_ATTR_SHARED =
+{ BTHREAD_STACKTYPE_SHARED, 0, NULL, BTHREAD_TAG_INVALID };
 
 // bthreads created with following attributes will have different size of
 // stacks. Default is BTHREAD_ATTR_NORMAL.
 static const bthread_attr_t BTHREAD_ATTR_SMALL =
-{ BTHREAD_STACKTYPE_SMALL, 0, NULL };
+{ BTHREAD_STACKTYPE_SMALL, 0, NULL, BTHREAD_TAG_INVALID };
 static const bthread_attr_t BTHREAD_ATTR_NORMAL =
-{ BTHREAD_STACKTYPE_NORMAL, 0, NULL };
+{ BTHREAD_STACKTYPE_NORMAL, 0, NULL, BTHREAD_TAG_INVALID };
 static const bthread_attr_t BTHREAD_ATTR_LARGE =
-{ BTHREAD_STACKTYPE_LARGE, 0, NULL };
+{ BTHREAD_STACKTYPE_LARGE, 0, NULL, BTHREAD_TAG_INVALID };
 
 // bthreads created with this attribute will print log when it's started,
 // context-switched, finished.
 static const bthread_attr_t BTHREAD_ATTR_DEBUG = {
     BTHREAD_STACKTYPE_NORMAL,
     BTHREAD_LOG_START_AND_FINISH | BTHREAD_LOG_CONTEXT_SWITCH,
-    NULL
+    NULL,
+    BTHREAD_TAG_INVALID
 };
 
 static const size_t BTHREAD_EPOLL_THREAD_NUM = 1;
@@ -137,6 +168,9 @@ static const bthread_t BTHREAD_ATOMIC_INIT = 0;
 static const int BTHREAD_MIN_CONCURRENCY = 3 + BTHREAD_EPOLL_THREAD_NUM;
 static const int BTHREAD_MAX_CONCURRENCY = 1024;
 
+// Max number of tags of worker pthreads.
+static const int BTHREAD_MAX_TAG_NUM = 16;
+
 typedef struct {
     void* impl;
     // following fields are part of previous impl. and not used right now.
@@ -159,6 +193,8 @@ typedef struct {
 } bthread_mutex_t;
 
 typedef struct {
+    // Non-zero to hand the lock over to a waiter directly on unlock.
+    int handoff;
 } bthread_mutexattr_t;
 
 typedef struct {
@@ -170,6 +206,16 @@ typedef struct {
 } bthread_condattr_t;
 
 typedef struct {
+    // Number of readers holding the lock, the highest bit is set when a
+    // writer is waiting for or holding the lock.
+    unsigned* lock_butex;
+    // Increased when the writer leaves, waited by readers blocked by it.
+    unsigned* reader_butex;
+    // Held by the writer, serializing writers.
+    bthread_mutex_t write_queue_mutex;
+    // True when the lock is held by the writer.
+    bool wlock_flag;
+    bthread_contention_site_t writer_csite;
 } bthread_rwlock_t;
 
 typedef struct {
@@ -40,6 +40,24 @@ extern void bthread_flush();
 // worker pthreads are not notified.
 extern int bthread_about_to_quit();
 
+// Make the calling bthread be scheduled as if it's created with (non-zero
+// `high') or without (zero `high') BTHREAD_PRIORITY_HIGH, since next time
+// it's ready to run.
+// Returns 0 on success, EPERM when called outside bthreads.
+extern int bthread_set_high_priority(int high);
+
+// Statistics of a bthread.
+typedef struct {
+    int64_t cputime_ns;     // time spent on running
+    int64_t queue_ns;       // total time waited in runqueues before running
+    int64_t last_queue_ns;  // time waited in the runqueue before latest run
+    int64_t nswitch;        // number of context switches
+} bthread_stat_t;
+
+// Get statistics of the calling bthread.
+// Returns 0 on success, EPERM when called outside bthreads.
+extern int bthread_self_stat(bthread_stat_t* stat);
+
 // Run `on_timer(arg)' at or after real-time `abstime'. Put identifier of the
 // timer into *id.
 // Return 0 on success, errno otherwise.
@@ -76,6 +94,13 @@ extern int bthread_close(int fd);
 extern int bthread_connect(int sockfd, const sockaddr* serv_addr,
                            socklen_t addrlen);
 
+// Replacement of pread(2)/pwrite(2) in bthreads. When io_uring is available,
+// only the calling bthread is suspended during the I/O instead of the
+// worker pthread. Same as pread(2)/pwrite(2) otherwise.
+extern ssize_t bthread_pread(int fd, void* buf, size_t count, off_t offset);
+extern ssize_t bthread_pwrite(int fd, const void* buf, size_t count,
+                              off_t offset);
+
 // Add a startup function that each pthread worker will run at the beginning
 // To run code at the end, use butil::thread_atexit()
 // Returns 0 on success, error code otherwise.
@@ -19,29 +19,42 @@
 #ifndef BTHREAD_WORK_STEALING_QUEUE_H
 #define BTHREAD_WORK_STEALING_QUEUE_H
 
+#include <new>                                  // std::nothrow
 #include "butil/macros.h"
 #include "butil/atomicops.h"
 #include "butil/logging.h"
 
 namespace bthread {
 
+// A Chase-Lev deque whose buffer grows when push() finds it full.
+// Stealers may still be reading a buffer when it's replaced, so replaced
+// buffers are kept until destruction of the queue, which cost less memory
+// than the current buffer in total.
 template <typename T>
 class WorkStealingQueue {
 public:
     WorkStealingQueue()
         : _bottom(1)
-        , _capacity(0)
+        , _max_capacity(0)
         , _buffer(NULL)
         , _top(1) {
     }
 
     ~WorkStealingQueue() {
-        delete [] _buffer;
-        _buffer = NULL;
+        Buffer* buf = _buffer.load(butil::memory_order_relaxed);
+        while (buf != NULL) {
+            Buffer* prev = buf->prev;
+            delete [] buf->items;
+            delete buf;
+            buf = prev;
+        }
+        _buffer.store(NULL, butil::memory_order_relaxed);
     }
 
-    int init(size_t capacity) {
-        if (_capacity != 0) {
+    // The queue holds `capacity' items initially and may grow() up to
+    // `max_capacity' items, which is `capacity' when it's 0.
+    int init(size_t capacity, size_t max_capacity = 0) {
+        if (_max_capacity != 0) {
             LOG(ERROR) << "Already initialized";
             return -1;
         }
@@ -54,29 +67,68 @@ public:
                        << " which must be power of 2";
             return -1;
         }
-        _buffer = new(std::nothrow) T[capacity];
-        if (NULL == _buffer) {
+        if (max_capacity == 0) {
+            max_capacity = capacity;
+        }
+        if (max_capacity < capacity || (max_capacity & (max_capacity - 1))) {
+            LOG(ERROR) << "Invalid max_capacity=" << max_capacity
+                       << " which must be power of 2 and not less than "
+                       << capacity;
+            return -1;
+        }
+        Buffer* buf = new_buffer(capacity);
+        if (NULL == buf) {
             return -1;
         }
-        _capacity = capacity;
+        _buffer.store(buf, butil::memory_order_relaxed);
+        _max_capacity = max_capacity;
         return 0;
     }
 
     // Push an item into the queue.
-    // Returns true on pushed.
+    // Returns true on pushed, false when the queue is full which may be
+    // retried after grow().
     // May run in parallel with steal().
     // Never run in parallel with pop() or another push().
     bool push(const T& x) {
         const size_t b = _bottom.load(butil::memory_order_relaxed);
         const size_t t = _top.load(butil::memory_order_acquire);
-        if (b >= t + _capacity) { // Full queue.
+        Buffer* buf = _buffer.load(butil::memory_order_relaxed);
+        if (b >= t + buf->capacity) { // Full queue.
             return false;
         }
-        _buffer[b & (_capacity - 1)] = x;
+        buf->items[b & (buf->capacity - 1)] = x;
         _bottom.store(b + 1, butil::memory_order_release);
         return true;
     }
 
+    // Double the capacity of the queue.
+    // Returns true on grown, false when max_capacity is reached or out of
+    // memory.
+    // May run in parallel with steal().
+    // Never run in parallel with push() pop() or another grow().
+    bool grow() {
+        Buffer* old_buf = _buffer.load(butil::memory_order_relaxed);
+        if (old_buf->capacity >= _max_capacity) {
+            return false;
+        }
+        Buffer* buf = new_buffer(old_buf->capacity * 2);
+        if (NULL == buf) {
+            return false;
+        }
+        // Items in [t, b) are copied, stealers reading the old buffer get
+        // same values from it.
+        const size_t b = _bottom.load(butil::memory_order_relaxed);
+        const size_t t = _top.load(butil::memory_order_acquire);
+        for (size_t i = t; i < b; ++i) {
+            buf->items[i & (buf->capacity - 1)] =
+                old_buf->items[i & (old_buf->capacity - 1)];
+        }
+        buf->prev = old_buf;
+        _buffer.store(buf, butil::memory_order_release);
+        return true;
+    }
+
     // Pop an item from the queue.
     // Returns true on popped and the item is written to `val'.
     // May run in parallel with steal().
@@ -97,7 +149,8 @@ public:
             _bottom.store(b, butil::memory_order_relaxed);
             return false;
         }
-        *val = _buffer[newb & (_capacity - 1)];
+        Buffer* buf = _buffer.load(butil::memory_order_relaxed);
+        *val = buf->items[newb & (buf->capacity - 1)];
         if (t != newb) {
             return true;
         }
@@ -110,7 +163,7 @@ public:
 
     // Steal one item from the queue.
     // Returns true on stolen.
-    // May run in parallel with push() pop() or another steal().
+    // May run in parallel with push() pop() grow() or another steal().
     bool steal(T* val) {
         size_t t = _top.load(butil::memory_order_acquire);
         size_t b = _bottom.load(butil::memory_order_acquire);
@@ -124,7 +177,8 @@ public:
             if (t >= b) {
                 return false;
             }
-            *val = _buffer[t & (_capacity - 1)];
+            Buffer* buf = _buffer.load(butil::memory_order_acquire);
+            *val = buf->items[t & (buf->capacity - 1)];
         } while (!_top.compare_exchange_strong(t, t + 1,
                                                butil::memory_order_seq_cst,
                                                butil::memory_order_relaxed));
@@ -137,15 +191,41 @@ public:
         return (b <= t ? 0 : (b - t));
     }
 
-    size_t capacity() const { return _capacity; }
+    size_t capacity() const {
+        return _buffer.load(butil::memory_order_relaxed)->capacity;
+    }
+
+    size_t max_capacity() const { return _max_capacity; }
 
 private:
     // Copying a concurrent structure makes no sense.
     DISALLOW_COPY_AND_ASSIGN(WorkStealingQueue);
 
+    struct Buffer {
+        size_t capacity;
+        T* items;
+        // The buffer replaced by this one.
+        Buffer* prev;
+    };
+
+    static Buffer* new_buffer(size_t capacity) {
+        Buffer* buf = new (std::nothrow) Buffer;
+        if (NULL == buf) {
+            return NULL;
+        }
+        buf->items = new (std::nothrow) T[capacity];
+        if (NULL == buf->items) {
+            delete buf;
+            return NULL;
+        }
+        buf->capacity = capacity;
+        buf->prev = NULL;
+        return buf;
+    }
+
     butil::atomic<size_t> _bottom;
-    size_t _capacity;
-    T* _buffer;
+    size_t _max_capacity;
+    butil::atomic<Buffer*> _buffer;
     butil::atomic<size_t> BAIDU_CACHELINE_ALIGNMENT _top;
 };
 
@@ -29,6 +29,13 @@ inline char ascii_tolower(char c) {
     return g_tolower_map[(int)c];
 }
 
+// A string whose case-ignored hash is computed only once, used for looking
+// up well-known keys (say header names of HTTP) in CaseIgnoredFlatMap
+// repeatedly. Example:
+//   static const butil::CaseIgnoredKey HOST("host");
+//   map.seek(HOST);
+class CaseIgnoredKey;
+
 struct CaseIgnoredHasher {
     size_t operator()(const std::string& s) const {
         std::size_t result = 0;                                               
@@ -44,8 +51,31 @@ struct CaseIgnoredHasher {
         }
         return result;
     }
+    inline size_t operator()(const CaseIgnoredKey& k) const;
+};
+
+class CaseIgnoredKey {
+public:
+    explicit CaseIgnoredKey(const std::string& s)
+        : _str(s), _hash(CaseIgnoredHasher()(s)) {}
+    explicit CaseIgnoredKey(const char* s)
+        : _str(s), _hash(CaseIgnoredHasher()(s)) {}
+
+    const std::string& str() const { return _str; }
+    const char* c_str() const { return _str.c_str(); }
+    size_t size() const { return _str.size(); }
+    size_t hash() const { return _hash; }
+    operator const std::string&() const { return _str; }
+
+private:
+    std::string _str;
+    size_t _hash;
 };
 
+inline size_t CaseIgnoredHasher::operator()(const CaseIgnoredKey& k) const {
+    return k.hash();
+}
+
 struct CaseIgnoredEqual {
     // NOTE: No overload for butil::StringPiece. It needs strncasecmp
     // which is much slower than strcasecmp in micro-benchmarking. As a
@@ -56,6 +86,10 @@ struct CaseIgnoredEqual {
     }
     bool operator()(const std::string& s1, const char* s2) const
     { return strcasecmp(s1.c_str(), s2) == 0; }
+    bool operator()(const std::string& s1, const CaseIgnoredKey& s2) const {
+        return s1.size() == s2.size() &&
+            strcasecmp(s1.c_str(), s2.c_str()) == 0;
+    }
 };
 
 template <typename T>
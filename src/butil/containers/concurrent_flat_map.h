@@ -0,0 +1,453 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An open-addressing hash map for read-mostly lookups from many threads.
+//
+// Keys are distributed into shards, each of which is a linear-probing
+// table guarded by a mutex and a sequence number. seek() never locks: it
+// reads the sequence number, probes the table, copies the value out and
+// retries if the sequence number was changed by a writer meanwhile.
+// Writers (insert/erase) lock the shard and bump the sequence number
+// before and after the modification, so writers on different shards don't
+// interfere with each other.
+//
+// Restrictions due to the optimistic reading:
+//  - K and V must be trivially copyable and trivially destructible (PODs,
+//    EndPoints, ids ...), since they may be copied by readers while being
+//    overwritten. V must be default-constructible.
+//  - There's no iteration, keep another container if you need to list
+//    the entries.
+//  - Tables replaced by enlarging are kept until the map is destroyed to
+//    make sure that readers never touch freed memory. Total memory of
+//    them is less than the current tables, since tables are only replaced
+//    by ones twice as large: tables filled with DELETED slots by erasures
+//    are rehashed in place.
+//
+// See test/concurrent_flat_map_unittest.cpp for comparisons with
+// FlatMap+mutex and DoublyBufferedData<FlatMap>: seek() is several times
+// faster with many reading threads, and modifications are O(1) rather than
+// being applied to two instances as DoublyBufferedData does.
+
+#ifndef BUTIL_CONTAINERS_CONCURRENT_FLAT_MAP_H
+#define BUTIL_CONTAINERS_CONCURRENT_FLAT_MAP_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <new>                                  // placement new
+#include "butil/atomicops.h"
+#include "butil/compiler_specific.h"            // BAIDU_CACHELINE_ALIGNMENT
+#include "butil/macros.h"                       // DISALLOW_COPY_AND_ASSIGN
+#include "butil/memory/aligned_memory.h"        // AlignedMemory
+#include "butil/containers/flat_map.h"          // DefaultHasher
+
+namespace butil {
+
+template <typename K, typename V,
+          typename Hash = DefaultHasher<K>,
+          typename Equal = DefaultEqualTo<K> >
+class ConcurrentFlatMap {
+public:
+    ConcurrentFlatMap();
+    ~ConcurrentFlatMap();
+
+    // Allocate `nshard' (rounded up to power of 2) shards, each of which
+    // has buckets for about `nbucket / nshard' elements initially. Shards
+    // are enlarged on demand.
+    // Returns 0 on success, -1 otherwise.
+    int init(size_t nbucket, size_t nshard = 32);
+
+    // True if init() succeeded.
+    bool initialized() const { return _shards != NULL; }
+
+    // Copy the value associated with `key' into `value'. Lock-free.
+    // Returns true if the key exists.
+    bool seek(const K& key, V* value) const;
+
+    // Insert or overwrite the value associated with `key'.
+    // Returns 0 on success, -1 otherwise (not initialized or ENOMEM).
+    int insert(const K& key, const V& value);
+
+    // Remove `key'. Returns number of erased elements (0 or 1).
+    size_t erase(const K& key);
+
+    // Remove all elements.
+    void clear();
+
+    // Number of elements.
+    size_t size() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ConcurrentFlatMap);
+
+    enum SlotState { EMPTY = 0, FULL = 1, DELETED = 2 };
+
+    struct Slot {
+        Slot() : state(EMPTY) {}
+        const K* key() const { return key_mem.template data_as<K>(); }
+        K* key() { return key_mem.template data_as<K>(); }
+        const V* value() const { return value_mem.template data_as<V>(); }
+        V* value() { return value_mem.template data_as<V>(); }
+
+        butil::atomic<int> state;
+        AlignedMemory<sizeof(K), ALIGNOF(K)> key_mem;
+        AlignedMemory<sizeof(V), ALIGNOF(V)> value_mem;
+    };
+
+    struct Table {
+        size_t mask;            // number of slots - 1
+        Slot* slots;
+        Table* retired;         // earlier tables replaced by this one
+    };
+
+    struct BAIDU_CACHELINE_ALIGNMENT Shard {
+        // Odd iff a writer is modifying this shard.
+        butil::atomic<uint64_t> version;
+        butil::atomic<Table*> table;
+        // Number of FULL slots.
+        size_t size;
+        // Number of FULL and DELETED slots.
+        size_t nused;
+        pthread_mutex_t mutex;
+    };
+
+    static Table* new_table(size_t nslot, Table* retired);
+    static void delete_tables(Table* t);
+    // Called with shard.mutex locked.
+    static void begin_write(Shard& s);
+    static void end_write(Shard& s);
+    bool enlarge_if_needed(Shard& s);
+    // Copy FULL ones in the `nslot' slots into `t' which has no FULL slots.
+    void copy_full_slots(const Slot* slots, size_t nslot, Table* t) const;
+
+    size_t shard_index(size_t h) const { return h & (_nshard - 1); }
+    size_t slot_index(size_t h) const { return h >> _shard_bits; }
+
+    Shard* _shards;
+    size_t _nshard;
+    size_t _shard_bits;
+    Hash _hashfn;
+    Equal _eql;
+};
+
+// ===== Implementation =====
+
+template <typename K, typename V, typename H, typename E>
+ConcurrentFlatMap<K, V, H, E>::ConcurrentFlatMap()
+    : _shards(NULL), _nshard(0), _shard_bits(0) {}
+
+template <typename K, typename V, typename H, typename E>
+ConcurrentFlatMap<K, V, H, E>::~ConcurrentFlatMap() {
+    if (_shards) {
+        for (size_t i = 0; i < _nshard; ++i) {
+            delete_tables(_shards[i].table.load(butil::memory_order_relaxed));
+            pthread_mutex_destroy(&_shards[i].mutex);
+        }
+        delete [] _shards;
+        _shards = NULL;
+    }
+}
+
+template <typename K, typename V, typename H, typename E>
+typename ConcurrentFlatMap<K, V, H, E>::Table*
+ConcurrentFlatMap<K, V, H, E>::new_table(size_t nslot, Table* retired) {
+    Table* t = new (std::nothrow) Table;
+    if (t == NULL) {
+        return NULL;
+    }
+    t->slots = new (std::nothrow) Slot[nslot];
+    if (t->slots == NULL) {
+        delete t;
+        return NULL;
+    }
+    t->mask = nslot - 1;
+    t->retired = retired;
+    return t;
+}
+
+template <typename K, typename V, typename H, typename E>
+void ConcurrentFlatMap<K, V, H, E>::delete_tables(Table* t) {
+    while (t) {
+        Table* const saved_retired = t->retired;
+        delete [] t->slots;
+        delete t;
+        t = saved_retired;
+    }
+}
+
+template <typename K, typename V, typename H, typename E>
+int ConcurrentFlatMap<K, V, H, E>::init(size_t nbucket, size_t nshard) {
+    if (_shards != NULL || nshard == 0) {
+        return -1;
+    }
+    size_t shard_bits = 0;
+    while (((size_t)1 << shard_bits) < nshard) {
+        ++shard_bits;
+    }
+    nshard = (size_t)1 << shard_bits;
+    size_t nslot = 8;
+    while (nslot * nshard < nbucket * 2) {
+        nslot *= 2;
+    }
+    Shard* shards = new (std::nothrow) Shard[nshard];
+    if (shards == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < nshard; ++i) {
+        Table* t = new_table(nslot, NULL);
+        if (t == NULL) {
+            for (size_t j = 0; j < i; ++j) {
+                delete_tables(shards[j].table.load(butil::memory_order_relaxed));
+                pthread_mutex_destroy(&shards[j].mutex);
+            }
+            delete [] shards;
+            return -1;
+        }
+        shards[i].version.store(0, butil::memory_order_relaxed);
+        shards[i].table.store(t, butil::memory_order_relaxed);
+        shards[i].size = 0;
+        shards[i].nused = 0;
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+    _shard_bits = shard_bits;
+    _nshard = nshard;
+    _shards = shards;
+    return 0;
+}
+
+template <typename K, typename V, typename H, typename E>
+bool ConcurrentFlatMap<K, V, H, E>::seek(const K& key, V* value) const {
+    if (BAIDU_UNLIKELY(_shards == NULL)) {
+        return false;
+    }
+    const size_t h = _hashfn(key);
+    const Shard& s = _shards[shard_index(h)];
+    while (true) {
+        const uint64_t v1 = s.version.load(butil::memory_order_acquire);
+        if (v1 & 1) {
+            continue;  // being modified
+        }
+        const Table* t = s.table.load(butil::memory_order_acquire);
+        bool found = false;
+        V tmp;
+        size_t i = slot_index(h) & t->mask;
+        // Bounded by number of slots in case of reading a torn table.
+        for (size_t n = 0; n <= t->mask; ++n, i = ((i + 1) & t->mask)) {
+            const Slot& slot = t->slots[i];
+            const int state = slot.state.load(butil::memory_order_relaxed);
+            if (state == EMPTY) {
+                break;
+            }
+            if (state == FULL && _eql(*slot.key(), key)) {
+                tmp = *slot.value();
+                found = true;
+                break;
+            }
+        }
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        if (s.version.load(butil::memory_order_relaxed) == v1) {
+            if (found) {
+                *value = tmp;
+            }
+            return found;
+        }
+    }
+}
+
+template <typename K, typename V, typename H, typename E>
+void ConcurrentFlatMap<K, V, H, E>::begin_write(Shard& s) {
+    s.version.store(s.version.load(butil::memory_order_relaxed) + 1,
+                    butil::memory_order_relaxed);
+    // Following modifications can't be seen before the odd version.
+    butil::atomic_thread_fence(butil::memory_order_release);
+}
+
+template <typename K, typename V, typename H, typename E>
+void ConcurrentFlatMap<K, V, H, E>::end_write(Shard& s) {
+    s.version.store(s.version.load(butil::memory_order_relaxed) + 1,
+                    butil::memory_order_release);
+}
+
+template <typename K, typename V, typename H, typename E>
+void ConcurrentFlatMap<K, V, H, E>::copy_full_slots(
+    const Slot* slots, size_t nslot, Table* t) const {
+    for (size_t i = 0; i < nslot; ++i) {
+        const Slot& slot = slots[i];
+        if (slot.state.load(butil::memory_order_relaxed) != FULL) {
+            continue;
+        }
+        size_t j = slot_index(_hashfn(*slot.key())) & t->mask;
+        while (t->slots[j].state.load(butil::memory_order_relaxed) != EMPTY) {
+            j = ((j + 1) & t->mask);
+        }
+        Slot& dst = t->slots[j];
+        new (dst.key()) K(*slot.key());
+        new (dst.value()) V(*slot.value());
+        dst.state.store(FULL, butil::memory_order_relaxed);
+    }
+}
+
+template <typename K, typename V, typename H, typename E>
+bool ConcurrentFlatMap<K, V, H, E>::enlarge_if_needed(Shard& s) {
+    Table* t = s.table.load(butil::memory_order_relaxed);
+    const size_t nslot = t->mask + 1;
+    // Keep load factor (including DELETED) under 70%.
+    if ((s.nused + 1) * 10 <= nslot * 7) {
+        return true;
+    }
+    size_t new_nslot = nslot;
+    while ((s.size + 1) * 2 > new_nslot) {
+        new_nslot *= 2;
+    }
+    if (new_nslot == nslot) {
+        // Most used slots are DELETED. Rehash in place rather than replacing
+        // the table with one of the same size, otherwise the retired tables
+        // would pile up with churns of insertions and erasures. Readers
+        // seeing the table being rehashed retry since the version is odd.
+        Slot* saved = new (std::nothrow) Slot[nslot];
+        if (saved == NULL) {
+            return false;
+        }
+        for (size_t i = 0; i < nslot; ++i) {
+            Slot& slot = t->slots[i];
+            if (slot.state.load(butil::memory_order_relaxed) == FULL) {
+                new (saved[i].key()) K(*slot.key());
+                new (saved[i].value()) V(*slot.value());
+                saved[i].state.store(FULL, butil::memory_order_relaxed);
+            }
+            slot.state.store(EMPTY, butil::memory_order_relaxed);
+        }
+        copy_full_slots(saved, nslot, t);
+        delete [] saved;
+        s.nused = s.size;
+        return true;
+    }
+    Table* nt = new_table(new_nslot, t);
+    if (nt == NULL) {
+        return false;
+    }
+    copy_full_slots(t->slots, nslot, nt);
+    s.nused = s.size;
+    s.table.store(nt, butil::memory_order_release);
+    return true;
+}
+
+template <typename K, typename V, typename H, typename E>
+int ConcurrentFlatMap<K, V, H, E>::insert(const K& key, const V& value) {
+    if (BAIDU_UNLIKELY(_shards == NULL)) {
+        return -1;
+    }
+    const size_t h = _hashfn(key);
+    Shard& s = _shards[shard_index(h)];
+    pthread_mutex_lock(&s.mutex);
+    begin_write(s);
+    if (!enlarge_if_needed(s)) {
+        end_write(s);
+        pthread_mutex_unlock(&s.mutex);
+        return -1;
+    }
+    Table* t = s.table.load(butil::memory_order_relaxed);
+    Slot* first_deleted = NULL;
+    size_t i = slot_index(h) & t->mask;
+    while (true) {
+        Slot& slot = t->slots[i];
+        const int state = slot.state.load(butil::memory_order_relaxed);
+        if (state == EMPTY) {
+            Slot* dst = first_deleted;
+            if (dst == NULL) {
+                dst = &slot;
+                ++s.nused;
+            }
+            new (dst->key()) K(key);
+            new (dst->value()) V(value);
+            dst->state.store(FULL, butil::memory_order_relaxed);
+            ++s.size;
+            break;
+        }
+        if (state == FULL) {
+            if (_eql(*slot.key(), key)) {
+                *slot.value() = value;
+                break;
+            }
+        } else if (first_deleted == NULL) {
+            first_deleted = &slot;
+        }
+        i = ((i + 1) & t->mask);
+    }
+    end_write(s);
+    pthread_mutex_unlock(&s.mutex);
+    return 0;
+}
+
+template <typename K, typename V, typename H, typename E>
+size_t ConcurrentFlatMap<K, V, H, E>::erase(const K& key) {
+    if (BAIDU_UNLIKELY(_shards == NULL)) {
+        return 0;
+    }
+    const size_t h = _hashfn(key);
+    Shard& s = _shards[shard_index(h)];
+    size_t nerased = 0;
+    pthread_mutex_lock(&s.mutex);
+    Table* t = s.table.load(butil::memory_order_relaxed);
+    size_t i = slot_index(h) & t->mask;
+    for (size_t n = 0; n <= t->mask; ++n, i = ((i + 1) & t->mask)) {
+        Slot& slot = t->slots[i];
+        const int state = slot.state.load(butil::memory_order_relaxed);
+        if (state == EMPTY) {
+            break;
+        }
+        if (state == FULL && _eql(*slot.key(), key)) {
+            begin_write(s);
+            slot.state.store(DELETED, butil::memory_order_relaxed);
+            --s.size;
+            end_write(s);
+            nerased = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s.mutex);
+    return nerased;
+}
+
+template <typename K, typename V, typename H, typename E>
+void ConcurrentFlatMap<K, V, H, E>::clear() {
+    for (size_t i = 0; i < _nshard; ++i) {
+        Shard& s = _shards[i];
+        pthread_mutex_lock(&s.mutex);
+        begin_write(s);
+        Table* t = s.table.load(butil::memory_order_relaxed);
+        for (size_t j = 0; j <= t->mask; ++j) {
+            t->slots[j].state.store(EMPTY, butil::memory_order_relaxed);
+        }
+        s.size = 0;
+        s.nused = 0;
+        end_write(s);
+        pthread_mutex_unlock(&s.mutex);
+    }
+}
+
+template <typename K, typename V, typename H, typename E>
+size_t ConcurrentFlatMap<K, V, H, E>::size() const {
+    size_t n = 0;
+    for (size_t i = 0; i < _nshard; ++i) {
+        Shard& s = _shards[i];
+        pthread_mutex_lock(&s.mutex);
+        n += s.size;
+        pthread_mutex_unlock(&s.mutex);
+    }
+    return n;
+}
+
+}  // namespace butil
+
+#endif  // BUTIL_CONTAINERS_CONCURRENT_FLAT_MAP_H
@@ -20,6 +20,12 @@
 
 #include <vector>                                       // std::vector
 #include <pthread.h>
+#include <sched.h>                                      // sched_yield
+#include "butil/build_config.h"
+#if defined(OS_LINUX)
+#include <sys/syscall.h>                                // __NR_membarrier
+#include <unistd.h>                                     // syscall
+#endif
 #include "butil/scoped_lock.h"
 #include "butil/thread_local.h"
 #include "butil/logging.h"
@@ -46,10 +52,60 @@ namespace butil {
 // foreground and background, lock thread-local mutexes one by one to make
 // sure all existing Read() finish and later Read() see new foreground,
 // then modify background(foreground before flip) again.
+//
+// If WaitFreeRead is true, Read() does not lock the mutex but marks an
+// epoch of the thread-local wrapper odd during reading, Modify() waits for
+// odd epochs to change after flipping. On Linux supporting membarrier(2),
+// a barrier issued by Modify() makes Read() free of memory fences as well,
+// which is cheaper than the mutex when many threads read concurrently,
+// while Modify() costs a system call interrupting all running threads of
+// the process. Nested Read() of a same instance in one thread is not
+// allowed in both modes.
 
 class Void { };
 
-template <typename T, typename TLS = Void>
+namespace detail {
+
+#if defined(OS_LINUX) && defined(__NR_membarrier)
+inline bool register_membarrier() {
+    // MEMBARRIER_CMD_PRIVATE_EXPEDITED and its registration.
+    const int kPrivateExpedited = (1 << 3);
+    const int kRegisterPrivateExpedited = (1 << 4);
+    const long cmds = syscall(__NR_membarrier, 0/*QUERY*/, 0);
+    return cmds > 0 && (cmds & kPrivateExpedited) &&
+        syscall(__NR_membarrier, kRegisterPrivateExpedited, 0) == 0;
+}
+inline bool has_membarrier() {
+    static const bool has = register_membarrier();
+    return has;
+}
+#else
+inline bool has_membarrier() { return false; }
+#endif
+
+// Orders the epoch store before the following reads of readers, paired
+// with heavy_barrier() of writers.
+inline void light_barrier() {
+    if (has_membarrier()) {
+        butil::atomic_signal_fence(butil::memory_order_seq_cst);
+    } else {
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    }
+}
+
+inline void heavy_barrier() {
+#if defined(OS_LINUX) && defined(__NR_membarrier)
+    if (has_membarrier() &&
+        syscall(__NR_membarrier, (1 << 3)/*PRIVATE_EXPEDITED*/, 0) == 0) {
+        return;
+    }
+#endif
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+}
+
+}  // namespace detail
+
+template <typename T, typename TLS = Void, bool WaitFreeRead = false>
 class DoublyBufferedData {
     class Wrapper;
 public:
@@ -198,22 +254,12 @@ template <typename T>
 class DoublyBufferedDataWrapperBase<T, Void> {
 };
 
-
-template <typename T, typename TLS>
-class DoublyBufferedData<T, TLS>::Wrapper
-    : public DoublyBufferedDataWrapperBase<T, TLS> {
-friend class DoublyBufferedData;
+// Synchronizes Read() of a thread with Modify().
+template <bool WaitFreeRead>
+class DoublyBufferedDataReadGuard {
 public:
-    explicit Wrapper(DoublyBufferedData* c) : _control(c) {
-        pthread_mutex_init(&_mutex, NULL);
-    }
-    
-    ~Wrapper() {
-        if (_control != NULL) {
-            _control->RemoveWrapper(this);
-        }
-        pthread_mutex_destroy(&_mutex);
-    }
+    DoublyBufferedDataReadGuard() { pthread_mutex_init(&_mutex, NULL); }
+    ~DoublyBufferedDataReadGuard() { pthread_mutex_destroy(&_mutex); }
 
     // _mutex will be locked by the calling pthread and DoublyBufferedData.
     // Most of the time, no modifications are done, so the mutex is
@@ -229,16 +275,66 @@ public:
     inline void WaitReadDone() {
         BAIDU_SCOPED_LOCK(_mutex);
     }
+
+private:
+    pthread_mutex_t _mutex;
+};
+
+template <>
+class DoublyBufferedDataReadGuard<true> {
+public:
+    DoublyBufferedDataReadGuard() : _epoch(0) {}
+
+    // Only the calling pthread modifies _epoch, which is odd during reading.
+    inline void BeginRead() {
+        _epoch.store(_epoch.load(butil::memory_order_relaxed) + 1,
+                     butil::memory_order_relaxed);
+        detail::light_barrier();
+    }
+
+    inline void EndRead() {
+        _epoch.store(_epoch.load(butil::memory_order_relaxed) + 1,
+                     butil::memory_order_release);
+    }
+
+    // Called after detail::heavy_barrier(), the reading seen here may still
+    // use the old foreground, wait for its end.
+    inline void WaitReadDone() {
+        const uint64_t epoch = _epoch.load(butil::memory_order_acquire);
+        if (epoch & 1) {
+            while (_epoch.load(butil::memory_order_acquire) == epoch) {
+                sched_yield();
+            }
+        }
+    }
+
+private:
+    butil::atomic<uint64_t> _epoch;
+};
+
+
+template <typename T, typename TLS, bool WaitFreeRead>
+class DoublyBufferedData<T, TLS, WaitFreeRead>::Wrapper
+    : public DoublyBufferedDataWrapperBase<T, TLS>
+    , public DoublyBufferedDataReadGuard<WaitFreeRead> {
+friend class DoublyBufferedData;
+public:
+    explicit Wrapper(DoublyBufferedData* c) : _control(c) {}
     
+    ~Wrapper() {
+        if (_control != NULL) {
+            _control->RemoveWrapper(this);
+        }
+    }
+
 private:
     DoublyBufferedData* _control;
-    pthread_mutex_t _mutex;
 };
 
 // Called when thread initializes thread-local wrapper.
-template <typename T, typename TLS>
-typename DoublyBufferedData<T, TLS>::Wrapper*
-DoublyBufferedData<T, TLS>::AddWrapper() {
+template <typename T, typename TLS, bool WaitFreeRead>
+typename DoublyBufferedData<T, TLS, WaitFreeRead>::Wrapper*
+DoublyBufferedData<T, TLS, WaitFreeRead>::AddWrapper() {
     std::unique_ptr<Wrapper> w(new (std::nothrow) Wrapper(this));
     if (NULL == w) {
         return NULL;
@@ -253,9 +349,9 @@ DoublyBufferedData<T, TLS>::AddWrapper() {
 }
 
 // Called when thread quits.
-template <typename T, typename TLS>
-void DoublyBufferedData<T, TLS>::RemoveWrapper(
-    typename DoublyBufferedData<T, TLS>::Wrapper* w) {
+template <typename T, typename TLS, bool WaitFreeRead>
+void DoublyBufferedData<T, TLS, WaitFreeRead>::RemoveWrapper(
+    typename DoublyBufferedData<T, TLS, WaitFreeRead>::Wrapper* w) {
     if (NULL == w) {
         return;
     }
@@ -269,8 +365,8 @@ void DoublyBufferedData<T, TLS>::RemoveWrapper(
     }
 }
 
-template <typename T, typename TLS>
-DoublyBufferedData<T, TLS>::DoublyBufferedData()
+template <typename T, typename TLS, bool WaitFreeRead>
+DoublyBufferedData<T, TLS, WaitFreeRead>::DoublyBufferedData()
     : _index(0)
     , _created_key(false)
     , _wrapper_key(0) {
@@ -293,8 +389,8 @@ DoublyBufferedData<T, TLS>::DoublyBufferedData()
     }
 }
 
-template <typename T, typename TLS>
-DoublyBufferedData<T, TLS>::~DoublyBufferedData() {
+template <typename T, typename TLS, bool WaitFreeRead>
+DoublyBufferedData<T, TLS, WaitFreeRead>::~DoublyBufferedData() {
     // User is responsible for synchronizations between Read()/Modify() and
     // this function.
     if (_created_key) {
@@ -313,9 +409,9 @@ DoublyBufferedData<T, TLS>::~DoublyBufferedData() {
     pthread_mutex_destroy(&_wrappers_mutex);
 }
 
-template <typename T, typename TLS>
-int DoublyBufferedData<T, TLS>::Read(
-    typename DoublyBufferedData<T, TLS>::ScopedPtr* ptr) {
+template <typename T, typename TLS, bool WaitFreeRead>
+int DoublyBufferedData<T, TLS, WaitFreeRead>::Read(
+    typename DoublyBufferedData<T, TLS, WaitFreeRead>::ScopedPtr* ptr) {
     if (BAIDU_UNLIKELY(!_created_key)) {
         return -1;
     }
@@ -339,9 +435,9 @@ int DoublyBufferedData<T, TLS>::Read(
     return -1;
 }
 
-template <typename T, typename TLS>
+template <typename T, typename TLS, bool WaitFreeRead>
 template <typename Fn>
-size_t DoublyBufferedData<T, TLS>::Modify(Fn& fn) {
+size_t DoublyBufferedData<T, TLS, WaitFreeRead>::Modify(Fn& fn) {
     // _modify_mutex sequences modifications. Using a separate mutex rather
     // than _wrappers_mutex is to avoid blocking threads calling
     // AddWrapper() or RemoveWrapper() too long. Most of the time, modifications
@@ -364,6 +460,11 @@ size_t DoublyBufferedData<T, TLS>::Modify(Fn& fn) {
     
     // Wait until all threads finishes current reading. When they begin next
     // read, they should see updated _index.
+    if (WaitFreeRead) {
+        // Make readers which see old _index visible to following loads of
+        // epochs.
+        detail::heavy_barrier();
+    }
     {
         BAIDU_SCOPED_LOCK(_wrappers_mutex);
         for (size_t i = 0; i < _wrappers.size(); ++i) {
@@ -376,38 +477,38 @@ size_t DoublyBufferedData<T, TLS>::Modify(Fn& fn) {
     return ret2;
 }
 
-template <typename T, typename TLS>
+template <typename T, typename TLS, bool WaitFreeRead>
 template <typename Fn, typename Arg1>
-size_t DoublyBufferedData<T, TLS>::Modify(Fn& fn, const Arg1& arg1) {
+size_t DoublyBufferedData<T, TLS, WaitFreeRead>::Modify(Fn& fn, const Arg1& arg1) {
     Closure1<Fn, Arg1> c(fn, arg1);
     return Modify(c);
 }
 
-template <typename T, typename TLS>
+template <typename T, typename TLS, bool WaitFreeRead>
 template <typename Fn, typename Arg1, typename Arg2>
-size_t DoublyBufferedData<T, TLS>::Modify(
+size_t DoublyBufferedData<T, TLS, WaitFreeRead>::Modify(
     Fn& fn, const Arg1& arg1, const Arg2& arg2) {
     Closure2<Fn, Arg1, Arg2> c(fn, arg1, arg2);
     return Modify(c);
 }
 
-template <typename T, typename TLS>
+template <typename T, typename TLS, bool WaitFreeRead>
 template <typename Fn>
-size_t DoublyBufferedData<T, TLS>::ModifyWithForeground(Fn& fn) {
+size_t DoublyBufferedData<T, TLS, WaitFreeRead>::ModifyWithForeground(Fn& fn) {
     WithFG0<Fn> c(fn, _data);
     return Modify(c);
 }
 
-template <typename T, typename TLS>
+template <typename T, typename TLS, bool WaitFreeRead>
 template <typename Fn, typename Arg1>
-size_t DoublyBufferedData<T, TLS>::ModifyWithForeground(Fn& fn, const Arg1& arg1) {
+size_t DoublyBufferedData<T, TLS, WaitFreeRead>::ModifyWithForeground(Fn& fn, const Arg1& arg1) {
     WithFG1<Fn, Arg1> c(fn, _data, arg1);
     return Modify(c);
 }
 
-template <typename T, typename TLS>
+template <typename T, typename TLS, bool WaitFreeRead>
 template <typename Fn, typename Arg1, typename Arg2>
-size_t DoublyBufferedData<T, TLS>::ModifyWithForeground(
+size_t DoublyBufferedData<T, TLS, WaitFreeRead>::ModifyWithForeground(
     Fn& fn, const Arg1& arg1, const Arg2& arg2) {
     WithFG2<Fn, Arg1, Arg2> c(fn, _data, arg1, arg2);
     return Modify(c);
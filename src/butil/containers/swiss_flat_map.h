@@ -0,0 +1,190 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An open-addressing hash map with the same interface as FlatMap. Existing
+// code can opt in by replacing FlatMap with SwissFlatMap in typedefs.
+//
+// Elements are stored in a flat array of slots, each of which has a control
+// byte: 7 bits of the hash code when the slot is used, or EMPTY/DELETED.
+// Control bytes are grouped by 16 and compared with the hash code in one
+// SSE2 (or NEON) instruction, thus probing candidates of a key costs about
+// one cache miss for control bytes and one for the slot, while FlatMap
+// chases pointers of linked nodes when buckets collide.
+//
+// Differences with FlatMap:
+//  - Inserting or erasing elements invalidates iterators and addresses of
+//    values when the map is resized. Erasing does not resize.
+//  - load_factor is capped at 87, which is enough for open addressing.
+//  - No node pool, clear_and_reset_pool() is same as clear().
+//  - Memory per element is (1 + sizeof(value_type)) * 100 / load, without
+//    next pointers of FlatMap::Bucket. see perf_cmp_with_swiss_flat_map in
+//    test/flat_map_unittest.cpp for comparisons.
+
+#ifndef BUTIL_SWISS_FLAT_MAP_H
+#define BUTIL_SWISS_FLAT_MAP_H
+
+#include <stdint.h>
+#include <iterator>                                  // forward_iterator_tag
+#include "butil/containers/flat_map.h"               // DefaultHasher
+
+namespace butil {
+
+template <typename _Map, typename _Value> class SwissFlatMapIterator;
+
+template <typename _K, typename _T,
+          // Compute hash code from key. The hash code is mixed again inside
+          // so that identity hashes of integers work well.
+          typename _Hash = DefaultHasher<_K>,
+          // Test equivalence between stored-key and passed-key.
+          // stored-key is always on LHS, passed-key is always on RHS.
+          typename _Equal = DefaultEqualTo<_K> >
+class SwissFlatMap {
+public:
+    typedef _K key_type;
+    typedef _T mapped_type;
+    typedef std::pair<const _K, _T> value_type;
+    typedef SwissFlatMapIterator<SwissFlatMap, value_type> iterator;
+    typedef SwissFlatMapIterator<SwissFlatMap, const value_type> const_iterator;
+    typedef _Hash hasher;
+    typedef _Equal key_equal;
+    struct PositionHint {
+        size_t nbucket;
+        size_t offset;
+    };
+
+    // Number of control bytes probed together.
+    static const size_t GROUP_WIDTH = 16;
+    static const u_int MAX_LOAD_FACTOR = 87;
+
+    SwissFlatMap(const hasher& hashfn = hasher(),
+                 const key_equal& eql = key_equal());
+    ~SwissFlatMap();
+    SwissFlatMap(const SwissFlatMap& rhs);
+    void operator=(const SwissFlatMap& rhs);
+    void swap(SwissFlatMap& rhs);
+
+    // Must be called to initialize this map, otherwise insert/operator[]
+    // crashes, and seek/erase fails.
+    // `nbucket' is the initial number of slots, rounded up to power of 2.
+    // `load_factor' is the maximum value of (size()+deleted)*100/nbucket,
+    // if the value is reached, the map is rehashed. Values larger than
+    // MAX_LOAD_FACTOR are treated as MAX_LOAD_FACTOR.
+    int init(size_t nbucket, u_int load_factor = 80);
+
+    // Insert a pair of |key| and |value|, overwriting the value if |key|
+    // exists.
+    // Returns address of the inserted value, NULL on error.
+    mapped_type* insert(const key_type& key, const mapped_type& value);
+
+    // Remove |key| and the associated value
+    // Returns: 1 on erased, 0 otherwise.
+    template <typename K2> size_t erase(const K2& key);
+
+    // Remove all items. Allocated spaces are NOT returned by system.
+    void clear();
+
+    // Same as clear(), kept for compatibility with FlatMap.
+    void clear_and_reset_pool() { clear(); }
+
+    // Search for the value associated with |key|
+    // Returns: address of the value
+    template <typename K2> mapped_type* seek(const K2& key) const;
+
+    // Get the value associated with |key|. If |key| does not exist,
+    // insert with a default-constructed value.
+    // Returns reference of the value
+    mapped_type& operator[](const key_type& key);
+
+    // Rehash this map into at least `nbucket' slots. This is optional
+    // because resizing will be triggered by insert() or operator[] if
+    // there're too many items.
+    // Returns successful or not.
+    bool resize(size_t nbucket);
+
+    // Iterators
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    // Iterate the map inconsistently in more-than-one passes, see comments
+    // in FlatMap. Iteration is restarted at beginning when the map is resized.
+    void save_iterator(const const_iterator&, PositionHint*) const;
+    const_iterator restore_iterator(const PositionHint&) const;
+
+    // True if init() was successfully called.
+    bool initialized() const { return _ctrl != NULL; }
+
+    bool empty() const { return _size == 0; }
+    size_t size() const { return _size; }
+    size_t bucket_count() const { return _nbucket; }
+    u_int load_factor () const { return _load_factor; }
+
+    // Returns max/average number of probed groups to find the elements.
+    // This scans all slots.
+    BucketInfo bucket_info() const;
+
+private:
+template <typename _Map, typename _Value> friend class SwissFlatMapIterator;
+
+    // Values of control bytes besides 7-bit hash codes.
+    enum {
+        CTRL_EMPTY = -128,
+        CTRL_DELETED = -2,
+        CTRL_SENTINEL = -1     // stops iterators after the last slot
+    };
+
+    struct Slot {
+        value_type& value() {
+            void* spaces = value_spaces;  // Suppress strict-aliasing
+            return *reinterpret_cast<value_type*>(spaces);
+        }
+        const value_type& value() const {
+            const void* spaces = value_spaces;
+            return *reinterpret_cast<const value_type*>(spaces);
+        }
+        char value_spaces[sizeof(value_type)];
+    };
+
+    static uint64_t mix_hash(size_t h) {
+        return (uint64_t)h * 0x9E3779B97F4A7C15ULL;
+    }
+    static int8_t h2_of(uint64_t mixed) { return (int8_t)(mixed >> 57); }
+    size_t ngroup() const { return _nbucket / GROUP_WIDTH; }
+
+    // Returns index of the slot storing `key', -1 if not found.
+    template <typename K2> long find_index(const K2& key) const;
+    // Returns index of a free slot for a key not in this map.
+    size_t find_free_index(uint64_t mixed) const;
+    // Allocate `nbucket' slots and move elements into them.
+    bool rehash(size_t nbucket);
+    bool is_too_crowded(size_t nused) const
+    { return nused * 100 >= _nbucket * _load_factor; }
+    static bool allocate(size_t nbucket, int8_t** ctrl, Slot** slots);
+
+    size_t _size;
+    size_t _ndeleted;
+    size_t _nbucket;
+    int8_t* _ctrl;
+    Slot* _slots;
+    u_int _load_factor;
+    hasher _hashfn;
+    key_equal _eql;
+};
+
+}  // namespace butil
+
+#include "butil/containers/swiss_flat_map_inl.h"
+
+#endif  // BUTIL_SWISS_FLAT_MAP_H
@@ -0,0 +1,486 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BUTIL_SWISS_FLAT_MAP_INL_H
+#define BUTIL_SWISS_FLAT_MAP_INL_H
+
+#include <stdlib.h>                                  // malloc
+#include <string.h>                                  // memset
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace butil {
+
+namespace swiss_flat_map_internal {
+
+// Bitmask of 16 control bytes, bit i is set iff byte i matches.
+inline uint32_t group_match(const int8_t* ctrl, int8_t c) {
+#if defined(__SSE2__)
+    const __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    static const uint8_t POW2[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                      1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t eq = vceqq_s8(vld1q_s8(ctrl), vdupq_n_s8(c));
+    const uint8x16_t bits = vandq_u8(eq, vld1q_u8(POW2));
+    return vaddv_u8(vget_low_u8(bits)) |
+        ((uint32_t)vaddv_u8(vget_high_u8(bits)) << 8);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; ++i) {
+        mask |= (uint32_t)(ctrl[i] == c) << i;
+    }
+    return mask;
+#endif
+}
+
+// Bitmask of EMPTY or DELETED bytes, namely bytes less than SENTINEL(-1).
+inline uint32_t group_match_free(const int8_t* ctrl) {
+#if defined(__SSE2__)
+    const __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), g));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; ++i) {
+        mask |= (uint32_t)(ctrl[i] < -1) << i;
+    }
+    return mask;
+#endif
+}
+
+}  // namespace swiss_flat_map_internal
+
+template <typename Map, typename Value> class SwissFlatMapIterator {
+public:
+    typedef Value value_type;
+    typedef Value& reference;
+    typedef Value* pointer;
+    typedef typename add_const<Value>::type ConstValue;
+    typedef ConstValue& const_reference;
+    typedef ConstValue* const_pointer;
+    typedef std::forward_iterator_tag iterator_category;
+    typedef ptrdiff_t difference_type;
+    typedef typename remove_const<Value>::type NonConstValue;
+
+    SwissFlatMapIterator() : _map(NULL), _pos(0) {}
+    SwissFlatMapIterator(const Map* map, size_t pos) : _map(map), _pos(pos) {
+        if (map->initialized()) {
+            find_and_set_valid_slot();
+        } else {
+            _pos = 0;
+        }
+    }
+    SwissFlatMapIterator(const SwissFlatMapIterator<Map, NonConstValue>& rhs)
+        : _map(rhs._map), _pos(rhs._pos) {}
+    ~SwissFlatMapIterator() {}  // required by style-checker
+
+    // *this == rhs
+    bool operator==(const SwissFlatMapIterator& rhs) const
+    { return _pos == rhs._pos; }
+
+    // *this != rhs
+    bool operator!=(const SwissFlatMapIterator& rhs) const
+    { return _pos != rhs._pos; }
+
+    // ++ it
+    SwissFlatMapIterator& operator++() {
+        ++_pos;
+        find_and_set_valid_slot();
+        return *this;
+    }
+
+    // it ++
+    SwissFlatMapIterator operator++(int) {
+        SwissFlatMapIterator tmp = *this;
+        this->operator++();
+        return tmp;
+    }
+
+    reference operator*() { return value(); }
+    pointer operator->() { return &value(); }
+    const_reference operator*() const { return value(); }
+    const_pointer operator->() const { return &value(); }
+
+private:
+friend class SwissFlatMapIterator<Map, ConstValue>;
+friend class SwissFlatMap<typename Map::key_type, typename Map::mapped_type,
+                          typename Map::hasher, typename Map::key_equal>;
+
+    reference value() const
+    { return const_cast<Map*>(_map)->_slots[_pos].value(); }
+
+    // The sentinel after the last slot stops the loop.
+    void find_and_set_valid_slot() {
+        for (; _map->_ctrl[_pos] < 0 &&
+                 _map->_ctrl[_pos] != Map::CTRL_SENTINEL; ++_pos);
+    }
+
+    const Map* _map;
+    size_t _pos;
+};
+
+template <typename _K, typename _T, typename _H, typename _E>
+const size_t SwissFlatMap<_K, _T, _H, _E>::GROUP_WIDTH;
+
+template <typename _K, typename _T, typename _H, typename _E>
+const u_int SwissFlatMap<_K, _T, _H, _E>::MAX_LOAD_FACTOR;
+
+template <typename _K, typename _T, typename _H, typename _E>
+SwissFlatMap<_K, _T, _H, _E>::SwissFlatMap(const hasher& hashfn,
+                                           const key_equal& eql)
+    : _size(0)
+    , _ndeleted(0)
+    , _nbucket(0)
+    , _ctrl(NULL)
+    , _slots(NULL)
+    , _load_factor(0)
+    , _hashfn(hashfn)
+    , _eql(eql) {}
+
+template <typename _K, typename _T, typename _H, typename _E>
+SwissFlatMap<_K, _T, _H, _E>::~SwissFlatMap() {
+    clear();
+    free(_ctrl);
+    _ctrl = NULL;
+    free(_slots);
+    _slots = NULL;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+SwissFlatMap<_K, _T, _H, _E>::SwissFlatMap(const SwissFlatMap& rhs)
+    : _size(0)
+    , _ndeleted(0)
+    , _nbucket(0)
+    , _ctrl(NULL)
+    , _slots(NULL)
+    , _load_factor(rhs._load_factor)
+    , _hashfn(rhs._hashfn)
+    , _eql(rhs._eql) {
+    operator=(rhs);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissFlatMap<_K, _T, _H, _E>::operator=(const SwissFlatMap& rhs) {
+    if (this == &rhs) {
+        return;
+    }
+    // NOTE: assignment does not change _load_factor/_hashfn/_eql if |this| is
+    // initialized
+    clear();
+    if (rhs.empty()) {
+        return;
+    }
+    if (!initialized()) {
+        if (init(rhs._nbucket, rhs._load_factor) != 0) {
+            LOG(ERROR) << "Fail to init";
+            return;
+        }
+    } else if (_nbucket < rhs._nbucket && !rehash(rhs._nbucket)) {
+        LOG(ERROR) << "Fail to rehash";
+        return;
+    }
+    for (const_iterator it = rhs.begin(); it != rhs.end(); ++it) {
+        operator[](it->first) = it->second;
+    }
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissFlatMap<_K, _T, _H, _E>::swap(SwissFlatMap& rhs) {
+    std::swap(rhs._size, _size);
+    std::swap(rhs._ndeleted, _ndeleted);
+    std::swap(rhs._nbucket, _nbucket);
+    std::swap(rhs._ctrl, _ctrl);
+    std::swap(rhs._slots, _slots);
+    std::swap(rhs._load_factor, _load_factor);
+    std::swap(rhs._hashfn, _hashfn);
+    std::swap(rhs._eql, _eql);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+bool SwissFlatMap<_K, _T, _H, _E>::allocate(
+    size_t nbucket, int8_t** ctrl, Slot** slots) {
+    // One more control byte for the sentinel.
+    *ctrl = (int8_t*)malloc(nbucket + 1);
+    *slots = (Slot*)malloc(sizeof(Slot) * nbucket);
+    if (*ctrl == NULL || *slots == NULL) {
+        free(*ctrl);
+        free(*slots);
+        return false;
+    }
+    memset(*ctrl, CTRL_EMPTY, nbucket);
+    (*ctrl)[nbucket] = CTRL_SENTINEL;
+    return true;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+int SwissFlatMap<_K, _T, _H, _E>::init(size_t nbucket, u_int load_factor) {
+    if (initialized()) {
+        LOG(ERROR) << "Already initialized";
+        return -1;
+    }
+    if (load_factor < 10 || load_factor > 100) {
+        LOG(ERROR) << "Invalid load_factor=" << load_factor;
+        return -1;
+    }
+    size_t n = GROUP_WIDTH;
+    while (n < nbucket) {
+        n *= 2;
+    }
+    if (!allocate(n, &_ctrl, &_slots)) {
+        LOG(ERROR) << "Fail to allocate " << n << " slots";
+        return -1;
+    }
+    _size = 0;
+    _ndeleted = 0;
+    _nbucket = n;
+    _load_factor = std::min(load_factor, MAX_LOAD_FACTOR);
+    return 0;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+long SwissFlatMap<_K, _T, _H, _E>::find_index(const K2& key) const {
+    if (!initialized()) {
+        return -1;
+    }
+    const uint64_t mixed = mix_hash(_hashfn(key));
+    const int8_t h2 = h2_of(mixed);
+    const size_t group_mask = ngroup() - 1;
+    size_t g = mixed & group_mask;
+    // Triangular probing visits all groups since ngroup is power of 2.
+    for (size_t i = 1; i <= ngroup(); ++i) {
+        const int8_t* ctrl = _ctrl + g * GROUP_WIDTH;
+        uint32_t m = swiss_flat_map_internal::group_match(ctrl, h2);
+        while (m) {
+            const size_t index = g * GROUP_WIDTH + __builtin_ctz(m);
+            if (_eql(_slots[index].value().first, key)) {
+                return (long)index;
+            }
+            m &= m - 1;
+        }
+        if (swiss_flat_map_internal::group_match(ctrl, CTRL_EMPTY)) {
+            return -1;
+        }
+        g = (g + i) & group_mask;
+    }
+    return -1;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+size_t SwissFlatMap<_K, _T, _H, _E>::find_free_index(uint64_t mixed) const {
+    const size_t group_mask = ngroup() - 1;
+    size_t g = mixed & group_mask;
+    for (size_t i = 1; ; ++i) {
+        const uint32_t m =
+            swiss_flat_map_internal::group_match_free(_ctrl + g * GROUP_WIDTH);
+        if (m) {
+            return g * GROUP_WIDTH + __builtin_ctz(m);
+        }
+        g = (g + i) & group_mask;
+    }
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+_T* SwissFlatMap<_K, _T, _H, _E>::seek(const K2& key) const {
+    const long index = find_index(key);
+    if (index < 0) {
+        return NULL;
+    }
+    return &_slots[index].value().second;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+_T& SwissFlatMap<_K, _T, _H, _E>::operator[](const key_type& key) {
+    const long index = find_index(key);
+    if (index >= 0) {
+        return _slots[index].value().second;
+    }
+    if (is_too_crowded(_size + _ndeleted + 1)) {
+        // Drop DELETED slots only if there're many of them.
+        const size_t n = (is_too_crowded(_size * 2 + 1) ?
+                          _nbucket * 2 : _nbucket);
+        if (!rehash(n)) {
+            LOG(ERROR) << "Fail to rehash";
+        }
+    }
+    const uint64_t mixed = mix_hash(_hashfn(key));
+    const size_t free_index = find_free_index(mixed);
+    if (_ctrl[free_index] == CTRL_DELETED) {
+        --_ndeleted;
+    }
+    _ctrl[free_index] = h2_of(mixed);
+    ++_size;
+    // NOTE: T() zeroizes PODs, see FlatMapElement.
+    value_type* p = new (_slots[free_index].value_spaces) value_type(key, _T());
+    return p->second;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+_T* SwissFlatMap<_K, _T, _H, _E>::insert(const key_type& key,
+                                         const mapped_type& value) {
+    mapped_type* p = &operator[](key);
+    *p = value;
+    return p;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+size_t SwissFlatMap<_K, _T, _H, _E>::erase(const K2& key) {
+    const long index = find_index(key);
+    if (index < 0) {
+        return 0;
+    }
+    _slots[index].value().~value_type();
+    --_size;
+    // If the group has EMPTY slots, it was never full so no probing passed
+    // it and the slot can be EMPTY as well.
+    const int8_t* group = _ctrl + (index / GROUP_WIDTH) * GROUP_WIDTH;
+    if (swiss_flat_map_internal::group_match(group, CTRL_EMPTY)) {
+        _ctrl[index] = CTRL_EMPTY;
+    } else {
+        _ctrl[index] = CTRL_DELETED;
+        ++_ndeleted;
+    }
+    return 1;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissFlatMap<_K, _T, _H, _E>::clear() {
+    if (!initialized()) {
+        return;
+    }
+    if (_size) {
+        for (size_t i = 0; i < _nbucket; ++i) {
+            if (_ctrl[i] >= 0) {
+                _slots[i].value().~value_type();
+            }
+        }
+    }
+    memset(_ctrl, CTRL_EMPTY, _nbucket);
+    _size = 0;
+    _ndeleted = 0;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+bool SwissFlatMap<_K, _T, _H, _E>::rehash(size_t nbucket) {
+    size_t n = GROUP_WIDTH;
+    while (n < nbucket || _size * 100 >= n * _load_factor) {
+        n *= 2;
+    }
+    int8_t* new_ctrl = NULL;
+    Slot* new_slots = NULL;
+    if (!allocate(n, &new_ctrl, &new_slots)) {
+        return false;
+    }
+    int8_t* const old_ctrl = _ctrl;
+    Slot* const old_slots = _slots;
+    const size_t old_nbucket = _nbucket;
+    _ctrl = new_ctrl;
+    _slots = new_slots;
+    _nbucket = n;
+    _ndeleted = 0;
+    for (size_t i = 0; i < old_nbucket; ++i) {
+        if (old_ctrl[i] < 0) {
+            continue;
+        }
+        value_type& v = old_slots[i].value();
+        const uint64_t mixed = mix_hash(_hashfn(v.first));
+        const size_t index = find_free_index(mixed);
+        _ctrl[index] = h2_of(mixed);
+        new (_slots[index].value_spaces) value_type(v);
+        v.~value_type();
+    }
+    free(old_ctrl);
+    free(old_slots);
+    return true;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+bool SwissFlatMap<_K, _T, _H, _E>::resize(size_t nbucket) {
+    if (!initialized()) {
+        return false;
+    }
+    return rehash(nbucket);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+BucketInfo SwissFlatMap<_K, _T, _H, _E>::bucket_info() const {
+    size_t max_n = 0;
+    size_t total = 0;
+    const size_t group_mask = ngroup() - 1;
+    for (size_t i = 0; i < _nbucket; ++i) {
+        if (_ctrl[i] < 0) {
+            continue;
+        }
+        const uint64_t mixed = mix_hash(_hashfn(_slots[i].value().first));
+        size_t g = mixed & group_mask;
+        size_t n = 1;
+        for (; g != i / GROUP_WIDTH; ++n) {
+            g = (g + n) & group_mask;
+        }
+        max_n = std::max(max_n, n);
+        total += n;
+    }
+    const BucketInfo info = { max_n, total / (double)std::max(_size, (size_t)1) };
+    return info;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::iterator
+SwissFlatMap<_K, _T, _H, _E>::begin() {
+    return iterator(this, 0);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::iterator
+SwissFlatMap<_K, _T, _H, _E>::end() {
+    return iterator(this, _nbucket);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::const_iterator
+SwissFlatMap<_K, _T, _H, _E>::begin() const {
+    return const_iterator(this, 0);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::const_iterator
+SwissFlatMap<_K, _T, _H, _E>::end() const {
+    return const_iterator(this, _nbucket);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissFlatMap<_K, _T, _H, _E>::save_iterator(
+    const const_iterator& it, PositionHint* hint) const {
+    hint->nbucket = _nbucket;
+    hint->offset = it._pos;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::const_iterator
+SwissFlatMap<_K, _T, _H, _E>::restore_iterator(const PositionHint& hint) const {
+    if (hint.nbucket != _nbucket/*resized*/ ||
+        hint.offset > _nbucket/*invalid hint*/) {
+        return begin();  // restart
+    }
+    return const_iterator(this, hint.offset);
+}
+
+}  // namespace butil
+
+#endif  // BUTIL_SWISS_FLAT_MAP_INL_H
@@ -18,6 +18,7 @@
 #include <nmmintrin.h>
 #endif
 #include "butil/build_config.h"
+#include "butil/iobuf.h"
 
 namespace butil {
 namespace crc32c {
@@ -453,5 +454,14 @@ uint32_t Extend(uint32_t crc, const char* buf, size_t size) {
   return ChosenExtend(crc, buf, size);
 }
 
+uint32_t Extend(uint32_t crc, const IOBuf& buf) {
+  const size_t n = buf.backing_block_num();
+  for (size_t i = 0; i < n; ++i) {
+    const StringPiece blk = buf.backing_block(i);
+    crc = Extend(crc, blk.data(), blk.size());
+  }
+  return crc;
+}
+
 }  // namespace crc32c
 }  // namespace butil
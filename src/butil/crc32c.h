@@ -14,6 +14,8 @@
 #include <stdint.h>
 
 namespace butil {
+class IOBuf;
+
 namespace crc32c {
 
 extern bool IsFastCrc32Supported();
@@ -28,6 +30,15 @@ inline uint32_t Value(const char* data, size_t n) {
   return Extend(0, data, n);
 }
 
+// Return the crc32c of concat(A, buf) where init_crc is the crc32c of some
+// string A. Backing blocks of `buf' are chained without being copied.
+extern uint32_t Extend(uint32_t init_crc, const IOBuf& buf);
+
+// Return the crc32c of all bytes inside `buf'
+inline uint32_t Value(const IOBuf& buf) {
+  return Extend(0, buf);
+}
+
 static const uint32_t kMaskDelta = 0xa282ead8ul;
 
 // Return a masked representation of crc.
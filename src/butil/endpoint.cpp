@@ -23,6 +23,14 @@
 #include <string.h>                            // strcpy
 #include <stdio.h>                             // snprintf
 #include <stdlib.h>                            // strtol
+#include <stddef.h>                            // offsetof
+#include <pthread.h>
+#include <sys/un.h>                            // sockaddr_un
+#include <sys/stat.h>                          // stat
+#include <map>
+#include <string>
+#include <vector>
+#include "butil/atomicops.h"                   // static_atomic
 #include "butil/fd_guard.h"                    // fd_guard
 #include "butil/endpoint.h"                    // ip_t
 #include "butil/logging.h"
@@ -89,8 +97,117 @@ int ip2hostname(ip_t ip, std::string* host) {
     return -1;
 }
 
+// Paths of unix domain sockets, indexed by port-1 of their EndPoints.
+struct UnixPathTable {
+    pthread_mutex_t mutex;
+    std::vector<const std::string*> paths;
+    std::map<std::string, int> ports;
+
+    UnixPathTable() { pthread_mutex_init(&mutex, NULL); }
+};
+
+static const size_t MAX_UNIX_PATH_LEN = sizeof(((sockaddr_un*)0)->sun_path) - 1;
+
+int unix_path2endpoint(const char* path, EndPoint* point) {
+    if (path == NULL || strlen(path) > MAX_UNIX_PATH_LEN) {
+        return -1;
+    }
+    UnixPathTable* t = get_leaky_singleton<UnixPathTable>();
+    int port = 0;
+    pthread_mutex_lock(&t->mutex);
+    std::map<std::string, int>::const_iterator it = t->ports.find(path);
+    if (it != t->ports.end()) {
+        port = it->second;
+    } else if (t->paths.size() < 65535) {
+        // Port 0 means "any port" to servers, start from 1.
+        port = t->paths.size() + 1;
+        it = t->ports.insert(std::make_pair(std::string(path), port)).first;
+        t->paths.push_back(&it->first);
+    }
+    pthread_mutex_unlock(&t->mutex);
+    if (port == 0) {
+        return -1;
+    }
+    point->ip = UNIX_SOCKET_IP;
+    point->port = port;
+    return 0;
+}
+
+const char* endpoint2unix_path(const EndPoint& point) {
+    if (!is_unix_endpoint(point) || point.port <= 0) {
+        return NULL;
+    }
+    UnixPathTable* t = get_leaky_singleton<UnixPathTable>();
+    const char* path = NULL;
+    pthread_mutex_lock(&t->mutex);
+    if ((size_t)point.port <= t->paths.size()) {
+        // Keys of std::map never move.
+        path = t->paths[point.port - 1]->c_str();
+    }
+    pthread_mutex_unlock(&t->mutex);
+    return path;
+}
+
+int endpoint2sockaddr(const EndPoint& point, sockaddr_storage* addr,
+                      socklen_t* len) {
+    bzero(addr, sizeof(*addr));
+    if (!is_unix_endpoint(point)) {
+        sockaddr_in* in = (sockaddr_in*)addr;
+        in->sin_family = AF_INET;
+        in->sin_addr = point.ip;
+        in->sin_port = htons(point.port);
+        *len = sizeof(sockaddr_in);
+        return 0;
+    }
+    const char* path = endpoint2unix_path(point);
+    if (path == NULL) {
+        return -1;
+    }
+    sockaddr_un* un = (sockaddr_un*)addr;
+    un->sun_family = AF_UNIX;
+    const size_t path_len = strlen(path);
+    memcpy(un->sun_path, path, path_len);
+    if (path[0] == '@') {
+        // Names in the abstract namespace start with '\0' and are not
+        // terminated.
+        un->sun_path[0] = '\0';
+        *len = offsetof(sockaddr_un, sun_path) + path_len;
+    } else {
+        *len = offsetof(sockaddr_un, sun_path) + path_len + 1;
+    }
+    return 0;
+}
+
+int sockaddr2endpoint(const sockaddr_storage& addr, socklen_t len,
+                      EndPoint* point) {
+    if (addr.ss_family == AF_INET) {
+        *point = EndPoint(*(const sockaddr_in*)&addr);
+        return 0;
+    }
+    if (addr.ss_family != AF_UNIX) {
+        return -1;
+    }
+    const sockaddr_un& un = (const sockaddr_un&)addr;
+    const size_t offset = offsetof(sockaddr_un, sun_path);
+    std::string path;
+    if (len > offset) {
+        if (un.sun_path[0] == '\0') {  // abstract namespace
+            path.push_back('@');
+            path.append(un.sun_path + 1, len - offset - 1);
+        } else {
+            path.append(un.sun_path, strnlen(un.sun_path, len - offset));
+        }
+    }  // else unnamed, say the client side.
+    return unix_path2endpoint(path.c_str(), point);
+}
+
 EndPointStr endpoint2str(const EndPoint& point) {
     EndPointStr str;
+    if (is_unix_endpoint(point)) {
+        const char* path = endpoint2unix_path(point);
+        snprintf(str._buf, sizeof(str._buf), "unix:%s", path ? path : "");
+        return str;
+    }
     if (inet_ntop(AF_INET, &point.ip, str._buf, INET_ADDRSTRLEN) == NULL) {
         return endpoint2str(EndPoint(IP_NONE, 0));
     }
@@ -100,6 +217,13 @@ EndPointStr endpoint2str(const EndPoint& point) {
     return str;
 }
 
+static butil::static_atomic<HostnameResolver> s_hostname_resolver =
+    BUTIL_STATIC_ATOMIC_INIT(NULL);
+
+void set_hostname_resolver(HostnameResolver resolver) {
+    s_hostname_resolver.store(resolver, butil::memory_order_release);
+}
+
 int hostname2ip(const char* hostname, ip_t* ip) {
     char buf[256];
     if (NULL == hostname) {
@@ -111,6 +235,11 @@ int hostname2ip(const char* hostname, ip_t* ip) {
         // skip heading space
         for (; isspace(*hostname); ++hostname);
     }
+    const HostnameResolver resolver =
+        s_hostname_resolver.load(butil::memory_order_acquire);
+    if (resolver != NULL) {
+        return resolver(hostname, ip);
+    }
 
 #if defined(OS_MACOSX)
     // gethostbyname on MAC is thread-safe (with current usage) since the
@@ -163,7 +292,13 @@ const char* my_hostname() {
     return get_leaky_singleton<MyAddressInfo>()->my_hostname;
 }
 
+static const char UNIX_PREFIX[] = "unix:";
+static const size_t UNIX_PREFIX_LEN = sizeof(UNIX_PREFIX) - 1;
+
 int str2endpoint(const char* str, EndPoint* point) {
+    if (strncmp(str, UNIX_PREFIX, UNIX_PREFIX_LEN) == 0) {
+        return unix_path2endpoint(str + UNIX_PREFIX_LEN, point);
+    }
     // Should be enough to hold ip address
     char buf[64];
     size_t i = 0;
@@ -206,6 +341,9 @@ int str2endpoint(const char* ip_str, int port, EndPoint* point) {
 }
 
 int hostname2endpoint(const char* str, EndPoint* point) {
+    if (strncmp(str, UNIX_PREFIX, UNIX_PREFIX_LEN) == 0) {
+        return unix_path2endpoint(str + UNIX_PREFIX_LEN, point);
+    }
     // Should be enough to hold ip address
     char buf[64];
     size_t i = 0;
@@ -271,21 +409,22 @@ int endpoint2hostname(const EndPoint& point, std::string* host) {
 }
 
 int tcp_connect(EndPoint point, int* self_port) {
-    fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_len = 0;
+    if (endpoint2sockaddr(point, &serv_addr, &serv_addr_len) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         return -1;
     }
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = point.ip;
-    serv_addr.sin_port = htons(point.port);
     int rc = 0;
     if (bthread_connect != NULL) {
         rc = bthread_connect(sockfd, (struct sockaddr*)&serv_addr,
-                             sizeof(serv_addr));
+                             serv_addr_len);
     } else {
-        rc = ::connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+        rc = ::connect(sockfd, (struct sockaddr*)&serv_addr, serv_addr_len);
     }
     if (rc < 0) {
         return -1;
@@ -302,7 +441,45 @@ int tcp_connect(EndPoint point, int* self_port) {
 }
 
 int tcp_listen(EndPoint point, bool reuse_addr) {
-    fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    return tcp_listen(point, reuse_addr, false);
+}
+
+// Remove the file of unix domain socket at `path' if no one listens to it.
+static void remove_stale_unix_socket(const sockaddr_storage& addr,
+                                     socklen_t len) {
+    const sockaddr_un& un = (const sockaddr_un&)addr;
+    if (un.sun_path[0] == '\0') {  // abstract namespace, no files.
+        return;
+    }
+    struct stat st;
+    if (stat(un.sun_path, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+        return;
+    }
+    fd_guard fd(socket(AF_UNIX, SOCK_STREAM, 0));
+    if (fd >= 0 && ::connect(fd, (const sockaddr*)&addr, len) != 0 &&
+        errno == ECONNREFUSED) {
+        unlink(un.sun_path);
+    }
+}
+
+int tcp_listen(EndPoint point, bool reuse_addr, bool reuse_port) {
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_len = 0;
+    if (endpoint2sockaddr(point, &serv_addr, &serv_addr_len) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (serv_addr.ss_family == AF_UNIX) {
+        if (reuse_port) {
+            errno = ENOPROTOOPT;
+            return -1;
+        }
+        if (reuse_addr) {
+            remove_stale_unix_socket(serv_addr, serv_addr_len);
+        }
+        reuse_addr = false;
+    }
+    fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         return -1;
     }
@@ -313,12 +490,19 @@ int tcp_listen(EndPoint point, bool reuse_addr) {
             return -1;
         }
     }
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = point.ip;
-    serv_addr.sin_port = htons(point.port); 
-    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
+    if (reuse_port) {
+#if defined(SO_REUSEPORT)
+        const int on = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                       &on, sizeof(on)) != 0) {
+            return -1;
+        }
+#else
+        errno = ENOPROTOOPT;
+        return -1;
+#endif
+    }
+    if (bind(sockfd, (struct sockaddr*)&serv_addr, serv_addr_len) != 0) {
         return -1;
     }
     if (listen(sockfd, INT_MAX) != 0) {
@@ -330,27 +514,27 @@ int tcp_listen(EndPoint point, bool reuse_addr) {
 }
 
 int get_local_side(int fd, EndPoint *out) {
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t socklen = sizeof(addr);
-    const int rc = getsockname(fd, &addr, &socklen);
+    const int rc = getsockname(fd, (struct sockaddr*)&addr, &socklen);
     if (rc != 0) {
         return rc;
     }
-    if (out) {
-        *out = butil::EndPoint(*(sockaddr_in*)&addr);
+    if (out && sockaddr2endpoint(addr, socklen, out) != 0) {
+        return -1;
     }
     return 0;
 }
 
 int get_remote_side(int fd, EndPoint *out) {
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t socklen = sizeof(addr);
-    const int rc = getpeername(fd, &addr, &socklen);
+    const int rc = getpeername(fd, (struct sockaddr*)&addr, &socklen);
     if (rc != 0) {
         return rc;
     }
-    if (out) {
-        *out = butil::EndPoint(*(sockaddr_in*)&addr);
+    if (out && sockaddr2endpoint(addr, socklen, out) != 0) {
+        return -1;
     }
     return 0;
 }
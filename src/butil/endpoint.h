@@ -62,6 +62,13 @@ IPStr ip2str(ip_t ip);
 // Returns 0 on success, -1 otherwise.
 int hostname2ip(const char* hostname, ip_t* ip);
 
+// Resolve hostnames by `resolver' in hostname2ip() and hostname2endpoint()
+// instead of the blocking gethostbyname_r. `resolver' should return 0 and
+// set the first ip of the hostname on success, -1 otherwise.
+// Pass NULL to restore the default.
+typedef int (*HostnameResolver)(const char* hostname, ip_t* ip);
+void set_hostname_resolver(HostnameResolver resolver);
+
 // Convert `ip' to `hostname'.
 // Returns 0 on success, -1 otherwise and errno is set.
 int ip2hostname(ip_t ip, char* hostname, size_t hostname_len);
@@ -90,9 +97,38 @@ struct EndPoint {
 
 struct EndPointStr {
     const char* c_str() const { return _buf; }
-    char _buf[INET_ADDRSTRLEN + 16];
+    // Enough for "unix:" and sun_path of sockaddr_un.
+    char _buf[128];
 };
 
+// Unix domain sockets are addressed by EndPoints as well, written as
+// "unix:<path>", or "unix:@<name>" for the abstract namespace (Linux only).
+// ip of such an EndPoint is UNIX_SOCKET_IP and port is the index of the path
+// registered in this process, so that it can be copied, compared and hashed
+// like other EndPoints. Registered paths are never removed.
+static const ip_t UNIX_SOCKET_IP = { 0xFEFEFEFEU };  // 254.254.254.254
+
+inline bool is_unix_endpoint(const EndPoint& point) {
+    return point.ip.s_addr == UNIX_SOCKET_IP.s_addr;
+}
+
+// Get the EndPoint of the unix domain socket at `path' (without "unix:").
+// Returns 0 on success, -1 otherwise.
+int unix_path2endpoint(const char* path, EndPoint* point);
+
+// Path of a unix domain socket EndPoint, NULL if `point' is not.
+const char* endpoint2unix_path(const EndPoint& point);
+
+// Fill `addr' with address of `point' and `*len' with its length.
+// Returns 0 on success, -1 otherwise.
+int endpoint2sockaddr(const EndPoint& point, sockaddr_storage* addr,
+                      socklen_t* len);
+
+// Convert an IPv4 or unix domain socket address, say from accept().
+// Returns 0 on success, -1 otherwise.
+int sockaddr2endpoint(const sockaddr_storage& addr, socklen_t len,
+                      EndPoint* point);
+
 // Convert EndPoint to c-style string. Notice that you can serialize 
 // EndPoint to std::ostream directly. Use this function when you don't 
 // have streaming log.
@@ -115,7 +151,8 @@ int endpoint2hostname(const EndPoint& point, char* hostname, size_t hostname_len
 int endpoint2hostname(const EndPoint& point, std::string* host);
 
 // Create a TCP socket and connect it to `server'. Write port of this side
-// into `self_port' if it's not NULL.
+// into `self_port' if it's not NULL. A unix domain socket is created if
+// `server' is an unix domain socket EndPoint, for all tcp_* functions.
 // Returns the socket descriptor, -1 otherwise and errno is set.
 int tcp_connect(EndPoint server, int* self_port);
 
@@ -124,6 +161,13 @@ int tcp_connect(EndPoint server, int* self_port);
 // Returns the socket descriptor, -1 otherwise and errno is set.
 int tcp_listen(EndPoint ip_and_port, bool reuse_addr);
 
+// Same as above, and if `reuse_port' is true, SO_REUSEPORT is set so that
+// multiple sockets can listen to a same port and incoming connections are
+// distributed between them by the kernel.
+// For unix domain sockets, `reuse_addr' removes the file left by a process
+// that is not listening anymore and `reuse_port' is not supported.
+int tcp_listen(EndPoint ip_and_port, bool reuse_addr, bool reuse_port);
+
 // Get the local end of a socket connection
 int get_local_side(int fd, EndPoint *out);
 
@@ -182,6 +226,9 @@ inline bool operator!=(EndPoint p1, EndPoint p2) {
 }
 
 inline std::ostream& operator<<(std::ostream& os, const EndPoint& ep) {
+    if (is_unix_endpoint(ep)) {
+        return os << endpoint2str(ep).c_str();
+    }
     return os << ep.ip << ':' << ep.port;
 }
 inline std::ostream& operator<<(std::ostream& os, const EndPointStr& ep_str) {
@@ -0,0 +1,159 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BUTIL_FAST_SEARCH_H
+#define BUTIL_FAST_SEARCH_H
+
+#include <stddef.h>                     // size_t
+#include <string.h>                     // memchr, memcmp
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace butil {
+
+// Searching primitives on flat memory, vectorized with SSE2 (x86_64) or
+// NEON (aarch64) which are always available on these platforms. Used by
+// IOBuf to search across blocks and by protocol parsers.
+
+// Returns address of the first byte in [s, s+n) equal to c1 or c2, NULL
+// if not found. Typically used for finding CR or LF in one pass instead of
+// calling memchr twice.
+inline const char* find_first_of2(const char* s, size_t n, char c1, char c2) {
+    const char* const end = s + n;
+#if defined(__SSE2__)
+    const __m128i v1 = _mm_set1_epi8(c1);
+    const __m128i v2 = _mm_set1_epi8(c2);
+    for (; s + 16 <= end; s += 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)s);
+        const int mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(x, v1), _mm_cmpeq_epi8(x, v2)));
+        if (mask) {
+            return s + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t v1 = vdupq_n_u8((uint8_t)c1);
+    const uint8x16_t v2 = vdupq_n_u8((uint8_t)c2);
+    for (; s + 16 <= end; s += 16) {
+        const uint8x16_t x = vld1q_u8((const uint8_t*)s);
+        if (vmaxvq_u8(vorrq_u8(vceqq_u8(x, v1), vceqq_u8(x, v2)))) {
+            break;  // found in this 16 bytes
+        }
+    }
+#endif
+    for (; s < end; ++s) {
+        if (*s == c1 || *s == c2) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// Returns address of the first control character (< 0x20 or 0x7F) in
+// [s, s+n), NULL if not found. Used for finding the CR ending a line of
+// text while validating that the line is printable in the same pass.
+inline const char* find_control_char(const char* s, size_t n) {
+    const char* const end = s + n;
+#if defined(__SSE2__)
+    const __m128i space_minus_1 = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    for (; s + 16 <= end; s += 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)s);
+        // x <= 0x1F (unsigned) iff min(x, 0x1F) == x
+        const int mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x, space_minus_1), x),
+                         _mm_cmpeq_epi8(x, del)));
+        if (mask) {
+            return s + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    const uint8x16_t del = vdupq_n_u8(0x7F);
+    for (; s + 16 <= end; s += 16) {
+        const uint8x16_t x = vld1q_u8((const uint8_t*)s);
+        if (vmaxvq_u8(vorrq_u8(vcltq_u8(x, space), vceqq_u8(x, del)))) {
+            break;  // found in this 16 bytes
+        }
+    }
+#endif
+    for (; s < end; ++s) {
+        const unsigned char c = *s;
+        if (c < 0x20 || c == 0x7F) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// Returns address of the first occurrence of [p, p+m) in [s, s+n), NULL if
+// not found. Candidates are filtered by comparing first and last bytes of
+// the pattern with 16 positions at once.
+inline const char* find_substr(const char* s, size_t n,
+                               const char* p, size_t m) {
+    if (m == 0) {
+        return s;
+    }
+    if (m > n) {
+        return NULL;
+    }
+    if (m == 1) {
+        return (const char*)memchr(s, p[0], n);
+    }
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(p[0]);
+    const __m128i last = _mm_set1_epi8(p[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        const __m128i bf = _mm_loadu_si128((const __m128i*)(s + i));
+        const __m128i bl = _mm_loadu_si128((const __m128i*)(s + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+        while (mask) {
+            const unsigned bit = __builtin_ctz(mask);
+            if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0) {
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t first = vdupq_n_u8((uint8_t)p[0]);
+    const uint8x16_t last = vdupq_n_u8((uint8_t)p[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        const uint8x16_t bf = vld1q_u8((const uint8_t*)(s + i));
+        const uint8x16_t bl = vld1q_u8((const uint8_t*)(s + i + m - 1));
+        if (vmaxvq_u8(vandq_u8(vceqq_u8(bf, first), vceqq_u8(bl, last)))) {
+            for (size_t j = i; j < i + 16; ++j) {
+                if (s[j] == p[0] && memcmp(s + j + 1, p + 1, m - 1) == 0) {
+                    return s + j;
+                }
+            }
+        }
+    }
+#endif
+    for (; i + m <= n; ++i) {
+        if (s[i] == p[0] && memcmp(s + i + 1, p + 1, m - 1) == 0) {
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+}  // namespace butil
+
+#endif  // BUTIL_FAST_SEARCH_H
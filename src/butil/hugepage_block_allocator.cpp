@@ -0,0 +1,432 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/mman.h>                       // mmap
+#include <stdint.h>                         // uintptr_t
+#include <string.h>                         // memset
+#include <algorithm>                        // std::max
+#include <new>                              // std::nothrow
+#include "butil/build_config.h"             // OS_LINUX
+#include "butil/atomicops.h"                // butil::atomic
+#include "butil/thread_local.h"             // thread_atexit
+#include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
+#include "butil/logging.h"
+#include "butil/iobuf.h"
+#include "butil/hugepage_block_allocator.h"
+
+#if defined(OS_LINUX)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#endif  // OS_LINUX
+
+namespace butil {
+namespace iobuf {
+
+// Defined in iobuf.cpp
+extern void* (*blockmem_allocate)(size_t);
+extern void  (*blockmem_deallocate)(void*);
+
+static const size_t HUGE_PAGE_2MB = 2UL * 1024 * 1024;
+static const size_t HUGE_PAGE_1GB = 1024UL * 1024 * 1024;
+
+HugePageAllocatorOptions::HugePageAllocatorOptions()
+    : region_size(HUGE_PAGE_2MB)
+    , max_memory(4UL * 1024 * 1024 * 1024)
+    , block_size(IOBuf::DEFAULT_BLOCK_SIZE)
+    , use_1gb_pages(false)
+    , max_cached_blocks_per_thread(64) {
+}
+
+namespace {
+
+// Free blocks are linked through their first bytes.
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+struct HugePageArena {
+    size_t region_size;
+    size_t block_size;
+    size_t min_alloc_size;
+    size_t max_regions;
+    size_t max_cached;
+    int page_flags;
+    void* (*prev_allocate)(size_t);
+    void  (*prev_deallocate)(void*);
+
+    // Bases of regions in an open-addressing table. Entries are only added
+    // and never removed, so that lookups are lock-free.
+    butil::atomic<uintptr_t>* region_table;
+    size_t table_mask;
+
+    // Following fields are protected by `mutex'.
+    butil::Mutex mutex;
+    FreeBlock* free_list;
+    size_t nfree;
+    char* carve_begin;
+    char* carve_end;
+    size_t nregion;
+    size_t nhugetlb_region;
+    size_t carved_memory;
+};
+
+struct TLSFreeList {
+    FreeBlock* head;
+    size_t num_blocks;
+    bool registered;
+    // Set when the thread is quitting. Blocks freed after that (e.g. by the
+    // TLS block chain of IOBuf) go to the global list directly.
+    bool exited;
+};
+
+}  // namespace
+
+static HugePageArena* g_arena = NULL;
+static butil::static_atomic<size_t> g_nfallback = BUTIL_STATIC_ATOMIC_INIT(0);
+static __thread TLSFreeList g_tls_free_list = { NULL, 0, false, false };
+
+inline size_t region_slot(const HugePageArena* a, uintptr_t base) {
+    // Fibonacci hashing on the index of the region.
+    return ((base / a->region_size) * 11400714819323198485ULL >> 20)
+        & a->table_mask;
+}
+
+static void add_region_to_table(HugePageArena* a, uintptr_t base) {
+    size_t i = region_slot(a, base);
+    while (a->region_table[i].load(butil::memory_order_relaxed) != 0) {
+        i = (i + 1) & a->table_mask;
+    }
+    a->region_table[i].store(base, butil::memory_order_release);
+}
+
+inline bool in_regions(const HugePageArena* a, const void* p) {
+    const uintptr_t base = (uintptr_t)p & ~(uintptr_t)(a->region_size - 1);
+    size_t i = region_slot(a, base);
+    do {
+        const uintptr_t v = a->region_table[i].load(butil::memory_order_acquire);
+        if (v == base) {
+            return true;
+        }
+        if (v == 0) {
+            return false;
+        }
+        i = (i + 1) & a->table_mask;
+    } while (true);
+}
+
+// Map `size' bytes aligned to `size' with additional `flags'.
+static void* map_aligned(size_t size, int flags) {
+    const int base_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    char* p = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          base_flags | flags, -1, 0);
+    if (p == (char*)MAP_FAILED) {
+        return NULL;
+    }
+    if (((uintptr_t)p & (size - 1)) == 0) {
+        return p;
+    }
+    munmap(p, size);
+    // Map twice of the size and trim both sides.
+    p = (char*)mmap(NULL, size * 2, PROT_READ | PROT_WRITE,
+                    base_flags | flags, -1, 0);
+    if (p == (char*)MAP_FAILED) {
+        return NULL;
+    }
+    char* const aligned = (char*)(((uintptr_t)p + size - 1) & ~(uintptr_t)(size - 1));
+    if (aligned != p) {
+        munmap(p, aligned - p);
+    }
+    char* const end = aligned + size;
+    if (end != p + size * 2) {
+        munmap(end, p + size * 2 - end);
+    }
+    return aligned;
+}
+
+// Called with a->mutex locked.
+static bool add_region(HugePageArena* a) {
+    if (a->nregion >= a->max_regions) {
+        return false;
+    }
+    bool hugetlb = false;
+    void* region = NULL;
+#if defined(OS_LINUX) && defined(MAP_HUGETLB)
+    region = map_aligned(a->region_size, MAP_HUGETLB | a->page_flags);
+    hugetlb = (region != NULL);
+#endif
+    if (region == NULL) {
+        region = map_aligned(a->region_size, 0);
+        if (region == NULL) {
+            PLOG_EVERY_SECOND(ERROR) << "Fail to map region of "
+                                     << a->region_size << " bytes";
+            return false;
+        }
+#if defined(OS_LINUX) && defined(MADV_HUGEPAGE)
+        madvise(region, a->region_size, MADV_HUGEPAGE);
+#endif
+    }
+    add_region_to_table(a, (uintptr_t)region);
+    a->carve_begin = (char*)region;
+    // Leave the tail which can't hold a whole block when region_size is
+    // not a multiple of block_size.
+    a->carve_end = (char*)region +
+        a->region_size / a->block_size * a->block_size;
+    ++a->nregion;
+    if (hugetlb) {
+        ++a->nhugetlb_region;
+    }
+    return true;
+}
+
+static void flush_tls_free_list(HugePageArena* a, TLSFreeList* tls,
+                                size_t nkeep) {
+    if (tls->num_blocks <= nkeep) {
+        return;
+    }
+    FreeBlock* first = tls->head;
+    for (size_t i = 0; i < nkeep; ++i) {
+        first = first->next;
+    }
+    // Find the tail of the blocks to be returned.
+    FreeBlock* last = first;
+    const size_t n = tls->num_blocks - nkeep;
+    for (size_t i = 1; i < n; ++i) {
+        last = last->next;
+    }
+    if (nkeep == 0) {
+        tls->head = NULL;
+    } else {
+        FreeBlock* p = tls->head;
+        for (size_t i = 1; i < nkeep; ++i) {
+            p = p->next;
+        }
+        p->next = NULL;
+    }
+    tls->num_blocks = nkeep;
+    BAIDU_SCOPED_LOCK(a->mutex);
+    last->next = a->free_list;
+    a->free_list = first;
+    a->nfree += n;
+}
+
+static void return_tls_free_list() {
+    TLSFreeList& tls = g_tls_free_list;
+    tls.exited = true;
+    if (g_arena) {
+        flush_tls_free_list(g_arena, &tls, 0);
+    }
+}
+
+inline void register_tls_free_list(TLSFreeList* tls) {
+    if (!tls->registered) {
+        tls->registered = true;
+        butil::thread_atexit(return_tls_free_list);
+    }
+}
+
+// Get a batch of blocks from the global list or carve them from regions.
+// One of them is returned while others are cached in TLS.
+static FreeBlock* refill_tls_free_list(HugePageArena* a, TLSFreeList* tls) {
+    const size_t batch = std::max(a->max_cached / 2, (size_t)1);
+    FreeBlock* head = NULL;
+    size_t n = 0;
+    {
+        BAIDU_SCOPED_LOCK(a->mutex);
+        if (a->free_list != NULL) {
+            head = a->free_list;
+            FreeBlock* last = head;
+            n = 1;
+            for (; n < batch && last->next != NULL; ++n) {
+                last = last->next;
+            }
+            a->free_list = last->next;
+            a->nfree -= n;
+            last->next = NULL;
+        } else {
+            if (a->carve_begin == a->carve_end && !add_region(a)) {
+                return NULL;
+            }
+            for (; n < batch && a->carve_begin != a->carve_end; ++n) {
+                FreeBlock* b = (FreeBlock*)a->carve_begin;
+                a->carve_begin += a->block_size;
+                b->next = head;
+                head = b;
+            }
+            a->carved_memory += n * a->block_size;
+        }
+    }
+    if (!tls->exited) {
+        tls->head = head->next;
+        tls->num_blocks = n - 1;
+        register_tls_free_list(tls);
+    } else if (head->next) {
+        BAIDU_SCOPED_LOCK(a->mutex);
+        FreeBlock* last = head->next;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = a->free_list;
+        a->free_list = head->next;
+        a->nfree += n - 1;
+    }
+    return head;
+}
+
+static void* hugepage_block_allocate(size_t size) {
+    HugePageArena* const a = g_arena;
+    if (size <= a->block_size && size > a->min_alloc_size) {
+        TLSFreeList& tls = g_tls_free_list;
+        FreeBlock* b = tls.head;
+        if (b != NULL) {
+            tls.head = b->next;
+            --tls.num_blocks;
+            return b;
+        }
+        b = refill_tls_free_list(a, &tls);
+        if (b != NULL) {
+            return b;
+        }
+    }
+    g_nfallback.fetch_add(1, butil::memory_order_relaxed);
+    return a->prev_allocate(size);
+}
+
+static void hugepage_block_deallocate(void* p) {
+    HugePageArena* const a = g_arena;
+    if (!in_regions(a, p)) {
+        return a->prev_deallocate(p);
+    }
+    FreeBlock* const b = (FreeBlock*)p;
+    TLSFreeList& tls = g_tls_free_list;
+    if (BAIDU_UNLIKELY(tls.exited)) {
+        BAIDU_SCOPED_LOCK(a->mutex);
+        b->next = a->free_list;
+        a->free_list = b;
+        ++a->nfree;
+        return;
+    }
+    b->next = tls.head;
+    tls.head = b;
+    if (++tls.num_blocks > a->max_cached) {
+        flush_tls_free_list(a, &tls, a->max_cached / 2);
+    }
+    register_tls_free_list(&tls);
+}
+
+inline size_t round_up_power_of_2(size_t n) {
+    size_t r = 1;
+    while (r < n) {
+        r <<= 1;
+    }
+    return r;
+}
+
+int enable_hugepage_block_allocator(const HugePageAllocatorOptions* options) {
+    HugePageAllocatorOptions opt;
+    if (options) {
+        opt = *options;
+    }
+    if (g_arena != NULL) {
+        LOG(ERROR) << "The huge-page block allocator was already enabled";
+        return -1;
+    }
+    const size_t page_size = (opt.use_1gb_pages ? HUGE_PAGE_1GB : HUGE_PAGE_2MB);
+    const size_t region_size =
+        round_up_power_of_2(std::max(opt.region_size, page_size));
+    if (opt.block_size < sizeof(FreeBlock) || opt.block_size > region_size) {
+        LOG(ERROR) << "Invalid block_size=" << opt.block_size;
+        return -1;
+    }
+    if (opt.max_memory < region_size) {
+        LOG(ERROR) << "max_memory=" << opt.max_memory
+                   << " is less than region_size=" << region_size;
+        return -1;
+    }
+    HugePageArena* a = new (std::nothrow) HugePageArena;
+    if (a == NULL) {
+        return -1;
+    }
+    a->region_size = region_size;
+    a->block_size = opt.block_size;
+    a->min_alloc_size = opt.block_size / 2;
+    a->max_regions = opt.max_memory / region_size;
+    a->max_cached = std::max(opt.max_cached_blocks_per_thread, (size_t)1);
+#if defined(OS_LINUX)
+    a->page_flags = (opt.use_1gb_pages ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+#else
+    a->page_flags = 0;
+#endif
+    // Keep the load factor of the table under 0.5
+    const size_t table_size = round_up_power_of_2(a->max_regions * 2);
+    a->region_table = new (std::nothrow) butil::atomic<uintptr_t>[table_size];
+    if (a->region_table == NULL) {
+        delete a;
+        return -1;
+    }
+    for (size_t i = 0; i < table_size; ++i) {
+        a->region_table[i].store(0, butil::memory_order_relaxed);
+    }
+    a->table_mask = table_size - 1;
+    a->free_list = NULL;
+    a->nfree = 0;
+    a->carve_begin = NULL;
+    a->carve_end = NULL;
+    a->nregion = 0;
+    a->nhugetlb_region = 0;
+    a->carved_memory = 0;
+    a->prev_allocate = blockmem_allocate;
+    a->prev_deallocate = blockmem_deallocate;
+    {
+        BAIDU_SCOPED_LOCK(a->mutex);
+        if (!add_region(a)) {
+            LOG(ERROR) << "Fail to map the first region";
+            delete [] a->region_table;
+            delete a;
+            return -1;
+        }
+    }
+    g_arena = a;
+    blockmem_allocate = hugepage_block_allocate;
+    blockmem_deallocate = hugepage_block_deallocate;
+    return 0;
+}
+
+bool is_hugepage_block_allocator_enabled() {
+    return g_arena != NULL;
+}
+
+void get_hugepage_allocator_stats(HugePageAllocatorStats* stats) {
+    HugePageArena* const a = g_arena;
+    if (a == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    BAIDU_SCOPED_LOCK(a->mutex);
+    stats->region_count = a->nregion;
+    stats->hugetlb_region_count = a->nhugetlb_region;
+    stats->region_memory = a->nregion * a->region_size;
+    stats->carved_memory = a->carved_memory;
+    stats->global_free_block_count = a->nfree;
+    stats->fallback_count = g_nfallback.load(butil::memory_order_relaxed);
+}
+
+}  // namespace iobuf
+}  // namespace butil
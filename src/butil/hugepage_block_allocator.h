@@ -0,0 +1,96 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BUTIL_HUGEPAGE_BLOCK_ALLOCATOR_H
+#define BUTIL_HUGEPAGE_BLOCK_ALLOCATOR_H
+
+#include <stddef.h>                  // size_t
+
+namespace butil {
+namespace iobuf {
+
+// An allocator carving IOBuf::Block out of big regions backed by huge pages,
+// to reduce TLB misses and contentions inside malloc when millions of blocks
+// are allocated and deallocated per second.
+//  - Regions are mapped with MAP_HUGETLB (2MB or 1GB pages). If the kernel
+//    does not have enough reserved huge pages (see /proc/sys/vm/nr_hugepages),
+//    the region is mapped normally and advised with MADV_HUGEPAGE so that
+//    transparent huge pages are used when possible.
+//  - Freed blocks are cached in per-thread free lists, which are refilled
+//    from or flushed into a global list in batches. Most allocations and
+//    deallocations don't touch any lock.
+//  - Regions are never returned to the system.
+//  - Sizes not in (block_size/2, block_size] and allocations failing to get
+//    a new region are forwarded to the allocator installed before.
+struct HugePageAllocatorOptions {
+    HugePageAllocatorOptions();
+
+    // Bytes of each region, rounded up to a power of 2 not less than the
+    // huge page size.
+    // Default: 2MB, or 1GB when use_1gb_pages is true.
+    size_t region_size;
+
+    // Max bytes of all regions.
+    // Default: 4GB
+    size_t max_memory;
+
+    // Bytes of each block carved from the regions. The tail of each region
+    // shorter than block_size is not used.
+    // Default: IOBuf::DEFAULT_BLOCK_SIZE
+    size_t block_size;
+
+    // Map regions with 1GB pages instead of 2MB pages.
+    // Default: false
+    bool use_1gb_pages;
+
+    // Max number of free blocks cached in each thread.
+    // Default: 64
+    size_t max_cached_blocks_per_thread;
+};
+
+// Replace blockmem_allocate/blockmem_deallocate of IOBuf with the huge-page
+// allocator. Blocks allocated before are still deallocated by the previous
+// allocator. This function should be called before heavy usages of IOBuf.
+// NULL `options' means default options.
+// Returns 0 on success, -1 otherwise (already enabled or invalid options).
+int enable_hugepage_block_allocator(const HugePageAllocatorOptions* options);
+
+// True iff enable_hugepage_block_allocator() succeeded.
+bool is_hugepage_block_allocator_enabled();
+
+struct HugePageAllocatorStats {
+    // Number of mapped regions.
+    size_t region_count;
+    // Number of regions backed by MAP_HUGETLB, others rely on transparent
+    // huge pages.
+    size_t hugetlb_region_count;
+    // Bytes of all mapped regions.
+    size_t region_memory;
+    // Bytes of regions that were carved into blocks.
+    size_t carved_memory;
+    // Number of free blocks in the global list (not including the ones
+    // cached in threads).
+    size_t global_free_block_count;
+    // Number of allocations forwarded to the previous allocator.
+    size_t fallback_count;
+};
+
+// Get statistics of the huge-page allocator. All fields are 0 if the
+// allocator is not enabled.
+void get_hugepage_allocator_stats(HugePageAllocatorStats* stats);
+
+}  // namespace iobuf
+}  // namespace butil
+
+#endif  // BUTIL_HUGEPAGE_BLOCK_ALLOCATOR_H
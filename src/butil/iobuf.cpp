@@ -21,13 +21,19 @@
 #include <fcntl.h>                         // O_RDONLY
 #include <errno.h>                         // errno
 #include <limits.h>                        // CHAR_BIT
+#include <sys/socket.h>                    // sendmsg
+#include <sys/mman.h>                      // mmap
+#include <sys/stat.h>                      // fstat
+#include <pthread.h>                       // pthread_mutex_t
 #include <stdexcept>                       // std::invalid_argument
+#include <vector>                          // std::vector
 #include "butil/build_config.h"             // ARCH_CPU_X86_64
 #include "butil/atomicops.h"                // butil::atomic
 #include "butil/thread_local.h"             // thread_atexit
 #include "butil/macros.h"                   // BAIDU_CASSERT
 #include "butil/logging.h"                  // CHECK, LOG
 #include "butil/fd_guard.h"                 // butil::fd_guard
+#include "butil/fast_search.h"              // find_substr
 #include "butil/iobuf.h"
 
 namespace butil {
@@ -35,19 +41,40 @@ namespace butil {
 // Currently, the block_pool implementation used by RDMA is coupled with
 // these block size. If the following values are changed, please make sure
 // the block_pool can still work.
+// sizeof(IOBuf::Block), checked by payload_should_follow_block below.
+#ifdef IOBUF_HUGE_BLOCK
+static const size_t BLOCK_HEADER_SIZE = 24;
+#else
+static const size_t BLOCK_HEADER_SIZE = 16;
+#endif
 #ifdef IOBUF_HUGE_BLOCK
 const size_t IOBuf::DEFAULT_BLOCK_SIZE = 256 * 1024;
 const size_t IOBuf::MAX_BLOCK_SIZE = 2048 * 1024;
-const size_t IOBuf::DEFAULT_PAYLOAD = IOBuf::DEFAULT_BLOCK_SIZE - 40;
-const size_t IOBuf::MAX_PAYLOAD = IOBuf::MAX_BLOCK_SIZE - 40;
+const size_t IOBuf::DEFAULT_PAYLOAD = IOBuf::DEFAULT_BLOCK_SIZE - BLOCK_HEADER_SIZE;
+const size_t IOBuf::MAX_PAYLOAD = IOBuf::MAX_BLOCK_SIZE - BLOCK_HEADER_SIZE;
 #else
 const size_t IOBuf::DEFAULT_BLOCK_SIZE = 8192;
 const size_t IOBuf::MAX_BLOCK_SIZE = (1 << 16);
-const size_t IOBuf::DEFAULT_PAYLOAD = IOBuf::DEFAULT_BLOCK_SIZE - 16;
-const size_t IOBuf::MAX_PAYLOAD = IOBuf::MAX_BLOCK_SIZE - 16;
+const size_t IOBuf::DEFAULT_PAYLOAD = IOBuf::DEFAULT_BLOCK_SIZE - BLOCK_HEADER_SIZE;
+const size_t IOBuf::MAX_PAYLOAD = IOBuf::MAX_BLOCK_SIZE - BLOCK_HEADER_SIZE;
 #endif
+const size_t IOBuf::npos;
 namespace iobuf {
 
+// Size classes of blocks besides DEFAULT_BLOCK_SIZE. Small blocks are used
+// for reading a few bytes when no TLS block is cached, large blocks are used
+// for appending or reading a lot of data to reduce BlockRefs and iovecs.
+// Only blocks of DEFAULT_BLOCK_SIZE are cached in TLS.
+static const size_t SMALL_BLOCK_SIZE = 1024;
+static const size_t SMALL_PAYLOAD = SMALL_BLOCK_SIZE - (IOBuf::DEFAULT_BLOCK_SIZE - IOBuf::DEFAULT_PAYLOAD);
+#ifdef IOBUF_HUGE_BLOCK
+static const size_t LARGE_BLOCK_SIZE = 1024 * 1024;
+#else
+// Not larger than MAX_BLOCK_SIZE.
+static const size_t LARGE_BLOCK_SIZE = (1 << 16);
+#endif
+static const size_t LARGE_PAYLOAD = LARGE_BLOCK_SIZE - (IOBuf::DEFAULT_BLOCK_SIZE - IOBuf::DEFAULT_PAYLOAD);
+
 typedef ssize_t (*iov_function)(int fd, const struct iovec *vector,
                                    int count, off_t offset);
 
@@ -230,6 +257,10 @@ void reset_blockmem_allocate_and_deallocate() {
 butil::static_atomic<size_t> g_nblock = BUTIL_STATIC_ATOMIC_INIT(0);
 butil::static_atomic<size_t> g_blockmem = BUTIL_STATIC_ATOMIC_INIT(0);
 butil::static_atomic<size_t> g_newbigview = BUTIL_STATIC_ATOMIC_INIT(0);
+// Memory of blocks by their tags.
+butil::static_atomic<size_t> g_tag_blockmem[IOBuf::MAX_BLOCK_TAGS] = {};
+// Tag of blocks created in this thread, set by ScopedIOBufBlockTag.
+static __thread int tls_block_tag = 0;
 
 }  // namespace iobuf
 
@@ -241,12 +272,39 @@ size_t IOBuf::block_memory() {
     return iobuf::g_blockmem.load(butil::memory_order_relaxed);
 }
 
+size_t IOBuf::block_memory(int tag) {
+    if (tag < 0 || tag >= MAX_BLOCK_TAGS) {
+        return 0;
+    }
+    return iobuf::g_tag_blockmem[tag].load(butil::memory_order_relaxed);
+}
+
+ScopedIOBufBlockTag::ScopedIOBufBlockTag(int tag)
+    : _saved_tag(iobuf::tls_block_tag) {
+    if (tag >= 0 && tag < IOBuf::MAX_BLOCK_TAGS) {
+        iobuf::tls_block_tag = tag;
+    }
+}
+
+ScopedIOBufBlockTag::~ScopedIOBufBlockTag() {
+    iobuf::tls_block_tag = _saved_tag;
+}
+
 size_t IOBuf::new_bigview_count() {
     return iobuf::g_newbigview.load(butil::memory_order_relaxed);
 }
 
+namespace iobuf {
+// Deleter of blocks wrapping mapped file regions, which is just a tag since
+// munmap needs the length as well.
+static void unmap_file_block(void*) {}
+}  // namespace iobuf
+
 struct IOBuf::Block {
-    butil::atomic<int> nshared;
+    // Low bits are the reference count, high bits are the tag whose
+    // g_tag_blockmem counts memory of the block. Packing them keeps the
+    // header as small as it was before blocks were tagged.
+    butil::atomic<uint32_t> nshared;
 #ifdef IOBUF_HUGE_BLOCK
     uint32_t size;
     uint32_t cap;
@@ -255,75 +313,113 @@ struct IOBuf::Block {
     uint16_t cap;
 #endif
     Block* portal_next;
-#ifdef IOBUF_HUGE_BLOCK
-    void (*release_cb)(void*);
-    char* data;
-#else
-    char data[0];
-#endif
+    // Payload follows the header unless cap is 0, in which case the block
+    // wraps user data described by a UserData following the header.
+
+    struct UserData {
+        char* data;
+        // Called with `data' at destruction of the block.
+        void (*deleter)(void*);
+        uint32_t size;
+    };
+
+    static const int TAG_SHIFT = 28;
+    static const uint32_t REF_MASK = (1u << TAG_SHIFT) - 1;
 
-#ifdef IOBUF_HUGE_BLOCK
-    // if data memory is not allocated in IOBuf, set nshared to be 0.
-    explicit Block(size_t block_size, bool inner_mem = true)
-        : nshared((inner_mem) ? 1 : 0), size(0), cap(block_size - sizeof(IOBuf::Block))
-        , portal_next(NULL), release_cb(NULL), data(NULL) {
-        assert(block_size <= (MAX_HUGE_BLOCK_SIZE + sizeof(IOBuf::Block)));
-        if (!inner_mem) {
-            return;
-        }
-        data = (char*)((char*)this + sizeof(IOBuf::Block));
-        iobuf::g_nblock.fetch_add(1, butil::memory_order_relaxed);
-        iobuf::g_blockmem.fetch_add(block_size, butil::memory_order_relaxed);
-    }
-#else
     explicit Block(size_t block_size)
-        : nshared(1), size(0), cap(block_size - offsetof(Block, data))
-        , portal_next(NULL) {
+        : nshared(1 | ((uint32_t)iobuf::tls_block_tag << TAG_SHIFT))
+        , size(0), cap(block_size - sizeof(Block)), portal_next(NULL) {
         assert(block_size <= MAX_BLOCK_SIZE);
         iobuf::g_nblock.fetch_add(1, butil::memory_order_relaxed);
         iobuf::g_blockmem.fetch_add(block_size, butil::memory_order_relaxed);
+        iobuf::g_tag_blockmem[tag()].fetch_add(block_size,
+                                               butil::memory_order_relaxed);
+    }
+
+    // Wrap `user_data' which is full and never written. The memory of the
+    // block must be sizeof(Block) + sizeof(UserData).
+    Block(char* user_data, size_t user_size, void (*user_deleter)(void*))
+        : nshared(1), size(0), cap(0), portal_next(NULL) {
+        UserData* ud = user_data_ext();
+        ud->data = user_data;
+        ud->deleter = user_deleter;
+        ud->size = user_size;
     }
-#endif
 
     void inc_ref() {
         nshared.fetch_add(1, butil::memory_order_relaxed);
     }
         
     void dec_ref() {
-        if (nshared.fetch_sub(1, butil::memory_order_release) == 1) {
-#ifdef IOBUF_HUGE_BLOCK
-            if (this->data != ((char*)this + sizeof(IOBuf::Block))) {
-                // mean `data` memory is not allocated in IOBuf
-                if (release_cb) {
-                    release_cb((void *)data);
+        if ((nshared.fetch_sub(1, butil::memory_order_release) & REF_MASK) == 1) {
+            butil::atomic_thread_fence(butil::memory_order_acquire);
+            if (is_user_data()) {
+                const UserData* ud = user_data_ext();
+                if (ud->deleter == iobuf::unmap_file_block) {
+                    munmap(ud->data, ud->size);
+                } else if (ud->deleter) {
+                    ud->deleter(ud->data);
                 }
-                this->~Block();
-                iobuf::blockmem_deallocate(this);
-                return;
+            } else {
+                iobuf::g_nblock.fetch_sub(1, butil::memory_order_relaxed);
+                iobuf::g_blockmem.fetch_sub(cap + sizeof(Block),
+                                            butil::memory_order_relaxed);
+                iobuf::g_tag_blockmem[tag()].fetch_sub(
+                    cap + sizeof(Block), butil::memory_order_relaxed);
             }
-#endif
-            butil::atomic_thread_fence(butil::memory_order_acquire);
-            iobuf::g_nblock.fetch_sub(1, butil::memory_order_relaxed);
-#ifdef IOBUF_HUGE_BLOCK
-            iobuf::g_blockmem.fetch_sub(cap + sizeof(IOBuf::Block),
-                                        butil::memory_order_relaxed);
-#else
-            iobuf::g_blockmem.fetch_sub(cap + offsetof(Block, data),
-                                        butil::memory_order_relaxed);
-#endif
             this->~Block();
             iobuf::blockmem_deallocate(this);
         }
     }
 
     int ref_count() const {
-        return nshared.load(butil::memory_order_relaxed);
+        return nshared.load(butil::memory_order_relaxed) & REF_MASK;
+    }
+
+    int tag() const {
+        return nshared.load(butil::memory_order_relaxed) >> TAG_SHIFT;
+    }
+
+    // Count the block in the tag of current thread. Only called on blocks
+    // which are referenced by the TLS cache only, whose memory is going to
+    // be used by current thread entirely.
+    void retag() {
+        const int old_tag = tag();
+        const int new_tag = iobuf::tls_block_tag;
+        if (new_tag != old_tag && !is_user_data()) {
+            iobuf::g_tag_blockmem[old_tag].fetch_sub(
+                cap + sizeof(Block), butil::memory_order_relaxed);
+            iobuf::g_tag_blockmem[new_tag].fetch_add(
+                cap + sizeof(Block), butil::memory_order_relaxed);
+            // Wraps around when new_tag < old_tag, leaving the count intact.
+            nshared.fetch_add((uint32_t)(new_tag - old_tag) << TAG_SHIFT,
+                              butil::memory_order_relaxed);
+        }
     }
 
     bool full() const { return size >= cap; }
     size_t left_space() const { return cap - size; }
+    bool is_user_data() const { return cap == 0; }
+    // Bytes that can be referenced.
+    size_t data_size() const {
+        return is_user_data() ? user_data_ext()->size : cap;
+    }
+    char* data() {
+        return is_user_data() ? user_data_ext()->data : (char*)(this + 1);
+    }
+    const char* data() const {
+        return const_cast<Block*>(this)->data();
+    }
+
+private:
+    UserData* user_data_ext() const {
+        return (UserData*)(const_cast<Block*>(this) + 1);
+    }
 };
 
+BAIDU_CASSERT(IOBuf::MAX_BLOCK_TAGS <= (1 << (32 - IOBuf::Block::TAG_SHIFT)),
+              too_many_block_tags_to_pack_with_nshared);
+
 namespace iobuf {
 
 // for unit test
@@ -333,24 +429,10 @@ IOBuf::Block* get_portal_next(IOBuf::Block const* b) {
     return b->portal_next;
 }
 
-#ifdef IOBUF_HUGE_BLOCK
 uint32_t block_cap(IOBuf::Block const *b) {
-#else
-uint16_t block_cap(IOBuf::Block const *b) {
-#endif
-    return b->cap;
+    return b->data_size();
 }
 
-#ifdef IOBUF_HUGE_BLOCK
-inline IOBuf::Block* create_block(const size_t block_size, bool inner_mem = true) {
-    size_t alloc_size = (inner_mem) ? block_size : sizeof(IOBuf::Block);
-    void* mem = iobuf::blockmem_allocate(alloc_size);
-    if (BAIDU_LIKELY(mem != NULL)) {
-        return new (mem) IOBuf::Block(block_size, inner_mem);
-    }
-    return NULL;
-}
-#else
 inline IOBuf::Block* create_block(const size_t block_size) {
     void* mem = iobuf::blockmem_allocate(block_size);
     if (BAIDU_LIKELY(mem != NULL)) {
@@ -358,16 +440,27 @@ inline IOBuf::Block* create_block(const size_t block_size) {
     }
     return NULL;
 }
-#endif
 
 inline IOBuf::Block* create_block() {
     return create_block(IOBuf::DEFAULT_BLOCK_SIZE);
 }
 
+// True if the block can be put into TLS. Blocks in other size classes are
+// never cached to keep share_tls_block() and reserve() working on blocks
+// of DEFAULT_BLOCK_SIZE.
+inline bool is_default_block(const IOBuf::Block* b) {
+    return b->cap == IOBuf::DEFAULT_PAYLOAD && !b->is_user_data();
+}
+
 // === Share TLS blocks between appending operations ===
 // Max number of blocks in each TLS. This is a soft limit namely
 // release_tls_block_chain() may exceed this limit sometimes.
-const int MAX_BLOCKS_PER_THREAD = 8;
+static butil::static_atomic<int> g_max_blocks_per_thread =
+    BUTIL_STATIC_ATOMIC_INIT(8);
+
+inline int max_blocks_per_thread() {
+    return g_max_blocks_per_thread.load(butil::memory_order_relaxed);
+}
 
 // NOTE: not see differences in examples when CACHE_IOBUF_BLOCKREFS is turned on
 // (tcmalloc linked)
@@ -375,6 +468,23 @@ const int MAX_BLOCKS_PER_THREAD = 8;
 const int MAX_BLOCKREFS_PER_THREAD = 8;
 #endif
 
+// Counters of a TLS block cache. Only modified by the owner thread and read
+// by other threads in IOBuf::get_tls_block_cache_stats(), so atomic RMW are
+// not needed.
+struct TLSBlockCounters {
+    butil::atomic<int> cached;
+    butil::atomic<int64_t> hit;
+    butil::atomic<int64_t> miss;
+    butil::atomic<int64_t> release;
+    butil::atomic<int64_t> trimmed;
+
+    TLSBlockCounters() : cached(0), hit(0), miss(0), release(0), trimmed(0) {}
+};
+
+inline void add_counter(butil::atomic<int64_t>& c, int64_t n) {
+    c.store(c.load(butil::memory_order_relaxed) + n, butil::memory_order_relaxed);
+}
+
 struct TLSData {
     // Head of the TLS block chain.
     IOBuf::Block* block_head;
@@ -385,6 +495,16 @@ struct TLSData {
     // True if the remote_tls_block_chain is registered to the thread.
     bool registered;
 
+    // Min value of num_blocks since last trimming, namely number of blocks
+    // not used during the period.
+    int min_blocks;
+
+    // Value of g_tls_trim_epoch at last trimming.
+    int trim_epoch;
+
+    // Exposed to get_tls_block_cache_stats(), created at registration.
+    TLSBlockCounters* counters;
+
 #ifdef CACHE_IOBUF_BLOCKREFS
     // Reuse array of BlockRef
     int num_blockrefs;
@@ -393,9 +513,9 @@ struct TLSData {
 };
 
 #ifdef CACHE_IOBUF_BLOCKREFS
-static __thread TLSData g_tls_data = { NULL, 0, false, 0, {} };
+static __thread TLSData g_tls_data = { NULL, 0, false, 0, 0, NULL, 0, {} };
 #else
-static __thread TLSData g_tls_data = { NULL, 0, false };
+static __thread TLSData g_tls_data = { NULL, 0, false, 0, 0, NULL };
 #endif
 
 // Used in UT
@@ -407,6 +527,25 @@ int get_tls_block_count() { return g_tls_data.num_blocks; }
 // of appending functions in IOPortal may be lowered.
 static butil::static_atomic<size_t> g_num_hit_tls_threshold = BUTIL_STATIC_ATOMIC_INIT(0);
 
+// Incremented by IOBuf::trim_tls_block_caches(). Threads trim their caches
+// when they see a different value.
+static butil::static_atomic<int> g_tls_trim_epoch = BUTIL_STATIC_ATOMIC_INIT(0);
+
+// Counters of all threads having TLS caches and sums of exited threads.
+static pthread_mutex_t g_tls_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TLSBlockCounters*>* g_tls_counters_list = NULL;
+static IOBuf::TLSBlockCacheStats g_exited_tls_stats;
+
+inline void set_num_blocks(TLSData& tls_data, int n) {
+    tls_data.num_blocks = n;
+    if (n < tls_data.min_blocks) {
+        tls_data.min_blocks = n;
+    }
+    if (tls_data.counters) {
+        tls_data.counters->cached.store(n, butil::memory_order_relaxed);
+    }
+}
+
 // Called in UT.
 void remove_tls_block_chain() {
     TLSData& tls_data = g_tls_data;
@@ -423,7 +562,107 @@ void remove_tls_block_chain() {
         ++n;
     } while (b);
     CHECK_EQ(n, tls_data.num_blocks);
-    tls_data.num_blocks = 0;
+    set_num_blocks(tls_data, 0);
+}
+
+static void on_tls_data_thread_exit() {
+    remove_tls_block_chain();
+    TLSData& tls_data = g_tls_data;
+    TLSBlockCounters* c = tls_data.counters;
+    if (c == NULL) {
+        return;
+    }
+    tls_data.counters = NULL;
+    pthread_mutex_lock(&g_tls_counters_mutex);
+    g_exited_tls_stats.hit_count += c->hit.load(butil::memory_order_relaxed);
+    g_exited_tls_stats.miss_count += c->miss.load(butil::memory_order_relaxed);
+    g_exited_tls_stats.release_count +=
+        c->release.load(butil::memory_order_relaxed);
+    g_exited_tls_stats.trimmed_count +=
+        c->trimmed.load(butil::memory_order_relaxed);
+    std::vector<TLSBlockCounters*>& list = *g_tls_counters_list;
+    for (size_t i = 0; i < list.size(); ++i) {
+        if (list[i] == c) {
+            list[i] = list.back();
+            list.pop_back();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_tls_counters_mutex);
+    delete c;
+}
+
+// Register atexit and counters at the first time.
+inline void register_tls_data(TLSData& tls_data) {
+    if (tls_data.registered) {
+        return;
+    }
+    tls_data.registered = true;
+    tls_data.trim_epoch = g_tls_trim_epoch.load(butil::memory_order_relaxed);
+    TLSBlockCounters* c = new (std::nothrow) TLSBlockCounters;
+    if (c) {
+        pthread_mutex_lock(&g_tls_counters_mutex);
+        if (g_tls_counters_list == NULL) {
+            g_tls_counters_list = new std::vector<TLSBlockCounters*>;
+        }
+        g_tls_counters_list->push_back(c);
+        pthread_mutex_unlock(&g_tls_counters_mutex);
+        c->cached.store(tls_data.num_blocks, butil::memory_order_relaxed);
+        tls_data.counters = c;
+    }
+    butil::thread_atexit(on_tls_data_thread_exit);
+}
+
+inline void count_tls_hit(TLSData& tls_data) {
+    if (tls_data.counters) {
+        add_counter(tls_data.counters->hit, 1);
+    }
+}
+
+inline void count_tls_miss(TLSData& tls_data) {
+    if (tls_data.counters) {
+        add_counter(tls_data.counters->miss, 1);
+    }
+}
+
+inline void count_tls_release(TLSData& tls_data, int n) {
+    if (tls_data.counters) {
+        add_counter(tls_data.counters->release, n);
+    }
+}
+
+// Free blocks not used since last trimming or exceeding the cap. Blocks
+// at the tail of the chain are the least recently used ones.
+static void trim_tls_block_chain(TLSData& tls_data) {
+    int ntrim = std::max(tls_data.min_blocks,
+                         tls_data.num_blocks - max_blocks_per_thread());
+    if (ntrim > 0) {
+        const int nkeep = tls_data.num_blocks - ntrim;
+        IOBuf::Block** pb = &tls_data.block_head;
+        for (int i = 0; i < nkeep; ++i) {
+            pb = &(*pb)->portal_next;
+        }
+        IOBuf::Block* b = *pb;
+        *pb = NULL;
+        while (b) {
+            IOBuf::Block* const saved_next = b->portal_next;
+            b->dec_ref();
+            b = saved_next;
+        }
+        set_num_blocks(tls_data, nkeep);
+        if (tls_data.counters) {
+            add_counter(tls_data.counters->trimmed, ntrim);
+        }
+    }
+    tls_data.min_blocks = tls_data.num_blocks;
+}
+
+inline void maybe_trim_tls_block_chain(TLSData& tls_data) {
+    const int epoch = g_tls_trim_epoch.load(butil::memory_order_relaxed);
+    if (BAIDU_UNLIKELY(epoch != tls_data.trim_epoch)) {
+        tls_data.trim_epoch = epoch;
+        trim_tls_block_chain(tls_data);
+    }
 }
 
 // Get a (non-full) block from TLS.
@@ -438,16 +677,24 @@ inline IOBuf::Block* share_tls_block() {
     if (b) {
         new_block = b->portal_next;
         b->dec_ref();
-        --tls_data.num_blocks;
-    } else if (!tls_data.registered) {
-        tls_data.registered = true;
+        tls_data.block_head = new_block;
+        set_num_blocks(tls_data, tls_data.num_blocks - 1);
+        maybe_trim_tls_block_chain(tls_data);
+        new_block = tls_data.block_head;
+    } else {
         // Only register atexit at the first time
-        butil::thread_atexit(remove_tls_block_chain);
+        register_tls_data(tls_data);
     }
-    if (!new_block) {
+    if (new_block) {
+        count_tls_hit(tls_data);
+        if (new_block->ref_count() == 1) {
+            new_block->retag();
+        }
+    } else {
+        count_tls_miss(tls_data);
         new_block = create_block(); // may be NULL
         if (new_block) {
-            ++tls_data.num_blocks;
+            set_num_blocks(tls_data, tls_data.num_blocks + 1);
         }
     }
     tls_data.block_head = new_block;
@@ -460,20 +707,19 @@ inline void release_tls_block(IOBuf::Block *b) {
         return;
     }
     TLSData& tls_data = g_tls_data;
-    if (b->full()) {
+    if (b->full() || !is_default_block(b)) {
         b->dec_ref();
-    } else if (tls_data.num_blocks >= MAX_BLOCKS_PER_THREAD) {
+    } else if (tls_data.num_blocks >= max_blocks_per_thread()) {
         b->dec_ref();
         g_num_hit_tls_threshold.fetch_add(1, butil::memory_order_relaxed);
     } else {
         b->portal_next = tls_data.block_head;
         tls_data.block_head = b;
-        ++tls_data.num_blocks;
-        if (!tls_data.registered) {
-            tls_data.registered = true;
-            butil::thread_atexit(remove_tls_block_chain);
-        }
+        register_tls_data(tls_data);
+        set_num_blocks(tls_data, tls_data.num_blocks + 1);
+        count_tls_release(tls_data, 1);
     }
+    maybe_trim_tls_block_chain(tls_data);
 }
 
 // Return chained blocks to TLS.
@@ -481,7 +727,7 @@ inline void release_tls_block(IOBuf::Block *b) {
 inline void release_tls_block_chain(IOBuf::Block* b) {
     TLSData& tls_data = g_tls_data;
     size_t n = 0;
-    if (tls_data.num_blocks >= MAX_BLOCKS_PER_THREAD) {
+    if (tls_data.num_blocks >= max_blocks_per_thread()) {
         do {
             ++n;
             IOBuf::Block* const saved_next = b->portal_next;
@@ -489,26 +735,36 @@ inline void release_tls_block_chain(IOBuf::Block* b) {
             b = saved_next;
         } while (b);
         g_num_hit_tls_threshold.fetch_add(n, butil::memory_order_relaxed);
+        maybe_trim_tls_block_chain(tls_data);
         return;
     }
-    IOBuf::Block* first_b = b;
+    IOBuf::Block* first_b = NULL;
     IOBuf::Block* last_b = NULL;
     do {
-        ++n;
+        IOBuf::Block* const saved_next = b->portal_next;
         CHECK(!b->full());
-        if (b->portal_next == NULL) {
+        if (!is_default_block(b)) {
+            b->dec_ref();
+        } else {
+            ++n;
+            if (last_b) {
+                last_b->portal_next = b;
+            } else {
+                first_b = b;
+            }
             last_b = b;
-            break;
         }
-        b = b->portal_next;
-    } while (true);
+        b = saved_next;
+    } while (b);
+    if (first_b == NULL) {
+        return;
+    }
     last_b->portal_next = tls_data.block_head;
     tls_data.block_head = first_b;
-    tls_data.num_blocks += n;
-    if (!tls_data.registered) {
-        tls_data.registered = true;
-        butil::thread_atexit(remove_tls_block_chain);
-    }
+    register_tls_data(tls_data);
+    set_num_blocks(tls_data, tls_data.num_blocks + n);
+    count_tls_release(tls_data, n);
+    maybe_trim_tls_block_chain(tls_data);
 }
 
 // Get and remove one (non-full) block from TLS. If TLS is empty, create one.
@@ -516,24 +772,43 @@ inline IOBuf::Block* acquire_tls_block() {
     TLSData& tls_data = g_tls_data;
     IOBuf::Block* b = tls_data.block_head;
     if (!b) {
+        register_tls_data(tls_data);
+        count_tls_miss(tls_data);
         return create_block();
     }
     if (b->full()) {
         IOBuf::Block* const saved_next = b->portal_next;
         b->dec_ref();
         tls_data.block_head = saved_next;
-        --tls_data.num_blocks;
+        set_num_blocks(tls_data, tls_data.num_blocks - 1);
         b = saved_next;
         if (!b) {
+            count_tls_miss(tls_data);
             return create_block();
         }
     }
     tls_data.block_head = b->portal_next;
-    --tls_data.num_blocks;
+    set_num_blocks(tls_data, tls_data.num_blocks - 1);
     b->portal_next = NULL;
+    count_tls_hit(tls_data);
+    if (b->ref_count() == 1) {
+        b->retag();
+    }
     return b;
 }
 
+// Get a block for reading about `expected' bytes. TLS blocks are preferred
+// for medium sizes while large or small reads get blocks of other classes.
+inline IOBuf::Block* acquire_block_for(size_t expected) {
+    if (expected >= LARGE_PAYLOAD) {
+        return create_block(LARGE_BLOCK_SIZE);
+    }
+    if (expected <= SMALL_PAYLOAD && g_tls_data.block_head == NULL) {
+        return create_block(SMALL_BLOCK_SIZE);
+    }
+    return acquire_tls_block();
+}
+
 inline IOBuf::BlockRef* acquire_blockref_array() {
 #ifdef CACHE_IOBUF_BLOCKREFS
     TLSData& tls_data = g_tls_data;
@@ -574,12 +849,53 @@ size_t IOBuf::block_count_hit_tls_threshold() {
     return iobuf::g_num_hit_tls_threshold.load(butil::memory_order_relaxed);
 }
 
+void IOBuf::get_tls_block_cache_stats(TLSBlockCacheStats* stats) {
+    pthread_mutex_lock(&iobuf::g_tls_counters_mutex);
+    *stats = iobuf::g_exited_tls_stats;
+    stats->cached_block_count = 0;
+    stats->max_cached_block_count = 0;
+    stats->thread_count = 0;
+    if (iobuf::g_tls_counters_list) {
+        const std::vector<iobuf::TLSBlockCounters*>& list =
+            *iobuf::g_tls_counters_list;
+        stats->thread_count = list.size();
+        for (size_t i = 0; i < list.size(); ++i) {
+            const iobuf::TLSBlockCounters* c = list[i];
+            const size_t cached = c->cached.load(butil::memory_order_relaxed);
+            stats->cached_block_count += cached;
+            stats->max_cached_block_count =
+                std::max(stats->max_cached_block_count, cached);
+            stats->hit_count += c->hit.load(butil::memory_order_relaxed);
+            stats->miss_count += c->miss.load(butil::memory_order_relaxed);
+            stats->release_count += c->release.load(butil::memory_order_relaxed);
+            stats->trimmed_count += c->trimmed.load(butil::memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&iobuf::g_tls_counters_mutex);
+}
+
+void IOBuf::set_max_blocks_per_thread(int n) {
+    iobuf::g_max_blocks_per_thread.store(std::max(n, 0),
+                                         butil::memory_order_relaxed);
+}
+
+int IOBuf::max_blocks_per_thread() {
+    return iobuf::max_blocks_per_thread();
+}
+
+void IOBuf::trim_tls_block_caches() {
+    iobuf::g_tls_trim_epoch.fetch_add(1, butil::memory_order_relaxed);
+}
+
 BAIDU_CASSERT(sizeof(IOBuf::SmallView) == sizeof(IOBuf::BigView),
               sizeof_small_and_big_view_should_equal);
 
 BAIDU_CASSERT(IOBuf::DEFAULT_BLOCK_SIZE/4096*4096 == IOBuf::DEFAULT_BLOCK_SIZE,
               sizeof_block_should_be_multiply_of_4096);
 
+BAIDU_CASSERT(IOBuf::DEFAULT_BLOCK_SIZE - IOBuf::DEFAULT_PAYLOAD == sizeof(IOBuf::Block),
+              payload_should_follow_block);
+
 const IOBuf::Area IOBuf::INVALID_AREA;
 
 IOBuf::IOBuf(const IOBuf& rhs) {
@@ -830,7 +1146,7 @@ bool IOBuf::cut1(char* c) {
         return false;
     }
     IOBuf::BlockRef &r = _front_ref();
-    *c = r.block->data[r.offset];
+    *c = r.block->data()[r.offset];
     if (r.length > 1) {
         ++r.offset;
         --r.length;
@@ -901,12 +1217,12 @@ size_t IOBuf::cutn(void* out, size_t n) {
     while (n) {   // length() == 0 does not enter
         IOBuf::BlockRef &r = _front_ref();
         if (r.length <= n) {
-            iobuf::cp(out, r.block->data + r.offset, r.length);
+            iobuf::cp(out, r.block->data() + r.offset, r.length);
             out = (char*)out + r.length;
             n -= r.length;
             _pop_front_ref();
         } else {
-            iobuf::cp(out, r.block->data + r.offset, n);
+            iobuf::cp(out, r.block->data() + r.offset, n);
             out = (char*)out + n;
             r.offset += n;
             r.length -= n;
@@ -934,61 +1250,106 @@ size_t IOBuf::cutn(std::string* out, size_t n) {
 }
 
 int IOBuf::_cut_by_char(IOBuf* out, char d) {
-    const size_t nref = _ref_num();
-    size_t n = 0;
-    
-    for (size_t i = 0; i < nref; ++i) {
-        IOBuf::BlockRef const& r = _ref_at(i);
-        char const* const s = r.block->data + r.offset;
-        for (uint32_t j = 0; j < r.length; ++j, ++n) {
-            if (s[j] == d) {
-                // There's no way cutn/pop_front fails
-                cutn(out, n);
-                pop_front(1);
-                return 0;
-            }
-        }
+    const size_t n = find(d);
+    if (n == npos) {
+        return -1;
     }
-
-    return -1;
+    // There's no way cutn/pop_front fails
+    cutn(out, n);
+    pop_front(1);
+    return 0;
 }
 
 int IOBuf::_cut_by_delim(IOBuf* out, char const* dbegin, size_t ndelim) {
-    typedef unsigned long SigType;
-    const size_t NMAX = sizeof(SigType);
-    
-    if (ndelim > NMAX || ndelim > length()) {
+    if (ndelim > length()) {
         return -1;
     }
-    
-    SigType dsig = 0;
-    for (size_t i = 0; i < ndelim; ++i) {
-        dsig = (dsig << CHAR_BIT) | static_cast<SigType>(dbegin[i]);
+    const size_t n = find(butil::StringPiece(dbegin, ndelim));
+    if (n == npos) {
+        return -1;
     }
-    
-    const SigType SIGMASK =
-        (ndelim == NMAX ? (SigType)-1 : (((SigType)1 << (ndelim * CHAR_BIT)) - 1));
+    // There's no way cutn/pop_front fails
+    cutn(out, n);
+    pop_front(ndelim);
+    return 0;
+}
 
+size_t IOBuf::find(char c, size_t pos) const {
     const size_t nref = _ref_num();
-    SigType sig = 0;
-    size_t n = 0;
+    size_t base = 0;
+    for (size_t i = 0; i < nref; ++i) {
+        IOBuf::BlockRef const& r = _ref_at(i);
+        if (base + r.length > pos) {
+            const size_t start = (pos > base ? pos - base : 0);
+            char const* const s = r.block->data() + r.offset;
+            const char* p = (const char*)memchr(s + start, c, r.length - start);
+            if (p) {
+                return base + (p - s);
+            }
+        }
+        base += r.length;
+    }
+    return npos;
+}
 
+size_t IOBuf::find(const butil::StringPiece& pattern, size_t pos) const {
+    const size_t m = pattern.size();
+    if (m <= 1) {
+        if (m == 1) {
+            return find(pattern[0], pos);
+        }
+        return (pos <= length() ? pos : npos);
+    }
+    const size_t nref = _ref_num();
+    size_t base = 0;
     for (size_t i = 0; i < nref; ++i) {
         IOBuf::BlockRef const& r = _ref_at(i);
-        char const* const s = r.block->data + r.offset;
-        
-        for (uint32_t j = 0; j < r.length; ++j, ++n) {
-            sig = ((sig << CHAR_BIT) | static_cast<SigType>(s[j])) & SIGMASK;
-            if (sig == dsig) {
-                // There's no way cutn/pop_front fails
-                cutn(out, n + 1 - ndelim);
-                pop_front(ndelim);
-                return 0;
+        if (base + r.length <= pos) {
+            base += r.length;
+            continue;
+        }
+        const size_t start = (pos > base ? pos - base : 0);
+        char const* const s = r.block->data() + r.offset;
+        // Occurrences inside this block.
+        if (start + m <= r.length) {
+            const char* p = find_substr(s + start, r.length - start,
+                                        pattern.data(), m);
+            if (p) {
+                return base + (p - s);
+            }
+        }
+        // Occurrences beginning in this block but ending in following ones.
+        size_t j = (r.length >= m ? r.length - m + 1 : 0);
+        for (j = std::max(j, start); j < r.length; ++j) {
+            if (s[j] == pattern[0] && equals_at(base + j, pattern)) {
+                return base + j;
             }
         }
+        base += r.length;
     }
+    return npos;
+}
 
-    return -1;
+bool IOBuf::equals_at(size_t pos, const butil::StringPiece& s) const {
+    if (pos > length() || s.size() > length() - pos) {
+        return false;
+    }
+    const size_t nref = _ref_num();
+    size_t base = 0;
+    size_t soff = 0;
+    for (size_t i = 0; i < nref && soff < s.size(); ++i) {
+        IOBuf::BlockRef const& r = _ref_at(i);
+        if (base + r.length > pos) {
+            const size_t start = (pos + soff > base ? pos + soff - base : 0);
+            const size_t len = std::min((size_t)r.length - start, s.size() - soff);
+            if (memcmp(r.block->data() + r.offset + start, s.data() + soff, len) != 0) {
+                return false;
+            }
+            soff += len;
+        }
+        base += r.length;
+    }
+    return true;
 }
 
 // Since cut_into_file_descriptor() allocates iovec on stack, IOV_MAX=1024
@@ -1007,7 +1368,7 @@ ssize_t IOBuf::pcut_into_file_descriptor(int fd, off_t offset, size_t size_hint)
 
     do {
         IOBuf::BlockRef const& r = _ref_at(nvec);
-        vec[nvec].iov_base = r.block->data + r.offset;
+        vec[nvec].iov_base = r.block->data() + r.offset;
         vec[nvec].iov_len = r.length;
         ++nvec;
         cur_len += r.length;
@@ -1034,7 +1395,7 @@ ssize_t IOBuf::cut_into_SSL_channel(SSL* ssl, int* ssl_error) {
     }
     
     IOBuf::BlockRef const& r = _ref_at(0);
-    const int nw = SSL_write(ssl, r.block->data + r.offset, r.length);
+    const int nw = SSL_write(ssl, r.block->data() + r.offset, r.length);
     if (nw > 0) {
         pop_front(nw);
     }
@@ -1102,7 +1463,7 @@ ssize_t IOBuf::pcut_multiple_into_file_descriptor(
         const size_t nref = p->_ref_num();
         for (size_t j = 0; j < nref && nvec < IOBUF_IOV_MAX; ++j, ++nvec) {
             IOBuf::BlockRef const& r = p->_ref_at(j);
-            vec[nvec].iov_base = r.block->data + r.offset;
+            vec[nvec].iov_base = r.block->data() + r.offset;
             vec[nvec].iov_len = r.length;
         }
     }
@@ -1127,6 +1488,50 @@ ssize_t IOBuf::pcut_multiple_into_file_descriptor(
     return nw;
 }
 
+#if defined(OS_LINUX) && !defined(MSG_ZEROCOPY)
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+ssize_t IOBuf::cut_multiple_into_socket_zerocopy(
+    int fd, IOBuf* const* pieces, size_t count, IOBuf* sent) {
+#if defined(OS_LINUX)
+    struct iovec vec[IOBUF_IOV_MAX];
+    size_t nvec = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const IOBuf* p = pieces[i];
+        const size_t nref = p->_ref_num();
+        for (size_t j = 0; j < nref && nvec < IOBUF_IOV_MAX; ++j, ++nvec) {
+            IOBuf::BlockRef const& r = p->_ref_at(j);
+            vec[nvec].iov_base = r.block->data() + r.offset;
+            vec[nvec].iov_len = r.length;
+        }
+    }
+    if (nvec == 0) {
+        return 0;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = nvec;
+    const ssize_t nw = ::sendmsg(fd, &msg, MSG_ZEROCOPY);
+    if (nw <= 0) {
+        return nw;
+    }
+    // Keep references to the sent blocks.
+    size_t npop_all = nw;
+    for (size_t i = 0; i < count; ++i) {
+        npop_all -= pieces[i]->cutn(sent, npop_all);
+        if (npop_all == 0) {
+            break;
+        }
+    }
+    return nw;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 void IOBuf::append(const IOBuf& other) {
     const size_t nref = other._ref_num();
     for (size_t i = 0; i < nref; ++i) {
@@ -1155,32 +1560,77 @@ int IOBuf::push_back(char c) {
     if (BAIDU_UNLIKELY(!b)) {
         return -1;
     }
-    b->data[b->size] = c;
+    b->data()[b->size] = c;
     const IOBuf::BlockRef r = { b->size, 1, b };
     ++b->size;
     _push_back_ref(r);
     return 0;
 }
 
-int IOBuf::append_zerocopy(void const* data, size_t count, void (*cb)(void*)) {
-#ifndef IOBUF_HUGE_BLOCK
-    LOG(FATAL) << "Not supported, append_zerocopy is supported only for huge block";
-    return -1;
-#else
-    if (BAIDU_UNLIKELY(!data || count <= 0)) {
+int IOBuf::append_user_data(void* data, size_t size, void (*deleter)(void*)) {
+    if (BAIDU_UNLIKELY(!data || size == 0 || size > MAX_HUGE_BLOCK_SIZE)) {
         return -1;
     }
-    IOBuf::Block* b = iobuf::create_block(count + sizeof(IOBuf::Block), false);
-    if (BAIDU_UNLIKELY(!b)) {
+    void* mem = iobuf::blockmem_allocate(
+        sizeof(IOBuf::Block) + sizeof(IOBuf::Block::UserData));
+    if (BAIDU_UNLIKELY(!mem)) {
         return -1;
     }
-    b->data = (char *)data;
-    b->release_cb = cb;
-    const IOBuf::BlockRef r = { b->size, b->cap, b };
-    _push_back_ref(r);
+    IOBuf::Block* b = new (mem) IOBuf::Block((char*)data, size, deleter);
+    const IOBuf::BlockRef r = { 0, (uint32_t)size, b };
+    _move_back_ref(r);
+    return 0;
+}
+
+int IOBuf::append_zerocopy(void const* data, size_t count, void (*cb)(void*)) {
+    return append_user_data(const_cast<void*>(data), count, cb);
+}
 
+// Max bytes of a mapping, which is much less than MAX_HUGE_BLOCK_SIZE to
+// avoid too much address space being pinned by a partially used IOBuf.
+static const size_t MAX_FILE_MAPPING_SIZE = 64 * 1024 * 1024;
+
+int IOBuf::append_mapped_file(int fd, off_t offset, size_t count) {
+    if (fd < 0 || offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    // Pages beyond EOF can't be accessed.
+    if (offset > st.st_size || count > (size_t)(st.st_size - offset)) {
+        errno = EINVAL;
+        return -1;
+    }
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    IOBuf tmp;
+    while (count > 0) {
+        const off_t aligned_offset = offset & ~(off_t)(page_size - 1);
+        const size_t delta = offset - aligned_offset;
+        const size_t len = std::min(count, MAX_FILE_MAPPING_SIZE - delta);
+        void* mem = mmap(NULL, delta + len, PROT_READ, MAP_SHARED,
+                         fd, aligned_offset);
+        if (mem == MAP_FAILED) {
+            return -1;
+        }
+        void* block_mem = iobuf::blockmem_allocate(
+            sizeof(IOBuf::Block) + sizeof(IOBuf::Block::UserData));
+        if (BAIDU_UNLIKELY(!block_mem)) {
+            munmap(mem, delta + len);
+            errno = ENOMEM;
+            return -1;
+        }
+        IOBuf::Block* b = new (block_mem) IOBuf::Block(
+            (char*)mem, delta + len, iobuf::unmap_file_block);
+        const IOBuf::BlockRef r = { (uint32_t)delta, (uint32_t)len, b };
+        tmp._move_back_ref(r);
+        offset += len;
+        count -= len;
+    }
+    append(tmp.movable());
     return 0;
-#endif
 }
 
 int IOBuf::append(char const* s) {
@@ -1198,13 +1648,28 @@ int IOBuf::append(void const* data, size_t count) {
         return push_back(*((char const*)data));
     }
     size_t total_nc = 0;
+    // Copy into large blocks which are fully filled, so that no space is
+    // wasted and much fewer BlockRefs are needed.
+    while (count - total_nc >= iobuf::LARGE_PAYLOAD) {
+        IOBuf::Block* b = iobuf::create_block(iobuf::LARGE_BLOCK_SIZE);
+        if (BAIDU_UNLIKELY(!b)) {
+            break;  // try default blocks
+        }
+        const size_t nc = b->left_space();
+        iobuf::cp(b->data(), (char*)data + total_nc, nc);
+        b->size = nc;
+        const IOBuf::BlockRef r = { 0, (uint32_t)nc, b };
+        _push_back_ref(r);
+        b->dec_ref();  // referenced by this IOBuf now
+        total_nc += nc;
+    }
     while (total_nc < count) {  // excluded count == 0
         IOBuf::Block* b = iobuf::share_tls_block();
         if (BAIDU_UNLIKELY(!b)) {
             return -1;
         }
         const size_t nc = std::min(count - total_nc, b->left_space());
-        iobuf::cp(b->data + b->size, (char*)data + total_nc, nc);
+        iobuf::cp(b->data() + b->size, (char*)data + total_nc, nc);
         
         const IOBuf::BlockRef r = { (uint32_t)b->size, (uint32_t)nc, b };
         _push_back_ref(r);
@@ -1225,7 +1690,7 @@ int IOBuf::appendv(const const_iovec* vec, size_t n) {
         for (; i < n; ++i, offset = 0) {
             const const_iovec & vec_i = vec[i];
             const size_t nc = std::min(vec_i.iov_len - offset, b->left_space() - total_cp);
-            iobuf::cp(b->data + b->size + total_cp, (char*)vec_i.iov_base + offset, nc);
+            iobuf::cp(b->data() + b->size + total_cp, (char*)vec_i.iov_base + offset, nc);
             total_cp += nc;
             offset += nc;
             if (offset != vec_i.iov_len) {
@@ -1254,7 +1719,7 @@ int IOBuf::resize(size_t n, char c) {
             return -1;
         }
         const size_t nc = std::min(count - total_nc, b->left_space());
-        memset(b->data + b->size, c, nc);
+        memset(b->data() + b->size, c, nc);
         
         const IOBuf::BlockRef r = { (uint32_t)b->size, (uint32_t)nc, b };
         _push_back_ref(r);
@@ -1332,7 +1797,7 @@ int IOBuf::unsafe_assign(Area area, const void* data) {
         // (by different BlockRef-s)
         
         const size_t nc = std::min(length, r.length - ref_offset);
-        iobuf::cp(r.block->data + r.offset + ref_offset, data, nc);
+        iobuf::cp(r.block->data() + r.offset + ref_offset, data, nc);
         if (length == nc) {
             return 0;
         }
@@ -1393,7 +1858,7 @@ size_t IOBuf::copy_to(void* d, size_t n, size_t pos) const {
     for (; m != 0 && i < nref; ++i) {
         IOBuf::BlockRef const& r = _ref_at(i);
         const size_t nc = std::min(m, (size_t)r.length - offset);
-        iobuf::cp(d, r.block->data + r.offset + offset, nc);
+        iobuf::cp(d, r.block->data() + r.offset + offset, nc);
         offset = 0;
         d = (char*)d + nc;
         m -= nc;
@@ -1438,20 +1903,20 @@ void const* IOBuf::fetch(void* d, size_t n) const {
     if (n <= length()) {
         IOBuf::BlockRef const& r0 = _ref_at(0);
         if (n <= r0.length) {
-            return r0.block->data + r0.offset;
+            return r0.block->data() + r0.offset;
         }
     
-        iobuf::cp(d, r0.block->data + r0.offset, r0.length);
+        iobuf::cp(d, r0.block->data() + r0.offset, r0.length);
         size_t total_nc = r0.length;
         const size_t nref = _ref_num();
         for (size_t i = 1; i < nref; ++i) {
             IOBuf::BlockRef const& r = _ref_at(i);
             if (n <= r.length + total_nc) {
                 iobuf::cp((char*)d + total_nc,
-                            r.block->data + r.offset, n - total_nc);
+                            r.block->data() + r.offset, n - total_nc);
                 return d;
             }
-            iobuf::cp((char*)d + total_nc, r.block->data + r.offset, r.length);
+            iobuf::cp((char*)d + total_nc, r.block->data() + r.offset, r.length);
             total_nc += r.length;
         }
     }
@@ -1461,7 +1926,7 @@ void const* IOBuf::fetch(void* d, size_t n) const {
 const void* IOBuf::fetch1() const {
     if (!empty()) {
         const IOBuf::BlockRef& r0 = _front_ref();
-        return r0.block->data + r0.offset;
+        return r0.block->data() + r0.offset;
     }
     return NULL;
 }
@@ -1571,7 +2036,7 @@ bool IOBuf::equals(const butil::StringPiece& s) const {
     size_t soff = 0;
     for (size_t i = 0; i < nref; ++i) {
         const BlockRef& r = _ref_at(i);
-        if (memcmp(r.block->data + r.offset, s.data() + soff, r.length) != 0) {
+        if (memcmp(r.block->data() + r.offset, s.data() + soff, r.length) != 0) {
             return false;
         }
         soff += r.length;
@@ -1582,7 +2047,7 @@ bool IOBuf::equals(const butil::StringPiece& s) const {
 StringPiece IOBuf::backing_block(size_t i) const {
     if (i < _ref_num()) {
         const BlockRef& r = _ref_at(i);
-        return StringPiece(r.block->data + r.offset, r.length);
+        return StringPiece(r.block->data() + r.offset, r.length);
     }
     return StringPiece();
 }
@@ -1596,10 +2061,10 @@ bool IOBuf::equals(const butil::IOBuf& other) const {
         return true;
     }
     const BlockRef& r1 = _ref_at(0);
-    const char* d1 = r1.block->data + r1.offset;
+    const char* d1 = r1.block->data() + r1.offset;
     size_t len1 = r1.length;
     const BlockRef& r2 = other._ref_at(0);
-    const char* d2 = r2.block->data + r2.offset;
+    const char* d2 = r2.block->data() + r2.offset;
     size_t len2 = r2.length;
     const size_t nref1 = _ref_num();
     const size_t nref2 = other._ref_num();
@@ -1616,7 +2081,7 @@ bool IOBuf::equals(const butil::IOBuf& other) const {
                 return true;
             }
             const BlockRef& r = _ref_at(i++);
-            d1 = r.block->data + r.offset;
+            d1 = r.block->data() + r.offset;
             len1 = r.length;
         } else {
             d1 += cmplen;
@@ -1627,7 +2092,7 @@ bool IOBuf::equals(const butil::IOBuf& other) const {
                 return true;
             }
             const BlockRef& r = other._ref_at(j++);
-            d2 = r.block->data + r.offset;
+            d2 = r.block->data() + r.offset;
             len2 = r.length;
         } else {
             d2 += cmplen;
@@ -1661,7 +2126,7 @@ ssize_t IOPortal::pappend_from_file_descriptor(
     // Prepare at most MAX_APPEND_IOVEC blocks or space of blocks >= max_count
     do {
         if (p == NULL) {
-            p = iobuf::acquire_tls_block();
+            p = iobuf::acquire_block_for(max_count - space);
             if (BAIDU_UNLIKELY(!p)) {
                 errno = ENOMEM;
                 return -1;
@@ -1672,7 +2137,7 @@ ssize_t IOPortal::pappend_from_file_descriptor(
                 _block = p;
             }
         }
-        vec[nvec].iov_base = p->data + p->size;
+        vec[nvec].iov_base = p->data() + p->size;
         vec[nvec].iov_len = std::min(p->left_space(), max_count - space);
         space += vec[nvec].iov_len;
         ++nvec;
@@ -1718,7 +2183,7 @@ ssize_t IOPortal::append_from_SSL_channel(
     size_t nr = 0;
     do {
         if (!_block) {
-            _block = iobuf::acquire_tls_block();
+            _block = iobuf::acquire_block_for(max_count - nr);
             if (BAIDU_UNLIKELY(!_block)) {
                 errno = ENOMEM;
                 *ssl_error = SSL_ERROR_SYSCALL;
@@ -1727,7 +2192,7 @@ ssize_t IOPortal::append_from_SSL_channel(
         }
 
         const size_t read_len = std::min(_block->left_space(), max_count - nr);
-        const int rc = SSL_read(ssl, _block->data + _block->size, read_len);
+        const int rc = SSL_read(ssl, _block->data() + _block->size, read_len);
         *ssl_error = SSL_get_error(ssl, rc);
         if (rc > 0) {
             const IOBuf::BlockRef r = { (uint32_t)_block->size, (uint32_t)rc, _block };
@@ -1772,7 +2237,7 @@ IOBufAsZeroCopyInputStream::IOBufAsZeroCopyInputStream(const IOBuf& buf)
 
 bool IOBufAsZeroCopyInputStream::Next(const void** data, int* size) {
     if (_cur_ref != NULL) {
-        *data = _cur_ref->block->data + _cur_ref->offset + _add_offset;
+        *data = _cur_ref->block->data() + _cur_ref->offset + _add_offset;
         // Impl. of Backup/Skip guarantees that _add_offset < _cur_ref->length.
         *size = _cur_ref->length - _add_offset;
         _byte_count += _cur_ref->length - _add_offset;
@@ -1835,11 +2300,7 @@ IOBufAsZeroCopyOutputStream::IOBufAsZeroCopyOutputStream(
     , _cur_block(NULL)
     , _byte_count(0) {
     
-#ifdef IOBUF_HUGE_BLOCK
     if (_block_size <= sizeof(IOBuf::Block)) {
-#else
-    if (_block_size <= offsetof(IOBuf::Block, data)) {
-#endif
         throw std::invalid_argument("block_size is too small");
     }
 }
@@ -1863,7 +2324,7 @@ bool IOBufAsZeroCopyOutputStream::Next(void** data, int* size) {
     const IOBuf::BlockRef r = { _cur_block->size, 
                                 (uint32_t)_cur_block->left_space(),
                                 _cur_block };
-    *data = _cur_block->data + r.offset;
+    *data = _cur_block->data() + r.offset;
     *size = r.length;
     _cur_block->size = _cur_block->cap;
     _buf->_push_back_ref(r);
@@ -1892,7 +2353,7 @@ void IOBufAsZeroCopyOutputStream::BackUp(int count) {
             // An extended BackUp which is undefined in regular 
             // ZeroCopyOutputStream. The `count' given by user is larger than 
             // size of last _cur_block (already released in last iteration).
-            if (r.block->ref_count() == 1) {
+            if (r.block->ref_count() == 1 && !r.block->is_user_data()) {
                 // A special case: the block is only referenced by last
                 // BlockRef of _buf. Safe to allocate more on the block.
                 if (r.offset + r.length != r.block->size) {
@@ -1903,7 +2364,8 @@ void IOBufAsZeroCopyOutputStream::BackUp(int count) {
                 }
             } else if (r.offset + r.length != r.block->size) {
                 // Last BlockRef does not match end of the block (which is
-                // used by other IOBuf already). Unsafe to re-reference
+                // used by other IOBuf already, or wraps user data whose
+                // size is always 0). Unsafe to re-reference
                 // the block and allocate more, just pop the bytes.
                 _byte_count -= _buf->pop_back(count);
                 return;
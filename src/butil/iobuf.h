@@ -58,6 +58,7 @@ public:
     static const size_t MAX_BLOCK_SIZE;
     static const size_t MAX_PAYLOAD;
     static const size_t INITIAL_CAP = 32; // must be power of 2
+    static const size_t npos = (size_t)-1;
 
     static const size_t MAX_HUGE_BLOCK_SIZE = (1UL << 32) - 1;
 
@@ -184,6 +185,17 @@ public:
     static ssize_t pcut_multiple_into_file_descriptor(
         int fd, off_t offset, IOBuf* const* pieces, size_t count);
 
+    // Cut `count' number of `pieces' into socket `fd' with MSG_ZEROCOPY,
+    // which requires linux >= 4.14 and SO_ZEROCOPY being set on `fd'.
+    // The kernel sends the payload directly from blocks, thus written data
+    // is moved into `sent' instead of being released and must be kept
+    // until the completion is notified via the error queue of `fd'.
+    // Returns bytes cut on success, -1 otherwise and errno is set. ENOBUFS
+    // means that the kernel can't pin more pages and the caller should write
+    // without zero-copy.
+    static ssize_t cut_multiple_into_socket_zerocopy(
+        int fd, IOBuf* const* pieces, size_t count, IOBuf* sent);
+
     // Append another IOBuf to back side, payload of the IOBuf is shared
     // rather than copied.
     void append(const IOBuf& other);
@@ -202,17 +214,32 @@ public:
     // Returns 0 on success, -1 otherwise.
     int push_back(char c);
 
-    // Append `data` with `count` bytes to back side(without copying).
-    // `data` should be allocated before calling this function, and the
-    // Block doesn't own the `data` memory. `cb` is callback function
-    // to release `data` memory.
-    // Return 0 on success, -1 otherwise.
-    // NOTICE: This function can be called only when HUGE_BLOCK enabled.
+    // Append `data' with `size' bytes to back side without copying. The
+    // memory is wrapped as a block which is shared by IOBufs cut from this
+    // one and `deleter' (if not NULL) is called with `data' when the block
+    // is not referenced anymore, possibly in another thread. Content of
+    // `data' must not be modified until then.
+    // `size' must be less than 4GB. To be written into RDMA channels without
+    // copying, `data' should be registered by rdma::RegisterMemoryForRdma.
+    // Returns 0 on success, -1 otherwise.
     // Example:
     //   void* data = malloc(1024);
-    //   foo.append_zerocopy(data, 1024, free);
+    //   foo.append_user_data(data, 1024, free);
+    int append_user_data(void* data, size_t size, void (*deleter)(void*));
+
+    // Same as append_user_data, kept for compatibility.
     int append_zerocopy(void const* data, size_t count, void (*cb)(void*));
 
+    // Map [offset, offset + count) of the file `fd' into memory and append
+    // the mapped pages to back side without copying. Pages are unmapped when
+    // no IOBuf references them. Writing the IOBuf into sockets does not copy
+    // the file into user space and RSS is shared with the page cache.
+    // The file should not be truncated before the IOBuf is destroyed,
+    // otherwise accessing the pages raises SIGBUS. `fd' can be closed after
+    // this function returns.
+    // Returns 0 on success, -1 otherwise.
+    int append_mapped_file(int fd, off_t offset, size_t count);
+
     // Append `data' with `count' bytes to back side. (with copying)
     // Returns 0 on success(include count == 0), -1 otherwise.
     int append(void const* data, size_t count);
@@ -330,13 +357,55 @@ public:
     // Get number of Blocks in use. block_memory = block_count * BLOCK_SIZE
     static size_t block_count();
     static size_t block_memory();
+    // Memory of blocks created with `tag', see ScopedIOBufBlockTag.
+    static const int MAX_BLOCK_TAGS = 8;
+    static size_t block_memory(int tag);
     static size_t new_bigview_count();
     static size_t block_count_hit_tls_threshold();
 
+    // Statistics of blocks cached in threads to speed up appending.
+    struct TLSBlockCacheStats {
+        // Number of threads having caches.
+        size_t thread_count;
+        // Number of blocks cached in all threads.
+        size_t cached_block_count;
+        // Max number of blocks cached in one thread.
+        size_t max_cached_block_count;
+        // Number of blocks got from caches.
+        size_t hit_count;
+        // Number of blocks created since caches were empty.
+        size_t miss_count;
+        // Number of blocks returned to caches.
+        size_t release_count;
+        // Number of blocks freed by trim_tls_block_caches().
+        size_t trimmed_count;
+    };
+    static void get_tls_block_cache_stats(TLSBlockCacheStats* stats);
+
+    // Max number of blocks cached in each thread. Default: 8
+    static void set_max_blocks_per_thread(int n);
+    static int max_blocks_per_thread();
+
+    // Ask all threads to free blocks in their caches which were not used
+    // since last call to this function, and blocks exceeding
+    // max_blocks_per_thread(). Trimming is done by each thread at next
+    // returning of blocks, so caches of idle threads are kept.
+    static void trim_tls_block_caches();
+
     // Equal with a string/IOBuf or not.
     bool equals(const butil::StringPiece&) const;
     bool equals(const IOBuf& other) const;
 
+    // True if bytes in [pos, pos + s.size()) are same with `s'.
+    bool equals_at(size_t pos, const butil::StringPiece& s) const;
+
+    // Returns position of the first `c' at or after `pos', npos if not found.
+    size_t find(char c, size_t pos = 0) const;
+
+    // Returns position of the first occurrence of `s' at or after `pos',
+    // npos if not found. The occurrence may span multiple blocks.
+    size_t find(const butil::StringPiece& s, size_t pos = 0) const;
+
     // Get the number of backing blocks
     size_t backing_block_num() const { return _ref_num(); }
 
@@ -399,6 +468,19 @@ private:
 
 std::ostream& operator<<(std::ostream&, const IOBuf& buf);
 
+// Blocks created by current thread during lifetime of this object are
+// tagged with `tag' (in [0, IOBuf::MAX_BLOCK_TAGS), 0 by default), so that
+// memory of blocks can be attributed to their creators. Notice that the tag
+// is thread-local, code inside the scope must not switch bthreads.
+class ScopedIOBufBlockTag {
+public:
+    explicit ScopedIOBufBlockTag(int tag);
+    ~ScopedIOBufBlockTag();
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedIOBufBlockTag);
+    int _saved_tag;
+};
+
 // Print binary content within max length,
 // working for both butil::IOBuf and std::string
 struct PrintedAsBinary {
@@ -661,6 +743,9 @@ public:
     // Copy at most n bytes into buf, forwarding this iterator.
     size_t copy_and_forward(void* buf, size_t n);
     size_t copy_and_forward(std::string* s, size_t n);
+    // Forward this iterator to the first `c' or the end.
+    // Returns bytes skipped.
+    size_t forward_to(char c);
     size_t bytes_left() const { return _bytes_left; }
 private:
     void try_next_block();
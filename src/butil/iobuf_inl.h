@@ -274,6 +274,23 @@ inline size_t IOBufBytesIterator::copy_and_forward(void* buf, size_t n) {
     return nc;
 }
 
+inline size_t IOBufBytesIterator::forward_to(char c) {
+    size_t nskip = 0;
+    while (_bytes_left) {
+        const size_t block_size = _block_end - _block_begin;
+        const char* p = (const char*)memchr(_block_begin, c, block_size);
+        const size_t n = (p ? p - _block_begin : block_size);
+        _block_begin += n;
+        _bytes_left -= n;
+        nskip += n;
+        if (p) {
+            break;
+        }
+        try_next_block();
+    }
+    return nskip;
+}
+
 inline size_t IOBufBytesIterator::copy_and_forward(std::string* s, size_t n) {
     bool resized = false;
     if (s->size() < n) {
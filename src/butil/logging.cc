@@ -52,6 +52,7 @@ typedef FILE* FileHandle;
 typedef pthread_mutex_t* MutexHandle;
 #endif
 
+#include <inttypes.h>
 #include <algorithm>
 #include <cstring>
 #include <ctime>
@@ -137,6 +138,18 @@ DEFINE_bool(log_hostname, false, "Add host after pid in each log so"
 
 DEFINE_bool(log_year, false, "Log year in datetime part in each log");
 
+DEFINE_bool(async_log, false, "Logs below FATAL are buffered in thread-local "
+            "queues and written by a background thread, so that logging "
+            "threads never block on locks or I/O of logging");
+DEFINE_int32(async_log_buffer_size, 1024, "Max number of logs buffered by "
+             "each thread when -async_log is on, more logs are dropped");
+DEFINE_int32(async_log_flush_interval_ms, 10, "Interval for the background "
+             "thread to write logs buffered by -async_log");
+DEFINE_int32(async_log_dedup_window_ms, 0, "When -async_log is on and this "
+             "is positive, identical logs from a same line are written at "
+             "most once within so many milliseconds, logs suppressed are "
+             "counted in a later log");
+
 namespace {
 
 LoggingDestination logging_destination = LOG_DEFAULT;
@@ -462,16 +475,12 @@ inline void log_severity_name(std::ostream& os, int severity) {
     }
 }
 
-void print_log_prefix(std::ostream& os,
-                      int severity, const char* file, int line) {
+// Print prefix of a log printed by thread `tid' at `time_us'.
+static void print_log_prefix_at(std::ostream& os,
+                                int severity, const char* file, int line,
+                                int64_t time_us, butil::PlatformThreadId tid) {
     log_severity_name(os, severity);
-#if defined(OS_LINUX)
-    timeval tv;
-    gettimeofday(&tv, NULL);
-    time_t t = tv.tv_sec;
-#else
-    time_t t = time(NULL);
-#endif
+    time_t t = time_us / 1000000L;
     struct tm local_tm = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL};
 #if _MSC_VER >= 1400
     localtime_s(&local_tm, &t);
@@ -488,13 +497,13 @@ void print_log_prefix(std::ostream& os,
        << std::setw(2) << local_tm.tm_min << ':'
        << std::setw(2) << local_tm.tm_sec;
 #if defined(OS_LINUX)
-    os << '.' << std::setw(6) << tv.tv_usec;
+    os << '.' << std::setw(6) << time_us % 1000000L;
 #endif
     if (FLAGS_log_process_id) {
         os << ' ' << std::setfill(' ') << std::setw(5) << CurrentProcessId();
     }
     os << ' ' << std::setfill(' ') << std::setw(5)
-       << butil::PlatformThread::CurrentId() << std::setfill('0');
+       << tid << std::setfill('0');
     if (FLAGS_log_hostname) {
         butil::StringPiece hostname(butil::my_hostname());
         if (hostname.ends_with(".baidu.com")) { // make it shorter
@@ -506,6 +515,12 @@ void print_log_prefix(std::ostream& os,
     os.fill(prev_fill);
 }
 
+void print_log_prefix(std::ostream& os,
+                      int severity, const char* file, int line) {
+    print_log_prefix_at(os, severity, file, line, butil::gettimeofday_us(),
+                        butil::PlatformThread::CurrentId());
+}
+
 // A log message handler that gets notified of every log message we process.
 class DoublyBufferedLogSink : public butil::DoublyBufferedData<LogSink*> {
 public:
@@ -774,15 +789,23 @@ public:
         os.write(content.data(), content.size());
         os << '\n';
         std::string log = os.str();
-        
+        WriteLogs(log, (severity >= kAlwaysPrintErrorLevel ?
+                        butil::StringPiece(log) : butil::StringPiece()));
+        return true;
+    }
+
+    // Write formatted `log' to destinations, `error_log' which is part
+    // of `log' is always printed to stderr.
+    void WriteLogs(const butil::StringPiece& log,
+                   const butil::StringPiece& error_log) {
         if ((logging_destination & LOG_TO_SYSTEM_DEBUG_LOG) != 0) {
             fwrite(log.data(), log.size(), 1, stderr);
             fflush(stderr);
-        } else if (severity >= kAlwaysPrintErrorLevel) {
+        } else if (!error_log.empty()) {
             // When we're only outputting to a log file, above a certain log level, we
             // should still output to stderr so that we can better detect and diagnose
             // problems with unit tests, especially on the buildbots.
-            fwrite(log.data(), log.size(), 1, stderr);
+            fwrite(error_log.data(), error_log.size(), 1, stderr);
             fflush(stderr);
         }
 
@@ -812,7 +835,6 @@ public:
 #endif
             }
         }
-        return true;
     }
 private:
     DefaultLogSink() {}
@@ -820,6 +842,374 @@ private:
 friend struct DefaultSingletonTraits<DefaultLogSink>;
 };
 
+// Give any logsink first dibs on the message.
+static void LogToSinks(int severity, const char* file, int line,
+                       const butil::StringPiece& content) {
+#ifdef BAIDU_INTERNAL
+    // If the logsink fails and it's not comlog, try comlog. stderr on last try.
+    bool tried_comlog = false;
+#endif
+    bool tried_default = false;
+    {
+        DoublyBufferedLogSink::ScopedPtr ptr;
+        if (DoublyBufferedLogSink::GetInstance()->Read(&ptr) == 0 &&
+            (*ptr) != NULL) {
+            if ((*ptr)->OnLogMessage(severity, file, line, content)) {
+                return;
+            }
+#ifdef BAIDU_INTERNAL
+            tried_comlog = (*ptr == ComlogSink::GetInstance());
+#endif
+            tried_default = (*ptr == DefaultLogSink::GetInstance());
+        }
+    }
+
+#ifdef BAIDU_INTERNAL
+    if (!tried_comlog) {
+        if (ComlogSink::GetInstance()->OnLogMessage(
+                severity, file, line, content)) {
+            return;
+        }
+    }
+#endif
+    if (!tried_default) {
+        DefaultLogSink::GetInstance()->OnLogMessage(
+            severity, file, line, content);
+    }
+}
+
+// ===== -async_log =====
+// Each logging thread appends logs into its own single-producer/single-
+// consumer ring without locks, the background thread (or FlushAsyncLogs())
+// drains all rings, sorts logs by time and writes them out in one batch.
+// Logs are dropped and counted when the ring is full.
+
+struct AsyncLogRecord {
+    int severity;
+    const char* file;
+    int line;
+    int64_t time_us;
+    butil::PlatformThreadId tid;
+    std::string content;
+};
+
+struct AsyncLogRing {
+    explicit AsyncLogRing(size_t cap)
+        : capacity(cap), slots(new AsyncLogRecord[cap])
+        , head(0), tail(0), exited(false) {}
+    ~AsyncLogRing() { delete [] slots; }
+
+    const size_t capacity;
+    AsyncLogRecord* const slots;
+    // Modified by the consumer.
+    butil::atomic<uint64_t> head;
+    // Modified by the producer.
+    butil::atomic<uint64_t> tail;
+    // Set when the producing thread quits, the ring is deleted by the
+    // consumer after being drained.
+    butil::atomic<bool> exited;
+};
+
+static pthread_mutex_t async_log_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<AsyncLogRing*>* async_log_rings = NULL;
+// Held by the consumer.
+static pthread_mutex_t async_log_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static butil::static_atomic<int64_t> async_log_ndropped = BUTIL_STATIC_ATOMIC_INIT(0);
+static pthread_once_t async_log_flusher_once = PTHREAD_ONCE_INIT;
+static bool async_log_flusher_started = false;
+
+static BAIDU_THREAD_LOCAL AsyncLogRing* tls_async_log_ring = NULL;
+static BAIDU_THREAD_LOCAL bool tls_async_log_ring_exited = false;
+// Set in the consumer, logs printed by sinks are written synchronously.
+static BAIDU_THREAD_LOCAL bool tls_draining_async_logs = false;
+
+static void* AsyncLogFlusher(void*);
+
+static void StartAsyncLogFlusher() {
+    pthread_t th;
+    if (pthread_create(&th, NULL, AsyncLogFlusher, NULL) != 0) {
+        return;
+    }
+    pthread_detach(th);
+    // Logs buffered at exit are written out.
+    atexit(FlushAsyncLogs);
+    async_log_flusher_started = true;
+}
+
+static void ExitAsyncLogRing(void* arg) {
+    tls_async_log_ring = NULL;
+    tls_async_log_ring_exited = true;
+    static_cast<AsyncLogRing*>(arg)->exited.store(
+        true, butil::memory_order_release);
+}
+
+static AsyncLogRing* GetOrNewAsyncLogRing() {
+    AsyncLogRing* ring = tls_async_log_ring;
+    if (ring != NULL) {
+        return ring;
+    }
+    if (tls_async_log_ring_exited) {
+        return NULL;
+    }
+    pthread_once(&async_log_flusher_once, StartAsyncLogFlusher);
+    if (!async_log_flusher_started) {
+        return NULL;
+    }
+    ring = new (std::nothrow) AsyncLogRing(
+        std::max(FLAGS_async_log_buffer_size, 1));
+    if (ring == NULL) {
+        return NULL;
+    }
+    if (butil::thread_atexit(ExitAsyncLogRing, ring) != 0) {
+        delete ring;
+        return NULL;
+    }
+    {
+        BAIDU_SCOPED_LOCK(async_log_ring_mutex);
+        if (async_log_rings == NULL) {
+            async_log_rings = new std::vector<AsyncLogRing*>;
+        }
+        async_log_rings->push_back(ring);
+    }
+    tls_async_log_ring = ring;
+    return ring;
+}
+
+// Returns false when the log should be written synchronously.
+static bool PushAsyncLog(int severity, const char* file, int line,
+                         const butil::StringPiece& content) {
+    if (tls_draining_async_logs) {
+        return false;
+    }
+    AsyncLogRing* ring = GetOrNewAsyncLogRing();
+    if (ring == NULL) {
+        return false;
+    }
+    const uint64_t tail = ring->tail.load(butil::memory_order_relaxed);
+    if (tail - ring->head.load(butil::memory_order_acquire) >= ring->capacity) {
+        async_log_ndropped.fetch_add(1, butil::memory_order_relaxed);
+        return true;
+    }
+    AsyncLogRecord& r = ring->slots[tail % ring->capacity];
+    r.severity = severity;
+    r.file = file;
+    r.line = line;
+    r.time_us = butil::gettimeofday_us();
+    r.tid = butil::PlatformThread::CurrentId();
+    r.content.assign(content.data(), content.size());
+    ring->tail.store(tail + 1, butil::memory_order_release);
+    return true;
+}
+
+struct AsyncLogDedupState {
+    std::string content;
+    int severity;
+    int64_t last_us;
+    int64_t nsuppressed;
+};
+typedef std::map<std::pair<const char*, int>, AsyncLogDedupState>
+AsyncLogDedupMap;
+// Protected by async_log_flush_mutex.
+static AsyncLogDedupMap* async_log_dedup_map = NULL;
+static int64_t async_log_ndropped_reported = 0;
+
+static void AddSuppressedLog(std::deque<AsyncLogRecord>* extra,
+                             const char* file, int line,
+                             const AsyncLogDedupState& st) {
+    AsyncLogRecord r;
+    r.severity = st.severity;
+    r.file = file;
+    r.line = line;
+    r.time_us = butil::gettimeofday_us();
+    r.tid = butil::PlatformThread::CurrentId();
+    r.content = butil::StringPrintf(
+        "Suppressed %" PRId64 " identical logs in last %dms: ",
+        st.nsuppressed, FLAGS_async_log_dedup_window_ms);
+    r.content.append(st.content);
+    extra->push_back(r);
+}
+
+// Returns true if `r' should be suppressed.
+static bool DedupAsyncLog(const AsyncLogRecord& r,
+                          std::deque<AsyncLogRecord>* extra) {
+    const int64_t window_us = FLAGS_async_log_dedup_window_ms * 1000L;
+    if (window_us <= 0) {
+        return false;
+    }
+    if (async_log_dedup_map == NULL) {
+        async_log_dedup_map = new AsyncLogDedupMap;
+    }
+    AsyncLogDedupState& st =
+        (*async_log_dedup_map)[std::make_pair(r.file, r.line)];
+    if (st.last_us != 0 && r.time_us - st.last_us < window_us &&
+        st.content == r.content) {
+        ++st.nsuppressed;
+        return true;
+    }
+    if (st.nsuppressed > 0) {
+        AddSuppressedLog(extra, r.file, r.line, st);
+    }
+    st.content = r.content;
+    st.severity = r.severity;
+    st.last_us = r.time_us;
+    st.nsuppressed = 0;
+    return false;
+}
+
+// Report logs suppressed in windows that ended.
+static void SweepAsyncLogDedupMap(std::deque<AsyncLogRecord>* extra) {
+    if (async_log_dedup_map == NULL) {
+        return;
+    }
+    const int64_t window_us = FLAGS_async_log_dedup_window_ms * 1000L;
+    const int64_t now_us = butil::gettimeofday_us();
+    for (AsyncLogDedupMap::iterator it = async_log_dedup_map->begin();
+         it != async_log_dedup_map->end();) {
+        if (now_us - it->second.last_us < window_us) {
+            ++it;
+            continue;
+        }
+        if (it->second.nsuppressed > 0) {
+            AddSuppressedLog(extra, it->first.first, it->first.second,
+                             it->second);
+        }
+        async_log_dedup_map->erase(it++);
+    }
+}
+
+inline bool AsyncLogRecordLess(const AsyncLogRecord* r1,
+                               const AsyncLogRecord* r2) {
+    return r1->time_us < r2->time_us;
+}
+
+static void WriteAsyncLogs(std::vector<AsyncLogRecord*>& logs) {
+    std::stable_sort(logs.begin(), logs.end(), AsyncLogRecordLess);
+    DoublyBufferedLogSink::ScopedPtr ptr;
+    LogSink* sink = NULL;
+    if (DoublyBufferedLogSink::GetInstance()->Read(&ptr) == 0) {
+        sink = *ptr;
+    }
+    bool batch = (sink == NULL || sink == DefaultLogSink::GetInstance());
+#ifdef BAIDU_INTERNAL
+    // comlog is tried before DefaultLogSink.
+    batch = (sink == DefaultLogSink::GetInstance());
+#endif
+    if (!batch) {
+        for (size_t i = 0; i < logs.size(); ++i) {
+            const AsyncLogRecord* r = logs[i];
+            LogToSinks(r->severity, r->file, r->line, r->content);
+        }
+        return;
+    }
+    // Format all logs and write them in one batch.
+    std::string all;
+    std::string errors;
+    std::ostringstream os;
+    for (size_t i = 0; i < logs.size(); ++i) {
+        const AsyncLogRecord* r = logs[i];
+        os.str(std::string());
+        print_log_prefix_at(os, r->severity, r->file, r->line,
+                            r->time_us, r->tid);
+        os << r->content << '\n';
+        const std::string log = os.str();
+        all.append(log);
+        if (r->severity >= kAlwaysPrintErrorLevel) {
+            errors.append(log);
+        }
+    }
+    DefaultLogSink::GetInstance()->WriteLogs(all, errors);
+}
+
+// Called with async_log_flush_mutex held.
+static void DrainAsyncLogsLocked() {
+    std::vector<AsyncLogRing*> rings;
+    {
+        BAIDU_SCOPED_LOCK(async_log_ring_mutex);
+        if (async_log_rings != NULL) {
+            rings = *async_log_rings;
+        }
+    }
+    std::vector<uint64_t> tails(rings.size());
+    std::vector<bool> exited(rings.size());
+    std::vector<AsyncLogRecord*> logs;
+    std::deque<AsyncLogRecord> extra;
+    for (size_t i = 0; i < rings.size(); ++i) {
+        AsyncLogRing* ring = rings[i];
+        // Load `exited' before `tail' so that the ring is empty after
+        // being drained if the thread had quit.
+        exited[i] = ring->exited.load(butil::memory_order_acquire);
+        tails[i] = ring->tail.load(butil::memory_order_acquire);
+        for (uint64_t j = ring->head.load(butil::memory_order_relaxed);
+             j != tails[i]; ++j) {
+            AsyncLogRecord* r = &ring->slots[j % ring->capacity];
+            if (!DedupAsyncLog(*r, &extra)) {
+                logs.push_back(r);
+            }
+        }
+    }
+    SweepAsyncLogDedupMap(&extra);
+    const int64_t ndropped =
+        async_log_ndropped.load(butil::memory_order_relaxed);
+    if (ndropped != async_log_ndropped_reported) {
+        AsyncLogRecord r;
+        r.severity = BLOG_WARNING;
+        r.file = __FILE__;
+        r.line = __LINE__;
+        r.time_us = butil::gettimeofday_us();
+        r.tid = butil::PlatformThread::CurrentId();
+        r.content = butil::StringPrintf(
+            "Dropped %" PRId64 " logs because buffers of -async_log were full",
+            ndropped - async_log_ndropped_reported);
+        extra.push_back(r);
+        async_log_ndropped_reported = ndropped;
+    }
+    for (size_t i = 0; i < extra.size(); ++i) {
+        logs.push_back(&extra[i]);
+    }
+    if (!logs.empty()) {
+        WriteAsyncLogs(logs);
+    }
+    std::vector<AsyncLogRing*> exited_rings;
+    for (size_t i = 0; i < rings.size(); ++i) {
+        rings[i]->head.store(tails[i], butil::memory_order_release);
+        if (exited[i]) {
+            exited_rings.push_back(rings[i]);
+        }
+    }
+    if (!exited_rings.empty()) {
+        BAIDU_SCOPED_LOCK(async_log_ring_mutex);
+        for (size_t i = 0; i < exited_rings.size(); ++i) {
+            async_log_rings->erase(std::find(async_log_rings->begin(),
+                                             async_log_rings->end(),
+                                             exited_rings[i]));
+            delete exited_rings[i];
+        }
+    }
+}
+
+void FlushAsyncLogs() {
+    if (tls_draining_async_logs) {
+        return;
+    }
+    tls_draining_async_logs = true;
+    pthread_mutex_lock(&async_log_flush_mutex);
+    DrainAsyncLogsLocked();
+    pthread_mutex_unlock(&async_log_flush_mutex);
+    tls_draining_async_logs = false;
+}
+
+int64_t GetDroppedAsyncLogCount() {
+    return async_log_ndropped.load(butil::memory_order_relaxed);
+}
+
+static void* AsyncLogFlusher(void*) {
+    while (true) {
+        FlushAsyncLogs();
+        usleep(std::max(FLAGS_async_log_flush_interval_ms, 1) * 1000L);
+    }
+    return NULL;
+}
+
 void LogStream::FlushWithoutReset() {
     if (empty()) {
         // Nothing to flush.
@@ -852,38 +1242,17 @@ void LogStream::FlushWithoutReset() {
     // Move back one step because we don't want to count the zero.
     pbump(-1); 
 
-    // Give any logsink first dibs on the message.
-#ifdef BAIDU_INTERNAL
-    // If the logsink fails and it's not comlog, try comlog. stderr on last try.
-    bool tried_comlog = false;
-#endif
-    bool tried_default = false;
-    {
-        DoublyBufferedLogSink::ScopedPtr ptr;
-        if (DoublyBufferedLogSink::GetInstance()->Read(&ptr) == 0 &&
-            (*ptr) != NULL) {
-            if ((*ptr)->OnLogMessage(_severity, _file, _line, content())) {
+    if (FLAGS_async_log) {
+        if (_severity < BLOG_FATAL) {
+            if (PushAsyncLog(_severity, _file, _line, content())) {
                 goto FINISH_LOGGING;
             }
-#ifdef BAIDU_INTERNAL
-            tried_comlog = (*ptr == ComlogSink::GetInstance());
-#endif
-            tried_default = (*ptr == DefaultLogSink::GetInstance());
-        }
-    }
-
-#ifdef BAIDU_INTERNAL
-    if (!tried_comlog) {
-        if (ComlogSink::GetInstance()->OnLogMessage(
-                _severity, _file, _line, content())) {
-            goto FINISH_LOGGING;
+        } else {
+            // Write logs before the fatal one.
+            FlushAsyncLogs();
         }
     }
-#endif
-    if (!tried_default) {
-        DefaultLogSink::GetInstance()->OnLogMessage(
-            _severity, _file, _line, content());
-    }
+    LogToSinks(_severity, _file, _line, content());
 
 FINISH_LOGGING:
     if (FLAGS_crash_on_fatal_log && _severity == BLOG_FATAL) {
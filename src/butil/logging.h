@@ -1045,6 +1045,13 @@ private:
 //       after this call.
 BUTIL_EXPORT void CloseLogFile();
 
+// Write logs buffered by -async_log and wait until they're written. Called
+// automatically at exit and before FATAL logs.
+BUTIL_EXPORT void FlushAsyncLogs();
+
+// Number of logs dropped by -async_log because buffers were full.
+BUTIL_EXPORT int64_t GetDroppedAsyncLogCount();
+
 // Async signal safe logging mechanism.
 BUTIL_EXPORT void RawLog(int level, const char* message);
 
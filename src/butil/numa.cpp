@@ -0,0 +1,94 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <sched.h>                       // sched_getcpu
+#include <stdint.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <string.h>
+#include "butil/numa.h"
+
+namespace butil {
+
+// cpus with greater ids are treated as node 0.
+static const int MAX_CPU_NUM = 4096;
+static int s_numa_node_num = 1;
+static uint8_t s_cpu_to_node[MAX_CPU_NUM];
+static pthread_once_t s_numa_once = PTHREAD_ONCE_INIT;
+
+static void init_numa_info() {
+#if defined(OS_LINUX) || defined(__linux__)
+    // Each /sys/devices/system/node/nodeN has entries named cpuM.
+    DIR* nodes = opendir("/sys/devices/system/node");
+    if (nodes == NULL) {
+        return;
+    }
+    int max_node = 0;
+    struct dirent* e = NULL;
+    while ((e = readdir(nodes)) != NULL) {
+        int node = -1;
+        if (sscanf(e->d_name, "node%d", &node) != 1 || node < 0) {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+        DIR* cpus = opendir(path);
+        if (cpus == NULL) {
+            continue;
+        }
+        const int folded = node % MAX_NUMA_NODE_NUM;
+        if (folded > max_node) {
+            max_node = folded;
+        }
+        struct dirent* c = NULL;
+        while ((c = readdir(cpus)) != NULL) {
+            int cpu = -1;
+            char dummy;
+            if (sscanf(c->d_name, "cpu%d%c", &cpu, &dummy) == 1 &&
+                cpu >= 0 && cpu < MAX_CPU_NUM) {
+                s_cpu_to_node[cpu] = folded;
+            }
+        }
+        closedir(cpus);
+    }
+    closedir(nodes);
+    s_numa_node_num = max_node + 1;
+#endif
+}
+
+int numa_node_num() {
+    pthread_once(&s_numa_once, init_numa_info);
+    return s_numa_node_num;
+}
+
+int current_numa_node() {
+    if (numa_node_num() == 1) {
+        return 0;
+    }
+#if defined(OS_LINUX) || defined(__linux__)
+    return numa_node_of_cpu(sched_getcpu());
+#else
+    return 0;
+#endif
+}
+
+int numa_node_of_cpu(int cpu) {
+    if (numa_node_num() == 1 || cpu < 0 || cpu >= MAX_CPU_NUM) {
+        return 0;
+    }
+    return s_cpu_to_node[cpu];
+}
+
+}  // namespace butil
@@ -0,0 +1,39 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BUTIL_NUMA_H
+#define BUTIL_NUMA_H
+
+namespace butil {
+
+// Nodes with larger ids are folded into [0, MAX_NUMA_NODE_NUM) so that
+// per-node structures can be fixed-size arrays.
+static const int MAX_NUMA_NODE_NUM = 8;
+
+// Number of NUMA nodes of this machine, read from sysfs once. Always 1 on
+// platforms without NUMA information.
+int numa_node_num();
+
+// NUMA node of the cpu running the calling thread, in [0, numa_node_num()).
+// Costs a vDSO call of sched_getcpu() on linux, so it's cheap enough for
+// paths running once per batch of allocations. The result may be stale
+// immediately since the thread can be migrated.
+int current_numa_node();
+
+// NUMA node of the cpu, 0 if the cpu is unknown.
+int numa_node_of_cpu(int cpu);
+
+}  // namespace butil
+
+#endif  // BUTIL_NUMA_H
@@ -24,6 +24,7 @@
 #include <algorithm>                     // std::max, std::min
 #include "butil/atomicops.h"              // butil::atomic
 #include "butil/macros.h"                 // BAIDU_CACHELINE_ALIGNMENT
+#include "butil/numa.h"                   // current_numa_node
 #include "butil/scoped_lock.h"            // BAIDU_SCOPED_LOCK
 #include "butil/thread_local.h"           // BAIDU_THREAD_LOCAL
 #include <vector>
@@ -60,6 +61,11 @@ struct ObjectPoolInfo {
     size_t block_item_num;
     size_t free_chunk_item_num;
     size_t total_size;
+    size_t numa_node_num;
+    // Blocks allocated by threads running on each node.
+    size_t numa_block_num[MAX_NUMA_NODE_NUM];
+    // Free chunks popped from lists of other nodes.
+    size_t remote_free_chunk_num;
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
     size_t free_item_num;
 #endif
@@ -86,7 +92,7 @@ public:
     static const size_t FREE_CHUNK_NITEM = BLOCK_NITEM;
 
     // Free objects are batched in a FreeChunk before they're added to
-    // global list(_free_chunks).
+    // global lists(_free_chunks).
     typedef ObjectPoolFreeChunk<T, FREE_CHUNK_NITEM>    FreeChunk;
     typedef ObjectPoolFreeChunk<T, 0> DynamicFreeChunk;
 
@@ -277,6 +283,13 @@ public:
         info.item_num = 0;
         info.free_chunk_item_num = free_chunk_nitem();
         info.block_item_num = BLOCK_NITEM;
+        info.numa_node_num = numa_node_num();
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            info.numa_block_num[i] =
+                _numa_nblock[i].load(butil::memory_order_relaxed);
+        }
+        info.remote_free_chunk_num =
+            _nremote_free_chunk.load(butil::memory_order_relaxed);
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
         info.free_item_num = _global_nfree.load(butil::memory_order_relaxed);
 #endif
@@ -316,13 +329,17 @@ public:
     }
 
 private:
-    ObjectPool() {
-        _free_chunks.reserve(OP_INITIAL_FREE_LIST_SIZE);
-        pthread_mutex_init(&_free_chunks_mutex, NULL);
+    ObjectPool() : _nremote_free_chunk(0) {
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            _free_chunks[i].chunks.reserve(OP_INITIAL_FREE_LIST_SIZE);
+            pthread_mutex_init(&_free_chunks[i].mutex, NULL);
+        }
     }
 
     ~ObjectPool() {
-        pthread_mutex_destroy(&_free_chunks_mutex);
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            pthread_mutex_destroy(&_free_chunks[i].mutex);
+        }
     }
 
     // Create a Block and append it to right-most BlockGroup.
@@ -343,6 +360,10 @@ private:
                     g->blocks[block_index].store(
                         new_block, butil::memory_order_release);
                     *index = (ngroup - 1) * OP_GROUP_NBLOCK + block_index;
+                    // Pages of the block are touched by the calling thread
+                    // first, thus they're likely to be on this node.
+                    _numa_nblock[current_numa_node()].fetch_add(
+                        1, butil::memory_order_relaxed);
                     return new_block;
                 }
                 g->nblock.fetch_sub(1, butil::memory_order_relaxed);
@@ -443,24 +464,45 @@ private:
         }
 
         memset(_block_groups, 0, sizeof(BlockGroup*) * OP_MAX_BLOCK_NGROUP);
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            _numa_nblock[i].store(0, butil::memory_order_relaxed);
+        }
+        _nremote_free_chunk.store(0, butil::memory_order_relaxed);
 #endif
     }
 
 private:
     bool pop_free_chunk(FreeChunk& c) {
+        const int node = current_numa_node();
+        if (pop_free_chunk_of(node, c)) {
+            return true;
+        }
+        // Steal from other nodes rather than allocating new blocks.
+        const int nnode = numa_node_num();
+        for (int i = 1; i < nnode; ++i) {
+            if (pop_free_chunk_of((node + i) % nnode, c)) {
+                _nremote_free_chunk.fetch_add(1, butil::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool pop_free_chunk_of(int node, FreeChunk& c) {
+        FreeChunkList& l = _free_chunks[node];
         // Critical for the case that most return_object are called in
         // different threads of get_object.
-        if (_free_chunks.empty()) {
+        if (l.chunks.empty()) {
             return false;
         }
-        pthread_mutex_lock(&_free_chunks_mutex);
-        if (_free_chunks.empty()) {
-            pthread_mutex_unlock(&_free_chunks_mutex);
+        pthread_mutex_lock(&l.mutex);
+        if (l.chunks.empty()) {
+            pthread_mutex_unlock(&l.mutex);
             return false;
         }
-        DynamicFreeChunk* p = _free_chunks.back();
-        _free_chunks.pop_back();
-        pthread_mutex_unlock(&_free_chunks_mutex);
+        DynamicFreeChunk* p = l.chunks.back();
+        l.chunks.pop_back();
+        pthread_mutex_unlock(&l.mutex);
         c.nfree = p->nfree;
         memcpy(c.ptrs, p->ptrs, sizeof(*p->ptrs) * p->nfree);
         free(p);
@@ -475,9 +517,10 @@ private:
         }
         p->nfree = c.nfree;
         memcpy(p->ptrs, c.ptrs, sizeof(*c.ptrs) * c.nfree);
-        pthread_mutex_lock(&_free_chunks_mutex);
-        _free_chunks.push_back(p);
-        pthread_mutex_unlock(&_free_chunks_mutex);
+        FreeChunkList& l = _free_chunks[current_numa_node()];
+        pthread_mutex_lock(&l.mutex);
+        l.chunks.push_back(p);
+        pthread_mutex_unlock(&l.mutex);
         return true;
     }
     
@@ -490,8 +533,17 @@ private:
     static pthread_mutex_t _change_thread_mutex;
     static butil::static_atomic<BlockGroup*> _block_groups[OP_MAX_BLOCK_NGROUP];
 
-    std::vector<DynamicFreeChunk*> _free_chunks;
-    pthread_mutex_t _free_chunks_mutex;
+    static butil::static_atomic<size_t> _numa_nblock[MAX_NUMA_NODE_NUM];
+
+    // Free chunks are pushed into the list of the node where the thread
+    // returning them runs, and popped from the list of current node first,
+    // so that items are mostly reused on the node touched them recently.
+    struct BAIDU_CACHELINE_ALIGNMENT FreeChunkList {
+        std::vector<DynamicFreeChunk*> chunks;
+        pthread_mutex_t mutex;
+    };
+    FreeChunkList _free_chunks[MAX_NUMA_NODE_NUM];
+    butil::atomic<size_t> _nremote_free_chunk;
 
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
     static butil::static_atomic<size_t> _global_nfree;
@@ -529,6 +581,9 @@ template <typename T>
 butil::static_atomic<typename ObjectPool<T>::BlockGroup*>
 ObjectPool<T>::_block_groups[OP_MAX_BLOCK_NGROUP] = {};
 
+template <typename T>
+butil::static_atomic<size_t> ObjectPool<T>::_numa_nblock[MAX_NUMA_NODE_NUM] = {};
+
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
 template <typename T>
 butil::static_atomic<size_t> ObjectPool<T>::_global_nfree = BUTIL_STATIC_ATOMIC_INIT(0);
@@ -536,13 +591,19 @@ butil::static_atomic<size_t> ObjectPool<T>::_global_nfree = BUTIL_STATIC_ATOMIC_
 
 inline std::ostream& operator<<(std::ostream& os,
                                 ObjectPoolInfo const& info) {
-    return os << "local_pool_num: " << info.local_pool_num
+    os << "local_pool_num: " << info.local_pool_num
               << "\nblock_group_num: " << info.block_group_num
               << "\nblock_num: " << info.block_num
               << "\nitem_num: " << info.item_num
               << "\nblock_item_num: " << info.block_item_num
               << "\nfree_chunk_item_num: " << info.free_chunk_item_num
               << "\ntotal_size: " << info.total_size
+              << "\nnuma_node_num: " << info.numa_node_num
+              << "\nnuma_block_num:";
+    for (size_t i = 0; i < info.numa_node_num; ++i) {
+        os << ' ' << info.numa_block_num[i];
+    }
+    return os << "\nremote_free_chunk_num: " << info.remote_free_chunk_num
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
               << "\nfree_num: " << info.free_item_num
 #endif
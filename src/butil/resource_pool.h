@@ -20,6 +20,7 @@
 #define BUTIL_RESOURCE_POOL_H
 
 #include <cstddef>                       // size_t
+#include <stdint.h>                      // uint64_t
 
 // Efficiently allocate fixed-size (small) objects addressable by identifiers
 // in multi-threaded environment.
@@ -81,6 +82,18 @@ template <typename T> struct ResourcePoolValidator {
     static bool validate(const T*) { return true; }
 };
 
+// Specialize this class with enabled=true to make shrink_resources<T>()
+// return memory of idle blocks to the system. Objects in a reclaimed block
+// are destructed, and constructed again when the block is reused, so
+// versions stored inside objects(to make identifiers unique) are lost.
+// save() is called on free objects before destruction and the result is
+// passed to restore() after construction to keep versions increasing.
+template <typename T> struct ResourcePoolReclaimer {
+    static const bool enabled = false;
+    static uint64_t save(const T*) { return 0; }
+    static void restore(T*, uint64_t) {}
+};
+
 }  // namespace butil
 
 #include "butil/resource_pool_inl.h"
@@ -133,6 +146,19 @@ template <typename T> inline void clear_resources() {
     ResourcePool<T>::singleton()->clear_resources();
 }
 
+// Return memory of blocks whose objects are all free to the system, if
+// ResourcePoolReclaimer<T> is enabled. Identifiers inside such blocks are
+// still valid and will be reused, address_resource() of them returns NULL
+// until they're allocated again. To make sure no thread is still accessing
+// the objects found by address_resource() just before, memory of a block is
+// returned in a later call at least `grace_us' after it was found idle.
+// Call this function periodically rather than frequently: it takes all
+// global free objects temporarily and sorts them.
+// Returns bytes returned to the system in this call.
+template <typename T> inline size_t shrink_resources(int64_t grace_us) {
+    return ResourcePool<T>::singleton()->shrink(grace_us);
+}
+
 // Get description of resources typed T.
 // This function is possibly slow because it iterates internal structures.
 // Don't use it frequently like a "getter" function.
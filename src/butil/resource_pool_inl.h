@@ -21,11 +21,15 @@
 
 #include <iostream>                      // std::ostream
 #include <pthread.h>                     // pthread_mutex_t
+#include <sys/mman.h>                    // madvise
+#include <unistd.h>                      // getpagesize
 #include <algorithm>                     // std::max, std::min
 #include "butil/atomicops.h"              // butil::atomic
 #include "butil/macros.h"                 // BAIDU_CACHELINE_ALIGNMENT
+#include "butil/numa.h"                   // current_numa_node
 #include "butil/scoped_lock.h"            // BAIDU_SCOPED_LOCK
 #include "butil/thread_local.h"           // thread_atexit
+#include "butil/time.h"                   // monotonic_time_us
 #include <vector>
 
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
@@ -75,6 +79,15 @@ struct ResourcePoolInfo {
     size_t block_item_num;
     size_t free_chunk_item_num;
     size_t total_size;
+    size_t numa_node_num;
+    // Blocks allocated by threads running on each node.
+    size_t numa_block_num[MAX_NUMA_NODE_NUM];
+    // Free chunks popped from lists of other nodes.
+    size_t remote_free_chunk_num;
+    // Blocks found idle by shrink(), memory of them will be returned.
+    size_t idle_block_num;
+    // Blocks whose memory was returned and not reused yet.
+    size_t reclaimed_block_num;
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
     size_t free_item_num;
 #endif
@@ -102,7 +115,7 @@ public:
     static const size_t FREE_CHUNK_NITEM = BLOCK_NITEM;
 
     // Free identifiers are batched in a FreeChunk before they're added to
-    // global list(_free_chunks).
+    // global lists(_free_chunks).
     typedef ResourcePoolFreeChunk<T, FREE_CHUNK_NITEM>      FreeChunk;
     typedef ResourcePoolFreeChunk<T, 0> DynamicFreeChunk;
 
@@ -138,7 +151,8 @@ public:
         explicit LocalPool(ResourcePool* pool)
             : _pool(pool)
             , _cur_block(NULL)
-            , _cur_block_index(0) {
+            , _cur_block_index(0)
+            , _cur_states(NULL) {
             _cur_free.nfree = 0;
         }
 
@@ -147,6 +161,8 @@ public:
             if (_cur_free.nfree) {
                 _pool->push_free_chunk(_cur_free);
             }
+            free(_cur_states);
+            _cur_states = NULL;
 
             _pool->clear_from_destructor_of_local_pool();
         }
@@ -185,11 +201,20 @@ public:
                 p->~T();                                                \
                 return NULL;                                            \
             }                                                           \
+            if (ResourcePoolReclaimer<T>::enabled && _cur_states) {     \
+                ResourcePoolReclaimer<T>::restore(                      \
+                    p, _cur_states[_cur_block->nitem]);                 \
+            }                                                           \
             ++_cur_block->nitem;                                        \
+            if (ResourcePoolReclaimer<T>::enabled &&                    \
+                _cur_block->nitem == BLOCK_NITEM) {                     \
+                /* Full blocks may be reclaimed, don't touch them */    \
+                _cur_block = NULL;                                      \
+            }                                                           \
             return p;                                                   \
         }                                                               \
         /* Fetch a Block from global */                                 \
-        _cur_block = add_block(&_cur_block_index);                      \
+        _cur_block = fetch_block();                                     \
         if (_cur_block != NULL) {                                       \
             id->value = _cur_block_index * BLOCK_NITEM + _cur_block->nitem; \
             T* p = new ((T*)_cur_block->items + _cur_block->nitem) T CTOR_ARGS; \
@@ -197,7 +222,16 @@ public:
                 p->~T();                                                \
                 return NULL;                                            \
             }                                                           \
+            if (ResourcePoolReclaimer<T>::enabled && _cur_states) {     \
+                ResourcePoolReclaimer<T>::restore(                      \
+                    p, _cur_states[_cur_block->nitem]);                 \
+            }                                                           \
             ++_cur_block->nitem;                                        \
+            if (ResourcePoolReclaimer<T>::enabled &&                    \
+                _cur_block->nitem == BLOCK_NITEM) {                     \
+                /* Full blocks may be reclaimed, don't touch them */    \
+                _cur_block = NULL;                                      \
+            }                                                           \
             return p;                                                   \
         }                                                               \
         return NULL;                                                    \
@@ -238,9 +272,26 @@ public:
         }
 
     private:
+        // Reuse a reclaimed block before creating new ones.
+        Block* fetch_block() {
+            free(_cur_states);
+            _cur_states = NULL;
+            if (ResourcePoolReclaimer<T>::enabled) {
+                Block* b = _pool->pop_reclaimed_block(
+                    &_cur_block_index, &_cur_states);
+                if (b != NULL) {
+                    return b;
+                }
+            }
+            return add_block(&_cur_block_index);
+        }
+
         ResourcePool* _pool;
         Block* _cur_block;
         size_t _cur_block_index;
+        // States saved from destructed objects of _cur_block if it was
+        // reclaimed, indexed by offsets of objects.
+        uint64_t* _cur_states;
         FreeChunk _cur_free;
     };
 
@@ -331,6 +382,16 @@ public:
         info.item_num = 0;
         info.free_chunk_item_num = free_chunk_nitem();
         info.block_item_num = BLOCK_NITEM;
+        info.numa_node_num = numa_node_num();
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            info.numa_block_num[i] =
+                _numa_nblock[i].load(butil::memory_order_relaxed);
+        }
+        info.remote_free_chunk_num =
+            _nremote_free_chunk.load(butil::memory_order_relaxed);
+        info.idle_block_num = _nidle_block.load(butil::memory_order_relaxed);
+        info.reclaimed_block_num =
+            _nreclaimed_block.load(butil::memory_order_relaxed);
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
         info.free_item_num = _global_nfree.load(butil::memory_order_relaxed);
 #endif
@@ -354,6 +415,16 @@ public:
         return info;
     }
 
+    size_t shrink(int64_t grace_us) {
+        if (!ResourcePoolReclaimer<T>::enabled) {
+            return 0;
+        }
+        BAIDU_SCOPED_LOCK(_reclaim_mutex);
+        const size_t nreclaimed = reclaim_idle_blocks(grace_us);
+        find_idle_blocks();
+        return nreclaimed * sizeof(T) * BLOCK_NITEM;
+    }
+
     static inline ResourcePool* singleton() {
         ResourcePool* p = _singleton.load(butil::memory_order_consume);
         if (p) {
@@ -370,13 +441,128 @@ public:
     }
 
 private:
-    ResourcePool() {
-        _free_chunks.reserve(RP_INITIAL_FREE_LIST_SIZE);
-        pthread_mutex_init(&_free_chunks_mutex, NULL);
+    ResourcePool()
+        : _nremote_free_chunk(0)
+        , _nidle_block(0)
+        , _nreclaimed_block(0) {
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            _free_chunks[i].chunks.reserve(RP_INITIAL_FREE_LIST_SIZE);
+            pthread_mutex_init(&_free_chunks[i].mutex, NULL);
+        }
+        pthread_mutex_init(&_reclaim_mutex, NULL);
     }
 
     ~ResourcePool() {
-        pthread_mutex_destroy(&_free_chunks_mutex);
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            pthread_mutex_destroy(&_free_chunks[i].mutex);
+        }
+        pthread_mutex_destroy(&_reclaim_mutex);
+    }
+
+    static Block* block_at(size_t block_index) {
+        return _block_groups[(block_index >> RP_GROUP_NBLOCK_NBIT)]
+            .load(butil::memory_order_consume)
+            ->blocks[(block_index & (RP_GROUP_NBLOCK - 1))]
+            .load(butil::memory_order_consume);
+    }
+
+    // Take all free identifiers in global lists. Blocks whose identifiers
+    // are all taken are hidden from address_resource() by resetting nitem,
+    // and remaining identifiers are put back.
+    void find_idle_blocks() {
+        std::vector<ResourceId<T> > ids;
+        FreeChunk c;
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            while (pop_free_chunk_of(i, c)) {
+                ids.insert(ids.end(), c.ids, c.ids + c.nfree);
+            }
+        }
+        std::sort(ids.begin(), ids.end(), less_id);
+        c.nfree = 0;
+        const int64_t now = butil::monotonic_time_us();
+        for (size_t i = 0; i < ids.size();) {
+            const size_t block_index = ids[i].value / BLOCK_NITEM;
+            size_t j = i + 1;
+            for (; j < ids.size() && ids[j].value / BLOCK_NITEM == block_index;
+                 ++j) {}
+            Block* b = block_at(block_index);
+            uint64_t* states = NULL;
+            if (j - i == BLOCK_NITEM && b->nitem == BLOCK_NITEM) {
+                states = (uint64_t*)malloc(sizeof(uint64_t) * BLOCK_NITEM);
+            }
+            if (states != NULL) {
+                T* const objs = (T*)b->items;
+                for (size_t k = 0; k < BLOCK_NITEM; ++k) {
+                    states[k] = ResourcePoolReclaimer<T>::save(objs + k);
+                }
+                b->nitem = 0;
+                IdleBlock ib = { block_index, states, now };
+                _idle_blocks.push_back(ib);
+                _nidle_block.fetch_add(1, butil::memory_order_relaxed);
+            } else {
+                for (size_t k = i; k < j; ++k) {
+                    c.ids[c.nfree++] = ids[k];
+                    if (c.nfree == free_chunk_nitem()) {
+                        push_free_chunk(c);
+                        c.nfree = 0;
+                    }
+                }
+            }
+            i = j;
+        }
+        if (c.nfree) {
+            push_free_chunk(c);
+        }
+    }
+
+    // Destruct objects of blocks found idle for more than grace_us and
+    // return their pages to the system.
+    size_t reclaim_idle_blocks(int64_t grace_us) {
+        const int64_t now = butil::monotonic_time_us();
+        const uintptr_t page_size = getpagesize();
+        size_t nreclaimed = 0;
+        size_t i = 0;
+        for (; i < _idle_blocks.size() &&
+                 _idle_blocks[i].idle_time_us + grace_us <= now; ++i) {
+            Block* b = block_at(_idle_blocks[i].index);
+            T* const objs = (T*)b->items;
+            for (size_t k = 0; k < BLOCK_NITEM; ++k) {
+                objs[k].~T();
+            }
+            const uintptr_t begin =
+                ((uintptr_t)b->items + page_size - 1) & ~(page_size - 1);
+            const uintptr_t end =
+                ((uintptr_t)b->items + sizeof(b->items)) & ~(page_size - 1);
+            if (begin < end) {
+                madvise((void*)begin, end - begin, MADV_DONTNEED);
+            }
+            _reclaimed_blocks.push_back(_idle_blocks[i]);
+            ++nreclaimed;
+        }
+        _idle_blocks.erase(_idle_blocks.begin(), _idle_blocks.begin() + i);
+        _nidle_block.fetch_sub(nreclaimed, butil::memory_order_relaxed);
+        _nreclaimed_block.fetch_add(nreclaimed, butil::memory_order_relaxed);
+        return nreclaimed;
+    }
+
+    Block* pop_reclaimed_block(size_t* index, uint64_t** states) {
+        if (_nreclaimed_block.load(butil::memory_order_relaxed) == 0) {
+            return NULL;
+        }
+        BAIDU_SCOPED_LOCK(_reclaim_mutex);
+        if (_reclaimed_blocks.empty()) {
+            return NULL;
+        }
+        const IdleBlock ib = _reclaimed_blocks.back();
+        _reclaimed_blocks.pop_back();
+        _nreclaimed_block.fetch_sub(1, butil::memory_order_relaxed);
+        *index = ib.index;
+        *states = ib.states;
+        return block_at(ib.index);
+    }
+
+    static bool less_id(ResourceId<T> id1, ResourceId<T> id2) {
+        return id1.value < id2.value;
     }
 
     // Create a Block and append it to right-most BlockGroup.
@@ -398,6 +584,10 @@ private:
                     g->blocks[block_index].store(
                         new_block, butil::memory_order_release);
                     *index = (ngroup - 1) * RP_GROUP_NBLOCK + block_index;
+                    // Pages of the block are touched by the calling thread
+                    // first, thus they're likely to be on this node.
+                    _numa_nblock[current_numa_node()].fetch_add(
+                        1, butil::memory_order_relaxed);
                     return new_block;
                 }
                 g->nblock.fetch_sub(1, butil::memory_order_relaxed);
@@ -474,6 +664,22 @@ private:
         FreeChunk dummy;
         while (pop_free_chunk(dummy));
 
+        // Objects of idle blocks are not destructed yet, reclaimed ones are.
+        for (size_t i = 0; i < _idle_blocks.size(); ++i) {
+            T* const objs = (T*)block_at(_idle_blocks[i].index)->items;
+            for (size_t k = 0; k < BLOCK_NITEM; ++k) {
+                objs[k].~T();
+            }
+            free(_idle_blocks[i].states);
+        }
+        _idle_blocks.clear();
+        for (size_t i = 0; i < _reclaimed_blocks.size(); ++i) {
+            free(_reclaimed_blocks[i].states);
+        }
+        _reclaimed_blocks.clear();
+        _nidle_block.store(0, butil::memory_order_relaxed);
+        _nreclaimed_block.store(0, butil::memory_order_relaxed);
+
         // Delete all memory
         const size_t ngroup = _ngroup.exchange(0, butil::memory_order_relaxed);
         for (size_t i = 0; i < ngroup; ++i) {
@@ -498,24 +704,45 @@ private:
         }
 
         memset(_block_groups, 0, sizeof(BlockGroup*) * RP_MAX_BLOCK_NGROUP);
+        for (int i = 0; i < MAX_NUMA_NODE_NUM; ++i) {
+            _numa_nblock[i].store(0, butil::memory_order_relaxed);
+        }
+        _nremote_free_chunk.store(0, butil::memory_order_relaxed);
 #endif
     }
 
 private:
     bool pop_free_chunk(FreeChunk& c) {
+        const int node = current_numa_node();
+        if (pop_free_chunk_of(node, c)) {
+            return true;
+        }
+        // Steal from other nodes rather than allocating new blocks.
+        const int nnode = numa_node_num();
+        for (int i = 1; i < nnode; ++i) {
+            if (pop_free_chunk_of((node + i) % nnode, c)) {
+                _nremote_free_chunk.fetch_add(1, butil::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool pop_free_chunk_of(int node, FreeChunk& c) {
+        FreeChunkList& l = _free_chunks[node];
         // Critical for the case that most return_object are called in
         // different threads of get_object.
-        if (_free_chunks.empty()) {
+        if (l.chunks.empty()) {
             return false;
         }
-        pthread_mutex_lock(&_free_chunks_mutex);
-        if (_free_chunks.empty()) {
-            pthread_mutex_unlock(&_free_chunks_mutex);
+        pthread_mutex_lock(&l.mutex);
+        if (l.chunks.empty()) {
+            pthread_mutex_unlock(&l.mutex);
             return false;
         }
-        DynamicFreeChunk* p = _free_chunks.back();
-        _free_chunks.pop_back();
-        pthread_mutex_unlock(&_free_chunks_mutex);
+        DynamicFreeChunk* p = l.chunks.back();
+        l.chunks.pop_back();
+        pthread_mutex_unlock(&l.mutex);
         c.nfree = p->nfree;
         memcpy(c.ids, p->ids, sizeof(*p->ids) * p->nfree);
         free(p);
@@ -530,9 +757,10 @@ private:
         }
         p->nfree = c.nfree;
         memcpy(p->ids, c.ids, sizeof(*c.ids) * c.nfree);
-        pthread_mutex_lock(&_free_chunks_mutex);
-        _free_chunks.push_back(p);
-        pthread_mutex_unlock(&_free_chunks_mutex);
+        FreeChunkList& l = _free_chunks[current_numa_node()];
+        pthread_mutex_lock(&l.mutex);
+        l.chunks.push_back(p);
+        pthread_mutex_unlock(&l.mutex);
         return true;
     }
     
@@ -545,8 +773,31 @@ private:
     static pthread_mutex_t _change_thread_mutex;
     static butil::static_atomic<BlockGroup*> _block_groups[RP_MAX_BLOCK_NGROUP];
 
-    std::vector<DynamicFreeChunk*> _free_chunks;
-    pthread_mutex_t _free_chunks_mutex;
+    static butil::static_atomic<size_t> _numa_nblock[MAX_NUMA_NODE_NUM];
+
+    // Free chunks are pushed into the list of the node where the thread
+    // returning them runs, and popped from the list of current node first,
+    // so that items are mostly reused on the node touched them recently.
+    struct BAIDU_CACHELINE_ALIGNMENT FreeChunkList {
+        std::vector<DynamicFreeChunk*> chunks;
+        pthread_mutex_t mutex;
+    };
+    FreeChunkList _free_chunks[MAX_NUMA_NODE_NUM];
+    butil::atomic<size_t> _nremote_free_chunk;
+
+    struct IdleBlock {
+        size_t index;
+        uint64_t* states;
+        int64_t idle_time_us;
+    };
+    // Protect following vectors and serialize shrink().
+    pthread_mutex_t _reclaim_mutex;
+    // Blocks hidden from address_resource(), in the order of being found.
+    std::vector<IdleBlock> _idle_blocks;
+    // Blocks whose objects are destructed and pages are returned.
+    std::vector<IdleBlock> _reclaimed_blocks;
+    butil::atomic<size_t> _nidle_block;
+    butil::atomic<size_t> _nreclaimed_block;
 
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
     static butil::static_atomic<size_t> _global_nfree;
@@ -586,6 +837,9 @@ template <typename T>
 butil::static_atomic<typename ResourcePool<T>::BlockGroup*>
 ResourcePool<T>::_block_groups[RP_MAX_BLOCK_NGROUP] = {};
 
+template <typename T>
+butil::static_atomic<size_t> ResourcePool<T>::_numa_nblock[MAX_NUMA_NODE_NUM] = {};
+
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
 template <typename T>
 butil::static_atomic<size_t> ResourcePool<T>::_global_nfree = BUTIL_STATIC_ATOMIC_INIT(0);
@@ -610,13 +864,21 @@ bool operator!=(ResourceId<T1> id1, ResourceId<T2> id2);
 
 inline std::ostream& operator<<(std::ostream& os,
                                 ResourcePoolInfo const& info) {
-    return os << "local_pool_num: " << info.local_pool_num
+    os << "local_pool_num: " << info.local_pool_num
               << "\nblock_group_num: " << info.block_group_num
               << "\nblock_num: " << info.block_num
               << "\nitem_num: " << info.item_num
               << "\nblock_item_num: " << info.block_item_num
               << "\nfree_chunk_item_num: " << info.free_chunk_item_num
-              << "\ntotal_size: " << info.total_size;
+              << "\ntotal_size: " << info.total_size
+              << "\nnuma_node_num: " << info.numa_node_num
+              << "\nnuma_block_num:";
+    for (size_t i = 0; i < info.numa_node_num; ++i) {
+        os << ' ' << info.numa_block_num[i];
+    }
+    return os << "\nremote_free_chunk_num: " << info.remote_free_chunk_num
+              << "\nidle_block_num: " << info.idle_block_num
+              << "\nreclaimed_block_num: " << info.reclaimed_block_num
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
               << "\nfree_num: " << info.free_item_num
 #endif
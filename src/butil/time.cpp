@@ -26,6 +26,10 @@
 #include <string.h>                          // memmem
 #undef _GNU_SOURCE
 
+#include <pthread.h>                         // pthread_once
+#include <stdlib.h>                          // abs
+#include <algorithm>                         // std::max
+#include "butil/atomicops.h"
 #include "butil/time.h"
 
 #if defined(NO_CLOCK_GETTIME_IN_MAC)
@@ -140,17 +144,108 @@ int64_t read_cpu_frequency(bool* invariant_tsc) {
     return result;
 }
 
-// Return value must be >= 0
-int64_t read_invariant_cpu_frequency() {
+static bool has_invariant_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0x80000000;
+    unsigned int ebx = 0;
+    unsigned int ecx = 0;
+    unsigned int edx = 0;
+    __asm__ __volatile__ ("cpuid"
+                          : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (eax >= 0x80000007) {
+        eax = 0x80000007;
+        __asm__ __volatile__ ("cpuid"
+                              : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+        if (edx & (1 << 8)) {
+            return true;
+        }
+    }
+    // Hypervisors may hide the CPUID bit while the kernel knows better.
     bool invariant_tsc = false;
-    const int64_t freq = read_cpu_frequency(&invariant_tsc);
-    if (!invariant_tsc || freq < 0) {
+    read_cpu_frequency(&invariant_tsc);
+    return invariant_tsc;
+#elif defined(__aarch64__)
+    // The generic timer ticks at a constant frequency by architecture.
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Count clock_cycles() during `duration_ns' of CLOCK_MONOTONIC.
+static int64_t calibrate_cpu_frequency(int64_t duration_ns) {
+    const int64_t start_ns = monotonic_time_ns();
+    const uint64_t start_cycles = clock_cycles();
+    int64_t end_ns = 0;
+    uint64_t end_cycles = 0;
+    do {
+        end_ns = monotonic_time_ns();
+        end_cycles = clock_cycles();
+    } while (end_ns - start_ns < duration_ns);
+    if (end_cycles <= start_cycles) {
         return 0;
     }
-    return freq;
+    return (int64_t)((double)(end_cycles - start_cycles) * 1000000000.0 /
+                     (end_ns - start_ns));
+}
+
+static int64_t s_invariant_cpu_freq = 0;
+static pthread_once_t s_read_cpu_freq_once = PTHREAD_ONCE_INIT;
+
+static void read_invariant_cpu_frequency_once() {
+    if (!has_invariant_counter()) {
+        return;
+    }
+    // Calibrate twice and give up if the results differ by more than 0.1%,
+    // which means the counter is not stable(e.g. migrated VMs).
+    const int64_t freq1 = calibrate_cpu_frequency(2000000L);
+    const int64_t freq2 = calibrate_cpu_frequency(2000000L);
+    if (freq1 <= 0 || freq2 <= 0 ||
+        std::abs(freq1 - freq2) * 1000 > std::max(freq1, freq2)) {
+        return;
+    }
+    s_invariant_cpu_freq = (freq1 + freq2) / 2;
+    nanoseconds_per_cycle_q32 =
+        (uint64_t)((1000000000.0 * 4294967296.0) / s_invariant_cpu_freq);
+}
+
+// Return value must be >= 0
+int64_t read_invariant_cpu_frequency() {
+    pthread_once(&s_read_cpu_freq_once, read_invariant_cpu_frequency_once);
+    return s_invariant_cpu_freq;
 }
 
 int64_t invariant_cpu_freq = -1;
+uint64_t nanoseconds_per_cycle_q32 = 0;
 }  // namespace detail
 
+// gettimeofday_us() - cpuwide_time_us() at the last sync.
+static butil::static_atomic<int64_t> s_realtime_offset_us =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+static butil::static_atomic<int64_t> s_realtime_sync_us =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+static butil::static_atomic<bool> s_realtime_syncing =
+    BUTIL_STATIC_ATOMIC_INIT(false);
+
+int64_t fast_realtime_us() {
+    const int64_t now_us = cpuwide_time_us();
+    if (detail::invariant_cpu_freq <= 0) {
+        return gettimeofday_us();
+    }
+    const int64_t sync_us = s_realtime_sync_us.load(butil::memory_order_acquire);
+    if ((now_us - sync_us >= 1000000L || sync_us == 0) &&
+        !s_realtime_syncing.exchange(true, butil::memory_order_acquire)) {
+        const int64_t offset_us = gettimeofday_us() - cpuwide_time_us();
+        s_realtime_offset_us.store(offset_us, butil::memory_order_relaxed);
+        s_realtime_sync_us.store(now_us, butil::memory_order_release);
+        s_realtime_syncing.store(false, butil::memory_order_release);
+        return now_us + offset_us;
+    }
+    if (sync_us == 0) {
+        // Another thread is syncing for the first time.
+        return gettimeofday_us();
+    }
+    return now_us + s_realtime_offset_us.load(butil::memory_order_relaxed);
+}
+
 }  // namespace butil
@@ -16,6 +16,7 @@
 // Date: Mon Dec 14 19:12:30 CST 2015
 
 #include <map>
+#include <algorithm>                       // std::stable_sort
 #include <gflags/gflags.h>
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "bvar/bvar.h"
@@ -29,7 +30,8 @@ DEFINE_int32(bvar_collector_max_pending_samples, 1000,
              "Destroy unprocessed samples when they're too many");
 
 DEFINE_int32(bvar_collector_expected_per_second, 1000,
-             "Expected number of samples to be collected per second");
+             "Expected number of samples to be collected per second, for "
+             "types of samples without their own budgets");
 
 // CAUTION: Don't change this value unless you know exactly what it means.
 static const int64_t COLLECTOR_GRAB_INTERVAL_US = 100000L; // 100ms
@@ -87,6 +89,8 @@ private:
         Collector* d = static_cast<Collector*>(arg);
         return d->_ngrab - d->_ndump - d->_ndrop;
     }
+
+    static int64_t get_dropped_count(void* arg);
     
 private:
     // periodically modified by grab_thread, accessed by every submit.
@@ -148,6 +152,33 @@ static T deref_value(void* arg) {
 // for limiting samples returning NULL in speed_limit()
 static CollectorSpeedLimit g_null_speed_limit = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
 
+// Samples destroyed in submit() because grab_thread is not running in time.
+static butil::static_atomic<int64_t> g_nlate_samples = BUTIL_STATIC_ATOMIC_INIT(0);
+
+int64_t Collector::get_dropped_count(void* arg) {
+    Collector* d = static_cast<Collector*>(arg);
+    return d->_ndrop + g_nlate_samples.load(butil::memory_order_relaxed);
+}
+
+inline CollectorSpeedLimit* get_speed_limit(Collected* c) {
+    CollectorSpeedLimit* sl = c->speed_limit();
+    return (sl ? sl : &g_null_speed_limit);
+}
+
+inline int64_t get_expected_per_second(const CollectorSpeedLimit* sl) {
+    if (sl->expected_per_second && *sl->expected_per_second > 0) {
+        return *sl->expected_per_second;
+    }
+    return FLAGS_bvar_collector_expected_per_second;
+}
+
+// Samples with higher priority go first.
+struct HigherPriority {
+    bool operator()(Collected* c1, Collected* c2) const {
+        return get_speed_limit(c1)->priority > get_speed_limit(c2)->priority;
+    }
+};
+
 void Collector::grab_thread() {
     _last_active_cpuwide_us = butil::cpuwide_time_us();
     int64_t last_before_update_sl = _last_active_cpuwide_us;
@@ -170,6 +201,9 @@ void Collector::grab_thread() {
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > ngrab_second(
         "bvar_collector_grab_second", &ngrab_var);
 
+    bvar::PassiveStatus<int64_t> ndropped_var(
+        "bvar_collector_dropped_samples", get_dropped_count, this);
+
     // Maps for calculating speed limit.
     typedef std::map<CollectorSpeedLimit*, size_t> GrapMap;
     GrapMap last_ngrab_map;
@@ -178,6 +212,8 @@ void Collector::grab_thread() {
     typedef std::map<CollectorPreprocessor*, std::vector<Collected*> >
         PreprocessorMap;
     PreprocessorMap prep_map;
+    // Samples grabbed in one round.
+    std::vector<Collected*> grabbed;
 
     // The main loop.
     while (!_stop) {
@@ -205,7 +241,7 @@ void Collector::grab_thread() {
                 p = saved_next;
             }
             // Iterate prep_map
-            butil::LinkNode<Collected> root;
+            grabbed.clear();
             for (PreprocessorMap::iterator it = prep_map.begin();
                  it != prep_map.end(); ++it) {
                 std::vector<Collected*> & list = it->second;
@@ -217,24 +253,33 @@ void Collector::grab_thread() {
                     it->first->process(list);
                 }
                 for (size_t i = 0; i < list.size(); ++i) {
-                    Collected* p = list[i];
-                    CollectorSpeedLimit* speed_limit = p->speed_limit();
-                    if (speed_limit == NULL) {
-                        ++ngrab_map[&g_null_speed_limit];
-                    } else {
-                        // Add up the samples of certain type.
-                        ++ngrab_map[speed_limit];
-                    }
-                    // Drop samples if dump_thread is too busy.
-                    // FIXME: equal probabilities to drop.
-                    ++_ngrab;
-                    if (_ngrab >= _ndrop + _ndump +
-                        FLAGS_bvar_collector_max_pending_samples) {
-                        ++_ndrop;
-                        p->destroy();
-                    } else {
-                        p->InsertBefore(&root);
-                    }
+                    // Add up the samples of certain type.
+                    ++ngrab_map[get_speed_limit(list[i])];
+                }
+                grabbed.insert(grabbed.end(), list.begin(), list.end());
+            }
+            // Drop samples if dump_thread is too busy, samples with lower
+            // priority are dropped first.
+            const int64_t npending = _ngrab - _ndrop - _ndump;
+            const size_t nkept = (size_t)std::max(std::min(
+                    (int64_t)FLAGS_bvar_collector_max_pending_samples - npending,
+                    (int64_t)grabbed.size()), (int64_t)0);
+            if (nkept < grabbed.size()) {
+                // Stable to keep the order given by preprocessors.
+                std::stable_sort(grabbed.begin(), grabbed.end(),
+                                 HigherPriority());
+            }
+            _ngrab += grabbed.size();
+            butil::LinkNode<Collected> root;
+            for (size_t i = 0; i < grabbed.size(); ++i) {
+                Collected* p = grabbed[i];
+                if (i >= nkept) {
+                    ++_ndrop;
+                    get_speed_limit(p)->ndropped.fetch_add(
+                        1, butil::memory_order_relaxed);
+                    p->destroy();
+                } else {
+                    p->InsertBefore(&root);
                 }
             }
             // Give the samples to dump_thread
@@ -310,11 +355,11 @@ void Collector::update_speed_limit(CollectorSpeedLimit* sl,
             // use the default interval which may make the calculated
             // sampling_range larger.
         }
-        new_sampling_range = FLAGS_bvar_collector_expected_per_second
+        new_sampling_range = get_expected_per_second(sl)
             * interval_us * COLLECTOR_SAMPLING_BASE / (1000000L * round_ngrab);
     } else {
         // NOTE: the multiplications are unlikely to overflow.
-        new_sampling_range = FLAGS_bvar_collector_expected_per_second
+        new_sampling_range = get_expected_per_second(sl)
             * interval_us * old_sampling_range / (1000000L * round_ngrab);
         // Don't grow or shrink too fast.
         if (interval_us < 1000000L) {
@@ -346,7 +391,7 @@ size_t is_collectable_before_first_time_grabbed(CollectorSpeedLimit* sl) {
             1, butil::memory_order_relaxed);
         if (before_add == 0) {
             sl->first_sample_real_us = butil::gettimeofday_us();
-        } else if (before_add >= FLAGS_bvar_collector_expected_per_second) {
+        } else if (before_add >= get_expected_per_second(sl)) {
             butil::get_leaky_singleton<Collector>()->wakeup_grab_thread();
         }
     }
@@ -415,6 +460,8 @@ void Collected::submit(int64_t cpuwide_us) {
     if (cpuwide_us < d->last_active_cpuwide_us() + COLLECTOR_GRAB_INTERVAL_US * 2) {
         *d << this;
     } else {
+        g_nlate_samples.fetch_add(1, butil::memory_order_relaxed);
+        get_speed_limit(this)->ndropped.fetch_add(1, butil::memory_order_relaxed);
         destroy();
     }
 }
@@ -429,4 +476,14 @@ DisplaySamplingRatio::DisplaySamplingRatio(const char* name,
     : _var(name, get_sampling_ratio, (void*)sl) {
 }
 
+static int64_t get_dropped_samples(void* arg) {
+    return ((CollectorSpeedLimit*)arg)->ndropped.load(
+        butil::memory_order_relaxed);
+}
+
+DisplayDroppedSamples::DisplayDroppedSamples(const char* name,
+                                             const CollectorSpeedLimit* sl)
+    : _var(name, get_dropped_samples, (void*)sl) {
+}
+
 }  // namespace bvar
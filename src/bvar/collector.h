@@ -33,12 +33,34 @@ struct CollectorSpeedLimit {
     bool ever_grabbed;
     butil::static_atomic<int> count_before_grabbed;
     int64_t first_sample_real_us;
+    // Number of samples destroyed without being dumped.
+    butil::static_atomic<int64_t> ndropped;
+
+    // [Set by BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH]
+    // Points to the expected number of samples collected per second, generally
+    // a gflag. -bvar_collector_expected_per_second is used when this field
+    // is NULL or the pointed value is not positive.
+    const int32_t* expected_per_second;
+    // When samples are too many to be dumped in time, samples with lower
+    // priority are dropped first.
+    int priority;
 };
 
 static const size_t COLLECTOR_SAMPLING_BASE = 16384;
 
 #define BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER                          \
-    { ::bvar::COLLECTOR_SAMPLING_BASE, false, BUTIL_STATIC_ATOMIC_INIT(0), 0 }
+    BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH(NULL, 0)
+
+// Samples of the speed limit have their own budget pointed by
+// `expected_per_second_ptr' and are dropped according to `priority'.
+// Example:
+//   DEFINE_int32(foo_samples_per_second, 100, "...");
+//   static bvar::CollectorSpeedLimit g_foo_sl =
+//       BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH(&FLAGS_foo_samples_per_second, 1);
+#define BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH(expected_per_second_ptr, \
+                                                    priority)           \
+    { ::bvar::COLLECTOR_SAMPLING_BASE, false, BUTIL_STATIC_ATOMIC_INIT(0), 0, \
+      BUTIL_STATIC_ATOMIC_INIT(0), (expected_per_second_ptr), (priority) }
 
 class Collected;
 
@@ -87,6 +109,8 @@ public:
     // Returns an object to control #samples collected per second.
     // If NULL is returned, samples collected per second is limited by a
     // global speed limit shared with other samples also returning NULL.
+    // Each CollectorSpeedLimit is adjusted separately to collect its
+    // expected_per_second samples per second.
     // All instances of a subclass of Collected should return a same instance
     // of CollectorSpeedLimit. The instance should remain valid during lifetime
     // of program.
@@ -116,8 +140,8 @@ inline size_t is_collectable(CollectorSpeedLimit* speed_limit) {
         }
         return sampling_range;
     }
-    // Slower, only runs before -bvar_collector_expected_per_second samples are
-    // collected to calculate a more reasonable sampling_range for the type.
+    // Slower, only runs before expected_per_second samples are collected to
+    // calculate a more reasonable sampling_range for the type.
     extern size_t is_collectable_before_first_time_grabbed(CollectorSpeedLimit*);
     return is_collectable_before_first_time_grabbed(speed_limit);
 }
@@ -130,6 +154,15 @@ private:
     bvar::PassiveStatus<double> _var;
 };
 
+// An utility for displaying number of samples dropped by Collector due to
+// slow dumping or late submission.
+class DisplayDroppedSamples {
+public:
+    DisplayDroppedSamples(const char* name, const CollectorSpeedLimit*);
+private:
+    bvar::PassiveStatus<int64_t> _var;
+};
+
 }  // namespace bvar
 
 #endif  // BVAR_COLLECTOR_H
@@ -0,0 +1,268 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/object_pool.h"
+#include "bvar/detail/compressed_series.h"
+
+namespace bvar {
+
+DEFINE_bool(bvar_compress_series, false, "Save series of numeric bvars in "
+            "compressed chunks, which keeps longer history(specified by "
+            "-bvar_compressed_series_*) with less memory. Only affects bvars "
+            "exposed after setting this flag");
+DEFINE_int32(bvar_compressed_series_seconds, 600,
+             "Number of per-second values kept in a compressed series");
+DEFINE_int32(bvar_compressed_series_minutes, 360,
+             "Number of per-minute values kept in a compressed series");
+DEFINE_int32(bvar_compressed_series_hours, 168,
+             "Number of per-hour values kept in a compressed series");
+DEFINE_int32(bvar_compressed_series_days, 90,
+             "Number of per-day values kept in a compressed series");
+
+static bool validate_retention(const char*, int32_t v) {
+    return v > 0;
+}
+const bool ALLOW_UNUSED dummy_bvar_compressed_series_seconds =
+    ::GFLAGS_NS::RegisterFlagValidator(
+        &FLAGS_bvar_compressed_series_seconds, validate_retention);
+const bool ALLOW_UNUSED dummy_bvar_compressed_series_minutes =
+    ::GFLAGS_NS::RegisterFlagValidator(
+        &FLAGS_bvar_compressed_series_minutes, validate_retention);
+const bool ALLOW_UNUSED dummy_bvar_compressed_series_hours =
+    ::GFLAGS_NS::RegisterFlagValidator(
+        &FLAGS_bvar_compressed_series_hours, validate_retention);
+const bool ALLOW_UNUSED dummy_bvar_compressed_series_days =
+    ::GFLAGS_NS::RegisterFlagValidator(
+        &FLAGS_bvar_compressed_series_days, validate_retention);
+
+namespace detail {
+
+// 64 bytes including the header.
+struct SeriesChunk {
+    static const uint32_t NWORD = 6;
+    static const uint32_t NBIT = NWORD * 64;
+
+    SeriesChunk* next;
+    uint16_t npoints;
+    uint16_t nbits;
+    uint64_t words[NWORD];
+};
+
+// An encoded value never exceeds so many bits.
+static const uint32_t MAX_BITS_PER_VALUE = 80;
+// _leading of CompressedStream before any XOR window is recorded.
+static const uint8_t INVALID_LEADING = 0xFF;
+
+inline uint64_t low_bits(uint64_t v, uint32_t n) {
+    return (n >= 64 ? v : (v & ((1UL << n) - 1)));
+}
+
+// Write lowest `n'(1-64) bits of `v' into `c', higher bits go first.
+static void write_bits(SeriesChunk* c, uint64_t v, uint32_t n) {
+    v = low_bits(v, n);
+    const uint32_t w = c->nbits / 64;
+    const uint32_t space = 64 - c->nbits % 64;
+    if (n <= space) {
+        c->words[w] |= (v << (space - n));
+    } else {
+        c->words[w] |= (v >> (n - space));
+        c->words[w + 1] |= (v << (64 - (n - space)));
+    }
+    c->nbits += n;
+}
+
+class ChunkReader {
+public:
+    explicit ChunkReader(const SeriesChunk* c) : _c(c), _pos(0) {}
+
+    uint64_t read(uint32_t n) {
+        const uint32_t w = _pos / 64;
+        const uint32_t space = 64 - _pos % 64;
+        uint64_t v;
+        if (n <= space) {
+            v = low_bits(_c->words[w] >> (space - n), n);
+        } else {
+            v = (low_bits(_c->words[w], space) << (n - space)) |
+                (_c->words[w + 1] >> (64 - (n - space)));
+        }
+        _pos += n;
+        return v;
+    }
+
+    // Number of leading 1 bits before a 0 bit, at most `max'.
+    uint32_t read_ones(uint32_t max) {
+        uint32_t n = 0;
+        while (n < max && read(1)) {
+            ++n;
+        }
+        return n;
+    }
+
+private:
+    const SeriesChunk* _c;
+    uint32_t _pos;
+};
+
+// Widths of zigzag-encoded delta-of-delta prefixed by 1-5 '1' bits.
+static const uint32_t DOD_WIDTHS[] = { 7, 9, 12, 32, 64 };
+
+CompressedStream::CompressedStream(bool floating, size_t retention)
+    : _floating(floating)
+    , _leading(INVALID_LEADING)
+    , _trailing(0)
+    , _retention(retention)
+    , _npoints(0)
+    , _head(NULL)
+    , _tail(NULL)
+    , _prev(0)
+    , _prev_delta(0) {
+}
+
+CompressedStream::~CompressedStream() {
+    while (_head) {
+        SeriesChunk* next = _head->next;
+        butil::return_object(_head);
+        _head = next;
+    }
+    _tail = NULL;
+}
+
+void CompressedStream::append(uint64_t bits) {
+    if (_tail == NULL || SeriesChunk::NBIT - _tail->nbits < MAX_BITS_PER_VALUE) {
+        SeriesChunk* c = butil::get_object<SeriesChunk>();
+        if (c == NULL) {
+            LOG_EVERY_SECOND(ERROR) << "Fail to allocate SeriesChunk";
+            return;
+        }
+        // Objects from ObjectPool are not cleared.
+        memset(c, 0, sizeof(*c));
+        if (_tail) {
+            _tail->next = c;
+        } else {
+            _head = c;
+        }
+        _tail = c;
+        // First value of a chunk is not compressed.
+        write_bits(c, bits, 64);
+        _prev_delta = 0;
+        _leading = INVALID_LEADING;
+        _trailing = 0;
+    } else if (!_floating) {
+        const uint64_t delta = bits - _prev;
+        const int64_t dod = (int64_t)(delta - _prev_delta);
+        const uint64_t zz = ((uint64_t)dod << 1) ^ (uint64_t)(dod >> 63);
+        if (zz == 0) {
+            write_bits(_tail, 0, 1);
+        } else {
+            size_t i = 0;
+            for (; i + 1 < ARRAY_SIZE(DOD_WIDTHS) &&
+                     (zz >> DOD_WIDTHS[i]) != 0; ++i) {}
+            // i+1 '1' followed by a '0' unless it's the widest.
+            const uint32_t nprefix = (i + 1 < ARRAY_SIZE(DOD_WIDTHS) ?
+                                      i + 2 : i + 1);
+            write_bits(_tail, ((1UL << (i + 1)) - 1) << (nprefix - i - 1),
+                       nprefix);
+            write_bits(_tail, zz, DOD_WIDTHS[i]);
+        }
+        _prev_delta = delta;
+    } else {
+        const uint64_t x = bits ^ _prev;
+        if (x == 0) {
+            write_bits(_tail, 0, 1);
+        } else {
+            uint32_t leading = __builtin_clzll(x);
+            if (leading > 31) {
+                leading = 31;
+            }
+            const uint32_t trailing = __builtin_ctzll(x);
+            if (_leading != INVALID_LEADING &&
+                leading >= _leading && trailing >= _trailing) {
+                // Meaningful bits fit in the previous window.
+                write_bits(_tail, 2/*10*/, 2);
+                write_bits(_tail, x >> _trailing, 64 - _leading - _trailing);
+            } else {
+                const uint32_t meaningful = 64 - leading - trailing;
+                write_bits(_tail, 3/*11*/, 2);
+                write_bits(_tail, leading, 5);
+                write_bits(_tail, meaningful - 1, 6);
+                write_bits(_tail, x >> trailing, meaningful);
+                _leading = leading;
+                _trailing = trailing;
+            }
+        }
+    }
+    _prev = bits;
+    ++_tail->npoints;
+    ++_npoints;
+    while (_head != _tail && _npoints - _head->npoints >= _retention) {
+        SeriesChunk* next = _head->next;
+        _npoints -= _head->npoints;
+        butil::return_object(_head);
+        _head = next;
+    }
+}
+
+void CompressedStream::get_values(std::vector<uint64_t>* out) const {
+    out->clear();
+    out->reserve(size());
+    size_t nskip = _npoints - size();
+    for (const SeriesChunk* c = _head; c != NULL; c = c->next) {
+        if (nskip >= c->npoints) {
+            nskip -= c->npoints;
+            continue;
+        }
+        ChunkReader reader(c);
+        uint64_t value = reader.read(64);
+        uint64_t delta = 0;
+        uint32_t leading = 0;
+        uint32_t trailing = 0;
+        for (uint32_t i = 0; i < c->npoints; ++i) {
+            if (i != 0) {
+                if (!_floating) {
+                    const uint32_t nones = reader.read_ones(
+                        ARRAY_SIZE(DOD_WIDTHS));
+                    if (nones != 0) {
+                        const uint64_t zz = reader.read(DOD_WIDTHS[nones - 1]);
+                        delta += (zz >> 1) ^ (-(zz & 1));
+                    }
+                    value += delta;
+                } else if (reader.read(1)) {
+                    if (reader.read(1)) {
+                        leading = reader.read(5);
+                        trailing = 64 - leading - (reader.read(6) + 1);
+                    }
+                    value ^= (reader.read(64 - leading - trailing) << trailing);
+                }
+            }
+            if (nskip) {
+                --nskip;
+            } else {
+                out->push_back(value);
+            }
+        }
+    }
+}
+
+size_t CompressedStream::chunk_bytes() const {
+    size_t n = 0;
+    for (const SeriesChunk* c = _head; c != NULL; c = c->next) {
+        n += sizeof(*c);
+    }
+    return n;
+}
+
+}  // namespace detail
+}  // namespace bvar
@@ -0,0 +1,287 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BVAR_DETAIL_COMPRESSED_SERIES_H
+#define  BVAR_DETAIL_COMPRESSED_SERIES_H
+
+#include <string.h>                      // memcpy
+#include <stdint.h>
+#include <vector>
+#include <algorithm>                     // std::min
+#include <ostream>
+#include <gflags/gflags_declare.h>
+#include "butil/macros.h"
+#include "butil/scoped_lock.h"           // BAIDU_SCOPED_LOCK
+#include "butil/type_traits.h"
+#include "bvar/variable.h"               // SeriesOptions
+#include "bvar/detail/series.h"
+
+namespace bvar {
+
+DECLARE_bool(bvar_compress_series);
+DECLARE_int32(bvar_compressed_series_seconds);
+DECLARE_int32(bvar_compressed_series_minutes);
+DECLARE_int32(bvar_compressed_series_hours);
+DECLARE_int32(bvar_compressed_series_days);
+
+namespace detail {
+
+struct SeriesChunk;
+
+// Append-only stream of 64-bit values compressed in the way of Gorilla:
+//   - integers are encoded as delta-of-delta, a steadily increasing counter
+//     costs 1 bit per value.
+//   - floating points are encoded as XOR with previous value, an unchanged
+//     value costs 1 bit, a slightly changed value costs some meaningful bits.
+// Values are put in fixed-size chunks allocated from a shared ObjectPool,
+// each chunk starts with an uncompressed value so that the oldest chunk can
+// be dropped without touching others. At least `retention' latest values
+// are kept.
+// This class is not thread-safe.
+class CompressedStream {
+public:
+    CompressedStream(bool floating, size_t retention);
+    ~CompressedStream();
+
+    // Append raw bits of a value, integers are casted to int64_t, floating
+    // points are casted to double.
+    void append(uint64_t bits);
+
+    // Number of latest values(at most `retention') that can be retrieved.
+    size_t size() const { return std::min(_npoints, _retention); }
+
+    // Put latest size() values into `out' in the order of appending.
+    void get_values(std::vector<uint64_t>* out) const;
+
+    // Memory used by chunks.
+    size_t chunk_bytes() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CompressedStream);
+
+    bool _floating;
+    uint8_t _leading;
+    uint8_t _trailing;
+    size_t _retention;
+    size_t _npoints;
+    SeriesChunk* _head;
+    SeriesChunk* _tail;
+    uint64_t _prev;
+    uint64_t _prev_delta;
+};
+
+template <typename T, typename Enabler = void>
+struct SeriesBits {
+    static uint64_t to_bits(const T& v) { return (uint64_t)(int64_t)v; }
+    static T from_bits(uint64_t bits) { return (T)(int64_t)bits; }
+};
+
+template <typename T>
+struct SeriesBits<T, typename butil::enable_if<
+                         butil::is_floating_point<T>::value>::type> {
+    static uint64_t to_bits(const T& v) {
+        const double d = v;
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return bits;
+    }
+    static T from_bits(uint64_t bits) {
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        return (T)d;
+    }
+};
+
+// Same levels as Series: values of seconds are averaged(when Op is
+// addition) into minutes, minutes into hours, hours into days. Each level
+// retains values for a configurable length which is often much longer than
+// the 60s/60m/24h/30d of Series, with less memory for most variables.
+// T must be an integral or floating point.
+template <typename T, typename Op>
+class CompressedSeries {
+public:
+    explicit CompressedSeries(const Op& op);
+    ~CompressedSeries() {
+        for (int i = 0; i < NLEVEL; ++i) {
+            delete _levels[i];
+        }
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    void append(const T& value) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        append_level(0, value);
+    }
+
+    // Print in the same layout of Series::describe() which has last 30 days,
+    // 24 hours, 60 minutes and 60 seconds, or all retained values when
+    // `options.fixed_length' is false.
+    void describe(std::ostream& os, const SeriesOptions& options) const;
+
+    size_t chunk_bytes() const {
+        BAIDU_SCOPED_LOCK(_mutex);
+        size_t n = 0;
+        for (int i = 0; i < NLEVEL; ++i) {
+            n += _levels[i]->chunk_bytes();
+        }
+        return n;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CompressedSeries);
+
+    static const int NLEVEL = 4;
+
+    void append_level(int level, const T& value);
+
+    Op _op;
+    mutable pthread_mutex_t _mutex;
+    CompressedStream* _levels[NLEVEL];
+    // Combined values to be appended into the next level.
+    T _acc[NLEVEL - 1];
+    int _nacc[NLEVEL - 1];
+};
+
+// Number of values in a level to be combined into next level, and the
+// fixed length of each level in describe().
+static const int SERIES_LEVEL_SPAN[] = { 60, 60, 24 };
+static const int SERIES_LEVEL_FIXED_LENGTH[] = { 60, 60, 24, 30 };
+
+template <typename T, typename Op>
+CompressedSeries<T, Op>::CompressedSeries(const Op& op) : _op(op) {
+    pthread_mutex_init(&_mutex, NULL);
+    const bool floating = butil::is_floating_point<T>::value;
+    _levels[0] = new CompressedStream(floating, FLAGS_bvar_compressed_series_seconds);
+    _levels[1] = new CompressedStream(floating, FLAGS_bvar_compressed_series_minutes);
+    _levels[2] = new CompressedStream(floating, FLAGS_bvar_compressed_series_hours);
+    _levels[3] = new CompressedStream(floating, FLAGS_bvar_compressed_series_days);
+    for (int i = 0; i < NLEVEL - 1; ++i) {
+        _acc[i] = T();
+        _nacc[i] = 0;
+    }
+}
+
+template <typename T, typename Op>
+void CompressedSeries<T, Op>::append_level(int level, const T& value) {
+    _levels[level]->append(SeriesBits<T>::to_bits(value));
+    if (level + 1 >= NLEVEL) {
+        return;
+    }
+    if (_nacc[level] == 0) {
+        _acc[level] = value;
+    } else {
+        call_op_returning_void(_op, _acc[level], value);
+    }
+    if (++_nacc[level] >= SERIES_LEVEL_SPAN[level]) {
+        T tmp = _acc[level];
+        DivideOnAddition<T, Op>::inplace_divide(tmp, _op, _nacc[level]);
+        _nacc[level] = 0;
+        append_level(level + 1, tmp);
+    }
+}
+
+template <typename T, typename Op>
+void CompressedSeries<T, Op>::describe(std::ostream& os,
+                                       const SeriesOptions& options) const {
+    std::vector<uint64_t> values[NLEVEL];
+    pthread_mutex_lock(&_mutex);
+    for (int i = 0; i < NLEVEL; ++i) {
+        _levels[i]->get_values(&values[i]);
+    }
+    pthread_mutex_unlock(&_mutex);
+    int c = 0;
+    os << "{\"label\":\"trend\",\"data\":[";
+    // From days to seconds.
+    for (int i = NLEVEL - 1; i >= 0; --i) {
+        const std::vector<uint64_t>& v = values[i];
+        size_t begin = 0;
+        if (options.fixed_length) {
+            // Missing values are zeros, as in Series.
+            const size_t len = SERIES_LEVEL_FIXED_LENGTH[i];
+            for (size_t j = v.size(); j < len; ++j, ++c) {
+                if (c) {
+                    os << ',';
+                }
+                os << '[' << c << ',' << T() << ']';
+            }
+            if (v.size() > len) {
+                begin = v.size() - len;
+            }
+        }
+        for (size_t j = begin; j < v.size(); ++j, ++c) {
+            if (c) {
+                os << ',';
+            }
+            os << '[' << c << ',' << SeriesBits<T>::from_bits(v[j]) << ']';
+        }
+    }
+    os << "]}";
+}
+
+// Save values in Series, or CompressedSeries when -bvar_compress_series is
+// on and T is a number.
+template <typename T, typename Op, typename Enabler = void>
+class SeriesStore {
+public:
+    explicit SeriesStore(const Op& op) : _series(op) {}
+    void append(const T& value) { _series.append(value); }
+    void describe(std::ostream& os, const std::string* vector_names,
+                  const SeriesOptions&) const {
+        _series.describe(os, vector_names);
+    }
+private:
+    Series<T, Op> _series;
+};
+
+template <typename T, typename Op>
+class SeriesStore<T, Op, typename butil::enable_if<
+                             butil::is_integral<T>::value ||
+                             butil::is_floating_point<T>::value>::type> {
+public:
+    explicit SeriesStore(const Op& op) : _series(NULL), _compressed(NULL) {
+        if (FLAGS_bvar_compress_series) {
+            _compressed = new CompressedSeries<T, Op>(op);
+        } else {
+            _series = new Series<T, Op>(op);
+        }
+    }
+    ~SeriesStore() {
+        delete _series;
+        delete _compressed;
+    }
+    void append(const T& value) {
+        if (_compressed) {
+            _compressed->append(value);
+        } else {
+            _series->append(value);
+        }
+    }
+    void describe(std::ostream& os, const std::string* vector_names,
+                  const SeriesOptions& options) const {
+        if (_compressed) {
+            _compressed->describe(os, options);
+        } else {
+            _series->describe(os, vector_names);
+        }
+    }
+private:
+    DISALLOW_COPY_AND_ASSIGN(SeriesStore);
+    Series<T, Op>* _series;
+    CompressedSeries<T, Op>* _compressed;
+};
+
+}  // namespace detail
+}  // namespace bvar
+
+#endif  // BVAR_DETAIL_COMPRESSED_SERIES_H
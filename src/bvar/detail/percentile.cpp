@@ -46,7 +46,7 @@ inline uint32_t log2(uint32_t x) {
     return(ones32(x) - 1 - y);
 }
 
-inline size_t get_interval_index(int64_t &x) {
+size_t get_interval_index(int64_t &x) {
     if (x <= 2) {
         return 0;
     } else if (x > std::numeric_limits<uint32_t>::max()) {
@@ -57,33 +57,8 @@ inline size_t get_interval_index(int64_t &x) {
     }
 }
 
-class AddLatency {
-public:
-    AddLatency(int64_t latency) : _latency(latency) {}
-    
-    void operator()(GlobalValue<Percentile::combiner_type>& global_value,
-                    ThreadLocalPercentileSamples& local_value) const {
-        // Copy to latency since get_interval_index may change input.
-        int64_t latency = _latency;
-        const size_t index = get_interval_index(latency);
-        PercentileInterval<ThreadLocalPercentileSamples::SAMPLE_SIZE>&
-            interval = local_value.get_interval_at(index);
-        if (interval.full()) {
-            GlobalPercentileSamples* g = global_value.lock();
-            g->get_interval_at(index).merge(interval);
-            g->_num_added += interval.added_count();
-            global_value.unlock();
-            local_value._num_added -= interval.added_count();
-            interval.clear();
-        }
-        interval.add64(latency);
-        ++local_value._num_added;
-    }
-private:
-    int64_t _latency;
-};
-
-Percentile::Percentile() : _combiner(NULL), _sampler(NULL) {
+Percentile::Percentile()
+    : _combiner(NULL), _sampler(NULL), _sketch_mode(false) {
     _combiner = new combiner_type;
 }
 
@@ -124,7 +99,7 @@ Percentile &Percentile::operator<<(int64_t latency) {
         }
         return *this;
     }
-    agent->merge_global(AddLatency(latency));
+    agent->merge_global(AddLatency(latency, _sketch_mode));
     return *this;
 }
 
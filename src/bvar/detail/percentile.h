@@ -230,6 +230,176 @@ template <size_t size2> friend class PercentileInterval;
 
 static const size_t NUM_INTERVALS = 32;
 
+// Counters of latencies in log-linear buckets: latencies are grouped by
+// their highest bit and each group is divided into NUM_SUB_BUCKETS linear
+// buckets. Unlike PercentileInterval, no latency is dropped and merging
+// two sketches just adds counters, so that long-tail percentiles like
+// 99.99% are as stable as the median. Returned values are centers of
+// buckets whose relative error is at most 1/(2*NUM_SUB_BUCKETS).
+// Groups are allocated on demand, latencies of a service usually fall
+// into a few groups.
+class PercentileSketch {
+public:
+    static const uint32_t SUB_BUCKET_BITS = 6;
+    static const uint32_t NUM_SUB_BUCKETS = (1u << SUB_BUCKET_BITS);
+    // Group 0 stores [0, NUM_SUB_BUCKETS) exactly, group i (i > 0) stores
+    // [2^(i+SUB_BUCKET_BITS-1), 2^(i+SUB_BUCKET_BITS)).
+    static const size_t NUM_GROUPS = 32 - SUB_BUCKET_BITS + 1;
+
+    PercentileSketch() : _num_added(0) {
+        memset(_groups, 0, sizeof(_groups));
+    }
+
+    ~PercentileSketch() {
+        for (size_t i = 0; i < NUM_GROUPS; ++i) {
+            delete [] _groups[i];
+        }
+    }
+
+    PercentileSketch(const PercentileSketch& rhs) : _num_added(0) {
+        memset(_groups, 0, sizeof(_groups));
+        *this = rhs;
+    }
+
+    // Notice that we keep allocated groups to avoid future allocations.
+    void operator=(const PercentileSketch& rhs) {
+        for (size_t i = 0; i < NUM_GROUPS; ++i) {
+            if (rhs._groups[i]) {
+                memcpy(get_group_at(i), rhs._groups[i],
+                       sizeof(uint32_t) * NUM_SUB_BUCKETS);
+            } else if (_groups[i]) {
+                memset(_groups[i], 0, sizeof(uint32_t) * NUM_SUB_BUCKETS);
+            }
+        }
+        _num_added = rhs._num_added;
+    }
+
+    void add32(uint32_t x) {
+        size_t group = 0;
+        size_t sub = 0;
+        locate(x, &group, &sub);
+        ++get_group_at(group)[sub];
+        ++_num_added;
+    }
+
+    // Add counters of another sketch.
+    void merge(const PercentileSketch& rhs) {
+        if (rhs._num_added == 0) {
+            return;
+        }
+        for (size_t i = 0; i < NUM_GROUPS; ++i) {
+            if (rhs._groups[i]) {
+                uint32_t* counters = get_group_at(i);
+                for (size_t j = 0; j < NUM_SUB_BUCKETS; ++j) {
+                    counters[j] += rhs._groups[i][j];
+                }
+            }
+        }
+        _num_added += rhs._num_added;
+    }
+
+    // Get the `ratio'-ile value. E.g. 0.99 means 99%-ile value.
+    uint32_t get_number(double ratio) const {
+        size_t n = (size_t)ceil(ratio * _num_added);
+        if (n > _num_added) {
+            n = _num_added;
+        } else if (n == 0) {
+            return 0;
+        }
+        for (size_t i = 0; i < NUM_GROUPS; ++i) {
+            if (_groups[i] == NULL) {
+                continue;
+            }
+            for (size_t j = 0; j < NUM_SUB_BUCKETS; ++j) {
+                if (n <= _groups[i][j]) {
+                    return bucket_value(i, j);
+                }
+                n -= _groups[i][j];
+            }
+        }
+        CHECK(false) << "Can't reach here";
+        return std::numeric_limits<uint32_t>::max();
+    }
+
+    // Reset all counters.
+    void clear() {
+        for (size_t i = 0; i < NUM_GROUPS; ++i) {
+            if (_groups[i]) {
+                memset(_groups[i], 0, sizeof(uint32_t) * NUM_SUB_BUCKETS);
+            }
+        }
+        _num_added = 0;
+    }
+
+    bool empty() const { return _num_added == 0; }
+
+    // #latencies ever added.
+    size_t added_count() const { return _num_added; }
+
+    // Bytes of allocated groups.
+    size_t allocated_bytes() const {
+        size_t n = 0;
+        for (size_t i = 0; i < NUM_GROUPS; ++i) {
+            if (_groups[i]) {
+                n += sizeof(uint32_t) * NUM_SUB_BUCKETS;
+            }
+        }
+        return n;
+    }
+
+    // For debuggin.
+    void describe(std::ostream &os) const {
+        os << "(num_added=" << _num_added << ")[";
+        for (size_t i = 0; i < NUM_GROUPS; ++i) {
+            if (_groups[i] == NULL) {
+                continue;
+            }
+            for (size_t j = 0; j < NUM_SUB_BUCKETS; ++j) {
+                if (_groups[i][j]) {
+                    os << ' ' << bucket_value(i, j) << ':' << _groups[i][j];
+                }
+            }
+        }
+        os << " ]";
+    }
+
+private:
+    static void locate(uint32_t x, size_t* group, size_t* sub) {
+        if (x < NUM_SUB_BUCKETS) {
+            *group = 0;
+            *sub = x;
+            return;
+        }
+        const uint32_t shift = 31 - __builtin_clz(x) - SUB_BUCKET_BITS;
+        *group = shift + 1;
+        *sub = (x >> shift) - NUM_SUB_BUCKETS;
+    }
+
+    // Center of the bucket.
+    static uint32_t bucket_value(size_t group, size_t sub) {
+        if (group == 0) {
+            return sub;
+        }
+        const uint32_t shift = group - 1;
+        return ((NUM_SUB_BUCKETS + sub) << shift) + ((1u << shift) >> 1);
+    }
+
+    uint32_t* get_group_at(size_t index) {
+        if (_groups[index] == NULL) {
+            _groups[index] = new uint32_t[NUM_SUB_BUCKETS]();
+        }
+        return _groups[index];
+    }
+
+    size_t _num_added;
+    uint32_t* _groups[NUM_GROUPS];
+};
+
+inline std::ostream &operator<<(std::ostream &os, const PercentileSketch &p) {
+    p.describe(os);
+    return os;
+}
+
 // This declartion is a must for gcc 3.4
 class AddLatency;
 
@@ -251,6 +421,7 @@ friend class AddLatency;
                 delete _intervals[i];
             }
         }
+        delete _sketch;
     }
 
     // Copy-construct from another PercentileSamples.
@@ -264,6 +435,8 @@ friend class AddLatency;
                 _intervals[i] = NULL;
             }
         }
+        _sketch = (rhs._sketch && !rhs._sketch->empty()) ?
+            new PercentileSketch(*rhs._sketch) : NULL;
     }
 
     // Assign from another PercentileSamples.
@@ -277,6 +450,11 @@ friend class AddLatency;
                 _intervals[i]->clear();
             }
         }
+        if (rhs._sketch && !rhs._sketch->empty()) {
+            get_sketch() = *rhs._sketch;
+        } else if (_sketch) {
+            _sketch->clear();
+        }
     }
     
     // Get the `ratio'-ile value. E.g. 0.99 means 99%-ile value.
@@ -288,7 +466,11 @@ friend class AddLatency;
     // stable as current impl. CDF plotted by the method changes dramatically
     // from seconds to seconds. It seems that separating intervals probably
     // keep more long-tail values.
+    // Latencies added in sketch mode are answered by the sketch.
     uint32_t get_number(double ratio) {
+        if (_sketch && !_sketch->empty()) {
+            return _sketch->get_number(ratio);
+        }
         size_t n = (size_t)ceil(ratio * _num_added);
         if (n > _num_added) {
             n = _num_added;
@@ -320,6 +502,9 @@ friend class AddLatency;
                 get_interval_at(i).merge(*rhs._intervals[i]);
             }
         }
+        if (rhs._sketch && !rhs._sketch->empty()) {
+            get_sketch().merge(*rhs._sketch);
+        }
     }
 
     // Combine multiple into a single PercentileSamples
@@ -332,11 +517,18 @@ friend class AddLatency;
                     _intervals[i]->clear();
                 }
             }
+            if (_sketch) {
+                _sketch->clear();
+            }
             _num_added = 0;
         }
 
         for (Iterator iter = begin; iter != end; ++iter) {
             _num_added += iter->_num_added;
+            // Sketches are merged without sampling.
+            if (iter->_sketch && !iter->_sketch->empty()) {
+                get_sketch().merge(*iter->_sketch);
+            }
         }
 
         // Calculate probabilities for each interval
@@ -393,6 +585,10 @@ friend class AddLatency;
                 _intervals[i]->describe(os);
             }
         }
+        if (_sketch && !_sketch->empty()) {
+            os << " sketch=";
+            _sketch->describe(os);
+        }
         os << '}';
     }
 
@@ -406,6 +602,20 @@ friend class AddLatency;
         return true;
     }
 
+    // Bytes of allocated intervals and sketch.
+    size_t allocated_bytes() const {
+        size_t n = 0;
+        for (size_t i = 0; i < NUM_INTERVALS; ++i) {
+            if (_intervals[i]) {
+                n += sizeof(PercentileInterval<SAMPLE_SIZE>);
+            }
+        }
+        if (_sketch) {
+            n += sizeof(PercentileSketch) + _sketch->allocated_bytes();
+        }
+        return n;
+    }
+
 private:
 template <size_t size1> friend class PercentileSamples;
 
@@ -416,10 +626,18 @@ template <size_t size1> friend class PercentileSamples;
         }
         return *_intervals[index];
     }
+    PercentileSketch& get_sketch() {
+        if (_sketch == NULL) {
+            _sketch = new PercentileSketch;
+        }
+        return *_sketch;
+    }
     // sum of _num_added of all intervals. we update this value after any
     // changes to intervals inside to make it O(1)-time accessible.
     size_t _num_added;
     PercentileInterval<SAMPLE_SIZE>* _intervals[NUM_INTERVALS];
+    // Created when latencies are added in sketch mode.
+    PercentileSketch* _sketch;
 };
 
 template <size_t sz> const size_t PercentileSamples<sz>::SAMPLE_SIZE;
@@ -441,6 +659,52 @@ std::ostream &operator<<(std::ostream &os, const PercentileSamples<size> &p) {
 typedef PercentileSamples<254> GlobalPercentileSamples;
 typedef PercentileSamples<30> ThreadLocalPercentileSamples;
 
+// Get index of the interval that `x' belongs to, `x' larger than UINT32_MAX
+// is changed to UINT32_MAX.
+size_t get_interval_index(int64_t &x);
+
+// Add a latency into thread-local samples. When the interval of the latency
+// is full, it's merged into global samples got from global_value.lock().
+// GlobalValue may be GlobalValue<Percentile::combiner_type> or any class
+// with the same lock()/unlock() semantics.
+class AddLatency {
+public:
+    AddLatency(int64_t latency, bool sketch)
+        : _latency(latency), _sketch(sketch) {}
+
+    template <typename GlobalValue>
+    void operator()(GlobalValue& global_value,
+                    ThreadLocalPercentileSamples& local_value) const {
+        if (_sketch) {
+            // Nothing is dropped, counters are merged into global_value
+            // when the combiner is reset.
+            const int64_t max_latency = std::numeric_limits<uint32_t>::max();
+            local_value.get_sketch().add32(
+                (uint32_t)std::min(_latency, max_latency));
+            ++local_value._num_added;
+            return;
+        }
+        // Copy to latency since get_interval_index may change input.
+        int64_t latency = _latency;
+        const size_t index = get_interval_index(latency);
+        PercentileInterval<ThreadLocalPercentileSamples::SAMPLE_SIZE>&
+            interval = local_value.get_interval_at(index);
+        if (interval.full()) {
+            GlobalPercentileSamples* g = global_value.lock();
+            g->get_interval_at(index).merge(interval);
+            g->_num_added += interval.added_count();
+            global_value.unlock();
+            local_value._num_added -= interval.added_count();
+            interval.clear();
+        }
+        interval.add64(latency);
+        ++local_value._num_added;
+    }
+private:
+    int64_t _latency;
+    bool _sketch;
+};
+
 // A specialized reducer for finding the percentile of latencies.
 // NOTE: DON'T use it directly, use LatencyRecorder instead.
 class Percentile {
@@ -483,6 +747,11 @@ public:
     Percentile& operator<<(int64_t latency);
 
     bool valid() const { return _combiner != NULL && _combiner->valid(); }
+
+    // Count latencies in PercentileSketch instead of sampling them into
+    // PercentileIntervals. Call this before adding latencies.
+    void set_sketch_mode(bool on) { _sketch_mode = on; }
+    bool sketch_mode() const { return _sketch_mode; }
     
     // This name is useful for warning negative latencies in operator<<
     void set_debug_name(const butil::StringPiece& name) {
@@ -494,6 +763,7 @@ private:
 
     combiner_type*          _combiner;
     sampler_type*           _sampler;
+    bool                    _sketch_mode;
     std::string _debug_name;
 };
 
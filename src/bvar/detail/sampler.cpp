@@ -15,6 +15,7 @@
 // Author: Ge,Jun (gejun@baidu.com)
 // Date: Tue Jul 28 18:14:40 CST 2015
 
+#include <string.h>                                  // memset
 #include "butil/time.h"
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "bvar/reducer.h"
@@ -26,6 +27,7 @@ namespace bvar {
 namespace detail {
 
 const int WARN_NOSLEEP_THRESHOLD = 2;
+const int SAMPLING_SLICES = 10;
 
 // Combine two circular linked list into one.
 struct CombineSampler {
@@ -52,9 +54,14 @@ struct CombineSampler {
 // list of Samplers. Waking through the list and call take_sample().
 // If a Sampler needs to be deleted, we just mark it as unused and the
 // deletion is taken place in the thread as well.
+// Samplers are sampled in SAMPLING_SLICES slices evenly distributed in
+// each second to avoid latency spikes of threads modifying the combiners
+// when there're a lot of bvars.
 class SamplerCollector : public bvar::Reducer<Sampler*, CombineSampler> {
 public:
-    SamplerCollector() : _created(false), _stop(false), _cumulated_time_us(0) {
+    SamplerCollector()
+        : _created(false), _stop(false), _cumulated_time_us(0) {
+        memset(_nsampler, 0, sizeof(_nsampler));
         int rc = pthread_create(&_tid, NULL, sampling_thread, this);
         if (rc != 0) {
             LOG(FATAL) << "Fail to create sampling_thread, " << berror(rc);
@@ -77,6 +84,12 @@ public:
 private:
     void run();
     
+    // Move newly scheduled samplers into the least loaded slices.
+    void distribute(Sampler* s);
+
+    // Call take_sample() of samplers in the slice, remove destroyed ones.
+    void sample_slice(int slice);
+
     static void* sampling_thread(void* arg) {
         ((SamplerCollector*)arg)->run();
         return NULL;
@@ -87,45 +100,75 @@ private:
     bool _stop;
     int64_t _cumulated_time_us;
     pthread_t _tid;
+    // Samplers are (nearly) evenly spread into slices which are sampled
+    // one by one in each second, instead of sampling all of them in one
+    // burst that locks many combiners at the same time. Each sampler is
+    // still sampled once per second. Only accessed by sampling_thread.
+    butil::LinkNode<Sampler> _slices[SAMPLING_SLICES];
+    int _nsampler[SAMPLING_SLICES];
 };
 
+void SamplerCollector::distribute(Sampler* s) {
+    if (s == NULL) {
+        return;
+    }
+    // Detach samplers from the circular list one by one.
+    butil::LinkNode<Sampler> tmp_root;
+    s->InsertBeforeAsList(&tmp_root);
+    for (butil::LinkNode<Sampler>* p = tmp_root.next(); p != &tmp_root;) {
+        butil::LinkNode<Sampler>* saved_next = p->next();
+        p->RemoveFromList();
+        int min_slice = 0;
+        for (int i = 1; i < SAMPLING_SLICES; ++i) {
+            if (_nsampler[i] < _nsampler[min_slice]) {
+                min_slice = i;
+            }
+        }
+        p->InsertBefore(&_slices[min_slice]);
+        ++_nsampler[min_slice];
+        p = saved_next;
+    }
+}
+
+void SamplerCollector::sample_slice(int slice) {
+    butil::LinkNode<Sampler>* root = &_slices[slice];
+    for (butil::LinkNode<Sampler>* p = root->next(); p != root;) {
+        // We may remove p from the list, save next first.
+        butil::LinkNode<Sampler>* saved_next = p->next();
+        Sampler* s = p->value();
+        s->_mutex.lock();
+        if (!s->_used) {
+            s->_mutex.unlock();
+            p->RemoveFromList();
+            delete s;
+            --_nsampler[slice];
+        } else {
+            s->take_sample();
+            s->_mutex.unlock();
+        }
+        p = saved_next;
+    }
+}
+
 void SamplerCollector::run() {
-    butil::LinkNode<Sampler> root;
     int consecutive_nosleep = 0;
 #ifndef UNIT_TEST
     PassiveStatus<double> cumulated_time(get_cumulated_time, this);
     bvar::PerSecond<bvar::PassiveStatus<double> > usage(
             "bvar_sampler_collector_usage", &cumulated_time, 10);
 #endif
+    const int64_t slice_interval_us = 1000000L / SAMPLING_SLICES;
+    int slice = 0;
+    int64_t abstime = butil::gettimeofday_us();
     while (!_stop) {
-        int64_t abstime = butil::gettimeofday_us();
-        Sampler* s = this->reset();
-        if (s) {
-            s->InsertBeforeAsList(&root);
-        }
-        int nremoved = 0;
-        int nsampled = 0;
-        for (butil::LinkNode<Sampler>* p = root.next(); p != &root;) {
-            // We may remove p from the list, save next first.
-            butil::LinkNode<Sampler>* saved_next = p->next();
-            Sampler* s = p->value();
-            s->_mutex.lock();
-            if (!s->_used) {
-                s->_mutex.unlock();
-                p->RemoveFromList();
-                delete s;
-                ++nremoved;
-            } else {
-                s->take_sample();
-                s->_mutex.unlock();
-                ++nsampled;
-            }
-            p = saved_next;
-        }
+        const int64_t start_us = butil::gettimeofday_us();
+        distribute(this->reset());
+        sample_slice(slice);
+        slice = (slice + 1) % SAMPLING_SLICES;
         bool slept = false;
         int64_t now = butil::gettimeofday_us();
-        _cumulated_time_us += now - abstime;
-        abstime += 1000000L;
+        _cumulated_time_us += now - start_us;
+        abstime += slice_interval_us;
         while (abstime > now) {
             ::usleep(abstime - now);
             slept = true;
@@ -134,11 +177,14 @@ void SamplerCollector::run() {
         if (slept) {
             consecutive_nosleep = 0;
         } else {            
-            if (++consecutive_nosleep >= WARN_NOSLEEP_THRESHOLD) {
+            if (++consecutive_nosleep >=
+                WARN_NOSLEEP_THRESHOLD * SAMPLING_SLICES) {
                 consecutive_nosleep = 0;
                 LOG(WARNING) << "bvar is busy at sampling for "
                              << WARN_NOSLEEP_THRESHOLD << " seconds!";
             }
+            // Don't try to catch up with the lagged slices.
+            abstime = now;
         }
     }
 }
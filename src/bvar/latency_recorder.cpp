@@ -30,6 +30,11 @@ DEFINE_int32(bvar_latency_p3, 99, "Third latency percentile");
 static bool valid_percentile(const char*, int32_t v) {
     return v > 0 && v < 100;
 }
+DEFINE_bool(bvar_latency_percentile_sketch, false, "Count latencies of "
+            "LatencyRecorders in log-linear buckets instead of sampling them,"
+            " which is more accurate at long-tail percentiles and merges"
+            " cheaper. Only affects LatencyRecorders created afterwards");
+
 const bool ALLOW_UNUSED dummy_bvar_latency_p1 = ::GFLAGS_NS::RegisterFlagValidator(
     &FLAGS_bvar_latency_p1, valid_percentile);
 const bool ALLOW_UNUSED dummy_bvar_latency_p2 = ::GFLAGS_NS::RegisterFlagValidator(
@@ -41,6 +46,269 @@ namespace detail {
 
 typedef PercentileSamples<1022> CombinedPercentileSamples;
 
+LatencyCombiner::Agent::~Agent() {
+    if (combiner) {
+        BAIDU_SCOPED_LOCK(combiner->_lock);
+        combiner->commit(this);
+        RemoveFromList();
+        combiner = NULL;
+    }
+}
+
+LatencyCombiner::LatencyCombiner()
+    : _id(AgentGroup::create_new_agent())
+    , _sketch_mode(false)
+    , _global_sum(0)
+    , _global_num(0)
+    , _global_max(0) {
+}
+
+LatencyCombiner::~LatencyCombiner() {
+    if (_id < 0) {
+        return;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_lock);
+        // Agents are reused by other combiners getting the same id, reset
+        // them to release the samples.
+        for (butil::LinkNode<Agent>* node = _agents.head();
+             node != _agents.end();) {
+            Agent* a = node->value();
+            butil::LinkNode<Agent>* const saved_next = node->next();
+            {
+                BAIDU_SCOPED_LOCK(a->lock);
+                a->combiner = NULL;
+                a->sum = 0;
+                a->num = 0;
+                a->max = 0;
+                a->samples = ThreadLocalPercentileSamples();
+            }
+            node->RemoveFromList();
+            node = saved_next;
+        }
+    }
+    AgentGroup::destroy_agent(_id);
+    _id = -1;
+}
+
+inline LatencyCombiner::Agent* LatencyCombiner::get_or_create_tls_agent() {
+    Agent* agent = AgentGroup::get_tls_agent(_id);
+    if (!agent) {
+        agent = AgentGroup::get_or_create_tls_agent(_id);
+        if (NULL == agent) {
+            LOG(FATAL) << "Fail to create agent";
+            return NULL;
+        }
+    }
+    if (agent->combiner) {
+        return agent;
+    }
+    {
+        BAIDU_SCOPED_LOCK(agent->lock);
+        agent->combiner = this;
+    }
+    BAIDU_SCOPED_LOCK(_lock);
+    _agents.Append(agent);
+    return agent;
+}
+
+void LatencyCombiner::commit(Agent* a) {
+    BAIDU_SCOPED_LOCK(a->lock);
+    _global_sum += a->sum;
+    _global_num += a->num;
+    _global_max = std::max(_global_max, a->max);
+    _global_samples.merge(a->samples);
+    a->sum = 0;
+    a->num = 0;
+    a->max = 0;
+    a->samples = ThreadLocalPercentileSamples();
+}
+
+// Passed to AddLatency to merge full intervals, see GlobalValue<> in
+// bvar/detail/combiner.h
+class LatencyCombinerGlobal {
+public:
+    LatencyCombinerGlobal(butil::Lock* agent_lock, butil::Lock* global_lock,
+                          GlobalPercentileSamples* global_samples)
+        : _agent_lock(agent_lock)
+        , _global_lock(global_lock)
+        , _global_samples(global_samples) {}
+
+    GlobalPercentileSamples* lock() {
+        _agent_lock->Release();
+        _global_lock->Acquire();
+        return _global_samples;
+    }
+
+    void unlock() {
+        _global_lock->Release();
+        _agent_lock->Acquire();
+    }
+
+private:
+    butil::Lock* _agent_lock;
+    butil::Lock* _global_lock;
+    GlobalPercentileSamples* _global_samples;
+};
+
+void LatencyCombiner::add(int64_t latency) {
+    Agent* agent = get_or_create_tls_agent();
+    if (BAIDU_UNLIKELY(!agent)) {
+        return;
+    }
+    if (BAIDU_UNLIKELY(latency < 0)) {
+        // Same as Percentile, negative latencies are dropped from the
+        // samples but still counted in sum/num/max.
+        if (!_debug_name.empty()) {
+            LOG(WARNING) << "Input=" << latency << " to `" << _debug_name
+                         << "' is negative, drop";
+        } else {
+            LOG(WARNING) << "Input=" << latency << " to LatencyRecorder("
+                         << (void*)this << ") is negative, drop";
+        }
+        BAIDU_SCOPED_LOCK(agent->lock);
+        agent->sum += latency;
+        ++agent->num;
+        return;
+    }
+    agent->lock.Acquire();
+    agent->sum += latency;
+    ++agent->num;
+    if (agent->max < latency) {
+        agent->max = latency;
+    }
+    LatencyCombinerGlobal g(&agent->lock, &_lock, &_global_samples);
+    AddLatency(latency, _sketch_mode)(g, agent->samples);
+    agent->lock.Release();
+}
+
+Stat LatencyCombiner::get_stat() const {
+    BAIDU_SCOPED_LOCK(_lock);
+    Stat s(_global_sum, _global_num);
+    for (const butil::LinkNode<Agent>* node = _agents.head();
+         node != _agents.end(); node = node->next()) {
+        Agent* a = const_cast<Agent*>(node->value());
+        BAIDU_SCOPED_LOCK(a->lock);
+        s.sum += a->sum;
+        s.num += a->num;
+    }
+    return s;
+}
+
+Stat LatencyCombiner::reset_stat() {
+    BAIDU_SCOPED_LOCK(_lock);
+    Stat s(_global_sum, _global_num);
+    _global_sum = 0;
+    _global_num = 0;
+    for (butil::LinkNode<Agent>* node = _agents.head();
+         node != _agents.end(); node = node->next()) {
+        Agent* a = node->value();
+        BAIDU_SCOPED_LOCK(a->lock);
+        s.sum += a->sum;
+        s.num += a->num;
+        a->sum = 0;
+        a->num = 0;
+    }
+    return s;
+}
+
+int64_t LatencyCombiner::get_max() const {
+    BAIDU_SCOPED_LOCK(_lock);
+    int64_t max = _global_max;
+    for (const butil::LinkNode<Agent>* node = _agents.head();
+         node != _agents.end(); node = node->next()) {
+        Agent* a = const_cast<Agent*>(node->value());
+        BAIDU_SCOPED_LOCK(a->lock);
+        max = std::max(max, a->max);
+    }
+    return max;
+}
+
+int64_t LatencyCombiner::reset_max() {
+    BAIDU_SCOPED_LOCK(_lock);
+    int64_t max = _global_max;
+    _global_max = 0;
+    for (butil::LinkNode<Agent>* node = _agents.head();
+         node != _agents.end(); node = node->next()) {
+        Agent* a = node->value();
+        BAIDU_SCOPED_LOCK(a->lock);
+        max = std::max(max, a->max);
+        a->max = 0;
+    }
+    return max;
+}
+
+GlobalPercentileSamples LatencyCombiner::get_samples() const {
+    BAIDU_SCOPED_LOCK(_lock);
+    GlobalPercentileSamples result(_global_samples);
+    for (const butil::LinkNode<Agent>* node = _agents.head();
+         node != _agents.end(); node = node->next()) {
+        Agent* a = const_cast<Agent*>(node->value());
+        BAIDU_SCOPED_LOCK(a->lock);
+        result.merge(a->samples);
+    }
+    return result;
+}
+
+GlobalPercentileSamples LatencyCombiner::reset_samples() {
+    BAIDU_SCOPED_LOCK(_lock);
+    GlobalPercentileSamples result(_global_samples);
+    _global_samples = GlobalPercentileSamples();
+    for (butil::LinkNode<Agent>* node = _agents.head();
+         node != _agents.end(); node = node->next()) {
+        Agent* a = node->value();
+        BAIDU_SCOPED_LOCK(a->lock);
+        result.merge(a->samples);
+        a->samples = ThreadLocalPercentileSamples();
+    }
+    return result;
+}
+
+LatencyStatReducer::~LatencyStatReducer() {
+    if (_sampler) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+}
+
+LatencyStatReducer::sampler_type* LatencyStatReducer::get_sampler() {
+    if (NULL == _sampler) {
+        _sampler = new sampler_type(this);
+        _sampler->schedule();
+    }
+    return _sampler;
+}
+
+LatencyMaxReducer::~LatencyMaxReducer() {
+    if (_sampler) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+}
+
+LatencyMaxReducer::sampler_type* LatencyMaxReducer::get_sampler() {
+    if (NULL == _sampler) {
+        _sampler = new sampler_type(this);
+        _sampler->schedule();
+    }
+    return _sampler;
+}
+
+LatencyPercentileReducer::~LatencyPercentileReducer() {
+    if (_sampler) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+}
+
+LatencyPercentileReducer::sampler_type* LatencyPercentileReducer::get_sampler() {
+    if (NULL == _sampler) {
+        _sampler = new sampler_type(this);
+        _sampler->schedule();
+    }
+    return _sampler;
+}
+
 CDF::CDF(PercentileWindow* w) : _w(w) {}
 
 CDF::~CDF() {
@@ -98,7 +366,7 @@ static int64_t get_window_recorder_qps(void* arg) {
 }
 
 static int64_t get_recorder_count(void* arg) {
-    return static_cast<IntRecorder*>(arg)->get_value().num;
+    return static_cast<LatencyStatReducer*>(arg)->get_value().num;
 }
 
 // Caller is responsible for deleting the return value.
@@ -144,7 +412,9 @@ static Vector<int64_t, 4> get_latencies(void *arg) {
 }
 
 LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
-    : _max_latency(0)
+    : _latency(&_combiner)
+    , _max_latency(&_combiner)
+    , _latency_percentile(&_combiner)
     , _latency_window(&_latency, window_size)
     , _max_latency_window(&_max_latency, window_size)
     , _count(get_recorder_count, &_latency)
@@ -156,8 +426,9 @@ LatencyRecorderBase::LatencyRecorderBase(time_t window_size)
     , _latency_999(get_percetile<999, 1000>, this)
     , _latency_9999(get_percetile<9999, 10000>, this)
     , _latency_cdf(&_latency_percentile_window)
-    , _latency_percentiles(get_latencies, &_latency_percentile_window)
-{}
+    , _latency_percentiles(get_latencies, &_latency_percentile_window) {
+    _combiner.set_sketch_mode(FLAGS_bvar_latency_percentile_sketch);
+}
 
 }  // namespace detail
 
@@ -202,8 +473,7 @@ int LatencyRecorder::expose(const butil::StringPiece& prefix1,
     }
 
     // set debug names for printing helpful error log.
-    _latency.set_debug_name(prefix);
-    _latency_percentile.set_debug_name(prefix);
+    _combiner.set_debug_name(prefix);
 
     if (_latency_window.expose_as(prefix, "latency") != 0) {
         return -1;
@@ -268,9 +538,7 @@ void LatencyRecorder::hide() {
 }
 
 LatencyRecorder& LatencyRecorder::operator<<(int64_t latency) {
-    _latency << latency;
-    _max_latency << latency;
-    _latency_percentile << latency;
+    _combiner.add(latency);
     return *this;
 }
 
@@ -18,18 +18,146 @@
 #ifndef  BVAR_LATENCY_RECORDER_H
 #define  BVAR_LATENCY_RECORDER_H
 
+#include "butil/containers/linked_list.h"
+#include "butil/synchronization/lock.h"
 #include "bvar/recorder.h"
 #include "bvar/reducer.h"
 #include "bvar/passive_status.h"
+#include "bvar/detail/agent_group.h"
 #include "bvar/detail/percentile.h"
 
 namespace bvar {
 namespace detail {
 
-class Percentile;
-typedef Window<IntRecorder, SERIES_IN_SECOND> RecorderWindow;
-typedef Window<Maxer<int64_t>, SERIES_IN_SECOND> MaxWindow;
-typedef Window<Percentile, SERIES_IN_SECOND> PercentileWindow;
+// Sum, number, max and percentile samples of latencies recorded by a
+// LatencyRecorder. Each thread updates all of them in one agent, which
+// avoids looking up and modifying agents of separate reducers.
+class LatencyCombiner {
+public:
+    struct Agent : public butil::LinkNode<Agent> {
+        Agent() : combiner(NULL), sum(0), num(0), max(0) {}
+        ~Agent();
+
+        LatencyCombiner* combiner;
+        // Protects fields below, held by the owning thread when recording.
+        butil::Lock lock;
+        int64_t sum;
+        int64_t num;
+        int64_t max;
+        ThreadLocalPercentileSamples samples;
+    };
+    typedef detail::AgentGroup<Agent> AgentGroup;
+
+    LatencyCombiner();
+    ~LatencyCombiner();
+
+    void add(int64_t latency);
+
+    // Sum and number of all latencies.
+    Stat get_stat() const;
+    Stat reset_stat();
+    // Max and samples of latencies since last reset.
+    int64_t get_max() const;
+    int64_t reset_max();
+    GlobalPercentileSamples get_samples() const;
+    GlobalPercentileSamples reset_samples();
+
+    // Count latencies in PercentileSketch, see Percentile::set_sketch_mode().
+    void set_sketch_mode(bool on) { _sketch_mode = on; }
+    bool sketch_mode() const { return _sketch_mode; }
+
+    // This name is useful for warning negative latencies in add()
+    void set_debug_name(const butil::StringPiece& name) {
+        _debug_name.assign(name.data(), name.size());
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyCombiner);
+    Agent* get_or_create_tls_agent();
+    // Move values of the agent into global ones. Called with _lock held.
+    void commit(Agent* agent);
+
+    AgentId _id;
+    bool _sketch_mode;
+    mutable butil::Lock _lock;
+    int64_t _global_sum;
+    int64_t _global_num;
+    int64_t _global_max;
+    GlobalPercentileSamples _global_samples;
+    butil::LinkedList<Agent> _agents;
+    std::string _debug_name;
+};
+
+// Views of LatencyCombiner as reducers of windows.
+class LatencyStatReducer {
+public:
+    typedef Stat value_type;
+    typedef IntRecorder::AddStat AddStat;
+    typedef IntRecorder::MinusStat MinusStat;
+    typedef ReducerSampler<LatencyStatReducer, Stat,
+                           AddStat, MinusStat> sampler_type;
+
+    explicit LatencyStatReducer(LatencyCombiner* c) : _c(c), _sampler(NULL) {}
+    ~LatencyStatReducer();
+    AddStat op() const { return AddStat(); }
+    MinusStat inv_op() const { return MinusStat(); }
+    sampler_type* get_sampler();
+    Stat get_value() const { return _c->get_stat(); }
+    Stat reset() { return _c->reset_stat(); }
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyStatReducer);
+    LatencyCombiner* _c;
+    sampler_type* _sampler;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const LatencyStatReducer& r) {
+    return os << r.get_value();
+}
+
+class LatencyMaxReducer {
+public:
+    typedef int64_t value_type;
+    typedef MaxTo<int64_t> MaxOp;
+    typedef ReducerSampler<LatencyMaxReducer, int64_t,
+                           MaxOp, VoidOp> sampler_type;
+
+    explicit LatencyMaxReducer(LatencyCombiner* c) : _c(c), _sampler(NULL) {}
+    ~LatencyMaxReducer();
+    MaxOp op() const { return MaxOp(); }
+    VoidOp inv_op() const { return VoidOp(); }
+    sampler_type* get_sampler();
+    int64_t get_value() const { return _c->get_max(); }
+    int64_t reset() { return _c->reset_max(); }
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyMaxReducer);
+    LatencyCombiner* _c;
+    sampler_type* _sampler;
+};
+
+class LatencyPercentileReducer {
+public:
+    typedef GlobalPercentileSamples value_type;
+    typedef Percentile::AddPercentileSamples AddPercentileSamples;
+    typedef ReducerSampler<LatencyPercentileReducer, GlobalPercentileSamples,
+                           AddPercentileSamples, VoidOp> sampler_type;
+
+    explicit LatencyPercentileReducer(LatencyCombiner* c)
+        : _c(c), _sampler(NULL) {}
+    ~LatencyPercentileReducer();
+    AddPercentileSamples op() const { return AddPercentileSamples(); }
+    VoidOp inv_op() const { return VoidOp(); }
+    sampler_type* get_sampler();
+    GlobalPercentileSamples get_value() const { return _c->get_samples(); }
+    GlobalPercentileSamples reset() { return _c->reset_samples(); }
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyPercentileReducer);
+    LatencyCombiner* _c;
+    sampler_type* _sampler;
+};
+
+typedef Window<LatencyStatReducer, SERIES_IN_SECOND> RecorderWindow;
+typedef Window<LatencyMaxReducer, SERIES_IN_SECOND> MaxWindow;
+typedef Window<LatencyPercentileReducer, SERIES_IN_SECOND> PercentileWindow;
 
 // NOTE: Always use int64_t in the interfaces no matter what the impl. is.
 
@@ -49,9 +177,10 @@ public:
     explicit LatencyRecorderBase(time_t window_size);
     time_t window_size() const { return _latency_window.window_size(); }
 protected:
-    IntRecorder _latency;
-    Maxer<int64_t> _max_latency;
-    Percentile _latency_percentile;
+    LatencyCombiner _combiner;
+    LatencyStatReducer _latency;
+    LatencyMaxReducer _max_latency;
+    LatencyPercentileReducer _latency_percentile;
 
     RecorderWindow _latency_window;
     MaxWindow _max_latency_window;
@@ -144,6 +273,14 @@ public:
     // E.g. 0.99 means 99%-ile
     int64_t latency_percentile(double ratio) const;
 
+    // Count latencies in log-linear buckets(detail::PercentileSketch) instead
+    // of sampling them. Percentiles are within 1% relative error and stable
+    // at 99.99%, while memory and merging cost are lower with many threads.
+    // Default value is -bvar_latency_percentile_sketch. Call this before
+    // recording any latency.
+    void set_percentile_sketch(bool on) { _combiner.set_sketch_mode(on); }
+    bool percentile_sketch() const { return _combiner.sketch_mode(); }
+
     // Get name of a sub-bvar.
     const std::string& latency_name() const { return _latency_window.name(); }
     const std::string& latency_percentiles_name() const
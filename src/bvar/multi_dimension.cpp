@@ -0,0 +1,55 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gflags/gflags.h>
+#include "bvar/multi_dimension.h"
+
+namespace bvar {
+
+DEFINE_int32(bvar_max_multi_dimension_stats_count, 20000,
+             "Max number of stats in a MultiDimension, values of labels "
+             "beyond the limit are counted in the overflow stat");
+
+static bool validate_max_stats_count(const char*, int32_t v) {
+    return v > 0;
+}
+const bool ALLOW_UNUSED dummy_bvar_max_multi_dimension_stats_count =
+    ::GFLAGS_NS::RegisterFlagValidator(
+        &FLAGS_bvar_max_multi_dimension_stats_count, validate_max_stats_count);
+
+namespace detail {
+
+void describe_labels(std::ostream& os,
+                     const std::vector<std::string>& label_names,
+                     const std::vector<std::string>& label_values) {
+    os << '{';
+    for (size_t i = 0; i < label_names.size() && i < label_values.size(); ++i) {
+        if (i) {
+            os << ',';
+        }
+        os << label_names[i] << "=\"";
+        const std::string& value = label_values[i];
+        for (size_t j = 0; j < value.size(); ++j) {
+            if (value[j] == '"' || value[j] == '\\') {
+                os << '\\';
+            }
+            os << value[j];
+        }
+        os << '"';
+    }
+    os << '}';
+}
+
+}  // namespace detail
+}  // namespace bvar
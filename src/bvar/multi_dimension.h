@@ -0,0 +1,237 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef  BVAR_MULTI_DIMENSION_H
+#define  BVAR_MULTI_DIMENSION_H
+
+#include <map>                                   // std::map
+#include <string>                                // std::string
+#include <vector>                                // std::vector
+#include <ostream>                               // std::ostream
+#include <gflags/gflags_declare.h>
+#include "butil/logging.h"                       // LOG()
+#include "butil/atomicops.h"                     // butil::atomic
+#include "butil/scoped_lock.h"                   // BAIDU_SCOPED_LOCK
+#include "butil/containers/doubly_buffered_data.h"
+#include "bvar/variable.h"
+
+namespace bvar {
+
+DECLARE_int32(bvar_max_multi_dimension_stats_count);
+
+namespace detail {
+// Write `{name1="value1",name2="value2"}' into `os'.
+void describe_labels(std::ostream& os,
+                     const std::vector<std::string>& label_names,
+                     const std::vector<std::string>& label_values);
+}  // namespace detail
+
+// A family of bvars(called stats) distinguished by values of a fixed list of
+// labels, e.g. per-method or per-peer metrics. Stats are created on demand
+// and not exposed individually, the family is exposed as one Variable whose
+// description contains all stats:
+//   {method="Echo",peer="10.0.0.1:8000"}:12 {method="Echo",peer="..."}:3
+// Each stat has its own thread-local combiner, thus updating a stat is as
+// fast as updating a plain bvar. The number of stats is bounded by
+// `max_stats_count', latter values are counted in an overflow stat whose
+// labels are all "__overflow__", so that a label with unexpectedly many
+// values does not exhaust memory.
+//
+// T can be any default-constructible bvar printable by operator<<, e.g.
+// Adder<int64_t>, Maxer<int>, LatencyRecorder.
+// Example:
+//   bvar::MultiDimension<bvar::Adder<int64_t> > error_count(
+//       "rpc_error_count", {"method", "error_code"});
+//   *error_count.get_stats({"Echo", "1008"}) << 1;
+//
+// Stats are never deleted before the MultiDimension, pointers returned by
+// get_stats() can be cached.
+template <typename T>
+class MultiDimension : public Variable {
+public:
+    typedef std::vector<std::string> key_type;
+    typedef T value_type;
+
+    explicit MultiDimension(const key_type& label_names)
+        : _label_names(label_names)
+        , _max_stats_count(FLAGS_bvar_max_multi_dimension_stats_count)
+        , _overflow_stats(NULL) {}
+
+    MultiDimension(const butil::StringPiece& name,
+                   const key_type& label_names)
+        : _label_names(label_names)
+        , _max_stats_count(FLAGS_bvar_max_multi_dimension_stats_count)
+        , _overflow_stats(NULL) {
+        expose(name);
+    }
+
+    MultiDimension(const butil::StringPiece& prefix,
+                   const butil::StringPiece& name,
+                   const key_type& label_names)
+        : _label_names(label_names)
+        , _max_stats_count(FLAGS_bvar_max_multi_dimension_stats_count)
+        , _overflow_stats(NULL) {
+        expose_as(prefix, name);
+    }
+
+    ~MultiDimension() {
+        hide();
+        typename StatsMapDBD::ScopedPtr ptr;
+        if (_stats.Read(&ptr) == 0) {
+            for (typename StatsMap::const_iterator it = ptr->begin();
+                 it != ptr->end(); ++it) {
+                delete it->second;
+            }
+        }
+        delete _overflow_stats.load(butil::memory_order_relaxed);
+    }
+
+    // Get the stat of `label_values', create it if it does not exist.
+    // Returns the overflow stat when the number of stats reaches
+    // max_stats_count(), NULL when size of `label_values' does not match
+    // the labels.
+    T* get_stats(const key_type& label_values) {
+        if (label_values.size() != _label_names.size()) {
+            LOG(ERROR) << "Expect " << _label_names.size()
+                       << " label values, actually " << label_values.size();
+            return NULL;
+        }
+        T* stats = find_stats(label_values);
+        if (stats) {
+            return stats;
+        }
+        // Don't lock for values counted in the overflow stat.
+        T* overflow_stats = _overflow_stats.load(butil::memory_order_acquire);
+        if (overflow_stats && count_stats() >= _max_stats_count) {
+            return overflow_stats;
+        }
+        BAIDU_SCOPED_LOCK(_modify_mutex);
+        // Another thread may have created the stat.
+        stats = find_stats(label_values);
+        if (stats) {
+            return stats;
+        }
+        if (count_stats() >= _max_stats_count) {
+            overflow_stats = _overflow_stats.load(butil::memory_order_relaxed);
+            if (overflow_stats == NULL) {
+                LOG(WARNING) << "Number of stats of `" << name()
+                             << "' reaches " << _max_stats_count
+                             << ", count new label values as overflow";
+                overflow_stats = new T;
+                _overflow_stats.store(overflow_stats, butil::memory_order_release);
+            }
+            return overflow_stats;
+        }
+        stats = new T;
+        _stats.Modify(add_stats, label_values, stats);
+        return stats;
+    }
+
+    // True if `label_values' has its own stat.
+    bool has_stats(const key_type& label_values) const {
+        return find_stats(label_values) != NULL;
+    }
+
+    // Number of stats, the overflow stat is not counted.
+    size_t count_stats() const {
+        typename StatsMapDBD::ScopedPtr ptr;
+        if (_stats.Read(&ptr) != 0) {
+            return 0;
+        }
+        return ptr->size();
+    }
+
+    // Put label values of all stats into `keys'.
+    void list_stats(std::vector<key_type>* keys) const {
+        keys->clear();
+        typename StatsMapDBD::ScopedPtr ptr;
+        if (_stats.Read(&ptr) != 0) {
+            return;
+        }
+        keys->reserve(ptr->size());
+        for (typename StatsMap::const_iterator it = ptr->begin();
+             it != ptr->end(); ++it) {
+            keys->push_back(it->first);
+        }
+    }
+
+    // Change the limit of stats. Existing stats are kept.
+    void set_max_stats_count(size_t max_stats_count) {
+        BAIDU_SCOPED_LOCK(_modify_mutex);
+        _max_stats_count = max_stats_count;
+    }
+    size_t max_stats_count() const { return _max_stats_count; }
+
+    const key_type& labels() const { return _label_names; }
+
+    // Print all stats in one pass.
+    void describe(std::ostream& os, bool /*quote_string*/) const {
+        bool first = true;
+        {
+            typename StatsMapDBD::ScopedPtr ptr;
+            if (_stats.Read(&ptr) != 0) {
+                return;
+            }
+            for (typename StatsMap::const_iterator it = ptr->begin();
+                 it != ptr->end(); ++it) {
+                if (!first) {
+                    os << ' ';
+                }
+                first = false;
+                detail::describe_labels(os, _label_names, it->first);
+                os << ':' << *it->second;
+            }
+        }
+        const T* overflow_stats =
+            _overflow_stats.load(butil::memory_order_acquire);
+        if (overflow_stats) {
+            if (!first) {
+                os << ' ';
+            }
+            const key_type overflow_values(_label_names.size(), "__overflow__");
+            detail::describe_labels(os, _label_names, overflow_values);
+            os << ':' << *overflow_stats;
+        }
+    }
+
+private:
+    typedef std::map<key_type, T*> StatsMap;
+    typedef butil::DoublyBufferedData<StatsMap> StatsMapDBD;
+
+    T* find_stats(const key_type& label_values) const {
+        typename StatsMapDBD::ScopedPtr ptr;
+        if (_stats.Read(&ptr) != 0) {
+            return NULL;
+        }
+        typename StatsMap::const_iterator it = ptr->find(label_values);
+        return (it != ptr->end() ? it->second : NULL);
+    }
+
+    static size_t add_stats(StatsMap& bg, const key_type& label_values,
+                            T* const& stats) {
+        bg[label_values] = stats;
+        return 1;
+    }
+
+    const key_type _label_names;
+    size_t _max_stats_count;
+    mutable StatsMapDBD _stats;
+    // Serialize creations of stats.
+    butil::Mutex _modify_mutex;
+    butil::atomic<T*> _overflow_stats;
+};
+
+}  // namespace bvar
+
+#endif  //BVAR_MULTI_DIMENSION_H
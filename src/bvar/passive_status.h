@@ -58,7 +58,9 @@ public:
             delete _vector_names;
         }
         void take_sample() { _series.append(_owner->get_value()); }
-        void describe(std::ostream& os) { _series.describe(os, _vector_names); }
+        void describe(std::ostream& os, const SeriesOptions& options) {
+            _series.describe(os, _vector_names, options);
+        }
         void set_vector_names(const std::string& names) {
             if (_vector_names == NULL) {
                 _vector_names = new std::string;
@@ -68,7 +70,7 @@ public:
     private:
         PassiveStatus* _owner;
         std::string* _vector_names;
-        detail::Series<Tp, Op> _series;
+        detail::SeriesStore<Tp, Op> _series;
     };
 
 public:
@@ -154,7 +156,7 @@ public:
             return 1;
         }
         if (!options.test_only) {
-            _series_sampler->describe(os);
+            _series_sampler->describe(os, options);
         }
         return 0;
     }
@@ -25,7 +25,7 @@
 #include "bvar/variable.h"                        // Variable
 #include "bvar/detail/combiner.h"                 // detail::AgentCombiner
 #include "bvar/detail/sampler.h"                  // ReducerSampler
-#include "bvar/detail/series.h"
+#include "bvar/detail/compressed_series.h"
 #include "bvar/window.h"
 
 namespace bvar {
@@ -75,10 +75,12 @@ public:
             : _owner(owner), _series(op) {}
         ~SeriesSampler() {}
         void take_sample() { _series.append(_owner->get_value()); }
-        void describe(std::ostream& os) { _series.describe(os, NULL); }
+        void describe(std::ostream& os, const SeriesOptions& options) {
+            _series.describe(os, NULL, options);
+        }
     private:
         Reducer* _owner;
-        detail::Series<T, Op> _series;
+        detail::SeriesStore<T, Op> _series;
     };
 
 public:
@@ -158,7 +160,7 @@ public:
             return 1;
         }
         if (!options.test_only) {
-            _series_sampler->describe(os);
+            _series_sampler->describe(os, options);
         }
         return 0;
     }
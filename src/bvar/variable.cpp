@@ -19,6 +19,7 @@
 #include <set>                                  // std::set
 #include <fstream>                              // std::ifstream
 #include <sstream>                              // std::ostringstream
+#include <memory>                               // std::unique_ptr
 #include <gflags/gflags.h>
 #include "butil/macros.h"                        // BAIDU_CASSERT
 #include "butil/containers/flat_map.h"           // butil::FlatMap
@@ -560,10 +561,11 @@ std::string read_command_name() {
     return s;
 }
 
+// Lines are buffered and written by flush() with a single write.
 class FileDumper : public Dumper {
 public:
     FileDumper(const std::string& filename, butil::StringPiece s/*prefix*/)
-        : _filename(filename), _fp(NULL) {
+        : _filename(filename) {
         // setting prefix.
         // remove trailing spaces.
         const char* p = s.data() + s.size();
@@ -578,44 +580,52 @@ public:
         }
     }
 
-    ~FileDumper() {
-        close();
+    bool dump(const std::string& name, const butil::StringPiece& desc) {
+        _buf.append(_prefix);
+        _buf.append(name);
+        _buf.append(" : ", 3);
+        _buf.append(desc.data(), desc.size());
+        _buf.append("\r\n", 2);
+        return true;
     }
-    void close() {
-        if (_fp) {
-            fclose(_fp);
-            _fp = NULL;
+
+    // Write buffered lines into the file, which is truncated before writing
+    // unless `append' is true. The file is untouched when nothing was
+    // dumped.
+    bool flush(bool append) {
+        if (_buf.empty()) {
+            return true;
         }
-    }
-    bool dump(const std::string& name, const butil::StringPiece& desc) {
-        if (_fp == NULL) {
-            butil::File::Error error;
-            butil::FilePath dir = butil::FilePath(_filename).DirName();
-            if (!butil::CreateDirectoryAndGetError(dir, &error)) {
-                LOG(ERROR) << "Fail to create directory=`" << dir.value()
-                           << "', " << error;
-                return false;
-            }
-            _fp = fopen(_filename.c_str(), "w");
-            if (NULL == _fp) {
-                LOG(ERROR) << "Fail to open " << _filename;
-                return false;
-            }
+        butil::File::Error error;
+        butil::FilePath dir = butil::FilePath(_filename).DirName();
+        if (!butil::CreateDirectoryAndGetError(dir, &error)) {
+            LOG(ERROR) << "Fail to create directory=`" << dir.value()
+                       << "', " << error;
+            _buf.clear();
+            return false;
         }
-        if (fprintf(_fp, "%.*s%.*s : %.*s\r\n",
-                    (int)_prefix.size(), _prefix.data(),
-                    (int)name.size(), name.data(),
-                    (int)desc.size(), desc.data()) < 0) {
-            PLOG(ERROR) << "Fail to write into " << _filename;
+        FILE* fp = fopen(_filename.c_str(), (append ? "a" : "w"));
+        if (NULL == fp) {
+            LOG(ERROR) << "Fail to open " << _filename;
+            _buf.clear();
             return false;
         }
-        return true;
+        bool ok = (fwrite(_buf.data(), 1, _buf.size(), fp) == _buf.size());
+        if (!ok) {
+            PLOG(ERROR) << "Fail to write into " << _filename;
+        }
+        if (fclose(fp) != 0 && ok) {
+            PLOG(ERROR) << "Fail to close " << _filename;
+            ok = false;
+        }
+        _buf.clear();
+        return ok;
     }
 private:
 
     std::string _filename;
-    FILE* _fp;
     std::string _prefix;
+    std::string _buf;
 };
 
 class FileDumperGroup : public Dumper {
@@ -659,10 +669,87 @@ public:
         // dump to default file
         return dumpers.back().first->dump(name, desc);
     }
+
+    bool flush(bool append) {
+        bool ok = true;
+        for (size_t i = 0; i < dumpers.size(); ++i) {
+            if (!dumpers[i].first->flush(append)) {
+                ok = false;
+            }
+        }
+        return ok;
+    }
 private:
     std::vector<std::pair<FileDumper *, WildcardMatcher*> > dumpers;
 };
 
+DEFINE_bool(bvar_dump_incremental, false,
+            "Append values changed since last dump to the dump files rather "
+            "than rewriting all values. Files are rewritten with all values "
+            "every -bvar_dump_full_interval dumps");
+DEFINE_int32(bvar_dump_full_interval, 60,
+             "Rewrite dump files with all values every so many dumps when "
+             "-bvar_dump_incremental is on, so that the files don't grow "
+             "indefinitely. Non-positive value means never");
+
+// Remember values dumped before and dump changed ones only.
+class IncrementalFileDumper : public Dumper {
+public:
+    IncrementalFileDumper(const std::string& tabs,
+                          const std::string& filename,
+                          const std::string& prefix)
+        : _tabs(tabs), _filename(filename), _prefix(prefix)
+        , _files(tabs, filename, prefix), _ndump(0) {
+        _last_values.init(1024);
+    }
+
+    bool same_files(const std::string& tabs, const std::string& filename,
+                    const std::string& prefix) const {
+        return tabs == _tabs && filename == _filename && prefix == _prefix;
+    }
+
+    // Returns number of variables described, -1 on error.
+    int dump_changed(const DumpOptions& options) {
+        const int full_interval = FLAGS_bvar_dump_full_interval;
+        const bool full = (_ndump == 0 ||
+                           (full_interval > 0 && _ndump >= full_interval));
+        if (full) {
+            _ndump = 0;
+            _last_values.clear();
+        }
+        ++_ndump;
+        int rc = Variable::dump_exposed(this, &options);
+        if (!_files.flush(!full)) {
+            rc = -1;
+        }
+        if (rc < 0) {
+            // Rewrite all values next time.
+            _ndump = 0;
+        }
+        return rc;
+    }
+
+    bool dump(const std::string& name, const butil::StringPiece& desc) {
+        std::string* last = _last_values.seek(name);
+        if (last == NULL) {
+            _last_values[name].assign(desc.data(), desc.size());
+        } else if (*last == desc) {
+            return true;
+        } else {
+            last->assign(desc.data(), desc.size());
+        }
+        return _files.dump(name, desc);
+    }
+
+private:
+    std::string _tabs;
+    std::string _filename;
+    std::string _prefix;
+    FileDumperGroup _files;
+    int _ndump;
+    butil::FlatMap<std::string, std::string> _last_values;
+};
+
 static pthread_once_t dumping_thread_once = PTHREAD_ONCE_INIT;
 static bool created_dumping_thread = false;
 static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -697,6 +784,7 @@ static void* dumping_thread(void*) {
     // destructed when program exits and caused coredumps.
     const std::string command_name = read_command_name();
     std::string last_filename;
+    std::unique_ptr<IncrementalFileDumper> inc_dumper;
     while (1) {
         // We can't access string flags directly because it's thread-unsafe.
         std::string filename;
@@ -745,8 +833,22 @@ static void* dumping_thread(void*) {
             if (pos2 != std::string::npos) {
                 prefix.replace(pos2, 5/*<app>*/, command_name);
             }            
-            FileDumperGroup dumper(tabs, filename, prefix);
-            int nline = Variable::dump_exposed(&dumper, &options);
+            int nline = 0;
+            if (FLAGS_bvar_dump_incremental) {
+                if (inc_dumper == NULL ||
+                    !inc_dumper->same_files(tabs, filename, prefix)) {
+                    inc_dumper.reset(
+                        new IncrementalFileDumper(tabs, filename, prefix));
+                }
+                nline = inc_dumper->dump_changed(options);
+            } else {
+                inc_dumper.reset();
+                FileDumperGroup dumper(tabs, filename, prefix);
+                nline = Variable::dump_exposed(&dumper, &options);
+                if (!dumper.flush(false)) {
+                    nline = -1;
+                }
+            }
             if (nline < 0) {
                 LOG(ERROR) << "Fail to dump vars into " << filename;
             }
@@ -78,7 +78,10 @@ struct DumpOptions {
 struct SeriesOptions {
     SeriesOptions() : fixed_length(true), test_only(false) {}
     
-    bool fixed_length; // useless now
+    // Print the last 30 days, 24 hours, 60 minutes and 60 seconds. When it's
+    // false, compressed series(-bvar_compress_series) print all retained
+    // values instead.
+    bool fixed_length;
     bool test_only;
 };
 
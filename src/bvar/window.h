@@ -23,7 +23,7 @@
 #include <gflags/gflags_declare.h>
 #include "butil/logging.h"                         // LOG
 #include "bvar/detail/sampler.h"
-#include "bvar/detail/series.h"
+#include "bvar/detail/compressed_series.h"
 #include "bvar/variable.h"
 
 namespace bvar {
@@ -68,10 +68,12 @@ public:
                 _series.append(_owner->get_value());
             }
         }
-        void describe(std::ostream& os) { _series.describe(os, NULL); }
+        void describe(std::ostream& os, const SeriesOptions& options) {
+            _series.describe(os, NULL, options);
+        }
     private:
         WindowBase* _owner;
-        detail::Series<value_type, Op> _series;
+        detail::SeriesStore<value_type, Op> _series;
     };
     
     WindowBase(R* var, time_t window_size)
@@ -128,7 +130,7 @@ public:
             return 1;
         }
         if (!options.test_only) {
-            _series_sampler->describe(os);
+            _series_sampler->describe(os, options);
         }
         return 0;
     }
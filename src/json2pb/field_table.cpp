@@ -0,0 +1,164 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <pthread.h>
+#include <string.h>
+#include <map>
+#include <algorithm>
+#include <google/protobuf/descriptor.h>
+#include "butil/scoped_lock.h"
+#include "butil/thread_local.h"
+#include "encode_decode.h"
+#include "protobuf_map.h"
+#include "field_table.h"
+
+namespace json2pb {
+
+namespace {
+class NameLess {
+public:
+    explicit NameLess(const std::vector<JsonField>& fields) : _fields(&fields) {}
+    bool operator()(int i, int j) const {
+        const std::string& a = (*_fields)[i].name;
+        const std::string& b = (*_fields)[j].name;
+        if (a.size() != b.size()) {
+            return a.size() < b.size();
+        }
+        // Fields with same names are found in the order of conversions.
+        const int rc = memcmp(a.data(), b.data(), a.size());
+        return rc != 0 ? rc < 0 : i < j;
+    }
+private:
+    const std::vector<JsonField>* _fields;
+};
+} // namespace
+
+FieldTable::FieldTable(const google::protobuf::Message& prototype)
+    : _serializer(NULL)
+    , _generated_reflection(NULL) {
+    const google::protobuf::Reflection* reflection = prototype.GetReflection();
+    const google::protobuf::Descriptor* descriptor = prototype.GetDescriptor();
+    const JsonMessageHandler* handler = NULL;
+    if (descriptor->file()->pool() ==
+        google::protobuf::DescriptorPool::generated_pool()) {
+        handler = find_json_handler(descriptor->full_name());
+    }
+    if (handler) {
+        const google::protobuf::Message* generated_prototype =
+            google::protobuf::MessageFactory::generated_factory()
+            ->GetPrototype(descriptor);
+        if (generated_prototype) {
+            _generated_reflection = generated_prototype->GetReflection();
+            _serializer = handler->serialize;
+        } else {
+            handler = NULL;
+        }
+    }
+    std::vector<const google::protobuf::FieldDescriptor*> fields;
+    for (int i = 0; i < descriptor->extension_range_count(); ++i) {
+        const google::protobuf::Descriptor::ExtensionRange*
+            ext_range = descriptor->extension_range(i);
+        for (int tag_number = ext_range->start; tag_number < ext_range->end;
+             ++tag_number) {
+            const google::protobuf::FieldDescriptor* field =
+                reflection->FindKnownExtensionByNumber(tag_number);
+            if (field) {
+                fields.push_back(field);
+            }
+        }
+    }
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        fields.push_back(descriptor->field(i));
+    }
+    _fields.resize(fields.size());
+    for (size_t i = 0; i < fields.size(); ++i) {
+        JsonField& f = _fields[i];
+        f.field = fields[i];
+        if (!decode_name(f.field->name(), f.name)) {
+            f.name = f.field->name();
+        }
+        f.is_map = IsProtobufMap(f.field);
+        f.setter = NULL;
+        if (handler && !f.field->is_extension() &&
+            f.field->index() < handler->setter_count) {
+            f.setter = handler->setters[f.field->index()];
+        }
+        if (f.field->is_required()) {
+            _required.push_back(i);
+        }
+        _sorted.push_back(i);
+    }
+    std::sort(_sorted.begin(), _sorted.end(), NameLess(_fields));
+}
+
+int FieldTable::Find(const char* name, size_t len) const {
+    size_t lo = 0;
+    size_t hi = _sorted.size();
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        const std::string& s = _fields[_sorted[mid]].name;
+        int rc;
+        if (s.size() != len) {
+            rc = (s.size() < len ? -1 : 1);
+        } else {
+            rc = memcmp(s.data(), name, len);
+        }
+        if (rc < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < _sorted.size()) {
+        const std::string& s = _fields[_sorted[lo]].name;
+        if (s.size() == len && memcmp(s.data(), name, len) == 0) {
+            return _sorted[lo];
+        }
+    }
+    return -1;
+}
+
+// Tables are looked up for every converted message, check a small
+// thread-local cache before locking the global map.
+struct CachedFieldTable {
+    const google::protobuf::Descriptor* descriptor;
+    const FieldTable* table;
+};
+static const size_t TLS_TABLE_CACHE_SIZE = 64;
+static BAIDU_THREAD_LOCAL CachedFieldTable tls_table_cache[TLS_TABLE_CACHE_SIZE];
+
+static pthread_mutex_t s_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Never deleted since conversions may run during program termination.
+static std::map<const google::protobuf::Descriptor*, FieldTable*>* s_tables = NULL;
+
+const FieldTable* GetCachedFieldTable(const google::protobuf::Message& message) {
+    const google::protobuf::Descriptor* descriptor = message.GetDescriptor();
+    CachedFieldTable& cached = tls_table_cache[
+        (reinterpret_cast<uintptr_t>(descriptor) / sizeof(*descriptor))
+        % TLS_TABLE_CACHE_SIZE];
+    if (cached.descriptor == descriptor) {
+        return cached.table;
+    }
+    if (descriptor->file()->pool() !=
+        google::protobuf::DescriptorPool::generated_pool()) {
+        return NULL;
+    }
+    FieldTable* table = NULL;
+    {
+        BAIDU_SCOPED_LOCK(s_table_mutex);
+        if (s_tables == NULL) {
+            s_tables = new std::map<const google::protobuf::Descriptor*, FieldTable*>;
+        }
+        FieldTable*& t = (*s_tables)[descriptor];
+        if (t == NULL) {
+            // Extensions are registered during static initialization, which
+            // are all visible to conversions.
+            t = new FieldTable(message);
+        }
+        table = t;
+    }
+    cached.descriptor = descriptor;
+    cached.table = table;
+    return table;
+}
+
+} // namespace json2pb
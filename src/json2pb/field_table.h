@@ -0,0 +1,65 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#ifndef BRPC_JSON2PB_FIELD_TABLE_H
+#define BRPC_JSON2PB_FIELD_TABLE_H
+
+#include <string>
+#include <vector>
+#include <google/protobuf/message.h>
+#include "json2pb/json_handler.h"
+
+namespace json2pb {
+
+struct JsonField {
+    const google::protobuf::FieldDescriptor* field;
+    // Name of the field in json (decoded by decode_name).
+    std::string name;
+    // IsProtobufMap(field)
+    bool is_map;
+    // Generated setter of the field, NULL if absent.
+    JsonSetFieldFn setter;
+};
+
+// Fields of a message type in the order of conversions: known extensions
+// first, then fields in the order of declaration. Computing these for each
+// message being converted (especially probing every number inside extension
+// ranges) costs more than converting small messages.
+class FieldTable {
+public:
+    explicit FieldTable(const google::protobuf::Message& prototype);
+
+    size_t size() const { return _fields.size(); }
+    const JsonField& field(size_t i) const { return _fields[i]; }
+
+    // Indexes of required fields.
+    const std::vector<int>& required_fields() const { return _required; }
+
+    // Index of the field whose json name is `name', -1 if not found.
+    int Find(const char* name, size_t len) const;
+
+    // Generated serializer of the type, NULL if absent.
+    JsonSerializeFn serializer() const { return _serializer; }
+
+    // Generated functions can only be called with messages of generated
+    // classes rather than DynamicMessage of the same descriptor.
+    bool is_generated(const google::protobuf::Message& message) const
+    { return message.GetReflection() == _generated_reflection; }
+
+private:
+    std::vector<JsonField> _fields;
+    JsonSerializeFn _serializer;
+    const google::protobuf::Reflection* _generated_reflection;
+    std::vector<int> _required;
+    // Indexes of fields sorted by names.
+    std::vector<int> _sorted;
+};
+
+// Get the table of the type of `message'. Tables of generated types are
+// created once and cached forever. NULL is returned for other types
+// (e.g. from DynamicMessageFactory) whose descriptors may be destroyed,
+// create a FieldTable for the conversion instead.
+const FieldTable* GetCachedFieldTable(const google::protobuf::Message& message);
+
+} // namespace json2pb
+
+#endif  // BRPC_JSON2PB_FIELD_TABLE_H
@@ -0,0 +1,515 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// protoc-gen-json: generate functions converting messages from/to json
+// without reflection into *.pb.cc, which are registered to json2pb. Run it
+// along with the C++ code generator:
+//   protoc --cpp_out=DIR --plugin=protoc-gen-json=PATH --json_out=DIR X.proto
+
+#include <map>
+#include <set>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include "butil/string_printf.h"
+#include "json2pb/encode_decode.h"
+#include "json2pb/protobuf_map.h"
+
+namespace json2pb {
+
+typedef std::map<std::string, std::string> Vars;
+
+static std::string to_var_name(const std::string& name) {
+    std::string result = name;
+    for (size_t i = 0; i < result.size(); ++i) {
+        if (result[i] == '.') {
+            result[i] = '_';
+        }
+    }
+    return result;
+}
+
+static std::string to_cpp_name(const std::string& full_name) {
+    std::string cname = "::";
+    cname.reserve(full_name.size() + 8);
+    for (size_t i = 0; i < full_name.size(); ++i) {
+        if (full_name[i] == '.') {
+            cname.append("::", 2);
+        } else {
+            cname.push_back(full_name[i]);
+        }
+    }
+    return cname;
+}
+
+// Same as the C++ code generator of protobuf which appends '_' to names
+// of fields colliding with C++ keywords.
+static std::string field_name(const google::protobuf::FieldDescriptor* f) {
+    static const char* const s_keywords[] = {
+        "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand",
+        "bitor", "bool", "break", "case", "catch", "char", "class", "compl",
+        "const", "constexpr", "const_cast", "continue", "decltype",
+        "default", "delete", "do", "double", "dynamic_cast", "else", "enum",
+        "explicit", "export", "extern", "false", "float", "for", "friend",
+        "goto", "if", "inline", "int", "long", "mutable", "namespace", "new",
+        "noexcept", "not", "not_eq", "NULL", "operator", "or", "or_eq",
+        "private", "protected", "public", "register", "reinterpret_cast",
+        "return", "short", "signed", "sizeof", "static", "static_assert",
+        "static_cast", "struct", "switch", "template", "this",
+        "thread_local", "throw", "true", "try", "typedef", "typeid",
+        "typename", "union", "unsigned", "using", "virtual", "void",
+        "volatile", "wchar_t", "while", "xor", "xor_eq"
+    };
+    static const std::set<std::string> s_keyword_set(
+        s_keywords, s_keywords + sizeof(s_keywords) / sizeof(s_keywords[0]));
+    std::string name = f->lowercase_name();
+    if (s_keyword_set.count(name)) {
+        name.push_back('_');
+    }
+    return name;
+}
+
+// Prefix of IsValid/Name functions of enums, e.g. "::ns::Msg::Type_".
+static std::string enum_prefix(const google::protobuf::EnumDescriptor* e) {
+    std::string prefix;
+    if (e->containing_type()) {
+        prefix = to_cpp_name(e->containing_type()->full_name());
+    } else if (!e->file()->package().empty()) {
+        prefix = to_cpp_name(e->file()->package());
+    }
+    return prefix + "::" + e->name();
+}
+
+static std::string c_escape(const std::string& s) {
+    std::string result;
+    for (size_t i = 0; i < s.size(); ++i) {
+        const unsigned char c = s[i];
+        if (isalnum(c) || c == '_' || c == '-' || c == ' ') {
+            result.push_back(c);
+        } else {
+            butil::string_appendf(&result, "\\%03o", (int)c);
+        }
+    }
+    return result;
+}
+
+static std::string json_name(const google::protobuf::FieldDescriptor* f) {
+    std::string decoded;
+    if (decode_name(f->name(), decoded)) {
+        return decoded;
+    }
+    return f->name();
+}
+
+static bool is_real_map(const google::protobuf::FieldDescriptor* f) {
+    return f->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE &&
+        f->message_type()->options().map_entry();
+}
+
+// Messages of proto3 (implicit presence) or with map<> fields whose
+// ordering of entries follows internal hash maps are converted by
+// reflection, so are extensions.
+static bool can_generate_serializer(const google::protobuf::Descriptor* d) {
+    if (d->extension_range_count() != 0) {
+        return false;
+    }
+    for (int i = 0; i < d->field_count(); ++i) {
+        if (is_real_map(d->field(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool can_generate(const google::protobuf::Descriptor* d) {
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+    if (d->file()->syntax() != google::protobuf::FileDescriptor::SYNTAX_PROTO2) {
+        return false;
+    }
+#endif
+    return !d->options().map_entry();
+}
+
+static void generate_setter(const google::protobuf::FieldDescriptor* f,
+                            Vars vars, google::protobuf::io::Printer& impl) {
+    vars["lcfield"] = field_name(f);
+    vars["op"] = (f->is_repeated() ? "add" : "set");
+    impl.Print(vars,
+               "static bool set_$vmsg$_$lcfield$_json(\n"
+               "    ::google::protobuf::Message* msg_base,\n"
+               "    const BUTIL_RAPIDJSON_NAMESPACE::Value& value) {\n");
+    switch (f->cpp_type()) {
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+        vars["jtype"] = "Int";
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+        vars["jtype"] = "Uint";
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+        vars["jtype"] = "Int64";
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+        vars["jtype"] = "Uint64";
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+        vars["jtype"] = "Bool";
+        break;
+    default:
+        break;
+    }
+    switch (f->cpp_type()) {
+    case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+    case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+        // Strings like "NaN" are converted by reflection.
+        vars["ctype"] = (f->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_FLOAT
+                         ? "float" : "double");
+        impl.Print(vars,
+                   "  if (!value.IsNumber()) {\n"
+                   "    return false;\n"
+                   "  }\n"
+                   "  static_cast< $msg$*>(msg_base)->$op$_$lcfield$(\n"
+                   "      static_cast< $ctype$>(value.GetDouble()));\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+        impl.Print(vars,
+                   "  if (!value.IsString()) {\n"
+                   "    return false;\n"
+                   "  }\n"
+                   "  static_cast< $msg$*>(msg_base)->$op$_$lcfield$(\n"
+                   "      value.GetString(), value.GetStringLength());\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+        // Names of enums are converted by reflection.
+        vars["enum"] = enum_prefix(f->enum_type());
+        impl.Print(vars,
+                   "  if (!value.IsInt() || !$enum$_IsValid(value.GetInt())) {\n"
+                   "    return false;\n"
+                   "  }\n"
+                   "  static_cast< $msg$*>(msg_base)->$op$_$lcfield$(\n"
+                   "      static_cast< $enum$>(value.GetInt()));\n");
+        break;
+    default:
+        impl.Print(vars,
+                   "  if (!value.Is$jtype$()) {\n"
+                   "    return false;\n"
+                   "  }\n"
+                   "  static_cast< $msg$*>(msg_base)->$op$_$lcfield$(value.Get$jtype$());\n");
+        break;
+    }
+    impl.Print("  return true;\n"
+               "}\n\n");
+}
+
+static bool has_setter(const google::protobuf::FieldDescriptor* f) {
+    // Messages are converted field by field. Bytes may be encoded with
+    // base64 according to Json2PbOptions.
+    return f->cpp_type() != google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE &&
+        f->type() != google::protobuf::FieldDescriptor::TYPE_BYTES;
+}
+
+// Write value(s) of `f' in `obj' which is an expression of the message.
+static void generate_write_value(const google::protobuf::FieldDescriptor* f,
+                                 const std::string& obj,
+                                 google::protobuf::io::Printer& impl) {
+    Vars vars;
+    vars["obj"] = obj;
+    vars["lcfield"] = field_name(f);
+    if (f->is_repeated()) {
+        impl.Print(vars,
+                   "w.StartArray();\n"
+                   "for (int i = 0; i < $obj$.$lcfield$_size(); ++i) {\n");
+        vars["value"] = obj + "." + field_name(f) + "(i)";
+        impl.Indent();
+    } else {
+        vars["value"] = obj + "." + field_name(f) + "()";
+    }
+    switch (f->cpp_type()) {
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+        impl.Print(vars, "w.Int($value$);\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+        impl.Print(vars, "w.Uint($value$);\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+        impl.Print(vars, "w.Int64($value$);\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+        impl.Print(vars, "w.Uint64($value$);\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+        impl.Print(vars, "w.Bool($value$);\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+    case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+        impl.Print(vars, "w.Double($value$);\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+        if (f->type() == google::protobuf::FieldDescriptor::TYPE_BYTES) {
+            impl.Print(vars, "w.Bytes($value$);\n");
+        } else {
+            impl.Print(vars, "w.String($value$);\n");
+        }
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+        vars["enum"] = enum_prefix(f->enum_type());
+        impl.Print(vars,
+                   "if (w.options().enum_option == ::json2pb::OUTPUT_ENUM_BY_NAME) {\n"
+                   "  w.String($enum$_Name($value$));\n"
+                   "} else {\n"
+                   "  w.Int($value$);\n"
+                   "}\n");
+        break;
+    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+        impl.Print(vars,
+                   "if (!w.Message($value$)) {\n"
+                   "  return false;\n"
+                   "}\n");
+        break;
+    }
+    if (f->is_repeated()) {
+        impl.Outdent();
+        impl.Print("}\n"
+                   "w.EndArray();\n");
+    }
+}
+
+static void generate_write_key(const google::protobuf::FieldDescriptor* f,
+                               google::protobuf::io::Printer& impl) {
+    const std::string name = json_name(f);
+    impl.Print("w.Key(\"$name$\", $len$);\n",
+               "name", c_escape(name),
+               "len", butil::string_printf("%d", (int)name.size()));
+}
+
+static void generate_write_field(const google::protobuf::FieldDescriptor* f,
+                                 google::protobuf::io::Printer& impl) {
+    Vars vars;
+    vars["lcfield"] = field_name(f);
+    vars["index"] = butil::string_printf("%d", f->index());
+    if (f->is_repeated()) {
+        impl.Print(vars, "if (msg.$lcfield$_size() != 0) {\n");
+    } else {
+        impl.Print(vars, "if (msg.has_$lcfield$()) {\n");
+    }
+    impl.Indent();
+    generate_write_key(f, impl);
+    generate_write_value(f, "msg", impl);
+    impl.Outdent();
+    if (f->is_required()) {
+        impl.Print(vars,
+                   "} else {\n"
+                   "  return w.MissingRequired(msg.descriptor()->field($index$));\n"
+                   "}\n");
+    } else {
+        impl.Print("}\n");
+    }
+}
+
+static void generate_write_map(const google::protobuf::FieldDescriptor* f,
+                               google::protobuf::io::Printer& impl) {
+    Vars vars;
+    vars["lcfield"] = field_name(f);
+    vars["entry"] = to_cpp_name(f->message_type()->full_name());
+    generate_write_key(f, impl);
+    impl.Print(vars,
+               "w.StartObject();\n"
+               "for (int i = 0; i < msg.$lcfield$_size(); ++i) {\n"
+               "  const $entry$& entry = msg.$lcfield$(i);\n"
+               "  w.Key(entry.key().data(), entry.key().size());\n");
+    impl.Indent();
+    generate_write_value(f->message_type()->field(VALUE_INDEX), "entry", impl);
+    impl.Outdent();
+    impl.Print("}\n"
+               "w.EndObject();\n");
+}
+
+// Keep the output same with PbToJsonConverter.
+static void generate_serializer(const google::protobuf::Descriptor* d,
+                                const Vars& vars,
+                                google::protobuf::io::Printer& impl) {
+    impl.Print(vars,
+               "static bool serialize_$vmsg$_json(\n"
+               "    const ::google::protobuf::Message& msg_base,\n"
+               "    ::json2pb::JsonWriter& w) {\n"
+               "  const $msg$& msg = static_cast<const $msg$&>(msg_base);\n"
+               "  w.StartObject();\n");
+    impl.Indent();
+    bool has_map = false;
+    for (int i = 0; i < d->field_count(); ++i) {
+        const google::protobuf::FieldDescriptor* f = d->field(i);
+        if (IsProtobufMap(f)) {
+            has_map = true;
+            impl.Print("if (!w.options().enable_protobuf_map) {\n");
+            impl.Indent();
+            generate_write_field(f, impl);
+            impl.Outdent();
+            impl.Print("}\n");
+        } else {
+            generate_write_field(f, impl);
+        }
+    }
+    if (has_map) {
+        impl.Print("if (w.options().enable_protobuf_map) {\n");
+        impl.Indent();
+        for (int i = 0; i < d->field_count(); ++i) {
+            if (IsProtobufMap(d->field(i))) {
+                generate_write_map(d->field(i), impl);
+            }
+        }
+        impl.Outdent();
+        impl.Print("}\n");
+    }
+    impl.Outdent();
+    impl.Print("  w.EndObject();\n"
+               "  return true;\n"
+               "}\n\n");
+}
+
+static void generate_message(const google::protobuf::Descriptor* d,
+                             std::vector<const google::protobuf::Descriptor*>* generated,
+                             google::protobuf::io::Printer& impl) {
+    for (int i = 0; i < d->nested_type_count(); ++i) {
+        generate_message(d->nested_type(i), generated, impl);
+    }
+    if (!can_generate(d)) {
+        return;
+    }
+    generated->push_back(d);
+    Vars vars;
+    vars["vmsg"] = to_var_name(d->full_name());
+    vars["msg"] = to_cpp_name(d->full_name());
+    impl.Print(vars, "// ==== $msg$ ====\n");
+    for (int i = 0; i < d->field_count(); ++i) {
+        if (has_setter(d->field(i))) {
+            generate_setter(d->field(i), vars, impl);
+        }
+    }
+    impl.Print(vars,
+               "static const ::json2pb::JsonSetFieldFn $vmsg$_json_setters[] = {\n");
+    for (int i = 0; i < d->field_count(); ++i) {
+        const google::protobuf::FieldDescriptor* f = d->field(i);
+        if (has_setter(f)) {
+            impl.Print("  set_$vmsg$_$lcfield$_json,\n",
+                       "vmsg", vars["vmsg"], "lcfield", field_name(f));
+        } else {
+            impl.Print("  NULL,\n");
+        }
+    }
+    impl.Print("  NULL\n"
+               "};\n\n");
+    if (can_generate_serializer(d)) {
+        generate_serializer(d, vars, impl);
+    }
+}
+
+static std::string protobuf_style_normalize_filename(const std::string & fname) {
+    std::string norm_fname;
+    norm_fname.reserve(fname.size() + 10);
+    for (size_t i = 0; i < fname.size(); ++i) {
+        if (fname[i] == '_' || isdigit(fname[i]) || isalpha(fname[i])) {
+            norm_fname.push_back(fname[i]);
+        } else {
+            char symbol[4];
+            snprintf(symbol, sizeof(symbol), "_%02x", (int)fname[i]);
+            norm_fname.append(symbol, 3);
+        }
+    }
+    return norm_fname;
+}
+
+static void generate_registration(
+    const google::protobuf::FileDescriptor* file,
+    const std::vector<const google::protobuf::Descriptor*>& generated,
+    google::protobuf::io::Printer& impl) {
+    const std::string norm_fname = protobuf_style_normalize_filename(file->name());
+    impl.Print(
+        "// register all json handlers\n"
+        "struct RegisterJsonFunctions_$norm_fname$ {\n"
+        "  RegisterJsonFunctions_$norm_fname$() {\n"
+        , "norm_fname", norm_fname);
+    impl.Indent();
+    impl.Indent();
+    for (size_t i = 0; i < generated.size(); ++i) {
+        const google::protobuf::Descriptor* d = generated[i];
+        Vars vars;
+        vars["vmsg"] = to_var_name(d->full_name());
+        vars["fmsg"] = d->full_name();
+        vars["serialize"] = (can_generate_serializer(d)
+                             ? "serialize_" + vars["vmsg"] + "_json" : "NULL");
+        vars["field_count"] = butil::string_printf("%d", d->field_count());
+        impl.Print(vars,
+                   "{\n"
+                   "  const ::json2pb::JsonMessageHandler handler = {\n"
+                   "    $serialize$, $vmsg$_json_setters, $field_count$\n"
+                   "  };\n"
+                   "  ::json2pb::register_json_handler_or_die(\"$fmsg$\", handler);\n"
+                   "}\n");
+    }
+    impl.Outdent();
+    impl.Outdent();
+    impl.Print("  }\n"
+               "} static_init_json_$suffix$;\n"
+               , "suffix", norm_fname);
+}
+
+class ProtobufToJson : public google::protobuf::compiler::CodeGenerator {
+public:
+    bool Generate(const google::protobuf::FileDescriptor* file,
+                  const std::string& parameter,
+                  google::protobuf::compiler::GeneratorContext*,
+                  std::string* error) const;
+};
+
+bool ProtobufToJson::Generate(const google::protobuf::FileDescriptor* file,
+                              const std::string& /*parameter*/,
+                              google::protobuf::compiler::GeneratorContext* ctx,
+                              std::string* error) const {
+    std::string cpp_name = file->name();
+    const size_t pos = cpp_name.find_last_of('.');
+    if (pos == std::string::npos) {
+        ::butil::string_printf(error, "Bad filename=%s", cpp_name.c_str());
+        return false;
+    }
+    cpp_name.resize(pos);
+    cpp_name.append(".pb.cc");
+
+    google::protobuf::io::Printer inc_printer(
+        ctx->OpenForInsert(cpp_name, "includes"), '$');
+    inc_printer.Print("#include <json2pb/json_handler.h>\n");
+
+    google::protobuf::io::Printer impl_printer(
+        ctx->OpenForInsert(cpp_name, "global_scope"), '$');
+    impl_printer.Print(
+        "\n// ==== functions generated by brpc/json2pb/protoc-gen-json ====\n");
+    std::vector<const google::protobuf::Descriptor*> generated;
+    for (int i = 0; i < file->message_type_count(); ++i) {
+        generate_message(file->message_type(i), &generated, impl_printer);
+    }
+    generate_registration(file, generated, impl_printer);
+    if (inc_printer.failed() || impl_printer.failed()) {
+        ::butil::string_printf(error, "Fail to generate json functions for %s",
+                               cpp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace json2pb
+
+int main(int argc, char* argv[]) {
+    ::json2pb::ProtobufToJson generator;
+    return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
@@ -0,0 +1,37 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <map>
+#include "butil/logging.h"
+#include "json_handler.h"
+
+namespace json2pb {
+
+static pthread_once_t s_init_json_handlers_once = PTHREAD_ONCE_INIT;
+static std::map<std::string, JsonMessageHandler>* s_json_handlers = NULL;
+static void init_json_handlers() {
+    s_json_handlers = new std::map<std::string, JsonMessageHandler>;
+}
+
+void register_json_handler_or_die(const std::string& full_name,
+                                  const JsonMessageHandler& handler) {
+    pthread_once(&s_init_json_handlers_once, init_json_handlers);
+    if (!s_json_handlers->insert(std::make_pair(full_name, handler)).second) {
+        LOG(ERROR) << full_name << " was registered before!";
+        exit(1);
+    }
+}
+
+const JsonMessageHandler* find_json_handler(const std::string& full_name) {
+    pthread_once(&s_init_json_handlers_once, init_json_handlers);
+    // Handlers are registered before main() and never changed after.
+    std::map<std::string, JsonMessageHandler>::const_iterator
+        it = s_json_handlers->find(full_name);
+    if (it == s_json_handlers->end()) {
+        return NULL;
+    }
+    return &it->second;
+}
+
+} // namespace json2pb
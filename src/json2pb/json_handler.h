@@ -0,0 +1,76 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#ifndef BRPC_JSON2PB_JSON_HANDLER_H
+#define BRPC_JSON2PB_JSON_HANDLER_H
+
+#include <stdint.h>
+#include <string>
+#include <google/protobuf/message.h>
+#include "json2pb/pb_to_json.h"
+#include "json2pb/rapidjson.h"
+
+// Functions generated by protoc-gen-json (src/json2pb/generator.cpp) which
+// convert messages of a type without reflection. They're registered before
+// main() and used by JsonToProtoMessage/ProtoMessageToJson automatically,
+// types without generated functions are converted by reflection.
+
+namespace json2pb {
+
+// Writer of json for generated serializers.
+class JsonWriter {
+public:
+    virtual ~JsonWriter() {}
+    virtual const Pb2JsonOptions& options() const = 0;
+    virtual void StartObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void StartArray() = 0;
+    virtual void EndArray() = 0;
+    virtual void Key(const char* name, size_t size) = 0;
+    virtual void Bool(bool b) = 0;
+    virtual void Int(int i) = 0;
+    virtual void Uint(unsigned u) = 0;
+    virtual void Int64(int64_t i) = 0;
+    virtual void Uint64(uint64_t u) = 0;
+    virtual void Double(double d) = 0;
+    virtual void String(const std::string& str) = 0;
+    // Write a field of type bytes, encoded according to options().
+    virtual void Bytes(const std::string& bytes) = 0;
+    // Write `message' as a json object, by its generated serializer or
+    // reflection. Returns false on error.
+    virtual bool Message(const google::protobuf::Message& message) = 0;
+    // Fail the conversion. Always returns false.
+    virtual bool MissingRequired(const google::protobuf::FieldDescriptor* field) = 0;
+};
+
+// Set `value' to a field of `message', or add it when the field is repeated.
+// Returns false without touching `message' if `value' does not match the
+// field, in which case the value is converted(and errors are reported) by
+// reflection.
+typedef bool (*JsonSetFieldFn)(google::protobuf::Message* message,
+                               const BUTIL_RAPIDJSON_NAMESPACE::Value& value);
+
+// Write `message' as a json object with `writer'. Returns false on error.
+typedef bool (*JsonSerializeFn)(const google::protobuf::Message& message,
+                                JsonWriter& writer);
+
+struct JsonMessageHandler {
+    // NULL if the type is serialized by reflection.
+    JsonSerializeFn serialize;
+
+    // Setters indexed by FieldDescriptor::index(), NULL for fields set by
+    // reflection.
+    const JsonSetFieldFn* setters;
+    int setter_count;
+};
+
+// Called by code generated by protoc-gen-json before main().
+void register_json_handler_or_die(const std::string& full_name,
+                                  const JsonMessageHandler& handler);
+
+// Find the registered handler by `full_name' e.g. "example.EchoRequest".
+// Returns NULL if the handler was not registered.
+const JsonMessageHandler* find_json_handler(const std::string& full_name);
+
+} // namespace json2pb
+
+#endif  // BRPC_JSON2PB_JSON_HANDLER_H
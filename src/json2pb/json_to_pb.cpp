@@ -11,10 +11,10 @@
 #include <google/protobuf/descriptor.h>
 #include "json_to_pb.h"
 #include "zero_copy_stream_reader.h"       // ZeroCopyStreamReader
-#include "encode_decode.h"
 #include "butil/base64.h"
 #include "butil/string_printf.h"
 #include "protobuf_map.h"
+#include "field_table.h"
 #include "rapidjson.h"
 
 #define J2PERROR(perr, fmt, ...)                                        \
@@ -35,12 +35,6 @@ Json2PbOptions::Json2PbOptions()
 #endif
 }
 
-enum MatchType { 
-    TYPE_MATCH = 0x00, 
-    REQUIRED_OR_REPEATED_TYPE_MISMATCH = 0x01, 
-    OPTIONAL_TYPE_MISMATCH = 0x02 
-};
- 
 static void string_append_value(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
                                 std::string* output) {
     if (value.IsNull()) {
@@ -192,11 +186,6 @@ inline bool convert_enum_type(const BUTIL_RAPIDJSON_NAMESPACE::Value&item, bool
     return true;
 }
 
-bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
-                             google::protobuf::Message* message,
-                             const Json2PbOptions& options,
-                             std::string* err);
-
 //Json value to protobuf convert rules for type:
 //Json value type                 Protobuf type                convert rules
 //int                             int uint int64 uint64        valid convert is available
@@ -204,21 +193,85 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
 //int64                           int uint int64 uint64        valid convert is available
 //uint64                          int uint int64 uint64        valid convert is available
 //int uint int64 uint64           float double                 available
-//"NaN" "Infinity" "-Infinity"    float double                 only "NaN" "Infinity" "-Infinity" is available    
+//"NaN" "Infinity" "-Infinity"    float double                 only "NaN" "Infinity" "-Infinity" is available
 //int                             enum                         valid enum number value is available
-//string                          enum                         valid enum name value is available         
+//string                          enum                         valid enum name value is available
 //other mismatch type convertion will be regarded as error.
-#define J2PCHECKTYPE(value, cpptype, jsontype) ({                   \
-            MatchType match_type = TYPE_MATCH;                      \
-            if (!value.Is##jsontype()) {                            \
-                match_type = OPTIONAL_TYPE_MISMATCH;                \
-                if (!value_invalid(field, #cpptype, value, err)) {  \
-                    return false;                                   \
-                }                                                   \
-            }                                                       \
-            match_type;                                             \
-        })
+//
+//Set `value' to `field' or add it into `field' when `repeated' is true.
+//`value' is never an object or an array with items, which are converted
+//by JsonToPbHandler.
+static bool JsonValueToProtoItem(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
+                                 bool repeated,
+                                 const google::protobuf::FieldDescriptor* field,
+                                 google::protobuf::Message* message,
+                                 const Json2PbOptions& options,
+                                 std::string* err) {
+    const google::protobuf::Reflection* reflection = message->GetReflection();
+    switch (field->cpp_type()) {
+#define CASE_FIELD_TYPE(cpptype, method, jsontype)                      \
+    case google::protobuf::FieldDescriptor::CPPTYPE_##cpptype:          \
+        if (!value.Is##jsontype()) {                                    \
+            return value_invalid(field, #cpptype, value, err);          \
+        }                                                               \
+        if (repeated) {                                                 \
+            reflection->Add##method(message, field, value.Get##jsontype()); \
+        } else {                                                        \
+            reflection->Set##method(message, field, value.Get##jsontype()); \
+        }                                                               \
+        return true;
+        CASE_FIELD_TYPE(INT32,  Int32,  Int);
+        CASE_FIELD_TYPE(UINT32, UInt32, Uint);
+        CASE_FIELD_TYPE(BOOL,   Bool,   Bool);
+        CASE_FIELD_TYPE(INT64,  Int64,  Int64);
+        CASE_FIELD_TYPE(UINT64, UInt64, Uint64);
+#undef CASE_FIELD_TYPE
+
+    case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+        return convert_float_type(value, repeated, message, field,
+                                  reflection, err);
 
+    case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+        return convert_double_type(value, repeated, message, field,
+                                   reflection, err);
+
+    case google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+        if (!value.IsString()) {
+            return value_invalid(field, "string", value, err);
+        }
+        const butil::StringPiece str(value.GetString(), value.GetStringLength());
+        std::string str_decoded;
+        if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
+            options.base64_to_bytes) {
+            if (!butil::Base64Decode(str, &str_decoded)) {
+                J2PERROR(err, "Fail to decode base64 string=%s",
+                         str.as_string().c_str());
+                return false;
+            }
+        } else {
+            str.CopyToString(&str_decoded);
+        }
+        if (repeated) {
+            reflection->AddString(message, field, str_decoded);
+        } else {
+            reflection->SetString(message, field, str_decoded);
+        }
+        return true;
+    }
+
+    case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+        return convert_enum_type(value, repeated, message, field,
+                                 reflection, err);
+
+    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+        // Only items of repeated fields, objects are converted separately.
+        return value_invalid(field, "message", value, err);
+    }
+    return true;
+}
+
+//Convert `value' to `field' which is the value of a member in the json
+//object. Same as above, `value' is never an object or an array with items.
 static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
                                   const google::protobuf::FieldDescriptor* field,
                                   google::protobuf::Message* message,
@@ -231,267 +284,496 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
         }
         return true;
     }
-        
+
     if (field->is_repeated()) {
-        if (!value.IsArray()) {
-            J2PERROR(err, "Invalid value for repeated field: %s",
-                     field->full_name().c_str());
-            return false;
-        }
-    } 
+        J2PERROR(err, "Invalid value for repeated field: %s",
+                 field->full_name().c_str());
+        return false;
+    }
 
-    const google::protobuf::Reflection* reflection = message->GetReflection();
-    switch (field->cpp_type()) {
-#define CASE_FIELD_TYPE(cpptype, method, jsontype)                      \
-        case google::protobuf::FieldDescriptor::CPPTYPE_##cpptype: {                      \
-            if (field->is_repeated()) {                                 \
-                const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();          \
-                for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) { \
-                    const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];       \
-                    if (TYPE_MATCH == J2PCHECKTYPE(item, cpptype, jsontype)) { \
-                        reflection->Add##method(message, field, item.Get##jsontype()); \
-                    }                                                   \
-                }                                                       \
-            } else if (TYPE_MATCH == J2PCHECKTYPE(value, cpptype, jsontype)) { \
-                reflection->Set##method(message, field, value.Get##jsontype()); \
-            }                                                           \
-            break;                                                      \
-        }                                                           
-        CASE_FIELD_TYPE(INT32,  Int32,  Int);
-        CASE_FIELD_TYPE(UINT32, UInt32, Uint);
-        CASE_FIELD_TYPE(BOOL,   Bool,   Bool);
-        CASE_FIELD_TYPE(INT64,  Int64,  Int64);
-        CASE_FIELD_TYPE(UINT64, UInt64, Uint64);
-#undef CASE_FIELD_TYPE
+    if (field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+        message->GetReflection()->MutableMessage(message, field);
+        J2PERROR(err, "`json_value' is not a json object");
+        return false;
+    }
+    return JsonValueToProtoItem(value, false, field, message, options, err);
+}
 
-    case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:  
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_float_type(item, true, message, field,
-                                        reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_float_type(value, false, message, field,
-                                       reflection, err)) {
-            return false;
+// Convert events of rapidjson::Reader to the message directly instead of
+// parsing the json into a Document first.
+// Errors are the same as converting a Document: fields of a message are
+// converted in the order of FieldTable and the conversion stops at the
+// first fatal error. Since members of json objects come in arbitrary order,
+// errors of fields are saved until the end of the object and merged in the
+// order of fields.
+class JsonToPbHandler {
+public:
+    JsonToPbHandler(google::protobuf::Message* message,
+                    const Json2PbOptions& options, std::string* err)
+        : _message(message), _options(options), _err(err)
+        , _depth(0), _skip_depth(0), _succeeded(false) {}
+
+    ~JsonToPbHandler() {
+        // Frames left on parsing errors.
+        for (size_t i = 0; i < _depth; ++i) {
+            delete _frames[i].owned_table;
         }
-        break;
-
-    case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: 
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_double_type(item, true, message, field,
-                                         reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_double_type(value, false, message, field,
-                                        reflection, err)) {
+    }
+
+    // True if the json was converted successfully.
+    bool succeeded() const { return _succeeded; }
+
+    bool Null() {
+        BUTIL_RAPIDJSON_NAMESPACE::Value v;
+        return OnValue(v);
+    }
+    bool Bool(bool b) {
+        BUTIL_RAPIDJSON_NAMESPACE::Value v(b);
+        return OnValue(v);
+    }
+    bool AddInt(int i) {
+        BUTIL_RAPIDJSON_NAMESPACE::Value v(i);
+        return OnValue(v);
+    }
+    bool AddUint(unsigned i) {
+        BUTIL_RAPIDJSON_NAMESPACE::Value v(i);
+        return OnValue(v);
+    }
+    bool AddInt64(int64_t i) {
+        BUTIL_RAPIDJSON_NAMESPACE::Value v(i);
+        return OnValue(v);
+    }
+    bool AddUint64(uint64_t i) {
+        BUTIL_RAPIDJSON_NAMESPACE::Value v(i);
+        return OnValue(v);
+    }
+    bool Double(double d) {
+        BUTIL_RAPIDJSON_NAMESPACE::Value v(d);
+        return OnValue(v);
+    }
+    bool String(const char* str, BUTIL_RAPIDJSON_NAMESPACE::SizeType length,
+                bool /*copy*/) {
+        // `str' ends with '\0' and is valid during the call.
+        BUTIL_RAPIDJSON_NAMESPACE::Value v(
+            BUTIL_RAPIDJSON_NAMESPACE::StringRef(str, length));
+        return OnValue(v);
+    }
+    bool StartObject();
+    bool Key(const char* str, BUTIL_RAPIDJSON_NAMESPACE::SizeType length,
+             bool copy);
+    bool EndObject(BUTIL_RAPIDJSON_NAMESPACE::SizeType member_count);
+    bool StartArray();
+    bool EndArray(BUTIL_RAPIDJSON_NAMESPACE::SizeType element_count);
+
+private:
+    enum FrameType {
+        FRAME_MESSAGE,    // a json object converted to a message
+        FRAME_ARRAY,      // a json array converted to a repeated field
+        FRAME_MAP         // a json object converted to a map field
+    };
+
+    struct Frame {
+        FrameType type;
+        google::protobuf::Message* message;
+        // FRAME_MESSAGE
+        const FieldTable* table;
+        FieldTable* owned_table;
+        // Index of the field of the current member, -1 to ignore the member.
+        int index;
+        // Generated setters of the table are usable.
+        bool generated;
+        std::vector<bool> seen;
+        // Errors of fields, resized to table->size() at the first error.
+        std::vector<std::string> field_errors;
+        std::vector<bool> field_fatal;
+        // FRAME_ARRAY/FRAME_MAP
+        const google::protobuf::FieldDescriptor* field;
+        const google::protobuf::FieldDescriptor* key_desc;
+        const google::protobuf::FieldDescriptor* value_desc;
+        // Generated setter of items of FRAME_ARRAY.
+        JsonSetFieldFn setter;
+        // Entry of the current member of FRAME_MAP, NULL to ignore.
+        google::protobuf::Message* entry;
+        // Items(entries) after a fatal error are ignored.
+        bool failed;
+        // Errors of the frame.
+        std::string error;
+    };
+
+    // Where the value being parsed goes.
+    struct Target {
+        google::protobuf::Message* message;
+        const google::protobuf::FieldDescriptor* field;
+        // Added as an item of the repeated field.
+        bool item;
+        bool is_map;
+        // Generated setter of the field, adding items if the field is
+        // repeated.
+        JsonSetFieldFn setter;
+    };
+
+    bool OnValue(const BUTIL_RAPIDJSON_NAMESPACE::Value& value);
+    // Convert a value of the target which is not handled by frames.
+    void ConvertValue(const Target& t,
+                      const BUTIL_RAPIDJSON_NAMESPACE::Value& value);
+    bool GetTarget(Target* t) const;
+    Frame& PushFrame(FrameType type, google::protobuf::Message* message);
+    void PushMessage(google::protobuf::Message* message);
+    bool FinishMessage(Frame& f, std::string* err) const;
+    // Merge the result of a value into the parent frame.
+    void SetResult(bool ok, const std::string* error);
+
+    google::protobuf::Message* _message;
+    const Json2PbOptions& _options;
+    std::string* _err;
+    // Frames are reused(with capacities of containers) by later objects
+    // and arrays at the same depth.
+    std::vector<Frame> _frames;
+    size_t _depth;
+    // >0 when the current value is ignored.
+    int _skip_depth;
+    bool _succeeded;
+    std::string _scratch;
+};
+
+bool JsonToPbHandler::OnValue(const BUTIL_RAPIDJSON_NAMESPACE::Value& value) {
+    if (_skip_depth) {
+        return true;
+    }
+    if (_depth == 0) {
+        // The root is not an object.
+        std::string* err = &_scratch;
+        err->clear();
+        J2PERROR(err, "`json_value' is not a json object");
+        SetResult(false, err);
+        return true;
+    }
+    Target t;
+    if (GetTarget(&t)) {
+        ConvertValue(t, value);
+    }
+    return true;
+}
+
+void JsonToPbHandler::ConvertValue(
+    const Target& t, const BUTIL_RAPIDJSON_NAMESPACE::Value& value) {
+    if (t.setter != NULL && t.item == t.field->is_repeated() &&
+        t.setter(t.message, value)) {
+        return;
+    }
+    std::string* err = NULL;
+    if (_err) {
+        _scratch.clear();
+        err = &_scratch;
+    }
+    bool ok;
+    if (t.item) {
+        ok = JsonValueToProtoItem(value, true, t.field, t.message,
+                                  _options, err);
+    } else {
+        ok = JsonValueToProtoField(value, t.field, t.message, _options, err);
+    }
+    SetResult(ok, err);
+}
+
+bool JsonToPbHandler::GetTarget(Target* t) const {
+    const Frame& f = _frames[_depth - 1];
+    switch (f.type) {
+    case FRAME_MESSAGE:
+        if (f.index < 0) {
             return false;
         }
-        break;
-        
-    case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, string, String)) { 
-                    std::string str(item.GetString(), item.GetStringLength());
-                    if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
-                        options.base64_to_bytes) {
-                        std::string str_decoded;
-                        if (!butil::Base64Decode(str, &str_decoded)) {
-                            J2PERROR(err, "Fail to decode base64 string=%s", str.c_str());
-                            return false;
-                        }
-                        str = str_decoded;
-                    }
-                    reflection->AddString(message, field, str);
-                }  
-            }
-        } else if (TYPE_MATCH == J2PCHECKTYPE(value, string, String)) {
-            std::string str(value.GetString(), value.GetStringLength());
-            if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
-                options.base64_to_bytes) {
-                std::string str_decoded;
-                if (!butil::Base64Decode(str, &str_decoded)) {
-                    J2PERROR(err, "Fail to decode base64 string=%s", str.c_str());
-                    return false;
-                }
-                str = str_decoded;
-            }
-            reflection->SetString(message, field, str);
-        }
-        break;
-
-    case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_enum_type(item, true, message, field,
-                                       reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_enum_type(value, false, message, field,
-                                      reflection, err)) {
+        t->message = f.message;
+        t->field = f.table->field(f.index).field;
+        t->item = false;
+        t->is_map = f.table->field(f.index).is_map;
+        t->setter = (f.generated ? f.table->field(f.index).setter : NULL);
+        return true;
+    case FRAME_ARRAY:
+        if (f.failed) {
             return false;
         }
-        break;
-        
-    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, message, Object)) { 
-                    if (!JsonValueToProtoMessage(
-                            item, reflection->AddMessage(message, field), options, err)) {
-                        return false;
-                    }
-                } 
-            }
-        } else if (!JsonValueToProtoMessage(
-            value, reflection->MutableMessage(message, field), options, err)) {
+        t->message = f.message;
+        t->field = f.field;
+        t->item = true;
+        t->is_map = false;
+        t->setter = f.setter;
+        return true;
+    case FRAME_MAP:
+        if (f.entry == NULL) {
             return false;
         }
-        break;
+        // Map values are not converted as maps again.
+        t->message = f.entry;
+        t->field = f.value_desc;
+        t->item = false;
+        t->is_map = false;
+        t->setter = NULL;
+        return true;
     }
-    return true;
+    return false;
 }
 
-bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
-                       const google::protobuf::FieldDescriptor* map_desc,
-                       google::protobuf::Message* message,
-                       const Json2PbOptions& options,
-                       std::string* err) {
-    if (!value.IsObject()) {
-        J2PERROR(err, "Non-object value for map field: %s",
-                 map_desc->full_name().c_str());
-        return false;
+JsonToPbHandler::Frame& JsonToPbHandler::PushFrame(
+    FrameType type, google::protobuf::Message* message) {
+    if (_depth == _frames.size()) {
+        _frames.push_back(Frame());
     }
+    Frame& f = _frames[_depth++];
+    f.type = type;
+    f.message = message;
+    f.table = NULL;
+    f.owned_table = NULL;
+    f.index = -1;
+    f.generated = false;
+    f.seen.clear();
+    f.field_errors.clear();
+    f.field_fatal.clear();
+    f.field = NULL;
+    f.key_desc = NULL;
+    f.value_desc = NULL;
+    f.setter = NULL;
+    f.entry = NULL;
+    f.failed = false;
+    f.error.clear();
+    return f;
+}
 
-    const google::protobuf::Reflection* reflection = message->GetReflection();
-    const google::protobuf::FieldDescriptor* key_desc =
-            map_desc->message_type()->FindFieldByName(KEY_NAME);
-    const google::protobuf::FieldDescriptor* value_desc =
-            map_desc->message_type()->FindFieldByName(VALUE_NAME);
-
-    for (BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator it =
-                 value.MemberBegin(); it != value.MemberEnd(); ++it) {
-        google::protobuf::Message* entry = reflection->AddMessage(message, map_desc);
-        const google::protobuf::Reflection* entry_reflection = entry->GetReflection();
-        entry_reflection->SetString(
-            entry, key_desc, std::string(it->name.GetString(),
-                                         it->name.GetStringLength()));
-        if (!JsonValueToProtoField(it->value, value_desc, entry, options, err)) {
-            return false;
-        }
+void JsonToPbHandler::PushMessage(google::protobuf::Message* message) {
+    const FieldTable* table = GetCachedFieldTable(*message);
+    FieldTable* owned_table = NULL;
+    if (table == NULL) {
+        owned_table = new FieldTable(*message);
+        table = owned_table;
     }
-    return true;
+    Frame& f = PushFrame(FRAME_MESSAGE, message);
+    f.table = table;
+    f.owned_table = owned_table;
+    f.generated = table->is_generated(*message);
+    f.seen.resize(table->size(), false);
 }
 
-bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
-                             google::protobuf::Message* message,
-                             const Json2PbOptions& options,
-                             std::string* err) {
-    if (!json_value.IsObject()) {
-        J2PERROR(err, "`json_value' is not a json object");
-        return false;
+void JsonToPbHandler::SetResult(bool ok, const std::string* error) {
+    if (_depth == 0) {
+        _succeeded = ok;
+        if (_err && error) {
+            _err->append(*error);
+        }
+        return;
+    }
+    Frame& f = _frames[_depth - 1];
+    const bool has_error = (error != NULL && !error->empty());
+    std::string* dest = NULL;
+    if (f.type == FRAME_MESSAGE) {
+        if (ok && !has_error) {
+            return;
+        }
+        if (f.field_errors.empty()) {
+            f.field_errors.resize(f.table->size());
+            f.field_fatal.resize(f.table->size(), false);
+        }
+        if (!ok) {
+            f.field_fatal[f.index] = true;
+        }
+        dest = &f.field_errors[f.index];
+    } else {
+        if (!ok) {
+            f.failed = true;
+        }
+        dest = &f.error;
+    }
+    if (has_error) {
+        if (!dest->empty()) {
+            dest->append(", ", 2);
+        }
+        dest->append(*error);
     }
+}
 
-    const google::protobuf::Reflection* reflection = message->GetReflection();
-    const google::protobuf::Descriptor* descriptor = message->GetDescriptor();
-    
-    std::vector<const google::protobuf::FieldDescriptor*> fields;
-    fields.reserve(64);
-    for (int i = 0; i < descriptor->extension_range_count(); ++i) {
-        const google::protobuf::Descriptor::ExtensionRange*
-            ext_range = descriptor->extension_range(i);
-        for (int tag_number = ext_range->start; tag_number < ext_range->end;
-             ++tag_number) {
-            const google::protobuf::FieldDescriptor* field =
-                reflection->FindKnownExtensionByNumber(tag_number);
-            if (field) {
-                fields.push_back(field);
+bool JsonToPbHandler::FinishMessage(Frame& f, std::string* err) const {
+    const std::vector<int>& required = f.table->required_fields();
+    if (f.field_errors.empty()) {
+        for (size_t i = 0; i < required.size(); ++i) {
+            if (!f.seen[required[i]]) {
+                J2PERROR(err, "Missing required field: %s",
+                         f.table->field(required[i]).field->full_name().c_str());
+                return false;
             }
         }
+        return true;
     }
-    for (int i = 0; i < descriptor->field_count(); ++i) {
-        fields.push_back(descriptor->field(i));
-    }
-
-    std::string field_name_str_temp; 
-    const BUTIL_RAPIDJSON_NAMESPACE::Value* value_ptr = NULL;
-    for (size_t i = 0; i < fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* field = fields[i];
-        
-        const std::string& orig_name = field->name();
-        bool res = decode_name(orig_name, field_name_str_temp); 
-        const std::string& field_name_str = (res ? field_name_str_temp : orig_name);
-
-#ifndef RAPIDJSON_VERSION_0_1
-        BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator member =
-                json_value.FindMember(field_name_str.data());
-        if (member == json_value.MemberEnd()) {
-            if (field->is_required()) {
-                J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
+    size_t next_required = 0;
+    for (size_t i = 0; i < f.table->size(); ++i) {
+        if (next_required < required.size() &&
+            (size_t)required[next_required] == i) {
+            ++next_required;
+            if (!f.seen[i]) {
+                J2PERROR(err, "Missing required field: %s",
+                         f.table->field(i).field->full_name().c_str());
                 return false;
             }
-            continue; 
         }
-        value_ptr = &(member->value);
-#else 
-        const BUTIL_RAPIDJSON_NAMESPACE::Value::Member* member =
-                json_value.FindMember(field_name_str.data());
-        if (member == NULL) {
-            if (field->is_required()) {
-                J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
-                return false;
+        if (err && !f.field_errors[i].empty()) {
+            if (!err->empty()) {
+                err->append(", ", 2);
             }
-            continue; 
+            err->append(f.field_errors[i]);
         }
-        value_ptr = &(member->value);
-#endif
+        if (f.field_fatal[i]) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        if (IsProtobufMap(field) && value_ptr->IsObject()) {
-            // Try to parse json like {"key":value, ...} into protobuf map
-            if (!JsonMapToProtoMap(*value_ptr, field, message, options, err)) {
-                return false;
-            }
-        } else {
-            if (!JsonValueToProtoField(*value_ptr, field, message, options, err)) {
-                return false;
+bool JsonToPbHandler::StartObject() {
+    if (_skip_depth) {
+        ++_skip_depth;
+        return true;
+    }
+    if (_depth == 0) {
+        PushMessage(_message);
+        return true;
+    }
+    Target t;
+    if (!GetTarget(&t)) {
+        _skip_depth = 1;
+        return true;
+    }
+    const google::protobuf::Reflection* reflection = t.message->GetReflection();
+    if (t.field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE
+        && (t.item || !t.field->is_repeated())) {
+        PushMessage(t.item ? reflection->AddMessage(t.message, t.field)
+                    : reflection->MutableMessage(t.message, t.field));
+    } else if (t.is_map) {
+        // Try to parse json like {"key":value, ...} into protobuf map
+        Frame& f = PushFrame(FRAME_MAP, t.message);
+        f.field = t.field;
+        f.key_desc = t.field->message_type()->field(KEY_INDEX);
+        f.value_desc = t.field->message_type()->field(VALUE_INDEX);
+    } else {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(BUTIL_RAPIDJSON_NAMESPACE::kObjectType);
+        ConvertValue(t, v);
+        _skip_depth = 1;
+    }
+    return true;
+}
+
+bool JsonToPbHandler::Key(const char* str,
+                          BUTIL_RAPIDJSON_NAMESPACE::SizeType length,
+                          bool /*copy*/) {
+    if (_skip_depth) {
+        return true;
+    }
+    Frame& f = _frames[_depth - 1];
+    if (f.type == FRAME_MESSAGE) {
+        int index = f.table->Find(str, length);
+        if (index >= 0) {
+            if (f.seen[index]) {
+                // Only the first member with the name is converted.
+                index = -1;
+            } else {
+                f.seen[index] = true;
             }
         }
+        f.index = index;
+    } else if (!f.failed) {
+        f.entry = f.message->GetReflection()->AddMessage(f.message, f.field);
+        f.entry->GetReflection()->SetString(
+            f.entry, f.key_desc, std::string(str, length));
+    } else {
+        f.entry = NULL;
     }
     return true;
 }
 
-bool ZeroCopyStreamToJson(BUTIL_RAPIDJSON_NAMESPACE::Document *dest, 
-                          google::protobuf::io::ZeroCopyInputStream *stream) {
-    ZeroCopyStreamReader stream_reader(stream);
-    dest->ParseStream<0, BUTIL_RAPIDJSON_NAMESPACE::UTF8<> >(stream_reader);
-    return !dest->HasParseError();
+bool JsonToPbHandler::EndObject(BUTIL_RAPIDJSON_NAMESPACE::SizeType) {
+    if (_skip_depth) {
+        --_skip_depth;
+        return true;
+    }
+    Frame& f = _frames[_depth - 1];
+    bool ok;
+    if (f.type == FRAME_MESSAGE) {
+        ok = FinishMessage(f, (_err ? &f.error : NULL));
+        delete f.owned_table;
+        f.owned_table = NULL;
+    } else {
+        ok = !f.failed;
+    }
+    --_depth;
+    // `f' is not modified by SetResult() which only touches the parent.
+    SetResult(ok, (_err ? &f.error : NULL));
+    return true;
 }
 
-inline bool JsonToProtoMessageInline(const std::string& json_string, 
-                        google::protobuf::Message* message,
-                        const Json2PbOptions& options,
-                        std::string* error) {
+bool JsonToPbHandler::StartArray() {
+    if (_skip_depth) {
+        ++_skip_depth;
+        return true;
+    }
+    if (_depth == 0) {
+        OnValue(BUTIL_RAPIDJSON_NAMESPACE::Value(BUTIL_RAPIDJSON_NAMESPACE::kArrayType));
+        _skip_depth = 1;
+        return true;
+    }
+    Target t;
+    if (!GetTarget(&t)) {
+        _skip_depth = 1;
+        return true;
+    }
+    if (!t.item && t.field->is_repeated()) {
+        Frame& f = PushFrame(FRAME_ARRAY, t.message);
+        f.field = t.field;
+        f.setter = t.setter;
+    } else {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value v(BUTIL_RAPIDJSON_NAMESPACE::kArrayType);
+        ConvertValue(t, v);
+        _skip_depth = 1;
+    }
+    return true;
+}
+
+bool JsonToPbHandler::EndArray(BUTIL_RAPIDJSON_NAMESPACE::SizeType) {
+    if (_skip_depth) {
+        --_skip_depth;
+        return true;
+    }
+    Frame& f = _frames[_depth - 1];
+    --_depth;
+    SetResult(!f.failed, (_err ? &f.error : NULL));
+    return true;
+}
+
+template <typename InputStream>
+static bool JsonStreamToProtoMessage(InputStream& is,
+                                     google::protobuf::Message* message,
+                                     const Json2PbOptions& options,
+                                     std::string* error,
+                                     const char* parse_error) {
     if (error) {
         error->clear();
     }
-    BUTIL_RAPIDJSON_NAMESPACE::Document d;
-    d.Parse<0>(json_string.c_str());
-    return json2pb::JsonValueToProtoMessage(d, message, options, error);
+    JsonToPbHandler handler(message, options, error);
+    BUTIL_RAPIDJSON_NAMESPACE::Reader reader;
+    reader.Parse<0>(is, handler);
+    if (reader.HasParseError()) {
+        if (error) {
+            error->clear();
+        }
+        J2PERROR(error, "%s", parse_error);
+        return false;
+    }
+    return handler.succeeded();
+}
+
+inline bool JsonToProtoMessageInline(const std::string& json_string,
+                        google::protobuf::Message* message,
+                        const Json2PbOptions& options,
+                        std::string* error) {
+    BUTIL_RAPIDJSON_NAMESPACE::StringStream ss(json_string.c_str());
+    return JsonStreamToProtoMessage(ss, message, options, error,
+                                    "`json_value' is not a json object");
 }
 
 bool JsonToProtoMessage(const std::string& json_string,
@@ -505,18 +787,12 @@ bool JsonToProtoMessage(google::protobuf::io::ZeroCopyInputStream* stream,
                         google::protobuf::Message* message,
                         const Json2PbOptions& options,
                         std::string* error) {
-    if (error) {
-        error->clear();
-    }
-    BUTIL_RAPIDJSON_NAMESPACE::Document d;
-    if (!json2pb::ZeroCopyStreamToJson(&d, stream)) {
-        J2PERROR(error, "Invalid json format");
-        return false;
-    }
-    return json2pb::JsonValueToProtoMessage(d, message, options, error);
+    ZeroCopyStreamReader stream_reader(stream);
+    return JsonStreamToProtoMessage(stream_reader, message, options, error,
+                                    "Invalid json format");
 }
 
-bool JsonToProtoMessage(const std::string& json_string, 
+bool JsonToProtoMessage(const std::string& json_string,
                         google::protobuf::Message* message,
                         std::string* error) {
     return JsonToProtoMessageInline(json_string, message, Json2PbOptions(), error);
@@ -526,7 +802,7 @@ bool JsonToProtoMessage(const std::string& json_string,
 // (https://svn.baidu.com/public/tags/protobuf-json/protobuf-json_1-0-0-0_PD_BL)
 // This method should not be exposed in header, otherwise calls to
 // JsonToProtoMessage will be ambiguous.
-bool JsonToProtoMessage(std::string json_string, 
+bool JsonToProtoMessage(std::string json_string,
                         google::protobuf::Message* message,
                         std::string* error) {
     return JsonToProtoMessageInline(json_string, message, Json2PbOptions(), error);
@@ -535,17 +811,8 @@ bool JsonToProtoMessage(std::string json_string,
 bool JsonToProtoMessage(google::protobuf::io::ZeroCopyInputStream *stream,
                         google::protobuf::Message* message,
                         std::string* error) {
-    if (error) {
-        error->clear();
-    }
-    BUTIL_RAPIDJSON_NAMESPACE::Document d;
-    if (!json2pb::ZeroCopyStreamToJson(&d, stream)) {
-        J2PERROR(error, "Invalid json format");
-        return false;
-    }
-    return json2pb::JsonValueToProtoMessage(d, message, Json2PbOptions(), error);
+    return JsonToProtoMessage(stream, message, Json2PbOptions(), error);
 }
 } //namespace json2pb
 
 #undef J2PERROR
-#undef J2PCHECKTYPE
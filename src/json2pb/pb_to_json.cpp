@@ -3,14 +3,15 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <memory>
 #include <sstream>
 #include <sys/time.h>
 #include <time.h>
 #include <google/protobuf/descriptor.h>
 #include "butil/base64.h"
 #include "zero_copy_stream_writer.h"
-#include "encode_decode.h"
 #include "protobuf_map.h"
+#include "field_table.h"
 #include "rapidjson.h"
 #include "pb_to_json.h"
 
@@ -34,7 +35,14 @@ public:
     bool Convert(const google::protobuf::Message& message, Handler& handler);
 
     const std::string& ErrorText() const { return _error; }
-    
+
+    bool MissingRequired(const google::protobuf::FieldDescriptor* field) {
+        _error = "Missing required field: " + field->full_name();
+        return false;
+    }
+
+    const Pb2JsonOptions& options() const { return _option; }
+
 private:
     template <typename Handler>
     bool _PbFieldToJson(const google::protobuf::Message& message,
@@ -45,42 +53,73 @@ private:
     Pb2JsonOptions _option;
 };
 
+// Pass writers to generated serializers.
 template <typename Handler>
-bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handler& handler) {
-    handler.StartObject();
-    const google::protobuf::Reflection* reflection = message.GetReflection();
-    const google::protobuf::Descriptor* descriptor = message.GetDescriptor();
-    
-    int ext_range_count = descriptor->extension_range_count();
-    int field_count = descriptor->field_count();
-    std::vector<const google::protobuf::FieldDescriptor*> fields;
-    fields.reserve(64);
-    for (int i = 0; i < ext_range_count; ++i) {
-        const google::protobuf::Descriptor::ExtensionRange*
-            ext_range = descriptor->extension_range(i);
-        for (int tag_number = ext_range->start;
-             tag_number < ext_range->end; ++tag_number) {
-            const google::protobuf::FieldDescriptor* field =
-                    reflection->FindKnownExtensionByNumber(tag_number);
-            if (field) {
-                fields.push_back(field);
-            }
-        }
+class JsonWriterAdapter : public JsonWriter {
+public:
+    JsonWriterAdapter(PbToJsonConverter* converter, Handler& handler)
+        : _converter(converter), _handler(handler) {}
+
+    const Pb2JsonOptions& options() const { return _converter->options(); }
+    // Hack: Pass 0 as parameter since Writer doesn't care this
+    void StartObject() { _handler.StartObject(); }
+    void EndObject() { _handler.EndObject(0); }
+    void StartArray() { _handler.StartArray(); }
+    void EndArray() { _handler.EndArray(0); }
+    void Key(const char* name, size_t size) { _handler.Key(name, size, false); }
+    void Bool(bool b) { _handler.Bool(b); }
+    void Int(int i) { _handler.AddInt(i); }
+    void Uint(unsigned u) { _handler.AddUint(u); }
+    void Int64(int64_t i) { _handler.AddInt64(i); }
+    void Uint64(uint64_t u) { _handler.AddUint64(u); }
+    void Double(double d) { _handler.Double(d); }
+    void String(const std::string& str) {
+        _handler.String(str.data(), str.size(), false);
     }
-    std::vector<const google::protobuf::FieldDescriptor*> map_fields;
-    for (int i = 0; i < field_count; ++i) {
-        const google::protobuf::FieldDescriptor* field = descriptor->field(i);
-        if (_option.enable_protobuf_map && json2pb::IsProtobufMap(field)) {
-            map_fields.push_back(field);
+    void Bytes(const std::string& bytes) {
+        if (options().bytes_to_base64) {
+            std::string encoded;
+            butil::Base64Encode(bytes, &encoded);
+            _handler.String(encoded.data(), encoded.size(), false);
         } else {
-            fields.push_back(field);
+            _handler.String(bytes.data(), bytes.size(), false);
         }
     }
+    bool Message(const google::protobuf::Message& message) {
+        return _converter->Convert(message, _handler);
+    }
+    bool MissingRequired(const google::protobuf::FieldDescriptor* field) {
+        return _converter->MissingRequired(field);
+    }
+
+private:
+    PbToJsonConverter* _converter;
+    Handler& _handler;
+};
+
+template <typename Handler>
+bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handler& handler) {
+    const google::protobuf::Reflection* reflection = message.GetReflection();
+    const FieldTable* table = GetCachedFieldTable(message);
+    std::unique_ptr<FieldTable> temp_table;
+    if (table == NULL) {
+        temp_table.reset(new FieldTable(message));
+        table = temp_table.get();
+    }
+    if (table->serializer() != NULL && table->is_generated(message)) {
+        JsonWriterAdapter<Handler> writer(this, handler);
+        return table->serializer()(message, writer);
+    }
+
+    handler.StartObject();
 
     // Fill in non-map fields
-    std::string field_name_str;
-    for (size_t i = 0; i < fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* field = fields[i];
+    for (size_t i = 0; i < table->size(); ++i) {
+        const JsonField& f = table->field(i);
+        if (_option.enable_protobuf_map && f.is_map) {
+            continue;
+        }
+        const google::protobuf::FieldDescriptor* field = f.field;
         if (!field->is_repeated() && !reflection->HasField(message, field)) {
             // Field that has not been set
             if (field->is_required()) {
@@ -94,18 +133,19 @@ bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handle
             continue;
         }
 
-        const std::string& orig_name = field->name();
-        bool decoded = decode_name(orig_name, field_name_str); 
-        const std::string& name = decoded ? field_name_str : orig_name;
-        handler.Key(name.data(), name.size(), false);
+        handler.Key(f.name.data(), f.name.size(), false);
         if (!_PbFieldToJson(message, field, handler)) {
             return false;
         }
     }
 
     // Fill in map fields
-    for (size_t i = 0; i < map_fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* map_desc = map_fields[i];
+    for (size_t i = 0; _option.enable_protobuf_map && i < table->size(); ++i) {
+        const JsonField& f = table->field(i);
+        if (!f.is_map) {
+            continue;
+        }
+        const google::protobuf::FieldDescriptor* map_desc = f.field;
         const google::protobuf::FieldDescriptor* key_desc =
                 map_desc->message_type()->field(json2pb::KEY_INDEX);
         const google::protobuf::FieldDescriptor* value_desc =
@@ -113,18 +153,15 @@ bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handle
 
         // Write a json object corresponding to hold protobuf map
         // such as {"key": value, ...}
-        const std::string& orig_name = map_desc->name();
-        bool decoded = decode_name(orig_name, field_name_str);
-        const std::string& name = decoded ? field_name_str : orig_name;
-        handler.Key(name.data(), name.size(), false);
+        handler.Key(f.name.data(), f.name.size(), false);
         handler.StartObject();
-        std::string entry_name;
+        std::string scratch;
         for (int j = 0; j < reflection->FieldSize(message, map_desc); ++j) {
             const google::protobuf::Message& entry =
                     reflection->GetRepeatedMessage(message, map_desc, j);
             const google::protobuf::Reflection* entry_reflection = entry.GetReflection();
-            entry_name = entry_reflection->GetStringReference(
-                entry, key_desc, &entry_name);
+            const std::string& entry_name =
+                entry_reflection->GetStringReference(entry, key_desc, &scratch);
             handler.Key(entry_name.data(), entry_name.size(), false);
 
             // Fill in entries into this json object
@@ -176,13 +213,13 @@ bool PbToJsonConverter::_PbFieldToJson(
 #undef CASE_FIELD_TYPE
 
     case google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
-        std::string value;
+        std::string scratch;
         if (field->is_repeated()) {
             int field_size = reflection->FieldSize(message, field);
             handler.StartArray();
             for (int index = 0; index < field_size; ++index) {
-                value = reflection->GetRepeatedStringReference(
-                    message, field, index, &value);
+                const std::string& value = reflection->GetRepeatedStringReference(
+                    message, field, index, &scratch);
                 if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES
                     && _option.bytes_to_base64) {
                     std::string value_decoded;
@@ -195,7 +232,8 @@ bool PbToJsonConverter::_PbFieldToJson(
             handler.EndArray(field_size);
             
         } else {
-            value = reflection->GetStringReference(message, field, &value);
+            const std::string& value =
+                reflection->GetStringReference(message, field, &scratch);
             if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES
                 && _option.bytes_to_base64) {
                 std::string value_decoded;
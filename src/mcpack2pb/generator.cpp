@@ -189,6 +189,10 @@ bool generate_declarations(const std::set<std::string>& ref_msgs,
             "    const ::google::protobuf::Message& msg,\n"
             "    ::mcpack2pb::Serializer& serializer,\n"
             "    ::mcpack2pb::SerializationFormat format);\n"
+            "extern void serialize_$vmsg$_body(\n"
+            "    const ::google::protobuf::Message& msg,\n"
+            "    ::mcpack2pb::Sizer& serializer,\n"
+            "    ::mcpack2pb::SerializationFormat format);\n"
             "extern ::mcpack2pb::FieldMap* g_$vmsg$_fields;\n"
             , "vmsg", *it);
     }
@@ -858,10 +862,13 @@ static bool generate_serializing(const google::protobuf::Descriptor* d,
     std::string var_name = mcpack2pb::to_var_name(d->full_name());
     std::string cpp_name = mcpack2pb::to_cpp_name(d->full_name());
     ref_msgs.insert(var_name);
+    // The body is instantiated with Serializer and with Sizer which computes
+    // sizes for the former in two-pass serializations.
     impl.Print(
-        "void serialize_$vmsg$_body(\n"
+        "template <typename SERIALIZER>\n"
+        "static void serialize_$vmsg$_body_impl(\n"
         "    const ::google::protobuf::Message& msg_base,\n"
-        "    ::mcpack2pb::Serializer& serializer,\n"
+        "    SERIALIZER& serializer,\n"
         "    ::mcpack2pb::SerializationFormat format) {\n"
         "  (void)format;     // suppress compiler warning when it's not used\n"
         , "vmsg", var_name);
@@ -1260,6 +1267,18 @@ static bool generate_serializing(const google::protobuf::Descriptor* d,
     }
     impl.Outdent();
     impl.Print(
+        "}\n"
+        "void serialize_$vmsg$_body(\n"
+        "    const ::google::protobuf::Message& msg_base,\n"
+        "    ::mcpack2pb::Serializer& serializer,\n"
+        "    ::mcpack2pb::SerializationFormat format) {\n"
+        "  serialize_$vmsg$_body_impl(msg_base, serializer, format);\n"
+        "}\n"
+        "void serialize_$vmsg$_body(\n"
+        "    const ::google::protobuf::Message& msg_base,\n"
+        "    ::mcpack2pb::Sizer& serializer,\n"
+        "    ::mcpack2pb::SerializationFormat format) {\n"
+        "  serialize_$vmsg$_body_impl(msg_base, serializer, format);\n"
         "}\n"
         "bool serialize_$vmsg$(\n"
         "    const ::google::protobuf::Message& msg_base,\n"
@@ -1308,15 +1327,28 @@ static bool generate_registration(
         const google::protobuf::Descriptor* d = file->message_type(i);
         std::string var_name = mcpack2pb::to_var_name(d->full_name());
 
+        std::vector<std::string> names;
+        std::set<std::string> name_set;
+        for (int i = 0; i < d->field_count(); ++i) {
+            names.push_back(get_idl_name(d->field(i)));
+            if (!name_set.insert(names.back()).second) {
+                LOG(ERROR) << "Duplicated field name=" << names.back()
+                           << " in " << d->full_name();
+                return false;
+            }
+        }
+        uint32_t seed = 0;
+        size_t nbucket = 0;
+        ::mcpack2pb::FieldMap::find_perfect_hash(names, &seed, &nbucket);
         impl.Print(
             "\n"
-            "g_$vmsg$_fields = new ::mcpack2pb::FieldMap;\n"
-            "CHECK_EQ(0, g_$vmsg$_fields->init(std::max($field_count$, 1), 30));\n"
+            "g_$vmsg$_fields = new ::mcpack2pb::FieldMap($seed$, $nbucket$);\n"
             , "vmsg", var_name
-            , "field_count", ::butil::string_printf("%d", d->field_count())); 
+            , "seed", ::butil::string_printf("%u", seed)
+            , "nbucket", ::butil::string_printf("%lu", (unsigned long)nbucket));
         for (int i = 0; i < d->field_count(); ++i) {
             const google::protobuf::FieldDescriptor* f = d->field(i);
-            impl.Print("(*g_$vmsg$_fields)[\"$field$\"] = ::set_$vmsg$_$lcfield$;\n"
+            impl.Print("CHECK(g_$vmsg$_fields->insert(\"$field$\", ::set_$vmsg$_$lcfield$));\n"
                        , "vmsg", var_name
                        , "field", get_idl_name(f)
                        , "lcfield", f->lowercase_name());
@@ -1326,6 +1358,7 @@ static bool generate_registration(
             "  parse_$vmsg$,\n"
             "  parse_$vmsg$_body,\n"
             "  serialize_$vmsg$,\n"
+            "  serialize_$vmsg$_body,\n"
             "  serialize_$vmsg$_body\n"
             "};\n"
             "::mcpack2pb::register_message_handler_or_die(\"$fmsg$\", $vmsg$_handler);\n"
@@ -16,7 +16,9 @@
 // Author: Ge,Jun (gejun@baidu.com)
 // Date: Mon Oct 19 17:17:36 CST 2015
 
+#include <algorithm>                    // std::min
 #include <gflags/gflags.h>
+#include "butil/thread_local.h"
 #include "mcpack2pb/mcpack2pb.h"
 
 DEFINE_bool(mcpack2pb_absent_field_is_error, false, "Parsing fails if the "
@@ -24,6 +26,61 @@ DEFINE_bool(mcpack2pb_absent_field_is_error, false, "Parsing fails if the "
 
 namespace mcpack2pb {
 
+FieldMap::FieldMap(uint32_t seed, size_t nbucket)
+    : _seed(seed)
+    , _nbucket(nbucket)
+    , _buckets(new Bucket[nbucket]) {
+    CHECK(nbucket != 0 && (nbucket & (nbucket - 1)) == 0)
+        << "nbucket=" << nbucket << " is not power of 2";
+    for (size_t i = 0; i < nbucket; ++i) {
+        _buckets[i].fn = NULL;
+    }
+}
+
+FieldMap::~FieldMap() {
+    delete [] _buckets;
+}
+
+bool FieldMap::insert(const butil::StringPiece& name, SetFieldFn fn) {
+    Bucket& b = _buckets[hash(name, _seed) & (_nbucket - 1)];
+    if (b.fn != NULL) {
+        LOG(ERROR) << "Bucket of " << name << " is taken by " << b.name;
+        return false;
+    }
+    b.name.assign(name.data(), name.size());
+    b.fn = fn;
+    return true;
+}
+
+void FieldMap::find_perfect_hash(const std::vector<std::string>& names,
+                                 uint32_t* seed, size_t* nbucket) {
+    // Start with load factor <= 50%, which generally gets a seed in a few
+    // tries, and double the buckets when no seed works.
+    size_t n = 1;
+    while (n < names.size() * 2) {
+        n <<= 1;
+    }
+    std::vector<bool> taken;
+    for (;; n <<= 1) {
+        for (uint32_t s = 0; s < 1024; ++s) {
+            taken.assign(n, false);
+            size_t i = 0;
+            for (; i < names.size(); ++i) {
+                const size_t index = hash(names[i], s) & (n - 1);
+                if (taken[index]) {
+                    break;
+                }
+                taken[index] = true;
+            }
+            if (i == names.size()) {
+                *seed = s;
+                *nbucket = n;
+                return;
+            }
+        }
+    }
+}
+
 static pthread_once_t s_init_handler_map_once = PTHREAD_ONCE_INIT;
 static butil::FlatMap<std::string, MessageHandler>* s_handler_map = NULL;
 static void init_handler_map() {
@@ -50,8 +107,82 @@ MessageHandler find_message_handler(const std::string& full_name) {
     if (handler != NULL) {
         return *handler;
     }
-    MessageHandler null_handler = { NULL, NULL, NULL, NULL };
+    MessageHandler null_handler = { NULL, NULL, NULL, NULL, NULL };
     return null_handler;
 }
 
+static void delete_group_sizes(void* arg) {
+    delete static_cast<std::vector<GroupSize>*>(arg);
+}
+
+// Reused by serializations of the thread to avoid allocating sizes.
+static BAIDU_THREAD_LOCAL std::vector<GroupSize>* tls_group_sizes = NULL;
+
+static std::vector<GroupSize>* get_tls_group_sizes() {
+    std::vector<GroupSize>* sizes = tls_group_sizes;
+    if (sizes == NULL) {
+        sizes = new (std::nothrow) std::vector<GroupSize>;
+        if (sizes == NULL) {
+            return NULL;
+        }
+        tls_group_sizes = sizes;
+        butil::thread_atexit(delete_group_sizes, sizes);
+    }
+    return sizes;
+}
+
+static bool serialize_with_sizes(
+    const MessageHandler& handler, const ::google::protobuf::Message& msg,
+    ::google::protobuf::io::ZeroCopyOutputStream* output,
+    const std::vector<GroupSize>* sizes, size_t nbytes,
+    SerializationFormat format) {
+    OutputStream ostream(output);
+    Serializer serializer(&ostream, sizes);
+    serializer.begin_object();
+    handler.serialize_body(msg, serializer, format);
+    serializer.end_object();
+    ostream.done();
+    if (serializer.good() && ostream.pushed_bytes() != nbytes) {
+        CHECK(false) << "Sizer computed " << nbytes << " bytes, actually "
+                     << ostream.pushed_bytes() << " bytes";
+        return false;
+    }
+    return serializer.good();
+}
+
+bool MessageHandler::serialize_to_iobuf_two_pass(
+    const ::google::protobuf::Message& msg,
+    ::butil::IOBuf* buf, SerializationFormat format) {
+    if (size_body == NULL || serialize_body == NULL) {
+        LOG(ERROR) << "`size_body' or `serialize_body' is NULL";
+        return false;
+    }
+    std::vector<GroupSize>* sizes = get_tls_group_sizes();
+    if (sizes == NULL) {
+        LOG(ERROR) << "Fail to new sizes";
+        return false;
+    }
+    Sizer sizer(sizes);
+    sizer.begin_object();
+    size_body(msg, sizer, format);
+    sizer.end_object();
+    if (!sizer.good()) {
+        return false;
+    }
+    const size_t nbytes = sizer.pushed_bytes();
+    // Small messages are written into the TLS block shared by IOBufs of
+    // the thread, large ones into dedicated blocks as large as the message
+    // or MAX_BLOCK_SIZE.
+    if (nbytes <= ::butil::IOBuf::DEFAULT_PAYLOAD) {
+        ::butil::IOBufAsZeroCopyOutputStream zc_stream(buf);
+        return serialize_with_sizes(*this, msg, &zc_stream, sizes,
+                                    nbytes, format);
+    }
+    const size_t block_overhead =
+        ::butil::IOBuf::DEFAULT_BLOCK_SIZE - ::butil::IOBuf::DEFAULT_PAYLOAD;
+    ::butil::IOBufAsZeroCopyOutputStream zc_stream(
+        buf, std::min(nbytes + block_overhead, ::butil::IOBuf::MAX_BLOCK_SIZE));
+    return serialize_with_sizes(*this, msg, &zc_stream, sizes, nbytes, format);
+}
+
 } // namespace mcpack2pb
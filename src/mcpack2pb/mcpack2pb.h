@@ -19,6 +19,8 @@
 #ifndef MCPACK2PB_MCPACK_MCPACK2PB_H
 #define MCPACK2PB_MCPACK_MCPACK2PB_H
 
+#include <string>
+#include <vector>
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include "butil/containers/flat_map.h"
@@ -31,8 +33,53 @@ namespace mcpack2pb {
 typedef bool (*SetFieldFn)(::google::protobuf::Message* msg,
                            UnparsedValue& value);
 
-// Mapping from filed name to its parsing&setting function.
-typedef butil::FlatMap<butil::StringPiece, SetFieldFn> FieldMap;
+// Mapping from field name to its parsing&setting function.
+// protoc-gen-mcpack searches a seed and number of buckets with which names
+// of fields in a message are hashed into different buckets(perfect hashing),
+// thus a lookup hashes the name once and compares at most one name.
+class FieldMap {
+public:
+    // `nbucket' must be power of 2.
+    FieldMap(uint32_t seed, size_t nbucket);
+    ~FieldMap();
+
+    // Map `name' to `fn'. Returns false if the bucket of `name' is taken.
+    bool insert(const butil::StringPiece& name, SetFieldFn fn);
+
+    // Returns address of the function mapped from `name', NULL if absent.
+    SetFieldFn* seek(const butil::StringPiece& name) const {
+        Bucket& b = _buckets[hash(name, _seed) & (_nbucket - 1)];
+        if (b.fn != NULL && name == b.name) {
+            return &b.fn;
+        }
+        return NULL;
+    }
+
+    static uint32_t hash(const butil::StringPiece& name, uint32_t seed) {
+        // FNV-1a, names of fields are short.
+        uint32_t h = 2166136261u ^ seed;
+        for (size_t i = 0; i < name.size(); ++i) {
+            h = (h ^ (uint8_t)name[i]) * 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    // Find `seed' and `nbucket' with which `names' are hashed into
+    // different buckets.
+    static void find_perfect_hash(const std::vector<std::string>& names,
+                                  uint32_t* seed, size_t* nbucket);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FieldMap);
+
+    struct Bucket {
+        std::string name;
+        SetFieldFn fn;
+    };
+    uint32_t _seed;
+    size_t _nbucket;
+    Bucket* _buckets;
+};
 
 enum SerializationFormat {
     FORMAT_COMPACK,
@@ -65,6 +112,13 @@ struct MessageHandler {
                            Serializer& serializer,
                            SerializationFormat format);
 
+    // Compute sizes of objects and arrays that serialize_body() writes into
+    // a Serializer, for two-pass serializations. NULL if the handler was
+    // generated by an older protoc-gen-mcpack.
+    void (*size_body)(const ::google::protobuf::Message& msg,
+                      Sizer& sizer,
+                      SerializationFormat format);
+
     // -------------------
     //  Helper functions
     // -------------------
@@ -87,13 +141,22 @@ struct MessageHandler {
     bool serialize_to_iobuf(const ::google::protobuf::Message& msg,
                             ::butil::IOBuf* buf, SerializationFormat format);
 
+    // Same as serialize_to_iobuf() but serialize `msg' in two passes: the
+    // first pass computes sizes of all objects and arrays with size_body(),
+    // the second one writes heads with the sizes directly into blocks
+    // sized for the whole message, rather than reserving heads and
+    // backpatching them at the end.
+    bool serialize_to_iobuf_two_pass(const ::google::protobuf::Message& msg,
+                                     ::butil::IOBuf* buf,
+                                     SerializationFormat format);
+
     // TODO(gejun): serialize_to_string is not supported because OutputStream
     // requires the embedded zero-copy stream to return permanent memory blocks
     // to support reserve() however the string inside StringOutputStream may
     // be resized and invalidates previous returned memory blocks.
 };
 
-static const MessageHandler INVALID_MESSAGE_HANDLER = {NULL, NULL, NULL, NULL};
+static const MessageHandler INVALID_MESSAGE_HANDLER = {NULL, NULL, NULL, NULL, NULL};
 
 // if the *.pb.cc and *.pb.h was generated by mcpack2pb. This function will be
 // called with the mcpack/compack parser and serializer BEFORE main().
@@ -296,6 +296,83 @@ inline void Serializer::end_object()
 inline void Serializer::end_object_iso()
 { end_object_internal(true); }
 
+inline const GroupSize* Serializer::next_group_size() {
+    if (_nsize_used < _sizes->size()) {
+        return &(*_sizes)[_nsize_used++];
+    }
+    CHECK(false) << "Sizer computed " << _sizes->size() << " groups only";
+    return NULL;
+}
+
+inline Sizer::Sizer(std::vector<GroupSize>* sizes)
+    : _good(true)
+    , _ndepth(0)
+    , _size(0)
+    , _sizes(sizes) {
+    _sizes->clear();
+    Group& g = _groups[0];
+    g.head_offset = 0;
+    g.value_offset = 0;
+    g.size_index = 0;
+    g.item_count = 0;
+    g.isomorphic = false;
+}
+
+inline void Sizer::begin_group(const StringWrapper& name, FieldType type,
+                               bool isomorphic) {
+    if (!_good) {
+        return;
+    }
+    if (_ndepth >= MAX_DEPTH) {
+        CHECK(false) << "Fail to push " << type2str(type);
+        return set_bad();
+    }
+    ++_groups[_ndepth].item_count;
+    Group& g = _groups[++_ndepth];
+    g.head_offset = _size;
+    g.value_offset = _size + 6/*FieldLongHead*/ +
+        (name.empty() ? 0 : name.size() + 1);
+    g.size_index = _sizes->size();
+    g.item_count = 0;
+    g.isomorphic = isomorphic;
+    const GroupSize size = {
+        0, 0, (uint8_t)(isomorphic ? FIELD_ISOARRAY : type) };
+    _sizes->push_back(size);
+    _size = g.value_offset + (isomorphic ? 1/*item type*/ : 4/*ItemsHead*/);
+}
+
+inline void Sizer::end_group(FieldType type) {
+    if (!_good) {
+        return;
+    }
+    if (_ndepth == 0) {
+        CHECK(false) << "Nothing to end";
+        return set_bad();
+    }
+    const Group& g = _groups[_ndepth--];
+    GroupSize& size = (*_sizes)[g.size_index];
+    if (type == FIELD_ARRAY) {
+        if (size.type != FIELD_ARRAY && size.type != FIELD_ISOARRAY) {
+            CHECK(false) << "end_array() is called on " << type2str(size.type);
+            return set_bad();
+        }
+        if (g.item_count == 0) {
+            // Removed by Serializer, see Serializer::end_array()
+            _size = g.head_offset;
+            --_groups[_ndepth].item_count;
+            return;
+        }
+    } else {
+        if (size.type != FIELD_OBJECT) {
+            CHECK(false) << "end_object() is called on " << type2str(size.type);
+            return set_bad();
+        }
+        size.type = type;
+    }
+    size.value_size = _size - g.value_offset;
+    size.item_count = g.item_count;
+}
+
 }  // namespace mcpack2pb
 
 #endif  // MCPACK2PB_MCPACK_SERIALIZER_INL_H
@@ -158,7 +158,9 @@ std::ostream& operator<<(std::ostream& os, const Serializer::GroupInfo& gi) {
 Serializer::Serializer(OutputStream* stream)
     : _stream(stream)
     , _ndepth(0)
-    , _group_info_more(NULL) {
+    , _group_info_more(NULL)
+    , _sizes(NULL)
+    , _nsize_used(0) {
     GroupInfo & info = _group_info_fast[0];
     info.item_count = 0;
     info.isomorphic = false;
@@ -167,6 +169,27 @@ Serializer::Serializer(OutputStream* stream)
     info.name_size = 0;
     info.output_offset = 0;
     info.pending_null_count = 0;
+    info.size = NULL;
+    info.head_area = INVALID_AREA;
+    info.items_head_area = INVALID_AREA;
+}
+
+Serializer::Serializer(OutputStream* stream,
+                       const std::vector<GroupSize>* sizes)
+    : _stream(stream)
+    , _ndepth(0)
+    , _group_info_more(NULL)
+    , _sizes(sizes)
+    , _nsize_used(0) {
+    GroupInfo & info = _group_info_fast[0];
+    info.item_count = 0;
+    info.isomorphic = false;
+    info.item_type = 0;
+    info.type = FIELD_OBJECT;
+    info.name_size = 0;
+    info.output_offset = 0;
+    info.pending_null_count = 0;
+    info.size = NULL;
     info.head_area = INVALID_AREA;
     info.items_head_area = INVALID_AREA;
 }
@@ -621,6 +644,14 @@ void Serializer::add_empty_array() {
 // =========================
 // append array/object
 
+inline void pop_group_info(int & ndepth) {
+    if (ndepth > 0) {
+        --ndepth;
+    } else {
+        CHECK(false) << "Nothing to pop";
+    }
+}
+
 void Serializer::begin_object_internal() {
     if (!_stream->good()) {
         return;
@@ -640,6 +671,10 @@ void Serializer::begin_object_internal() {
     info->name_size = 0;
     info->output_offset = _stream->pushed_bytes();
     info->pending_null_count = 0;
+    if (_sizes) {
+        return begin_group_with_size(info, StringWrapper(""));
+    }
+    info->size = NULL;
     info->head_area = _stream->reserve(sizeof(ObjectHead));
     info->items_head_area = INVALID_AREA;
 }
@@ -666,19 +701,77 @@ void Serializer::begin_object_internal(const StringWrapper& name) {
     info->name_size = (uint8_t)(name.size() + 1);
     info->output_offset = _stream->pushed_bytes();
     info->pending_null_count = 0;
+    if (_sizes) {
+        return begin_group_with_size(info, name);
+    }
+    info->size = NULL;
     info->head_area = _stream->reserve(sizeof(FieldLongHead));
     _stream->append(name.data(), name.size() + 1);
     info->items_head_area = _stream->reserve(sizeof(ItemsHead));
 }
 
-inline void pop_group_info(int & ndepth) {
-    if (ndepth > 0) {
-        --ndepth;
+void Serializer::begin_group_with_size(GroupInfo* info,
+                                       const StringWrapper& name) {
+    info->head_area = INVALID_AREA;
+    info->items_head_area = INVALID_AREA;
+    info->size = next_group_size();
+    if (info->size == NULL) {
+        return _stream->set_bad();
+    }
+    const GroupSize& size = *info->size;
+    if (info->type == FIELD_OBJECT ?
+        (size.type != FIELD_OBJECT && size.type != FIELD_OBJECTISOARRAY) :
+        (size.type != (info->isomorphic ? FIELD_ISOARRAY : FIELD_ARRAY))) {
+        CHECK(false) << "Sizer computed " << type2str(size.type)
+                     << " for " << *info;
+        return _stream->set_bad();
+    }
+    FieldLongHead head;
+    head.set_type(size.type);
+    head.set_name_size(info->name_size);
+    head.set_value_size(size.value_size);
+    const ItemsHead items_head = { size.item_count };
+    const int n = sizeof(FieldLongHead) + info->name_size +
+        (info->isomorphic ? 1 : sizeof(ItemsHead));
+    char* data = (char*)_stream->skip_continuous(n);
+    if (data) {
+        // Same as add_primitive(), write the whole head directly.
+        *(FieldLongHead*)data = head;
+        data += sizeof(FieldLongHead);
+        fast_memcpy(data, name.data(), info->name_size);
+        data += info->name_size;
+        if (info->isomorphic) {
+            *data = (char)info->item_type;
+        } else {
+            *(ItemsHead*)data = items_head;
+        }
     } else {
-        CHECK(false) << "Nothing to pop";
+        _stream->append_packed_pod(head);
+        _stream->append(name.data(), info->name_size);
+        if (info->isomorphic) {
+            _stream->push_back((char)info->item_type);
+        } else {
+            _stream->append_packed_pod(items_head);
+        }
     }
 }
 
+void Serializer::end_group_with_size(const GroupInfo& info, uint8_t type) {
+    const size_t value_size = _stream->pushed_bytes() - info.output_offset
+        - info.name_size - sizeof(FieldLongHead);
+    if (value_size != info.size->value_size ||
+        info.item_count != info.size->item_count ||
+        type != info.size->type) {
+        CHECK(false) << "Sizer computed " << type2str(info.size->type)
+                     << " of " << info.size->item_count << " items in "
+                     << info.size->value_size << " bytes, actually "
+                     << type2str(type) << " of " << info.item_count
+                     << " items in " << value_size << " bytes";
+        return _stream->set_bad();
+    }
+    pop_group_info(_ndepth);
+}
+
 void Serializer::end_object_internal(bool objectisoarray) {
     if (!_stream->good()) {
         return;
@@ -688,6 +781,11 @@ void Serializer::end_object_internal(bool objectisoarray) {
         CHECK(false) << "end_object() is called on " << group_info;
         return _stream->set_bad();
     }
+    if (group_info.size) {
+        end_group_with_size(group_info, objectisoarray ?
+                            FIELD_OBJECTISOARRAY : FIELD_OBJECT);
+        return;
+    }
     if (group_info.name_size == 0) {
         ObjectHead objhead;
         objhead.head.set_type(objectisoarray ? FIELD_OBJECTISOARRAY : FIELD_OBJECT);
@@ -728,6 +826,11 @@ void Serializer::begin_array_internal(FieldType item_type, bool compack) {
     info->name_size = 0;
     info->output_offset = _stream->pushed_bytes();
     info->pending_null_count = 0;
+    if (_sizes) {
+        info->isomorphic = (compack && get_primitive_type_size(item_type));
+        return begin_group_with_size(info, StringWrapper(""));
+    }
+    info->size = NULL;
     info->head_area = _stream->reserve(sizeof(FieldLongHead));
     if (compack && get_primitive_type_size(item_type)) {
         info->isomorphic = true;
@@ -762,6 +865,11 @@ void Serializer::begin_array_internal(const StringWrapper& name,
     info->name_size = (uint8_t)(name.size() + 1);
     info->output_offset = _stream->pushed_bytes();
     info->pending_null_count = 0;
+    if (_sizes) {
+        info->isomorphic = (compack && get_primitive_type_size(item_type));
+        return begin_group_with_size(info, name);
+    }
+    info->size = NULL;
     info->head_area = _stream->reserve(sizeof(FieldLongHead));
     _stream->append(name.data(), name.size() + 1);
     if (compack && get_primitive_type_size(item_type)) {
@@ -791,6 +899,17 @@ void Serializer::end_array() {
         --peek_group_info().item_count;
         return;
     }
+    if (group_info.size) {
+        if (group_info.isomorphic) {
+            end_group_with_size(group_info, FIELD_ISOARRAY);
+        } else {
+            if (group_info.pending_null_count) {
+                add_pending_nulls(_stream, group_info);
+            }
+            end_group_with_size(group_info, FIELD_ARRAY);
+        }
+        return;
+    }
     // Reset lhead/items_head
     FieldLongHead lhead;
     if (group_info.isomorphic) {
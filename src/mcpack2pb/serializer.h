@@ -144,10 +144,25 @@ inline std::ostream& operator<<(std::ostream& os, const StringWrapper& sw) {
     return os << butil::StringPiece(sw.data(), sw.size());
 }
 
+// Size of an object or array computed by Sizer.
+struct GroupSize {
+    // value_size of the head, namely bytes after the name.
+    uint32_t value_size;
+    uint32_t item_count;
+    // FIELD_OBJECTISOARRAY when the object is ended by end_object_iso().
+    uint8_t type;
+};
+
 class Serializer {
 public:
     // Serialize into `output'.
     explicit Serializer(OutputStream* stream);
+
+    // Serialize into `output' with `sizes' computed by a Sizer through the
+    // same calls, so that heads of objects and arrays are written with their
+    // final sizes rather than being reserved and assigned at the end.
+    // `sizes' must be valid until the serialization is done.
+    Serializer(OutputStream* stream, const std::vector<GroupSize>* sizes);
     ~Serializer();
 
     bool good() const { return _stream->good(); }
@@ -255,6 +270,8 @@ public:
         uint8_t name_size;
         size_t output_offset;
         int pending_null_count;
+        // Size computed by Sizer, only used with sizes.
+        const GroupSize* size;
         OutputStream::Area head_area;
         OutputStream::Area items_head_area;
 
@@ -272,11 +289,175 @@ private:
     void begin_array_internal(FieldType item_type, bool compack);
     void begin_array_internal(const StringWrapper& name,
                               FieldType item_type, bool compack);
+    const GroupSize* next_group_size();
+    void begin_group_with_size(GroupInfo* info, const StringWrapper& name);
+    void end_group_with_size(const GroupInfo& info, uint8_t type);
 
     OutputStream* _stream;
     int _ndepth;
     GroupInfo _group_info_fast[15];
     GroupInfo *_group_info_more;
+    const std::vector<GroupSize>* _sizes;
+    size_t _nsize_used;
+};
+
+// Compute sizes of objects and arrays without writing anything. Methods are
+// same with Serializer's so that generated serializing code runs over both:
+// sizes computed by the first pass let the Serializer in the second pass
+// write heads directly. Calls are not validated as strictly as Serializer,
+// which fails the serialization if it sees calls or sizes inconsistent with
+// the ones given to Sizer.
+class Sizer {
+public:
+    // Append sizes into `sizes' which is cleared first.
+    explicit Sizer(std::vector<GroupSize>* sizes);
+
+    bool good() const { return _good; }
+    void set_bad() { _good = false; }
+    // Bytes that Serializer will push.
+    size_t pushed_bytes() const { return _size; }
+
+    void add_int8(const StringWrapper& name, int8_t)
+    { add_named_fixed(name, sizeof(int8_t)); }
+    void add_int16(const StringWrapper& name, int16_t)
+    { add_named_fixed(name, sizeof(int16_t)); }
+    void add_int32(const StringWrapper& name, int32_t)
+    { add_named_fixed(name, sizeof(int32_t)); }
+    void add_int64(const StringWrapper& name, int64_t)
+    { add_named_fixed(name, sizeof(int64_t)); }
+    void add_uint8(const StringWrapper& name, uint8_t)
+    { add_named_fixed(name, sizeof(uint8_t)); }
+    void add_uint16(const StringWrapper& name, uint16_t)
+    { add_named_fixed(name, sizeof(uint16_t)); }
+    void add_uint32(const StringWrapper& name, uint32_t)
+    { add_named_fixed(name, sizeof(uint32_t)); }
+    void add_uint64(const StringWrapper& name, uint64_t)
+    { add_named_fixed(name, sizeof(uint64_t)); }
+    void add_bool(const StringWrapper& name, bool)
+    { add_named_fixed(name, sizeof(bool)); }
+    void add_float(const StringWrapper& name, float)
+    { add_named_fixed(name, sizeof(float)); }
+    void add_double(const StringWrapper& name, double)
+    { add_named_fixed(name, sizeof(double)); }
+
+    void add_int8(int8_t) { add_fixed(sizeof(int8_t), 1); }
+    void add_int16(int16_t) { add_fixed(sizeof(int16_t), 1); }
+    void add_int32(int32_t) { add_fixed(sizeof(int32_t), 1); }
+    void add_int64(int64_t) { add_fixed(sizeof(int64_t), 1); }
+    void add_uint8(uint8_t) { add_fixed(sizeof(uint8_t), 1); }
+    void add_uint16(uint16_t) { add_fixed(sizeof(uint16_t), 1); }
+    void add_uint32(uint32_t) { add_fixed(sizeof(uint32_t), 1); }
+    void add_uint64(uint64_t) { add_fixed(sizeof(uint64_t), 1); }
+    void add_bool(bool) { add_fixed(sizeof(bool), 1); }
+    void add_float(float) { add_fixed(sizeof(float), 1); }
+    void add_double(double) { add_fixed(sizeof(double), 1); }
+
+    template <typename T> void add_multiple_int8(const T*, size_t count)
+    { add_fixed(sizeof(int8_t), count); }
+    template <typename T> void add_multiple_int16(const T*, size_t count)
+    { add_fixed(sizeof(int16_t), count); }
+    template <typename T> void add_multiple_int32(const T*, size_t count)
+    { add_fixed(sizeof(int32_t), count); }
+    template <typename T> void add_multiple_int64(const T*, size_t count)
+    { add_fixed(sizeof(int64_t), count); }
+    template <typename T> void add_multiple_uint8(const T*, size_t count)
+    { add_fixed(sizeof(uint8_t), count); }
+    template <typename T> void add_multiple_uint16(const T*, size_t count)
+    { add_fixed(sizeof(uint16_t), count); }
+    template <typename T> void add_multiple_uint32(const T*, size_t count)
+    { add_fixed(sizeof(uint32_t), count); }
+    template <typename T> void add_multiple_uint64(const T*, size_t count)
+    { add_fixed(sizeof(uint64_t), count); }
+    void add_multiple_bool(const bool*, size_t count)
+    { add_fixed(sizeof(bool), count); }
+    void add_multiple_float(const float*, size_t count)
+    { add_fixed(sizeof(float), count); }
+    void add_multiple_double(const double*, size_t count)
+    { add_fixed(sizeof(double), count); }
+
+    void add_string(const StringWrapper& name, const StringWrapper& str)
+    { add_named_binary(name, str.size() + 1); }
+    void add_string(const StringWrapper& str)
+    { add_binary_item(0, str.size() + 1); }
+    void add_binary(const StringWrapper& name, const std::string& data)
+    { add_named_binary(name, data.size()); }
+    void add_binary(const StringWrapper& name, const void*, size_t n)
+    { add_named_binary(name, n); }
+    void add_binary(const std::string& data)
+    { add_binary_item(0, data.size()); }
+    void add_binary(const void*, size_t n) { add_binary_item(0, n); }
+
+    void add_null(const StringWrapper& name) {
+        add_items(3/*head and zero*/ + (name.empty() ? 0 : name.size() + 1), 1);
+    }
+    void add_null() { add_items(3/*head and zero*/, 1); }
+    void add_empty_array(const StringWrapper& name) {
+        add_items(10/*head and item count*/ +
+                  (name.empty() ? 0 : name.size() + 1), 1);
+    }
+    void add_empty_array() { add_items(10/*head and item count*/, 1); }
+
+    void begin_mcpack_array(const StringWrapper& name, FieldType)
+    { begin_group(name, FIELD_ARRAY, false); }
+    void begin_mcpack_array(FieldType)
+    { begin_group(StringWrapper(""), FIELD_ARRAY, false); }
+    void begin_compack_array(const StringWrapper& name, FieldType item_type) {
+        begin_group(name, FIELD_ARRAY,
+                    get_primitive_type_size(item_type) != 0);
+    }
+    void begin_compack_array(FieldType item_type) {
+        begin_group(StringWrapper(""), FIELD_ARRAY,
+                    get_primitive_type_size(item_type) != 0);
+    }
+    void end_array() { end_group(FIELD_ARRAY); }
+
+    void begin_object(const StringWrapper& name)
+    { begin_group(name, FIELD_OBJECT, false); }
+    void begin_object() { begin_group(StringWrapper(""), FIELD_OBJECT, false); }
+    void end_object() { end_group(FIELD_OBJECT); }
+    void end_object_iso() { end_group(FIELD_OBJECTISOARRAY); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Sizer);
+
+    struct Group {
+        size_t head_offset;
+        size_t value_offset;
+        uint32_t size_index;
+        uint32_t item_count;
+        bool isomorphic;
+    };
+
+    void add_items(size_t size, size_t count) {
+        _size += size;
+        _groups[_ndepth].item_count += count;
+    }
+    void add_fixed(size_t value_size, size_t count) {
+        add_items((_groups[_ndepth].isomorphic ? value_size :
+                   (2/*FieldFixedHead*/ + value_size)) * count, count);
+    }
+    void add_named_fixed(const StringWrapper& name, size_t value_size) {
+        if (name.empty()) {
+            return add_fixed(value_size, 1);
+        }
+        add_items(2/*FieldFixedHead*/ + name.size() + 1 + value_size, 1);
+    }
+    void add_binary_item(size_t name_size, size_t value_size) {
+        add_items((value_size <= 255 ? 3/*FieldShortHead*/ :
+                   6/*FieldLongHead*/) + name_size + value_size, 1);
+    }
+    void add_named_binary(const StringWrapper& name, size_t value_size) {
+        add_binary_item(name.empty() ? 0 : name.size() + 1, value_size);
+    }
+    void begin_group(const StringWrapper& name, FieldType type,
+                     bool isomorphic);
+    void end_group(FieldType type);
+
+    bool _good;
+    int _ndepth;
+    size_t _size;
+    std::vector<GroupSize>* _sizes;
+    Group _groups[MAX_DEPTH + 1];
 };
 
 }  // namespace mcpack2pb
@@ -112,6 +112,29 @@ TEST(BaiduTimeTest, cost_of_timer) {
     }
 }
 
+TEST(BaiduTimeTest, calibrated_cpuwide_time) {
+    const int64_t m0 = butil::monotonic_time_ns();
+    const int64_t c0 = butil::cpuwide_time_ns();
+    LOG(INFO) << "invariant_cpu_freq=" << butil::detail::invariant_cpu_freq;
+    usleep(100000);
+    const int64_t m1 = butil::monotonic_time_ns();
+    const int64_t c1 = butil::cpuwide_time_ns();
+    // Either the calibrated TSC or CLOCK_MONOTONIC, both agree within 1%.
+    ASSERT_NEAR(m1 - m0, c1 - c0, (m1 - m0) / 100);
+}
+
+TEST(BaiduTimeTest, fast_realtime) {
+    for (int i = 0; i < 3; ++i) {
+        const int64_t t1 = butil::gettimeofday_us();
+        const int64_t t = butil::fast_realtime_us();
+        const int64_t t2 = butil::gettimeofday_us();
+        ASSERT_LE(t1 - 1000, t);
+        ASSERT_GE(t2 + 1000, t);
+        // Cross the re-syncing interval.
+        usleep(600000);
+    }
+}
+
 TEST(BaiduTimeTest, timespec) {
     timespec ts1 = { 0, -1 };
     butil::timespec_normalize(&ts1);
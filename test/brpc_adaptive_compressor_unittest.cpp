@@ -0,0 +1,173 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <sstream>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "brpc/global.h"
+#include "brpc/compress.h"
+#include "brpc/adaptive_compressor.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/details/method_status.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_int32(auto_compress_min_size);
+DECLARE_int32(auto_compress_sample_interval);
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    brpc::GlobalInitializeOrDie();
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+std::string RepeatedText(size_t len) {
+    std::string s;
+    while (s.size() < len) {
+        s.append("brpc adaptive compression ");
+    }
+    s.resize(len);
+    return s;
+}
+
+std::string RandomBytes(size_t len) {
+    std::string s;
+    s.resize(len);
+    for (size_t i = 0; i < len; ++i) {
+        s[i] = (char)butil::fast_rand_less_than(256);
+    }
+    return s;
+}
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        response->set_message(request->message());
+        cntl->set_response_compress_type(brpc::COMPRESS_TYPE_AUTO);
+    }
+};
+
+TEST(AdaptiveCompressorTest, skip_small_messages) {
+    brpc::AdaptiveCompressor c;
+    test::EchoRequest req;
+    req.set_message("hello");
+    butil::IOBuf buf;
+    brpc::CompressType type = brpc::COMPRESS_TYPE_AUTO;
+    ASSERT_TRUE(c.Serialize(req, &buf, &type));
+    ASSERT_EQ(brpc::COMPRESS_TYPE_NONE, type);
+    test::EchoRequest req2;
+    ASSERT_TRUE(brpc::ParseFromCompressedData(buf, &req2, type));
+    ASSERT_EQ(req.message(), req2.message());
+    ASSERT_TRUE(c.used());
+}
+
+TEST(AdaptiveCompressorTest, pick_cheapest_qualified) {
+    brpc::AdaptiveCompressor c;
+    test::EchoRequest req;
+    req.set_message(RepeatedText(16 * 1024));
+    for (int i = 0; i < 3 * brpc::FLAGS_auto_compress_sample_interval; ++i) {
+        butil::IOBuf buf;
+        brpc::CompressType type = brpc::COMPRESS_TYPE_AUTO;
+        ASSERT_TRUE(c.Serialize(req, &buf, &type));
+        ASSERT_NE(brpc::COMPRESS_TYPE_NONE, type);
+        ASSERT_LT(buf.size(), (size_t)req.ByteSize());
+        test::EchoRequest req2;
+        ASSERT_TRUE(brpc::ParseFromCompressedData(buf, &req2, type));
+        ASSERT_EQ(req.message(), req2.message());
+    }
+    // The first registered type in the order of lz4, snappy, zstd, zlib.
+    const brpc::CompressType expected =
+        (brpc::HasCompressHandler(brpc::COMPRESS_TYPE_LZ4) ?
+         brpc::COMPRESS_TYPE_LZ4 : brpc::COMPRESS_TYPE_SNAPPY);
+    ASSERT_EQ(expected, c.selected());
+    std::ostringstream os;
+    c.Describe(os, brpc::DescribeOptions());
+    ASSERT_NE(std::string::npos, os.str().find("samples=3")) << os.str();
+}
+
+TEST(AdaptiveCompressorTest, skip_incompressible_messages) {
+    brpc::AdaptiveCompressor c;
+    test::BytesRequest req;
+    req.set_databytes(RandomBytes(16 * 1024));
+    for (int i = 0; i < brpc::FLAGS_auto_compress_sample_interval; ++i) {
+        butil::IOBuf buf;
+        brpc::CompressType type = brpc::COMPRESS_TYPE_AUTO;
+        ASSERT_TRUE(c.Serialize(req, &buf, &type));
+        ASSERT_EQ(brpc::COMPRESS_TYPE_NONE, type);
+    }
+    ASSERT_EQ(brpc::COMPRESS_TYPE_NONE, c.selected());
+}
+
+TEST(AdaptiveCompressorTest, follow_changes_of_payloads) {
+    const int saved_interval = brpc::FLAGS_auto_compress_sample_interval;
+    brpc::FLAGS_auto_compress_sample_interval = 1;
+    brpc::AdaptiveCompressor c;
+    test::BytesRequest req;
+    butil::IOBuf buf;
+    brpc::CompressType type = brpc::COMPRESS_TYPE_AUTO;
+    req.set_databytes(RepeatedText(16 * 1024));
+    ASSERT_TRUE(c.Serialize(req, &buf, &type));
+    ASSERT_NE(brpc::COMPRESS_TYPE_NONE, c.selected());
+    // Ratios are smoothed, random payloads take a few samples to switch.
+    req.set_databytes(RandomBytes(16 * 1024));
+    for (int i = 0; i < 10; ++i) {
+        buf.clear();
+        ASSERT_TRUE(c.Serialize(req, &buf, &type));
+    }
+    ASSERT_EQ(brpc::COMPRESS_TYPE_NONE, c.selected());
+    brpc::FLAGS_auto_compress_sample_interval = saved_interval;
+}
+
+TEST(AdaptiveCompressorTest, rpc) {
+    brpc::Server server;
+    EchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8672, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8672", NULL));
+    test::EchoService_Stub stub(&channel);
+
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(RepeatedText(16 * 1024));
+    brpc::Controller cntl;
+    cntl.set_request_compress_type(brpc::COMPRESS_TYPE_AUTO);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(req.message(), res.message());
+    ASSERT_NE(brpc::COMPRESS_TYPE_NONE, cntl.request_compress_type());
+    ASSERT_NE(brpc::COMPRESS_TYPE_AUTO, cntl.request_compress_type());
+    ASSERT_NE(brpc::COMPRESS_TYPE_NONE, cntl.response_compress_type());
+    ASSERT_NE(brpc::COMPRESS_TYPE_AUTO, cntl.response_compress_type());
+
+    cntl.Reset();
+    req.set_message("small");
+    cntl.set_request_compress_type(brpc::COMPRESS_TYPE_AUTO);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ("small", res.message());
+    ASSERT_EQ(brpc::COMPRESS_TYPE_NONE, cntl.request_compress_type());
+    ASSERT_EQ(brpc::COMPRESS_TYPE_NONE, cntl.response_compress_type());
+
+    // Decisions of responses are shown in /status.
+    brpc::MethodStatus* status = server.FindMethodPropertyByFullName(
+        "test.EchoService.Echo")->status;
+    std::ostringstream os;
+    status->Describe(os, brpc::DescribeOptions());
+    ASSERT_NE(std::string::npos, os.str().find("auto_compress: selected="))
+        << os.str();
+}
+
+} // namespace
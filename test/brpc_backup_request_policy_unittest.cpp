@@ -0,0 +1,68 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "brpc/controller.h"
+#include "brpc/backup_request_policy.h"
+
+namespace {
+
+class BackupRequestPolicyTest : public ::testing::Test {};
+
+static void FinishRPC(brpc::LatencyPercentileBackupPolicy* policy,
+                      int64_t latency_us, bool failed) {
+    brpc::Controller cntl;
+    cntl.OnRPCBegin(1000000);
+    cntl.OnRPCEnd(1000000 + latency_us);
+    if (failed) {
+        cntl.SetFailed(brpc::ERPCTIMEDOUT, "timedout");
+    }
+    policy->OnRPCEnd(&cntl);
+}
+
+TEST_F(BackupRequestPolicyTest, budget) {
+    brpc::LatencyPercentileBackupPolicyOptions opt;
+    opt.max_backup_ratio = 0.1;
+    opt.max_backup_burst = 2;
+    brpc::LatencyPercentileBackupPolicy policy(opt);
+    // No budget before any RPC finishes.
+    ASSERT_FALSE(policy.DoBackup(NULL));
+    for (int i = 0; i < 9; ++i) {
+        FinishRPC(&policy, 1000, false);
+    }
+    ASSERT_FALSE(policy.DoBackup(NULL));
+    FinishRPC(&policy, 1000, false);
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_FALSE(policy.DoBackup(NULL));
+    // Capped by the burst.
+    for (int i = 0; i < 100; ++i) {
+        FinishRPC(&policy, 1000, true);
+    }
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_TRUE(policy.DoBackup(NULL));
+    ASSERT_FALSE(policy.DoBackup(NULL));
+}
+
+TEST_F(BackupRequestPolicyTest, percentile) {
+    brpc::LatencyPercentileBackupPolicyOptions opt;
+    opt.percentile = 0.9;
+    brpc::LatencyPercentileBackupPolicy policy(opt);
+    // No latencies yet.
+    ASSERT_EQ(-1, policy.GetBackupRequestMs());
+    for (int i = 1; i <= 100; ++i) {
+        FinishRPC(&policy, i * 1000L, false);
+        // Failed RPCs are not counted.
+        FinishRPC(&policy, 1000000L, true);
+    }
+    int32_t ms = -1;
+    for (int i = 0; i < 30 && ms < 0; ++i) {
+        // Wait for the sampler of bvar.
+        bthread_usleep(100000);
+        ms = policy.GetBackupRequestMs();
+    }
+    ASSERT_GE(ms, 85);
+    ASSERT_LE(ms, 95);
+}
+
+} // namespace
@@ -0,0 +1,332 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/iobuf.h"
+#include "butil/raw_pack.h"
+#include "butil/time.h"
+#include "brpc/socket.h"
+#include "brpc/policy/baidu_rpc_meta.pb.h"
+#include "brpc/policy/baidu_rpc_protocol.h"
+#include "brpc/policy/most_common_message.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_int64(socket_max_unwritten_bytes);
+namespace policy {
+DECLARE_int32(baidu_std_streaming_drain_timeout_ms);
+}  // namespace policy
+}  // namespace brpc
+
+int main(int argc, char* argv[]) {
+    // Read ends of pipes are closed while the failed sockets may still be
+    // writing unwritten chunks.
+    signal(SIGPIPE, SIG_IGN);
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+void AppendFrame(butil::IOBuf* out, const char* magic,
+                 const brpc::policy::RpcMeta& meta,
+                 const butil::IOBuf& payload) {
+    const std::string meta_str = meta.SerializeAsString();
+    char header[12];
+    memcpy(header, magic, 4);
+    butil::RawPacker(header + 4)
+        .pack32(meta_str.size() + payload.size())
+        .pack32(meta_str.size());
+    out->append(header, sizeof(header));
+    out->append(meta_str);
+    out->append(payload);
+}
+
+// Split the body(meta + payload) of the message `cid' into chunks of at
+// most `chunk_size' bytes.
+std::vector<butil::IOBuf> MakeChunks(int64_t cid, const std::string& payload,
+                                     size_t chunk_size) {
+    brpc::policy::RpcMeta meta;
+    meta.set_correlation_id(cid);
+    meta.mutable_response()->set_error_code(0);
+    butil::IOBuf body;
+    body.append(meta.SerializeAsString());
+    body.append(payload);
+
+    brpc::policy::RpcMeta chunk_meta;
+    chunk_meta.set_correlation_id(cid);
+    chunk_meta.mutable_chunk()->set_body_size(body.size());
+    chunk_meta.mutable_chunk()->set_meta_size(meta.ByteSize());
+    std::vector<butil::IOBuf> chunks;
+    while (!body.empty()) {
+        butil::IOBuf part;
+        body.cutn(&part, chunk_size);
+        butil::IOBuf frame;
+        AppendFrame(&frame, "PCHK", chunk_meta, part);
+        chunks.push_back(frame);
+    }
+    return chunks;
+}
+
+void ExpectMessage(const brpc::ParseResult& pr, int64_t cid,
+                   const std::string& payload) {
+    ASSERT_TRUE(pr.is_ok());
+    ASSERT_TRUE(pr.message() != NULL);
+    brpc::policy::MostCommonMessage* msg =
+        static_cast<brpc::policy::MostCommonMessage*>(pr.message());
+    brpc::policy::RpcMeta meta;
+    ASSERT_TRUE(meta.ParseFromString(msg->meta.to_string()));
+    ASSERT_EQ(cid, meta.correlation_id());
+    ASSERT_EQ(payload, msg->payload.to_string());
+    msg->Destroy();
+}
+
+TEST(BaiduRpcProtocolTest, reassemble_interleaved_chunks) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+
+    const std::string payload1(1000, 'a');
+    const std::string payload2(500, 'b');
+    std::vector<butil::IOBuf> chunks1 = MakeChunks(1, payload1, 128);
+    std::vector<butil::IOBuf> chunks2 = MakeChunks(2, payload2, 128);
+    ASSERT_LT(chunks2.size(), chunks1.size());
+
+    // Chunks of the two messages are interleaved and a small message is
+    // put between them.
+    butil::IOBuf source;
+    for (size_t i = 0; i < chunks1.size(); ++i) {
+        source.append(chunks1[i]);
+        if (i < chunks2.size()) {
+            source.append(chunks2[i]);
+        }
+        if (i == 0) {
+            brpc::policy::RpcMeta meta;
+            meta.set_correlation_id(3);
+            butil::IOBuf small;
+            small.append("small");
+            AppendFrame(&source, "PRPC", meta, small);
+        }
+    }
+    std::vector<int64_t> cids;
+    while (!source.empty()) {
+        brpc::ParseResult pr =
+            brpc::policy::ParseRpcMessage(&source, s.get(), false, NULL);
+        ASSERT_TRUE(pr.is_ok()) << pr.error_str();
+        if (pr.message() == NULL) {
+            continue;
+        }
+        brpc::policy::MostCommonMessage* msg =
+            static_cast<brpc::policy::MostCommonMessage*>(pr.message());
+        brpc::policy::RpcMeta meta;
+        ASSERT_TRUE(meta.ParseFromString(msg->meta.to_string()));
+        cids.push_back(meta.correlation_id());
+        ExpectMessage(pr, meta.correlation_id(),
+                      meta.correlation_id() == 1 ? payload1 :
+                      (meta.correlation_id() == 2 ? payload2 : "small"));
+    }
+    ASSERT_EQ(3u, cids.size());
+    ASSERT_EQ(3, cids[0]);
+    ASSERT_EQ(2, cids[1]);
+    ASSERT_EQ(1, cids[2]);
+
+    // Incomplete chunks are waited.
+    butil::IOBuf partial;
+    partial.append(chunks1[0]);
+    partial.pop_back(1);
+    brpc::ParseResult pr =
+        brpc::policy::ParseRpcMessage(&partial, s.get(), false, NULL);
+    ASSERT_EQ(brpc::PARSE_ERROR_NOT_ENOUGH_DATA, pr.error());
+    close(fds[0]);
+}
+
+// Write a response of about 1MB into `write_socket' in chunks of 8192 bytes
+// while serializing.
+struct ChunkedResponse {
+    ChunkedResponse() {
+        std::string message(1000000, 0);
+        for (size_t i = 0; i < message.size(); ++i) {
+            message[i] = 'a' + i % 26;
+        }
+        res.set_message(message);
+        attachment.append("attachment");
+        meta.set_correlation_id(1);
+        meta.mutable_response()->set_error_code(0);
+        meta.set_attachment_size(attachment.size());
+        res_size = res.ByteSize();
+        payload = res.SerializeAsString() + "attachment";
+    }
+
+    int Write(brpc::Socket* write_socket) {
+        return brpc::policy::WriteRpcChunksWhileSerializing(
+            write_socket, meta, res, res_size, &attachment, 8192, -1);
+    }
+
+    test::EchoResponse res;
+    butil::IOBuf attachment;
+    brpc::policy::RpcMeta meta;
+    int res_size;
+    std::string payload;
+};
+
+struct ReadArg {
+    int fd;
+    brpc::Socket* parse_socket;
+    const std::string* payload;
+    int nchunk;
+};
+
+// Parse chunks read from `fd' until the response is reassembled.
+void* ReadChunkedResponse(void* void_arg) {
+    ReadArg* arg = static_cast<ReadArg*>(void_arg);
+    butil::IOPortal source;
+    arg->nchunk = 0;
+    while (true) {
+        brpc::ParseResult pr = brpc::policy::ParseRpcMessage(
+            &source, arg->parse_socket, false, NULL);
+        if (pr.error() == brpc::PARSE_ERROR_NOT_ENOUGH_DATA) {
+            EXPECT_GT(source.append_from_file_descriptor(arg->fd, 65536), 0);
+            continue;
+        }
+        EXPECT_TRUE(pr.is_ok()) << pr.error_str();
+        if (!pr.is_ok()) {
+            return NULL;
+        }
+        ++arg->nchunk;
+        if (pr.message() != NULL) {
+            ExpectMessage(pr, 1, *arg->payload);
+            break;
+        }
+    }
+    EXPECT_TRUE(source.empty());
+    return NULL;
+}
+
+class BaiduRpcChunkWriteTest : public ::testing::Test {
+protected:
+    void SetUp() {
+        ASSERT_EQ(0, pipe(_write_fds));
+        ASSERT_EQ(0, pipe(_parse_fds));
+        brpc::SocketOptions options;
+        brpc::SocketId id;
+        options.fd = _write_fds[1];
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+        ASSERT_EQ(0, brpc::Socket::Address(id, &_write_socket));
+        options.fd = _parse_fds[1];
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+        ASSERT_EQ(0, brpc::Socket::Address(id, &_parse_socket));
+        _saved_max_unwritten_bytes = brpc::FLAGS_socket_max_unwritten_bytes;
+        _saved_drain_timeout_ms =
+            brpc::policy::FLAGS_baidu_std_streaming_drain_timeout_ms;
+    }
+    void TearDown() {
+        brpc::FLAGS_socket_max_unwritten_bytes = _saved_max_unwritten_bytes;
+        brpc::policy::FLAGS_baidu_std_streaming_drain_timeout_ms =
+            _saved_drain_timeout_ms;
+        _write_socket->SetFailed();
+        _parse_socket->SetFailed();
+        close(_write_fds[0]);
+        close(_parse_fds[0]);
+    }
+
+    int _write_fds[2];
+    int _parse_fds[2];
+    brpc::SocketUniquePtr _write_socket;
+    brpc::SocketUniquePtr _parse_socket;
+    int64_t _saved_max_unwritten_bytes;
+    int32_t _saved_drain_timeout_ms;
+};
+
+TEST_F(BaiduRpcChunkWriteTest, write_chunks_while_serializing) {
+    ChunkedResponse r;
+    // Written in background since the pipe is much smaller than the
+    // response.
+    ASSERT_EQ(0, r.Write(_write_socket.get()));
+    ASSERT_TRUE(r.attachment.empty());
+
+    ReadArg arg = { _write_fds[0], _parse_socket.get(), &r.payload, 0 };
+    ReadChunkedResponse(&arg);
+    ASSERT_EQ((int)(r.payload.size() + r.meta.ByteSize() + 8191) / 8192,
+              arg.nchunk);
+}
+
+TEST_F(BaiduRpcChunkWriteTest, wait_for_draining_when_overcrowded) {
+    brpc::FLAGS_socket_max_unwritten_bytes = 32768;
+    ChunkedResponse r;
+    ReadArg arg = { _write_fds[0], _parse_socket.get(), &r.payload, 0 };
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, ReadChunkedResponse, &arg));
+    // The response is much larger than -socket_max_unwritten_bytes, the
+    // writing is overcrowded repeatedly and continues once the reader
+    // drains the pipe.
+    ASSERT_EQ(0, r.Write(_write_socket.get()));
+    ASSERT_EQ(0, pthread_join(th, NULL));
+    ASSERT_EQ((int)(r.payload.size() + r.meta.ByteSize() + 8191) / 8192,
+              arg.nchunk);
+    ASSERT_FALSE(_write_socket->Failed());
+}
+
+TEST_F(BaiduRpcChunkWriteTest, fail_if_not_drained_in_time) {
+    brpc::FLAGS_socket_max_unwritten_bytes = 32768;
+    brpc::policy::FLAGS_baidu_std_streaming_drain_timeout_ms = 100;
+    ChunkedResponse r;
+    // Nobody reads the pipe.
+    const int64_t start_us = butil::gettimeofday_us();
+    ASSERT_EQ(-1, r.Write(_write_socket.get()));
+    ASSERT_EQ(brpc::EOVERCROWDED, errno);
+    ASSERT_LT(butil::gettimeofday_us() - start_us, 2000000L);
+    ASSERT_TRUE(_write_socket->Failed());
+
+    // Bytes written before failing are bounded by the pipe buffer,
+    // -socket_max_unwritten_bytes and one chunk rather than the response.
+    ASSERT_EQ(0, fcntl(_write_fds[0], F_SETFL, O_NONBLOCK));
+    size_t nread = 0;
+    char buf[8192];
+    ssize_t n;
+    while ((n = read(_write_fds[0], buf, sizeof(buf))) > 0) {
+        nread += n;
+    }
+    ASSERT_GT(nread, 0u);
+    ASSERT_LT(nread, 65536u + 32768u + 2 * 8192u);
+}
+
+TEST(BaiduRpcProtocolTest, deadline_bounds_waiting_for_draining) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr sock;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &sock));
+    const int64_t saved_max_unwritten_bytes =
+        brpc::FLAGS_socket_max_unwritten_bytes;
+    brpc::FLAGS_socket_max_unwritten_bytes = 32768;
+
+    ChunkedResponse r;
+    // The deadline is earlier than -baidu_std_streaming_drain_timeout_ms.
+    const int64_t start_us = butil::gettimeofday_us();
+    ASSERT_EQ(-1, brpc::policy::WriteRpcChunksWhileSerializing(
+                  sock.get(), r.meta, r.res, r.res_size, &r.attachment,
+                  8192, start_us + 100000));
+    ASSERT_EQ(brpc::EOVERCROWDED, errno);
+    ASSERT_LT(butil::gettimeofday_us() - start_us, 1000000L);
+    ASSERT_TRUE(sock->Failed());
+
+    brpc::FLAGS_socket_max_unwritten_bytes = saved_max_unwritten_bytes;
+    close(fds[0]);
+}
+} // namespace
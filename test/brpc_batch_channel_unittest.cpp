@@ -0,0 +1,225 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "butil/string_printf.h"
+#include "bthread/bthread.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/batch_channel.h"
+#include "brpc/batch_service.h"
+#include "echo.pb.h"
+
+namespace {
+
+static const int PORT = 9208;
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    EchoServiceImpl() : ncalled(0) {}
+
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* req,
+              test::EchoResponse* res,
+              google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        ncalled.fetch_add(1);
+        if (req->server_fail()) {
+            cntl->SetFailed(req->server_fail(), "Fail on purpose");
+            return;
+        }
+        res->set_message(req->message());
+    }
+
+    butil::atomic<int> ncalled;
+};
+
+class CountingBatchService : public brpc::BatchService {
+public:
+    CountingBatchService() : nbatch(0) {}
+
+    void call(google::protobuf::RpcController* cntl,
+              const brpc::BatchRequest* req,
+              brpc::BatchResponse* res,
+              google::protobuf::Closure* done) {
+        nbatch.fetch_add(1);
+        brpc::BatchService::call(cntl, req, res, done);
+    }
+
+    butil::atomic<int> nbatch;
+};
+
+class BatchChannelTest : public ::testing::Test {
+protected:
+    BatchChannelTest() {
+        EXPECT_EQ(0, _server.AddService(&_echo_svc,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+        EXPECT_EQ(0, _server.AddService(&_batch_svc,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+        EXPECT_EQ(0, _server.Start(PORT, NULL));
+    }
+
+    ~BatchChannelTest() {
+        _server.Stop(0);
+        _server.Join();
+    }
+
+    int InitChannel(brpc::BatchChannel* chan, int max_delay_us,
+                    int max_batch_size) {
+        brpc::Channel* sub_chan = new brpc::Channel;
+        if (sub_chan->Init("127.0.0.1", PORT, NULL) != 0) {
+            delete sub_chan;
+            return -1;
+        }
+        brpc::BatchChannelOptions opt;
+        opt.max_delay_us = max_delay_us;
+        opt.max_batch_size = max_batch_size;
+        return chan->Init(sub_chan, brpc::OWNS_CHANNEL, &opt);
+    }
+
+    brpc::Server _server;
+    EchoServiceImpl _echo_svc;
+    CountingBatchService _batch_svc;
+};
+
+struct AsyncCall {
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+};
+
+TEST_F(BatchChannelTest, sync_call) {
+    brpc::BatchChannel chan;
+    ASSERT_EQ(0, InitChannel(&chan, 100, 64));
+    test::EchoService_Stub stub(&chan);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("hello");
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ("hello", res.message());
+    ASSERT_EQ(1, _batch_svc.nbatch.load());
+    ASSERT_EQ(PORT, cntl.remote_side().port);
+
+    // Errors of calls are passed through.
+    cntl.Reset();
+    req.set_server_fail(brpc::EINTERNAL);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_TRUE(cntl.Failed());
+    ASSERT_EQ(brpc::EINTERNAL, cntl.ErrorCode());
+
+    // Missing required fields.
+    cntl.Reset();
+    test::EchoRequest bad_req;
+    stub.Echo(&cntl, &bad_req, &res, NULL);
+    ASSERT_EQ(brpc::EREQUEST, cntl.ErrorCode());
+}
+
+TEST_F(BatchChannelTest, async_calls_are_batched) {
+    const int N = 50;
+    brpc::BatchChannel chan;
+    ASSERT_EQ(0, InitChannel(&chan, 100000/*100ms*/, N));
+    test::EchoService_Stub stub(&chan);
+    AsyncCall calls[N];
+    for (int i = 0; i < N; ++i) {
+        butil::string_printf(calls[i].req.mutable_message(), "%d", i);
+        if (i % 10 == 9) {
+            calls[i].req.set_server_fail(brpc::EINTERNAL);
+        }
+        stub.Echo(&calls[i].cntl, &calls[i].req, &calls[i].res,
+                  brpc::DoNothing());
+    }
+    for (int i = 0; i < N; ++i) {
+        brpc::Join(calls[i].cntl.call_id());
+        if (i % 10 == 9) {
+            ASSERT_EQ(brpc::EINTERNAL, calls[i].cntl.ErrorCode());
+        } else {
+            ASSERT_FALSE(calls[i].cntl.Failed()) << calls[i].cntl.ErrorText();
+            ASSERT_EQ(calls[i].req.message(), calls[i].res.message());
+        }
+    }
+    // Sent in one batch when reaching max_batch_size.
+    ASSERT_EQ(1, _batch_svc.nbatch.load());
+    ASSERT_EQ(N, _echo_svc.ncalled.load());
+}
+
+TEST_F(BatchChannelTest, flush_after_delay) {
+    brpc::BatchChannel chan;
+    ASSERT_EQ(0, InitChannel(&chan, 20000/*20ms*/, 64));
+    test::EchoService_Stub stub(&chan);
+    AsyncCall calls[3];
+    const int64_t start_us = butil::gettimeofday_us();
+    for (int i = 0; i < 3; ++i) {
+        calls[i].req.set_message("x");
+        stub.Echo(&calls[i].cntl, &calls[i].req, &calls[i].res,
+                  brpc::DoNothing());
+    }
+    for (int i = 0; i < 3; ++i) {
+        brpc::Join(calls[i].cntl.call_id());
+        ASSERT_FALSE(calls[i].cntl.Failed()) << calls[i].cntl.ErrorText();
+    }
+    ASSERT_GE(butil::gettimeofday_us() - start_us, 15000);
+    ASSERT_EQ(1, _batch_svc.nbatch.load());
+}
+
+struct SyncCall {
+    brpc::BatchChannel* chan;
+    brpc::Controller cntl;
+};
+
+static void* run_sync_call(void* arg) {
+    SyncCall* call = static_cast<SyncCall*>(arg);
+    test::EchoService_Stub stub(call->chan);
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("x");
+    stub.Echo(&call->cntl, &req, &res, NULL);
+    return NULL;
+}
+
+TEST_F(BatchChannelTest, destroy_with_pending_calls) {
+    brpc::BatchChannel* chan = new brpc::BatchChannel;
+    ASSERT_EQ(0, InitChannel(chan, 10000000/*10s*/, 64));
+    test::EchoService_Stub stub(chan);
+    AsyncCall calls[3];
+    for (int i = 0; i < 3; ++i) {
+        calls[i].req.set_message("x");
+        stub.Echo(&calls[i].cntl, &calls[i].req, &calls[i].res,
+                  brpc::DoNothing());
+    }
+    SyncCall sync_call;
+    sync_call.chan = chan;
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, run_sync_call, &sync_call));
+    bthread_usleep(50000);
+
+    // Calls waiting for the flush are not sent and don't hang.
+    const int64_t start_us = butil::gettimeofday_us();
+    delete chan;
+    for (int i = 0; i < 3; ++i) {
+        brpc::Join(calls[i].cntl.call_id());
+        ASSERT_EQ(ECANCELED, calls[i].cntl.ErrorCode());
+    }
+    pthread_join(th, NULL);
+    ASSERT_EQ(ECANCELED, sync_call.cntl.ErrorCode());
+    ASSERT_LT(butil::gettimeofday_us() - start_us, 1000000);
+    ASSERT_EQ(0, _batch_svc.nbatch.load());
+}
+
+TEST_F(BatchChannelTest, unknown_method) {
+    brpc::Channel sub_chan;
+    ASSERT_EQ(0, sub_chan.Init("127.0.0.1", PORT, NULL));
+    brpc::batch_Stub stub(&sub_chan);
+    brpc::Controller cntl;
+    brpc::BatchRequest req;
+    brpc::BatchResponse res;
+    req.set_method("test.EchoService.NotExist");
+    req.add_items()->set_request_size(0);
+    stub.call(&cntl, &req, &res, NULL);
+    ASSERT_EQ(brpc::ENOMETHOD, cntl.ErrorCode());
+}
+
+} // namespace
@@ -2,6 +2,7 @@
 // Copyright (c) 2018 baidu-rpc authors
 
 #include <errno.h>
+#include <vector>
 #include <bthread/bthread.h>
 #include <butil/time.h>
 #include <gtest/gtest.h>
@@ -20,9 +21,12 @@ DECLARE_int32(rdma_memory_pool_initial_size_mb);
 DECLARE_int32(rdma_memory_pool_increase_size_mb);
 DECLARE_int32(rdma_memory_pool_max_regions);
 DECLARE_int32(rdma_memory_pool_buckets);
+DECLARE_bool(rdma_memory_pool_use_hugepage);
+DECLARE_int32(rdma_memory_pool_extend_watermark);
 extern void DestroyBlockPool();
 extern int GetBlockType(void* buf);
 extern size_t GetBlockSize(int type);
+extern int GetBlockSizeCount();
 extern size_t GetGlobalLen(int block_type);
 extern size_t GetRegionNum();
 }
@@ -176,6 +180,71 @@ TEST_F(BlockPoolTest, memory_not_enough) {
     FLAGS_rdma_memory_pool_buckets = 4;
 }
 
+TEST_F(BlockPoolTest, large_size_classes) {
+    FLAGS_rdma_memory_pool_initial_size_mb = 64;
+    FLAGS_rdma_memory_pool_increase_size_mb = 64;
+    EXPECT_TRUE(InitBlockPool(DummyCallback) != NULL);
+
+    for (int i = 4; i < GetBlockSizeCount(); ++i) {
+        void* buf = AllocBlock(GetBlockSize(i - 1) + 1);
+        ASSERT_TRUE(buf != NULL);
+        EXPECT_EQ(i, GetBlockType(buf));
+        memset(buf, 1, GetBlockSize(i));
+        EXPECT_EQ(0, DeallocBlock(buf));
+    }
+
+    DestroyBlockPool();
+}
+
+TEST_F(BlockPoolTest, extend_in_background) {
+    FLAGS_rdma_memory_pool_initial_size_mb = 64;
+    FLAGS_rdma_memory_pool_increase_size_mb = 64;
+    FLAGS_rdma_memory_pool_buckets = 1;
+    FLAGS_rdma_memory_pool_extend_watermark = 50;
+    EXPECT_TRUE(InitBlockPool(DummyCallback) != NULL);
+    EXPECT_EQ(1u, GetRegionNum());
+
+    // Use a little more than half of the first region
+    const size_t n = 64 * 1048576 / GetBlockSize(0) / 2 + 1;
+    std::vector<void*> bufs;
+    for (size_t i = 0; i < n; ++i) {
+        bufs.push_back(AllocBlock(GetBlockSize(0)));
+        ASSERT_TRUE(bufs.back() != NULL);
+    }
+    for (int i = 0; i < 1000 && GetRegionNum() < 2; ++i) {
+        bthread_usleep(1000);
+    }
+    EXPECT_EQ(2u, GetRegionNum());
+    // The region is ready before the first one is used up
+    for (size_t i = 0; i < n; ++i) {
+        bufs.push_back(AllocBlock(GetBlockSize(0)));
+        ASSERT_TRUE(bufs.back() != NULL);
+    }
+    for (size_t i = 0; i < bufs.size(); ++i) {
+        DeallocBlock(bufs[i]);
+    }
+
+    DestroyBlockPool();
+    FLAGS_rdma_memory_pool_extend_watermark = 0;
+    FLAGS_rdma_memory_pool_buckets = 4;
+}
+
+TEST_F(BlockPoolTest, hugepage) {
+    FLAGS_rdma_memory_pool_initial_size_mb = 64;
+    FLAGS_rdma_memory_pool_increase_size_mb = 64;
+    // Fall back to normal pages when hugepages are not reserved
+    FLAGS_rdma_memory_pool_use_hugepage = true;
+    EXPECT_TRUE(InitBlockPool(DummyCallback) != NULL);
+
+    void* buf = AllocBlock(8192);
+    ASSERT_TRUE(buf != NULL);
+    memset(buf, 1, 8192);
+    EXPECT_EQ(0, DeallocBlock(buf));
+
+    DestroyBlockPool();
+    FLAGS_rdma_memory_pool_use_hugepage = false;
+}
+
 TEST_F(BlockPoolTest, invalid_use) {
     FLAGS_rdma_memory_pool_initial_size_mb = 64;
     FLAGS_rdma_memory_pool_increase_size_mb = 64;
@@ -185,7 +254,7 @@ TEST_F(BlockPoolTest, invalid_use) {
     EXPECT_EQ(NULL, buf);
     EXPECT_EQ(EINVAL, errno);
 
-    buf = AllocBlock(GetBlockSize(3) + 1);
+    buf = AllocBlock(GetBlockSize(GetBlockSizeCount() - 1) + 1);
     EXPECT_EQ(NULL, buf);
     EXPECT_EQ(EINVAL, errno);
 
@@ -12,6 +12,7 @@
 #include "butil/gperftools_profiler.h"
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "bvar/bvar.h"
 #include "brpc/socket.h"
 #include "brpc/server.h"
 #include "brpc/channel.h"
@@ -28,14 +29,17 @@
 #include "brpc/builtin/connections_service.h"  // ConnectionsService
 #include "brpc/builtin/flags_service.h"        // FlagsService
 #include "brpc/builtin/vars_service.h"         // VarsService
+#include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/builtin/rpcz_service.h"         // RpczService
 #include "brpc/builtin/dir_service.h"          // DirService
 #include "brpc/builtin/pprof_service.h"        // PProfService
 #include "brpc/builtin/bthreads_service.h"     // BthreadsService
 #include "brpc/builtin/ids_service.h"          // IdsService
 #include "brpc/builtin/sockets_service.h"      // SocketsService
+#include "brpc/builtin/hotspots_service.h"     // HotspotsService
 #include "brpc/builtin/common.h"
 #include "brpc/builtin/bad_method_service.h"
+#include "brpc/details/continuous_profiler.h"
 #include "echo.pb.h"
 
 DEFINE_bool(foo, false, "Flags for UT");
@@ -225,6 +229,62 @@ protected:
         StopAndJoin();
     }
     
+    void TestConnectionList() {
+        brpc::ConnectionsService service;
+        butil::EndPoint ep;
+        ASSERT_EQ(0, str2endpoint("127.0.0.1:9798", &ep));
+        ASSERT_EQ(0, _server.Start(ep, NULL));
+        int self_port = -1;
+        const int cfd = tcp_connect(ep, &self_port);
+        ASSERT_GT(cfd, 0);
+        char buf[64];
+        snprintf(buf, sizeof(buf), "127.0.0.1:%d", self_port);
+        usleep(100000);
+        {
+            ClosureChecker done;
+            brpc::Controller cntl;
+            SetUpController(&cntl, false);
+            brpc::ConnectionListRequest req;
+            brpc::ConnectionListResponse res;
+            req.set_sort_by("age");
+            req.set_remote_side(buf);
+            req.set_side("server");
+            service.list(&cntl, &req, &res, &done);
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+            ASSERT_EQ(1u, res.total());
+            ASSERT_EQ(1, res.connection_size());
+            EXPECT_EQ(buf, res.connection(0).remote_side());
+            EXPECT_TRUE(res.connection(0).server_side());
+            EXPECT_FALSE(res.connection(0).broken());
+        }
+        {
+            // Queries overwrite fields of the request.
+            ClosureChecker done;
+            brpc::Controller cntl;
+            SetUpController(&cntl, false);
+            cntl.http_request().uri().SetQuery("remote_side", buf);
+            cntl.http_request().uri().SetQuery("limit", "0");
+            brpc::ConnectionListRequest req;
+            brpc::ConnectionListResponse res;
+            service.list(&cntl, &req, &res, &done);
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+            ASSERT_EQ(1u, res.total());
+            ASSERT_EQ(0, res.connection_size());
+        }
+        {
+            ClosureChecker done;
+            brpc::Controller cntl;
+            SetUpController(&cntl, false);
+            brpc::ConnectionListRequest req;
+            brpc::ConnectionListResponse res;
+            req.set_sort_by("rtt");
+            service.list(&cntl, &req, &res, &done);
+            ASSERT_EQ(EINVAL, cntl.ErrorCode());
+        }
+        close(cfd);
+        StopAndJoin();
+    }
+
     void TestBadMethod(bool use_html) {
         std::string expect_type = (use_html ? "text/html" : "text/plain");
         brpc::BadMethodService service;
@@ -583,6 +643,7 @@ TEST_F(BuiltinServiceTest, vlog) {
 TEST_F(BuiltinServiceTest, connections) {
     TestConnections(false);
     TestConnections(true);
+    TestConnectionList();
 }
 
 TEST_F(BuiltinServiceTest, flags) {
@@ -621,6 +682,35 @@ TEST_F(BuiltinServiceTest, vars) {
     }
 }
 
+TEST_F(BuiltinServiceTest, prometheus_metrics) {
+    brpc::PrometheusMetricsService service;
+    brpc::MetricsRequest req;
+    brpc::MetricsResponse res;
+    bvar::Adder<int64_t> myvar("my.prom-var");
+    myvar << 9;
+    std::vector<std::string> labels;
+    labels.push_back("method");
+    bvar::MultiDimension<bvar::Adder<int64_t> > mdvar("my_md_var", labels);
+    std::vector<std::string> label_values;
+    label_values.push_back("Echo");
+    *mdvar.get_stats(label_values) << 3;
+    bvar::Status<std::string> text_var("my_text_var", "not a number");
+
+    ClosureChecker done;
+    brpc::Controller cntl;
+    service.default_method(&cntl, &req, &res, &done);
+    EXPECT_FALSE(cntl.Failed());
+    EXPECT_EQ("text/plain; version=0.0.4",
+              cntl.http_response().content_type());
+    const std::string content = cntl.response_attachment().to_string();
+    EXPECT_NE(std::string::npos,
+              content.find("# TYPE my_prom_var gauge\nmy_prom_var 9\n"));
+    EXPECT_NE(std::string::npos,
+              content.find("# TYPE my_md_var gauge\n"
+                           "my_md_var{method=\"Echo\"} 3\n"));
+    EXPECT_EQ(std::string::npos, content.find("my_text_var"));
+}
+
 TEST_F(BuiltinServiceTest, rpcz) {
     for (int i = 0; i <= 1; ++i) {  // enable rpcz
         for (int j = 0; j <= 1; ++j) {  // hex log id
@@ -817,3 +907,44 @@ TEST_F(BuiltinServiceTest, sockets) {
         CheckContent(cntl, "fd=-1");
     }    
 }
+
+void* burn_cpu_in_echo(void*) {
+    brpc::ScopedProfiledMethod profiled_method(
+        test::EchoService::descriptor()->FindMethodByName("Echo"));
+    const int64_t end_us = butil::gettimeofday_us() + 500000;
+    volatile int64_t sum = 0;
+    while (butil::gettimeofday_us() < end_us) {
+        for (int i = 0; i < 10000; ++i) {
+            sum += i;
+        }
+    }
+    return NULL;
+}
+
+TEST_F(BuiltinServiceTest, continuous_profiler) {
+    brpc::HotspotsService service;
+    {
+        ClosureChecker done;
+        brpc::Controller cntl;
+        service.continuous(&cntl, NULL, NULL, &done);
+        EXPECT_EQ(brpc::HTTP_STATUS_FORBIDDEN,
+                  cntl.http_response().status_code());
+        CheckContent(cntl, "not enabled");
+    }
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "continuous_profiling_hz", "97").empty());
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, burn_cpu_in_echo, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // Wait for the collecting thread.
+    usleep(300000);
+    {
+        ClosureChecker done;
+        brpc::Controller cntl;
+        service.continuous(&cntl, NULL, NULL, &done);
+        EXPECT_FALSE(cntl.Failed());
+        CheckContent(cntl, "test.EchoService.Echo;");
+    }
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "continuous_profiling_hz", "0").empty());
+}
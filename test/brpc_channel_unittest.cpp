@@ -3,6 +3,7 @@
 
 // Date: Sun Jul 13 15:04:18 CST 2014
 
+#include <set>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <gtest/gtest.h>
@@ -30,6 +31,7 @@
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
 DECLARE_int32(max_connection_pool_size);
+DECLARE_bool(share_load_balancer);
 class Server;
 class MethodStatus;
 namespace policy {
@@ -451,6 +453,24 @@ protected:
     };
 
 
+    // Sub calls after the first two are slow.
+    class SetCodeAndDelayTail : public brpc::CallMapper {
+    public:
+        brpc::SubCall Map(
+            int channel_index,
+            const google::protobuf::MethodDescriptor* method,
+            const google::protobuf::Message* req_base,
+            google::protobuf::Message* response) {
+            test::EchoRequest* req = brpc::Clone<test::EchoRequest>(req_base);
+            req->set_code(channel_index + 1/*non-zero*/);
+            if (channel_index >= 2) {
+                req->set_sleep_us(500000);
+            }
+            return brpc::SubCall(method, req, response->New(),
+                                brpc::DELETE_REQUEST | brpc::DELETE_RESPONSE);
+        }
+    };
+
     class GetReqAndAddRes : public brpc::CallMapper {
         brpc::SubCall Map(
             int channel_index,
@@ -523,6 +543,129 @@ protected:
         StopAndJoin();
     }
 
+    void TestSuccessLimitParallel(
+        bool single_server, bool async, bool short_connection) {
+        std::cout << " *** single=" << single_server
+                  << " async=" << async
+                  << " short=" << short_connection << std::endl;
+
+        ASSERT_EQ(0, StartAccept(_ep));
+        const size_t NCHANS = 4;
+        brpc::Channel subchans[NCHANS];
+        brpc::ParallelChannel channel;
+        brpc::ParallelChannelOptions options;
+        options.success_limit = 2;
+        // Canceled sub calls are not failures.
+        options.fail_limit = 1;
+        options.timeout_ms = 2000;
+        ASSERT_EQ(0, channel.Init(&options));
+        for (size_t i = 0; i < NCHANS; ++i) {
+            SetUpChannel(&subchans[i], single_server, short_connection);
+            ASSERT_EQ(0, channel.AddChannel(
+                          &subchans[i], brpc::DOESNT_OWN_CHANNEL,
+                          new SetCodeAndDelayTail, NULL));
+        }
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(__FUNCTION__);
+        const int64_t start_time = butil::gettimeofday_us();
+        CallMethod(&channel, &cntl, &req, &res, async);
+        // Not delayed by the slow sub calls.
+        EXPECT_LT(butil::gettimeofday_us(), start_time + 400000L);
+
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_EQ(NCHANS, (size_t)cntl.sub_count());
+        for (int i = 0; i < cntl.sub_count(); ++i) {
+            if (i < 2) {
+                EXPECT_FALSE(cntl.sub(i)->Failed()) << "i=" << i;
+            } else {
+                EXPECT_EQ(brpc::EPCHANENOUGH, cntl.sub(i)->ErrorCode())
+                    << "i=" << i;
+            }
+        }
+        // Only responses of the winners are merged.
+        ASSERT_EQ(2, res.code_list_size());
+        std::set<int> codes(res.code_list().begin(), res.code_list().end());
+        EXPECT_EQ(1u, codes.count(1));
+        EXPECT_EQ(1u, codes.count(2));
+        StopAndJoin();
+    }
+
+    void TestIncrementalMergeParallel(
+        bool single_server, bool async, bool short_connection) {
+        std::cout << " *** single=" << single_server
+                  << " async=" << async
+                  << " short=" << short_connection << std::endl;
+
+        ASSERT_EQ(0, StartAccept(_ep));
+        const size_t NCHANS = 8;
+        brpc::Channel subchans[NCHANS];
+        brpc::ParallelChannel channel;
+        brpc::ParallelChannelOptions options;
+        options.incremental_merge = true;
+        ASSERT_EQ(0, channel.Init(&options));
+        for (size_t i = 0; i < NCHANS; ++i) {
+            SetUpChannel(&subchans[i], single_server, short_connection);
+            ASSERT_EQ(0, channel.AddChannel(
+                          &subchans[i], brpc::DOESNT_OWN_CHANNEL,
+                          new SetCode, NULL));
+        }
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(__FUNCTION__);
+        CallMethod(&channel, &cntl, &req, &res, async);
+
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_EQ("received " + std::string(__FUNCTION__), res.message());
+        // All responses are merged in the order of arrival.
+        ASSERT_EQ(NCHANS, (size_t)res.code_list_size());
+        std::set<int> codes(res.code_list().begin(), res.code_list().end());
+        ASSERT_EQ(NCHANS, codes.size());
+        EXPECT_EQ(1, *codes.begin());
+        EXPECT_EQ((int)NCHANS, *codes.rbegin());
+        StopAndJoin();
+    }
+
+    void TestSharedRequestParallel(
+        bool single_server, bool async, bool short_connection) {
+        std::cout << " *** single=" << single_server
+                  << " async=" << async
+                  << " short=" << short_connection << std::endl;
+
+        ASSERT_EQ(0, StartAccept(_ep));
+        const size_t NCHANS = 8;
+        brpc::Channel subchans[NCHANS];
+        brpc::ParallelChannel channel;
+        for (size_t i = 0; i < NCHANS; ++i) {
+            SetUpChannel(&subchans[i], single_server, short_connection);
+            // All sub channels get the same request without CallMapper.
+            ASSERT_EQ(0, channel.AddChannel(
+                          &subchans[i], brpc::DOESNT_OWN_CHANNEL, NULL, NULL));
+        }
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(std::string(10000, 'a'));
+        CallMethod(&channel, &cntl, &req, &res, async);
+
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        ASSERT_EQ(NCHANS, (size_t)cntl.sub_count());
+        // Serialized once and shared by all sub calls.
+        const brpc::Controller* first = cntl.sub(0);
+        ASSERT_TRUE(first != NULL);
+        ASSERT_FALSE(first->_request_buf.empty());
+        for (int i = 0; i < cntl.sub_count(); ++i) {
+            const brpc::Controller* sub = cntl.sub(i);
+            ASSERT_TRUE(sub && !sub->Failed()) << "i=" << i;
+            ASSERT_EQ(first->_request_buf, sub->_request_buf);
+            ASSERT_EQ(first->_request_buf.backing_block(0).data(),
+                      sub->_request_buf.backing_block(0).data());
+        }
+        StopAndJoin();
+    }
+
     void TestSuccessDuplicatedParallel(
         bool single_server, bool async, bool short_connection) {
         std::cout << " *** single=" << single_server
@@ -1741,6 +1884,72 @@ protected:
         StopAndJoin();
     }
 
+    void CallWithResponseCache(brpc::Channel* channel, const char* message,
+                               bool async, bool from_cache) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(message);
+        CallMethod(channel, &cntl, &req, &res, async);
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_EQ("received " + std::string(message), res.message());
+        EXPECT_EQ(from_cache, cntl.response_from_cache()) << message;
+    }
+
+    void TestResponseCache(bool single_server, bool async) {
+        std::cout << " *** single=" << single_server
+                  << " async=" << async << std::endl;
+
+        ASSERT_EQ(0, StartAccept(_ep));
+        brpc::ClientResponseCacheOptions cache_options;
+        cache_options.fresh_ms = 100;
+        cache_options.stale_ms = 200;
+        brpc::ClientResponseCache cache(cache_options);
+        brpc::ChannelOptions opt;
+        opt.max_retry = 0;
+        opt.response_cache = &cache;
+        brpc::Channel channel;
+        brpc::Channel channel2;
+        if (single_server) {
+            ASSERT_EQ(0, channel.Init(_ep, &opt));
+            ASSERT_EQ(0, channel2.Init(_ep, &opt));
+        } else {
+            ASSERT_EQ(0, channel.Init(_naming_url.c_str(), "rr", &opt));
+            ASSERT_EQ(0, channel2.Init(_naming_url.c_str(), "rr", &opt));
+        }
+        CallWithResponseCache(&channel, "a", async, false);
+        CallWithResponseCache(&channel, "a", async, true);
+        CallWithResponseCache(&channel, "b", async, false);
+        // Shared by channels.
+        CallWithResponseCache(&channel2, "b", async, true);
+        EXPECT_EQ(2, cache.hit_count());
+
+        // Failed calls are not cached.
+        for (int i = 0; i < 2; ++i) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message("a");
+            req.set_server_fail(brpc::EINTERNAL);
+            CallMethod(&channel, &cntl, &req, &res, async);
+            EXPECT_EQ(brpc::EINTERNAL, cntl.ErrorCode());
+            EXPECT_FALSE(cntl.response_from_cache());
+        }
+
+        // The stale response is returned and refreshed in background.
+        bthread_usleep(150000);
+        CallWithResponseCache(&channel, "a", async, true);
+        // Dropped after fresh_ms + stale_ms without the refreshing.
+        bthread_usleep(200000);
+        CallWithResponseCache(&channel, "a", async, true);
+        CallWithResponseCache(&channel, "b", async, false);
+
+        cache.Clear();
+        EXPECT_EQ(0, cache.memory());
+        CallWithResponseCache(&channel, "a", async, false);
+        StopAndJoin();
+    }
+
     butil::EndPoint _ep;
     butil::TempFile _server_list;                                        
     std::string _naming_url;
@@ -1878,6 +2087,8 @@ TEST_F(ChannelTest, init_using_naming_service) {
                 dynamic_cast<brpc::LoadBalancerWithNaming*>(channels[i]._lb.get());
             ASSERT_TRUE(lb2 != NULL);
             ASSERT_EQ(ns, lb2->_nsthread_ptr.get());
+            // and the same load balancer, names are case-insensitive.
+            ASSERT_EQ(lb, lb2);
         }
     }
 
@@ -1888,6 +2099,13 @@ TEST_F(ChannelTest, init_using_naming_service) {
     delete channel;
     ASSERT_EQ(lb, another_ctx.get());
     ASSERT_EQ(1, another_ctx->_nref.load());
+
+    // Channels have their own load balancers when sharing is off.
+    brpc::FLAGS_share_load_balancer = false;
+    brpc::Channel channel2;
+    ASSERT_EQ(0, channel2.Init(naming_url.c_str(), "rr", NULL));
+    ASSERT_NE(lb, channel2._lb.get());
+    brpc::FLAGS_share_load_balancer = true;
     // `lb' should be destroyed after
 }
 
@@ -2023,6 +2241,16 @@ TEST_F(ChannelTest, success_parallel) {
     }
 }
 
+TEST_F(ChannelTest, shared_request_parallel) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
+            for (int k = 0; k <=1; ++k) { // Flag ShortConnection
+                TestSharedRequestParallel(i, j, k);
+            }
+        }
+    }
+}
+
 TEST_F(ChannelTest, success_duplicated_parallel) {
     for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
         for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
@@ -2033,6 +2261,26 @@ TEST_F(ChannelTest, success_duplicated_parallel) {
     }
 }
 
+TEST_F(ChannelTest, success_limit_parallel) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
+            for (int k = 0; k <=1; ++k) { // Flag ShortConnection
+                TestSuccessLimitParallel(i, j, k);
+            }
+        }
+    }
+}
+
+TEST_F(ChannelTest, incremental_merge_parallel) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
+            for (int k = 0; k <=1; ++k) { // Flag ShortConnection
+                TestIncrementalMergeParallel(i, j, k);
+            }
+        }
+    }
+}
+
 TEST_F(ChannelTest, success_selective) {
     for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
         for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
@@ -2321,6 +2569,14 @@ TEST_F(ChannelTest, retry_other_servers) {
     }
 }
 
+TEST_F(ChannelTest, response_cache) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
+            TestResponseCache(i, j);
+        }
+    }
+}
+
 TEST_F(ChannelTest, multiple_threads_single_channel) {
     srand(time(NULL));
     ASSERT_EQ(0, StartAccept(_ep));
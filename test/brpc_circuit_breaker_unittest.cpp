@@ -0,0 +1,103 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "brpc/errno.pb.h"
+#include "brpc/circuit_breaker.h"
+#include "brpc/retry_policy.h"
+
+namespace brpc {
+DECLARE_int32(circuit_breaker_window_size);
+DECLARE_int32(circuit_breaker_min_isolation_ms);
+DECLARE_int32(circuit_breaker_recovery_ms);
+}
+
+namespace {
+
+class CircuitBreakerTest : public ::testing::Test {
+protected:
+    CircuitBreakerTest() {
+        brpc::FLAGS_circuit_breaker_window_size = 20;
+        brpc::FLAGS_circuit_breaker_min_isolation_ms = 100;
+        brpc::FLAGS_circuit_breaker_recovery_ms = 1000;
+    }
+};
+
+TEST_F(CircuitBreakerTest, error_rate) {
+    brpc::CircuitBreaker cb;
+    for (int i = 0; i < 1000; ++i) {
+        // 10% errors are tolerated.
+        ASSERT_TRUE(cb.OnCallEnd(i % 10 == 0 ? brpc::EFAILEDSOCKET : 0, 1000));
+    }
+    // Cancellations are not counted.
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(cb.OnCallEnd(ECANCELED, 1000));
+    }
+    ASSERT_FALSE(cb.broken());
+    int i = 0;
+    for (; i < 100 && cb.OnCallEnd(brpc::ERPCTIMEDOUT, 1000); ++i) {}
+    ASSERT_LT(i, 100);
+    ASSERT_TRUE(cb.broken());
+    ASSERT_EQ(100, cb.isolation_duration_ms());
+    ASSERT_GT(cb.isolation_remaining_us(), 0);
+    // Calls sent before the isolation are ignored.
+    ASSERT_TRUE(cb.OnCallEnd(brpc::ERPCTIMEDOUT, 1000));
+}
+
+TEST_F(CircuitBreakerTest, latency) {
+    brpc::CircuitBreaker cb;
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(cb.OnCallEnd(0, 1000));
+    }
+    int i = 0;
+    for (; i < 100 && cb.OnCallEnd(0, 100000); ++i) {}
+    ASSERT_LT(i, 100);
+    ASSERT_TRUE(cb.broken());
+}
+
+TEST_F(CircuitBreakerTest, recovery) {
+    brpc::CircuitBreaker cb;
+    for (int i = 0; i < 100 && cb.OnCallEnd(brpc::EFAILEDSOCKET, 1000); ++i) {}
+    ASSERT_TRUE(cb.broken());
+    ASSERT_EQ(1000, cb.admission_permille());
+    cb.OnRevived();
+    ASSERT_FALSE(cb.broken());
+    ASSERT_EQ(0, cb.isolation_remaining_us());
+    ASSERT_LT(cb.admission_permille(), 100);
+    usleep(500000);
+    const int permille = cb.admission_permille();
+    ASSERT_GT(permille, 300);
+    ASSERT_LT(permille, 800);
+
+    // Broken again soon after the recovery, isolated longer.
+    for (int i = 0; i < 100 && cb.OnCallEnd(brpc::EFAILEDSOCKET, 1000); ++i) {}
+    ASSERT_TRUE(cb.broken());
+    ASSERT_EQ(200, cb.isolation_duration_ms());
+
+    cb.Reset();
+    ASSERT_FALSE(cb.broken());
+    ASSERT_EQ(1000, cb.admission_permille());
+}
+
+TEST(RetryBudgetTest, sanity) {
+    brpc::RetryBudgetOptions opt;
+    opt.retry_ratio = 0.5;
+    opt.max_retry_burst = 2;
+    brpc::RetryBudget budget(opt);
+    ASSERT_EQ(2, budget.remaining_retries());
+    ASSERT_TRUE(budget.Withdraw());
+    ASSERT_TRUE(budget.Withdraw());
+    ASSERT_FALSE(budget.Withdraw());
+    budget.Deposit();
+    ASSERT_FALSE(budget.Withdraw());
+    budget.Deposit();
+    ASSERT_TRUE(budget.Withdraw());
+    // Capped by the burst.
+    for (int i = 0; i < 100; ++i) {
+        budget.Deposit();
+    }
+    ASSERT_EQ(2, budget.remaining_retries());
+}
+
+} // namespace
@@ -0,0 +1,155 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "bthread/bthread.h"
+#include "brpc/global.h"
+#include "brpc/compress.h"
+#include "brpc/policy/gzip_compress.h"
+#include "echo.pb.h"
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    brpc::GlobalInitializeOrDie();
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+// Pretends to be a device by running the software gzip in another bthread.
+class MockAccelerator : public brpc::CompressAccelerator {
+public:
+    enum Mode { WORKING, SATURATED, BROKEN };
+
+    MockAccelerator() : mode(WORKING), nsubmit(0) {}
+
+    int SubmitCompress(const butil::IOBuf& in, butil::IOBuf* out,
+                       brpc::CompressDone* done) {
+        return Submit(true, in, out, done);
+    }
+
+    int SubmitDecompress(const butil::IOBuf& in, butil::IOBuf* out,
+                         brpc::CompressDone* done) {
+        return Submit(false, in, out, done);
+    }
+
+    Mode mode;
+    int nsubmit;
+
+private:
+    struct Job {
+        bool compress;
+        bool broken;
+        const butil::IOBuf* in;
+        butil::IOBuf* out;
+        brpc::CompressDone* done;
+    };
+
+    static void* RunJob(void* arg) {
+        Job* job = static_cast<Job*>(arg);
+        bthread_usleep(1000);
+        bool ok = false;
+        if (job->broken) {
+            // Partial output must be dropped by the framework.
+            job->out->append("garbage");
+        } else {
+            ok = (job->compress ? brpc::policy::GzipCompress(*job->in, job->out, NULL)
+                  : brpc::policy::GzipDecompress(*job->in, job->out));
+        }
+        brpc::CompressDone* done = job->done;
+        delete job;
+        done->Finish(ok);
+        return NULL;
+    }
+
+    int Submit(bool compress, const butil::IOBuf& in, butil::IOBuf* out,
+               brpc::CompressDone* done) {
+        if (mode == SATURATED) {
+            return -1;
+        }
+        ++nsubmit;
+        Job* job = new Job;
+        job->compress = compress;
+        job->broken = (mode == BROKEN);
+        job->in = &in;
+        job->out = out;
+        job->done = done;
+        bthread_t tid;
+        EXPECT_EQ(0, bthread_start_background(&tid, NULL, RunJob, job));
+        return 0;
+    }
+};
+
+MockAccelerator* g_accelerator = NULL;
+
+// Compressed size is still above -compress_accelerator_min_size.
+std::string RandomText(size_t len) {
+    std::string s;
+    for (size_t i = 0; i < len; ++i) {
+        s.push_back('a' + butil::fast_rand_less_than(26));
+    }
+    return s;
+}
+
+void RoundTrip(const std::string& text) {
+    test::EchoRequest req;
+    req.set_message(text);
+    butil::IOBuf buf;
+    ASSERT_TRUE(brpc::SerializeAsCompressedData(
+                    req, &buf, brpc::COMPRESS_TYPE_GZIP));
+    // Always decodable by the software handler.
+    butil::IOBuf raw;
+    ASSERT_TRUE(brpc::policy::GzipDecompress(buf, &raw));
+    test::EchoRequest req2;
+    ASSERT_TRUE(brpc::ParseFromCompressedData(
+                    buf, &req2, brpc::COMPRESS_TYPE_GZIP));
+    ASSERT_EQ(text, req2.message());
+}
+
+class CompressAcceleratorTest : public testing::Test {
+protected:
+    void SetUp() {
+        if (g_accelerator == NULL) {
+            g_accelerator = new MockAccelerator;
+            ASSERT_EQ(0, brpc::RegisterCompressAccelerator(
+                          brpc::COMPRESS_TYPE_GZIP, g_accelerator));
+        }
+        g_accelerator->mode = MockAccelerator::WORKING;
+        g_accelerator->nsubmit = 0;
+    }
+};
+
+TEST_F(CompressAcceleratorTest, register) {
+    MockAccelerator other;
+    ASSERT_EQ(-1, brpc::RegisterCompressAccelerator(
+                  brpc::COMPRESS_TYPE_GZIP, &other));
+    ASSERT_EQ(-1, brpc::RegisterCompressAccelerator(
+                  brpc::COMPRESS_TYPE_NONE, &other));
+}
+
+TEST_F(CompressAcceleratorTest, offload) {
+    RoundTrip(RandomText(64 * 1024));
+    ASSERT_EQ(2, g_accelerator->nsubmit);
+}
+
+TEST_F(CompressAcceleratorTest, small_payloads_use_software) {
+    RoundTrip("hello");
+    ASSERT_EQ(0, g_accelerator->nsubmit);
+}
+
+TEST_F(CompressAcceleratorTest, fallback_when_saturated) {
+    g_accelerator->mode = MockAccelerator::SATURATED;
+    RoundTrip(RandomText(64 * 1024));
+    ASSERT_EQ(0, g_accelerator->nsubmit);
+}
+
+TEST_F(CompressAcceleratorTest, fallback_when_broken) {
+    g_accelerator->mode = MockAccelerator::BROKEN;
+    RoundTrip(RandomText(64 * 1024));
+    ASSERT_EQ(2, g_accelerator->nsubmit);
+}
+
+} // namespace
@@ -0,0 +1,132 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "brpc/adaptive_max_concurrency.h"
+#include "brpc/policy/auto_concurrency_limiter.h"
+#include "brpc/details/method_status.h"
+
+namespace brpc {
+DECLARE_int32(codel_target_delay_ms);
+DECLARE_int32(codel_interval_ms);
+DECLARE_bool(lazy_method_status);
+namespace policy {
+DECLARE_int32(auto_cl_sample_window_ms);
+DECLARE_int32(auto_cl_min_sample_count);
+DECLARE_int32(auto_cl_initial_max_concurrency);
+}
+}
+
+namespace {
+
+TEST(ConcurrencyLimiterTest, adaptive_max_concurrency) {
+    brpc::AdaptiveMaxConcurrency amc;
+    ASSERT_EQ(0, amc);
+    ASSERT_FALSE(amc.is_adaptive());
+    amc = 10;
+    ASSERT_EQ(10, amc);
+    ASSERT_EQ("10", amc.value());
+    amc = "auto";
+    ASSERT_EQ(0, amc);
+    ASSERT_TRUE(amc.is_adaptive());
+    ASSERT_EQ("auto", amc.value());
+    amc = "20";
+    ASSERT_EQ(20, amc);
+    ASSERT_FALSE(amc.is_adaptive());
+}
+
+TEST(ConcurrencyLimiterTest, auto_limit) {
+    brpc::policy::FLAGS_auto_cl_sample_window_ms = 10;
+    brpc::policy::FLAGS_auto_cl_min_sample_count = 10;
+    brpc::policy::AutoConcurrencyLimiter* cl =
+        brpc::policy::AutoConcurrencyLimiter().New();
+    ASSERT_EQ(brpc::policy::FLAGS_auto_cl_initial_max_concurrency,
+              cl->MaxConcurrency());
+    ASSERT_TRUE(cl->OnRequested(cl->MaxConcurrency()));
+    ASSERT_FALSE(cl->OnRequested(cl->MaxConcurrency() + 1));
+
+    // 100 requests of 1ms in each 10ms: qps=10000 and the concurrency
+    // without queueing is 10.
+    butil::Timer tm;
+    tm.start();
+    do {
+        for (int i = 0; i < 100; ++i) {
+            cl->OnResponded(true, 1000);
+        }
+        usleep(10000);
+        tm.stop();
+    } while (tm.m_elapsed() < 500);
+    LOG(INFO) << "max_concurrency=" << cl->MaxConcurrency();
+    ASSERT_GE(cl->MaxConcurrency(), 5);
+    ASSERT_LE(cl->MaxConcurrency(), 20);
+    cl->Destroy();
+    brpc::policy::FLAGS_auto_cl_sample_window_ms = 1000;
+    brpc::policy::FLAGS_auto_cl_min_sample_count = 100;
+}
+
+TEST(ConcurrencyLimiterTest, shed_requests_queued_too_long) {
+    const int32_t saved_target = brpc::FLAGS_codel_target_delay_ms;
+    const int32_t saved_interval = brpc::FLAGS_codel_interval_ms;
+    brpc::FLAGS_codel_target_delay_ms = 10;
+    brpc::FLAGS_codel_interval_ms = 20;
+    brpc::MethodStatus status;
+    // Not overloaded until all requests in an interval exceeded target.
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_TRUE(status.OnRequested());
+        ASSERT_TRUE(status.OnDispatched(butil::cpuwide_time_us() - 50000));
+        status.OnResponded(true, 1);
+        ASSERT_TRUE(status.OnRequested());
+        ASSERT_TRUE(status.OnDispatched(butil::cpuwide_time_us()));
+        status.OnResponded(true, 1);
+        usleep(5000);
+    }
+    bool shed = false;
+    for (int i = 0; i < 20 && !shed; ++i) {
+        ASSERT_TRUE(status.OnRequested());
+        shed = !status.OnDispatched(butil::cpuwide_time_us() - 50000);
+        status.OnResponded(!shed, 1);
+        usleep(5000);
+    }
+    ASSERT_TRUE(shed);
+    // Newer requests are still accepted when overloaded.
+    ASSERT_TRUE(status.OnRequested());
+    ASSERT_TRUE(status.OnDispatched(butil::cpuwide_time_us() - 15000));
+    status.OnResponded(true, 1);
+    // Recovered after an interval of short queueing latencies.
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_TRUE(status.OnRequested());
+        ASSERT_TRUE(status.OnDispatched(butil::cpuwide_time_us()));
+        status.OnResponded(true, 1);
+        usleep(5000);
+    }
+    ASSERT_TRUE(status.OnRequested());
+    ASSERT_TRUE(status.OnDispatched(butil::cpuwide_time_us() - 50000));
+    status.OnResponded(true, 1);
+    brpc::FLAGS_codel_target_delay_ms = saved_target;
+    brpc::FLAGS_codel_interval_ms = saved_interval;
+}
+
+TEST(ConcurrencyLimiterTest, lazy_method_status) {
+    brpc::FLAGS_lazy_method_status = true;
+    brpc::MethodStatus status;
+    ASSERT_EQ(0, status.Expose("lazy_method_status_unittest"));
+    // Not exposed until the first call.
+    ASSERT_EQ("", bvar::Variable::describe_exposed(
+                  "lazy_method_status_unittest_count"));
+    std::ostringstream os;
+    status.Describe(os, brpc::DescribeOptions());
+    ASSERT_NE(std::string::npos, os.str().find("count: 0")) << os.str();
+    ASSERT_TRUE(status.OnRequested());
+    status.OnResponded(true, 1);
+    ASSERT_EQ("1", bvar::Variable::describe_exposed(
+                  "lazy_method_status_unittest_count"));
+    brpc::FLAGS_lazy_method_status = false;
+
+    brpc::MethodStatus status2;
+    ASSERT_EQ(0, status2.Expose("eager_method_status_unittest"));
+    ASSERT_EQ("0", bvar::Variable::describe_exposed(
+                  "eager_method_status_unittest_count"));
+}
+
+} // namespace
@@ -56,3 +56,46 @@ TEST_F(ControllerTest, notify_on_destruction) {
     delete cntl;
     ASSERT_TRUE(cancel);
 }
+
+TEST_F(ControllerTest, reset_rare_fields) {
+    brpc::Controller cntl;
+    ASSERT_TRUE(cntl._ext == NULL);
+    ASSERT_EQ("", cntl.thrift_method_name());
+    ASSERT_FALSE(cntl.has_remote_stream());
+    ASSERT_TRUE(cntl.rpc_dump_meta() == NULL);
+    ASSERT_TRUE(cntl._ext == NULL);
+
+    cntl.set_thrift_method_name("Echo");
+    ASSERT_TRUE(cntl._ext != NULL);
+    ASSERT_EQ("Echo", cntl.thrift_method_name());
+
+    // The extension is kept for following RPCs after being cleared.
+    brpc::Controller::Extension* ext = cntl._ext;
+    cntl.Reset();
+    ASSERT_EQ(ext, cntl._ext);
+    ASSERT_EQ("", cntl.thrift_method_name());
+}
+
+TEST_F(ControllerTest, phase_times) {
+    brpc::RpcPhaseTimes times;
+    // Nothing is marked when -rpc_phase_latency is off.
+    times.Mark(brpc::RPC_CLIENT_BEGIN, 100);
+    ASSERT_EQ(-1, times.Between(brpc::RPC_CLIENT_BEGIN,
+                                brpc::RPC_CLIENT_SERIALIZED));
+
+    brpc::FLAGS_rpc_phase_latency = true;
+    times.Mark(brpc::RPC_CLIENT_BEGIN, 100);
+    ASSERT_EQ(-1, times.Between(brpc::RPC_CLIENT_BEGIN,
+                                brpc::RPC_CLIENT_SERIALIZED));
+    times.Mark(brpc::RPC_CLIENT_SERIALIZED, 130);
+    ASSERT_EQ(30, times.Between(brpc::RPC_CLIENT_BEGIN,
+                                brpc::RPC_CLIENT_SERIALIZED));
+    // Points reached out of order are not counted.
+    times.Mark(brpc::RPC_CLIENT_WRITTEN, 120);
+    ASSERT_EQ(-1, times.Between(brpc::RPC_CLIENT_SERIALIZED,
+                                brpc::RPC_CLIENT_WRITTEN));
+    times.Reset();
+    ASSERT_EQ(-1, times.Between(brpc::RPC_CLIENT_BEGIN,
+                                brpc::RPC_CLIENT_SERIALIZED));
+    brpc::FLAGS_rpc_phase_latency = false;
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "bthread/bthread.h"
+#include "bthread/countdown_event.h"
+#include "brpc/coroutine.h"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+namespace {
+
+void* RunDoneLater(void* arg) {
+    google::protobuf::Closure* done = (google::protobuf::Closure*)arg;
+    bthread_usleep(10000);
+    done->Run();
+    return NULL;
+}
+
+brpc::CoTask CallInline(int* stage, bthread::CountdownEvent* ev) {
+    *stage = 1;
+    co_await brpc::AwaitCall([](google::protobuf::Closure* done) {
+            done->Run();
+        });
+    *stage = 2;
+    ev->signal();
+}
+
+brpc::CoTask CallInBthread(int* stage, bthread_t* resumed_in,
+                           bthread::CountdownEvent* ev) {
+    *stage = 1;
+    for (int i = 0; i < 2; ++i) {
+        co_await brpc::AwaitCall([](google::protobuf::Closure* done) {
+                bthread_t th;
+                ASSERT_EQ(0, bthread_start_background(
+                              &th, NULL, RunDoneLater, done));
+            });
+        ++*stage;
+    }
+    *resumed_in = bthread_self();
+    ev->signal();
+}
+
+TEST(CoroutineTest, done_run_before_suspension) {
+    int stage = 0;
+    bthread::CountdownEvent ev(1);
+    CallInline(&stage, &ev);
+    // Not suspended at all.
+    ASSERT_EQ(2, stage);
+    ASSERT_EQ(0, ev.wait());
+}
+
+TEST(CoroutineTest, resumed_in_done) {
+    int stage = 0;
+    bthread_t resumed_in = 0;
+    bthread::CountdownEvent ev(1);
+    CallInBthread(&stage, &resumed_in, &ev);
+    // Returned at the first suspension.
+    ASSERT_EQ(1, stage);
+    ASSERT_EQ(0, ev.wait());
+    ASSERT_EQ(3, stage);
+    ASSERT_NE(0UL, resumed_in);
+}
+
+} // namespace
+
+#endif  // __cpp_impl_coroutine
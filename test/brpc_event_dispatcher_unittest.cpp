@@ -7,13 +7,19 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/gperftools_profiler.h"
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/fd_utility.h"
+#include "bthread/bthread.h"
 #include "brpc/event_dispatcher.h"
 #include "brpc/details/has_epollrdhup.h"
 
+namespace brpc {
+DECLARE_bool(event_dispatcher_busy_poll);
+}
+
 class EventDispatcherTest : public ::testing::Test{
 protected:
     EventDispatcherTest(){
@@ -36,6 +42,30 @@ TEST_F(EventDispatcherTest, versioned_ref) {
     ASSERT_EQ(brpc::MakeVRef(1, 1), versioned_ref);
 }
 
+static void* dummy_bthread(void* arg) {
+    *(bool*)arg = true;
+    return NULL;
+}
+
+TEST_F(EventDispatcherTest, busy_poll) {
+    brpc::FLAGS_event_dispatcher_busy_poll = true;
+    brpc::EventDispatcher* edisp = new brpc::EventDispatcher;
+    ASSERT_EQ(0, edisp->Start(NULL));
+    brpc::FLAGS_event_dispatcher_busy_poll = false;
+    ASSERT_TRUE(edisp->Running());
+    // The spinning dispatcher does not occupy bthread workers.
+    bool ran = false;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, dummy_bthread, &ran));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_TRUE(ran);
+    usleep(100000);
+    edisp->Stop();
+    edisp->Join();
+    ASSERT_FALSE(edisp->Running());
+    delete edisp;
+}
+
 std::vector<int> err_fd;
 pthread_mutex_t err_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -0,0 +1,94 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "brpc/hls.h"
+
+namespace {
+
+brpc::RtmpAudioMessage MakeAACMessage(uint32_t timestamp,
+                                      brpc::FlvAACPacketType type) {
+    brpc::RtmpAudioMessage msg;
+    msg.timestamp = timestamp;
+    msg.codec = brpc::FLV_AUDIO_AAC;
+    msg.rate = brpc::FLV_SOUND_RATE_44100HZ;
+    msg.bits = brpc::FLV_SOUND_16BIT;
+    msg.type = brpc::FLV_SOUND_STEREO;
+    msg.data.push_back((char)type);
+    if (type == brpc::FLV_AAC_PACKET_SEQUENCE_HEADER) {
+        // AAC-LC, 44100HZ, stereo.
+        msg.data.push_back(0x12);
+        msg.data.push_back(0x10);
+    } else {
+        msg.data.append(std::string(300, 'a'));
+    }
+    return msg;
+}
+
+TEST(HlsTest, rolling_audio_segments) {
+    brpc::HlsSegmenterOptions options;
+    options.target_duration_ms = 2000;
+    options.max_segments = 3;
+    options.segment_uri_prefix = "/hls/";
+    brpc::HlsSegmenter segmenter(options);
+    ASSERT_TRUE(segmenter.Write(
+        MakeAACMessage(0, brpc::FLV_AAC_PACKET_SEQUENCE_HEADER)).ok());
+    // 10 seconds at 23ms per frame.
+    for (uint32_t ts = 0; ts < 10000; ts += 23) {
+        ASSERT_TRUE(segmenter.Write(
+            MakeAACMessage(ts, brpc::FLV_AAC_PACKET_RAW)).ok());
+    }
+    // 4 segments are closed, the first one is dropped.
+    ASSERT_EQ(1, segmenter.first_sequence());
+    butil::IOBuf seg;
+    ASSERT_FALSE(segmenter.GetSegment(0, &seg));
+    ASSERT_FALSE(segmenter.GetSegment(4, &seg));
+    for (int64_t seq = 1; seq <= 3; ++seq) {
+        seg.clear();
+        ASSERT_TRUE(segmenter.GetSegment(seq, &seg));
+        ASSERT_FALSE(seg.empty());
+        ASSERT_EQ(0u, seg.size() % 188);
+        // Starts with the PAT.
+        char head[4];
+        seg.copy_to(head, sizeof(head));
+        ASSERT_EQ(0x47, head[0]);
+        ASSERT_EQ(0, head[1] & 0x1F);
+        ASSERT_EQ(0, head[2]);
+    }
+    segmenter.Flush();
+    ASSERT_EQ(2, segmenter.first_sequence());
+    ASSERT_TRUE(segmenter.GetSegment(4, &seg));
+
+    std::string playlist;
+    segmenter.GetPlaylist(&playlist);
+    ASSERT_EQ(0u, playlist.find("#EXTM3U\n"));
+    ASSERT_NE(std::string::npos, playlist.find("#EXT-X-MEDIA-SEQUENCE:2\n"));
+    ASSERT_NE(std::string::npos, playlist.find("#EXT-X-TARGETDURATION:3\n"));
+    ASSERT_NE(std::string::npos, playlist.find("#EXTINF:2.001,\n/hls/2.ts\n"));
+    ASSERT_NE(std::string::npos, playlist.find("/hls/4.ts\n"));
+    ASSERT_EQ(std::string::npos, playlist.find("/hls/1.ts\n"));
+}
+
+TEST(HlsTest, segments_share_blocks) {
+    brpc::HlsSegmenter segmenter((brpc::HlsSegmenterOptions()));
+    ASSERT_TRUE(segmenter.Write(
+        MakeAACMessage(0, brpc::FLV_AAC_PACKET_SEQUENCE_HEADER)).ok());
+    for (uint32_t ts = 0; ts < 100; ts += 23) {
+        ASSERT_TRUE(segmenter.Write(
+            MakeAACMessage(ts, brpc::FLV_AAC_PACKET_RAW)).ok());
+    }
+    butil::IOBuf viewer1;
+    butil::IOBuf viewer2;
+    // The current segment is not served until it's closed.
+    ASSERT_FALSE(segmenter.GetSegment(0, &viewer1));
+    segmenter.Flush();
+    ASSERT_TRUE(segmenter.GetSegment(0, &viewer1));
+    ASSERT_TRUE(segmenter.GetSegment(0, &viewer2));
+    ASSERT_EQ(viewer1.backing_block_num(), viewer2.backing_block_num());
+    for (size_t i = 0; i < viewer1.backing_block_num(); ++i) {
+        ASSERT_EQ(viewer1.backing_block(i).data(),
+                  viewer2.backing_block(i).data());
+    }
+}
+
+} // namespace
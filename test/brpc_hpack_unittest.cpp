@@ -6,6 +6,7 @@
 #include <gtest/gtest.h>
 #include "brpc/details/hpack.h"
 #include "butil/logging.h"
+#include "butil/time.h"
 
 class HPackTest : public testing::Test {
 };
@@ -527,3 +528,93 @@ TEST_F(HPackTest, responses_with_huffman) {
     }
     ASSERT_TRUE(buf.buf().empty());
 }
+
+TEST_F(HPackTest, huffman_of_all_bytes) {
+    brpc::HPacker p1;
+    ASSERT_EQ(0, p1.Init(4096));
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(4096));
+    brpc::HPackOptions options;
+    options.index_policy = brpc::HPACK_NEVER_INDEX_HEADER;
+    options.encode_name = true;
+    options.encode_value = true;
+    for (size_t len = 0; len < 300; ++len) {
+        brpc::HPacker::Header h;
+        h.name = "x-key";
+        for (size_t i = 0; i < len; ++i) {
+            h.value.push_back((char)((i * 131 + len) & 0xFF));
+        }
+        butil::IOBufAppender buf;
+        const ssize_t nwrite = p1.Encode(&buf, h, options);
+        ASSERT_EQ((size_t)nwrite, buf.buf().length());
+        brpc::HPacker::Header h2;
+        ASSERT_EQ(nwrite, p2.Decode(&buf.buf(), &h2));
+        ASSERT_EQ(h.name, h2.name);
+        ASSERT_EQ(h.value, h2.value);
+    }
+}
+
+TEST_F(HPackTest, invalid_huffman_strings) {
+    brpc::HPacker p;
+    ASSERT_EQ(0, p.Init(4096));
+    brpc::HPacker::Header h;
+    // Never indexed header with name="0" whose code is 00000 followed by
+    // padding `111', and an empty value.
+    const char valid[] = { 0x10, (char)0x81, 0x07, 0x00 };
+    butil::IOBuf buf;
+    buf.append(valid, sizeof(valid));
+    ASSERT_EQ((ssize_t)sizeof(valid), p.Decode(&buf, &h));
+    ASSERT_EQ("0", h.name);
+    ASSERT_EQ("", h.value);
+    // Padding is not MSB of EOS
+    const char bad_padding[] = { 0x10, (char)0x81, 0x00, 0x00 };
+    buf.append(bad_padding, sizeof(bad_padding));
+    ASSERT_EQ(-1, p.Decode(&buf, &h));
+    buf.clear();
+    // Padding is longer than 7 bits
+    const char long_padding[] = { 0x10, (char)0x82, 0x07, (char)0xff, 0x00 };
+    buf.append(long_padding, sizeof(long_padding));
+    ASSERT_EQ(-1, p.Decode(&buf, &h));
+    buf.clear();
+    // EOS is decoded
+    const char eos[] = { 0x10, (char)0x84, (char)0xff, (char)0xff,
+                         (char)0xff, (char)0xff, 0x00 };
+    buf.append(eos, sizeof(eos));
+    ASSERT_EQ(-1, p.Decode(&buf, &h));
+}
+
+TEST_F(HPackTest, huffman_perf) {
+    brpc::HPacker p1;
+    ASSERT_EQ(0, p1.Init(4096));
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(4096));
+    brpc::HPackOptions options;
+    options.index_policy = brpc::HPACK_NEVER_INDEX_HEADER;
+    options.encode_name = true;
+    options.encode_value = true;
+    brpc::HPacker::Header h;
+    h.name = "user-agent";
+    h.value = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/66.0.3359.139 Safari/537.36";
+    const size_t N = 100000;
+    butil::IOBufAppender appender;
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < N; ++i) {
+        p1.Encode(&appender, h, options);
+    }
+    tm.stop();
+    butil::IOBuf buf;
+    appender.move_to(buf);
+    const size_t raw_bytes = N * (h.name.size() + h.value.size());
+    LOG(INFO) << "Encode " << raw_bytes * 1000 / tm.n_elapsed()
+              << "MB/s into " << buf.size() << " bytes";
+    tm.start();
+    for (size_t i = 0; i < N; ++i) {
+        brpc::HPacker::Header h2;
+        ASSERT_GT(p2.Decode(&buf, &h2), 0);
+    }
+    tm.stop();
+    ASSERT_TRUE(buf.empty());
+    LOG(INFO) << "Decode " << raw_bytes * 1000 / tm.n_elapsed() << "MB/s";
+}
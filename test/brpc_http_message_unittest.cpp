@@ -4,6 +4,7 @@
 // Date 2014/10/24 16:44:30
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include <google/protobuf/descriptor.h>
 
 #include "brpc/server.h"
@@ -12,6 +13,7 @@
 #include "echo.pb.h"
 
 namespace brpc {
+DECLARE_bool(http_fast_parser);
 namespace policy {
 Server::MethodProperty*
 FindMethodPropertyByURI(const std::string& uri_path, const Server* server,
@@ -212,6 +214,118 @@ TEST(HttpMessageTest, parse_from_iobuf) {
     ASSERT_EQ("text/plain", http_message.header().content_type());
 }
 
+void ExpectSameMessage(const brpc::HttpMessage& m1,
+                       const brpc::HttpMessage& m2) {
+    const brpc::HttpHeader& h1 = m1.header();
+    const brpc::HttpHeader& h2 = m2.header();
+    ASSERT_EQ(m1.Completed(), m2.Completed());
+    ASSERT_EQ(h1.major_version(), h2.major_version());
+    ASSERT_EQ(h1.minor_version(), h2.minor_version());
+    ASSERT_EQ(h1.method(), h2.method());
+    ASSERT_EQ(h1.status_code(), h2.status_code());
+    ASSERT_EQ(h1.content_type(), h2.content_type());
+    ASSERT_EQ(h1.uri().path(), h2.uri().path());
+    ASSERT_EQ(h1.uri().host(), h2.uri().host());
+    size_t n = 0;
+    for (brpc::HttpHeader::HeaderIterator it = h1.HeaderBegin();
+         it != h1.HeaderEnd(); ++it, ++n) {
+        const std::string* value = h2.GetHeader(it->first);
+        ASSERT_TRUE(value) << it->first;
+        ASSERT_EQ(it->second, *value);
+    }
+    ASSERT_EQ(n, h2.HeaderCount());
+    ASSERT_EQ(m1.body().to_string(), m2.body().to_string());
+}
+
+void ParseWithAndWithoutFastParser(const std::string& msg) {
+    butil::IOBuf buf;
+    buf.append(msg);
+    brpc::HttpMessage slow_message;
+    brpc::FLAGS_http_fast_parser = false;
+    ASSERT_EQ((ssize_t)msg.size(), slow_message.ParseFromIOBuf(buf));
+    brpc::HttpMessage fast_message;
+    brpc::FLAGS_http_fast_parser = true;
+    ASSERT_EQ((ssize_t)msg.size(), fast_message.ParseFromIOBuf(buf));
+    ASSERT_TRUE(fast_message.Completed());
+    ExpectSameMessage(slow_message, fast_message);
+}
+
+TEST(HttpMessageTest, fast_parser_sanity) {
+    ParseWithAndWithoutFastParser(
+        "POST /path/file.html?sdfsdf=sdfs&sldf1=sdf HTTP/1.1\r\n"
+        "User-Agent: HTTPTool/1.0  \r\n"  // intended ending spaces
+        "Content-Type: json\r\n"
+        "Content-Length: 19\r\n"
+        "Host: myhost:8765\r\n"
+        "Foo:bar\r\n"
+        "foo: \tbaz\r\n"                 // merged with the former one
+        "Empty:\r\n"
+        "\r\n"
+        "Message Body sdfsdf");
+    ParseWithAndWithoutFastParser(
+        "GET /search HTTP/1.0\r\n"
+        "Accept: */*\r\n"
+        "\r\n");
+    ParseWithAndWithoutFastParser(
+        "HTTP/1.1 404 Not Found\r\n"
+        "Content-Length: 4\r\n"
+        "Set-Cookie: a=1\r\n"
+        "Set-Cookie: b=2\r\n"
+        "\r\n"
+        "none");
+    // Following messages are parsed by http_parser.
+    ParseWithAndWithoutFastParser(
+        "HTTP/1.1 200 OK\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n"
+        "4\r\nWiki\r\n0\r\n\r\n");
+    ParseWithAndWithoutFastParser(
+        "PROPFIND /dav HTTP/1.1\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n");
+}
+
+TEST(HttpMessageTest, fast_parser_with_partial_body) {
+    const std::string header =
+        "POST /service/method HTTP/1.1\r\n"
+        "Content-Length: 10\r\n"
+        "\r\n";
+    butil::IOBuf buf;
+    buf.append(header);
+    buf.append("01234");
+    brpc::HttpMessage http_message;
+    ASSERT_EQ((ssize_t)buf.size(), http_message.ParseFromIOBuf(buf));
+    ASSERT_FALSE(http_message.Completed());
+    buf.clear();
+    buf.append("56789extra");
+    ASSERT_EQ(5, http_message.ParseFromIOBuf(buf));
+    ASSERT_TRUE(http_message.Completed());
+    ASSERT_EQ("0123456789", http_message.body().to_string());
+
+    // EOF before the body is complete.
+    brpc::HttpMessage http_message2;
+    buf.clear();
+    buf.append(header);
+    ASSERT_EQ((ssize_t)buf.size(), http_message2.ParseFromIOBuf(buf));
+    ASSERT_FALSE(http_message2.Completed());
+    ASSERT_EQ(-1, http_message2.ParseFromArray(NULL, 0));
+}
+
+TEST(HttpMessageTest, fast_parser_with_headers_across_blocks) {
+    butil::IOBuf buf;
+    const std::string header1 = "GET /service/method HTTP/1.1\r\nFoo: ba";
+    const std::string header2 = "r\r\nContent-Length: 3\r\n\r\nabc";
+    // A user block is never merged with following data.
+    buf.append_user_data(strdup(header1.c_str()), header1.size(), free);
+    buf.append(header2);
+    ASSERT_LT(1UL, buf.backing_block_num());
+    brpc::HttpMessage http_message;
+    ASSERT_EQ((ssize_t)buf.size(), http_message.ParseFromIOBuf(buf));
+    ASSERT_TRUE(http_message.Completed());
+    ASSERT_EQ("bar", *http_message.header().GetHeader("foo"));
+    ASSERT_EQ("abc", http_message.body().to_string());
+}
+
 TEST(HttpMessageTest, find_method_property_by_uri) {
     brpc::Server server;
     ASSERT_EQ(0, server.AddService(new test::EchoService(),
@@ -317,6 +431,26 @@ TEST(HttpMessageTest, http_header) {
                  header.reason_phrase());
 }
 
+TEST(HttpMessageTest, http_header_with_case_ignored_key) {
+    static const butil::CaseIgnoredKey KEY("x-my-key");
+    ASSERT_EQ(butil::CaseIgnoredHasher()("X-My-Key"), KEY.hash());
+    brpc::HttpHeader header;
+    ASSERT_FALSE(header.GetHeader(KEY));
+    header.RemoveHeader(KEY);
+    header.SetHeader("X-MY-KEY", "value1");
+    const std::string* value = header.GetHeader(KEY);
+    ASSERT_TRUE(value && *value == "value1");
+    header.SetHeader(KEY, "value2");
+    ASSERT_EQ(1u, header.HeaderCount());
+    value = header.GetHeader("x-my-key");
+    ASSERT_TRUE(value && *value == "value2");
+    // Same length but different name.
+    ASSERT_FALSE(header.GetHeader(butil::CaseIgnoredKey("x-my-kez")));
+    header.RemoveHeader(KEY);
+    ASSERT_FALSE(header.GetHeader("x-my-key"));
+    ASSERT_EQ(0u, header.HeaderCount());
+}
+
 TEST(HttpMessageTest, empty_url) {
     butil::EndPoint host;
     ASSERT_FALSE(ParseHttpServerAddress(&host, ""));
@@ -390,4 +524,25 @@ TEST(HttpMessageTest, serialize_http_response) {
     ASSERT_EQ("HTTP/1.1 200 OK\r\nFoo: Bar\r\n\r\n", response);
 }
 
+TEST(HttpMessageTest, serialize_status_lines) {
+    brpc::HttpHeader header;
+    butil::IOBuf response;
+    header.set_version(1, 0);
+    header.set_status_code(brpc::HTTP_STATUS_NOT_FOUND);
+    header.set_content_type("text/plain");
+    butil::IOBuf content;
+    content.resize(1234567, 'a');
+    SerializeHttpResponse(&response, &header, &content);
+    response.resize(response.size() - 1234567);
+    ASSERT_EQ("HTTP/1.0 404 Not Found\r\nContent-Length: 1234567\r\n"
+              "Content-Type: text/plain\r\n\r\n", response);
+
+    // Not cached.
+    header.set_version(1, 2);
+    header.set_status_code(1000);
+    SerializeHttpResponse(&response, &header, NULL);
+    ASSERT_EQ("HTTP/1.2 1000 Unknown status code (1000)\r\n"
+              "Content-Type: text/plain\r\n\r\n", response);
+}
+
 } //namespace
@@ -18,11 +18,16 @@
 #include "brpc/channel.h"
 #include "brpc/policy/most_common_message.h"
 #include "brpc/controller.h"
+#include "brpc/grpc.h"
 #include "echo.pb.h"
 #include "brpc/policy/http_rpc_protocol.h"
+#include "brpc/policy/http2_rpc_protocol.h"
+#include "brpc/details/hpack.h"
 #include "json2pb/pb_to_json.h"
 #include "json2pb/json_to_pb.h"
 #include "brpc/details/method_status.h"
+#include "brpc/details/compressed_body_cache.h"
+#include "brpc/policy/gzip_compress.h"
 
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
@@ -921,4 +926,493 @@ TEST_F(HttpTest, broken_socket_stops_progressive_reading) {
     ASSERT_TRUE(reader->destroyed());
     ASSERT_EQ(ECONNRESET, reader->destroying_status().error_code());
 }
+
+class H2EchoService : public ::test::EchoService {
+public:
+    void Echo(::google::protobuf::RpcController* cntl_base,
+              const ::test::EchoRequest* req,
+              ::test::EchoResponse* res,
+              ::google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        EXPECT_EQ(2, cntl->http_request().major_version());
+        EXPECT_EQ(brpc::PROTOCOL_H2, cntl->request_protocol());
+        res->set_message(req->message());
+        cntl->response_attachment().swap(cntl->request_attachment());
+    }
+};
+
+TEST_F(HttpTest, h2_sanity) {
+    const int port = 8923;
+    brpc::Server server;
+    H2EchoService svc;
+    EXPECT_EQ(0, server.AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    EXPECT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "h2c";
+    ASSERT_EQ(brpc::PROTOCOL_H2, options.protocol);
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    test::EchoService_Stub stub(&channel);
+    // HPACK tables are used by following requests.
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        cntl.request_attachment().append("attachment");
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+        ASSERT_EQ("attachment", cntl.response_attachment().to_string());
+        ASSERT_EQ(2, cntl.http_response().major_version());
+    }
+    // Unknown methods are failed by the server with http status.
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/NoSuchService/Echo";
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_TRUE(cntl.Failed());
+    ASSERT_EQ(brpc::EHTTP, cntl.ErrorCode());
+    ASSERT_EQ(brpc::HTTP_STATUS_NOT_FOUND, cntl.http_response().status_code());
+}
+
+TEST_F(HttpTest, h2_concurrent_streams_with_flow_control) {
+    const int port = 8923;
+    brpc::Server server;
+    H2EchoService svc;
+    EXPECT_EQ(0, server.AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    EXPECT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_H2;
+    options.timeout_ms = 5000;
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    test::EchoService_Stub stub(&channel);
+
+    // Bodies are larger than windows of streams and the connection, which
+    // are interleaved over the single connection.
+    const size_t N = 20;
+    brpc::Controller cntl[N];
+    test::EchoRequest req[N];
+    test::EchoResponse res[N];
+    std::string body[N];
+    for (size_t i = 0; i < N; ++i) {
+        body[i].resize(i * 60000 + 1, 'a' + i % 26);
+        req[i].set_message(EXP_REQUEST);
+        cntl[i].request_attachment().append(body[i]);
+        stub.Echo(&cntl[i], &req[i], &res[i], brpc::DoNothing());
+    }
+    for (size_t i = 0; i < N; ++i) {
+        brpc::Join(cntl[i].call_id());
+        ASSERT_FALSE(cntl[i].Failed()) << cntl[i].ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res[i].message());
+        ASSERT_EQ(body[i], cntl[i].response_attachment().to_string());
+    }
+}
+
+struct H2Frame {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+    butil::IOBuf payload;
+};
+
+static void AppendH2Frame(butil::IOBuf* out, uint8_t type, uint8_t flags,
+                          uint32_t stream_id, const butil::IOBuf& payload) {
+    const uint32_t size = payload.size();
+    const char head[9] = {
+        (char)(size >> 16), (char)(size >> 8), (char)size,
+        (char)type, (char)flags,
+        (char)(stream_id >> 24), (char)(stream_id >> 16),
+        (char)(stream_id >> 8), (char)stream_id };
+    out->append(head, sizeof(head));
+    out->append(payload);
+}
+
+// Cut all frames written into the pipe.
+static void ReadH2Frames(int fd, std::vector<H2Frame>* frames) {
+    frames->clear();
+    int bytes_in_pipe = 0;
+    ioctl(fd, FIONREAD, &bytes_in_pipe);
+    butil::IOPortal buf;
+    while (buf.size() < (size_t)bytes_in_pipe) {
+        ASSERT_GT(buf.append_from_file_descriptor(fd, bytes_in_pipe), 0);
+    }
+    while (!buf.empty()) {
+        uint8_t head[9];
+        ASSERT_EQ(sizeof(head), buf.cutn(head, sizeof(head)));
+        frames->push_back(H2Frame());
+        H2Frame& f = frames->back();
+        const uint32_t size = (head[0] << 16) | (head[1] << 8) | head[2];
+        f.type = head[3];
+        f.flags = head[4];
+        f.stream_id = ((uint32_t)head[5] << 24) | (head[6] << 16) |
+            (head[7] << 8) | head[8];
+        ASSERT_EQ(size, buf.cutn(&f.payload, size));
+    }
+}
+
+static void AppendH2RequestHeaders(brpc::HPacker* packer, uint8_t flags,
+                                   uint32_t stream_id, butil::IOBuf* out) {
+    const char* const headers[][2] = {
+        { ":method", "POST" }, { ":scheme", "http" },
+        { ":authority", "localhost" }, { ":path", "/EchoService/Echo" } };
+    butil::IOBufAppender appender;
+    for (size_t i = 0; i < arraysize(headers); ++i) {
+        brpc::HPacker::Header h;
+        h.name = headers[i][0];
+        h.value = headers[i][1];
+        packer->Encode(&appender, h);
+    }
+    butil::IOBuf block;
+    appender.move_to(block);
+    AppendH2Frame(out, 0x1/*HEADERS*/, flags, stream_id, block);
+}
+
+TEST_F(HttpTest, h2_frames_after_end_stream) {
+    const uint8_t END_STREAM = 0x1;
+    const uint8_t END_HEADERS = 0x4;
+    const uint8_t RST_STREAM = 0x3;
+    // Otherwise sockets created without users are regarded as client-side
+    // before any channel is initialized.
+    brpc::get_or_new_client_side_messenger();
+    std::vector<H2Frame> frames;
+    butil::IOBuf buf;
+    buf.append("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+    brpc::ParseResult pr =
+        brpc::policy::ParseH2Message(&buf, _socket.get(), false, NULL);
+    ASSERT_TRUE(pr.is_ok());
+    ASSERT_TRUE(buf.empty());
+    ReadH2Frames(_pipe_fds[0], &frames);
+    ASSERT_FALSE(frames.empty());
+    ASSERT_EQ(0x4/*SETTINGS*/, frames[0].type);
+
+    brpc::HPacker packer;
+    ASSERT_EQ(0, packer.Init());
+    for (int trailers = 0; trailers < 2; ++trailers) {
+        const uint32_t stream_id = 1 + trailers * 2;
+        // The whole request is received, the stream is half-closed(remote)
+        // until the response is sent.
+        AppendH2RequestHeaders(&packer, END_HEADERS | END_STREAM,
+                               stream_id, &buf);
+        pr = brpc::policy::ParseH2Message(&buf, _socket.get(), false, NULL);
+        ASSERT_TRUE(pr.is_ok());
+        ASSERT_TRUE(pr.message() != NULL);
+        brpc::policy::H2StreamContext* msg =
+            static_cast<brpc::policy::H2StreamContext*>(pr.message());
+        ASSERT_EQ(stream_id, msg->stream_id());
+        ASSERT_EQ("/EchoService/Echo", msg->header().uri().path());
+        msg->Destroy();
+
+        // DATA or HEADERS with END_STREAM after END_STREAM are not new
+        // parts of the request.
+        if (trailers) {
+            AppendH2RequestHeaders(&packer, END_HEADERS | END_STREAM,
+                                   stream_id, &buf);
+        } else {
+            butil::IOBuf data;
+            data.append("more data");
+            AppendH2Frame(&buf, 0x0/*DATA*/, END_STREAM, stream_id, data);
+        }
+        pr = brpc::policy::ParseH2Message(&buf, _socket.get(), false, NULL);
+        ASSERT_TRUE(pr.is_ok());
+        ASSERT_TRUE(pr.message() == NULL);
+        ASSERT_TRUE(buf.empty());
+        ReadH2Frames(_pipe_fds[0], &frames);
+        ASSERT_EQ(1u, frames.size());
+        ASSERT_EQ(RST_STREAM, frames[0].type);
+        ASSERT_EQ(stream_id, frames[0].stream_id);
+        char code[4];
+        ASSERT_EQ(4u, frames[0].payload.copy_to(code, sizeof(code)));
+        ASSERT_EQ(0x5/*STREAM_CLOSED*/, code[3]);
+
+        // The stream is closed and the response is dropped.
+        brpc::HttpHeader header;
+        butil::IOBuf body;
+        body.append("response");
+        brpc::SocketMessagePtr<> res(brpc::policy::NewH2UnsentResponse(
+                                         stream_id, header, &body, NULL));
+        ASSERT_EQ(0, _socket->Write(res));
+        ReadH2Frames(_pipe_fds[0], &frames);
+        ASSERT_TRUE(frames.empty());
+    }
+}
+
+class SleepyEchoService : public ::test::EchoService {
+public:
+    void Echo(::google::protobuf::RpcController*,
+              const ::test::EchoRequest* req,
+              ::test::EchoResponse* res,
+              ::google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        if (req->sleep_us() > 0) {
+            bthread_usleep(req->sleep_us());
+        }
+        res->set_message(req->message());
+    }
+};
+
+TEST_F(HttpTest, http_pipelining) {
+    const int port = 8923;
+    brpc::Server server;
+    SleepyEchoService svc;
+    EXPECT_EQ(0, server.AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    EXPECT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    options.connection_type = brpc::CONNECTION_TYPE_SINGLE;
+    options.timeout_ms = 5000;
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    test::EchoService_Stub stub(&channel);
+
+    // Earlier requests finish later at server-side, responses are still
+    // written in the order of requests.
+    const int N = 10;
+    brpc::Controller cntl[N];
+    test::EchoRequest req[N];
+    test::EchoResponse res[N];
+    for (int i = 0; i < N; ++i) {
+        req[i].set_message(butil::string_printf("hello%d", i));
+        req[i].set_sleep_us((N - i) * 10000);
+        stub.Echo(&cntl[i], &req[i], &res[i], brpc::DoNothing());
+    }
+    for (int i = 0; i < N; ++i) {
+        brpc::Join(cntl[i].call_id());
+        ASSERT_FALSE(cntl[i].Failed()) << cntl[i].ErrorText();
+        ASSERT_EQ(req[i].message(), res[i].message());
+    }
+
+    // Responses can't be read progressively over a single connection.
+    brpc::Controller cntl2;
+    cntl2.response_will_be_read_progressively();
+    req[0].set_sleep_us(0);
+    stub.Echo(&cntl2, &req[0], &res[0], NULL);
+    ASSERT_EQ(brpc::EREQUEST, cntl2.ErrorCode());
+}
+
+class GrpcEchoService : public ::test::EchoService {
+public:
+    void Echo(::google::protobuf::RpcController* cntl_base,
+              const ::test::EchoRequest* req,
+              ::test::EchoResponse* res,
+              ::google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        EXPECT_EQ(brpc::PROTOCOL_GRPC, cntl->request_protocol());
+        // Set from grpc-timeout.
+        EXPECT_GE(cntl->deadline_us(), 0);
+        if (req->server_fail()) {
+            return cntl->SetFailed(req->server_fail(), "Fail on purpose: 100%");
+        }
+        cntl->set_response_compress_type(cntl->request_compress_type());
+        res->set_message(req->message());
+    }
+};
+
+TEST_F(HttpTest, grpc_sanity) {
+    const int port = 8923;
+    brpc::Server server;
+    GrpcEchoService svc;
+    EXPECT_EQ(0, server.AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    EXPECT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "grpc";
+    options.timeout_ms = 5000;
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    test::EchoService_Stub stub(&channel);
+    const brpc::CompressType compress_types[] = {
+        brpc::COMPRESS_TYPE_NONE, brpc::COMPRESS_TYPE_GZIP,
+        brpc::COMPRESS_TYPE_ZLIB, brpc::COMPRESS_TYPE_SNAPPY };
+    for (size_t i = 0; i < ARRAY_SIZE(compress_types); ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        cntl.set_request_compress_type(compress_types[i]);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+        ASSERT_EQ("application/grpc", cntl.http_response().content_type());
+        ASSERT_EQ("0", *cntl.http_response().GetHeader("grpc-status"));
+    }
+    // Errors are carried by grpc-status and grpc-message.
+    const int errors[] = { brpc::ELIMIT, brpc::EREQUEST, brpc::EINTERNAL };
+    for (size_t i = 0; i < ARRAY_SIZE(errors); ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        req.set_server_fail(errors[i]);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_TRUE(cntl.Failed());
+        ASSERT_EQ(errors[i], cntl.ErrorCode());
+        ASSERT_NE(std::string::npos,
+                  cntl.ErrorText().find("Fail on purpose: 100%"))
+            << cntl.ErrorText();
+        ASSERT_EQ(brpc::HTTP_STATUS_OK, cntl.http_response().status_code());
+    }
+    // Attachments can't be sent along with grpc messages.
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(EXP_REQUEST);
+    cntl.request_attachment().append("attachment");
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_TRUE(cntl.Failed());
+    ASSERT_EQ(brpc::EREQUEST, cntl.ErrorCode());
+}
+
+TEST_F(HttpTest, grpc_timeout_and_message) {
+    std::string s = "1H";
+    ASSERT_EQ(3600 * 1000000L, brpc::ConvertGrpcTimeoutToUS(&s));
+    s = "2M";
+    ASSERT_EQ(120 * 1000000L, brpc::ConvertGrpcTimeoutToUS(&s));
+    s = "3S";
+    ASSERT_EQ(3000000L, brpc::ConvertGrpcTimeoutToUS(&s));
+    s = "99999999m";
+    ASSERT_EQ(99999999000L, brpc::ConvertGrpcTimeoutToUS(&s));
+    s = "4u";
+    ASSERT_EQ(4, brpc::ConvertGrpcTimeoutToUS(&s));
+    s = "1n";
+    ASSERT_EQ(1, brpc::ConvertGrpcTimeoutToUS(&s));
+    const char* const bad[] = { "", "m", "123456789m", "1x", "-1m", "1.5S" };
+    for (size_t i = 0; i < ARRAY_SIZE(bad); ++i) {
+        s = bad[i];
+        ASSERT_EQ(-1, brpc::ConvertGrpcTimeoutToUS(&s)) << s;
+    }
+    ASSERT_EQ(-1, brpc::ConvertGrpcTimeoutToUS(NULL));
+
+    std::string encoded;
+    std::string decoded;
+    brpc::PercentEncode("100% ok\n\xe4\xb8\xad", &encoded);
+    ASSERT_EQ("100%25 ok%0A%E4%B8%AD", encoded);
+    brpc::PercentDecode(encoded, &decoded);
+    ASSERT_EQ("100% ok\n\xe4\xb8\xad", decoded);
+    brpc::PercentDecode("bad%zz%4", &decoded);
+    ASSERT_EQ("bad%zz%4", decoded);
+
+    ASSERT_EQ(brpc::GRPC_UNIMPLEMENTED, brpc::ErrorCodeToGrpcStatus(brpc::ENOMETHOD));
+    ASSERT_EQ(brpc::GRPC_DEADLINEEXCEEDED,
+              brpc::ErrorCodeToGrpcStatus(brpc::ERPCTIMEDOUT));
+    ASSERT_EQ(brpc::ERPCTIMEDOUT,
+              brpc::GrpcStatusToErrorCode(brpc::GRPC_DEADLINEEXCEEDED));
+    ASSERT_EQ(brpc::EINTERNAL, brpc::GrpcStatusToErrorCode(brpc::GRPC_DATALOSS));
+}
+
+class CountBody : public brpc::ProgressiveReader {
+public:
+    CountBody(brpc::Controller* cntl, google::protobuf::Closure* done)
+        : _cntl(cntl), _done(done), _nread(0) {}
+
+    butil::Status OnReadOnePart(const void* data, size_t length) {
+        const char* p = (const char*)data;
+        for (size_t i = 0; i < length; ++i) {
+            if (p[i] != PA_DATA[(_nread + i) % PA_DATA_LEN]) {
+                return butil::Status(EINVAL, "Unexpected byte at %lu",
+                                     (unsigned long)(_nread + i));
+            }
+        }
+        _nread += length;
+        return butil::Status::OK();
+    }
+    void OnEndOfMessage(const butil::Status& st) {
+        if (st.ok()) {
+            _cntl->response_attachment().append(
+                butil::string_printf("%lu", (unsigned long)_nread));
+        } else {
+            _cntl->SetFailed(st.error_code(), "%s", st.error_cstr());
+        }
+        _done->Run();
+        delete this;
+    }
+private:
+    brpc::Controller* _cntl;
+    google::protobuf::Closure* _done;
+    size_t _nread;
+};
+
+class UploadServiceImpl : public ::test::DownloadService {
+public:
+    void Download(::google::protobuf::RpcController* cntl_base,
+                  const ::test::HttpRequest*,
+                  ::test::HttpResponse*,
+                  ::google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl =
+            static_cast<brpc::Controller*>(cntl_base);
+        if (!cntl->is_request_read_progressively()) {
+            cntl->SetFailed("The request is not read progressively");
+            return;
+        }
+        // The response is sent after the body is fully read.
+        cntl->ReadProgressiveAttachmentBy(
+            new CountBody(cntl, done_guard.release()));
+    }
+};
+
+TEST_F(HttpTest, read_request_progressively) {
+    const int port = 8923;
+    brpc::Server server;
+    UploadServiceImpl svc;
+    brpc::ServiceOptions svc_opt;
+    svc_opt.ownership = brpc::SERVER_DOESNT_OWN_SERVICE;
+    svc_opt.enable_progressive_read = true;
+    EXPECT_EQ(0, server.AddService(&svc, svc_opt));
+    EXPECT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    options.timeout_ms = 10000;
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    // Larger than -socket_max_unwritten_bytes which bounds the body
+    // buffered before the reader is set.
+    const size_t body_size = 4000000;
+    for (int i = 0; i < 2; ++i) {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/DownloadService/Download";
+        cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+        for (size_t n = 0; n < body_size; n += PA_DATA_LEN) {
+            cntl.request_attachment().append(
+                PA_DATA, std::min(PA_DATA_LEN, body_size - n));
+        }
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(butil::string_printf("%lu", (unsigned long)body_size),
+                  cntl.response_attachment().to_string());
+    }
+}
+
+TEST_F(HttpTest, gzip_with_cache) {
+    butil::IOBuf body1;
+    butil::IOBuf body2;
+    for (int i = 0; i < 100; ++i) {
+        body1.append("hello world ");
+        body2.append("hello World ");
+    }
+    ASSERT_EQ(body1.size(), body2.size());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "http_compressed_body_cache_size", "2").empty());
+    butil::IOBuf out[3];
+    ASSERT_TRUE(brpc::GzipCompressWithCache(body1, &out[0]));
+    ASSERT_TRUE(brpc::GzipCompressWithCache(body1, &out[1]));
+    ASSERT_TRUE(brpc::GzipCompressWithCache(body2, &out[2]));
+    // The cached result was reused.
+    ASSERT_EQ(out[0], out[1]);
+    ASSERT_EQ(out[0].backing_block(0).data(), out[1].backing_block(0).data());
+    butil::IOBuf decompressed;
+    ASSERT_TRUE(brpc::policy::GzipDecompress(out[1], &decompressed));
+    ASSERT_EQ(body1, decompressed);
+    decompressed.clear();
+    ASSERT_TRUE(brpc::policy::GzipDecompress(out[2], &decompressed));
+    ASSERT_EQ(body2, decompressed);
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "http_compressed_body_cache_size", "0").empty());
+}
 } //namespace
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <map>
+#include <set>
 #include <gtest/gtest.h>
 #include "bthread/bthread.h"
 #include "butil/gperftools_profiler.h"
@@ -14,17 +15,30 @@
 #include "butil/containers/doubly_buffered_data.h"
 #include "brpc/describable.h"
 #include "brpc/socket.h"
+#include "brpc/controller.h"
 #include "butil/strings/string_number_conversions.h"
 #include "brpc/policy/weighted_round_robin_load_balancer.h"
 #include "brpc/policy/round_robin_load_balancer.h"
 #include "brpc/policy/randomized_load_balancer.h"
+#include "brpc/policy/weighted_randomized_load_balancer.h"
 #include "brpc/policy/locality_aware_load_balancer.h"
+#include "brpc/policy/p2c_ewma_load_balancer.h"
+#include "brpc/policy/maglev_load_balancer.h"
+#include "brpc/policy/jump_hash_load_balancer.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+#include "brpc/policy/aperture_load_balancer.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
 #include "brpc/policy/hasher.h"
 
 namespace brpc {
 namespace policy {
 extern uint32_t CRCHash32(const char *key, size_t len);
+extern const char* GetHashName(uint32_t (*hasher)(const void* key, size_t len));
+DECLARE_string(local_zone);
+DECLARE_int32(aperture_client_index);
+DECLARE_int32(aperture_client_count);
+DECLARE_int32(aperture_min_size);
+DECLARE_int32(aperture_update_interval_ms);
 }}
 
 namespace {
@@ -99,6 +113,62 @@ TEST_F(LoadBalancerTest, doubly_buffered_data) {
     }
 }
 
+typedef butil::DoublyBufferedData<std::vector<int>, butil::Void, true>
+WaitFreeDBD;
+
+size_t AssignAll(std::vector<int>& v, int n) {
+    v.assign(16, n);
+    return 1;
+}
+
+struct WaitFreeReadArg {
+    WaitFreeDBD* d;
+    butil::atomic<bool> stop;
+    butil::atomic<int> ninconsistent;
+};
+
+void* read_wait_free_dbd(void* void_arg) {
+    WaitFreeReadArg* arg = (WaitFreeReadArg*)void_arg;
+    while (!arg->stop.load(butil::memory_order_relaxed)) {
+        WaitFreeDBD::ScopedPtr ptr;
+        if (arg->d->Read(&ptr) != 0) {
+            arg->ninconsistent.fetch_add(1);
+            break;
+        }
+        for (size_t i = 1; i < ptr->size(); ++i) {
+            if ((*ptr)[i] != (*ptr)[0]) {
+                arg->ninconsistent.fetch_add(1);
+            }
+        }
+    }
+    return NULL;
+}
+
+TEST_F(LoadBalancerTest, wait_free_doubly_buffered_data) {
+    WaitFreeDBD d;
+    d.Modify(AssignAll, 0);
+    WaitFreeReadArg arg;
+    arg.d = &d;
+    arg.stop.store(false);
+    arg.ninconsistent.store(0);
+    pthread_t th[8];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, read_wait_free_dbd, &arg));
+    }
+    // Modifications never change instances being read.
+    for (int i = 1; i <= 10000; ++i) {
+        ASSERT_EQ(1u, d.Modify(AssignAll, i));
+    }
+    arg.stop.store(true);
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    ASSERT_EQ(0, arg.ninconsistent.load());
+    WaitFreeDBD::ScopedPtr ptr;
+    ASSERT_EQ(0, d.Read(&ptr));
+    ASSERT_EQ(10000, (*ptr)[0]);
+}
+
 typedef brpc::policy::LocalityAwareLoadBalancer LALB;
 
 static void ValidateWeightTree(
@@ -236,7 +306,7 @@ class SaveRecycle : public brpc::SocketUser {
 };
 
 TEST_F(LoadBalancerTest, update_while_selection) {
-    for (size_t round = 0; round < 5; ++round) {
+    for (size_t round = 0; round < 6; ++round) {
         brpc::LoadBalancer* lb = NULL;
         SelectArg sa = { NULL, NULL};
         bool is_lalb = false;
@@ -249,10 +319,12 @@ TEST_F(LoadBalancerTest, update_while_selection) {
             is_lalb = true;
         } else if (round == 3) {
             lb = new brpc::policy::WeightedRoundRobinLoadBalancer;
-        } else {
+        } else if (round == 4) {
             lb = new brpc::policy::ConsistentHashingLoadBalancer(
                         ::brpc::policy::MurmurHash32);
             sa.hash = ::brpc::policy::MurmurHash32;
+        } else {
+            lb = new brpc::policy::P2CEwmaLoadBalancer;
         }
         sa.lb = lb;
 
@@ -488,7 +560,8 @@ TEST_F(LoadBalancerTest, fairness) {
 TEST_F(LoadBalancerTest, consistent_hashing) {
     ::brpc::policy::ConsistentHashingLoadBalancer::HashFunc hashs[] = {
             ::brpc::policy::MurmurHash32, 
-            ::brpc::policy::MD5Hash32
+            ::brpc::policy::MD5Hash32,
+            ::brpc::policy::WyHash32
             // ::brpc::policy::CRCHash32 crc is a bad hash function in test
     };
     const char* servers[] = { 
@@ -558,6 +631,345 @@ TEST_F(LoadBalancerTest, consistent_hashing) {
     }
 }
 
+TEST_F(LoadBalancerTest, wyhash_of_multiple_keys) {
+    std::string long_key(1000, 'x');
+    for (size_t i = 0; i < long_key.size(); ++i) {
+        long_key[i] = 'a' + i % 26;
+    }
+    const butil::StringPiece keys[] = { "10.92.115.19", ":8833",
+                                        long_key, "-", "0" };
+    std::string concatenated;
+    for (size_t i = 0; i < ARRAY_SIZE(keys); ++i) {
+        keys[i].AppendToString(&concatenated);
+        ASSERT_EQ(brpc::policy::WyHash32(concatenated.data(),
+                                         concatenated.size()),
+                  brpc::policy::WyHash32V(keys, i + 1));
+    }
+    ASSERT_STREQ("wyhash", brpc::policy::GetHashName(brpc::policy::WyHash32));
+}
+
+TEST_F(LoadBalancerTest, consistent_hashing_with_bounded_load) {
+    brpc::policy::ConsistentHashingLoadBalancer lb(
+        brpc::policy::MurmurHash32, 100, true);
+    std::vector<brpc::ServerId> ids;
+    for (int i = 0; i < 10; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.3.%d:8080", i);
+        brpc::SocketOptions options;
+        ASSERT_EQ(0, str2endpoint(addr, &options.remote_side));
+        brpc::ServerId id(8888);
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    ASSERT_EQ(ids.size(), lb.AddServersInBatch(ids));
+    // All requests hit one key and none of them ends.
+    brpc::Controller cntl;
+    cntl.set_request_code(brpc::policy::MurmurHash32("hot", 3));
+    const int N = 1000;
+    CountMap selected_count;
+    std::vector<brpc::SocketId> selected;
+    for (int i = 0; i < N; ++i) {
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in =
+            { 0, false, true, cntl.request_code(), NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ++selected_count[ptr->id()];
+        selected.push_back(ptr->id());
+    }
+    ASSERT_EQ(ids.size(), selected_count.size());
+    for (CountMap::const_iterator it = selected_count.begin();
+         it != selected_count.end(); ++it) {
+        ASSERT_LE(it->second, ceil(1.25 * N / ids.size()) + 1);
+    }
+    ASSERT_GT(lb._nspill.load(), 0);
+    for (size_t i = 0; i < selected.size(); ++i) {
+        brpc::LoadBalancer::CallInfo info = { 0, selected[i], 0, &cntl };
+        lb.Feedback(info);
+    }
+    ASSERT_EQ(0, lb._total_inflight.load());
+    // Without in-flight requests, the key goes to its own server again.
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in =
+        { 0, false, true, cntl.request_code(), NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    ASSERT_EQ(0, lb.SelectServer(in, &out));
+    ASSERT_EQ(selected[0], ptr->id());
+    std::ostringstream os;
+    brpc::DescribeOptions opt;
+    opt.verbose = true;
+    lb.Describe(os, opt);
+    ASSERT_NE(std::string::npos, os.str().find("spilled requests"));
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
+// Map keys [0, nkey) to servers.
+static void MapKeys(brpc::LoadBalancer* lb, size_t nkey,
+                    std::vector<brpc::SocketId>* out) {
+    out->clear();
+    for (size_t i = 0; i < nkey; ++i) {
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = {
+            0, false, true, brpc::policy::MurmurHash32(&i, sizeof(i)), NULL };
+        brpc::LoadBalancer::SelectOut out2(&ptr);
+        ASSERT_EQ(0, lb->SelectServer(in, &out2));
+        out->push_back(ptr->id());
+    }
+}
+
+TEST_F(LoadBalancerTest, maglev_and_jump_hash) {
+    std::vector<brpc::ServerId> ids;
+    for (int i = 0; i < 20; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.4.%d:8080", i);
+        brpc::SocketOptions options;
+        ASSERT_EQ(0, str2endpoint(addr, &options.remote_side));
+        brpc::ServerId id(8888);
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    const size_t NKEY = 20000;
+    for (int round = 0; round < 2; ++round) {
+        brpc::LoadBalancer* lb = NULL;
+        if (round == 0) {
+            lb = new brpc::policy::MaglevLoadBalancer(4099);
+        } else {
+            lb = new brpc::policy::JumpHashLoadBalancer;
+        }
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, true, 0, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+        ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+        ASSERT_FALSE(lb->AddServer(ids[0]));
+
+        std::vector<brpc::SocketId> before;
+        MapKeys(lb, NKEY, &before);
+        if (HasFatalFailure()) { return; }
+        CountMap count;
+        for (size_t i = 0; i < before.size(); ++i) {
+            ++count[before[i]];
+        }
+        ASSERT_EQ(ids.size(), count.size());
+        for (CountMap::const_iterator it = count.begin();
+             it != count.end(); ++it) {
+            ASSERT_GT(it->second, (int)(NKEY / ids.size() * 0.7));
+            ASSERT_LT(it->second, (int)(NKEY / ids.size() * 1.3));
+        }
+
+        // Removing a server moves (almost) only keys of the server.
+        ASSERT_TRUE(lb->RemoveServer(ids[5]));
+        std::vector<brpc::SocketId> after;
+        MapKeys(lb, NKEY, &after);
+        if (HasFatalFailure()) { return; }
+        size_t moved = 0;
+        for (size_t i = 0; i < NKEY; ++i) {
+            ASSERT_NE(ids[5].id, after[i]);
+            if (before[i] != ids[5].id && before[i] != after[i]) {
+                ++moved;
+            }
+        }
+        if (round == 0) {
+            // Maglev moves a few keys of other servers.
+            ASSERT_LT(moved, NKEY / 20);
+        } else {
+            ASSERT_EQ(0UL, moved);
+        }
+
+        // Adding it back restores the mapping.
+        ASSERT_TRUE(lb->AddServer(ids[5]));
+        MapKeys(lb, NKEY, &after);
+        if (HasFatalFailure()) { return; }
+        moved = 0;
+        for (size_t i = 0; i < NKEY; ++i) {
+            moved += (before[i] != after[i]);
+        }
+        ASSERT_EQ(0UL, moved) << "round=" << round;
+
+        std::ostringstream os;
+        brpc::DescribeOptions opt;
+        opt.verbose = true;
+        lb->Describe(os, opt);
+        std::cout << os.str() << std::endl;
+        ASSERT_EQ(ids.size(), lb->RemoveServersInBatch(ids));
+        ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+        delete lb;
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, zone_aware_spillover) {
+    std::vector<brpc::ServerId> ids;
+    for (int i = 0; i < 8; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.5.%d:8080", i);
+        brpc::SocketOptions options;
+        ASSERT_EQ(0, str2endpoint(addr, &options.remote_side));
+        brpc::ServerId id(8888, (i < 4 ? "zone=a" : "dc=x,zone=b"));
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    ASSERT_EQ("a", ids[0].zone());
+    ASSERT_EQ("b", ids[4].zone());
+    const std::string saved_local_zone = brpc::policy::FLAGS_local_zone;
+    brpc::policy::FLAGS_local_zone = "a";
+    brpc::policy::RoundRobinLoadBalancer rr;
+    brpc::policy::ZoneAwareLoadBalancer lb(&rr);
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    ASSERT_EQ(ENODATA, lb.SelectServer(in, &out));
+    ASSERT_EQ(ids.size(), lb.AddServersInBatch(ids));
+    ASSERT_FALSE(lb.AddServer(ids[0]));
+
+    brpc::Controller cntl;
+    const int N = 10000;
+    for (int round = 0; round < 2; ++round) {
+        if (round == 1) {
+            // 1 of 4 local servers is healthy, local capacity is 1/4*1.4
+            // and the rest 65% spills over.
+            for (size_t i = 1; i < 4; ++i) {
+                ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+            }
+            bthread_usleep(200000);
+        }
+        int nremote = 0;
+        for (int i = 0; i < N; ++i) {
+            ASSERT_EQ(0, lb.SelectServer(in, &out));
+            ASSERT_TRUE(out.need_feedback);
+            bool local = false;
+            for (size_t j = 0; j < 4; ++j) {
+                local = local || (ptr->id() == ids[j].id);
+            }
+            nremote += !local;
+            brpc::LoadBalancer::CallInfo info = { 0, ptr->id(), 0, &cntl };
+            lb.Feedback(info);
+        }
+        if (round == 0) {
+            ASSERT_EQ(0, nremote);
+        } else {
+            ASSERT_GT(nremote, N * 0.6);
+            ASSERT_LT(nremote, N * 0.7);
+        }
+    }
+    std::ostringstream os;
+    brpc::DescribeOptions opt;
+    opt.verbose = true;
+    lb.Describe(os, opt);
+    std::cout << os.str() << std::endl;
+
+    // Without feedback, in-flight requests pile up on local servers and
+    // spill over when local ones are much busier than remote ones.
+    brpc::policy::ZoneAwareLoadBalancer lb2(&rr);
+    ids.erase(ids.begin() + 1, ids.begin() + 4);
+    ASSERT_EQ(ids.size(), lb2.AddServersInBatch(ids));
+    int nremote = 0;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, lb2.SelectServer(in, &out));
+        nremote += (ptr->id() != ids[0].id);
+    }
+    ASSERT_GT(nremote, 50);
+    brpc::policy::FLAGS_local_zone = saved_local_zone;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, aperture) {
+    std::vector<brpc::ServerId> ids;
+    for (int i = 0; i < 100; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.6.%d:8080", i);
+        brpc::SocketOptions options;
+        ASSERT_EQ(0, str2endpoint(addr, &options.remote_side));
+        brpc::ServerId id(8888);
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    const int saved_index = brpc::policy::FLAGS_aperture_client_index;
+    const int saved_count = brpc::policy::FLAGS_aperture_client_count;
+    const int saved_min_size = brpc::policy::FLAGS_aperture_min_size;
+    const int saved_interval = brpc::policy::FLAGS_aperture_update_interval_ms;
+    brpc::policy::FLAGS_aperture_client_count = 10;
+    brpc::policy::FLAGS_aperture_min_size = 3;
+    brpc::policy::FLAGS_aperture_update_interval_ms = 1;
+    brpc::policy::RoundRobinLoadBalancer rr;
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    brpc::Controller cntl;
+
+    // Evenly spread clients cover all servers with apertures of 100/10+1.
+    std::set<brpc::SocketId> all_selected;
+    for (int index = 0; index < 10; ++index) {
+        brpc::policy::FLAGS_aperture_client_index = index;
+        brpc::policy::ApertureLoadBalancer lb(&rr);
+        ASSERT_EQ(ENODATA, lb.SelectServer(in, &out));
+        ASSERT_EQ(ids.size(), lb.AddServersInBatch(ids));
+        ASSERT_FALSE(lb.AddServer(ids[0]));
+        ASSERT_EQ(11u, lb.aperture_size());
+        std::set<brpc::SocketId> selected;
+        for (int i = 0; i < 100; ++i) {
+            ASSERT_EQ(0, lb.SelectServer(in, &out));
+            ASSERT_TRUE(out.need_feedback);
+            selected.insert(ptr->id());
+            brpc::LoadBalancer::CallInfo info = { 0, ptr->id(), 0, &cntl };
+            lb.Feedback(info);
+        }
+        ASSERT_EQ(11u, selected.size());
+        all_selected.insert(selected.begin(), selected.end());
+    }
+    ASSERT_EQ(ids.size(), all_selected.size());
+
+    // The aperture grows when servers inside are busy and shrinks when
+    // they're idle.
+    brpc::policy::FLAGS_aperture_client_index = 3;
+    brpc::policy::FLAGS_aperture_update_interval_ms = 1000;
+    brpc::policy::ApertureLoadBalancer lb(&rr);
+    ASSERT_EQ(ids.size(), lb.AddServersInBatch(ids));
+    std::vector<brpc::SocketId> inflight;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        inflight.push_back(ptr->id());
+    }
+    ASSERT_EQ(11u, lb.aperture_size());
+    brpc::policy::FLAGS_aperture_update_interval_ms = 1;
+    for (int i = 0; i < 3; ++i) {
+        bthread_usleep(2000);
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        inflight.push_back(ptr->id());
+    }
+    ASSERT_EQ(14u, lb.aperture_size());
+    for (size_t i = 0; i < inflight.size(); ++i) {
+        brpc::LoadBalancer::CallInfo info = { 0, inflight[i], 0, &cntl };
+        lb.Feedback(info);
+    }
+    for (int i = 0; i < 10; ++i) {
+        bthread_usleep(2000);
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        brpc::LoadBalancer::CallInfo info = { 0, ptr->id(), 0, &cntl };
+        lb.Feedback(info);
+    }
+    ASSERT_EQ(11u, lb.aperture_size());
+
+    ASSERT_EQ(ids.size(), lb.RemoveServersInBatch(ids));
+    ASSERT_EQ(0u, lb.aperture_size());
+    ASSERT_EQ(ENODATA, lb.SelectServer(in, &out));
+
+    brpc::policy::FLAGS_aperture_client_index = saved_index;
+    brpc::policy::FLAGS_aperture_client_count = saved_count;
+    brpc::policy::FLAGS_aperture_min_size = saved_min_size;
+    brpc::policy::FLAGS_aperture_update_interval_ms = saved_interval;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
 TEST_F(LoadBalancerTest, weighted_round_robin) {
     const char* servers[] = { 
             "10.92.115.19:8831", 
@@ -621,4 +1033,200 @@ TEST_F(LoadBalancerTest, weighted_round_robin) {
     }
 }
 
+TEST_F(LoadBalancerTest, weighted_random) {
+    ASSERT_EQ(1u, brpc::policy::WeightedRandomizedLoadBalancer::ParseWeight(""));
+    ASSERT_EQ(10u, brpc::policy::WeightedRandomizedLoadBalancer::ParseWeight(
+                  "zone=bj,10"));
+    ASSERT_EQ(0u, brpc::policy::WeightedRandomizedLoadBalancer::ParseWeight("0"));
+    ASSERT_EQ(0u, brpc::policy::WeightedRandomizedLoadBalancer::ParseWeight("1ab"));
+
+    const char* weight[] = { "1", "zone=bj,2", "1000", "", "-1", "0" };
+    std::map<butil::EndPoint, int> configed_weight;
+    brpc::policy::WeightedRandomizedLoadBalancer wrlb;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < ARRAY_SIZE(weight); ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "10.92.115.%d:8831", (int)i);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        options.user = new SaveRecycle;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        id.tag = weight[i];
+        if (i < 4) {
+            configed_weight[dummy] =
+                brpc::policy::WeightedRandomizedLoadBalancer::ParseWeight(id.tag);
+            ids.push_back(id);
+        }
+    }
+    ASSERT_EQ(ids.size(), wrlb.AddServersInBatch(ids));
+
+    std::map<butil::EndPoint, size_t> select_result;
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    const int total_weight = 1004;
+    const int nround = 1000;
+    for (int i = 0; i != total_weight * nround; ++i) {
+        ASSERT_EQ(0, wrlb.SelectServer(in, &out));
+        ++select_result[ptr->remote_side()];
+    }
+    ASSERT_EQ(4u, select_result.size());
+    for (std::map<butil::EndPoint, size_t>::const_iterator
+             it = select_result.begin(); it != select_result.end(); ++it) {
+        const double expected = configed_weight[it->first] * nround;
+        std::cout << it->first << " result=" << it->second
+                  << " expected=" << expected << std::endl;
+        EXPECT_LT(std::abs(it->second - expected), expected * 0.1 + 100);
+    }
+
+    // Removed servers are never selected.
+    ASSERT_TRUE(wrlb.RemoveServer(ids[2]));
+    ASSERT_FALSE(wrlb.RemoveServer(ids[2]));
+    for (int i = 0; i != 1000; ++i) {
+        ASSERT_EQ(0, wrlb.SelectServer(in, &out));
+        ASSERT_NE(ids[2].id, ptr->id());
+    }
+    ASSERT_EQ(3u, wrlb.RemoveServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin(), ids.begin() + 2)) +
+              wrlb.RemoveServersInBatch(
+                  std::vector<brpc::ServerId>(ids.begin() + 3, ids.end())));
+    ASSERT_EQ(ENODATA, wrlb.SelectServer(in, &out));
+    for (size_t i = 0; i < ids.size(); ++i) {
+        brpc::Socket::SetFailed(ids[i].id);
+    }
+}
+
+TEST_F(LoadBalancerTest, p2c_ewma_avoids_slow_servers) {
+    brpc::policy::P2CEwmaLoadBalancer lb;
+    std::vector<brpc::ServerId> ids;
+    for (int i = 0; i < 10; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.2.%d:8080", i);
+        brpc::SocketOptions options;
+        ASSERT_EQ(0, str2endpoint(addr, &options.remote_side));
+        brpc::ServerId id(8888);
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+        ASSERT_TRUE(lb.AddServer(id));
+    }
+    brpc::Controller cntl;
+    CountMap selected_count;
+    const int N = 10000;
+    for (int i = 0; i < N; ++i) {
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(0, lb.SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ++selected_count[ptr->id()];
+        // The first server is 50 times slower than others.
+        const int64_t latency_us = (ptr->id() == ids[0].id ? 50000 : 1000);
+        brpc::LoadBalancer::CallInfo info = {
+            butil::gettimeofday_us() - latency_us, ptr->id(), 0, &cntl };
+        lb.Feedback(info);
+    }
+    std::ostringstream os;
+    brpc::DescribeOptions opt;
+    opt.verbose = true;
+    lb.Describe(os, opt);
+    std::cout << os.str() << std::endl;
+    ASSERT_LT(selected_count[ids[0].id], N / ids.size() / 5);
+    for (size_t i = 1; i < ids.size(); ++i) {
+        ASSERT_GT(selected_count[ids[i].id], N / ids.size() / 2) << "i=" << i;
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_TRUE(lb.RemoveServer(ids[i]));
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
+void* select_and_feedback(void* arg) {
+    brpc::LoadBalancer* lb = (brpc::LoadBalancer*)arg;
+    brpc::Controller cntl;
+    size_t count = 0;
+    while (!global_stop) {
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = {
+            butil::gettimeofday_us(), false, false, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        if (lb->SelectServer(in, &out) != 0) {
+            break;
+        }
+        if (out.need_feedback) {
+            brpc::LoadBalancer::CallInfo info = {
+                in.begin_time_us - 1000, ptr->id(), 0, &cntl };
+            lb->Feedback(info);
+        }
+        ++count;
+    }
+    return (void*)count;
+}
+
+TEST_F(LoadBalancerTest, select_and_update_at_scale) {
+    const size_t NSERVER = 10000;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "10.%d.%d.1:8080",
+                 (int)(i / 256), (int)(i % 256));
+        brpc::SocketOptions options;
+        ASSERT_EQ(0, str2endpoint(addr, &options.remote_side));
+        brpc::ServerId id(8888);
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    std::vector<brpc::ServerId> removed(ids.begin(), ids.begin() + NSERVER / 10);
+    for (size_t round = 0; round < 3; ++round) {
+        brpc::LoadBalancer* lb = NULL;
+        if (round == 0) {
+            lb = new brpc::policy::RoundRobinLoadBalancer;
+        } else if (round == 1) {
+            lb = new LALB;
+        } else {
+            lb = new brpc::policy::P2CEwmaLoadBalancer;
+        }
+        butil::Timer tm;
+        tm.start();
+        ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+        tm.stop();
+        const int64_t add_us = tm.u_elapsed();
+
+        global_stop = false;
+        pthread_t th[8];
+        tm.start();
+        for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+            ASSERT_EQ(0, pthread_create(&th[i], NULL, select_and_feedback, lb));
+        }
+        usleep(100000);
+        // Update membership while selecting.
+        butil::Timer tm2;
+        tm2.start();
+        ASSERT_EQ(removed.size(), lb->RemoveServersInBatch(removed));
+        ASSERT_EQ(removed.size(), lb->AddServersInBatch(removed));
+        tm2.stop();
+        usleep(100000);
+        global_stop = true;
+        size_t total = 0;
+        for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+            void* ret = NULL;
+            ASSERT_EQ(0, pthread_join(th[i], &ret));
+            total += (size_t)ret;
+        }
+        tm.stop();
+        ASSERT_GT(total, 0UL);
+        std::cout << butil::class_name_str(*lb) << ": add " << NSERVER
+                  << " servers in " << add_us << "us, update " << removed.size()
+                  << " servers in " << tm2.u_elapsed() << "us, select+feedback "
+                  << total * 1000000L / tm.u_elapsed() << " times/s with "
+                  << ARRAY_SIZE(th) << " threads" << std::endl;
+        delete lb;
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
 } //namespace
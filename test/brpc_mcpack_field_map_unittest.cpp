@@ -0,0 +1,85 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "butil/time.h"
+#include "mcpack2pb/mcpack2pb.h"
+
+namespace {
+
+bool set_field1(::google::protobuf::Message*, mcpack2pb::UnparsedValue&) {
+    return true;
+}
+
+bool set_field2(::google::protobuf::Message*, mcpack2pb::UnparsedValue&) {
+    return true;
+}
+
+class McpackFieldMapTest : public testing::Test {
+};
+
+TEST_F(McpackFieldMapTest, perfect_hash) {
+    for (size_t n = 0; n < 200; n += 7) {
+        std::vector<std::string> names;
+        for (size_t i = 0; i < n; ++i) {
+            names.push_back(butil::string_printf("field_%lu", (unsigned long)i));
+        }
+        uint32_t seed = 0;
+        size_t nbucket = 0;
+        mcpack2pb::FieldMap::find_perfect_hash(names, &seed, &nbucket);
+        ASSERT_GE(nbucket, n);
+        mcpack2pb::FieldMap m(seed, nbucket);
+        for (size_t i = 0; i < n; ++i) {
+            ASSERT_TRUE(m.insert(names[i], (i % 2 ? set_field1 : set_field2)));
+        }
+        for (size_t i = 0; i < n; ++i) {
+            mcpack2pb::SetFieldFn* fn = m.seek(names[i]);
+            ASSERT_TRUE(fn != NULL) << names[i];
+            ASSERT_EQ((i % 2 ? set_field1 : set_field2), *fn);
+        }
+        ASSERT_TRUE(m.seek("not_exist") == NULL);
+        ASSERT_TRUE(m.seek("") == NULL);
+    }
+}
+
+TEST_F(McpackFieldMapTest, compare_with_flatmap) {
+    std::vector<std::string> names;
+    const char* const common_names[] = {
+        "id", "name", "type", "uid", "query", "result", "status", "time",
+        "ip", "page_no", "page_size", "cmd", "data", "extra", "logid", "sign"
+    };
+    for (size_t i = 0; i < arraysize(common_names); ++i) {
+        names.push_back(common_names[i]);
+    }
+    uint32_t seed = 0;
+    size_t nbucket = 0;
+    mcpack2pb::FieldMap::find_perfect_hash(names, &seed, &nbucket);
+    mcpack2pb::FieldMap m(seed, nbucket);
+    butil::FlatMap<butil::StringPiece, mcpack2pb::SetFieldFn> fm;
+    ASSERT_EQ(0, fm.init(names.size(), 30));
+    for (size_t i = 0; i < names.size(); ++i) {
+        ASSERT_TRUE(m.insert(names[i], set_field1));
+        fm[names[i]] = set_field1;
+    }
+    const size_t N = 1000000;
+    size_t found = 0;
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < N; ++i) {
+        found += (m.seek(names[i % names.size()]) != NULL);
+    }
+    tm.stop();
+    const int64_t perfect_ns = tm.n_elapsed();
+    tm.start();
+    for (size_t i = 0; i < N; ++i) {
+        found += (fm.seek(names[i % names.size()]) != NULL);
+    }
+    tm.stop();
+    ASSERT_EQ(2 * N, found);
+    LOG(INFO) << "Seek field: FieldMap=" << perfect_ns / N
+              << "ns FlatMap=" << tm.n_elapsed() / N << "ns";
+}
+
+} // namespace
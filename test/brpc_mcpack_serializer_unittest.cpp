@@ -0,0 +1,133 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "butil/iobuf.h"
+#include "mcpack2pb/mcpack2pb.h"
+
+namespace {
+
+// Calls to SERIALIZER in the way that code generated by protoc-gen-mcpack
+// does, covering all kinds of heads.
+template <typename SERIALIZER>
+void serialize_body(SERIALIZER& sr, int n) {
+    const std::string long_str(300, 'l');
+    const int32_t values[] = { 1, 2, 3, 4, 5 };
+    sr.add_int32("int32", n);
+    sr.add_uint64("uint64", n);
+    sr.add_double("double", n * 0.5);
+    sr.add_string("short_string", "hello");
+    sr.add_string("long_string", long_str);
+    sr.add_binary("binary", long_str.data(), n);
+    sr.add_null("null");
+    sr.add_empty_array("empty_array");
+    // Removed by end_array().
+    sr.begin_mcpack_array("removed_array", mcpack2pb::FIELD_INT32);
+    sr.end_array();
+    sr.begin_compack_array("isoarray", mcpack2pb::FIELD_INT32);
+    sr.add_multiple_int32(values, arraysize(values));
+    sr.add_int32(n);
+    sr.end_array();
+    sr.begin_mcpack_array("strings", mcpack2pb::FIELD_STRING);
+    for (int i = 0; i < n; ++i) {
+        if (i % 3 == 0) {
+            sr.add_null();
+        } else {
+            sr.add_string(i % 2 ? long_str : std::string(i, 's'));
+        }
+    }
+    sr.end_array();
+    sr.begin_mcpack_array("objects", mcpack2pb::FIELD_OBJECT);
+    for (int i = 0; i < n; ++i) {
+        sr.begin_object();
+        sr.add_int32("id", i);
+        sr.begin_compack_array("values", mcpack2pb::FIELD_INT32);
+        sr.add_multiple_int32(values, i % arraysize(values));
+        sr.end_array();
+        sr.end_object();
+    }
+    sr.end_array();
+    sr.begin_mcpack_array("arrays", mcpack2pb::FIELD_ARRAY);
+    for (int i = 0; i < n; ++i) {
+        sr.add_empty_array();
+        sr.begin_mcpack_array(mcpack2pb::FIELD_INT32);
+        sr.add_int32(i);
+        sr.end_array();
+        sr.begin_compack_array(mcpack2pb::FIELD_INT32);
+        sr.add_multiple_int32(values, i % arraysize(values));
+        sr.end_array();
+    }
+    sr.end_array();
+    sr.begin_object("isoobject");
+    sr.begin_mcpack_array("ids", mcpack2pb::FIELD_INT32);
+    for (int i = 0; i < n; ++i) {
+        sr.add_int32(i);
+    }
+    sr.end_array();
+    sr.end_object_iso();
+}
+
+class McpackSerializerTest : public testing::Test {
+};
+
+void serialize_in_one_pass(butil::IOBuf* buf, uint32_t block_size, int n) {
+    butil::IOBufAsZeroCopyOutputStream zc_stream(buf, block_size);
+    mcpack2pb::OutputStream ostream(&zc_stream);
+    mcpack2pb::Serializer sr(&ostream);
+    sr.begin_object();
+    serialize_body(sr, n);
+    sr.end_object();
+    ostream.done();
+    ASSERT_TRUE(sr.good());
+}
+
+TEST_F(McpackSerializerTest, two_pass_is_same_with_one_pass) {
+    std::vector<mcpack2pb::GroupSize> sizes;
+    // Small blocks split heads.
+    const uint32_t block_sizes[] = { 128, 8192 };
+    for (size_t i = 0; i < arraysize(block_sizes); ++i) {
+        for (int n = 0; n < 20; ++n) {
+            butil::IOBuf expected;
+            serialize_in_one_pass(&expected, block_sizes[i], n);
+
+            mcpack2pb::Sizer sizer(&sizes);
+            sizer.begin_object();
+            serialize_body(sizer, n);
+            sizer.end_object();
+            ASSERT_TRUE(sizer.good());
+            ASSERT_EQ(expected.size(), sizer.pushed_bytes());
+
+            butil::IOBuf buf;
+            butil::IOBufAsZeroCopyOutputStream zc_stream(&buf, block_sizes[i]);
+            mcpack2pb::OutputStream ostream(&zc_stream);
+            mcpack2pb::Serializer sr(&ostream, &sizes);
+            sr.begin_object();
+            serialize_body(sr, n);
+            sr.end_object();
+            ostream.done();
+            ASSERT_TRUE(sr.good());
+            ASSERT_EQ(expected, buf) << "n=" << n;
+        }
+    }
+}
+
+TEST_F(McpackSerializerTest, fail_on_different_sizes) {
+    std::vector<mcpack2pb::GroupSize> sizes;
+    mcpack2pb::Sizer sizer(&sizes);
+    sizer.begin_object();
+    serialize_body(sizer, 3);
+    sizer.end_object();
+    ASSERT_TRUE(sizer.good());
+
+    butil::IOBuf buf;
+    butil::IOBufAsZeroCopyOutputStream zc_stream(&buf);
+    mcpack2pb::OutputStream ostream(&zc_stream);
+    mcpack2pb::Serializer sr(&ostream, &sizes);
+    sr.begin_object();
+    serialize_body(sr, 4);
+    sr.end_object();
+    ostream.done();
+    ASSERT_FALSE(sr.good());
+}
+
+} // namespace
@@ -6,6 +6,7 @@
 #include "butil/logging.h"
 #include <brpc/memcache.h>
 #include <brpc/channel.h>
+#include <brpc/sharded_memcache_channel.h>
 #include <gtest/gtest.h>
 
 namespace brpc {
@@ -208,4 +209,111 @@ TEST_F(MemcacheTest, version) {
     ASSERT_TRUE(response.PopVersion(&version)) << response.LastError();
     std::cout << "version=" << version << std::endl;
 }
+TEST_F(MemcacheTest, multi_get) {
+    if (g_mc_pid < 0) {
+        puts("Skipped due to absence of memcached");
+        return;
+    }
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_MEMCACHE;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0:" MEMCACHED_PORT, &options));
+    brpc::MemcacheRequest request;
+    brpc::MemcacheResponse response;
+    brpc::Controller cntl;
+    request.Set("mget_key1", "value1", 1, 10, 0);
+    request.Set("mget_key3", "value3", 3, 10, 0);
+    request.Delete("mget_key2");
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+
+    cntl.Reset();
+    request.Clear();
+    std::vector<std::string> keys;
+    keys.push_back("mget_key1");
+    keys.push_back("mget_key2");
+    keys.push_back("mget_key3");
+    ASSERT_TRUE(request.MultiGet(keys));
+    ASSERT_TRUE(request.MultiGet(NULL, 0));
+    request.Get("mget_key1");
+    ASSERT_EQ(3, request.pipelined_count());
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    std::map<std::string, brpc::MemcacheValue> values;
+    ASSERT_TRUE(response.PopMultiGet(&values)) << response.LastError();
+    ASSERT_EQ(2u, values.size());
+    ASSERT_EQ("value1", values["mget_key1"].value.to_string());
+    ASSERT_EQ(1u, values["mget_key1"].flags);
+    ASSERT_EQ("value3", values["mget_key3"].value.to_string());
+    ASSERT_EQ(3u, values["mget_key3"].flags);
+    ASSERT_TRUE(response.PopMultiGet(&values)) << response.LastError();
+    ASSERT_TRUE(values.empty());
+    std::string value;
+    ASSERT_TRUE(response.PopGet(&value, NULL, NULL));
+    ASSERT_EQ("value1", value);
+}
+
+TEST_F(MemcacheTest, sharded_multi_get) {
+    brpc::ShardedMemcacheChannel channel;
+    ASSERT_EQ(-1, channel.Init("not_a_server", "c_md5", NULL));
+    ASSERT_EQ(-1, channel.Init("0.0.0.0:" MEMCACHED_PORT, "rr", NULL));
+    // Two shards on the same memcached.
+    ASSERT_EQ(0, channel.Init("0.0.0.0:" MEMCACHED_PORT
+                              ",127.0.0.1:" MEMCACHED_PORT, "c_md5", NULL));
+    ASSERT_EQ(2u, channel.shard_count());
+    const int N = 100;
+    size_t nkey_of_shard[2] = { 0, 0 };
+    std::vector<std::string> keys;
+    for (int i = 0; i < N; ++i) {
+        char key[32];
+        snprintf(key, sizeof(key), "sharded_key%d", i);
+        keys.push_back(key);
+        ++nkey_of_shard[channel.GetShard(key)];
+    }
+    ASSERT_LT(0u, nkey_of_shard[0]);
+    ASSERT_LT(0u, nkey_of_shard[1]);
+    if (g_mc_pid < 0) {
+        puts("Skipped due to absence of memcached");
+        return;
+    }
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_MEMCACHE;
+    brpc::Channel single;
+    ASSERT_EQ(0, single.Init("0.0.0.0:" MEMCACHED_PORT, &options));
+    brpc::MemcacheRequest request;
+    brpc::MemcacheResponse response;
+    brpc::Controller cntl;
+    for (int i = 0; i < N; i += 2) {
+        request.Set(keys[i], keys[i] + "_value", i, 10, 0);
+    }
+    for (int i = 1; i < N; i += 2) {
+        request.Delete(keys[i]);
+    }
+    single.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+
+    cntl.Reset();
+    request.Clear();
+    ASSERT_TRUE(request.MultiGet(keys));
+    ASSERT_TRUE(request.MultiGet(std::vector<std::string>(1, keys[0])));
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    std::map<std::string, brpc::MemcacheValue> values;
+    ASSERT_TRUE(response.PopMultiGet(&values)) << response.LastError();
+    ASSERT_EQ((size_t)N / 2, values.size());
+    for (int i = 0; i < N; i += 2) {
+        ASSERT_EQ(keys[i] + "_value", values[keys[i]].value.to_string());
+        ASSERT_EQ((uint32_t)i, values[keys[i]].flags);
+    }
+    ASSERT_TRUE(response.PopMultiGet(&values)) << response.LastError();
+    ASSERT_EQ(1u, values.size());
+    ASSERT_TRUE(response.raw_buffer().empty());
+
+    // Only MultiGet is supported.
+    cntl.Reset();
+    request.Clear();
+    request.Get(keys[0]);
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_EQ(brpc::EREQUEST, cntl.ErrorCode());
+}
 } //namespace
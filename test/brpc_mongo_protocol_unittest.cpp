@@ -18,6 +18,7 @@
 #include "brpc/policy/most_common_message.h"
 #include "brpc/controller.h"
 #include "brpc/mongo_head.h"
+#include "brpc/mongo_msg.h"
 #include "brpc/mongo_service_adaptor.h"
 #include "brpc/policy/mongo.pb.h"
 
@@ -33,12 +34,24 @@ static const std::string EXP_REQUEST = "hello";
 static const std::string EXP_RESPONSE = "world";
 
 class MyEchoService : public ::brpc::policy::MongoService {
-    void default_method(::google::protobuf::RpcController*,
+    void default_method(::google::protobuf::RpcController* cntl_base,
                         const ::brpc::policy::MongoRequest* req,
                         ::brpc::policy::MongoResponse* res,
                         ::google::protobuf::Closure* done) {
         brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
 
+        if (req->header().op_code() == brpc::policy::DB_OP_MSG) {
+            // Echo the body of OP_MSG.
+            brpc::MongoMsg msg;
+            if (!brpc::ParseMongoMsg(&cntl->request_attachment(), &msg)) {
+                cntl->SetFailed(brpc::EREQUEST, "Fail to parse OP_MSG");
+                return;
+            }
+            msg.sequences.clear();
+            brpc::SerializeMongoMsg(msg, &cntl->response_attachment());
+            return;
+        }
         EXPECT_EQ(EXP_REQUEST, req->message());
 
         res->mutable_header()->set_message_length(
@@ -216,4 +229,82 @@ TEST_F(MongoTest, complete_flow) {
     ASSERT_FALSE(cntl.Failed());
     ASSERT_STREQ(EXP_RESPONSE.c_str(), msg_buf);
 }
+
+TEST_F(MongoTest, parse_and_serialize_op_msg) {
+    brpc::MongoMsg msg;
+    msg.flag_bits = brpc::MONGO_MSG_EXHAUST_ALLOWED;
+    msg.body.append("\x05\x00\x00\x00\x00", 5);  // {}
+    msg.sequences.resize(1);
+    msg.sequences[0].identifier = "documents";
+    msg.sequences[0].documents.append("\x05\x00\x00\x00\x00"
+                                      "\x05\x00\x00\x00\x00", 10);
+    butil::IOBuf buf;
+    const size_t n = brpc::SerializeMongoMsg(msg, &buf);
+    ASSERT_EQ(buf.size(), n);
+    ASSERT_EQ(4u + 1 + 5 + 1 + 4 + 10 + 10, n);
+    // Set the checksum which should be removed.
+    uint32_t flag_bits = 0;
+    buf.cutn(&flag_bits, sizeof(flag_bits));
+    flag_bits |= brpc::MONGO_MSG_CHECKSUM_PRESENT;
+    butil::IOBuf payload;
+    payload.append(&flag_bits, sizeof(flag_bits));
+    payload.append(buf);
+    payload.append("CRC!", 4);
+
+    brpc::MongoMsg msg2;
+    ASSERT_TRUE(brpc::ParseMongoMsg(&payload, &msg2));
+    ASSERT_TRUE(payload.empty());
+    ASSERT_EQ(flag_bits, msg2.flag_bits);
+    ASSERT_EQ(msg.body, msg2.body);
+    ASSERT_EQ(1u, msg2.sequences.size());
+    ASSERT_EQ("documents", msg2.sequences[0].identifier);
+    ASSERT_EQ(msg.sequences[0].documents, msg2.sequences[0].documents);
+
+    // Truncated sequence.
+    payload.clear();
+    brpc::SerializeMongoMsg(msg, &payload);
+    payload.pop_back(1);
+    ASSERT_FALSE(brpc::ParseMongoMsg(&payload, &msg2));
+}
+
+TEST_F(MongoTest, op_msg_flow) {
+    brpc::MongoMsg msg;
+    brpc::MakeMongoMsgError(11, "dummy", &msg);  // any valid document
+    butil::IOBuf body;
+    brpc::SerializeMongoMsg(msg, &body);
+    brpc::mongo_head_t header = {
+        (int32_t)(sizeof(brpc::mongo_head_t) + body.size()), 7, 0,
+        brpc::MONGO_OPCODE_OP_MSG };
+    butil::IOBuf total_buf;
+    total_buf.append(&header, sizeof(header));
+    total_buf.append(body);
+    brpc::ParseResult req_pr = brpc::policy::ParseMongoMessage(
+        &total_buf, _socket.get(), false, &_server);
+    ASSERT_EQ(brpc::PARSE_OK, req_pr.error());
+    ProcessMessage(brpc::policy::ProcessMongoRequest, req_pr.message(), false);
+
+    butil::IOPortal response_buf;
+    response_buf.append_from_file_descriptor(_pipe_fds[0], 1024);
+    brpc::mongo_head_t res_header;
+    ASSERT_EQ(sizeof(res_header), response_buf.cutn(&res_header, sizeof(res_header)));
+    ASSERT_EQ(brpc::MONGO_OPCODE_OP_MSG, res_header.op_code);
+    ASSERT_EQ(7, res_header.response_to);
+    ASSERT_EQ(response_buf.size() + sizeof(res_header),
+              (size_t)res_header.message_length);
+    brpc::MongoMsg res_msg;
+    ASSERT_TRUE(brpc::ParseMongoMsg(&response_buf, &res_msg));
+    ASSERT_EQ(msg.body, res_msg.body);
+
+    // Requests with moreToCome are not replied.
+    msg.flag_bits = brpc::MONGO_MSG_MORE_TO_COME;
+    body.clear();
+    brpc::SerializeMongoMsg(msg, &body);
+    total_buf.append(&header, sizeof(header));
+    total_buf.append(body);
+    req_pr = brpc::policy::ParseMongoMessage(
+        &total_buf, _socket.get(), false, &_server);
+    ASSERT_EQ(brpc::PARSE_OK, req_pr.error());
+    ProcessMessage(brpc::policy::ProcessMongoRequest, req_pr.message(), false);
+    CheckEmptyResponse();
+}
 } //namespace
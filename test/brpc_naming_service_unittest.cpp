@@ -2,8 +2,12 @@
 // Date 2014/10/20 13:50:10
 
 #include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <gtest/gtest.h>
 #include <vector>
+#include <set>
+#include "butil/base64.h"
 #include "butil/string_printf.h"
 #include "butil/files/temp_file.h"
 #include "bthread/bthread.h"
@@ -17,6 +21,9 @@
 #include "brpc/policy/remote_file_naming_service.h"
 #include "echo.pb.h"
 #include "brpc/server.h"
+#include "brpc/progressive_attachment.h"
+#include "brpc/details/naming_service_thread.h"
+#include "brpc/details/dns_resolver.h"
 
 
 namespace brpc {
@@ -27,6 +34,9 @@ DECLARE_string(consul_file_naming_service_dir);
 DECLARE_string(consul_service_discovery_url);
 
 } // policy
+DECLARE_string(dns_nameservers);
+DECLARE_string(dns_search);
+DECLARE_int32(dns_ndots);
 } // brpc
 
 namespace {
@@ -111,6 +121,153 @@ TEST(NamingServiceTest, invalid_port) {
     ASSERT_EQ(-1, dns.GetServers("brpc.baidu.com:99999", &servers));
 }
 
+// Answers 10.1.2.3 with TTL=60 to "foo.example" and
+// "svc.ns.svc.cluster.local", other names don't exist.
+struct FakeNameserver {
+    int fd;
+    butil::atomic<int> nquery;
+};
+
+static std::string DecodeName(const uint8_t* p, size_t len) {
+    std::string name;
+    for (size_t off = 0; off < len && p[off] != 0; off += 1 + p[off]) {
+        if (!name.empty()) {
+            name.push_back('.');
+        }
+        name.append((const char*)p + off + 1, p[off]);
+    }
+    return name;
+}
+
+static void* RunFakeNameserver(void* arg) {
+    FakeNameserver* ns = (FakeNameserver*)arg;
+    uint8_t buf[512];
+    while (true) {
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        const ssize_t nr = recvfrom(ns->fd, buf, 400, 0,
+                                    (struct sockaddr*)&from, &fromlen);
+        if (nr <= 12) {
+            break;
+        }
+        ns->nquery.fetch_add(1);
+        const std::string query = DecodeName(buf + 12, nr - 12 - 4);
+        size_t len = nr;
+        buf[2] = 0x81;  // response, recursion desired
+        buf[3] = 0x80;  // recursion available
+        if (query != "foo.example" && query != "svc.ns.svc.cluster.local") {
+            buf[3] |= 3;  // NXDOMAIN
+        } else {
+            buf[7] = 1;  // one answer
+            const uint8_t answer[] = {
+                0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 10, 1, 2, 3 };
+            memcpy(buf + len, answer, sizeof(answer));
+            len += sizeof(answer);
+        }
+        sendto(ns->fd, buf, len, 0, (struct sockaddr*)&from, fromlen);
+    }
+    return NULL;
+}
+
+class DnsResolverTest : public ::testing::Test {
+protected:
+    void SetUp() {
+        _ns.nquery = 0;
+        _ns.fd = socket(AF_INET, SOCK_DGRAM, 0);
+        ASSERT_GE(_ns.fd, 0);
+        memset(&_addr, 0, sizeof(_addr));
+        _addr.sin_family = AF_INET;
+        _addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT_EQ(0, bind(_ns.fd, (struct sockaddr*)&_addr, sizeof(_addr)));
+        _addrlen = sizeof(_addr);
+        ASSERT_EQ(0, getsockname(_ns.fd, (struct sockaddr*)&_addr, &_addrlen));
+        ASSERT_EQ(0, pthread_create(&_th, NULL, RunFakeNameserver, &_ns));
+        _saved_nameservers = brpc::FLAGS_dns_nameservers;
+        _saved_search = brpc::FLAGS_dns_search;
+        _saved_ndots = brpc::FLAGS_dns_ndots;
+        brpc::FLAGS_dns_nameservers =
+            butil::string_printf("127.0.0.1:%d", ntohs(_addr.sin_port));
+        brpc::ClearDnsCache();
+    }
+    void TearDown() {
+        brpc::FLAGS_dns_nameservers = _saved_nameservers;
+        brpc::FLAGS_dns_search = _saved_search;
+        brpc::FLAGS_dns_ndots = _saved_ndots;
+        brpc::ClearDnsCache();
+        shutdown(_ns.fd, SHUT_RDWR);
+        // Wake up recvfrom.
+        sendto(_ns.fd, "", 0, 0, (struct sockaddr*)&_addr, _addrlen);
+        pthread_join(_th, NULL);
+        close(_ns.fd);
+    }
+
+    FakeNameserver _ns;
+    struct sockaddr_in _addr;
+    socklen_t _addrlen;
+    pthread_t _th;
+    std::string _saved_nameservers;
+    std::string _saved_search;
+    int _saved_ndots;
+};
+
+TEST_F(DnsResolverTest, dns_cache) {
+    brpc::FLAGS_dns_search = "svc.cluster.local";
+    brpc::FLAGS_dns_ndots = 1;
+    butil::ip_t expected_ip;
+    ASSERT_EQ(0, butil::str2ip("10.1.2.3", &expected_ip));
+    brpc::policy::DomainNamingService dns;
+    std::vector<brpc::ServerNode> servers;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(0, dns.GetServers("foo.example:1234", &servers));
+        ASSERT_EQ(1u, servers.size());
+        ASSERT_EQ(expected_ip, servers[0].addr.ip);
+        ASSERT_EQ(1234, servers[0].addr.port);
+    }
+    // Answered from the cache.
+    ASSERT_EQ(1, _ns.nquery.load());
+    std::vector<butil::ip_t> ips;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(-1, brpc::ResolveHostname("bad.example", &ips));
+    }
+    // Tried as it is and with the search domain, then cached as
+    // non-existent.
+    ASSERT_EQ(3, _ns.nquery.load());
+    ASSERT_EQ(0, brpc::ResolveHostname("127.0.0.1", &ips));
+    ASSERT_EQ(3, _ns.nquery.load());
+}
+
+TEST_F(DnsResolverTest, search_domains) {
+    // Like resolv.conf in pods of kubernetes.
+    brpc::FLAGS_dns_search = "ns.svc.cluster.local,svc.cluster.local";
+    brpc::FLAGS_dns_ndots = 5;
+    butil::ip_t expected_ip;
+    ASSERT_EQ(0, butil::str2ip("10.1.2.3", &expected_ip));
+    std::vector<butil::ip_t> ips;
+    // "svc.ns.ns.svc.cluster.local" does not exist, then
+    // "svc.ns.svc.cluster.local" is found.
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(0, brpc::ResolveHostname("svc.ns", &ips));
+        ASSERT_EQ(1u, ips.size());
+        ASSERT_EQ(expected_ip, ips[0]);
+    }
+    ASSERT_EQ(2, _ns.nquery.load());
+    // Names ending with a dot are absolute.
+    ASSERT_EQ(-1, brpc::ResolveHostname("svc.ns.", &ips));
+    ASSERT_EQ(3, _ns.nquery.load());
+    ASSERT_EQ(0, brpc::ResolveHostname("svc.ns.svc.cluster.local.", &ips));
+    ASSERT_EQ(expected_ip, ips[0]);
+    ASSERT_EQ(4, _ns.nquery.load());
+
+    // Names with enough dots are tried as they are first.
+    brpc::FLAGS_dns_ndots = 1;
+    brpc::ClearDnsCache();
+    ASSERT_EQ(0, brpc::ResolveHostname("svc.ns", &ips));
+    ASSERT_EQ(expected_ip, ips[0]);
+    ASSERT_EQ(7, _ns.nquery.load());
+    ASSERT_EQ(0, brpc::ResolveHostname("foo.example", &ips));
+    ASSERT_EQ(8, _ns.nquery.load());
+}
+
 TEST(NamingServiceTest, wrong_name) {
     std::vector<brpc::ServerNode> servers;
 
@@ -414,4 +571,167 @@ TEST(NamingServiceTest, consul_with_backup_file) {
     }
 }
 
+// Pushes changes of servers incrementally instead of full lists.
+class IncrementalNamingService : public brpc::NamingService {
+public:
+    int RunNamingService(const char*, brpc::NamingServiceActions* actions) {
+        std::vector<brpc::ServerNode> servers;
+        for (int i = 0; i < 2; ++i) {
+            servers.push_back(brpc::ServerNode(butil::my_ip(), 9100 + i));
+        }
+        actions->ResetServers(servers);
+        servers.clear();
+        for (int i = 1; i < 4; ++i) {
+            // 9101 exists already.
+            servers.push_back(brpc::ServerNode(butil::my_ip(), 9100 + i));
+        }
+        actions->AddServers(servers);
+        servers.clear();
+        servers.push_back(brpc::ServerNode(butil::my_ip(), 9100));
+        servers.push_back(brpc::ServerNode(butil::my_ip(), 9199));
+        actions->RemoveServers(servers);
+        return 0;
+    }
+    bool RunNamingServiceReturnsQuickly() { return true; }
+    brpc::NamingService* New() const { return new IncrementalNamingService; }
+    void Destroy() { delete this; }
+    void Describe(std::ostream& os, const brpc::DescribeOptions&) const {
+        os << "incr";
+    }
+};
+
+class CountingWatcher : public brpc::NamingServiceWatcher {
+public:
+    void OnAddedServers(const std::vector<brpc::ServerId>& servers) {
+        BAIDU_SCOPED_LOCK(mutex);
+        for (size_t i = 0; i < servers.size(); ++i) {
+            tags[servers[i].id] = servers[i].tag;
+        }
+    }
+    void OnRemovedServers(const std::vector<brpc::ServerId>& servers) {
+        BAIDU_SCOPED_LOCK(mutex);
+        for (size_t i = 0; i < servers.size(); ++i) {
+            tags.erase(servers[i].id);
+        }
+    }
+    // Sorted tags of current servers, joined by commas.
+    std::string joined_tags() {
+        BAIDU_SCOPED_LOCK(mutex);
+        std::multiset<std::string> sorted;
+        for (std::map<brpc::SocketId, std::string>::const_iterator
+                 it = tags.begin(); it != tags.end(); ++it) {
+            sorted.insert(it->second);
+        }
+        std::string result;
+        for (std::multiset<std::string>::const_iterator
+                 it = sorted.begin(); it != sorted.end(); ++it) {
+            if (!result.empty()) {
+                result.push_back(',');
+            }
+            result.append(*it);
+        }
+        return result;
+    }
+    size_t size() {
+        BAIDU_SCOPED_LOCK(mutex);
+        return tags.size();
+    }
+
+    butil::Mutex mutex;
+    std::map<brpc::SocketId, std::string> tags;
+};
+
+TEST(NamingServiceTest, incremental_updates) {
+    static IncrementalNamingService incr_ns;
+    brpc::NamingServiceExtension()->Register("incr", &incr_ns);
+    butil::intrusive_ptr<brpc::NamingServiceThread> nsthread;
+    ASSERT_EQ(0, brpc::GetNamingServiceThread(&nsthread, "incr://foo", NULL));
+    CountingWatcher watcher;
+    ASSERT_EQ(0, nsthread->AddWatcher(&watcher));
+    ASSERT_EQ(3u, watcher.size());
+    ASSERT_EQ(0, nsthread->RemoveWatcher(&watcher));
+}
+
+static std::string EtcdBase64(const std::string& s) {
+    std::string out;
+    butil::Base64Encode(s, &out);
+    return out;
+}
+
+static std::string EtcdKeyValue(const std::string& addr,
+                                const std::string& tag) {
+    std::string kv = "{\"key\":\"" + EtcdBase64("services/echo/" + addr) + '"';
+    if (!tag.empty()) {
+        kv += ",\"value\":\"" + EtcdBase64(tag) + '"';
+    }
+    return kv + '}';
+}
+
+// Serves /v3/kv/range by ListNames and /v3/watch by Touch.
+class EtcdServiceImpl : public test::UserNamingService {
+public:
+    void ListNames(google::protobuf::RpcController* cntl_base,
+                   const test::HttpRequest*,
+                   test::HttpResponse*,
+                   google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = (brpc::Controller*)cntl_base;
+        cntl->response_attachment().append(
+            "{\"header\":{\"revision\":\"5\"},\"kvs\":[" +
+            EtcdKeyValue("10.0.0.1:8000", "1") + ',' +
+            EtcdKeyValue("10.0.0.2:8000", "2") + "],\"count\":\"2\"}");
+    }
+    void Touch(google::protobuf::RpcController* cntl_base,
+               const test::HttpRequest*,
+               test::HttpResponse*,
+               google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = (brpc::Controller*)cntl_base;
+        watch_request = cntl->request_attachment().to_string();
+        stream = cntl->CreateProgressiveAttachment(brpc::FORCE_STOP);
+        std::string msg = "{\"result\":{\"header\":{\"revision\":\"5\"},"
+            "\"created\":true}}\n";
+        // Adding and updating in one response, split into two parts.
+        msg += "{\"result\":{\"header\":{\"revision\":\"7\"},\"events\":["
+            "{\"kv\":" + EtcdKeyValue("10.0.0.3:8000", "3") + "},"
+            "{\"kv\":" + EtcdKeyValue("10.0.0.2:8000", "22") + "}]}}\n";
+        msg += "{\"result\":{\"header\":{\"revision\":\"8\"},\"events\":["
+            "{\"type\":\"DELETE\",\"kv\":" + EtcdKeyValue("10.0.0.1:8000", "")
+            + "}]}}\n";
+        const size_t half = msg.size() / 2;
+        stream->Write(msg.data(), half);
+        stream->Write(msg.data() + half, msg.size() - half);
+    }
+
+    std::string watch_request;
+    butil::intrusive_ptr<brpc::ProgressiveAttachment> stream;
+};
+
+TEST(NamingServiceTest, etcd_watch) {
+    brpc::Server server;
+    EtcdServiceImpl svc;
+    ASSERT_EQ(0, server.AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE,
+                                   "/v3/kv/range => ListNames,"
+                                   "/v3/watch => Touch"));
+    ASSERT_EQ(0, server.Start("127.0.0.1:2379", NULL));
+
+    butil::intrusive_ptr<brpc::NamingServiceThread> nsthread;
+    ASSERT_EQ(0, brpc::GetNamingServiceThread(
+                  &nsthread, "etcd://services/echo/", NULL));
+    CountingWatcher watcher;
+    ASSERT_EQ(0, nsthread->AddWatcher(&watcher));
+    for (int i = 0; i < 100 && watcher.joined_tags() != "22,3"; ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_EQ("22,3", watcher.joined_tags());
+    // Watching starts after the revision of the list.
+    ASSERT_NE(std::string::npos,
+              svc.watch_request.find("\"start_revision\":6"));
+    ASSERT_EQ(0, nsthread->RemoveWatcher(&watcher));
+    nsthread.reset();
+    svc.stream.reset();
+    server.Stop(0);
+    server.Join();
+}
+
 } //namespace
@@ -0,0 +1,147 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <stdio.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/string_printf.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "brpc/global.h"
+#include "brpc/server.h"
+#include "brpc/partition_channel.h"
+#include "brpc/controller.h"
+#include "echo.pb.h"
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    brpc::GlobalInitializeOrDie();
+    return RUN_ALL_TESTS();
+}
+
+namespace {
+
+static const int PORT_BASE = 8690;
+
+// Parse N/M as Partition{index=N, num_partition_kinds=M}.
+class MyPartitionParser : public brpc::PartitionParser {
+public:
+    bool ParseFromTag(const std::string& tag, brpc::Partition* out) {
+        return sscanf(tag.c_str(), "%d/%d",
+                      &out->index, &out->num_partition_kinds) == 2;
+    }
+};
+
+// Appends its id to code_list of responses, which are merged from all
+// partitions.
+class EchoServiceImpl : public test::EchoService {
+public:
+    explicit EchoServiceImpl(int id) : _id(id), _sleep_us(0), _ncall(0) {}
+
+    virtual void Echo(google::protobuf::RpcController*,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        _ncall.fetch_add(1, butil::memory_order_relaxed);
+        const int sleep_us = _sleep_us.load(butil::memory_order_relaxed);
+        if (sleep_us > 0) {
+            bthread_usleep(sleep_us);
+        }
+        response->set_message(request->message());
+        response->add_code_list(_id);
+    }
+
+    void set_sleep_us(int us) {
+        _sleep_us.store(us, butil::memory_order_relaxed);
+    }
+    int ncall() const { return _ncall.load(butil::memory_order_relaxed); }
+
+private:
+    int _id;
+    butil::atomic<int> _sleep_us;
+    butil::atomic<int> _ncall;
+};
+
+TEST(PartitionChannelTest, backup_request_per_partition) {
+    // Server 0, 1 are in partition 0, server 2, 3 are in partition 1.
+    const int NSERVER = 4;
+    const char* const tags[NSERVER] = { "0/2", "0/2", "1/2", "1/2" };
+    brpc::Server servers[NSERVER];
+    EchoServiceImpl* services[NSERVER];
+    std::string ns_url = "list://";
+    for (int i = 0; i < NSERVER; ++i) {
+        services[i] = new EchoServiceImpl(i);
+        ASSERT_EQ(0, servers[i].AddService(services[i],
+                                           brpc::SERVER_OWNS_SERVICE));
+        ASSERT_EQ(0, servers[i].Start(PORT_BASE + i, NULL));
+        butil::string_appendf(&ns_url, "%s127.0.0.1:%d %s",
+                              (i ? "," : ""), PORT_BASE + i, tags[i]);
+    }
+
+    brpc::PartitionChannelOptions opt;
+    opt.timeout_ms = 5000;
+    opt.max_retry = 1;
+    opt.backup_request_per_partition = true;
+    // Fast servers never answer so late, slow ones always do.
+    opt.partition_backup_options.min_backup_request_ms = 100;
+    opt.partition_backup_options.max_backup_ratio = 1.0;
+    brpc::PartitionChannel channel;
+    ASSERT_EQ(0, channel.Init(2, new MyPartitionParser, ns_url.c_str(),
+                              "rr", &opt));
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    req.set_message("hello");
+
+    // Latencies of both partitions are known after the sampler of bvar runs.
+    for (int i = 0; i < 20; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(2, res.code_list_size());
+    }
+    bthread_usleep(2000000);
+
+    // Server 0 becomes slow, calls to it are backed up by server 1.
+    const int SLOW_US = 1000000;
+    services[0]->set_sleep_us(SLOW_US);
+    int ncall[NSERVER];
+    for (int i = 0; i < NSERVER; ++i) {
+        ncall[i] = services[i]->ncall();
+    }
+    const int NCALL = 10;
+    for (int i = 0; i < NCALL; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_LT(cntl.latency_us(), SLOW_US / 2);
+        // Answered by the fast server of partition 0 and any server of
+        // partition 1.
+        ASSERT_EQ(2, res.code_list_size());
+        ASSERT_EQ(1, (res.code_list(0) < 2 ? res.code_list(0)
+                                           : res.code_list(1)))
+            << res.ShortDebugString();
+    }
+    const int nslow = services[0]->ncall() - ncall[0];
+    const int nfast = services[1]->ncall() - ncall[1];
+    ASSERT_GT(nslow, 0);
+    // Every call to the slow server is backed up by the fast one.
+    ASSERT_EQ(NCALL, nfast);
+    // Partition 1 is not slowed down and sends no backup requests.
+    ASSERT_EQ(NCALL, services[2]->ncall() - ncall[2] +
+              services[3]->ncall() - ncall[3]);
+
+    services[0]->set_sleep_us(0);
+    for (int i = 0; i < NSERVER; ++i) {
+        servers[i].Stop(0);
+    }
+    for (int i = 0; i < NSERVER; ++i) {
+        servers[i].Join();
+    }
+}
+
+} // namespace
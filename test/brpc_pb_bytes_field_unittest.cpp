@@ -0,0 +1,87 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "butil/iobuf.h"
+#include "brpc/pb_bytes_field.h"
+#include "echo.pb.h"
+
+namespace {
+
+class PbBytesFieldTest : public ::testing::Test {};
+
+TEST_F(PbBytesFieldTest, cut_field) {
+    test::EchoRequest req;
+    const std::string big(100000, 'a');
+    req.set_message(big);
+    req.set_code(7);
+    req.set_sleep_us(9);
+    butil::IOBuf buf;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&buf);
+    ASSERT_TRUE(req.SerializeToZeroCopyStream(&wrapper));
+
+    butil::IOBuf field;
+    ASSERT_EQ(1, brpc::CutPbBytesField(&buf, 1, &field));
+    ASSERT_EQ(big, field.to_string());
+    test::EchoRequest rest;
+    ASSERT_TRUE(rest.ParsePartialFromString(buf.to_string()));
+    ASSERT_FALSE(rest.has_message());
+    ASSERT_EQ(7, rest.code());
+    ASSERT_EQ(9, rest.sleep_us());
+
+    // Not found or not length-delimited.
+    butil::IOBuf saved = buf;
+    ASSERT_EQ(0, brpc::CutPbBytesField(&buf, 1, &field));
+    ASSERT_EQ(0, brpc::CutPbBytesField(&buf, 2, &field));
+    ASSERT_EQ(saved, buf);
+}
+
+TEST_F(PbBytesFieldTest, last_one_wins) {
+    test::EchoRequest req1;
+    req1.set_message("first");
+    test::EchoRequest req2;
+    req2.set_message("second");
+    req2.set_code(1);
+    butil::IOBuf buf;
+    buf.append(req1.SerializePartialAsString());
+    buf.append(req2.SerializePartialAsString());
+    butil::IOBuf field;
+    ASSERT_EQ(1, brpc::CutPbBytesField(&buf, 1, &field));
+    ASSERT_EQ("second", field.to_string());
+    test::EchoRequest rest;
+    ASSERT_TRUE(rest.ParsePartialFromString(buf.to_string()));
+    ASSERT_FALSE(rest.has_message());
+    ASSERT_EQ(1, rest.code());
+}
+
+TEST_F(PbBytesFieldTest, skip_groups) {
+    // Group numbered 7 containing varint field 1, then field 1 as bytes.
+    const char data[] = { 59, 8, 5, 60, 10, 3, 'a', 'b', 'c' };
+    butil::IOBuf buf;
+    buf.append(data, sizeof(data));
+    butil::IOBuf field;
+    ASSERT_EQ(1, brpc::CutPbBytesField(&buf, 1, &field));
+    ASSERT_EQ("abc", field.to_string());
+    ASSERT_EQ(std::string(data, 4), buf.to_string());
+}
+
+TEST_F(PbBytesFieldTest, invalid_data) {
+    // Truncated payload.
+    const char data1[] = { 10, 10, 'a' };
+    // Unmatched end of group.
+    const char data2[] = { 60, 10, 1, 'a' };
+    // Truncated varint.
+    const char data3[] = { 10, 1, 'a', 16, (char)0x80 };
+    const char* datas[] = { data1, data2, data3 };
+    const size_t sizes[] = { sizeof(data1), sizeof(data2), sizeof(data3) };
+    for (size_t i = 0; i < 3; ++i) {
+        butil::IOBuf buf;
+        buf.append(datas[i], sizes[i]);
+        butil::IOBuf field;
+        field.append("unchanged");
+        ASSERT_EQ(-1, brpc::CutPbBytesField(&buf, 1, &field)) << i;
+        ASSERT_EQ(std::string(datas[i], sizes[i]), buf.to_string());
+        ASSERT_EQ("unchanged", field.to_string());
+    }
+}
+
+} // namespace
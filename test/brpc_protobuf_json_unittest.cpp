@@ -479,6 +479,50 @@ TEST_F(ProtobufJsonTest, json_to_pb_expected_failed_case) {
     ASSERT_STREQ("Invalid value `23' for optional field `Content.uid' which SHOULD be string, Missing required field: Ext.databyte", error.data());
 }
 
+TEST_F(ProtobufJsonTest, json_to_pb_members_in_any_order) {
+    // Unknown members are skipped whatever they are, only the first member
+    // with the same name is converted.
+    std::string info = "{\"unknown\":{\"a\":[1,{\"judge\":false}],\"b\":null},"
+        "\"spur\":2, \"judge\":true, \"judge\":\"x\","
+        "\"content\":[{\"distance\":1,\"uid\":\"u\",\"uid\":3}]}";
+    std::string error;
+    JsonContextBody data;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(info, &data, &error)) << error;
+    ASSERT_TRUE(error.empty()) << error;
+    ASSERT_TRUE(data.judge());
+    ASSERT_EQ(2, data.spur());
+    ASSERT_EQ(1, data.content_size());
+    ASSERT_EQ("u", data.content(0).uid());
+
+    // Errors are in the order of fields rather than members, and stop at
+    // the first fatal one.
+    info = "{\"text\":\"x\", \"judge\":true, \"spur\":\"y\"}";
+    JsonContextBody data2;
+    ASSERT_FALSE(json2pb::JsonToProtoMessage(info, &data2, &error));
+    ASSERT_EQ("Invalid value `\"y\"' for field `JsonContextBody.spur' which SHOULD be d",
+              error);
+
+    info = "{\"text\":\"x\", \"content\":[{\"distance\":\"z\"}], \"judge\":true, \"spur\":1}";
+    JsonContextBody data3;
+    ASSERT_FALSE(json2pb::JsonToProtoMessage(info, &data3, &error));
+    ASSERT_EQ("Invalid value `\"z\"' for field `Content.distance' which SHOULD be f",
+              error);
+
+    info = "{\"text\":\"x\", \"content\":[], \"judge\":true, \"spur\":1}";
+    JsonContextBody data4;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(info, &data4, &error));
+    ASSERT_EQ("Invalid value `\"x\"' for optional field `JsonContextBody.text' which SHOULD be f",
+              error);
+
+    info = "{\"judge\":true, \"spur\":1,";
+    butil::IOBuf buf;
+    buf.append(info);
+    butil::IOBufAsZeroCopyInputStream stream(buf);
+    JsonContextBody data5;
+    ASSERT_FALSE(json2pb::JsonToProtoMessage(&stream, &data5, &error));
+    ASSERT_EQ("Invalid json format", error);
+}
+
 TEST_F(ProtobufJsonTest, json_to_pb_perf_case) {
     
     std::string info3 = "{\"content\":[{\"distance\":1.0,\
@@ -1234,6 +1278,54 @@ TEST_F(ProtobufJsonTest, pb_to_json_perf_case) {
     printf("avg time to convert pb to json is %fus\n", avg_time2);
 }
 
+TEST_F(ProtobufJsonTest, bytes_base64_perf_case) {
+    AddressBook address_book;
+    Person* person = address_book.add_person();
+    person->set_id(100);
+    person->set_name("baidu");
+    person->set_datadouble(123.456);
+    person->set_datafloat(8.6123);
+    std::string data(64 * 1024, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (char)(i * 131 + (i >> 8));
+    }
+    person->set_databyte(data);
+
+    printf("----------test bytes with base64 performance------------\n\n");
+    json2pb::Pb2JsonOptions pb2json_options;
+    pb2json_options.bytes_to_base64 = true;
+    json2pb::Json2PbOptions json2pb_options;
+    json2pb_options.base64_to_bytes = true;
+    ProfilerStart("bytes_base64_perf.prof");
+    butil::Timer timer;
+    float avg_time1 = 0;
+    float avg_time2 = 0;
+    const int times = 1000;
+    for (int i = 0; i < times; i++) {
+        std::string json;
+        timer.start();
+        ASSERT_TRUE(json2pb::ProtoMessageToJson(
+                        address_book, &json, pb2json_options, NULL));
+        timer.stop();
+        avg_time1 += timer.u_elapsed();
+
+        AddressBook data1;
+        timer.start();
+        ASSERT_TRUE(json2pb::JsonToProtoMessage(
+                        json, &data1, json2pb_options, NULL));
+        timer.stop();
+        avg_time2 += timer.u_elapsed();
+        ASSERT_EQ(data, data1.person(0).databyte());
+    }
+    avg_time1 /= times;
+    avg_time2 /= times;
+    ProfilerStop();
+    printf("avg time to convert pb with %lu bytes to json is %fus\n",
+           (unsigned long)data.size(), avg_time1);
+    printf("avg time to convert json to pb with %lu bytes is %fus\n",
+           (unsigned long)data.size(), avg_time2);
+}
+
 TEST_F(ProtobufJsonTest, pb_to_json_encode_decode_perf_case) {
     JsonContextBodyEncDec json_data;
     json_data.set_type(80000);
@@ -39,6 +39,7 @@ namespace brpc {
 namespace rdma {
 DECLARE_int32(rdma_cq_num);
 DECLARE_int32(rdma_cq_size);
+DECLARE_int32(rdma_rendezvous_threshold);
 extern bool DestinationInGivenCluster(std::string prefix, in_addr_t addr);
 extern void InitRdmaConnParam(rdma_conn_param* p, const char* data, size_t len);
 }
@@ -494,6 +495,28 @@ TEST_F(RdmaTest, success) {
     StopServer();
 }
 
+TEST_F(RdmaTest, success_with_rendezvous) {
+    // Peers only read blocks when block_pool was registered with remote
+    // read permission, i.e. the flag was set before RDMA initialization.
+    // Otherwise the data falls back to ordinary sends, which must also work.
+    int32_t saved_threshold = rdma::FLAGS_rdma_rendezvous_threshold;
+    rdma::FLAGS_rdma_rendezvous_threshold = 4096;
+    StartServer();
+
+    StartClientOptions opt;
+    opt.att_size = 1048576;
+    for (int j = 0; j < 2; ++j) {
+        for (int k = 0; k < 2; ++k) {
+            opt.single_connection = j;
+            opt.large_block = k;
+            StartClient(&opt);
+        }
+    }
+
+    StopServer();
+    rdma::FLAGS_rdma_rendezvous_threshold = saved_threshold;
+}
+
 TEST_F(RdmaTest, success_with_other_rpc_protocols) {
     StartServer();
 
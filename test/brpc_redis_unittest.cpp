@@ -5,13 +5,19 @@
 #include <iostream>
 #include "butil/time.h"
 #include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "butil/synchronization/lock.h"
 #include <brpc/redis.h>
+#include <brpc/redis_command.h>
+#include <brpc/redis_cluster_channel.h>
 #include <brpc/channel.h>
+#include <brpc/server.h>
 #include <brpc/policy/redis_authenticator.h>
 #include <gtest/gtest.h>
 
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
+DECLARE_int32(redis_reply_zero_copy_size);
 }
 
 int main(int argc, char* argv[]) {
@@ -490,4 +496,402 @@ TEST_F(RedisTest, cmd_format) {
     ASSERT_STREQ("*3\r\n$3\r\nget\r\n$6\r\nkeyext\r\n$5\r\nvalue\r\n", request._buf.to_string().c_str());
     request.Clear();
 }
+TEST_F(RedisTest, command_parser) {
+    brpc::RedisCommandParser parser;
+    std::vector<butil::StringPiece> args;
+    butil::IOBuf buf;
+    {
+        // Pipelined commands, empty arrays are ignored.
+        brpc::RedisCommandNoFormat(&buf, "set key value");
+        buf.append("*0\r\n");
+        brpc::RedisCommandNoFormat(&buf, "get key");
+        ASSERT_EQ(brpc::PARSE_OK, parser.Consume(buf, &args));
+        ASSERT_EQ(3u, args.size());
+        ASSERT_EQ("set", args[0]);
+        ASSERT_EQ("key", args[1]);
+        ASSERT_EQ("value", args[2]);
+        ASSERT_EQ(brpc::PARSE_OK, parser.Consume(buf, &args));
+        ASSERT_EQ(2u, args.size());
+        ASSERT_EQ("get", args[0]);
+        ASSERT_STREQ("key", args[1].data());
+        ASSERT_EQ(brpc::PARSE_ERROR_NOT_ENOUGH_DATA, parser.Consume(buf, &args));
+        ASSERT_TRUE(buf.empty());
+        ASSERT_FALSE(parser.in_progress());
+    }
+    {
+        // Fed byte by byte.
+        butil::IOBuf cmd;
+        const butil::StringPiece comps[] = { "mset", "", "a b", "c\r\nd" };
+        brpc::RedisCommandByComponents(&cmd, comps, arraysize(comps));
+        const std::string str = cmd.to_string();
+        for (size_t i = 0; i < str.size(); ++i) {
+            buf.push_back(str[i]);
+            const brpc::ParseError err = parser.Consume(buf, &args);
+            if (i + 1 < str.size()) {
+                ASSERT_EQ(brpc::PARSE_ERROR_NOT_ENOUGH_DATA, err);
+            } else {
+                ASSERT_EQ(brpc::PARSE_OK, err);
+            }
+        }
+        ASSERT_TRUE(buf.empty());
+        ASSERT_EQ(arraysize(comps), args.size());
+        for (size_t i = 0; i < arraysize(comps); ++i) {
+            ASSERT_EQ(comps[i], args[i]);
+        }
+    }
+    {
+        // Not a command.
+        brpc::RedisCommandParser parser2;
+        buf.clear();
+        buf.append("+OK\r\n");
+        ASSERT_EQ(brpc::PARSE_ERROR_ABSOLUTELY_WRONG, parser2.Consume(buf, &args));
+        brpc::RedisCommandParser parser3;
+        buf.clear();
+        buf.append("*1\r\n$3\r\nget\r\r");
+        ASSERT_EQ(brpc::PARSE_ERROR_ABSOLUTELY_WRONG, parser3.Consume(buf, &args));
+    }
+}
+
+TEST_F(RedisTest, reply_writer) {
+    butil::IOBuf buf;
+    brpc::RedisReplyWriter writer(&buf);
+    writer.AppendStatus("OK");
+    writer.AppendError("ERR something wrong");
+    writer.AppendInteger(-1234567890123LL);
+    writer.AppendString("short");
+    const std::string long_str(1000, 'x');
+    butil::IOBuf long_buf;
+    long_buf.append(long_str);
+    writer.AppendString(long_buf);
+    writer.AppendNil();
+    writer.AppendArray(2);
+    writer.AppendString("");
+    writer.AppendInteger(0);
+
+    brpc::RedisResponse response;
+    ASSERT_TRUE(response.ConsumePartialIOBuf(buf, 7));
+    ASSERT_TRUE(buf.empty());
+    ASSERT_EQ(brpc::REDIS_REPLY_STATUS, response.reply(0).type());
+    ASSERT_STREQ("OK", response.reply(0).c_str());
+    ASSERT_STREQ("ERR something wrong", response.reply(1).error_message());
+    ASSERT_EQ(-1234567890123LL, response.reply(2).integer());
+    ASSERT_STREQ("short", response.reply(3).c_str());
+    ASSERT_EQ(long_str, response.reply(4).data());
+    ASSERT_TRUE(response.reply(5).is_nil());
+    ASSERT_EQ(2u, response.reply(6).size());
+    ASSERT_STREQ("", response.reply(6)[0].c_str());
+    ASSERT_EQ(0, response.reply(6)[1].integer());
+}
+
+TEST_F(RedisTest, zero_copy_reply) {
+    const int saved_size = brpc::FLAGS_redis_reply_zero_copy_size;
+    brpc::FLAGS_redis_reply_zero_copy_size = 100;
+    butil::IOBuf buf;
+    brpc::RedisReplyWriter writer(&buf);
+    const std::string long_str(1000, 'x');
+    writer.AppendArray(3);
+    writer.AppendString(long_str);
+    writer.AppendString("short");
+    writer.AppendString(std::string(99, 'y'));
+    const std::string str = buf.to_string();
+    const char* long_data = buf.backing_block(0).data() + 11/*"*3\r\n$1000\r\n"*/;
+
+    butil::Arena arena;
+    brpc::RedisIOBufString* iobuf_strings = NULL;
+    brpc::RedisReply reply;
+    ASSERT_TRUE(reply.ConsumePartialIOBuf(buf, &arena, &iobuf_strings));
+    ASSERT_TRUE(buf.empty());
+    ASSERT_TRUE(iobuf_strings != NULL);
+    ASSERT_EQ(3u, reply.size());
+    // The long string references the read buffer.
+    butil::IOBuf long_buf = reply[0].iobuf_data();
+    ASSERT_EQ(long_str, long_buf.to_string());
+    ASSERT_EQ(long_data, long_buf.backing_block(0).data());
+    ASSERT_EQ("short", reply[1].iobuf_data().to_string());
+    ASSERT_EQ(std::string(99, 'y'), reply[2].data());
+    // Flattened on demand.
+    ASSERT_EQ(long_str, reply[0].data());
+    ASSERT_EQ(long_str, reply[0].c_str());
+
+    buf.clear();
+    brpc::RedisReplyWriter(&buf).AppendReply(reply);
+    ASSERT_EQ(str, buf.to_string());
+
+    butil::Arena arena2;
+    brpc::RedisReply copied;
+    copied.CopyFromDifferentArena(reply, &arena2);
+    brpc::RedisReply::ReleaseIOBufStrings(iobuf_strings);
+    ASSERT_EQ(long_str, copied[0].data());
+    brpc::FLAGS_redis_reply_zero_copy_size = saved_size;
+}
+
+class SimpleCache {
+public:
+    void Set(const std::string& key, const std::string& value) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _kv[key] = value;
+    }
+    bool Get(const std::string& key, std::string* value) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<std::string, std::string>::const_iterator it = _kv.find(key);
+        if (it == _kv.end()) {
+            return false;
+        }
+        *value = it->second;
+        return true;
+    }
+private:
+    butil::Mutex _mutex;
+    std::map<std::string, std::string> _kv;
+};
+
+class SetCommandHandler : public brpc::RedisCommandHandler {
+public:
+    explicit SetCommandHandler(SimpleCache* cache) : _cache(cache) {}
+    void Run(const std::vector<butil::StringPiece>& args,
+             brpc::RedisReplyWriter* writer) {
+        if (args.size() != 3) {
+            writer->AppendError("ERR wrong number of arguments for 'set' command");
+            return;
+        }
+        _cache->Set(args[1].as_string(), args[2].as_string());
+        writer->AppendStatus("OK");
+    }
+private:
+    SimpleCache* _cache;
+};
+
+class GetCommandHandler : public brpc::RedisCommandHandler {
+public:
+    explicit GetCommandHandler(SimpleCache* cache) : _cache(cache) {}
+    void Run(const std::vector<butil::StringPiece>& args,
+             brpc::RedisReplyWriter* writer) {
+        if (args.size() != 2) {
+            writer->AppendError("ERR wrong number of arguments for 'get' command");
+            return;
+        }
+        std::string value;
+        if (_cache->Get(args[1].as_string(), &value)) {
+            writer->AppendString(value);
+        } else {
+            writer->AppendNil();
+        }
+    }
+private:
+    SimpleCache* _cache;
+};
+
+TEST_F(RedisTest, redis_service) {
+    SimpleCache cache;
+    SetCommandHandler set_handler(&cache);
+    GetCommandHandler get_handler(&cache);
+    brpc::RedisService* rs = new brpc::RedisService;
+    ASSERT_TRUE(rs->AddCommandHandler("set", &set_handler));
+    ASSERT_TRUE(rs->AddCommandHandler("GET", &get_handler));
+    ASSERT_FALSE(rs->AddCommandHandler("Get", &get_handler));
+    ASSERT_EQ(&get_handler, rs->FindCommandHandler("get"));
+    ASSERT_TRUE(rs->FindCommandHandler("del") == NULL);
+
+    brpc::Server server;
+    brpc::ServerOptions server_options;
+    server_options.redis_service = rs;
+    const int port = 8732;
+    ASSERT_EQ(0, server.Start(port, &server_options));
+
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_REDIS;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1", port, &options));
+
+    brpc::RedisRequest request;
+    ASSERT_TRUE(request.AddCommand("get hello"));
+    ASSERT_TRUE(request.AddCommand("SET hello world"));
+    ASSERT_TRUE(request.AddCommand("Get hello"));
+    ASSERT_TRUE(request.AddCommand("set hello"));
+    ASSERT_TRUE(request.AddCommand("del hello"));
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(request.AddCommand("set key%d value%d", i, i));
+        ASSERT_TRUE(request.AddCommand("get key%d", i));
+    }
+    brpc::RedisResponse response;
+    brpc::Controller cntl;
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(205, response.reply_size());
+    ASSERT_TRUE(response.reply(0).is_nil());
+    ASSERT_STREQ("OK", response.reply(1).c_str());
+    ASSERT_STREQ("world", response.reply(2).c_str());
+    ASSERT_TRUE(response.reply(3).is_error());
+    ASSERT_TRUE(response.reply(4).is_error());
+    ASSERT_STREQ("ERR unknown command 'del'", response.reply(4).error_message());
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_STREQ("OK", response.reply(5 + 2 * i).c_str());
+        ASSERT_EQ(butil::string_printf("value%d", i),
+                  response.reply(6 + 2 * i).data());
+    }
+    server.Stop(0);
+    server.Join();
+}
+TEST_F(RedisTest, cluster_slot) {
+    ASSERT_EQ(12182, brpc::RedisClusterSlot("foo"));
+    ASSERT_EQ(5061, brpc::RedisClusterSlot("bar"));
+    ASSERT_EQ(brpc::RedisClusterSlot("user"), brpc::RedisClusterSlot("{user}a"));
+    ASSERT_EQ(brpc::RedisClusterSlot("{user}a"), brpc::RedisClusterSlot("{user}b"));
+    // Empty hash tags are not hash tags.
+    ASSERT_NE(brpc::RedisClusterSlot("{}a"), brpc::RedisClusterSlot("{}b"));
+}
+
+// Two nodes dividing slots at `split', sharing one cache as if data were
+// migrated along with slots.
+struct FakeCluster {
+    int ports[2];
+    butil::atomic<int> split;
+    butil::atomic<int> nslots_command;
+    SimpleCache cache;
+};
+
+class ClusterCommandHandler : public brpc::RedisCommandHandler {
+public:
+    explicit ClusterCommandHandler(FakeCluster* cluster) : _cluster(cluster) {}
+    void Run(const std::vector<butil::StringPiece>& args,
+             brpc::RedisReplyWriter* writer) {
+        if (args.size() != 2 || strcasecmp(args[1].data(), "slots") != 0) {
+            writer->AppendError("ERR unsupported");
+            return;
+        }
+        _cluster->nslots_command.fetch_add(1);
+        const int split = _cluster->split.load();
+        writer->AppendArray(split < brpc::REDIS_CLUSTER_SLOTS ? 2 : 1);
+        writer->AppendArray(3);
+        writer->AppendInteger(0);
+        writer->AppendInteger(split - 1);
+        writer->AppendArray(2);
+        writer->AppendString("127.0.0.1");
+        writer->AppendInteger(_cluster->ports[0]);
+        if (split < brpc::REDIS_CLUSTER_SLOTS) {
+            writer->AppendArray(3);
+            writer->AppendInteger(split);
+            writer->AppendInteger(brpc::REDIS_CLUSTER_SLOTS - 1);
+            writer->AppendArray(2);
+            writer->AppendString("");  // the replying node
+            writer->AppendInteger(_cluster->ports[1]);
+        }
+    }
+private:
+    FakeCluster* _cluster;
+};
+
+class ClusterKeyCommandHandler : public brpc::RedisCommandHandler {
+public:
+    ClusterKeyCommandHandler(FakeCluster* cluster, int node)
+        : _cluster(cluster), _node(node)
+        , _set_handler(&cluster->cache), _get_handler(&cluster->cache) {}
+    void Run(const std::vector<butil::StringPiece>& args,
+             brpc::RedisReplyWriter* writer) {
+        if (args.size() < 2) {
+            writer->AppendError("ERR wrong number of arguments");
+            return;
+        }
+        const int slot = brpc::RedisClusterSlot(args[1]);
+        const int owner = (slot < _cluster->split.load() ? 0 : 1);
+        if (owner != _node) {
+            writer->AppendError(butil::string_printf(
+                    "MOVED %d 127.0.0.1:%d", slot, _cluster->ports[owner]));
+            return;
+        }
+        if (strcasecmp(args[0].data(), "set") == 0) {
+            _set_handler.Run(args, writer);
+        } else {
+            _get_handler.Run(args, writer);
+        }
+    }
+private:
+    FakeCluster* _cluster;
+    int _node;
+    SetCommandHandler _set_handler;
+    GetCommandHandler _get_handler;
+};
+
+TEST_F(RedisTest, cluster_channel) {
+    FakeCluster cluster;
+    cluster.ports[0] = 8733;
+    cluster.ports[1] = 8734;
+    cluster.split.store(brpc::REDIS_CLUSTER_SLOTS / 2);
+    cluster.nslots_command.store(0);
+    ClusterCommandHandler cluster_handler(&cluster);
+    ClusterKeyCommandHandler node0_handler(&cluster, 0);
+    ClusterKeyCommandHandler node1_handler(&cluster, 1);
+    brpc::Server servers[2];
+    for (int i = 0; i < 2; ++i) {
+        brpc::RedisService* rs = new brpc::RedisService;
+        ClusterKeyCommandHandler* h = (i == 0 ? &node0_handler : &node1_handler);
+        ASSERT_TRUE(rs->AddCommandHandler("cluster", &cluster_handler));
+        ASSERT_TRUE(rs->AddCommandHandler("set", h));
+        ASSERT_TRUE(rs->AddCommandHandler("get", h));
+        brpc::ServerOptions server_options;
+        server_options.redis_service = rs;
+        ASSERT_EQ(0, servers[i].Start(cluster.ports[i], &server_options));
+    }
+
+    brpc::RedisClusterChannel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8733", NULL));
+    ASSERT_EQ(1, cluster.nslots_command.load());
+
+    const int N = 64;
+    brpc::RedisRequest request;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(request.AddCommand("set key%d value%d", i, i));
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(request.AddCommand("get key%d", i));
+    }
+    ASSERT_TRUE(request.AddCommand("set key0"));
+    {
+        brpc::RedisResponse response;
+        brpc::Controller cntl;
+        channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(2 * N + 1, response.reply_size());
+        for (int i = 0; i < N; ++i) {
+            ASSERT_STREQ("OK", response.reply(i).c_str());
+            ASSERT_EQ(butil::string_printf("value%d", i),
+                      response.reply(N + i).data());
+        }
+        ASSERT_TRUE(response.reply(2 * N).is_error());
+        // No redirections.
+        ASSERT_EQ(1, cluster.nslots_command.load());
+    }
+
+    // Move all slots to node0, commands to node1 are redirected.
+    cluster.split.store(brpc::REDIS_CLUSTER_SLOTS);
+    for (int k = 0; k < 2; ++k) {
+        brpc::RedisResponse response;
+        brpc::Controller cntl;
+        channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(2 * N + 1, response.reply_size());
+        for (int i = 0; i < N; ++i) {
+            ASSERT_STREQ("OK", response.reply(i).c_str());
+            ASSERT_EQ(butil::string_printf("value%d", i),
+                      response.reply(N + i).data());
+        }
+        // Slots were refreshed after MOVED at the first time.
+        ASSERT_EQ(2, cluster.nslots_command.load());
+    }
+
+    // Asynchronous call.
+    {
+        brpc::RedisResponse response;
+        brpc::Controller cntl;
+        channel.CallMethod(NULL, &cntl, &request, &response, brpc::DoNothing());
+        brpc::Join(cntl.call_id());
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(2 * N + 1, response.reply_size());
+        ASSERT_EQ("value1", response.reply(N + 1).data());
+    }
+    for (int i = 0; i < 2; ++i) {
+        servers[i].Stop(0);
+        servers[i].Join();
+    }
+}
 } //namespace
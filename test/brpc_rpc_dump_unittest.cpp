@@ -0,0 +1,91 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <fcntl.h>
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/file_util.h"
+#include "butil/files/file_enumerator.h"
+#include "brpc/rpc_dump.h"
+
+namespace brpc {
+DECLARE_int32(rpc_dump_max_requests_in_one_file);
+}
+
+namespace {
+
+const char* const DUMP_DIR = "./rpc_dump_unittest_dir";
+
+std::vector<std::string> ListDumpedFiles() {
+    std::vector<std::string> files;
+    butil::FileEnumerator e(butil::FilePath(DUMP_DIR), false,
+                            butil::FileEnumerator::FILES);
+    for (butil::FilePath name = e.Next(); !name.empty(); name = e.Next()) {
+        files.push_back(name.value());
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+std::string RequestOf(int i) {
+    return std::string(100 + i, 'a' + i % 26);
+}
+
+TEST(RpcDumpTest, indexed_files) {
+    GFLAGS_NS::SetCommandLineOption("rpc_dump_dir", DUMP_DIR);
+    brpc::FLAGS_rpc_dump_max_requests_in_one_file = 3;
+    // The 7th request is buffered and not written yet.
+    for (int i = 0; i < 7; ++i) {
+        brpc::SampledRequest* sample = new brpc::SampledRequest;
+        sample->set_service_name("EchoService");
+        sample->set_method_name("Echo");
+        sample->set_protocol_type(brpc::PROTOCOL_BAIDU_STD);
+        sample->request.append(RequestOf(i));
+        sample->dump_and_destroy(1);
+    }
+    const std::vector<std::string> files = ListDumpedFiles();
+    ASSERT_EQ(2u, files.size());
+
+    for (size_t f = 0; f < files.size(); ++f) {
+        brpc::SampleFile file;
+        ASSERT_EQ(0, file.Open(files[f]));
+        ASSERT_EQ(3u, file.size());
+        // Random access.
+        for (int k = 2; k >= 0; --k) {
+            brpc::SampledRequest* req = file.Get(k);
+            ASSERT_TRUE(req != NULL);
+            ASSERT_EQ("EchoService", req->service_name());
+            ASSERT_EQ(RequestOf(f * 3 + k), req->request.to_string());
+            delete req;
+        }
+        ASSERT_TRUE(file.Get(3) == NULL);
+    }
+
+    // Files are still readable sequentially.
+    brpc::SampleIterator it(DUMP_DIR);
+    int n = 0;
+    for (brpc::SampledRequest* req = it.Next(); req; req = it.Next(), ++n) {
+        delete req;
+    }
+    ASSERT_EQ(6, n);
+
+    // Files without the index are scanned.
+    std::string content;
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath(files[0]), &content));
+    const std::string truncated = std::string(DUMP_DIR) + "/truncated";
+    const size_t index_size = 12 + 3 * 8;
+    ASSERT_EQ((int)(content.size() - index_size),
+              butil::WriteFile(butil::FilePath(truncated), content.data(),
+                               content.size() - index_size));
+    brpc::SampleFile file;
+    ASSERT_EQ(0, file.Open(truncated));
+    ASSERT_EQ(3u, file.size());
+    brpc::SampledRequest* req = file.Get(1);
+    ASSERT_TRUE(req != NULL);
+    ASSERT_EQ(RequestOf(1), req->request.to_string());
+    delete req;
+    butil::DeleteFile(butil::FilePath(DUMP_DIR), true);
+}
+
+} // namespace
@@ -507,6 +507,82 @@ TEST(RtmpTest, amf) {
     ASSERT_EQ("heheda", info3.description());
 }
 
+TEST(RtmpTest, shared_message_chunks) {
+    brpc::RtmpVideoMessage vmsg;
+    vmsg.timestamp = 1000;
+    vmsg.frame_type = brpc::FLV_VIDEO_FRAME_KEYFRAME;
+    vmsg.codec = brpc::FLV_VIDEO_AVC;
+    vmsg.data.append(std::string(299, 'v'));
+    butil::intrusive_ptr<brpc::RtmpSharedMessage> msg =
+        brpc::RtmpSharedMessage::Create(vmsg);
+    ASSERT_TRUE(msg != NULL);
+    ASSERT_TRUE(msg->is_key_frame());
+    ASSERT_FALSE(msg->is_sequence_header());
+    ASSERT_EQ(300u, msg->body().size());
+
+    // type-0 header + 2 type-3 headers.
+    butil::IOBuf chunks1;
+    msg->AppendChunks(128, 6, 1, &chunks1);
+    ASSERT_EQ(12u + 300u + 2u, chunks1.size());
+    const uint8_t* p = (const uint8_t*)chunks1.fetch1();
+    ASSERT_EQ(6, *p);  // fmt=0, cs_id=6
+    butil::IOBuf chunks2;
+    msg->AppendChunks(128, 6, 1, &chunks2);
+    ASSERT_EQ(chunks1, chunks2);
+    // Blocks are shared rather than serialized again.
+    ASSERT_EQ(chunks1.backing_block(0).data(), chunks2.backing_block(0).data());
+    butil::IOBuf chunks3;
+    msg->AppendChunks(4096, 6, 1, &chunks3);
+    ASSERT_EQ(12u + 300u, chunks3.size());
+
+    // Extended timestamp in all chunks.
+    vmsg.timestamp = 0x1000000;
+    msg = brpc::RtmpSharedMessage::Create(vmsg);
+    butil::IOBuf chunks4;
+    msg->AppendChunks(128, 6, 1, &chunks4);
+    ASSERT_EQ(16u + 300u + 2 * 5u, chunks4.size());
+}
+
+TEST(RtmpTest, gop_cache) {
+    brpc::RtmpGopCache cache(3);
+    brpc::RtmpVideoMessage vmsg;
+    vmsg.timestamp = 0;
+    vmsg.codec = brpc::FLV_VIDEO_AVC;
+    vmsg.frame_type = brpc::FLV_VIDEO_FRAME_INTERFRAME;
+    vmsg.data.push_back(brpc::FLV_AVC_PACKET_NALU);
+    // Not cached before the first key frame.
+    cache.Add(brpc::RtmpSharedMessage::Create(vmsg));
+    ASSERT_EQ(0u, cache.gop_size());
+
+    brpc::RtmpVideoMessage seq_header = vmsg;
+    seq_header.frame_type = brpc::FLV_VIDEO_FRAME_KEYFRAME;
+    seq_header.data.clear();
+    seq_header.data.push_back(brpc::FLV_AVC_PACKET_SEQUENCE_HEADER);
+    butil::intrusive_ptr<brpc::RtmpSharedMessage> msg =
+        brpc::RtmpSharedMessage::Create(seq_header);
+    ASSERT_TRUE(msg->is_sequence_header());
+    ASSERT_FALSE(msg->is_key_frame());
+    cache.Add(msg);
+    ASSERT_EQ(0u, cache.gop_size());
+
+    brpc::RtmpVideoMessage key_frame = vmsg;
+    key_frame.frame_type = brpc::FLV_VIDEO_FRAME_KEYFRAME;
+    cache.Add(brpc::RtmpSharedMessage::Create(key_frame));
+    cache.Add(brpc::RtmpSharedMessage::Create(vmsg));
+    ASSERT_EQ(2u, cache.gop_size());
+    // A new key frame starts a new GOP.
+    cache.Add(brpc::RtmpSharedMessage::Create(key_frame));
+    ASSERT_EQ(1u, cache.gop_size());
+    cache.Add(brpc::RtmpSharedMessage::Create(vmsg));
+    cache.Add(brpc::RtmpSharedMessage::Create(vmsg));
+    ASSERT_EQ(3u, cache.gop_size());
+    // Too long GOP is dropped.
+    cache.Add(brpc::RtmpSharedMessage::Create(vmsg));
+    ASSERT_EQ(0u, cache.gop_size());
+    cache.Add(brpc::RtmpSharedMessage::Create(vmsg));
+    ASSERT_EQ(0u, cache.gop_size());
+}
+
 TEST(RtmpTest, successfully_play_streams) {
     PlayingDummyService rtmp_service;
     brpc::Server server;
@@ -8,7 +8,9 @@
 #include <fstream>
 #include <gtest/gtest.h>
 #include <google/protobuf/descriptor.h>
+#include <google/protobuf/arena.h>
 #include "butil/time.h"
+#include "butil/string_printf.h"
 #include "butil/macros.h"
 #include "butil/fd_guard.h"
 #include "butil/files/scoped_file.h"
@@ -30,11 +32,18 @@
 #include "brpc/builtin/ids_service.h"          // IdsService
 #include "brpc/builtin/sockets_service.h"      // SocketsService
 #include "brpc/builtin/bad_method_service.h"
+#include "brpc/acceptor.h"
 #include "brpc/server.h"
+#include "brpc/tenant_quota.h"
 #include "brpc/restful.h"
 #include "brpc/channel.h"
 #include "brpc/socket_map.h"
 #include "brpc/controller.h"
+#include "brpc/pb_bytes_field.h"
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/method_status.h"
+#include "brpc/details/response_cache.h"
+#include "brpc/details/message_pool.h"
 #include "echo.pb.h"
 #include "v1.pb.h"
 #include "v2.pb.h"
@@ -48,6 +57,7 @@ int main(int argc, char* argv[]) {
 namespace brpc {
 DECLARE_bool(enable_threads_service);
 DECLARE_bool(enable_dir_service);
+DECLARE_bool(reuse_server_controller);
 }
 
 namespace {
@@ -935,6 +945,86 @@ TEST_F(ServerTest, restful_mapping_is_tried_after_others) {
 
 }
 
+static std::string FindRestfulMethod(const brpc::RestfulMap& map,
+                                     const std::string& path,
+                                     std::string* unresolved_path) {
+    const brpc::Server::MethodProperty* mp =
+        map.FindMethodProperty(path, unresolved_path);
+    return mp ? mp->method->name() : "NULL";
+}
+
+TEST_F(ServerTest, restful_map_matching) {
+    EchoServiceV1 service_v1;
+    // Paths are mapped into the RestfulMap named by their first components.
+    brpc::RestfulMap map("v6");
+    std::vector<brpc::RestfulMapping> mappings;
+    ASSERT_TRUE(brpc::ParseRestfulMappings(
+                    "/v6/echo => Echo,"
+                    "/v6/echo/* => Echo2,"
+                    "/v6/abc/*/def => Echo3,"
+                    "/v6/echo/*.flv => Echo4,"
+                    "/v6/*.flv => Echo5,"
+                    "/v6/abc/def/ghi => Echo",
+                    &mappings));
+    for (size_t i = 0; i < mappings.size(); ++i) {
+        brpc::Server::MethodProperty::OpaqueParams params;
+        ASSERT_TRUE(map.AddMethod(mappings[i].path, &service_v1, params,
+                                  mappings[i].method_name, NULL));
+    }
+    map.PrepareForFinding();
+
+    std::string unresolved;
+    ASSERT_EQ("Echo", FindRestfulMethod(map, "/echo", &unresolved));
+    ASSERT_EQ("", unresolved);
+    ASSERT_EQ("Echo", FindRestfulMethod(map, "//echo///", &unresolved));
+    ASSERT_EQ("Echo2", FindRestfulMethod(map, "/echo/a/b", &unresolved));
+    ASSERT_EQ("a/b", unresolved);
+    ASSERT_EQ("Echo4", FindRestfulMethod(map, "/echo/a/b.flv", &unresolved));
+    ASSERT_EQ("a/b", unresolved);
+    ASSERT_EQ("Echo5", FindRestfulMethod(map, "/echoo/b.flv", &unresolved));
+    ASSERT_EQ("echoo/b", unresolved);
+    ASSERT_EQ("Echo3", FindRestfulMethod(map, "/abc/x/y/def", &unresolved));
+    ASSERT_EQ("x/y", unresolved);
+    ASSERT_EQ("Echo", FindRestfulMethod(map, "/abc/def/ghi", &unresolved));
+    // Go back to shorter prefixes when longer ones do not match.
+    ASSERT_EQ("Echo3", FindRestfulMethod(map, "/abc/def/ghi/def", &unresolved));
+    ASSERT_EQ("def/ghi", unresolved);
+    ASSERT_EQ("Echo5", FindRestfulMethod(map, "/abc/def/ghi.flv", &unresolved));
+    ASSERT_EQ("Echo3", FindRestfulMethod(map, "/abc/def", &unresolved));
+    ASSERT_EQ("", unresolved);
+    ASSERT_EQ("NULL", FindRestfulMethod(map, "/abc/de", &unresolved));
+    ASSERT_EQ("NULL", FindRestfulMethod(map, "/", &unresolved));
+
+    // Many mappings sharing prefixes.
+    brpc::RestfulMap big_map("api");
+    const int N = 2000;
+    for (int i = 0; i < N; ++i) {
+        brpc::RestfulMethodPath path;
+        ASSERT_TRUE(brpc::ParseRestfulPath(
+                        butil::string_printf("/api/v%d/res%d/*", i % 10, i),
+                        &path));
+        brpc::Server::MethodProperty::OpaqueParams params;
+        ASSERT_TRUE(big_map.AddMethod(path, &service_v1, params,
+                                      (i % 2 ? "Echo" : "Echo2"), NULL));
+    }
+    big_map.PrepareForFinding();
+    butil::Timer tm;
+    tm.start();
+    const int LOOKUPS = 100000;
+    for (int i = 0; i < LOOKUPS; ++i) {
+        const int k = i % N;
+        const std::string path = butil::string_printf(
+            "/v%d/res%d/item%d", k % 10, k, i);
+        ASSERT_EQ((k % 2 ? "Echo" : "Echo2"),
+                  FindRestfulMethod(big_map, path, &unresolved));
+        ASSERT_EQ(butil::string_printf("item%d", i), unresolved);
+    }
+    tm.stop();
+    LOG(INFO) << "Found in " << N << " restful mappings in "
+              << tm.n_elapsed() / LOOKUPS << "ns";
+    ASSERT_EQ("NULL", FindRestfulMethod(big_map, "/v1/res2/x", &unresolved));
+}
+
 TEST_F(ServerTest, add_remove_service) {
     brpc::Server server;
     EchoServiceImpl echo_svc;
@@ -1350,4 +1440,724 @@ TEST_F(ServerTest, max_concurrency) {
     stub.Echo(&cntl4, &req, NULL, NULL);
     ASSERT_FALSE(cntl4.Failed()) << cntl4.ErrorText();
 }
+
+TEST_F(ServerTest, auto_max_concurrency) {
+    const int port = 9201;
+    brpc::Server server;
+    EchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    server.MaxConcurrencyOf("test.EchoService.Echo") = "not_exist";
+    ASSERT_EQ(-1, server.Start(port, NULL));
+    server.MaxConcurrencyOf("test.EchoService.Echo") = "auto";
+    ASSERT_EQ("auto", server.MaxConcurrencyOf("test.EchoService.Echo").value());
+    ASSERT_EQ(0, server.Start(port, NULL));
+    const brpc::Server& const_server = server;
+    ASSERT_GT(const_server.MaxConcurrencyOf("test.EchoService.Echo"), 0);
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message("hello");
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+class DeadlineEchoServiceImpl : public EchoServiceImpl {
+public:
+    DeadlineEchoServiceImpl() : deadline_us(0), nested_timeout_ms(0), port(0) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = (brpc::Controller*)cntl_base;
+        response->set_message(EXP_RESPONSE);
+        if (request->sleep_us() > 0) {
+            bthread_usleep(request->sleep_us());
+            return;
+        }
+        deadline_us = cntl->deadline_us();
+        // Calls to other servers inherit the deadline.
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+        test::EchoService_Stub stub(&channel);
+        brpc::Controller nested_cntl;
+        nested_cntl.set_timeout_ms(100000);
+        test::EchoRequest nested_req;
+        test::EchoResponse nested_res;
+        nested_req.set_message(EXP_REQUEST);
+        nested_req.set_sleep_us(1);
+        stub.Echo(&nested_cntl, &nested_req, &nested_res, NULL);
+        EXPECT_FALSE(nested_cntl.Failed()) << nested_cntl.ErrorText();
+        nested_timeout_ms = nested_cntl.timeout_ms();
+    }
+    int64_t deadline_us;
+    int64_t nested_timeout_ms;
+    int port;
+};
+
+TEST_F(ServerTest, deadline_propagation) {
+    const int port = 9202;
+    brpc::Server server;
+    DeadlineEchoServiceImpl service;
+    service.port = port;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    const char* const protocols[] = { "baidu_std", "http" };
+    for (size_t i = 0; i < ARRAY_SIZE(protocols); ++i) {
+        brpc::ChannelOptions opt;
+        opt.protocol = protocols[i];
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init("0.0.0.0", port, &opt));
+        test::EchoService_Stub stub(&channel);
+        brpc::Controller cntl;
+        cntl.set_timeout_ms(3000);
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        const int64_t start_us = butil::gettimeofday_us();
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_LE(service.deadline_us, start_us + 3000 * 1000L);
+        ASSERT_GT(service.deadline_us, start_us);
+        ASSERT_GT(service.nested_timeout_ms, 0);
+        ASSERT_LE(service.nested_timeout_ms, 3000);
+    }
+
+    // Requests without timeout have no deadline.
+    {
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+        test::EchoService_Stub stub(&channel);
+        brpc::Controller cntl;
+        cntl.set_timeout_ms(-1);
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(-1, service.deadline_us);
+        ASSERT_EQ(100000, service.nested_timeout_ms);
+    }
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+TEST_F(ServerTest, tenant_quotas) {
+    const int port = 9203;
+    brpc::TenantQuotas quotas;
+    quotas.set_http_header("x-tenant");
+    brpc::TenantQuota quota;
+    quota.max_qps = 1;
+    quotas.SetQuota("limited", quota);
+    brpc::Server server;
+    EchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    brpc::ServerOptions opt;
+    opt.tenant_quotas = &quotas;
+    ASSERT_EQ(0, server.Start(port, &opt));
+
+    brpc::ChannelOptions copt;
+    copt.protocol = "http";
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, &copt));
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    req.set_message(EXP_REQUEST);
+    // The bucket of "limited" is empty after the first request.
+    for (int i = 0; i < 2; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        cntl.http_request().SetHeader("x-tenant", "limited");
+        stub.Echo(&cntl, &req, &res, NULL);
+        if (i == 0) {
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        } else {
+            ASSERT_TRUE(cntl.Failed());
+            ASSERT_EQ(brpc::ELIMIT, cntl.ErrorCode()) << cntl.ErrorText();
+        }
+    }
+    // Other tenants are not affected.
+    for (int i = 0; i < 2; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        cntl.http_request().SetHeader("x-tenant", "other");
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    }
+    std::ostringstream os;
+    quotas.Describe(os, brpc::DescribeOptions());
+    ASSERT_NE(std::string::npos,
+              os.str().find("tenant=limited count=1 rejected=1")) << os.str();
+    ASSERT_NE(std::string::npos,
+              os.str().find("tenant=other count=2 rejected=0")) << os.str();
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+TEST_F(ServerTest, hot_restart) {
+    const int port = 9204;
+    const char* path = "./hot_restart_unittest.sock";
+    unlink(path);
+    // Register the quit handler so that the old server asking to quit
+    // does not kill this process.
+    brpc::IsAskedToQuit();
+    EchoServiceImpl service;
+    brpc::ServerOptions opt;
+    opt.hot_restart_path = path;
+    brpc::Server old_server;
+    ASSERT_EQ(0, old_server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, old_server.Start(port, &opt));
+
+    brpc::ChannelOptions copt;
+    copt.protocol = "http";
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, &copt));
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    req.set_message(EXP_REQUEST);
+    {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    }
+
+    // Listening to the same port succeeds with the handed-over socket.
+    brpc::Server new_server;
+    ASSERT_EQ(0, new_server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, new_server.Start(port, &opt));
+    ASSERT_TRUE(old_server.IsHandedOver());
+    ASSERT_FALSE(new_server.IsHandedOver());
+    for (int i = 0; i < 500 && !brpc::IsAskedToQuit(); ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_TRUE(brpc::IsAskedToQuit());
+    ASSERT_EQ(0u, old_server._am->ConnectionCount());
+
+    // Requests are served by the new server.
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    }
+    ASSERT_EQ(1u, new_server._am->ConnectionCount());
+    ASSERT_EQ(0, old_server.Stop(0));
+    ASSERT_EQ(0, old_server.Join());
+    ASSERT_EQ(0, new_server.Stop(0));
+    ASSERT_EQ(0, new_server.Join());
+    unlink(path);
+}
+
+class ArenaEchoServiceImpl : public test::EchoService {
+public:
+    ArenaEchoServiceImpl() : on_arena(false), shares_arena(false) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        on_arena = (request->GetArena() != NULL &&
+                    request->GetArena() == response->GetArena());
+        // Allocations of users are on the same arena.
+        shares_arena = (cntl->arena() != NULL &&
+                        cntl->arena() == request->GetArena());
+        char* buf = static_cast<char*>(
+            cntl->AllocateFromArena(request->message().size()));
+        ASSERT_TRUE(buf != NULL);
+        ASSERT_EQ(0u, (uintptr_t)buf % 8);
+        memcpy(buf, request->message().data(), request->message().size());
+        response->set_message(buf, request->message().size());
+        test::EchoRequest* tmp =
+            google::protobuf::Arena::CreateMessage<test::EchoRequest>(
+                cntl->arena());
+        tmp->set_message(request->message());
+        ASSERT_EQ(cntl->arena(), tmp->GetArena());
+    }
+    bool on_arena;
+    bool shares_arena;
+};
+
+TEST_F(ServerTest, arena) {
+    const int port = 9205;
+    brpc::Server server;
+    ArenaEchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_FALSE(server.IsUsingArena("test.EchoService.Echo"));
+    ASSERT_EQ(-1, server.SetUseArena("test.EchoService.NotExist", true));
+    ASSERT_EQ(0, server.SetUseArena("test.EchoService.Echo", true));
+    ASSERT_TRUE(server.IsUsingArena("test.EchoService.Echo"));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    test::EchoRequest req;
+    req.set_message(EXP_REQUEST);
+    // Arenas are reused between RPCs.
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+        ASSERT_TRUE(service.on_arena);
+        ASSERT_TRUE(service.shares_arena);
+    }
+    ASSERT_EQ(0, server.SetUseArena("test.EchoService.Echo", false));
+    {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+        ASSERT_FALSE(service.on_arena);
+        // Created on demand for allocations of users.
+        ASSERT_FALSE(service.shares_arena);
+    }
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+class ReuseEchoServiceImpl : public test::EchoService {
+public:
+    ReuseEchoServiceImpl() : has_code(false), cntl_from_pool(false) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        has_code = request->has_code();
+        cntl_from_pool = brpc::ControllerPrivateAccessor(
+            static_cast<brpc::Controller*>(cntl_base)).is_from_pool();
+        // Cleared before being reused.
+        EXPECT_EQ(0, response->code_list_size());
+        response->set_message(request->message());
+        response->add_code_list(request->code());
+    }
+    bool has_code;
+    bool cntl_from_pool;
+};
+
+TEST_F(ServerTest, reuse_messages) {
+    const int port = 9206;
+    const bool saved_reuse_cntl = brpc::FLAGS_reuse_server_controller;
+    brpc::FLAGS_reuse_server_controller = true;
+    brpc::Server server;
+    ReuseEchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_FALSE(server.IsReusingMessages("test.EchoService.Echo"));
+    ASSERT_EQ(-1, server.SetReuseMessages("test.EchoService.NotExist", true));
+    ASSERT_EQ(0, server.SetReuseMessages("test.EchoService.Echo", true));
+    ASSERT_TRUE(server.IsReusingMessages("test.EchoService.Echo"));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        req.set_message(EXP_REQUEST);
+        if (i == 0) {
+            req.set_code(1);
+        }
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+        ASSERT_EQ(1, res.code_list_size());
+        // Fields of previous requests are not seen.
+        ASSERT_EQ(i == 0, service.has_code);
+        ASSERT_TRUE(service.cntl_from_pool);
+    }
+    brpc::MethodStatus* st =
+        server.FindMethodPropertyByFullName("test.EchoService.Echo")->status;
+    ASSERT_EQ(1u, st->request_pool()->stat().ncreated);
+    ASSERT_EQ(1u, st->response_pool()->stat().ncreated);
+    ASSERT_EQ(1u, st->request_pool()->stat().nfree);
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+    brpc::FLAGS_reuse_server_controller = saved_reuse_cntl;
+}
+
+class LazyEchoServiceImpl : public test::EchoService {
+public:
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        // Not parsed.
+        EXPECT_FALSE(request->has_message());
+        butil::IOBuf& buf = cntl->unparsed_request();
+        if (brpc::CutPbBytesField(&buf, 1, &cntl->response_attachment()) != 1) {
+            cntl->SetFailed("Fail to cut message");
+            return;
+        }
+        test::EchoRequest rest;
+        butil::IOBufAsZeroCopyInputStream wrapper(buf);
+        if (!rest.ParsePartialFromZeroCopyStream(&wrapper)) {
+            cntl->SetFailed("Fail to parse the rest");
+            return;
+        }
+        response->set_message("cut");
+        response->add_code_list(rest.code());
+    }
+};
+
+TEST_F(ServerTest, parse_request_lazily) {
+    const int port = 9207;
+    brpc::Server server;
+    LazyEchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_FALSE(server.IsParsingRequestLazily("test.EchoService.Echo"));
+    ASSERT_EQ(-1, server.SetParseRequestLazily("test.EchoService.NotExist", true));
+    ASSERT_EQ(0, server.SetParseRequestLazily("test.EchoService.Echo", true));
+    ASSERT_TRUE(server.IsParsingRequestLazily("test.EchoService.Echo"));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    const std::string big(256 * 1024, 'x');
+    const brpc::CompressType types[] = {
+        brpc::COMPRESS_TYPE_NONE, brpc::COMPRESS_TYPE_GZIP };
+    for (size_t i = 0; i < arraysize(types); ++i) {
+        brpc::Controller cntl;
+        cntl.set_request_compress_type(types[i]);
+        test::EchoRequest req;
+        req.set_message(big);
+        req.set_code(17);
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("cut", res.message());
+        ASSERT_EQ(1, res.code_list_size());
+        ASSERT_EQ(17, res.code_list(0));
+        ASSERT_EQ(big, cntl.response_attachment().to_string());
+    }
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+TEST_F(ServerTest, arena_and_reused_messages_of_legacy_pbrpc) {
+    const int port = 9211;
+    brpc::Server server;
+    ArenaEchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, NULL));
+    const char* protocols[] = { "hulu_pbrpc", "sofa_pbrpc" };
+    for (size_t i = 0; i < arraysize(protocols); ++i) {
+        brpc::ChannelOptions opt;
+        opt.protocol = protocols[i];
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init("0.0.0.0", port, &opt));
+        test::EchoService_Stub stub(&channel);
+        test::EchoRequest req;
+        req.set_message(EXP_REQUEST);
+
+        ASSERT_EQ(0, server.SetUseArena("test.EchoService.Echo", true));
+        for (int j = 0; j < 3; ++j) {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            stub.Echo(&cntl, &req, &res, NULL);
+            ASSERT_FALSE(cntl.Failed()) << protocols[i] << ": "
+                                        << cntl.ErrorText();
+            ASSERT_EQ(EXP_REQUEST, res.message());
+            ASSERT_TRUE(service.on_arena);
+            ASSERT_TRUE(service.shares_arena);
+        }
+        ASSERT_EQ(0, server.SetUseArena("test.EchoService.Echo", false));
+
+        ASSERT_EQ(0, server.SetReuseMessages("test.EchoService.Echo", true));
+        for (int j = 0; j < 3; ++j) {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            stub.Echo(&cntl, &req, &res, NULL);
+            ASSERT_FALSE(cntl.Failed()) << protocols[i] << ": "
+                                        << cntl.ErrorText();
+            ASSERT_EQ(EXP_REQUEST, res.message());
+            ASSERT_FALSE(service.on_arena);
+        }
+        ASSERT_EQ(0, server.SetReuseMessages("test.EchoService.Echo", false));
+    }
+    // Messages are returned to the pools rather than created for each of
+    // the 6 RPCs.
+    brpc::MethodStatus* st =
+        server.FindMethodPropertyByFullName("test.EchoService.Echo")->status;
+    ASSERT_LT(st->request_pool()->stat().ncreated, 6u);
+    ASSERT_LT(st->response_pool()->stat().ncreated, 6u);
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+class CountingEchoServiceImpl : public test::EchoService {
+public:
+    CountingEchoServiceImpl() : ncalled(0) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        response->set_message(request->message());
+        response->add_code_list(++ncalled);
+        cntl->response_attachment().append(cntl->request_attachment());
+    }
+    int ncalled;
+};
+
+TEST_F(ServerTest, response_cache) {
+    const int port = 9208;
+    brpc::Server server;
+    CountingEchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_FALSE(server.IsCachingResponses("test.EchoService.Echo"));
+    ASSERT_EQ(-1, server.SetResponseCache("test.EchoService.NotExist", 100, 1 << 20));
+    ASSERT_EQ(-1, server.SetResponseCache("test.EchoService.Echo", 100, 0));
+    ASSERT_EQ(0, server.SetResponseCache("test.EchoService.Echo", 100, 1 << 20));
+    ASSERT_TRUE(server.IsCachingResponses("test.EchoService.Echo"));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    // Requests differ in messages or attachments are cached separately.
+    const char* const messages[] = { "a", "a", "b", "a", "a" };
+    const char* const attachments[] = { "", "", "", "x", "x" };
+    const int codes[] = { 1, 1, 2, 3, 3 };
+    for (size_t i = 0; i < arraysize(messages); ++i) {
+        brpc::Controller cntl;
+        cntl.request_attachment().append(attachments[i]);
+        test::EchoRequest req;
+        req.set_message(messages[i]);
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(messages[i], res.message());
+        ASSERT_EQ(1, res.code_list_size());
+        ASSERT_EQ(codes[i], res.code_list(0));
+        ASSERT_EQ(attachments[i], cntl.response_attachment().to_string());
+    }
+    ASSERT_EQ(3, service.ncalled);
+
+    // Expired.
+    bthread_usleep(150000);
+    {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        req.set_message("a");
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(4, res.code_list(0));
+    }
+    // Stop caching.
+    ASSERT_EQ(0, server.SetResponseCache("test.EchoService.Echo", 0, 0));
+    ASSERT_FALSE(server.IsCachingResponses("test.EchoService.Echo"));
+    {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        req.set_message("a");
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(5, res.code_list(0));
+    }
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+TEST_F(ServerTest, response_cache_eviction) {
+    brpc::ResponseCache cache;
+    // Each shard holds 2 responses below at most.
+    const int64_t max_bytes = 16 * 300;
+    cache.Reset(1000, max_bytes);
+    // Find 3 keys in the same shard.
+    std::vector<brpc::ResponseCache::Key> keys;
+    for (int i = 0; keys.size() < 3; ++i) {
+        butil::IOBuf req;
+        req.append(butil::string_printf("request%d", i));
+        const brpc::ResponseCache::Key key =
+            brpc::ResponseCache::MakeKey(0, 0, req);
+        if (key.hash[0] % 16 == 0) {
+            keys.push_back(key);
+        }
+    }
+    brpc::ResponseCache::Response res;
+    res.body.append("response");
+    brpc::ResponseCache::Response out;
+    ASSERT_FALSE(cache.Get(keys[0], &out));
+    cache.Put(keys[0], res);
+    cache.Put(keys[1], res);
+    ASSERT_TRUE(cache.Get(keys[0], &out));
+    ASSERT_EQ("response", out.body.to_string());
+    // keys[1] is the least recently used one.
+    cache.Put(keys[2], res);
+    ASSERT_TRUE(cache.Get(keys[0], &out));
+    ASSERT_FALSE(cache.Get(keys[1], &out));
+    ASSERT_TRUE(cache.Get(keys[2], &out));
+    // Too big to be cached.
+    res.body.append(std::string(1000, 'x'));
+    cache.Put(keys[1], res);
+    ASSERT_FALSE(cache.Get(keys[1], &out));
+    // Dropped by Reset().
+    cache.Reset(1000, max_bytes);
+    ASSERT_FALSE(cache.Get(keys[0], &out));
+}
+
+class SlowCountingEchoServiceImpl : public test::EchoService {
+public:
+    SlowCountingEchoServiceImpl() : ncalled(0) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        ncalled.fetch_add(1);
+        bthread_usleep(100000);
+        if (request->message() == "fail") {
+            cntl->SetFailed(EPERM, "Denied");
+            return;
+        }
+        response->set_message(request->message());
+        cntl->response_attachment().append(cntl->request_attachment());
+    }
+    butil::atomic<int> ncalled;
+};
+
+TEST_F(ServerTest, coalesce_requests) {
+    const int port = 9209;
+    brpc::Server server;
+    SlowCountingEchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_FALSE(server.IsCoalescingRequests("test.EchoService.Echo"));
+    ASSERT_EQ(-1, server.SetCoalesceRequests("test.EchoService.NotExist", true));
+    ASSERT_EQ(0, server.SetCoalesceRequests("test.EchoService.Echo", true));
+    ASSERT_TRUE(server.IsCoalescingRequests("test.EchoService.Echo"));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    // Identical requests share one call, different ones are not coalesced.
+    const char* const messages[] = { "a", "a", "a", "b", "fail", "fail" };
+    const size_t N = arraysize(messages);
+    brpc::Controller cntl[N];
+    test::EchoResponse res[N];
+    for (size_t i = 0; i < N; ++i) {
+        cntl[i].request_attachment().append("x");
+        test::EchoRequest req;
+        req.set_message(messages[i]);
+        stub.Echo(&cntl[i], &req, &res[i], brpc::DoNothing());
+    }
+    for (size_t i = 0; i < N; ++i) {
+        brpc::Join(cntl[i].call_id());
+        if (strcmp(messages[i], "fail") == 0) {
+            ASSERT_EQ(EPERM, cntl[i].ErrorCode());
+            continue;
+        }
+        ASSERT_FALSE(cntl[i].Failed()) << cntl[i].ErrorText();
+        ASSERT_EQ(messages[i], res[i].message());
+        ASSERT_EQ("x", cntl[i].response_attachment().to_string());
+    }
+    ASSERT_EQ(3, service.ncalled.load());
+
+    // Requests after the first one is done are not coalesced.
+    {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        req.set_message("a");
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(4, service.ncalled.load());
+    }
+    ASSERT_EQ(0, server.SetCoalesceRequests("test.EchoService.Echo", false));
+    ASSERT_FALSE(server.IsCoalescingRequests("test.EchoService.Echo"));
+    brpc::Controller cntl2[2];
+    test::EchoResponse res2[2];
+    for (size_t i = 0; i < 2; ++i) {
+        test::EchoRequest req;
+        req.set_message("a");
+        stub.Echo(&cntl2[i], &req, &res2[i], brpc::DoNothing());
+    }
+    for (size_t i = 0; i < 2; ++i) {
+        brpc::Join(cntl2[i].call_id());
+        ASSERT_FALSE(cntl2[i].Failed()) << cntl2[i].ErrorText();
+    }
+    ASSERT_EQ(6, service.ncalled.load());
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+
+TEST_F(ServerTest, usercode_pool) {
+    const int port = 9210;
+    brpc::Server server;
+    SlowCountingEchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_FALSE(server.IsUsingUserCodePool("test.EchoService.Echo"));
+    ASSERT_EQ(-1, server.SetUserCodePool("test.EchoService.NotExist", 0, 1, 1));
+    ASSERT_EQ(-1, server.SetUserCodePool("test.EchoService.Echo", 2, 1, 1));
+    // One running request and one waiting request at most.
+    ASSERT_EQ(0, server.SetUserCodePool("test.EchoService.Echo", 0, 1, 1));
+    ASSERT_TRUE(server.IsUsingUserCodePool("test.EchoService.Echo"));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    const size_t N = 3;
+    brpc::Controller cntl[N];
+    test::EchoResponse res[N];
+    for (size_t i = 0; i < N; ++i) {
+        test::EchoRequest req;
+        req.set_message("a");
+        stub.Echo(&cntl[i], &req, &res[i], brpc::DoNothing());
+    }
+    int nsucc = 0;
+    int nrejected = 0;
+    for (size_t i = 0; i < N; ++i) {
+        brpc::Join(cntl[i].call_id());
+        if (cntl[i].Failed()) {
+            ASSERT_EQ(brpc::ELIMIT, cntl[i].ErrorCode()) << cntl[i].ErrorText();
+            ++nrejected;
+        } else {
+            ASSERT_EQ("a", res[i].message());
+            ++nsucc;
+        }
+    }
+    ASSERT_EQ(2, nsucc);
+    ASSERT_EQ(1, nrejected);
+    ASSERT_EQ(2, service.ncalled.load());
+
+    ASSERT_EQ(0, server.SetUserCodePool("test.EchoService.Echo", 0, 0, 0));
+    ASSERT_FALSE(server.IsUsingUserCodePool("test.EchoService.Echo"));
+    brpc::Controller cntl2[N];
+    test::EchoResponse res2[N];
+    for (size_t i = 0; i < N; ++i) {
+        test::EchoRequest req;
+        req.set_message("a");
+        stub.Echo(&cntl2[i], &req, &res2[i], brpc::DoNothing());
+    }
+    for (size_t i = 0; i < N; ++i) {
+        brpc::Join(cntl2[i].call_id());
+        ASSERT_FALSE(cntl2[i].Failed()) << cntl2[i].ErrorText();
+    }
+    ASSERT_EQ(5, service.ncalled.load());
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
 } //namespace
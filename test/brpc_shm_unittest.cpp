@@ -0,0 +1,190 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "butil/iobuf.h"
+#include "brpc/shm/shm_ring.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "echo.pb.h"
+
+namespace {
+
+const size_t RING_SIZE = 4096;
+
+class ShmRingTest : public ::testing::Test {
+protected:
+    ShmRingTest() {
+        _mem = calloc(1, brpc::shm::ShmRing::MemorySize(RING_SIZE));
+        _producer.Attach(_mem, RING_SIZE);
+        _consumer.Attach(_mem, RING_SIZE);
+    }
+    ~ShmRingTest() {
+        free(_mem);
+    }
+
+    void* _mem;
+    brpc::shm::ShmRing _producer;
+    brpc::shm::ShmRing _consumer;
+};
+
+TEST_F(ShmRingTest, write_and_read_across_the_end) {
+    ASSERT_TRUE(_consumer.empty());
+    ASSERT_EQ(RING_SIZE, _producer.free_bytes());
+    butil::IOBuf buf;
+    buf.append(std::string(3000, 'a'));
+    butil::IOBuf* bufs[1] = { &buf };
+    ASSERT_EQ(3000u, _producer.Write(bufs, 1));
+    ASSERT_TRUE(buf.empty());
+    butil::IOBuf out;
+    ASSERT_EQ(3000, _consumer.Read(&out, 8192));
+    ASSERT_EQ(std::string(3000, 'a'), out.to_string());
+
+    // The second write wraps around.
+    std::string data;
+    for (size_t i = 0; i < 3000; ++i) {
+        data.push_back('a' + i % 26);
+    }
+    buf.append(data);
+    ASSERT_EQ(3000u, _producer.Write(bufs, 1));
+    out.clear();
+    ASSERT_EQ(1000, _consumer.Read(&out, 1000));
+    ASSERT_EQ(2000, _consumer.Read(&out, 8192));
+    ASSERT_EQ(data, out.to_string());
+    ASSERT_EQ(0, _consumer.Read(&out, 8192));
+}
+
+TEST_F(ShmRingTest, full_ring) {
+    butil::IOBuf buf1;
+    butil::IOBuf buf2;
+    buf1.append(std::string(RING_SIZE - 10, 'x'));
+    buf2.append(std::string(100, 'y'));
+    butil::IOBuf* bufs[2] = { &buf1, &buf2 };
+    ASSERT_EQ(RING_SIZE, _producer.Write(bufs, 2));
+    ASSERT_TRUE(buf1.empty());
+    ASSERT_EQ(90u, buf2.size());
+    ASSERT_EQ(0u, _producer.free_bytes());
+    ASSERT_EQ(0u, _producer.Write(bufs, 2));
+    // Nobody reads, the producer should wait.
+    ASSERT_TRUE(_producer.TryWaitAsProducer());
+    butil::IOBuf out;
+    ASSERT_EQ(100, _consumer.Read(&out, 100));
+    ASSERT_TRUE(_consumer.ProducerShouldBeWoken());
+    // Woken only once.
+    ASSERT_FALSE(_consumer.ProducerShouldBeWoken());
+    ASSERT_FALSE(_producer.TryWaitAsProducer());
+}
+
+TEST_F(ShmRingTest, sleeping_consumer) {
+    ASSERT_TRUE(_consumer.TrySleepAsConsumer());
+    butil::IOBuf buf;
+    buf.append("hello");
+    butil::IOBuf* bufs[1] = { &buf };
+    ASSERT_EQ(5u, _producer.Write(bufs, 1));
+    ASSERT_TRUE(_producer.ConsumerShouldBeWoken());
+    ASSERT_FALSE(_producer.ConsumerShouldBeWoken());
+    // Data is not read, no need to sleep.
+    ASSERT_FALSE(_consumer.TrySleepAsConsumer());
+    ASSERT_FALSE(_producer.ConsumerShouldBeWoken());
+}
+
+TEST_F(ShmRingTest, corrupted_indexes) {
+    _producer.header()->head.store(RING_SIZE + 1);
+    butil::IOBuf out;
+    ASSERT_EQ(-1, _consumer.Read(&out, 8192));
+    ASSERT_EQ(EPROTO, errno);
+    ASSERT_EQ(0u, _producer.free_bytes());
+}
+
+const size_t NMSG = 100000;
+
+void* produce(void* arg) {
+    brpc::shm::ShmRing* ring = static_cast<brpc::shm::ShmRing*>(arg);
+    butil::IOBuf buf;
+    for (uint32_t i = 0; i < NMSG; ++i) {
+        buf.append(&i, sizeof(i));
+        butil::IOBuf* bufs[1] = { &buf };
+        while (!buf.empty()) {
+            if (ring->Write(bufs, 1) == 0) {
+                sched_yield();
+            }
+        }
+    }
+    return NULL;
+}
+
+TEST_F(ShmRingTest, producer_and_consumer) {
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, produce, &_producer));
+    butil::IOBuf out;
+    while (out.size() < NMSG * sizeof(uint32_t)) {
+        const ssize_t n = _consumer.Read(&out, 1000);
+        ASSERT_LE(0, n);
+        if (n == 0) {
+            sched_yield();
+        }
+    }
+    pthread_join(th, NULL);
+    ASSERT_TRUE(_consumer.empty());
+    for (uint32_t i = 0; i < NMSG; ++i) {
+        uint32_t v = 0;
+        ASSERT_EQ(sizeof(v), out.cutn(&v, sizeof(v)));
+        ASSERT_EQ(i, v);
+    }
+}
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        response->set_message(request->message());
+    }
+};
+
+void Echo(brpc::Channel* channel, const std::string& message) {
+    test::EchoService_Stub stub(channel);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(message);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(message, res.message());
+}
+
+TEST(ShmTest, echo_over_shared_memory) {
+    EchoServiceImpl service;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    brpc::ServerOptions options;
+    options.use_shm = true;
+    ASSERT_EQ(0, server.Start("127.0.0.1:8613", &options));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions copt;
+    copt.use_shm = true;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:8613", &copt));
+    Echo(&channel, "hello");
+    // Larger than the ring, written in pieces.
+    Echo(&channel, std::string(3 * 1024 * 1024, 'x'));
+    Echo(&channel, "world");
+
+    // Servers not enabling shared memory refuse it.
+    brpc::Server server2;
+    ASSERT_EQ(0, server2.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server2.Start("127.0.0.1:8614", NULL));
+    brpc::Channel channel2;
+    ASSERT_EQ(0, channel2.Init("127.0.0.1:8614", &copt));
+    Echo(&channel2, "hello");
+    Echo(&channel2, std::string(3 * 1024 * 1024, 'x'));
+}
+
+} // namespace
@@ -4,14 +4,28 @@
 // Date: 2015/01/20 19:01:06
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/gperftools_profiler.h"
 #include "butil/third_party/snappy/snappy.h"
 #include "butil/macros.h"
 #include "butil/iobuf.h"
 #include "butil/time.h"
 #include "snappy_message.pb.h"
+#include "echo.pb.h"
 #include "brpc/policy/snappy_compress.h"
 #include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/policy/parallel_compress.h"
+#include "brpc/compress.h"
+#include "brpc/global.h"
+
+namespace brpc {
+namespace policy {
+DECLARE_int32(parallel_compress_min_size);
+DECLARE_int32(parallel_compress_frame_size);
+}
+}
 
 typedef bool (*Compress)(const google::protobuf::Message&, butil::IOBuf*);
 typedef bool (*Decompress)(const butil::IOBuf&, google::protobuf::Message*);
@@ -178,6 +192,16 @@ TEST_F(test_compress_method, throughput_compare) {
         CompressMessage("Zlib", k, old_msg, len, 
                          brpc::policy::ZlibCompress, 
                          brpc::policy::ZlibDecompress);
+#ifdef BRPC_WITH_LZ4
+        CompressMessage("Lz4", k, old_msg, len,
+                         brpc::policy::Lz4Compress,
+                         brpc::policy::Lz4Decompress);
+#endif
+#ifdef BRPC_WITH_ZSTD
+        CompressMessage("Zstd", k, old_msg, len,
+                         brpc::policy::ZstdCompress,
+                         brpc::policy::ZstdDecompress);
+#endif
         printf("\n");
         delete [] text;
     }
@@ -212,6 +236,16 @@ TEST_F(test_compress_method, throughput_compare_complete_random) {
         CompressMessage("Zlib", k, old_msg, len, 
                          brpc::policy::ZlibCompress, 
                          brpc::policy::ZlibDecompress);
+#ifdef BRPC_WITH_LZ4
+        CompressMessage("Lz4", k, old_msg, len,
+                         brpc::policy::Lz4Compress,
+                         brpc::policy::Lz4Decompress);
+#endif
+#ifdef BRPC_WITH_ZSTD
+        CompressMessage("Zstd", k, old_msg, len,
+                         brpc::policy::ZstdCompress,
+                         brpc::policy::ZstdDecompress);
+#endif
         printf("\n");
         delete [] text;
     }
@@ -237,3 +271,236 @@ TEST_F(test_compress_method, mass_snappy_iobuf) {
     ASSERT_TRUE(strcmp(check_str.c_str(), text) == 0);
     delete [] text;
 }
+
+// Content spanning many blocks of IOBuf to exercise the streaming.
+static void MakeMultiBlockIOBuf(butil::IOBuf* buf, size_t len) {
+    char str_table[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    std::string piece;
+    while (buf->size() < len) {
+        piece.clear();
+        for (int i = 0; i < 100; ++i) {
+            piece.push_back((i % 7 == 0) ? str_table[rand() % 36]
+                            : str_table[i % 36]);
+        }
+        buf->append(piece);
+    }
+    ASSERT_GT(buf->backing_block_num(), 2UL);
+}
+
+TEST_F(test_compress_method, snappy_multi_block_iobuf) {
+    butil::IOBuf buf;
+    MakeMultiBlockIOBuf(&buf, 4 * 1024 * 1024);
+    butil::IOBuf output_buf;
+    ASSERT_TRUE(brpc::policy::SnappyCompress(buf, &output_buf));
+    butil::IOBuf check_buf;
+    check_buf.append("prefix");
+    ASSERT_TRUE(brpc::policy::SnappyDecompress(output_buf, &check_buf));
+    ASSERT_EQ("prefix" + buf.to_string(), check_buf.to_string());
+
+    // Truncated input fails without touching the output.
+    butil::IOBuf truncated;
+    output_buf.append_to(&truncated, output_buf.size() / 2);
+    check_buf.clear();
+    check_buf.append("prefix");
+    ASSERT_FALSE(brpc::policy::SnappyDecompress(truncated, &check_buf));
+    ASSERT_EQ("prefix", check_buf.to_string());
+
+    // A header claiming more than snappy could ever expand to is rejected
+    // before allocating anything.
+    butil::IOBuf forged;
+    const char huge_len[] = { '\xff', '\xff', '\xff', '\xff', '\x0f', 'a' };
+    forged.append(huge_len, sizeof(huge_len));
+    check_buf.clear();
+    ASSERT_FALSE(brpc::policy::SnappyDecompress(forged, &check_buf));
+    ASSERT_TRUE(check_buf.empty());
+}
+
+#ifdef BRPC_WITH_LZ4
+TEST_F(test_compress_method, lz4) {
+    snappy_message::SnappyMessageProto old_msg;
+    old_msg.set_text("Hello World!");
+    old_msg.add_numbers(2);
+    old_msg.add_numbers(7);
+    butil::IOBuf buf;
+    ASSERT_TRUE(brpc::policy::Lz4Compress(old_msg, &buf));
+    snappy_message::SnappyMessageProto new_msg;
+    ASSERT_TRUE(brpc::policy::Lz4Decompress(buf, &new_msg));
+    ASSERT_EQ("Hello World!", new_msg.text());
+    ASSERT_EQ(2, new_msg.numbers_size());
+}
+
+TEST_F(test_compress_method, lz4_iobuf) {
+    butil::IOBuf buf, output_buf, check_buf;
+    MakeMultiBlockIOBuf(&buf, 1024 * 1024);
+    ASSERT_TRUE(brpc::policy::Lz4Compress(buf, &output_buf));
+    ASSERT_LT(output_buf.size(), buf.size());
+    ASSERT_TRUE(brpc::policy::Lz4Decompress(output_buf, &check_buf));
+    ASSERT_TRUE(check_buf.equals(buf.to_string()));
+
+    // Truncated frames are rejected.
+    butil::IOBuf truncated;
+    output_buf.cutn(&truncated, output_buf.size() - 1);
+    check_buf.clear();
+    ASSERT_FALSE(brpc::policy::Lz4Decompress(truncated, &check_buf));
+}
+#endif  // BRPC_WITH_LZ4
+
+#ifdef BRPC_WITH_ZSTD
+TEST_F(test_compress_method, zstd) {
+    snappy_message::SnappyMessageProto old_msg;
+    old_msg.set_text("Hello World!");
+    old_msg.add_numbers(2);
+    old_msg.add_numbers(7);
+    butil::IOBuf buf;
+    ASSERT_TRUE(brpc::policy::ZstdCompress(old_msg, &buf));
+    snappy_message::SnappyMessageProto new_msg;
+    ASSERT_TRUE(brpc::policy::ZstdDecompress(buf, &new_msg));
+    ASSERT_EQ("Hello World!", new_msg.text());
+    ASSERT_EQ(2, new_msg.numbers_size());
+}
+
+TEST_F(test_compress_method, zstd_iobuf) {
+    butil::IOBuf buf, output_buf, check_buf;
+    MakeMultiBlockIOBuf(&buf, 1024 * 1024);
+    ASSERT_TRUE(brpc::policy::ZstdCompress(buf, &output_buf));
+    ASSERT_LT(output_buf.size(), buf.size());
+    ASSERT_TRUE(brpc::policy::ZstdDecompress(output_buf, &check_buf));
+    ASSERT_TRUE(check_buf.equals(buf.to_string()));
+
+    butil::IOBuf truncated;
+    output_buf.cutn(&truncated, output_buf.size() - 1);
+    check_buf.clear();
+    ASSERT_FALSE(brpc::policy::ZstdDecompress(truncated, &check_buf));
+}
+
+TEST_F(test_compress_method, zstd_dictionary) {
+    test::EchoRequest req;
+    req.set_message("GET /api/v1/users?id=10086&fields=name,avatar,follower_count");
+    butil::IOBuf without_dict;
+    ASSERT_TRUE(brpc::policy::ZstdCompress(req, &without_dict));
+
+    // Raw content is also a valid dictionary of zstd.
+    const std::string dict =
+        "GET /api/v1/users?id=&fields=name,avatar,follower_count,following_count";
+    const google::protobuf::MethodDescriptor* method =
+        test::EchoService::descriptor()->FindMethodByName("Echo");
+    ASSERT_TRUE(method != NULL);
+    ASSERT_EQ(0, brpc::policy::RegisterZstdDictionary(method, dict, ""));
+    ASSERT_EQ(-1, brpc::policy::RegisterZstdDictionary(
+                  test::EchoRequest::descriptor(), dict));
+
+    butil::IOBuf with_dict;
+    ASSERT_TRUE(brpc::policy::ZstdCompress(req, &with_dict));
+    ASSERT_LT(with_dict.size(), without_dict.size());
+    test::EchoRequest new_req;
+    ASSERT_TRUE(brpc::policy::ZstdDecompress(with_dict, &new_req));
+    ASSERT_EQ(req.message(), new_req.message());
+
+    // The dictionary is required to decode the data.
+    butil::IOBuf out;
+    ASSERT_FALSE(brpc::policy::ZstdDecompress(with_dict, &out));
+
+    // Responses are not affected.
+    test::EchoResponse res;
+    res.set_message(req.message());
+    butil::IOBuf res_buf;
+    ASSERT_TRUE(brpc::policy::ZstdCompress(res, &res_buf));
+    ASSERT_TRUE(brpc::policy::ZstdDecompress(res_buf, &out));
+}
+#endif  // BRPC_WITH_ZSTD
+
+static void CheckParallelCompress(brpc::CompressType type) {
+    std::string text;
+    for (int i = 0; text.size() < 4 * 1024 * 1024; ++i) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%09d\n", i * 7);
+        text.append(buf);
+    }
+    butil::IOBuf in;
+    in.append(text);
+    const int saved_frame_size = brpc::policy::FLAGS_parallel_compress_frame_size;
+    brpc::policy::FLAGS_parallel_compress_frame_size = 256 * 1024;
+    butil::IOBuf out;
+    ASSERT_TRUE(brpc::policy::ParallelCompress(in, type, NULL, &out));
+    brpc::policy::FLAGS_parallel_compress_frame_size = saved_frame_size;
+    ASSERT_LT(out.size(), in.size());
+    ASSERT_TRUE(brpc::policy::IsCompressedInParallel(out, type));
+
+    butil::IOBuf check_buf;
+    ASSERT_TRUE(brpc::policy::ParallelDecompress(out, type, NULL, &check_buf));
+    ASSERT_TRUE(check_buf.equals(text));
+
+    // Frames are decodable by the sequential decompressor as well.
+    check_buf.clear();
+    switch (type) {
+    case brpc::COMPRESS_TYPE_GZIP:
+        ASSERT_TRUE(brpc::policy::GzipDecompress(out, &check_buf));
+        break;
+    case brpc::COMPRESS_TYPE_LZ4:
+        ASSERT_TRUE(brpc::policy::Lz4Decompress(out, &check_buf));
+        break;
+    case brpc::COMPRESS_TYPE_ZSTD:
+        ASSERT_TRUE(brpc::policy::ZstdDecompress(out, &check_buf));
+        break;
+    default:
+        ASSERT_TRUE(false) << "Unsupported type=" << type;
+    }
+    ASSERT_TRUE(check_buf.equals(text));
+
+    butil::IOBuf truncated = out;
+    truncated.pop_back(1);
+    check_buf.clear();
+    ASSERT_FALSE(brpc::policy::ParallelDecompress(truncated, type, NULL, &check_buf));
+}
+
+TEST_F(test_compress_method, parallel_gzip) {
+    CheckParallelCompress(brpc::COMPRESS_TYPE_GZIP);
+}
+
+#ifdef BRPC_WITH_LZ4
+TEST_F(test_compress_method, parallel_lz4) {
+    CheckParallelCompress(brpc::COMPRESS_TYPE_LZ4);
+}
+#endif
+
+#ifdef BRPC_WITH_ZSTD
+TEST_F(test_compress_method, parallel_zstd) {
+    CheckParallelCompress(brpc::COMPRESS_TYPE_ZSTD);
+}
+#endif
+
+TEST_F(test_compress_method, parallel_message) {
+    // Register compress handlers.
+    brpc::GlobalInitializeOrDie();
+    const int saved_min_size = brpc::policy::FLAGS_parallel_compress_min_size;
+    const int saved_frame_size = brpc::policy::FLAGS_parallel_compress_frame_size;
+    brpc::policy::FLAGS_parallel_compress_min_size = 1024 * 1024;
+    brpc::policy::FLAGS_parallel_compress_frame_size = 256 * 1024;
+    snappy_message::SnappyMessageProto old_msg;
+    std::string text;
+    for (int i = 0; text.size() < 2 * 1024 * 1024; ++i) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%09d\n", i);
+        text.append(buf);
+    }
+    old_msg.set_text(text);
+    butil::IOBuf buf;
+    ASSERT_TRUE(brpc::SerializeAsCompressedData(
+                    old_msg, &buf, brpc::COMPRESS_TYPE_GZIP));
+    ASSERT_TRUE(brpc::policy::IsCompressedInParallel(
+                    buf, brpc::COMPRESS_TYPE_GZIP));
+    snappy_message::SnappyMessageProto new_msg;
+    ASSERT_TRUE(brpc::ParseFromCompressedData(
+                    buf, &new_msg, brpc::COMPRESS_TYPE_GZIP));
+    ASSERT_EQ(text, new_msg.text());
+
+    // Small messages are compressed as usual.
+    old_msg.set_text("Hello World!");
+    buf.clear();
+    ASSERT_TRUE(brpc::SerializeAsCompressedData(
+                    old_msg, &buf, brpc::COMPRESS_TYPE_GZIP));
+    ASSERT_FALSE(brpc::policy::IsCompressedInParallel(
+                     buf, brpc::COMPRESS_TYPE_GZIP));
+    brpc::policy::FLAGS_parallel_compress_min_size = saved_min_size;
+    brpc::policy::FLAGS_parallel_compress_frame_size = saved_frame_size;
+}
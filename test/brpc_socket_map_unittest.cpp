@@ -8,6 +8,8 @@
 #include "brpc/socket.h"
 #include "brpc/socket_map.h"
 #include "brpc/reloadable_flags.h"
+#include "brpc/authenticator.h"
+#include "brpc/details/idle_connection_wheel.h"
 
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
@@ -124,6 +126,112 @@ TEST_F(SocketMapTest, max_pool_size) {
         EXPECT_TRUE(ptrs[i]->Failed());
     }
 }
+
+void* insert_and_remove_many(void* arg) {
+    const int base_port = *static_cast<int*>(arg);
+    const int COUNT = 100;
+    for (int i = 0; i < COUNT; ++i) {
+        brpc::SocketMapKey key(butil::EndPoint(g_key.peer.ip, base_port + i));
+        brpc::SocketId id;
+        EXPECT_EQ(0, brpc::SocketMapInsert(key, &id));
+        brpc::SocketId found_id = (brpc::SocketId)-1;
+        EXPECT_EQ(0, brpc::SocketMapFind(key, &found_id));
+        EXPECT_EQ(id, found_id);
+    }
+    for (int i = 0; i < COUNT; ++i) {
+        brpc::SocketMapKey key(butil::EndPoint(g_key.peer.ip, base_port + i));
+        brpc::SocketMapRemove(key);
+    }
+    return NULL;
+}
+
+TEST_F(SocketMapTest, many_endpoints) {
+    const int saved_defer_close_second = brpc::FLAGS_defer_close_second;
+    brpc::FLAGS_defer_close_second = 0;
+    std::vector<brpc::SocketId> ids;
+    brpc::SocketMapList(&ids);
+    const size_t nsocket = ids.size();
+    // Endpoints of threads are distributed into different shards.
+    const int NTHREAD = 8;
+    pthread_t tids[NTHREAD];
+    int base_ports[NTHREAD];
+    for (int i = 0; i < NTHREAD; ++i) {
+        base_ports[i] = 20000 + i * 100;
+        ASSERT_EQ(0, pthread_create(&tids[i], NULL, insert_and_remove_many,
+                                    &base_ports[i]));
+    }
+    for (int i = 0; i < NTHREAD; ++i) {
+        ASSERT_EQ(0, pthread_join(tids[i], NULL));
+    }
+    brpc::SocketMapList(&ids);
+    ASSERT_EQ(nsocket, ids.size());
+    brpc::SocketId id;
+    ASSERT_EQ(-1, brpc::SocketMapFind(
+                  brpc::SocketMapKey(butil::EndPoint(g_key.peer.ip, 20000)),
+                  &id));
+    brpc::FLAGS_defer_close_second = saved_defer_close_second;
+}
+
+class DummyAuthenticator : public brpc::Authenticator {
+public:
+    int GenerateCredential(std::string*) const { return 0; }
+    int VerifyCredential(const std::string&, const butil::EndPoint&,
+                         brpc::AuthContext*) const { return 0; }
+};
+
+TEST_F(SocketMapTest, reclaim_orphan_with_non_default_key) {
+    const int TIMEOUT = 1;
+    const int saved_defer_close_second = brpc::FLAGS_defer_close_second;
+    brpc::FLAGS_defer_close_second = TIMEOUT;
+    // Keys with authenticators or SSL options are different from the key
+    // of the same endpoint without them.
+    DummyAuthenticator auth;
+    brpc::SocketMapKey key(butil::EndPoint(g_key.peer.ip, 23456),
+                           false, brpc::ChannelSSLOptions(), &auth);
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::SocketMapInsert(key, &id));
+    brpc::SocketMapRemove(key);
+    // Not closed until the orphan is checked by WatchConnections.
+    brpc::SocketId found_id;
+    ASSERT_EQ(0, brpc::SocketMapFind(key, &found_id));
+    ASSERT_EQ(id, found_id);
+    usleep(TIMEOUT * 1000000L + 2100000L);
+    ASSERT_EQ(-1, brpc::SocketMapFind(key, &found_id));
+    brpc::FLAGS_defer_close_second = saved_defer_close_second;
+}
+
+TEST_F(SocketMapTest, idle_connection_wheel) {
+    brpc::IdleConnectionWheel wheel(8);
+    const int64_t now_us = butil::cpuwide_time_us();
+    wheel.Add(1, now_us + 1000000L);
+    wheel.Add(2, now_us + 3000000L);
+    // Beyond one round of the wheel.
+    wheel.Add(3, now_us + 20000000L);
+    // Passed deadlines are due at once.
+    wheel.Add(4, now_us - 5000000L);
+    ASSERT_EQ(4u, wheel.size());
+
+    std::vector<brpc::SocketId> due;
+    wheel.Advance(now_us, &due);
+    ASSERT_EQ(1u, due.size());
+    ASSERT_EQ(4u, due[0]);
+    wheel.Advance(now_us + 1000000L, &due);
+    ASSERT_TRUE(due.empty());
+    wheel.Advance(now_us + 2000000L, &due);
+    ASSERT_EQ(1u, due.size());
+    ASSERT_EQ(1u, due[0]);
+    // Skipped ticks are checked as well.
+    wheel.Advance(now_us + 10000000L, &due);
+    ASSERT_EQ(1u, due.size());
+    ASSERT_EQ(2u, due[0]);
+    ASSERT_EQ(1u, wheel.size());
+    wheel.Advance(now_us + 20000000L, &due);
+    ASSERT_TRUE(due.empty());
+    wheel.Advance(now_us + 21000000L, &due);
+    ASSERT_EQ(1u, due.size());
+    ASSERT_EQ(3u, due[0]);
+    ASSERT_EQ(0u, wheel.size());
+}
 } //namespace
 
 int main(int argc, char* argv[]) {
@@ -19,6 +19,7 @@
 #include "brpc/policy/hulu_pbrpc_protocol.h"
 #include "brpc/policy/most_common_message.h"
 #include "brpc/nshead.h"
+#include "brpc/details/io_uring_engine.h"
 #if defined(OS_MACOSX)
 #include <sys/event.h>
 #endif
@@ -29,6 +30,18 @@ namespace bthread {
 extern TaskControl* g_task_control;
 }
 
+namespace brpc {
+DECLARE_string(socket_io_engine);
+DECLARE_int32(socket_write_coalesce_us);
+DECLARE_int32(single_connection_num);
+DECLARE_bool(single_connection_by_unwritten_bytes);
+DECLARE_int32(acceptor_batch_size);
+DECLARE_int32(max_new_connections_per_second);
+DECLARE_int64(socket_max_total_unwritten_bytes);
+DECLARE_int64(socket_max_total_read_buffer_bytes);
+DECLARE_int32(health_check_slow_start_ms);
+}
+
 void EchoProcessHuluRequest(brpc::InputMessageBase* msg_base);
 
 int main(int argc, char* argv[]) {
@@ -386,6 +399,206 @@ TEST_F(SocketTest, single_threaded_connect_and_write) {
     ASSERT_EQ(EBADF, errno);
 }
 
+TEST_F(SocketTest, io_uring_echo) {
+    brpc::IoUringEngine* probe = brpc::IoUringEngine::Create();
+    if (probe == NULL) {
+        LOG(WARNING) << "io_uring is not supported, skip this test";
+        return;
+    }
+    delete probe;
+    const std::string saved_engine = brpc::FLAGS_socket_io_engine;
+    // Accepted sockets read and write through io_uring.
+    brpc::FLAGS_socket_io_engine = "io_uring";
+    brpc::Acceptor* messenger = new brpc::Acceptor;
+    const brpc::InputMessageHandler pairs[] = {
+        { brpc::policy::ParseHuluMessage, 
+          EchoProcessHuluRequest, NULL, NULL, "dummy_hulu" }
+    };
+    butil::EndPoint point(butil::IP_ANY, 7879);
+    int listening_fd = tcp_listen(point, false);
+    ASSERT_TRUE(listening_fd > 0);
+    butil::make_non_blocking(listening_fd);
+    ASSERT_EQ(0, messenger->AddHandler(pairs[0]));
+    ASSERT_EQ(0, messenger->StartAccept(listening_fd, -1, NULL));
+
+    butil::EndPoint loopback;
+    ASSERT_EQ(0, butil::str2endpoint("127.0.0.1", 7879, &loopback));
+    const int fd = tcp_connect(loopback, NULL);
+    ASSERT_LT(0, fd);
+    // Large enough to use multiple buffers of the ring.
+    const size_t body_len = 100000;
+    std::string body(body_len, 'x');
+    for (size_t i = 0; i < 20; ++i) {
+        const size_t meta_len = 4;
+        char header[12];
+        memcpy(header, "HULU", 4);
+        *(uint32_t*)(header + 4) = body_len + meta_len;
+        *(uint32_t*)(header + 8) = meta_len;
+        body[i] = 'a' + i;
+        butil::IOBuf src;
+        src.append(header, sizeof(header));
+        src.append("Meta", meta_len);
+        src.append(body);
+        while (!src.empty()) {
+            ASSERT_LT(0, src.cut_into_file_descriptor(fd));
+        }
+        std::string dest;
+        char buf[16384];
+        while (dest.size() < meta_len + body_len) {
+            const ssize_t nr = read(fd, buf, sizeof(buf));
+            ASSERT_LT(0, nr);
+            dest.append(buf, nr);
+        }
+        ASSERT_EQ("Meta" + body, dest);
+    }
+    close(fd);
+
+    messenger->StopAccept(0);
+    ASSERT_EQ(-1, messenger->listened_fd());
+    brpc::FLAGS_socket_io_engine = saved_engine;
+}
+
+TEST_F(SocketTest, accept_rate_limit) {
+    const int saved_batch_size = brpc::FLAGS_acceptor_batch_size;
+    // Create Sockets of every connection in other bthreads.
+    brpc::FLAGS_acceptor_batch_size = 1;
+    brpc::FLAGS_max_new_connections_per_second = 2;
+    brpc::Acceptor* messenger = new brpc::Acceptor;
+    const brpc::InputMessageHandler pairs[] = {
+        { brpc::policy::ParseHuluMessage, 
+          EchoProcessHuluRequest, NULL, NULL, "dummy_hulu" }
+    };
+    butil::EndPoint point(butil::IP_ANY, 7880);
+    int listening_fd = tcp_listen(point, false);
+    ASSERT_TRUE(listening_fd > 0);
+    butil::make_non_blocking(listening_fd);
+    ASSERT_EQ(0, messenger->AddHandler(pairs[0]));
+    ASSERT_EQ(0, messenger->StartAccept(listening_fd, -1, NULL));
+
+    butil::EndPoint loopback;
+    ASSERT_EQ(0, butil::str2endpoint("127.0.0.1", 7880, &loopback));
+    const size_t N = 6;
+    int fds[N];
+    for (size_t i = 0; i < N; ++i) {
+        // Connected in the kernel even if not accepted.
+        fds[i] = tcp_connect(loopback, NULL);
+        ASSERT_LT(0, fds[i]);
+    }
+    // At most 2 connections in each of the two seconds overlapped.
+    bthread_usleep(200000);
+    ASSERT_GE(4u, messenger->ConnectionCount());
+    // Others are accepted in following seconds.
+    const int64_t start_time = butil::gettimeofday_us();
+    while (messenger->ConnectionCount() != N) {
+        bthread_usleep(10000);
+        ASSERT_LT(butil::gettimeofday_us(), start_time + 4000000L);
+    }
+    for (size_t i = 0; i < N; ++i) {
+        close(fds[i]);
+    }
+    messenger->StopAccept(0);
+    messenger->Join();
+    ASSERT_EQ(0u, messenger->ConnectionCount());
+    brpc::FLAGS_max_new_connections_per_second = 0;
+    brpc::FLAGS_acceptor_batch_size = saved_batch_size;
+}
+
+TEST_F(SocketTest, total_unwritten_bytes_limit) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    brpc::FLAGS_socket_max_total_unwritten_bytes = 1024 * 1024;
+    // Nobody reads fds[0], the data is queued in the socket after the
+    // kernel buffer is full.
+    const std::string data(256 * 1024, 'x');
+    int rc = 0;
+    for (int i = 0; i < 1000 && rc == 0; ++i) {
+        butil::IOBuf buf;
+        buf.append(data);
+        rc = s->Write(&buf);
+    }
+    ASSERT_EQ(-1, rc);
+    ASSERT_EQ(brpc::EOVERCROWDED, errno);
+    // Far from -socket_max_unwritten_bytes of the socket itself.
+    ASSERT_FALSE(s->is_overcrowded());
+
+    // Writes succeed again after the data is consumed.
+    char tmp[65536];
+    while (s->_unwritten_bytes.load() > 0) {
+        ASSERT_LT(0, read(fds[0], tmp, sizeof(tmp)));
+    }
+    butil::IOBuf buf;
+    buf.append(data);
+    ASSERT_EQ(0, s->Write(&buf));
+    brpc::FLAGS_socket_max_total_unwritten_bytes = 0;
+    ASSERT_EQ(0, s->SetFailed());
+    close(fds[0]);
+}
+
+TEST_F(SocketTest, write_priority) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    // Nobody reads fds[0] before all writes, the first write can't be
+    // completed and following ones are queued.
+    const std::string first(4 * 1024 * 1024, 'a');
+    const std::string bulk(1024 * 1024, 'b');
+    const std::string small(100, 'c');
+    butil::IOBuf buf;
+    buf.append(first);
+    ASSERT_EQ(0, s->Write(&buf));
+    brpc::Socket::WriteOptions wopt;
+    wopt.priority = -1;
+    buf.append(bulk);
+    ASSERT_EQ(0, s->Write(&buf, &wopt));
+    buf.append(small);
+    ASSERT_EQ(0, s->Write(&buf));
+
+    std::string received;
+    char tmp[65536];
+    while (received.size() < first.size() + bulk.size() + small.size()) {
+        const ssize_t nr = read(fds[0], tmp, sizeof(tmp));
+        ASSERT_LT(0, nr);
+        received.append(tmp, nr);
+    }
+    // The small write with higher priority is written before the bulk one
+    // queued earlier, but not the first one being written.
+    ASSERT_EQ(first, received.substr(0, first.size()));
+    ASSERT_EQ(small, received.substr(first.size(), small.size()));
+    ASSERT_EQ(bulk, received.substr(first.size() + small.size()));
+    ASSERT_EQ(0, s->SetFailed());
+    close(fds[0]);
+}
+
+TEST_F(SocketTest, total_read_buffer_bytes_limit) {
+    brpc::SocketOptions options;
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    brpc::FLAGS_socket_max_total_read_buffer_bytes = 128 * 1024;
+    s->_read_buf.append(std::string(64 * 1024, 'x'));
+    ASSERT_FALSE(s->UpdateReadBufferUsage());
+    s->_read_buf.append(std::string(128 * 1024, 'x'));
+    ASSERT_TRUE(s->UpdateReadBufferUsage());
+    // The socket without fd can't be paused.
+    ASSERT_FALSE(s->PauseReading());
+    s->_read_buf.clear();
+    ASSERT_FALSE(s->UpdateReadBufferUsage());
+    brpc::FLAGS_socket_max_total_read_buffer_bytes = 0;
+    ASSERT_EQ(0, s->SetFailed());
+}
+
 #define NUMBER_WIDTH 16
 
 struct WriterArg {
@@ -420,6 +633,164 @@ void* FailedWriter(void* void_arg) {
     return NULL;
 }
 
+TEST_F(SocketTest, lazy_part) {
+    brpc::SocketId id;
+    brpc::SocketOptions options;
+    options.remote_side = butil::EndPoint(butil::IP_ANY, 7588);
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    // Idle sockets don't have the lazy part.
+    ASSERT_TRUE(s->GetLazyPart() == NULL);
+    const size_t mem0 = s->MemoryUsage();
+    ASSERT_GE(mem0, sizeof(brpc::Socket));
+    LOG(INFO) << "sizeof(Socket)=" << sizeof(brpc::Socket)
+              << " memory_usage=" << mem0;
+
+    brpc::PipelinedInfo pi;
+    ASSERT_FALSE(s->PopPipelinedInfo(&pi));
+    for (uint32_t i = 1; i <= 3; ++i) {
+        pi.count = i;
+        s->PushPipelinedInfo(pi);
+    }
+    ASSERT_TRUE(s->GetLazyPart() != NULL);
+    ASSERT_GT(s->MemoryUsage(), mem0);
+    ASSERT_TRUE(s->PopPipelinedInfo(&pi));
+    ASSERT_EQ(1u, pi.count);
+    s->GivebackPipelinedInfo(pi);
+    for (uint32_t i = 1; i <= 3; ++i) {
+        ASSERT_TRUE(s->PopPipelinedInfo(&pi));
+        ASSERT_EQ(i, pi.count);
+    }
+    ASSERT_FALSE(s->PopPipelinedInfo(&pi));
+    ASSERT_EQ(0, s->SetFailed());
+
+    // Rarely used options are kept in the lazy part and passed to
+    // sockets created from this one.
+    options.sni_name = "brpc.test";
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    ASSERT_TRUE(s->GetLazyPart() != NULL);
+    brpc::SocketOptions opt2;
+    s->GetOriginalOptions(&opt2);
+    ASSERT_EQ(-1, opt2.fd);
+    ASSERT_EQ(options.remote_side, opt2.remote_side);
+    ASSERT_EQ("brpc.test", opt2.sni_name);
+    ASSERT_EQ(0, s->SetFailed());
+}
+
+TEST_F(SocketTest, warm_up_and_trim_pooled_sockets) {
+    butil::EndPoint point(butil::IP_ANY, 7589);
+    // Connections complete in the backlog without accept().
+    int listening_fd = tcp_listen(point, false);
+    ASSERT_GT(listening_fd, 0);
+    brpc::SocketOptions options;
+    options.remote_side = point;
+    brpc::SocketId main_id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &main_id));
+    brpc::SocketUniquePtr main_socket;
+    ASSERT_EQ(0, brpc::Socket::Address(main_id, &main_socket));
+
+    brpc::Socket::WarmUpPooledSockets(main_socket.get(), 3, 1000);
+    std::vector<brpc::SocketId> pooled;
+    for (int i = 0; i < 100; ++i) {
+        main_socket->ListPooledSockets(&pooled);
+        if (pooled.size() == 3u) {
+            break;
+        }
+        bthread_usleep(10000);
+    }
+    ASSERT_EQ(3u, pooled.size());
+    for (size_t i = 0; i < pooled.size(); ++i) {
+        brpc::SocketUniquePtr s;
+        ASSERT_EQ(0, brpc::Socket::Address(pooled[i], &s));
+        ASSERT_GE(s->fd(), 0);
+    }
+
+    // A burst takes all warmed up sockets and creates 2 more.
+    brpc::SocketUniquePtr sockets[5];
+    for (size_t i = 0; i < ARRAY_SIZE(sockets); ++i) {
+        ASSERT_EQ(0, brpc::Socket::GetPooledSocket(main_socket.get(),
+                                                   &sockets[i]));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(sockets); ++i) {
+        ASSERT_EQ(0, sockets[i]->ReturnToPool());
+        sockets[i].reset();
+    }
+    main_socket->ListPooledSockets(&pooled);
+    ASSERT_EQ(5u, pooled.size());
+    // Not used since then, surplus sockets are closed gradually except the
+    // warmed up ones.
+    main_socket->TrimPooledSockets();
+    main_socket->ListPooledSockets(&pooled);
+    ASSERT_EQ(5u, pooled.size());
+    for (int i = 0; i < 20; ++i) {
+        main_socket->TrimPooledSockets();
+    }
+    main_socket->ListPooledSockets(&pooled);
+    ASSERT_EQ(3u, pooled.size());
+    ASSERT_EQ(0, main_socket->SetFailed());
+    close(listening_fd);
+}
+
+void* GetMultiplexedSocketId(void* arg) {
+    brpc::SocketUniquePtr main_socket;
+    if (brpc::Socket::Address(*(brpc::SocketId*)arg, &main_socket) != 0) {
+        return NULL;
+    }
+    brpc::SocketUniquePtr ptr;
+    if (brpc::Socket::GetMultiplexedSocket(main_socket.get(), &ptr) != 0) {
+        return NULL;
+    }
+    return (void*)ptr->id();
+}
+
+TEST_F(SocketTest, multiplexed_sockets) {
+    brpc::SocketOptions options;
+    options.remote_side = butil::EndPoint(butil::IP_ANY, 7590);
+    brpc::SocketId main_id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &main_id));
+    brpc::SocketUniquePtr main_socket;
+    ASSERT_EQ(0, brpc::Socket::Address(main_id, &main_socket));
+    brpc::SocketUniquePtr ptr;
+    ASSERT_EQ(0, brpc::Socket::GetMultiplexedSocket(main_socket.get(), &ptr));
+    ASSERT_EQ(main_id, ptr->id());
+
+    brpc::FLAGS_single_connection_num = 3;
+    const brpc::SocketId id = (brpc::SocketId)GetMultiplexedSocketId(&main_id);
+    // Same thread, same socket.
+    ASSERT_EQ(id, (brpc::SocketId)GetMultiplexedSocketId(&main_id));
+    // Consecutive threads are mapped to different sockets.
+    std::set<brpc::SocketId> ids;
+    ids.insert(id);
+    for (int i = 0; i < 2; ++i) {
+        pthread_t th;
+        void* ret = NULL;
+        ASSERT_EQ(0, pthread_create(&th, NULL, GetMultiplexedSocketId,
+                                    &main_id));
+        ASSERT_EQ(0, pthread_join(th, &ret));
+        ids.insert((brpc::SocketId)ret);
+    }
+    ASSERT_EQ(3u, ids.size());
+    ASSERT_EQ(1u, ids.count(main_id));
+    if (id != main_id) {
+        // A broken socket is replaced.
+        ASSERT_EQ(0, brpc::Socket::SetFailed(id));
+        const brpc::SocketId id2 =
+            (brpc::SocketId)GetMultiplexedSocketId(&main_id);
+        ASSERT_NE(id, id2);
+        ASSERT_NE(main_id, id2);
+    }
+
+    // Idle sockets are preferred.
+    brpc::FLAGS_single_connection_by_unwritten_bytes = true;
+    ASSERT_EQ(main_id, (brpc::SocketId)GetMultiplexedSocketId(&main_id));
+    brpc::FLAGS_single_connection_by_unwritten_bytes = false;
+    brpc::FLAGS_single_connection_num = 1;
+    ptr.reset();
+    ASSERT_EQ(0, main_socket->SetFailed());
+}
+
 TEST_F(SocketTest, fail_to_connect) {
     const size_t REP = 10;
     butil::EndPoint point(butil::IP_ANY, 7563/*not listened*/);
@@ -669,6 +1040,34 @@ TEST_F(SocketTest, health_check) {
     ASSERT_EQ(-1, brpc::Socket::Address(id, &ptr));
 }
 
+TEST_F(SocketTest, slow_start_after_revival) {
+    brpc::SocketId id;
+    brpc::SocketOptions options;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    ASSERT_EQ(1000, s->slow_start_permille());
+
+    const int saved_slow_start_ms = brpc::FLAGS_health_check_slow_start_ms;
+    brpc::FLAGS_health_check_slow_start_ms = 1000;
+    s->_revive_time_us.store(butil::cpuwide_time_us(),
+                             butil::memory_order_relaxed);
+    ASSERT_LT(s->slow_start_permille(), 100);
+    // Half way of the slow start.
+    s->_revive_time_us.store(butil::cpuwide_time_us() - 500000L,
+                             butil::memory_order_relaxed);
+    const int permille = s->slow_start_permille();
+    ASSERT_GE(permille, 500);
+    ASSERT_LT(permille, 600);
+    // The slow start is over.
+    s->_revive_time_us.store(butil::cpuwide_time_us() - 2000000L,
+                             butil::memory_order_relaxed);
+    ASSERT_EQ(1000, s->slow_start_permille());
+    ASSERT_EQ(0, s->_revive_time_us.load(butil::memory_order_relaxed));
+    brpc::FLAGS_health_check_slow_start_ms = saved_slow_start_ms;
+    ASSERT_EQ(0, s->SetFailed());
+}
+
 void* Writer(void* void_arg) {
     WriterArg* arg = static_cast<WriterArg*>(void_arg);
     brpc::SocketUniquePtr sock;
@@ -700,8 +1099,10 @@ void* Writer(void* void_arg) {
 TEST_F(SocketTest, multi_threaded_write) {
     const size_t REP = 20000;
     int fds[2];
-    for (int k = 0; k < 2; ++k) {
+    for (int k = 0; k < 3; ++k) {
         printf("Round %d\n", k + 1);
+        // Gather requests from concurrent writers in the last round.
+        brpc::FLAGS_socket_write_coalesce_us = (k == 2 ? 50 : 0);
         ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
         pthread_t th[8];
         WriterArg args[ARRAY_SIZE(th)];
@@ -788,6 +1189,7 @@ TEST_F(SocketTest, multi_threaded_write) {
         ASSERT_EQ((brpc::Socket*)NULL, global_sock);
         close(fds[0]);
     }
+    brpc::FLAGS_socket_write_coalesce_us = 0;
 }
 
 void* FastWriter(void* void_arg) {
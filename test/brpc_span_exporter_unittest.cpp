@@ -0,0 +1,93 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include "butil/third_party/rapidjson/document.h"
+#include "brpc/span.h"
+#include "brpc/span_exporter.h"
+
+namespace {
+
+typedef BUTIL_RAPIDJSON_NAMESPACE::Value JsonValue;
+
+const JsonValue& FindAttribute(const JsonValue& attrs, const char* key) {
+    static JsonValue null_value;
+    for (BUTIL_RAPIDJSON_NAMESPACE::SizeType i = 0; i < attrs.Size(); ++i) {
+        if (strcmp(attrs[i]["key"].GetString(), key) == 0) {
+            return attrs[i]["value"];
+        }
+    }
+    return null_value;
+}
+
+TEST(SpanExporterTest, otlp_json) {
+    std::vector<brpc::RpczSpan> spans(1);
+    brpc::RpczSpan& server = spans[0];
+    server.set_trace_id(0x1234);
+    server.set_span_id(0xabcd);
+    server.set_parent_span_id(0);
+    server.set_type(brpc::SPAN_TYPE_SERVER);
+    server.set_protocol(brpc::PROTOCOL_BAIDU_STD);
+    server.set_full_method_name("test.EchoService.Echo");
+    server.set_received_real_us(1000);
+    server.set_sent_real_us(3000);
+    server.set_error_code(1008);
+    server.set_info("\1" "2000 hello \"rpcz\"\n");
+    brpc::RpczSpan* client = server.add_client_spans();
+    client->set_trace_id(0x1234);
+    client->set_span_id(0xef);
+    client->set_parent_span_id(0xabcd);
+    client->set_type(brpc::SPAN_TYPE_CLIENT);
+    client->set_full_method_name("test.EchoService.Echo2");
+    client->set_start_send_real_us(1500);
+    client->set_received_real_us(2500);
+
+    std::string json;
+    brpc::SpansToOtlpJson(spans, "my_service", &json);
+    BUTIL_RAPIDJSON_NAMESPACE::Document doc;
+    doc.Parse<0>(json.c_str());
+    ASSERT_FALSE(doc.HasParseError()) << json;
+
+    const JsonValue& rs = doc["resourceSpans"][0];
+    ASSERT_STREQ("my_service",
+                 FindAttribute(rs["resource"]["attributes"],
+                               "service.name")["stringValue"].GetString());
+    const JsonValue& out = rs["scopeSpans"][0]["spans"];
+    ASSERT_EQ(2u, out.Size());
+
+    ASSERT_STREQ("00000000000000000000000000001234", out[0]["traceId"].GetString());
+    ASSERT_STREQ("000000000000abcd", out[0]["spanId"].GetString());
+    ASSERT_FALSE(out[0].HasMember("parentSpanId"));
+    ASSERT_STREQ("test.EchoService.Echo", out[0]["name"].GetString());
+    ASSERT_EQ(2, out[0]["kind"].GetInt());
+    ASSERT_STREQ("1000000", out[0]["startTimeUnixNano"].GetString());
+    ASSERT_STREQ("3000000", out[0]["endTimeUnixNano"].GetString());
+    ASSERT_STREQ("1008", FindAttribute(out[0]["attributes"],
+                                       "brpc.error_code")["intValue"].GetString());
+    ASSERT_EQ(2, out[0]["status"]["code"].GetInt());
+    ASSERT_EQ(1u, out[0]["events"].Size());
+    ASSERT_STREQ("2000000", out[0]["events"][0]["timeUnixNano"].GetString());
+    ASSERT_STREQ("hello \"rpcz\"\n", out[0]["events"][0]["name"].GetString());
+
+    ASSERT_STREQ("000000000000abcd", out[1]["parentSpanId"].GetString());
+    ASSERT_EQ(3, out[1]["kind"].GetInt());
+    ASSERT_STREQ("1500000", out[1]["startTimeUnixNano"].GetString());
+    ASSERT_STREQ("2500000", out[1]["endTimeUnixNano"].GetString());
+    ASSERT_EQ(0u, out[1]["events"].Size());
+    ASSERT_FALSE(out[1]["status"].HasMember("code"));
+}
+
+TEST(SpanExporterTest, no_spans_when_exporting) {
+    const bool saved = brpc::FLAGS_enable_rpcz;
+    brpc::FLAGS_enable_rpcz = true;
+    brpc::FLAGS_rpcz_tail_sampling = true;
+    ASSERT_TRUE(brpc::IsTraceable(false));
+    brpc::tls_exporting_spans = true;
+    ASSERT_FALSE(brpc::IsTraceable(false));
+    ASSERT_TRUE(brpc::IsTraceable(true));
+    brpc::tls_exporting_spans = false;
+    brpc::FLAGS_rpcz_tail_sampling = false;
+    brpc::FLAGS_enable_rpcz = saved;
+}
+
+} // namespace
@@ -20,6 +20,8 @@
 
 namespace brpc {
 void ExtractHostnames(X509* x, std::vector<std::string>* hostnames);
+DECLARE_int32(ssl_max_concurrent_handshakes);
+DECLARE_int32(ssl_max_handshakes_per_second);
 } // namespace brpc
 
 
@@ -156,6 +158,49 @@ TEST_F(SSLTest, sanity) {
     ASSERT_EQ(0, server.Join());
 }
 
+int64_t GetHandshakeCount() {
+    std::ostringstream os;
+    if (bvar::Variable::describe_exposed("rpc_ssl_handshake_count", os) != 0) {
+        return 0;
+    }
+    return strtoll(os.str().c_str(), NULL, 10);
+}
+
+TEST_F(SSLTest, throttled_handshakes) {
+    const int port = 8613;
+    brpc::Server server;
+    brpc::ServerOptions options;
+    options.ssl_options.default_cert.certificate = "cert1.crt";
+    options.ssl_options.default_cert.private_key = "cert1.key";
+    EchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(
+        &echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, &options));
+
+    brpc::FLAGS_ssl_max_concurrent_handshakes = 1;
+    brpc::FLAGS_ssl_max_handshakes_per_second = 20;
+    brpc::Channel channel;
+    brpc::ChannelOptions coptions;
+    coptions.ssl_options.enable = true;
+    coptions.connection_type = "short";
+    coptions.timeout_ms = 5000;
+    ASSERT_EQ(0, channel.Init("127.0.0.1", port, &coptions));
+    const int64_t old_count = GetHandshakeCount();
+    butil::Timer tm;
+    tm.start();
+    // Both sides of each short connection do a handshake.
+    const int NUM = 6;
+    SendMultipleRPC(&channel, NUM);
+    tm.stop();
+    brpc::FLAGS_ssl_max_concurrent_handshakes = 0;
+    brpc::FLAGS_ssl_max_handshakes_per_second = 0;
+    ASSERT_GE(tm.m_elapsed(), (2 * NUM - 1) * 50 - 10);
+    ASSERT_EQ(old_count + 2 * NUM, GetHandshakeCount());
+
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
 void CheckCert(const char* cname, const char* cert) {
     const int port = 8613;
     brpc::Channel channel;
@@ -334,3 +379,50 @@ TEST_F(SSLTest, ssl_perf) {
     close(clifd);
     close(servfd);
 }
+
+void* ssl_resume_server(void* arg) {
+    SSL* ssl = (SSL*)arg;
+    EXPECT_EQ(1, SSL_do_handshake(ssl));
+    // Tickets of TLSv1.3 are sent after handshake along with data.
+    EXPECT_EQ(1, SSL_write(ssl, "x", 1));
+    char buf[1];
+    EXPECT_EQ(1, SSL_read(ssl, buf, 1));
+    return NULL;
+}
+
+TEST_F(SSLTest, ssl_session_resumption) {
+    brpc::ChannelSSLOptions opt;
+    opt.enable = true;
+    SSL_CTX* cli_ctx = brpc::CreateClientSSLContext(opt);
+    SSL_CTX* serv_ctx =
+            brpc::CreateServerSSLContext("cert1.crt", "cert1.key",
+                                         brpc::SSLOptions(), NULL);
+    ASSERT_TRUE(cli_ctx);
+    ASSERT_TRUE(serv_ctx);
+    const butil::EndPoint ep(butil::IP_ANY, 5962);
+    butil::fd_guard listenfd(butil::tcp_listen(ep, false));
+    ASSERT_GT(listenfd, 0);
+    for (int i = 0; i < 3; ++i) {
+        int clifd = tcp_connect(ep, NULL);
+        ASSERT_GT(clifd, 0);
+        int servfd = accept(listenfd, NULL, NULL);
+        ASSERT_GT(servfd, 0);
+        SSL* cli_ssl = brpc::CreateSSLSession(cli_ctx, 0, clifd, false);
+        SSL* serv_ssl = brpc::CreateSSLSession(serv_ctx, 0, servfd, true);
+        pthread_t spid;
+        ASSERT_EQ(0, pthread_create(&spid, NULL, ssl_resume_server, serv_ssl));
+        ASSERT_EQ(1, SSL_do_handshake(cli_ssl));
+        char buf[1];
+        ASSERT_EQ(1, SSL_read(cli_ssl, buf, 1));
+        ASSERT_EQ(1, SSL_write(cli_ssl, "y", 1));
+        ASSERT_EQ(0, pthread_join(spid, NULL));
+        // Only the first connection does a full handshake.
+        ASSERT_EQ(i != 0, (bool)SSL_session_reused(cli_ssl));
+        brpc::FreeSSLSession(cli_ssl);
+        brpc::FreeSSLSession(serv_ssl);
+        close(clifd);
+        close(servfd);
+    }
+    SSL_CTX_free(cli_ctx);
+    SSL_CTX_free(serv_ctx);
+}
@@ -9,6 +9,7 @@
 #include "brpc/controller.h"
 #include "brpc/channel.h"
 #include "brpc/stream_impl.h"
+#include "brpc/details/stream_frame_queue.h"
 #include "echo.pb.h"
 
 class AfterAcceptStream {
@@ -277,6 +278,166 @@ TEST_F(StreamingRpcTest, block) {
     ASSERT_EQ(N + N + N, handler._expected_next_value);
 }
 
+TEST_F(StreamingRpcTest, coalesced_messages_and_batched_feedback) {
+    OrderedInputHandler handler;
+    brpc::StreamOptions opt;
+    opt.handler = &handler;
+    opt.min_feedback_size = 1024 * 1024;
+    opt.feedback_delay_ms = 10;
+    brpc::Server server;
+    MyServiceWithStream service(opt);
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(9007, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:9007", NULL));
+    brpc::Controller cntl;
+    brpc::StreamId request_stream;
+    brpc::StreamOptions request_stream_options;
+    // min_feedback_size of the server is capped to half of the window,
+    // otherwise the writer would be blocked forever.
+    const int W = 100;
+    request_stream_options.max_buf_size = sizeof(uint32_t) * W;
+    ASSERT_EQ(0, StreamCreate(&request_stream, cntl, &request_stream_options));
+    brpc::ScopedStream stream_guard(request_stream);
+    test::EchoService_Stub stub(&channel);
+    stub.Echo(&cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText() << " request_stream="
+                                << request_stream;
+    const int N = 10000;
+    for (int i = 0; i < N; ++i) {
+        int network = htonl(i);
+        butil::IOBuf out;
+        out.append(&network, sizeof(network));
+        int rc = 0;
+        while ((rc = brpc::StreamWrite(request_stream, out)) == EAGAIN) {
+            ASSERT_EQ(0, brpc::StreamWait(request_stream, NULL));
+        }
+        ASSERT_EQ(0, rc) << "i=" << i;
+    }
+    while (handler._expected_next_value != N) {
+        usleep(100);
+    }
+    // Data less than min_feedback_size is acknowledged after the delay.
+    brpc::SocketUniquePtr ptr;
+    ASSERT_EQ(0, brpc::Socket::Address(request_stream, &ptr));
+    brpc::Stream* s = (brpc::Stream*)ptr->conn();
+    for (int i = 0; i < 1000 && s->_remote_consumed != sizeof(uint32_t) * N; ++i) {
+        usleep(1000);
+    }
+    ASSERT_EQ(sizeof(uint32_t) * N, s->_remote_consumed);
+    ptr.reset();
+    ASSERT_EQ(0, brpc::StreamClose(request_stream));
+    server.Stop(0);
+    server.Join();
+    while (!handler.stopped()) {
+        usleep(100);
+    }
+    ASSERT_FALSE(handler.failed());
+    ASSERT_EQ(N, handler._expected_next_value);
+}
+
+class LargeMessageHandler : public brpc::StreamInputHandler {
+public:
+    LargeMessageHandler() : _nmessage(0), _failed(false), _stopped(false) {}
+    int on_received_messages(brpc::StreamId /*id*/,
+                             butil::IOBuf *const messages[],
+                             size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            const std::string expected(_nmessage * 1000 + 1, 'a' + _nmessage % 26);
+            if (messages[i]->to_string() != expected) {
+                _failed = true;
+            }
+            ++_nmessage;
+        }
+        return 0;
+    }
+    void on_idle_timeout(brpc::StreamId /*id*/) {}
+    void on_closed(brpc::StreamId /*id*/) { _stopped = true; }
+
+    int _nmessage;
+    bool _failed;
+    bool _stopped;
+};
+
+TEST_F(StreamingRpcTest, split_large_messages_into_frames) {
+    LargeMessageHandler handler;
+    brpc::StreamOptions opt;
+    opt.handler = &handler;
+    brpc::Server server;
+    MyServiceWithStream service(opt);
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(9007, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:9007", NULL));
+    brpc::Controller cntl;
+    brpc::StreamId request_stream;
+    brpc::StreamOptions request_stream_options;
+    request_stream_options.max_frame_size = 4096;
+    request_stream_options.weight = 4;
+    ASSERT_EQ(0, StreamCreate(&request_stream, cntl, &request_stream_options));
+    brpc::ScopedStream stream_guard(request_stream);
+    test::EchoService_Stub stub(&channel);
+    stub.Echo(&cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText() << " request_stream="
+                                << request_stream;
+    const int N = 100;
+    for (int i = 0; i < N; ++i) {
+        butil::IOBuf out;
+        out.append(std::string(i * 1000 + 1, 'a' + i % 26));
+        int rc = 0;
+        while ((rc = brpc::StreamWrite(request_stream, out)) == EAGAIN) {
+            ASSERT_EQ(0, brpc::StreamWait(request_stream, NULL));
+        }
+        ASSERT_EQ(0, rc) << "i=" << i;
+    }
+    ASSERT_EQ(0, brpc::StreamClose(request_stream));
+    server.Stop(0);
+    server.Join();
+    while (!handler._stopped) {
+        usleep(100);
+    }
+    ASSERT_FALSE(handler._failed);
+    ASSERT_EQ(N, handler._nmessage);
+}
+
+TEST_F(StreamingRpcTest, frame_queue_is_weighted_round_robin) {
+    brpc::StreamFrameQueue q;
+    std::deque<butil::IOBuf> frames(4);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        frames[i].append(std::string(100, 'a'));
+    }
+    ASSERT_TRUE(q.Push(1, 1, &frames));
+    ASSERT_TRUE(frames.empty());
+    frames.resize(4);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        frames[i].append(std::string(100, 'b'));
+    }
+    // The writer is still working, other pushers just enqueue.
+    ASSERT_FALSE(q.Push(2, 2, &frames));
+    butil::IOBuf out;
+    ASSERT_TRUE(q.PickFrames(100, &out));
+    ASSERT_EQ(std::string(100, 'a') + std::string(200, 'b'), out.to_string());
+    out.clear();
+    ASSERT_TRUE(q.PickFrames(100, &out));
+    ASSERT_EQ(std::string(100, 'a') + std::string(200, 'b'), out.to_string());
+    out.clear();
+    ASSERT_TRUE(q.PickFrames(100, &out));
+    ASSERT_EQ(std::string(100, 'a'), out.to_string());
+    out.clear();
+    ASSERT_TRUE(q.PickFrames(100, &out));
+    ASSERT_EQ(std::string(100, 'a'), out.to_string());
+    out.clear();
+    ASSERT_FALSE(q.PickFrames(100, &out));
+    // A frame larger than the quantum is taken after accumulating credits.
+    frames.resize(1);
+    frames[0].append(std::string(250, 'c'));
+    ASSERT_TRUE(q.Push(3, 1, &frames));
+    ASSERT_TRUE(q.PickFrames(100, &out));
+    ASSERT_EQ(250u, out.size());
+    out.clear();
+    ASSERT_FALSE(q.PickFrames(100, &out));
+}
+
 TEST_F(StreamingRpcTest, auto_close_if_host_socket_closed) {
     HandlerControl hc;
     OrderedInputHandler handler(&hc);
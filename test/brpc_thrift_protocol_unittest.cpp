@@ -0,0 +1,274 @@
+// brpc - A framework to host and access services throughout Baidu.
+// Copyright (c) 2018 Baidu, Inc.
+
+#ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <gtest/gtest.h>
+#include "butil/macros.h"
+#include "butil/iobuf.h"
+#include "brpc/thrift_message.h"
+#include "brpc/policy/most_common_message.h"
+#include "brpc/policy/thrift_protocol.h"
+#include "brpc/details/thrift_utils.h"
+
+namespace {
+
+namespace tp = ::apache::thrift::protocol;
+
+// Write a call of "Echo" with a string field and an i64 field.
+void WriteCall(bool compact, const std::string& data, butil::IOBuf* out) {
+    THRIFT_STDCXX::shared_ptr<brpc::ThriftIOBufTransport> transport =
+        THRIFT_STDCXX::make_shared<brpc::ThriftIOBufTransport>(
+            (butil::IOBuf*)NULL);
+    THRIFT_STDCXX::shared_ptr<tp::TProtocol> prot =
+        brpc::create_thrift_protocol(transport, compact);
+    prot->writeMessageBegin("Echo", tp::T_CALL, 7);
+    prot->writeStructBegin("EchoRequest");
+    prot->writeFieldBegin("data", tp::T_STRING, 1);
+    prot->writeString(data);
+    prot->writeFieldEnd();
+    prot->writeFieldBegin("id", tp::T_I64, 2);
+    prot->writeI64(-1234567890123LL);
+    prot->writeFieldEnd();
+    prot->writeFieldStop();
+    prot->writeStructEnd();
+    prot->writeMessageEnd();
+    prot->getTransport()->flush();
+    transport->move_written_to(out);
+}
+
+// Read the call written by WriteCall() from `in' which is consumed.
+void ExpectCall(bool compact, const std::string& data, butil::IOBuf* in) {
+    THRIFT_STDCXX::shared_ptr<brpc::ThriftIOBufTransport> transport =
+        THRIFT_STDCXX::make_shared<brpc::ThriftIOBufTransport>(in);
+    THRIFT_STDCXX::shared_ptr<tp::TProtocol> prot =
+        brpc::create_thrift_protocol(transport, compact);
+    std::string name;
+    tp::TMessageType type;
+    int32_t seqid = 0;
+    prot->readMessageBegin(name, type, seqid);
+    EXPECT_EQ("Echo", name);
+    EXPECT_EQ(tp::T_CALL, type);
+    EXPECT_EQ(7, seqid);
+    prot->readStructBegin(name);
+
+    tp::TType field_type;
+    int16_t field_id = 0;
+    prot->readFieldBegin(name, field_type, field_id);
+    ASSERT_EQ(tp::T_STRING, field_type);
+    ASSERT_EQ(1, field_id);
+    std::string read_data;
+    prot->readString(read_data);
+    EXPECT_EQ(data, read_data);
+    prot->readFieldEnd();
+
+    prot->readFieldBegin(name, field_type, field_id);
+    ASSERT_EQ(tp::T_I64, field_type);
+    ASSERT_EQ(2, field_id);
+    int64_t id = 0;
+    prot->readI64(id);
+    EXPECT_EQ(-1234567890123LL, id);
+    prot->readFieldEnd();
+
+    prot->readFieldBegin(name, field_type, field_id);
+    EXPECT_EQ(tp::T_STOP, field_type);
+    prot->readStructEnd();
+    prot->readMessageEnd();
+    EXPECT_TRUE(in->empty());
+}
+
+// Copy `in' into blocks of at most `block_size' bytes, so that fields
+// cross blocks and can't be borrowed.
+void Fragment(const butil::IOBuf& in, size_t block_size, butil::IOBuf* out) {
+    const std::string str = in.to_string();
+    for (size_t i = 0; i < str.size(); i += block_size) {
+        const size_t n = std::min(block_size, str.size() - i);
+        void* block = malloc(n);
+        memcpy(block, str.data() + i, n);
+        out->append_user_data(block, n, free);
+    }
+}
+
+TEST(ThriftProtocolTest, round_trip_in_both_protocols) {
+    const std::string long_data(20000, 'x');
+    for (int compact = 0; compact < 2; ++compact) {
+        butil::IOBuf buf;
+        WriteCall(compact, long_data, &buf);
+        ASSERT_EQ((bool)compact, brpc::is_thrift_compact_message(buf));
+        butil::IOBuf fragmented;
+        Fragment(buf, 3, &fragmented);
+        ExpectCall(compact, long_data, &buf);
+
+        ASSERT_EQ((bool)compact, brpc::is_thrift_compact_message(fragmented));
+        ExpectCall(compact, long_data, &fragmented);
+    }
+}
+
+TEST(ThriftProtocolTest, compact_is_smaller) {
+    butil::IOBuf binary;
+    WriteCall(false, "hello", &binary);
+    butil::IOBuf compact;
+    WriteCall(true, "hello", &compact);
+    ASSERT_LT(compact.size(), binary.size());
+}
+
+// The struct of arguments in WriteArgs(), reading like thrift-generated code.
+struct EchoRequest {
+    std::string data;
+    int64_t id;
+
+    EchoRequest() : id(0) {}
+
+    uint32_t read(tp::TProtocol* iprot) {
+        tp::TInputRecursionTracker tracker(*iprot);
+        uint32_t xfer = 0;
+        std::string fname;
+        tp::TType ftype;
+        int16_t fid;
+        xfer += iprot->readStructBegin(fname);
+        while (true) {
+            xfer += iprot->readFieldBegin(fname, ftype, fid);
+            if (ftype == tp::T_STOP) {
+                break;
+            }
+            if (fid == 1 && ftype == tp::T_STRING) {
+                xfer += iprot->readString(data);
+            } else if (fid == 2 && ftype == tp::T_I64) {
+                xfer += iprot->readI64(id);
+            } else {
+                xfer += iprot->skip(ftype);
+            }
+            xfer += iprot->readFieldEnd();
+        }
+        xfer += iprot->readStructEnd();
+        return xfer;
+    }
+};
+
+// Write a call of "Echo" whose arguments are an EchoRequest in field 1
+// followed by fields unknown to the reader.
+void WriteArgs(bool compact, const std::string& data, butil::IOBuf* out) {
+    THRIFT_STDCXX::shared_ptr<brpc::ThriftIOBufTransport> transport =
+        THRIFT_STDCXX::make_shared<brpc::ThriftIOBufTransport>(
+            (butil::IOBuf*)NULL);
+    THRIFT_STDCXX::shared_ptr<tp::TProtocol> prot =
+        brpc::create_thrift_protocol(transport, compact);
+    prot->writeMessageBegin("Echo", tp::T_CALL, 9);
+    prot->writeStructBegin("Echo_args");
+    prot->writeFieldBegin("request", tp::T_STRUCT, 1);
+    prot->writeStructBegin("EchoRequest");
+    prot->writeFieldBegin("flag", tp::T_BOOL, 3);
+    prot->writeBool(true);
+    prot->writeFieldEnd();
+    prot->writeFieldBegin("data", tp::T_STRING, 1);
+    prot->writeString(data);
+    prot->writeFieldEnd();
+    prot->writeFieldBegin("list", tp::T_LIST, 4);
+    prot->writeListBegin(tp::T_I32, 20);
+    for (int i = 0; i < 20; ++i) {
+        prot->writeI32(-i);
+    }
+    prot->writeListEnd();
+    prot->writeFieldEnd();
+    prot->writeFieldBegin("id", tp::T_I64, 2);
+    prot->writeI64(-1234567890123LL);
+    prot->writeFieldEnd();
+    prot->writeFieldStop();
+    prot->writeStructEnd();
+    prot->writeFieldEnd();
+    prot->writeFieldBegin("trace", tp::T_MAP, 100);
+    prot->writeMapBegin(tp::T_STRING, tp::T_DOUBLE, 1);
+    prot->writeString("key");
+    prot->writeDouble(0.5);
+    prot->writeMapEnd();
+    prot->writeFieldEnd();
+    prot->writeFieldStop();
+    prot->writeStructEnd();
+    prot->writeMessageEnd();
+    prot->getTransport()->flush();
+    transport->move_written_to(out);
+}
+
+TEST(ThriftProtocolTest, read_args_and_skip_unknown_fields) {
+    const std::string long_data(20000, 'x');
+    for (int compact = 0; compact < 2; ++compact) {
+        butil::IOBuf buf;
+        WriteArgs(compact, long_data, &buf);
+        butil::IOBuf fragmented;
+        Fragment(buf, 3, &fragmented);
+        butil::IOBuf* bodies[] = { &buf, &fragmented };
+        for (size_t i = 0; i < arraysize(bodies); ++i) {
+            const size_t size = bodies[i]->size();
+            EchoRequest req;
+            std::string method_name;
+            int32_t seqid = 0;
+            ASSERT_TRUE(brpc::serialize_iobuf_to_thrift_message<EchoRequest>(
+                            *bodies[i], &req, &method_name, &seqid));
+            EXPECT_EQ("Echo", method_name);
+            EXPECT_EQ(9, seqid);
+            EXPECT_EQ(long_data, req.data);
+            EXPECT_EQ(-1234567890123LL, req.id);
+            // The body is read from a copy.
+            EXPECT_EQ(size, bodies[i]->size());
+        }
+    }
+}
+
+void AppendFrame(const butil::IOBuf& body, butil::IOBuf* out) {
+    brpc::thrift_head_t head;
+    head.body_len = htonl(body.size());
+    out->append(&head, sizeof(head));
+    out->append(body);
+}
+
+TEST(ThriftProtocolTest, parse_messages_of_both_protocols) {
+    for (int compact = 0; compact < 2; ++compact) {
+        butil::IOBuf body;
+        WriteCall(compact, "hello", &body);
+        butil::IOBuf source;
+        AppendFrame(body, &source);
+        brpc::ParseResult pr =
+            brpc::policy::ParseThriftMessage(&source, NULL, false, NULL);
+        ASSERT_TRUE(pr.is_ok()) << pr.error_str();
+        ASSERT_TRUE(source.empty());
+        brpc::policy::MostCommonMessage* msg =
+            static_cast<brpc::policy::MostCommonMessage*>(pr.message());
+        ASSERT_EQ(body.size(), msg->payload.size());
+        ExpectCall(compact, "hello", &msg->payload);
+        msg->Destroy();
+    }
+}
+
+TEST(ThriftProtocolTest, parse_other_messages) {
+    // The id of TCompactProtocol with version 2 rather than 1.
+    const char bad_version[] = { 0, 0, 0, 4, (char)0x82, 0x22, 0, 0 };
+    // Unframed TBinaryProtocol and baidu_std.
+    const char unframed[] = { (char)0x80, 0x01, 0, 1, 0, 0, 0, 4 };
+    const char baidu_std[] = "PRPC\0\0\0\0\0\0\0\0";
+    const char* inputs[] = { bad_version, unframed, baidu_std };
+    const size_t sizes[] = { sizeof(bad_version), sizeof(unframed),
+                             sizeof(baidu_std) - 1 };
+    for (size_t i = 0; i < arraysize(inputs); ++i) {
+        butil::IOBuf source;
+        source.append(inputs[i], sizes[i]);
+        brpc::ParseResult pr =
+            brpc::policy::ParseThriftMessage(&source, NULL, false, NULL);
+        ASSERT_EQ(brpc::PARSE_ERROR_TRY_OTHERS, pr.error()) << i;
+        ASSERT_EQ(sizes[i], source.size());
+    }
+
+    // Not enough data to tell the protocol.
+    butil::IOBuf source;
+    source.append("\0\0\0\4\x82", 5);
+    ASSERT_EQ(brpc::PARSE_ERROR_NOT_ENOUGH_DATA,
+              brpc::policy::ParseThriftMessage(
+                  &source, NULL, false, NULL).error());
+}
+
+} // namespace
+
+#endif  // ENABLE_THRIFT_FRAMED_PROTOCOL
@@ -381,4 +381,130 @@ TEST(ButexTest, stop_before_sleeping) {
         ASSERT_EQ(EINVAL, bthread_stop(th));
     }
 }
+struct WakeAllArg {
+    butil::atomic<int>* butex;
+    butil::atomic<int>* nwaiting;
+    butil::atomic<int>* nwoken;
+    bool timed;
+};
+
+void* wait_for_wake_all(void* void_arg) {
+    WakeAllArg* arg = (WakeAllArg*)void_arg;
+    const timespec abstime = butil::seconds_from_now(60);
+    arg->nwaiting->fetch_add(1);
+    while (arg->butex->load() == 0) {
+        bthread::butex_wait(arg->butex, 0, arg->timed ? &abstime : NULL);
+    }
+    arg->nwoken->fetch_add(1);
+    return NULL;
+}
+
+void* wake_all_in_bthread(void* butex) {
+    static_cast<butil::atomic<int>*>(butex)->store(1);
+    return (void*)(intptr_t)bthread::butex_wake_all(butex);
+}
+
+void WakeAllPerfTest(int nwaiter, bool timed, bool wake_in_bthread) {
+    butil::atomic<int>* butex =
+        bthread::butex_create_checked<butil::atomic<int> >();
+    ASSERT_TRUE(butex);
+    butex->store(0);
+    butil::atomic<int> nwaiting(0);
+    butil::atomic<int> nwoken(0);
+    WakeAllArg arg = { butex, &nwaiting, &nwoken, timed };
+    std::vector<bthread_t> th(nwaiter);
+    for (int i = 0; i < nwaiter; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, wait_for_wake_all, &arg));
+    }
+    while (nwaiting.load() != nwaiter) {
+        usleep(1000);
+    }
+    usleep(50000);  // wait for the waiters to sleep.
+    butil::Timer tm;
+    int nwakeup = 0;
+    tm.start();
+    if (wake_in_bthread) {
+        bthread_t waker;
+        void* ret = NULL;
+        ASSERT_EQ(0, bthread_start_urgent(&waker, NULL, wake_all_in_bthread, butex));
+        ASSERT_EQ(0, bthread_join(waker, &ret));
+        nwakeup = (int)(intptr_t)ret;
+    } else {
+        butex->store(1);
+        nwakeup = bthread::butex_wake_all(butex);
+    }
+    tm.stop();
+    const int64_t wake_us = tm.u_elapsed();
+    for (int i = 0; i < nwaiter; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    tm.stop();
+    ASSERT_EQ(nwaiter, nwoken.load());
+    ASSERT_LE(nwakeup, nwaiter);
+    LOG(INFO) << "Woke up " << nwaiter << (timed ? " timed" : "")
+              << " waiters from " << (wake_in_bthread ? "bthread" : "pthread")
+              << " in " << wake_us << "us, all of them ran in "
+              << tm.u_elapsed() << "us";
+    bthread::butex_destroy(butex);
+}
+
+TEST(ButexTest, wake_all_perf) {
+    WakeAllPerfTest(100, false, false);
+    WakeAllPerfTest(10000, false, false);
+    WakeAllPerfTest(10000, true, false);
+    WakeAllPerfTest(10000, false, true);
+    WakeAllPerfTest(10000, true, true);
+}
+
+const int NBUTEX_IN_BATCH = 8;
+
+void* wake_all_nosignal_in_bthread(void* butexes) {
+    butil::atomic<int>** b = static_cast<butil::atomic<int>**>(butexes);
+    int nwakeup = 0;
+    for (int i = 0; i < NBUTEX_IN_BATCH; ++i) {
+        b[i]->store(1);
+        nwakeup += bthread::butex_wake_all_nosignal(b[i]);
+    }
+    bthread::butex_flush_nosignal_wakeups();
+    return (void*)(intptr_t)nwakeup;
+}
+
+TEST(ButexTest, wake_all_nosignal) {
+    const int NWAITER_PER_BUTEX = 4;
+    butil::atomic<int>* butexes[NBUTEX_IN_BATCH];
+    butil::atomic<int> nwaiting(0);
+    butil::atomic<int> nwoken(0);
+    WakeAllArg args[NBUTEX_IN_BATCH];
+    std::vector<bthread_t> th;
+    for (int i = 0; i < NBUTEX_IN_BATCH; ++i) {
+        butexes[i] = bthread::butex_create_checked<butil::atomic<int> >();
+        ASSERT_TRUE(butexes[i]);
+        butexes[i]->store(0);
+        WakeAllArg arg = { butexes[i], &nwaiting, &nwoken, (i % 2 == 0) };
+        args[i] = arg;
+        for (int j = 0; j < NWAITER_PER_BUTEX; ++j) {
+            bthread_t tid;
+            ASSERT_EQ(0, bthread_start_background(
+                          &tid, NULL, wait_for_wake_all, &args[i]));
+            th.push_back(tid);
+        }
+    }
+    while (nwaiting.load() != NBUTEX_IN_BATCH * NWAITER_PER_BUTEX) {
+        usleep(1000);
+    }
+    usleep(50000);  // wait for the waiters to sleep.
+    bthread_t waker;
+    void* ret = NULL;
+    ASSERT_EQ(0, bthread_start_urgent(&waker, NULL,
+                                      wake_all_nosignal_in_bthread, butexes));
+    ASSERT_EQ(0, bthread_join(waker, &ret));
+    ASSERT_LE((int)(intptr_t)ret, NBUTEX_IN_BATCH * NWAITER_PER_BUTEX);
+    for (size_t i = 0; i < th.size(); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    ASSERT_EQ(NBUTEX_IN_BATCH * NWAITER_PER_BUTEX, nwoken.load());
+    for (int i = 0; i < NBUTEX_IN_BATCH; ++i) {
+        bthread::butex_destroy(butexes[i]);
+    }
+}
 } // namespace
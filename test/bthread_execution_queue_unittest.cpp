@@ -695,4 +695,86 @@ TEST_F(ExecutionQueueTest, cancel_unexecuted_high_priority_task) {
 
     ASSERT_EQ(12345, result);
 }
+
+struct BatchMeta {
+    int64_t sum;
+    int nbatch;
+    int max_batch;
+};
+
+int add_in_batch(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
+    BatchMeta* m = (BatchMeta*)meta;
+    std::vector<bthread::CountdownEvent*> events;
+    int n = 0;
+    for (; iter; ++iter) {
+        m->sum += iter->value;
+        if (iter->event) { events.push_back(iter->event); }
+        ++n;
+    }
+    if (n) {
+        ++m->nbatch;
+        m->max_batch = std::max(m->max_batch, n);
+    }
+    // Signal after updating the statistics which are checked by waiters.
+    for (size_t i = 0; i < events.size(); ++i) {
+        events[i]->signal();
+    }
+    return 0;
+}
+
+TEST_F(ExecutionQueueTest, max_batch_size) {
+    bthread::ExecutionQueueId<LongIntTask> queue_id;
+    bthread::ExecutionQueueOptions options;
+    options.max_batch_size = 10;
+    // Accumulate full batches before executing.
+    options.max_batch_delay_us = 1000000L;
+    BatchMeta meta = { 0, 0, 0 };
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_in_batch, &meta));
+    int64_t expected = 0;
+    for (int i = 0; i < 1000; ++i) {
+        expected += i;
+        ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, i));
+    }
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(expected, meta.sum);
+    ASSERT_EQ(10, meta.max_batch);
+    ASSERT_GE(meta.nbatch, 100);
+}
+
+TEST_F(ExecutionQueueTest, max_batch_delay) {
+    bthread::ExecutionQueueId<LongIntTask> queue_id;
+    bthread::ExecutionQueueOptions options;
+    options.max_batch_delay_us = 50000;
+    BatchMeta meta = { 0, 0, 0 };
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_in_batch, &meta));
+    bthread::CountdownEvent event(5);
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < 5; ++i) {
+        ASSERT_EQ(0, bthread::execution_queue_execute(
+                      queue_id, LongIntTask(i, &event)));
+    }
+    event.wait();
+    tm.stop();
+    // All tasks were executed in one batch after the delay.
+    ASSERT_EQ(1, meta.nbatch);
+    ASSERT_EQ(5, meta.max_batch);
+    ASSERT_GE(tm.m_elapsed(), 40);
+
+    // High-priority tasks are not delayed.
+    bthread::CountdownEvent event2(1);
+    tm.start();
+    ASSERT_EQ(0, bthread::execution_queue_execute(
+                  queue_id, LongIntTask(5, &event2),
+                  &bthread::TASK_OPTIONS_URGENT));
+    event2.wait();
+    tm.stop();
+    ASSERT_LT(tm.m_elapsed(), 40);
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(15, meta.sum);
+}
 } // namespace
@@ -8,6 +8,7 @@
 #include <sys/utsname.h>                           // uname
 #include <fcntl.h>
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include <pthread.h>
 #include "butil/gperftools_profiler.h"
 #include "butil/time.h"
@@ -19,11 +20,16 @@
 #include "bthread/interrupt_pthread.h"
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
+#include "bthread/io_uring.h"
 #if defined(OS_MACOSX)
 #include <sys/types.h>                           // struct kevent
 #include <sys/event.h>                           // kevent(), kqueue()
 #endif
 
+namespace bthread {
+DECLARE_bool(bthread_fd_wait_use_io_uring);
+}
+
 #ifndef NDEBUG
 namespace bthread {
 extern butil::atomic<int> break_nums;
@@ -542,4 +548,162 @@ TEST(FDTest, double_close) {
     ASSERT_EQ(-1, bthread_close(fds[1]));
     ASSERT_EQ(ec, errno);
 }
+struct PipeWaiterArg {
+    int fd;
+    int rc;
+};
+
+void* timedwait_pipe(void* void_arg) {
+    PipeWaiterArg* arg = (PipeWaiterArg*)void_arg;
+    const timespec abstime = butil::seconds_from_now(10);
+#if defined(OS_LINUX)
+    arg->rc = bthread_fd_timedwait(arg->fd, EPOLLIN, &abstime);
+#elif defined(OS_MACOSX)
+    arg->rc = bthread_fd_timedwait(arg->fd, EVFILT_READ, &abstime);
+#endif
+    return NULL;
+}
+
+TEST(FDTest, many_fds_woken_up_together) {
+    // Spread over all epoll threads and woken up in batches.
+    const size_t NPIPE = 200;
+    int fds[NPIPE][2];
+    PipeWaiterArg args[NPIPE];
+    bthread_t th[NPIPE];
+    for (size_t i = 0; i < NPIPE; ++i) {
+        ASSERT_EQ(0, pipe(fds[i]));
+        args[i].fd = fds[i][0];
+        args[i].rc = -2;
+        ASSERT_EQ(0, bthread_start_background(
+                      &th[i], NULL, timedwait_pipe, &args[i]));
+    }
+    usleep(50000);  // wait for the waiters to sleep.
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < NPIPE; ++i) {
+        ASSERT_EQ(1, write(fds[i][1], "x", 1));
+    }
+    for (size_t i = 0; i < NPIPE; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+        ASSERT_EQ(0, args[i].rc) << berror();
+    }
+    tm.stop();
+    ASSERT_LT(tm.m_elapsed(), 1000);
+    for (size_t i = 0; i < NPIPE; ++i) {
+        ASSERT_EQ(0, bthread_close(fds[i][0]));
+        ASSERT_EQ(0, bthread_close(fds[i][1]));
+    }
+}
+
+struct FileIOArg {
+    int fd;
+    int index;
+    ssize_t nwritten;
+    ssize_t nread;
+    bool matched;
+};
+
+const size_t FILE_IO_BLOCK = 4096;
+
+void* write_and_read_file(void* void_arg) {
+    FileIOArg* arg = (FileIOArg*)void_arg;
+    char wbuf[FILE_IO_BLOCK];
+    char rbuf[FILE_IO_BLOCK];
+    memset(wbuf, 'a' + arg->index, sizeof(wbuf));
+    const off_t offset = arg->index * FILE_IO_BLOCK;
+    arg->nwritten = bthread_pwrite(arg->fd, wbuf, sizeof(wbuf), offset);
+    arg->nread = bthread_pread(arg->fd, rbuf, sizeof(rbuf), offset);
+    arg->matched = (memcmp(wbuf, rbuf, sizeof(rbuf)) == 0);
+    return NULL;
+}
+
+TEST(FDTest, pread_and_pwrite) {
+    LOG(INFO) << "io_uring_available=" << bthread::io_uring_available();
+    char path[] = "bthread_fd_unittest_XXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    unlink(path);
+    const int N = 32;
+    bthread_t th[N];
+    FileIOArg args[N];
+    for (int i = 0; i < N; ++i) {
+        FileIOArg tmp = { fd, i, -1, -1, false };
+        args[i] = tmp;
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, write_and_read_file, &args[i]));
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+        ASSERT_EQ((ssize_t)FILE_IO_BLOCK, args[i].nwritten);
+        ASSERT_EQ((ssize_t)FILE_IO_BLOCK, args[i].nread);
+        ASSERT_TRUE(args[i].matched);
+    }
+    // Read from pthread.
+    char buf[FILE_IO_BLOCK];
+    ASSERT_EQ((ssize_t)FILE_IO_BLOCK, bthread_pread(fd, buf, sizeof(buf), FILE_IO_BLOCK));
+    ASSERT_EQ('b', buf[0]);
+    // Errors are reported by errno.
+    args[0].fd = -1;
+    ASSERT_EQ(0, bthread_start_background(&th[0], NULL, write_and_read_file, &args[0]));
+    ASSERT_EQ(0, bthread_join(th[0], NULL));
+    ASSERT_EQ(-1, args[0].nwritten);
+    ASSERT_EQ(-1, args[0].nread);
+    close(fd);
+}
+
+struct PipeWaitArg {
+    int fd;
+    const timespec* abstime;
+    int rc;
+    int error;
+};
+
+void* wait_for_pipe(void* void_arg) {
+    PipeWaitArg* arg = (PipeWaitArg*)void_arg;
+    arg->rc = bthread_fd_timedwait(arg->fd, EPOLLIN, arg->abstime);
+    arg->error = errno;
+    return NULL;
+}
+
+TEST(FDTest, fd_wait_with_io_uring) {
+    if (!bthread::io_uring_available()) {
+        LOG(WARNING) << "Skip because io_uring is not available";
+        return;
+    }
+    bthread::FLAGS_bthread_fd_wait_use_io_uring = true;
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    // Woken up by data.
+    PipeWaitArg arg = { fds[0], NULL, -1, 0 };
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, wait_for_pipe, &arg));
+    usleep(10000);
+    ASSERT_EQ(-1, arg.rc);
+    ASSERT_EQ(1, write(fds[1], "x", 1));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, arg.rc);
+    char c;
+    ASSERT_EQ(1, read(fds[0], &c, 1));
+
+    // Timed out.
+    const timespec abstime = butil::milliseconds_from_now(20);
+    PipeWaitArg arg2 = { fds[0], &abstime, -1, 0 };
+    butil::Timer tm;
+    tm.start();
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, wait_for_pipe, &arg2));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    tm.stop();
+    ASSERT_EQ(-1, arg2.rc);
+    ASSERT_EQ(ETIMEDOUT, arg2.error);
+    ASSERT_GE(tm.m_elapsed(), 15);
+
+    // Woken up by bthread_close.
+    PipeWaitArg arg3 = { fds[0], NULL, -1, 0 };
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, wait_for_pipe, &arg3));
+    usleep(10000);
+    ASSERT_EQ(0, bthread_close(fds[0]));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, arg3.rc);
+    close(fds[1]);
+    bthread::FLAGS_bthread_fd_wait_use_io_uring = false;
+}
 } // namespace
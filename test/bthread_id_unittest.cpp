@@ -99,6 +99,31 @@ TEST(BthreadIdTest, join_before_destroy) {
     ASSERT_EQ(1UL, non_null_ret);
 }
 
+TEST(BthreadIdTest, timedjoin) {
+    bthread_id_t id1;
+    int x = 0xdead;
+    ASSERT_EQ(0, bthread_id_create(&id1, &x, NULL));
+    butil::Timer tm;
+    tm.start();
+    timespec abstime = butil::milliseconds_from_now(20);
+    ASSERT_EQ(ETIMEDOUT, bthread_id_timedjoin(id1, &abstime));
+    tm.stop();
+    ASSERT_GE(tm.m_elapsed(), 15);
+
+    pthread_t th;
+    SignalArg arg;
+    arg.sleep_us_before_fight = 10000;
+    arg.sleep_us_before_signal = 0;
+    arg.id = id1;
+    ASSERT_EQ(0, pthread_create(&th, NULL, signaller, &arg));
+    abstime = butil::seconds_from_now(10);
+    ASSERT_EQ(0, bthread_id_timedjoin(id1, &abstime));
+    ASSERT_EQ(0xdead + 1, x);
+    ASSERT_EQ(0, pthread_join(th, NULL));
+    // Joining a destroyed id returns immediately.
+    ASSERT_EQ(0, bthread_id_timedjoin(id1, &abstime));
+}
+
 struct OnResetArg {
     bthread_id_t id;
     int error_code;
@@ -581,4 +606,109 @@ TEST(BthreadIdTest, error_with_descriptions) {
     ASSERT_EQ(0, bthread_id_unlock(id1));
     ASSERT_EQ(branch_counter, branch_tags[0]);
 }
+TEST(BthreadIdTest, uncontended_lock_perf) {
+    bthread_id_t id;
+    ASSERT_EQ(0, bthread_id_create(&id, NULL, NULL));
+    const int N = 1000000;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        bthread_id_lock(id, NULL);
+        bthread_id_unlock(id);
+    }
+    tm.stop();
+    LOG(INFO) << "lock+unlock takes " << tm.n_elapsed() / (double)N << "ns";
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        bthread_id_trylock(id, NULL);
+        bthread_id_unlock(id);
+    }
+    tm.stop();
+    LOG(INFO) << "trylock+unlock takes " << tm.n_elapsed() / (double)N << "ns";
+    ASSERT_EQ(get_version(id), bthread::id_value(id));
+    ASSERT_EQ(0, bthread_id_lock(id, NULL));
+    ASSERT_EQ(0, bthread_id_about_to_destroy(id));
+    ASSERT_EQ(EBUSY, bthread_id_trylock(id, NULL));
+    ASSERT_EQ(0, bthread_id_unlock_and_destroy(id));
+}
+
+struct StressArg {
+    bthread_id_t id;
+    int64_t nlocked;   // modified inside the lock
+    int64_t nerror;    // modified inside the lock
+    bool inside;
+};
+
+int on_stress_error(bthread_id_t id, void* data, int) {
+    StressArg* arg = (StressArg*)data;
+    EXPECT_FALSE(arg->inside);
+    ++arg->nerror;
+    return bthread_id_unlock(id);
+}
+
+bool g_stress_stop = false;
+
+void* lock_with_range(void* void_arg) {
+    StressArg* arg = (StressArg*)void_arg;
+    int64_t n = 0;
+    for (int i = 1; !g_stress_stop; ++i) {
+        void* data = NULL;
+        const int rc = (i % 100 == 0 ?
+                        bthread_id_lock_and_reset_range(arg->id, &data, 2 + i % 3) :
+                        bthread_id_lock(arg->id, &data));
+        EXPECT_EQ(0, rc);
+        EXPECT_EQ(arg, data);
+        EXPECT_FALSE(arg->inside);
+        arg->inside = true;
+        ++arg->nlocked;
+        arg->inside = false;
+        ++n;
+        EXPECT_EQ(0, bthread_id_unlock(arg->id));
+    }
+    return (void*)n;
+}
+
+void* send_errors(void* void_arg) {
+    StressArg* arg = (StressArg*)void_arg;
+    int64_t n = 0;
+    while (!g_stress_stop) {
+        EXPECT_EQ(0, bthread_id_error(arg->id, EINVAL));
+        ++n;
+        if (n % 16 == 0) {
+            sched_yield();
+        }
+    }
+    return (void*)n;
+}
+
+TEST(BthreadIdTest, contended_lock_with_errors) {
+    StressArg arg;
+    arg.nlocked = 0;
+    arg.nerror = 0;
+    arg.inside = false;
+    ASSERT_EQ(0, bthread_id_create(&arg.id, &arg, on_stress_error));
+    g_stress_stop = false;
+    pthread_t lockers[4];
+    pthread_t error_sender;
+    for (size_t i = 0; i < ARRAY_SIZE(lockers); ++i) {
+        ASSERT_EQ(0, pthread_create(&lockers[i], NULL, lock_with_range, &arg));
+    }
+    ASSERT_EQ(0, pthread_create(&error_sender, NULL, send_errors, &arg));
+    usleep(500000);
+    g_stress_stop = true;
+    int64_t nlocked = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(lockers); ++i) {
+        void* ret = NULL;
+        ASSERT_EQ(0, pthread_join(lockers[i], &ret));
+        nlocked += (int64_t)ret;
+    }
+    void* nerror = NULL;
+    ASSERT_EQ(0, pthread_join(error_sender, &nerror));
+    // All errors are handled after the id is unlocked.
+    ASSERT_EQ(0, bthread_id_lock(arg.id, NULL));
+    ASSERT_EQ(nlocked, arg.nlocked);
+    ASSERT_EQ((int64_t)nerror, arg.nerror);
+    LOG(INFO) << "nlocked=" << nlocked << " nerror=" << arg.nerror;
+    ASSERT_EQ(0, bthread_id_unlock_and_destroy(arg.id));
+}
 } // namespace
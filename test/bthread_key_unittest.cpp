@@ -390,4 +390,59 @@ TEST(KeyTest, using_pool) {
     ASSERT_EQ(0, bthread_key_delete(key));
 }
 
+struct FastSlotArg {
+    bthread_fast_slot_t slot;
+    void* data;
+};
+
+butil::atomic<int> nfast_slot_dtor(0);
+
+void fast_slot_dtor(void* data) {
+    ASSERT_EQ((void*)1, data);
+    nfast_slot_dtor.fetch_add(1);
+}
+
+void* use_fast_slot(void* arg) {
+    FastSlotArg* a = (FastSlotArg*)arg;
+    EXPECT_EQ(NULL, bthread_fast_slot_get(a->slot));
+    EXPECT_EQ(0, bthread_fast_slot_set(a->slot, a->data));
+    bthread_usleep(1000);
+    EXPECT_EQ(a->data, bthread_fast_slot_get(a->slot));
+    return NULL;
+}
+
+TEST(KeyTest, fast_slot) {
+    bthread_fast_slot_t slot;
+    ASSERT_EQ(0, bthread_fast_slot_create(&slot, fast_slot_dtor));
+    ASSERT_EQ(EINVAL, bthread_fast_slot_set(BTHREAD_FAST_SLOT_NUM, NULL));
+    ASSERT_EQ(NULL, bthread_fast_slot_get(BTHREAD_FAST_SLOT_NUM));
+
+    // Each bthread has its own value, destructed when it ends.
+    FastSlotArg args[3] = { { slot, (void*)1 }, { slot, (void*)1 },
+                            { slot, NULL } };
+    bthread_t th[3];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, use_fast_slot,
+                                              &args[i]));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    ASSERT_EQ(2, nfast_slot_dtor.load());
+
+    // Works in pthread as well.
+    ASSERT_EQ(NULL, bthread_fast_slot_get(slot));
+    ASSERT_EQ(0, bthread_fast_slot_set(slot, (void*)2));
+    ASSERT_EQ((void*)2, bthread_fast_slot_get(slot));
+    ASSERT_EQ(0, bthread_fast_slot_set(slot, NULL));
+
+    // Slots are limited.
+    int nslot = slot + 1;
+    bthread_fast_slot_t s;
+    for (; nslot < BTHREAD_FAST_SLOT_NUM; ++nslot) {
+        ASSERT_EQ(0, bthread_fast_slot_create(&s, NULL));
+    }
+    ASSERT_EQ(EAGAIN, bthread_fast_slot_create(&s, NULL));
+}
+
 }  // namespace
@@ -3,6 +3,7 @@
 // Date: Sun Jul 13 15:04:18 CST 2014
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/compat.h"
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -13,6 +14,15 @@
 #include "bthread/task_control.h"
 #include "bthread/mutex.h"
 #include "butil/gperftools_profiler.h"
+#include "butil/file_util.h"
+
+namespace bthread {
+DECLARE_int32(bthread_mutex_max_spin);
+extern bool ContentionProfilerStart(const char* filename);
+extern void ContentionProfilerStop();
+extern bool OffCpuProfilerStart(const char* filename);
+extern void OffCpuProfilerStop();
+}
 
 namespace {
 inline unsigned* get_butex(bthread_mutex_t & m) {
@@ -216,6 +226,219 @@ TEST(MutexTest, performance) {
     PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
 }
 
+TEST(MutexTest, handoff_sanity) {
+    bthread_mutexattr_t attr;
+    ASSERT_EQ(0, bthread_mutexattr_init(&attr));
+    int handoff = -1;
+    ASSERT_EQ(0, bthread_mutexattr_gethandoff(&attr, &handoff));
+    ASSERT_EQ(0, handoff);
+    ASSERT_EQ(0, bthread_mutexattr_sethandoff(&attr, 1));
+    ASSERT_EQ(0, bthread_mutexattr_gethandoff(&attr, &handoff));
+    ASSERT_EQ(1, handoff);
+    bthread_mutex_t m;
+    ASSERT_EQ(0, bthread_mutex_init(&m, &attr));
+    ASSERT_EQ(0, bthread_mutexattr_destroy(&attr));
+    const unsigned unlocked = *get_butex(m);
+    ASSERT_NE(0u, unlocked);
+    ASSERT_EQ(0, bthread_mutex_lock(&m));
+    ASSERT_EQ(unlocked + 1, *get_butex(m));
+    ASSERT_EQ(EBUSY, bthread_mutex_trylock(&m));
+    bthread_t th1;
+    ASSERT_EQ(0, bthread_start_urgent(&th1, NULL, locker, &m));
+    usleep(5000); // wait for locker to run.
+    ASSERT_EQ(unlocked + 257, *get_butex(m)); // contention
+    ASSERT_EQ(0, bthread_mutex_unlock(&m));
+    ASSERT_EQ(0, bthread_join(th1, NULL));
+    ASSERT_EQ(unlocked, *get_butex(m));
+    ASSERT_EQ(0, bthread_mutex_trylock(&m));
+    ASSERT_EQ(0, bthread_mutex_unlock(&m));
+    ASSERT_EQ(unlocked, *get_butex(m));
+
+    // Waiters timed out, nobody takes the handed lock.
+    struct timespec t = { -2, 0 };
+    ASSERT_EQ(0, bthread_mutex_lock(&m));
+    ASSERT_EQ(ETIMEDOUT, bthread_mutex_timedlock(&m, &t));
+    ASSERT_EQ(0, bthread_mutex_unlock(&m));
+    ASSERT_EQ(0, bthread_mutex_trylock(&m));
+    ASSERT_EQ(0, bthread_mutex_unlock(&m));
+    ASSERT_EQ(0, bthread_mutex_destroy(&m));
+}
+
+TEST(MutexTest, handoff_used_in_pthread) {
+    bthread_mutexattr_t attr;
+    ASSERT_EQ(0, bthread_mutexattr_init(&attr));
+    ASSERT_EQ(0, bthread_mutexattr_sethandoff(&attr, 1));
+    bthread_mutex_t m;
+    ASSERT_EQ(0, bthread_mutex_init(&m, &attr));
+    const unsigned unlocked = *get_butex(m);
+    pthread_t th[8];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, locker, &m));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    ASSERT_EQ(unlocked, *get_butex(m));
+    ASSERT_EQ(0, bthread_mutex_destroy(&m));
+}
+
+struct CondArgs {
+    bthread_mutex_t* mutex;
+    bthread_cond_t* cond;
+    int* value;
+    int nconsumed;
+};
+
+void* consume_with_cond(void* void_arg) {
+    CondArgs* args = (CondArgs*)void_arg;
+    bthread_mutex_lock(args->mutex);
+    while (true) {
+        while (*args->value == 0) {
+            bthread_cond_wait(args->cond, args->mutex);
+        }
+        if (*args->value < 0) {
+            break;
+        }
+        --*args->value;
+        ++args->nconsumed;
+    }
+    bthread_mutex_unlock(args->mutex);
+    return NULL;
+}
+
+TEST(MutexTest, handoff_with_cond) {
+    bthread_mutexattr_t attr;
+    ASSERT_EQ(0, bthread_mutexattr_init(&attr));
+    ASSERT_EQ(0, bthread_mutexattr_sethandoff(&attr, 1));
+    bthread_mutex_t m;
+    ASSERT_EQ(0, bthread_mutex_init(&m, &attr));
+    bthread_cond_t c;
+    ASSERT_EQ(0, bthread_cond_init(&c, NULL));
+    int value = 0;
+    const int N = 8;
+    bthread_t th[N];
+    CondArgs args[N];
+    for (int i = 0; i < N; ++i) {
+        CondArgs tmp = { &m, &c, &value, 0 };
+        args[i] = tmp;
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, consume_with_cond, &args[i]));
+    }
+    const int ROUND = 10000;
+    for (int i = 0; i < ROUND; ++i) {
+        bthread_mutex_lock(&m);
+        ++value;
+        // Requeue waiters on the mutex sometimes.
+        if (i % 3) {
+            bthread_cond_signal(&c);
+        } else {
+            bthread_cond_broadcast(&c);
+        }
+        bthread_mutex_unlock(&m);
+    }
+    while (true) {
+        bthread_mutex_lock(&m);
+        if (value == 0) {
+            value = -1;
+            bthread_cond_broadcast(&c);
+            bthread_mutex_unlock(&m);
+            break;
+        }
+        bthread_mutex_unlock(&m);
+        bthread_usleep(1000);
+    }
+    int nconsumed = 0;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+        nconsumed += args[i].nconsumed;
+    }
+    ASSERT_EQ(ROUND, nconsumed);
+    ASSERT_EQ(0, bthread_cond_destroy(&c));
+    ASSERT_EQ(0, bthread_mutex_destroy(&m));
+}
+
+struct BAIDU_CACHELINE_ALIGNMENT LatencyArgs {
+    bthread_mutex_t* mutex;
+    int64_t* shared_counter;
+    int64_t counter;
+    int64_t total_wait_ns;
+    int64_t max_wait_ns;
+};
+
+void* add_with_short_critical_section(void* void_arg) {
+    LatencyArgs* args = (LatencyArgs*)void_arg;
+    while (!g_stopped) {
+        const int64_t start_ns = butil::cpuwide_time_ns();
+        bthread_mutex_lock(args->mutex);
+        const int64_t wait_ns = butil::cpuwide_time_ns() - start_ns;
+        // Short critical section.
+        for (int i = 0; i < 20; ++i) {
+            ++*args->shared_counter;
+        }
+        bthread_mutex_unlock(args->mutex);
+        ++args->counter;
+        args->total_wait_ns += wait_ns;
+        if (wait_ns > args->max_wait_ns) {
+            args->max_wait_ns = wait_ns;
+        }
+    }
+    return NULL;
+}
+
+void LatencyTest(bool handoff, int max_spin) {
+    const int saved_max_spin = bthread::FLAGS_bthread_mutex_max_spin;
+    bthread::FLAGS_bthread_mutex_max_spin = max_spin;
+    bthread_mutexattr_t attr;
+    ASSERT_EQ(0, bthread_mutexattr_init(&attr));
+    ASSERT_EQ(0, bthread_mutexattr_sethandoff(&attr, handoff));
+    bthread_mutex_t m;
+    ASSERT_EQ(0, bthread_mutex_init(&m, &attr));
+    g_stopped = false;
+    int64_t shared_counter = 0;
+    const int N = 8;
+    bthread_t th[N];
+    std::vector<LatencyArgs> args(N);
+    for (int i = 0; i < N; ++i) {
+        LatencyArgs tmp = { &m, &shared_counter, 0, 0, 0 };
+        args[i] = tmp;
+        ASSERT_EQ(0, bthread_start_background(
+                      &th[i], NULL, add_with_short_critical_section, &args[i]));
+    }
+    // Contentions are also written into the profile, which shows waiting
+    // time of this test when it's viewed by pprof.
+    char prof_name[64];
+    snprintf(prof_name, sizeof(prof_name), "mutex_contention_%d.prof",
+             ++g_prof_name_counter);
+    const bool prof_started = bthread::ContentionProfilerStart(prof_name);
+    usleep(500 * 1000);
+    if (prof_started) {
+        bthread::ContentionProfilerStop();
+    }
+    g_stopped = true;
+    int64_t count = 0;
+    int64_t total_wait_ns = 0;
+    int64_t max_wait_ns = 0;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+        count += args[i].counter;
+        total_wait_ns += args[i].total_wait_ns;
+        max_wait_ns = std::max(max_wait_ns, args[i].max_wait_ns);
+    }
+    ASSERT_EQ(count * 20, shared_counter);
+    LOG(INFO) << "handoff=" << handoff << " max_spin=" << max_spin
+              << " count=" << count
+              << " average_wait=" << total_wait_ns / (double)count << "ns"
+              << " max_wait=" << max_wait_ns << "ns";
+    ASSERT_EQ(0, bthread_mutex_destroy(&m));
+    bthread::FLAGS_bthread_mutex_max_spin = saved_max_spin;
+}
+
+TEST(MutexTest, spin_and_handoff_latency) {
+    LatencyTest(false, 0);
+    LatencyTest(false, bthread::FLAGS_bthread_mutex_max_spin);
+    LatencyTest(true, 0);
+    LatencyTest(true, bthread::FLAGS_bthread_mutex_max_spin);
+}
+
 void* loop_until_stopped(void* arg) {
     bthread::Mutex *m = (bthread::Mutex*)arg;
     while (!g_stopped) {
@@ -253,4 +476,36 @@ TEST(MutexTest, mix_thread_types) {
         pthread_join(pthreads[i], NULL);
     }
 }
+
+void* sleep_until_stopped(void*) {
+    while (!g_stopped) {
+        bthread_usleep(1000);
+    }
+    return NULL;
+}
+
+TEST(MutexTest, offcpu_profiler) {
+    g_stopped = false;
+    const char* prof_name = "mutex_offcpu.prof";
+    ASSERT_TRUE(bthread::OffCpuProfilerStart(prof_name));
+    ASSERT_FALSE(bthread::OffCpuProfilerStart(prof_name));
+    bthread_t th[4];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, bthread_start_background(
+                      &th[i], NULL, sleep_until_stopped, NULL));
+    }
+    usleep(500 * 1000);
+    g_stopped = true;
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    bthread::OffCpuProfilerStop();
+    std::string content;
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath(prof_name), &content));
+    ASSERT_EQ(0u, content.find("--- contention\ncycles/second=1000000000\n"))
+        << content;
+    // Blocked time of sleep_until_stopped was sampled.
+    ASSERT_NE(std::string::npos, content.find(" @ ")) << content;
+    butil::DeleteFile(butil::FilePath(prof_name), false);
+}
 } // namespace
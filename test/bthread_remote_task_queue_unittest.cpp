@@ -0,0 +1,109 @@
+// bthread - A M:N threading library to make applications more concurrent.
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <algorithm>                        // std::sort
+#include <vector>
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include "butil/atomicops.h"
+#include "bthread/remote_task_queue.h"
+
+namespace {
+const size_t N = 100000;
+const size_t NPUSHER = 4;
+const size_t NPOPPER = 3;
+butil::atomic<size_t> g_npopped(0);
+
+struct PushArg {
+    bthread::RemoteTaskQueue* q;
+    size_t begin;
+};
+
+void* push_thread(void* arg) {
+    PushArg* a = (PushArg*)arg;
+    for (size_t i = a->begin; i < a->begin + N; ++i) {
+        while (!a->q->push(i, i % 7 == 0)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void* pop_thread(void* arg) {
+    bthread::RemoteTaskQueue* q = (bthread::RemoteTaskQueue*)arg;
+    std::vector<bthread_t>* popped = new std::vector<bthread_t>;
+    while (g_npopped.load(butil::memory_order_relaxed) < N * NPUSHER) {
+        bthread_t val;
+        if (q->pop(&val)) {
+            popped->push_back(val);
+            g_npopped.fetch_add(1, butil::memory_order_relaxed);
+        } else {
+            sched_yield();
+        }
+    }
+    return popped;
+}
+
+TEST(RemoteTaskQueueTest, push_until_full) {
+    bthread::RemoteTaskQueue q;
+    ASSERT_EQ(0, q.init(8));
+    ASSERT_EQ(16u, q.capacity());
+    for (bthread_t i = 0; i < 16; ++i) {
+        ASSERT_TRUE(q.push(i));
+    }
+    ASSERT_FALSE(q.push(16));
+    // Overflowed tasks are popped first.
+    bthread_t val;
+    ASSERT_TRUE(q.pop(&val));
+    ASSERT_EQ(8u, val);
+    // High priority tasks are popped before others.
+    ASSERT_TRUE(q.push(100, true));
+    ASSERT_TRUE(q.pop(&val));
+    ASSERT_EQ(100u, val);
+    std::vector<bthread_t> popped;
+    while (q.pop(&val)) {
+        popped.push_back(val);
+    }
+    ASSERT_EQ(15u, popped.size());
+    std::sort(popped.begin(), popped.end());
+    for (size_t i = 0; i < popped.size(); ++i) {
+        ASSERT_EQ((i < 8 ? i : i + 1), popped[i]);
+    }
+}
+
+TEST(RemoteTaskQueueTest, multiple_pushers_and_poppers) {
+    bthread::RemoteTaskQueue q;
+    // Small capacity so that the overflow queue is used.
+    ASSERT_EQ(0, q.init(16));
+    g_npopped.store(0, butil::memory_order_relaxed);
+    pthread_t pushers[NPUSHER];
+    PushArg args[NPUSHER];
+    for (size_t i = 0; i < NPUSHER; ++i) {
+        args[i].q = &q;
+        args[i].begin = i * N;
+        ASSERT_EQ(0, pthread_create(&pushers[i], NULL, push_thread, &args[i]));
+    }
+    pthread_t poppers[NPOPPER];
+    for (size_t i = 0; i < NPOPPER; ++i) {
+        ASSERT_EQ(0, pthread_create(&poppers[i], NULL, pop_thread, &q));
+    }
+    for (size_t i = 0; i < NPUSHER; ++i) {
+        pthread_join(pushers[i], NULL);
+    }
+    std::vector<bthread_t> all;
+    for (size_t i = 0; i < NPOPPER; ++i) {
+        void* ret = NULL;
+        pthread_join(poppers[i], &ret);
+        std::vector<bthread_t>* popped = (std::vector<bthread_t>*)ret;
+        all.insert(all.end(), popped->begin(), popped->end());
+        delete popped;
+    }
+    bthread_t val;
+    ASSERT_FALSE(q.pop(&val));
+    ASSERT_EQ(N * NPUSHER, all.size());
+    std::sort(all.begin(), all.end());
+    for (size_t i = 0; i < all.size(); ++i) {
+        ASSERT_EQ(i, all[i]);
+    }
+}
+} // namespace
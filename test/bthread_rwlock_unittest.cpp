@@ -5,9 +5,13 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <signal.h>
+#include <vector>
 #include <gtest/gtest.h>
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "butil/logging.h"
+#include "bthread/bthread.h"
+#include "bthread/rwlock.h"
 
 namespace {
 void* read_thread(void* arg) {
@@ -62,4 +66,233 @@ TEST(RWLockTest, rdlock_performance) {
     pthread_mutex_destroy(&lock1);
 #endif
 }
+
+TEST(RWLockTest, sanity) {
+    bthread_rwlock_t rw;
+    ASSERT_EQ(0, bthread_rwlock_init(&rw, NULL));
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_tryrdlock(&rw));
+    ASSERT_EQ(EBUSY, bthread_rwlock_trywrlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+
+    ASSERT_EQ(0, bthread_rwlock_wrlock(&rw));
+    ASSERT_EQ(EBUSY, bthread_rwlock_tryrdlock(&rw));
+    ASSERT_EQ(EBUSY, bthread_rwlock_trywrlock(&rw));
+    timespec abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedrdlock(&rw, &abstime));
+    abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedwrlock(&rw, &abstime));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+
+    ASSERT_EQ(0, bthread_rwlock_trywrlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_tryrdlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+}
+
+struct WriterArg {
+    bthread_rwlock_t* rw;
+    volatile bool locked;
+};
+
+void* wrlock_and_unlock(void* arg) {
+    WriterArg* a = (WriterArg*)arg;
+    EXPECT_EQ(0, bthread_rwlock_wrlock(a->rw));
+    a->locked = true;
+    bthread_usleep(10000);
+    a->locked = false;
+    EXPECT_EQ(0, bthread_rwlock_unlock(a->rw));
+    return NULL;
+}
+
+TEST(RWLockTest, writer_preference) {
+    bthread_rwlock_t rw;
+    ASSERT_EQ(0, bthread_rwlock_init(&rw, NULL));
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+    WriterArg arg = { &rw, false };
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, wrlock_and_unlock, &arg));
+    bthread_usleep(10000);
+    ASSERT_FALSE(arg.locked);
+    // The writer is pending, new readers are blocked.
+    ASSERT_EQ(EBUSY, bthread_rwlock_tryrdlock(&rw));
+    timespec abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedrdlock(&rw, &abstime));
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    // The writer gets the lock before following readers.
+    ASSERT_EQ(0, bthread_rwlock_rdlock(&rw));
+    ASSERT_FALSE(arg.locked);
+    ASSERT_EQ(0, bthread_rwlock_unlock(&rw));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, bthread_rwlock_destroy(&rw));
+}
+
+TEST(RWLockTest, timed_out_writer_releases_readers) {
+    bthread::RWLock rw;
+    rw.lock_shared();
+    timespec abstime = butil::milliseconds_from_now(10);
+    ASSERT_EQ(ETIMEDOUT, bthread_rwlock_timedwrlock(rw.native_handler(), &abstime));
+    // Readers are not blocked after the writer gave up.
+    ASSERT_TRUE(rw.try_lock_shared());
+    rw.unlock_shared();
+    rw.unlock_shared();
+    ASSERT_TRUE(rw.try_lock());
+    rw.unlock();
+}
+
+struct MixedArg {
+    bthread::RWLock* rw;
+    volatile bool* stop;
+    int nreader;    // readers inside the lock
+    int nwriter;    // writers inside the lock
+    int64_t value;
+    int64_t nread;
+    int64_t nwrite;
+    int nerror;
+};
+
+void* mixed_reader(void* void_arg) {
+    MixedArg* arg = (MixedArg*)void_arg;
+    while (!*arg->stop) {
+        bthread::ReadLockGuard guard(*arg->rw);
+        __sync_fetch_and_add(&arg->nreader, 1);
+        if (arg->nwriter != 0) {
+            __sync_fetch_and_add(&arg->nerror, 1);
+        }
+        __sync_fetch_and_add(&arg->nread, 1);
+        __sync_fetch_and_sub(&arg->nreader, 1);
+    }
+    return NULL;
+}
+
+void* mixed_writer(void* void_arg) {
+    MixedArg* arg = (MixedArg*)void_arg;
+    while (!*arg->stop) {
+        BAIDU_SCOPED_LOCK(*arg->rw);
+        if (__sync_fetch_and_add(&arg->nwriter, 1) != 0 || arg->nreader != 0) {
+            __sync_fetch_and_add(&arg->nerror, 1);
+        }
+        ++arg->value;
+        ++arg->nwrite;
+        __sync_fetch_and_sub(&arg->nwriter, 1);
+        bthread_usleep(100);
+    }
+    return NULL;
+}
+
+TEST(RWLockTest, mixed_readers_and_writers) {
+    bthread::RWLock rw;
+    volatile bool stop = false;
+    MixedArg arg = { &rw, &stop, 0, 0, 0, 0, 0, 0 };
+    // Use pthreads since busy readers never yield bthread workers.
+    pthread_t rth[8];
+    pthread_t wth[2];
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        ASSERT_EQ(0, pthread_create(&rth[i], NULL, mixed_reader, &arg));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(wth); ++i) {
+        ASSERT_EQ(0, pthread_create(&wth[i], NULL, mixed_writer, &arg));
+    }
+    usleep(200000);
+    stop = true;
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        pthread_join(rth[i], NULL);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(wth); ++i) {
+        pthread_join(wth[i], NULL);
+    }
+    ASSERT_EQ(0, arg.nerror);
+    ASSERT_EQ(arg.nwrite, arg.value);
+    ASSERT_GT(arg.nwrite, 0);
+    ASSERT_GT(arg.nread, 0);
+    LOG(INFO) << "nread=" << arg.nread << " nwrite=" << arg.nwrite;
+}
+
+struct PerfArg {
+    void* lock;
+    bool use_bthread_rwlock;
+    volatile bool* stop;
+    int64_t nread;
+};
+
+void* read_in_loop(void* void_arg) {
+    PerfArg* arg = (PerfArg*)void_arg;
+    int64_t n = 0;
+    while (!*arg->stop) {
+        for (int i = 0; i < 100; ++i) {
+            if (arg->use_bthread_rwlock) {
+                bthread_rwlock_rdlock((bthread_rwlock_t*)arg->lock);
+                bthread_rwlock_unlock((bthread_rwlock_t*)arg->lock);
+            } else {
+                pthread_rwlock_rdlock((pthread_rwlock_t*)arg->lock);
+                pthread_rwlock_unlock((pthread_rwlock_t*)arg->lock);
+            }
+        }
+        n += 100;
+    }
+    arg->nread = n;
+    return NULL;
+}
+
+void* write_in_loop(void* void_arg) {
+    PerfArg* arg = (PerfArg*)void_arg;
+    while (!*arg->stop) {
+        if (arg->use_bthread_rwlock) {
+            bthread_rwlock_wrlock((bthread_rwlock_t*)arg->lock);
+            bthread_rwlock_unlock((bthread_rwlock_t*)arg->lock);
+        } else {
+            pthread_rwlock_wrlock((pthread_rwlock_t*)arg->lock);
+            pthread_rwlock_unlock((pthread_rwlock_t*)arg->lock);
+        }
+        bthread_usleep(1000);
+    }
+    return NULL;
+}
+
+// Reads per second by `nthread' readers with one writer.
+int64_t read_heavy_qps(void* lock, bool use_bthread_rwlock, size_t nthread) {
+    volatile bool stop = false;
+    std::vector<PerfArg> args(nthread);
+    std::vector<pthread_t> rth(nthread);
+    for (size_t i = 0; i < nthread; ++i) {
+        PerfArg a = { lock, use_bthread_rwlock, &stop, 0 };
+        args[i] = a;
+        EXPECT_EQ(0, pthread_create(&rth[i], NULL, read_in_loop, &args[i]));
+    }
+    PerfArg warg = { lock, use_bthread_rwlock, &stop, 0 };
+    pthread_t wth;
+    EXPECT_EQ(0, pthread_create(&wth, NULL, write_in_loop, &warg));
+    butil::Timer tm;
+    tm.start();
+    usleep(500000);
+    stop = true;
+    int64_t nread = 0;
+    for (size_t i = 0; i < nthread; ++i) {
+        pthread_join(rth[i], NULL);
+        nread += args[i].nread;
+    }
+    pthread_join(wth, NULL);
+    tm.stop();
+    return nread * 1000 / tm.m_elapsed();
+}
+
+TEST(RWLockTest, perf_cmp_with_pthread_rwlock) {
+    bthread_rwlock_t rw1;
+    ASSERT_EQ(0, bthread_rwlock_init(&rw1, NULL));
+    pthread_rwlock_t rw2;
+    ASSERT_EQ(0, pthread_rwlock_init(&rw2, NULL));
+    // Run with more threads on machines with more cores, e.g. 64.
+    const size_t nthreads[] = { 1, 4, 16 };
+    for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+        const int64_t qps1 = read_heavy_qps(&rw1, true, nthreads[i]);
+        const int64_t qps2 = read_heavy_qps(&rw2, false, nthreads[i]);
+        LOG(INFO) << "Reads per second of " << nthreads[i]
+                  << " readers: bthread_rwlock=" << qps1
+                  << " pthread_rwlock=" << qps2;
+    }
+    bthread_rwlock_destroy(&rw1);
+    pthread_rwlock_destroy(&rw2);
+}
 } // namespace
@@ -13,6 +13,7 @@
 #include "butil/logging.h"
 #include "bthread/bthread.h"
 #include "bthread/task_control.h"
+#include "bvar/variable.h"
 
 namespace bthread {
     extern TaskControl* g_task_control;
@@ -39,8 +40,10 @@ TEST(BthreadTest, setconcurrency) {
     ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 1, bthread_getconcurrency());
     ASSERT_EQ(0, bthread_setconcurrency(BTHREAD_MIN_CONCURRENCY + 5));
     ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 5, bthread_getconcurrency());
-    ASSERT_EQ(EPERM, bthread_setconcurrency(BTHREAD_MIN_CONCURRENCY + 1));
-    ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 5, bthread_getconcurrency());
+    ASSERT_EQ(0, bthread_setconcurrency(BTHREAD_MIN_CONCURRENCY + 1));
+    ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 1, bthread_getconcurrency());
+    ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 1,
+              bthread::g_task_control->concurrency());
 }
 
 static butil::atomic<int> *odd;
@@ -112,6 +115,71 @@ TEST(BthreadTest, setconcurrency_with_running_bthread) {
     LOG(INFO) << "Touched pthreads=" << npthreads;
 }
 
+int get_worker_count() {
+    return atoi(bvar::Variable::describe_exposed("bthread_worker_count").c_str());
+}
+
+static butil::atomic<int> nrun(0);
+
+static void* yield_and_count(void*) {
+    for (int i = 0; i < 100; ++i) {
+        bthread_yield();
+        if (i % 10 == 0) {
+            bthread_usleep(100);
+        }
+    }
+    nrun.fetch_add(1);
+    return NULL;
+}
+
+TEST(BthreadTest, reduce_concurrency_with_running_bthread) {
+    const int conn = bthread_getconcurrency();
+    ASSERT_EQ(0, bthread_setconcurrency(conn + 16));
+    ASSERT_EQ(conn + 16, bthread_getconcurrency());
+    std::vector<bthread_t> tids;
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        bthread_t tid;
+        ASSERT_EQ(0, bthread_start_background(
+                      &tid, &BTHREAD_ATTR_SMALL, yield_and_count, NULL));
+        tids.push_back(tid);
+    }
+    // Retire workers while they're running bthreads.
+    ASSERT_EQ(0, bthread_setconcurrency(conn));
+    ASSERT_EQ(conn, bthread_getconcurrency());
+    ASSERT_EQ(conn, bthread::g_task_control->concurrency());
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    ASSERT_EQ(N, nrun.load());
+    // Retired workers quit after running bthreads left in their runqueues.
+    for (int i = 0; i < 500 && get_worker_count() != conn; ++i) {
+        usleep(10000);
+    }
+    ASSERT_EQ(conn, get_worker_count());
+
+    // Remaining workers still run new bthreads, which can be created from
+    // non-workers in batch.
+    nrun.store(0);
+    tids.resize(N);
+    std::vector<void*> args(N, (void*)NULL);
+    ASSERT_EQ(0, bthread_start_batch(&tids[0], N, NULL,
+                                     yield_and_count, &args[0]));
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    ASSERT_EQ(N, nrun.load());
+
+    // Add workers back.
+    ASSERT_EQ(0, bthread_setconcurrency(conn + 2));
+    ASSERT_EQ(conn + 2, bthread::g_task_control->concurrency());
+    for (int i = 0; i < 500 && get_worker_count() != conn + 2; ++i) {
+        usleep(10000);
+    }
+    ASSERT_EQ(conn + 2, get_worker_count());
+    ASSERT_EQ(0, bthread_setconcurrency(conn));
+}
+
 void* sleep_proc(void*) {
     usleep(100000);
     return NULL;
@@ -7,6 +7,7 @@
 #include "bthread/timer_thread.h"
 #include "bthread/bthread.h"
 #include "butil/logging.h"
+#include "butil/macros.h"
 
 namespace {
 
@@ -240,4 +241,97 @@ TEST(TimerThreadTest, schedule_and_unschedule_in_task) {
     keeper5.expect_first_run();
 }
 
+TEST(TimerThreadTest, timing_wheel) {
+    bthread::TimerThreadOptions options;
+    options.use_timing_wheel = true;
+    options.num_threads = 2;
+    bthread::TimerThread timer_thread;
+    ASSERT_EQ(0, timer_thread.start(&options));
+
+    timespec past_time = { 0, 0 };
+    timespec future_time = { std::numeric_limits<int>::max(), 0 };
+    TimeKeeper keeper1(past_time, "keeper1");
+    TimeKeeper keeper2(butil::milliseconds_from_now(10), "keeper2");
+    TimeKeeper keeper3(butil::milliseconds_from_now(300), "keeper3");
+    TimeKeeper keeper4(butil::milliseconds_from_now(300), "keeper4");
+    // Cascaded from upper levels of the wheel.
+    TimeKeeper keeper5(butil::milliseconds_from_now(1500), "keeper5");
+    TimeKeeper keeper6(future_time, "keeper6");
+    keeper1.schedule(&timer_thread);
+    const timespec keeper1_addtime = butil::seconds_from_now(0);
+    keeper2.schedule(&timer_thread);
+    keeper3.schedule(&timer_thread);
+    keeper4.schedule(&timer_thread);
+    keeper5.schedule(&timer_thread);
+    keeper6.schedule(&timer_thread);
+    ASSERT_EQ(0, timer_thread.unschedule(keeper4._task_id));
+    ASSERT_EQ(0, timer_thread.unschedule(keeper6._task_id));
+
+    sleep(2);
+    timer_thread.stop_and_join();
+    keeper1.expect_first_run(keeper1_addtime);
+    keeper2.expect_first_run();
+    keeper3.expect_first_run();
+    keeper4.expect_not_run();
+    keeper5.expect_first_run();
+    keeper6.expect_not_run();
+}
+
+static void noop(void*) {}
+
+struct ScheduleArg {
+    bthread::TimerThread* timer_thread;
+    int64_t elapsed_ns;
+};
+
+static void* schedule_and_unschedule(void* void_arg) {
+    ScheduleArg* arg = (ScheduleArg*)void_arg;
+    const size_t N = 100000;
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < N; ++i) {
+        // Like timeouts of RPC which are mostly unscheduled before running.
+        const bthread::TimerThread::TaskId id = arg->timer_thread->schedule(
+            noop, NULL, butil::milliseconds_from_now(500 + i % 1000));
+        arg->timer_thread->unschedule(id);
+    }
+    tm.stop();
+    arg->elapsed_ns = tm.n_elapsed() / N;
+    return NULL;
+}
+
+TEST(TimerThreadTest, perf_cmp_heap_and_timing_wheel) {
+    const bool use_timing_wheel[] = { false, true, true };
+    const size_t num_threads[] = { 1, 1, 4 };
+    for (size_t i = 0; i < ARRAY_SIZE(num_threads); ++i) {
+        bthread::TimerThreadOptions options;
+        options.use_timing_wheel = use_timing_wheel[i];
+        options.num_threads = num_threads[i];
+        bthread::TimerThread timer_thread;
+        ASSERT_EQ(0, timer_thread.start(&options));
+        pthread_t th[4];
+        ScheduleArg args[ARRAY_SIZE(th)];
+        for (size_t j = 0; j < ARRAY_SIZE(th); ++j) {
+            args[j].timer_thread = &timer_thread;
+            args[j].elapsed_ns = 0;
+            ASSERT_EQ(0, pthread_create(&th[j], NULL,
+                                        schedule_and_unschedule, &args[j]));
+        }
+        int64_t elapsed_ns = 0;
+        for (size_t j = 0; j < ARRAY_SIZE(th); ++j) {
+            pthread_join(th[j], NULL);
+            elapsed_ns += args[j].elapsed_ns;
+        }
+        // A task running soon measures the delay of the timer threads.
+        TimeKeeper keeper(butil::milliseconds_from_now(1), "keeper");
+        keeper.schedule(&timer_thread);
+        usleep(100000);
+        timer_thread.stop_and_join();
+        keeper.expect_first_run();
+        LOG(INFO) << (use_timing_wheel[i] ? "timing wheel" : "heap")
+                  << " with " << num_threads[i] << " threads: schedule+"
+                  "unschedule takes " << elapsed_ns / ARRAY_SIZE(th) << "ns";
+    }
+}
+
 } // end namespace
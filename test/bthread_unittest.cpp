@@ -6,12 +6,22 @@
 #include <gtest/gtest.h>
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "butil/atomicops.h"
 #include "butil/logging.h"
 #include "butil/logging.h"
 #include "butil/gperftools_profiler.h"
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
 #include "bthread/task_meta.h"
+#include "bthread/task_group.h"
+#include "bthread/task_control.h"
+#include "bthread/stack.h"
+#include "bvar/variable.h"
+
+namespace bthread {
+extern __thread TaskGroup* tls_task_group;
+extern TaskControl* g_task_control;
+}
 
 namespace {
 class BthreadTest : public ::testing::Test{
@@ -507,6 +517,64 @@ TEST_F(BthreadTest, too_many_nosignal_threads) {
     }
 }
 
+void* start_burst_of_bthreads(void* arg) {
+    std::vector<bthread_t>* tids = (std::vector<bthread_t>*)arg;
+    // All bthreads are pushed into runqueue of this worker before any of
+    // them runs.
+    for (size_t i = 0; i < tids->size(); ++i) {
+        bthread_attr_t attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
+        EXPECT_EQ(0, bthread_start_background(&(*tids)[i], &attr,
+                                              dummy_thread, NULL));
+    }
+    bthread_flush();
+    return NULL;
+}
+
+TEST_F(BthreadTest, burst_grows_runqueue) {
+    std::vector<bthread_t> tids(100000);
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, start_burst_of_bthreads,
+                                          &tids));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    for (size_t i = 0; i < tids.size(); ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+    }
+    bthread::TaskControl* c = bthread::g_task_control;
+    ASSERT_GT(c->_rq_grows.get_value(), 0);
+    ASSERT_EQ(0, c->_rq_fulls.get_value());
+}
+
+int64_t get_exposed_int(const char* name) {
+    return atoll(bvar::Variable::describe_exposed(name).c_str());
+}
+
+void* use_deep_stack(void*) {
+    char buf[256 * 1024];
+    memset(buf, 1, sizeof(buf));
+    asm volatile("" : : "r"(buf) : "memory");
+    return NULL;
+}
+
+TEST_F(BthreadTest, reclaim_stack) {
+    FLAGS_stack_reclaim_threshold = 65536;
+    FLAGS_stack_usage_sample_interval = 1;
+    const int64_t nreclaim = get_exposed_int("bthread_stack_reclaim_count");
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, use_deep_stack, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // The stack is inspected after joiners are woken up.
+    for (int i = 0; i < 100 &&
+             get_exposed_int("bthread_stack_reclaim_count") == nreclaim; ++i) {
+        usleep(10000);
+    }
+    ASSERT_LT(nreclaim, get_exposed_int("bthread_stack_reclaim_count"));
+    ASSERT_GT(get_exposed_int("bthread_stack_resident_memory"), 0);
+    ASSERT_FALSE(bvar::Variable::describe_exposed(
+                     "bthread_stack_usage_max").empty());
+    FLAGS_stack_reclaim_threshold = 0;
+    FLAGS_stack_usage_sample_interval = 0;
+}
+
 static void* yield_thread(void*) {
     bthread_yield();
     return NULL;
@@ -518,4 +586,203 @@ TEST_F(BthreadTest, yield_single_thread) {
     ASSERT_EQ(0, bthread_join(tid, NULL));
 }
 
+struct PriorityArg {
+    butil::atomic<int>* nrun;
+    int order;
+};
+
+void* record_order(void* arg) {
+    PriorityArg* a = (PriorityArg*)arg;
+    a->order = a->nrun->fetch_add(1);
+    return NULL;
+}
+
+const int NPRIORITY_TASK = 10;
+
+void* start_tasks_of_different_priorities(void* arg) {
+    PriorityArg* args = (PriorityArg*)arg;
+    bthread_t th[NPRIORITY_TASK * 2];
+    // Tasks are put into runqueue of this worker without signalling other
+    // workers, normal ones first.
+    for (int i = 0; i < NPRIORITY_TASK * 2; ++i) {
+        bthread_attr_t attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
+        if (i >= NPRIORITY_TASK) {
+            attr = attr | BTHREAD_PRIORITY_HIGH;
+        }
+        EXPECT_EQ(0, bthread_start_background(&th[i], &attr, record_order,
+                                              &args[i]));
+    }
+    // Blocking on the first normal task runs all the tasks in this worker.
+    for (int i = 0; i < NPRIORITY_TASK * 2; ++i) {
+        bthread_join(th[i], NULL);
+    }
+    return NULL;
+}
+
+TEST_F(BthreadTest, high_priority_runs_first) {
+    ASSERT_EQ(EPERM, bthread_set_high_priority(1));
+    butil::atomic<int> nrun(0);
+    PriorityArg args[NPRIORITY_TASK * 2];
+    for (int i = 0; i < NPRIORITY_TASK * 2; ++i) {
+        args[i].nrun = &nrun;
+        args[i].order = -1;
+    }
+    bthread_t tid;
+    ASSERT_EQ(0, bthread_start_urgent(
+                  &tid, NULL, start_tasks_of_different_priorities, args));
+    ASSERT_EQ(0, bthread_join(tid, NULL));
+    ASSERT_EQ(NPRIORITY_TASK * 2, nrun.load());
+    for (int i = NPRIORITY_TASK; i < NPRIORITY_TASK * 2; ++i) {
+        ASSERT_LT(args[i].order, NPRIORITY_TASK) << "i=" << i;
+    }
+}
+
+void* get_self_tag(void* arg) {
+    *(bthread_tag_t*)arg = bthread_self_tag();
+    return NULL;
+}
+
+TEST_F(BthreadTest, tags) {
+    ASSERT_EQ(BTHREAD_TAG_INVALID, bthread_self_tag());
+    ASSERT_GT(bthread_getconcurrency_by_tag(BTHREAD_TAG_DEFAULT), 0);
+    ASSERT_EQ(-1, bthread_getconcurrency_by_tag(BTHREAD_MAX_TAG_NUM));
+    ASSERT_EQ(EINVAL, bthread_setconcurrency_by_tag(1, BTHREAD_MAX_TAG_NUM));
+    ASSERT_EQ(EPERM, bthread_setconcurrency_by_tag(0, BTHREAD_TAG_DEFAULT));
+
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = BTHREAD_MAX_TAG_NUM;
+    bthread_t tid;
+    bthread_tag_t tag = BTHREAD_TAG_INVALID;
+    ASSERT_EQ(EINVAL, bthread_start_background(&tid, &attr, get_self_tag, &tag));
+
+    attr.tag = BTHREAD_TAG_DEFAULT;
+    ASSERT_EQ(0, bthread_start_background(&tid, &attr, get_self_tag, &tag));
+    ASSERT_EQ(0, bthread_join(tid, NULL));
+    ASSERT_EQ(BTHREAD_TAG_DEFAULT, tag);
+}
+
+void* add_one(void* arg) {
+    ((butil::atomic<int>*)arg)->fetch_add(1);
+    return NULL;
+}
+
+void* start_batch_and_join(void* arg) {
+    const size_t N = 100;
+    bthread_t tids[N];
+    void* args[N];
+    for (size_t i = 0; i < N; ++i) {
+        args[i] = arg;
+    }
+    EXPECT_EQ(0, bthread_start_batch(tids, N, NULL, add_one, args));
+    for (size_t i = 0; i < N; ++i) {
+        EXPECT_EQ(0, bthread_join(tids[i], NULL));
+    }
+    return NULL;
+}
+
+TEST_F(BthreadTest, start_batch) {
+    butil::atomic<int> nrun(0);
+    // From non-worker
+    start_batch_and_join(&nrun);
+    ASSERT_EQ(100, nrun.load());
+    // From worker
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL, start_batch_and_join, &nrun));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(200, nrun.load());
+
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = BTHREAD_MAX_TAG_NUM;
+    bthread_t tids[2] = { 1, 1 };
+    void* args[2] = { &nrun, &nrun };
+    ASSERT_EQ(EINVAL, bthread_start_batch(tids, 2, &attr, add_one, args));
+    ASSERT_EQ(INVALID_BTHREAD, tids[0]);
+    ASSERT_EQ(INVALID_BTHREAD, tids[1]);
+}
+
+void* check_shared_stack(void* arg) {
+    // Runs on stack of the worker.
+    *(bool*)arg = bthread::tls_task_group->is_current_pthread_task();
+    return NULL;
+}
+
+TEST_F(BthreadTest, shared_stack) {
+    bool on_worker_stack = false;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(
+                  &th, &BTHREAD_ATTR_SHARED, check_shared_stack, &on_worker_stack));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_TRUE(on_worker_stack);
+
+    on_worker_stack = true;
+    ASSERT_EQ(0, bthread_start_background(
+                  &th, &BTHREAD_ATTR_SMALL, check_shared_stack, &on_worker_stack));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_FALSE(on_worker_stack);
+}
+
+struct StartAndJoinArg {
+    const bthread_attr_t* attr;
+    int64_t elapsed_ns;
+};
+
+void* start_and_join_many(void* void_arg) {
+    StartAndJoinArg* arg = (StartAndJoinArg*)void_arg;
+    const size_t N = 10000;
+    std::vector<bthread_t> tids(N);
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < N; ++i) {
+        EXPECT_EQ(0, bthread_start_background(&tids[i], arg->attr, dummy_thread, NULL));
+    }
+    for (size_t i = 0; i < N; ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    tm.stop();
+    arg->elapsed_ns = tm.n_elapsed() / N;
+    return NULL;
+}
+
+TEST_F(BthreadTest, shared_stack_perf) {
+    const bthread_attr_t* attrs[] = { &BTHREAD_ATTR_SMALL, &BTHREAD_ATTR_SHARED };
+    const char* names[] = { "small", "shared" };
+    for (size_t i = 0; i < ARRAY_SIZE(attrs); ++i) {
+        StartAndJoinArg arg = { attrs[i], 0 };
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_urgent(&th, NULL, start_and_join_many, &arg));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        LOG(INFO) << "Creating and running a bthread with " << names[i]
+                  << " stack takes " << arg.elapsed_ns << "ns";
+    }
+}
+
+void* check_self_stat(void* arg) {
+    bthread_stat_t* stats = (bthread_stat_t*)arg;
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    while (butil::cpuwide_time_ns() - start_ns < 5000000L) {}
+    EXPECT_EQ(0, bthread_self_stat(&stats[0]));
+    bthread_yield();
+    EXPECT_EQ(0, bthread_self_stat(&stats[1]));
+    return NULL;
+}
+
+TEST_F(BthreadTest, self_stat) {
+    bthread_stat_t stat;
+    ASSERT_EQ(EPERM, bthread_self_stat(&stat));
+
+    bthread_stat_t stats[2];
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, check_self_stat, stats));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // Waited in the runqueue once before the first run.
+    ASSERT_GT(stats[0].queue_ns, 0);
+    ASSERT_EQ(stats[0].queue_ns, stats[0].last_queue_ns);
+    ASSERT_GE(stats[0].cputime_ns, 5000000L);
+    // bthread_yield() pushed the bthread into the runqueue again.
+    ASSERT_GT(stats[1].nswitch, stats[0].nswitch);
+    ASSERT_GT(stats[1].last_queue_ns, 0);
+    ASSERT_EQ(stats[0].queue_ns + stats[1].last_queue_ns, stats[1].queue_ns);
+    ASSERT_GE(stats[1].cputime_ns, stats[0].cputime_ns);
+}
+
 } // namespace
@@ -113,4 +113,70 @@ TEST(WSQTest, sanity) {
               << " popped=" << npopped
               << " left=" << (N - nstolen - npopped)  << std::endl;
 }
+
+void* grow_push_thread(void* arg) {
+    bthread::WorkStealingQueue<value_type> *q =
+        (bthread::WorkStealingQueue<value_type>*)arg;
+    for (value_type i = 0; i < N; ++i) {
+        while (!q->push(i)) {
+            if (!q->grow()) {
+                sched_yield();
+            }
+        }
+    }
+    g_stop = true;
+    return NULL;
+}
+
+TEST(WSQTest, grow_while_stealing) {
+    bthread::WorkStealingQueue<value_type> q;
+    ASSERT_EQ(-1, q.init(CAP, CAP * 3));
+    ASSERT_EQ(0, q.init(CAP, CAP * 1024));
+    g_stop = false;
+    pthread_t rth[4];
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        ASSERT_EQ(0, pthread_create(&rth[i], NULL, steal_thread, &q));
+    }
+    pthread_t wth;
+    ASSERT_EQ(0, pthread_create(&wth, NULL, grow_push_thread, &q));
+    std::vector<value_type> values;
+    values.reserve(N);
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        std::vector<value_type>* res = NULL;
+        pthread_join(rth[i], (void**)&res);
+        values.insert(values.end(), res->begin(), res->end());
+        delete res;
+    }
+    pthread_join(wth, NULL);
+    value_type val;
+    while (q.pop(&val)) {
+        values.push_back(val);
+    }
+    ASSERT_GT(q.capacity(), CAP);
+    ASSERT_LE(q.capacity(), CAP * 1024);
+    ASSERT_EQ(N, values.size());
+    std::sort(values.begin(), values.end());
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(i, values[i]);
+    }
+
+    // Full at max_capacity.
+    bthread::WorkStealingQueue<value_type> q2;
+    ASSERT_EQ(0, q2.init(CAP, CAP * 2));
+    for (value_type i = 0; i < CAP; ++i) {
+        ASSERT_TRUE(q2.push(i));
+    }
+    ASSERT_FALSE(q2.push(CAP));
+    ASSERT_TRUE(q2.grow());
+    ASSERT_EQ(CAP * 2, q2.capacity());
+    for (value_type i = CAP; i < CAP * 2; ++i) {
+        ASSERT_TRUE(q2.push(i));
+    }
+    ASSERT_FALSE(q2.push(CAP * 2));
+    ASSERT_FALSE(q2.grow());
+    for (value_type i = CAP * 2; i > 0; --i) {
+        ASSERT_TRUE(q2.pop(&val));
+        ASSERT_EQ(i - 1, val);
+    }
+}
 } // namespace
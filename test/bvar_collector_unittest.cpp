@@ -0,0 +1,98 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/atomicops.h"
+#include "bvar/collector.h"
+
+namespace bvar {
+DECLARE_int32(bvar_collector_max_pending_samples);
+}
+
+namespace {
+
+int32_t g_slow_expected_per_second = 50;
+int32_t g_fast_expected_per_second = 500;
+
+bvar::CollectorSpeedLimit g_slow_sl =
+    BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH(&g_slow_expected_per_second, 0);
+bvar::CollectorSpeedLimit g_fast_sl =
+    BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH(&g_fast_expected_per_second, 0);
+bvar::CollectorSpeedLimit g_low_sl =
+    BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH(&g_fast_expected_per_second, 0);
+bvar::CollectorSpeedLimit g_high_sl =
+    BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER_WITH(&g_fast_expected_per_second, 1);
+
+butil::atomic<int> g_ndumped[4];
+
+class TestSample : public bvar::Collected {
+public:
+    TestSample(int type, int dump_us) : _type(type), _dump_us(dump_us) {}
+    void dump_and_destroy(size_t) {
+        g_ndumped[_type].fetch_add(1, butil::memory_order_relaxed);
+        if (_dump_us) {
+            usleep(_dump_us);
+        }
+        delete this;
+    }
+    void destroy() { delete this; }
+    bvar::CollectorSpeedLimit* speed_limit() {
+        static bvar::CollectorSpeedLimit* const sls[] = {
+            &g_slow_sl, &g_fast_sl, &g_low_sl, &g_high_sl };
+        return sls[_type];
+    }
+private:
+    int _type;
+    int _dump_us;
+};
+
+TEST(CollectorTest, separate_budgets) {
+    butil::Timer tm;
+    tm.start();
+    int64_t nsubmit[2] = { 0, 0 };
+    do {
+        for (int type = 0; type < 2; ++type) {
+            TestSample tmp(type, 0);
+            if (bvar::is_collectable(tmp.speed_limit())) {
+                (new TestSample(type, 0))->submit();
+                ++nsubmit[type];
+            }
+        }
+        usleep(50);
+        tm.stop();
+    } while (tm.m_elapsed() < 3000);
+    usleep(200000);
+    LOG(INFO) << "submitted=" << nsubmit[0] << "/" << nsubmit[1]
+              << " dumped=" << g_ndumped[0].load() << "/" << g_ndumped[1].load()
+              << " sampling_range=" << g_slow_sl.sampling_range
+              << "/" << g_fast_sl.sampling_range;
+    // Sampling ranges are adjusted separately.
+    ASSERT_LT(g_slow_sl.sampling_range, g_fast_sl.sampling_range);
+    ASSERT_LT(nsubmit[0] * 2, nsubmit[1]);
+}
+
+TEST(CollectorTest, drop_lower_priority_first) {
+    const int32_t saved_max_pending = bvar::FLAGS_bvar_collector_max_pending_samples;
+    bvar::FLAGS_bvar_collector_max_pending_samples = 20;
+    butil::Timer tm;
+    tm.start();
+    do {
+        // Both are more than dump_thread can handle.
+        for (int i = 0; i < 10; ++i) {
+            (new TestSample(2, 1000))->submit();
+            (new TestSample(3, 1000))->submit();
+        }
+        usleep(10000);
+        tm.stop();
+    } while (tm.m_elapsed() < 1000);
+    bvar::FLAGS_bvar_collector_max_pending_samples = saved_max_pending;
+    const int64_t nlow = g_low_sl.ndropped.load(butil::memory_order_relaxed);
+    const int64_t nhigh = g_high_sl.ndropped.load(butil::memory_order_relaxed);
+    LOG(INFO) << "dropped low=" << nlow << " high=" << nhigh;
+    ASSERT_GT(nlow, 0);
+    ASSERT_LT(nhigh, nlow);
+}
+
+} // namespace
@@ -0,0 +1,149 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <math.h>
+#include <limits>
+#include <algorithm>
+#include <sstream>
+#include <gtest/gtest.h>
+#include "butil/fast_rand.h"
+#include "bvar/bvar.h"
+#include "bvar/detail/compressed_series.h"
+
+namespace {
+
+using bvar::detail::CompressedStream;
+
+TEST(CompressedSeriesTest, integers) {
+    std::vector<uint64_t> expected;
+    CompressedStream s(false, 100000);
+    int64_t v = 0;
+    for (int i = 0; i < 10000; ++i) {
+        switch (i % 5) {
+        case 0: v += 1; break;
+        case 1: v += butil::fast_rand_less_than(100); break;
+        case 2: v -= butil::fast_rand_less_than(100000); break;
+        case 3: v = (int64_t)butil::fast_rand(); break;
+        default: break;
+        }
+        if (i == 5000) {
+            v = std::numeric_limits<int64_t>::min();
+        } else if (i == 5001) {
+            v = std::numeric_limits<int64_t>::max();
+        }
+        s.append((uint64_t)v);
+        expected.push_back((uint64_t)v);
+    }
+    std::vector<uint64_t> values;
+    s.get_values(&values);
+    ASSERT_EQ(expected, values);
+}
+
+TEST(CompressedSeriesTest, floating_points) {
+    std::vector<uint64_t> expected;
+    CompressedStream s(true, 100000);
+    const double specials[] = {
+        0.0, -0.0, 1.5, std::numeric_limits<double>::infinity(),
+        std::numeric_limits<double>::quiet_NaN(),
+        std::numeric_limits<double>::min(), 1e300 };
+    double d = 0;
+    for (int i = 0; i < 10000; ++i) {
+        if (i % 3 == 0) {
+            d += butil::fast_rand_less_than(1000) / 7.0;
+        } else if (i % 7 == 0) {
+            d = specials[i % ARRAY_SIZE(specials)];
+        }
+        const uint64_t bits = bvar::detail::SeriesBits<double>::to_bits(d);
+        s.append(bits);
+        expected.push_back(bits);
+    }
+    std::vector<uint64_t> values;
+    s.get_values(&values);
+    ASSERT_EQ(expected, values);
+}
+
+TEST(CompressedSeriesTest, retention) {
+    CompressedStream s(false, 100);
+    for (int i = 0; i < 100000; ++i) {
+        s.append(butil::fast_rand());
+        ASSERT_EQ(std::min(i + 1, 100), (int)s.size());
+    }
+    const size_t bytes = s.chunk_bytes();
+    std::vector<uint64_t> values;
+    for (int i = 0; i < 1000; ++i) {
+        s.append(i * 3);
+    }
+    s.get_values(&values);
+    ASSERT_EQ(100u, values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+        ASSERT_EQ((900 + i) * 3, values[i]);
+    }
+    // Old chunks are dropped and a steady counter costs 1 bit per value.
+    ASSERT_LE(s.chunk_bytes(), bytes);
+    ASSERT_LE(s.chunk_bytes(), 128u);
+}
+
+template <typename T>
+void check_same_as_series(T (*gen)(int)) {
+    typedef bvar::detail::AddTo<T> Op;
+    bvar::detail::Series<T, Op> series((Op()));
+    bvar::detail::CompressedSeries<T, Op> compressed((Op()));
+    bvar::SeriesOptions options;
+    // Including the partially filled levels.
+    for (int i = 0; i < 60 * 60 * 30; ++i) {
+        const T v = gen(i);
+        series.append(v);
+        compressed.append(v);
+        if (i == 10 || i == 4000 || i % 20000 == 0) {
+            std::ostringstream os1;
+            std::ostringstream os2;
+            series.describe(os1, NULL);
+            compressed.describe(os2, options);
+            ASSERT_EQ(os1.str(), os2.str()) << "i=" << i;
+        }
+    }
+    LOG(INFO) << "CompressedSeries takes " << compressed.chunk_bytes()
+              << " bytes for chunks, sizeof(Series)=" << sizeof(series);
+
+    options.fixed_length = false;
+    std::ostringstream os;
+    compressed.describe(os, options);
+    // 1 day, 30 hours, 1800 minutes and 108000 seconds were appended, the
+    // last value is at x = number of all retained values - 1.
+    const int nretained =
+        std::min(1, (int)bvar::FLAGS_bvar_compressed_series_days) +
+        std::min(30, (int)bvar::FLAGS_bvar_compressed_series_hours) +
+        std::min(1800, (int)bvar::FLAGS_bvar_compressed_series_minutes) +
+        std::min(108000, (int)bvar::FLAGS_bvar_compressed_series_seconds);
+    std::ostringstream last;
+    last << ",[" << nretained - 1 << ',' << gen(60 * 60 * 30 - 1) << "]]}";
+    ASSERT_NE(std::string::npos, os.str().find(last.str())) << os.str();
+}
+
+int64_t gen_int(int i) {
+    return (i % 100 == 0 ? i * 2 : i);
+}
+
+double gen_double(int i) {
+    return (i % 1000) / 8.0;
+}
+
+TEST(CompressedSeriesTest, same_as_series) {
+    check_same_as_series<int64_t>(gen_int);
+    check_same_as_series<double>(gen_double);
+}
+
+TEST(CompressedSeriesTest, exposed_bvar) {
+    const bool saved = bvar::FLAGS_bvar_compress_series;
+    bvar::FLAGS_bvar_compress_series = true;
+    bvar::Adder<int64_t> adder("compressed_series_adder");
+    bvar::FLAGS_bvar_compress_series = saved;
+    adder << 1;
+    std::ostringstream os;
+    bvar::SeriesOptions options;
+    options.fixed_length = false;
+    ASSERT_EQ(0, bvar::Variable::describe_series_exposed(
+                  "compressed_series_adder", os, options));
+    ASSERT_EQ(0u, os.str().find("{\"label\":\"trend\",\"data\":["));
+}
+
+}  // namespace
@@ -7,6 +7,9 @@
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
 
 class FileDumperTest : public testing::Test {
 protected:
@@ -24,3 +27,51 @@ TEST_F(FileDumperTest, filters) {
     GFLAGS_NS::SetCommandLineOption("bvar_dump", "true");
     sleep(2);
 }
+
+static int count_lines(const std::string& filename, const std::string& head) {
+    std::ifstream fin(filename.c_str());
+    int n = 0;
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.compare(0, head.size(), head) == 0) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+TEST_F(FileDumperTest, incremental) {
+    bvar::Adder<int> changed("file_dumper_changed");
+    bvar::Adder<int> unchanged("file_dumper_unchanged");
+    char dir[] = "/tmp/bvar_file_dumper_XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    const std::string filename = std::string(dir) + "/bvar.data";
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_file", filename.c_str());
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_include", "file_dumper_*");
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_prefix", "");
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_incremental", "true");
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_full_interval", "100");
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_interval", "1");
+    GFLAGS_NS::SetCommandLineOption("bvar_dump", "true");
+    for (int i = 0; i < 20; ++i) {
+        changed << 1;
+        usleep(200000);
+    }
+    GFLAGS_NS::SetCommandLineOption("bvar_dump", "false");
+    // Unchanged value is only written by the first dump while changed
+    // values are appended.
+    ASSERT_EQ(1, count_lines(filename, "file_dumper_unchanged : "));
+    ASSERT_LE(2, count_lines(filename, "file_dumper_changed : "));
+
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_incremental", "false");
+    GFLAGS_NS::SetCommandLineOption("bvar_dump", "true");
+    sleep(2);
+    GFLAGS_NS::SetCommandLineOption("bvar_dump", "false");
+    // All values are rewritten.
+    ASSERT_EQ(1, count_lines(filename, "file_dumper_unchanged : "));
+    ASSERT_EQ(1, count_lines(filename, "file_dumper_changed : "));
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_include", "");
+    GFLAGS_NS::SetCommandLineOption("bvar_dump_prefix", "<app>");
+    unlink(filename.c_str());
+    rmdir(dir);
+}
@@ -0,0 +1,133 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "butil/string_printf.h"
+#include "bvar/bvar.h"
+
+namespace {
+
+typedef bvar::MultiDimension<bvar::Adder<int64_t> > MAdder;
+
+MAdder::key_type make_key(const std::string& v1, const std::string& v2) {
+    MAdder::key_type key;
+    key.push_back(v1);
+    key.push_back(v2);
+    return key;
+}
+
+MAdder::key_type make_labels() {
+    return make_key("method", "code");
+}
+
+TEST(MultiDimensionTest, sanity) {
+    MAdder m("bvar_multi_dimension_sanity", make_labels());
+    ASSERT_EQ(0u, m.count_stats());
+    ASSERT_EQ(2u, m.labels().size());
+    bvar::Adder<int64_t>* echo0 = m.get_stats(make_key("Echo", "0"));
+    ASSERT_TRUE(echo0);
+    ASSERT_EQ(echo0, m.get_stats(make_key("Echo", "0")));
+    bvar::Adder<int64_t>* get1 = m.get_stats(make_key("Get", "1"));
+    ASSERT_TRUE(get1);
+    ASSERT_NE(echo0, get1);
+    ASSERT_EQ(2u, m.count_stats());
+    ASSERT_TRUE(m.has_stats(make_key("Get", "1")));
+    ASSERT_FALSE(m.has_stats(make_key("Get", "0")));
+    // Stats are not exposed individually.
+    ASSERT_TRUE(echo0->name().empty());
+
+    *echo0 << 1 << 2;
+    *get1 << 10;
+    ASSERT_EQ(3, echo0->get_value());
+    ASSERT_EQ("{method=\"Echo\",code=\"0\"}:3 {method=\"Get\",code=\"1\"}:10",
+              bvar::Variable::describe_exposed("bvar_multi_dimension_sanity"));
+
+    std::vector<MAdder::key_type> keys;
+    m.list_stats(&keys);
+    ASSERT_EQ(2u, keys.size());
+    ASSERT_EQ(make_key("Echo", "0"), keys[0]);
+    ASSERT_EQ(make_key("Get", "1"), keys[1]);
+
+    // Mismatched label values.
+    MAdder::key_type bad_key;
+    bad_key.push_back("Echo");
+    ASSERT_EQ(NULL, m.get_stats(bad_key));
+}
+
+TEST(MultiDimensionTest, escape_label_values) {
+    MAdder m(make_labels());
+    *m.get_stats(make_key("a\"b", "c\\d")) << 1;
+    ASSERT_EQ("{method=\"a\\\"b\",code=\"c\\\\d\"}:1", m.get_description());
+}
+
+TEST(MultiDimensionTest, overflow) {
+    MAdder m(make_labels());
+    m.set_max_stats_count(3);
+    for (int i = 0; i < 3; ++i) {
+        *m.get_stats(make_key("Echo", butil::string_printf("%d", i))) << 1;
+    }
+    bvar::Adder<int64_t>* overflow = m.get_stats(make_key("Echo", "3"));
+    ASSERT_TRUE(overflow);
+    ASSERT_EQ(overflow, m.get_stats(make_key("Echo", "4")));
+    ASSERT_EQ(3u, m.count_stats());
+    ASSERT_FALSE(m.has_stats(make_key("Echo", "3")));
+    *overflow << 5;
+    *m.get_stats(make_key("Echo", "5")) << 5;
+    // Existing stats are still available.
+    *m.get_stats(make_key("Echo", "1")) << 1;
+    ASSERT_EQ("{method=\"Echo\",code=\"0\"}:1 {method=\"Echo\",code=\"1\"}:2 "
+              "{method=\"Echo\",code=\"2\"}:1 "
+              "{method=\"__overflow__\",code=\"__overflow__\"}:10",
+              m.get_description());
+    // Raising the limit allows new stats again.
+    m.set_max_stats_count(4);
+    ASSERT_NE(overflow, m.get_stats(make_key("Echo", "6")));
+    ASSERT_EQ(4u, m.count_stats());
+}
+
+const int NUM_OPS_PER_THREAD = 100000;
+const int NUM_KEYS = 10;
+
+void* add_to_stats(void* arg) {
+    MAdder* m = (MAdder*)arg;
+    for (int i = 0; i < NUM_OPS_PER_THREAD; ++i) {
+        *m->get_stats(make_key("Echo", butil::string_printf("%d", i % NUM_KEYS))) << 1;
+    }
+    return NULL;
+}
+
+TEST(MultiDimensionTest, multi_threaded) {
+    MAdder m(make_labels());
+    pthread_t th[8];
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, add_to_stats, &m));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    tm.stop();
+    LOG(INFO) << "get_stats and add takes "
+              << tm.n_elapsed() / (double)(ARRAY_SIZE(th) * NUM_OPS_PER_THREAD)
+              << "ns";
+    ASSERT_EQ((size_t)NUM_KEYS, m.count_stats());
+    for (int i = 0; i < NUM_KEYS; ++i) {
+        ASSERT_EQ((int64_t)(ARRAY_SIZE(th) * NUM_OPS_PER_THREAD / NUM_KEYS),
+                  m.get_stats(make_key("Echo", butil::string_printf("%d", i)))
+                  ->get_value());
+    }
+}
+
+TEST(MultiDimensionTest, latency_recorder) {
+    bvar::MultiDimension<bvar::LatencyRecorder> m(make_labels());
+    bvar::LatencyRecorder* rec = m.get_stats(make_key("Echo", "0"));
+    ASSERT_TRUE(rec);
+    *rec << 10 << 20;
+    ASSERT_EQ(2, rec->count());
+    ASSERT_NE(std::string::npos,
+              m.get_description().find("{method=\"Echo\",code=\"0\"}:{latency="));
+}
+
+} // namespace
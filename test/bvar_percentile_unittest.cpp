@@ -5,7 +5,10 @@
 
 #include "bvar/detail/percentile.h"
 #include "butil/logging.h"
+#include "butil/time.h"
+#include "butil/fast_rand.h"
 #include <gtest/gtest.h>
+#include <pthread.h>
 #include <fstream>
 
 class PercentileTest : public testing::Test {
@@ -172,3 +175,142 @@ TEST_F(PercentileTest, combine_of) {
                   
     }
 }
+
+// Exact `ratio'-ile value of sorted `v' in the same rank as get_number().
+static uint32_t exact_number(const std::vector<uint32_t>& v, double ratio) {
+    size_t n = (size_t)ceil(ratio * v.size());
+    if (n > v.size()) {
+        n = v.size();
+    }
+    return n ? v[n - 1] : 0;
+}
+
+static const double SKETCH_MAX_ERROR =
+    1.0 / (2 * bvar::detail::PercentileSketch::NUM_SUB_BUCKETS);
+
+TEST_F(PercentileTest, sketch_accuracy) {
+    bvar::detail::PercentileSketch sketch;
+    std::vector<uint32_t> values;
+    const int N = 100000;
+    for (int i = 0; i < N; ++i) {
+        // Long-tail distribution ranging from 1 to ~10^9
+        const uint32_t x = (uint32_t)exp(butil::fast_rand_double() * 21);
+        sketch.add32(x);
+        values.push_back(x);
+    }
+    sketch.add32(0);
+    values.push_back(0);
+    sketch.add32(std::numeric_limits<uint32_t>::max());
+    values.push_back(std::numeric_limits<uint32_t>::max());
+    std::sort(values.begin(), values.end());
+    ASSERT_EQ(values.size(), sketch.added_count());
+    const double ratios[] = { 0, 0.00001, 0.1, 0.5, 0.8, 0.9, 0.99,
+                              0.999, 0.9999, 1 };
+    for (size_t i = 0; i < ARRAY_SIZE(ratios); ++i) {
+        const uint32_t expected = exact_number(values, ratios[i]);
+        const uint32_t actual = sketch.get_number(ratios[i]);
+        EXPECT_LE(fabs((double)actual - expected), expected * SKETCH_MAX_ERROR)
+            << "ratio=" << ratios[i] << " expected=" << expected
+            << " actual=" << actual;
+    }
+    // Small values are exact.
+    bvar::detail::PercentileSketch small;
+    for (uint32_t i = 1; i <= 60; ++i) {
+        small.add32(i);
+    }
+    ASSERT_EQ(30u, small.get_number(0.5));
+    ASSERT_EQ(60u, small.get_number(1));
+    small.clear();
+    ASSERT_TRUE(small.empty());
+    ASSERT_EQ(0u, small.get_number(0.5));
+}
+
+TEST_F(PercentileTest, sketch_merge) {
+    bvar::detail::PercentileSketch all;
+    bvar::detail::PercentileSketch parts[4];
+    for (int i = 0; i < 40000; ++i) {
+        const uint32_t x = butil::fast_rand_less_than(1 << (i % 30 + 1));
+        all.add32(x);
+        parts[i % ARRAY_SIZE(parts)].add32(x);
+    }
+    bvar::detail::PercentileSketch merged;
+    for (size_t i = 0; i < ARRAY_SIZE(parts); ++i) {
+        merged.merge(parts[i]);
+    }
+    ASSERT_EQ(all.added_count(), merged.added_count());
+    for (int i = 0; i <= 1000; ++i) {
+        ASSERT_EQ(all.get_number(i / 1000.0), merged.get_number(i / 1000.0));
+    }
+    // Copy and assign
+    bvar::detail::PercentileSketch copied(merged);
+    ASSERT_EQ(all.get_number(0.9999), copied.get_number(0.9999));
+    copied = parts[0];
+    ASSERT_EQ(parts[0].added_count(), copied.added_count());
+    ASSERT_EQ(parts[0].get_number(0.99), copied.get_number(0.99));
+}
+
+static const int LATENCIES_PER_THREAD = 500000;
+
+struct AddLatencyArg {
+    bvar::detail::Percentile* p;
+    std::vector<uint32_t> values;
+    int64_t elapsed_ns;
+};
+
+static void* add_latencies(void* void_arg) {
+    AddLatencyArg* arg = (AddLatencyArg*)void_arg;
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < arg->values.size(); ++i) {
+        *arg->p << arg->values[i];
+    }
+    tm.stop();
+    arg->elapsed_ns = tm.n_elapsed();
+    return NULL;
+}
+
+TEST_F(PercentileTest, sketch_vs_reservoir) {
+    const size_t NTHREAD = 4;
+    std::vector<uint32_t> all;
+    AddLatencyArg args[NTHREAD];
+    for (size_t i = 0; i < NTHREAD; ++i) {
+        args[i].values.reserve(LATENCIES_PER_THREAD);
+        for (int j = 0; j < LATENCIES_PER_THREAD; ++j) {
+            // Most latencies are around 1ms, 1/1000 of them are ~100ms.
+            uint32_t x = 500 + butil::fast_rand_less_than(1000);
+            if (butil::fast_rand_less_than(1000) == 0) {
+                x = 50000 + butil::fast_rand_less_than(100000);
+            }
+            args[i].values.push_back(x);
+            all.push_back(x);
+        }
+    }
+    std::sort(all.begin(), all.end());
+    for (int sketch = 0; sketch < 2; ++sketch) {
+        bvar::detail::Percentile p;
+        p.set_sketch_mode(sketch);
+        pthread_t th[NTHREAD];
+        for (size_t i = 0; i < NTHREAD; ++i) {
+            args[i].p = &p;
+            ASSERT_EQ(0, pthread_create(&th[i], NULL, add_latencies, &args[i]));
+        }
+        int64_t elapsed_ns = 0;
+        for (size_t i = 0; i < NTHREAD; ++i) {
+            pthread_join(th[i], NULL);
+            elapsed_ns += args[i].elapsed_ns;
+        }
+        bvar::detail::GlobalPercentileSamples b = p.reset();
+        const uint32_t expected = exact_number(all, 0.9999);
+        const uint32_t actual = b.get_number(0.9999);
+        const double error = fabs((double)actual - expected) / expected;
+        LOG(INFO) << (sketch ? "sketch" : "reservoir")
+                  << ": add=" << elapsed_ns / (double)all.size() << "ns"
+                  << " memory=" << b.allocated_bytes()
+                  << " 99%=" << b.get_number(0.99) << '/' << exact_number(all, 0.99)
+                  << " 99.99%=" << actual << '/' << expected
+                  << " error=" << error;
+        if (sketch) {
+            ASSERT_LE(error, SKETCH_MAX_ERROR);
+        }
+    }
+}
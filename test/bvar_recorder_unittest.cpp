@@ -192,4 +192,47 @@ TEST(RecorderTest, perf) {
               << "ns per sample with " << ARRAY_SIZE(threads) 
               << " threads";
 }
+
+static void *latency_counter(void* arg) {
+    bvar::LatencyRecorder* recorder = (bvar::LatencyRecorder*)arg;
+    butil::Timer timer;
+    timer.start();
+    for (int i = 0; i < (int)OPS_PER_THREAD; ++i) {
+        *recorder << i;
+    }
+    timer.stop();
+    return (void *)(timer.n_elapsed());
+}
+
+TEST(RecorderTest, latency_recorder_perf) {
+    bvar::LatencyRecorder recorder;
+    pthread_t threads[8];
+    for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+        pthread_create(&threads[i], NULL, &latency_counter, (void *)&recorder);
+    }
+    long totol_time = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(threads); ++i) {
+        void *ret; 
+        pthread_join(threads[i], &ret);
+        totol_time += (long)ret;
+    }
+    // Values of exited threads are kept.
+    ASSERT_EQ((int64_t)(OPS_PER_THREAD * ARRAY_SIZE(threads)),
+              recorder._latency.get_value().num);
+    // Max and samples are reset by the sampler every second, and samples
+    // which were downsampled in global samples must be merged correctly.
+    ASSERT_GE((int64_t)OPS_PER_THREAD - 1, recorder._max_latency.get_value());
+    for (int i = 0; i < 2; ++i) {
+        bvar::detail::GlobalPercentileSamples s =
+            recorder._latency_percentile.get_value();
+        ASSERT_GE(OPS_PER_THREAD * ARRAY_SIZE(threads), s._num_added);
+    }
+    recorder._latency_percentile.reset();
+    recorder._max_latency.reset();
+    ASSERT_EQ(0, recorder._max_latency.get_value());
+    LOG(INFO) << "LatencyRecorder takes "
+              << totol_time / (OPS_PER_THREAD * ARRAY_SIZE(threads)) 
+              << "ns per sample with " << ARRAY_SIZE(threads) 
+              << " threads";
+}
 } // namespace
@@ -61,7 +61,9 @@ TEST(SamplerTest, single_threaded) {
         s[i] = new DebugSampler;
         s[i]->schedule();
     }
-    usleep(1010000);
+    // Samplers are spread into slices of the second, a new sampler is
+    // picked up within 0.1 second and sampled within 1 second after that.
+    usleep(1110000);
     for (int i = 0; i < N; ++i) {
         // LE: called once every second, may be called more than once
         ASSERT_LE(1, s[i]->called_count()) << "i=" << i;
@@ -88,7 +90,9 @@ static void* check(void*) {
         s[i] = new DebugSampler;
         s[i]->schedule();
     }
-    usleep(1010000);
+    // Samplers are spread into slices of the second, a new sampler is
+    // picked up within 0.1 second and sampled within 1 second after that.
+    usleep(1110000);
     for (int i = 0; i < N; ++i) {
         EXPECT_LE(1, s[i]->called_count()) << "i=" << i;
     }
@@ -121,4 +125,38 @@ TEST(SamplerTest, multi_threaded) {
     }
 #endif
 }
+class TimedSampler : public bvar::detail::Sampler {
+public:
+    TimedSampler() : _first_call_us(0) {}
+    void take_sample() {
+        if (_first_call_us == 0) {
+            _first_call_us = butil::gettimeofday_us();
+        }
+    }
+    int64_t first_call_us() const { return _first_call_us; }
+private:
+    int64_t _first_call_us;
+};
+
+TEST(SamplerTest, spread_in_second) {
+    const int N = 1000;
+    TimedSampler* s[N];
+    for (int i = 0; i < N; ++i) {
+        s[i] = new TimedSampler;
+        s[i]->schedule();
+    }
+    usleep(1200000);
+    int64_t min_us = std::numeric_limits<int64_t>::max();
+    int64_t max_us = 0;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_NE(0, s[i]->first_call_us()) << "i=" << i;
+        min_us = std::min(min_us, s[i]->first_call_us());
+        max_us = std::max(max_us, s[i]->first_call_us());
+    }
+    // Not sampled in one burst.
+    ASSERT_GT(max_us - min_us, 500000);
+    for (int i = 0; i < N; ++i) {
+        s[i]->destroy();
+    }
+}
 } // namespace
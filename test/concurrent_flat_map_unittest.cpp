@@ -0,0 +1,290 @@
+// Copyright (c) 2018 Baidu, Inc.
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <vector>
+#include "butil/time.h"
+#include "butil/macros.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "butil/containers/flat_map.h"
+#include "butil/containers/doubly_buffered_data.h"
+#include "butil/containers/concurrent_flat_map.h"
+
+namespace {
+class ConcurrentFlatMapTest : public ::testing::Test{
+protected:
+    ConcurrentFlatMapTest(){};
+    virtual ~ConcurrentFlatMapTest(){};
+    virtual void SetUp() {
+    };
+    virtual void TearDown() {
+    };
+};
+
+typedef butil::ConcurrentFlatMap<uint64_t, uint64_t> Map;
+
+TEST_F(ConcurrentFlatMapTest, sanity) {
+    Map m;
+    uint64_t v = 0;
+    ASSERT_FALSE(m.initialized());
+    ASSERT_FALSE(m.seek(1, &v));
+    ASSERT_EQ(-1, m.insert(1, 1));
+    ASSERT_EQ(0u, m.erase(1));
+
+    ASSERT_EQ(0, m.init(16, 4));
+    ASSERT_TRUE(m.initialized());
+    ASSERT_EQ(-1, m.init(16, 4));
+    ASSERT_EQ(0u, m.size());
+    ASSERT_EQ(0, m.insert(1, 10));
+    ASSERT_EQ(0, m.insert(2, 20));
+    ASSERT_EQ(2u, m.size());
+    ASSERT_TRUE(m.seek(1, &v));
+    ASSERT_EQ(10u, v);
+    ASSERT_TRUE(m.seek(2, &v));
+    ASSERT_EQ(20u, v);
+    ASSERT_FALSE(m.seek(3, &v));
+
+    // overwrite
+    ASSERT_EQ(0, m.insert(1, 11));
+    ASSERT_EQ(2u, m.size());
+    ASSERT_TRUE(m.seek(1, &v));
+    ASSERT_EQ(11u, v);
+
+    ASSERT_EQ(1u, m.erase(1));
+    ASSERT_EQ(0u, m.erase(1));
+    ASSERT_FALSE(m.seek(1, &v));
+    ASSERT_EQ(1u, m.size());
+
+    m.clear();
+    ASSERT_EQ(0u, m.size());
+    ASSERT_FALSE(m.seek(2, &v));
+}
+
+TEST_F(ConcurrentFlatMapTest, enlarge_and_reuse_deleted_slots) {
+    Map m;
+    ASSERT_EQ(0, m.init(8, 2));
+    const uint64_t N = 10000;
+    for (uint64_t i = 0; i < N; ++i) {
+        ASSERT_EQ(0, m.insert(i, i * 3));
+    }
+    ASSERT_EQ(N, m.size());
+    for (uint64_t i = 0; i < N; ++i) {
+        uint64_t v = 0;
+        ASSERT_TRUE(m.seek(i, &v));
+        ASSERT_EQ(i * 3, v);
+    }
+    // Erase and insert repeatedly, which fills tables with DELETED slots.
+    for (int round = 0; round < 10; ++round) {
+        for (uint64_t i = 0; i < N; i += 2) {
+            ASSERT_EQ(1u, m.erase(i));
+        }
+        ASSERT_EQ(N / 2, m.size());
+        for (uint64_t i = 0; i < N; i += 2) {
+            ASSERT_EQ(0, m.insert(i, i * 3 + round));
+        }
+        ASSERT_EQ(N, m.size());
+    }
+    for (uint64_t i = 0; i < N; ++i) {
+        uint64_t v = 0;
+        ASSERT_TRUE(m.seek(i, &v));
+        ASSERT_EQ(i % 2 ? i * 3 : i * 3 + 9, v);
+    }
+}
+
+// Slots of current and retired tables.
+static size_t allocated_slots(const Map& m) {
+    size_t n = 0;
+    for (size_t i = 0; i < m._nshard; ++i) {
+        for (const Map::Table* t = m._shards[i].table.load();
+             t != NULL; t = t->retired) {
+            n += t->mask + 1;
+        }
+    }
+    return n;
+}
+
+TEST_F(ConcurrentFlatMapTest, churn_does_not_retire_tables) {
+    Map m;
+    ASSERT_EQ(0, m.init(16, 4));
+    const uint64_t NLIVE = 100;
+    for (uint64_t i = 0; i < NLIVE; ++i) {
+        ASSERT_EQ(0, m.insert(i, i));
+    }
+    const size_t nslot = allocated_slots(m);
+    // Keep NLIVE keys in the map while inserting and erasing new keys, as
+    // SocketMap does with connections.
+    for (uint64_t i = NLIVE; i < 1000000; ++i) {
+        ASSERT_EQ(0, m.insert(i, i));
+        ASSERT_EQ(1u, m.erase(i - NLIVE));
+    }
+    ASSERT_EQ(NLIVE, m.size());
+    ASSERT_EQ(nslot, allocated_slots(m));
+    for (uint64_t i = 1000000 - NLIVE; i < 1000000; ++i) {
+        uint64_t v = 0;
+        ASSERT_TRUE(m.seek(i, &v));
+        ASSERT_EQ(i, v);
+    }
+}
+
+struct ReaderArg {
+    Map* map;
+    uint64_t nkey;
+    volatile bool* stop;
+    size_t nfound;
+    size_t nwrong;
+};
+
+static void* read_consistently(void* void_arg) {
+    ReaderArg* arg = (ReaderArg*)void_arg;
+    while (!*arg->stop) {
+        for (uint64_t i = 0; i < arg->nkey; ++i) {
+            uint64_t v = 0;
+            if (arg->map->seek(i, &v)) {
+                ++arg->nfound;
+                // Values written by the writer are always multiples of keys
+                if (v % (i + 1) != 0) {
+                    ++arg->nwrong;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+TEST_F(ConcurrentFlatMapTest, read_during_modifications) {
+    Map m;
+    ASSERT_EQ(0, m.init(16, 4));
+    const uint64_t NKEY = 1000;
+    volatile bool stop = false;
+    pthread_t th[4];
+    ReaderArg args[ARRAY_SIZE(th)];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ReaderArg a = { &m, NKEY, &stop, 0, 0 };
+        args[i] = a;
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, read_consistently, &args[i]));
+    }
+    for (uint64_t round = 1; round <= 200; ++round) {
+        for (uint64_t i = 0; i < NKEY; ++i) {
+            if ((i + round) % 3 == 0) {
+                m.erase(i);
+            } else {
+                ASSERT_EQ(0, m.insert(i, (i + 1) * round));
+            }
+        }
+    }
+    stop = true;
+    size_t nfound = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        pthread_join(th[i], NULL);
+        ASSERT_EQ(0u, args[i].nwrong);
+        nfound += args[i].nfound;
+    }
+    LOG(INFO) << "found " << nfound << " times";
+}
+
+// ===== Benchmark against FlatMap+mutex and DoublyBufferedData =====
+
+typedef butil::FlatMap<uint64_t, uint64_t> FlatMap;
+
+struct LockedMap {
+    butil::Mutex mutex;
+    FlatMap map;
+};
+
+static size_t init_map(FlatMap& m, size_t nbucket) {
+    return m.init(nbucket) == 0;
+}
+
+static size_t add_to_map(FlatMap& m, uint64_t k) {
+    m[k] = k;
+    return 1;
+}
+
+static const uint64_t PERF_NKEY = 1024;
+static const size_t PERF_NSEEK = 2000000;
+
+template <typename Seeker>
+static void* run_seeks(void* arg) {
+    Seeker* seeker = (Seeker*)arg;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < PERF_NSEEK; ++i) {
+        sum += seeker->seek(i % PERF_NKEY);
+    }
+    return (void*)sum;
+}
+
+struct ConcurrentSeeker {
+    Map* m;
+    uint64_t seek(uint64_t k) {
+        uint64_t v = 0;
+        m->seek(k, &v);
+        return v;
+    }
+};
+
+struct LockedSeeker {
+    LockedMap* m;
+    uint64_t seek(uint64_t k) {
+        BAIDU_SCOPED_LOCK(m->mutex);
+        uint64_t* p = m->map.seek(k);
+        return p ? *p : 0;
+    }
+};
+
+struct DBDSeeker {
+    butil::DoublyBufferedData<FlatMap>* m;
+    uint64_t seek(uint64_t k) {
+        butil::DoublyBufferedData<FlatMap>::ScopedPtr ptr;
+        if (m->Read(&ptr) != 0) {
+            return 0;
+        }
+        const uint64_t* p = ptr->seek(k);
+        return p ? *p : 0;
+    }
+};
+
+template <typename Seeker>
+static int64_t seek_in_threads(Seeker* seeker, size_t nthread) {
+    std::vector<pthread_t> th(nthread);
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < nthread; ++i) {
+        EXPECT_EQ(0, pthread_create(&th[i], NULL, run_seeks<Seeker>, seeker));
+    }
+    for (size_t i = 0; i < nthread; ++i) {
+        pthread_join(th[i], NULL);
+    }
+    tm.stop();
+    return tm.n_elapsed() / (int64_t)PERF_NSEEK;
+}
+
+TEST_F(ConcurrentFlatMapTest, perf_cmp_with_locked_map_and_dbd) {
+    Map cm;
+    ASSERT_EQ(0, cm.init(PERF_NKEY));
+    LockedMap lm;
+    ASSERT_EQ(0, lm.map.init(PERF_NKEY * 2));
+    butil::DoublyBufferedData<FlatMap> dbd;
+    dbd.Modify(init_map, PERF_NKEY * 2);
+    for (uint64_t k = 0; k < PERF_NKEY; ++k) {
+        cm.insert(k, k);
+        lm.map[k] = k;
+        dbd.Modify(add_to_map, k);
+    }
+    ConcurrentSeeker cs = { &cm };
+    LockedSeeker ls = { &lm };
+    DBDSeeker ds = { &dbd };
+    const size_t nthreads[] = { 1, 4, 8 };
+    for (size_t i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+        const size_t n = nthreads[i];
+        const int64_t t1 = seek_in_threads(&cs, n);
+        const int64_t t2 = seek_in_threads(&ls, n);
+        const int64_t t3 = seek_in_threads(&ds, n);
+        LOG(INFO) << "Seeking in " << n << " threads takes " << t1 << "/"
+                  << t2 << "/" << t3 << "ns with ConcurrentFlatMap/"
+                  "FlatMap+mutex/DoublyBufferedData<FlatMap>";
+    }
+}
+
+} // namespace
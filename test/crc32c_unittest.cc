@@ -9,6 +9,7 @@
 
 #include <gtest/gtest.h>
 #include "butil/crc32c.h"
+#include "butil/iobuf.h"
 
 namespace butil {
 namespace crc32c {
@@ -61,6 +62,28 @@ TEST_F(CRC, Extend) {
             Extend(Value("hello ", 6), "world", 5));
 }
 
+TEST_F(CRC, IOBuf) {
+  std::string expected;
+  butil::IOBuf buf;
+  ASSERT_EQ(Value("", 0), Value(buf));
+  for (int i = 0; i < 100; ++i) {
+    char tmp[32];
+    const int n = snprintf(tmp, sizeof(tmp), "block-%d;", i);
+    butil::IOBuf piece;
+    piece.append(tmp, n);
+    buf.append(piece);
+    expected.append(tmp, n);
+  }
+  buf.append(std::string(20000, 'x'));
+  expected.append(20000, 'x');
+  ASSERT_GT(buf.backing_block_num(), 1u);
+  const uint32_t crc = Value(expected.data(), expected.size());
+  ASSERT_EQ(crc, Value(buf));
+  butil::IOBuf head;
+  buf.cutn(&head, 5);
+  ASSERT_EQ(crc, Extend(Value(head), buf));
+}
+
 TEST_F(CRC, Mask) {
   uint32_t crc = Value("foo", 3);
   ASSERT_NE(crc, Mask(crc));
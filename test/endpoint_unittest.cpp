@@ -3,7 +3,9 @@
 // Author: Ge,Jun (gejun@baidu.com)
 // Date: 2010-12-04 11:59
 
+#include <sys/socket.h>
 #include <gtest/gtest.h>
+#include "butil/build_config.h"
 #include "butil/errno.h"
 #include "butil/endpoint.h"
 #include "butil/logging.h"
@@ -109,4 +111,91 @@ TEST(EndPointTest, hash_table) {
     ASSERT_EQ(2u, m.size());
 }
 
+TEST(EndPointTest, tcp_listen_reuse_port) {
+    butil::EndPoint ep(butil::IP_ANY, 8613);
+    const int fd1 = butil::tcp_listen(ep, true, true);
+    if (fd1 < 0 && errno == ENOPROTOOPT) {
+        LOG(WARNING) << "SO_REUSEPORT is not supported";
+        return;
+    }
+    ASSERT_GE(fd1, 0) << berror();
+    // Sockets with SO_REUSEPORT can listen on the same port.
+    const int fd2 = butil::tcp_listen(ep, true, true);
+    ASSERT_GE(fd2, 0) << berror();
+    // Without SO_REUSEPORT, the port is in use.
+    ASSERT_LT(butil::tcp_listen(ep, true, false), 0);
+    ASSERT_EQ(EADDRINUSE, errno);
+    close(fd1);
+    close(fd2);
+}
+
+TEST(EndPointTest, unix_endpoint) {
+    butil::EndPoint ep1;
+    ASSERT_EQ(0, butil::str2endpoint("unix:/tmp/endpoint_unittest.sock", &ep1));
+    ASSERT_TRUE(butil::is_unix_endpoint(ep1));
+    ASSERT_STREQ("/tmp/endpoint_unittest.sock", butil::endpoint2unix_path(ep1));
+    ASSERT_STREQ("unix:/tmp/endpoint_unittest.sock",
+                 butil::endpoint2str(ep1).c_str());
+    // Same path, same EndPoint.
+    butil::EndPoint ep2;
+    ASSERT_EQ(0, butil::hostname2endpoint("unix:/tmp/endpoint_unittest.sock",
+                                          &ep2));
+    ASSERT_EQ(ep1, ep2);
+    ASSERT_EQ(0, butil::str2endpoint("unix:@endpoint_unittest", &ep2));
+    ASSERT_NE(ep1, ep2);
+    ASSERT_STREQ("@endpoint_unittest", butil::endpoint2unix_path(ep2));
+    std::ostringstream os;
+    os << ep2;
+    ASSERT_EQ("unix:@endpoint_unittest", os.str());
+
+    butil::EndPoint ep3(butil::IP_ANY, 8613);
+    ASSERT_FALSE(butil::is_unix_endpoint(ep3));
+    ASSERT_TRUE(butil::endpoint2unix_path(ep3) == NULL);
+    // Longer than sun_path.
+    ASSERT_EQ(-1, butil::str2endpoint(
+                  ("unix:/" + std::string(200, 'x')).c_str(), &ep3));
+}
+
+void connect_unix_socket(const char* addr) {
+    butil::EndPoint ep;
+    ASSERT_EQ(0, butil::str2endpoint(addr, &ep));
+    const int listened_fd = butil::tcp_listen(ep, true);
+    ASSERT_GE(listened_fd, 0) << berror();
+    butil::EndPoint local;
+    ASSERT_EQ(0, butil::get_local_side(listened_fd, &local));
+    ASSERT_EQ(ep, local);
+    const int client_fd = butil::tcp_connect(ep, NULL);
+    ASSERT_GE(client_fd, 0) << berror();
+    const int server_fd = accept(listened_fd, NULL, NULL);
+    ASSERT_GE(server_fd, 0) << berror();
+    butil::EndPoint remote;
+    ASSERT_EQ(0, butil::get_remote_side(client_fd, &remote));
+    ASSERT_EQ(ep, remote);
+    ASSERT_EQ(5, write(client_fd, "hello", 5));
+    char buf[8];
+    ASSERT_EQ(5, read(server_fd, buf, sizeof(buf)));
+    ASSERT_EQ(0, memcmp(buf, "hello", 5));
+    close(server_fd);
+    close(client_fd);
+    close(listened_fd);
+}
+
+TEST(EndPointTest, unix_socket) {
+    const char* path = "/tmp/endpoint_unittest.sock";
+    unlink(path);
+    connect_unix_socket("unix:/tmp/endpoint_unittest.sock");
+    // The file left by the closed listener is removed with `reuse_addr'.
+    connect_unix_socket("unix:/tmp/endpoint_unittest.sock");
+    butil::EndPoint ep;
+    ASSERT_EQ(0, butil::str2endpoint("unix:/tmp/endpoint_unittest.sock", &ep));
+    ASSERT_LT(butil::tcp_listen(ep, false), 0);
+    ASSERT_EQ(EADDRINUSE, errno);
+    ASSERT_LT(butil::tcp_listen(ep, true, true), 0);
+    ASSERT_EQ(ENOPROTOOPT, errno);
+    unlink(path);
+#if defined(OS_LINUX)
+    connect_unix_socket("unix:@endpoint_unittest");
+#endif
+}
+
 }
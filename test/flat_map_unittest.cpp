@@ -4,7 +4,9 @@
 #include <gtest/gtest.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <map>
+#include <set>
 #include <vector>
 #include "butil/time.h"
 #include "butil/macros.h"
@@ -12,8 +14,10 @@
 #include "butil/logging.h"
 #include "butil/containers/hash_tables.h"
 #include "butil/containers/flat_map.h"
+#include "butil/containers/swiss_flat_map.h"
 #include "butil/containers/pooled_map.h"
 #include "butil/containers/case_ignored_flat_map.h"
+#include "butil/fast_hash.h"
 
 namespace {
 class FlatMapTest : public ::testing::Test{
@@ -176,6 +180,56 @@ TEST_F(FlatMapTest, seek_by_string_piece) {
     ASSERT_TRUE(m.seek(k3) == NULL);
 }
 
+TEST_F(FlatMapTest, wyhasher) {
+    butil::FlatMap<std::string, int, butil::WyHasher<std::string> > m;
+    ASSERT_EQ(0, m.init(16));
+    m["hello"] = 1;
+    m["world"] = 2;
+    ASSERT_EQ(1, *m.seek(butil::StringPiece("hello")));
+    ASSERT_EQ(2, *m.seek("world"));
+    ASSERT_EQ(2, *m.seek(std::string("world")));
+    ASSERT_TRUE(m.seek("heheda") == NULL);
+
+    butil::FlatMap<uint64_t, int, butil::WyHasher<uint64_t> > m2;
+    ASSERT_EQ(0, m2.init(1024));
+    // Keys with identical low bits are put into different buckets.
+    for (uint64_t i = 0; i < 1000; ++i) {
+        m2[i << 32] = (int)i;
+    }
+    for (uint64_t i = 0; i < 1000; ++i) {
+        ASSERT_EQ((int)i, *m2.seek(i << 32));
+    }
+    butil::BucketInfo info = m2.bucket_info();
+    ASSERT_LE(info.longest_length, 8u);
+}
+
+TEST_F(FlatMapTest, wyhash_of_all_lengths) {
+    char buf[256];
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        buf[i] = (char)i;
+    }
+    std::set<uint64_t> hashes;
+    for (size_t len = 0; len <= sizeof(buf); ++len) {
+        const uint64_t h = butil::WyHash64(buf, len);
+        // Stable for same inputs, no matter where the bytes are.
+        std::string copy(buf, len);
+        ASSERT_EQ(h, butil::WyHash64(copy.data(), copy.size()));
+        ASSERT_NE(h, butil::WyHash64(buf, len, 1));
+        hashes.insert(h);
+    }
+    ASSERT_EQ(sizeof(buf) + 1, hashes.size());
+    // Every byte of long keys is hashed.
+    for (size_t len = 1; len <= sizeof(buf); len += 7) {
+        std::string copy(buf, len);
+        const uint64_t h = butil::WyHash64(copy.data(), copy.size());
+        for (size_t i = 0; i < len; ++i) {
+            copy[i] ^= 1;
+            ASSERT_NE(h, butil::WyHash64(copy.data(), copy.size()));
+            copy[i] ^= 1;
+        }
+    }
+}
+
 TEST_F(FlatMapTest, to_lower) {
     for (int c = -128; c < 128; ++c) {
         ASSERT_EQ((char)::tolower(c), butil::ascii_tolower(c)) << "c=" << c;
@@ -1264,4 +1318,187 @@ TEST_F(FlatMapTest, copy) {
     ASSERT_FALSE(m2.is_too_crowded(m1.size()));
 }
 
+
+TEST_F(FlatMapTest, swiss_flat_map_sanity) {
+    typedef butil::SwissFlatMap<uint64_t, long> Map;
+    Map m;
+    ASSERT_FALSE(m.initialized());
+    ASSERT_EQ(NULL, m.seek(1));
+    ASSERT_EQ(0u, m.erase(1));
+    ASSERT_TRUE(m.begin() == m.end());
+    ASSERT_EQ(-1, m.init(32, 5));
+    ASSERT_EQ(0, m.init(20, 100));
+    ASSERT_EQ(-1, m.init(20));
+    ASSERT_EQ(32u, m.bucket_count());
+    ASSERT_EQ(Map::MAX_LOAD_FACTOR, m.load_factor());
+    ASSERT_TRUE(m.empty());
+    ASSERT_TRUE(m.begin() == m.end());
+
+    ASSERT_EQ(10, *m.insert(1, 10));
+    m[2] = 20;
+    ASSERT_EQ(0, m[3]);
+    ASSERT_EQ(3u, m.size());
+    ASSERT_EQ(10, *m.seek(1));
+    ASSERT_EQ(20, *m.seek(2));
+    ASSERT_EQ(NULL, m.seek(4));
+    ASSERT_EQ(11, *m.insert(1, 11));
+    ASSERT_EQ(3u, m.size());
+    long sum = 0;
+    for (Map::const_iterator it = m.begin(); it != m.end(); ++it) {
+        sum += it->second;
+    }
+    ASSERT_EQ(31, sum);
+
+    ASSERT_EQ(1u, m.erase(2));
+    ASSERT_EQ(0u, m.erase(2));
+    ASSERT_EQ(NULL, m.seek(2));
+    ASSERT_EQ(2u, m.size());
+
+    Map m2 = m;
+    ASSERT_EQ(2u, m2.size());
+    ASSERT_EQ(11, *m2.seek(1));
+    m.clear();
+    ASSERT_TRUE(m.empty());
+    ASSERT_EQ(NULL, m.seek(1));
+    m.swap(m2);
+    ASSERT_EQ(2u, m.size());
+    ASSERT_TRUE(m2.empty());
+
+    // Enlarge
+    for (uint64_t i = 0; i < 10000; ++i) {
+        m[i] = i * 2;
+    }
+    ASSERT_EQ(10000u, m.size());
+    ASSERT_LE(m.size() * 100, m.bucket_count() * m.load_factor());
+    for (uint64_t i = 0; i < 10000; ++i) {
+        ASSERT_EQ((long)i * 2, *m.seek(i));
+    }
+    const butil::BucketInfo info = m.bucket_info();
+    LOG(INFO) << "longest=" << info.longest_length
+              << " average=" << info.average_length;
+
+    // Iteration in more-than-one passes.
+    Map::PositionHint hint;
+    size_t n = 0;
+    Map::const_iterator it = m.begin();
+    for (; it != m.end() && n < 100; ++it, ++n) {}
+    m.save_iterator(it, &hint);
+    for (it = m.restore_iterator(hint); it != m.end(); ++it, ++n) {}
+    ASSERT_EQ(m.size(), n);
+}
+
+TEST_F(FlatMapTest, swiss_flat_map_random_insert_erase) {
+    srand(0);
+    n_con = 0;
+    n_cp_con = 0;
+    n_des = 0;
+    {
+        butil::hash_map<uint64_t, Value> ref;
+        typedef butil::SwissFlatMap<uint64_t, Value> Map;
+        Map ht;
+        ASSERT_EQ(0, ht.init(40));
+        for (int j = 0; j < 10; ++j) {
+            for (int i = 0; i < 100000; ++i) {
+                int k = rand() % 0xFFFF;
+                int p = rand() % 1000;
+                if (p < 600) {
+                    ht.insert(k, i);
+                    ref[k] = i;
+                } else if (p < 999) {
+                    ht.erase(k);
+                    ref.erase(k);
+                } else {
+                    ht.clear();
+                    ref.clear();
+                }
+            }
+            for (Map::iterator it = ht.begin(); it != ht.end(); ++it) {
+                butil::hash_map<uint64_t, Value>::iterator it2 =
+                    ref.find(it->first);
+                ASSERT_TRUE(it2 != ref.end());
+                ASSERT_EQ(it2->second, it->second);
+            }
+            for (butil::hash_map<uint64_t, Value>::iterator it = ref.begin();
+                 it != ref.end(); ++it) {
+                Value* p_value = ht.seek(it->first);
+                ASSERT_TRUE(p_value != NULL);
+                ASSERT_EQ(it->second, *p_value);
+            }
+            ASSERT_EQ(ht.size(), ref.size());
+        }
+    }
+    ASSERT_EQ(n_con + n_cp_con, n_des);
+}
+
+// Bytes used by FlatMap: a bucket(value + next pointer) per slot plus a
+// pooled node for each element collided into a used bucket. The number of
+// used buckets is the expectation under uniform hashing.
+template <typename Map>
+static double flat_map_bytes_per_entry(const Map& m, size_t value_size) {
+    const double nb = m.bucket_count();
+    const double n = m.size();
+    const double used = nb * (1 - pow(1 - 1 / nb, n));
+    const double bucket_size = value_size + sizeof(void*);
+    return (nb * bucket_size + (n - used) * bucket_size) / n;
+}
+
+template <typename Map>
+static double swiss_flat_map_bytes_per_entry(const Map& m, size_t value_size) {
+    return m.bucket_count() * (1.0 + value_size) / m.size();
+}
+
+template <typename Map>
+static int64_t seek_ns(const Map& m, const std::vector<uint64_t>& keys) {
+    long sum = 0;
+    butil::Timer tm;
+    tm.start();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        const long* p = (const long*)m.seek(keys[i]);
+        sum += (p ? *p : 0);
+    }
+    tm.stop();
+    EXPECT_NE(-1, sum);  // keep the loop
+    return tm.n_elapsed() / (int64_t)keys.size();
+}
+
+template <typename T> void perf_cmp_swiss(const T& value) {
+    typedef std::pair<const uint64_t, T> value_type;
+    const size_t nkeys[] = { 1000, 100000, 1000000 };
+    LOG(INFO) << "[ value = " << sizeof(T) << " bytes ]";
+    for (size_t pass = 0; pass < ARRAY_SIZE(nkeys); ++pass) {
+        butil::FlatMap<uint64_t, T> fm;
+        butil::SwissFlatMap<uint64_t, T> sm;
+        ASSERT_EQ(0, fm.init(32));
+        ASSERT_EQ(0, sm.init(32));
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> missed_keys;
+        const uint64_t start = rand();
+        for (size_t i = 0; i < nkeys[pass]; ++i) {
+            // Scattered keys, 50% of them are present.
+            const uint64_t k = (start + i) * 0x9E3779B97F4A7C15ULL;
+            if (i % 2) {
+                missed_keys.push_back(k);
+            } else {
+                keys.push_back(k);
+                fm[k] = value;
+                sm[k] = value;
+            }
+        }
+        random_shuffle(keys.begin(), keys.end());
+        LOG(INFO) << "Seeking " << keys.size() << " existing/missing keys from "
+                  "FlatMap/SwissFlatMap takes "
+                  << seek_ns(fm, keys) << "/" << seek_ns(sm, keys) << "ns "
+                  << seek_ns(fm, missed_keys) << "/"
+                  << seek_ns(sm, missed_keys) << "ns, bytes per entry: "
+                  << flat_map_bytes_per_entry(fm, sizeof(value_type)) << "/"
+                  << swiss_flat_map_bytes_per_entry(sm, sizeof(value_type));
+    }
+}
+
+TEST_F(FlatMapTest, perf_cmp_with_swiss_flat_map) {
+    perf_cmp_swiss<long>(100);
+    perf_cmp_swiss<Dummy1>(Dummy1());
+    perf_cmp_swiss<Dummy2>(Dummy2());
+}
+
 }
@@ -13,6 +13,7 @@
 #include <butil/time.h>                 // Timer
 #include <butil/fd_utility.h>           // make_non_blocking
 #include <butil/iobuf.h>
+#include <butil/hugepage_block_allocator.h>
 #include <butil/logging.h>
 #include <butil/fd_guard.h>
 #include <butil/errno.h>
@@ -676,6 +677,78 @@ TEST_F(IOBufTest, cut_by_multiple_text_delim) {
     ASSERT_EQ("", to_str(b));
 }
 
+TEST_F(IOBufTest, find_and_equals_at) {
+    install_debug_allocator();
+
+    // Build a buffer with many small blocks so that patterns span them.
+    butil::IOBuf b;
+    std::string expected;
+    for (int i = 0; i < 200; ++i) {
+        char tmp[32];
+        const int n = snprintf(tmp, sizeof(tmp), "k%d:v%d\r\n", i, i * 7);
+        butil::IOBuf piece;
+        piece.append(tmp, n);
+        // append IOBuf keeps the refs separated.
+        b.append(piece);
+        expected.append(tmp, n);
+    }
+    b.append(std::string(30000, 'x') + "needle-in-haystack");
+    expected.append(std::string(30000, 'x') + "needle-in-haystack");
+    ASSERT_EQ(expected, b.to_string());
+    ASSERT_GT(b.backing_block_num(), 2u);
+
+    ASSERT_EQ(expected.find('\n'), b.find('\n'));
+    ASSERT_EQ(expected.find('\n', 100), b.find('\n', 100));
+    ASSERT_EQ(butil::IOBuf::npos, b.find('#'));
+    ASSERT_EQ(butil::IOBuf::npos, b.find('k', b.size()));
+    const char* patterns[] = { "\r\n", "v7\r\nk2", "k199:", ":v1393\r\nx",
+                               "xxneedle", "haystack", "needle-in-haystack!",
+                               "not exist" };
+    for (size_t i = 0; i < arraysize(patterns); ++i) {
+        const std::string pat = patterns[i];
+        for (size_t pos = 0; pos < expected.size(); pos += 997) {
+            const size_t exp = expected.find(pat, pos);
+            ASSERT_EQ(exp == std::string::npos ? butil::IOBuf::npos : exp,
+                      b.find(pat, pos)) << pat << " pos=" << pos;
+        }
+    }
+    ASSERT_EQ(10u, b.find("", 10));
+
+    ASSERT_TRUE(b.equals_at(0, "k0:v0\r\n"));
+    ASSERT_TRUE(b.equals_at(5, "\r\nk1:v7"));
+    ASSERT_FALSE(b.equals_at(5, "\r\nk1:v8"));
+    ASSERT_TRUE(b.equals_at(b.size() - 8, "haystack"));
+    ASSERT_FALSE(b.equals_at(b.size() - 7, "haystack"));
+    ASSERT_TRUE(b.equals_at(b.size(), ""));
+    ASSERT_FALSE(b.equals_at(b.size() + 1, ""));
+
+    // cut_until with delimiters longer than 8 bytes.
+    butil::IOBuf out;
+    ASSERT_EQ(0, b.cut_until(&out, "xxxxneedle-"));
+    ASSERT_EQ(expected.find("xxxxneedle-"), out.size());
+    ASSERT_EQ("in-haystack", b.to_string());
+}
+
+TEST_F(IOBufTest, bytes_iterator_forward_to) {
+    butil::IOBuf b;
+    for (int i = 0; i < 10; ++i) {
+        butil::IOBuf piece;
+        piece.append("abc");
+        b.append(piece);
+    }
+    b.append("|tail");
+    butil::IOBufBytesIterator it(b);
+    ASSERT_EQ(0u, it.forward_to('a'));
+    ASSERT_EQ(2u, it.forward_to('c'));
+    ASSERT_EQ('c', *it);
+    ++it;
+    ASSERT_EQ(27u, it.forward_to('|'));
+    ASSERT_EQ('|', *it);
+    ASSERT_EQ(5u, it.bytes_left());
+    ASSERT_EQ(5u, it.forward_to('#'));
+    ASSERT_EQ(0u, it.bytes_left());
+}
+
 TEST_F(IOBufTest, append_a_lot_and_cut_them_all) {
     install_debug_allocator();
     
@@ -774,6 +847,33 @@ TEST_F(IOBufTest, cut_multiple_into_fd_tiny) {
     close(fds[1]);
 }
 
+TEST_F(IOBufTest, cut_multiple_into_socket_zerocopy) {
+    butil::IOBuf b0, b1;
+    const std::string s0(100000, 'a');
+    const std::string s1 = "hello world";
+    b0.append(s0);
+    b1.append(s1);
+    butil::IOBuf* pieces[] = { &b0, &b1 };
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    butil::make_non_blocking(fds[0]);
+    butil::make_non_blocking(fds[1]);
+    butil::IOBuf sent;
+    butil::IOPortal received;
+    while (!b0.empty() || !b1.empty()) {
+        const ssize_t nw = butil::IOBuf::cut_multiple_into_socket_zerocopy(
+            fds[1], pieces, ARRAY_SIZE(pieces), &sent);
+        // AF_UNIX ignores MSG_ZEROCOPY and copies.
+        ASSERT_TRUE(nw > 0 || errno == EAGAIN) << berror();
+        while (received.append_from_file_descriptor(fds[0], 1024 * 1024) > 0) {}
+    }
+    while (received.append_from_file_descriptor(fds[0], 1024 * 1024) > 0) {}
+    ASSERT_EQ(s0 + s1, sent.to_string());
+    ASSERT_EQ(s0 + s1, received.to_string());
+    close(fds[0]);
+    close(fds[1]);
+}
+
 TEST_F(IOBufTest, cut_into_fd_a_lot_of_data) {
     install_debug_allocator();
 
@@ -1558,7 +1658,124 @@ TEST_F(IOBufTest, copy_to_string_from_iterator) {
     ASSERT_EQ(nc, b0.length());
 }
 
-#ifdef IOBUF_HUGE_BLOCK
+TEST_F(IOBufTest, block_size_classes) {
+    const size_t header_size =
+        butil::IOBuf::DEFAULT_BLOCK_SIZE - butil::IOBuf::DEFAULT_PAYLOAD;
+    const size_t len = 1024 * 1024;
+    std::string s;
+    for (size_t i = 0; i < len; ++i) {
+        s.push_back(butil::fast_rand_in('a', 'z'));
+    }
+    {
+        butil::IOBuf b;
+        ASSERT_EQ(0, b.append(s));
+        ASSERT_EQ(s, b.to_string());
+        // Much fewer than len / DEFAULT_PAYLOAD
+        ASSERT_LE(b.backing_block_num(), len / 65000 + 2);
+    }
+
+    butil::TempFile file;
+    ASSERT_EQ(0, file.save_bin(s.data(), s.size()));
+    butil::fd_guard fd(open(file.fname(), O_RDONLY));
+    ASSERT_TRUE(fd >= 0) << file.fname() << ' ' << berror();
+    {
+        butil::IOPortal p;
+        ASSERT_EQ((ssize_t)len, p.pappend_from_file_descriptor(fd, 0, len));
+        ASSERT_EQ(s, p.to_string());
+        ASSERT_LE(p.backing_block_num(), len / 65000 + 2);
+        ASSERT_LT(butil::IOBuf::DEFAULT_PAYLOAD, p.backing_block(0).size());
+    }
+    {
+        // Reading a few bytes with empty TLS gets a small block which is
+        // not cached in TLS after being returned.
+        butil::iobuf::remove_tls_block_chain();
+        butil::IOPortal p;
+        ASSERT_EQ(10, p.pappend_from_file_descriptor(fd, 0, 10));
+        ASSERT_EQ(s.substr(0, 10), p.to_string());
+        ASSERT_TRUE(p._block != NULL);
+        ASSERT_EQ(1024 - header_size, butil::iobuf::block_cap(p._block));
+        p.clear();
+        ASSERT_EQ(0, butil::iobuf::get_tls_block_count());
+    }
+}
+
+static void* append_and_cut_in_thread(void*) {
+    for (int i = 0; i < 100; ++i) {
+        butil::IOBuf buf;
+        buf.resize(butil::IOBuf::DEFAULT_PAYLOAD * 10, 'x');
+        std::string out;
+        buf.cutn(&out, buf.length());
+    }
+    return NULL;
+}
+
+TEST_F(IOBufTest, hugepage_block_allocator) {
+    void* (*saved_allocate)(size_t) = butil::iobuf::blockmem_allocate;
+    void (*saved_deallocate)(void*) = butil::iobuf::blockmem_deallocate;
+    butil::iobuf::remove_tls_block_chain();
+
+    butil::iobuf::HugePageAllocatorOptions opt;
+    opt.max_memory = 8 * 1024 * 1024;
+    opt.max_cached_blocks_per_thread = 8;
+    opt.block_size = 0;
+    ASSERT_EQ(-1, butil::iobuf::enable_hugepage_block_allocator(&opt));
+    // Not a divisor of region_size, the tail of each region is not carved.
+    opt.block_size = butil::IOBuf::DEFAULT_BLOCK_SIZE + 64;
+    ASSERT_EQ(0, butil::iobuf::enable_hugepage_block_allocator(&opt));
+    ASSERT_TRUE(butil::iobuf::is_hugepage_block_allocator_enabled());
+    ASSERT_EQ(-1, butil::iobuf::enable_hugepage_block_allocator(&opt));
+
+    butil::iobuf::HugePageAllocatorStats stats;
+    butil::iobuf::get_hugepage_allocator_stats(&stats);
+    ASSERT_EQ(1u, stats.region_count);
+    ASSERT_EQ(2u * 1024 * 1024, stats.region_memory);
+    ASSERT_EQ(0u, stats.carved_memory);
+    // Regions fall back to transparent huge pages without hugetlb pages.
+    ASSERT_LE(stats.hugetlb_region_count, stats.region_count);
+    {
+        // 2MB region holds 254 blocks, 6MB needs all 4 regions.
+        const size_t len = 6 * 1024 * 1024;
+        butil::IOBuf buf;
+        buf.resize(len, 'a');
+        ASSERT_EQ(len, buf.length());
+        butil::iobuf::get_hugepage_allocator_stats(&stats);
+        ASSERT_EQ(4u, stats.region_count);
+        ASSERT_GE(stats.carved_memory, len);
+        ASSERT_EQ(0u, stats.fallback_count);
+
+        // Exceeding max_memory falls back to the previous allocator.
+        butil::IOBuf buf2;
+        buf2.resize(4 * 1024 * 1024, 'b');
+        butil::iobuf::get_hugepage_allocator_stats(&stats);
+        ASSERT_EQ(4u, stats.region_count);
+        ASSERT_LT(0u, stats.fallback_count);
+
+        std::string out;
+        buf.cutn(&out, len);
+        ASSERT_EQ(len, out.size());
+        ASSERT_EQ(std::string(len, 'a'), out);
+    }
+    butil::iobuf::remove_tls_block_chain();
+    butil::iobuf::get_hugepage_allocator_stats(&stats);
+    // Blocks beyond the TLS cache were flushed into the global list.
+    ASSERT_LT(0u, stats.global_free_block_count);
+    const size_t carved_memory = stats.carved_memory;
+
+    pthread_t th[4];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, append_and_cut_in_thread, NULL));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    butil::iobuf::get_hugepage_allocator_stats(&stats);
+    // Freed blocks are reused.
+    ASSERT_EQ(carved_memory, stats.carved_memory);
+
+    butil::iobuf::blockmem_allocate = saved_allocate;
+    butil::iobuf::blockmem_deallocate = saved_deallocate;
+}
+
 void debug_block_is_deallocated(void* b) {
     if (1ul == s_set.erase(b)) {
         ASSERT_TRUE(false) << "The Block=" << b << "isn't deallocated in cb";
@@ -1603,6 +1820,187 @@ TEST_F(IOBufTest, append_with_release_cb) {
     ASSERT_EQ(1024, b0.cutn(&out, len));
     debug_block_is_deallocated((void*)data);
 }
+
+static int s_user_data_deleted = 0;
+static void delete_user_data(void* data) {
+    ++s_user_data_deleted;
+    delete [] (char*)data;
+}
+
+static void read_into_portals(int fd_in, int fd_out, size_t n) {
+    std::vector<butil::IOPortal> portals(n);
+    for (size_t i = 0; i < n; ++i) {
+        ASSERT_EQ(5, write(fd_out, "hello", 5));
+        ASSERT_EQ(5, portals[i].append_from_file_descriptor(fd_in, 4096));
+    }
+    // Non-full blocks are returned to TLS at destruction of portals.
+}
+
+TEST_F(IOBufTest, tls_block_cache_stats_and_trim) {
+    butil::iobuf::remove_tls_block_chain();
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    butil::IOBuf::TLSBlockCacheStats s0;
+    butil::IOBuf::get_tls_block_cache_stats(&s0);
+
+    read_into_portals(fds[0], fds[1], 5);
+    ASSERT_EQ(5, butil::iobuf::get_tls_block_count());
+    butil::IOBuf::TLSBlockCacheStats s1;
+    butil::IOBuf::get_tls_block_cache_stats(&s1);
+    ASSERT_GE(s1.thread_count, 1u);
+    ASSERT_GE(s1.cached_block_count, 5u);
+    ASSERT_GE(s1.max_cached_block_count, 5u);
+    ASSERT_EQ(s0.miss_count + 5, s1.miss_count);
+    ASSERT_EQ(s0.release_count + 5, s1.release_count);
+
+    // All blocks were used since the cache was filled, nothing is trimmed.
+    butil::IOBuf::trim_tls_block_caches();
+    read_into_portals(fds[0], fds[1], 1);
+    ASSERT_EQ(5, butil::iobuf::get_tls_block_count());
+
+    // Only one block was used in this period.
+    butil::IOBuf::trim_tls_block_caches();
+    read_into_portals(fds[0], fds[1], 1);
+    ASSERT_EQ(1, butil::iobuf::get_tls_block_count());
+    butil::IOBuf::TLSBlockCacheStats s2;
+    butil::IOBuf::get_tls_block_cache_stats(&s2);
+    ASSERT_EQ(s1.hit_count + 2, s2.hit_count);
+    ASSERT_EQ(s1.trimmed_count + 4, s2.trimmed_count);
+
+    // Blocks exceeding the cap are trimmed as well.
+    ASSERT_EQ(8, butil::IOBuf::max_blocks_per_thread());
+    read_into_portals(fds[0], fds[1], 4);
+    ASSERT_EQ(4, butil::iobuf::get_tls_block_count());
+    butil::IOBuf::set_max_blocks_per_thread(2);
+    butil::IOBuf::trim_tls_block_caches();
+    read_into_portals(fds[0], fds[1], 1);
+    ASSERT_EQ(2, butil::iobuf::get_tls_block_count());
+    butil::IOBuf::set_max_blocks_per_thread(8);
+
+    butil::iobuf::remove_tls_block_chain();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(IOBufTest, block_tag) {
+#ifndef IOBUF_HUGE_BLOCK
+    // Tags are packed into the header which is not enlarged.
+    ASSERT_EQ(8176u, butil::IOBuf::DEFAULT_PAYLOAD);
 #endif
+    butil::iobuf::remove_tls_block_chain();
+    const size_t m0 = butil::IOBuf::block_memory(3);
+    const std::string data(100000, 'x');
+    butil::IOBuf b;
+    {
+        butil::ScopedIOBufBlockTag tag(3);
+        {
+            butil::ScopedIOBufBlockTag inner(4);
+        }
+        b.append(data);
+    }
+    ASSERT_GE(butil::IOBuf::block_memory(3), m0 + data.size());
+    butil::IOBuf b2;
+    b2.append(data);
+    ASSERT_LT(butil::IOBuf::block_memory(3), m0 + 2 * data.size());
+    b.clear();
+    b2.clear();
+    butil::iobuf::remove_tls_block_chain();
+    ASSERT_EQ(m0, butil::IOBuf::block_memory(3));
+    ASSERT_EQ(0u, butil::IOBuf::block_memory(-1));
+    ASSERT_EQ(0u, butil::IOBuf::block_memory(butil::IOBuf::MAX_BLOCK_TAGS));
+}
+
+TEST_F(IOBufTest, append_mapped_file) {
+    const size_t len = 300 * 1024 + 123;
+    std::string expected;
+    expected.reserve(len);
+    for (size_t i = 0; i < len; ++i) {
+        expected.push_back(butil::fast_rand_in('a', 'z'));
+    }
+    butil::TempFile file;
+    ASSERT_EQ(0, file.save_bin(expected.data(), expected.size()));
+    butil::IOBuf buf;
+    {
+        butil::fd_guard fd(open(file.fname(), O_RDONLY));
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(-1, buf.append_mapped_file(fd, len + 1, 0));
+        ASSERT_EQ(-1, buf.append_mapped_file(fd, 10, len));
+        ASSERT_EQ(0, buf.append("head"));
+        ASSERT_EQ(0, buf.append_mapped_file(fd, 5000, len - 5000));
+        ASSERT_EQ(0, buf.append_mapped_file(fd, 0, 7));
+    }
+    // Content is still accessible after the fd is closed.
+    ASSERT_EQ("head" + expected.substr(5000) + expected.substr(0, 7),
+              buf.to_string());
+
+    // Cut into a pipe like writing to sockets.
+    butil::IOBuf b2 = buf;
+    buf.clear();
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    butil::make_non_blocking(fds[0]);
+    butil::make_non_blocking(fds[1]);
+    butil::IOPortal received;
+    while (!b2.empty()) {
+        ASSERT_TRUE(b2.cut_into_file_descriptor(fds[1]) > 0 || errno == EAGAIN);
+        while (received.append_from_file_descriptor(fds[0], len) > 0) {}
+    }
+    ASSERT_EQ("head" + expected.substr(5000) + expected.substr(0, 7),
+              received.to_string());
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(IOBufTest, append_user_data) {
+    s_user_data_deleted = 0;
+    const size_t len = 100 * 1024;
+    char* data = new char[len];
+    for (size_t i = 0; i < len; ++i) {
+        data[i] = butil::fast_rand_in('a', 'z');
+    }
+    const std::string expected(data, len);
+    {
+        butil::IOBuf b0;
+        ASSERT_EQ(-1, b0.append_user_data(NULL, len, delete_user_data));
+        ASSERT_EQ(-1, b0.append_user_data(data, 0, delete_user_data));
+        ASSERT_EQ(0, b0.append("head"));
+        ASSERT_EQ(0, b0.append_user_data(data, len, delete_user_data));
+        ASSERT_EQ(0, b0.append("tail"));
+        ASSERT_EQ(len + 8, b0.size());
+        ASSERT_EQ(3u, b0.backing_block_num());
+        ASSERT_EQ(data, b0.backing_block(1).data());
+        ASSERT_EQ("head" + expected + "tail", b0.to_string());
+
+        // Read through ZeroCopyInputStream
+        butil::IOBuf b1 = b0;
+        std::string out;
+        butil::IOBufAsZeroCopyInputStream in(b1);
+        const void* p = NULL;
+        int size = 0;
+        while (in.Next(&p, &size)) {
+            out.append((const char*)p, size);
+        }
+        ASSERT_EQ(b0.to_string(), out);
+
+        // Shared by cut IOBufs whose data are written into fd.
+        butil::IOBuf b2;
+        b1.cutn(&b2, len / 2);
+        b1.clear();
+        b0.clear();
+        ASSERT_EQ(0, s_user_data_deleted);
+        int fds[2];
+        ASSERT_EQ(0, pipe(fds));
+        butil::make_non_blocking(fds[1]);
+        butil::IOPortal received;
+        while (!b2.empty()) {
+            ASSERT_TRUE(b2.cut_into_file_descriptor(fds[1]) > 0 || errno == EAGAIN);
+            while (received.append_from_file_descriptor(fds[0], len) == 0) {}
+        }
+        close(fds[0]);
+        close(fds[1]);
+        ASSERT_EQ(("head" + expected).substr(0, len / 2), received.to_string());
+    }
+    ASSERT_EQ(1, s_user_data_deleted);
+}
 
 } // namespace
@@ -13,6 +13,9 @@
 namespace logging {
 DECLARE_bool(crash_on_fatal_log);
 DECLARE_int32(v);
+DECLARE_bool(async_log);
+DECLARE_int32(async_log_buffer_size);
+DECLARE_int32(async_log_dedup_window_ms);
 
 namespace {
 
@@ -419,6 +422,60 @@ TEST_F(LoggingTest, limited_logging) {
     }
 }
 
+
+static size_t count_substr(const std::string& s, const std::string& sub) {
+    size_t n = 0;
+    for (size_t pos = s.find(sub); pos != std::string::npos;
+         pos = s.find(sub, pos + sub.size())) {
+        ++n;
+    }
+    return n;
+}
+
+static void* log_many(void*) {
+    for (int i = 0; i < 10000; ++i) {
+        LOG(INFO) << "many" << i;
+    }
+    return NULL;
+}
+
+TEST_F(LoggingTest, async_log) {
+    ::logging::StringSink log_str;
+    ::logging::LogSink* old_sink = ::logging::SetLogSink(&log_str);
+    FLAGS_async_log = true;
+    LOG(INFO) << "async1";
+    LOG(WARNING) << "async2";
+    FlushAsyncLogs();
+    ASSERT_EQ(1u, count_substr(log_str, "async1"));
+    ASSERT_EQ(1u, count_substr(log_str, "async2"));
+    ASSERT_LT(log_str.find("async1"), log_str.find("async2"));
+
+    // Identical logs from a same line are written once.
+    FLAGS_async_log_dedup_window_ms = 100000;
+    for (int i = 0; i < 10; ++i) {
+        LOG(INFO) << "same";
+    }
+    FlushAsyncLogs();
+    ASSERT_EQ(1u, count_substr(log_str, "same"));
+    // Suppressed logs are reported when the window ends.
+    FLAGS_async_log_dedup_window_ms = 0;
+    FlushAsyncLogs();
+    ASSERT_EQ(1u, count_substr(log_str, "Suppressed 9 identical logs"));
+
+    // Logs are dropped when buffers are full.
+    FLAGS_async_log_buffer_size = 4;
+    const int64_t ndropped = GetDroppedAsyncLogCount();
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, log_many, NULL));
+    pthread_join(th, NULL);
+    FlushAsyncLogs();
+    ASSERT_LT(ndropped, GetDroppedAsyncLogCount());
+    ASSERT_LT(count_substr(log_str, "many"), 10000u);
+    FLAGS_async_log_buffer_size = 1024;
+    FLAGS_async_log = false;
+    ASSERT_EQ(&log_str, ::logging::SetLogSink(old_sink));
+}
+
 }  // namespace
 
 }  // namespace logging
@@ -81,7 +81,8 @@ TEST_F(ObjectPoolTest, change_config) {
     printf("%lu\n", ARRAY_SIZE(a));
     
     ObjectPoolInfo info = describe_objects<MyObject>();
-    ObjectPoolInfo zero_info = { 0, 0, 0, 0, 3, 3, 0 };
+    ObjectPoolInfo zero_info = { 0, 0, 0, 0, 3, 3, 0,
+                                 (size_t)butil::numa_node_num(), {}, 0 };
     ASSERT_EQ(0, memcmp(&info, &zero_info, sizeof(info)));
 
     MyObject* p = get_object<MyObject>();
@@ -337,7 +338,8 @@ TEST_F(ObjectPoolTest, get_and_return_int_multiple_threads) {
     clear_objects<D>();
     ObjectPoolInfo info = describe_objects<D>();
     ObjectPoolInfo zero_info = { 0, 0, 0, 0, ObjectPoolBlockMaxItem<D>::value,
-                                 ObjectPoolBlockMaxItem<D>::value, 0 };
+                                 ObjectPoolBlockMaxItem<D>::value, 0,
+                                 (size_t)butil::numa_node_num(), {}, 0 };
     ASSERT_EQ(0, memcmp(&info, &zero_info, sizeof(info)));
 }
 
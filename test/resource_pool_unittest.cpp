@@ -3,6 +3,9 @@
 // Date: Sun Jul 13 15:04:18 CST 2014
 
 #include <gtest/gtest.h>
+#include <pthread.h>
+#include <map>
+#include <vector>
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/fast_rand.h"
@@ -23,9 +26,24 @@ struct Foo {
     }
     int x;
 };
+
+int nreclaimable_ctor = 0;
+int nreclaimable_dtor = 0;
+struct Reclaimable {
+    Reclaimable() : version(0) { ++nreclaimable_ctor; }
+    ~Reclaimable() { ++nreclaimable_dtor; }
+    uint64_t version;
+    char padding[1016];
+};
 }
 
 namespace butil {
+template <> struct ResourcePoolReclaimer<Reclaimable> {
+    static const bool enabled = true;
+    static uint64_t save(const Reclaimable* r) { return r->version; }
+    static void restore(Reclaimable* r, uint64_t v) { r->version = v; }
+};
+
 template <> struct ResourcePoolBlockMaxSize<MyObject> {
     static const size_t value = 128;
 };
@@ -99,7 +117,9 @@ TEST_F(ResourcePoolTest, change_config) {
     printf("%lu\n", ARRAY_SIZE(a));
     
     ResourcePoolInfo info = describe_resources<MyObject>();
-    ResourcePoolInfo zero_info = { 0, 0, 0, 0, 3, 3, 0 };
+    ResourcePoolInfo zero_info = { 0, 0, 0, 0, 3, 3, 0,
+                                   (size_t)butil::numa_node_num(), {},
+                                   0, 0, 0 };
     ASSERT_EQ(0, memcmp(&info, &zero_info, sizeof(info)));
 
     ResourceId<MyObject> id = { 0 };
@@ -384,10 +404,117 @@ TEST_F(ResourcePoolTest, get_and_return_int_multiple_threads) {
     ResourcePoolInfo info = describe_resources<D>();
     ResourcePoolInfo zero_info = { 0, 0, 0, 0,
                                    ResourcePoolBlockMaxItem<D>::value,
-                                   ResourcePoolBlockMaxItem<D>::value, 0};
+                                   ResourcePoolBlockMaxItem<D>::value, 0,
+                                   (size_t)butil::numa_node_num(), {},
+                                   0, 0, 0 };
     ASSERT_EQ(0, memcmp(&info, &zero_info, sizeof(info)));
 }
 
+TEST_F(ResourcePoolTest, numa_placement) {
+    ASSERT_GE(butil::numa_node_num(), 1);
+    ASSERT_LE(butil::numa_node_num(), butil::MAX_NUMA_NODE_NUM);
+    const int node = butil::current_numa_node();
+    ASSERT_TRUE(node >= 0 && node < butil::numa_node_num()) << node;
+
+    std::vector<ResourceId<D> > ids;
+    for (int i = 0; i < 10000; ++i) {
+        ResourceId<D> id = { 0 };
+        ASSERT_TRUE(get_resource<D>(&id));
+        ids.push_back(id);
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, return_resource(ids[i]));
+    }
+    ResourcePoolInfo info = describe_resources<D>();
+    std::cout << info << std::endl;
+    size_t nblock = 0;
+    for (size_t i = 0; i < info.numa_node_num; ++i) {
+        nblock += info.numa_block_num[i];
+    }
+    ASSERT_EQ(info.block_num, nblock);
+    // Free chunks are reused within the only node.
+    if (info.numa_node_num == 1) {
+        ASSERT_EQ(0u, info.remote_free_chunk_num);
+    }
+    clear_resources<D>();
+}
+
+static const size_t RECLAIM_NBLOCK = 4;
+typedef ResourcePool<Reclaimable> ReclaimablePool;
+const size_t RECLAIM_NITEM = ReclaimablePool::BLOCK_NITEM * RECLAIM_NBLOCK;
+std::map<uint64_t, uint64_t> reclaimed_versions;
+
+static void* get_and_return_reclaimable(void*) {
+    std::vector<ResourceId<Reclaimable> > ids;
+    for (size_t i = 0; i < RECLAIM_NITEM; ++i) {
+        ResourceId<Reclaimable> id = { 0 };
+        Reclaimable* r = get_resource(&id);
+        r->version = id.value + 100;
+        reclaimed_versions[id.value] = r->version;
+        ids.push_back(id);
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        EXPECT_EQ(0, return_resource(ids[i]));
+    }
+    return NULL;
+}
+
+TEST_F(ResourcePoolTest, shrink_and_reuse_idle_blocks) {
+    // Hold a local pool in this thread to prevent the pool from being
+    // cleared after the thread below quits.
+    ResourceId<Reclaimable> id0 = { 0 };
+    ASSERT_TRUE(get_resource(&id0));
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, get_and_return_reclaimable, NULL));
+    pthread_join(th, NULL);
+
+    // Blocks allocated by the quitted thread are idle and hidden.
+    ASSERT_EQ(0u, shrink_resources<Reclaimable>(0));
+    ResourcePoolInfo info = describe_resources<Reclaimable>();
+    ASSERT_EQ(RECLAIM_NBLOCK, info.idle_block_num);
+    ASSERT_EQ(0u, info.reclaimed_block_num);
+    const int nctor = nreclaimable_ctor;
+    for (std::map<uint64_t, uint64_t>::iterator
+             it = reclaimed_versions.begin();
+         it != reclaimed_versions.end(); ++it) {
+        ResourceId<Reclaimable> id = { it->first };
+        ASSERT_EQ(NULL, address_resource(id));
+    }
+
+    // Objects are destructed and memory is returned.
+    ASSERT_EQ(RECLAIM_NITEM * sizeof(Reclaimable),
+              shrink_resources<Reclaimable>(0));
+    info = describe_resources<Reclaimable>();
+    ASSERT_EQ(0u, info.idle_block_num);
+    ASSERT_EQ(RECLAIM_NBLOCK, info.reclaimed_block_num);
+    ASSERT_EQ(RECLAIM_NITEM, (size_t)nreclaimable_dtor);
+
+    // Reclaimed blocks are reused before allocating new ones, objects are
+    // constructed again with saved versions. The block of this thread is
+    // used up first.
+    const size_t nblock = info.block_num;
+    const size_t nget = ReclaimablePool::BLOCK_NITEM - 1 + RECLAIM_NITEM;
+    size_t nrestored = 0;
+    for (size_t i = 0; i < nget; ++i) {
+        ResourceId<Reclaimable> id = { 0 };
+        Reclaimable* r = get_resource(&id);
+        ASSERT_TRUE(r);
+        ASSERT_EQ(r, address_resource(id));
+        std::map<uint64_t, uint64_t>::iterator it =
+            reclaimed_versions.find(id.value);
+        if (it != reclaimed_versions.end()) {
+            ASSERT_EQ(it->second, r->version);
+            ++nrestored;
+        }
+    }
+    ASSERT_EQ(RECLAIM_NITEM, nrestored);
+    ASSERT_EQ((int)(nctor + nget), nreclaimable_ctor);
+    info = describe_resources<Reclaimable>();
+    ASSERT_EQ(0u, info.reclaimed_block_num);
+    ASSERT_EQ(nblock, info.block_num);
+    std::cout << info << std::endl;
+}
+
 TEST_F(ResourcePoolTest, verify_get) {
     clear_resources<int>();
     std::cout << describe_resources<int>() << std::endl;
@@ -0,0 +1,480 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/file_util.h>
+#include <butil/string_printf.h>
+#include <butil/strings/string_split.h>
+#include <butil/third_party/rapidjson/document.h>
+#include <butil/third_party/rapidjson/prettywriter.h>
+#include <butil/third_party/rapidjson/stringbuffer.h>
+#include "benchmark.h"
+
+DEFINE_string(benchmark_filter, "", "Only run benchmarks whose names contain "
+              "any of these comma-separated strings, all by default");
+DEFINE_bool(benchmark_list, false, "List names of benchmarks and quit");
+DEFINE_int32(benchmark_min_time_ms, 500, "Iterations of a benchmark are "
+             "increased until it runs for at least so many milliseconds");
+DEFINE_int32(benchmark_repetitions, 1, "Run each benchmark for so many times "
+             "and report the median");
+DEFINE_string(benchmark_format, "console", "Format of results printed to "
+              "stdout, console or json");
+DEFINE_string(benchmark_out, "", "Also write results in json into this file");
+DEFINE_string(benchmark_baseline, "", "Compare results with this json file "
+              "written by -benchmark_out of a previous run");
+DEFINE_double(benchmark_max_regression, 0.1, "Fail if a benchmark is slower "
+              "than the one in -benchmark_baseline by more than this ratio");
+
+namespace bench {
+
+static const int64_t MAX_ITERATIONS = 1000000000L;
+
+// CPU time of the whole process, which includes time spent by bthread
+// workers and the benchmark code may run in different pthreads.
+static int64_t process_cpu_time_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+State::State(int64_t max_iterations, int64_t arg, int thread_index, int threads)
+    : _started(false)
+    , _finished(false)
+    , _remaining(max_iterations)
+    , _max_iterations(max_iterations)
+    , _arg(arg)
+    , _thread_index(thread_index)
+    , _threads(threads)
+    , _real_start_ns(0)
+    , _cpu_start_ns(0)
+    , _real_time_ns(0)
+    , _cpu_time_ns(0)
+    , _bytes_processed(0)
+    , _items_processed(0) {
+}
+
+void State::start_running() {
+    _started = true;
+    ResumeTiming();
+}
+
+void State::finish_running() {
+    if (!_finished) {
+        _finished = true;
+        PauseTiming();
+    }
+}
+
+void State::PauseTiming() {
+    _real_time_ns += butil::monotonic_time_ns() - _real_start_ns;
+    _cpu_time_ns += process_cpu_time_ns() - _cpu_start_ns;
+}
+
+void State::ResumeTiming() {
+    _real_start_ns = butil::monotonic_time_ns();
+    _cpu_start_ns = process_cpu_time_ns();
+}
+
+void State::SkipWithError(const std::string& error) {
+    _error = error;
+    _remaining = 0;
+}
+
+Benchmark::Benchmark(const std::string& name, BenchmarkFunction fn)
+    : _name(name), _fn(fn) {
+}
+
+Benchmark* Benchmark::Arg(int64_t arg) {
+    _args.push_back(arg);
+    return this;
+}
+
+Benchmark* Benchmark::Threads(int n) {
+    _thread_nums.push_back(n);
+    return this;
+}
+
+static std::vector<Benchmark*>* registry() {
+    static std::vector<Benchmark*> benchmarks;
+    return &benchmarks;
+}
+
+Benchmark* RegisterBenchmark(const std::string& name, BenchmarkFunction fn) {
+    Benchmark* b = new Benchmark(name, fn);
+    registry()->push_back(b);
+    return b;
+}
+
+struct RunResult {
+    std::string name;
+    int64_t iterations;
+    // Per iteration.
+    double real_time_ns;
+    double cpu_time_ns;
+    double bytes_per_second;
+    double items_per_second;
+    std::string error;
+};
+
+static bool real_time_less(const RunResult& r1, const RunResult& r2) {
+    return r1.real_time_ns < r2.real_time_ns;
+}
+
+struct ThreadArgs {
+    BenchmarkFunction fn;
+    State* state;
+};
+
+static void* run_thread(void* arg) {
+    ThreadArgs* args = static_cast<ThreadArgs*>(arg);
+    args->fn(*args->state);
+    return NULL;
+}
+
+static void run_once(BenchmarkFunction fn, int64_t iterations, int64_t arg,
+                     int threads, RunResult* result) {
+    std::vector<State*> states(threads);
+    std::vector<ThreadArgs> args(threads);
+    for (int i = 0; i < threads; ++i) {
+        states[i] = new State(iterations, arg, i, threads);
+        args[i].fn = fn;
+        args[i].state = states[i];
+    }
+    if (threads == 1) {
+        run_thread(&args[0]);
+    } else {
+        std::vector<pthread_t> tids(threads);
+        for (int i = 0; i < threads; ++i) {
+            if (pthread_create(&tids[i], NULL, run_thread, &args[i]) != 0) {
+                LOG(FATAL) << "Fail to create pthread";
+            }
+        }
+        for (int i = 0; i < threads; ++i) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+    double real_time_ns = 0;
+    double cpu_time_ns = 0;
+    int64_t bytes = 0;
+    int64_t items = 0;
+    result->error.clear();
+    for (int i = 0; i < threads; ++i) {
+        real_time_ns += states[i]->real_time_ns();
+        cpu_time_ns += states[i]->cpu_time_ns();
+        bytes += states[i]->bytes_processed();
+        items += states[i]->items_processed();
+        if (result->error.empty()) {
+            result->error = states[i]->error();
+        }
+        delete states[i];
+    }
+    // Average over threads. Every thread measures the CPU time of the
+    // process, which is divided by iterations of all threads.
+    real_time_ns /= threads;
+    cpu_time_ns /= threads;
+    const double seconds = std::max(real_time_ns, 1.0) / 1e9;
+    result->iterations = iterations;
+    result->real_time_ns = real_time_ns / iterations;
+    result->cpu_time_ns = cpu_time_ns / (iterations * threads);
+    result->bytes_per_second = bytes / seconds;
+    result->items_per_second = items / seconds;
+}
+
+// Increase iterations until the run lasts for -benchmark_min_time_ms.
+static void run_benchmark(BenchmarkFunction fn, int64_t arg, int threads,
+                          RunResult* result) {
+    const double min_time_ns = FLAGS_benchmark_min_time_ms * 1000000.0;
+    int64_t iterations = 1;
+    while (true) {
+        run_once(fn, iterations, arg, threads, result);
+        if (!result->error.empty()) {
+            return;
+        }
+        const double elapsed_ns = result->real_time_ns * iterations;
+        if (elapsed_ns >= min_time_ns || iterations >= MAX_ITERATIONS) {
+            return;
+        }
+        // Overshoot a little to avoid another round, but no more than 10x
+        // in case that the first iterations are much slower.
+        const double multiplier = std::min(
+            min_time_ns * 1.4 / std::max(elapsed_ns, 1.0), 10.0);
+        iterations = std::min(
+            std::max(iterations + 1, (int64_t)(iterations * multiplier)),
+            MAX_ITERATIONS);
+    }
+}
+
+static bool is_selected(const std::string& name) {
+    if (FLAGS_benchmark_filter.empty()) {
+        return true;
+    }
+    std::vector<std::string> filters;
+    butil::SplitString(FLAGS_benchmark_filter, ',', &filters);
+    for (size_t i = 0; i < filters.size(); ++i) {
+        if (!filters[i].empty() && name.find(filters[i]) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::string human_readable(double value, const char* unit) {
+    static const char* const prefixes[] = { "", "k", "M", "G", "T" };
+    size_t i = 0;
+    while (value >= 1000 && i + 1 < arraysize(prefixes)) {
+        value /= 1000;
+        ++i;
+    }
+    return butil::string_printf("%.2f%s%s", value, prefixes[i], unit);
+}
+
+static void print_console_header() {
+    printf("%-52s %14s %14s %12s  %s\n", "Benchmark", "Time(ns)",
+           "CPU(ns)", "Iterations", "Throughput");
+    printf("%s\n", std::string(110, '-').c_str());
+}
+
+static void print_console(const RunResult& r) {
+    if (!r.error.empty()) {
+        printf("%-52s ERROR: %s\n", r.name.c_str(), r.error.c_str());
+        return;
+    }
+    std::string throughput;
+    if (r.bytes_per_second > 0) {
+        throughput.append(human_readable(r.bytes_per_second, "B/s"));
+    }
+    if (r.items_per_second > 0) {
+        if (!throughput.empty()) {
+            throughput.push_back(' ');
+        }
+        throughput.append(human_readable(r.items_per_second, "items/s"));
+    }
+    printf("%-52s %14.1f %14.1f %12" PRId64 "  %s\n", r.name.c_str(),
+           r.real_time_ns, r.cpu_time_ns, r.iterations, throughput.c_str());
+    fflush(stdout);
+}
+
+static std::string to_json(const std::vector<RunResult>& results) {
+    BUTIL_RAPIDJSON_NAMESPACE::StringBuffer buf;
+    BUTIL_RAPIDJSON_NAMESPACE::PrettyWriter<
+        BUTIL_RAPIDJSON_NAMESPACE::StringBuffer> w(buf);
+    w.StartObject();
+    w.Key("context");
+    w.StartObject();
+    char date[64];
+    const time_t now = time(NULL);
+    struct tm tm_now;
+    localtime_r(&now, &tm_now);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm_now);
+    w.Key("date");
+    w.String(date);
+    char host[256];
+    if (gethostname(host, sizeof(host)) == 0) {
+        host[sizeof(host) - 1] = '\0';
+        w.Key("host_name");
+        w.String(host);
+    }
+    w.Key("num_cpus");
+    w.AddInt64(sysconf(_SC_NPROCESSORS_ONLN));
+    w.Key("min_time_ms");
+    w.AddInt(FLAGS_benchmark_min_time_ms);
+    w.Key("repetitions");
+    w.AddInt(FLAGS_benchmark_repetitions);
+    w.EndObject();
+    w.Key("benchmarks");
+    w.StartArray();
+    for (size_t i = 0; i < results.size(); ++i) {
+        const RunResult& r = results[i];
+        w.StartObject();
+        w.Key("name");
+        w.String(r.name.c_str());
+        if (!r.error.empty()) {
+            w.Key("error_message");
+            w.String(r.error.c_str());
+        } else {
+            w.Key("iterations");
+            w.AddInt64(r.iterations);
+            w.Key("real_time");
+            w.Double(r.real_time_ns);
+            w.Key("cpu_time");
+            w.Double(r.cpu_time_ns);
+            w.Key("time_unit");
+            w.String("ns");
+            if (r.bytes_per_second > 0) {
+                w.Key("bytes_per_second");
+                w.Double(r.bytes_per_second);
+            }
+            if (r.items_per_second > 0) {
+                w.Key("items_per_second");
+                w.Double(r.items_per_second);
+            }
+        }
+        w.EndObject();
+    }
+    w.EndArray();
+    w.EndObject();
+    return std::string(buf.GetString(), buf.GetSize());
+}
+
+// Load real_time of benchmarks from a file written by -benchmark_out.
+static int load_baseline(const std::string& path,
+                         std::map<std::string, double>* baseline) {
+    std::string content;
+    if (!butil::ReadFileToString(butil::FilePath(path), &content)) {
+        LOG(ERROR) << "Fail to read " << path;
+        return -1;
+    }
+    BUTIL_RAPIDJSON_NAMESPACE::Document doc;
+    doc.Parse<0>(content.c_str());
+    if (doc.HasParseError() || !doc.IsObject() ||
+        !doc.HasMember("benchmarks") || !doc["benchmarks"].IsArray()) {
+        LOG(ERROR) << path << " is not written by -benchmark_out";
+        return -1;
+    }
+    const BUTIL_RAPIDJSON_NAMESPACE::Value& benchmarks = doc["benchmarks"];
+    for (BUTIL_RAPIDJSON_NAMESPACE::SizeType i = 0; i < benchmarks.Size(); ++i) {
+        const BUTIL_RAPIDJSON_NAMESPACE::Value& b = benchmarks[i];
+        if (b.IsObject() && b.HasMember("name") && b["name"].IsString() &&
+            b.HasMember("real_time") && b["real_time"].IsNumber()) {
+            (*baseline)[b["name"].GetString()] = b["real_time"].GetDouble();
+        }
+    }
+    return 0;
+}
+
+// Print changes into `out' and returns number of regressed benchmarks.
+static int compare_with_baseline(const std::vector<RunResult>& results,
+                                 const std::map<std::string, double>& baseline,
+                                 FILE* out) {
+    int nregressed = 0;
+    fprintf(out, "\nComparing with %s\n", FLAGS_benchmark_baseline.c_str());
+    fprintf(out, "%-52s %14s %14s %9s\n", "Benchmark", "Baseline(ns)",
+            "Time(ns)", "Change");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const RunResult& r = results[i];
+        std::map<std::string, double>::const_iterator it = baseline.find(r.name);
+        if (!r.error.empty() || it == baseline.end() || it->second <= 0) {
+            continue;
+        }
+        const double change = (r.real_time_ns - it->second) / it->second;
+        const bool regressed = (change > FLAGS_benchmark_max_regression);
+        if (regressed) {
+            ++nregressed;
+        }
+        fprintf(out, "%-52s %14.1f %14.1f %+8.1f%%%s\n", r.name.c_str(),
+                it->second, r.real_time_ns, change * 100,
+                regressed ? "  REGRESSED" : "");
+    }
+    return nregressed;
+}
+
+int RunBenchmarks() {
+    std::map<std::string, double> baseline;
+    if (!FLAGS_benchmark_baseline.empty() &&
+        load_baseline(FLAGS_benchmark_baseline, &baseline) != 0) {
+        return -1;
+    }
+    const bool console = (FLAGS_benchmark_format != "json");
+    if (console && !FLAGS_benchmark_list) {
+        print_console_header();
+    }
+    std::vector<RunResult> results;
+    int nfailed = 0;
+    const std::vector<Benchmark*>& benchmarks = *registry();
+    for (size_t i = 0; i < benchmarks.size(); ++i) {
+        const Benchmark* b = benchmarks[i];
+        std::vector<int64_t> args = b->args();
+        if (args.empty()) {
+            args.push_back(0);
+        }
+        std::vector<int> thread_nums = b->thread_nums();
+        if (thread_nums.empty()) {
+            thread_nums.push_back(1);
+        }
+        const bool show_threads = (thread_nums.size() > 1 || thread_nums[0] != 1);
+        for (size_t j = 0; j < args.size(); ++j) {
+            for (size_t k = 0; k < thread_nums.size(); ++k) {
+                std::string name = b->name();
+                if (!b->args().empty()) {
+                    butil::string_appendf(&name, "/%" PRId64, args[j]);
+                }
+                if (show_threads) {
+                    butil::string_appendf(&name, "/threads:%d", thread_nums[k]);
+                }
+                if (!is_selected(name)) {
+                    continue;
+                }
+                if (FLAGS_benchmark_list) {
+                    printf("%s\n", name.c_str());
+                    continue;
+                }
+                std::vector<RunResult> reps(
+                    std::max(FLAGS_benchmark_repetitions, 1));
+                for (size_t r = 0; r < reps.size(); ++r) {
+                    run_benchmark(b->function(), args[j], thread_nums[k], &reps[r]);
+                    if (!reps[r].error.empty()) {
+                        reps[0] = reps[r];
+                        reps.resize(1);
+                        break;
+                    }
+                }
+                std::sort(reps.begin(), reps.end(), real_time_less);
+                RunResult result = reps[reps.size() / 2];
+                result.name = name;
+                if (!result.error.empty()) {
+                    ++nfailed;
+                }
+                if (console) {
+                    print_console(result);
+                }
+                results.push_back(result);
+            }
+        }
+    }
+    if (FLAGS_benchmark_list) {
+        return 0;
+    }
+    const std::string json = to_json(results);
+    if (!console) {
+        printf("%s\n", json.c_str());
+    }
+    if (!FLAGS_benchmark_out.empty() &&
+        butil::WriteFile(butil::FilePath(FLAGS_benchmark_out),
+                         json.data(), json.size()) != (int)json.size()) {
+        LOG(ERROR) << "Fail to write " << FLAGS_benchmark_out;
+        return -1;
+    }
+    int nregressed = 0;
+    if (!baseline.empty()) {
+        // Keep stdout as valid json.
+        nregressed = compare_with_baseline(results, baseline,
+                                           console ? stdout : stderr);
+    }
+    if (nfailed || nregressed) {
+        LOG(ERROR) << nfailed << " benchmarks failed, "
+                   << nregressed << " benchmarks regressed";
+        return 1;
+    }
+    return 0;
+}
+
+} // namespace bench
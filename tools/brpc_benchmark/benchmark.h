@@ -0,0 +1,153 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_BENCHMARK_BENCHMARK_H
+#define BRPC_BENCHMARK_BENCHMARK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <butil/macros.h>
+
+namespace bench {
+
+// Passed to a benchmark function which runs the measured code in a loop:
+//   static void BM_Something(bench::State& state) {
+//       ... setup, not timed ...
+//       while (state.KeepRunning()) {
+//           ... measured code ...
+//       }
+//   }
+//   BENCHMARK(BM_Something)->Arg(16)->Arg(4096)->Threads(1)->Threads(8);
+// The runner grows the number of iterations until a run lasts for at least
+// -benchmark_min_time_ms.
+class State {
+public:
+    State(int64_t max_iterations, int64_t arg, int thread_index, int threads);
+
+    // Returns true if one more iteration should be run. The timer starts
+    // at the first call and stops when false is returned.
+    bool KeepRunning() {
+        if (BAIDU_UNLIKELY(!_started)) {
+            start_running();
+        }
+        if (BAIDU_LIKELY(_remaining > 0)) {
+            --_remaining;
+            return true;
+        }
+        finish_running();
+        return false;
+    }
+
+    // Exclude code between the two calls from timing, which is slow and
+    // should be used outside tight loops.
+    void PauseTiming();
+    void ResumeTiming();
+
+    // Report throughputs along with the latencies.
+    void SetBytesProcessed(int64_t bytes) { _bytes_processed = bytes; }
+    void SetItemsProcessed(int64_t items) { _items_processed = items; }
+
+    // Mark the benchmark as failed, KeepRunning() returns false afterwards.
+    void SkipWithError(const std::string& error);
+
+    int64_t iterations() const { return _max_iterations; }
+    // Argument set by Benchmark::Arg(), 0 by default.
+    int64_t arg() const { return _arg; }
+    // Index of the calling thread in [0, threads()).
+    int thread_index() const { return _thread_index; }
+    int threads() const { return _threads; }
+
+    int64_t real_time_ns() const { return _real_time_ns; }
+    int64_t cpu_time_ns() const { return _cpu_time_ns; }
+    int64_t bytes_processed() const { return _bytes_processed; }
+    int64_t items_processed() const { return _items_processed; }
+    const std::string& error() const { return _error; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(State);
+    void start_running();
+    void finish_running();
+
+    bool _started;
+    bool _finished;
+    int64_t _remaining;
+    int64_t _max_iterations;
+    int64_t _arg;
+    int _thread_index;
+    int _threads;
+    int64_t _real_start_ns;
+    int64_t _cpu_start_ns;
+    int64_t _real_time_ns;
+    int64_t _cpu_time_ns;
+    int64_t _bytes_processed;
+    int64_t _items_processed;
+    std::string _error;
+};
+
+typedef void (*BenchmarkFunction)(State& state);
+
+// A registered benchmark, which runs once for each combination of args
+// and thread numbers.
+class Benchmark {
+public:
+    Benchmark(const std::string& name, BenchmarkFunction fn);
+
+    // Run with State::arg() being `arg', the name is suffixed with "/<arg>".
+    Benchmark* Arg(int64_t arg);
+    // Call the function in `n' threads concurrently, the name is suffixed
+    // with "/threads:<n>" when any of the thread numbers is not 1.
+    Benchmark* Threads(int n);
+
+    const std::string& name() const { return _name; }
+    BenchmarkFunction function() const { return _fn; }
+    const std::vector<int64_t>& args() const { return _args; }
+    const std::vector<int>& thread_nums() const { return _thread_nums; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Benchmark);
+    std::string _name;
+    BenchmarkFunction _fn;
+    std::vector<int64_t> _args;
+    std::vector<int> _thread_nums;
+};
+
+// Register a benchmark which is not owned by the caller. Returns the
+// benchmark to be configured further.
+Benchmark* RegisterBenchmark(const std::string& name, BenchmarkFunction fn);
+
+// Run benchmarks selected by flags and report results. Returns 0 on
+// success, non-zero if any benchmark failed or regressed against
+// -benchmark_baseline.
+int RunBenchmarks();
+
+// Prevent the compiler from optimizing away computations whose results
+// are not used otherwise.
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void ClobberMemory() {
+    asm volatile("" : : : "memory");
+}
+
+} // namespace bench
+
+#define BENCHMARK(fn)                                                   \
+    static ::bench::Benchmark* BAIDU_CONCAT(benchmark_registered_, __LINE__) \
+    ALLOW_UNUSED = ::bench::RegisterBenchmark(#fn, fn)
+
+#endif // BRPC_BENCHMARK_BENCHMARK_H
@@ -0,0 +1,27 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+// A standalone runner of microbenchmarks on hot paths of brpc. Run with
+// -benchmark_out=<file> to save results and -benchmark_baseline=<file> to
+// compare with results saved before, e.g. of the previous release.
+
+#include <gflags/gflags.h>
+#include "benchmark.h"
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    return bench::RunBenchmarks();
+}
@@ -0,0 +1,225 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Benchmarks of creating, switching and waking up bthreads.
+
+#include <pthread.h>
+#include <butil/atomicops.h>
+#include <bthread/bthread.h>
+#include <bthread/butex.h>
+#include "benchmark.h"
+
+namespace {
+
+void* do_nothing(void*) {
+    return NULL;
+}
+
+struct BenchmarkInBthread {
+    bench::BenchmarkFunction fn;
+    bench::State* state;
+};
+
+void* run_benchmark_in_bthread(void* arg) {
+    BenchmarkInBthread* b = static_cast<BenchmarkInBthread*>(arg);
+    b->fn(*b->state);
+    return NULL;
+}
+
+// Run `fn' in a bthread and wait for its completion.
+void run_in_bthread(bench::BenchmarkFunction fn, bench::State& state) {
+    BenchmarkInBthread b = { fn, &state };
+    bthread_t th;
+    if (bthread_start_urgent(&th, NULL, run_benchmark_in_bthread, &b) != 0) {
+        return state.SkipWithError("Fail to create bthread");
+    }
+    bthread_join(th, NULL);
+}
+
+void start_urgent_and_join(bench::State& state) {
+    while (state.KeepRunning()) {
+        bthread_t th;
+        bthread_start_urgent(&th, NULL, do_nothing, NULL);
+        bthread_join(th, NULL);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Create a bthread from a bthread, which runs the new bthread immediately.
+void BM_BthreadStartUrgent(bench::State& state) {
+    run_in_bthread(start_urgent_and_join, state);
+}
+BENCHMARK(BM_BthreadStartUrgent);
+
+// Create bthreads from pthreads, which are queued remotely and picked up
+// by idle workers.
+void BM_BthreadStartBackground(bench::State& state) {
+    while (state.KeepRunning()) {
+        bthread_t th;
+        bthread_start_background(&th, NULL, do_nothing, NULL);
+        bthread_join(th, NULL);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BthreadStartBackground)->Threads(1)->Threads(4);
+
+void start_batch_and_join(bench::State& state) {
+    const size_t batch = 64;
+    std::vector<bthread_t> tids;
+    tids.reserve(batch);
+    while (state.KeepRunning()) {
+        bthread_t th;
+        bthread_start_background(&th, NULL, do_nothing, NULL);
+        tids.push_back(th);
+        if (tids.size() == batch) {
+            for (size_t i = 0; i < tids.size(); ++i) {
+                bthread_join(tids[i], NULL);
+            }
+            tids.clear();
+        }
+    }
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Create batches of bthreads from pthreads, which are pushed into remote
+// runqueues of workers concurrently.
+void BM_BthreadStartBackgroundBatch(bench::State& state) {
+    start_batch_and_join(state);
+}
+BENCHMARK(BM_BthreadStartBackgroundBatch)->Threads(1)->Threads(4)->Threads(8);
+
+// Create batches of bthreads in the runqueue of a worker, most of which
+// are stolen by other workers.
+void BM_BthreadSteal(bench::State& state) {
+    run_in_bthread(start_batch_and_join, state);
+}
+BENCHMARK(BM_BthreadSteal);
+
+// The butex is incremented alternatively by two sides: ping makes it odd
+// and pong makes it even again. A negative value stops pong.
+void* pong(void* arg) {
+    butil::atomic<int>* b = static_cast<butil::atomic<int>*>(arg);
+    while (true) {
+        const int v = b->load(butil::memory_order_acquire);
+        if (v < 0) {
+            break;
+        }
+        if (v & 1) {
+            b->store(v + 1, butil::memory_order_release);
+            bthread::butex_wake(b);
+        } else {
+            bthread::butex_wait(b, v, NULL);
+        }
+    }
+    return NULL;
+}
+
+void ping(bench::State& state) {
+    butil::atomic<int>* b = bthread::butex_create_checked<butil::atomic<int> >();
+    b->store(0, butil::memory_order_relaxed);
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, pong, b) != 0) {
+        bthread::butex_destroy(b);
+        return state.SkipWithError("Fail to create bthread");
+    }
+    while (state.KeepRunning()) {
+        const int v = b->load(butil::memory_order_relaxed) + 1;
+        b->store(v, butil::memory_order_release);
+        bthread::butex_wake(b);
+        while (b->load(butil::memory_order_acquire) == v) {
+            bthread::butex_wait(b, v, NULL);
+        }
+    }
+    b->store(-1, butil::memory_order_release);
+    bthread::butex_wake(b);
+    bthread_join(th, NULL);
+    bthread::butex_destroy(b);
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Round trips between two bthreads waking each other with a butex, which
+// are 2 context switches per iteration.
+void BM_BthreadSwitch(bench::State& state) {
+    run_in_bthread(ping, state);
+}
+BENCHMARK(BM_BthreadSwitch);
+
+// Round trips between a pthread and a bthread.
+void BM_ButexPingPong(bench::State& state) {
+    ping(state);
+}
+BENCHMARK(BM_ButexPingPong);
+
+// Waking up a butex without waiters, the cost paid by every notification.
+void BM_ButexWakeNoWaiter(bench::State& state) {
+    butil::atomic<int>* b = bthread::butex_create_checked<butil::atomic<int> >();
+    while (state.KeepRunning()) {
+        b->fetch_add(1, butil::memory_order_release);
+        bthread::butex_wake(b);
+    }
+    bthread::butex_destroy(b);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ButexWakeNoWaiter)->Threads(1)->Threads(4);
+
+void get_specific(bench::State& state) {
+    bthread_key_t key;
+    if (bthread_key_create(&key, NULL) != 0) {
+        return state.SkipWithError("Fail to create key");
+    }
+    bthread_setspecific(key, &key);
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(bthread_getspecific(key));
+    }
+    bthread_setspecific(key, NULL);
+    bthread_key_delete(key);
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Get bthread-local data by a key, which looks up the KeyTable.
+void BM_BthreadGetSpecific(bench::State& state) {
+    run_in_bthread(get_specific, state);
+}
+BENCHMARK(BM_BthreadGetSpecific);
+
+bthread_fast_slot_t g_fast_slot = -1;
+pthread_once_t g_fast_slot_once = PTHREAD_ONCE_INIT;
+
+void create_fast_slot() {
+    bthread_fast_slot_create(&g_fast_slot, NULL);
+}
+
+void get_fast_slot(bench::State& state) {
+    pthread_once(&g_fast_slot_once, create_fast_slot);
+    if (bthread_fast_slot_set(g_fast_slot, &g_fast_slot) != 0) {
+        return state.SkipWithError("Fail to create fast slot");
+    }
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(bthread_fast_slot_get(g_fast_slot));
+    }
+    bthread_fast_slot_set(g_fast_slot, NULL);
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Get bthread-local data in a fast slot.
+void BM_BthreadFastSlotGet(bench::State& state) {
+    run_in_bthread(get_fast_slot, state);
+}
+BENCHMARK(BM_BthreadFastSlotGet);
+
+} // namespace
@@ -0,0 +1,174 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Benchmarks of IOBuf, FlatMap and DoublyBufferedData.
+
+#include <butil/iobuf.h>
+#include <butil/containers/flat_map.h>
+#include <butil/containers/doubly_buffered_data.h>
+#include <butil/fast_rand.h>
+#include "benchmark.h"
+
+namespace {
+
+// Append `arg' bytes and cut them out, which is what protocols do with
+// every message.
+void BM_IOBufAppendCut(bench::State& state) {
+    const size_t len = state.arg();
+    const std::string data(len, 'x');
+    butil::IOBuf buf;
+    butil::IOBuf out;
+    while (state.KeepRunning()) {
+        buf.append(data);
+        buf.cutn(&out, len);
+        out.clear();
+    }
+    state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_IOBufAppendCut)->Arg(16)->Arg(1024)->Arg(64 * 1024);
+
+// Append an IOBuf by referencing its blocks, without copying.
+void BM_IOBufAppendRef(bench::State& state) {
+    butil::IOBuf src;
+    for (int i = 0; i < 4; ++i) {
+        src.append(std::string(8192, 'x'));
+    }
+    butil::IOBuf buf;
+    while (state.KeepRunning()) {
+        buf.append(src);
+        buf.pop_front(src.size());
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+}
+BENCHMARK(BM_IOBufAppendRef);
+
+void BM_IOBufCopyTo(bench::State& state) {
+    const size_t len = state.arg();
+    butil::IOBuf buf;
+    buf.append(std::string(len, 'x'));
+    std::string out;
+    out.resize(len);
+    while (state.KeepRunning()) {
+        buf.copy_to(&out[0], len);
+        bench::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_IOBufCopyTo)->Arg(1024)->Arg(64 * 1024);
+
+// Seek `arg' keys in a FlatMap randomly.
+void BM_FlatMapSeek(bench::State& state) {
+    const size_t n = state.arg();
+    butil::FlatMap<uint64_t, uint64_t> m;
+    if (m.init(n * 2) != 0) {
+        return state.SkipWithError("Fail to init FlatMap");
+    }
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = butil::fast_rand();
+        m[keys[i]] = i;
+    }
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(m.seek(keys[i]));
+        if (++i == n) {
+            i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FlatMapSeek)->Arg(64)->Arg(65536);
+
+void BM_FlatMapInsertErase(bench::State& state) {
+    const size_t n = state.arg();
+    butil::FlatMap<uint64_t, uint64_t> m;
+    if (m.init(n * 2) != 0) {
+        return state.SkipWithError("Fail to init FlatMap");
+    }
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = butil::fast_rand();
+    }
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        m[keys[i]] = i;
+        m.erase(keys[i]);
+        if (++i == n) {
+            i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FlatMapInsertErase)->Arg(64)->Arg(65536);
+
+
+// Read by all threads like SelectServer() of load balancers.
+butil::DoublyBufferedData<std::vector<int> > g_dbd;
+butil::DoublyBufferedData<std::vector<int>, butil::Void, true> g_wait_free_dbd;
+
+template <typename DBD>
+void read_dbd(bench::State& state, DBD& dbd) {
+    while (state.KeepRunning()) {
+        typename DBD::ScopedPtr ptr;
+        if (dbd.Read(&ptr) != 0) {
+            return state.SkipWithError("Fail to read");
+        }
+        bench::DoNotOptimize(ptr->size());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Read() locking a thread-local mutex.
+void BM_DoublyBufferedDataRead(bench::State& state) {
+    read_dbd(state, g_dbd);
+}
+BENCHMARK(BM_DoublyBufferedDataRead)->Threads(1)->Threads(8)->Threads(128);
+
+// Read() marking a thread-local epoch.
+void BM_WaitFreeDoublyBufferedDataRead(bench::State& state) {
+    read_dbd(state, g_wait_free_dbd);
+}
+BENCHMARK(BM_WaitFreeDoublyBufferedDataRead)
+    ->Threads(1)->Threads(8)->Threads(128);
+
+size_t push_one(std::vector<int>& v) {
+    v.push_back(1);
+    if (v.size() > 64) {
+        v.clear();
+    }
+    return 1;
+}
+
+// Modify() waiting for readers in wrappers of all threads which read the
+// instances in benchmarks above.
+template <typename DBD>
+void modify_dbd(bench::State& state, DBD& dbd) {
+    while (state.KeepRunning()) {
+        dbd.Modify(push_one);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_DoublyBufferedDataModify(bench::State& state) {
+    modify_dbd(state, g_dbd);
+}
+BENCHMARK(BM_DoublyBufferedDataModify);
+
+void BM_WaitFreeDoublyBufferedDataModify(bench::State& state) {
+    modify_dbd(state, g_wait_free_dbd);
+}
+BENCHMARK(BM_WaitFreeDoublyBufferedDataModify);
+
+} // namespace
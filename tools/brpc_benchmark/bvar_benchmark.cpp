@@ -0,0 +1,72 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Benchmarks of updating bvars from multiple threads, which shares the
+// same variable just like RPC frameworks do.
+
+#include <bvar/bvar.h>
+#include "benchmark.h"
+
+namespace {
+
+bvar::Adder<int64_t> g_adder;
+bvar::Maxer<int64_t> g_maxer;
+bvar::IntRecorder g_int_recorder;
+bvar::LatencyRecorder g_latency_recorder;
+
+void BM_AdderAdd(bench::State& state) {
+    while (state.KeepRunning()) {
+        g_adder << 1;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AdderAdd)->Threads(1)->Threads(4)->Threads(8);
+
+void BM_MaxerUpdate(bench::State& state) {
+    int64_t i = 0;
+    while (state.KeepRunning()) {
+        g_maxer << ++i;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MaxerUpdate)->Threads(1)->Threads(4)->Threads(8);
+
+void BM_IntRecorderUpdate(bench::State& state) {
+    int64_t i = 0;
+    while (state.KeepRunning()) {
+        g_int_recorder << (++i & 1023);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IntRecorderUpdate)->Threads(1)->Threads(4)->Threads(8);
+
+void BM_LatencyRecorderUpdate(bench::State& state) {
+    int64_t i = 0;
+    while (state.KeepRunning()) {
+        g_latency_recorder << (++i & 1023);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LatencyRecorderUpdate)->Threads(1)->Threads(4)->Threads(8);
+
+void BM_AdderGetValue(bench::State& state) {
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(g_adder.get_value());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AdderGetValue);
+
+} // namespace
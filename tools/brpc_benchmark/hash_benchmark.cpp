@@ -0,0 +1,93 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Benchmarks of hash functions used by consistent hashing load balancers
+// and FlatMap.
+
+#include <string>
+#include <vector>
+#include <butil/fast_hash.h>
+#include <butil/containers/flat_map.h>
+#include <butil/string_printf.h>
+#include <brpc/policy/hasher.h>
+#include "benchmark.h"
+
+namespace {
+
+typedef uint32_t (*HashFunc)(const void*, size_t);
+
+void hash_keys(bench::State& state, HashFunc hash) {
+    std::string key(state.arg(), 'x');
+    for (size_t i = 0; i < key.size(); ++i) {
+        key[i] = 'a' + i % 26;
+    }
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(hash(key.data(), key.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * key.size());
+}
+
+// Request codes of c_md5, c_murmurhash and c_wyhash are generally computed
+// by the same hash functions on keys of requests.
+void BM_MD5Hash32(bench::State& state) {
+    hash_keys(state, brpc::policy::MD5Hash32);
+}
+BENCHMARK(BM_MD5Hash32)->Arg(8)->Arg(64)->Arg(1024);
+
+void BM_MurmurHash32(bench::State& state) {
+    hash_keys(state, brpc::policy::MurmurHash32);
+}
+BENCHMARK(BM_MurmurHash32)->Arg(8)->Arg(64)->Arg(1024);
+
+void BM_WyHash32(bench::State& state) {
+    hash_keys(state, brpc::policy::WyHash32);
+}
+BENCHMARK(BM_WyHash32)->Arg(8)->Arg(64)->Arg(1024);
+
+template <typename Hasher>
+void seek_strings(bench::State& state) {
+    const size_t N = 10000;
+    butil::FlatMap<std::string, size_t, Hasher> m;
+    if (m.init(N * 2) != 0) {
+        return state.SkipWithError("Fail to init FlatMap");
+    }
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < N; ++i) {
+        keys.push_back(butil::string_printf("%0*lu", (int)state.arg(),
+                                            (unsigned long)i));
+        m[keys.back()] = i;
+    }
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(m.seek(keys[i]));
+        if (++i == N) {
+            i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Seek string keys in FlatMap with the default hasher and WyHasher.
+void BM_FlatMapSeekDefaultHasher(bench::State& state) {
+    seek_strings<butil::DefaultHasher<std::string> >(state);
+}
+BENCHMARK(BM_FlatMapSeekDefaultHasher)->Arg(16)->Arg(128);
+
+void BM_FlatMapSeekWyHasher(bench::State& state) {
+    seek_strings<butil::WyHasher<std::string> >(state);
+}
+BENCHMARK(BM_FlatMapSeekWyHasher)->Arg(16)->Arg(128);
+
+} // namespace
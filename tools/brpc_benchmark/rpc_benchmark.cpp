@@ -0,0 +1,273 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Benchmarks of writing sockets, parsing messages and echo RPCs over
+// loopback.
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <butil/logging.h>
+#include <butil/string_printf.h>
+#include <bthread/bthread.h>
+#include <brpc/channel.h>
+#include <brpc/server.h>
+#include <brpc/socket.h>
+#include <brpc/protocol.h>
+#include <brpc/controller.h>
+#include <brpc/input_message_base.h>
+#include "echo.pb.h"
+#include "benchmark.h"
+
+namespace {
+
+class EchoServiceImpl : public benchmark::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const benchmark::EchoRequest* request,
+              benchmark::EchoResponse* response,
+              google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        response->set_message(request->message());
+    }
+};
+
+// Shared by all benchmarks in this file, created at the first use.
+struct RpcEnv {
+    EchoServiceImpl service;
+    brpc::Server server;
+    // Same service over a unix domain socket.
+    brpc::Server unix_server;
+    std::string unix_address;
+    // Written by BM_SocketWrite, the other side is drained by `drainer'.
+    brpc::SocketUniquePtr write_socket;
+    int write_fds[2];
+    pthread_t drainer;
+    // Used as the connection of parsed messages.
+    brpc::SocketUniquePtr parse_socket;
+    int parse_fds[2];
+};
+
+RpcEnv* g_env = NULL;
+pthread_once_t g_env_once = PTHREAD_ONCE_INIT;
+
+void* drain(void* arg) {
+    const int fd = *static_cast<int*>(arg);
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    return NULL;
+}
+
+int create_socket(int fd, brpc::SocketUniquePtr* ptr) {
+    brpc::SocketOptions options;
+    options.fd = fd;
+    brpc::SocketId id;
+    if (brpc::Socket::Create(options, &id) != 0) {
+        return -1;
+    }
+    return brpc::Socket::Address(id, ptr);
+}
+
+void init_env() {
+    RpcEnv* env = new RpcEnv;
+    if (env->server.AddService(&env->service,
+                               brpc::SERVER_DOESNT_OWN_SERVICE) != 0 ||
+        env->server.Start("127.0.0.1:0", NULL) != 0) {
+        LOG(ERROR) << "Fail to start echo server";
+        return;
+    }
+    env->unix_address = butil::string_printf(
+        "unix:/tmp/brpc_benchmark_%d.sock", (int)getpid());
+    if (env->unix_server.AddService(&env->service,
+                                    brpc::SERVER_DOESNT_OWN_SERVICE) != 0 ||
+        env->unix_server.Start(env->unix_address.c_str(), NULL) != 0) {
+        LOG(ERROR) << "Fail to start echo server on " << env->unix_address;
+        return;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, env->write_fds) != 0 ||
+        create_socket(env->write_fds[0], &env->write_socket) != 0 ||
+        pthread_create(&env->drainer, NULL, drain, &env->write_fds[1]) != 0) {
+        LOG(ERROR) << "Fail to create socket to write";
+        return;
+    }
+    if (pipe(env->parse_fds) != 0 ||
+        create_socket(env->parse_fds[1], &env->parse_socket) != 0) {
+        LOG(ERROR) << "Fail to create socket to parse";
+        return;
+    }
+    g_env = env;
+}
+
+RpcEnv* get_env(bench::State& state) {
+    pthread_once(&g_env_once, init_env);
+    if (g_env == NULL) {
+        state.SkipWithError("Fail to initialize");
+    }
+    return g_env;
+}
+
+// Write `arg' bytes into a socket each time, which are sent by KeepWrite
+// bthreads in the background.
+void BM_SocketWrite(bench::State& state) {
+    RpcEnv* env = get_env(state);
+    if (env == NULL) {
+        return;
+    }
+    const std::string data(state.arg(), 'x');
+    while (state.KeepRunning()) {
+        butil::IOBuf buf;
+        buf.append(data);
+        if (env->write_socket->Write(&buf) != 0) {
+            if (errno != brpc::EOVERCROWDED) {
+                state.SkipWithError(berror());
+                break;
+            }
+            // Too many bytes are not written yet, back off a bit.
+            bthread_usleep(1000);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_SocketWrite)->Arg(64)->Arg(4096)->Threads(1)->Threads(4);
+
+// Parse a request packed by the protocol repeatedly. HTTP requests are
+// written directly since packing them depends on the connection.
+void parse_message(bench::State& state, brpc::ProtocolType type) {
+    RpcEnv* env = get_env(state);
+    if (env == NULL) {
+        return;
+    }
+    const brpc::Protocol* protocol = brpc::FindProtocol(type);
+    if (protocol == NULL) {
+        return state.SkipWithError("Unknown protocol");
+    }
+    benchmark::EchoRequest req;
+    req.set_message(std::string(64, 'x'));
+    butil::IOBuf packet;
+    if (type == brpc::PROTOCOL_HTTP) {
+        const std::string body = req.SerializeAsString();
+        packet.append(butil::string_printf(
+            "POST /EchoService/Echo HTTP/1.1\r\n"
+            "Host: 127.0.0.1\r\n"
+            "Content-Type: application/proto\r\n"
+            "Content-Length: %lu\r\n\r\n", (unsigned long)body.size()));
+        packet.append(body);
+    } else {
+        brpc::Controller cntl;
+        butil::IOBuf body;
+        protocol->serialize_request(&body, &cntl, &req);
+        protocol->pack_request(&packet, NULL, cntl.call_id().value,
+                               benchmark::EchoService::descriptor()->method(0),
+                               &cntl, body, NULL);
+        if (cntl.Failed()) {
+            return state.SkipWithError(cntl.ErrorText());
+        }
+    }
+    while (state.KeepRunning()) {
+        butil::IOBuf buf(packet);
+        brpc::ParseResult result =
+            protocol->parse(&buf, env->parse_socket.get(), false, NULL);
+        if (!result.is_ok()) {
+            state.SkipWithError(result.error_str());
+            break;
+        }
+        result.message()->Destroy();
+    }
+    state.SetBytesProcessed(state.iterations() * packet.size());
+}
+
+void BM_ParseBaiduStd(bench::State& state) {
+    parse_message(state, brpc::PROTOCOL_BAIDU_STD);
+}
+BENCHMARK(BM_ParseBaiduStd);
+
+void BM_ParseHuluPbrpc(bench::State& state) {
+    parse_message(state, brpc::PROTOCOL_HULU_PBRPC);
+}
+BENCHMARK(BM_ParseHuluPbrpc);
+
+void BM_ParseSofaPbrpc(bench::State& state) {
+    parse_message(state, brpc::PROTOCOL_SOFA_PBRPC);
+}
+BENCHMARK(BM_ParseSofaPbrpc);
+
+void BM_ParseHttp(bench::State& state) {
+    parse_message(state, brpc::PROTOCOL_HTTP);
+}
+BENCHMARK(BM_ParseHttp);
+
+// Synchronous echo RPCs to the server in this process over loopback, or
+// over a unix domain socket if `over_unix_socket' is true.
+void echo(bench::State& state, const char* protocol,
+          bool over_unix_socket = false) {
+    RpcEnv* env = get_env(state);
+    if (env == NULL) {
+        return;
+    }
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = protocol;
+    const int rc = over_unix_socket ?
+        channel.Init(env->unix_address.c_str(), &options) :
+        channel.Init(env->server.listen_address(), &options);
+    if (rc != 0) {
+        return state.SkipWithError("Fail to init channel");
+    }
+    benchmark::EchoService_Stub stub(&channel);
+    benchmark::EchoRequest req;
+    req.set_message(std::string(64, 'x'));
+    while (state.KeepRunning()) {
+        brpc::Controller cntl;
+        benchmark::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        if (cntl.Failed()) {
+            state.SkipWithError(cntl.ErrorText());
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_EchoBaiduStd(bench::State& state) {
+    echo(state, "baidu_std");
+}
+BENCHMARK(BM_EchoBaiduStd)->Threads(1)->Threads(8);
+
+void BM_EchoBaiduStdUnix(bench::State& state) {
+    echo(state, "baidu_std", true);
+}
+BENCHMARK(BM_EchoBaiduStdUnix)->Threads(1)->Threads(8);
+
+void BM_EchoHuluPbrpc(bench::State& state) {
+    echo(state, "hulu_pbrpc");
+}
+BENCHMARK(BM_EchoHuluPbrpc)->Threads(1)->Threads(8);
+
+void BM_EchoSofaPbrpc(bench::State& state) {
+    echo(state, "sofa_pbrpc");
+}
+BENCHMARK(BM_EchoSofaPbrpc)->Threads(1)->Threads(8);
+
+void BM_EchoHttp(bench::State& state) {
+    echo(state, "http");
+}
+BENCHMARK(BM_EchoHttp)->Threads(1)->Threads(8);
+
+void BM_EchoHttpUnix(bench::State& state) {
+    echo(state, "http", true);
+}
+BENCHMARK(BM_EchoHttpUnix)->Threads(1)->Threads(8);
+
+} // namespace
@@ -0,0 +1,80 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Benchmarks of clocks used on hot paths of RPCs.
+
+#include <time.h>
+#include <butil/time.h>
+#include "benchmark.h"
+
+namespace {
+
+void BM_GettimeofdayUs(bench::State& state) {
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(butil::gettimeofday_us());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GettimeofdayUs)->Threads(1)->Threads(4);
+
+// TSC-based elapse since the Epoch.
+void BM_FastRealtimeUs(bench::State& state) {
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(butil::fast_realtime_us());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FastRealtimeUs)->Threads(1)->Threads(4);
+
+void BM_MonotonicTimeNs(bench::State& state) {
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(butil::monotonic_time_ns());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MonotonicTimeNs);
+
+void BM_CpuwideTimeUs(bench::State& state) {
+    while (state.KeepRunning()) {
+        bench::DoNotOptimize(butil::cpuwide_time_us());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CpuwideTimeUs)->Threads(1)->Threads(4);
+
+// Timestamps taken by a RPC on both sides: begin/end and deadline checks
+// in wall time, phases, latencies of methods and spans in cpuwide time.
+// `arg' = 0 reads clocks of the system, 1 reads the TSC.
+void BM_PerRpcTimestamps(bench::State& state) {
+    const bool use_tsc = (state.arg() == 1);
+    const int kRealtimeStamps = 4;
+    const int kCpuwideStamps = 12;
+    while (state.KeepRunning()) {
+        int64_t sum = 0;
+        for (int i = 0; i < kRealtimeStamps; ++i) {
+            sum += (use_tsc ? butil::fast_realtime_us() :
+                    butil::gettimeofday_us());
+        }
+        for (int i = 0; i < kCpuwideStamps; ++i) {
+            sum += (use_tsc ? butil::cpuwide_time_us() :
+                    butil::monotonic_time_ns() / 1000L);
+        }
+        bench::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PerRpcTimestamps)->Arg(0)->Arg(1);
+
+} // namespace
@@ -0,0 +1,380 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Drive load balancers with simulated servers and compare latencies of the
+// calls, distribution of the traffic and costs of SelectServer/Feedback.
+// Calls never touch network: a server is modeled by a latency distribution
+// inflated by the calls in flight beyond its capacity, some servers are
+// slow or failing, and servers may be removed and added back periodically.
+
+#include <gflags/gflags.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <math.h>
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <vector>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/fast_rand.h>
+#include <butil/string_splitter.h>
+#include <butil/string_printf.h>
+#include <butil/containers/flat_map.h>
+#include <brpc/controller.h>
+#include <brpc/global.h>
+#include <brpc/load_balancer.h>
+#include <brpc/socket.h>
+
+DEFINE_string(lb, "rr,wrr,random,la,c_murmurhash", "Comma-separated names of"
+              " load balancers to run one after another");
+DEFINE_int32(server_num, 32, "Number of simulated servers");
+DEFINE_int32(thread_num, 4, "Number of threads selecting servers");
+DEFINE_int32(concurrency, 64, "Max number of calls in flight of each thread");
+DEFINE_int32(duration_s, 5, "Seconds to run each load balancer");
+DEFINE_uint64(seed, 1, "Seed of the simulation, runs with the same seed "
+              "model servers in the same way");
+DEFINE_string(latency_dist, "exp", "Distribution of latencies of servers: "
+              "fixed, uniform (in [0, 2*mean]) or exp");
+DEFINE_int32(latency_us, 200, "Mean latency of a server not overloaded");
+DEFINE_int32(server_capacity, 8, "Calls a server handles in parallel, "
+             "latencies grow proportionally with calls beyond the capacity");
+DEFINE_int32(slow_server_num, 2, "Number of servers slower than others");
+DEFINE_double(slow_factor, 5, "Latencies of slow servers are multiplied "
+              "by this factor");
+DEFINE_int32(failing_server_num, 1, "Number of servers failing calls");
+DEFINE_double(fail_ratio, 0.5, "Ratio of calls failed by failing servers");
+DEFINE_int32(churn_interval_ms, 0, "Remove a random server every so many "
+             "milliseconds and add it back after -churn_down_ms, 0 to disable");
+DEFINE_int32(churn_down_ms, 100, "Milliseconds that a removed server is "
+             "absent from the load balancer");
+
+// Latencies beyond are counted in the last bucket.
+static const int64_t MAX_LATENCY_US = 1000000;
+
+struct Server {
+    brpc::ServerId id;
+    double latency_factor;
+    double fail_ratio;
+    butil::atomic<int> inflight;
+};
+
+std::vector<Server*> g_servers;
+butil::FlatMap<brpc::SocketId, size_t> g_server_index;
+
+struct Call {
+    int64_t begin_us;
+    int64_t end_us;
+    size_t server;
+    int slot;
+    int error_code;
+    bool need_feedback;
+
+    bool operator<(const Call& rhs) const { return end_us > rhs.end_us; }
+};
+
+struct ThreadStats {
+    ThreadStats() : ncalls(0), nfailed(0), nselect_failed(0), select_ns(0)
+                  , nfeedback(0), feedback_ns(0) {}
+
+    // Index is latency in microseconds.
+    std::vector<int64_t> latency_hist;
+    // Index is the server.
+    std::vector<int64_t> selected;
+    int64_t ncalls;
+    int64_t nfailed;
+    int64_t nselect_failed;
+    int64_t select_ns;
+    int64_t nfeedback;
+    int64_t feedback_ns;
+};
+
+struct ThreadArgs {
+    brpc::SharedLoadBalancer* lb;
+    butil::FastRandSeed seed;
+    volatile bool* stop;
+    ThreadStats stats;
+};
+
+static void init_seed(butil::FastRandSeed* seed, uint64_t index) {
+    // Any non-zero state is valid for xorshift128+.
+    seed->s[0] = (FLAGS_seed + index) * 0x9E3779B97F4A7C15ULL + 1;
+    seed->s[1] = (FLAGS_seed ^ (index << 32)) * 0xBF58476D1CE4E5B9ULL + 1;
+}
+
+static double rand_double(butil::FastRandSeed* seed) {
+    return (butil::fast_rand(seed) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static double sample_latency(butil::FastRandSeed* seed) {
+    if (FLAGS_latency_dist == "fixed") {
+        return FLAGS_latency_us;
+    } else if (FLAGS_latency_dist == "uniform") {
+        return rand_double(seed) * 2 * FLAGS_latency_us;
+    }
+    return -log(1 - rand_double(seed)) * FLAGS_latency_us;
+}
+
+static void* run_calls(void* void_arg) {
+    ThreadArgs* args = static_cast<ThreadArgs*>(void_arg);
+    ThreadStats& st = args->stats;
+    st.latency_hist.assign(MAX_LATENCY_US + 1, 0);
+    st.selected.assign(g_servers.size(), 0);
+    // Controllers are passed to Feedback() of the calls in flight.
+    std::vector<brpc::Controller> cntls(FLAGS_concurrency);
+    std::vector<int> free_slots;
+    for (int i = FLAGS_concurrency - 1; i >= 0; --i) {
+        cntls[i].set_max_retry(0);
+        free_slots.push_back(i);
+    }
+    std::priority_queue<Call> calls;
+    while (!*args->stop || !calls.empty()) {
+        int64_t now = butil::gettimeofday_us();
+        if (!calls.empty() && calls.top().end_us <= now) {
+            const Call c = calls.top();
+            calls.pop();
+            g_servers[c.server]->inflight.fetch_sub(
+                1, butil::memory_order_relaxed);
+            ++st.latency_hist[std::min(now - c.begin_us, MAX_LATENCY_US)];
+            ++st.ncalls;
+            st.nfailed += (c.error_code != 0);
+            if (c.need_feedback) {
+                brpc::LoadBalancer::CallInfo info = {
+                    c.begin_us, g_servers[c.server]->id.id, c.error_code,
+                    &cntls[c.slot] };
+                const int64_t t1 = butil::cpuwide_time_ns();
+                args->lb->Feedback(info);
+                st.feedback_ns += butil::cpuwide_time_ns() - t1;
+                ++st.nfeedback;
+            }
+            free_slots.push_back(c.slot);
+            continue;
+        }
+        if (*args->stop || free_slots.empty()) {
+            continue;
+        }
+        Call c;
+        c.slot = free_slots.back();
+        brpc::Controller& cntl = cntls[c.slot];
+        cntl.set_request_code(butil::fast_rand(&args->seed) & 0xFFFFFFFFULL);
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = {
+            now, true, true, cntl.request_code(), NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        const int64_t t1 = butil::cpuwide_time_ns();
+        const int rc = args->lb->SelectServer(in, &out);
+        st.select_ns += butil::cpuwide_time_ns() - t1;
+        if (rc != 0) {
+            ++st.nselect_failed;
+            continue;
+        }
+        const size_t* index = g_server_index.seek(ptr->id());
+        if (index == NULL) {
+            LOG(ERROR) << "Selected unknown server=" << ptr->id();
+            continue;
+        }
+        Server* s = g_servers[*index];
+        ++st.selected[*index];
+        const int inflight =
+            s->inflight.fetch_add(1, butil::memory_order_relaxed) + 1;
+        double latency = sample_latency(&args->seed) * s->latency_factor;
+        if (inflight > FLAGS_server_capacity) {
+            latency = latency * inflight / FLAGS_server_capacity;
+        }
+        free_slots.pop_back();
+        c.begin_us = now;
+        c.end_us = now + (int64_t)latency;
+        c.server = *index;
+        c.error_code = (rand_double(&args->seed) < s->fail_ratio ?
+                        brpc::EINTERNAL : 0);
+        c.need_feedback = out.need_feedback;
+        calls.push(c);
+    }
+    return NULL;
+}
+
+// Remove a random server and add it back periodically until `stop' is set.
+static void churn_servers(brpc::SharedLoadBalancer* lb, volatile bool* stop,
+                          int64_t deadline_us, butil::FastRandSeed* seed) {
+    while (butil::gettimeofday_us() < deadline_us && !*stop) {
+        const int64_t left_us = deadline_us - butil::gettimeofday_us();
+        if (FLAGS_churn_interval_ms <= 0) {
+            usleep(std::max(std::min(left_us, (int64_t)100000), (int64_t)0));
+            continue;
+        }
+        usleep(FLAGS_churn_interval_ms * 1000L);
+        const brpc::ServerId& id =
+            g_servers[butil::fast_rand(seed) % g_servers.size()]->id;
+        lb->RemoveServer(id);
+        usleep(FLAGS_churn_down_ms * 1000L);
+        lb->AddServer(id);
+    }
+}
+
+static int64_t percentile(const std::vector<int64_t>& hist, int64_t n,
+                          double ratio) {
+    const int64_t rank = std::min((int64_t)(n * ratio), n - 1);
+    int64_t count = 0;
+    for (size_t i = 0; i < hist.size(); ++i) {
+        count += hist[i];
+        if (count > rank) {
+            return i;
+        }
+    }
+    return hist.size() - 1;
+}
+
+static int run_lb(const std::string& lb_name) {
+    butil::intrusive_ptr<brpc::SharedLoadBalancer> lb(
+        new brpc::SharedLoadBalancer);
+    if (lb->Init(lb_name.c_str()) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < g_servers.size(); ++i) {
+        if (!lb->AddServer(g_servers[i]->id)) {
+            LOG(ERROR) << "Fail to add server into " << lb_name;
+            return -1;
+        }
+    }
+    volatile bool stop = false;
+    std::vector<ThreadArgs> args(FLAGS_thread_num);
+    std::vector<pthread_t> tids(FLAGS_thread_num);
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        args[i].lb = lb.get();
+        init_seed(&args[i].seed, i + 1);
+        args[i].stop = &stop;
+        if (pthread_create(&tids[i], NULL, run_calls, &args[i]) != 0) {
+            LOG(ERROR) << "Fail to create pthread";
+            return -1;
+        }
+    }
+    const int64_t start_us = butil::gettimeofday_us();
+    butil::FastRandSeed churn_seed;
+    init_seed(&churn_seed, 0);
+    churn_servers(lb.get(), &stop, start_us + FLAGS_duration_s * 1000000L,
+                  &churn_seed);
+    stop = true;
+    for (int i = 0; i < FLAGS_thread_num; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+
+    ThreadStats total = args[0].stats;
+    for (int i = 1; i < FLAGS_thread_num; ++i) {
+        const ThreadStats& st = args[i].stats;
+        for (size_t j = 0; j < st.latency_hist.size(); ++j) {
+            total.latency_hist[j] += st.latency_hist[j];
+        }
+        for (size_t j = 0; j < st.selected.size(); ++j) {
+            total.selected[j] += st.selected[j];
+        }
+        total.ncalls += st.ncalls;
+        total.nfailed += st.nfailed;
+        total.nselect_failed += st.nselect_failed;
+        total.select_ns += st.select_ns;
+        total.nfeedback += st.nfeedback;
+        total.feedback_ns += st.feedback_ns;
+    }
+    if (total.ncalls == 0) {
+        LOG(ERROR) << lb_name << " did not select any server";
+        return -1;
+    }
+    int64_t latency_sum = 0;
+    for (size_t i = 0; i < total.latency_hist.size(); ++i) {
+        latency_sum += i * total.latency_hist[i];
+    }
+    // Traffic of normal servers should be even, abnormal ones should get
+    // less traffic.
+    const size_t nabnormal = std::min(
+        (size_t)(FLAGS_slow_server_num + FLAGS_failing_server_num),
+        g_servers.size());
+    int64_t normal_max = 0;
+    int64_t normal_sum = 0;
+    int64_t abnormal_sum = 0;
+    for (size_t i = 0; i < total.selected.size(); ++i) {
+        if (i < nabnormal) {
+            abnormal_sum += total.selected[i];
+        } else {
+            normal_sum += total.selected[i];
+            normal_max = std::max(normal_max, total.selected[i]);
+        }
+    }
+    const size_t nnormal = g_servers.size() - nabnormal;
+    const int64_t nselected = total.ncalls + total.nselect_failed;
+    printf("%-20s %8.3f %7ld %7ld %7ld %7ld %7ld %7.2f%% %7.2f %7.2f%%"
+           " %8.1f %8.1f\n", lb_name.c_str(),
+           total.ncalls / (double)elapsed_us,
+           (long)(latency_sum / total.ncalls),
+           (long)percentile(total.latency_hist, total.ncalls, 0.5),
+           (long)percentile(total.latency_hist, total.ncalls, 0.99),
+           (long)percentile(total.latency_hist, total.ncalls, 0.999),
+           (long)percentile(total.latency_hist, total.ncalls, 1),
+           total.nfailed * 100.0 / total.ncalls,
+           (nnormal && normal_sum ?
+            normal_max * nnormal / (double)normal_sum : 0),
+           abnormal_sum * 100.0 / total.ncalls,
+           total.select_ns / (double)nselected,
+           (total.nfeedback ? total.feedback_ns / (double)total.nfeedback : 0));
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_server_num <= 0 || FLAGS_thread_num <= 0 ||
+        FLAGS_concurrency <= 0 || FLAGS_server_capacity <= 0) {
+        LOG(ERROR) << "-server_num, -thread_num, -concurrency and "
+            "-server_capacity must be positive";
+        return -1;
+    }
+    brpc::GlobalInitializeOrDie();
+    if (g_server_index.init(FLAGS_server_num * 2) != 0) {
+        LOG(ERROR) << "Fail to init g_server_index";
+        return -1;
+    }
+    // Abnormal servers are at the front: slow ones and then failing ones.
+    for (int i = 0; i < FLAGS_server_num; ++i) {
+        Server* s = new Server;
+        s->id.tag = "10";  // weight of wrr and wr
+        brpc::SocketOptions options;
+        options.remote_side = butil::EndPoint(butil::IP_ANY, 10000 + i);
+        if (brpc::Socket::Create(options, &s->id.id) != 0) {
+            LOG(ERROR) << "Fail to create socket";
+            return -1;
+        }
+        s->latency_factor = (i < FLAGS_slow_server_num ? FLAGS_slow_factor : 1);
+        s->fail_ratio = (i >= FLAGS_slow_server_num &&
+                         i < FLAGS_slow_server_num + FLAGS_failing_server_num ?
+                         FLAGS_fail_ratio : 0);
+        s->inflight.store(0, butil::memory_order_relaxed);
+        g_server_index[s->id.id] = g_servers.size();
+        g_servers.push_back(s);
+    }
+    printf("%d servers (%d slow, %d failing), %d threads x %d calls in flight,"
+           " %s latency of %dus, capacity=%d\n", FLAGS_server_num,
+           FLAGS_slow_server_num, FLAGS_failing_server_num, FLAGS_thread_num,
+           FLAGS_concurrency, FLAGS_latency_dist.c_str(), FLAGS_latency_us,
+           FLAGS_server_capacity);
+    printf("%-20s %8s %7s %7s %7s %7s %7s %8s %7s %8s %8s %8s\n", "LB",
+           "Mcall/s", "avg(us)", "p50", "p99", "p999", "max", "error",
+           "imbal", "abnormal", "sel(ns)", "fb(ns)");
+    int rc = 0;
+    for (butil::StringSplitter sp(FLAGS_lb.c_str(), ','); sp; ++sp) {
+        if (run_lb(std::string(sp.field(), sp.length())) != 0) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
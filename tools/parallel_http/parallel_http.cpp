@@ -17,11 +17,18 @@
 // Access many http servers in parallel, much faster than curl (even called in batch)
 
 #include <gflags/gflags.h>
+#include <algorithm>
 #include <deque>
+#include <map>
+#include <mutex>
+#include <string>
 #include <bthread/bthread.h>
+#include <bthread/mutex.h>
 #include <butil/logging.h>
+#include <butil/time.h>
 #include <butil/files/scoped_file.h>
 #include <brpc/channel.h>
+#include <brpc/uri.h>
 
 DEFINE_string(url_file, "", "The file containing urls to fetch. If this flag is"
               " empty, read urls from stdin");
@@ -29,31 +36,181 @@ DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
 DEFINE_int32(max_retry, 3, "Max retries(not including the first RPC)");
 DEFINE_int32(thread_num, 8, "Number of threads to access urls");
 DEFINE_int32(concurrency, 1000, "Max number of http calls in parallel");
+DEFINE_int32(concurrency_per_host, 32, "Max number of http calls to a host in"
+             " parallel, other urls of the host wait in a queue");
+DEFINE_string(connection_type, "pooled", "Connection type of channels, pooled"
+              " connections are kept alive and reused by calls to the same host");
 DEFINE_bool(one_line_mode, false, "Output as `URL HTTP-RESPONSE' on true");
 DEFINE_bool(only_show_host, false, "Print host name only");
+DEFINE_bool(quiet, false, "Don't print responses, just count them");
+DEFINE_bool(report, false, "Print throughput and latency histogram of the"
+            " calls to stderr at the end, useful for benchmarking");
 
 struct AccessThreadArgs {
     const std::deque<std::string>* url_list;
     size_t offset;
     std::deque<std::pair<std::string, butil::IOBuf> > output_queue;
+    // Latencies of finished calls, protected by output_queue_mutex as well.
+    std::vector<int64_t> latencies;
     butil::Mutex output_queue_mutex;
     butil::atomic<int> current_concurrency;
 };
 
+butil::atomic<int64_t> g_nfailed(0);
+butil::atomic<int64_t> g_nbytes(0);
+brpc::ChannelOptions g_channel_options;
+
+class HostChannel;
+
 class OnHttpCallEnd : public google::protobuf::Closure {
 public:
     void Run();
 public:
     brpc::Controller cntl;
     AccessThreadArgs* args;
+    HostChannel* host;
     std::string url;
 };
 
+// All urls of a host share a channel, so that the host is resolved once and
+// connections are reused. Calls beyond -concurrency_per_host are queued and
+// issued when previous calls end.
+class HostChannel {
+public:
+    explicit HostChannel(const std::string& server)
+        : _server(server), _state(RESOLVING), _inflight(0) {}
+
+    // Resolve the host in background to not block issuing urls of other
+    // hosts.
+    void StartResolving() {
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, RunResolve, this) != 0) {
+            RunResolve(this);
+        }
+    }
+
+    void Call(OnHttpCallEnd* done) {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        if (_state == RESOLVING ||
+            (_state == READY && _inflight >= FLAGS_concurrency_per_host)) {
+            _pending.push_back(done);
+            return;
+        }
+        if (_state == READY) {
+            ++_inflight;
+        }
+        const State state = _state;
+        mu.unlock();
+        Issue(state, done);
+    }
+
+    // Called when a call issued by this channel ends.
+    void OnCallEnd() {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        if (_pending.empty()) {
+            --_inflight;
+            return;
+        }
+        OnHttpCallEnd* next = _pending.front();
+        _pending.pop_front();
+        mu.unlock();
+        Issue(READY, next);
+    }
+
+private:
+    enum State { RESOLVING, READY, FAILED };
+
+    static void* RunResolve(void* arg) {
+        HostChannel* c = static_cast<HostChannel*>(arg);
+        State state = READY;
+        if (c->_channel.Init(c->_server.c_str(), &g_channel_options) != 0) {
+            LOG(ERROR) << "Fail to create channel to " << c->_server;
+            state = FAILED;
+        }
+        std::deque<OnHttpCallEnd*> to_issue;
+        {
+            BAIDU_SCOPED_LOCK(c->_mutex);
+            c->_state = state;
+            if (state == FAILED) {
+                to_issue.swap(c->_pending);
+            } else {
+                while (!c->_pending.empty() &&
+                       c->_inflight < FLAGS_concurrency_per_host) {
+                    to_issue.push_back(c->_pending.front());
+                    c->_pending.pop_front();
+                    ++c->_inflight;
+                }
+            }
+        }
+        for (size_t i = 0; i < to_issue.size(); ++i) {
+            c->Issue(state, to_issue[i]);
+        }
+        return NULL;
+    }
+
+    void Issue(State state, OnHttpCallEnd* done) {
+        if (state == FAILED) {
+            done->host = NULL;
+            done->cntl.SetFailed(EHOSTDOWN, "Fail to create channel to %s",
+                                 _server.c_str());
+            done->Run();
+            return;
+        }
+        _channel.CallMethod(NULL, &done->cntl, NULL, NULL, done);
+    }
+
+    const std::string _server;
+    brpc::Channel _channel;
+    bthread::Mutex _mutex;
+    State _state;
+    int _inflight;
+    std::deque<OnHttpCallEnd*> _pending;
+};
+
+// Channels of all hosts, keyed by "schema://host:port".
+butil::Mutex g_host_channels_mutex;
+std::map<std::string, HostChannel*> g_host_channels;
+
+HostChannel* get_host_channel(const std::string& url) {
+    brpc::URI uri;
+    if (uri.SetHttpURL(url) != 0 || uri.host().empty()) {
+        return NULL;
+    }
+    std::string server = (uri.schema().empty() ? "http" : uri.schema());
+    server.append("://");
+    server.append(uri.host());
+    if (uri.port() >= 0) {
+        server.push_back(':');
+        server.append(std::to_string(uri.port()));
+    }
+    HostChannel* c = NULL;
+    {
+        BAIDU_SCOPED_LOCK(g_host_channels_mutex);
+        HostChannel*& slot = g_host_channels[server];
+        if (slot != NULL) {
+            return slot;
+        }
+        c = slot = new HostChannel(server);
+    }
+    c->StartResolving();
+    return c;
+}
+
 void OnHttpCallEnd::Run() {
     std::unique_ptr<OnHttpCallEnd> delete_self(this);
+    if (host) {
+        host->OnCallEnd();
+    }
+    if (cntl.Failed()) {
+        g_nfailed.fetch_add(1, butil::memory_order_relaxed);
+    } else {
+        g_nbytes.fetch_add(cntl.response_attachment().size(),
+                           butil::memory_order_relaxed);
+    }
     {
         BAIDU_SCOPED_LOCK(args->output_queue_mutex);
-        if (cntl.Failed()) {
+        args->latencies.push_back(cntl.latency_us());
+        if (cntl.Failed() || FLAGS_quiet) {
             args->output_queue.push_back(std::make_pair(url, butil::IOBuf()));
         } else {
             args->output_queue.push_back(
@@ -65,19 +222,16 @@ void OnHttpCallEnd::Run() {
 
 void* access_thread(void* void_args) {
     AccessThreadArgs* args = (AccessThreadArgs*)void_args;
-    brpc::ChannelOptions options;
-    options.protocol = brpc::PROTOCOL_HTTP;
-    options.connect_timeout_ms = FLAGS_timeout_ms / 2;
-    options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
-    options.max_retry = FLAGS_max_retry;
     const int concurrency_for_this_thread = FLAGS_concurrency / FLAGS_thread_num;
 
     for (size_t i = args->offset; i < args->url_list->size(); i += FLAGS_thread_num) {
         std::string const& url = (*args->url_list)[i];
-        brpc::Channel channel;
-        if (channel.Init(url.c_str(), &options) != 0) {
-            LOG(ERROR) << "Fail to create channel to url=" << url;
+        HostChannel* host = get_host_channel(url);
+        if (host == NULL) {
+            LOG(ERROR) << "Invalid url=" << url;
+            g_nfailed.fetch_add(1, butil::memory_order_relaxed);
             BAIDU_SCOPED_LOCK(args->output_queue_mutex);
+            args->latencies.push_back(0);
             args->output_queue.push_back(std::make_pair(url, butil::IOBuf()));
             continue;
         }
@@ -89,12 +243,45 @@ void* access_thread(void* void_args) {
         OnHttpCallEnd* done = new OnHttpCallEnd;
         done->cntl.http_request().uri() = url;
         done->args = args;
+        done->host = host;
         done->url = url;
-        channel.CallMethod(NULL, &done->cntl, NULL, NULL, done);
+        host->Call(done);
     }
     return NULL;
 }
 
+void print_report(std::vector<int64_t>* latencies, int64_t elapsed_us) {
+    if (latencies->empty()) {
+        return;
+    }
+    std::sort(latencies->begin(), latencies->end());
+    const size_t n = latencies->size();
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += (*latencies)[i];
+    }
+    const double elapsed_s = std::max(elapsed_us, (int64_t)1) / 1000000.0;
+    const int64_t nfailed = g_nfailed.load(butil::memory_order_relaxed);
+    fprintf(stderr, "Fetched %lu urls (%ld failed) from %lu hosts in %.3fs,"
+            " %.1f urls/s, %.3fMB/s\n", (unsigned long)n, (long)nfailed,
+            (unsigned long)g_host_channels.size(), elapsed_s, n / elapsed_s,
+            g_nbytes.load(butil::memory_order_relaxed) / elapsed_s / 1048576);
+    fprintf(stderr, "Latency(us): avg=%ld p50=%ld p90=%ld p99=%ld p999=%ld"
+            " max=%ld\n", (long)(sum / n), (long)(*latencies)[n * 50 / 100],
+            (long)(*latencies)[n * 90 / 100], (long)(*latencies)[n * 99 / 100],
+            (long)(*latencies)[n * 999 / 1000], (long)(*latencies)[n - 1]);
+    // Buckets of [0, 1ms), [1ms, 2ms), [2ms, 4ms) ...
+    size_t i = 0;
+    for (int64_t upper = 1000; i < n; upper *= 2) {
+        size_t count = 0;
+        for (; i < n && (*latencies)[i] < upper; ++i, ++count) {}
+        if (count != 0) {
+            fprintf(stderr, "  < %8ldms %10lu %6.2f%%\n", (long)(upper / 1000),
+                    (unsigned long)count, count * 100.0 / n);
+        }
+    }
+}
+
 int main(int argc, char** argv) {
     // Parse gflags. We recommend you to use gflags as well.
     GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
@@ -133,6 +320,13 @@ int main(int argc, char** argv) {
     if (url_list.empty()) {
         return 0;
     }
+    g_channel_options.protocol = brpc::PROTOCOL_HTTP;
+    g_channel_options.connection_type = FLAGS_connection_type;
+    g_channel_options.connect_timeout_ms = FLAGS_timeout_ms / 2;
+    g_channel_options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
+    g_channel_options.max_retry = FLAGS_max_retry;
+
+    const int64_t start_us = butil::gettimeofday_us();
     AccessThreadArgs* args = new AccessThreadArgs[FLAGS_thread_num];
     for (int i = 0; i < FLAGS_thread_num; ++i) {
         args[i].url_list = &url_list;
@@ -152,7 +346,7 @@ int main(int argc, char** argv) {
                 BAIDU_SCOPED_LOCK(args[i].output_queue_mutex);
                 output_queue.swap(args[i].output_queue);
             }
-            for (size_t i = 0; i < output_queue.size(); ++i) {
+            for (size_t i = 0; !FLAGS_quiet && i < output_queue.size(); ++i) {
                 butil::StringPiece url = output_queue[i].first;
                 butil::StringPiece hostname;
                 if (url.starts_with("http://")) {
@@ -205,5 +399,15 @@ int main(int argc, char** argv) {
             usleep(10000);
         }
     }
+    if (FLAGS_report) {
+        const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+        std::vector<int64_t> latencies;
+        for (int i = 0; i < FLAGS_thread_num; ++i) {
+            BAIDU_SCOPED_LOCK(args[i].output_queue_mutex);
+            latencies.insert(latencies.end(), args[i].latencies.begin(),
+                             args[i].latencies.end());
+        }
+        print_report(&latencies, elapsed_us);
+    }
     return 0;
 }
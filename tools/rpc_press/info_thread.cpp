@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "latency_histogram.h"
 #include "info_thread.h"
 
 namespace brpc {
@@ -87,6 +88,26 @@ void InfoThread::run() {
                    (long long)_options.latency_recorder->latency_percentile(0.999),
                    (long long)_options.latency_recorder->latency_percentile(0.9999),
                    (long long)_options.latency_recorder->max_latency());
+            const pbrpcframework::LatencyHistogram* h = _options.intended_latency;
+            if (h) {
+                printf("[Latency from intended time, since start]\n"
+                       "  avg     %10lld us\n"
+                       "  50%%     %10lld us\n"
+                       "  90%%     %10lld us\n"
+                       "  99%%     %10lld us\n"
+                       "  99.9%%   %10lld us\n"
+                       "  99.99%%  %10lld us\n"
+                       "  99.999%% %10lld us\n"
+                       "  max     %10lld us\n",
+                       (long long)h->mean(),
+                       (long long)h->percentile(0.5),
+                       (long long)h->percentile(0.9),
+                       (long long)h->percentile(0.99),
+                       (long long)h->percentile(0.999),
+                       (long long)h->percentile(0.9999),
+                       (long long)h->percentile(0.99999),
+                       (long long)h->max_value());
+            }
         }
     }
 }
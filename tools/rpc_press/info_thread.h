@@ -18,17 +18,24 @@
 #include <pthread.h>
 #include <bvar/bvar.h>
 
+namespace pbrpcframework {
+class LatencyHistogram;
+}
+
 namespace brpc {
 
 struct InfoThreadOptions {
     bvar::LatencyRecorder* latency_recorder;
     bvar::Adder<int64_t>* sent_count;
     bvar::Adder<int64_t>* error_count;
+    // If non-NULL, also print latencies from the intended sending times.
+    const pbrpcframework::LatencyHistogram* intended_latency;
 
     InfoThreadOptions()
         : latency_recorder(NULL)
         , sent_count(NULL)
-        , error_count(NULL) {}
+        , error_count(NULL)
+        , intended_latency(NULL) {}
 };
 
 class InfoThread {
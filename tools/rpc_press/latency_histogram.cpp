@@ -0,0 +1,163 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <butil/logging.h>
+#include <butil/scoped_lock.h>
+#include "latency_histogram.h"
+
+namespace pbrpcframework {
+
+const int LatencyHistogram::SUB_BUCKET_BITS;
+const int64_t LatencyHistogram::MAX_VALUE;
+
+// Values less than 2^SUB_BUCKET_BITS are counted exactly. Larger values
+// whose highest bit is at `msb' are shifted right by `msb-SUB_BUCKET_BITS+1'
+// so that 2^(SUB_BUCKET_BITS-1) buckets cover every power of 2.
+static const int HALF_BUCKET_COUNT = 1 << (LatencyHistogram::SUB_BUCKET_BITS - 1);
+static const int MAX_SHIFT = 36 - LatencyHistogram::SUB_BUCKET_BITS + 1;
+static const size_t NBUCKET = (MAX_SHIFT + 2) * HALF_BUCKET_COUNT;
+// The sum of values is saved after the buckets.
+static const size_t SUM_INDEX = NBUCKET;
+
+LatencyHistogram::LatencyHistogram() {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_key_create(&_key, NULL);
+}
+
+LatencyHistogram::~LatencyHistogram() {
+    pthread_key_delete(_key);
+    for (size_t i = 0; i < _thread_buckets.size(); ++i) {
+        delete [] _thread_buckets[i];
+    }
+    _thread_buckets.clear();
+    pthread_mutex_destroy(&_mutex);
+}
+
+size_t LatencyHistogram::index_of(int64_t value) {
+    if (value < (1 << SUB_BUCKET_BITS)) {
+        return value;
+    }
+    const int msb = 63 - __builtin_clzll(value);
+    const int shift = msb - SUB_BUCKET_BITS + 1;
+    return shift * HALF_BUCKET_COUNT + (value >> shift);
+}
+
+int64_t LatencyHistogram::value_of(size_t index) {
+    if (index < (size_t)(1 << SUB_BUCKET_BITS)) {
+        return index;
+    }
+    const int shift = index / HALF_BUCKET_COUNT - 1;
+    const int64_t sub = index - shift * HALF_BUCKET_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+LatencyHistogram::Counter* LatencyHistogram::thread_buckets() {
+    Counter* buckets = static_cast<Counter*>(pthread_getspecific(_key));
+    if (buckets == NULL) {
+        buckets = new Counter[NBUCKET + 1];
+        for (size_t i = 0; i <= NBUCKET; ++i) {
+            buckets[i].store(0, butil::memory_order_relaxed);
+        }
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            _thread_buckets.push_back(buckets);
+        }
+        pthread_setspecific(_key, buckets);
+    }
+    return buckets;
+}
+
+void LatencyHistogram::record(int64_t latency_us) {
+    if (latency_us < 0) {
+        latency_us = 0;
+    } else if (latency_us > MAX_VALUE) {
+        latency_us = MAX_VALUE;
+    }
+    Counter* buckets = thread_buckets();
+    // Only this thread modifies the buckets, no atomic RMW needed.
+    Counter& c = buckets[index_of(latency_us)];
+    c.store(c.load(butil::memory_order_relaxed) + 1, butil::memory_order_relaxed);
+    Counter& sum = buckets[SUM_INDEX];
+    sum.store(sum.load(butil::memory_order_relaxed) + latency_us,
+              butil::memory_order_relaxed);
+}
+
+void LatencyHistogram::merge(std::vector<int64_t>* counts) const {
+    counts->assign(NBUCKET + 1, 0);
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = 0; i < _thread_buckets.size(); ++i) {
+        const Counter* buckets = _thread_buckets[i];
+        for (size_t j = 0; j <= NBUCKET; ++j) {
+            (*counts)[j] += buckets[j].load(butil::memory_order_relaxed);
+        }
+    }
+}
+
+int64_t LatencyHistogram::count() const {
+    std::vector<int64_t> counts;
+    merge(&counts);
+    int64_t n = 0;
+    for (size_t i = 0; i < NBUCKET; ++i) {
+        n += counts[i];
+    }
+    return n;
+}
+
+int64_t LatencyHistogram::max_value() const {
+    std::vector<int64_t> counts;
+    merge(&counts);
+    for (size_t i = NBUCKET; i > 0; --i) {
+        if (counts[i - 1]) {
+            return value_of(i - 1);
+        }
+    }
+    return 0;
+}
+
+int64_t LatencyHistogram::mean() const {
+    std::vector<int64_t> counts;
+    merge(&counts);
+    int64_t n = 0;
+    for (size_t i = 0; i < NBUCKET; ++i) {
+        n += counts[i];
+    }
+    return n ? counts[SUM_INDEX] / n : 0;
+}
+
+int64_t LatencyHistogram::percentile(double ratio) const {
+    std::vector<int64_t> counts;
+    merge(&counts);
+    int64_t n = 0;
+    for (size_t i = 0; i < NBUCKET; ++i) {
+        n += counts[i];
+    }
+    if (n == 0) {
+        return 0;
+    }
+    int64_t rank = (int64_t)(ratio * n + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    int64_t seen = 0;
+    for (size_t i = 0; i < NBUCKET; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return value_of(i);
+        }
+    }
+    return value_of(NBUCKET - 1);
+}
+
+} // namespace pbrpcframework
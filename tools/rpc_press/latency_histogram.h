@@ -0,0 +1,75 @@
+// Copyright (c) 2018 Baidu, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BRPC_RPC_PRESS_LATENCY_HISTOGRAM_H
+#define BRPC_RPC_PRESS_LATENCY_HISTOGRAM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+#include <butil/atomicops.h>
+#include <butil/macros.h>
+
+namespace pbrpcframework {
+
+// A HDR(high dynamic range) histogram of latencies in microseconds. Unlike
+// the reservoir sampling of bvar::LatencyRecorder, every value is counted
+// so that rare long latencies are never lost. Values are put into buckets
+// with relative error less than 1/2^(SUB_BUCKET_BITS-1) (0.8%).
+// record() writes into a bucket array owned by calling thread without
+// contention, which are summed up by percentile() and others.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+    ~LatencyHistogram();
+
+    // Count `latency_us' which is capped at MAX_VALUE. Thread-safe.
+    void record(int64_t latency_us);
+
+    // Number of recorded values.
+    int64_t count() const;
+
+    // Max recorded value(with the relative error).
+    int64_t max_value() const;
+
+    // Average of recorded values.
+    int64_t mean() const;
+
+    // Smallest value that `ratio' of recorded values are not greater than.
+    // `ratio' is in [0, 1].
+    int64_t percentile(double ratio) const;
+
+    static const int SUB_BUCKET_BITS = 8;
+    static const int64_t MAX_VALUE = (1LL << 36);  // 19 hours
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+
+    typedef butil::atomic<int64_t> Counter;
+
+    static size_t index_of(int64_t value);
+    // Largest value put into the bucket.
+    static int64_t value_of(size_t index);
+    Counter* thread_buckets();
+    void merge(std::vector<int64_t>* counts) const;
+
+    mutable pthread_mutex_t _mutex;
+    std::vector<Counter*> _thread_buckets;
+    pthread_key_t _key;
+};
+
+} // namespace pbrpcframework
+
+#endif // BRPC_RPC_PRESS_LATENCY_HISTOGRAM_H
@@ -41,6 +41,13 @@ DEFINE_int32(attachment_size, 0, "Carry so many byte attachment along with reque
 DEFINE_int32(duration, 0, "how many seconds the press keep");
 DEFINE_int32(qps, 100 , "how many calls  per seconds");
 DEFINE_bool(pretty, true, "output pretty jsons");
+DEFINE_bool(open_loop, false, "Send requests at the scheduled times of -qps "
+            "without waiting for responses and measure latencies from the "
+            "scheduled times, so that stalls of the server are not hidden by "
+            "delayed sending(coordinated omission)");
+DEFINE_bool(poisson, false, "Intervals between requests in -open_loop are "
+            "exponentially distributed(Poisson arrivals) instead of uniform");
+DEFINE_bool(use_bthread, false, "Send requests in bthreads instead of pthreads");
 
 bool set_press_options(pbrpcframework::PressOptions* options){
     size_t dot_pos = FLAGS_method.find_last_of('.');
@@ -52,6 +59,13 @@ bool set_press_options(pbrpcframework::PressOptions* options){
     options->method = FLAGS_method.substr(dot_pos + 1);
     options->lb_policy = FLAGS_lb_policy;
     options->test_req_rate = FLAGS_qps;
+    if (FLAGS_open_loop && FLAGS_qps <= 0) {
+        LOG(ERROR) << "-open_loop requires positive -qps";
+        return false;
+    }
+    options->open_loop = FLAGS_open_loop;
+    options->poisson = FLAGS_poisson;
+    options->use_bthread = FLAGS_use_bthread;
     if (FLAGS_thread_num > 0) {
         options->test_thread_num = FLAGS_thread_num;
     } else {
@@ -19,7 +19,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <math.h>
 #include <bthread/bthread.h>
+#include <butil/fast_rand.h>
 #include <butil/file_util.h>                     // butil::FilePath
 #include <butil/time.h>
 #include <brpc/channel.h>
@@ -176,17 +178,27 @@ int RpcPress::init(const PressOptions* options) {
 }
 
 void* RpcPress::sync_call_thread(void* arg) {
-    ((RpcPress*)arg)->sync_client();
+    RpcPress* press = (RpcPress*)arg;
+    if (press->_options.open_loop) {
+        press->open_loop_client();
+    } else {
+        press->sync_client();
+    }
     return NULL;
 }
 
 void RpcPress::handle_response(brpc::Controller* cntl, 
                                Message* request,
                                Message* response, 
-                               int64_t start_time){
+                               int64_t start_time,
+                               int64_t intended_time){
     if (!cntl->Failed()){
-        int64_t rpc_call_time_us = butil::gettimeofday_us() - start_time;
+        const int64_t end_time = butil::gettimeofday_us();
+        int64_t rpc_call_time_us = end_time - start_time;
         _latency_recorder << rpc_call_time_us;
+        if (intended_time > 0) {
+            _intended_latency.record(end_time - intended_time);
+        }
 
         if (_output_json) {
             std::string response_json;
@@ -205,6 +217,25 @@ void RpcPress::handle_response(brpc::Controller* cntl,
     delete cntl;
 }
 
+brpc::CallId RpcPress::send_request(int msg_index, int64_t intended_time) {
+    brpc::Controller* cntl = new brpc::Controller;
+    Message* request = _msgs[msg_index];
+    Message* response = _pbrpc_client->get_output_message();
+    const int64_t start_time = butil::gettimeofday_us();
+    google::protobuf::Closure* done = brpc::NewCallback<
+        RpcPress, 
+        RpcPress*, 
+        brpc::Controller*, 
+        Message*, 
+        Message*, int64_t, int64_t>
+        (this, &RpcPress::handle_response, cntl, request, response,
+         start_time, intended_time);
+    const brpc::CallId cid = cntl->call_id();
+    _pbrpc_client->call_method(cntl, request, response, done);
+    _sent_count << 1;
+    return cid;
+}
+
 static butil::atomic<int> g_thread_count(0);
 
 void RpcPress::sync_client() {
@@ -225,21 +256,8 @@ void RpcPress::sync_client() {
     }
     timeq.push_back(butil::gettimeofday_us());
     while (!_stop) {
-        brpc::Controller* cntl = new brpc::Controller;
         msg_index = (msg_index + _options.test_thread_num) % _msgs.size();
-        Message* request = _msgs[msg_index];
-        Message* response = _pbrpc_client->get_output_message();
-        const int64_t start_time = butil::gettimeofday_us();
-        google::protobuf::Closure* done = brpc::NewCallback<
-            RpcPress, 
-            RpcPress*, 
-            brpc::Controller*, 
-            Message*, 
-            Message*, int64_t>
-            (this, &RpcPress::handle_response, cntl, request, response, start_time);
-        const brpc::CallId cid1 = cntl->call_id();
-        _pbrpc_client->call_method(cntl, request, response, done);
-        _sent_count << 1;
+        const brpc::CallId cid1 = send_request(msg_index, 0);
 
         if (_options.test_req_rate <= 0) { 
             brpc::Join(cid1);
@@ -257,23 +275,71 @@ void RpcPress::sync_client() {
                 expected_elp = (int64_t)(1000000 * (timeq.size() - 1) / req_rate);
             }
             if (actual_elp < expected_elp) {
-                usleep(expected_elp - actual_elp);
+                bthread_usleep(expected_elp - actual_elp);
             }
         }
     }
 }
 
+// Sleeping for shorter time is not accurate, send such requests a little
+// earlier instead.
+static const int64_t MIN_SLEEP_US = 50;
+
+void RpcPress::open_loop_client() {
+    if (_msgs.empty()) {
+        LOG(ERROR) << "nothing to send!";
+        return;
+    }
+    const int thread_index = g_thread_count.fetch_add(1, butil::memory_order_relaxed);
+    int msg_index = thread_index;
+    const double interval_us =
+        1000000.0 * _options.test_thread_num / _options.test_req_rate;
+    // Requests are scheduled on a timeline that never waits for responses
+    // or late sends. When sending falls behind(e.g. the server stalls and
+    // the channel blocks), the overdue requests are sent at once and their
+    // latencies count from the scheduled times, otherwise the stall would
+    // be hidden from the results(coordinated omission).
+    double intended_time = butil::gettimeofday_us();
+    while (!_stop) {
+        if (_options.poisson) {
+            intended_time += -log(1.0 - butil::fast_rand_double()) * interval_us;
+        } else {
+            intended_time += interval_us;
+        }
+        const int64_t now = butil::gettimeofday_us();
+        if ((int64_t)intended_time - now >= MIN_SLEEP_US) {
+            bthread_usleep((int64_t)intended_time - now);
+        }
+        msg_index = (msg_index + _options.test_thread_num) % _msgs.size();
+        send_request(msg_index, (int64_t)intended_time);
+    }
+}
+
 int RpcPress::start() {
-    _ttid.resize(_options.test_thread_num);
     int ret = 0;
-    for (int i = 0; i < _options.test_thread_num; i++) {
-        if ((ret = pthread_create(&_ttid[i], NULL, sync_call_thread, this)) != 0) {
-            LOG(ERROR) << "Fail to create sending threads";
-            return -1;
+    if (_options.use_bthread) {
+        _btid.resize(_options.test_thread_num);
+        for (int i = 0; i < _options.test_thread_num; i++) {
+            if ((ret = bthread_start_background(
+                     &_btid[i], NULL, sync_call_thread, this)) != 0) {
+                LOG(ERROR) << "Fail to create sending bthreads";
+                return -1;
+            }
+        }
+    } else {
+        _ttid.resize(_options.test_thread_num);
+        for (int i = 0; i < _options.test_thread_num; i++) {
+            if ((ret = pthread_create(&_ttid[i], NULL, sync_call_thread, this)) != 0) {
+                LOG(ERROR) << "Fail to create sending threads";
+                return -1;
+            }
         }
     }
     brpc::InfoThreadOptions info_thr_opt;
     info_thr_opt.latency_recorder = &_latency_recorder;
+    if (_options.open_loop) {
+        info_thr_opt.intended_latency = &_intended_latency;
+    }
     info_thr_opt.error_count = &_error_count;
     info_thr_opt.sent_count = &_sent_count;
     if (!_info_thr.start(info_thr_opt)) {
@@ -291,6 +357,9 @@ int RpcPress::stop() {
     for (size_t i = 0; i < _ttid.size(); i++) {
         pthread_join(_ttid[i], NULL);
     }
+    for (size_t i = 0; i < _btid.size(); i++) {
+        bthread_join(_btid[i], NULL);
+    }
     _info_thr.stop();
     return 0;
 }
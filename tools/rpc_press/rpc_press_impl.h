@@ -22,6 +22,7 @@
 #include <bvar/bvar.h>
 #include <brpc/channel.h>
 #include "info_thread.h"
+#include "latency_histogram.h"
 #include "pb_util.h"
 
 namespace pbrpcframework {
@@ -53,6 +54,9 @@ struct PressOptions {
     std::string lb_policy; // "rr", "Policy of load balance rr ||random"
     std::string proto_file;
     std::string proto_includes;
+    bool open_loop; // send at scheduled times, see -open_loop
+    bool poisson; // exponential intervals between requests in open loop
+    bool use_bthread; // send requests in bthreads
     
     PressOptions() :
         server_type(0),
@@ -64,7 +68,10 @@ struct PressOptions {
         request_compress_type(0),
         response_compress_type(0),
         attachment_size(0),
-        auth(false)
+        auth(false),
+        open_loop(false),
+        poisson(false),
+        use_bthread(false)
     {}
 };
 
@@ -114,13 +121,21 @@ private:
     
     bool new_pbrpc_press_client_by_client_type(int client_type);
     void sync_client();
+    void open_loop_client();
+    // Send _msgs[msg_index] asynchronously. `intended_time' is the time
+    // that the request is scheduled to be sent at in open loop, 0 otherwise.
+    brpc::CallId send_request(int msg_index, int64_t intended_time);
     void handle_response(brpc::Controller* cntl,
                          google::protobuf::Message* request,
                          google::protobuf::Message* response,
-                         int64_t start_time_ns);
+                         int64_t start_time,
+                         int64_t intended_time);
     static void* sync_call_thread(void* arg);
 
     bvar::LatencyRecorder _latency_recorder;
+    // Latencies from the intended sending times in open loop, which
+    // include the time that requests wait behind stalled ones.
+    LatencyHistogram _intended_latency;
     bvar::Adder<int64_t> _error_count;
     bvar::Adder<int64_t> _sent_count;
     std::deque<google::protobuf::Message*> _msgs;
@@ -132,6 +147,7 @@ private:
     google::protobuf::compiler::Importer* _importer;
     google::protobuf::DynamicMessageFactory _factory;
     std::vector<pthread_t> _ttid;
+    std::vector<bthread_t> _btid;
     brpc::InfoThread _info_thr;
 };
 }
@@ -14,11 +14,17 @@
 
 // Authors: Ge,Jun (gejun@baidu.com)
 
+#include <algorithm>
+#include <map>
+#include <inttypes.h>
 #include <gflags/gflags.h>
 #include <butil/logging.h>
 #include <butil/time.h>
 #include <butil/macros.h>
 #include <butil/file_util.h>
+#include <butil/files/file_enumerator.h>
+#include <butil/string_printf.h>
+#include <butil/third_party/murmurhash3/murmurhash3.h>
 #include <bvar/bvar.h>
 #include <bthread/bthread.h>
 #include <brpc/channel.h>
@@ -26,10 +32,17 @@
 #include <brpc/rpc_dump.h>
 #include <brpc/serialized_request.h>
 #include "info_thread.h"
+#include "../rpc_press/latency_histogram.h"   // shared with rpc_press
 
 DEFINE_string(dir, "", "The directory of dumped requests");
 DEFINE_int32(times, 1, "Repeat replaying for so many times");
 DEFINE_int32(qps, 0, "Limit QPS if this flag is positive");
+DEFINE_double(speed, 0, "If this flag is positive, replay requests at the "
+              "times they were dumped, accelerated by so many times, "
+              "-qps is ignored");
+DEFINE_int32(shard_num, 1, "Split dumped requests into so many shards by "
+             "hash of method and request, and replay one of them");
+DEFINE_int32(shard_index, 0, "Index of the shard to replay, in [0, shard_num)");
 DEFINE_int32(thread_num, 0, "Number of threads for replaying");
 DEFINE_bool(use_bthread, true, "Use bthread to replay");
 DEFINE_string(connection_type, "", "Connection type, choose automatically "
@@ -43,6 +56,22 @@ DEFINE_int32(dummy_port, 8899, "Port of dummy server(to monitor replaying)");
 bvar::LatencyRecorder g_latency_recorder("rpc_replay");
 bvar::Adder<int64_t> g_error_count("rpc_replay_error_count");
 bvar::Adder<int64_t> g_sent_count;
+bvar::Adder<int64_t> g_late_count("rpc_replay_late_count");
+
+// Latencies and errors of one method, reported after replaying.
+struct MethodStats {
+    std::string name;
+    pbrpcframework::LatencyHistogram latency;
+    bvar::Adder<int64_t> error_count;
+};
+
+// A dumped request to replay.
+struct ReplayEntry {
+    int64_t timestamp_us;
+    const brpc::SampleFile* file;
+    size_t index;
+    MethodStats* stats;
+};
 
 // Include channels for all protocols that support both client and server.
 class ChannelGroup {
@@ -105,7 +134,7 @@ ChannelGroup::~ChannelGroup() {
 }
 
 static void handle_response(brpc::Controller* cntl, int64_t start_time,
-                            bool sleep_on_error/*note*/) {
+                            MethodStats* stats, bool sleep_on_error/*note*/) {
     // TODO(gejun): some bthreads are starved when new bthreads are created 
     // continuously, which happens when server is down and RPC keeps failing.
     // Sleep a while on error to avoid that now.
@@ -113,8 +142,10 @@ static void handle_response(brpc::Controller* cntl, int64_t start_time,
     const int64_t elp = end_time - start_time;
     if (!cntl->Failed()) {
         g_latency_recorder << elp;
+        stats->latency.record(elp);
     } else {
         g_error_count << 1;
+        stats->error_count << 1;
         if (sleep_on_error) {
             bthread_usleep(10000);
         }
@@ -124,6 +155,104 @@ static void handle_response(brpc::Controller* cntl, int64_t start_time,
 
 butil::atomic<int> g_thread_offset(0);
 
+// Dumped files mapped into memory, shared by all replaying threads.
+std::vector<brpc::SampleFile*> g_sample_files;
+
+// Replayed requests of this shard, sorted by dumped times when -speed is
+// positive, and in the order of files otherwise.
+std::vector<ReplayEntry> g_timeline;
+std::vector<MethodStats*> g_method_stats;
+// Replaying of all threads starts from this time when -speed is positive.
+int64_t g_start_us = 0;
+
+static std::string method_of(const brpc::SampledRequest& sample) {
+    std::string name = sample.service_name();
+    if (sample.has_method_name()) {
+        if (!name.empty()) {
+            name.push_back('.');
+        }
+        name.append(sample.method_name());
+    } else if (sample.has_method_index()) {
+        butil::string_appendf(&name, "#%d", sample.method_index());
+    }
+    return name;
+}
+
+// Same requests to the same method always belong to the same shard, so
+// that processes replaying different shards don't overlap.
+static uint32_t shard_key_of(const std::string& method,
+                             const brpc::SampledRequest& sample) {
+    butil::MurmurHash3_x86_32_Context ctx;
+    butil::MurmurHash3_x86_32_Init(&ctx, 0);
+    butil::MurmurHash3_x86_32_Update(&ctx, method.data(), (int)method.size());
+    for (size_t i = 0; i < sample.request.backing_block_num(); ++i) {
+        const butil::StringPiece blk = sample.request.backing_block(i);
+        butil::MurmurHash3_x86_32_Update(&ctx, blk.data(), (int)blk.size());
+    }
+    uint32_t key = 0;
+    butil::MurmurHash3_x86_32_Final(&key, &ctx);
+    return key;
+}
+
+static bool timestamp_less(const ReplayEntry& e1, const ReplayEntry& e2) {
+    return e1.timestamp_us < e2.timestamp_us;
+}
+
+static void load_sample_files() {
+    butil::FileEnumerator e(butil::FilePath(FLAGS_dir), false,
+                            butil::FileEnumerator::FILES);
+    for (butil::FilePath name = e.Next(); !name.empty(); name = e.Next()) {
+        brpc::SampleFile* file = new brpc::SampleFile;
+        if (file->Open(name.value()) != 0) {
+            delete file;
+            continue;
+        }
+        g_sample_files.push_back(file);
+    }
+    std::map<std::string, MethodStats*> stats_map;
+    for (size_t f = 0; f < g_sample_files.size(); ++f) {
+        const brpc::SampleFile* file = g_sample_files[f];
+        for (size_t k = 0; k < file->size(); ++k) {
+            brpc::SampledRequest* sample = file->Get(k);
+            if (sample == NULL) {
+                continue;
+            }
+            std::unique_ptr<brpc::SampledRequest> sample_guard(sample);
+            const std::string method = method_of(*sample);
+            if (shard_key_of(method, *sample) % FLAGS_shard_num
+                != (uint32_t)FLAGS_shard_index) {
+                continue;
+            }
+            MethodStats*& stats = stats_map[method];
+            if (stats == NULL) {
+                stats = new MethodStats;
+                stats->name = method;
+                g_method_stats.push_back(stats);
+            }
+            ReplayEntry entry = { sample->timestamp_us(), file, k, stats };
+            g_timeline.push_back(entry);
+        }
+    }
+    if (FLAGS_speed > 0) {
+        std::stable_sort(g_timeline.begin(), g_timeline.end(), timestamp_less);
+    }
+}
+
+static void print_method_stats() {
+    printf("%-40s %10s %8s %8s %8s %8s %8s %8s\n", "method", "count",
+           "error", "avg", "50%", "99%", "99.9%", "max");
+    for (size_t i = 0; i < g_method_stats.size(); ++i) {
+        const MethodStats* stats = g_method_stats[i];
+        printf("%-40s %10" PRId64 " %8" PRId64 " %8" PRId64 " %8" PRId64
+               " %8" PRId64 " %8" PRId64 " %8" PRId64 "\n",
+               stats->name.c_str(), stats->latency.count(),
+               stats->error_count.get_value(), stats->latency.mean(),
+               stats->latency.percentile(0.5), stats->latency.percentile(0.99),
+               stats->latency.percentile(0.999), stats->latency.max_value());
+    }
+    fflush(stdout);
+}
+
 static void* replay_thread(void* arg) {
     ChannelGroup* chan_group = static_cast<ChannelGroup*>(arg);
     const int thread_offset = g_thread_offset.fetch_add(1, butil::memory_order_relaxed);
@@ -137,15 +266,34 @@ static void* replay_thread(void* arg) {
         MAX_QUEUE_SIZE = 2000;
     }
     timeq.push_back(butil::gettimeofday_us());
+    const bool time_faithful = (FLAGS_speed > 0);
+    const bool async = time_faithful || FLAGS_qps > 0;
+    const int64_t first_ts = g_timeline.front().timestamp_us;
+    // Every round lasts as long as the dumped requests spread, plus at
+    // least 1 millisecond so that rounds of a single request don't spin.
+    const int64_t round_us = (!time_faithful ? 0 : std::max<int64_t>(
+        (g_timeline.back().timestamp_us - first_ts) / FLAGS_speed, 1000));
     for (int i = 0; !brpc::IsAskedToQuit() && i < FLAGS_times; ++i) {
-        brpc::SampleIterator it(FLAGS_dir);
-        int j = 0;
-        for (brpc::SampledRequest* sample = it.Next();
-             !brpc::IsAskedToQuit() && sample != NULL; sample = it.Next(), ++j) {
-            std::unique_ptr<brpc::SampledRequest> sample_guard(sample);
-            if ((j % FLAGS_thread_num) != thread_offset) {
+        for (size_t j = thread_offset; !brpc::IsAskedToQuit() &&
+                 j < g_timeline.size(); j += FLAGS_thread_num) {
+            const ReplayEntry& entry = g_timeline[j];
+            if (time_faithful) {
+                const int64_t due_us = g_start_us + i * round_us +
+                    (int64_t)((entry.timestamp_us - first_ts) / FLAGS_speed);
+                const int64_t now_us = butil::gettimeofday_us();
+                if (due_us > now_us) {
+                    bthread_usleep(due_us - now_us);
+                } else if (now_us - due_us > 1000) {
+                    // Fall behind the original pattern for more than 1ms,
+                    // add more threads(-thread_num) or lower -speed.
+                    g_late_count << 1;
+                }
+            }
+            brpc::SampledRequest* sample = entry.file->Get(entry.index);
+            if (sample == NULL) {
                 continue;
             }
+            std::unique_ptr<brpc::SampledRequest> sample_guard(sample);
             brpc::Channel* chan =
                 chan_group->channel(sample->protocol_type());
             if (chan == NULL) {
@@ -168,30 +316,33 @@ static void* replay_thread(void* arg) {
             }
             g_sent_count << 1;
             const int64_t start_time = butil::gettimeofday_us();
-            if (FLAGS_qps <= 0) {
+            if (!async) {
                 chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
                         cntl, &req, NULL/*ignore response*/, NULL);
-                handle_response(cntl, start_time, true);
+                handle_response(cntl, start_time, entry.stats, true);
+                continue;
+            }
+            google::protobuf::Closure* done = brpc::NewCallback(
+                handle_response, cntl, start_time, entry.stats, false);
+            chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
+                    cntl, &req, NULL/*ignore response*/, done);
+            if (time_faithful) {
+                continue;
+            }
+            const int64_t end_time = butil::gettimeofday_us();
+            int64_t expected_elp = 0;
+            int64_t actual_elp = 0;
+            timeq.push_back(end_time);
+            if (timeq.size() > MAX_QUEUE_SIZE) {
+                actual_elp = end_time - timeq.front();
+                timeq.pop_front();
+                expected_elp = (size_t)(1000000 * timeq.size() / req_rate);
             } else {
-                google::protobuf::Closure* done =
-                    brpc::NewCallback(handle_response, cntl, start_time, false);
-                chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
-                        cntl, &req, NULL/*ignore response*/, done);
-                const int64_t end_time = butil::gettimeofday_us();
-                int64_t expected_elp = 0;
-                int64_t actual_elp = 0;
-                timeq.push_back(end_time);
-                if (timeq.size() > MAX_QUEUE_SIZE) {
-                    actual_elp = end_time - timeq.front();
-                    timeq.pop_front();
-                    expected_elp = (size_t)(1000000 * timeq.size() / req_rate);
-                } else {
-                    actual_elp = end_time - timeq.front();
-                    expected_elp = (size_t)(1000000 * (timeq.size() - 1) / req_rate);
-                }
-                if (actual_elp < expected_elp) {
-                    bthread_usleep(expected_elp - actual_elp);
-                }
+                actual_elp = end_time - timeq.front();
+                expected_elp = (size_t)(1000000 * (timeq.size() - 1) / req_rate);
+            }
+            if (actual_elp < expected_elp) {
+                bthread_usleep(expected_elp - actual_elp);
             }
         }
     }
@@ -212,6 +363,24 @@ int main(int argc, char* argv[]) {
         brpc::StartDummyServerAt(FLAGS_dummy_port);
     }
     
+    if (FLAGS_shard_num <= 0 || FLAGS_shard_index < 0 ||
+        FLAGS_shard_index >= FLAGS_shard_num) {
+        LOG(ERROR) << "Invalid --shard_index=" << FLAGS_shard_index
+                   << " --shard_num=" << FLAGS_shard_num;
+        return -1;
+    }
+
+    load_sample_files();
+    if (g_timeline.empty()) {
+        LOG(ERROR) << "No dumped requests in " << FLAGS_dir;
+        return -1;
+    }
+    if (FLAGS_speed > 0 && g_timeline.front().timestamp_us == 0) {
+        LOG(ERROR) << "Requests in " << FLAGS_dir << " were dumped without "
+            "timestamps, which are required by --speed";
+        return -1;
+    }
+
     ChannelGroup chan_group;
     if (chan_group.Init() != 0) {
         LOG(ERROR) << "Fail to init ChannelGroup";
@@ -219,7 +388,7 @@ int main(int argc, char* argv[]) {
     }
 
     if (FLAGS_thread_num <= 0) {
-        if (FLAGS_qps <= 0) { // unlimited qps
+        if (FLAGS_qps <= 0 || FLAGS_speed > 0) { // unlimited qps
             FLAGS_thread_num = 50;
         } else {
             FLAGS_thread_num = FLAGS_qps / 10000;
@@ -232,6 +401,7 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    g_start_us = butil::gettimeofday_us();
     std::vector<bthread_t> bids;
     std::vector<pthread_t> pids;
     if (!FLAGS_use_bthread) {
@@ -271,6 +441,7 @@ int main(int argc, char* argv[]) {
         }
     }
     info_thr.stop();
+    print_method_stats();
 
     return 0;
 }